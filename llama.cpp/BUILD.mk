@@ -24,6 +24,8 @@ include llama.cpp/main/BUILD.mk
 include llama.cpp/imatrix/BUILD.mk
 include llama.cpp/quantize/BUILD.mk
 include llama.cpp/perplexity/BUILD.mk
+include llama.cpp/llama-bench/BUILD.mk
+include llama.cpp/server-bench/BUILD.mk
 
 $(LLAMA_CPP_OBJS): private				\
 		CCFLAGS +=				\
@@ -47,6 +49,8 @@ o/$(MODE)/llama.cpp/ggml-quants.o: private CXXFLAGS += -Os
 o/$(MODE)/llama.cpp/ggml-quants-amd-avx.o: private TARGET_ARCH += -Xx86_64-mtune=sandybridge
 o/$(MODE)/llama.cpp/ggml-quants-amd-avx2.o: private TARGET_ARCH += -Xx86_64-mtune=skylake -Xx86_64-mf16c -Xx86_64-mfma -Xx86_64-mavx2
 o/$(MODE)/llama.cpp/ggml-quants-amd-avx512.o: private TARGET_ARCH += -Xx86_64-mtune=cannonlake -Xx86_64-mf16c -Xx86_64-mfma -Xx86_64-mavx2 -Xx86_64-mavx512f
+o/$(MODE)/llama.cpp/ggml-quants-amd-zen4.o: private TARGET_ARCH += -Xx86_64-mtune=znver4 -Xx86_64-mf16c -Xx86_64-mfma -Xx86_64-mavx2 -Xx86_64-mavx512f -Xx86_64-mavx512vl -Xx86_64-mavx512vnni -Xx86_64-mavx512vbmi
+o/$(MODE)/llama.cpp/ggml-quants-arm82.o: private TARGET_ARCH += -Xaarch64-march=armv8.2-a+dotprod+fp16
 
 o/$(MODE)/llama.cpp/ggml-vector.o: private CXXFLAGS += -Os
 o/$(MODE)/llama.cpp/ggml-vector-amd-avx.o: private TARGET_ARCH += -Xx86_64-mtune=sandybridge
@@ -66,4 +70,6 @@ o/$(MODE)/llama.cpp: 					\
 		o/$(MODE)/llama.cpp/server		\
 		o/$(MODE)/llama.cpp/imatrix		\
 		o/$(MODE)/llama.cpp/quantize		\
-		o/$(MODE)/llama.cpp/perplexity
+		o/$(MODE)/llama.cpp/perplexity		\
+		o/$(MODE)/llama.cpp/llama-bench		\
+		o/$(MODE)/llama.cpp/server-bench
@@ -5,6 +5,10 @@
 #include "json.h"
 #include "json-schema-to-grammar.h"
 #include "llamafile/debug.h"
+#include "llamafile/perfctr.h"
+#include "llamafile/trace.h"
+#include "llamafile/flight.h"
+#include "llamafile/llamafile.h"
 #include "llama.h"
 
 #include <algorithm>
@@ -42,6 +46,7 @@
 #else
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <dirent.h>
 #include <unistd.h>
 #endif
 #if defined(LLAMA_USE_CURL)
@@ -110,76 +115,14 @@ int32_t get_num_physical_cores() {
     return n_threads > 0 ? (n_threads <= 4 ? n_threads : n_threads / 2) : 4;
 }
 
-#if defined(__x86_64__) && (defined(__linux__) || defined(__COSMOPOLITAN__)) && !defined(__ANDROID__)
-#include <pthread.h>
-
-static void cpuid(unsigned leaf, unsigned subleaf,
-                  unsigned *eax, unsigned *ebx, unsigned *ecx, unsigned *edx) {
-    __asm__("movq\t%%rbx,%%rsi\n\t"
-            "cpuid\n\t"
-            "xchgq\t%%rbx,%%rsi"
-            : "=a"(*eax), "=S"(*ebx), "=c"(*ecx), "=d"(*edx)
-            : "0"(leaf), "2"(subleaf));
-}
-
-static int pin_cpu(int cpu) {
-    cpu_set_t mask;
-    CPU_ZERO(&mask);
-    CPU_SET(cpu, &mask);
-    return pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask);
-}
-
-static bool is_hybrid_cpu(void) {
-    unsigned eax, ebx, ecx, edx;
-    cpuid(7, 0, &eax, &ebx, &ecx, &edx);
-    return !!(edx & (1u << 15));
-}
-
-static bool is_running_on_efficiency_core(void) {
-    unsigned eax, ebx, ecx, edx;
-    cpuid(0x1a, 0, &eax, &ebx, &ecx, &edx);
-    int intel_atom = 0x20;
-    int core_type = (eax & 0xff000000u) >> 24;
-    return core_type == intel_atom;
-}
-
-static int count_math_cpus(int cpu_count) {
-    int result = 0;
-    for (int cpu = 0; cpu < cpu_count; ++cpu) {
-        if (pin_cpu(cpu)) {
-            return -1;
-        }
-        if (is_running_on_efficiency_core()) {
-            continue; // efficiency cores harm lockstep threading
-        }
-        ++cpu; // hyperthreading isn't useful for linear algebra
-        ++result;
-    }
-    return result;
-}
-
-#endif // __x86_64__ && __linux__
-
 /**
  * Returns number of CPUs on system that are useful for math.
  */
 int get_math_cpu_count() {
-#if defined(__x86_64__) && (defined(__linux__) || defined(__COSMOPOLITAN__)) && !defined(__ANDROID__)
-    int cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
-    if (cpu_count < 1) {
-        return get_num_physical_cores();
-    }
-    if (is_hybrid_cpu()) {
-        cpu_set_t affinity;
-        if (!pthread_getaffinity_np(pthread_self(), sizeof(affinity), &affinity)) {
-            int result = count_math_cpus(cpu_count);
-            pthread_setaffinity_np(pthread_self(), sizeof(affinity), &affinity);
-            if (result > 0) {
-                return result;
-            }
-        }
+    int n = llamafile_math_cpus();
+    if (n > 0) {
+        return n; // efficiency cores harm lockstep threading
     }
-#endif
     return get_num_physical_cores();
 }
 
@@ -316,6 +259,10 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         FLAG_recompile = true;
         return true;
     }
+    if (arg == "--cuda-graphs") {
+        FLAG_cuda_graphs = true;
+        return true;
+    }
     if (arg == "--tinyblas") {
         FLAG_tinyblas = true;  // undocumented
         return true;
@@ -415,6 +362,10 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         params.prompt_cache_ro = true;
         return true;
     }
+    if (arg == "--prompt-cache-compress") {
+        params.prompt_cache_compress = true;
+        return true;
+    }
     if (arg == "-bf" || arg == "--binary-file") {
         if (++i >= argc) {
             invalid_param = true;
@@ -581,6 +532,35 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         else { invalid_param = true; }
         return true;
     }
+    if (arg == "--batch-file") {
+        if (++i >= argc) {
+            invalid_param = true;
+            return true;
+        }
+        params.batch_file = argv[i];
+        return true;
+    }
+    if (arg == "--embd-input") {
+        if (++i >= argc) {
+            invalid_param = true;
+            return true;
+        }
+        params.embd_input = argv[i];
+        return true;
+    }
+    if (arg == "--embd-format") {
+        if (++i >= argc) {
+            invalid_param = true;
+            return true;
+        }
+        std::string value(argv[i]);
+        if (value != "text" && value != "f32" && value != "f16" && value != "npy") {
+            invalid_param = true;
+            return true;
+        }
+        params.embd_format = value;
+        return true;
+    }
     if (arg == "--defrag-thold" || arg == "-dt") {
         if (++i >= argc) {
             invalid_param = true;
@@ -589,6 +569,30 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         params.defrag_thold = std::stof(argv[i]);
         return true;
     }
+    if (arg == "--defrag-max-ms") {
+        if (++i >= argc) {
+            invalid_param = true;
+            return true;
+        }
+        params.defrag_max_ms = std::stof(argv[i]);
+        return true;
+    }
+    if (arg == "--state-checkpoint") {
+        if (++i >= argc) {
+            invalid_param = true;
+            return true;
+        }
+        params.n_seq_checkpoint = std::stoi(argv[i]);
+        return true;
+    }
+    if (arg == "--cpu-decode") {
+        if (++i >= argc) {
+            invalid_param = true;
+            return true;
+        }
+        params.n_cpu_decode = std::stoi(argv[i]);
+        return true;
+    }
     if (arg == "--samplers") {
         if (++i >= argc) {
             invalid_param = true;
@@ -946,6 +950,33 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         params.image.emplace_back(argv[i]);
         return true;
     }
+    if (arg == "--image-dir") {
+        if (++i >= argc) {
+            invalid_param = true;
+            return true;
+        }
+        DIR * dir = opendir(argv[i]);
+        if (!dir) {
+            fprintf(stderr, "error: failed to open directory '%s': %s\n", argv[i], strerror(errno));
+            invalid_param = true;
+            return true;
+        }
+        std::vector<std::string> images;
+        std::string path = argv[i];
+        if (path.back() != '/') {
+            path += '/';
+        }
+        while (struct dirent * ent = readdir(dir)) {
+            struct stat st;
+            if (ent->d_name[0] != '.' && !stat((path + ent->d_name).c_str(), &st) && S_ISREG(st.st_mode)) {
+                images.push_back(path + ent->d_name);
+            }
+        }
+        closedir(dir);
+        std::sort(images.begin(), images.end());
+        params.image.insert(params.image.end(), images.begin(), images.end());
+        return true;
+    }
     if (arg == "-i" || arg == "--interactive") {
         params.interactive = true;
         return true;
@@ -1002,6 +1033,10 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         params.flash_attn = true;
         return true;
     }
+    if (arg == "--swa-evict") {
+        params.swa_evict = true;
+        return true;
+    }
     if (arg == "--color") {
         params.use_color = true;
         return true;
@@ -1015,6 +1050,10 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
             invalid_param = true;
             return true;
         }
+        if (std::strcmp(argv[i], "auto") == 0) {
+            params.n_gpu_layers = LLAMAFILE_GPU_LAYERS_AUTO;
+            return true;
+        }
         params.n_gpu_layers = std::stoi(argv[i]);
         if (params.n_gpu_layers <= 0)
             FLAG_gpu = LLAMAFILE_GPU_DISABLE;
@@ -1028,6 +1067,22 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         params.n_gpu_layers_draft = std::stoi(argv[i]);
         return true;
     }
+    if (arg == "--gpu-experts") {
+        if (++i >= argc) {
+            invalid_param = true;
+            return true;
+        }
+        params.n_gpu_experts = std::stoi(argv[i]);
+        return true;
+    }
+    if (arg == "--expert-stats") {
+        if (++i >= argc) {
+            invalid_param = true;
+            return true;
+        }
+        params.expert_stats = argv[i];
+        return true;
+    }
     if (arg == "--main-gpu" || arg == "-mg") {
         if (++i >= argc) {
             invalid_param = true;
@@ -1086,6 +1141,62 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         params.use_mmap = false;
         return true;
     }
+    if (arg == "--hugepages") {
+        FLAG_hugepages = true;
+        return true;
+    }
+    if (arg == "--share-weights") {
+        FLAG_share_weights = true;
+        return true;
+    }
+    if (arg == "--verify") {
+        FLAG_verify = true;
+        return true;
+    }
+    if (arg == "--adaptive-threads") {
+        FLAG_adaptive_threads = true;
+        return true;
+    }
+    if (arg == "--stream-weights") {
+        FLAG_stream_weights = true;
+        return true;
+    }
+    if (arg == "--trace") {
+        if (++i >= argc) {
+            invalid_param = true;
+            return true;
+        }
+        if (!llamafile_trace_begin(argv[i])) {
+            exit(1);
+        }
+        return true;
+    }
+    if (arg == "--flight-recorder") {
+        if (++i >= argc) {
+            invalid_param = true;
+            return true;
+        }
+        if (!llamafile_flight_begin(argv[i])) {
+            exit(1);
+        }
+        return true;
+    }
+    if (arg == "--perf-counters") {
+        llamafile_perf_begin();
+        return true;
+    }
+    if (arg == "--repack") {
+        params.repack = true;
+        return true;
+    }
+    if (arg == "--tune") {
+        params.tune = true;
+        return true;
+    }
+    if (arg == "--lazy-load") {
+        params.lazy_load = true;
+        return true;
+    }
     if (arg == "--numa") {
         if (++i >= argc) {
             invalid_param = true;
@@ -1095,6 +1206,9 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         /**/ if (value == "distribute" || value == "") { params.numa = GGML_NUMA_STRATEGY_DISTRIBUTE; }
         else if (value == "isolate") { params.numa = GGML_NUMA_STRATEGY_ISOLATE; }
         else if (value == "numactl") { params.numa = GGML_NUMA_STRATEGY_NUMACTL; }
+        else if (value == "mirror" || value == "replicate") { params.numa = GGML_NUMA_STRATEGY_MIRROR; }
+        else if (value == "shard") { params.numa = GGML_NUMA_STRATEGY_SHARD; }
+        else if (value == "tier") { params.numa = GGML_NUMA_STRATEGY_TIER; }
         else { invalid_param = true; }
         return true;
     }
@@ -1471,6 +1585,8 @@ void gpt_print_usage(int /*argc*/, char ** argv, const gpt_params & params) {
     printf("  --prompt-cache-all    if specified, saves user input and generations to cache as well.\n");
     printf("                        not supported with --interactive or other interactive options\n");
     printf("  --prompt-cache-ro     if specified, uses the prompt cache but does not update it.\n");
+    printf("  --prompt-cache-compress\n");
+    printf("                        if specified, compresses the kv data saved to the prompt cache.\n");
     printf("  --random-prompt       start with a randomized prompt.\n");
     printf("  --in-prefix-bos       prefix BOS to user inputs, preceding the `--in-prefix` string\n");
     printf("  --in-prefix STRING    string to prefix user inputs with (default: empty)\n");
@@ -1529,8 +1645,20 @@ void gpt_print_usage(int /*argc*/, char ** argv, const gpt_params & params) {
     printf("  --yarn-beta-fast N    YaRN: low correction dim or beta (default: %.1f)\n", params.yarn_beta_fast);
     printf("  --pooling {none,mean,cls}\n");
     printf("                        pooling type for embeddings, use model default if unspecified\n");
+    printf("  --batch-file FNAME    generate a completion for each prompt of a jsonl file (- for stdin),\n");
+    printf("                        --parallel at a time, writing them to stdout as jsonl\n");
+    printf("  --embd-input FNAME    with --embedding, embed each line of FNAME (- for stdin) as it's read,\n");
+    printf("                        rather than the lines of the prompt\n");
+    printf("  --embd-format {text,f32,f16,npy}\n");
+    printf("                        how --embedding writes embeddings to stdout (default: text)\n");
     printf("  -dt N, --defrag-thold N\n");
     printf("                        KV cache defragmentation threshold (default: %.1f, < 0 - disabled)\n", params.defrag_thold);
+    printf("  --defrag-max-ms N     spend at most N ms defragmenting the KV cache per decode,\n");
+    printf("                        finishing the job over several calls (default: %.1f, 0 - unbounded)\n", params.defrag_max_ms);
+    printf("  --state-checkpoint N  with recurrent models, save the state of each sequence every N tokens,\n");
+    printf("                        so it can be rolled back without starting over (default: %d, 0 - never)\n", params.n_seq_checkpoint);
+    printf("  --cpu-decode N        compute batches of up to N tokens on the cpu, reading the weights of gpus that share\n");
+    printf("                        memory with it in place, e.g. to decode on the cpu of an apu (default: %d, 0 - never)\n", params.n_cpu_decode);
     printf("  --ignore-eos          ignore end of stream token and continue generating (implies --logit-bias 2-inf)\n");
     printf("  --penalize-nl         penalize newline tokens\n");
     printf("  --temp N              temperature (default: %.1f)\n", (double)sparams.temp);
@@ -1550,25 +1678,47 @@ void gpt_print_usage(int /*argc*/, char ** argv, const gpt_params & params) {
     printf("  -ps N, --p-split N    speculative decoding split probability (default: %.1f)\n", (double)params.p_split);
     printf("  -cb, --cont-batching  enable continuous batching (a.k.a dynamic batching) (default: disabled)\n");
     printf("  -fa, --flash-attn     enable Flash Attention (default: %s)\n", params.flash_attn ? "enabled" : "disabled");
+    printf("  --swa-evict           with sliding window attention models, free kv cells that slid out of the window\n");
     printf("  --mmproj MMPROJ_FILE  path to a multimodal projector file for LLaVA. see examples/llava/README.md\n");
     printf("  --image IMAGE_FILE    path to an image file. use with multimodal models. Specify multiple times for batching\n");
+    printf("  --image-dir DIR       use each file in DIR as an --image. with -np N, N images are described at once\n");
     if (llama_supports_mlock()) {
         printf("  --mlock               force system to keep model in RAM rather than swapping or compressing\n");
     }
     if (llama_supports_mmap()) {
         printf("  --no-mmap             do not memory-map model (slower load but may reduce pageouts if not using mlock)\n");
     }
+    printf("  --hugepages           copy weights into 2mb pages to reduce tlb misses (linux and windows, uses more memory)\n");
+    printf("  --share-weights       let processes loading the same model share --hugepages and --repack copies\n");
+    printf("  --verify              check the crc32 of weights stored in a zip or llamafile while loading them\n");
+    printf("  --adaptive-threads    measure how each kind of op scales and give it only the threads that help\n");
+    printf("  --stream-weights      read weights a few layers ahead and let go of used ones, for models bigger than ram\n");
+    printf("  --trace FNAME         save per-op timings of every thread and backend as a chrome trace at exit\n");
+    printf("  --flight-recorder FNAME\n");
+    printf("                        keep the last events of the decode loop, saved to FNAME on SIGUSR1\n");
+    printf("  --perf-counters       count cycles, instructions and cache misses of matmul and attention ops\n");
+    printf("  --repack              copy q4_0 and q8_0 weights into a faster layout for cpu matmuls (uses more memory)\n");
+    printf("  --tune                benchmark cpu matmul tiles on this model and save the winners in ~/.llamafile\n");
+    printf("  --lazy-load           start without waiting for weights to load off disk; they're read on first use\n");
     printf("  --numa TYPE           attempt optimizations that help on some NUMA systems\n");
     printf("                          - distribute: spread execution evenly over all nodes\n");
     printf("                          - isolate: only spawn threads on CPUs on the node that execution started on\n");
     printf("                          - numactl: use the CPU map provided by numactl\n");
+    printf("                          - replicate: like distribute, but copy weights to every node\n");
+    printf("                          - shard: like distribute, but put each node's rows of every matrix on that node\n");
+    printf("                          - tier: put the weights read most per token and the kv cache in the fastest memory (hbm, dram, cxl)\n");
     printf("                        if run without this previously, it is recommended to drop the system page cache before using this\n");
     printf("                        see https://github.com/ggerganov/llama.cpp/issues/1437\n");
     // if (llama_supports_gpu_offload()) {
         printf("  -ngl N, --n-gpu-layers N\n");
-        printf("                        number of layers to store in VRAM\n");
+        printf("                        number of layers to store in VRAM, or `auto` to fit as many as\n");
+        printf("                        free memory allows with the chosen context size\n");
         printf("  -ngld N, --n-gpu-layers-draft N\n");
         printf("                        number of layers to store in VRAM for the draft model\n");
+        printf("  --gpu-experts N       store only the N experts each offloaded MoE layer picks most often\n");
+        printf("                        in VRAM, computing the others from host memory (default: all)\n");
+        printf("  --expert-stats FNAME  file counting how often each expert is picked, which is read to\n");
+        printf("                        choose the --gpu-experts and updated on exit\n");
         printf("  -sm SPLIT_MODE, --split-mode SPLIT_MODE\n");
         printf("                        how to split the model across multiple GPUs, one of:\n");
         printf("                          - none: use one GPU only\n");
@@ -1578,6 +1728,7 @@ void gpt_print_usage(int /*argc*/, char ** argv, const gpt_params & params) {
         printf("                        fraction of the model to offload to each GPU, comma-separated list of proportions, e.g. 3,1\n");
         printf("  -mg i, --main-gpu i   the GPU to use for the model (with split-mode = none),\n");
         printf("                        or for intermediate results and KV (with split-mode = row) (default: %d)\n", params.main_gpu);
+        printf("  --cuda-graphs         replay each decode step on nvidia gpus as one cuda graph\n");
     // }
     printf("  --verbose-prompt      print a verbose prompt before generation (default: %s)\n", params.verbose_prompt ? "true" : "false");
     printf("  --no-display-prompt   don't print prompt at generation (default: %s)\n", !params.display_prompt ? "true" : "false");
@@ -1858,6 +2009,13 @@ struct llama_model_params llama_model_params_from_gpt_params(const gpt_params &
     mparams.use_mmap        = params.use_mmap;
     mparams.use_mlock       = params.use_mlock;
     mparams.check_tensors   = params.check_tensors;
+    mparams.repack          = params.repack;
+    mparams.tune            = params.tune;
+    mparams.lazy_load       = params.lazy_load;
+    mparams.n_ctx_fit       = params.n_ctx;
+    mparams.n_ubatch_fit    = params.n_ubatch;
+    mparams.n_gpu_experts   = params.n_gpu_experts;
+    mparams.expert_stats    = params.expert_stats.empty() ? nullptr : params.expert_stats.c_str();
     if (params.kv_overrides.empty()) {
         mparams.kv_overrides = NULL;
     } else {
@@ -1875,6 +2033,9 @@ static ggml_type kv_cache_type_from_str(const std::string & s) {
     if (s == "f16") {
         return GGML_TYPE_F16;
     }
+    if (s == "bf16") {
+        return GGML_TYPE_BF16;
+    }
     if (s == "q8_0") {
         return GGML_TYPE_Q8_0;
     }
@@ -1919,10 +2080,14 @@ struct llama_context_params llama_context_params_from_gpt_params(const gpt_param
     cparams.yarn_orig_ctx     = params.yarn_orig_ctx;
     cparams.pooling_type      = params.pooling_type;
     cparams.defrag_thold      = params.defrag_thold;
+    cparams.defrag_max_ms     = params.defrag_max_ms;
+    cparams.n_seq_checkpoint  = params.n_seq_checkpoint;
+    cparams.n_cpu_decode      = params.n_cpu_decode;
     cparams.cb_eval           = params.cb_eval;
     cparams.cb_eval_user_data = params.cb_eval_user_data;
     cparams.offload_kqv       = !params.no_kv_offload;
     cparams.flash_attn        = params.flash_attn;
+    cparams.swa_evict         = params.swa_evict;
 
     cparams.type_k = kv_cache_type_from_str(params.cache_type_k);
     cparams.type_v = kv_cache_type_from_str(params.cache_type_v);
@@ -2354,7 +2519,8 @@ std::tuple<struct llama_model *, struct llama_context *> llama_init_from_gpt_par
         params.sparams.logit_bias[llama_token_eos(model)] = -INFINITY;
     }
 
-    if (params.warmup) {
+    // an empty run would touch every layer, which is what lazy loading avoids
+    if (params.warmup && !params.lazy_load) {
         LOG("warming up the model with an empty run\n");
 
         std::vector<llama_token> tmp = { llama_token_bos(model), llama_token_eos(model), };
@@ -2399,6 +2565,13 @@ std::vector<llama_token> llama_tokenize(
 }
 
 std::string llama_token_to_piece(const struct llama_context * ctx, llama_token token, bool special) {
+    // the model already rendered every token it has
+    int32_t length;
+    const char * piece = llama_token_get_piece(llama_get_model(ctx), token, special, &length);
+    if (length) {
+        return std::string(piece, length);
+    }
+
     std::vector<char> result(8, 0);
     const int n_tokens = llama_token_to_piece(llama_get_model(ctx), token, result.data(), result.size(), special);
     if (n_tokens < 0) {
@@ -2725,6 +2898,7 @@ void dump_non_result_info_yaml(FILE * stream, const gpt_params & params, const l
     fprintf(stream, "prompt_cache: %s\n", params.path_prompt_cache.c_str());
     fprintf(stream, "prompt_cache_all: %s # default: false\n", params.prompt_cache_all ? "true" : "false");
     fprintf(stream, "prompt_cache_ro: %s # default: false\n", params.prompt_cache_ro ? "true" : "false");
+    fprintf(stream, "prompt_cache_compress: %s # default: false\n", params.prompt_cache_compress ? "true" : "false");
     dump_vector_int_yaml(stream, "prompt_tokens", prompt_tokens);
     fprintf(stream, "random_prompt: %s # default: false\n", params.random_prompt ? "true" : "false");
     fprintf(stream, "repeat_penalty: %f # default: 1.1\n", sparams.penalty_repeat);
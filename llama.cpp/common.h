@@ -72,6 +72,7 @@ struct gpt_params {
     float   p_split               = 0.1f;  // speculative decoding split probability
     int32_t n_gpu_layers          = -1;    // number of layers to store in VRAM (-1 - use default)
     int32_t n_gpu_layers_draft    = -1;    // number of layers to store in VRAM for the draft model (-1 - use default)
+    int32_t n_gpu_experts         = 0;     // experts of each offloaded MoE layer to store in VRAM (0 - all of them)
     llama_split_mode split_mode   = LLAMA_SPLIT_MODE_LAYER; // how to split the model across GPUs
     int32_t main_gpu              = 0;     // the GPU that is used for scratch and small tensors
     float   tensor_split[128]     = {0};   // how split tensors should be distributed across GPUs
@@ -87,6 +88,9 @@ struct gpt_params {
     float   yarn_beta_slow        = 1.0f;  // YaRN high correction dim
     int32_t yarn_orig_ctx         = 0;     // YaRN original context length
     float   defrag_thold          = -1.0f; // KV cache defragmentation threshold
+    float   defrag_max_ms         =  0.0f; // KV cache defragmentation time budget per update
+    int32_t n_seq_checkpoint      = 0;     // recurrent models: tokens between saved states of a sequence (0 - never)
+    int32_t n_cpu_decode          = 0;     // ubatches of at most this many tokens run on the cpu over shared gpu memory (0 - never)
 
     ggml_backend_sched_eval_callback cb_eval = nullptr;
     void * cb_eval_user_data                 = nullptr;
@@ -107,6 +111,9 @@ struct gpt_params {
     std::string hf_file              = "";  // HF file
     std::string prompt               = "";
     std::string prompt_file          = "";  // store the external prompt file name
+    std::string embd_input           = "";  // stream lines to embed from this file, or "-" for stdin
+    std::string embd_format          = "text"; // how embeddings are written: text, f32, f16 or npy
+    std::string batch_file           = "";  // jsonl prompts to generate completions for, or "-" for stdin
     std::string path_prompt_cache    = "";  // path to file for saving/loading prompt eval state
     std::string input_prefix         = "";  // string to prefix user inputs with
     std::string input_suffix         = "";  // string to suffix user inputs with
@@ -115,6 +122,7 @@ struct gpt_params {
     std::string lookup_cache_static  = ""; // path of static ngram cache file for lookup decoding
     std::string lookup_cache_dynamic = ""; // path of dynamic ngram cache file for lookup decoding
     std::string logits_file          = "";  // file for saving *all* logits
+    std::string expert_stats         = "";  // file counting how often each expert is picked
 
     std::vector<llama_model_kv_override> kv_overrides;
 
@@ -148,6 +156,7 @@ struct gpt_params {
     bool chatml            = false; // chatml mode (used for models trained on chatml syntax)
     bool prompt_cache_all  = false; // save user input and generations to prompt cache
     bool prompt_cache_ro   = false; // open the prompt cache read-only and do not update it
+    bool prompt_cache_compress = false; // deflate kv data written to the prompt cache
 
     bool embedding         = false; // get only sentence embedding
     bool escape            = false; // escape "\n", "\r", "\t", "\'", "\"", and "\\"
@@ -156,6 +165,7 @@ struct gpt_params {
     bool simple_io         = false; // improves compatibility with subprocesses and limited consoles
     bool cont_batching     = true;  // insert new sequences for decoding on-the-fly
     bool flash_attn        = false; // flash attention
+    bool swa_evict         = false; // free kv cells outside the sliding window
 
     bool input_prefix_bos  = false; // prefix BOS to user inputs, preceding input_prefix
     bool ignore_eos        = false; // ignore generated EOS tokens
@@ -170,6 +180,9 @@ struct gpt_params {
     bool no_kv_offload     = false; // disable KV offloading
     bool warmup            = true;  // warmup run
     bool check_tensors     = false; // validate tensor data
+    bool repack            = false; // interleave cpu weights for the matmul kernels
+    bool tune              = false; // benchmark cpu matmul kernels on the model's shapes
+    bool lazy_load         = false; // read weights on first use and skip the warmup run
 
     std::string cache_type_k = "f16"; // KV cache data type for the K
     std::string cache_type_v = "f16"; // KV cache data type for the V
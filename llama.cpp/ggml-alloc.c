@@ -336,10 +336,22 @@ struct hash_node {
     int n_children;
     int n_views;
     int buffer_id;
+    int block; // index of the block in galloc->blocks, plus one
     size_t offset; // offset within the buffer
     bool allocated;
 };
 
+// a region handed out by the dynamic allocator, which lives from the
+// node at which it was allocated up to the node at which it was freed,
+// and may be passed on to children that are computed inplace
+struct alloc_block {
+    int buffer_id;
+    int first;  // index of the first node using the block
+    int last;   // index of the last node using the block
+    size_t size;
+    size_t offset;
+};
+
 struct tensor_alloc {
     size_t offset;
     size_t size_max; // 0 = pre-allocated, unused, or view
@@ -370,6 +382,11 @@ struct ggml_gallocr {
 
     struct leaf_alloc * leaf_allocs; // [n_leafs]
     int n_leafs;
+
+    struct alloc_block * blocks; // [n_blocks]
+    int n_blocks;
+    int blocks_size;
+    int step; // index of the node being allocated
 };
 
 ggml_gallocr_t ggml_gallocr_new_n(ggml_backend_buffer_type_t * bufts, int n_bufs) {
@@ -421,6 +438,7 @@ void ggml_gallocr_free(ggml_gallocr_t galloc) {
     free(galloc->buf_tallocs);
     free(galloc->node_allocs);
     free(galloc->leaf_allocs);
+    free(galloc->blocks);
     free(galloc);
 }
 
@@ -446,6 +464,21 @@ static bool ggml_gallocr_is_allocated(ggml_gallocr_t galloc, struct ggml_tensor
     return t->data != NULL || ggml_gallocr_hash_get(galloc, t)->allocated;
 }
 
+static int ggml_gallocr_new_block(ggml_gallocr_t galloc, int buffer_id, size_t size, size_t offset) {
+    if (galloc->n_blocks == galloc->blocks_size) {
+        galloc->blocks_size = MAX(2 * galloc->blocks_size, 256);
+        galloc->blocks = realloc(galloc->blocks, galloc->blocks_size * sizeof(struct alloc_block));
+        GGML_ASSERT(galloc->blocks != NULL);
+    }
+    struct alloc_block * block = &galloc->blocks[galloc->n_blocks++];
+    block->buffer_id = buffer_id;
+    block->first  = galloc->step;
+    block->last   = INT_MAX; // outputs are never freed
+    block->size   = size;
+    block->offset = offset;
+    return galloc->n_blocks;
+}
+
 static void ggml_gallocr_allocate_node(ggml_gallocr_t galloc, struct ggml_tensor * node, int buffer_id) {
     struct hash_node * hn = ggml_gallocr_hash_get(galloc, node);
 
@@ -488,6 +521,7 @@ static void ggml_gallocr_allocate_node(ggml_gallocr_t galloc, struct ggml_tensor
                             assert(view_src_hn->offset == p_hn->offset);
                             hn->buffer_id = p_hn->buffer_id;
                             hn->offset = p_hn->offset;
+                            hn->block = view_src_hn->block;
                             p_hn->allocated = false; // avoid freeing the parent
                             view_src_hn->allocated = false;
                             return;
@@ -496,6 +530,7 @@ static void ggml_gallocr_allocate_node(ggml_gallocr_t galloc, struct ggml_tensor
                         AT_PRINTF("reusing parent %s for %s\n", parent->name, node->name);
                         hn->buffer_id = p_hn->buffer_id;
                         hn->offset = p_hn->offset;
+                        hn->block = p_hn->block;
                         p_hn->allocated = false; // avoid freeing the parent
                         return;
                     }
@@ -509,6 +544,7 @@ static void ggml_gallocr_allocate_node(ggml_gallocr_t galloc, struct ggml_tensor
         size_t offset = ggml_dyn_tallocr_alloc(alloc, size, node);
         hn->buffer_id = buffer_id;
         hn->offset = offset;
+        hn->block = ggml_gallocr_new_block(galloc, buffer_id, aligned_offset(NULL, size, alloc->alignment), offset);
         return;
     }
 }
@@ -527,6 +563,9 @@ static void ggml_gallocr_free_node(ggml_gallocr_t galloc, struct ggml_tensor * n
     size_t size = ggml_backend_buft_get_alloc_size(buft, node);
     ggml_dyn_tallocr_free_tensor(alloc, offset, size, node);
     hn->allocated = false;
+    if (hn->block) {
+        galloc->blocks[hn->block - 1].last = galloc->step;
+    }
 }
 
 static int get_node_buffer_id(const int * node_buffer_ids, int i) {
@@ -537,6 +576,8 @@ static void ggml_gallocr_alloc_graph_impl(ggml_gallocr_t galloc, struct ggml_cgr
     // clear hash tables
     memset(galloc->hash_set.keys, 0, galloc->hash_set.size * sizeof(struct ggml_tensor *));
     memset(galloc->hash_values,   0, galloc->hash_set.size * sizeof(struct hash_node));
+    galloc->n_blocks = 0;
+    galloc->step = 0;
 
     // allocate leafs
     // these may be tensors that the application is not using in the graph, but may still want to allocate for other purposes
@@ -582,6 +623,7 @@ static void ggml_gallocr_alloc_graph_impl(ggml_gallocr_t galloc, struct ggml_cgr
     for (int i = 0; i < graph->n_nodes; i++) {
         struct ggml_tensor * node = graph->nodes[i];
         int buffer_id = get_node_buffer_id(node_buffer_ids, i);
+        galloc->step = i;
 
         // allocate parents (only leafs need to be allocated at this point)
         for (int j = 0; j < GGML_MAX_SRC; j++) {
@@ -640,6 +682,96 @@ static void ggml_gallocr_alloc_graph_impl(ggml_gallocr_t galloc, struct ggml_cgr
     }
 }
 
+static int ggml_gallocr_block_cmp(const void * pa, const void * pb) {
+    const struct alloc_block * a = *(const struct alloc_block * const *) pa;
+    const struct alloc_block * b = *(const struct alloc_block * const *) pb;
+    if (a->size != b->size) {
+        return a->size < b->size ? 1 : -1;
+    }
+    return a->first - b->first;
+}
+
+static int ggml_gallocr_offset_cmp(const void * pa, const void * pb) {
+    const struct alloc_block * a = *(const struct alloc_block * const *) pa;
+    const struct alloc_block * b = *(const struct alloc_block * const *) pb;
+    return a->offset < b->offset ? -1 : a->offset > b->offset;
+}
+
+// the dynamic allocator only sees one node at a time, so its free list
+// ends up fragmented and the buffer larger than it needs to be. once the
+// lifetimes of all blocks are known, lay them out again from scratch,
+// biggest first, each in the tightest gap left by the blocks it overlaps
+// with, and keep that layout if it has a lower peak.
+static void ggml_gallocr_plan_buffer(ggml_gallocr_t galloc, int buffer_id) {
+    int n = 0;
+    struct alloc_block ** order = malloc((galloc->n_blocks + 1) * sizeof(struct alloc_block *));
+    struct alloc_block ** live  = malloc((galloc->n_blocks + 1) * sizeof(struct alloc_block *));
+    size_t * offsets = malloc((galloc->n_blocks + 1) * sizeof(size_t));
+    GGML_ASSERT(order != NULL && live != NULL && offsets != NULL);
+
+    for (int i = 0; i < galloc->n_blocks; i++) {
+        if (galloc->blocks[i].buffer_id == buffer_id) {
+            offsets[i] = galloc->blocks[i].offset;
+            order[n++] = &galloc->blocks[i];
+        }
+    }
+    qsort(order, n, sizeof(*order), ggml_gallocr_block_cmp);
+
+    size_t peak = 0;
+    for (int i = 0; i < n; i++) {
+        struct alloc_block * block = order[i];
+
+        int n_live = 0;
+        for (int j = 0; j < i; j++) {
+            if (order[j]->first <= block->last && block->first <= order[j]->last) {
+                live[n_live++] = order[j];
+            }
+        }
+        qsort(live, n_live, sizeof(*live), ggml_gallocr_offset_cmp);
+
+        size_t best_offset = 0;
+        size_t best_gap = SIZE_MAX;
+        size_t prev_end = 0;
+        for (int j = 0; j < n_live; j++) {
+            if (live[j]->offset >= prev_end) {
+                size_t gap = live[j]->offset - prev_end;
+                if (gap >= block->size && gap < best_gap) {
+                    best_gap = gap;
+                    best_offset = prev_end;
+                }
+            }
+            prev_end = MAX(prev_end, live[j]->offset + live[j]->size);
+        }
+        if (best_gap == SIZE_MAX) {
+            best_offset = prev_end;
+        }
+        block->offset = best_offset;
+        peak = MAX(peak, best_offset + block->size);
+    }
+
+    struct ggml_dyn_tallocr * alloc = galloc->buf_tallocs[buffer_id];
+    if (peak < alloc->max_size) {
+        AT_PRINTF("%s: planned buffer %d at %zu bytes instead of %zu\n", __func__, buffer_id, peak, alloc->max_size);
+        alloc->max_size = peak;
+        for (size_t i = 0; i < galloc->hash_set.size; i++) {
+            struct hash_node * hn = &galloc->hash_values[i];
+            if (galloc->hash_set.keys[i] != NULL && hn->block && hn->buffer_id == buffer_id) {
+                hn->offset = galloc->blocks[hn->block - 1].offset;
+            }
+        }
+    } else {
+        for (int i = 0; i < galloc->n_blocks; i++) {
+            if (galloc->blocks[i].buffer_id == buffer_id) {
+                galloc->blocks[i].offset = offsets[i];
+            }
+        }
+    }
+
+    free(offsets);
+    free(live);
+    free(order);
+}
+
 bool ggml_gallocr_reserve_n(ggml_gallocr_t galloc, struct ggml_cgraph * graph, const int * node_buffer_ids, const int * leaf_buffer_ids) {
     size_t hash_size = graph->visited_hash_table.size;
 
@@ -666,6 +798,11 @@ bool ggml_gallocr_reserve_n(ggml_gallocr_t galloc, struct ggml_cgraph * graph, c
     // allocate in hash table
     ggml_gallocr_alloc_graph_impl(galloc, graph, node_buffer_ids, leaf_buffer_ids);
 
+    // pack the blocks now that their lifetimes are known
+    for (int i = 0; i < galloc->n_buffers; i++) {
+        ggml_gallocr_plan_buffer(galloc, i);
+    }
+
     // set the node_allocs from the hash table
     if (galloc->n_nodes < graph->n_nodes) {
         free(galloc->node_allocs);
@@ -5,6 +5,9 @@
 #include "ggml-alloc.h"
 #include "ggml-impl.h"
 
+#include "llamafile/trace.h"
+#include "llamafile/flight.h"
+
 #include <assert.h>
 #include <limits.h>
 #include <stdarg.h>
@@ -738,6 +741,9 @@ struct ggml_backend_cpu_context {
 
     ggml_abort_callback abort_callback;
     void *              abort_callback_data;
+
+    ggml_node_callback node_callback;
+    void *             node_callback_data;
 };
 
 GGML_CALL static const char * ggml_backend_cpu_name(ggml_backend_t backend) {
@@ -782,6 +788,8 @@ GGML_CALL static ggml_backend_graph_plan_t ggml_backend_cpu_graph_plan_create(gg
 
     cpu_plan->cplan.abort_callback      = cpu_ctx->abort_callback;
     cpu_plan->cplan.abort_callback_data = cpu_ctx->abort_callback_data;
+    cpu_plan->cplan.node_callback       = cpu_ctx->node_callback;
+    cpu_plan->cplan.node_callback_data  = cpu_ctx->node_callback_data;
 
     return cpu_plan;
 }
@@ -821,6 +829,8 @@ GGML_CALL static enum ggml_status ggml_backend_cpu_graph_compute(ggml_backend_t
 
     cplan.abort_callback      = cpu_ctx->abort_callback;
     cplan.abort_callback_data = cpu_ctx->abort_callback_data;
+    cplan.node_callback       = cpu_ctx->node_callback;
+    cplan.node_callback_data  = cpu_ctx->node_callback_data;
 
     return ggml_graph_compute(cgraph, &cplan);
 }
@@ -834,7 +844,10 @@ GGML_CALL static bool ggml_backend_cpu_supports_op(ggml_backend_t backend, const
                 op->type != GGML_TYPE_IQ1_S   &&
                 op->type != GGML_TYPE_IQ1_M; // missing type_traits.from_float
         case GGML_OP_MUL_MAT:
+        case GGML_OP_MUL_MAT_SWIGLU:
             return op->src[1]->type == GGML_TYPE_F32 || op->src[1]->type == ggml_internal_get_type_traits(op->src[0]->type).vec_dot_type;
+        case GGML_OP_MUL_MAT_AXPY:
+            return op->src[1]->type == GGML_TYPE_F32;
         default:
             return true;
     }
@@ -879,6 +892,8 @@ ggml_backend_t ggml_backend_cpu_init(void) {
     ctx->work_size           = 0;
     ctx->abort_callback      = NULL;
     ctx->abort_callback_data = NULL;
+    ctx->node_callback       = NULL;
+    ctx->node_callback_data  = NULL;
 
     ggml_backend_t cpu_backend = malloc(sizeof(struct ggml_backend));
     if (cpu_backend == NULL) {
@@ -913,6 +928,14 @@ void ggml_backend_cpu_set_abort_callback(ggml_backend_t backend_cpu, ggml_abort_
     ctx->abort_callback_data = abort_callback_data;
 }
 
+void ggml_backend_cpu_set_node_callback(ggml_backend_t backend_cpu, ggml_node_callback node_callback, void * node_callback_data) {
+    GGML_ASSERT(ggml_backend_is_cpu(backend_cpu));
+
+    struct ggml_backend_cpu_context * ctx = (struct ggml_backend_cpu_context *)backend_cpu->context;
+    ctx->node_callback = node_callback;
+    ctx->node_callback_data = node_callback_data;
+}
+
 GGML_CALL ggml_backend_buffer_t ggml_backend_cpu_buffer_from_ptr(void * ptr, size_t size) {
     GGML_ASSERT((uintptr_t)ptr % TENSOR_ALIGNMENT == 0 && "buffer pointer must be aligned");
     return ggml_backend_buffer_init(ggml_backend_cpu_buffer_type(), cpu_backend_buffer_i_from_ptr, ptr, size);
@@ -1032,6 +1055,12 @@ static bool ggml_is_view_op(enum ggml_op op) {
 #define GGML_SCHED_MAX_COPIES 4
 #endif
 
+// throughput is measured by batch size, in buckets of powers of two
+#define GGML_SCHED_PERF_BUCKETS 14
+
+// one compute in this many is timed split by split to update the cost model
+#define GGML_SCHED_PERF_INTERVAL 64
+
 struct ggml_backend_sched_split {
     int backend_id;
     int i_start;
@@ -1081,6 +1110,22 @@ struct ggml_backend_sched {
     ggml_backend_sched_eval_callback callback_eval;
     void * callback_eval_user_data;
 
+    // backend assignments of the last graph that was split, which are
+    // reused as long as the graphs that follow have the same topology
+    uint64_t cache_key; // 0 = empty
+    int * cache_node_ids; // [graph_size]
+    int * cache_leaf_ids; // [graph_size]
+
+    // measured costs, to decide if ops on weights in host memory are worth offloading
+    double perf_flops[GGML_SCHED_MAX_BACKENDS][GGML_SCHED_PERF_BUCKETS]; // matmul flop/s, 0 = not measured
+    double perf_bandwidth[GGML_SCHED_MAX_BACKENDS]; // byte/s of copies into the backend, 0 = not measured
+    int64_t n_computes;
+
+    // graphs for at most this many tokens are computed on the cpu, over
+    // the host memory of the other backends, 0 = never
+    int host_decode;
+    bool is_host_decode; // if the graph being split is one of them
+
     // align context_buffer to GGML_MEM_ALIGN
 #ifdef _MSC_VER
     __declspec(align(GGML_MEM_ALIGN))
@@ -1109,6 +1154,13 @@ static int ggml_backend_sched_backend_from_buffer(ggml_backend_sched_t sched, co
         return -1;
     }
 
+    // the cpu reads the memory gpus share with it in place
+    const int cpu_id = sched->n_backends - 1;
+    if (sched->is_host_decode && ggml_backend_buffer_is_host(buffer) &&
+        ggml_backend_buft_supports_backend(buffer->buft, sched->backends[cpu_id])) {
+        return cpu_id;
+    }
+
     // find highest prio backend that supports the buffer type
     for (int i = 0; i < sched->n_backends; i++) {
         if (ggml_backend_buft_supports_backend(buffer->buft, sched->backends[i])) {
@@ -1132,6 +1184,62 @@ static char causes[GGML_DEFAULT_GRAPH_SIZE*16 + GGML_SCHED_MAX_SPLITS*GGML_SCHED
 #define GET_CAUSE(node) ""
 #endif
 
+static int ggml_backend_sched_perf_bucket(int64_t n_tokens) {
+    int bucket = 0;
+    while (n_tokens > 1 && bucket < GGML_SCHED_PERF_BUCKETS - 1) {
+        n_tokens >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+// number of tokens a matmul is computed for, or 0 for other ops
+static int64_t ggml_backend_sched_op_tokens(const struct ggml_tensor * op) {
+    switch (op->op) {
+        case GGML_OP_MUL_MAT:    return op->ne[1];
+        case GGML_OP_MUL_MAT_ID: return op->ne[2];
+        default:                 return 0;
+    }
+}
+
+static double ggml_backend_sched_op_flops(const struct ggml_tensor * op) {
+    return ggml_backend_sched_op_tokens(op) ? 2.0 * op->src[0]->ne[0] * ggml_nelements(op) : 0;
+}
+
+// flop/s of a backend at a batch size, falling back to the nearest smaller
+// batch that was measured, which errs on the side of the backend being slow
+static double ggml_backend_sched_perf_flops(ggml_backend_sched_t sched, int backend_id, int64_t n_tokens) {
+    for (int b = ggml_backend_sched_perf_bucket(n_tokens); b >= 0; b--) {
+        if (sched->perf_flops[backend_id][b] > 0) {
+            return sched->perf_flops[backend_id][b];
+        }
+    }
+    return 0;
+}
+
+static void ggml_backend_sched_perf_update(double * v, double x) {
+    *v = *v > 0 ? 0.75*(*v) + 0.25*x : x;
+}
+
+// decides if an op on a weight that lives on a lower priority backend is
+// better computed on a higher priority one, which first has to copy the
+// weight over. once both backends and the copy have been measured this
+// compares the estimated times, and until then it's up to the backend.
+static bool ggml_backend_sched_offload_op(ggml_backend_sched_t sched, int backend_id, int weight_backend_id,
+                                          const struct ggml_tensor * op, const struct ggml_tensor * weight) {
+    const int64_t n_tokens = ggml_backend_sched_op_tokens(op);
+    if (n_tokens > 0) {
+        const double f_dev  = ggml_backend_sched_perf_flops(sched, backend_id, n_tokens);
+        const double f_host = ggml_backend_sched_perf_flops(sched, weight_backend_id, n_tokens);
+        const double bw     = sched->perf_bandwidth[backend_id];
+        if (f_dev > 0 && f_host > 0 && bw > 0 && ggml_backend_supports_op(sched->backends[backend_id], op)) {
+            const double flops = ggml_backend_sched_op_flops(op);
+            return ggml_nbytes(weight) / bw + flops / f_dev < flops / f_host;
+        }
+    }
+    return ggml_backend_offload_op(sched->backends[backend_id], op);
+}
+
 // returns the backend that should be used for the node based on the current locations
 static int ggml_backend_sched_backend_id_from_cur(ggml_backend_sched_t sched, struct ggml_tensor * tensor) {
     // TODO: use supports_op to check if the backend supports the op
@@ -1171,7 +1279,7 @@ static int ggml_backend_sched_backend_id_from_cur(ggml_backend_sched_t sched, st
             // check if a backend with higher prio wants to offload the op
             if (src_backend_id == sched->n_backends - 1) {
                 for (int b = 0; b < src_backend_id; b++) {
-                    if (ggml_backend_offload_op(sched->backends[b], tensor)) {
+                    if (ggml_backend_sched_offload_op(sched, b, src_backend_id, tensor, src)) {
                         SET_CAUSE(tensor, "1.off");
                         return b;
                     }
@@ -1229,6 +1337,36 @@ static void ggml_backend_sched_print_assignments(ggml_backend_sched_t sched, str
     }
 }
 
+// hashes what the backend assignments depend on: the ops, their shapes,
+// and which weights and other pre-allocated tensors they use
+static uint64_t ggml_backend_sched_graph_key(const struct ggml_cgraph * graph) {
+    uint64_t h = 0xcbf29ce484222325;
+#define GGML_SCHED_MIX(x) h = (h ^ (uint64_t) (x)) * 0x100000001b3
+    GGML_SCHED_MIX(graph->n_nodes);
+    GGML_SCHED_MIX(graph->n_leafs);
+    for (int i = 0; i < graph->n_leafs; i++) {
+        const struct ggml_tensor * leaf = graph->leafs[i];
+        GGML_SCHED_MIX(leaf->buffer ? (uintptr_t) leaf : (uintptr_t) leaf->flags);
+        GGML_SCHED_MIX(leaf->ne[0]);
+        GGML_SCHED_MIX(leaf->ne[1]);
+    }
+    for (int i = 0; i < graph->n_nodes; i++) {
+        const struct ggml_tensor * node = graph->nodes[i];
+        GGML_SCHED_MIX(node->op);
+        GGML_SCHED_MIX(node->flags);
+        GGML_SCHED_MIX((uintptr_t) node->buffer);
+        for (int k = 0; k < GGML_MAX_DIMS; k++) {
+            GGML_SCHED_MIX(node->ne[k]);
+        }
+        for (int j = 0; j < GGML_MAX_SRC; j++) {
+            const struct ggml_tensor * src = node->src[j];
+            GGML_SCHED_MIX(src && src->buffer ? (uintptr_t) src : (uintptr_t) (src != NULL));
+        }
+    }
+#undef GGML_SCHED_MIX
+    return h ? h : 1;
+}
+
 //#define DEBUG_PASS1
 //#define DEBUG_PASS2
 //#define DEBUG_PASS3
@@ -1255,6 +1393,33 @@ static void ggml_backend_sched_split_graph(ggml_backend_sched_t sched, struct gg
         GGML_ASSERT(false);
     }
 
+    // prompts are compute bound and go to the gpus, while decoding is
+    // bound by memory bandwidth, which integrated gpus share with the cpu
+    int64_t n_tokens = 0;
+    for (int i = 0; i < graph->n_nodes; i++) {
+        n_tokens = MAX(n_tokens, ggml_backend_sched_op_tokens(graph->nodes[i]));
+    }
+    sched->is_host_decode = n_tokens > 0 && n_tokens <= sched->host_decode;
+
+    // the passes below only look at the topology, so a graph that was
+    // rebuilt the same way as the last one gets the same assignments
+    const uint64_t key = ggml_backend_sched_graph_key(graph);
+    if (key == sched->cache_key) {
+        for (int i = 0; i < graph->n_leafs; i++) {
+            int * leaf_backend_id = &tensor_backend_id(graph->leafs[i]);
+            if (*leaf_backend_id == -1) {
+                *leaf_backend_id = sched->cache_leaf_ids[i];
+            }
+        }
+        for (int i = 0; i < graph->n_nodes; i++) {
+            int * node_backend_id = &tensor_backend_id(graph->nodes[i]);
+            if (*node_backend_id == -1) {
+                *node_backend_id = sched->cache_node_ids[i];
+            }
+        }
+        goto split;
+    }
+
     // pass 1: assign backends to ops with pre-allocated inputs
     for (int i = 0; i < graph->n_leafs; i++) {
         struct ggml_tensor * leaf = graph->leafs[i];
@@ -1409,6 +1574,15 @@ static void ggml_backend_sched_split_graph(ggml_backend_sched_t sched, struct gg
     fprintf(stderr, "PASS 3 ASSIGNMENTS\n"); ggml_backend_sched_print_assignments(sched, graph);
 #endif
 
+    for (int i = 0; i < graph->n_leafs; i++) {
+        sched->cache_leaf_ids[i] = tensor_backend_id(graph->leafs[i]);
+    }
+    for (int i = 0; i < graph->n_nodes; i++) {
+        sched->cache_node_ids[i] = tensor_backend_id(graph->nodes[i]);
+    }
+    sched->cache_key = key;
+
+split:
     // pass 4: split graph, find tensors that need to be copied
     {
         int i_split = 0;
@@ -1639,36 +1813,80 @@ static bool ggml_backend_sched_alloc_splits(ggml_backend_sched_t sched) {
 static enum ggml_status ggml_backend_sched_compute_splits(ggml_backend_sched_t sched) {
     struct ggml_backend_sched_split * splits = sched->splits;
 
+    // now and then, wait for every split and copy to finish so their
+    // times can be measured. this updates the costs that decide offloading
+    const bool measure = sched->n_backends > 1 && !sched->callback_eval &&
+                         sched->n_computes++ % GGML_SCHED_PERF_INTERVAL == 0;
+    if (measure) {
+        ggml_backend_sched_synchronize(sched);
+    }
+
     for (int i = 0; i < sched->n_splits; i++) {
         struct ggml_backend_sched_split * split = &splits[i];
         int split_backend_id = split->backend_id;
         ggml_backend_t split_backend = sched->backends[split_backend_id];
 
+        // wait for the split backend to finish using the inputs before overwriting them,
+        // once for all of them, so a stage boundary costs one wait rather than one per tensor
+        if (split->n_inputs > 0) {
+            bool user_inputs = false;
+            for (int j = 0; j < split->n_inputs; j++) {
+                if (split->inputs[j]->flags & GGML_TENSOR_FLAG_INPUT) {
+                    user_inputs = true;
+                }
+            }
+            if (sched->events[split_backend_id][sched->cur_copy] != NULL) {
+                if (user_inputs) {
+                    // inputs from the user must be copied immediately to prevent the user overwriting the data before the copy is done
+                    ggml_backend_event_synchronize(sched->events[split_backend_id][sched->cur_copy]);
+                } else {
+                    ggml_backend_event_wait(split_backend, sched->events[split_backend_id][sched->cur_copy]);
+                }
+            } else {
+                ggml_backend_synchronize(split_backend);
+            }
+        }
+
+        size_t copied = 0;
+        const int64_t t_copy_us = measure ? ggml_time_us() : 0;
+
         // copy the input tensors to the split backend
         for (int j = 0; j < split->n_inputs; j++) {
             ggml_backend_t input_backend = ggml_backend_sched_get_tensor_backend(sched, split->inputs[j]);
             struct ggml_tensor * input = split->inputs[j];
             struct ggml_tensor * input_cpy = sched->tensor_copies[hash_id(input)][split_backend_id][sched->cur_copy];
 
+            const long long trace_start = llamafile_tracing ? llamafile_trace_now() : 0;
+
             if (input->flags & GGML_TENSOR_FLAG_INPUT) {
-                // inputs from the user must be copied immediately to prevent the user overwriting the data before the copy is done
-                if (sched->events[split_backend_id][sched->cur_copy] != NULL) {
-                    ggml_backend_event_synchronize(sched->events[split_backend_id][sched->cur_copy]);
-                } else {
-                    ggml_backend_synchronize(split_backend);
-                }
                 ggml_backend_tensor_copy(input, input_cpy);
             } else {
-                // wait for the split backend to finish using the input before overwriting it
-                if (sched->events[split_backend_id][sched->cur_copy] != NULL) {
-                    ggml_backend_event_wait(split_backend, sched->events[split_backend_id][sched->cur_copy]);
-                } else {
-                    ggml_backend_synchronize(split_backend);
-                }
                 ggml_backend_tensor_copy_async(input_backend, split_backend, input, input_cpy);
             }
+
+            if (trace_start) {
+                // wait for the copy so its event shows how long it really took
+                char name[32];
+                ggml_backend_synchronize(split_backend);
+                snprintf(name, sizeof(name), "%s->%s", input_backend ? ggml_backend_name(input_backend) : "host", ggml_backend_name(split_backend));
+                llamafile_trace_event("copy", name, input->name, ggml_nbytes(input), trace_start, llamafile_trace_now());
+            }
+
+            copied += ggml_nbytes(input);
         }
 
+        int64_t t_compute_us = 0;
+        if (measure) {
+            ggml_backend_synchronize(split_backend);
+            t_compute_us = ggml_time_us();
+            // small copies are all latency
+            if (copied >= 1024*1024 && t_compute_us > t_copy_us) {
+                ggml_backend_sched_perf_update(&sched->perf_bandwidth[split_backend_id], copied / ((t_compute_us - t_copy_us) * 1e-6));
+            }
+        }
+
+        const long long trace_start = llamafile_tracing || llamafile_flight_enabled ? llamafile_trace_now() : 0;
+
         if (!sched->callback_eval) {
             enum ggml_status ec = ggml_backend_graph_compute_async(split_backend, &split->graph);
             if (ec != GGML_STATUS_SUCCESS) {
@@ -1708,6 +1926,38 @@ static enum ggml_status ggml_backend_sched_compute_splits(ggml_backend_sched_t s
             }
         }
 
+        if (measure) {
+            double flops = 0;
+            int64_t n_tokens = 0;
+            for (int j = 0; j < split->graph.n_nodes; j++) {
+                flops += ggml_backend_sched_op_flops(split->graph.nodes[j]);
+                n_tokens = MAX(n_tokens, ggml_backend_sched_op_tokens(split->graph.nodes[j]));
+            }
+            ggml_backend_synchronize(split_backend);
+            const int64_t t_end_us = ggml_time_us();
+            if (flops >= 1e6 && t_end_us > t_compute_us) {
+                const int bucket = ggml_backend_sched_perf_bucket(n_tokens);
+                ggml_backend_sched_perf_update(&sched->perf_flops[split_backend_id][bucket], flops / ((t_end_us - t_compute_us) * 1e-6));
+            }
+        }
+
+        if (llamafile_flight_enabled && !llamafile_tracing) {
+            // the flight recorder mustn't slow things down, so for device
+            // backends this is only how long it took to queue the split
+            llamafile_flight_record(LLAMAFILE_FLIGHT_SPLIT, ggml_backend_name(split_backend), i, split->graph.n_nodes, trace_start, llamafile_trace_now());
+        }
+
+        if (llamafile_tracing) {
+            // device backends compute asynchronously, so wait for them to finish
+            char label[64];
+            ggml_backend_synchronize(split_backend);
+            snprintf(label, sizeof(label), "split %d (%d nodes)", i, split->graph.n_nodes);
+            llamafile_trace_event("sched", ggml_backend_name(split_backend), label, 0, trace_start, llamafile_trace_now());
+            if (llamafile_flight_enabled) {
+                llamafile_flight_record(LLAMAFILE_FLIGHT_SPLIT, ggml_backend_name(split_backend), i, split->graph.n_nodes, trace_start, llamafile_trace_now());
+            }
+        }
+
         // record the event of this copy
         if (split->n_inputs > 0) {
             if (sched->events[split_backend_id][sched->cur_copy] != NULL) {
@@ -1718,6 +1968,10 @@ static enum ggml_status ggml_backend_sched_compute_splits(ggml_backend_sched_t s
 
     sched->cur_copy = (sched->cur_copy + 1) % sched->n_copies;
 
+    if (measure) {
+        sched->cache_key = 0; // placements may change with the new costs
+    }
+
     return GGML_STATUS_SUCCESS;
 }
 
@@ -1741,6 +1995,8 @@ ggml_backend_sched_t ggml_backend_sched_new(
     const size_t nodes_size = graph_size + GGML_SCHED_MAX_SPLITS*GGML_SCHED_MAX_SPLIT_INPUTS*2;
     sched->node_backend_ids  = calloc(nodes_size, sizeof(sched->node_backend_ids[0]));
     sched->leaf_backend_ids  = calloc(nodes_size, sizeof(sched->leaf_backend_ids[0]));
+    sched->cache_node_ids    = calloc(nodes_size, sizeof(sched->cache_node_ids[0]));
+    sched->cache_leaf_ids    = calloc(nodes_size, sizeof(sched->cache_leaf_ids[0]));
 
     sched->n_backends = n_backends;
 
@@ -1785,6 +2041,8 @@ void ggml_backend_sched_free(ggml_backend_sched_t sched) {
     free(sched->tensor_copies);
     free(sched->node_backend_ids);
     free(sched->leaf_backend_ids);
+    free(sched->cache_node_ids);
+    free(sched->cache_leaf_ids);
     free(sched);
 }
 
@@ -1862,6 +2120,13 @@ void ggml_backend_sched_set_eval_callback(ggml_backend_sched_t sched, ggml_backe
     sched->callback_eval_user_data = user_data;
 }
 
+void ggml_backend_sched_set_host_decode(ggml_backend_sched_t sched, int n_tokens) {
+    if (sched->host_decode != n_tokens) {
+        sched->host_decode = n_tokens;
+        sched->cache_key = 0;
+    }
+}
+
 int ggml_backend_sched_get_n_splits(ggml_backend_sched_t sched) {
     return sched->n_splits;
 }
@@ -2107,6 +2372,7 @@ bool ggml_backend_compare_graph_backend(ggml_backend_t backend1, ggml_backend_t
 }
 
 #include "llamafile/log.h"
+#include "llamafile/llamafile.h"
 
 GGML_CALL static void system_exit(int rc) {
     exit(rc);
@@ -2164,6 +2430,7 @@ static const struct ggml_backend_api kGgmlBackendApi = {
     ggml_guid_matches,
     ggml_is_empty,
     ggml_are_same_shape,
+    &FLAG_cuda_graphs,
 };
 
 const struct ggml_backend_api *ggml_backend_api(void) {
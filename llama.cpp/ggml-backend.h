@@ -101,6 +101,7 @@ extern "C" {
     GGML_API GGML_CALL bool ggml_backend_is_cpu                (ggml_backend_t backend);
     GGML_API           void ggml_backend_cpu_set_n_threads     (ggml_backend_t backend_cpu, int n_threads);
     GGML_API           void ggml_backend_cpu_set_abort_callback(ggml_backend_t backend_cpu, ggml_abort_callback abort_callback, void * abort_callback_data);
+    GGML_API           void ggml_backend_cpu_set_node_callback(ggml_backend_t backend_cpu, ggml_node_callback node_callback, void * node_callback_data);
 
     // Create a backend buffer from an existing pointer
     GGML_API GGML_CALL ggml_backend_buffer_t ggml_backend_cpu_buffer_from_ptr(void * ptr, size_t size);
@@ -203,6 +204,11 @@ extern "C" {
     // Set a callback to be called for each resulting node during graph compute
     GGML_API void                 ggml_backend_sched_set_eval_callback(ggml_backend_sched_t sched, ggml_backend_sched_eval_callback callback, void * user_data);
 
+    // Compute graphs whose matmuls are for at most n_tokens tokens on the CPU backend, reading the tensors
+    // of the other backends in place if their buffers are in host memory, e.g. on GPUs that share memory
+    // with the CPU, where decoding is bound by the same memory bandwidth either way (0 = never)
+    GGML_API void                 ggml_backend_sched_set_host_decode(ggml_backend_sched_t sched, int n_tokens);
+
     //
     // Utils
     //
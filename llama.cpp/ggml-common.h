@@ -139,6 +139,9 @@ typedef sycl::half2 ggml_half2;
 #define QR4_XS 8
 #endif
 
+#define QI8_E4M3 (QK_F8_E4M3 / (4*QR8_E4M3))
+#define QR8_E4M3 1
+
 #endif // GGML_COMMON_DECL_CUDA || GGML_COMMON_DECL_HIP
 
 #define QK4_0 32
@@ -418,6 +421,16 @@ typedef struct {
 static_assert(sizeof(block_iq4_xs) == sizeof(ggml_half) + sizeof(uint16_t) + QK_K/64 + QK_K/2, "wrong iq4_xs block size/padding");
 #endif
 
+// 8-bit floats, with 4 exponent bits and 3 mantissa bits, as defined
+// by the OCP 8-bit floating point specification. The block scale maps
+// the largest magnitude of the block onto 448, the largest e4m3 value.
+#define QK_F8_E4M3 32
+typedef struct {
+    ggml_half d;            // scale
+    uint8_t qs[QK_F8_E4M3]; // e4m3 values
+} block_f8_e4m3;
+static_assert(sizeof(block_f8_e4m3) == sizeof(ggml_half) + QK_F8_E4M3, "wrong f8_e4m3 block size/padding");
+
 #endif // GGML_COMMON_DECL
 #endif // GGML_COMMON_DECL
 
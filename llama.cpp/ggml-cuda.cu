@@ -11,6 +11,7 @@
 #include <cstddef>
 #include <cstdint>
 #include <cstdio>
+#include <cstring>
 #include <float.h>
 #include <limits>
 #include <map>
@@ -70,6 +71,9 @@
 // for rocblas_initialize()
 #include "rocblas/rocblas.h"
 #endif // __HIP_PLATFORM_AMD__
+#ifdef GGML_USE_HIPBLASLT
+#include <hipblaslt/hipblaslt.h>
+#endif // GGML_USE_HIPBLASLT
 #define CUBLAS_COMPUTE_16F HIPBLAS_R_16F
 #define CUBLAS_COMPUTE_32F HIPBLAS_R_32F
 #define CUBLAS_COMPUTE_32F_FAST_16F HIPBLAS_R_32F
@@ -108,6 +112,8 @@
 #define cudaDeviceCanAccessPeer hipDeviceCanAccessPeer
 #define cudaDeviceDisablePeerAccess hipDeviceDisablePeerAccess
 #define cudaDeviceEnablePeerAccess hipDeviceEnablePeerAccess
+#define cudaDeviceGetP2PAttribute hipDeviceGetP2PAttribute
+#define cudaDevP2PAttrNativeAtomicSupported hipDevP2PAttrNativeAtomicSupported
 #define cudaDeviceProp hipDeviceProp_t
 #define cudaDeviceSynchronize hipDeviceSynchronize
 #define cudaError_t hipError_t
@@ -209,11 +215,17 @@
 
 #endif // defined(GGML_USE_HIPBLAS)
 
+// decode steps may be captured as a graph, whose kernels launch together
+#if !defined(GGML_USE_HIPBLAS) && CUDART_VERSION >= 12000
+#define USE_CUDA_GRAPH
+#endif
+
 #include "ggml-backend-impl.h"
 
 static const struct ggml_backend_api *g_backend;
 #define getenv g_backend->getenv
 #define FLAG_log_disable (*g_backend->FLAG_log_disable)
+#define FLAG_cuda_graphs (*g_backend->FLAG_cuda_graphs)
 #define ggml_backend_register g_backend->ggml_backend_register
 #define ggml_is_quantized g_backend->ggml_is_quantized
 #define ggml_type_size g_backend->ggml_type_size
@@ -285,6 +297,11 @@ static void ggml_cuda_print(const char *fmt, ...) {
 #define BLAS_NAME GGML_CUBLAS_NAME
 #endif
 
+#ifdef GGML_USE_TINYBLAS
+// kernel each device's tinyblas handle uses, see ggml_cuda_tune()
+static int g_tinyblas_config[GGML_CUDA_MAX_DEVICES];
+#endif
+
 GGML_CALL bool ggml_cuda_link(const struct ggml_backend_api *backend_api) {
     g_backend = backend_api;
     if (!FLAG_log_disable)
@@ -423,10 +440,11 @@ static __device__ void no_device_code(
 #define NO_DEVICE_CODE //GGML_ASSERT(false && "NO_DEVICE_CODE not valid in host code.")
 #endif // __CUDA_ARCH__
 
+template<int width = WARP_SIZE>
 static __device__ __forceinline__ float warp_reduce_sum(float x) {
 #pragma unroll
-    for (int mask = 16; mask > 0; mask >>= 1) {
-        x += __shfl_xor_sync(0xffffffff, x, mask, 32);
+    for (int mask = width/2; mask > 0; mask >>= 1) {
+        x += __shfl_xor_sync(0xffffffff, x, mask, width);
     }
     return x;
 }
@@ -440,67 +458,61 @@ static __device__ __forceinline__ float2 warp_reduce_sum(float2 a) {
     return a;
 }
 
+template<int width = WARP_SIZE>
 static __device__ __forceinline__ half2 warp_reduce_sum(half2 a) {
-#if !(defined(GGML_USE_HIPBLAS) && defined(__HIP_PLATFORM_AMD__)) && __CUDA_ARCH__ >= CC_PASCAL
+#if defined(GGML_USE_HIPBLAS) && defined(__HIP_PLATFORM_AMD__)
 #pragma unroll
-   for (int mask = 16; mask > 0; mask >>= 1) {
-       a = __hadd2(a, __shfl_xor_sync(0xffffffff, a, mask, 32));
+   for (int mask = width/2; mask > 0; mask >>= 1) {
+       // hip can't shuffle half2 before rocm 5.7, so it's moved as bits
+       const int b = __shfl_xor_sync(0xffffffff, *(const int *) &a, mask, width);
+       a = __hadd2(a, *(const half2 *) &b);
+   }
+   return a;
+#elif __CUDA_ARCH__ >= CC_PASCAL
+#pragma unroll
+   for (int mask = width/2; mask > 0; mask >>= 1) {
+       a = __hadd2(a, __shfl_xor_sync(0xffffffff, a, mask, width));
    }
    return a;
 #else
    GGML_UNUSED(a);
    NO_DEVICE_CODE;
-#endif // !(defined(GGML_USE_HIPBLAS) && defined(__HIP_PLATFORM_AMD__)) && __CUDA_ARCH__ >= CC_PASCAL
+#endif // defined(GGML_USE_HIPBLAS) && defined(__HIP_PLATFORM_AMD__)
 }
 
+template<int width = WARP_SIZE>
 static __device__ __forceinline__ float warp_reduce_max(float x) {
 #pragma unroll
-    for (int mask = 16; mask > 0; mask >>= 1) {
-        x = fmaxf(x, __shfl_xor_sync(0xffffffff, x, mask, 32));
+    for (int mask = width/2; mask > 0; mask >>= 1) {
+        x = fmaxf(x, __shfl_xor_sync(0xffffffff, x, mask, width));
     }
     return x;
 }
 
 static __device__ __forceinline__ half ggml_cuda_hmax(const half a, const half b) {
-#if !(defined(GGML_USE_HIPBLAS) && defined(__HIP_PLATFORM_AMD__))
-
-#if CUDART_VERSION >= CUDART_HMAX
+#if !(defined(GGML_USE_HIPBLAS) && defined(__HIP_PLATFORM_AMD__)) && CUDART_VERSION >= CUDART_HMAX
     return __hmax(a, b);
 #else
     return __half2float(a) > __half2float(b) ? a : b;
-#endif // CUDART_VERSION >= CUDART_HMAX
-
-#else
-    GGML_UNUSED(a);
-    GGML_UNUSED(b);
-    NO_DEVICE_CODE;
-#endif // !(defined(GGML_USE_HIPBLAS) && defined(__HIP_PLATFORM_AMD__)) && CUDART_VERSION < CUDART_HMAX
+#endif // !(defined(GGML_USE_HIPBLAS) && defined(__HIP_PLATFORM_AMD__)) && CUDART_VERSION >= CUDART_HMAX
 }
 static __device__ __forceinline__ half2 ggml_cuda_hmax2(const half2 a, const half2 b) {
-#if !(defined(GGML_USE_HIPBLAS) && defined(__HIP_PLATFORM_AMD__))
-
-#if CUDART_VERSION >= CUDART_HMAX
+#if !(defined(GGML_USE_HIPBLAS) && defined(__HIP_PLATFORM_AMD__)) && CUDART_VERSION >= CUDART_HMAX
     return __hmax2(a, b);
 #else
     half2 ret;
     reinterpret_cast<half&>(ret.x) =  __low2float(a) >  __low2float(b) ?  __low2half(a) :  __low2half(b);
     reinterpret_cast<half&>(ret.y) = __high2float(a) > __high2float(b) ? __high2half(a) : __high2half(b);
     return ret;
-#endif // CUDART_VERSION >= CUDART_HMAX
-
-#else
-    GGML_UNUSED(a);
-    GGML_UNUSED(b);
-    NO_DEVICE_CODE;
-#endif // !(defined(GGML_USE_HIPBLAS) && defined(__HIP_PLATFORM_AMD__)) && CUDART_VERSION < CUDART_HMAX
+#endif // !(defined(GGML_USE_HIPBLAS) && defined(__HIP_PLATFORM_AMD__)) && CUDART_VERSION >= CUDART_HMAX
 }
 
 #define FP16_AVAILABLE (defined(GGML_USE_HIPBLAS) && defined(__HIP_PLATFORM_AMD__) ? \
-                        defined(RDNA1) || defined(RDNA2) || defined(RDNA3) : __CUDA_ARCH__ >= CC_PASCAL)
-#define FP16_MMA_AVAILABLE (!(defined(GGML_USE_HIPBLAS) && defined(__HIP_PLATFORM_AMD__)) && __CUDA_ARCH__ >= CC_VOLTA)
-#if FP16_MMA_AVAILABLE
-#include <mma.h>
-#endif
+                        defined(RDNA1) || defined(RDNA2) || defined(RDNA3) || defined(CDNA) : __CUDA_ARCH__ >= CC_PASCAL)
+// rocwmma programs the matrix cores of cdna and rdna3 through the same
+// api as nvcuda::wmma, which is only used if we found it at build time
+#define FP16_MMA_AVAILABLE (defined(GGML_USE_HIPBLAS) && defined(__HIP_PLATFORM_AMD__) ? \
+                            defined(GGML_HIP_ROCWMMA_FATTN) && (defined(CDNA) || defined(RDNA3)) : __CUDA_ARCH__ >= CC_VOLTA)
 
 #if defined(GGML_MINIMIZE_CODE_SIZE) && FP16_AVAILABLE // [jart]
 static __device__ __forceinline__ half2 warp_reduce_max(half2 x) {
@@ -538,6 +550,10 @@ static __device__ __forceinline__ uint32_t __hgt2_mask(const half2 a, const half
 #define RDNA2
 #endif
 
+#if defined(__gfx908__) || defined(__gfx90a__) || defined(__gfx940__) || defined(__gfx941__) || defined(__gfx942__)
+#define CDNA
+#endif
+
 #ifndef __has_builtin
     #define __has_builtin(x) 0
 #endif
@@ -608,6 +624,24 @@ static __device__ __forceinline__ int __dp4a(const int a, const int b, int c) {
 }
 #endif // defined(GGML_USE_HIPBLAS)
 
+#if FP16_MMA_AVAILABLE
+#if defined(GGML_USE_HIPBLAS)
+#include <rocwmma/rocwmma.hpp>
+namespace wmma = rocwmma;
+#else
+#include <mma.h>
+namespace wmma = nvcuda::wmma;
+#endif // defined(GGML_USE_HIPBLAS)
+#endif // FP16_MMA_AVAILABLE
+
+// the matrix cores of cdna work on whole 64-wide wavefronts, so that's
+// what a warp of the flash attention kernel is over there
+#if defined(CDNA)
+#define FATTN_WARP_SIZE 64
+#else
+#define FATTN_WARP_SIZE WARP_SIZE
+#endif // defined(CDNA)
+
 // TODO: move to ggml-common.h
 static const __device__ int8_t kvalues_iq4nl[16] = {-127, -104, -83, -65, -49, -35, -22, -10, 1, 13, 25, 38, 53, 69, 89, 113};
 
@@ -622,10 +656,16 @@ struct ggml_cuda_device_info {
     struct cuda_device_info {
         int     cc;                 // compute capability
         int     nsm;                // number of streaming multiprocessors
+        int     warp_size;          // 64 on cdna and gcn
+        bool    fp16;               // has the half precision kernels
+        bool    matrix_cores;       // tensor cores, or cdna and rdna3 on amd
+        bool    fp16_mma;           // has the flash attention kernel for batches
         size_t  smpb;               // max. shared memory per block
         bool    vmm;                // virtual memory support
         size_t  vmm_granularity;    // granularity of virtual memory
         size_t  total_vram;
+        bool    peer[GGML_CUDA_MAX_DEVICES];      // can access memory of other device
+        bool    fast_peer[GGML_CUDA_MAX_DEVICES]; // over nvlink or similar, rather than pcie
     };
 
     cuda_device_info devices[GGML_CUDA_MAX_DEVICES] = {};
@@ -697,14 +737,62 @@ struct ggml_tensor_extra_gpu {
     cudaEvent_t events[GGML_CUDA_MAX_DEVICES][GGML_CUDA_MAX_STREAMS]; // events for synchronizing multiple GPUs
 };
 
+#ifdef USE_CUDA_GRAPH
+// what a node of the ggml graph looked like on the previous call, which
+// is how we know if the kernels that were captured still compute it
+struct ggml_cuda_graph_node {
+    void * data;
+    ggml_op op;
+    int64_t ne[GGML_MAX_DIMS];
+    size_t nb[GGML_MAX_DIMS];
+    void * src[GGML_MAX_SRC];
+};
+
+// kernel of the captured graph that stores into the kv cache, whose
+// destination moves on every token
+struct ggml_cuda_graph_cpy {
+    cudaGraphNode_t node;
+    cudaKernelNodeParams params;
+    int i_node; // of the ggml graph
+};
+
+struct ggml_cuda_graph {
+    cudaGraph_t graph = nullptr;
+    cudaGraphExec_t instance = nullptr;
+    bool captured = false; // for the nodes below
+    bool disabled = false;
+    std::vector<ggml_cuda_graph_node> nodes;
+    std::vector<ggml_cuda_graph_cpy> cpys;
+
+    ~ggml_cuda_graph() {
+        if (instance != nullptr) {
+            CUDA_CHECK(cudaGraphExecDestroy(instance));
+        }
+        if (graph != nullptr) {
+            CUDA_CHECK(cudaGraphDestroy(graph));
+        }
+    }
+};
+#endif
+
 struct ggml_backend_cuda_context {
     int device;
     std::string name;
     cudaEvent_t copy_event = nullptr;
 
+#ifdef USE_CUDA_GRAPH
+    std::unique_ptr<ggml_cuda_graph> cuda_graph;
+#endif
+
     cudaStream_t streams[GGML_CUDA_MAX_DEVICES][GGML_CUDA_MAX_STREAMS] = { { nullptr } };
     cublasHandle_t cublas_handles[GGML_CUDA_MAX_DEVICES] = {nullptr};
 
+#ifdef GGML_USE_HIPBLASLT
+    hipblasLtHandle_t hipblaslt_handles[GGML_CUDA_MAX_DEVICES] = {nullptr};
+    // algorithm hipblaslt picked for each shape of gemm {m, n, k, ldc}
+    std::map<std::array<int64_t, 4>, hipblasLtMatmulHeuristicResult_t> hipblaslt_algos[GGML_CUDA_MAX_DEVICES];
+#endif // GGML_USE_HIPBLASLT
+
     explicit ggml_backend_cuda_context(int device) :
         device(device),
         name(GGML_CUDA_NAME + std::to_string(device)) {
@@ -723,6 +811,11 @@ struct ggml_backend_cuda_context {
             if (cublas_handles[i] != nullptr) {
                 CUBLAS_CHECK(cublasDestroy(cublas_handles[i]));
             }
+#ifdef GGML_USE_HIPBLASLT
+            if (hipblaslt_handles[i] != nullptr) {
+                CUBLAS_CHECK(hipblasLtDestroy(hipblaslt_handles[i]));
+            }
+#endif // GGML_USE_HIPBLASLT
         }
     }
 
@@ -743,6 +836,9 @@ struct ggml_backend_cuda_context {
             ggml_cuda_set_device(device);
             CUBLAS_CHECK(cublasCreate(&cublas_handles[device]));
             CUBLAS_CHECK(cublasSetMathMode(cublas_handles[device], CUBLAS_TF32_TENSOR_OP_MATH));
+#ifdef GGML_USE_TINYBLAS
+            CUBLAS_CHECK(tinyblasSetConfig(cublas_handles[device], g_tinyblas_config[device]));
+#endif
         }
         return cublas_handles[device];
     }
@@ -751,6 +847,16 @@ struct ggml_backend_cuda_context {
         return cublas_handle(device);
     }
 
+#ifdef GGML_USE_HIPBLASLT
+    hipblasLtHandle_t hipblaslt_handle(int device) {
+        if (hipblaslt_handles[device] == nullptr) {
+            ggml_cuda_set_device(device);
+            CUBLAS_CHECK(hipblasLtCreate(&hipblaslt_handles[device]));
+        }
+        return hipblaslt_handles[device];
+    }
+#endif // GGML_USE_HIPBLASLT
+
     // pool
     std::unique_ptr<ggml_cuda_pool> pools[GGML_CUDA_MAX_DEVICES];
 
@@ -811,6 +917,8 @@ to_fp32_cuda_t ggml_get_to_fp32_cuda(ggml_type type);
 
 void ggml_cuda_cpy(ggml_backend_cuda_context & ctx, const ggml_tensor * src0, ggml_tensor * src1);
 
+void * ggml_cuda_cpy_fn(const ggml_tensor * src0, ggml_tensor * src1);
+
 void ggml_cuda_dup(ggml_backend_cuda_context & ctx, ggml_tensor * dst);
 
 #define CUDA_DIAG_MASK_INF_BLOCK_SIZE 32
@@ -1028,6 +1136,20 @@ static __device__ __forceinline__ void dequantize_q8_0(const void * vx, const in
 #endif // GGML_CUDA_F16
 }
 
+// the bits of an e4m3 moved into those of an fp16 make its value times 2**-8
+static __device__ __forceinline__ float f8_e4m3_to_fp32_scaled(const uint8_t q) {
+    return __half2float(__ushort_as_half((unsigned short)(((q & 0x80) << 8) | ((q & 0x7f) << 7))));
+}
+
+static __device__ __forceinline__ void dequantize_f8_e4m3(const void * vx, const int64_t ib, const int iqs, dfloat2 & v){
+    const block_f8_e4m3 * x = (const block_f8_e4m3 *) vx;
+
+    const float d = __half2float(x[ib].d) * 256.0f;
+
+    v.x = f8_e4m3_to_fp32_scaled(x[ib].qs[iqs + 0]) * d;
+    v.y = f8_e4m3_to_fp32_scaled(x[ib].qs[iqs + 1]) * d;
+}
+
 static __device__ __forceinline__ int get_int_from_int8(const int8_t * x8, const int & i32) {
     const uint16_t * x16 = (const uint16_t *) (x8 + sizeof(int) * i32); // assume at least 2 byte alignment
 
@@ -2513,6 +2635,123 @@ static int next_power_of_2(int x) {
     return n;
 }
 
+#define CUDA_TOP_K_BLOCK_SIZE 256
+
+// maps floats onto integers that compare the same way
+static __device__ __forceinline__ uint32_t top_k_key(const float x) {
+    const uint32_t u = __float_as_uint(x);
+    return u ^ ((u >> 31) ? 0xffffffffu : 0x80000000u);
+}
+
+// finds the k largest entries of rows too long for the bitonic sort
+//
+// a radix select narrows down the key of the k-th largest entry one
+// byte at a time, then the k entries at or above it are gathered and
+// bitonic sorted in shared memory, so the row is only read five times
+static __global__ void k_top_k_f32_i32(const float * x, int * dst, const int ncols, const int k, const int k_pad) {
+    const int row = blockIdx.y;
+    const int tid = threadIdx.x;
+
+    const float * x_row = x + (int64_t) row * ncols;
+
+    __shared__ int hist[256];
+    __shared__ uint32_t s_prefix;
+    __shared__ int s_need;
+    __shared__ int n_above;
+    __shared__ int n_equal;
+    extern __shared__ int cand[];
+
+    uint32_t prefix = 0;
+    uint32_t mask = 0;
+    int need = k;
+
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        for (int i = tid; i < 256; i += blockDim.x) {
+            hist[i] = 0;
+        }
+        __syncthreads();
+
+        for (int i = tid; i < ncols; i += blockDim.x) {
+            const uint32_t key = top_k_key(x_row[i]);
+            if ((key & mask) == prefix) {
+                atomicAdd(&hist[(key >> shift) & 255], 1);
+            }
+        }
+        __syncthreads();
+
+        if (tid == 0) {
+            int b = 255;
+            for (; b > 0 && hist[b] < need; --b) {
+                need -= hist[b];
+            }
+            s_prefix = prefix | ((uint32_t) b << shift);
+            s_need = need;
+        }
+        __syncthreads();
+
+        prefix = s_prefix;
+        need = s_need;
+        mask |= 255u << shift;
+    }
+
+    // everything above the k-th key is taken, and as many equal to it as fit
+    if (tid == 0) {
+        n_above = 0;
+        n_equal = 0;
+    }
+    for (int i = tid; i < k_pad; i += blockDim.x) {
+        cand[i] = -1;
+    }
+    __syncthreads();
+
+    for (int i = tid; i < ncols; i += blockDim.x) {
+        const uint32_t key = top_k_key(x_row[i]);
+        if (key > prefix) {
+            cand[atomicAdd(&n_above, 1)] = i;
+        } else if (key == prefix) {
+            const int j = atomicAdd(&n_equal, 1);
+            if (j < need) {
+                cand[k - need + j] = i;
+            }
+        }
+    }
+    __syncthreads();
+
+    // sort by decreasing value, ties by index, padding last
+    for (int size = 2; size <= k_pad; size *= 2) {
+        for (int stride = size / 2; stride > 0; stride /= 2) {
+            for (int i = tid; i < k_pad; i += blockDim.x) {
+                const int j = i ^ stride;
+                if (j > i) {
+                    const int a = cand[i];
+                    const int b = cand[j];
+                    const bool b_first = a < 0 ? b >= 0 :
+                        b >= 0 && (x_row[b] > x_row[a] || (x_row[b] == x_row[a] && b < a));
+                    if (((i & size) == 0) == b_first) {
+                        cand[i] = b;
+                        cand[j] = a;
+                    }
+                }
+            }
+            __syncthreads();
+        }
+    }
+
+    for (int i = tid; i < k; i += blockDim.x) {
+        dst[(int64_t) row * ncols + i] = cand[i];
+    }
+}
+
+static void top_k_f32_i32_cuda(const float * x, int * dst, const int ncols, const int nrows, const int k, cudaStream_t stream) {
+    const int k_pad = next_power_of_2(k);
+
+    const dim3 block_dims(CUDA_TOP_K_BLOCK_SIZE, 1, 1);
+    const dim3 block_nums(1, nrows, 1);
+    const size_t shared_mem = k_pad * sizeof(int);
+
+    k_top_k_f32_i32<<<block_nums, block_dims, shared_mem, stream>>>(x, dst, ncols, k, k_pad);
+}
+
 static void argsort_f32_i32_cuda(const float * x, int * dst, const int ncols, const int nrows, ggml_sort_order order, cudaStream_t stream) {
     // bitonic sort requires ncols to be power of 2
     const int ncols_pad = next_power_of_2(ncols);
@@ -2547,6 +2786,15 @@ void ggml_cuda_op_argsort(ggml_backend_cuda_context & ctx, ggml_tensor * dst) {
 
     enum ggml_sort_order order = (enum ggml_sort_order) dst->op_params[0];
 
+    // ggml_top_k() only looks at the first k indices
+    const int k = dst->op_params[1];
+
+    if (ncols > 1024) {
+        GGML_ASSERT(order == GGML_SORT_ORDER_DESC && k > 0 && k <= 1024);
+        top_k_f32_i32_cuda(src0_d, (int *)dst_d, ncols, nrows, k, stream);
+        return;
+    }
+
     argsort_f32_i32_cuda(src0_d, (int *)dst_d, ncols, nrows, order, stream);
 }
 
@@ -3653,6 +3901,8 @@ to_fp16_cuda_t ggml_get_to_fp16_cuda(ggml_type type) {
                 return dequantize_block_q8_0_f16_cuda;
             }
             return dequantize_block_cuda<QK8_0, QR8_0, dequantize_q8_0>;
+        case GGML_TYPE_F8_E4M3:
+            return dequantize_block_cuda<QK_F8_E4M3, QR8_E4M3, dequantize_f8_e4m3>;
         case GGML_TYPE_Q2_K:
             return dequantize_row_q2_K_cuda;
         case GGML_TYPE_Q3_K:
@@ -3700,6 +3950,8 @@ to_fp32_cuda_t ggml_get_to_fp32_cuda(ggml_type type) {
             return dequantize_block_cuda<QK5_1, QR5_1, dequantize_q5_1>;
         case GGML_TYPE_Q8_0:
             return dequantize_block_cuda<QK8_0, QR8_0, dequantize_q8_0>;
+        case GGML_TYPE_F8_E4M3:
+            return dequantize_block_cuda<QK_F8_E4M3, QR8_E4M3, dequantize_f8_e4m3>;
         case GGML_TYPE_Q2_K:
             return dequantize_row_q2_K_cuda;
         case GGML_TYPE_Q3_K:
@@ -4190,6 +4442,34 @@ void ggml_cuda_cpy(ggml_backend_cuda_context & ctx, const ggml_tensor * src0, gg
     }
 }
 
+// returns the kernel ggml_cuda_cpy() launches, whose second argument is
+// always the destination
+void * ggml_cuda_cpy_fn(const ggml_tensor * src0, ggml_tensor * src1) {
+    if (src0->type == GGML_TYPE_F32 && src1->type == GGML_TYPE_F32) {
+        return (void *) cpy_f32_f16<cpy_1_f32_f32>;
+    } else if (src0->type == GGML_TYPE_F32 && src1->type == GGML_TYPE_F16) {
+        return (void *) cpy_f32_f16<cpy_1_f32_f16>;
+    } else if (src0->type == GGML_TYPE_F32 && src1->type == GGML_TYPE_Q8_0) {
+        return (void *) cpy_f32_q<cpy_blck_f32_q8_0, QK8_0>;
+    } else if (src0->type == GGML_TYPE_F32 && src1->type == GGML_TYPE_Q4_0) {
+        return (void *) cpy_f32_q<cpy_blck_f32_q4_0, QK4_0>;
+    } else if (src0->type == GGML_TYPE_F32 && src1->type == GGML_TYPE_Q4_1) {
+        return (void *) cpy_f32_q<cpy_blck_f32_q4_1, QK4_1>;
+    } else if (src0->type == GGML_TYPE_F32 && src1->type == GGML_TYPE_Q5_0) {
+        return (void *) cpy_f32_q<cpy_blck_f32_q5_0, QK5_0>;
+    } else if (src0->type == GGML_TYPE_F32 && src1->type == GGML_TYPE_IQ4_NL) {
+        return (void *) cpy_f32_q<cpy_blck_f32_iq4_nl, QK4_NL>;
+    } else if (src0->type == GGML_TYPE_F32 && src1->type == GGML_TYPE_Q5_1) {
+        return (void *) cpy_f32_q<cpy_blck_f32_q5_1, QK5_1>;
+    } else if (src0->type == GGML_TYPE_F16 && src1->type == GGML_TYPE_F16) {
+        return (void *) cpy_f32_f16<cpy_1_f16_f16>;
+    } else if (src0->type == GGML_TYPE_F16 && src1->type == GGML_TYPE_F32) {
+        return (void *) cpy_f32_f16<cpy_1_f16_f32>;
+    } else {
+        return nullptr;
+    }
+}
+
 void ggml_cuda_dup(ggml_backend_cuda_context & ctx, ggml_tensor * dst) {
     const ggml_tensor * src0 = dst->src[0];
     ggml_cuda_cpy(ctx, src0, dst);
@@ -4916,6 +5196,15 @@ static void dequantize_mul_mat_vec_q8_0_cuda(const void * vx, const dfloat * y,
         <<<block_nums, block_dims, 0, stream>>>(vx, y, dst, ncols, nrows);
 }
 
+static void dequantize_mul_mat_vec_f8_e4m3_cuda(const void * vx, const dfloat * y, float * dst, const int ncols, const int nrows, cudaStream_t stream) {
+    GGML_ASSERT(ncols % GGML_CUDA_DMMV_X == 0);
+    const int block_num_y = (nrows + GGML_CUDA_MMV_Y - 1) / GGML_CUDA_MMV_Y;
+    const dim3 block_nums(block_num_y, 1, 1);
+    const dim3 block_dims(WARP_SIZE, GGML_CUDA_MMV_Y, 1);
+    dequantize_mul_mat_vec<QK_F8_E4M3, QR8_E4M3, dequantize_f8_e4m3>
+        <<<block_nums, block_dims, 0, stream>>>(vx, y, dst, ncols, nrows);
+}
+
 static void dequantize_mul_mat_vec_q2_K_cuda(const void * vx, const float * y, float * dst, const int ncols, const int nrows, cudaStream_t stream) {
     GGML_ASSERT(ncols % QK_K == 0);
     const int ny = 2; // very slightly faster than 1 even when K_QUANTS_PER_ITERATION = 2
@@ -4986,7 +5275,8 @@ void ggml_cuda_op_dequantize_mul_mat_vec(
     bool src1_convert_f16 =
         src0->type == GGML_TYPE_Q4_0 || src0->type == GGML_TYPE_Q4_1 ||
         src0->type == GGML_TYPE_Q5_0 || src0->type == GGML_TYPE_Q5_1 ||
-        src0->type == GGML_TYPE_Q8_0 || src0->type == GGML_TYPE_F16;
+        src0->type == GGML_TYPE_Q8_0 || src0->type == GGML_TYPE_F8_E4M3 ||
+        src0->type == GGML_TYPE_F16;
 
     if (src1_convert_f16) {
         src1_dfloat = src1_dfloat_a.alloc(ne00);
@@ -5014,6 +5304,9 @@ void ggml_cuda_op_dequantize_mul_mat_vec(
         case GGML_TYPE_Q8_0:
             dequantize_mul_mat_vec_q8_0_cuda(src0_dd_i, src1_dfloat, dst_dd_i, ne00, row_diff, stream);
             break;
+        case GGML_TYPE_F8_E4M3:
+            dequantize_mul_mat_vec_f8_e4m3_cuda(src0_dd_i, src1_dfloat, dst_dd_i, ne00, row_diff, stream);
+            break;
         case GGML_TYPE_Q2_K:
             dequantize_mul_mat_vec_q2_K_cuda(src0_dd_i, src1_ddf_i, dst_dd_i, ne00, row_diff, stream);
             break;
@@ -5228,7 +5521,7 @@ static __global__ void flash_attn_vec_ext_f16(
 
 // D == head size, VKQ_stride == num VKQ rows calculated in parallel:
 template<int D, int ncols, int nwarps, int VKQ_stride, int parallel_blocks, typename KQ_acc_t>
-__launch_bounds__(nwarps*WARP_SIZE, 1)
+__launch_bounds__(nwarps*FATTN_WARP_SIZE, 1)
 static __global__ void flash_attn_ext_f16(
         const char * __restrict__ Q,
         const char * __restrict__ K,
@@ -5268,11 +5561,11 @@ static __global__ void flash_attn_ext_f16(
     constexpr int frag_m = ncols == 8 ? 32 : 16;
     constexpr int frag_n = ncols == 8 ?  8 : 16;
     static_assert(D % frag_m == 0, "If ncols == 8 then D % frag_m must be 0.");
-    typedef nvcuda::wmma::fragment<nvcuda::wmma::matrix_a,    frag_m, frag_n, 16, half, nvcuda::wmma::row_major> frag_a_K;
-    typedef nvcuda::wmma::fragment<nvcuda::wmma::matrix_a,    frag_m, frag_n, 16, half, nvcuda::wmma::col_major> frag_a_V;
-    typedef nvcuda::wmma::fragment<nvcuda::wmma::matrix_b,    frag_m, frag_n, 16, half, nvcuda::wmma::col_major> frag_b;
-    typedef nvcuda::wmma::fragment<nvcuda::wmma::accumulator, frag_m, frag_n, 16, KQ_acc_t>                      frag_c_KQ;
-    typedef nvcuda::wmma::fragment<nvcuda::wmma::accumulator, frag_m, frag_n, 16, half>                          frag_c_VKQ;
+    typedef wmma::fragment<wmma::matrix_a,    frag_m, frag_n, 16, half, wmma::row_major> frag_a_K;
+    typedef wmma::fragment<wmma::matrix_a,    frag_m, frag_n, 16, half, wmma::col_major> frag_a_V;
+    typedef wmma::fragment<wmma::matrix_b,    frag_m, frag_n, 16, half, wmma::col_major> frag_b;
+    typedef wmma::fragment<wmma::accumulator, frag_m, frag_n, 16, KQ_acc_t>                      frag_c_KQ;
+    typedef wmma::fragment<wmma::accumulator, frag_m, frag_n, 16, half>                          frag_c_VKQ;
 
     constexpr int KQ_stride_tc  = nwarps*frag_m; // Number of KQ rows calculated in parallel.
     constexpr int VKQ_ratio = KQ_stride_tc/VKQ_stride; // Number of parallel VKQ accumulators needed to keep all warps busy.
@@ -5326,9 +5619,9 @@ static __global__ void flash_attn_ext_f16(
     for (int j0 = 0; j0 < ncols; j0 += nwarps) {
         const int j = j0 + threadIdx.y;
 #pragma unroll
-        for (int i0 = 0; i0 < D/2; i0 += WARP_SIZE) {
+        for (int i0 = 0; i0 < D/2; i0 += FATTN_WARP_SIZE) {
             const int i = i0 + threadIdx.x;
-            if (i0 + WARP_SIZE > D/2 && i >= D/2) {
+            if (i0 + FATTN_WARP_SIZE > D/2 && i >= D/2) {
                 break;
             }
             VKQ2[j*(D_padded/2) + i] = make_half2(0.0f, 0.0f);
@@ -5340,9 +5633,9 @@ static __global__ void flash_attn_ext_f16(
     for (int j0 = 0; j0 < ncols; j0 += nwarps) {
         const int j = j0 + threadIdx.y;
 #pragma unroll
-        for (int i0 = 0; i0 < D; i0 += WARP_SIZE) {
+        for (int i0 = 0; i0 < D; i0 += FATTN_WARP_SIZE) {
             const int i = i0 + threadIdx.x;
-            if (i0 + WARP_SIZE > D && i >= D) {
+            if (i0 + FATTN_WARP_SIZE > D && i >= D) {
                 break;
             }
             KQ[j*D_padded + i] = ic0 + j < ne01 ? Q_f[j*stride_Q + i] * scale : 0.0f;
@@ -5356,7 +5649,7 @@ static __global__ void flash_attn_ext_f16(
     for (int i0 = 0; i0 < D; i0 += 16) {
 #pragma unroll
         for (int j0 = 0; j0 < ncols; j0 += frag_n) {
-            nvcuda::wmma::load_matrix_sync(Q_b[i0/16][j0/frag_n], KQ + j0*D_padded + i0, D_padded);
+            wmma::load_matrix_sync(Q_b[i0/16][j0/frag_n], KQ + j0*D_padded + i0, D_padded);
         }
     }
 
@@ -5370,20 +5663,20 @@ static __global__ void flash_attn_ext_f16(
             frag_c_KQ KQ_c[ncols/frag_n];
 #pragma unroll
             for (int j = 0; j < ncols/frag_n; ++j) {
-                nvcuda::wmma::fill_fragment(KQ_c[j], 0.0f);
+                wmma::fill_fragment(KQ_c[j], 0.0f);
             }
 #pragma unroll
             for (int k_KQ_0 = 0; k_KQ_0 < D; k_KQ_0 += 16) {
                 frag_a_K K_a;
-                nvcuda::wmma::load_matrix_sync(K_a, K_h + (k_VKQ_0 + i_KQ_0 + frag_m*threadIdx.y)*stride_KV + k_KQ_0, stride_KV);
+                wmma::load_matrix_sync(K_a, K_h + (k_VKQ_0 + i_KQ_0 + frag_m*threadIdx.y)*stride_KV + k_KQ_0, stride_KV);
 #pragma unroll
                 for (int j = 0; j < ncols/frag_n; ++j) {
-                    nvcuda::wmma::mma_sync(KQ_c[j], K_a, Q_b[k_KQ_0/16][j], KQ_c[j]);
+                    wmma::mma_sync(KQ_c[j], K_a, Q_b[k_KQ_0/16][j], KQ_c[j]);
                 }
             }
 #pragma unroll
             for (int j0 = 0; j0 < ncols; j0 += frag_n) {
-                nvcuda::wmma::store_matrix_sync((KQ_acc_t *) KQ + j0*kqs_padded + i_KQ_0 + frag_m*threadIdx.y, KQ_c[j0/frag_n], kqs_padded, nvcuda::wmma::mem_col_major);
+                wmma::store_matrix_sync((KQ_acc_t *) KQ + j0*kqs_padded + i_KQ_0 + frag_m*threadIdx.y, KQ_c[j0/frag_n], kqs_padded, wmma::mem_col_major);
             }
         }
 
@@ -5396,23 +5689,23 @@ static __global__ void flash_attn_ext_f16(
             const int j = j0 + threadIdx.y;
 
             if (std::is_same<KQ_acc_t, float>::value) {
-                float KQ_f_tmp[FATTN_KQ_STRIDE / WARP_SIZE];
+                float KQ_f_tmp[FATTN_KQ_STRIDE / FATTN_WARP_SIZE];
 #pragma unroll
-                for (int k0 = 0; k0 < FATTN_KQ_STRIDE; k0 += WARP_SIZE) {
+                for (int k0 = 0; k0 < FATTN_KQ_STRIDE; k0 += FATTN_WARP_SIZE) {
                     const int k = k0 + threadIdx.x;
 
-                    KQ_f_tmp[k0/WARP_SIZE] = KQ_f[j*kqs_padded + k];
+                    KQ_f_tmp[k0/FATTN_WARP_SIZE] = KQ_f[j*kqs_padded + k];
                 }
 
                 float KQ_max_new = KQ_max_f[j0/nwarps];
 #pragma unroll
-                for (int k0 = 0; k0 < FATTN_KQ_STRIDE; k0 += WARP_SIZE) {
+                for (int k0 = 0; k0 < FATTN_KQ_STRIDE; k0 += FATTN_WARP_SIZE) {
                     const int k = k0 + threadIdx.x;
 
-                    KQ_f_tmp[k0/WARP_SIZE] += mask ? __half2float(maskh[j*(nb31/sizeof(half)) + k_VKQ_0 + k]) : 0.0f;
-                    KQ_max_new = max(KQ_max_new, KQ_f_tmp[k0/WARP_SIZE]);
+                    KQ_f_tmp[k0/FATTN_WARP_SIZE] += mask ? __half2float(maskh[j*(nb31/sizeof(half)) + k_VKQ_0 + k]) : 0.0f;
+                    KQ_max_new = max(KQ_max_new, KQ_f_tmp[k0/FATTN_WARP_SIZE]);
                 }
-                KQ_max_new = warp_reduce_max(KQ_max_new);
+                KQ_max_new = warp_reduce_max<FATTN_WARP_SIZE>(KQ_max_new);
 
                 const float diff = KQ_max_f[j0/nwarps] - KQ_max_new;
                 KQ_max_scale_f[j0/nwarps] = expf(diff);
@@ -5423,39 +5716,39 @@ static __global__ void flash_attn_ext_f16(
 
                 float KQ_rowsum_add = 0.0f;
 #pragma unroll
-                for (int k0 = 0; k0 < FATTN_KQ_STRIDE; k0 += WARP_SIZE) {
+                for (int k0 = 0; k0 < FATTN_KQ_STRIDE; k0 += FATTN_WARP_SIZE) {
                     const int k = k0 + threadIdx.x;
 
-                    const float diff = KQ_f_tmp[k0/WARP_SIZE] - KQ_max_f[j0/nwarps];
-                    KQ_f_tmp[k0/WARP_SIZE] = expf(diff);
+                    const float diff = KQ_f_tmp[k0/FATTN_WARP_SIZE] - KQ_max_f[j0/nwarps];
+                    KQ_f_tmp[k0/FATTN_WARP_SIZE] = expf(diff);
                     if (diff <= SOFTMAX_FTZ_THRESHOLD) {
-                        KQ_f_tmp[k0/WARP_SIZE] = 0.0f;
+                        KQ_f_tmp[k0/FATTN_WARP_SIZE] = 0.0f;
                     }
-                    KQ_rowsum_add += KQ_f_tmp[k0/WARP_SIZE];
-                    KQ[j*(kqar*kqs_padded) + k] = KQ_f_tmp[k0/WARP_SIZE];
+                    KQ_rowsum_add += KQ_f_tmp[k0/FATTN_WARP_SIZE];
+                    KQ[j*(kqar*kqs_padded) + k] = KQ_f_tmp[k0/FATTN_WARP_SIZE];
                 }
-                KQ_rowsum_add = warp_reduce_sum(KQ_rowsum_add);
+                KQ_rowsum_add = warp_reduce_sum<FATTN_WARP_SIZE>(KQ_rowsum_add);
 
                 // Scale previous KQ_rowsum to account for a potential increase in KQ_max:
                 KQ_rowsum_f[j0/nwarps] = KQ_max_scale_f[j0/nwarps]*KQ_rowsum_f[j0/nwarps] + KQ_rowsum_add;
             } else {
-                half2 KQ2_tmp[FATTN_KQ_STRIDE/(2*WARP_SIZE)];
+                half2 KQ2_tmp[FATTN_KQ_STRIDE/(2*FATTN_WARP_SIZE)];
 #pragma unroll
-                for (int k0 = 0; k0 < FATTN_KQ_STRIDE/2; k0 += WARP_SIZE) {
+                for (int k0 = 0; k0 < FATTN_KQ_STRIDE/2; k0 += FATTN_WARP_SIZE) {
                     const int k = k0 + threadIdx.x;
 
-                    KQ2_tmp[k0/WARP_SIZE] = KQ2[j*(kqs_padded/2) + k];
+                    KQ2_tmp[k0/FATTN_WARP_SIZE] = KQ2[j*(kqs_padded/2) + k];
                 }
 
                 half2 KQ_max_new = KQ_max_h2[j0/nwarps];
 #pragma unroll
-                for (int k0 = 0; k0 < FATTN_KQ_STRIDE/2; k0 += WARP_SIZE) {
+                for (int k0 = 0; k0 < FATTN_KQ_STRIDE/2; k0 += FATTN_WARP_SIZE) {
                     const int k = k0 + threadIdx.x;
 
-                    KQ2_tmp[k0/WARP_SIZE] += mask ? mask2[(j*ne11 + k_VKQ_0)/2 + k] : make_half2(0.0f, 0.0f);
-                    KQ_max_new = ggml_cuda_hmax2(KQ_max_new, KQ2_tmp[k0/WARP_SIZE]);
+                    KQ2_tmp[k0/FATTN_WARP_SIZE] += mask ? mask2[(j*ne11 + k_VKQ_0)/2 + k] : make_half2(0.0f, 0.0f);
+                    KQ_max_new = ggml_cuda_hmax2(KQ_max_new, KQ2_tmp[k0/FATTN_WARP_SIZE]);
                 }
-                KQ_max_new = __half2half2(warp_reduce_max(ggml_cuda_hmax(__low2half(KQ_max_new), __high2half(KQ_max_new))));
+                KQ_max_new = __half2half2(warp_reduce_max<FATTN_WARP_SIZE>(ggml_cuda_hmax(__low2half(KQ_max_new), __high2half(KQ_max_new))));
                 const half2 diff = KQ_max_h2[j0/nwarps] - KQ_max_new;
                 KQ_max_scale_h2[j0/nwarps] = h2exp(diff);
                 const uint32_t ftz_mask = __hgt2_mask(diff, make_half2(SOFTMAX_FTZ_THRESHOLD, SOFTMAX_FTZ_THRESHOLD));
@@ -5464,17 +5757,17 @@ static __global__ void flash_attn_ext_f16(
 
                 half2 KQ_rowsum_add = make_half2(0.0f, 0.0f);
 #pragma unroll
-                for (int k0 = 0; k0 < FATTN_KQ_STRIDE/2; k0 += WARP_SIZE) {
+                for (int k0 = 0; k0 < FATTN_KQ_STRIDE/2; k0 += FATTN_WARP_SIZE) {
                     const int k = k0 + threadIdx.x;
 
-                    const half2 diff = KQ2_tmp[k0/WARP_SIZE] - KQ_max_h2[j0/nwarps];
-                    KQ2_tmp[k0/WARP_SIZE] = h2exp(diff);
+                    const half2 diff = KQ2_tmp[k0/FATTN_WARP_SIZE] - KQ_max_h2[j0/nwarps];
+                    KQ2_tmp[k0/FATTN_WARP_SIZE] = h2exp(diff);
                     const uint32_t ftz_mask = __hgt2_mask(diff, make_half2(SOFTMAX_FTZ_THRESHOLD, SOFTMAX_FTZ_THRESHOLD));
-                    *((uint32_t *) &KQ2_tmp[k0/WARP_SIZE]) &= ftz_mask;
-                    KQ_rowsum_add += KQ2_tmp[k0/WARP_SIZE];
-                    KQ2[j*(kqs_padded/2) + k] = KQ2_tmp[k0/WARP_SIZE];
+                    *((uint32_t *) &KQ2_tmp[k0/FATTN_WARP_SIZE]) &= ftz_mask;
+                    KQ_rowsum_add += KQ2_tmp[k0/FATTN_WARP_SIZE];
+                    KQ2[j*(kqs_padded/2) + k] = KQ2_tmp[k0/FATTN_WARP_SIZE];
                 }
-                KQ_rowsum_add = warp_reduce_sum(KQ_rowsum_add);
+                KQ_rowsum_add = warp_reduce_sum<FATTN_WARP_SIZE>(KQ_rowsum_add);
 
                 // Scale previous KQ_rowsum to account for a potential increase in KQ_max:
                 KQ_rowsum_h2[j0/nwarps] = KQ_max_scale_h2[j0/nwarps]*KQ_rowsum_h2[j0/nwarps] + KQ_rowsum_add;
@@ -5489,7 +5782,7 @@ static __global__ void flash_attn_ext_f16(
 #pragma unroll
             for (int k0 = 0; k0 < FATTN_KQ_STRIDE; k0 += VKQ_ratio*16) {
                 const int k = k0 + (threadIdx.y % VKQ_ratio)*16;
-                nvcuda::wmma::load_matrix_sync(
+                wmma::load_matrix_sync(
                     KQ_b[k0/(VKQ_ratio*16)][j0/frag_n],
                     KQ + j0*(kqar*kqs_padded) + k,
                     kqar*kqs_padded);
@@ -5501,7 +5794,7 @@ static __global__ void flash_attn_ext_f16(
         for (int i_VKQ_0 = 0; i_VKQ_0 < D; i_VKQ_0 += VKQ_stride) {
 #pragma unroll
             for (int j = 0; j < ncols/frag_n; ++j) {
-                nvcuda::wmma::fill_fragment(VKQ_c[i_VKQ_0/VKQ_stride][j], 0.0f);
+                wmma::fill_fragment(VKQ_c[i_VKQ_0/VKQ_stride][j], 0.0f);
             }
 
 #pragma unroll
@@ -5509,10 +5802,10 @@ static __global__ void flash_attn_ext_f16(
                 const int k = k0 + (threadIdx.y % VKQ_ratio)*16;
 
                 frag_a_V v_a;
-                nvcuda::wmma::load_matrix_sync(v_a, V_h + (k_VKQ_0 + k)*stride_KV + i_VKQ_0 + frag_m*(threadIdx.y/VKQ_ratio), stride_KV);
+                wmma::load_matrix_sync(v_a, V_h + (k_VKQ_0 + k)*stride_KV + i_VKQ_0 + frag_m*(threadIdx.y/VKQ_ratio), stride_KV);
 #pragma unroll
                 for (int j = 0; j < ncols/frag_n; ++j) {
-                    nvcuda::wmma::mma_sync(VKQ_c[i_VKQ_0/VKQ_stride][j], v_a, KQ_b[k0/(VKQ_ratio*16)][j], VKQ_c[i_VKQ_0/VKQ_stride][j]);
+                    wmma::mma_sync(VKQ_c[i_VKQ_0/VKQ_stride][j], v_a, KQ_b[k0/(VKQ_ratio*16)][j], VKQ_c[i_VKQ_0/VKQ_stride][j]);
                 }
             }
         }
@@ -5524,10 +5817,10 @@ static __global__ void flash_attn_ext_f16(
         for (int i_KQ_0 = 0; i_KQ_0 < D; i_KQ_0 += VKQ_stride) {
 #pragma unroll
             for (int j0 = 0; j0 < ncols; j0 += frag_n) {
-                nvcuda::wmma::store_matrix_sync(
+                wmma::store_matrix_sync(
                     KQ + offset_k + j0*D_padded + i_KQ_0 + frag_m*(threadIdx.y/VKQ_ratio),
                     VKQ_c[i_KQ_0/VKQ_stride][j0/frag_n],
-                    D_padded, nvcuda::wmma::mem_col_major);
+                    D_padded, wmma::mem_col_major);
             }
         }
 
@@ -5545,9 +5838,9 @@ static __global__ void flash_attn_ext_f16(
             }
 
 #pragma unroll
-            for (int i0 = 0; i0 < D/2; i0 += WARP_SIZE) {
+            for (int i0 = 0; i0 < D/2; i0 += FATTN_WARP_SIZE) {
                 const int i = i0 + threadIdx.x;
-                if (i0 + WARP_SIZE > D/2 && i >= D/2) {
+                if (i0 + FATTN_WARP_SIZE > D/2 && i >= D/2) {
                     break;
                 }
 
@@ -5579,9 +5872,9 @@ static __global__ void flash_attn_ext_f16(
         }
 
 #pragma unroll
-        for (int i0 = 0; i0 < D; i0 += WARP_SIZE) {
+        for (int i0 = 0; i0 < D; i0 += FATTN_WARP_SIZE) {
             const int i = i0 + threadIdx.x;
-            if (i0 + WARP_SIZE > D && i >= D) {
+            if (i0 + FATTN_WARP_SIZE > D && i >= D) {
                 break;
             }
             float dst_val = VKQ[j_VKQ*D_padded + i];
@@ -5730,6 +6023,36 @@ template <int D, int parallel_blocks> void launch_fattn_vec_f16(
     CUDA_CHECK(cudaGetLastError());
 }
 
+// a single token decoding a long context with few heads would occupy
+// only a few SMs with 4 blocks per head, so the kv cells are split into
+// more parts, as long as each part still gets a few strides of D cells
+template <int D> void launch_fattn_vec_f16_split(
+        const ggml_tensor * Q, const ggml_tensor * K, const ggml_tensor * V, ggml_tensor * KQV, const ggml_tensor * mask,
+        const int nsm, ggml_cuda_pool & pool, cudaStream_t main_stream
+) {
+    const int64_t n_blocks = Q->ne[1]*Q->ne[2]*Q->ne[3];
+
+    int parallel_blocks = 4;
+    while (parallel_blocks < 32 && n_blocks*parallel_blocks < 2*nsm && K->ne[1] >= 2*parallel_blocks*4*D) {
+        parallel_blocks *= 2;
+    }
+
+    switch (parallel_blocks) {
+        case 4:
+            launch_fattn_vec_f16<D,  4>(Q, K, V, KQV, mask, pool, main_stream);
+            break;
+        case 8:
+            launch_fattn_vec_f16<D,  8>(Q, K, V, KQV, mask, pool, main_stream);
+            break;
+        case 16:
+            launch_fattn_vec_f16<D, 16>(Q, K, V, KQV, mask, pool, main_stream);
+            break;
+        default:
+            launch_fattn_vec_f16<D, 32>(Q, K, V, KQV, mask, pool, main_stream);
+            break;
+    }
+}
+
 template <int D, int cols_per_block, int nwarps, int parallel_blocks, typename KQ_acc_t> void launch_fattn_f16_impl(
         const ggml_tensor * Q, const ggml_tensor * K, const ggml_tensor * V, ggml_tensor * KQV, const ggml_tensor * mask,
         ggml_cuda_pool & pool, cudaStream_t main_stream
@@ -5743,7 +6066,8 @@ template <int D, int cols_per_block, int nwarps, int parallel_blocks, typename K
     }
 
     constexpr int  frag_m = (cols_per_block) == 8 && (D) % 32 == 0 ? 32 : 16;
-    const     dim3 block_dim(WARP_SIZE, nwarps, 1);
+    const     int  warp_size = ggml_cuda_info().devices[ggml_cuda_get_device()].warp_size;
+    const     dim3 block_dim(warp_size, nwarps, 1);
     const     dim3 blocks_num(parallel_blocks*(Q->ne[1] + cols_per_block - 1) / cols_per_block, Q->ne[2], Q->ne[3]);
     const     int  shmem = 0;
 
@@ -5883,16 +6207,15 @@ void ggml_cuda_flash_attn_ext(ggml_backend_cuda_context & ctx, ggml_tensor * dst
     }
 
     if (Q->ne[1] == 1 && Q->ne[0] % (2*WARP_SIZE) == 0) {
-        constexpr int parallel_blocks = 4;
         switch (Q->ne[0]) {
             case 64:
-                launch_fattn_vec_f16< 64, parallel_blocks>(Q, K, V, KQV, mask, ctx.pool(), ctx.stream());
+                launch_fattn_vec_f16_split< 64>(Q, K, V, KQV, mask, nsm, ctx.pool(), ctx.stream());
                 break;
             case 128:
-                launch_fattn_vec_f16<128, parallel_blocks>(Q, K, V, KQV, mask, ctx.pool(), ctx.stream());
+                launch_fattn_vec_f16_split<128>(Q, K, V, KQV, mask, nsm, ctx.pool(), ctx.stream());
                 break;
             case 256:
-                launch_fattn_vec_f16<256, parallel_blocks>(Q, K, V, KQV, mask, ctx.pool(), ctx.stream());
+                launch_fattn_vec_f16_split<256>(Q, K, V, KQV, mask, nsm, ctx.pool(), ctx.stream());
                 break;
             default:
                 GGML_ASSERT(false);
@@ -5901,6 +6224,8 @@ void ggml_cuda_flash_attn_ext(ggml_backend_cuda_context & ctx, ggml_tensor * dst
         return;
     }
 
+#if !defined(GGML_USE_HIPBLAS)
+    // rocwmma has no 32x8 tiles, so amd does these with 16 columns
     if (Q->ne[1] <= 8 && Q->ne[0] % WARP_SIZE == 0) {
         constexpr int cols_per_block = 8;
         constexpr int nwarps         = 4;
@@ -5923,6 +6248,7 @@ void ggml_cuda_flash_attn_ext(ggml_backend_cuda_context & ctx, ggml_tensor * dst
         }
         return;
     }
+#endif // !defined(GGML_USE_HIPBLAS)
 
     if (Q->ne[1] <= 32) {
         constexpr int cols_per_block = 16;
@@ -6150,6 +6476,9 @@ void ggml_cuda_op_get_rows(ggml_backend_cuda_context & ctx, ggml_tensor * dst) {
         case GGML_TYPE_Q8_0:
             get_rows_cuda<QK8_0, QR8_0, dequantize_q8_0>(src0, src1, dst, src0_d, src1_i32, dst_d, stream);
             break;
+        case GGML_TYPE_F8_E4M3:
+            get_rows_cuda<QK_F8_E4M3, QR8_E4M3, dequantize_f8_e4m3>(src0, src1, dst, src0_d, src1_i32, dst_d, stream);
+            break;
         default:
             // TODO: k-quants
             fprintf(stderr, "%s: unsupported type: %s\n", __func__, ggml_type_name(src0->type));
@@ -10361,17 +10690,54 @@ static ggml_cuda_device_info ggml_cuda_init() {
 
 #if defined(GGML_USE_HIPBLAS) && defined(__HIP_PLATFORM_AMD__)
         info.devices[id].cc = 100*prop.major + 10*prop.minor + CC_OFFSET_AMD;
+        // the compute capability doesn't tell cdna from gcn, but the isa
+        // name does, which is what decided the kernels built for it
+        const char * arch = prop.gcnArchName;
+        const bool cdna = !strncmp(arch, "gfx908", 6) || !strncmp(arch, "gfx90a", 6) || !strncmp(arch, "gfx94", 5);
+        const bool rdna3 = !strncmp(arch, "gfx11", 5);
+        info.devices[id].fp16 = cdna || rdna3 || !strncmp(arch, "gfx103", 6);
+        info.devices[id].matrix_cores = cdna || rdna3;
+#if defined(GGML_HIP_ROCWMMA_FATTN)
+        info.devices[id].fp16_mma = cdna || rdna3;
+#endif // defined(GGML_HIP_ROCWMMA_FATTN)
 #else
         info.devices[id].cc = 100*prop.major + 10*prop.minor;
+        info.devices[id].fp16 = info.devices[id].cc >= CC_PASCAL;
+        info.devices[id].matrix_cores = info.devices[id].cc >= CC_VOLTA;
+        info.devices[id].fp16_mma = info.devices[id].cc >= CC_VOLTA;
 #endif // defined(GGML_USE_HIPBLAS) && defined(__HIP_PLATFORM_AMD__)
         info.devices[id].smpb = prop.sharedMemPerBlock;
         info.devices[id].nsm  = prop.multiProcessorCount;
+        info.devices[id].warp_size = prop.warpSize;
     }
 
     for (int id = 0; id < info.device_count; ++id) {
         info.default_tensor_split[id] /= total_vram;
     }
 
+    // discover how the devices are connected. pcie doesn't do atomics
+    // between peers, so devices that can are assumed to have a link of
+    // their own, like nvlink, which is fast enough it's always worth it
+    for (int id = 0; id < info.device_count; ++id) {
+        for (int id_other = 0; id_other < info.device_count; ++id_other) {
+            if (id == id_other) {
+                continue;
+            }
+            int can_access_peer = 0;
+            int native_atomics = 0;
+            CUDA_CHECK(cudaDeviceCanAccessPeer(&can_access_peer, id, id_other));
+            if (can_access_peer &&
+                cudaDeviceGetP2PAttribute(&native_atomics, cudaDevP2PAttrNativeAtomicSupported, id, id_other) != cudaSuccess) {
+                (void) cudaGetLastError();
+                native_atomics = 0;
+            }
+            info.devices[id].peer[id_other] = !!can_access_peer;
+            info.devices[id].fast_peer[id_other] = can_access_peer && native_atomics;
+            if (!FLAG_log_disable && id < id_other && can_access_peer)
+            fprintf(stderr, "  Peer access: %d <-> %d via %s\n", id, id_other, native_atomics ? "NVLink" : "PCIe");
+        }
+    }
+
     // configure logging to stdout
     // CUBLAS_CHECK(cublasLoggerConfigure(1, 1, 0, nullptr));
 
@@ -11430,6 +11796,67 @@ static cudaError_t ggml_cuda_cpy_tensor_2d(
     }
 }
 
+#ifdef GGML_USE_HIPBLASLT
+// multiplies the transpose of a by b into c, all of them fp16, with the
+// kernels hipblaslt has for the matrix cores of cdna and rdna3, which
+// beat rocblas on the big gemms of prompt processing. returns false if
+// hipblaslt has no algorithm for this shape, so rocblas can be used.
+static bool ggml_cuda_gemm_hipblaslt(
+    ggml_backend_cuda_context & ctx, int id, int64_t m, int64_t n, int64_t k,
+    const half * a, int64_t lda, const half * b, int64_t ldb, half * c, int64_t ldc,
+    cudaStream_t stream) {
+
+    const size_t workspace_size = 32*1024*1024;
+    hipblasLtHandle_t handle = ctx.hipblaslt_handle(id);
+
+    hipblasLtMatmulDesc_t desc;
+    hipblasLtMatrixLayout_t layout_a, layout_b, layout_c;
+    CUBLAS_CHECK(hipblasLtMatmulDescCreate(&desc, HIPBLAS_COMPUTE_32F, HIP_R_32F));
+    const hipblasOperation_t op_a = HIPBLAS_OP_T;
+    const hipblasOperation_t op_b = HIPBLAS_OP_N;
+    CUBLAS_CHECK(hipblasLtMatmulDescSetAttribute(desc, HIPBLASLT_MATMUL_DESC_TRANSA, &op_a, sizeof(op_a)));
+    CUBLAS_CHECK(hipblasLtMatmulDescSetAttribute(desc, HIPBLASLT_MATMUL_DESC_TRANSB, &op_b, sizeof(op_b)));
+    CUBLAS_CHECK(hipblasLtMatrixLayoutCreate(&layout_a, HIP_R_16F, k, m, lda));
+    CUBLAS_CHECK(hipblasLtMatrixLayoutCreate(&layout_b, HIP_R_16F, k, n, ldb));
+    CUBLAS_CHECK(hipblasLtMatrixLayoutCreate(&layout_c, HIP_R_16F, m, n, ldc));
+
+    // asking for the heuristic costs more than small gemms do
+    const std::array<int64_t, 4> shape = {m, n, k, ldc};
+    auto it = ctx.hipblaslt_algos[id].find(shape);
+    if (it == ctx.hipblaslt_algos[id].end()) {
+        hipblasLtMatmulPreference_t pref;
+        CUBLAS_CHECK(hipblasLtMatmulPreferenceCreate(&pref));
+        CUBLAS_CHECK(hipblasLtMatmulPreferenceSetAttribute(pref, HIPBLASLT_MATMUL_PREF_MAX_WORKSPACE_BYTES,
+                                                           &workspace_size, sizeof(workspace_size)));
+        hipblasLtMatmulHeuristicResult_t result = {};
+        int found = 0;
+        if (hipblasLtMatmulAlgoGetHeuristic(handle, desc, layout_a, layout_b, layout_c, layout_c,
+                                            pref, 1, &result, &found) != HIPBLAS_STATUS_SUCCESS || !found) {
+            result.state = HIPBLAS_STATUS_NOT_SUPPORTED;
+        }
+        CUBLAS_CHECK(hipblasLtMatmulPreferenceDestroy(pref));
+        it = ctx.hipblaslt_algos[id].emplace(shape, result).first;
+    }
+
+    bool ok = it->second.state == HIPBLAS_STATUS_SUCCESS;
+    if (ok) {
+        const float alpha = 1.0f;
+        const float beta = 0.0f;
+        ggml_cuda_pool_alloc<char> workspace(ctx.pool(id), std::max(it->second.workspaceSize, (size_t) 1));
+        ok = hipblasLtMatmul(handle, desc,
+                             &alpha, a, layout_a, b, layout_b,
+                             &beta,  c, layout_c, c, layout_c,
+                             &it->second.algo, workspace.get(), it->second.workspaceSize, stream) == HIPBLAS_STATUS_SUCCESS;
+    }
+
+    CUBLAS_CHECK(hipblasLtMatrixLayoutDestroy(layout_c));
+    CUBLAS_CHECK(hipblasLtMatrixLayoutDestroy(layout_b));
+    CUBLAS_CHECK(hipblasLtMatrixLayoutDestroy(layout_a));
+    CUBLAS_CHECK(hipblasLtMatmulDescDestroy(desc));
+    return ok;
+}
+#endif // GGML_USE_HIPBLASLT
+
 static void ggml_cuda_op_mul_mat_cublas(
     ggml_backend_cuda_context & ctx,
     const ggml_tensor * src0, const ggml_tensor * src1, ggml_tensor * dst, const char * src0_dd_i, const float * src1_ddf_i,
@@ -11457,16 +11884,6 @@ static void ggml_cuda_op_mul_mat_cublas(
 
     if (compute_capability >= CC_VOLTA && (src0->type == GGML_TYPE_F16 || ggml_is_quantized(src0->type)) && ggml_is_contiguous(src0) && row_diff == src0->ne[1] && dst->op_params[0] == GGML_PREC_DEFAULT) {
         // convert src0 and src1 to fp16, multiply as fp16, convert dst to fp32
-        ggml_cuda_pool_alloc<half> src0_as_f16(ctx.pool(id));
-        if (src0->type != GGML_TYPE_F16) {
-            const to_fp16_cuda_t to_fp16_cuda = ggml_get_to_fp16_cuda(src0->type);
-            GGML_ASSERT(to_fp16_cuda != nullptr);
-            size_t ne = row_diff*ne00;
-            src0_as_f16.alloc(ne);
-            to_fp16_cuda(src0_dd_i, src0_as_f16.get(), ne, stream);
-        }
-        const half * src0_ptr = src0->type == GGML_TYPE_F16 ? (const half *) src0_dd_i : src0_as_f16.get();
-
         ggml_cuda_pool_alloc<half> src1_as_f16(ctx.pool(id));
         if (src1->type != GGML_TYPE_F16) {
             const to_fp16_cuda_t to_fp16_cuda = ggml_get_to_fp16_cuda(src1->type);
@@ -11482,6 +11899,50 @@ static void ggml_cuda_op_mul_mat_cublas(
         const half beta_f16 = 0.0f;
 
         CUBLAS_CHECK(cublasSetStream(ctx.cublas_handle(id), stream));
+
+#ifdef GGML_USE_TINYBLAS
+        // tinyblas can dequantize these itself on gpus with tensor cores
+        if (src0->type == GGML_TYPE_Q4_0 || src0->type == GGML_TYPE_Q8_0) {
+            tinyblasStatus_t status =
+                tinyblasGemmEx(ctx.cublas_handle(id), TINYBLAS_OP_T, TINYBLAS_OP_N,
+                        row_diff, src1_ncols, ne10,
+                        &alpha_f16, src0_dd_i,     src0->type == GGML_TYPE_Q4_0 ? TINYBLAS_R_Q4_0 : TINYBLAS_R_Q8_0, ne00,
+                                    src1_ptr,      TINYBLAS_R_16F, ne10,
+                        &beta_f16,  dst_f16.get(), TINYBLAS_R_16F, ldc,
+                        TINYBLAS_COMPUTE_16F,
+                        TINYBLAS_GEMM_DEFAULT);
+            if (status == TINYBLAS_STATUS_SUCCESS) {
+                const to_fp32_cuda_t to_fp32_cuda = ggml_get_to_fp32_cuda(GGML_TYPE_F16);
+                to_fp32_cuda(dst_f16.get(), dst_dd_i, row_diff*src1_ncols, stream);
+                return;
+            }
+            if (status != TINYBLAS_STATUS_NOT_SUPPORTED) {
+                CUBLAS_CHECK(status);
+            }
+        }
+#endif
+
+        ggml_cuda_pool_alloc<half> src0_as_f16(ctx.pool(id));
+        if (src0->type != GGML_TYPE_F16) {
+            const to_fp16_cuda_t to_fp16_cuda = ggml_get_to_fp16_cuda(src0->type);
+            GGML_ASSERT(to_fp16_cuda != nullptr);
+            size_t ne = row_diff*ne00;
+            src0_as_f16.alloc(ne);
+            to_fp16_cuda(src0_dd_i, src0_as_f16.get(), ne, stream);
+        }
+        const half * src0_ptr = src0->type == GGML_TYPE_F16 ? (const half *) src0_dd_i : src0_as_f16.get();
+
+#ifdef GGML_USE_HIPBLASLT
+        // token generation is bound by memory, not by the matrix cores
+        if (src1_ncols >= 32 && ggml_cuda_info().devices[id].matrix_cores &&
+            ggml_cuda_gemm_hipblaslt(ctx, id, row_diff, src1_ncols, ne10,
+                                     src0_ptr, ne00, src1_ptr, ne10, dst_f16.get(), ldc, stream)) {
+            const to_fp32_cuda_t to_fp32_cuda = ggml_get_to_fp32_cuda(GGML_TYPE_F16);
+            to_fp32_cuda(dst_f16.get(), dst_dd_i, row_diff*src1_ncols, stream);
+            return;
+        }
+#endif // GGML_USE_HIPBLASLT
+
         CUBLAS_CHECK(
             cublasGemmEx(ctx.cublas_handle(id), CUBLAS_OP_T, CUBLAS_OP_N,
                     row_diff, src1_ncols, ne10,
@@ -11530,9 +11991,42 @@ static void ggml_cuda_op_mul_mat_cublas(
     GGML_UNUSED(src1_padded_row_size);
 }
 
+// fast links are enabled between all devices once and left that way,
+// so copies between layers on different devices never go through the
+// host, and switching between prompts and tokens costs nothing
+static void ggml_cuda_enable_fast_peer_access() {
+    static bool fast_peer_access_enabled = false;
+
+    if (fast_peer_access_enabled) {
+        return;
+    }
+    fast_peer_access_enabled = true;
+
+#ifdef NDEBUG
+    const int main_device = ggml_cuda_get_device();
+    for (int id = 0; id < ggml_backend_cuda_get_device_count(); ++id) {
+        for (int id_other = 0; id_other < ggml_backend_cuda_get_device_count(); ++id_other) {
+            if (id == id_other || !ggml_cuda_info().devices[id].fast_peer[id_other]) {
+                continue;
+            }
+            ggml_cuda_set_device(id);
+            cudaError_t err = cudaDeviceEnablePeerAccess(id_other, 0);
+            if (err != cudaErrorPeerAccessAlreadyEnabled) {
+                CUDA_CHECK(err);
+            } else {
+                (void) cudaGetLastError();
+            }
+        }
+    }
+    ggml_cuda_set_device(main_device);
+#endif // NDEBUG
+}
+
 static void ggml_cuda_set_peer_access(const int n_tokens, int main_device) {
     static bool peer_access_enabled = false;
 
+    ggml_cuda_enable_fast_peer_access();
+
     const bool enable_peer_access = n_tokens <= GGML_CUDA_PEER_MAX_BATCH_SIZE;
 
     if (peer_access_enabled == enable_peer_access) {
@@ -11540,12 +12034,24 @@ static void ggml_cuda_set_peer_access(const int n_tokens, int main_device) {
     }
 
 #ifdef NDEBUG
+    // only pcie peers are toggled, which needs the devices to be idle
+    bool any_slow_peers = false;
     for (int id = 0; id < ggml_backend_cuda_get_device_count(); ++id) {
+        for (int id_other = 0; id_other < ggml_backend_cuda_get_device_count(); ++id_other) {
+            if (id != id_other && (id == main_device || id_other == main_device) &&
+                ggml_cuda_info().devices[id].peer[id_other] &&
+                !ggml_cuda_info().devices[id].fast_peer[id_other]) {
+                any_slow_peers = true;
+            }
+        }
+    }
+
+    for (int id = 0; any_slow_peers && id < ggml_backend_cuda_get_device_count(); ++id) {
         ggml_cuda_set_device(id);
         CUDA_CHECK(cudaDeviceSynchronize());
     }
 
-    for (int id = 0; id < ggml_backend_cuda_get_device_count(); ++id) {
+    for (int id = 0; any_slow_peers && id < ggml_backend_cuda_get_device_count(); ++id) {
         ggml_cuda_set_device(id);
 
         for (int id_other = 0; id_other < ggml_backend_cuda_get_device_count(); ++id_other) {
@@ -11556,9 +12062,8 @@ static void ggml_cuda_set_peer_access(const int n_tokens, int main_device) {
                 continue;
             }
 
-            int can_access_peer;
-            CUDA_CHECK(cudaDeviceCanAccessPeer(&can_access_peer, id, id_other));
-            if (can_access_peer) {
+            if (ggml_cuda_info().devices[id].peer[id_other] &&
+                !ggml_cuda_info().devices[id].fast_peer[id_other]) {
                 if (enable_peer_access) {
                     cudaError_t err = cudaDeviceEnablePeerAccess(id_other, 0);
                     if (err != cudaErrorPeerAccessAlreadyEnabled) {
@@ -12121,7 +12626,8 @@ static void ggml_cuda_mul_mat(ggml_backend_cuda_context & ctx, const ggml_tensor
         && src1->type == GGML_TYPE_F32 && dst->type == GGML_TYPE_F32
         && src0->ne[0] % GGML_CUDA_DMMV_X == 0 && src1->ne[1] == 1;
 
-    bool          use_mul_mat_vec_q =  ggml_is_quantized(src0->type)
+    // there's no integer dot product for e4m3 weights, which go through dmmv or cublas
+    bool          use_mul_mat_vec_q =  ggml_is_quantized(src0->type) && src0->type != GGML_TYPE_F8_E4M3
         && src1->type == GGML_TYPE_F32 && dst->type == GGML_TYPE_F32
         && src1->ne[1] <= MMVQ_MAX_BATCH_SIZE;
 
@@ -12240,6 +12746,26 @@ static __global__ void k_copy_dst_from_contiguous(char * __restrict__ dst_origin
     }
 }
 
+// the matrix of src0 used for an expert, or -1 if ggml_mul_mat_id_masked left it out
+static int32_t ggml_cuda_mul_mat_id_slot(const ggml_tensor * dst, int32_t expert) {
+    const int32_t flags = dst->op_params[0];
+    if (!flags) {
+        return expert;
+    }
+    const uint32_t * mask = (const uint32_t *) dst->op_params + 1;
+    if (expert < 0 || expert >= GGML_MAX_MASKED_EXPERTS || !(mask[expert/32] >> (expert%32) & 1)) {
+        return -1;
+    }
+    if (!(flags & 2)) {
+        return expert;
+    }
+    int32_t slot = __builtin_popcount(mask[expert/32] & ((1u << (expert%32)) - 1));
+    for (int i = 0; i < expert/32; ++i) {
+        slot += __builtin_popcount(mask[i]);
+    }
+    return slot;
+}
+
 static void ggml_cuda_mul_mat_id(ggml_backend_cuda_context & ctx, ggml_tensor * dst) {
     const ggml_tensor * src0 = dst->src[0];
     const ggml_tensor * src1 = dst->src[1];
@@ -12259,6 +12785,24 @@ static void ggml_cuda_mul_mat_id(ggml_backend_cuda_context & ctx, ggml_tensor *
     CUDA_CHECK(cudaMemcpyAsync(ids_host.data(), ids_dev, ggml_nbytes(ids), cudaMemcpyDeviceToHost, stream));
     CUDA_CHECK(cudaStreamSynchronize(stream));
 
+    // the expert whose ids pick each matrix of src0, and rows for the
+    // experts a masked op left out are zero
+    std::vector<int32_t> slot_expert(n_as);
+    if (dst->op_params[0]) {
+        std::fill(slot_expert.begin(), slot_expert.end(), -1);
+        for (int32_t expert = 0; expert < GGML_MAX_MASKED_EXPERTS; expert++) {
+            const int32_t slot = ggml_cuda_mul_mat_id_slot(dst, expert);
+            if (slot >= 0 && slot < n_as) {
+                slot_expert[slot] = expert;
+            }
+        }
+        CUDA_CHECK(cudaMemsetAsync(dst->data, 0, ggml_nbytes(dst), stream));
+    } else {
+        for (int64_t i02 = 0; i02 < n_as; i02++) {
+            slot_expert[i02] = i02;
+        }
+    }
+
     ggml_tensor src0_row = *src0;
     ggml_tensor src1_row = *src1;
     ggml_tensor dst_row  = *dst;
@@ -12286,9 +12830,14 @@ static void ggml_cuda_mul_mat_id(ggml_backend_cuda_context & ctx, ggml_tensor *
     if (ne12 == 1) {
         for (int64_t iid1 = 0; iid1 < ids->ne[1]; iid1++) {
             for (int64_t id = 0; id < n_ids; id++) {
-                const int32_t i02 = *(const int32_t *) (ids_host.data() + iid1*ids->nb[1] + id*ids->nb[0]);
+                const int32_t i02 = ggml_cuda_mul_mat_id_slot(dst,
+                        *(const int32_t *) (ids_host.data() + iid1*ids->nb[1] + id*ids->nb[0]));
 
-                GGML_ASSERT(i02 >= 0 && i02 < n_as);
+                GGML_ASSERT(i02 < n_as && (i02 >= 0 || dst->op_params[0]));
+
+                if (i02 < 0) {
+                    continue;
+                }
 
                 const int64_t i11 = id % ne11;
                 const int64_t i12 = iid1;
@@ -12311,15 +12860,20 @@ static void ggml_cuda_mul_mat_id(ggml_backend_cuda_context & ctx, ggml_tensor *
         dst_row.data  =  dst_contiguous.get();
 
         for (int64_t i02 = 0; i02 < n_as; i02++) {
+            const int32_t expert = slot_expert[i02];
+            if (expert < 0) {
+                continue;
+            }
+
             int64_t num_src1_rows = 0;
 
             for (int64_t iid1 = 0; iid1 < ids->ne[1]; iid1++) {
                 for (int64_t id = 0; id < n_ids; id++) {
                     const int32_t row_id_i = *(const int32_t *) (ids_host.data() + iid1*ids->nb[1] + id*ids->nb[0]);
 
-                    GGML_ASSERT(row_id_i >= 0 && row_id_i < n_as);
+                    GGML_ASSERT(dst->op_params[0] || (row_id_i >= 0 && row_id_i < n_as));
 
-                    if (row_id_i != i02) {
+                    if (row_id_i != expert) {
                         continue;
                     }
 
@@ -12341,7 +12895,7 @@ static void ggml_cuda_mul_mat_id(ggml_backend_cuda_context & ctx, ggml_tensor *
                 k_copy_src1_to_contiguous<<<grid_dims, block_dims, 0, stream>>>(
                         src1_original, src1_contiguous.get(),
                         dev_cur_src1_row.get(), dev_row_mapping.get(),
-                        ids_dev, i02, ids->nb[1], ids->nb[0],
+                        ids_dev, expert, ids->nb[1], ids->nb[0],
                         ne11, ne10,
                         nb11, nb12);
                 CUDA_CHECK(cudaGetLastError());
@@ -12601,6 +13155,9 @@ GGML_CALL static bool ggml_backend_cuda_cpy_tensor_async(ggml_backend_t backend_
         GGML_ASSERT(cuda_ctx_dst->device == buf_ctx_dst->device);
 
         // copy on src stream
+        if (cuda_ctx_src->device != cuda_ctx_dst->device) {
+            ggml_cuda_enable_fast_peer_access();
+        }
         if (cuda_ctx_src->device == cuda_ctx_dst->device) {
             CUDA_CHECK(cudaMemcpyAsync(dst->data, src->data, ggml_nbytes(dst), cudaMemcpyDeviceToDevice, cuda_ctx_dst->stream()));
         } else {
@@ -12636,15 +13193,15 @@ GGML_CALL static void ggml_backend_cuda_synchronize(ggml_backend_t backend) {
     GGML_UNUSED(backend);
 }
 
-GGML_CALL static enum ggml_status ggml_backend_cuda_graph_compute(ggml_backend_t backend, ggml_cgraph * cgraph) {
-    ggml_backend_cuda_context * cuda_ctx = (ggml_backend_cuda_context *)backend->context;
-
-    ggml_cuda_set_device(cuda_ctx->device);
+static bool ggml_cuda_is_noop(const ggml_tensor * node) {
+    return ggml_is_empty(node) || node->op == GGML_OP_RESHAPE || node->op == GGML_OP_TRANSPOSE || node->op == GGML_OP_VIEW || node->op == GGML_OP_PERMUTE || node->op == GGML_OP_NONE;
+}
 
+static void ggml_cuda_evaluate(ggml_backend_cuda_context * cuda_ctx, ggml_cgraph * cgraph) {
     for (int i = 0; i < cgraph->n_nodes; i++) {
         ggml_tensor * node = cgraph->nodes[i];
 
-        if (ggml_is_empty(node) || node->op == GGML_OP_RESHAPE || node->op == GGML_OP_TRANSPOSE || node->op == GGML_OP_VIEW || node->op == GGML_OP_PERMUTE || node->op == GGML_OP_NONE) {
+        if (ggml_cuda_is_noop(node)) {
             continue;
         }
 
@@ -12663,6 +13220,210 @@ GGML_CALL static enum ggml_status ggml_backend_cuda_graph_compute(ggml_backend_t
         }
         GGML_ASSERT(ok);
     }
+}
+
+#ifdef USE_CUDA_GRAPH
+//
+// cuda graphs
+//
+// When a single token is decoded, most of the time goes to launching
+// a thousand or so small kernels. So once the same ggml graph is seen
+// twice in a row, its kernels are captured as a cuda graph, which gets
+// launched in one go for the tokens that follow. Between two tokens,
+// the only thing that changes is where the new keys and values go in
+// the kv cache, and those copy kernels are patched in place. Anything
+// else, like the kv cache growing by another block, or a prompt being
+// evaluated in between, is noticed by comparing the ggml nodes to the
+// ones we captured, in which case they're evaluated as usual, and then
+// captured again, into the same executable graph if it can be updated.
+//
+
+static bool ggml_cuda_graph_supported(const ggml_cgraph * cgraph) {
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        const ggml_tensor * node = cgraph->nodes[i];
+        if (node->src[0] && node->src[0]->buffer && ggml_backend_buffer_is_cuda_split(node->src[0]->buffer)) {
+            return false; // toggles peer access with cudaDeviceSynchronize()
+        }
+        if (node->op == GGML_OP_MUL_MAT_ID) {
+            return false; // reads the expert ids back to the host
+        }
+        if (node->op == GGML_OP_ADD && node->src[1] && node->src[1]->ne[1] > 1) {
+            return false; // more than one token, which is rarely repeated
+        }
+        if (node->op == GGML_OP_CPY && !ggml_cuda_cpy_fn(node->src[0], node->src[1])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// compares nodes to those of the previous call, and remembers them
+static bool ggml_cuda_graph_update_nodes(ggml_cuda_graph & g, const ggml_cgraph * cgraph) {
+    bool same = g.nodes.size() == (size_t) cgraph->n_nodes;
+    g.nodes.resize(cgraph->n_nodes);
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        const ggml_tensor * node = cgraph->nodes[i];
+        ggml_cuda_graph_node & prev = g.nodes[i];
+        ggml_cuda_graph_node next = {};
+        next.data = node->data;
+        next.op = node->op;
+        for (int j = 0; j < GGML_MAX_DIMS; j++) {
+            next.ne[j] = node->ne[j];
+            next.nb[j] = node->nb[j];
+        }
+        for (int j = 0; j < GGML_MAX_SRC; j++) {
+            next.src[j] = node->src[j] ? node->src[j]->data : nullptr;
+        }
+        if (same) {
+            // a copy into the kv cache may move, since it's patched
+            const bool moves = node->op == GGML_OP_CPY;
+            same = prev.op == next.op &&
+                   (moves || prev.data == next.data) &&
+                   !memcmp(prev.ne, next.ne, sizeof(next.ne)) &&
+                   !memcmp(prev.nb, next.nb, sizeof(next.nb));
+            for (int j = 0; same && j < GGML_MAX_SRC; j++) {
+                same = (moves && j == 1) || prev.src[j] == next.src[j];
+            }
+        }
+        prev = next;
+    }
+    return same;
+}
+
+// captures kernels of graph into executable, returning false on error
+static bool ggml_cuda_graph_capture(ggml_backend_cuda_context * cuda_ctx, ggml_cuda_graph & g, ggml_cgraph * cgraph) {
+    cudaStream_t stream = cuda_ctx->stream();
+    if (g.graph != nullptr) {
+        CUDA_CHECK(cudaGraphDestroy(g.graph));
+        g.graph = nullptr;
+    }
+    CUDA_CHECK(cudaStreamBeginCapture(stream, cudaStreamCaptureModeRelaxed));
+    ggml_cuda_evaluate(cuda_ctx, cgraph);
+    if (cudaStreamEndCapture(stream, &g.graph) != cudaSuccess) {
+        (void) cudaGetLastError();
+        g.graph = nullptr;
+        return false;
+    }
+
+    // find the kernels to patch, by the destination they were given
+    g.cpys.clear();
+    size_t n_cpy = 0;
+    std::vector<void *> cpy_fns;
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        if (cgraph->nodes[i]->op == GGML_OP_CPY && !ggml_cuda_is_noop(cgraph->nodes[i])) {
+            cpy_fns.push_back(ggml_cuda_cpy_fn(cgraph->nodes[i]->src[0], cgraph->nodes[i]->src[1]));
+            ++n_cpy;
+        }
+    }
+    size_t n_nodes = 0;
+    CUDA_CHECK(cudaGraphGetNodes(g.graph, nullptr, &n_nodes));
+    std::vector<cudaGraphNode_t> nodes(n_nodes);
+    if (n_nodes > 0) {
+        CUDA_CHECK(cudaGraphGetNodes(g.graph, nodes.data(), &n_nodes));
+    }
+    for (cudaGraphNode_t node : nodes) {
+        cudaGraphNodeType type;
+        CUDA_CHECK(cudaGraphNodeGetType(node, &type));
+        if (type != cudaGraphNodeTypeKernel) {
+            continue;
+        }
+        ggml_cuda_graph_cpy cpy = {};
+        if (cudaGraphKernelNodeGetParams(node, &cpy.params) != cudaSuccess) {
+            (void) cudaGetLastError(); // e.g. cublas kernels, which we don't patch
+            continue;
+        }
+        if (std::find(cpy_fns.begin(), cpy_fns.end(), cpy.params.func) == cpy_fns.end()) {
+            continue;
+        }
+        const void * dst = *(void **) cpy.params.kernelParams[1];
+        cpy.i_node = -1;
+        for (int i = 0; i < cgraph->n_nodes; i++) {
+            if (cgraph->nodes[i]->op == GGML_OP_CPY && cgraph->nodes[i]->src[1]->data == dst) {
+                cpy.i_node = i;
+                break;
+            }
+        }
+        if (cpy.i_node == -1) {
+            return false;
+        }
+        cpy.node = node;
+        g.cpys.push_back(cpy);
+    }
+    if (g.cpys.size() != n_cpy) {
+        return false;
+    }
+
+    if (g.instance != nullptr) {
+        cudaGraphExecUpdateResultInfo info;
+        if (cudaGraphExecUpdate(g.instance, g.graph, &info) == cudaSuccess) {
+            return true;
+        }
+        // the topology changed, so it has to be instantiated again
+        (void) cudaGetLastError();
+        CUDA_CHECK(cudaGraphExecDestroy(g.instance));
+        g.instance = nullptr;
+    }
+    CUDA_CHECK(cudaGraphInstantiate(&g.instance, g.graph, 0));
+    return true;
+}
+
+// computes graph by launching a cuda graph, returning false if it can't
+static bool ggml_cuda_graph_launch(ggml_backend_cuda_context * cuda_ctx, ggml_cgraph * cgraph) {
+    if (cuda_ctx->cuda_graph == nullptr) {
+        cuda_ctx->cuda_graph.reset(new ggml_cuda_graph());
+        // older gpus don't launch graphs any faster than kernels
+        cuda_ctx->cuda_graph->disabled = ggml_cuda_info().devices[cuda_ctx->device].cc < CC_AMPERE;
+    }
+    ggml_cuda_graph & g = *cuda_ctx->cuda_graph;
+    if (g.disabled) {
+        return false;
+    }
+    if (!ggml_cuda_graph_supported(cgraph)) {
+        g.nodes.clear();
+        g.captured = false;
+        return false;
+    }
+    if (!ggml_cuda_graph_update_nodes(g, cgraph)) {
+        g.captured = false;
+        return false; // not worth capturing until we see it again
+    }
+
+    if (!g.captured) {
+        if (!ggml_cuda_graph_capture(cuda_ctx, g, cgraph)) {
+            if (!FLAG_log_disable) {
+                fprintf(stderr, "%s: failed to capture cuda graph; launching kernels individually\n", __func__);
+            }
+            g.disabled = true;
+            return false;
+        }
+        g.captured = true;
+    } else {
+        for (ggml_cuda_graph_cpy & cpy : g.cpys) {
+            void * dst = cgraph->nodes[cpy.i_node]->src[1]->data;
+            void * old = cpy.params.kernelParams[1];
+            cpy.params.kernelParams[1] = &dst;
+            CUDA_CHECK(cudaGraphExecKernelNodeSetParams(g.instance, cpy.node, &cpy.params));
+            cpy.params.kernelParams[1] = old;
+        }
+    }
+
+    CUDA_CHECK(cudaGraphLaunch(g.instance, cuda_ctx->stream()));
+    return true;
+}
+#endif // USE_CUDA_GRAPH
+
+GGML_CALL static enum ggml_status ggml_backend_cuda_graph_compute(ggml_backend_t backend, ggml_cgraph * cgraph) {
+    ggml_backend_cuda_context * cuda_ctx = (ggml_backend_cuda_context *)backend->context;
+
+    ggml_cuda_set_device(cuda_ctx->device);
+
+#ifdef USE_CUDA_GRAPH
+    if (FLAG_cuda_graphs && ggml_cuda_graph_launch(cuda_ctx, cgraph)) {
+        return GGML_STATUS_SUCCESS;
+    }
+#endif
+
+    ggml_cuda_evaluate(cuda_ctx, cgraph);
 
     return GGML_STATUS_SUCCESS;
 }
@@ -12718,6 +13479,7 @@ GGML_CALL static bool ggml_backend_cuda_supports_op(ggml_backend_t backend, cons
                     case GGML_TYPE_Q5_0:
                     case GGML_TYPE_Q5_1:
                     case GGML_TYPE_Q8_0:
+                    case GGML_TYPE_F8_E4M3:
                         return true;
                     default:
                         return false;
@@ -12759,6 +13521,12 @@ GGML_CALL static bool ggml_backend_cuda_supports_op(ggml_backend_t backend, cons
                 }
                 return false;
             } break;
+        case GGML_OP_ARGSORT:
+            // the bitonic sort gives each row one block of threads, so
+            // large rows such as a vocab need ggml_top_k() to ask for few
+            // enough of them that a radix select can be used instead
+            return op->src[0]->ne[0] <= 1024 ||
+                   (op->op_params[0] == GGML_SORT_ORDER_DESC && op->op_params[1] > 0 && op->op_params[1] <= 1024);
         case GGML_OP_DUP:
         case GGML_OP_REPEAT:
         case GGML_OP_CONCAT:
@@ -12787,7 +13555,6 @@ GGML_CALL static bool ggml_backend_cuda_supports_op(ggml_backend_t backend, cons
         case GGML_OP_IM2COL:
         case GGML_OP_POOL_2D:
         case GGML_OP_SUM_ROWS:
-        case GGML_OP_ARGSORT:
         case GGML_OP_ACC:
         case GGML_OP_GROUP_NORM:
         case GGML_OP_UPSCALE:
@@ -12795,10 +13562,20 @@ GGML_CALL static bool ggml_backend_cuda_supports_op(ggml_backend_t backend, cons
         case GGML_OP_ARANGE:
         case GGML_OP_TIMESTEP_EMBEDDING:
         case GGML_OP_LEAKY_RELU:
+            return true;
 #ifndef GGML_MINIMIZE_CODE_SIZE // [jart]
         case GGML_OP_FLASH_ATTN_EXT:
+            {
+                // quantized kv caches are only handled by the cpu kernel
+                if (op->src[1]->type != GGML_TYPE_F16 || op->src[2]->type != GGML_TYPE_F16) {
+                    return false;
+                }
+                // batches need matrix cores, which amd only has with rocwmma
+                ggml_backend_cuda_context * cuda_ctx = (ggml_backend_cuda_context *) backend->context;
+                const auto & dev = ggml_cuda_info().devices[cuda_ctx->device];
+                return dev.fp16 && (dev.fp16_mma || (op->src[0]->ne[1] == 1 && op->src[0]->ne[0] % (2*WARP_SIZE) == 0));
+            }
 #endif
-            return true;
         default:
             return false;
     }
@@ -12929,6 +13706,60 @@ GGML_CALL void ggml_backend_cuda_get_device_description(int device, char * descr
     snprintf(description, description_size, "%s", prop.name);
 }
 
+// picks the fastest tinyblas kernels for each gpu, the first time its
+// architecture is seen, and remembers them in the file at path, which
+// holds a line with the architecture and kernel number for each
+GGML_CALL void ggml_cuda_tune(const char * path) {
+#ifdef GGML_USE_TINYBLAS
+    std::map<std::string, int> known;
+    char arch[64];
+    int config;
+    if (FILE * f = fopen(path, "r")) {
+        while (fscanf(f, "%63s %d", arch, &config) == 2) {
+            known[arch] = config;
+        }
+        fclose(f);
+    }
+    for (int id = 0; id < ggml_backend_cuda_get_device_count(); ++id) {
+        cudaDeviceProp prop;
+        CUDA_CHECK(cudaGetDeviceProperties(&prop, id));
+#ifdef GGML_USE_HIPBLAS
+        snprintf(arch, sizeof(arch), "%s", prop.gcnArchName);
+        arch[strcspn(arch, ": ")] = 0; // drop feature flags like :xnack-
+#else
+        snprintf(arch, sizeof(arch), "sm_%d%d", prop.major, prop.minor);
+#endif
+        auto it = known.find(arch);
+        if (it == known.end()) {
+            tinyblasHandle_t handle;
+            double gflops;
+            ggml_cuda_set_device(id);
+            if (tinyblasCreate(&handle) != TINYBLAS_STATUS_SUCCESS) {
+                continue;
+            }
+            const tinyblasStatus_t status = tinyblasTune(handle, &config, &gflops);
+            tinyblasDestroy(handle);
+            if (status != TINYBLAS_STATUS_SUCCESS) {
+                continue;
+            }
+            if (!FLAG_log_disable) {
+                fprintf(stderr, "%s: tinyBLAS kernel %d is fastest on %s at %.0f GFLOPS\n", __func__, config, arch, gflops);
+            }
+            if (FILE * f = fopen(path, "a")) {
+                char line[80]; // fprintf() is the bridge to the log
+                snprintf(line, sizeof(line), "%s %d\n", arch, config);
+                fputs(line, f);
+                fclose(f);
+            }
+            it = known.emplace(arch, config).first;
+        }
+        g_tinyblas_config[id] = it->second;
+    }
+#else
+    GGML_UNUSED(path);
+#endif
+}
+
 GGML_CALL void ggml_backend_cuda_get_device_memory(int device, size_t * free, size_t * total) {
     ggml_cuda_set_device(device);
 
@@ -12936,10 +13767,6 @@ GGML_CALL void ggml_backend_cuda_get_device_memory(int device, size_t * free, si
 }
 
 GGML_CALL bool ggml_backend_cuda_register_host_buffer(void * buffer, size_t size) {
-    if (getenv("GGML_CUDA_REGISTER_HOST") == nullptr) {
-        return false;
-    }
-
 #if CUDART_VERSION >= 11100
     cudaError_t err = cudaHostRegister(buffer, size, cudaHostRegisterPortable | cudaHostRegisterReadOnly);
     if (err != cudaSuccess) {
@@ -12957,10 +13784,6 @@ GGML_CALL bool ggml_backend_cuda_register_host_buffer(void * buffer, size_t size
 }
 
 GGML_CALL void ggml_backend_cuda_unregister_host_buffer(void * buffer) {
-    if (getenv("GGML_CUDA_REGISTER_HOST") == nullptr) {
-        return;
-    }
-
     cudaError_t err = cudaHostUnregister(buffer);
     if (err != cudaSuccess) {
         // clear the error
@@ -96,6 +96,68 @@ static inline ggml_bf16_t ggml_compute_fp32_to_bf16(float s) {
 #define GGML_FP32_TO_BF16(x) ggml_compute_fp32_to_bf16(x)
 #define GGML_BF16_TO_FP32(x) ggml_compute_bf16_to_fp32(x)
 
+/**
+ * Converts 8-bit e4m3 float to float32.
+ *
+ *       ┌sign
+ *       │
+ *       │┌exponent
+ *       ││
+ *       ││   ┌mantissa
+ *       ││   │
+ *       │┌┴─┐┌┴┐
+ *     0b00000000 e4m3
+ *
+ * The exponent bias is 7. There are no infinities, and the largest
+ * finite value is 448. The all-ones encoding is nan, which the code
+ * below doesn't bother with since quantization never produces it.
+ *
+ * @see OCP 8-bit Floating Point Specification (OFP8)
+ */
+static inline float ggml_compute_fp8_e4m3_to_fp32(uint8_t h) {
+    union {
+        float f;
+        uint32_t i;
+    } u;
+    if (h & 0x78) {
+        u.i = (((uint32_t)(h & 0x7f) << 20) + (120 << 23)) | ((uint32_t)(h & 0x80) << 24);
+    } else {
+        u.f = (h & 7) * (1.f / 512); /* subnormal */
+        u.i |= (uint32_t)(h & 0x80) << 24;
+    }
+    return u.f;
+}
+
+/**
+ * Converts float32 to 8-bit e4m3 float.
+ *
+ * Rounds to nearest even. Values too large for e4m3 saturate to 448,
+ * and nans become zero.
+ */
+static inline uint8_t ggml_compute_fp32_to_fp8_e4m3(float s) {
+    union {
+        float f;
+        uint32_t i;
+    } u;
+    u.f = s;
+    const uint8_t sign = (u.i >> 24) & 0x80;
+    u.i &= 0x7fffffff;
+    if (u.i > 0x7f800000) { /* nan */
+        return 0;
+    }
+    if (u.f >= 448.f) {
+        return sign | 0x7e;
+    }
+    if (u.f < 1.f / 64) { /* subnormal */
+        return sign | (uint8_t)nearbyintf(u.f * 512);
+    }
+    u.i += 0x7ffff + ((u.i >> 20) & 1);
+    return sign | (uint8_t)((u.i >> 20) - (120 << 3));
+}
+
+#define GGML_FP32_TO_FP8_E4M3(x) ggml_compute_fp32_to_fp8_e4m3(x)
+#define GGML_FP8_E4M3_TO_FP32(x) ggml_compute_fp8_e4m3_to_fp32(x)
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -597,6 +659,27 @@ size_t ggml_hash_insert        (      struct ggml_hash_set hash_set, struct ggml
 // return index, asserts if table is full
 size_t ggml_hash_find_or_insert(      struct ggml_hash_set hash_set, struct ggml_tensor * key);
 
+// the matrix of src0 that a GGML_OP_MUL_MAT_ID multiplies by for an expert,
+// or -1 when ggml_mul_mat_id_masked() left that expert out
+static inline int32_t ggml_mul_mat_id_slot(const struct ggml_tensor * dst, int32_t expert) {
+    const int32_t flags = dst->op_params[0];
+    if (!flags) {
+        return expert;
+    }
+    const uint32_t * mask = (const uint32_t *) dst->op_params + 1;
+    if (expert < 0 || expert >= GGML_MAX_MASKED_EXPERTS || !(mask[expert/32] >> (expert%32) & 1)) {
+        return -1;
+    }
+    if (!(flags & 2)) {
+        return expert;
+    }
+    int32_t slot = __builtin_popcount(mask[expert/32] & ((1u << (expert%32)) - 1));
+    for (int i = 0; i < expert/32; ++i) {
+        slot += __builtin_popcount(mask[i]);
+    }
+    return slot;
+}
+
 #ifdef __cplusplus
 }
 #endif
@@ -62,6 +62,9 @@ GGML_API bool ggml_backend_metal_supports_family(ggml_backend_t backend, int fam
 // capture all command buffers committed the next time `ggml_backend_graph_compute` is called
 GGML_API void ggml_backend_metal_capture_next_compute(ggml_backend_t backend);
 
+// memory the device is willing to give us, as far as the driver knows
+GGML_API void ggml_backend_metal_get_device_memory(size_t * free, size_t * total);
+
 #ifdef __cplusplus
 }
 #endif
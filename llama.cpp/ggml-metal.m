@@ -214,7 +214,20 @@ enum ggml_metal_kernel_type {
     GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_F16_H128,
     GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_F16_H256,
     GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_VEC_F16_H128,
+    GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_Q8_0_H64,
+    GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_Q8_0_H96,
+    GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_Q8_0_H128,
+    GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_Q8_0_H256,
+    GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_Q4_0_H64,
+    GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_Q4_0_H96,
+    GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_Q4_0_H128,
+    GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_Q4_0_H256,
     GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_VEC_F16_H256,
+    GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_VEC_Q8_0_H128,
+    GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_VEC_Q8_0_H256,
+    GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_VEC_Q4_0_H128,
+    GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_VEC_Q4_0_H256,
+    GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_VEC_REDUCE,
     GGML_METAL_KERNEL_TYPE_CPY_F32_F16,
     GGML_METAL_KERNEL_TYPE_CPY_F32_F32,
     GGML_METAL_KERNEL_TYPE_CPY_F32_Q8_0,
@@ -246,8 +259,66 @@ struct ggml_metal_context {
     bool support_simdgroup_mm;
 
     bool should_capture_next_compute;
+    bool concurrent;
 };
 
+// when decoding, flash attention may split the kv cache into as many as
+// this many parts, whose partial results are kept after the output
+#define GGML_METAL_FA_MAX_SPLITS 32
+
+// returns how many bytes a node needs past the end of its data
+static size_t ggml_metal_extra_size(const struct ggml_tensor * t) {
+    if (t->op == GGML_OP_FLASH_ATTN_EXT && t->src[0]->ne[1] < 4 && t->src[0]->ne[0] % 128 == 0) {
+        return ggml_nrows(t)*GGML_METAL_FA_MAX_SPLITS*(t->ne[0] + 2)*sizeof(float);
+    }
+    return 0;
+}
+
+// memory read and written by the nodes encoded since the last barrier
+//
+// with MTLDispatchTypeConcurrent, dispatches in the same encoder may
+// overlap, so a barrier is only needed once a node touches memory that
+// an earlier one is still using. host addresses are compared instead of
+// buffers, since views of the same allocation are separate buffers
+//
+#define GGML_METAL_MAX_RANGES 256
+
+struct ggml_metal_mem_range {
+    const char * p0;
+    const char * p1;
+    bool write;
+};
+
+struct ggml_metal_mem_ranges {
+    int n;
+    struct ggml_metal_mem_range r[GGML_METAL_MAX_RANGES];
+};
+
+static bool ggml_metal_mem_conflict(const struct ggml_metal_mem_ranges * mr, const struct ggml_tensor * t, bool write) {
+    if (!t || !t->data) {
+        return false;
+    }
+    const char * p0 = (const char *) t->data;
+    const char * p1 = p0 + ggml_nbytes(t) + ggml_metal_extra_size(t);
+    for (int i = 0; i < mr->n; ++i) {
+        if ((write || mr->r[i].write) && p0 < mr->r[i].p1 && mr->r[i].p0 < p1) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void ggml_metal_mem_add(struct ggml_metal_mem_ranges * mr, const struct ggml_tensor * t, bool write) {
+    if (!t || !t->data) {
+        return;
+    }
+    GGML_ASSERT(mr->n < GGML_METAL_MAX_RANGES);
+    mr->r[mr->n].p0 = (const char *) t->data;
+    mr->r[mr->n].p1 = (const char *) t->data + ggml_nbytes(t) + ggml_metal_extra_size(t);
+    mr->r[mr->n].write = write;
+    mr->n++;
+}
+
 // MSL code
 // TODO: move the contents here when ready
 //       for now it is easier to work in a separate file
@@ -462,6 +533,11 @@ static struct ggml_metal_context * ggml_metal_init(int n_cb) {
 
     ctx->should_capture_next_compute = false;
 
+    // let independent nodes run at the same time, unless debugging
+    ctx->concurrent = getenv("GGML_METAL_NO_CONCURRENCY") == NULL;
+
+    GGML_METAL_LOG_INFO("%s: concurrent dispatch           = %s\n",       __func__, ctx->concurrent ? "true" : "false");
+
 #if TARGET_OS_OSX || (TARGET_OS_IOS && __clang_major__ >= 15)
     if (@available(macOS 10.12, iOS 16.0, *)) {
         GGML_METAL_LOG_INFO("%s: recommendedMaxWorkingSetSize  = %8.2f MB\n", __func__, ctx->device.recommendedMaxWorkingSetSize / 1e6);
@@ -661,7 +737,20 @@ static struct ggml_metal_context * ggml_metal_init(int n_cb) {
         GGML_METAL_ADD_KERNEL(GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_F16_H128,       flash_attn_ext_f16_h128,        true);
         GGML_METAL_ADD_KERNEL(GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_F16_H256,       flash_attn_ext_f16_h256,        true);
         GGML_METAL_ADD_KERNEL(GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_VEC_F16_H128,   flash_attn_ext_vec_f16_h128,    true);
+        GGML_METAL_ADD_KERNEL(GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_Q8_0_H64,       flash_attn_ext_q8_0_h64,        true);
+        GGML_METAL_ADD_KERNEL(GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_Q8_0_H96,       flash_attn_ext_q8_0_h96,        true);
+        GGML_METAL_ADD_KERNEL(GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_Q8_0_H128,      flash_attn_ext_q8_0_h128,       true);
+        GGML_METAL_ADD_KERNEL(GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_Q8_0_H256,      flash_attn_ext_q8_0_h256,       true);
+        GGML_METAL_ADD_KERNEL(GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_Q4_0_H64,       flash_attn_ext_q4_0_h64,        true);
+        GGML_METAL_ADD_KERNEL(GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_Q4_0_H96,       flash_attn_ext_q4_0_h96,        true);
+        GGML_METAL_ADD_KERNEL(GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_Q4_0_H128,      flash_attn_ext_q4_0_h128,       true);
+        GGML_METAL_ADD_KERNEL(GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_Q4_0_H256,      flash_attn_ext_q4_0_h256,       true);
         GGML_METAL_ADD_KERNEL(GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_VEC_F16_H256,   flash_attn_ext_vec_f16_h256,    true);
+        GGML_METAL_ADD_KERNEL(GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_VEC_Q8_0_H128,  flash_attn_ext_vec_q8_0_h128,   true);
+        GGML_METAL_ADD_KERNEL(GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_VEC_Q8_0_H256,  flash_attn_ext_vec_q8_0_h256,   true);
+        GGML_METAL_ADD_KERNEL(GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_VEC_Q4_0_H128,  flash_attn_ext_vec_q4_0_h128,   true);
+        GGML_METAL_ADD_KERNEL(GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_VEC_Q4_0_H256,  flash_attn_ext_vec_q4_0_h256,   true);
+        GGML_METAL_ADD_KERNEL(GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_VEC_REDUCE,     flash_attn_ext_vec_reduce,      true);
         GGML_METAL_ADD_KERNEL(GGML_METAL_KERNEL_TYPE_CPY_F32_F16,                   cpy_f32_f16,                    true);
         GGML_METAL_ADD_KERNEL(GGML_METAL_KERNEL_TYPE_CPY_F32_F32,                   cpy_f32_f32,                    true);
         GGML_METAL_ADD_KERNEL(GGML_METAL_KERNEL_TYPE_CPY_F32_Q8_0,                  cpy_f32_q8_0,                   true);
@@ -787,16 +876,35 @@ static bool ggml_metal_supports_op(const struct ggml_metal_context * ctx, const
         case GGML_OP_POOL_1D:
         case GGML_OP_POOL_2D:
             return false;
+        case GGML_OP_ARGSORT:
+            // the bitonic sort keeps one row in threadgroup memory
+            return op->src[0]->ne[0] <= 1024;
         case GGML_OP_UPSCALE:
         case GGML_OP_PAD:
         case GGML_OP_ARANGE:
         case GGML_OP_TIMESTEP_EMBEDDING:
-        case GGML_OP_ARGSORT:
         case GGML_OP_LEAKY_RELU:
-        case GGML_OP_FLASH_ATTN_EXT:
             return true;
-        case GGML_OP_MUL_MAT:
+        case GGML_OP_FLASH_ATTN_EXT:
+            // K and V are read by the same kernel, so they must share a type
+            if (op->src[1]->type != op->src[2]->type) {
+                return false;
+            }
+            switch (op->src[1]->type) {
+                case GGML_TYPE_F16:
+                    return true;
+                case GGML_TYPE_Q8_0:
+                case GGML_TYPE_Q4_0:
+                    return op->src[0]->ne[0] % 32 == 0;
+                default:
+                    return false;
+            }
         case GGML_OP_MUL_MAT_ID:
+            if (op->op_params[0]) {
+                return false; // ggml_mul_mat_id_masked
+            }
+            // fall through
+        case GGML_OP_MUL_MAT:
             return ctx->support_simdgroup_reduction &&
                 (op->src[0]->type != GGML_TYPE_F32 || op->src[1]->type == GGML_TYPE_F32);
         case GGML_OP_CPY:
@@ -846,7 +954,9 @@ static enum ggml_status ggml_metal_graph_compute(
 
     @autoreleasepool {
     MTLComputePassDescriptor * edesc = MTLComputePassDescriptor.computePassDescriptor;
-    edesc.dispatchType = MTLDispatchTypeSerial;
+    edesc.dispatchType = ctx->concurrent ? MTLDispatchTypeConcurrent : MTLDispatchTypeSerial;
+
+    const bool concurrent = ctx->concurrent;
 
     // create multiple command buffers and enqueue them
     // then, we encode the graph into the command buffers in parallel
@@ -894,12 +1004,9 @@ static enum ggml_status ggml_metal_graph_compute(
         const int node_start =                                      (cb_idx + 0) * n_nodes_per_cb;
         const int node_end   = MIN((cb_idx == n_cb - 1) ? n_nodes : (cb_idx + 1) * n_nodes_per_cb, n_nodes);
 
-        for (int i = node_start; i < node_end; ++i) {
-            if (i == -1) {
-                [encoder memoryBarrierWithScope:MTLBarrierScopeBuffers];
-                continue;
-            }
+        struct ggml_metal_mem_ranges * mem = concurrent ? calloc(1, sizeof(struct ggml_metal_mem_ranges)) : NULL;
 
+        for (int i = node_start; i < node_end; ++i) {
             //GGML_METAL_LOG_INFO("%s: encoding node %3d, op = %8s\n", __func__, i, ggml_op_name(gf->nodes[i]->op));
 
             struct ggml_tensor * src0 = gf->nodes[i]->src[0];
@@ -930,6 +1037,23 @@ static enum ggml_status ggml_metal_graph_compute(
                 GGML_ASSERT(!"unsupported op");
             }
 
+            if (mem) {
+                // wait for earlier nodes if this one reads what they write
+                // or writes what they read or write
+                bool hazard = ggml_metal_mem_conflict(mem, dst, true);
+                for (int j = 0; j < GGML_MAX_SRC && !hazard; ++j) {
+                    hazard = ggml_metal_mem_conflict(mem, dst->src[j], false);
+                }
+                if (hazard || mem->n + GGML_MAX_SRC + 1 > GGML_METAL_MAX_RANGES) {
+                    [encoder memoryBarrierWithScope:MTLBarrierScopeBuffers];
+                    mem->n = 0;
+                }
+                for (int j = 0; j < GGML_MAX_SRC; ++j) {
+                    ggml_metal_mem_add(mem, dst->src[j], false);
+                }
+                ggml_metal_mem_add(mem, dst, true);
+            }
+
             if (should_capture) {
                 [encoder pushDebugGroup:[NSString stringWithCString:ggml_op_desc(dst) encoding:NSUTF8StringEncoding]];
             }
@@ -1151,6 +1275,11 @@ static enum ggml_status ggml_metal_graph_compute(
                             const int nth = MIN((int) pipeline.maxTotalThreadsPerThreadgroup, ne00);
 
                             [encoder dispatchThreadgroups:MTLSizeMake(ne01, ne02, ne03) threadsPerThreadgroup:MTLSizeMake(nth, 1, 1)];
+
+                            // the add below reads the copy
+                            if (concurrent) {
+                                [encoder memoryBarrierWithScope:MTLBarrierScopeBuffers];
+                            }
                         }
 
                         const id<MTLComputePipelineState> pipeline = ctx->kernels[GGML_METAL_KERNEL_TYPE_ADD].pipeline;
@@ -2597,6 +2726,11 @@ static enum ggml_status ggml_metal_graph_compute(
 
                         const enum ggml_type src2t = src2 ? src2->type : GGML_TYPE_COUNT; GGML_UNUSED(src2t);
 
+                        GGML_ASSERT(src1->type == src2t);
+
+                        // quantized K and V are dequantized into threadgroup memory
+                        const bool is_q = src1->type != GGML_TYPE_F16;
+
                         float scale;
                         memcpy(&scale, dst->op_params, sizeof(float));
 
@@ -2604,36 +2738,68 @@ static enum ggml_status ggml_metal_graph_compute(
 
                         bool use_vec_kernel = false;
 
+                        enum ggml_metal_kernel_type kernel_type = GGML_METAL_KERNEL_TYPE_COUNT;
+
                         if (ne01 >= 4 || (ne00%128 != 0)) {
-                            switch (ne00) {
-                                case 64:  pipeline = ctx->kernels[GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_F16_H64 ].pipeline; break;
-                                case 80:  pipeline = ctx->kernels[GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_F16_H80 ].pipeline; break;
-                                case 96:  pipeline = ctx->kernels[GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_F16_H96 ].pipeline; break;
-                                case 112: pipeline = ctx->kernels[GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_F16_H112].pipeline; break;
-                                case 128: pipeline = ctx->kernels[GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_F16_H128].pipeline; break;
-                                case 256: pipeline = ctx->kernels[GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_F16_H256].pipeline; break;
+                            switch (src1->type) {
+                                case GGML_TYPE_F16:
+                                    switch (ne00) {
+                                        case 64:  kernel_type = GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_F16_H64;  break;
+                                        case 80:  kernel_type = GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_F16_H80;  break;
+                                        case 96:  kernel_type = GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_F16_H96;  break;
+                                        case 112: kernel_type = GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_F16_H112; break;
+                                        case 128: kernel_type = GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_F16_H128; break;
+                                        case 256: kernel_type = GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_F16_H256; break;
+                                    } break;
+                                case GGML_TYPE_Q8_0:
+                                    switch (ne00) {
+                                        case 64:  kernel_type = GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_Q8_0_H64;  break;
+                                        case 96:  kernel_type = GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_Q8_0_H96;  break;
+                                        case 128: kernel_type = GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_Q8_0_H128; break;
+                                        case 256: kernel_type = GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_Q8_0_H256; break;
+                                    } break;
+                                case GGML_TYPE_Q4_0:
+                                    switch (ne00) {
+                                        case 64:  kernel_type = GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_Q4_0_H64;  break;
+                                        case 96:  kernel_type = GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_Q4_0_H96;  break;
+                                        case 128: kernel_type = GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_Q4_0_H128; break;
+                                        case 256: kernel_type = GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_Q4_0_H256; break;
+                                    } break;
                                 default:
-                                          {
-                                              GGML_METAL_LOG_ERROR("unsupported size: %lld\n", ne00);
-                                              GGML_METAL_LOG_ERROR("add template specialization for this size\n");
-                                              GGML_ASSERT(false && "add template specialization for this size");
-                                          }
+                                    break;
                             }
                         } else {
                             use_vec_kernel = true;
 
-                            switch (ne00) {
-                                case 128: pipeline = ctx->kernels[GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_VEC_F16_H128].pipeline; break;
-                                case 256: pipeline = ctx->kernels[GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_VEC_F16_H256].pipeline; break;
+                            switch (src1->type) {
+                                case GGML_TYPE_F16:
+                                    switch (ne00) {
+                                        case 128: kernel_type = GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_VEC_F16_H128;  break;
+                                        case 256: kernel_type = GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_VEC_F16_H256;  break;
+                                    } break;
+                                case GGML_TYPE_Q8_0:
+                                    switch (ne00) {
+                                        case 128: kernel_type = GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_VEC_Q8_0_H128; break;
+                                        case 256: kernel_type = GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_VEC_Q8_0_H256; break;
+                                    } break;
+                                case GGML_TYPE_Q4_0:
+                                    switch (ne00) {
+                                        case 128: kernel_type = GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_VEC_Q4_0_H128; break;
+                                        case 256: kernel_type = GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_VEC_Q4_0_H256; break;
+                                    } break;
                                 default:
-                                          {
-                                              GGML_METAL_LOG_ERROR("unsupported size: %lld\n", ne00);
-                                              GGML_METAL_LOG_ERROR("add template specialization for this size\n");
-                                              GGML_ASSERT(false && "add template specialization for this size");
-                                          }
+                                    break;
                             }
                         }
 
+                        if (kernel_type == GGML_METAL_KERNEL_TYPE_COUNT) {
+                            GGML_METAL_LOG_ERROR("unsupported size: %lld (%s)\n", ne00, ggml_type_name(src1->type));
+                            GGML_METAL_LOG_ERROR("add template specialization for this size\n");
+                            GGML_ASSERT(false && "add template specialization for this size");
+                        }
+
+                        pipeline = ctx->kernels[kernel_type].pipeline;
+
                         [encoder setComputePipelineState:pipeline];
                         [encoder setBuffer:id_src0 offset:offs_src0        atIndex:0];
                         [encoder setBuffer:id_src1 offset:offs_src1        atIndex:1];
@@ -2676,7 +2842,7 @@ static enum ggml_status ggml_metal_graph_compute(
                             int64_t nsgmax = 2;
 
                             while (true) {
-                                const size_t smem = nqptg*(ne00 + 2*nsgmax*(ncpsg + nqptg))*(sizeof(float)/2);
+                                const size_t smem = (nqptg*(ne00 + 2*nsgmax*(ncpsg + nqptg)) + (is_q ? nsgmax*8*ne00 : 0))*(sizeof(float)/2);
                                 if (smem > ctx->device.maxThreadgroupMemoryLength) {
                                     break;
                                 }
@@ -2687,7 +2853,8 @@ static enum ggml_status ggml_metal_graph_compute(
                             // simdgroups per threadgroup (a.k.a. warps)
                             const int64_t nsg = ne01 <= nqptg ? MAX(4, MIN(nsgmax, MIN(ne11/ncpsg, (int64_t) pipeline.maxTotalThreadsPerThreadgroup/32))) : 4;
 
-                            const size_t smem = nqptg*(ne00 + 2*nsg*(ncpsg + nqptg))*(sizeof(float)/2);
+                            // each simdgroup dequantizes 8 rows of K or V at a time
+                            const size_t smem = (nqptg*(ne00 + 2*nsg*(ncpsg + nqptg)) + (is_q ? nsg*8*ne00 : 0))*(sizeof(float)/2);
 
                             //printf("smem: %zu, max: %zu\n", smem, ctx->device.maxThreadgroupMemoryLength);
                             GGML_ASSERT(smem <= ctx->device.maxThreadgroupMemoryLength);
@@ -2715,11 +2882,40 @@ static enum ggml_status ggml_metal_graph_compute(
 
                             const size_t smem = (nqptg*(ne00 + 2*nsg*(ncpsg + nqptg)) + nsg*ne00)*(sizeof(float)/2);
 
+                            // with few heads and a long kv cache, split the cache
+                            // across threadgroups until there's enough of them to
+                            // fill the gpu, as long as each part has a few blocks
+                            const int64_t ntg = ((ne01 + nqptg - 1)/nqptg)*ne02*ne03;
+
+                            int32_t nwg = 1;
+                            while (2*nwg <= GGML_METAL_FA_MAX_SPLITS && ntg*nwg < 256 && ne11 >= 2*nwg*4*ncpsg*nsg) {
+                                nwg *= 2;
+                            }
+
+                            [encoder setBytes:&nwg length:sizeof(int32_t) atIndex:28];
+
                             //printf("smem: %zu, max: %zu\n", smem, ctx->device.maxThreadgroupMemoryLength);
                             GGML_ASSERT(smem <= ctx->device.maxThreadgroupMemoryLength);
                             [encoder setThreadgroupMemoryLength:GGML_PAD(smem, 16) atIndex:0];
 
-                            [encoder dispatchThreadgroups:MTLSizeMake((ne01 + nqptg - 1)/nqptg, ne02, ne03) threadsPerThreadgroup:MTLSizeMake(32, nsg, 1)];
+                            [encoder dispatchThreadgroups:MTLSizeMake(((ne01 + nqptg - 1)/nqptg)*nwg, ne02, ne03) threadsPerThreadgroup:MTLSizeMake(32, nsg, 1)];
+
+                            if (nwg > 1) {
+                                // the reduction reads the partial results
+                                if (concurrent) {
+                                    [encoder memoryBarrierWithScope:MTLBarrierScopeBuffers];
+                                }
+
+                                const int64_t nrows = ne1*ne2*ne3;
+
+                                [encoder setComputePipelineState:ctx->kernels[GGML_METAL_KERNEL_TYPE_FLASH_ATTN_EXT_VEC_REDUCE].pipeline];
+                                [encoder setBuffer:id_dst  offset:offs_dst         atIndex:0];
+                                [encoder setBytes:&ne0     length:sizeof( int64_t) atIndex:1];
+                                [encoder setBytes:&nrows   length:sizeof( int64_t) atIndex:2];
+                                [encoder setBytes:&nwg     length:sizeof( int32_t) atIndex:3];
+
+                                [encoder dispatchThreadgroups:MTLSizeMake(nrows, 1, 1) threadsPerThreadgroup:MTLSizeMake(32, 1, 1)];
+                            }
                         }
                     } break;
                 case GGML_OP_DUP:
@@ -2796,6 +2992,8 @@ static enum ggml_status ggml_metal_graph_compute(
 
         [encoder endEncoding];
 
+        free(mem);
+
         [command_buffer commit];
     });
 
@@ -3008,6 +3206,12 @@ GGML_CALL static size_t ggml_backend_metal_buffer_type_get_max_size(ggml_backend
     UNUSED(buft);
 }
 
+GGML_CALL static size_t ggml_backend_metal_buffer_type_get_alloc_size(ggml_backend_buffer_type_t buft, const struct ggml_tensor * tensor) {
+    return ggml_nbytes(tensor) + ggml_metal_extra_size(tensor);
+
+    UNUSED(buft);
+}
+
 GGML_CALL static bool ggml_backend_metal_buffer_type_supports_backend(ggml_backend_buffer_type_t buft, ggml_backend_t backend) {
     return ggml_backend_is_metal(backend) || ggml_backend_is_cpu(backend);
 
@@ -3027,7 +3231,7 @@ GGML_CALL ggml_backend_buffer_type_t ggml_backend_metal_buffer_type(void) {
             /* .alloc_buffer     = */ ggml_backend_metal_buffer_type_alloc_buffer,
             /* .get_alignment    = */ ggml_backend_metal_buffer_type_get_alignment,
             /* .get_max_size     = */ ggml_backend_metal_buffer_type_get_max_size,
-            /* .get_alloc_size   = */ NULL, // defaults to ggml_nbytes
+            /* .get_alloc_size   = */ ggml_backend_metal_buffer_type_get_alloc_size,
             /* .supports_backend = */ ggml_backend_metal_buffer_type_supports_backend,
             /* .is_host          = */ ggml_backend_metal_buffer_type_is_host,
         },
@@ -3219,6 +3423,15 @@ void ggml_backend_metal_capture_next_compute(ggml_backend_t backend) {
     ctx->should_capture_next_compute = true;
 }
 
+void ggml_backend_metal_get_device_memory(size_t * free, size_t * total) {
+    id<MTLDevice> device = ggml_backend_metal_get_device();
+
+    *total = device.recommendedMaxWorkingSetSize;
+    *free  = *total - MIN(*total, (size_t) device.currentAllocatedSize);
+
+    ggml_backend_metal_free_device();
+}
+
 GGML_CALL ggml_backend_t ggml_backend_reg_metal_init(const char * params, void * user_data); // silence warning
 
 GGML_CALL ggml_backend_t ggml_backend_reg_metal_init(const char * params, void * user_data) {
@@ -3948,7 +3948,35 @@ kernel void kernel_leaky_relu_f32(
     dst[tpig] = src0[tpig] > 0.0f ? src0[tpig] : src0[tpig] * slope;
 }
 
-typedef void (flash_attn_ext_f16_t)(
+// dequantizes the il-th group of 4 values of a block, so that the flash
+// attention kernels can read a quantized K or V row one half4 at a time
+template <typename type4>
+void dequantize_f16_t4(device const half4 * src, short il, thread type4 & reg) {
+    reg = (type4) src[il];
+}
+
+template <typename type4>
+void dequantize_q8_0_t4(device const block_q8_0 * xb, short il, thread type4 & reg) {
+    device const int8_t * qs = ((device const int8_t *)xb->qs);
+    const float d = xb->d;
+
+    for (int i = 0; i < 4; i++) {
+        reg[i] = (qs[4*il + i] * d);
+    }
+}
+
+template <typename type4>
+void dequantize_q4_0_t4(device const block_q4_0 * xb, short il, thread type4 & reg) {
+    device const uint8_t * qs = ((device const uint8_t *)xb->qs);
+    const float d = xb->d;
+    const short shift = il < 4 ? 0 : 4;
+
+    for (int i = 0; i < 4; i++) {
+        reg[i] = (((qs[4*(il%4) + i] >> shift) & 0x0F) - 8) * d;
+    }
+}
+
+typedef void (flash_attn_ext_t)(
         device const  char * q,
         device const  char * k,
         device const  char * v,
@@ -3985,8 +4013,13 @@ typedef void (flash_attn_ext_f16_t)(
         ushort sgitg[[simdgroup_index_in_threadgroup]]);
 
 // ref: https://arxiv.org/pdf/2307.08691.pdf
-template<int64_t D, int64_t Q = 8, int64_t C = 32> // head size, queries per threadgroup, cache items per threadgroup
-kernel void kernel_flash_attn_ext_f16(
+//
+// K and V may be quantized, in which case each simdgroup dequantizes 8 of
+// their rows at a time into threadgroup memory before multiplying them
+template<
+    typename block_q, short nl4, void (*deq4)(device const block_q *, short, thread half4 &), // K/V block, half4s per block, dequantizer
+    int64_t D, int64_t Q = 8, int64_t C = 32> // head size, queries per threadgroup, cache items per threadgroup
+kernel void kernel_flash_attn_ext(
         device const  char * q,
         device const  char * k,
         device const  char * v,
@@ -4027,6 +4060,8 @@ kernel void kernel_flash_attn_ext_f16(
     const short iq2 = tgpig[1];
     const short iq1 = tgpig[0]*Q;
 
+    const bool is_f16 = is_same<block_q, half4>::value;
+
     const short D4 = D/4;
     const short D8 = D/8;
     const short Q8 = Q/8;
@@ -4040,6 +4075,8 @@ kernel void kernel_flash_attn_ext_f16(
     threadgroup half  * sq  = (threadgroup half  *) (shared +              0*D); // holds the query data
     threadgroup half4 * sq4 = (threadgroup half4 *) (shared +              0*D); // same as above but in half4
     threadgroup float * ss  = (threadgroup float *) (shared + 2*sgitg*SH + 1*D); // scratch buffer for attention and diagonal matrix
+    threadgroup half  * skv = (threadgroup half  *) (shared + sgitg*(8*D) + Q*T); // dequantized rows of K or V
+    threadgroup half4 * skv4 = (threadgroup half4 *) skv;
 
     // store the result for all queries in local memory in 8x8 matrices (the O matrix from the paper)
     simdgroup_half8x8 lo[D8];
@@ -4126,11 +4163,35 @@ kernel void kernel_flash_attn_ext_f16(
 
                     device const half * pk = (device const half *) ((device const char *) k + ((ic + 8*cc)*nb11 + ik2*nb12 + ik3*nb13));
 
-                    for (short i = 0; i < D8; ++i) {
-                        simdgroup_half8x8 mk;
-                        simdgroup_load(mk, pk + i*8, nb11/sizeof(half), 0, true); // transpose
+                    if (is_f16) {
+                        for (short i = 0; i < D8; ++i) {
+                            simdgroup_half8x8 mk;
+                            simdgroup_load(mk, pk + i*8, nb11/sizeof(half), 0, true); // transpose
+
+                            simdgroup_multiply_accumulate(mqk, mq[i], mk, mqk);
+                        }
+                    } else {
+                        simdgroup_barrier(mem_flags::mem_threadgroup);
 
-                        simdgroup_multiply_accumulate(mqk, mq[i], mk, mqk);
+                        for (short ii = tiisg; ii < 8*D4; ii += NW) {
+                            const short j = ii/D4;
+                            const short i = ii%D4;
+
+                            device const block_q * pq = (device const block_q *) ((device const char *) pk + j*nb11);
+
+                            half4 tmp;
+                            deq4(pq + i/nl4, i%nl4, tmp);
+                            skv4[j*D4 + i] = tmp;
+                        }
+
+                        simdgroup_barrier(mem_flags::mem_threadgroup);
+
+                        for (short i = 0; i < D8; ++i) {
+                            simdgroup_half8x8 mk;
+                            simdgroup_load(mk, skv + i*8, D, 0, true); // transpose
+
+                            simdgroup_multiply_accumulate(mqk, mq[i], mk, mqk);
+                        }
                     }
 
                     // mqk = mqk*scale + mask
@@ -4193,9 +4254,30 @@ kernel void kernel_flash_attn_ext_f16(
                 for (short cc = 0; cc < C/8; ++cc) {
                     device const half * pv = (device const half *) ((device const char *) v + ((ic + 8*cc)*nb21 + iv2*nb22 + iv3*nb23));
 
+                    if (!is_f16) {
+                        simdgroup_barrier(mem_flags::mem_threadgroup);
+
+                        for (short ii = tiisg; ii < 8*D4; ii += NW) {
+                            const short j = ii/D4;
+                            const short i = ii%D4;
+
+                            device const block_q * pq = (device const block_q *) ((device const char *) pv + j*nb21);
+
+                            half4 tmp;
+                            deq4(pq + i/nl4, i%nl4, tmp);
+                            skv4[j*D4 + i] = tmp;
+                        }
+
+                        simdgroup_barrier(mem_flags::mem_threadgroup);
+                    }
+
                     for (short i = 0; i < D8; ++i) {
                         simdgroup_half8x8 mk;
-                        simdgroup_load(mk, pv + i*8, nb21/sizeof(half), 0, false);
+                        if (is_f16) {
+                            simdgroup_load(mk, pv + i*8, nb21/sizeof(half), 0, false);
+                        } else {
+                            simdgroup_load(mk, skv + i*8, D, 0, false);
+                        }
 
                         simdgroup_float8x8 mv;
                         simdgroup_load(mv, ss + 8*cc, TF, 0, false);
@@ -4296,15 +4378,24 @@ kernel void kernel_flash_attn_ext_f16(
     }
 }
 
-template [[host_name("kernel_flash_attn_ext_f16_h64" )]] kernel flash_attn_ext_f16_t kernel_flash_attn_ext_f16<64>;
-template [[host_name("kernel_flash_attn_ext_f16_h80" )]] kernel flash_attn_ext_f16_t kernel_flash_attn_ext_f16<80>;
-template [[host_name("kernel_flash_attn_ext_f16_h96" )]] kernel flash_attn_ext_f16_t kernel_flash_attn_ext_f16<96>;
-template [[host_name("kernel_flash_attn_ext_f16_h112")]] kernel flash_attn_ext_f16_t kernel_flash_attn_ext_f16<112>;
-template [[host_name("kernel_flash_attn_ext_f16_h128")]] kernel flash_attn_ext_f16_t kernel_flash_attn_ext_f16<128>;
-template [[host_name("kernel_flash_attn_ext_f16_h256")]] kernel flash_attn_ext_f16_t kernel_flash_attn_ext_f16<256>;
+template [[host_name("kernel_flash_attn_ext_f16_h64" )]]  kernel flash_attn_ext_t kernel_flash_attn_ext<half4,      1, dequantize_f16_t4,  64>;
+template [[host_name("kernel_flash_attn_ext_f16_h80" )]]  kernel flash_attn_ext_t kernel_flash_attn_ext<half4,      1, dequantize_f16_t4,  80>;
+template [[host_name("kernel_flash_attn_ext_f16_h96" )]]  kernel flash_attn_ext_t kernel_flash_attn_ext<half4,      1, dequantize_f16_t4,  96>;
+template [[host_name("kernel_flash_attn_ext_f16_h112")]]  kernel flash_attn_ext_t kernel_flash_attn_ext<half4,      1, dequantize_f16_t4,  112>;
+template [[host_name("kernel_flash_attn_ext_f16_h128")]]  kernel flash_attn_ext_t kernel_flash_attn_ext<half4,      1, dequantize_f16_t4,  128>;
+template [[host_name("kernel_flash_attn_ext_f16_h256")]]  kernel flash_attn_ext_t kernel_flash_attn_ext<half4,      1, dequantize_f16_t4,  256>;
+
+template [[host_name("kernel_flash_attn_ext_q8_0_h64" )]] kernel flash_attn_ext_t kernel_flash_attn_ext<block_q8_0, 8, dequantize_q8_0_t4, 64>;
+template [[host_name("kernel_flash_attn_ext_q8_0_h96" )]] kernel flash_attn_ext_t kernel_flash_attn_ext<block_q8_0, 8, dequantize_q8_0_t4, 96>;
+template [[host_name("kernel_flash_attn_ext_q8_0_h128")]] kernel flash_attn_ext_t kernel_flash_attn_ext<block_q8_0, 8, dequantize_q8_0_t4, 128>;
+template [[host_name("kernel_flash_attn_ext_q8_0_h256")]] kernel flash_attn_ext_t kernel_flash_attn_ext<block_q8_0, 8, dequantize_q8_0_t4, 256>;
 
-template<int64_t D, int64_t Q = 1, int64_t C = 32> // head size, queries per threadgroup, cache items per threadgroup
-kernel void kernel_flash_attn_ext_vec_f16(
+template [[host_name("kernel_flash_attn_ext_q4_0_h64" )]] kernel flash_attn_ext_t kernel_flash_attn_ext<block_q4_0, 8, dequantize_q4_0_t4, 64>;
+template [[host_name("kernel_flash_attn_ext_q4_0_h96" )]] kernel flash_attn_ext_t kernel_flash_attn_ext<block_q4_0, 8, dequantize_q4_0_t4, 96>;
+template [[host_name("kernel_flash_attn_ext_q4_0_h128")]] kernel flash_attn_ext_t kernel_flash_attn_ext<block_q4_0, 8, dequantize_q4_0_t4, 128>;
+template [[host_name("kernel_flash_attn_ext_q4_0_h256")]] kernel flash_attn_ext_t kernel_flash_attn_ext<block_q4_0, 8, dequantize_q4_0_t4, 256>;
+
+typedef void (flash_attn_ext_vec_t)(
         device const  char * q,
         device const  char * k,
         device const  char * v,
@@ -4333,6 +4424,51 @@ kernel void kernel_flash_attn_ext_vec_f16(
         constant   int64_t & ne2,
         constant   int64_t & ne3,
         constant     float & scale,
+        constant   int32_t & nwg,
+        threadgroup   half * shared,
+        uint3  tgpig[[threadgroup_position_in_grid]],
+        uint3  tpitg[[thread_position_in_threadgroup]],
+        uint3    ntg[[threads_per_threadgroup]],
+        ushort tiisg[[thread_index_in_simdgroup]],
+        ushort sgitg[[simdgroup_index_in_threadgroup]]);
+
+// when decoding, there may be too few heads to keep the gpu busy, so the
+// kv cache can also be split across nwg threadgroups, in which case each
+// writes its unnormalized output, sum and max to the end of dst, for the
+// kernel_flash_attn_ext_vec_reduce kernel to combine
+template<
+    typename block_q, short nl4, void (*deq4)(device const block_q *, short, thread half4 &), // K/V block, half4s per block, dequantizer
+    int64_t D, int64_t Q = 1, int64_t C = 32> // head size, queries per threadgroup, cache items per threadgroup
+kernel void kernel_flash_attn_ext_vec(
+        device const  char * q,
+        device const  char * k,
+        device const  char * v,
+        device const  char * mask,
+        device       float * dst,
+        constant   int64_t & ne00,
+        constant   int64_t & ne01,
+        constant   int64_t & ne02,
+        constant   int64_t & ne03,
+        constant  uint64_t & nb00,
+        constant  uint64_t & nb01,
+        constant  uint64_t & nb02,
+        constant  uint64_t & nb03,
+        constant   int64_t & ne10,
+        constant   int64_t & ne11,
+        constant   int64_t & ne12,
+        constant   int64_t & ne13,
+        constant  uint64_t & nb10,
+        constant  uint64_t & nb11,
+        constant  uint64_t & nb12,
+        constant  uint64_t & nb13,
+        constant   int64_t & ne31,
+        constant  uint64_t & nb31,
+        constant   int64_t & ne0,
+        constant   int64_t & ne1,
+        constant   int64_t & ne2,
+        constant   int64_t & ne3,
+        constant     float & scale,
+        constant   int32_t & nwg,
         threadgroup   half * shared [[threadgroup(0)]],
         uint3  tgpig[[threadgroup_position_in_grid]],
         uint3  tpitg[[thread_position_in_threadgroup]],
@@ -4343,7 +4479,8 @@ kernel void kernel_flash_attn_ext_vec_f16(
 
     const short iq3 = tgpig[2];
     const short iq2 = tgpig[1];
-    const short iq1 = tgpig[0];
+    const short iq1 = tgpig[0]/nwg;
+    const short iwg = tgpig[0]%nwg; // which part of the kv cache
 
     const short D4 = D/4;
     const short NW = N_SIMDWIDTH;
@@ -4423,7 +4560,7 @@ kernel void kernel_flash_attn_ext_vec_f16(
 
         // loop over the KV cache
         // each simdgroup handles blocks of Q rows and C columns
-        for (int ic0 = 0; ic0 < ne11; ic0 += C*nsg) {
+        for (int ic0 = iwg*C*nsg; ic0 < ne11; ic0 += nwg*C*nsg) {
             const int ic = ic0 + C*sgitg;
             if (ic >= ne11) {
                 break;
@@ -4435,17 +4572,17 @@ kernel void kernel_flash_attn_ext_vec_f16(
                 for (short cc = 0; cc < C/4; ++cc) {
                     float4 mqk = { 0.0h };
 
-                    device const half4 * pk4 = (device const half4 *) ((device const char *) k + ((ic + 4*cc)*nb11 + ik2*nb12 + ik3*nb13));
+                    device const char * pk = (device const char *) k + ((ic + 4*cc)*nb11 + ik2*nb12 + ik3*nb13);
 
 #pragma unroll
                     for (short ii = 0; ii < D4; ii += NW) {
                         const short i = ii + tiisg;
 
                         half4x4 mk;
-                        mk[0] = pk4[i + 0*(nb11/8)];
-                        mk[1] = pk4[i + 1*(nb11/8)];
-                        mk[2] = pk4[i + 2*(nb11/8)];
-                        mk[3] = pk4[i + 3*(nb11/8)];
+                        deq4((device const block_q *) (pk + 0*nb11) + i/nl4, i%nl4, mk[0]);
+                        deq4((device const block_q *) (pk + 1*nb11) + i/nl4, i%nl4, mk[1]);
+                        deq4((device const block_q *) (pk + 2*nb11) + i/nl4, i%nl4, mk[2]);
+                        deq4((device const block_q *) (pk + 3*nb11) + i/nl4, i%nl4, mk[3]);
 
                         mqk += (float4) (mq[i] * mk);
                     }
@@ -4496,16 +4633,22 @@ kernel void kernel_flash_attn_ext_vec_f16(
             {
 #pragma unroll
                 for (short cc = 0; cc < C/4; ++cc) {
-                    device const half4 * pv4 = (device const half4 *) ((device const char *) v + ((ic + 4*cc)*nb21 + iv2*nb22 + iv3*nb23));
+                    device const char * pv = (device const char *) v + ((ic + 4*cc)*nb21 + iv2*nb22 + iv3*nb23);
 
 #pragma unroll
                     for (short ii = 0; ii < D4; ii += NW) {
                         const short i = ii + tiisg;
 
-                        lo[i/NW] += pv4[i + 0*(nb21/8)] * ss[4*cc + 0];
-                        lo[i/NW] += pv4[i + 1*(nb21/8)] * ss[4*cc + 1];
-                        lo[i/NW] += pv4[i + 2*(nb21/8)] * ss[4*cc + 2];
-                        lo[i/NW] += pv4[i + 3*(nb21/8)] * ss[4*cc + 3];
+                        half4x4 mv;
+                        deq4((device const block_q *) (pv + 0*nb21) + i/nl4, i%nl4, mv[0]);
+                        deq4((device const block_q *) (pv + 1*nb21) + i/nl4, i%nl4, mv[1]);
+                        deq4((device const block_q *) (pv + 2*nb21) + i/nl4, i%nl4, mv[2]);
+                        deq4((device const block_q *) (pv + 3*nb21) + i/nl4, i%nl4, mv[3]);
+
+                        lo[i/NW] += mv[0] * ss[4*cc + 0];
+                        lo[i/NW] += mv[1] * ss[4*cc + 1];
+                        lo[i/NW] += mv[2] * ss[4*cc + 2];
+                        lo[i/NW] += mv[3] * ss[4*cc + 3];
                     }
                 }
             }
@@ -4560,19 +4703,74 @@ kernel void kernel_flash_attn_ext_vec_f16(
 
     device float4 * dst4 = (device float4 *) dst;
 
-    // final rescale with 1/S and store to global memory
-    if (sgitg == 0) {
-        const float S = ss[0];
+    const int64_t row = iq3*ne2*ne1 + iq2 + (iq1)*ne1;
 
-        for (short ii = 0; ii < D4; ii += NW) {
-            short i = ii + tiisg;
-            dst4[(iq3*ne2*ne1 + iq2 + (iq1)*ne1)*D4 + i] = (float4) sr4[i]/S;
+    if (nwg == 1) {
+        // final rescale with 1/S and store to global memory
+        if (sgitg == 0) {
+            const float S = ss[0];
+
+            for (short ii = 0; ii < D4; ii += NW) {
+                short i = ii + tiisg;
+                dst4[row*D4 + i] = (float4) sr4[i]/S;
+            }
+        }
+    } else {
+        // store the partial result and its sum and max after dst
+        device float4 * tmp4 = dst4 + ne1*ne2*ne3*D4;
+        device float  * tmps = (device float *) (tmp4 + ne1*ne2*ne3*nwg*D4);
+
+        if (sgitg == 0) {
+            for (short ii = 0; ii < D4; ii += NW) {
+                short i = ii + tiisg;
+                tmp4[(row*nwg + iwg)*D4 + i] = (float4) sr4[i];
+            }
+
+            if (tiisg == 0) {
+                tmps[(row*nwg + iwg)*2 + 0] = ss[0];
+                tmps[(row*nwg + iwg)*2 + 1] = ss[1];
+            }
         }
     }
 }
 
-template [[host_name("kernel_flash_attn_ext_vec_f16_h128")]] kernel flash_attn_ext_f16_t kernel_flash_attn_ext_vec_f16<128>;
-template [[host_name("kernel_flash_attn_ext_vec_f16_h256")]] kernel flash_attn_ext_f16_t kernel_flash_attn_ext_vec_f16<256>;
+template [[host_name("kernel_flash_attn_ext_vec_f16_h128")]]  kernel flash_attn_ext_vec_t kernel_flash_attn_ext_vec<half4,      1, dequantize_f16_t4,  128>;
+template [[host_name("kernel_flash_attn_ext_vec_f16_h256")]]  kernel flash_attn_ext_vec_t kernel_flash_attn_ext_vec<half4,      1, dequantize_f16_t4,  256>;
+template [[host_name("kernel_flash_attn_ext_vec_q8_0_h128")]] kernel flash_attn_ext_vec_t kernel_flash_attn_ext_vec<block_q8_0, 8, dequantize_q8_0_t4, 128>;
+template [[host_name("kernel_flash_attn_ext_vec_q8_0_h256")]] kernel flash_attn_ext_vec_t kernel_flash_attn_ext_vec<block_q8_0, 8, dequantize_q8_0_t4, 256>;
+template [[host_name("kernel_flash_attn_ext_vec_q4_0_h128")]] kernel flash_attn_ext_vec_t kernel_flash_attn_ext_vec<block_q4_0, 8, dequantize_q4_0_t4, 128>;
+template [[host_name("kernel_flash_attn_ext_vec_q4_0_h256")]] kernel flash_attn_ext_vec_t kernel_flash_attn_ext_vec<block_q4_0, 8, dequantize_q4_0_t4, 256>;
+
+// combines the nwg partial results kernel_flash_attn_ext_vec wrote for a
+// row of dst, one threadgroup of a single simdgroup per row
+kernel void kernel_flash_attn_ext_vec_reduce(
+        device       float * dst,
+        constant   int64_t & ne0,
+        constant   int64_t & nrows,
+        constant   int32_t & nwg,
+        uint   tgpig[[threadgroup_position_in_grid]],
+        ushort tiisg[[thread_index_in_simdgroup]]) {
+    const int64_t row = tgpig;
+
+    device const float * tmp  = dst + nrows*ne0;
+    device const float * tmps = tmp + nrows*nwg*ne0;
+
+    // thread i holds the sum and max of part i
+    const float S0 = tiisg < nwg ? tmps[(row*nwg + tiisg)*2 + 0] : 0.0f;
+    const float M0 = tiisg < nwg ? tmps[(row*nwg + tiisg)*2 + 1] : -FLT_MAX/2;
+
+    const float M  = simd_max(M0);
+    const float ms = exp(M0 - M);
+    const float S  = simd_sum(S0*ms);
+
+    for (int64_t i = tiisg; i < ne0; i += N_SIMDWIDTH) {
+        float o = 0.0f;
+        for (int j = 0; j < nwg; ++j) {
+            o += tmp[(row*nwg + j)*ne0 + i]*simd_shuffle(ms, j);
+        }
+        dst[row*ne0 + i] = o/S;
+    }
+}
 
 kernel void kernel_cpy_f16_f16(
         device  const half * src0,
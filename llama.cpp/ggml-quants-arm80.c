@@ -5,6 +5,7 @@
 #define quantize_row_q5_1_reference quantize_row_q5_1_reference_arm80
 #define quantize_row_q8_0_reference quantize_row_q8_0_reference_arm80
 #define quantize_row_q8_1_reference quantize_row_q8_1_reference_arm80
+#define quantize_row_f8_e4m3_reference quantize_row_f8_e4m3_reference_arm80
 #define quantize_row_q2_K_reference quantize_row_q2_K_reference_arm80
 #define quantize_row_q3_K_reference quantize_row_q3_K_reference_arm80
 #define quantize_row_q4_K_reference quantize_row_q4_K_reference_arm80
@@ -22,6 +23,7 @@
 #define quantize_row_q5_1 quantize_row_q5_1_arm80
 #define quantize_row_q8_0 quantize_row_q8_0_arm80
 #define quantize_row_q8_1 quantize_row_q8_1_arm80
+#define quantize_row_f8_e4m3 quantize_row_f8_e4m3_arm80
 #define quantize_row_q2_K quantize_row_q2_K_arm80
 #define quantize_row_q3_K quantize_row_q3_K_arm80
 #define quantize_row_q4_K quantize_row_q4_K_arm80
@@ -38,6 +40,7 @@
 #define dequantize_row_q5_0 dequantize_row_q5_0_arm80
 #define dequantize_row_q5_1 dequantize_row_q5_1_arm80
 #define dequantize_row_q8_0 dequantize_row_q8_0_arm80
+#define dequantize_row_f8_e4m3 dequantize_row_f8_e4m3_arm80
 #define dequantize_row_q2_K dequantize_row_q2_K_arm80
 #define dequantize_row_q3_K dequantize_row_q3_K_arm80
 #define dequantize_row_q4_K dequantize_row_q4_K_arm80
@@ -58,6 +61,7 @@
 #define ggml_vec_dot_q5_0_q8_0 ggml_vec_dot_q5_0_q8_0_arm80
 #define ggml_vec_dot_q5_1_q8_1 ggml_vec_dot_q5_1_q8_1_arm80
 #define ggml_vec_dot_q8_0_q8_0 ggml_vec_dot_q8_0_q8_0_arm80
+#define ggml_vec_dot_f8_e4m3_q8_0 ggml_vec_dot_f8_e4m3_q8_0_arm80
 #define ggml_vec_dot_q2_K_q8_K ggml_vec_dot_q2_K_q8_K_arm80
 #define ggml_vec_dot_q3_K_q8_K ggml_vec_dot_q3_K_q8_K_arm80
 #define ggml_vec_dot_q4_K_q8_K ggml_vec_dot_q4_K_q8_K_arm80
@@ -91,6 +95,7 @@
 #define quantize_q5_0 quantize_q5_0_arm80
 #define quantize_q5_1 quantize_q5_1_arm80
 #define quantize_q8_0 quantize_q8_0_arm80
+#define quantize_f8_e4m3 quantize_f8_e4m3_arm80
 #define iq2xs_init_impl iq2xs_init_impl_arm80
 #define iq2xs_free_impl iq2xs_free_impl_arm80
 #define iq3xs_init_impl iq3xs_init_impl_arm80
@@ -3,489 +3,718 @@
 #include <libc/sysv/consts/hwcap.h>
 #include "ggml-quants.h"
 
+extern "C" void quantize_row_q4_0_reference_amd_zen4(const float * GGML_RESTRICT x, block_q4_0 * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q4_0_reference_amd_avx512(const float * GGML_RESTRICT x, block_q4_0 * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q4_0_reference_amd_avx2(const float * GGML_RESTRICT x, block_q4_0 * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q4_0_reference_amd_avx(const float * GGML_RESTRICT x, block_q4_0 * GGML_RESTRICT y, int64_t k);
+extern "C" void quantize_row_q4_0_reference_arm82(const float * GGML_RESTRICT x, block_q4_0 * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q4_0_reference_arm80(const float * GGML_RESTRICT x, block_q4_0 * GGML_RESTRICT y, int64_t k);
 
+extern "C" void quantize_row_q4_1_reference_amd_zen4(const float * GGML_RESTRICT x, block_q4_1 * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q4_1_reference_amd_avx512(const float * GGML_RESTRICT x, block_q4_1 * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q4_1_reference_amd_avx2(const float * GGML_RESTRICT x, block_q4_1 * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q4_1_reference_amd_avx(const float * GGML_RESTRICT x, block_q4_1 * GGML_RESTRICT y, int64_t k);
+extern "C" void quantize_row_q4_1_reference_arm82(const float * GGML_RESTRICT x, block_q4_1 * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q4_1_reference_arm80(const float * GGML_RESTRICT x, block_q4_1 * GGML_RESTRICT y, int64_t k);
 
+extern "C" void quantize_row_q5_0_reference_amd_zen4(const float * GGML_RESTRICT x, block_q5_0 * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q5_0_reference_amd_avx512(const float * GGML_RESTRICT x, block_q5_0 * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q5_0_reference_amd_avx2(const float * GGML_RESTRICT x, block_q5_0 * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q5_0_reference_amd_avx(const float * GGML_RESTRICT x, block_q5_0 * GGML_RESTRICT y, int64_t k);
+extern "C" void quantize_row_q5_0_reference_arm82(const float * GGML_RESTRICT x, block_q5_0 * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q5_0_reference_arm80(const float * GGML_RESTRICT x, block_q5_0 * GGML_RESTRICT y, int64_t k);
 
+extern "C" void quantize_row_q5_1_reference_amd_zen4(const float * GGML_RESTRICT x, block_q5_1 * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q5_1_reference_amd_avx512(const float * GGML_RESTRICT x, block_q5_1 * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q5_1_reference_amd_avx2(const float * GGML_RESTRICT x, block_q5_1 * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q5_1_reference_amd_avx(const float * GGML_RESTRICT x, block_q5_1 * GGML_RESTRICT y, int64_t k);
+extern "C" void quantize_row_q5_1_reference_arm82(const float * GGML_RESTRICT x, block_q5_1 * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q5_1_reference_arm80(const float * GGML_RESTRICT x, block_q5_1 * GGML_RESTRICT y, int64_t k);
 
+extern "C" void quantize_row_q8_0_reference_amd_zen4(const float * GGML_RESTRICT x, block_q8_0 * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q8_0_reference_amd_avx512(const float * GGML_RESTRICT x, block_q8_0 * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q8_0_reference_amd_avx2(const float * GGML_RESTRICT x, block_q8_0 * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q8_0_reference_amd_avx(const float * GGML_RESTRICT x, block_q8_0 * GGML_RESTRICT y, int64_t k);
+extern "C" void quantize_row_q8_0_reference_arm82(const float * GGML_RESTRICT x, block_q8_0 * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q8_0_reference_arm80(const float * GGML_RESTRICT x, block_q8_0 * GGML_RESTRICT y, int64_t k);
 
+extern "C" void quantize_row_q8_1_reference_amd_zen4(const float * GGML_RESTRICT x, block_q8_1 * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q8_1_reference_amd_avx512(const float * GGML_RESTRICT x, block_q8_1 * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q8_1_reference_amd_avx2(const float * GGML_RESTRICT x, block_q8_1 * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q8_1_reference_amd_avx(const float * GGML_RESTRICT x, block_q8_1 * GGML_RESTRICT y, int64_t k);
+extern "C" void quantize_row_q8_1_reference_arm82(const float * GGML_RESTRICT x, block_q8_1 * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q8_1_reference_arm80(const float * GGML_RESTRICT x, block_q8_1 * GGML_RESTRICT y, int64_t k);
 
+extern "C" void quantize_row_f8_e4m3_reference_amd_zen4(const float * GGML_RESTRICT x, block_f8_e4m3 * GGML_RESTRICT y, int64_t k);
+extern "C" void quantize_row_f8_e4m3_reference_amd_avx512(const float * GGML_RESTRICT x, block_f8_e4m3 * GGML_RESTRICT y, int64_t k);
+extern "C" void quantize_row_f8_e4m3_reference_amd_avx2(const float * GGML_RESTRICT x, block_f8_e4m3 * GGML_RESTRICT y, int64_t k);
+extern "C" void quantize_row_f8_e4m3_reference_amd_avx(const float * GGML_RESTRICT x, block_f8_e4m3 * GGML_RESTRICT y, int64_t k);
+extern "C" void quantize_row_f8_e4m3_reference_arm82(const float * GGML_RESTRICT x, block_f8_e4m3 * GGML_RESTRICT y, int64_t k);
+extern "C" void quantize_row_f8_e4m3_reference_arm80(const float * GGML_RESTRICT x, block_f8_e4m3 * GGML_RESTRICT y, int64_t k);
+
+extern "C" void quantize_row_q2_K_reference_amd_zen4(const float * GGML_RESTRICT x, block_q2_K * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q2_K_reference_amd_avx512(const float * GGML_RESTRICT x, block_q2_K * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q2_K_reference_amd_avx2(const float * GGML_RESTRICT x, block_q2_K * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q2_K_reference_amd_avx(const float * GGML_RESTRICT x, block_q2_K * GGML_RESTRICT y, int64_t k);
+extern "C" void quantize_row_q2_K_reference_arm82(const float * GGML_RESTRICT x, block_q2_K * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q2_K_reference_arm80(const float * GGML_RESTRICT x, block_q2_K * GGML_RESTRICT y, int64_t k);
 
+extern "C" void quantize_row_q3_K_reference_amd_zen4(const float * GGML_RESTRICT x, block_q3_K * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q3_K_reference_amd_avx512(const float * GGML_RESTRICT x, block_q3_K * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q3_K_reference_amd_avx2(const float * GGML_RESTRICT x, block_q3_K * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q3_K_reference_amd_avx(const float * GGML_RESTRICT x, block_q3_K * GGML_RESTRICT y, int64_t k);
+extern "C" void quantize_row_q3_K_reference_arm82(const float * GGML_RESTRICT x, block_q3_K * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q3_K_reference_arm80(const float * GGML_RESTRICT x, block_q3_K * GGML_RESTRICT y, int64_t k);
 
+extern "C" void quantize_row_q4_K_reference_amd_zen4(const float * GGML_RESTRICT x, block_q4_K * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q4_K_reference_amd_avx512(const float * GGML_RESTRICT x, block_q4_K * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q4_K_reference_amd_avx2(const float * GGML_RESTRICT x, block_q4_K * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q4_K_reference_amd_avx(const float * GGML_RESTRICT x, block_q4_K * GGML_RESTRICT y, int64_t k);
+extern "C" void quantize_row_q4_K_reference_arm82(const float * GGML_RESTRICT x, block_q4_K * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q4_K_reference_arm80(const float * GGML_RESTRICT x, block_q4_K * GGML_RESTRICT y, int64_t k);
 
+extern "C" void quantize_row_q5_K_reference_amd_zen4(const float * GGML_RESTRICT x, block_q5_K * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q5_K_reference_amd_avx512(const float * GGML_RESTRICT x, block_q5_K * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q5_K_reference_amd_avx2(const float * GGML_RESTRICT x, block_q5_K * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q5_K_reference_amd_avx(const float * GGML_RESTRICT x, block_q5_K * GGML_RESTRICT y, int64_t k);
+extern "C" void quantize_row_q5_K_reference_arm82(const float * GGML_RESTRICT x, block_q5_K * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q5_K_reference_arm80(const float * GGML_RESTRICT x, block_q5_K * GGML_RESTRICT y, int64_t k);
 
+extern "C" void quantize_row_q6_K_reference_amd_zen4(const float * GGML_RESTRICT x, block_q6_K * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q6_K_reference_amd_avx512(const float * GGML_RESTRICT x, block_q6_K * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q6_K_reference_amd_avx2(const float * GGML_RESTRICT x, block_q6_K * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q6_K_reference_amd_avx(const float * GGML_RESTRICT x, block_q6_K * GGML_RESTRICT y, int64_t k);
+extern "C" void quantize_row_q6_K_reference_arm82(const float * GGML_RESTRICT x, block_q6_K * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q6_K_reference_arm80(const float * GGML_RESTRICT x, block_q6_K * GGML_RESTRICT y, int64_t k);
 
+extern "C" void quantize_row_q8_K_reference_amd_zen4(const float * GGML_RESTRICT x, block_q8_K * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q8_K_reference_amd_avx512(const float * GGML_RESTRICT x, block_q8_K * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q8_K_reference_amd_avx2(const float * GGML_RESTRICT x, block_q8_K * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q8_K_reference_amd_avx(const float * GGML_RESTRICT x, block_q8_K * GGML_RESTRICT y, int64_t k);
+extern "C" void quantize_row_q8_K_reference_arm82(const float * GGML_RESTRICT x, block_q8_K * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q8_K_reference_arm80(const float * GGML_RESTRICT x, block_q8_K * GGML_RESTRICT y, int64_t k);
 
+extern "C" void quantize_row_iq3_xxs_reference_amd_zen4(const float * GGML_RESTRICT x, block_iq3_xxs * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_iq3_xxs_reference_amd_avx512(const float * GGML_RESTRICT x, block_iq3_xxs * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_iq3_xxs_reference_amd_avx2(const float * GGML_RESTRICT x, block_iq3_xxs * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_iq3_xxs_reference_amd_avx(const float * GGML_RESTRICT x, block_iq3_xxs * GGML_RESTRICT y, int64_t k);
+extern "C" void quantize_row_iq3_xxs_reference_arm82(const float * GGML_RESTRICT x, block_iq3_xxs * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_iq3_xxs_reference_arm80(const float * GGML_RESTRICT x, block_iq3_xxs * GGML_RESTRICT y, int64_t k);
 
+extern "C" void quantize_row_iq4_nl_reference_amd_zen4 (const float * GGML_RESTRICT x, block_iq4_nl  * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_iq4_nl_reference_amd_avx512 (const float * GGML_RESTRICT x, block_iq4_nl  * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_iq4_nl_reference_amd_avx2 (const float * GGML_RESTRICT x, block_iq4_nl  * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_iq4_nl_reference_amd_avx (const float * GGML_RESTRICT x, block_iq4_nl  * GGML_RESTRICT y, int64_t k);
+extern "C" void quantize_row_iq4_nl_reference_arm82 (const float * GGML_RESTRICT x, block_iq4_nl  * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_iq4_nl_reference_arm80 (const float * GGML_RESTRICT x, block_iq4_nl  * GGML_RESTRICT y, int64_t k);
 
+extern "C" void quantize_row_iq4_xs_reference_amd_zen4 (const float * GGML_RESTRICT x, block_iq4_xs  * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_iq4_xs_reference_amd_avx512 (const float * GGML_RESTRICT x, block_iq4_xs  * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_iq4_xs_reference_amd_avx2 (const float * GGML_RESTRICT x, block_iq4_xs  * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_iq4_xs_reference_amd_avx (const float * GGML_RESTRICT x, block_iq4_xs  * GGML_RESTRICT y, int64_t k);
+extern "C" void quantize_row_iq4_xs_reference_arm82 (const float * GGML_RESTRICT x, block_iq4_xs  * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_iq4_xs_reference_arm80 (const float * GGML_RESTRICT x, block_iq4_xs  * GGML_RESTRICT y, int64_t k);
 
+extern "C" void quantize_row_iq3_s_reference_amd_zen4  (const float * GGML_RESTRICT x, block_iq3_s   * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_iq3_s_reference_amd_avx512  (const float * GGML_RESTRICT x, block_iq3_s   * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_iq3_s_reference_amd_avx2  (const float * GGML_RESTRICT x, block_iq3_s   * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_iq3_s_reference_amd_avx  (const float * GGML_RESTRICT x, block_iq3_s   * GGML_RESTRICT y, int64_t k);
+extern "C" void quantize_row_iq3_s_reference_arm82  (const float * GGML_RESTRICT x, block_iq3_s   * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_iq3_s_reference_arm80  (const float * GGML_RESTRICT x, block_iq3_s   * GGML_RESTRICT y, int64_t k);
 
+extern "C" void quantize_row_iq2_s_reference_amd_zen4  (const float * GGML_RESTRICT x, block_iq2_s   * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_iq2_s_reference_amd_avx512  (const float * GGML_RESTRICT x, block_iq2_s   * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_iq2_s_reference_amd_avx2  (const float * GGML_RESTRICT x, block_iq2_s   * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_iq2_s_reference_amd_avx  (const float * GGML_RESTRICT x, block_iq2_s   * GGML_RESTRICT y, int64_t k);
+extern "C" void quantize_row_iq2_s_reference_arm82  (const float * GGML_RESTRICT x, block_iq2_s   * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_iq2_s_reference_arm80  (const float * GGML_RESTRICT x, block_iq2_s   * GGML_RESTRICT y, int64_t k);
 
+extern "C" void quantize_row_q4_0_amd_zen4(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q4_0_amd_avx512(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q4_0_amd_avx2(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q4_0_amd_avx(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
+extern "C" void quantize_row_q4_0_arm82(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q4_0_arm80(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 
+extern "C" void quantize_row_q4_1_amd_zen4(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q4_1_amd_avx512(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q4_1_amd_avx2(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q4_1_amd_avx(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
+extern "C" void quantize_row_q4_1_arm82(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q4_1_arm80(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 
+extern "C" void quantize_row_q5_0_amd_zen4(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q5_0_amd_avx512(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q5_0_amd_avx2(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q5_0_amd_avx(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
+extern "C" void quantize_row_q5_0_arm82(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q5_0_arm80(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 
+extern "C" void quantize_row_q5_1_amd_zen4(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q5_1_amd_avx512(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q5_1_amd_avx2(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q5_1_amd_avx(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
+extern "C" void quantize_row_q5_1_arm82(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q5_1_arm80(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 
+extern "C" void quantize_row_q8_0_amd_zen4(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q8_0_amd_avx512(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q8_0_amd_avx2(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q8_0_amd_avx(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
+extern "C" void quantize_row_q8_0_arm82(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q8_0_arm80(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 
+extern "C" void quantize_row_q8_1_amd_zen4(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q8_1_amd_avx512(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q8_1_amd_avx2(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q8_1_amd_avx(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
+extern "C" void quantize_row_q8_1_arm82(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q8_1_arm80(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 
+extern "C" void quantize_row_f8_e4m3_amd_zen4(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
+extern "C" void quantize_row_f8_e4m3_amd_avx512(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
+extern "C" void quantize_row_f8_e4m3_amd_avx2(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
+extern "C" void quantize_row_f8_e4m3_amd_avx(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
+extern "C" void quantize_row_f8_e4m3_arm82(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
+extern "C" void quantize_row_f8_e4m3_arm80(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
+
+extern "C" void quantize_row_q2_K_amd_zen4(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q2_K_amd_avx512(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q2_K_amd_avx2(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q2_K_amd_avx(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
+extern "C" void quantize_row_q2_K_arm82(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q2_K_arm80(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 
+extern "C" void quantize_row_q3_K_amd_zen4(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q3_K_amd_avx512(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q3_K_amd_avx2(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q3_K_amd_avx(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
+extern "C" void quantize_row_q3_K_arm82(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q3_K_arm80(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 
+extern "C" void quantize_row_q4_K_amd_zen4(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q4_K_amd_avx512(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q4_K_amd_avx2(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q4_K_amd_avx(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
+extern "C" void quantize_row_q4_K_arm82(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q4_K_arm80(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 
+extern "C" void quantize_row_q5_K_amd_zen4(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q5_K_amd_avx512(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q5_K_amd_avx2(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q5_K_amd_avx(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
+extern "C" void quantize_row_q5_K_arm82(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q5_K_arm80(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 
+extern "C" void quantize_row_q6_K_amd_zen4(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q6_K_amd_avx512(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q6_K_amd_avx2(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q6_K_amd_avx(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
+extern "C" void quantize_row_q6_K_arm82(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q6_K_arm80(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 
+extern "C" void quantize_row_q8_K_amd_zen4(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q8_K_amd_avx512(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q8_K_amd_avx2(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q8_K_amd_avx(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
+extern "C" void quantize_row_q8_K_arm82(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_q8_K_arm80(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 
+extern "C" void quantize_row_iq3_xxs_amd_zen4(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_iq3_xxs_amd_avx512(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_iq3_xxs_amd_avx2(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_iq3_xxs_amd_avx(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
+extern "C" void quantize_row_iq3_xxs_arm82(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_iq3_xxs_arm80(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 
+extern "C" void quantize_row_iq4_nl_amd_zen4 (const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_iq4_nl_amd_avx512 (const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_iq4_nl_amd_avx2 (const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_iq4_nl_amd_avx (const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
+extern "C" void quantize_row_iq4_nl_arm82 (const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_iq4_nl_arm80 (const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 
+extern "C" void quantize_row_iq4_xs_amd_zen4 (const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_iq4_xs_amd_avx512 (const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_iq4_xs_amd_avx2 (const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_iq4_xs_amd_avx (const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
+extern "C" void quantize_row_iq4_xs_arm82 (const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_iq4_xs_arm80 (const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 
+extern "C" void quantize_row_iq3_s_amd_zen4  (const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_iq3_s_amd_avx512  (const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_iq3_s_amd_avx2  (const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_iq3_s_amd_avx  (const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
+extern "C" void quantize_row_iq3_s_arm82  (const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_iq3_s_arm80  (const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 
+extern "C" void quantize_row_iq2_s_amd_zen4  (const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_iq2_s_amd_avx512  (const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_iq2_s_amd_avx2  (const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_iq2_s_amd_avx  (const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
+extern "C" void quantize_row_iq2_s_arm82  (const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 extern "C" void quantize_row_iq2_s_arm80  (const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k);
 
+extern "C" void dequantize_row_q4_0_amd_zen4(const block_q4_0 * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_q4_0_amd_avx512(const block_q4_0 * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_q4_0_amd_avx2(const block_q4_0 * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_q4_0_amd_avx(const block_q4_0 * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
+extern "C" void dequantize_row_q4_0_arm82(const block_q4_0 * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_q4_0_arm80(const block_q4_0 * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 
+extern "C" void dequantize_row_q4_1_amd_zen4(const block_q4_1 * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_q4_1_amd_avx512(const block_q4_1 * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_q4_1_amd_avx2(const block_q4_1 * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_q4_1_amd_avx(const block_q4_1 * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
+extern "C" void dequantize_row_q4_1_arm82(const block_q4_1 * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_q4_1_arm80(const block_q4_1 * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 
+extern "C" void dequantize_row_q5_0_amd_zen4(const block_q5_0 * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_q5_0_amd_avx512(const block_q5_0 * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_q5_0_amd_avx2(const block_q5_0 * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_q5_0_amd_avx(const block_q5_0 * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
+extern "C" void dequantize_row_q5_0_arm82(const block_q5_0 * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_q5_0_arm80(const block_q5_0 * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 
+extern "C" void dequantize_row_q5_1_amd_zen4(const block_q5_1 * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_q5_1_amd_avx512(const block_q5_1 * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_q5_1_amd_avx2(const block_q5_1 * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_q5_1_amd_avx(const block_q5_1 * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
+extern "C" void dequantize_row_q5_1_arm82(const block_q5_1 * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_q5_1_arm80(const block_q5_1 * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 
+extern "C" void dequantize_row_q8_0_amd_zen4(const block_q8_0 * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_q8_0_amd_avx512(const block_q8_0 * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_q8_0_amd_avx2(const block_q8_0 * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_q8_0_amd_avx(const block_q8_0 * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
+extern "C" void dequantize_row_q8_0_arm82(const block_q8_0 * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_q8_0_arm80(const block_q8_0 * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 
+extern "C" void dequantize_row_f8_e4m3_amd_zen4(const block_f8_e4m3 * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
+extern "C" void dequantize_row_f8_e4m3_amd_avx512(const block_f8_e4m3 * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
+extern "C" void dequantize_row_f8_e4m3_amd_avx2(const block_f8_e4m3 * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
+extern "C" void dequantize_row_f8_e4m3_amd_avx(const block_f8_e4m3 * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
+extern "C" void dequantize_row_f8_e4m3_arm82(const block_f8_e4m3 * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
+extern "C" void dequantize_row_f8_e4m3_arm80(const block_f8_e4m3 * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
+
+extern "C" void dequantize_row_q2_K_amd_zen4(const block_q2_K * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_q2_K_amd_avx512(const block_q2_K * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_q2_K_amd_avx2(const block_q2_K * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_q2_K_amd_avx(const block_q2_K * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
+extern "C" void dequantize_row_q2_K_arm82(const block_q2_K * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_q2_K_arm80(const block_q2_K * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 
+extern "C" void dequantize_row_q3_K_amd_zen4(const block_q3_K * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_q3_K_amd_avx512(const block_q3_K * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_q3_K_amd_avx2(const block_q3_K * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_q3_K_amd_avx(const block_q3_K * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
+extern "C" void dequantize_row_q3_K_arm82(const block_q3_K * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_q3_K_arm80(const block_q3_K * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 
+extern "C" void dequantize_row_q4_K_amd_zen4(const block_q4_K * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_q4_K_amd_avx512(const block_q4_K * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_q4_K_amd_avx2(const block_q4_K * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_q4_K_amd_avx(const block_q4_K * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
+extern "C" void dequantize_row_q4_K_arm82(const block_q4_K * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_q4_K_arm80(const block_q4_K * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 
+extern "C" void dequantize_row_q5_K_amd_zen4(const block_q5_K * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_q5_K_amd_avx512(const block_q5_K * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_q5_K_amd_avx2(const block_q5_K * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_q5_K_amd_avx(const block_q5_K * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
+extern "C" void dequantize_row_q5_K_arm82(const block_q5_K * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_q5_K_arm80(const block_q5_K * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 
+extern "C" void dequantize_row_q6_K_amd_zen4(const block_q6_K * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_q6_K_amd_avx512(const block_q6_K * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_q6_K_amd_avx2(const block_q6_K * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_q6_K_amd_avx(const block_q6_K * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
+extern "C" void dequantize_row_q6_K_arm82(const block_q6_K * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_q6_K_arm80(const block_q6_K * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 
+extern "C" void dequantize_row_q8_K_amd_zen4(const block_q8_K * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_q8_K_amd_avx512(const block_q8_K * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_q8_K_amd_avx2(const block_q8_K * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_q8_K_amd_avx(const block_q8_K * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
+extern "C" void dequantize_row_q8_K_arm82(const block_q8_K * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_q8_K_arm80(const block_q8_K * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 
+extern "C" void dequantize_row_iq2_xxs_amd_zen4(const block_iq2_xxs * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_iq2_xxs_amd_avx512(const block_iq2_xxs * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_iq2_xxs_amd_avx2(const block_iq2_xxs * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_iq2_xxs_amd_avx(const block_iq2_xxs * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
+extern "C" void dequantize_row_iq2_xxs_arm82(const block_iq2_xxs * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_iq2_xxs_arm80(const block_iq2_xxs * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 
+extern "C" void dequantize_row_iq2_xs_amd_zen4 (const block_iq2_xs  * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_iq2_xs_amd_avx512 (const block_iq2_xs  * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_iq2_xs_amd_avx2 (const block_iq2_xs  * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_iq2_xs_amd_avx (const block_iq2_xs  * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
+extern "C" void dequantize_row_iq2_xs_arm82 (const block_iq2_xs  * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_iq2_xs_arm80 (const block_iq2_xs  * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 
+extern "C" void dequantize_row_iq2_s_amd_zen4  (const block_iq2_s   * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_iq2_s_amd_avx512  (const block_iq2_s   * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_iq2_s_amd_avx2  (const block_iq2_s   * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_iq2_s_amd_avx  (const block_iq2_s   * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
+extern "C" void dequantize_row_iq2_s_arm82  (const block_iq2_s   * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_iq2_s_arm80  (const block_iq2_s   * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 
+extern "C" void dequantize_row_iq3_xxs_amd_zen4(const block_iq3_xxs * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_iq3_xxs_amd_avx512(const block_iq3_xxs * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_iq3_xxs_amd_avx2(const block_iq3_xxs * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_iq3_xxs_amd_avx(const block_iq3_xxs * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
+extern "C" void dequantize_row_iq3_xxs_arm82(const block_iq3_xxs * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_iq3_xxs_arm80(const block_iq3_xxs * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 
+extern "C" void dequantize_row_iq1_s_amd_zen4  (const block_iq1_s   * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_iq1_s_amd_avx512  (const block_iq1_s   * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_iq1_s_amd_avx2  (const block_iq1_s   * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_iq1_s_amd_avx  (const block_iq1_s   * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
+extern "C" void dequantize_row_iq1_s_arm82  (const block_iq1_s   * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_iq1_s_arm80  (const block_iq1_s   * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 
+extern "C" void dequantize_row_iq1_m_amd_zen4  (const block_iq1_m   * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_iq1_m_amd_avx512  (const block_iq1_m   * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_iq1_m_amd_avx2  (const block_iq1_m   * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_iq1_m_amd_avx  (const block_iq1_m   * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
+extern "C" void dequantize_row_iq1_m_arm82  (const block_iq1_m   * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_iq1_m_arm80  (const block_iq1_m   * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 
+extern "C" void dequantize_row_iq4_nl_amd_zen4 (const block_iq4_nl  * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_iq4_nl_amd_avx512 (const block_iq4_nl  * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_iq4_nl_amd_avx2 (const block_iq4_nl  * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_iq4_nl_amd_avx (const block_iq4_nl  * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
+extern "C" void dequantize_row_iq4_nl_arm82 (const block_iq4_nl  * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_iq4_nl_arm80 (const block_iq4_nl  * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 
+extern "C" void dequantize_row_iq4_xs_amd_zen4 (const block_iq4_xs  * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_iq4_xs_amd_avx512 (const block_iq4_xs  * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_iq4_xs_amd_avx2 (const block_iq4_xs  * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_iq4_xs_amd_avx (const block_iq4_xs  * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
+extern "C" void dequantize_row_iq4_xs_arm82 (const block_iq4_xs  * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_iq4_xs_arm80 (const block_iq4_xs  * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 
+extern "C" void dequantize_row_iq3_s_amd_zen4  (const block_iq3_s   * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_iq3_s_amd_avx512  (const block_iq3_s   * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_iq3_s_amd_avx2  (const block_iq3_s   * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_iq3_s_amd_avx  (const block_iq3_s   * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
+extern "C" void dequantize_row_iq3_s_arm82  (const block_iq3_s   * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 extern "C" void dequantize_row_iq3_s_arm80  (const block_iq3_s   * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k);
 
+extern "C" void ggml_vec_dot_q4_0_q8_0_amd_zen4(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_q4_0_q8_0_amd_avx512(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_q4_0_q8_0_amd_avx2(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_q4_0_q8_0_amd_avx(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
+extern "C" void ggml_vec_dot_q4_0_q8_0_arm82(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_q4_0_q8_0_arm80(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 
+extern "C" void ggml_vec_dot_q4_1_q8_1_amd_zen4(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_q4_1_q8_1_amd_avx512(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_q4_1_q8_1_amd_avx2(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_q4_1_q8_1_amd_avx(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
+extern "C" void ggml_vec_dot_q4_1_q8_1_arm82(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_q4_1_q8_1_arm80(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 
+extern "C" void ggml_vec_dot_q5_0_q8_0_amd_zen4(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_q5_0_q8_0_amd_avx512(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_q5_0_q8_0_amd_avx2(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_q5_0_q8_0_amd_avx(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
+extern "C" void ggml_vec_dot_q5_0_q8_0_arm82(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_q5_0_q8_0_arm80(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 
+extern "C" void ggml_vec_dot_q5_1_q8_1_amd_zen4(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_q5_1_q8_1_amd_avx512(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_q5_1_q8_1_amd_avx2(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_q5_1_q8_1_amd_avx(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
+extern "C" void ggml_vec_dot_q5_1_q8_1_arm82(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_q5_1_q8_1_arm80(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 
+extern "C" void ggml_vec_dot_q8_0_q8_0_amd_zen4(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_q8_0_q8_0_amd_avx512(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_q8_0_q8_0_amd_avx2(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_q8_0_q8_0_amd_avx(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
+extern "C" void ggml_vec_dot_q8_0_q8_0_arm82(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_q8_0_q8_0_arm80(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 
+extern "C" void ggml_vec_dot_f8_e4m3_q8_0_amd_zen4(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
+extern "C" void ggml_vec_dot_f8_e4m3_q8_0_amd_avx512(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
+extern "C" void ggml_vec_dot_f8_e4m3_q8_0_amd_avx2(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
+extern "C" void ggml_vec_dot_f8_e4m3_q8_0_amd_avx(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
+extern "C" void ggml_vec_dot_f8_e4m3_q8_0_arm82(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
+extern "C" void ggml_vec_dot_f8_e4m3_q8_0_arm80(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
+
+extern "C" void ggml_vec_dot_q2_K_q8_K_amd_zen4(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_q2_K_q8_K_amd_avx512(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_q2_K_q8_K_amd_avx2(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_q2_K_q8_K_amd_avx(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
+extern "C" void ggml_vec_dot_q2_K_q8_K_arm82(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_q2_K_q8_K_arm80(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 
+extern "C" void ggml_vec_dot_q3_K_q8_K_amd_zen4(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_q3_K_q8_K_amd_avx512(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_q3_K_q8_K_amd_avx2(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_q3_K_q8_K_amd_avx(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
+extern "C" void ggml_vec_dot_q3_K_q8_K_arm82(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_q3_K_q8_K_arm80(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 
+extern "C" void ggml_vec_dot_q4_K_q8_K_amd_zen4(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_q4_K_q8_K_amd_avx512(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_q4_K_q8_K_amd_avx2(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_q4_K_q8_K_amd_avx(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
+extern "C" void ggml_vec_dot_q4_K_q8_K_arm82(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_q4_K_q8_K_arm80(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 
+extern "C" void ggml_vec_dot_q5_K_q8_K_amd_zen4(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_q5_K_q8_K_amd_avx512(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_q5_K_q8_K_amd_avx2(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_q5_K_q8_K_amd_avx(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
+extern "C" void ggml_vec_dot_q5_K_q8_K_arm82(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_q5_K_q8_K_arm80(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 
+extern "C" void ggml_vec_dot_q6_K_q8_K_amd_zen4(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_q6_K_q8_K_amd_avx512(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_q6_K_q8_K_amd_avx2(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_q6_K_q8_K_amd_avx(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
+extern "C" void ggml_vec_dot_q6_K_q8_K_arm82(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_q6_K_q8_K_arm80(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 
+extern "C" void ggml_vec_dot_iq2_xxs_q8_K_amd_zen4(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_iq2_xxs_q8_K_amd_avx512(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_iq2_xxs_q8_K_amd_avx2(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_iq2_xxs_q8_K_amd_avx(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
+extern "C" void ggml_vec_dot_iq2_xxs_q8_K_arm82(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_iq2_xxs_q8_K_arm80(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 
+extern "C" void ggml_vec_dot_iq2_xs_q8_K_amd_zen4 (int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_iq2_xs_q8_K_amd_avx512 (int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_iq2_xs_q8_K_amd_avx2 (int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_iq2_xs_q8_K_amd_avx (int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
+extern "C" void ggml_vec_dot_iq2_xs_q8_K_arm82 (int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_iq2_xs_q8_K_arm80 (int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 
+extern "C" void ggml_vec_dot_iq2_s_q8_K_amd_zen4  (int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_iq2_s_q8_K_amd_avx512  (int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_iq2_s_q8_K_amd_avx2  (int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_iq2_s_q8_K_amd_avx  (int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
+extern "C" void ggml_vec_dot_iq2_s_q8_K_arm82  (int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_iq2_s_q8_K_arm80  (int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 
+extern "C" void ggml_vec_dot_iq3_xxs_q8_K_amd_zen4(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_iq3_xxs_q8_K_amd_avx512(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_iq3_xxs_q8_K_amd_avx2(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_iq3_xxs_q8_K_amd_avx(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
+extern "C" void ggml_vec_dot_iq3_xxs_q8_K_arm82(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_iq3_xxs_q8_K_arm80(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 
+extern "C" void ggml_vec_dot_iq1_s_q8_K_amd_zen4  (int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_iq1_s_q8_K_amd_avx512  (int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_iq1_s_q8_K_amd_avx2  (int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_iq1_s_q8_K_amd_avx  (int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
+extern "C" void ggml_vec_dot_iq1_s_q8_K_arm82  (int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_iq1_s_q8_K_arm80  (int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 
+extern "C" void ggml_vec_dot_iq1_m_q8_K_amd_zen4  (int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_iq1_m_q8_K_amd_avx512  (int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_iq1_m_q8_K_amd_avx2  (int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_iq1_m_q8_K_amd_avx  (int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
+extern "C" void ggml_vec_dot_iq1_m_q8_K_arm82  (int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_iq1_m_q8_K_arm80  (int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 
+extern "C" void ggml_vec_dot_iq4_nl_q8_0_amd_zen4 (int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_iq4_nl_q8_0_amd_avx512 (int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_iq4_nl_q8_0_amd_avx2 (int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_iq4_nl_q8_0_amd_avx (int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
+extern "C" void ggml_vec_dot_iq4_nl_q8_0_arm82 (int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_iq4_nl_q8_0_arm80 (int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 
+extern "C" void ggml_vec_dot_iq4_xs_q8_K_amd_zen4 (int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_iq4_xs_q8_K_amd_avx512 (int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_iq4_xs_q8_K_amd_avx2 (int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_iq4_xs_q8_K_amd_avx (int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
+extern "C" void ggml_vec_dot_iq4_xs_q8_K_arm82 (int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_iq4_xs_q8_K_arm80 (int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 
+extern "C" void ggml_vec_dot_iq3_s_q8_K_amd_zen4  (int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_iq3_s_q8_K_amd_avx512  (int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_iq3_s_q8_K_amd_avx2  (int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_iq3_s_q8_K_amd_avx  (int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
+extern "C" void ggml_vec_dot_iq3_s_q8_K_arm82  (int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 extern "C" void ggml_vec_dot_iq3_s_q8_K_arm80  (int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);
 
+extern "C" size_t quantize_iq2_xxs_amd_zen4(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_iq2_xxs_amd_avx512(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_iq2_xxs_amd_avx2(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_iq2_xxs_amd_avx(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
+extern "C" size_t quantize_iq2_xxs_arm82(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_iq2_xxs_arm80(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 
+extern "C" size_t quantize_iq2_xs_amd_zen4 (const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_iq2_xs_amd_avx512 (const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_iq2_xs_amd_avx2 (const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_iq2_xs_amd_avx (const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
+extern "C" size_t quantize_iq2_xs_arm82 (const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_iq2_xs_arm80 (const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 
+extern "C" size_t quantize_iq2_s_amd_zen4  (const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_iq2_s_amd_avx512  (const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_iq2_s_amd_avx2  (const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_iq2_s_amd_avx  (const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
+extern "C" size_t quantize_iq2_s_arm82  (const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_iq2_s_arm80  (const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 
+extern "C" size_t quantize_iq3_xxs_amd_zen4(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_iq3_xxs_amd_avx512(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_iq3_xxs_amd_avx2(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_iq3_xxs_amd_avx(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
+extern "C" size_t quantize_iq3_xxs_arm82(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_iq3_xxs_arm80(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 
+extern "C" size_t quantize_iq1_s_amd_zen4  (const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_iq1_s_amd_avx512  (const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_iq1_s_amd_avx2  (const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_iq1_s_amd_avx  (const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
+extern "C" size_t quantize_iq1_s_arm82  (const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_iq1_s_arm80  (const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 
+extern "C" size_t quantize_iq1_m_amd_zen4  (const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_iq1_m_amd_avx512  (const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_iq1_m_amd_avx2  (const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_iq1_m_amd_avx  (const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
+extern "C" size_t quantize_iq1_m_arm82  (const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_iq1_m_arm80  (const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 
+extern "C" size_t quantize_iq4_nl_amd_zen4 (const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_iq4_nl_amd_avx512 (const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_iq4_nl_amd_avx2 (const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_iq4_nl_amd_avx (const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
+extern "C" size_t quantize_iq4_nl_arm82 (const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_iq4_nl_arm80 (const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 
+extern "C" size_t quantize_iq4_xs_amd_zen4 (const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_iq4_xs_amd_avx512 (const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_iq4_xs_amd_avx2 (const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_iq4_xs_amd_avx (const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
+extern "C" size_t quantize_iq4_xs_arm82 (const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_iq4_xs_arm80 (const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 
+extern "C" size_t quantize_iq3_s_amd_zen4  (const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_iq3_s_amd_avx512  (const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_iq3_s_amd_avx2  (const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_iq3_s_amd_avx  (const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
+extern "C" size_t quantize_iq3_s_arm82  (const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_iq3_s_arm80  (const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 
+extern "C" size_t quantize_q2_K_amd_zen4(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_q2_K_amd_avx512(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_q2_K_amd_avx2(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_q2_K_amd_avx(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
+extern "C" size_t quantize_q2_K_arm82(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_q2_K_arm80(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 
+extern "C" size_t quantize_q3_K_amd_zen4(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_q3_K_amd_avx512(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_q3_K_amd_avx2(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_q3_K_amd_avx(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
+extern "C" size_t quantize_q3_K_arm82(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_q3_K_arm80(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 
+extern "C" size_t quantize_q4_K_amd_zen4(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_q4_K_amd_avx512(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_q4_K_amd_avx2(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_q4_K_amd_avx(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
+extern "C" size_t quantize_q4_K_arm82(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_q4_K_arm80(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 
+extern "C" size_t quantize_q5_K_amd_zen4(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_q5_K_amd_avx512(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_q5_K_amd_avx2(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_q5_K_amd_avx(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
+extern "C" size_t quantize_q5_K_arm82(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_q5_K_arm80(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 
+extern "C" size_t quantize_q6_K_amd_zen4(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_q6_K_amd_avx512(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_q6_K_amd_avx2(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_q6_K_amd_avx(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
+extern "C" size_t quantize_q6_K_arm82(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_q6_K_arm80(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 
+extern "C" size_t quantize_q4_0_amd_zen4(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_q4_0_amd_avx512(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_q4_0_amd_avx2(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_q4_0_amd_avx(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
+extern "C" size_t quantize_q4_0_arm82(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_q4_0_arm80(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 
+extern "C" size_t quantize_q4_1_amd_zen4(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_q4_1_amd_avx512(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_q4_1_amd_avx2(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_q4_1_amd_avx(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
+extern "C" size_t quantize_q4_1_arm82(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_q4_1_arm80(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 
+extern "C" size_t quantize_q5_0_amd_zen4(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_q5_0_amd_avx512(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_q5_0_amd_avx2(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_q5_0_amd_avx(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
+extern "C" size_t quantize_q5_0_arm82(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_q5_0_arm80(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 
+extern "C" size_t quantize_q5_1_amd_zen4(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_q5_1_amd_avx512(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_q5_1_amd_avx2(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_q5_1_amd_avx(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
+extern "C" size_t quantize_q5_1_arm82(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_q5_1_arm80(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 
+extern "C" size_t quantize_q8_0_amd_zen4(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_q8_0_amd_avx512(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_q8_0_amd_avx2(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_q8_0_amd_avx(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
+extern "C" size_t quantize_q8_0_arm82(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 extern "C" size_t quantize_q8_0_arm80(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 
+extern "C" size_t quantize_f8_e4m3_amd_zen4(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
+extern "C" size_t quantize_f8_e4m3_amd_avx512(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
+extern "C" size_t quantize_f8_e4m3_amd_avx2(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
+extern "C" size_t quantize_f8_e4m3_amd_avx(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
+extern "C" size_t quantize_f8_e4m3_arm82(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
+extern "C" size_t quantize_f8_e4m3_arm80(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
+
+extern "C" void iq2xs_init_impl_amd_zen4(enum ggml_type type);
 extern "C" void iq2xs_init_impl_amd_avx512(enum ggml_type type);
 extern "C" void iq2xs_init_impl_amd_avx2(enum ggml_type type);
 extern "C" void iq2xs_init_impl_amd_avx(enum ggml_type type);
+extern "C" void iq2xs_init_impl_arm82(enum ggml_type type);
 extern "C" void iq2xs_init_impl_arm80(enum ggml_type type);
 
+extern "C" void iq2xs_free_impl_amd_zen4(enum ggml_type type);
 extern "C" void iq2xs_free_impl_amd_avx512(enum ggml_type type);
 extern "C" void iq2xs_free_impl_amd_avx2(enum ggml_type type);
 extern "C" void iq2xs_free_impl_amd_avx(enum ggml_type type);
+extern "C" void iq2xs_free_impl_arm82(enum ggml_type type);
 extern "C" void iq2xs_free_impl_arm80(enum ggml_type type);
 
+extern "C" void iq3xs_init_impl_amd_zen4(int grid_size);
 extern "C" void iq3xs_init_impl_amd_avx512(int grid_size);
 extern "C" void iq3xs_init_impl_amd_avx2(int grid_size);
 extern "C" void iq3xs_init_impl_amd_avx(int grid_size);
+extern "C" void iq3xs_init_impl_arm82(int grid_size);
 extern "C" void iq3xs_init_impl_arm80(int grid_size);
 
+extern "C" void iq3xs_free_impl_amd_zen4(int grid_size);
 extern "C" void iq3xs_free_impl_amd_avx512(int grid_size);
 extern "C" void iq3xs_free_impl_amd_avx2(int grid_size);
 extern "C" void iq3xs_free_impl_amd_avx(int grid_size);
+extern "C" void iq3xs_free_impl_arm82(int grid_size);
 extern "C" void iq3xs_free_impl_arm80(int grid_size);
 
+extern "C" bool ggml_validate_row_data_amd_zen4(enum ggml_type type, const void * data, size_t nbytes);
 extern "C" bool ggml_validate_row_data_amd_avx512(enum ggml_type type, const void * data, size_t nbytes);
 extern "C" bool ggml_validate_row_data_amd_avx2(enum ggml_type type, const void * data, size_t nbytes);
 extern "C" bool ggml_validate_row_data_amd_avx(enum ggml_type type, const void * data, size_t nbytes);
+extern "C" bool ggml_validate_row_data_arm82(enum ggml_type type, const void * data, size_t nbytes);
 extern "C" bool ggml_validate_row_data_arm80(enum ggml_type type, const void * data, size_t nbytes);
 
 static const struct QuantFuncs {
@@ -495,6 +724,7 @@ static const struct QuantFuncs {
     typeof(quantize_row_q5_1_reference) *ptr_quantize_row_q5_1_reference;
     typeof(quantize_row_q8_0_reference) *ptr_quantize_row_q8_0_reference;
     typeof(quantize_row_q8_1_reference) *ptr_quantize_row_q8_1_reference;
+    typeof(quantize_row_f8_e4m3_reference) *ptr_quantize_row_f8_e4m3_reference;
     typeof(quantize_row_q2_K_reference) *ptr_quantize_row_q2_K_reference;
     typeof(quantize_row_q3_K_reference) *ptr_quantize_row_q3_K_reference;
     typeof(quantize_row_q4_K_reference) *ptr_quantize_row_q4_K_reference;
@@ -512,6 +742,7 @@ static const struct QuantFuncs {
     typeof(quantize_row_q5_1) *ptr_quantize_row_q5_1;
     typeof(quantize_row_q8_0) *ptr_quantize_row_q8_0;
     typeof(quantize_row_q8_1) *ptr_quantize_row_q8_1;
+    typeof(quantize_row_f8_e4m3) *ptr_quantize_row_f8_e4m3;
     typeof(quantize_row_q2_K) *ptr_quantize_row_q2_K;
     typeof(quantize_row_q3_K) *ptr_quantize_row_q3_K;
     typeof(quantize_row_q4_K) *ptr_quantize_row_q4_K;
@@ -528,6 +759,7 @@ static const struct QuantFuncs {
     typeof(dequantize_row_q5_0) *ptr_dequantize_row_q5_0;
     typeof(dequantize_row_q5_1) *ptr_dequantize_row_q5_1;
     typeof(dequantize_row_q8_0) *ptr_dequantize_row_q8_0;
+    typeof(dequantize_row_f8_e4m3) *ptr_dequantize_row_f8_e4m3;
     typeof(dequantize_row_q2_K) *ptr_dequantize_row_q2_K;
     typeof(dequantize_row_q3_K) *ptr_dequantize_row_q3_K;
     typeof(dequantize_row_q4_K) *ptr_dequantize_row_q4_K;
@@ -548,6 +780,7 @@ static const struct QuantFuncs {
     typeof(ggml_vec_dot_q5_0_q8_0) *ptr_ggml_vec_dot_q5_0_q8_0;
     typeof(ggml_vec_dot_q5_1_q8_1) *ptr_ggml_vec_dot_q5_1_q8_1;
     typeof(ggml_vec_dot_q8_0_q8_0) *ptr_ggml_vec_dot_q8_0_q8_0;
+    typeof(ggml_vec_dot_f8_e4m3_q8_0) *ptr_ggml_vec_dot_f8_e4m3_q8_0;
     typeof(ggml_vec_dot_q2_K_q8_K) *ptr_ggml_vec_dot_q2_K_q8_K;
     typeof(ggml_vec_dot_q3_K_q8_K) *ptr_ggml_vec_dot_q3_K_q8_K;
     typeof(ggml_vec_dot_q4_K_q8_K) *ptr_ggml_vec_dot_q4_K_q8_K;
@@ -581,6 +814,7 @@ static const struct QuantFuncs {
     typeof(quantize_q5_0) *ptr_quantize_q5_0;
     typeof(quantize_q5_1) *ptr_quantize_q5_1;
     typeof(quantize_q8_0) *ptr_quantize_q8_0;
+    typeof(quantize_f8_e4m3) *ptr_quantize_f8_e4m3;
     typeof(iq2xs_init_impl) *ptr_iq2xs_init_impl;
     typeof(iq2xs_free_impl) *ptr_iq2xs_free_impl;
     typeof(iq3xs_init_impl) *ptr_iq3xs_init_impl;
@@ -588,6 +822,113 @@ static const struct QuantFuncs {
     typeof(ggml_validate_row_data) *ptr_ggml_validate_row_data;
 
     QuantFuncs() {
+#ifdef __x86_64__
+        if (X86_HAVE(FMA) && X86_HAVE(F16C) && X86_HAVE(AVX2) && X86_HAVE(AVX512F) && X86_HAVE(AVX512VL) && X86_HAVE(AVX512_VNNI) && X86_HAVE(AVX512VBMI)) {
+            ptr_quantize_row_q4_0_reference = quantize_row_q4_0_reference_amd_zen4;
+            ptr_quantize_row_q4_1_reference = quantize_row_q4_1_reference_amd_zen4;
+            ptr_quantize_row_q5_0_reference = quantize_row_q5_0_reference_amd_zen4;
+            ptr_quantize_row_q5_1_reference = quantize_row_q5_1_reference_amd_zen4;
+            ptr_quantize_row_q8_0_reference = quantize_row_q8_0_reference_amd_zen4;
+            ptr_quantize_row_q8_1_reference = quantize_row_q8_1_reference_amd_zen4;
+            ptr_quantize_row_f8_e4m3_reference = quantize_row_f8_e4m3_reference_amd_zen4;
+            ptr_quantize_row_q2_K_reference = quantize_row_q2_K_reference_amd_zen4;
+            ptr_quantize_row_q3_K_reference = quantize_row_q3_K_reference_amd_zen4;
+            ptr_quantize_row_q4_K_reference = quantize_row_q4_K_reference_amd_zen4;
+            ptr_quantize_row_q5_K_reference = quantize_row_q5_K_reference_amd_zen4;
+            ptr_quantize_row_q6_K_reference = quantize_row_q6_K_reference_amd_zen4;
+            ptr_quantize_row_q8_K_reference = quantize_row_q8_K_reference_amd_zen4;
+            ptr_quantize_row_iq3_xxs_reference = quantize_row_iq3_xxs_reference_amd_zen4;
+            ptr_quantize_row_iq4_nl_reference = quantize_row_iq4_nl_reference_amd_zen4;
+            ptr_quantize_row_iq4_xs_reference = quantize_row_iq4_xs_reference_amd_zen4;
+            ptr_quantize_row_iq3_s_reference = quantize_row_iq3_s_reference_amd_zen4;
+            ptr_quantize_row_iq2_s_reference = quantize_row_iq2_s_reference_amd_zen4;
+            ptr_quantize_row_q4_0 = quantize_row_q4_0_amd_zen4;
+            ptr_quantize_row_q4_1 = quantize_row_q4_1_amd_zen4;
+            ptr_quantize_row_q5_0 = quantize_row_q5_0_amd_zen4;
+            ptr_quantize_row_q5_1 = quantize_row_q5_1_amd_zen4;
+            ptr_quantize_row_q8_0 = quantize_row_q8_0_amd_zen4;
+            ptr_quantize_row_q8_1 = quantize_row_q8_1_amd_zen4;
+            ptr_quantize_row_f8_e4m3 = quantize_row_f8_e4m3_amd_zen4;
+            ptr_quantize_row_q2_K = quantize_row_q2_K_amd_zen4;
+            ptr_quantize_row_q3_K = quantize_row_q3_K_amd_zen4;
+            ptr_quantize_row_q4_K = quantize_row_q4_K_amd_zen4;
+            ptr_quantize_row_q5_K = quantize_row_q5_K_amd_zen4;
+            ptr_quantize_row_q6_K = quantize_row_q6_K_amd_zen4;
+            ptr_quantize_row_q8_K = quantize_row_q8_K_amd_zen4;
+            ptr_quantize_row_iq3_xxs = quantize_row_iq3_xxs_amd_zen4;
+            ptr_quantize_row_iq4_nl = quantize_row_iq4_nl_amd_zen4;
+            ptr_quantize_row_iq4_xs = quantize_row_iq4_xs_amd_zen4;
+            ptr_quantize_row_iq3_s = quantize_row_iq3_s_amd_zen4;
+            ptr_quantize_row_iq2_s = quantize_row_iq2_s_amd_zen4;
+            ptr_dequantize_row_q4_0 = dequantize_row_q4_0_amd_zen4;
+            ptr_dequantize_row_q4_1 = dequantize_row_q4_1_amd_zen4;
+            ptr_dequantize_row_q5_0 = dequantize_row_q5_0_amd_zen4;
+            ptr_dequantize_row_q5_1 = dequantize_row_q5_1_amd_zen4;
+            ptr_dequantize_row_q8_0 = dequantize_row_q8_0_amd_zen4;
+            ptr_dequantize_row_f8_e4m3 = dequantize_row_f8_e4m3_amd_zen4;
+            ptr_dequantize_row_q2_K = dequantize_row_q2_K_amd_zen4;
+            ptr_dequantize_row_q3_K = dequantize_row_q3_K_amd_zen4;
+            ptr_dequantize_row_q4_K = dequantize_row_q4_K_amd_zen4;
+            ptr_dequantize_row_q5_K = dequantize_row_q5_K_amd_zen4;
+            ptr_dequantize_row_q6_K = dequantize_row_q6_K_amd_zen4;
+            ptr_dequantize_row_q8_K = dequantize_row_q8_K_amd_zen4;
+            ptr_dequantize_row_iq2_xxs = dequantize_row_iq2_xxs_amd_zen4;
+            ptr_dequantize_row_iq2_xs = dequantize_row_iq2_xs_amd_zen4;
+            ptr_dequantize_row_iq2_s = dequantize_row_iq2_s_amd_zen4;
+            ptr_dequantize_row_iq3_xxs = dequantize_row_iq3_xxs_amd_zen4;
+            ptr_dequantize_row_iq1_s = dequantize_row_iq1_s_amd_zen4;
+            ptr_dequantize_row_iq1_m = dequantize_row_iq1_m_amd_zen4;
+            ptr_dequantize_row_iq4_nl = dequantize_row_iq4_nl_amd_zen4;
+            ptr_dequantize_row_iq4_xs = dequantize_row_iq4_xs_amd_zen4;
+            ptr_dequantize_row_iq3_s = dequantize_row_iq3_s_amd_zen4;
+            ptr_ggml_vec_dot_q4_0_q8_0 = ggml_vec_dot_q4_0_q8_0_amd_zen4;
+            ptr_ggml_vec_dot_q4_1_q8_1 = ggml_vec_dot_q4_1_q8_1_amd_zen4;
+            ptr_ggml_vec_dot_q5_0_q8_0 = ggml_vec_dot_q5_0_q8_0_amd_zen4;
+            ptr_ggml_vec_dot_q5_1_q8_1 = ggml_vec_dot_q5_1_q8_1_amd_zen4;
+            ptr_ggml_vec_dot_q8_0_q8_0 = ggml_vec_dot_q8_0_q8_0_amd_zen4;
+            ptr_ggml_vec_dot_f8_e4m3_q8_0 = ggml_vec_dot_f8_e4m3_q8_0_amd_zen4;
+            ptr_ggml_vec_dot_q2_K_q8_K = ggml_vec_dot_q2_K_q8_K_amd_zen4;
+            ptr_ggml_vec_dot_q3_K_q8_K = ggml_vec_dot_q3_K_q8_K_amd_zen4;
+            ptr_ggml_vec_dot_q4_K_q8_K = ggml_vec_dot_q4_K_q8_K_amd_zen4;
+            ptr_ggml_vec_dot_q5_K_q8_K = ggml_vec_dot_q5_K_q8_K_amd_zen4;
+            ptr_ggml_vec_dot_q6_K_q8_K = ggml_vec_dot_q6_K_q8_K_amd_zen4;
+            ptr_ggml_vec_dot_iq2_xxs_q8_K = ggml_vec_dot_iq2_xxs_q8_K_amd_zen4;
+            ptr_ggml_vec_dot_iq2_xs_q8_K = ggml_vec_dot_iq2_xs_q8_K_amd_zen4;
+            ptr_ggml_vec_dot_iq2_s_q8_K = ggml_vec_dot_iq2_s_q8_K_amd_zen4;
+            ptr_ggml_vec_dot_iq3_xxs_q8_K = ggml_vec_dot_iq3_xxs_q8_K_amd_zen4;
+            ptr_ggml_vec_dot_iq1_s_q8_K = ggml_vec_dot_iq1_s_q8_K_amd_zen4;
+            ptr_ggml_vec_dot_iq1_m_q8_K = ggml_vec_dot_iq1_m_q8_K_amd_zen4;
+            ptr_ggml_vec_dot_iq4_nl_q8_0 = ggml_vec_dot_iq4_nl_q8_0_amd_zen4;
+            ptr_ggml_vec_dot_iq4_xs_q8_K = ggml_vec_dot_iq4_xs_q8_K_amd_zen4;
+            ptr_ggml_vec_dot_iq3_s_q8_K = ggml_vec_dot_iq3_s_q8_K_amd_zen4;
+            ptr_quantize_iq2_xxs = quantize_iq2_xxs_amd_zen4;
+            ptr_quantize_iq2_xs = quantize_iq2_xs_amd_zen4;
+            ptr_quantize_iq2_s = quantize_iq2_s_amd_zen4;
+            ptr_quantize_iq3_xxs = quantize_iq3_xxs_amd_zen4;
+            ptr_quantize_iq1_s = quantize_iq1_s_amd_zen4;
+            ptr_quantize_iq1_m = quantize_iq1_m_amd_zen4;
+            ptr_quantize_iq4_nl = quantize_iq4_nl_amd_zen4;
+            ptr_quantize_iq4_xs = quantize_iq4_xs_amd_zen4;
+            ptr_quantize_iq3_s = quantize_iq3_s_amd_zen4;
+            ptr_quantize_q2_K = quantize_q2_K_amd_zen4;
+            ptr_quantize_q3_K = quantize_q3_K_amd_zen4;
+            ptr_quantize_q4_K = quantize_q4_K_amd_zen4;
+            ptr_quantize_q5_K = quantize_q5_K_amd_zen4;
+            ptr_quantize_q6_K = quantize_q6_K_amd_zen4;
+            ptr_quantize_q4_0 = quantize_q4_0_amd_zen4;
+            ptr_quantize_q4_1 = quantize_q4_1_amd_zen4;
+            ptr_quantize_q5_0 = quantize_q5_0_amd_zen4;
+            ptr_quantize_q5_1 = quantize_q5_1_amd_zen4;
+            ptr_quantize_q8_0 = quantize_q8_0_amd_zen4;
+            ptr_quantize_f8_e4m3 = quantize_f8_e4m3_amd_zen4;
+            ptr_iq2xs_init_impl = iq2xs_init_impl_amd_zen4;
+            ptr_iq2xs_free_impl = iq2xs_free_impl_amd_zen4;
+            ptr_iq3xs_init_impl = iq3xs_init_impl_amd_zen4;
+            ptr_iq3xs_free_impl = iq3xs_free_impl_amd_zen4;
+            ptr_ggml_validate_row_data = ggml_validate_row_data_amd_zen4;
+            return;
+        }
+#endif
 #ifdef __x86_64__
         if (X86_HAVE(FMA) && X86_HAVE(F16C) && X86_HAVE(AVX2) && X86_HAVE(AVX512F)) {
             ptr_quantize_row_q4_0_reference = quantize_row_q4_0_reference_amd_avx512;
@@ -596,6 +937,7 @@ static const struct QuantFuncs {
             ptr_quantize_row_q5_1_reference = quantize_row_q5_1_reference_amd_avx512;
             ptr_quantize_row_q8_0_reference = quantize_row_q8_0_reference_amd_avx512;
             ptr_quantize_row_q8_1_reference = quantize_row_q8_1_reference_amd_avx512;
+            ptr_quantize_row_f8_e4m3_reference = quantize_row_f8_e4m3_reference_amd_avx512;
             ptr_quantize_row_q2_K_reference = quantize_row_q2_K_reference_amd_avx512;
             ptr_quantize_row_q3_K_reference = quantize_row_q3_K_reference_amd_avx512;
             ptr_quantize_row_q4_K_reference = quantize_row_q4_K_reference_amd_avx512;
@@ -613,6 +955,7 @@ static const struct QuantFuncs {
             ptr_quantize_row_q5_1 = quantize_row_q5_1_amd_avx512;
             ptr_quantize_row_q8_0 = quantize_row_q8_0_amd_avx512;
             ptr_quantize_row_q8_1 = quantize_row_q8_1_amd_avx512;
+            ptr_quantize_row_f8_e4m3 = quantize_row_f8_e4m3_amd_avx512;
             ptr_quantize_row_q2_K = quantize_row_q2_K_amd_avx512;
             ptr_quantize_row_q3_K = quantize_row_q3_K_amd_avx512;
             ptr_quantize_row_q4_K = quantize_row_q4_K_amd_avx512;
@@ -629,6 +972,7 @@ static const struct QuantFuncs {
             ptr_dequantize_row_q5_0 = dequantize_row_q5_0_amd_avx512;
             ptr_dequantize_row_q5_1 = dequantize_row_q5_1_amd_avx512;
             ptr_dequantize_row_q8_0 = dequantize_row_q8_0_amd_avx512;
+            ptr_dequantize_row_f8_e4m3 = dequantize_row_f8_e4m3_amd_avx512;
             ptr_dequantize_row_q2_K = dequantize_row_q2_K_amd_avx512;
             ptr_dequantize_row_q3_K = dequantize_row_q3_K_amd_avx512;
             ptr_dequantize_row_q4_K = dequantize_row_q4_K_amd_avx512;
@@ -649,6 +993,7 @@ static const struct QuantFuncs {
             ptr_ggml_vec_dot_q5_0_q8_0 = ggml_vec_dot_q5_0_q8_0_amd_avx512;
             ptr_ggml_vec_dot_q5_1_q8_1 = ggml_vec_dot_q5_1_q8_1_amd_avx512;
             ptr_ggml_vec_dot_q8_0_q8_0 = ggml_vec_dot_q8_0_q8_0_amd_avx512;
+            ptr_ggml_vec_dot_f8_e4m3_q8_0 = ggml_vec_dot_f8_e4m3_q8_0_amd_avx512;
             ptr_ggml_vec_dot_q2_K_q8_K = ggml_vec_dot_q2_K_q8_K_amd_avx512;
             ptr_ggml_vec_dot_q3_K_q8_K = ggml_vec_dot_q3_K_q8_K_amd_avx512;
             ptr_ggml_vec_dot_q4_K_q8_K = ggml_vec_dot_q4_K_q8_K_amd_avx512;
@@ -682,6 +1027,7 @@ static const struct QuantFuncs {
             ptr_quantize_q5_0 = quantize_q5_0_amd_avx512;
             ptr_quantize_q5_1 = quantize_q5_1_amd_avx512;
             ptr_quantize_q8_0 = quantize_q8_0_amd_avx512;
+            ptr_quantize_f8_e4m3 = quantize_f8_e4m3_amd_avx512;
             ptr_iq2xs_init_impl = iq2xs_init_impl_amd_avx512;
             ptr_iq2xs_free_impl = iq2xs_free_impl_amd_avx512;
             ptr_iq3xs_init_impl = iq3xs_init_impl_amd_avx512;
@@ -689,6 +1035,8 @@ static const struct QuantFuncs {
             ptr_ggml_validate_row_data = ggml_validate_row_data_amd_avx512;
             return;
         }
+#endif
+#ifdef __x86_64__
         if (X86_HAVE(FMA) && X86_HAVE(F16C) && X86_HAVE(AVX2)) {
             ptr_quantize_row_q4_0_reference = quantize_row_q4_0_reference_amd_avx2;
             ptr_quantize_row_q4_1_reference = quantize_row_q4_1_reference_amd_avx2;
@@ -696,6 +1044,7 @@ static const struct QuantFuncs {
             ptr_quantize_row_q5_1_reference = quantize_row_q5_1_reference_amd_avx2;
             ptr_quantize_row_q8_0_reference = quantize_row_q8_0_reference_amd_avx2;
             ptr_quantize_row_q8_1_reference = quantize_row_q8_1_reference_amd_avx2;
+            ptr_quantize_row_f8_e4m3_reference = quantize_row_f8_e4m3_reference_amd_avx2;
             ptr_quantize_row_q2_K_reference = quantize_row_q2_K_reference_amd_avx2;
             ptr_quantize_row_q3_K_reference = quantize_row_q3_K_reference_amd_avx2;
             ptr_quantize_row_q4_K_reference = quantize_row_q4_K_reference_amd_avx2;
@@ -713,6 +1062,7 @@ static const struct QuantFuncs {
             ptr_quantize_row_q5_1 = quantize_row_q5_1_amd_avx2;
             ptr_quantize_row_q8_0 = quantize_row_q8_0_amd_avx2;
             ptr_quantize_row_q8_1 = quantize_row_q8_1_amd_avx2;
+            ptr_quantize_row_f8_e4m3 = quantize_row_f8_e4m3_amd_avx2;
             ptr_quantize_row_q2_K = quantize_row_q2_K_amd_avx2;
             ptr_quantize_row_q3_K = quantize_row_q3_K_amd_avx2;
             ptr_quantize_row_q4_K = quantize_row_q4_K_amd_avx2;
@@ -729,6 +1079,7 @@ static const struct QuantFuncs {
             ptr_dequantize_row_q5_0 = dequantize_row_q5_0_amd_avx2;
             ptr_dequantize_row_q5_1 = dequantize_row_q5_1_amd_avx2;
             ptr_dequantize_row_q8_0 = dequantize_row_q8_0_amd_avx2;
+            ptr_dequantize_row_f8_e4m3 = dequantize_row_f8_e4m3_amd_avx2;
             ptr_dequantize_row_q2_K = dequantize_row_q2_K_amd_avx2;
             ptr_dequantize_row_q3_K = dequantize_row_q3_K_amd_avx2;
             ptr_dequantize_row_q4_K = dequantize_row_q4_K_amd_avx2;
@@ -749,6 +1100,7 @@ static const struct QuantFuncs {
             ptr_ggml_vec_dot_q5_0_q8_0 = ggml_vec_dot_q5_0_q8_0_amd_avx2;
             ptr_ggml_vec_dot_q5_1_q8_1 = ggml_vec_dot_q5_1_q8_1_amd_avx2;
             ptr_ggml_vec_dot_q8_0_q8_0 = ggml_vec_dot_q8_0_q8_0_amd_avx2;
+            ptr_ggml_vec_dot_f8_e4m3_q8_0 = ggml_vec_dot_f8_e4m3_q8_0_amd_avx2;
             ptr_ggml_vec_dot_q2_K_q8_K = ggml_vec_dot_q2_K_q8_K_amd_avx2;
             ptr_ggml_vec_dot_q3_K_q8_K = ggml_vec_dot_q3_K_q8_K_amd_avx2;
             ptr_ggml_vec_dot_q4_K_q8_K = ggml_vec_dot_q4_K_q8_K_amd_avx2;
@@ -782,6 +1134,7 @@ static const struct QuantFuncs {
             ptr_quantize_q5_0 = quantize_q5_0_amd_avx2;
             ptr_quantize_q5_1 = quantize_q5_1_amd_avx2;
             ptr_quantize_q8_0 = quantize_q8_0_amd_avx2;
+            ptr_quantize_f8_e4m3 = quantize_f8_e4m3_amd_avx2;
             ptr_iq2xs_init_impl = iq2xs_init_impl_amd_avx2;
             ptr_iq2xs_free_impl = iq2xs_free_impl_amd_avx2;
             ptr_iq3xs_init_impl = iq3xs_init_impl_amd_avx2;
@@ -789,6 +1142,8 @@ static const struct QuantFuncs {
             ptr_ggml_validate_row_data = ggml_validate_row_data_amd_avx2;
             return;
         }
+#endif
+#ifdef __x86_64__
         if (1) {
             ptr_quantize_row_q4_0_reference = quantize_row_q4_0_reference_amd_avx;
             ptr_quantize_row_q4_1_reference = quantize_row_q4_1_reference_amd_avx;
@@ -796,6 +1151,7 @@ static const struct QuantFuncs {
             ptr_quantize_row_q5_1_reference = quantize_row_q5_1_reference_amd_avx;
             ptr_quantize_row_q8_0_reference = quantize_row_q8_0_reference_amd_avx;
             ptr_quantize_row_q8_1_reference = quantize_row_q8_1_reference_amd_avx;
+            ptr_quantize_row_f8_e4m3_reference = quantize_row_f8_e4m3_reference_amd_avx;
             ptr_quantize_row_q2_K_reference = quantize_row_q2_K_reference_amd_avx;
             ptr_quantize_row_q3_K_reference = quantize_row_q3_K_reference_amd_avx;
             ptr_quantize_row_q4_K_reference = quantize_row_q4_K_reference_amd_avx;
@@ -813,6 +1169,7 @@ static const struct QuantFuncs {
             ptr_quantize_row_q5_1 = quantize_row_q5_1_amd_avx;
             ptr_quantize_row_q8_0 = quantize_row_q8_0_amd_avx;
             ptr_quantize_row_q8_1 = quantize_row_q8_1_amd_avx;
+            ptr_quantize_row_f8_e4m3 = quantize_row_f8_e4m3_amd_avx;
             ptr_quantize_row_q2_K = quantize_row_q2_K_amd_avx;
             ptr_quantize_row_q3_K = quantize_row_q3_K_amd_avx;
             ptr_quantize_row_q4_K = quantize_row_q4_K_amd_avx;
@@ -829,6 +1186,7 @@ static const struct QuantFuncs {
             ptr_dequantize_row_q5_0 = dequantize_row_q5_0_amd_avx;
             ptr_dequantize_row_q5_1 = dequantize_row_q5_1_amd_avx;
             ptr_dequantize_row_q8_0 = dequantize_row_q8_0_amd_avx;
+            ptr_dequantize_row_f8_e4m3 = dequantize_row_f8_e4m3_amd_avx;
             ptr_dequantize_row_q2_K = dequantize_row_q2_K_amd_avx;
             ptr_dequantize_row_q3_K = dequantize_row_q3_K_amd_avx;
             ptr_dequantize_row_q4_K = dequantize_row_q4_K_amd_avx;
@@ -849,6 +1207,7 @@ static const struct QuantFuncs {
             ptr_ggml_vec_dot_q5_0_q8_0 = ggml_vec_dot_q5_0_q8_0_amd_avx;
             ptr_ggml_vec_dot_q5_1_q8_1 = ggml_vec_dot_q5_1_q8_1_amd_avx;
             ptr_ggml_vec_dot_q8_0_q8_0 = ggml_vec_dot_q8_0_q8_0_amd_avx;
+            ptr_ggml_vec_dot_f8_e4m3_q8_0 = ggml_vec_dot_f8_e4m3_q8_0_amd_avx;
             ptr_ggml_vec_dot_q2_K_q8_K = ggml_vec_dot_q2_K_q8_K_amd_avx;
             ptr_ggml_vec_dot_q3_K_q8_K = ggml_vec_dot_q3_K_q8_K_amd_avx;
             ptr_ggml_vec_dot_q4_K_q8_K = ggml_vec_dot_q4_K_q8_K_amd_avx;
@@ -882,6 +1241,7 @@ static const struct QuantFuncs {
             ptr_quantize_q5_0 = quantize_q5_0_amd_avx;
             ptr_quantize_q5_1 = quantize_q5_1_amd_avx;
             ptr_quantize_q8_0 = quantize_q8_0_amd_avx;
+            ptr_quantize_f8_e4m3 = quantize_f8_e4m3_amd_avx;
             ptr_iq2xs_init_impl = iq2xs_init_impl_amd_avx;
             ptr_iq2xs_free_impl = iq2xs_free_impl_amd_avx;
             ptr_iq3xs_init_impl = iq3xs_init_impl_amd_avx;
@@ -889,104 +1249,220 @@ static const struct QuantFuncs {
             ptr_ggml_validate_row_data = ggml_validate_row_data_amd_avx;
             return;
         }
-#else
-        ptr_quantize_row_q4_0_reference = quantize_row_q4_0_reference_arm80;
-        ptr_quantize_row_q4_1_reference = quantize_row_q4_1_reference_arm80;
-        ptr_quantize_row_q5_0_reference = quantize_row_q5_0_reference_arm80;
-        ptr_quantize_row_q5_1_reference = quantize_row_q5_1_reference_arm80;
-        ptr_quantize_row_q8_0_reference = quantize_row_q8_0_reference_arm80;
-        ptr_quantize_row_q8_1_reference = quantize_row_q8_1_reference_arm80;
-        ptr_quantize_row_q2_K_reference = quantize_row_q2_K_reference_arm80;
-        ptr_quantize_row_q3_K_reference = quantize_row_q3_K_reference_arm80;
-        ptr_quantize_row_q4_K_reference = quantize_row_q4_K_reference_arm80;
-        ptr_quantize_row_q5_K_reference = quantize_row_q5_K_reference_arm80;
-        ptr_quantize_row_q6_K_reference = quantize_row_q6_K_reference_arm80;
-        ptr_quantize_row_q8_K_reference = quantize_row_q8_K_reference_arm80;
-        ptr_quantize_row_iq3_xxs_reference = quantize_row_iq3_xxs_reference_arm80;
-        ptr_quantize_row_iq4_nl_reference = quantize_row_iq4_nl_reference_arm80;
-        ptr_quantize_row_iq4_xs_reference = quantize_row_iq4_xs_reference_arm80;
-        ptr_quantize_row_iq3_s_reference = quantize_row_iq3_s_reference_arm80;
-        ptr_quantize_row_iq2_s_reference = quantize_row_iq2_s_reference_arm80;
-        ptr_quantize_row_q4_0 = quantize_row_q4_0_arm80;
-        ptr_quantize_row_q4_1 = quantize_row_q4_1_arm80;
-        ptr_quantize_row_q5_0 = quantize_row_q5_0_arm80;
-        ptr_quantize_row_q5_1 = quantize_row_q5_1_arm80;
-        ptr_quantize_row_q8_0 = quantize_row_q8_0_arm80;
-        ptr_quantize_row_q8_1 = quantize_row_q8_1_arm80;
-        ptr_quantize_row_q2_K = quantize_row_q2_K_arm80;
-        ptr_quantize_row_q3_K = quantize_row_q3_K_arm80;
-        ptr_quantize_row_q4_K = quantize_row_q4_K_arm80;
-        ptr_quantize_row_q5_K = quantize_row_q5_K_arm80;
-        ptr_quantize_row_q6_K = quantize_row_q6_K_arm80;
-        ptr_quantize_row_q8_K = quantize_row_q8_K_arm80;
-        ptr_quantize_row_iq3_xxs = quantize_row_iq3_xxs_arm80;
-        ptr_quantize_row_iq4_nl = quantize_row_iq4_nl_arm80;
-        ptr_quantize_row_iq4_xs = quantize_row_iq4_xs_arm80;
-        ptr_quantize_row_iq3_s = quantize_row_iq3_s_arm80;
-        ptr_quantize_row_iq2_s = quantize_row_iq2_s_arm80;
-        ptr_dequantize_row_q4_0 = dequantize_row_q4_0_arm80;
-        ptr_dequantize_row_q4_1 = dequantize_row_q4_1_arm80;
-        ptr_dequantize_row_q5_0 = dequantize_row_q5_0_arm80;
-        ptr_dequantize_row_q5_1 = dequantize_row_q5_1_arm80;
-        ptr_dequantize_row_q8_0 = dequantize_row_q8_0_arm80;
-        ptr_dequantize_row_q2_K = dequantize_row_q2_K_arm80;
-        ptr_dequantize_row_q3_K = dequantize_row_q3_K_arm80;
-        ptr_dequantize_row_q4_K = dequantize_row_q4_K_arm80;
-        ptr_dequantize_row_q5_K = dequantize_row_q5_K_arm80;
-        ptr_dequantize_row_q6_K = dequantize_row_q6_K_arm80;
-        ptr_dequantize_row_q8_K = dequantize_row_q8_K_arm80;
-        ptr_dequantize_row_iq2_xxs = dequantize_row_iq2_xxs_arm80;
-        ptr_dequantize_row_iq2_xs = dequantize_row_iq2_xs_arm80;
-        ptr_dequantize_row_iq2_s = dequantize_row_iq2_s_arm80;
-        ptr_dequantize_row_iq3_xxs = dequantize_row_iq3_xxs_arm80;
-        ptr_dequantize_row_iq1_s = dequantize_row_iq1_s_arm80;
-        ptr_dequantize_row_iq1_m = dequantize_row_iq1_m_arm80;
-        ptr_dequantize_row_iq4_nl = dequantize_row_iq4_nl_arm80;
-        ptr_dequantize_row_iq4_xs = dequantize_row_iq4_xs_arm80;
-        ptr_dequantize_row_iq3_s = dequantize_row_iq3_s_arm80;
-        ptr_ggml_vec_dot_q4_0_q8_0 = ggml_vec_dot_q4_0_q8_0_arm80;
-        ptr_ggml_vec_dot_q4_1_q8_1 = ggml_vec_dot_q4_1_q8_1_arm80;
-        ptr_ggml_vec_dot_q5_0_q8_0 = ggml_vec_dot_q5_0_q8_0_arm80;
-        ptr_ggml_vec_dot_q5_1_q8_1 = ggml_vec_dot_q5_1_q8_1_arm80;
-        ptr_ggml_vec_dot_q8_0_q8_0 = ggml_vec_dot_q8_0_q8_0_arm80;
-        ptr_ggml_vec_dot_q2_K_q8_K = ggml_vec_dot_q2_K_q8_K_arm80;
-        ptr_ggml_vec_dot_q3_K_q8_K = ggml_vec_dot_q3_K_q8_K_arm80;
-        ptr_ggml_vec_dot_q4_K_q8_K = ggml_vec_dot_q4_K_q8_K_arm80;
-        ptr_ggml_vec_dot_q5_K_q8_K = ggml_vec_dot_q5_K_q8_K_arm80;
-        ptr_ggml_vec_dot_q6_K_q8_K = ggml_vec_dot_q6_K_q8_K_arm80;
-        ptr_ggml_vec_dot_iq2_xxs_q8_K = ggml_vec_dot_iq2_xxs_q8_K_arm80;
-        ptr_ggml_vec_dot_iq2_xs_q8_K = ggml_vec_dot_iq2_xs_q8_K_arm80;
-        ptr_ggml_vec_dot_iq2_s_q8_K = ggml_vec_dot_iq2_s_q8_K_arm80;
-        ptr_ggml_vec_dot_iq3_xxs_q8_K = ggml_vec_dot_iq3_xxs_q8_K_arm80;
-        ptr_ggml_vec_dot_iq1_s_q8_K = ggml_vec_dot_iq1_s_q8_K_arm80;
-        ptr_ggml_vec_dot_iq1_m_q8_K = ggml_vec_dot_iq1_m_q8_K_arm80;
-        ptr_ggml_vec_dot_iq4_nl_q8_0 = ggml_vec_dot_iq4_nl_q8_0_arm80;
-        ptr_ggml_vec_dot_iq4_xs_q8_K = ggml_vec_dot_iq4_xs_q8_K_arm80;
-        ptr_ggml_vec_dot_iq3_s_q8_K = ggml_vec_dot_iq3_s_q8_K_arm80;
-        ptr_quantize_iq2_xxs = quantize_iq2_xxs_arm80;
-        ptr_quantize_iq2_xs = quantize_iq2_xs_arm80;
-        ptr_quantize_iq2_s = quantize_iq2_s_arm80;
-        ptr_quantize_iq3_xxs = quantize_iq3_xxs_arm80;
-        ptr_quantize_iq1_s = quantize_iq1_s_arm80;
-        ptr_quantize_iq1_m = quantize_iq1_m_arm80;
-        ptr_quantize_iq4_nl = quantize_iq4_nl_arm80;
-        ptr_quantize_iq4_xs = quantize_iq4_xs_arm80;
-        ptr_quantize_iq3_s = quantize_iq3_s_arm80;
-        ptr_quantize_q2_K = quantize_q2_K_arm80;
-        ptr_quantize_q3_K = quantize_q3_K_arm80;
-        ptr_quantize_q4_K = quantize_q4_K_arm80;
-        ptr_quantize_q5_K = quantize_q5_K_arm80;
-        ptr_quantize_q6_K = quantize_q6_K_arm80;
-        ptr_quantize_q4_0 = quantize_q4_0_arm80;
-        ptr_quantize_q4_1 = quantize_q4_1_arm80;
-        ptr_quantize_q5_0 = quantize_q5_0_arm80;
-        ptr_quantize_q5_1 = quantize_q5_1_arm80;
-        ptr_quantize_q8_0 = quantize_q8_0_arm80;
-        ptr_iq2xs_init_impl = iq2xs_init_impl_arm80;
-        ptr_iq2xs_free_impl = iq2xs_free_impl_arm80;
-        ptr_iq3xs_init_impl = iq3xs_init_impl_arm80;
-        ptr_iq3xs_free_impl = iq3xs_free_impl_arm80;
-        ptr_ggml_validate_row_data = ggml_validate_row_data_arm80;
+#endif
+#ifdef __aarch64__
+        if ((getauxval(AT_HWCAP) & HWCAP_FPHP) && (getauxval(AT_HWCAP) & HWCAP_ASIMDHP) && (getauxval(AT_HWCAP) & HWCAP_ASIMDDP)) {
+            ptr_quantize_row_q4_0_reference = quantize_row_q4_0_reference_arm82;
+            ptr_quantize_row_q4_1_reference = quantize_row_q4_1_reference_arm82;
+            ptr_quantize_row_q5_0_reference = quantize_row_q5_0_reference_arm82;
+            ptr_quantize_row_q5_1_reference = quantize_row_q5_1_reference_arm82;
+            ptr_quantize_row_q8_0_reference = quantize_row_q8_0_reference_arm82;
+            ptr_quantize_row_q8_1_reference = quantize_row_q8_1_reference_arm82;
+            ptr_quantize_row_f8_e4m3_reference = quantize_row_f8_e4m3_reference_arm82;
+            ptr_quantize_row_q2_K_reference = quantize_row_q2_K_reference_arm82;
+            ptr_quantize_row_q3_K_reference = quantize_row_q3_K_reference_arm82;
+            ptr_quantize_row_q4_K_reference = quantize_row_q4_K_reference_arm82;
+            ptr_quantize_row_q5_K_reference = quantize_row_q5_K_reference_arm82;
+            ptr_quantize_row_q6_K_reference = quantize_row_q6_K_reference_arm82;
+            ptr_quantize_row_q8_K_reference = quantize_row_q8_K_reference_arm82;
+            ptr_quantize_row_iq3_xxs_reference = quantize_row_iq3_xxs_reference_arm82;
+            ptr_quantize_row_iq4_nl_reference = quantize_row_iq4_nl_reference_arm82;
+            ptr_quantize_row_iq4_xs_reference = quantize_row_iq4_xs_reference_arm82;
+            ptr_quantize_row_iq3_s_reference = quantize_row_iq3_s_reference_arm82;
+            ptr_quantize_row_iq2_s_reference = quantize_row_iq2_s_reference_arm82;
+            ptr_quantize_row_q4_0 = quantize_row_q4_0_arm82;
+            ptr_quantize_row_q4_1 = quantize_row_q4_1_arm82;
+            ptr_quantize_row_q5_0 = quantize_row_q5_0_arm82;
+            ptr_quantize_row_q5_1 = quantize_row_q5_1_arm82;
+            ptr_quantize_row_q8_0 = quantize_row_q8_0_arm82;
+            ptr_quantize_row_q8_1 = quantize_row_q8_1_arm82;
+            ptr_quantize_row_f8_e4m3 = quantize_row_f8_e4m3_arm82;
+            ptr_quantize_row_q2_K = quantize_row_q2_K_arm82;
+            ptr_quantize_row_q3_K = quantize_row_q3_K_arm82;
+            ptr_quantize_row_q4_K = quantize_row_q4_K_arm82;
+            ptr_quantize_row_q5_K = quantize_row_q5_K_arm82;
+            ptr_quantize_row_q6_K = quantize_row_q6_K_arm82;
+            ptr_quantize_row_q8_K = quantize_row_q8_K_arm82;
+            ptr_quantize_row_iq3_xxs = quantize_row_iq3_xxs_arm82;
+            ptr_quantize_row_iq4_nl = quantize_row_iq4_nl_arm82;
+            ptr_quantize_row_iq4_xs = quantize_row_iq4_xs_arm82;
+            ptr_quantize_row_iq3_s = quantize_row_iq3_s_arm82;
+            ptr_quantize_row_iq2_s = quantize_row_iq2_s_arm82;
+            ptr_dequantize_row_q4_0 = dequantize_row_q4_0_arm82;
+            ptr_dequantize_row_q4_1 = dequantize_row_q4_1_arm82;
+            ptr_dequantize_row_q5_0 = dequantize_row_q5_0_arm82;
+            ptr_dequantize_row_q5_1 = dequantize_row_q5_1_arm82;
+            ptr_dequantize_row_q8_0 = dequantize_row_q8_0_arm82;
+            ptr_dequantize_row_f8_e4m3 = dequantize_row_f8_e4m3_arm82;
+            ptr_dequantize_row_q2_K = dequantize_row_q2_K_arm82;
+            ptr_dequantize_row_q3_K = dequantize_row_q3_K_arm82;
+            ptr_dequantize_row_q4_K = dequantize_row_q4_K_arm82;
+            ptr_dequantize_row_q5_K = dequantize_row_q5_K_arm82;
+            ptr_dequantize_row_q6_K = dequantize_row_q6_K_arm82;
+            ptr_dequantize_row_q8_K = dequantize_row_q8_K_arm82;
+            ptr_dequantize_row_iq2_xxs = dequantize_row_iq2_xxs_arm82;
+            ptr_dequantize_row_iq2_xs = dequantize_row_iq2_xs_arm82;
+            ptr_dequantize_row_iq2_s = dequantize_row_iq2_s_arm82;
+            ptr_dequantize_row_iq3_xxs = dequantize_row_iq3_xxs_arm82;
+            ptr_dequantize_row_iq1_s = dequantize_row_iq1_s_arm82;
+            ptr_dequantize_row_iq1_m = dequantize_row_iq1_m_arm82;
+            ptr_dequantize_row_iq4_nl = dequantize_row_iq4_nl_arm82;
+            ptr_dequantize_row_iq4_xs = dequantize_row_iq4_xs_arm82;
+            ptr_dequantize_row_iq3_s = dequantize_row_iq3_s_arm82;
+            ptr_ggml_vec_dot_q4_0_q8_0 = ggml_vec_dot_q4_0_q8_0_arm82;
+            ptr_ggml_vec_dot_q4_1_q8_1 = ggml_vec_dot_q4_1_q8_1_arm82;
+            ptr_ggml_vec_dot_q5_0_q8_0 = ggml_vec_dot_q5_0_q8_0_arm82;
+            ptr_ggml_vec_dot_q5_1_q8_1 = ggml_vec_dot_q5_1_q8_1_arm82;
+            ptr_ggml_vec_dot_q8_0_q8_0 = ggml_vec_dot_q8_0_q8_0_arm82;
+            ptr_ggml_vec_dot_f8_e4m3_q8_0 = ggml_vec_dot_f8_e4m3_q8_0_arm82;
+            ptr_ggml_vec_dot_q2_K_q8_K = ggml_vec_dot_q2_K_q8_K_arm82;
+            ptr_ggml_vec_dot_q3_K_q8_K = ggml_vec_dot_q3_K_q8_K_arm82;
+            ptr_ggml_vec_dot_q4_K_q8_K = ggml_vec_dot_q4_K_q8_K_arm82;
+            ptr_ggml_vec_dot_q5_K_q8_K = ggml_vec_dot_q5_K_q8_K_arm82;
+            ptr_ggml_vec_dot_q6_K_q8_K = ggml_vec_dot_q6_K_q8_K_arm82;
+            ptr_ggml_vec_dot_iq2_xxs_q8_K = ggml_vec_dot_iq2_xxs_q8_K_arm82;
+            ptr_ggml_vec_dot_iq2_xs_q8_K = ggml_vec_dot_iq2_xs_q8_K_arm82;
+            ptr_ggml_vec_dot_iq2_s_q8_K = ggml_vec_dot_iq2_s_q8_K_arm82;
+            ptr_ggml_vec_dot_iq3_xxs_q8_K = ggml_vec_dot_iq3_xxs_q8_K_arm82;
+            ptr_ggml_vec_dot_iq1_s_q8_K = ggml_vec_dot_iq1_s_q8_K_arm82;
+            ptr_ggml_vec_dot_iq1_m_q8_K = ggml_vec_dot_iq1_m_q8_K_arm82;
+            ptr_ggml_vec_dot_iq4_nl_q8_0 = ggml_vec_dot_iq4_nl_q8_0_arm82;
+            ptr_ggml_vec_dot_iq4_xs_q8_K = ggml_vec_dot_iq4_xs_q8_K_arm82;
+            ptr_ggml_vec_dot_iq3_s_q8_K = ggml_vec_dot_iq3_s_q8_K_arm82;
+            ptr_quantize_iq2_xxs = quantize_iq2_xxs_arm82;
+            ptr_quantize_iq2_xs = quantize_iq2_xs_arm82;
+            ptr_quantize_iq2_s = quantize_iq2_s_arm82;
+            ptr_quantize_iq3_xxs = quantize_iq3_xxs_arm82;
+            ptr_quantize_iq1_s = quantize_iq1_s_arm82;
+            ptr_quantize_iq1_m = quantize_iq1_m_arm82;
+            ptr_quantize_iq4_nl = quantize_iq4_nl_arm82;
+            ptr_quantize_iq4_xs = quantize_iq4_xs_arm82;
+            ptr_quantize_iq3_s = quantize_iq3_s_arm82;
+            ptr_quantize_q2_K = quantize_q2_K_arm82;
+            ptr_quantize_q3_K = quantize_q3_K_arm82;
+            ptr_quantize_q4_K = quantize_q4_K_arm82;
+            ptr_quantize_q5_K = quantize_q5_K_arm82;
+            ptr_quantize_q6_K = quantize_q6_K_arm82;
+            ptr_quantize_q4_0 = quantize_q4_0_arm82;
+            ptr_quantize_q4_1 = quantize_q4_1_arm82;
+            ptr_quantize_q5_0 = quantize_q5_0_arm82;
+            ptr_quantize_q5_1 = quantize_q5_1_arm82;
+            ptr_quantize_q8_0 = quantize_q8_0_arm82;
+            ptr_quantize_f8_e4m3 = quantize_f8_e4m3_arm82;
+            ptr_iq2xs_init_impl = iq2xs_init_impl_arm82;
+            ptr_iq2xs_free_impl = iq2xs_free_impl_arm82;
+            ptr_iq3xs_init_impl = iq3xs_init_impl_arm82;
+            ptr_iq3xs_free_impl = iq3xs_free_impl_arm82;
+            ptr_ggml_validate_row_data = ggml_validate_row_data_arm82;
+            return;
+        }
+#endif
+#ifdef __aarch64__
+        if (1) {
+            ptr_quantize_row_q4_0_reference = quantize_row_q4_0_reference_arm80;
+            ptr_quantize_row_q4_1_reference = quantize_row_q4_1_reference_arm80;
+            ptr_quantize_row_q5_0_reference = quantize_row_q5_0_reference_arm80;
+            ptr_quantize_row_q5_1_reference = quantize_row_q5_1_reference_arm80;
+            ptr_quantize_row_q8_0_reference = quantize_row_q8_0_reference_arm80;
+            ptr_quantize_row_q8_1_reference = quantize_row_q8_1_reference_arm80;
+            ptr_quantize_row_f8_e4m3_reference = quantize_row_f8_e4m3_reference_arm80;
+            ptr_quantize_row_q2_K_reference = quantize_row_q2_K_reference_arm80;
+            ptr_quantize_row_q3_K_reference = quantize_row_q3_K_reference_arm80;
+            ptr_quantize_row_q4_K_reference = quantize_row_q4_K_reference_arm80;
+            ptr_quantize_row_q5_K_reference = quantize_row_q5_K_reference_arm80;
+            ptr_quantize_row_q6_K_reference = quantize_row_q6_K_reference_arm80;
+            ptr_quantize_row_q8_K_reference = quantize_row_q8_K_reference_arm80;
+            ptr_quantize_row_iq3_xxs_reference = quantize_row_iq3_xxs_reference_arm80;
+            ptr_quantize_row_iq4_nl_reference = quantize_row_iq4_nl_reference_arm80;
+            ptr_quantize_row_iq4_xs_reference = quantize_row_iq4_xs_reference_arm80;
+            ptr_quantize_row_iq3_s_reference = quantize_row_iq3_s_reference_arm80;
+            ptr_quantize_row_iq2_s_reference = quantize_row_iq2_s_reference_arm80;
+            ptr_quantize_row_q4_0 = quantize_row_q4_0_arm80;
+            ptr_quantize_row_q4_1 = quantize_row_q4_1_arm80;
+            ptr_quantize_row_q5_0 = quantize_row_q5_0_arm80;
+            ptr_quantize_row_q5_1 = quantize_row_q5_1_arm80;
+            ptr_quantize_row_q8_0 = quantize_row_q8_0_arm80;
+            ptr_quantize_row_q8_1 = quantize_row_q8_1_arm80;
+            ptr_quantize_row_f8_e4m3 = quantize_row_f8_e4m3_arm80;
+            ptr_quantize_row_q2_K = quantize_row_q2_K_arm80;
+            ptr_quantize_row_q3_K = quantize_row_q3_K_arm80;
+            ptr_quantize_row_q4_K = quantize_row_q4_K_arm80;
+            ptr_quantize_row_q5_K = quantize_row_q5_K_arm80;
+            ptr_quantize_row_q6_K = quantize_row_q6_K_arm80;
+            ptr_quantize_row_q8_K = quantize_row_q8_K_arm80;
+            ptr_quantize_row_iq3_xxs = quantize_row_iq3_xxs_arm80;
+            ptr_quantize_row_iq4_nl = quantize_row_iq4_nl_arm80;
+            ptr_quantize_row_iq4_xs = quantize_row_iq4_xs_arm80;
+            ptr_quantize_row_iq3_s = quantize_row_iq3_s_arm80;
+            ptr_quantize_row_iq2_s = quantize_row_iq2_s_arm80;
+            ptr_dequantize_row_q4_0 = dequantize_row_q4_0_arm80;
+            ptr_dequantize_row_q4_1 = dequantize_row_q4_1_arm80;
+            ptr_dequantize_row_q5_0 = dequantize_row_q5_0_arm80;
+            ptr_dequantize_row_q5_1 = dequantize_row_q5_1_arm80;
+            ptr_dequantize_row_q8_0 = dequantize_row_q8_0_arm80;
+            ptr_dequantize_row_f8_e4m3 = dequantize_row_f8_e4m3_arm80;
+            ptr_dequantize_row_q2_K = dequantize_row_q2_K_arm80;
+            ptr_dequantize_row_q3_K = dequantize_row_q3_K_arm80;
+            ptr_dequantize_row_q4_K = dequantize_row_q4_K_arm80;
+            ptr_dequantize_row_q5_K = dequantize_row_q5_K_arm80;
+            ptr_dequantize_row_q6_K = dequantize_row_q6_K_arm80;
+            ptr_dequantize_row_q8_K = dequantize_row_q8_K_arm80;
+            ptr_dequantize_row_iq2_xxs = dequantize_row_iq2_xxs_arm80;
+            ptr_dequantize_row_iq2_xs = dequantize_row_iq2_xs_arm80;
+            ptr_dequantize_row_iq2_s = dequantize_row_iq2_s_arm80;
+            ptr_dequantize_row_iq3_xxs = dequantize_row_iq3_xxs_arm80;
+            ptr_dequantize_row_iq1_s = dequantize_row_iq1_s_arm80;
+            ptr_dequantize_row_iq1_m = dequantize_row_iq1_m_arm80;
+            ptr_dequantize_row_iq4_nl = dequantize_row_iq4_nl_arm80;
+            ptr_dequantize_row_iq4_xs = dequantize_row_iq4_xs_arm80;
+            ptr_dequantize_row_iq3_s = dequantize_row_iq3_s_arm80;
+            ptr_ggml_vec_dot_q4_0_q8_0 = ggml_vec_dot_q4_0_q8_0_arm80;
+            ptr_ggml_vec_dot_q4_1_q8_1 = ggml_vec_dot_q4_1_q8_1_arm80;
+            ptr_ggml_vec_dot_q5_0_q8_0 = ggml_vec_dot_q5_0_q8_0_arm80;
+            ptr_ggml_vec_dot_q5_1_q8_1 = ggml_vec_dot_q5_1_q8_1_arm80;
+            ptr_ggml_vec_dot_q8_0_q8_0 = ggml_vec_dot_q8_0_q8_0_arm80;
+            ptr_ggml_vec_dot_f8_e4m3_q8_0 = ggml_vec_dot_f8_e4m3_q8_0_arm80;
+            ptr_ggml_vec_dot_q2_K_q8_K = ggml_vec_dot_q2_K_q8_K_arm80;
+            ptr_ggml_vec_dot_q3_K_q8_K = ggml_vec_dot_q3_K_q8_K_arm80;
+            ptr_ggml_vec_dot_q4_K_q8_K = ggml_vec_dot_q4_K_q8_K_arm80;
+            ptr_ggml_vec_dot_q5_K_q8_K = ggml_vec_dot_q5_K_q8_K_arm80;
+            ptr_ggml_vec_dot_q6_K_q8_K = ggml_vec_dot_q6_K_q8_K_arm80;
+            ptr_ggml_vec_dot_iq2_xxs_q8_K = ggml_vec_dot_iq2_xxs_q8_K_arm80;
+            ptr_ggml_vec_dot_iq2_xs_q8_K = ggml_vec_dot_iq2_xs_q8_K_arm80;
+            ptr_ggml_vec_dot_iq2_s_q8_K = ggml_vec_dot_iq2_s_q8_K_arm80;
+            ptr_ggml_vec_dot_iq3_xxs_q8_K = ggml_vec_dot_iq3_xxs_q8_K_arm80;
+            ptr_ggml_vec_dot_iq1_s_q8_K = ggml_vec_dot_iq1_s_q8_K_arm80;
+            ptr_ggml_vec_dot_iq1_m_q8_K = ggml_vec_dot_iq1_m_q8_K_arm80;
+            ptr_ggml_vec_dot_iq4_nl_q8_0 = ggml_vec_dot_iq4_nl_q8_0_arm80;
+            ptr_ggml_vec_dot_iq4_xs_q8_K = ggml_vec_dot_iq4_xs_q8_K_arm80;
+            ptr_ggml_vec_dot_iq3_s_q8_K = ggml_vec_dot_iq3_s_q8_K_arm80;
+            ptr_quantize_iq2_xxs = quantize_iq2_xxs_arm80;
+            ptr_quantize_iq2_xs = quantize_iq2_xs_arm80;
+            ptr_quantize_iq2_s = quantize_iq2_s_arm80;
+            ptr_quantize_iq3_xxs = quantize_iq3_xxs_arm80;
+            ptr_quantize_iq1_s = quantize_iq1_s_arm80;
+            ptr_quantize_iq1_m = quantize_iq1_m_arm80;
+            ptr_quantize_iq4_nl = quantize_iq4_nl_arm80;
+            ptr_quantize_iq4_xs = quantize_iq4_xs_arm80;
+            ptr_quantize_iq3_s = quantize_iq3_s_arm80;
+            ptr_quantize_q2_K = quantize_q2_K_arm80;
+            ptr_quantize_q3_K = quantize_q3_K_arm80;
+            ptr_quantize_q4_K = quantize_q4_K_arm80;
+            ptr_quantize_q5_K = quantize_q5_K_arm80;
+            ptr_quantize_q6_K = quantize_q6_K_arm80;
+            ptr_quantize_q4_0 = quantize_q4_0_arm80;
+            ptr_quantize_q4_1 = quantize_q4_1_arm80;
+            ptr_quantize_q5_0 = quantize_q5_0_arm80;
+            ptr_quantize_q5_1 = quantize_q5_1_arm80;
+            ptr_quantize_q8_0 = quantize_q8_0_arm80;
+            ptr_quantize_f8_e4m3 = quantize_f8_e4m3_arm80;
+            ptr_iq2xs_init_impl = iq2xs_init_impl_arm80;
+            ptr_iq2xs_free_impl = iq2xs_free_impl_arm80;
+            ptr_iq3xs_init_impl = iq3xs_init_impl_arm80;
+            ptr_iq3xs_free_impl = iq3xs_free_impl_arm80;
+            ptr_ggml_validate_row_data = ggml_validate_row_data_arm80;
+            return;
+        }
 #endif
     }
 } funcs;
@@ -1015,6 +1491,10 @@ void quantize_row_q8_1_reference(const float * GGML_RESTRICT x, block_q8_1 * GGM
   return funcs.ptr_quantize_row_q8_1_reference(x, y, k);
 }
 
+void quantize_row_f8_e4m3_reference(const float * GGML_RESTRICT x, block_f8_e4m3 * GGML_RESTRICT y, int64_t k) {
+  return funcs.ptr_quantize_row_f8_e4m3_reference(x, y, k);
+}
+
 void quantize_row_q2_K_reference(const float * GGML_RESTRICT x, block_q2_K * GGML_RESTRICT y, int64_t k) {
   return funcs.ptr_quantize_row_q2_K_reference(x, y, k);
 }
@@ -1083,6 +1563,10 @@ void quantize_row_q8_1(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, in
   return funcs.ptr_quantize_row_q8_1(x, y, k);
 }
 
+void quantize_row_f8_e4m3(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k) {
+  return funcs.ptr_quantize_row_f8_e4m3(x, y, k);
+}
+
 void quantize_row_q2_K(const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int64_t k) {
   return funcs.ptr_quantize_row_q2_K(x, y, k);
 }
@@ -1147,6 +1631,10 @@ void dequantize_row_q8_0(const block_q8_0 * GGML_RESTRICT x, float * GGML_RESTRI
   return funcs.ptr_dequantize_row_q8_0(x, y, k);
 }
 
+void dequantize_row_f8_e4m3(const block_f8_e4m3 * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k) {
+  return funcs.ptr_dequantize_row_f8_e4m3(x, y, k);
+}
+
 void dequantize_row_q2_K(const block_q2_K * GGML_RESTRICT x, float * GGML_RESTRICT y, int64_t k) {
   return funcs.ptr_dequantize_row_q2_K(x, y, k);
 }
@@ -1227,6 +1715,10 @@ void ggml_vec_dot_q8_0_q8_0(int n, float * GGML_RESTRICT s, size_t bs, const voi
   return funcs.ptr_ggml_vec_dot_q8_0_q8_0(n, s, bs, vx, bx, vy, by, nrc);
 }
 
+void ggml_vec_dot_f8_e4m3_q8_0(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc) {
+  return funcs.ptr_ggml_vec_dot_f8_e4m3_q8_0(n, s, bs, vx, bx, vy, by, nrc);
+}
+
 void ggml_vec_dot_q2_K_q8_K(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc) {
   return funcs.ptr_ggml_vec_dot_q2_K_q8_K(n, s, bs, vx, bx, vy, by, nrc);
 }
@@ -1359,6 +1851,10 @@ size_t quantize_q8_0(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst,
   return funcs.ptr_quantize_q8_0(src, dst, nrows, n_per_row, imatrix);
 }
 
+size_t quantize_f8_e4m3(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix) {
+  return funcs.ptr_quantize_f8_e4m3(src, dst, nrows, n_per_row, imatrix);
+}
+
 void iq2xs_init_impl(enum ggml_type type) {
   return funcs.ptr_iq2xs_init_impl(type);
 }
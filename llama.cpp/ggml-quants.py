@@ -12,9 +12,11 @@ FUNCS.append(('ggml_validate_row_data', 'bool ggml_validate_row_data(enum ggml_t
 # END SPECIAL FUNCTIONS
 
 ARCHS = (
-  ('amd_avx512', '__x86_64__', ('FMA', 'F16C', 'AVX2', 'AVX512F')),
-  ('amd_avx2', '__x86_64__', ('FMA', 'F16C', 'AVX2')),
+  ('amd_zen4', '__x86_64__', ('X86_HAVE(FMA)', 'X86_HAVE(F16C)', 'X86_HAVE(AVX2)', 'X86_HAVE(AVX512F)', 'X86_HAVE(AVX512VL)', 'X86_HAVE(AVX512_VNNI)', 'X86_HAVE(AVX512VBMI)')),
+  ('amd_avx512', '__x86_64__', ('X86_HAVE(FMA)', 'X86_HAVE(F16C)', 'X86_HAVE(AVX2)', 'X86_HAVE(AVX512F)')),
+  ('amd_avx2', '__x86_64__', ('X86_HAVE(FMA)', 'X86_HAVE(F16C)', 'X86_HAVE(AVX2)')),
   ('amd_avx', '__x86_64__', ()),
+  ('arm82', '__aarch64__', ('(getauxval(AT_HWCAP) & HWCAP_FPHP)', '(getauxval(AT_HWCAP) & HWCAP_ASIMDHP)', '(getauxval(AT_HWCAP) & HWCAP_ASIMDDP)')),
   ('arm80', '__aarch64__', ()),
 )
 
@@ -44,7 +46,7 @@ with open('llama.cpp/ggml-quants.cpp', 'w') as f:
   f.write('    QuantFuncs() {\n')
   for arch, mac, needs in ARCHS:
     f.write('#ifdef %s\n' % (mac))
-    f.write('        if (%s) {\n' % (' && '.join('X86_HAVE(%s)' % (need) for need in needs) or '1'))
+    f.write('        if (%s) {\n' % (' && '.join(needs) or '1'))
     for func, proto in FUNCS:
       f.write('            ptr_%s = %s_%s;\n' % (func, func, arch))
     f.write('            return;\n')
@@ -57,6 +59,6 @@ with open('llama.cpp/ggml-quants.cpp', 'w') as f:
     proto = proto.replace(';', '')
     args = [s.split(' ')[-1] for s in re.search(r'(?<=\().*(?=\))', proto).group(0).split(',')]
     f.write(proto + ' {\n')
-    f.write('  return funcs.ptr_%s(%s);\n' % (func, args))
+    f.write('  return funcs.ptr_%s(%s);\n' % (func, ', '.join(args)))
     f.write('}\n')
     f.write('\n')
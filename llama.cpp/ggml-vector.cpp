@@ -489,6 +489,15 @@ extern "C" float ggml_vec_soft_max_f32_amd_avx(const int n, float * y, const flo
 extern "C" float ggml_vec_soft_max_f32_arm82(const int n, float * y, const float * x, float max);
 extern "C" float ggml_vec_soft_max_f32_arm80(const int n, float * y, const float * x, float max);
 
+extern "C" float ggml_vec_soft_max_fused_f32_amd_avx512bf16(const int n, float * y, const float * x);
+extern "C" float ggml_vec_soft_max_fused_f32_amd_avx512(const int n, float * y, const float * x);
+extern "C" float ggml_vec_soft_max_fused_f32_amd_avx2(const int n, float * y, const float * x);
+extern "C" float ggml_vec_soft_max_fused_f32_amd_f16c(const int n, float * y, const float * x);
+extern "C" float ggml_vec_soft_max_fused_f32_amd_fma(const int n, float * y, const float * x);
+extern "C" float ggml_vec_soft_max_fused_f32_amd_avx(const int n, float * y, const float * x);
+extern "C" float ggml_vec_soft_max_fused_f32_arm82(const int n, float * y, const float * x);
+extern "C" float ggml_vec_soft_max_fused_f32_arm80(const int n, float * y, const float * x);
+
 static const struct VectorFuncs {
     typeof(ggml_fp16_to_fp32_row) *ptr_ggml_fp16_to_fp32_row;
     typeof(ggml_fp32_to_fp16_row) *ptr_ggml_fp32_to_fp16_row;
@@ -544,6 +553,7 @@ static const struct VectorFuncs {
     typeof(ggml_vec_norm_inv_f32) *ptr_ggml_vec_norm_inv_f32;
     typeof(ggml_vec_argmax_f32) *ptr_ggml_vec_argmax_f32;
     typeof(ggml_vec_soft_max_f32) *ptr_ggml_vec_soft_max_f32;
+    typeof(ggml_vec_soft_max_fused_f32) *ptr_ggml_vec_soft_max_fused_f32;
 
     VectorFuncs() {
 #ifdef __x86_64__
@@ -602,6 +612,7 @@ static const struct VectorFuncs {
             ptr_ggml_vec_norm_inv_f32 = ggml_vec_norm_inv_f32_amd_avx512bf16;
             ptr_ggml_vec_argmax_f32 = ggml_vec_argmax_f32_amd_avx512bf16;
             ptr_ggml_vec_soft_max_f32 = ggml_vec_soft_max_f32_amd_avx512bf16;
+            ptr_ggml_vec_soft_max_fused_f32 = ggml_vec_soft_max_fused_f32_amd_avx512bf16;
             return;
         }
 #endif
@@ -661,6 +672,7 @@ static const struct VectorFuncs {
             ptr_ggml_vec_norm_inv_f32 = ggml_vec_norm_inv_f32_amd_avx512;
             ptr_ggml_vec_argmax_f32 = ggml_vec_argmax_f32_amd_avx512;
             ptr_ggml_vec_soft_max_f32 = ggml_vec_soft_max_f32_amd_avx512;
+            ptr_ggml_vec_soft_max_fused_f32 = ggml_vec_soft_max_fused_f32_amd_avx512;
             return;
         }
 #endif
@@ -720,6 +732,7 @@ static const struct VectorFuncs {
             ptr_ggml_vec_norm_inv_f32 = ggml_vec_norm_inv_f32_amd_avx2;
             ptr_ggml_vec_argmax_f32 = ggml_vec_argmax_f32_amd_avx2;
             ptr_ggml_vec_soft_max_f32 = ggml_vec_soft_max_f32_amd_avx2;
+            ptr_ggml_vec_soft_max_fused_f32 = ggml_vec_soft_max_fused_f32_amd_avx2;
             return;
         }
 #endif
@@ -779,6 +792,7 @@ static const struct VectorFuncs {
             ptr_ggml_vec_norm_inv_f32 = ggml_vec_norm_inv_f32_amd_f16c;
             ptr_ggml_vec_argmax_f32 = ggml_vec_argmax_f32_amd_f16c;
             ptr_ggml_vec_soft_max_f32 = ggml_vec_soft_max_f32_amd_f16c;
+            ptr_ggml_vec_soft_max_fused_f32 = ggml_vec_soft_max_fused_f32_amd_f16c;
             return;
         }
 #endif
@@ -838,6 +852,7 @@ static const struct VectorFuncs {
             ptr_ggml_vec_norm_inv_f32 = ggml_vec_norm_inv_f32_amd_fma;
             ptr_ggml_vec_argmax_f32 = ggml_vec_argmax_f32_amd_fma;
             ptr_ggml_vec_soft_max_f32 = ggml_vec_soft_max_f32_amd_fma;
+            ptr_ggml_vec_soft_max_fused_f32 = ggml_vec_soft_max_fused_f32_amd_fma;
             return;
         }
 #endif
@@ -897,6 +912,7 @@ static const struct VectorFuncs {
             ptr_ggml_vec_norm_inv_f32 = ggml_vec_norm_inv_f32_amd_avx;
             ptr_ggml_vec_argmax_f32 = ggml_vec_argmax_f32_amd_avx;
             ptr_ggml_vec_soft_max_f32 = ggml_vec_soft_max_f32_amd_avx;
+            ptr_ggml_vec_soft_max_fused_f32 = ggml_vec_soft_max_fused_f32_amd_avx;
             return;
         }
 #endif
@@ -956,6 +972,7 @@ static const struct VectorFuncs {
             ptr_ggml_vec_norm_inv_f32 = ggml_vec_norm_inv_f32_arm82;
             ptr_ggml_vec_argmax_f32 = ggml_vec_argmax_f32_arm82;
             ptr_ggml_vec_soft_max_f32 = ggml_vec_soft_max_f32_arm82;
+            ptr_ggml_vec_soft_max_fused_f32 = ggml_vec_soft_max_fused_f32_arm82;
             return;
         }
 #endif
@@ -1015,6 +1032,7 @@ static const struct VectorFuncs {
             ptr_ggml_vec_norm_inv_f32 = ggml_vec_norm_inv_f32_arm80;
             ptr_ggml_vec_argmax_f32 = ggml_vec_argmax_f32_arm80;
             ptr_ggml_vec_soft_max_f32 = ggml_vec_soft_max_f32_arm80;
+            ptr_ggml_vec_soft_max_fused_f32 = ggml_vec_soft_max_fused_f32_arm80;
             return;
         }
 #endif
@@ -1237,3 +1255,7 @@ float ggml_vec_soft_max_f32(const int n, float * y, const float * x, float max)
   return funcs.ptr_ggml_vec_soft_max_f32(n, y, x, max);
 }
 
+float ggml_vec_soft_max_fused_f32(const int n, float * y, const float * x) {
+  return funcs.ptr_ggml_vec_soft_max_fused_f32(n, y, x);
+}
+
@@ -62,6 +62,7 @@ void ggml_vec_max_f32(const int n, float * s, const float * x);
 void ggml_vec_norm_inv_f32(const int n, float * s, const float * x);
 void ggml_vec_argmax_f32(const int n, int * s, const float * x);
 float ggml_vec_soft_max_f32(const int n, float * y, const float * x, float max);
+float ggml_vec_soft_max_fused_f32(const int n, float * y, const float * x);
 
 #ifdef __cplusplus
 }
@@ -41,6 +41,8 @@ SOFTWARE.");
 #include "llamafile/log.h"
 #include "llamafile/debug.h"
 #include "llamafile/sgemm.h"
+#include "llamafile/perfctr.h"
+#include "llamafile/trace.h"
 
 #include <alloca.h>
 #include <assert.h>
@@ -66,6 +68,7 @@ SOFTWARE.");
 #include <stdatomic.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
 typedef void * thread_ret_t;
@@ -702,6 +705,18 @@ static const ggml_type_traits_t type_traits[GGML_TYPE_COUNT] = {
         .vec_dot                  = (ggml_vec_dot_t) ggml_vec_dot_bf16,
         .vec_dot_type             = GGML_TYPE_BF16,
         .nrows                    = 1,
+    },
+    [GGML_TYPE_F8_E4M3] = {
+        .type_name                = "f8_e4m3",
+        .blck_size                = QK_F8_E4M3,
+        .type_size                = sizeof(block_f8_e4m3),
+        .is_quantized             = true,
+        .to_float                 = (ggml_to_float_t) dequantize_row_f8_e4m3,
+        .from_float               = quantize_row_f8_e4m3,
+        .from_float_reference     = (ggml_from_float_t) quantize_row_f8_e4m3_reference,
+        .vec_dot                  = ggml_vec_dot_f8_e4m3_q8_0,
+        .vec_dot_type             = GGML_TYPE_Q8_0,
+        .nrows                    = 1,
     }
 };
 
@@ -1408,6 +1423,14 @@ void ggml_syncthreads(struct ggml_barrier * b, int nth) {
     sync_wait_end();
 }
 
+struct ggml_barrier * ggml_barrier_new(void) {
+    return calloc(1, sizeof(struct ggml_barrier));
+}
+
+void ggml_barrier_free(struct ggml_barrier * b) {
+    free(b);
+}
+
 //
 // data types
 //
@@ -1436,10 +1459,13 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "NORM",
     "RMS_NORM",
     "RMS_NORM_BACK",
+    "RMS_NORM_MUL",
     "GROUP_NORM",
 
     "MUL_MAT",
     "MUL_MAT_ID",
+    "MUL_MAT_SWIGLU",
+    "MUL_MAT_AXPY",
     "OUT_PROD",
 
     "SCALE",
@@ -1501,7 +1527,7 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "CROSS_ENTROPY_LOSS_BACK",
 };
 
-static_assert(GGML_OP_COUNT == 77, "GGML_OP_COUNT != 77");
+static_assert(GGML_OP_COUNT == 80, "GGML_OP_COUNT != 80");
 
 static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "none",
@@ -1527,10 +1553,13 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "norm(x)",
     "rms_norm(x)",
     "rms_norm_back(x)",
+    "rms_norm(x)*y",
     "group_norm(x)",
 
     "X*Y",
     "X[i]*Y",
+    "silu(X*Z)*(Y*Z)",
+    "X^T*Y",
     "X*Y",
 
     "x*v",
@@ -1592,7 +1621,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "cross_entropy_loss_back(x,y)",
 };
 
-static_assert(GGML_OP_COUNT == 77, "GGML_OP_COUNT != 77");
+static_assert(GGML_OP_COUNT == 80, "GGML_OP_COUNT != 80");
 
 static_assert(GGML_OP_POOL_COUNT == 2, "GGML_OP_POOL_COUNT != 2");
 
@@ -1663,6 +1692,7 @@ struct ggml_context {
     bool   mem_buffer_owned;
     bool   no_alloc;
     bool   no_alloc_save; // this is used to save the no_alloc state when using scratch buffers
+    bool   no_names;      // derived tensors inherit the source name verbatim
 
     int    n_objects;
 
@@ -1683,12 +1713,14 @@ struct ggml_context_container {
 // NUMA support
 //
 
-#define GGML_NUMA_MAX_NODES 8
+#define GGML_NUMA_MAX_NODES 16 // xeon max has 8 per socket in snc4 flat mode
 #define GGML_NUMA_MAX_CPUS 512
 
 struct ggml_numa_node {
     uint32_t cpus[GGML_NUMA_MAX_CPUS]; // hardware threads on this node
     uint32_t n_cpus;
+    uint64_t bandwidth; // read bandwidth of its memory in MB/s, or 0 if unknown
+    size_t free; // bytes of its memory that tiering may still use
 };
 
 struct ggml_numa_nodes {
@@ -1697,6 +1729,7 @@ struct ggml_numa_nodes {
     uint32_t n_nodes;
     uint32_t total_cpus; // hardware threads on system
     uint32_t current_node; // node on which main process is execting
+    uint32_t tiers[GGML_NUMA_MAX_NODES]; // nodes from fastest memory to slowest
 #if defined(__gnu_linux__)
     cpu_set_t cpuset; // cpuset from numactl
 #else
@@ -1750,6 +1783,71 @@ static uint32_t ggml_get_numa_affinity(void) {
 }
 #endif
 
+#if defined(__gnu_linux__) || defined(__COSMOPOLITAN__)
+
+// reads the number in a sysfs file, or returns 0
+static uint64_t ggml_numa_read_u64(const char * path) {
+    uint64_t x = 0;
+    FILE * f = fopen(path, "re");
+    if (f) {
+        if (fscanf(f, "%" SCNu64, &x) != 1) {
+            x = 0;
+        }
+        fclose(f);
+    }
+    return x;
+}
+
+// returns true if node a has faster memory than node b
+static bool ggml_numa_faster(uint32_t a, uint32_t b) {
+    const struct ggml_numa_node * x = &g_state.numa.nodes[a];
+    const struct ggml_numa_node * y = &g_state.numa.nodes[b];
+    if (x->bandwidth != y->bandwidth) {
+        return x->bandwidth > y->bandwidth;
+    }
+    if ((a == g_state.numa.current_node) != (b == g_state.numa.current_node)) {
+        return a == g_state.numa.current_node;
+    }
+    // without an hmat, memory without cpus is assumed to be cxl
+    return (x->n_cpus > 0) > (y->n_cpus > 0);
+}
+
+// orders the memory of the nodes from fastest to slowest, using the
+// bandwidths the acpi hmat reports, so that hbm comes before dram and
+// dram before cxl, and finds out how much of each is free
+static void ggml_numa_init_tiers(void) {
+    char path[256];
+    for (uint32_t n = 0; n < g_state.numa.n_nodes; ++n) {
+        struct ggml_numa_node * node = &g_state.numa.nodes[n];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/access0/initiators/read_bandwidth", n);
+        node->bandwidth = ggml_numa_read_u64(path);
+        node->free = 0;
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/meminfo", n);
+        FILE * f = fopen(path, "re");
+        if (f) {
+            char line[128];
+            unsigned long long kb;
+            while (fgets(line, sizeof(line), f)) {
+                if (sscanf(line, "Node %*u MemFree: %llu kB", &kb) == 1) {
+                    node->free = kb * 1024 / 8 * 7; // leave some for everyone else
+                }
+            }
+            fclose(f);
+        }
+        uint32_t i = n;
+        for (; i > 0 && ggml_numa_faster(n, g_state.numa.tiers[i - 1]); --i) {
+            g_state.numa.tiers[i] = g_state.numa.tiers[i - 1];
+        }
+        g_state.numa.tiers[i] = n;
+    }
+    for (uint32_t k = 0; k < g_state.numa.n_nodes; ++k) {
+        GGML_PRINT_DEBUG("memory tier %u is node %u with %zu MiB free at %" PRIu64 " MB/s\n", k, g_state.numa.tiers[k],
+                         g_state.numa.nodes[g_state.numa.tiers[k]].free >> 20, g_state.numa.nodes[g_state.numa.tiers[k]].bandwidth);
+    }
+}
+
+#endif
+
 void ggml_numa_init(enum ggml_numa_strategy numa_flag) {
     if (g_state.numa.n_nodes > 0) {
         fprintf(stderr, "ggml_numa_init: NUMA already initialized\n");
@@ -1827,6 +1925,10 @@ void ggml_numa_init(enum ggml_numa_strategy numa_flag) {
         GGML_PRINT_DEBUG("\n");
     }
 
+    if (g_state.numa.numa_strategy == GGML_NUMA_STRATEGY_TIER) {
+        ggml_numa_init_tiers();
+    }
+
     if (ggml_is_numa()) {
         FILE *fptr = fopen("/proc/sys/kernel/numa_balancing", "re");
         if (fptr != NULL) {
@@ -1847,6 +1949,533 @@ bool ggml_is_numa(void) {
     return g_state.numa.n_nodes > 1;
 }
 
+//
+// numa mirroring
+//
+// with GGML_NUMA_STRATEGY_MIRROR each node gets a private copy of the
+// model weights. threads are spread over the nodes the same way as
+// with distribute, and matrix multiplications read src0 from the copy
+// that lives on the thread's own node, so decoding no longer fetches
+// half the weights across the interconnect.
+//
+
+#define GGML_NUMA_MAX_MIRRORS 64
+
+struct ggml_numa_mirror {
+    const char * data;
+    size_t size;
+    char * copies[GGML_NUMA_MAX_NODES];
+    bool sharded; // one copy whose matrix rows are spread over nodes
+};
+
+static struct ggml_numa_mirror g_numa_mirrors[GGML_NUMA_MAX_MIRRORS];
+static int g_numa_n_mirrors;
+static _Thread_local int g_numa_node = -1; // set when thread is pinned to a node
+
+// returns the copy of x that lives on the node of the calling thread
+static inline const void * ggml_numa_local(const void * x) {
+    int node = g_numa_node;
+    if (node < 0) {
+        if (g_state.numa.numa_strategy != GGML_NUMA_STRATEGY_TIER) {
+            return x;
+        }
+        node = 0; // tiered weights have one copy for every thread
+    }
+    for (int i = 0; i < g_numa_n_mirrors; ++i) {
+        const struct ggml_numa_mirror * m = &g_numa_mirrors[i];
+        if ((const char *) x >= m->data && (const char *) x < m->data + m->size) {
+            return m->copies[node] + ((const char *) x - m->data);
+        }
+    }
+    return x;
+}
+
+//
+// numa sharding
+//
+// GGML_NUMA_STRATEGY_SHARD keeps a single copy of the weights, but the
+// rows of every matrix are split into one contiguous shard per node,
+// and the pages of each shard are put on its node. when decoding, the
+// threads of a node multiply the rows of their own shard first, which
+// makes the cpus of a multi-socket machine act like one device per
+// socket without needing memory for a copy per node. the results are
+// rows of dst, so no reduction is needed between nodes.
+//
+
+#define GGML_NUMA_SHARD_MAX_ROWS 8  // larger products are compute bound
+#define GGML_NUMA_SHARD_CHUNK    32 // rows a thread claims at a time
+
+// returns first row of shard k when n rows are split over the nodes
+static inline int64_t ggml_numa_shard_row(int64_t n, int k) {
+    return n * k / g_state.numa.n_nodes;
+}
+
+// returns true if x is in weights that were split over the nodes
+static inline bool ggml_numa_is_sharded(const void * x) {
+    for (int i = 0; i < g_numa_n_mirrors; ++i) {
+        const struct ggml_numa_mirror * m = &g_numa_mirrors[i];
+        if ((const char *) x >= m->data && (const char *) x < m->data + m->size) {
+            return m->sharded;
+        }
+    }
+    return false;
+}
+
+#if defined(__gnu_linux__) || defined(__COSMOPOLITAN__)
+
+// pins the calling thread to the cpus of a numa node
+static bool ggml_numa_bind_node(int n) {
+    struct ggml_numa_node * node = &g_state.numa.nodes[n];
+    size_t setsize = CPU_ALLOC_SIZE(g_state.numa.total_cpus);
+    cpu_set_t * cpus = CPU_ALLOC(g_state.numa.total_cpus);
+    CPU_ZERO_S(setsize, cpus);
+    for (size_t i = 0; i < node->n_cpus; ++i) {
+        CPU_SET_S(node->cpus[i], setsize, cpus);
+    }
+    int rv = pthread_setaffinity_np(pthread_self(), setsize, cpus);
+    CPU_FREE(cpus);
+    if (rv) {
+        fprintf(stderr, "warning: pthread_setaffinity_np() failed: %s\n", strerror(rv));
+        return false;
+    }
+    return true;
+}
+
+struct ggml_numa_copy {
+    struct ggml_numa_mirror * mirror;
+    int node;
+    bool ok;
+};
+
+static void * ggml_numa_copy_thread(void * arg) {
+    struct ggml_numa_copy * c = arg;
+    struct ggml_numa_mirror * m = c->mirror;
+
+    // the kernel puts pages on the node of the thread that first
+    // touches them, so we do the copying from that node
+    if (!ggml_numa_bind_node(c->node)) {
+        return NULL;
+    }
+
+    char * p = m->copies[c->node];
+    if (!p) {
+        p = mmap(NULL, m->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            return NULL;
+        }
+    } else if (mprotect(p, m->size, PROT_READ | PROT_WRITE)) {
+        return NULL;
+    }
+    memcpy(p, m->data, m->size);
+    mprotect(p, m->size, PROT_READ);
+    m->copies[c->node] = p;
+    c->ok = true;
+    return NULL;
+}
+
+bool ggml_numa_mirror(const void * data, size_t size) {
+    if (g_state.numa.numa_strategy != GGML_NUMA_STRATEGY_MIRROR || !ggml_is_numa() || !size) {
+        return false;
+    }
+
+    // copying the same region again refreshes it, e.g. after lora
+    struct ggml_numa_mirror * m = NULL;
+    for (int i = 0; i < g_numa_n_mirrors; ++i) {
+        if (g_numa_mirrors[i].data == data && g_numa_mirrors[i].size == size) {
+            m = &g_numa_mirrors[i];
+        }
+    }
+    const bool is_new = !m;
+    if (is_new) {
+        if (g_numa_n_mirrors == GGML_NUMA_MAX_MIRRORS) {
+            return false;
+        }
+        m = &g_numa_mirrors[g_numa_n_mirrors];
+        *m = (struct ggml_numa_mirror) { .data = data, .size = size };
+    }
+
+    const int n_nodes = g_state.numa.n_nodes;
+    struct ggml_numa_copy copies[GGML_NUMA_MAX_NODES];
+    pthread_t threads[GGML_NUMA_MAX_NODES];
+    for (int n = 0; n < n_nodes; ++n) {
+        copies[n] = (struct ggml_numa_copy) { .mirror = m, .node = n };
+        GGML_ASSERT(pthread_create(&threads[n], NULL, ggml_numa_copy_thread, &copies[n]) == 0);
+    }
+    bool ok = true;
+    for (int n = 0; n < n_nodes; ++n) {
+        pthread_join(threads[n], NULL);
+        ok &= copies[n].ok;
+    }
+
+    if (!ok) {
+        // fall back to the shared copy for this region
+        fprintf(stderr, "warning: failed to mirror %zu bytes to every numa node\n", size);
+        for (int n = 0; n < n_nodes; ++n) {
+            if (m->copies[n]) {
+                munmap(m->copies[n], size);
+            }
+        }
+        if (!is_new) {
+            *m = g_numa_mirrors[--g_numa_n_mirrors];
+        }
+        memset(&g_numa_mirrors[g_numa_n_mirrors], 0, sizeof(*m));
+        return false;
+    }
+
+    if (is_new) {
+        ++g_numa_n_mirrors;
+    }
+    return true;
+}
+
+static bool ggml_numa_can_shard(const struct ggml_tensor * t) {
+    return ggml_is_contiguous(t) && t->ne[1] >= (int64_t) g_state.numa.n_nodes;
+}
+
+struct ggml_numa_shard_job {
+    struct ggml_numa_mirror * mirror;
+    struct ggml_tensor ** tensors;
+    int n_tensors;
+    int node;
+    bool ok;
+};
+
+// copies the shard of each matrix that belongs to a node, from that
+// node, so first touch puts the pages there
+static void * ggml_numa_shard_thread(void * arg) {
+    struct ggml_numa_shard_job * c = arg;
+    struct ggml_numa_mirror * m = c->mirror;
+    if (!ggml_numa_bind_node(c->node)) {
+        return NULL;
+    }
+    for (int i = 0; i < c->n_tensors; ++i) {
+        const struct ggml_tensor * t = c->tensors[i];
+        if (!ggml_numa_can_shard(t)) {
+            continue;
+        }
+        const int64_t r0 = ggml_numa_shard_row(t->ne[1], c->node);
+        const int64_t r1 = ggml_numa_shard_row(t->ne[1], c->node + 1);
+        for (int64_t i3 = 0; i3 < t->ne[3]; ++i3) {
+            for (int64_t i2 = 0; i2 < t->ne[2]; ++i2) {
+                const size_t offs = (const char *) t->data - m->data + i3*t->nb[3] + i2*t->nb[2] + r0*t->nb[1];
+                memcpy(m->copies[0] + offs, m->data + offs, (r1 - r0)*t->nb[1]);
+            }
+        }
+    }
+    c->ok = true;
+    return NULL;
+}
+
+bool ggml_numa_shard(const void * data, size_t size, struct ggml_tensor ** tensors, int n_tensors) {
+    if (g_state.numa.numa_strategy != GGML_NUMA_STRATEGY_SHARD || !ggml_is_numa() || !size) {
+        return false;
+    }
+
+    // only tensors inside the region are copied
+    int n = 0;
+    for (int i = 0; i < n_tensors; ++i) {
+        const char * p = tensors[i]->data;
+        if (p && p >= (const char *) data && p + ggml_nbytes(tensors[i]) <= (const char *) data + size) {
+            tensors[n++] = tensors[i];
+        }
+    }
+    n_tensors = n;
+
+    // sharding the same region again refreshes it, e.g. after lora
+    struct ggml_numa_mirror * m = NULL;
+    for (int i = 0; i < g_numa_n_mirrors; ++i) {
+        if (g_numa_mirrors[i].data == data && g_numa_mirrors[i].size == size) {
+            m = &g_numa_mirrors[i];
+        }
+    }
+    const bool is_new = !m;
+    char * p;
+    if (is_new) {
+        if (g_numa_n_mirrors == GGML_NUMA_MAX_MIRRORS) {
+            return false;
+        }
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            return false;
+        }
+        m = &g_numa_mirrors[g_numa_n_mirrors];
+        *m = (struct ggml_numa_mirror) { .data = data, .size = size, .sharded = true };
+        for (uint32_t k = 0; k < g_state.numa.n_nodes; ++k) {
+            m->copies[k] = p;
+        }
+    } else {
+        p = m->copies[0];
+        if (mprotect(p, size, PROT_READ | PROT_WRITE)) {
+            return false;
+        }
+    }
+
+    const int n_nodes = g_state.numa.n_nodes;
+    struct ggml_numa_shard_job jobs[GGML_NUMA_MAX_NODES];
+    pthread_t threads[GGML_NUMA_MAX_NODES];
+    for (int k = 0; k < n_nodes; ++k) {
+        jobs[k] = (struct ggml_numa_shard_job) { .mirror = m, .tensors = tensors, .n_tensors = n_tensors, .node = k };
+        GGML_ASSERT(pthread_create(&threads[k], NULL, ggml_numa_shard_thread, &jobs[k]) == 0);
+    }
+    bool ok = true;
+    for (int k = 0; k < n_nodes; ++k) {
+        pthread_join(threads[k], NULL);
+        ok &= jobs[k].ok;
+    }
+
+    if (!ok) {
+        fprintf(stderr, "warning: failed to shard %zu bytes over the numa nodes\n", size);
+        munmap(p, size);
+        if (!is_new) {
+            *m = g_numa_mirrors[--g_numa_n_mirrors];
+        }
+        memset(&g_numa_mirrors[g_numa_n_mirrors], 0, sizeof(*m));
+        return false;
+    }
+
+    // vectors and such are small, so they live wherever we are
+    for (int i = 0; i < n_tensors; ++i) {
+        const struct ggml_tensor * t = tensors[i];
+        if (!ggml_numa_can_shard(t)) {
+            const size_t offs = (const char *) t->data - (const char *) data;
+            memcpy(p + offs, (const char *) data + offs, ggml_nbytes(t));
+        }
+    }
+    mprotect(p, size, PROT_READ);
+
+    if (is_new) {
+        ++g_numa_n_mirrors;
+    }
+    return true;
+}
+
+//
+// numa tiering
+//
+// GGML_NUMA_STRATEGY_TIER is for machines whose numa nodes differ in
+// the speed of their memory rather than in where their cpus are, like
+// xeon max with hbm in flat mode, or servers with cxl memory expanders,
+// whose extra memory shows up as nodes without cpus. the weights get a
+// single copy, whose pages are spread over the nodes so the bytes read
+// most per token end up in the fastest memory until it's full, and the
+// rest in the next fastest, and so on. the kv cache is moved to the
+// fastest memory that still has room once the weights are placed.
+//
+
+#define GGML_NUMA_TIER_COPIERS 8 // one thread can't keep memory busy
+
+#define GGML_MPOL_PREFERRED 1
+#define GGML_MPOL_MF_MOVE   2
+
+// sets the policy of the pages in a range to prefer one node, which the
+// libc has no wrapper for. preferring rather than binding lets the
+// kernel go elsewhere if that node runs out of memory after all
+static long ggml_numa_mbind(void * addr, size_t len, int node, unsigned flags) {
+    unsigned long mask = 1ul << node;
+    long rc;
+#ifdef __x86_64__
+    register long r10 asm("r10") = (long) &mask;
+    register long r8 asm("r8") = sizeof(mask) * 8 + 1; // maxnode
+    register long r9 asm("r9") = flags;
+    asm volatile("syscall"
+                 : "=a"(rc)
+                 : "0"(237L), // SYS_mbind
+                   "D"(addr),
+                   "S"(len),
+                   "d"((long) GGML_MPOL_PREFERRED),
+                   "r"(r10), "r"(r8), "r"(r9)
+                 : "rcx", "r11", "memory");
+#elif defined(__aarch64__)
+    register long x0 asm("x0") = (long) addr;
+    register long x1 asm("x1") = len;
+    register long x2 asm("x2") = GGML_MPOL_PREFERRED;
+    register long x3 asm("x3") = (long) &mask;
+    register long x4 asm("x4") = sizeof(mask) * 8 + 1; // maxnode
+    register long x5 asm("x5") = flags;
+    register long x8 asm("x8") = 235; // SYS_mbind
+    asm volatile("svc\t0" : "+r"(x0) : "r"(x1), "r"(x2), "r"(x3), "r"(x4), "r"(x5), "r"(x8) : "memory");
+    rc = x0;
+#else
+    GGML_UNUSED(addr);
+    GGML_UNUSED(len);
+    GGML_UNUSED(flags);
+    rc = -1;
+#endif
+    return rc;
+}
+
+// returns the fastest node with room for size more bytes, or -1
+static int ggml_numa_tier_take(size_t size) {
+    for (uint32_t k = 0; k < g_state.numa.n_nodes; ++k) {
+        struct ggml_numa_node * node = &g_state.numa.nodes[g_state.numa.tiers[k]];
+        if (node->free >= size) {
+            node->free -= size;
+            return g_state.numa.tiers[k];
+        }
+    }
+    return -1;
+}
+
+// orders spans by bytes read per token per byte, coldest first
+static int ggml_numa_span_cmp(const void * a, const void * b) {
+    const struct ggml_numa_span * x = a;
+    const struct ggml_numa_span * y = b;
+    const double hx = x->size ? x->heat / x->size : 0;
+    const double hy = y->size ? y->heat / y->size : 0;
+    return (hx > hy) - (hx < hy);
+}
+
+struct ggml_numa_tier_job {
+    char * dst;
+    const char * src;
+    size_t size;
+};
+
+static void * ggml_numa_tier_thread(void * arg) {
+    struct ggml_numa_tier_job * c = arg;
+    memcpy(c->dst, c->src, c->size);
+    return NULL;
+}
+
+// copies a region from several threads, whose page faults put each
+// page on the node its policy prefers
+static void ggml_numa_tier_copy(char * dst, const char * src, size_t size) {
+    struct ggml_numa_tier_job jobs[GGML_NUMA_TIER_COPIERS];
+    pthread_t threads[GGML_NUMA_TIER_COPIERS];
+    const size_t chunk = GGML_PAD((size + GGML_NUMA_TIER_COPIERS - 1) / GGML_NUMA_TIER_COPIERS, 4096);
+    int n = 0;
+    for (size_t i = 0; i < size; i += chunk, ++n) {
+        jobs[n] = (struct ggml_numa_tier_job) { .dst = dst + i, .src = src + i, .size = MIN(chunk, size - i) };
+        GGML_ASSERT(pthread_create(&threads[n], NULL, ggml_numa_tier_thread, &jobs[n]) == 0);
+    }
+    for (int i = 0; i < n; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+bool ggml_numa_tier(const void * data, size_t size, struct ggml_numa_span * spans, int n_spans) {
+    if (g_state.numa.numa_strategy != GGML_NUMA_STRATEGY_TIER || !ggml_is_numa() || !size) {
+        return false;
+    }
+
+    // tiering the same region again refreshes it, e.g. after lora
+    struct ggml_numa_mirror * m = NULL;
+    for (int i = 0; i < g_numa_n_mirrors; ++i) {
+        if (g_numa_mirrors[i].data == data && g_numa_mirrors[i].size == size) {
+            m = &g_numa_mirrors[i];
+        }
+    }
+    if (m) {
+        if (mprotect(m->copies[0], size, PROT_READ | PROT_WRITE)) {
+            return false;
+        }
+        ggml_numa_tier_copy(m->copies[0], data, size);
+        mprotect(m->copies[0], size, PROT_READ);
+        return true;
+    }
+    if (g_numa_n_mirrors == GGML_NUMA_MAX_MIRRORS) {
+        return false;
+    }
+
+    char * p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        return false;
+    }
+
+    // the hottest spans pick their node first, but get their policy
+    // last, so they win the pages they share with colder neighbors
+    int * nodes = malloc(sizeof(int) * MAX(n_spans, 1));
+    GGML_ASSERT(nodes);
+    qsort(spans, n_spans, sizeof(*spans), ggml_numa_span_cmp);
+    for (int i = n_spans - 1; i >= 0; --i) {
+        const bool inside = spans[i].size && spans[i].offs + spans[i].size <= size;
+        nodes[i] = inside ? ggml_numa_tier_take(spans[i].size) : -1;
+    }
+    const size_t pagesz = sysconf(_SC_PAGESIZE);
+    bool ok = true;
+    for (int i = 0; i < n_spans && ok; ++i) {
+        if (nodes[i] < 0) {
+            continue; // stays on the node that copies it
+        }
+        const size_t lo = spans[i].offs & -pagesz;
+        const size_t hi = spans[i].offs + spans[i].size;
+        ok = ggml_numa_mbind(p + lo, hi - lo, nodes[i], 0) == 0;
+    }
+    free(nodes);
+
+    if (!ok) {
+        fprintf(stderr, "warning: failed to place %zu bytes of weights in memory tiers\n", size);
+        munmap(p, size);
+        return false;
+    }
+
+    ggml_numa_tier_copy(p, data, size);
+    mprotect(p, size, PROT_READ);
+
+    m = &g_numa_mirrors[g_numa_n_mirrors++];
+    *m = (struct ggml_numa_mirror) { .data = data, .size = size };
+    for (uint32_t k = 0; k < g_state.numa.n_nodes; ++k) {
+        m->copies[k] = p;
+    }
+    return true;
+}
+
+bool ggml_numa_tier_place(void * data, size_t size) {
+    if (g_state.numa.numa_strategy != GGML_NUMA_STRATEGY_TIER || !ggml_is_numa()) {
+        return false;
+    }
+
+    // only the pages that lie wholly inside the buffer are ours to move
+    const uintptr_t pagesz = sysconf(_SC_PAGESIZE);
+    const uintptr_t lo = ((uintptr_t) data + pagesz - 1) & -pagesz;
+    const uintptr_t hi = ((uintptr_t) data + size) & -pagesz;
+    if (hi <= lo) {
+        return false;
+    }
+    const int node = ggml_numa_tier_take(hi - lo);
+    if (node < 0) {
+        return false;
+    }
+    if (ggml_numa_mbind((void *) lo, hi - lo, node, GGML_MPOL_MF_MOVE)) {
+        g_state.numa.nodes[node].free += hi - lo;
+        fprintf(stderr, "warning: failed to move %zu bytes to numa node %d\n", (size_t) (hi - lo), node);
+        return false;
+    }
+    return true;
+}
+
+#else
+
+bool ggml_numa_mirror(const void * data, size_t size) {
+    GGML_UNUSED(data);
+    GGML_UNUSED(size);
+    return false;
+}
+
+bool ggml_numa_shard(const void * data, size_t size, struct ggml_tensor ** tensors, int n_tensors) {
+    GGML_UNUSED(data);
+    GGML_UNUSED(size);
+    GGML_UNUSED(tensors);
+    GGML_UNUSED(n_tensors);
+    return false;
+}
+
+bool ggml_numa_tier(const void * data, size_t size, struct ggml_numa_span * spans, int n_spans) {
+    GGML_UNUSED(data);
+    GGML_UNUSED(size);
+    GGML_UNUSED(spans);
+    GGML_UNUSED(n_spans);
+    return false;
+}
+
+bool ggml_numa_tier_place(void * data, size_t size) {
+    GGML_UNUSED(data);
+    GGML_UNUSED(size);
+    return false;
+}
+
+#endif
+
 ////////////////////////////////////////////////////////////////////////////////
 
 void ggml_print_object(const struct ggml_object * obj) {
@@ -2007,6 +2636,7 @@ enum ggml_type ggml_ftype_to_ggml_type(enum ggml_ftype ftype) {
         case GGML_FTYPE_ALL_F32:              wtype = GGML_TYPE_F32;   break;
         case GGML_FTYPE_MOSTLY_F16:           wtype = GGML_TYPE_F16;   break;
         case GGML_FTYPE_MOSTLY_BF16:          wtype = GGML_TYPE_BF16;  break;
+        case GGML_FTYPE_MOSTLY_F8_E4M3:       wtype = GGML_TYPE_F8_E4M3;  break;
         case GGML_FTYPE_MOSTLY_Q4_0:          wtype = GGML_TYPE_Q4_0;  break;
         case GGML_FTYPE_MOSTLY_Q4_1:          wtype = GGML_TYPE_Q4_1;  break;
         case GGML_FTYPE_MOSTLY_Q5_0:          wtype = GGML_TYPE_Q5_0;  break;
@@ -2226,6 +2856,7 @@ struct ggml_context * ggml_init(struct ggml_init_params params) {
         /*.mem_buffer_owned   =*/ params.mem_buffer ? false : true,
         /*.no_alloc           =*/ params.no_alloc,
         /*.no_alloc_save      =*/ params.no_alloc,
+        /*.no_names           =*/ false,
         /*.n_objects          =*/ 0,
         /*.objects_begin      =*/ NULL,
         /*.objects_end        =*/ NULL,
@@ -2298,6 +2929,14 @@ void ggml_set_no_alloc(struct ggml_context * ctx, bool no_alloc) {
     ctx->no_alloc = no_alloc;
 }
 
+bool ggml_get_no_names(struct ggml_context * ctx) {
+    return ctx->no_names;
+}
+
+void ggml_set_no_names(struct ggml_context * ctx, bool no_names) {
+    ctx->no_names = no_names;
+}
+
 void * ggml_get_mem_buffer(const struct ggml_context * ctx) {
     return ctx->mem_buffer;
 }
@@ -3005,11 +3644,25 @@ struct ggml_tensor * ggml_format_name(struct ggml_tensor * tensor, const char *
     return tensor;
 }
 
+// names a view/reshape/copy of src; vsnprintf() dominates graph build
+// time for large models, so contexts with no_names set skip formatting
+static void ggml_derive_name(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * tensor,
+        const struct ggml_tensor * src,
+        const char * what) {
+    if (ctx->no_names) {
+        memcpy(tensor->name, src->name, sizeof(tensor->name));
+    } else {
+        ggml_format_name(tensor, "%s (%s)", src->name, what);
+    }
+}
+
 struct ggml_tensor * ggml_view_tensor(
         struct ggml_context * ctx,
         struct ggml_tensor  * src) {
     struct ggml_tensor * result = ggml_new_tensor_impl(ctx, src->type, GGML_MAX_DIMS, src->ne, src, 0);
-    ggml_format_name(result, "%s (view)", src->name);
+    ggml_derive_name(ctx, result, src, "view");
 
     for (int i = 0; i < GGML_MAX_DIMS; i++) {
         result->nb[i] = src->nb[i];
@@ -3945,33 +4598,59 @@ struct ggml_tensor * ggml_rms_norm_inplace(
     return ggml_rms_norm_impl(ctx, a, eps, true);
 }
 
-// ggml_rms_norm_back
+// ggml_rms_norm_mul
 
-struct ggml_tensor * ggml_rms_norm_back(
+struct ggml_tensor * ggml_rms_norm_mul(
         struct ggml_context * ctx,
         struct ggml_tensor  * a,
         struct ggml_tensor  * b,
-        float  eps) {
-    bool is_node = false;
+        float                 eps,
+        enum ggml_type        type) {
+    GGML_ASSERT(a->type == GGML_TYPE_F32 && b->type == GGML_TYPE_F32);
+    GGML_ASSERT(ggml_can_repeat_rows(b, a));
+    GGML_ASSERT(type == GGML_TYPE_F32 || (type_traits[type].from_float && a->ne[0] % ggml_blck_size(type) == 0));
 
-    if (a->grad) {
-        // TODO: implement backward
-        is_node = true;
-    }
+    GGML_ASSERT(!a->grad && !b->grad); // TODO: implement backward
 
-    struct ggml_tensor * result = ggml_dup_tensor(ctx, a);
+    struct ggml_tensor * result = ggml_new_tensor(ctx, type, GGML_MAX_DIMS, a->ne);
 
     ggml_set_op_params(result, &eps, sizeof(eps));
 
-    result->op   = GGML_OP_RMS_NORM_BACK;
-    result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
+    result->op     = GGML_OP_RMS_NORM_MUL;
+    result->grad   = NULL;
     result->src[0] = a;
     result->src[1] = b;
 
     return result;
 }
 
-// ggml_group_norm
+// ggml_rms_norm_back
+
+struct ggml_tensor * ggml_rms_norm_back(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b,
+        float  eps) {
+    bool is_node = false;
+
+    if (a->grad) {
+        // TODO: implement backward
+        is_node = true;
+    }
+
+    struct ggml_tensor * result = ggml_dup_tensor(ctx, a);
+
+    ggml_set_op_params(result, &eps, sizeof(eps));
+
+    result->op   = GGML_OP_RMS_NORM_BACK;
+    result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
+    result->src[0] = a;
+    result->src[1] = b;
+
+    return result;
+}
+
+// ggml_group_norm
 
 static struct ggml_tensor * ggml_group_norm_impl(
     struct ggml_context * ctx,
@@ -4093,6 +4772,109 @@ struct ggml_tensor * ggml_mul_mat_id(
     return result;
 }
 
+struct ggml_tensor * ggml_mul_mat_id_masked(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * as,
+        struct ggml_tensor  * b,
+        struct ggml_tensor  * ids,
+        const uint32_t      * mask,
+        bool                  packed) {
+    if (packed) {
+        int64_t n_masked = 0;
+        for (int i = 0; i < GGML_MAX_MASKED_EXPERTS/32; ++i) {
+            n_masked += __builtin_popcount(mask[i]);
+        }
+        GGML_ASSERT(as->ne[2] == n_masked);
+    }
+
+    struct ggml_tensor * result = ggml_mul_mat_id(ctx, as, b, ids);
+
+    int32_t params[1 + GGML_MAX_MASKED_EXPERTS/32];
+    params[0] = packed ? 2 : 1;
+    memcpy(params + 1, mask, GGML_MAX_MASKED_EXPERTS/8);
+    ggml_set_op_params(result, params, sizeof(params));
+
+    return result;
+}
+
+// ggml_mul_mat_swiglu
+
+static struct ggml_tensor * ggml_mul_mat_swiglu_impl(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * gate,
+        struct ggml_tensor  * up,
+        struct ggml_tensor  * b,
+        struct ggml_tensor  * pred) {
+    GGML_ASSERT(ggml_can_mul_mat(gate, b));
+    GGML_ASSERT(ggml_are_same_shape(gate, up));
+    GGML_ASSERT(gate->type == up->type);
+    GGML_ASSERT(!ggml_is_transposed(gate) && !ggml_is_transposed(up));
+    GGML_ASSERT(ggml_is_matrix(gate) && ggml_is_matrix(b)); // TODO: support batched matrices
+    GGML_ASSERT(b->type == GGML_TYPE_F32 || b->type == type_traits[gate->type].vec_dot_type);
+
+    GGML_ASSERT(!gate->grad && !up->grad && !b->grad); // TODO: implement backward
+
+    const int64_t ne[4] = { gate->ne[1], b->ne[1], 1, 1 };
+    struct ggml_tensor * result = ggml_new_tensor(ctx, GGML_TYPE_F32, 4, ne);
+
+    if (pred) {
+        GGML_ASSERT(pred->type == GGML_TYPE_F32);
+        GGML_ASSERT(ggml_are_same_shape(pred, result));
+        GGML_ASSERT(pred->nb[0] == sizeof(float));
+    }
+
+    result->op     = GGML_OP_MUL_MAT_SWIGLU;
+    result->grad   = NULL;
+    result->src[0] = gate;
+    result->src[1] = b;
+    result->src[2] = up;
+    result->src[3] = pred;
+
+    return result;
+}
+
+struct ggml_tensor * ggml_mul_mat_swiglu(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * gate,
+        struct ggml_tensor  * up,
+        struct ggml_tensor  * b) {
+    return ggml_mul_mat_swiglu_impl(ctx, gate, up, b, NULL);
+}
+
+struct ggml_tensor * ggml_mul_mat_swiglu_sparse(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * gate,
+        struct ggml_tensor  * up,
+        struct ggml_tensor  * b,
+        struct ggml_tensor  * pred) {
+    return ggml_mul_mat_swiglu_impl(ctx, gate, up, b, pred);
+}
+
+// ggml_mul_mat_axpy
+
+struct ggml_tensor * ggml_mul_mat_axpy(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b) {
+    GGML_ASSERT(a->ne[1] == b->ne[0]);
+    GGML_ASSERT(!ggml_is_transposed(a));
+    GGML_ASSERT(ggml_is_matrix(a) && ggml_is_matrix(b));
+    GGML_ASSERT(b->type == GGML_TYPE_F32);
+    GGML_ASSERT(a->type == GGML_TYPE_F32 || type_traits[a->type].to_float);
+
+    GGML_ASSERT(!a->grad && !b->grad); // TODO: implement backward
+
+    const int64_t ne[4] = { a->ne[0], b->ne[1], 1, 1 };
+    struct ggml_tensor * result = ggml_new_tensor(ctx, GGML_TYPE_F32, 4, ne);
+
+    result->op     = GGML_OP_MUL_MAT_AXPY;
+    result->grad   = NULL;
+    result->src[0] = a;
+    result->src[1] = b;
+
+    return result;
+}
+
 // ggml_out_prod
 
 struct ggml_tensor * ggml_out_prod(
@@ -4266,10 +5048,12 @@ static struct ggml_tensor * ggml_cpy_impl(
 
     // make a view of the destination
     struct ggml_tensor * result = ggml_view_tensor(ctx, b);
-    if (strlen(b->name) > 0) {
+    if (ctx->no_names) {
+        memcpy(result->name, b->name[0] ? b->name : a->name, sizeof(result->name));
+    } else if (strlen(b->name) > 0) {
         ggml_format_name(result, "%s (copy of %s)", b->name, a->name);
     } else {
-        ggml_format_name(result, "%s (copy)", a->name);
+        ggml_derive_name(ctx, result, a, "copy");
     }
 
     result->op   = GGML_OP_CPY;
@@ -4294,7 +5078,7 @@ struct ggml_tensor * ggml_cast(
     bool is_node = false;
 
     struct ggml_tensor * result = ggml_new_tensor(ctx, type, GGML_MAX_DIMS, a->ne);
-    ggml_format_name(result, "%s (copy)", a->name);
+    ggml_derive_name(ctx, result, a, "copy");
 
     result->op   = GGML_OP_CPY;
     result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
@@ -4316,7 +5100,7 @@ static struct ggml_tensor * ggml_cont_impl(
     }
 
     struct ggml_tensor * result = ggml_dup_tensor(ctx, a);
-    ggml_format_name(result, "%s (cont)", a->name);
+    ggml_derive_name(ctx, result, a, "cont");
 
     result->op   = GGML_OP_CONT;
     result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
@@ -4368,7 +5152,7 @@ struct ggml_tensor * ggml_cont_4d(
     bool is_node = false;
 
     struct ggml_tensor * result = ggml_new_tensor_4d(ctx, a->type, ne0, ne1, ne2, ne3);
-    ggml_format_name(result, "%s (cont)", a->name);
+    ggml_derive_name(ctx, result, a, "cont");
 
     result->op   = GGML_OP_CONT;
     result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
@@ -4399,7 +5183,7 @@ struct ggml_tensor * ggml_reshape(
     }
 
     struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, GGML_MAX_DIMS, b->ne, a, 0);
-    ggml_format_name(result, "%s (reshaped)", a->name);
+    ggml_derive_name(ctx, result, a, "reshaped");
 
     result->op   = GGML_OP_RESHAPE;
     result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
@@ -4423,7 +5207,7 @@ struct ggml_tensor * ggml_reshape_1d(
 
     const int64_t ne[1] = { ne0 };
     struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 1, ne, a, 0);
-    ggml_format_name(result, "%s (reshaped)", a->name);
+    ggml_derive_name(ctx, result, a, "reshaped");
 
     result->op   = GGML_OP_RESHAPE;
     result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
@@ -4448,7 +5232,7 @@ struct ggml_tensor * ggml_reshape_2d(
 
     const int64_t ne[2] = { ne0, ne1 };
     struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 2, ne, a, 0);
-    ggml_format_name(result, "%s (reshaped)", a->name);
+    ggml_derive_name(ctx, result, a, "reshaped");
 
     result->op   = GGML_OP_RESHAPE;
     result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
@@ -4474,7 +5258,7 @@ struct ggml_tensor * ggml_reshape_3d(
 
     const int64_t ne[3] = { ne0, ne1, ne2 };
     struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 3, ne, a, 0);
-    ggml_format_name(result, "%s (reshaped)", a->name);
+    ggml_derive_name(ctx, result, a, "reshaped");
 
     result->op   = GGML_OP_RESHAPE;
     result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
@@ -4501,7 +5285,7 @@ struct ggml_tensor * ggml_reshape_4d(
 
     const int64_t ne[4] = { ne0, ne1, ne2, ne3 };
     struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 4, ne, a, 0);
-    ggml_format_name(result, "%s (reshaped)", a->name);
+    ggml_derive_name(ctx, result, a, "reshaped");
 
     result->op   = GGML_OP_RESHAPE;
     result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
@@ -4524,7 +5308,7 @@ static struct ggml_tensor * ggml_view_impl(
     }
 
     struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, n_dims, ne, a, offset);
-    ggml_format_name(result, "%s (view)", a->name);
+    ggml_derive_name(ctx, result, a, "view");
 
     ggml_set_op_params(result, &offset, sizeof(offset));
 
@@ -4645,7 +5429,7 @@ struct ggml_tensor * ggml_permute(
     }
 
     struct ggml_tensor * result = ggml_view_tensor(ctx, a);
-    ggml_format_name(result, "%s (permuted)", a->name);
+    ggml_derive_name(ctx, result, a, "permuted");
 
     int ne[GGML_MAX_DIMS];
     int nb[GGML_MAX_DIMS];
@@ -4692,7 +5476,7 @@ struct ggml_tensor * ggml_transpose(
     }
 
     struct ggml_tensor * result = ggml_view_tensor(ctx, a);
-    ggml_format_name(result, "%s (transposed)", a->name);
+    ggml_derive_name(ctx, result, a, "transposed");
 
     result->ne[0] = a->ne[1];
     result->ne[1] = a->ne[0];
@@ -5664,6 +6448,9 @@ struct ggml_tensor * ggml_top_k(
 
     struct ggml_tensor * result = ggml_argsort(ctx, a, GGML_SORT_ORDER_DESC);
 
+    // only the first k indices will be looked at
+    ggml_set_op_params_i32(result, 1, k);
+
     result = ggml_view_4d(ctx, result,
                 k, result->ne[1], result->ne[2], result->ne[3],
                    result->nb[1], result->nb[2], result->nb[3],
@@ -7035,6 +7822,24 @@ static void ggml_compute_forward_dup_f32(
                         id += ne00 * (ne01 - ir1);
                     }
                 }
+            } else if (dst->type == GGML_TYPE_BF16) {
+                size_t id = 0;
+                ggml_bf16_t * dst_ptr = (ggml_bf16_t *) dst->data;
+
+                for (int i03 = 0; i03 < ne03; i03++) {
+                    for (int i02 = 0; i02 < ne02; i02++) {
+                        id += ne00 * ir0;
+                        for (int i01 = ir0; i01 < ir1; i01++) {
+                            for (int i00 = 0; i00 < ne00; i00++) {
+                                const float * src0_ptr = (float *) ((char *) src0->data + i00*nb00 + i01*nb01 + i02*nb02 + i03*nb03);
+
+                                dst_ptr[id] = GGML_FP32_TO_BF16(*src0_ptr);
+                                id++;
+                            }
+                        }
+                        id += ne00 * (ne01 - ir1);
+                    }
+                }
             } else {
                 GGML_ASSERT(false); // TODO: implement
             }
@@ -7154,11 +7959,167 @@ static void ggml_compute_forward_dup_f32(
                 }
             }
         }
+    } else if (dst->type == GGML_TYPE_BF16) {
+        for (int64_t i03 = 0; i03 < ne03; i03++) {
+            for (int64_t i02 = 0; i02 < ne02; i02++) {
+                i10 += ne00 * ir0;
+                while (i10 >= ne0) {
+                    i10 -= ne0;
+                    if (++i11 == ne1) {
+                        i11 = 0;
+                        if (++i12 == ne2) {
+                            i12 = 0;
+                            if (++i13 == ne3) {
+                                i13 = 0;
+                            }
+                        }
+                    }
+                }
+                for (int64_t i01 = ir0; i01 < ir1; i01++) {
+                    for (int64_t i00 = 0; i00 < ne00; i00++) {
+                        const char * src0_ptr = ((char *) src0->data + i00*nb00 + i01*nb01 + i02*nb02 + i03*nb03);
+                              char * dst_ptr  = ((char *)  dst->data + i10*nb0  + i11*nb1  + i12*nb2  + i13*nb3);
+
+                        *(ggml_bf16_t *) dst_ptr = GGML_FP32_TO_BF16(*(const float *) src0_ptr);
+
+                        if (++i10 == ne0) {
+                            i10 = 0;
+                            if (++i11 == ne1) {
+                                i11 = 0;
+                                if (++i12 == ne2) {
+                                    i12 = 0;
+                                    if (++i13 == ne3) {
+                                        i13 = 0;
+                                    }
+                                }
+                            }
+                        }
+                    }
+                }
+                i10 += ne00 * (ne01 - ir1);
+                while (i10 >= ne0) {
+                    i10 -= ne0;
+                    if (++i11 == ne1) {
+                        i11 = 0;
+                        if (++i12 == ne2) {
+                            i12 = 0;
+                            if (++i13 == ne3) {
+                                i13 = 0;
+                            }
+                        }
+                    }
+                }
+            }
+        }
     } else {
         GGML_ASSERT(false); // TODO: implement
     }
 }
 
+static void ggml_compute_forward_dup_bf16(
+        const struct ggml_compute_params * params,
+        struct ggml_tensor * dst) {
+
+    const struct ggml_tensor * src0 = dst->src[0];
+
+    GGML_ASSERT(ggml_nelements(dst) == ggml_nelements(src0));
+    GGML_ASSERT(dst->type == GGML_TYPE_F32); // TODO: implement
+
+    if (params->type == GGML_TASK_TYPE_INIT || params->type == GGML_TASK_TYPE_FINALIZE) {
+        return;
+    }
+
+    GGML_TENSOR_UNARY_OP_LOCALS
+
+    const int ith = params->ith; // thread index
+    const int nth = params->nth; // number of threads
+
+    // parallelize by rows
+    const int nr = ne01;
+    // number of rows per thread
+    const int dr = (nr + nth - 1) / nth;
+    // row range for this thread
+    const int ir0 = dr * ith;
+    const int ir1 = MIN(ir0 + dr, nr);
+
+    if (ggml_is_contiguous(dst) && nb00 == sizeof(ggml_bf16_t)) {
+        size_t id = 0;
+        float * dst_ptr = (float *) dst->data;
+
+        for (int i03 = 0; i03 < ne03; i03++) {
+            for (int i02 = 0; i02 < ne02; i02++) {
+                id += ne00 * ir0;
+                for (int i01 = ir0; i01 < ir1; i01++) {
+                    const ggml_bf16_t * src0_ptr = (ggml_bf16_t *) ((char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03);
+                    ggml_bf16_to_fp32_row(src0_ptr, dst_ptr + id, ne00);
+                    id += ne00;
+                }
+                id += ne00 * (ne01 - ir1);
+            }
+        }
+        return;
+    }
+
+    // dst counters
+
+    int64_t i10 = 0;
+    int64_t i11 = 0;
+    int64_t i12 = 0;
+    int64_t i13 = 0;
+
+    for (int64_t i03 = 0; i03 < ne03; i03++) {
+        for (int64_t i02 = 0; i02 < ne02; i02++) {
+            i10 += ne00 * ir0;
+            while (i10 >= ne0) {
+                i10 -= ne0;
+                if (++i11 == ne1) {
+                    i11 = 0;
+                    if (++i12 == ne2) {
+                        i12 = 0;
+                        if (++i13 == ne3) {
+                            i13 = 0;
+                        }
+                    }
+                }
+            }
+            for (int64_t i01 = ir0; i01 < ir1; i01++) {
+                for (int64_t i00 = 0; i00 < ne00; i00++) {
+                    const char * src0_ptr = ((char *) src0->data + i00*nb00 + i01*nb01 + i02*nb02 + i03*nb03);
+                          char * dst_ptr  = ((char *)  dst->data + i10*nb0  + i11*nb1  + i12*nb2  + i13*nb3);
+
+                    *(float *) dst_ptr = GGML_BF16_TO_FP32(*(const ggml_bf16_t *) src0_ptr);
+
+                    if (++i10 == ne0) {
+                        i10 = 0;
+                        if (++i11 == ne1) {
+                            i11 = 0;
+                            if (++i12 == ne2) {
+                                i12 = 0;
+                                if (++i13 == ne3) {
+                                    i13 = 0;
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+            i10 += ne00 * (ne01 - ir1);
+            while (i10 >= ne0) {
+                i10 -= ne0;
+                if (++i11 == ne1) {
+                    i11 = 0;
+                    if (++i12 == ne2) {
+                        i12 = 0;
+                        if (++i13 == ne3) {
+                            i13 = 0;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
 // A simplified version of ggml_compute_forward_dup that doesn't do float upcasting, and just plain old memcpy.
 static void ggml_compute_forward_dup_bytes(
         const struct ggml_compute_params * params,
@@ -7331,6 +8292,10 @@ static void ggml_compute_forward_dup(
             {
                 ggml_compute_forward_dup_f32(params, dst);
             } break;
+        case GGML_TYPE_BF16:
+            {
+                ggml_compute_forward_dup_bf16(params, dst);
+            } break;
         default:
             {
                 GGML_ASSERT(false);
@@ -7679,6 +8644,7 @@ static void ggml_compute_forward_add(
         case GGML_TYPE_Q5_0:
         case GGML_TYPE_Q5_1:
         case GGML_TYPE_Q8_0:
+        case GGML_TYPE_F8_E4M3:
         case GGML_TYPE_Q2_K:
         case GGML_TYPE_Q3_K:
         case GGML_TYPE_Q4_K:
@@ -7961,6 +8927,7 @@ static void ggml_compute_forward_add1(
         case GGML_TYPE_Q5_0:
         case GGML_TYPE_Q5_1:
         case GGML_TYPE_Q8_0:
+        case GGML_TYPE_F8_E4M3:
         case GGML_TYPE_Q8_1:
         case GGML_TYPE_Q2_K:
         case GGML_TYPE_Q3_K:
@@ -8089,6 +9056,7 @@ static void ggml_compute_forward_acc(
         case GGML_TYPE_Q5_0:
         case GGML_TYPE_Q5_1:
         case GGML_TYPE_Q8_0:
+        case GGML_TYPE_F8_E4M3:
         case GGML_TYPE_Q8_1:
         case GGML_TYPE_Q2_K:
         case GGML_TYPE_Q3_K:
@@ -10098,34 +11066,111 @@ static void ggml_compute_forward_rms_norm_back(
     }
 }
 
-// ggml_compute_forward_group_norm
+// ggml_compute_forward_rms_norm_mul
 
-static void ggml_compute_forward_group_norm_f32(
-    const struct ggml_compute_params * params,
-    struct ggml_tensor * dst) {
+static void ggml_compute_forward_rms_norm_mul_f32(
+        const struct ggml_compute_params * params,
+        struct ggml_tensor * dst) {
 
     const struct ggml_tensor * src0 = dst->src[0];
-
-    GGML_ASSERT(ggml_are_same_shape(src0, dst));
+    const struct ggml_tensor * src1 = dst->src[1];
 
     if (params->type == GGML_TASK_TYPE_INIT || params->type == GGML_TASK_TYPE_FINALIZE) {
         return;
     }
 
     GGML_ASSERT(src0->nb[0] == sizeof(float));
+    GGML_ASSERT(src1->nb[0] == sizeof(float));
 
     const int ith = params->ith;
     const int nth = params->nth;
 
-    GGML_TENSOR_UNARY_OP_LOCALS
+    GGML_TENSOR_BINARY_OP_LOCALS
 
-    const float eps = 1e-6f; // TODO: make this a parameter
+    float eps;
+    memcpy(&eps, dst->op_params, sizeof(float));
 
-    // TODO: optimize
+    GGML_ASSERT(eps > 0.0f);
 
-    int n_channels = src0->ne[2];
-    int n_groups = dst->op_params[0];
-    int n_channels_per_group = (n_channels + n_groups - 1) / n_groups;
+    // rows that aren't stored as f32 are normalized in our own scratch
+    // row and then converted straight into dst
+    ggml_from_float_t const from_float = type_traits[dst->type].from_float;
+    float * wdata = (float *) params->wdata + (ne00 + CACHE_LINE_SIZE_F32) * ith;
+
+    for (int64_t i03 = 0; i03 < ne03; i03++) {
+        for (int64_t i02 = 0; i02 < ne02; i02++) {
+            for (int64_t i01 = ith; i01 < ne01; i01 += nth) {
+                const float * x = (float *) ((char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03);
+                const float * w = (float *) ((char *) src1->data + (i01 % ne11)*nb11 + (i02 % ne12)*nb12 + (i03 % ne13)*nb13);
+
+                ggml_float sum = 0.0;
+                for (int64_t i00 = 0; i00 < ne00; i00++) {
+                    sum += (ggml_float)(x[i00] * x[i00]);
+                }
+
+                const float mean = sum/ne00;
+                const float scale = 1.0f/sqrtf(mean + eps);
+
+                char * y = (char *) dst->data + i01*nb1 + i02*nb2 + i03*nb3;
+                float * z = dst->type == GGML_TYPE_F32 ? (float *) y : wdata;
+
+                ggml_vec_mul_f32(ne00, z, x, w);
+                ggml_vec_scale_f32(ne00, z, scale);
+
+                if (dst->type != GGML_TYPE_F32) {
+                    from_float(z, y, ne00);
+                }
+            }
+        }
+    }
+}
+
+static void ggml_compute_forward_rms_norm_mul(
+        const struct ggml_compute_params * params,
+        struct ggml_tensor * dst) {
+
+    const struct ggml_tensor * src0 = dst->src[0];
+
+    switch (src0->type) {
+        case GGML_TYPE_F32:
+            {
+                ggml_compute_forward_rms_norm_mul_f32(params, dst);
+            } break;
+        default:
+            {
+                GGML_ASSERT(false);
+            } break;
+    }
+}
+
+// ggml_compute_forward_group_norm
+
+static void ggml_compute_forward_group_norm_f32(
+    const struct ggml_compute_params * params,
+    struct ggml_tensor * dst) {
+
+    const struct ggml_tensor * src0 = dst->src[0];
+
+    GGML_ASSERT(ggml_are_same_shape(src0, dst));
+
+    if (params->type == GGML_TASK_TYPE_INIT || params->type == GGML_TASK_TYPE_FINALIZE) {
+        return;
+    }
+
+    GGML_ASSERT(src0->nb[0] == sizeof(float));
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    GGML_TENSOR_UNARY_OP_LOCALS
+
+    const float eps = 1e-6f; // TODO: make this a parameter
+
+    // TODO: optimize
+
+    int n_channels = src0->ne[2];
+    int n_groups = dst->op_params[0];
+    int n_channels_per_group = (n_channels + n_groups - 1) / n_groups;
     for (int i = ith; i < n_groups; i += nth) {
         int start = i * n_channels_per_group;
         int end = start + n_channels_per_group;
@@ -10198,6 +11243,61 @@ static void ggml_compute_forward_group_norm(
 
 // ggml_compute_forward_mul_mat
 
+// the q, k and v projections of a layer, or its ffn gate and up, all
+// multiply the same activation, which would otherwise be converted to
+// vec_dot_type once per matmul. the first one converts it into a part
+// of the work buffer nothing else uses, and the others read it there.
+struct ggml_src1_cache {
+    const struct ggml_tensor * src1;  // whose converted rows are in data
+    enum ggml_type             type;  // vec_dot_type they were converted to
+    const struct ggml_tensor * fill;  // mul_mat that should convert into data
+    size_t                     size;
+    char                     * data;
+};
+
+// multiplies weights split by ggml_numa_shard() with a few vectors.
+// threads take chunks of rows from the shard on their own node, then
+// help the other nodes once their own shard is done. next holds one
+// zeroed counter per node, a cache line apart
+static void ggml_compute_forward_mul_mat_sharded(
+        struct ggml_tensor * dst,
+        const char * src0_data,
+        const char * src1_data,
+        size_t src1_col_stride,
+        char * next) {
+
+    const struct ggml_tensor * src0 = dst->src[0];
+    const struct ggml_tensor * src1 = dst->src[1];
+
+    GGML_TENSOR_BINARY_OP_LOCALS
+
+    ggml_vec_dot_t const vec_dot = type_traits[src0->type].vec_dot;
+
+    const int n_nodes = g_state.numa.n_nodes;
+    const int home = g_numa_node < 0 ? 0 : g_numa_node;
+
+    for (int j = 0; j < n_nodes; ++j) {
+        const int k = (home + j) % n_nodes;
+        const int64_t r0 = ggml_numa_shard_row(ne01, k);
+        const int64_t r1 = ggml_numa_shard_row(ne01, k + 1);
+        atomic_int * counter = (atomic_int *) (next + k*CACHE_LINE_SIZE);
+        for (;;) {
+            const int64_t i0 = r0 + (int64_t) atomic_fetch_add_explicit(counter, 1, memory_order_relaxed) * GGML_NUMA_SHARD_CHUNK;
+            if (i0 >= r1) {
+                break;
+            }
+            const int64_t i1 = MIN(i0 + GGML_NUMA_SHARD_CHUNK, r1);
+            for (int64_t i11 = 0; i11 < ne11; ++i11) {
+                const char * src1_col = src1_data + i11*src1_col_stride;
+                float * dst_col = (float *) ((char *) dst->data + i11*nb1);
+                for (int64_t ir0 = i0; ir0 < i1; ++ir0) {
+                    vec_dot(ne00, &dst_col[ir0], 0, src0_data + ir0*nb01, 0, src1_col, 0, 1);
+                }
+            }
+        }
+    }
+}
+
 #if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
 // helper function to determine if it is better to use BLAS or not
 // for large matrices, BLAS is faster
@@ -10255,6 +11355,14 @@ static void ggml_compute_forward_mul_mat(
     ggml_from_float_t const from_float_to_vec_dot = type_traits[vec_dot_type].from_float;
     int64_t           const vec_dot_num_rows      = type_traits[type].nrows;
 
+    // weights on our own numa node, if they've been mirrored
+    const char * src0_data = ggml_numa_local(src0->data);
+
+    // matrix-vector products of weights split over numa nodes
+    const bool sharded = ne11 <= GGML_NUMA_SHARD_MAX_ROWS &&
+        ne02 == 1 && ne03 == 1 && ne12 == 1 && ne13 == 1 &&
+        ggml_numa_is_sharded(src0->data);
+
     GGML_ASSERT(ne0 == ne01);
     GGML_ASSERT(ne1 == ne11);
     GGML_ASSERT(ne2 == ne12);
@@ -10356,18 +11464,22 @@ static void ggml_compute_forward_mul_mat(
 #endif
 
 #if GGML_USE_LLAMAFILE
-    if (src1_cont) {
+    // when src0 is broadcast, e.g. one kv head serving a group of query
+    // heads, the group is multiplied as a single matmul with r2 times as
+    // many columns, so each row of src0 gets read once instead of r2 times
+    const int64_t g2 = nb2 == ne1*nb1 ? r2 : 1;
+
+    if (src1_cont && !sharded) {
         for (int64_t i13 = 0; i13 < ne13; i13++)
-            for (int64_t i12 = 0; i12 < ne12; i12++)
-                if (!llamafile_sgemm(ne01, ne11, ne00/ggml_blck_size(src0->type),
-                                     (const char *)src0->data + i12/r2*nb02 + i13/r3*nb03,
+            for (int64_t i12 = 0; i12 < ne12; i12 += g2)
+                if (!llamafile_sgemm(params,
+                                     ne01, ne11*g2, ne00/ggml_blck_size(src0->type),
+                                     src0_data + i12/r2*nb02 + i13/r3*nb03,
                                      nb01/ggml_type_size(src0->type),
                                      (const char *)src1->data + i12*nb12 + i13*nb13,
                                      nb11/ggml_type_size(src1->type),
                                      (char *)dst->data + i12*nb2 + i13*nb3,
                                      nb1/ggml_type_size(dst->type),
-                                     ith, nth,
-                                     params->type,
                                      src0->type,
                                      src1->type,
                                      dst->type,
@@ -10378,11 +11490,15 @@ static void ggml_compute_forward_mul_mat(
 UseGgmlGemm1:;
 #endif
 
-    if (src1->type != vec_dot_type) {
-        char * wdata = params->wdata;
+    struct ggml_src1_cache * cache = params->src1_cache;
+    const bool cached = cache && cache->src1 == src1 && cache->type == vec_dot_type;
+    const bool fill   = cache && !cached && cache->fill == dst;
+
+    if (src1->type != vec_dot_type && !cached) {
+        char * wdata = fill ? cache->data : params->wdata;
         const size_t row_size = ggml_row_size(vec_dot_type, ne10);
 
-        assert(params->wsize >= ne11*ne12*ne13*row_size);
+        assert((fill ? cache->size : params->wsize) >= ne11*ne12*ne13*row_size);
         GGML_ASSERT(src1->type == GGML_TYPE_F32);
 
         unsigned chore = 0; // [jart] need for speed
@@ -10398,24 +11514,35 @@ UseGgmlGemm1:;
         }
 
         ggml_syncthreads(params->barrier, params->nth);
+
+        if (fill && ith == 0) {
+            // every thread has decided whether it hit by now
+            cache->src1 = src1;
+            cache->type = vec_dot_type;
+        }
     }
 
-    const void * wdata    = (src1->type == vec_dot_type) ? src1->data : params->wdata;
+    const bool in_cache   = cached || fill;
+    const void * wdata    = (src1->type == vec_dot_type) ? src1->data : in_cache ? cache->data : params->wdata;
     const size_t row_size = ggml_row_size(vec_dot_type, ne10);
 
 #if GGML_USE_LLAMAFILE
-    if (src1->type != vec_dot_type) {
+    if (src1->type != vec_dot_type && !sharded) {
+        // the scratch memory after the quantized src1 is free
+        struct ggml_compute_params sgemm_params = *params;
+        const size_t sgemm_offs = in_cache ? 0 : GGML_PAD(ggml_row_size(vec_dot_type, ggml_nelements(src1)), CACHE_LINE_SIZE);
+        sgemm_params.wdata = (char *)params->wdata + sgemm_offs;
+        sgemm_params.wsize = params->wsize > sgemm_offs ? params->wsize - sgemm_offs : 0;
         for (int64_t i13 = 0; i13 < ne13; i13++)
-            for (int64_t i12 = 0; i12 < ne12; i12++)
-                if (!llamafile_sgemm(ne01, ne11, ne00/ggml_blck_size(src0->type),
-                                     (const char *)src0->data + i12/r2*nb02 + i13/r3*nb03,
+            for (int64_t i12 = 0; i12 < ne12; i12 += g2)
+                if (!llamafile_sgemm(&sgemm_params,
+                                     ne01, ne11*g2, ne00/ggml_blck_size(src0->type),
+                                     src0_data + i12/r2*nb02 + i13/r3*nb03,
                                      nb01/ggml_type_size(src0->type),
                                      (const char *)wdata + (i12*ne11 + i13*ne12*ne11)*row_size,
                                      row_size/ggml_type_size(vec_dot_type),
                                      (char *)dst->data + i12*nb2 + i13*nb3,
                                      nb1/ggml_type_size(dst->type),
-                                     ith, nth,
-                                     params->type,
                                      src0->type,
                                      vec_dot_type,
                                      dst->type,
@@ -10426,6 +11553,21 @@ UseGgmlGemm1:;
 UseGgmlGemm2:;
 #endif
 
+    if (sharded) {
+        // the shard counters go after the quantized src1
+        char * next = (char *) params->wdata;
+        if (src1->type != vec_dot_type && !in_cache) {
+            next += GGML_PAD(ggml_row_size(vec_dot_type, ggml_nelements(src1)), CACHE_LINE_SIZE);
+        }
+        if (ith == 0) {
+            memset(next, 0, g_state.numa.n_nodes*CACHE_LINE_SIZE);
+        }
+        ggml_syncthreads(params->barrier, params->nth);
+        ggml_compute_forward_mul_mat_sharded(dst, src0_data, wdata,
+                                             src1_cont || src1->type != vec_dot_type ? row_size : nb11, next);
+        return;
+    }
+
     const int64_t nr0 = ne01;          // src0 rows
     const int64_t nr1 = ne1*ne12*ne13; // src1 rows
 
@@ -10439,14 +11581,11 @@ UseGgmlGemm2:;
     const int64_t ith0 = ith % nth0;
     const int64_t ith1 = ith / nth0;
 
-    const int64_t dr0 = (nr0 + nth0 - 1)/nth0;
-    const int64_t dr1 = (nr1 + nth1 - 1)/nth1;
-
-    const int64_t ir010 = dr0*ith0;
-    const int64_t ir011 = MIN(ir010 + dr0, nr0);
-
-    const int64_t ir110 = dr1*ith1;
-    const int64_t ir111 = MIN(ir110 + dr1, nr1);
+    // threads on slower cores of a hybrid cpu get fewer rows
+    long ir010, ir011;
+    long ir110, ir111;
+    llamafile_share(nr0, ith0, nth0, &ir010, &ir011);
+    llamafile_share(nr1, ith1, nth1, &ir110, &ir111);
 
     //printf("ir010 = %6lld, ir011 = %6lld, ir110 = %6lld, ir111 = %6lld\n", ir010, ir011, ir110, ir111);
 
@@ -10492,7 +11631,7 @@ UseGgmlGemm2:;
                 const int64_t i2 = i12;
                 const int64_t i3 = i13;
 
-                const char * src0_row = (const char *) src0->data + (0 + i02*nb02 + i03*nb03);
+                const char * src0_row = src0_data + (0 + i02*nb02 + i03*nb03);
 
                 // desc: when src1 is not a contiguous memory block we have to calculate the offset using the strides
                 //       if it is, then we have either copied the data to params->wdata and made it contiguous or we are using
@@ -10529,6 +11668,184 @@ UseGgmlGemm2:;
 #endif
 }
 
+// ggml_compute_forward_mul_mat_swiglu
+
+static void ggml_compute_forward_mul_mat_swiglu(
+        const struct ggml_compute_params * params,
+              struct ggml_tensor * dst) {
+
+    const struct ggml_tensor * src0 = dst->src[0]; // gate
+    const struct ggml_tensor * src1 = dst->src[1];
+    const struct ggml_tensor * src2 = dst->src[2]; // up
+    const struct ggml_tensor * src3 = dst->src[3]; // pred, if sparse
+
+    GGML_TENSOR_BINARY_OP_LOCALS
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const enum ggml_type type = src0->type;
+
+    ggml_vec_dot_t    const vec_dot               = type_traits[type].vec_dot;
+    enum ggml_type    const vec_dot_type          = type_traits[type].vec_dot_type;
+    ggml_from_float_t const from_float_to_vec_dot = type_traits[vec_dot_type].from_float;
+
+    // weights on our own numa node, if they've been mirrored
+    const char * gate_data = ggml_numa_local(src0->data);
+    const char * up_data   = ggml_numa_local(src2->data);
+
+    GGML_ASSERT(ne0 == ne01);
+    GGML_ASSERT(ne1 == ne11);
+    GGML_ASSERT(nb00 == ggml_type_size(type));
+    GGML_ASSERT(nb10 == ggml_type_size(src1->type));
+    GGML_ASSERT(nb0 == sizeof(float));
+    GGML_ASSERT(src2->nb[1] == nb01);
+
+    GGML_ASSERT(params->type == GGML_TASK_TYPE_COMPUTE);
+
+    const size_t row_size = ggml_row_size(vec_dot_type, ne10);
+
+    if (src1->type != vec_dot_type) {
+        char * wdata = params->wdata;
+
+        assert(params->wsize >= ne11*row_size);
+
+        for (int64_t i11 = ith; i11 < ne11; i11 += nth) {
+            from_float_to_vec_dot((float *)((char *) src1->data + i11*nb11), (void *) (wdata + i11*row_size), ne10);
+        }
+
+        ggml_syncthreads(params->barrier, params->nth);
+    }
+
+    const char * wdata = (src1->type == vec_dot_type) ? (const char *) src1->data : (const char *) params->wdata;
+    const size_t src1_col_stride = src1->type == vec_dot_type ? nb11 : row_size;
+
+    const int64_t nr0 = ne01;
+    const int64_t nr1 = ne11;
+
+    // distribute the thread work the same way ggml_compute_forward_mul_mat() does
+
+    const int64_t nth0 = nr0 > nr1 ? nth : 1;
+    const int64_t nth1 = nr0 > nr1 ? 1 : nth;
+
+    const int64_t ith0 = ith % nth0;
+    const int64_t ith1 = ith / nth0;
+
+    // threads on slower cores of a hybrid cpu get fewer rows
+    long ir010, ir011;
+    long ir110, ir111;
+    llamafile_share(nr0, ith0, nth0, &ir010, &ir011);
+    llamafile_share(nr1, ith1, nth1, &ir110, &ir111);
+
+    if (ir010 >= ir011 || ir110 >= ir111) {
+        return;
+    }
+
+    const int64_t blck_0 = 16;
+    const int64_t blck_1 = 16;
+
+    // both products of a block are kept on the stack, which means the
+    // intermediate up and gate tensors never hit memory
+    float tmp_gate[16];
+    float tmp_up[16];
+
+    for (int64_t iir1 = ir110; iir1 < ir111; iir1 += blck_1) {
+        for (int64_t iir0 = ir010; iir0 < ir011; iir0 += blck_0) {
+            const int64_t n0 = MIN(iir0 + blck_0, ir011) - iir0;
+            for (int64_t ir1 = iir1; ir1 < iir1 + blck_1 && ir1 < ir111; ++ir1) {
+                const char * src1_col = wdata + ir1*src1_col_stride;
+                float * dst_col = (float *) ((char *) dst->data + ir1*nb1);
+                const float * pred_col = src3 ? (const float *) ((const char *) src3->data + ir1*src3->nb[1]) : NULL;
+
+                for (int64_t ir0 = 0; ir0 < n0; ++ir0) {
+                    if (pred_col && pred_col[iir0 + ir0] <= 0.0f) {
+                        // silu(0)*0 is the zero the neuron was predicted to be
+                        tmp_gate[ir0] = 0.0f;
+                        tmp_up[ir0]   = 0.0f;
+                        continue;
+                    }
+                    vec_dot(ne00, &tmp_gate[ir0], 0, gate_data + (iir0 + ir0)*nb01, 0, src1_col, 0, 1);
+                    vec_dot(ne00, &tmp_up[ir0],   0, up_data   + (iir0 + ir0)*nb01, 0, src1_col, 0, 1);
+                }
+
+                ggml_vec_silu_f32(n0, tmp_gate, tmp_gate);
+                ggml_vec_mul_f32(n0, dst_col + iir0, tmp_gate, tmp_up);
+            }
+        }
+    }
+}
+
+// ggml_compute_forward_mul_mat_axpy
+
+static void ggml_compute_forward_mul_mat_axpy(
+        const struct ggml_compute_params * params,
+              struct ggml_tensor * dst) {
+
+    const struct ggml_tensor * src0 = dst->src[0];
+    const struct ggml_tensor * src1 = dst->src[1];
+
+    GGML_TENSOR_BINARY_OP_LOCALS
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const enum ggml_type type = src0->type;
+    ggml_to_float_t const to_float = type_traits[type].to_float;
+
+    const char * a_data = ggml_numa_local(src0->data);
+
+    GGML_ASSERT(ne0 == ne00);
+    GGML_ASSERT(ne1 == ne11);
+    GGML_ASSERT(ne01 == ne10);
+    GGML_ASSERT(nb00 == ggml_type_size(type));
+    GGML_ASSERT(nb10 == sizeof(float));
+    GGML_ASSERT(nb0 == sizeof(float));
+
+    GGML_ASSERT(params->type == GGML_TASK_TYPE_COMPUTE);
+
+    // each thread owns whole blocks of the output, so it can dequantize
+    // its slice of a row without touching anyone else's
+    const int64_t blck = ggml_blck_size(type);
+    const int64_t nblk = ne00/blck;
+
+    long ib0, ib1;
+    llamafile_share(nblk, ith, nth, &ib0, &ib1);
+
+    if (ib0 >= ib1) {
+        return;
+    }
+
+    const int64_t i0  = ib0*blck;
+    const int64_t nc  = (ib1 - ib0)*blck;
+    const size_t  off = ib0*ggml_type_size(type);
+
+    for (int64_t i1 = 0; i1 < ne1; ++i1) {
+        memset((char *) dst->data + i1*nb1 + i0*sizeof(float), 0, nc*sizeof(float));
+    }
+
+    float * tmp = (float *) params->wdata + (ne00 + CACHE_LINE_SIZE_F32) * ith;
+
+    for (int64_t i01 = 0; i01 < ne01; ++i01) {
+        const float * row = NULL;
+        for (int64_t i1 = 0; i1 < ne1; ++i1) {
+            const float v = *(const float *) ((const char *) src1->data + i01*nb10 + i1*nb11);
+            if (v == 0.0f) {
+                continue;
+            }
+            if (!row) {
+                const char * a_row = a_data + i01*nb01 + off;
+                if (type == GGML_TYPE_F32) {
+                    row = (const float *) a_row;
+                } else {
+                    to_float(a_row, tmp, nc);
+                    row = tmp;
+                }
+            }
+            ggml_vec_mad_f32(nc, (float *) ((char *) dst->data + i1*nb1) + i0, row, v);
+        }
+    }
+}
+
 // ggml_compute_forward_mul_mat_id
 
 static void ggml_compute_forward_mul_mat_id(
@@ -10539,6 +11856,18 @@ static void ggml_compute_forward_mul_mat_id(
     const struct ggml_tensor * src1 = dst->src[1];
     const struct ggml_tensor * ids = dst->src[2];
 
+    // rows for the experts ggml_mul_mat_id_masked left out are zero
+    if (params->type == GGML_TASK_TYPE_INIT && params->ith == 0 && ggml_get_op_params_i32(dst, 0)) {
+        for (int64_t iid1 = 0; iid1 < ids->ne[1]; ++iid1) {
+            for (int64_t id = 0; id < ids->ne[0]; ++id) {
+                const int32_t i02 = *(const int32_t *) ((const char *) ids->data + iid1*ids->nb[1] + id*ids->nb[0]);
+                if (ggml_mul_mat_id_slot(dst, i02) < 0) {
+                    memset((char *) dst->data + id*dst->nb[1] + iid1*dst->nb[2], 0, dst->ne[0]*sizeof(float));
+                }
+            }
+        }
+    }
+
     if (llamafile_mixmul(params, src0, src1, ids, dst))
         return;
 
@@ -10610,9 +11939,14 @@ static void ggml_compute_forward_mul_mat_id(
         // group rows by src0 matrix
         for (int64_t iid1 = 0; iid1 < ids->ne[1]; ++iid1) {
             for (int id = 0; id < n_ids; ++id) {
-                const int32_t i02 = *(const int32_t *) ((const char *) ids->data + iid1*ids->nb[1] + id*ids->nb[0]);
+                const int32_t i02 = ggml_mul_mat_id_slot(dst,
+                        *(const int32_t *) ((const char *) ids->data + iid1*ids->nb[1] + id*ids->nb[0]));
+
+                assert(i02 < n_as && (i02 >= 0 || ggml_get_op_params_i32(dst, 0)));
 
-                assert(i02 >= 0 && i02 < n_as);
+                if (i02 < 0) {
+                    continue;
+                }
 
                 MMID_MATRIX_ROW(i02, matrix_row_counts[i02]) = (struct mmid_row_mapping) {id, iid1};
                 matrix_row_counts[i02] += 1;
@@ -10634,7 +11968,7 @@ static void ggml_compute_forward_mul_mat_id(
             continue;
         }
 
-        const char * src0_cur = (const char *) src0->data + cur_a*nb02;
+        const char * src0_cur = (const char *) ggml_numa_local(src0->data) + cur_a*nb02;
 
         const void * wdata    = (src1->type == vec_dot_type) ? src1->data : params->wdata;
         const size_t row_size = ggml_row_size(vec_dot_type, ne10);
@@ -11035,6 +12369,7 @@ static void ggml_compute_forward_out_prod(
         case GGML_TYPE_Q5_0:
         case GGML_TYPE_Q5_1:
         case GGML_TYPE_Q8_0:
+        case GGML_TYPE_F8_E4M3:
         case GGML_TYPE_Q2_K:
         case GGML_TYPE_Q3_K:
         case GGML_TYPE_Q4_K:
@@ -11226,6 +12561,7 @@ static void ggml_compute_forward_set(
         case GGML_TYPE_Q5_0:
         case GGML_TYPE_Q5_1:
         case GGML_TYPE_Q8_0:
+        case GGML_TYPE_F8_E4M3:
         case GGML_TYPE_Q8_1:
         case GGML_TYPE_Q2_K:
         case GGML_TYPE_Q3_K:
@@ -11493,6 +12829,7 @@ static void ggml_compute_forward_get_rows(
         case GGML_TYPE_Q5_0:
         case GGML_TYPE_Q5_1:
         case GGML_TYPE_Q8_0:
+        case GGML_TYPE_F8_E4M3:
         case GGML_TYPE_Q8_1:
         case GGML_TYPE_Q2_K:
         case GGML_TYPE_Q3_K:
@@ -11893,9 +13230,9 @@ static void ggml_compute_forward_soft_max_f32(
         ggml_vec_scale_f32(nc, wp, scale);
         if (mp_f32) {
             if (use_f16) {
-                for (int i = 0; i < nc; ++i) {
-                    wp[i] += GGML_FP16_TO_FP32(mp_f16[i]);
-                }
+                // dp is only written at the end, so it holds the converted row
+                ggml_fp16_to_fp32_row(mp_f16, dp, nc);
+                ggml_vec_acc_f32(nc, wp, dp);
             } else {
                 for (int i = 0; i < nc; ++i) {
                     wp[i] += mp_f32[i];
@@ -11909,9 +13246,8 @@ static void ggml_compute_forward_soft_max_f32(
             const float slope = h < n_head_log2 ? powf(m0, h + 1) : powf(m1, 2*(h - n_head_log2) + 1);
 
             if (use_f16) {
-                for (int i = 0; i < nc; ++i) {
-                    wp[i] += slope*GGML_FP16_TO_FP32(pos_f16[i]);
-                }
+                ggml_fp16_to_fp32_row(pos_f16, dp, nc);
+                ggml_vec_mad_f32(nc, wp, dp, slope);
             } else {
                 for (int i = 0; i < nc; ++i) {
                     wp[i] += slope*pos_f32[i];
@@ -11926,14 +13262,9 @@ static void ggml_compute_forward_soft_max_f32(
         }
 #endif
 
-        float max = -INFINITY;
-        ggml_vec_max_f32(nc, &max, wp);
-
-        float sum = ggml_vec_soft_max_f32(nc, dp, wp, max);
+        float sum = ggml_vec_soft_max_fused_f32(nc, dp, wp);
         assert(sum > 0.0);
-
-        sum = 1.0/sum;
-        ggml_vec_scale_f32(nc, dp, sum);
+        UNUSED(sum);
 
 #ifndef NDEBUG
         for (int i = 0; i < nc; ++i) {
@@ -12204,6 +13535,7 @@ static void ggml_compute_forward_alibi(
         case GGML_TYPE_Q5_0:
         case GGML_TYPE_Q5_1:
         case GGML_TYPE_Q8_0:
+        case GGML_TYPE_F8_E4M3:
         case GGML_TYPE_Q8_1:
         case GGML_TYPE_Q2_K:
         case GGML_TYPE_Q3_K:
@@ -12293,6 +13625,7 @@ static void ggml_compute_forward_clamp(
         case GGML_TYPE_Q5_0:
         case GGML_TYPE_Q5_1:
         case GGML_TYPE_Q8_0:
+        case GGML_TYPE_F8_E4M3:
         case GGML_TYPE_Q8_1:
         case GGML_TYPE_Q2_K:
         case GGML_TYPE_Q3_K:
@@ -12369,6 +13702,26 @@ static void ggml_rope_cache_init(
     }
 }
 
+// same as above for neox, which rotates pairs n_dims/2 apart, and only
+// the first n_dims of them
+static void ggml_rope_cache_init_neox(
+     float theta_base, float freq_scale, float corr_dims[2], int64_t n_dims, float ext_factor, float mscale,
+     float * cache, float sin_sign, float theta_scale
+) {
+    const float inv_ndims = -1.f/n_dims;
+    float theta = theta_base*freq_scale;
+    for (int64_t ic = 0; ic < n_dims; ic += 2) {
+        // simplified from `(ib * n_dims + ic) * inv_ndims`
+        const float cur_rot = inv_ndims * ic;
+        rope_yarn(
+            theta, freq_scale, corr_dims, cur_rot, ext_factor, mscale, &cache[ic + 0], &cache[ic + 1]
+        );
+        cache[ic + 1] *= sin_sign;
+
+        theta *= theta_scale;
+    }
+}
+
 GGML_CALL void ggml_rope_yarn_corr_dims(
     int n_dims, int n_orig_ctx, float freq_base, float beta_fast, float beta_slow, float dims[2]
 ) {
@@ -12438,7 +13791,6 @@ static void ggml_compute_forward_rope_f32(
     int ir = 0;
 
     const float theta_scale = powf(freq_base, -2.0f/n_dims);
-    const float inv_ndims = -1.f/n_dims;
     float corr_dims[2];
     ggml_rope_yarn_corr_dims(n_dims, n_orig_ctx, freq_base, beta_fast, beta_slow, corr_dims);
 
@@ -12456,15 +13808,24 @@ static void ggml_compute_forward_rope_f32(
         for (int64_t i2 = 0; i2 < ne2; i2++) {
             const int64_t p = pos[i2];
 
+            // sin/cos of this position, shared by all of its heads, which
+            // is only worked out if this thread has rows of it
             float * cache = (float *) params->wdata + (ne0 + CACHE_LINE_SIZE_F32)*ith;
-            if (!is_glm && !is_neox) { // TODO: cache sin/cos for glm, neox
-                ggml_rope_cache_init(p, freq_scale, corr_dims, ne0, ext_factor, attn_factor, cache, sin_sign, theta_scale);
-            }
+            bool cached = false;
 
             for (int64_t i1 = 0; i1 < ne1; i1++) {
                 if (ir++ < ir0) continue;
                 if (ir   > ir1) break;
 
+                if (!cached && !is_glm) { // TODO: cache sin/cos for glm
+                    if (is_neox) {
+                        ggml_rope_cache_init_neox(p, freq_scale, corr_dims, n_dims, ext_factor, attn_factor, cache, sin_sign, theta_scale);
+                    } else {
+                        ggml_rope_cache_init(p, freq_scale, corr_dims, ne0, ext_factor, attn_factor, cache, sin_sign, theta_scale);
+                    }
+                    cached = true;
+                }
+
                 float theta_base = (float)p;
 
                 if (is_glm) {
@@ -12514,22 +13875,12 @@ static void ggml_compute_forward_rope_f32(
                     // TODO: this might be wrong for ne0 != n_dims - need double check
                     //       it seems we have to rope just the first n_dims elements and do nothing with the rest
                     // ref:  https://github.com/ml-explore/mlx/blob/dc2edc762c797e3b8de50b1dad4dc0a131691033/benchmarks/python/llama_jax_bench.py#L11-L26
-                    theta_base *= freq_scale;
                     for (int64_t ic = 0; ic < ne0; ic += 2) {
                         if (ic < n_dims) {
                             const int64_t ib = 0;
 
-                            // simplified from `(ib * n_dims + ic) * inv_ndims`
-                            float cur_rot = inv_ndims * ic - ib;
-
-                            float cos_theta, sin_theta;
-                            rope_yarn(
-                                theta_base, freq_scale, corr_dims, cur_rot, ext_factor, attn_factor,
-                                &cos_theta, &sin_theta
-                            );
-                            sin_theta *= sin_sign;
-
-                            theta_base *= theta_scale;
+                            const float cos_theta = cache[ic + 0];
+                            const float sin_theta = cache[ic + 1];
 
                             const int64_t i0 = ib*n_dims + ic/2;
 
@@ -12609,7 +13960,6 @@ static void ggml_compute_forward_rope_f16(
     int ir = 0;
 
     const float theta_scale = powf(freq_base, -2.0f/n_dims);
-    const float inv_ndims = -1.f/n_dims;
     float corr_dims[2];
     ggml_rope_yarn_corr_dims(n_dims, n_orig_ctx, freq_base, beta_fast, beta_slow, corr_dims);
 
@@ -12627,15 +13977,24 @@ static void ggml_compute_forward_rope_f16(
         for (int64_t i2 = 0; i2 < ne2; i2++) {
             const int64_t p = pos[i2];
 
+            // sin/cos of this position, shared by all of its heads, which
+            // is only worked out if this thread has rows of it
             float * cache = (float *) params->wdata + (ne0 + CACHE_LINE_SIZE_F32)*ith;
-            if (!is_glm && !is_neox) { // TODO: cache sin/cos for glm, neox
-                ggml_rope_cache_init(p, freq_scale, corr_dims, ne0, ext_factor, attn_factor, cache, sin_sign, theta_scale);
-            }
+            bool cached = false;
 
             for (int64_t i1 = 0; i1 < ne1; i1++) {
                 if (ir++ < ir0) continue;
                 if (ir   > ir1) break;
 
+                if (!cached && !is_glm) { // TODO: cache sin/cos for glm
+                    if (is_neox) {
+                        ggml_rope_cache_init_neox(p, freq_scale, corr_dims, n_dims, ext_factor, attn_factor, cache, sin_sign, theta_scale);
+                    } else {
+                        ggml_rope_cache_init(p, freq_scale, corr_dims, ne0, ext_factor, attn_factor, cache, sin_sign, theta_scale);
+                    }
+                    cached = true;
+                }
+
                 float theta_base = (float)p;
 
                 if (is_glm) {
@@ -12681,22 +14040,12 @@ static void ggml_compute_forward_rope_f16(
                     // TODO: this might be wrong for ne0 != n_dims - need double check
                     //       it seems we have to rope just the first n_dims elements and do nothing with the rest
                     // ref:  https://github.com/ml-explore/mlx/blob/dc2edc762c797e3b8de50b1dad4dc0a131691033/benchmarks/python/llama_jax_bench.py#L11-L26
-                    theta_base *= freq_scale;
                     for (int64_t ic = 0; ic < ne0; ic += 2) {
                         if (ic < n_dims) {
                             const int64_t ib = 0;
 
-                            // simplified from `(ib * n_dims + ic) * inv_ndims`
-                            float cur_rot = inv_ndims * ic - ib;
-
-                            float cos_theta, sin_theta;
-                            rope_yarn(
-                                theta_base, freq_scale, corr_dims, cur_rot, ext_factor, attn_factor,
-                                &cos_theta, &sin_theta
-                            );
-                            sin_theta *= sin_sign;
-
-                            theta_base *= theta_scale;
+                            const float cos_theta = cache[ic + 0];
+                            const float sin_theta = cache[ic + 1];
 
                             const int64_t i0 = ib*n_dims + ic/2;
 
@@ -13664,9 +15013,32 @@ static void ggml_compute_forward_timestep_embedding(
 
 // ggml_compute_forward_argsort
 
-static void ggml_compute_forward_argsort_f32(
-    const struct ggml_compute_params * params,
-    struct ggml_tensor * dst) {
+static inline bool ggml_argsort_before(const float * x, int32_t a, int32_t b, enum ggml_sort_order order) {
+    return order == GGML_SORT_ORDER_ASC ? x[a] < x[b] : x[a] > x[b];
+}
+
+static void ggml_argsort_sift(int32_t * h, int64_t n, int64_t i, const float * x, enum ggml_sort_order order) {
+    for (;;) {
+        int64_t c = 2*i + 1;
+        if (c >= n) {
+            break;
+        }
+        if (c + 1 < n && ggml_argsort_before(x, h[c], h[c + 1], order)) {
+            c++;
+        }
+        if (!ggml_argsort_before(x, h[i], h[c], order)) {
+            break;
+        }
+        int32_t tmp = h[i];
+        h[i] = h[c];
+        h[c] = tmp;
+        i = c;
+    }
+}
+
+static void ggml_compute_forward_argsort_f32(
+    const struct ggml_compute_params * params,
+    struct ggml_tensor * dst) {
 
     const struct ggml_tensor * src0 = dst->src[0];
 
@@ -13685,25 +15057,38 @@ static void ggml_compute_forward_argsort_f32(
 
     enum ggml_sort_order order = (enum ggml_sort_order) ggml_get_op_params_i32(dst, 0);
 
+    // ggml_top_k() only needs the first k entries of each row, which a
+    // heap of k elements finds in a single pass. the others are left as is
+    int64_t k = ggml_get_op_params_i32(dst, 1);
+    if (k <= 0 || k > ne0) {
+        k = ne0;
+    }
+
     for (int64_t i = ith; i < nr; i += nth) {
         int32_t * dst_data = (int32_t *)((char *) dst->data + i*nb1);
         const float * src_data = (float *)((char *) src0->data + i*nb01);
 
-        for (int64_t j = 0; j < ne0; j++) {
+        // the root of the heap is the entry that sorts last
+        for (int64_t j = 0; j < k; j++) {
             dst_data[j] = j;
         }
-
-        // C doesn't have a functional sort, so we do a bubble sort instead
-        for (int64_t j = 0; j < ne0; j++) {
-            for (int64_t k = j + 1; k < ne0; k++) {
-                if ((order == GGML_SORT_ORDER_ASC  && src_data[dst_data[j]] > src_data[dst_data[k]]) ||
-                    (order == GGML_SORT_ORDER_DESC && src_data[dst_data[j]] < src_data[dst_data[k]])) {
-                    int32_t tmp = dst_data[j];
-                    dst_data[j] = dst_data[k];
-                    dst_data[k] = tmp;
-                }
+        for (int64_t j = k/2; j > 0; j--) {
+            ggml_argsort_sift(dst_data, k, j - 1, src_data, order);
+        }
+        for (int64_t j = k; j < ne0; j++) {
+            if (ggml_argsort_before(src_data, j, dst_data[0], order)) {
+                dst_data[0] = j;
+                ggml_argsort_sift(dst_data, k, 0, src_data, order);
             }
         }
+
+        // move the root to the back until the heap is sorted
+        for (int64_t n = k; n > 1; n--) {
+            int32_t tmp = dst_data[0];
+            dst_data[0] = dst_data[n - 1];
+            dst_data[n - 1] = tmp;
+            ggml_argsort_sift(dst_data, n - 1, 0, src_data, order);
+        }
     }
 }
 
@@ -14157,6 +15542,222 @@ static void ggml_compute_forward_flash_attn(
 
 // ggml_compute_forward_flash_attn_ext
 
+// the tiled kernel reads each k and v row once for this many q rows,
+// scoring this many kv cells of them at a time
+#define GGML_FATTN_TILE_Q 32
+#define GGML_FATTN_TILE_K 64
+
+// fewest kv cells per range when decoding splits them across threads
+#define GGML_FATTN_SPLIT_MIN 256
+
+// how many ranges the kv cells are split into for each q row, so that
+// decoding with fewer q rows than threads still uses all the threads.
+// each range is attended to on its own, and the partial results are
+// combined after, using the max and sum of each range's softmax.
+static int64_t ggml_fattn_kv_splits(int64_t nr, int64_t n_kv, int nth) {
+    if (nr >= nth) {
+        return 1;
+    }
+    return MAX(1, MIN((nth + nr - 1)/nr, n_kv/GGML_FATTN_SPLIT_MIN));
+}
+
+// scratch floats each thread of the tiled kernel needs
+static size_t ggml_fattn_tiled_wsize(int64_t D) {
+    return 2*GGML_FATTN_TILE_Q*D                 // q tile, accumulators
+         + GGML_FATTN_TILE_Q*GGML_FATTN_TILE_K   // scores
+         + 2*GGML_FATTN_TILE_Q + D               // row max and sum, v row
+         + CACHE_LINE_SIZE_F32;
+}
+
+// for prompts, where a tile of q rows of the same head can share every
+// k and v row it reads, instead of each row going through all of k and
+// v on its own. the scores of a q tile against a k tile are one sgemm,
+// when tinyBLAS supports k's type, and the online softmax rescales the
+// accumulators once per k tile rather than once per kv cell.
+static void ggml_compute_forward_flash_attn_ext_tiled(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * q,
+        const struct ggml_tensor * k,
+        const struct ggml_tensor * v,
+        const struct ggml_tensor * mask,
+        struct ggml_tensor * dst,
+        float scale) {
+
+    GGML_TENSOR_LOCALS(int64_t, neq, q,   ne)
+    GGML_TENSOR_LOCALS(size_t,  nbq, q,   nb)
+    GGML_TENSOR_LOCALS(int64_t, nek, k,   ne)
+    GGML_TENSOR_LOCALS(size_t,  nbk, k,   nb)
+    GGML_TENSOR_LOCALS(int64_t, nev, v,   ne)
+    GGML_TENSOR_LOCALS(size_t,  nbv, v,   nb)
+    GGML_TENSOR_LOCALS(int64_t, ne,  dst, ne)
+    GGML_TENSOR_LOCALS(size_t,  nb,  dst, nb)
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int64_t D  = neq0;
+    const int64_t N  = neq1;
+    const int64_t TQ = GGML_FATTN_TILE_Q;
+    const int64_t TK = GGML_FATTN_TILE_K;
+
+    // broadcast factors
+    const int64_t rk2 = neq2/nek2;
+    const int64_t rk3 = neq3/nek3;
+
+    const int64_t rv2 = neq2/nev2;
+    const int64_t rv3 = neq3/nev3;
+
+    enum ggml_type    const k_vec_dot_type = type_traits[k->type].vec_dot_type;
+    ggml_from_float_t const q_to_vec_dot   = type_traits[k_vec_dot_type].from_float;
+    ggml_vec_dot_t    const kq_vec_dot     = type_traits[k->type].vec_dot;
+    ggml_to_float_t   const v_to_float     = type_traits[v->type].to_float;
+
+    const size_t q_row_size = ggml_row_size(k_vec_dot_type, D);
+
+    float * Q_q = (float *) params->wdata + ith*ggml_fattn_tiled_wsize(D); // q tile in k_vec_dot_type
+    float * O   = Q_q + TQ*D; // F32 accumulators
+    float * S   = O   + TQ*D; // scores of the k tile, then their weights
+    float * M   = S   + TQ*TK;
+    float * L   = M   + TQ;
+    float * V32 = L   + TQ;   // v row expanded to F32
+
+#if GGML_USE_LLAMAFILE
+    // each tile belongs to one thread
+    struct ggml_compute_params sgemm_params = *params;
+    sgemm_params.ith     = 0;
+    sgemm_params.nth     = 1;
+    sgemm_params.wsize   = 0;
+    sgemm_params.wdata   = NULL;
+    sgemm_params.barrier = NULL;
+#endif
+
+    // the last tiles of a causal prompt see the most cells, so tiles are
+    // dealt out round robin, rather than in a range per thread
+    const int64_t nqt = (N + TQ - 1)/TQ;
+
+    for (int64_t it = ith; it < nqt*neq2*neq3; it += nth) {
+        // q indices
+        const int64_t iq3 = it/(nqt*neq2);
+        const int64_t iq2 = (it - iq3*nqt*neq2)/nqt;
+        const int64_t iq1 = (it - iq3*nqt*neq2 - iq2*nqt)*TQ;
+        const int64_t nq  = MIN(TQ, N - iq1);
+
+        // k indices
+        const int64_t ik3 = iq3 / rk3;
+        const int64_t ik2 = iq2 / rk2;
+
+        // v indices
+        const int64_t iv3 = iq3 / rv3;
+        const int64_t iv2 = iq2 / rv2;
+
+        for (int64_t r = 0; r < nq; ++r) {
+            const float * pq = (const float *) ((char *) q->data + ((iq1 + r)*nbq1 + iq2*nbq2 + iq3*nbq3));
+            q_to_vec_dot(pq, (char *) Q_q + r*q_row_size, D);
+            M[r] = -INFINITY;
+            L[r] = 0.0f;
+        }
+        memset(O, 0, nq*D*sizeof(float));
+
+        for (int64_t ic0 = 0; ic0 < nek1; ic0 += TK) {
+            const int64_t nc = MIN(TK, nek1 - ic0);
+
+            // skip tiles the mask hides entirely, e.g. the future of a prompt
+            bool visible = !mask;
+            for (int64_t r = 0; r < nq && !visible; ++r) {
+                const ggml_fp16_t * mp = (const ggml_fp16_t *) ((char *) mask->data + (iq1 + r)*mask->nb[1]) + ic0;
+                for (int64_t c = 0; c < nc; ++c) {
+                    if (GGML_FP16_TO_FP32(mp[c]) != -INFINITY) {
+                        visible = true;
+                        break;
+                    }
+                }
+            }
+            if (!visible) {
+                continue;
+            }
+
+            const char * k_data = (const char *) k->data + (ic0*nbk1 + ik2*nbk2 + ik3*nbk3);
+
+            // S[r*TK + c] = k[c] . q[r]
+            bool scored = false;
+#if GGML_USE_LLAMAFILE
+            scored = llamafile_sgemm(&sgemm_params,
+                                     nc, nq, D/ggml_blck_size(k->type),
+                                     k_data, nbk1/ggml_type_size(k->type),
+                                     Q_q, q_row_size/ggml_type_size(k_vec_dot_type),
+                                     S, TK,
+                                     k->type, k_vec_dot_type, GGML_TYPE_F32,
+                                     GGML_PREC_DEFAULT);
+#endif
+            if (!scored) {
+                for (int64_t c = 0; c < nc; ++c) {
+                    for (int64_t r = 0; r < nq; ++r) {
+                        kq_vec_dot(D, S + r*TK + c, 0, k_data + c*nbk1, 0, (char *) Q_q + r*q_row_size, 0, 1);
+                    }
+                }
+            }
+
+            // online softmax, a tile at a time
+            for (int64_t r = 0; r < nq; ++r) {
+                const ggml_fp16_t * mp = mask ? (const ggml_fp16_t *) ((char *) mask->data + (iq1 + r)*mask->nb[1]) + ic0 : NULL;
+                float * sr = S + r*TK;
+
+                float smax = -INFINITY;
+                for (int64_t c = 0; c < nc; ++c) {
+                    sr[c] = sr[c]*scale + (mp ? GGML_FP16_TO_FP32(mp[c]) : 0.0f);
+                    smax = MAX(smax, sr[c]);
+                }
+                if (smax == -INFINITY) {
+                    memset(sr, 0, nc*sizeof(float));
+                    continue;
+                }
+
+                if (smax > M[r]) {
+                    const float ms = expf(M[r] - smax);
+
+                    // V = V*expf(Mold - M)
+                    ggml_vec_scale_f32(D, O + r*D, ms);
+                    L[r] *= ms;
+                    M[r] = smax;
+                }
+
+                float sum = 0.0f;
+                for (int64_t c = 0; c < nc; ++c) {
+                    sr[c] = expf(sr[c] - M[r]);
+                    sum += sr[c];
+                }
+                L[r] += sum;
+            }
+
+            // V += v*expf(s - M), expanding each v row once for the tile
+            for (int64_t c = 0; c < nc; ++c) {
+                const char * v_data = (const char *) v->data + ((ic0 + c)*nbv1 + iv2*nbv2 + iv3*nbv3);
+                bool expanded = false;
+                for (int64_t r = 0; r < nq; ++r) {
+                    const float vs = S[r*TK + c];
+                    if (vs == 0.0f) {
+                        continue;
+                    }
+                    if (!expanded) {
+                        v_to_float(v_data, V32, D);
+                        expanded = true;
+                    }
+                    ggml_vec_mad_f32(D, O + r*D, V32, vs);
+                }
+            }
+        }
+
+        for (int64_t r = 0; r < nq; ++r) {
+            // V /= S
+            ggml_vec_scale_f32(D, O + r*D, 1.0f/L[r]);
+
+            // permute(0, 2, 1, 3)
+            const int64_t i1 = iq1 + r;
+            memcpy((char *) dst->data + (iq3*ne2*ne1 + iq2 + i1*ne1)*nb1, O + r*D, nb1);
+        }
+    }
+}
+
 static void ggml_compute_forward_flash_attn_ext_f16(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * q,
@@ -14186,8 +15787,8 @@ static void ggml_compute_forward_flash_attn_ext_f16(
     GGML_ASSERT(ne2 == N);
 
     GGML_ASSERT(nbq0 == sizeof(float));
-    GGML_ASSERT(nbk0 == sizeof(ggml_fp16_t));
-    GGML_ASSERT(nbv0 == sizeof(ggml_fp16_t));
+    GGML_ASSERT(nbk0 == ggml_type_size(k->type));
+    GGML_ASSERT(nbv0 == ggml_type_size(v->type));
 
     GGML_ASSERT(neq0 == D);
     GGML_ASSERT(nek0 == D);
@@ -14217,23 +15818,55 @@ static void ggml_compute_forward_flash_attn_ext_f16(
         return;
     }
 
-    // parallelize by q rows using ggml_vec_dot_f32
+    // parallelize by q rows using ggml_vec_dot_f32, and by ranges of
+    // kv cells too, if there aren't enough rows
 
     // total rows in q
     const int nr = neq1*neq2*neq3;
 
-    // rows per thread
-    const int dr = (nr + nth - 1)/nth;
+    // kv ranges per row, whose partial results go after the scratch
+    int64_t ns = ggml_fattn_kv_splits(nr, nek1, nth);
+    float * parts = (float *) params->wdata + nth*(3*D + CACHE_LINE_SIZE_F32);
+    if (ns > 1 && (!params->barrier ||
+                   (parts + nr*ns*(D + 2)) - (float *) params->wdata > (ptrdiff_t) (params->wsize/sizeof(float)))) {
+        ns = 1;
+    }
+    const int64_t ck = (nek1 + ns - 1)/ns;
 
-    // row range for this thread
-    const int ir0 = dr*ith;
-    const int ir1 = MIN(ir0 + dr, nr);
+    // (row, kv range) pairs per thread
+    const int64_t dr = (nr*ns + nth - 1)/nth;
+
+    // pair range for this thread
+    const int64_t ir0 = dr*ith;
+    const int64_t ir1 = MIN(ir0 + dr, nr*ns);
 
     float scale = 1.0f;
     memcpy(&scale, (float *) dst->op_params + 0, sizeof(float));
 
+    // q is converted once per row into whatever k's dot product wants,
+    // so quantized k rows are dotted as is, without a dequantize pass.
+    // quantized v rows are expanded into a scratch row before they're
+    // added in, since they're only read once per kv cell anyway.
+    enum ggml_type    const k_vec_dot_type = type_traits[k->type].vec_dot_type;
+    ggml_from_float_t const q_to_vec_dot   = type_traits[k_vec_dot_type].from_float;
+    ggml_vec_dot_t    const kq_vec_dot     = type_traits[k->type].vec_dot;
+    ggml_to_float_t   const v_to_float     = type_traits[v->type].to_float;
+
+    GGML_ASSERT(q_to_vec_dot && kq_vec_dot && "fattn: unsupported K type");
+    GGML_ASSERT((v->type == GGML_TYPE_F16 || v_to_float) && "fattn: unsupported V type");
+
+    // prompts have enough q rows per head to be worth tiling
+    if (N >= GGML_FATTN_TILE_Q/4 && v_to_float) {
+        ggml_compute_forward_flash_attn_ext_tiled(params, q, k, v, mask, dst, scale);
+        return;
+    }
+
     // loop over n_batch and n_head
-    for (int ir = ir0; ir < ir1; ++ir) {
+    for (int64_t irs = ir0; irs < ir1; ++irs) {
+        const int     ir = irs/ns;
+        const int64_t ic0 = (irs%ns)*ck;
+        const int64_t ic1 = MIN(ic0 + ck, nek1);
+
         // q indices
         const int iq3 = ir/(neq2*neq1);
         const int iq2 = (ir - iq3*neq2*neq1)/neq1;
@@ -14242,11 +15875,16 @@ static void ggml_compute_forward_flash_attn_ext_f16(
         float S = 0.0f;
         float M = -INFINITY;
 
-        float       * V32 = (float       *) params->wdata + ith*(2*D + CACHE_LINE_SIZE_F32);
-        ggml_fp16_t * Q16 = (ggml_fp16_t *) (V32); // reuse memory
-        ggml_fp16_t * V16 = (ggml_fp16_t *) (V32 + D);
+        float       * VKQ32 = (float       *) params->wdata + ith*(3*D + CACHE_LINE_SIZE_F32); // F32 accumulator
+        float       * V32   =                 (VKQ32 + 1*D); // v row expanded to F32
+        ggml_fp16_t * VKQ16 = (ggml_fp16_t *) (VKQ32 + 1*D); // F16 accumulator, if v is F16
+        void        * Q_q   =                 (VKQ32 + 2*D); // q row in k_vec_dot_type
 
-        memset(V16, 0, D*sizeof(ggml_fp16_t));
+        if (v->type == GGML_TYPE_F16) {
+            memset(VKQ16, 0, D*sizeof(ggml_fp16_t));
+        } else {
+            memset(VKQ32, 0, D*sizeof(float));
+        }
 
         const ggml_fp16_t * mp = mask ? (ggml_fp16_t *)((char *) mask->data + iq1*mask->nb[1]) : NULL;
 
@@ -14258,10 +15896,13 @@ static void ggml_compute_forward_flash_attn_ext_f16(
         const int iv3 = iq3 / rv3;
         const int iv2 = iq2 / rv2;
 
+        const float * pq = (const float *) ((char *) q->data + (iq1*nbq1 + iq2*nbq2 + iq3*nbq3));
+        q_to_vec_dot(pq, Q_q, D);
+
         // online softmax / attention
         // loop over n_kv and n_head_kv
         // ref: https://arxiv.org/pdf/2112.05682.pdf
-        for (int64_t ic = 0; ic < nek1; ++ic) {
+        for (int64_t ic = ic0; ic < ic1; ++ic) {
             const float mv = mp ? GGML_FP16_TO_FP32(mp[ic]) : 0.0f;
             if (mv == -INFINITY) {
                 continue;
@@ -14269,19 +15910,8 @@ static void ggml_compute_forward_flash_attn_ext_f16(
 
             float s;
 
-            // convert Q to F16 in V32
-            {
-                const float * pq = (const float *) ((char *) q->data + (iq1*nbq1 + iq2*nbq2 + iq3*nbq3));
-
-                for (int64_t d = 0; d < D; ++d) {
-                    Q16[d] = GGML_FP32_TO_FP16(pq[d]);
-                }
-            }
-
-            ggml_vec_dot_f16(D,
-                    &s, 0,
-                    (ggml_fp16_t *) ((char *) k->data + ( ic*nbk1 + ik2*nbk2 + ik3*nbk3)), 0,
-                    Q16, 0, 1);
+            const char * k_data = (const char *) k->data + (ic*nbk1 + ik2*nbk2 + ik3*nbk3);
+            kq_vec_dot(D, &s, 0, k_data, 0, Q_q, 0, 1);
 
             s = s*scale + mv;
 
@@ -14290,29 +15920,57 @@ static void ggml_compute_forward_flash_attn_ext_f16(
             float ms = 1.0f;
             float vs = 1.0f;
 
-            if (s > M) {
-                M = s;
-                ms = expf(Mold - M);
+            const char * v_data = (const char *) v->data + (ic*nbv1 + iv2*nbv2 + iv3*nbv3);
+
+            if (v->type == GGML_TYPE_F16) {
+                if (s > M) {
+                    M = s;
+                    ms = expf(Mold - M);
+
+                    // V = V*expf(Mold - M)
+                    ggml_vec_scale_f16(D, VKQ16, ms);
+                } else {
+                    vs = expf(s - M);
+                }
 
-                // V = V*expf(Mold - M)
-                ggml_vec_scale_f16(D, V16, ms);
+                // V += v*expf(s - M)
+                ggml_vec_mad_f16(D, VKQ16, (const ggml_fp16_t *) v_data, vs);
             } else {
-                vs = expf(s - M);
-            }
+                if (s > M) {
+                    M = s;
+                    ms = expf(Mold - M);
+
+                    // V = V*expf(Mold - M)
+                    ggml_vec_scale_f32(D, VKQ32, ms);
+                } else {
+                    vs = expf(s - M);
+                }
 
-            const ggml_fp16_t * v16 = (const ggml_fp16_t *) ((char *) v->data + (ic*nbv1 + iv2*nbv2 + iv3*nbv3));
+                v_to_float(v_data, V32, D);
 
-            // V += v*expf(s - M)
-            ggml_vec_mad_f16(D, V16, v16, vs);
+                // V += v*expf(s - M)
+                ggml_vec_mad_f32(D, VKQ32, V32, vs);
+            }
 
             S = S*ms + vs;
         }
 
-        // V /= S
-        for (int64_t d = 0; d < D; ++d) {
-            V32[d] = GGML_FP16_TO_FP32(V16[d])/S;
+        if (v->type == GGML_TYPE_F16) {
+            ggml_fp16_to_fp32_row(VKQ16, VKQ32, D);
         }
 
+        if (ns > 1) {
+            // combined with the other ranges of this row below
+            float * part = parts + irs*(D + 2);
+            memcpy(part, VKQ32, D*sizeof(float));
+            part[D + 0] = M;
+            part[D + 1] = S;
+            continue;
+        }
+
+        // V /= S
+        ggml_vec_scale_f32(D, VKQ32, 1.0f/S);
+
         // dst indices
         const int i1 = iq1;
         const int i2 = iq2;
@@ -14322,7 +15980,47 @@ static void ggml_compute_forward_flash_attn_ext_f16(
         //memcpy((char *) dst->data + (i1*nb1 + i2*nb2 + i3*nb3), V, nev0*sizeof(float));
 
         // permute(0, 2, 1, 3)
-        memcpy((char *) dst->data + (i3*ne2*ne1 + i2 + i1*ne1)*nb1, V32, nb1);
+        memcpy((char *) dst->data + (i3*ne2*ne1 + i2 + i1*ne1)*nb1, VKQ32, nb1);
+    }
+
+    if (ns == 1) {
+        return;
+    }
+
+    ggml_syncthreads(params->barrier, nth);
+
+    // log-sum-exp the kv ranges of each row back together
+    float * VKQ32 = (float *) params->wdata + ith*(3*D + CACHE_LINE_SIZE_F32);
+    const int dr1 = (nr + nth - 1)/nth;
+    for (int ir = dr1*ith; ir < MIN(dr1*(ith + 1), nr); ++ir) {
+        const int iq3 = ir/(neq2*neq1);
+        const int iq2 = (ir - iq3*neq2*neq1)/neq1;
+        const int iq1 = (ir - iq3*neq2*neq1 - iq2*neq1);
+
+        const float * row = parts + ir*ns*(D + 2);
+
+        float M = -INFINITY;
+        for (int64_t is = 0; is < ns; ++is) {
+            M = MAX(M, row[is*(D + 2) + D]);
+        }
+
+        float S = 0.0f;
+        memset(VKQ32, 0, D*sizeof(float));
+        for (int64_t is = 0; is < ns; ++is) {
+            const float * part = row + is*(D + 2);
+            if (part[D] == -INFINITY) {
+                continue; // the mask hid this whole range
+            }
+            const float ms = expf(part[D] - M);
+            ggml_vec_mad_f32(D, VKQ32, part, ms);
+            S += part[D + 1]*ms;
+        }
+
+        // V /= S
+        ggml_vec_scale_f32(D, VKQ32, 1.0f/S);
+
+        // permute(0, 2, 1, 3)
+        memcpy((char *) dst->data + (iq3*ne2*ne1 + iq2 + iq1*ne1)*nb1, VKQ32, nb1);
     }
 }
 
@@ -15891,6 +17589,22 @@ static void ggml_compute_forward_cross_entropy_loss_back(
 
 /////////////////////////////////
 
+// ops whose hardware counters are worth the cost of sampling them
+static int ggml_perf_op(enum ggml_op op) {
+    switch (op) {
+        case GGML_OP_MUL_MAT:
+        case GGML_OP_MUL_MAT_ID:
+        case GGML_OP_MUL_MAT_SWIGLU:
+        case GGML_OP_MUL_MAT_AXPY:
+            return LLAMAFILE_PERF_MATMUL;
+        case GGML_OP_SOFT_MAX:
+        case GGML_OP_FLASH_ATTN_EXT:
+            return LLAMAFILE_PERF_ATTENTION;
+        default:
+            return -1;
+    }
+}
+
 static void ggml_compute_forward(struct ggml_compute_params * params, struct ggml_tensor * tensor) {
     GGML_ASSERT(params);
 
@@ -15898,6 +17612,14 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
         return;
     }
 
+    const long long trace_start = llamafile_tracing ? llamafile_trace_now() : 0;
+
+    struct llamafile_perf_sample perf_sample;
+    const int perf_op = llamafile_perf_enabled ? ggml_perf_op(tensor->op) : -1;
+    if (perf_op != -1) {
+        llamafile_perf_start(&perf_sample);
+    }
+
 #ifdef LLAMAFILE_SYNC_REPORT
     long start = rdtsc();
     unsigned long old = 0;
@@ -15992,6 +17714,10 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
             {
                 ggml_compute_forward_rms_norm_back(params, tensor);
             } break;
+        case GGML_OP_RMS_NORM_MUL:
+            {
+                ggml_compute_forward_rms_norm_mul(params, tensor);
+            } break;
         case GGML_OP_GROUP_NORM:
             {
                 ggml_compute_forward_group_norm(params, tensor);
@@ -16004,6 +17730,14 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
             {
                 ggml_compute_forward_mul_mat_id(params, tensor);
             } break;
+        case GGML_OP_MUL_MAT_SWIGLU:
+            {
+                ggml_compute_forward_mul_mat_swiglu(params, tensor);
+            } break;
+        case GGML_OP_MUL_MAT_AXPY:
+            {
+                ggml_compute_forward_mul_mat_axpy(params, tensor);
+            } break;
         case GGML_OP_OUT_PROD:
             {
                 ggml_compute_forward_out_prod(params, tensor);
@@ -16253,6 +17987,17 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
     cycles[llamafile_debug_op_index][params->ith] += end - start;
 #endif
 
+    if (perf_op != -1) {
+        llamafile_perf_stop(&perf_sample, perf_op);
+    }
+
+    if (trace_start) {
+        llamafile_trace_event(params->type == GGML_TASK_TYPE_INIT     ? "cpu.init" :
+                              params->type == GGML_TASK_TYPE_FINALIZE ? "cpu.finalize" : "cpu",
+                              ggml_op_desc(tensor), tensor->name, 0,
+                              trace_start, llamafile_trace_now());
+    }
+
 #ifdef LLAMAFILE_DEBUG
     llamafile_trapping_restore();
 #endif
@@ -16737,6 +18482,10 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
             {
                 GGML_ASSERT(false); // TODO: not implemented
             } break;
+        case GGML_OP_RMS_NORM_MUL:
+            {
+                GGML_ASSERT(false); // TODO: not implemented
+            } break;
         case GGML_OP_GROUP_NORM:
             {
                 GGML_ASSERT(false); // TODO: not implemented
@@ -16803,6 +18552,14 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
             {
                 GGML_ASSERT(false); // TODO: not implemented
             } break;
+        case GGML_OP_MUL_MAT_SWIGLU:
+            {
+                GGML_ASSERT(false); // TODO: not implemented
+            } break;
+        case GGML_OP_MUL_MAT_AXPY:
+            {
+                GGML_ASSERT(false); // TODO: not implemented
+            } break;
         case GGML_OP_OUT_PROD:
             {
                 GGML_ASSERT(false); // TODO: not implemented
@@ -17674,10 +19431,19 @@ static void set_numa_thread_affinity(int thread_n) {
             // run thread on node_num thread_n / (threads per node)
             node_num = thread_n % g_state.numa.n_nodes;
             break;
+        case GGML_NUMA_STRATEGY_MIRROR:
+        case GGML_NUMA_STRATEGY_SHARD:
+            // same as distribute, but also read weights from our node
+            node_num = thread_n % g_state.numa.n_nodes;
+            g_numa_node = node_num;
+            break;
         case GGML_NUMA_STRATEGY_ISOLATE:
             // run thread on current_node
             node_num = g_state.numa.current_node;
             break;
+        case GGML_NUMA_STRATEGY_TIER:
+            // it's the memory that's placed, threads may run anywhere
+            return;
         case GGML_NUMA_STRATEGY_NUMACTL:
             // use the cpuset that numactl gave us
             rv = pthread_setaffinity_np(pthread_self(), setsize, &g_state.numa.cpuset);
@@ -17710,6 +19476,8 @@ static void clear_numa_thread_affinity(void) {
         return;
     }
 
+    g_numa_node = -1;
+
     size_t setsize = CPU_ALLOC_SIZE(g_state.numa.total_cpus);
 
     cpu_set_t * cpus = CPU_ALLOC(g_state.numa.total_cpus);
@@ -17732,6 +19500,21 @@ static void set_numa_thread_affinity(int thread_n) { UNUSED(thread_n);  }
 static void clear_numa_thread_affinity(void) {}
 #endif
 
+// nodes that are computed side by side, see ggml_graph_wave_build()
+#define GGML_WAVE_WINDOW 16 // how many nodes to look ahead
+#define GGML_WAVE_MAX    8  // most nodes that run in one wave
+
+struct ggml_graph_wave {
+    int n;                          // nodes in this wave, 0 if none
+    int node[GGML_WAVE_MAX];        // node indices, first is node_n
+    int ith[GGML_WAVE_MAX + 1];     // first thread given to each node
+    int nth[GGML_WAVE_MAX];         // threads that do work on each node
+    size_t offs[GGML_WAVE_MAX];     // where each node's scratch starts
+    size_t wsize[GGML_WAVE_MAX];
+    size_t size;                    // scratch space needed by wave
+    struct ggml_barrier barrier[GGML_WAVE_MAX];
+};
+
 struct ggml_compute_state_shared {
     const struct ggml_cgraph * cgraph;
     const struct ggml_cplan  * cplan;
@@ -17745,10 +19528,20 @@ struct ggml_compute_state_shared {
     atomic_int n_active;  // num active threads
     atomic_int node_n;    // active graph node
     atomic_int node_task; // active graph node task phase
+    int n_tasks;          // threads that work on node_n
     struct ggml_barrier barrier;
 
     ggml_abort_callback abort_callback; // abort ggml_graph_compute when true
     void * abort_callback_data;
+
+    struct ggml_graph_wave wave; // nodes running alongside node_n
+    uint64_t done; // nodes after node_n that a wave already computed
+
+    struct ggml_src1_cache src1_cache;
+
+    struct ggml_adapt_stat * adapt; // stats of node_n, if it's being measured
+    int adapt_level;
+    int64_t adapt_start;
 };
 
 struct ggml_compute_state {
@@ -17831,6 +19624,7 @@ static int ggml_get_n_tasks(struct ggml_tensor * node, int n_threads, int n_cur_
         case GGML_OP_NORM:
         case GGML_OP_RMS_NORM:
         case GGML_OP_RMS_NORM_BACK:
+        case GGML_OP_RMS_NORM_MUL:
         case GGML_OP_GROUP_NORM:
         case GGML_OP_CONCAT:
             {
@@ -17848,6 +19642,8 @@ static int ggml_get_n_tasks(struct ggml_tensor * node, int n_threads, int n_cur_
                 //printf("nr0 = %8d, nr1 = %8d, nr0*nr1 = %8d, n_tasks%d\n", nr0, nr1, nr0*nr1, n_tasks);
             } break;
         case GGML_OP_MUL_MAT_ID:
+        case GGML_OP_MUL_MAT_SWIGLU:
+        case GGML_OP_MUL_MAT_AXPY:
             {
                 n_tasks = n_threads;
             } break;
@@ -18023,43 +19819,625 @@ static int ggml_get_n_tasks(struct ggml_tensor * node, int n_threads, int n_cur_
     return n_tasks;
 }
 
-static void ggml_graph_compute_thread_sync_node(int * node_n, struct ggml_compute_state * state, const bool do_yield) {
-    // wait for other threads to finish
-    const int last_node_n = * node_n;
-    int backoff = 0;
-
-    sync_wait_start();
-    while (true) {
-        * node_n = atomic_load_explicit(&state->shared->node_n, memory_order_acquire);
-        if (* node_n != last_node_n) break;
-        backoff = ggml_delay(backoff);
-    }
-    sync_wait_end();
-}
-
-static void ggml_graph_compute_thread_sync_task(int * task_phase, struct ggml_compute_state * state, const bool do_yield) {
-    // wait for other threads to finish
-    const int last_task_phase = * task_phase;
-    int backoff = 0;
-
-    sync_wait_start();
-    while (true) {
-        * task_phase = atomic_load_explicit(&state->shared->node_task, memory_order_acquire);
-        if (* task_phase != last_task_phase) break;
-        backoff = ggml_delay(backoff);
-    }
-    sync_wait_end();
-}
-
-static thread_ret_t ggml_graph_compute_thread(void * data) {
-    struct ggml_compute_state * state = (struct ggml_compute_state *) data;
-
-    const struct ggml_cgraph * cgraph = state->shared->cgraph;
-    const struct ggml_cplan  * cplan  = state->shared->cplan;
-
-    const int   n_threads   = state->shared->n_threads;
+// returns the scratch space needed by node, not counting the padding
+// between the rows owned by different threads
+static size_t ggml_graph_node_work_size(struct ggml_tensor * node, int n_tasks) {
+    size_t cur = 0;
 
-    set_numa_thread_affinity(state->ith);
+    switch (node->op) {
+        case GGML_OP_CPY:
+        case GGML_OP_DUP:
+            {
+                if (ggml_is_quantized(node->type)) {
+                    cur = ggml_type_size(GGML_TYPE_F32) * node->ne[0] * n_tasks;
+                }
+            } break;
+        case GGML_OP_ADD:
+        case GGML_OP_ADD1:
+            {
+                if (ggml_is_quantized(node->src[0]->type)) {
+                    cur = ggml_type_size(GGML_TYPE_F32) * node->src[0]->ne[0] * n_tasks;
+                }
+            } break;
+        case GGML_OP_ACC:
+            {
+                if (ggml_is_quantized(node->src[0]->type)) {
+                    cur = ggml_type_size(GGML_TYPE_F32) * node->src[1]->ne[0] * n_tasks;
+                }
+            } break;
+        case GGML_OP_MUL_MAT:
+            {
+                const enum ggml_type vec_dot_type = type_traits[node->src[0]->type].vec_dot_type;
+
+#if defined(GGML_USE_CLBLAST)
+                if (ggml_cl_can_mul_mat(node->src[0], node->src[1], node)) {
+                    cur = ggml_cl_mul_mat_get_wsize(node->src[0], node->src[1], node);
+                } else
+#endif
+#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
+                if (ggml_compute_forward_mul_mat_use_blas(node)) {
+                    if (node->src[0]->type != GGML_TYPE_F32) {
+                        // here we need memory for fully dequantized matrix from src0
+                        // take into account that src0 can be broadcasted into src1[2,3]
+                        cur = ggml_type_size(GGML_TYPE_F32)
+                            * node->src[0]->ne[0]*node->src[0]->ne[1]
+                            * node->src[1]->ne[2]*node->src[1]->ne[3];
+                    }
+                } else
+#endif
+                if (node->src[1]->type != vec_dot_type) {
+                    cur = ggml_row_size(vec_dot_type, ggml_nelements(node->src[1]));
+                }
+#if GGML_USE_LLAMAFILE
+                // llamafile_sgemm() keeps partial products after src1
+                // and takes broadcast query heads as one group of columns
+                const size_t sgemm_needs = llamafile_sgemm_needs(
+                    node->src[0]->ne[1], node->src[1]->ne[1]*(node->src[1]->ne[2]/node->src[0]->ne[2]),
+                    node->src[0]->ne[0]/ggml_blck_size(node->src[0]->type),
+                    n_tasks, node->src[0]->type, node->type);
+                if (sgemm_needs) {
+                    cur = GGML_PAD(cur, CACHE_LINE_SIZE) + sgemm_needs;
+                }
+#endif
+                if (g_state.numa.numa_strategy == GGML_NUMA_STRATEGY_SHARD) {
+                    // counters for ggml_compute_forward_mul_mat_sharded()
+                    size_t conv = 0;
+                    if (node->src[1]->type != vec_dot_type) {
+                        conv = ggml_row_size(vec_dot_type, ggml_nelements(node->src[1]));
+                    }
+                    cur = MAX(cur, GGML_PAD(conv, CACHE_LINE_SIZE) + CACHE_LINE_SIZE*GGML_NUMA_MAX_NODES);
+                }
+            } break;
+        case GGML_OP_RMS_NORM_MUL:
+            {
+                if (node->type != GGML_TYPE_F32) {
+                    cur = ggml_type_size(GGML_TYPE_F32) * (node->src[0]->ne[0] + CACHE_LINE_SIZE_F32) * n_tasks;
+                }
+            } break;
+        case GGML_OP_MUL_MAT_SWIGLU:
+            {
+                const enum ggml_type vec_dot_type = type_traits[node->src[0]->type].vec_dot_type;
+                if (node->src[1]->type != vec_dot_type) {
+                    cur = ggml_row_size(vec_dot_type, ggml_nelements(node->src[1]));
+                }
+            } break;
+        case GGML_OP_MUL_MAT_AXPY:
+            {
+                if (node->src[0]->type != GGML_TYPE_F32) {
+                    cur = ggml_type_size(GGML_TYPE_F32) * (node->src[0]->ne[0] + CACHE_LINE_SIZE_F32) * n_tasks;
+                }
+            } break;
+        case GGML_OP_MUL_MAT_ID:
+            {
+                cur = 0;
+                const struct ggml_tensor * src0 = node->src[0];
+                const struct ggml_tensor * src1 = node->src[1];
+                const struct ggml_tensor * src2 = node->src[2];
+                const enum ggml_type vec_dot_type = type_traits[src0->type].vec_dot_type;
+                if (src1->type != vec_dot_type) {
+                    cur += ggml_row_size(vec_dot_type, ggml_nelements(src1));
+                }
+                const int n_as = src0->ne[2];
+                cur += GGML_PAD(cur, sizeof(int64_t));       // align
+                cur += n_as * sizeof(int64_t);               // matrix_row_counts
+                cur += n_as * src1->ne[2] * sizeof(int64_t); // matrix_rows
+                size_t cur2 = llamafile_mixmul_needs(src0, src1, src2);
+                cur = cur > cur2 ? cur : cur2;
+            } break;
+        case GGML_OP_OUT_PROD:
+            {
+                if (ggml_is_quantized(node->src[0]->type)) {
+                    cur = ggml_type_size(GGML_TYPE_F32) * node->src[0]->ne[0] * n_tasks;
+                }
+            } break;
+        case GGML_OP_SOFT_MAX:
+        case GGML_OP_ROPE:
+            {
+                cur = ggml_type_size(GGML_TYPE_F32) * node->ne[0] * n_tasks;
+            } break;
+        case GGML_OP_CONV_TRANSPOSE_1D:
+            {
+                GGML_ASSERT(node->src[0]->ne[3] == 1);
+                GGML_ASSERT(node->src[1]->ne[2] == 1);
+                GGML_ASSERT(node->src[1]->ne[3] == 1);
+
+                const int64_t ne00 = node->src[0]->ne[0];  // K
+                const int64_t ne01 = node->src[0]->ne[1];  // Cout
+                const int64_t ne02 = node->src[0]->ne[2];  // Cin
+
+                const int64_t ne10 = node->src[1]->ne[0];  // L
+                const int64_t ne11 = node->src[1]->ne[1];  // Cin
+
+                if ((node->src[0]->type == GGML_TYPE_F16 ||
+                     node->src[0]->type == GGML_TYPE_BF16) &&
+                    node->src[1]->type == GGML_TYPE_F32) {
+                    cur += sizeof(ggml_fp16_t)*ne00*ne01*ne02;
+                    cur += sizeof(ggml_fp16_t)*ne10*ne11;
+                } else if (node->src[0]->type == GGML_TYPE_F32 &&
+                           node->src[1]->type == GGML_TYPE_F32) {
+                    cur += sizeof(float)*ne00*ne01*ne02;
+                    cur += sizeof(float)*ne10*ne11;
+                } else {
+                    GGML_ASSERT(false);
+                }
+            } break;
+        case GGML_OP_CONV_TRANSPOSE_2D:
+            {
+                const int64_t ne00 = node->src[0]->ne[0]; // W
+                const int64_t ne01 = node->src[0]->ne[1]; // H
+                const int64_t ne02 = node->src[0]->ne[2]; // Channels Out
+                const int64_t ne03 = node->src[0]->ne[3]; // Channels In
+
+                const int64_t ne10 = node->src[1]->ne[0]; // W
+                const int64_t ne11 = node->src[1]->ne[1]; // H
+                const int64_t ne12 = node->src[1]->ne[2]; // Channels In
+
+                cur += sizeof(ggml_fp16_t)*ne00*ne01*ne02*ne03;
+                cur += sizeof(ggml_fp16_t)*ne10*ne11*ne12;
+            } break;
+        case GGML_OP_FLASH_ATTN:
+            {
+                const int64_t ne11 = ggml_up(node->src[1]->ne[1], GGML_SOFT_MAX_UNROLL);
+
+                if (node->src[1]->type == GGML_TYPE_F32) {
+                    cur  = sizeof(float)*ne11*n_tasks; // TODO: this can become (n_tasks-1)
+                    cur += sizeof(float)*ne11*n_tasks; // this is overestimated by x2
+                } else if (node->src[1]->type == GGML_TYPE_F16) {
+                    cur  = sizeof(float)*ne11*n_tasks; // TODO: this can become (n_tasks-1)
+                    cur += sizeof(float)*ne11*n_tasks; // this is overestimated by x2
+                } else if (node->src[1]->type == GGML_TYPE_BF16) {
+                    cur  = sizeof(float)*ne11*n_tasks; // TODO: this can become (n_tasks-1)
+                    cur += sizeof(float)*ne11*n_tasks; // this is overestimated by x2
+                }
+            } break;
+        case GGML_OP_FLASH_ATTN_EXT:
+            {
+                const int64_t ne00 = node->src[0]->ne[0]; // D
+
+                const int64_t nr   = ggml_nrows(node->src[0]);
+                const int64_t ns   = ggml_fattn_kv_splits(nr, node->src[1]->ne[1], n_tasks);
+
+                cur = 3*sizeof(float)*ne00*n_tasks; // 3x head size
+                if (ns > 1) {
+                    // partial results of each kv range
+                    cur += sizeof(float)*(CACHE_LINE_SIZE_F32 + nr*ns*(ne00 + 2));
+                }
+                cur = MAX(cur, sizeof(float)*ggml_fattn_tiled_wsize(ne00)*n_tasks);
+            } break;
+        case GGML_OP_FLASH_FF:
+            {
+                if (node->src[1]->type == GGML_TYPE_F32) {
+                    cur  = sizeof(float)*node->src[1]->ne[1]*n_tasks; // TODO: this can become (n_tasks-1)
+                    cur += sizeof(float)*node->src[1]->ne[1]*n_tasks; // this is overestimated by x2
+                } else if (node->src[1]->type == GGML_TYPE_F16) {
+                    cur  = sizeof(float)*node->src[1]->ne[1]*n_tasks; // TODO: this can become (n_tasks-1)
+                    cur += sizeof(float)*node->src[1]->ne[1]*n_tasks; // this is overestimated by x2
+                } else if (node->src[1]->type == GGML_TYPE_BF16) {
+                    cur  = sizeof(float)*node->src[1]->ne[1]*n_tasks; // TODO: this can become (n_tasks-1)
+                    cur += sizeof(float)*node->src[1]->ne[1]*n_tasks; // this is overestimated by x2
+                }
+            } break;
+        case GGML_OP_FLASH_ATTN_BACK:
+            {
+                const int64_t    D = node->src[0]->ne[0];
+                const int64_t ne11 = ggml_up(node->src[1]->ne[1], GGML_SOFT_MAX_UNROLL);
+                const int64_t mxDn = MAX(D, ne11) * 2; // *2 because of S and SM in ggml_compute_forward_flash_attn_back
+                if (node->src[1]->type == GGML_TYPE_F32) {
+                    cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
+                    cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
+                } else if (node->src[1]->type == GGML_TYPE_F16) {
+                    cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
+                    cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
+                } else if (node->src[1]->type == GGML_TYPE_BF16) {
+                    cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
+                    cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
+                }
+            } break;
+
+        case GGML_OP_CROSS_ENTROPY_LOSS:
+            {
+                cur = ggml_type_size(node->type)*(n_tasks + node->src[0]->ne[0]*n_tasks);
+            } break;
+        case GGML_OP_COUNT:
+            {
+                GGML_ASSERT(false);
+            } break;
+        default:
+            break;
+    }
+
+    return cur;
+}
+
+//
+// waves
+//
+// the graph is computed one node at a time with every thread waiting
+// for the slowest one after each node. when decoding a single token,
+// many nodes are too small to keep all threads busy, and some nodes
+// don't depend on each other at all, e.g. the q, k and v projections
+// of an attention layer. so when the next node is ready to run, we
+// look ahead for other nodes that could run at the same time, and
+// split the threads between them in proportion to the memory each
+// has to touch. such a group of nodes is called a wave.
+//
+// nodes can join a wave out of order as long as they don't touch the
+// memory written by a node that precedes them, and don't write any
+// memory that a preceding node touches. comparing addresses instead
+// of walking sources also catches views, in-place ops, and nodes that
+// the graph allocator placed in memory freed by an earlier node.
+//
+
+static bool ggml_graph_wave_is_nop(const struct ggml_tensor * node) {
+    switch (node->op) {
+        case GGML_OP_NONE:
+        case GGML_OP_VIEW:
+        case GGML_OP_RESHAPE:
+        case GGML_OP_PERMUTE:
+        case GGML_OP_TRANSPOSE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool ggml_graph_wave_can_run(const struct ggml_tensor * node) {
+    if (GGML_OP_HAS_INIT[node->op] || GGML_OP_HAS_FINALIZE[node->op]) {
+        return false;
+    }
+    switch (node->op) {
+        case GGML_OP_MAP_UNARY:
+        case GGML_OP_MAP_BINARY:
+        case GGML_OP_MAP_CUSTOM1_F32:
+        case GGML_OP_MAP_CUSTOM2_F32:
+        case GGML_OP_MAP_CUSTOM3_F32:
+        case GGML_OP_MAP_CUSTOM1:
+        case GGML_OP_MAP_CUSTOM2:
+        case GGML_OP_MAP_CUSTOM3:
+            return false;
+        default:
+            return !ggml_graph_wave_is_nop(node);
+    }
+}
+
+static bool ggml_graph_wave_overlaps(const struct ggml_tensor * a, const struct ggml_tensor * b) {
+    if (!a->data || !b->data) {
+        return true;
+    }
+    const char * a0 = a->data;
+    const char * b0 = b->data;
+    return a0 < b0 + ggml_nbytes(b) && b0 < a0 + ggml_nbytes(a);
+}
+
+// returns true if a and b must not run at the same time
+static bool ggml_graph_wave_conflicts(const struct ggml_tensor * a, const struct ggml_tensor * b) {
+    if (ggml_graph_wave_overlaps(a, b)) {
+        return true;
+    }
+    for (int i = 0; i < GGML_MAX_SRC; ++i) {
+        if (a->src[i] && ggml_graph_wave_overlaps(a->src[i], b)) {
+            return true;
+        }
+        if (b->src[i] && ggml_graph_wave_overlaps(a, b->src[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static size_t ggml_graph_wave_cost(const struct ggml_tensor * node) {
+    size_t cost = ggml_nbytes(node);
+    for (int i = 0; i < GGML_MAX_SRC; ++i) {
+        if (node->src[i]) {
+            cost += ggml_nbytes(node->src[i]);
+        }
+    }
+    return cost;
+}
+
+//
+// src1 cache, see struct ggml_src1_cache
+//
+// mul_mats that could use it never join a wave, since the one that
+// fills the cache has to finish before its siblings start.
+//
+
+// at decode time converting src1 costs less than losing a wave
+#define GGML_SRC1_CACHE_MIN_ROWS 32
+
+// returns bytes node i needs to convert its src1 into the cache, or
+// zero if no later mul_mat nearby multiplies the same activation
+static size_t ggml_src1_cache_need(const struct ggml_cgraph * cgraph, int i) {
+    const struct ggml_tensor * node = cgraph->nodes[i];
+    if (node->op != GGML_OP_MUL_MAT || !ggml_is_quantized(node->src[0]->type)) {
+        return 0;
+    }
+    const struct ggml_tensor * src1 = node->src[1];
+    const enum ggml_type vec_dot_type = type_traits[node->src[0]->type].vec_dot_type;
+    if (src1->type != GGML_TYPE_F32 || ggml_nrows(src1) < GGML_SRC1_CACHE_MIN_ROWS) {
+        return 0;
+    }
+    const int end = MIN(cgraph->n_nodes, i + 1 + GGML_WAVE_WINDOW);
+    for (int j = i + 1; j < end; ++j) {
+        const struct ggml_tensor * next = cgraph->nodes[j];
+        if (next->op == GGML_OP_MUL_MAT && next->src[1] == src1 &&
+            type_traits[next->src[0]->type].vec_dot_type == vec_dot_type) {
+            return ggml_row_size(vec_dot_type, ggml_nelements(src1));
+        }
+    }
+    return 0;
+}
+
+// forgets the cached src1 if node is about to overwrite its memory
+static void ggml_src1_cache_clobber(struct ggml_src1_cache * cache, const struct ggml_tensor * node) {
+    if (cache->src1 && !ggml_graph_wave_is_nop(node) && ggml_graph_wave_overlaps(node, cache->src1)) {
+        cache->src1 = NULL;
+    }
+}
+
+// decides whether node_n, which runs by itself, fills the cache
+static void ggml_src1_cache_prepare(struct ggml_src1_cache * cache, const struct ggml_cgraph * cgraph, int node_n) {
+    const struct ggml_tensor * node = cgraph->nodes[node_n];
+    ggml_src1_cache_clobber(cache, node);
+    cache->fill = NULL;
+    const size_t need = ggml_src1_cache_need(cgraph, node_n);
+    if (need && need <= cache->size &&
+        !(cache->src1 == node->src[1] && cache->type == type_traits[node->src[0]->type].vec_dot_type)) {
+        cache->fill = node;
+    }
+}
+
+// builds a wave that starts at node_n, using at most work_size bytes
+// of scratch space. each node the wave computes ahead of node_n gets a
+// bit set in *done, where bit 0 is node_n. return false if node_n has
+// to run by itself, in which case the wave is left empty.
+static bool ggml_graph_wave_build(const struct ggml_cgraph * cgraph, int node_n, int n_threads,
+                                  size_t work_size, struct ggml_graph_wave * wave, uint64_t * done) {
+    wave->n = 0;
+    if (n_threads < 2 || !ggml_graph_wave_can_run(cgraph->nodes[node_n]) ||
+        ggml_src1_cache_need(cgraph, node_n)) {
+        return false;
+    }
+
+    int n_tasks[GGML_WAVE_MAX];
+    size_t cost[GGML_WAVE_MAX];
+    size_t size = 0;
+    int n = 0;
+
+    const int end = MIN(cgraph->n_nodes, node_n + GGML_WAVE_WINDOW);
+    for (int j = node_n; j < end && n < MIN(n_threads, GGML_WAVE_MAX); ++j) {
+        if (*done & (1ull << (j - node_n))) {
+            continue;
+        }
+        struct ggml_tensor * node = cgraph->nodes[j];
+        if (ggml_graph_wave_is_nop(node)) {
+            continue;
+        }
+        bool ok = ggml_graph_wave_can_run(node) && !ggml_src1_cache_need(cgraph, j);
+        for (int i = node_n; ok && i < j; ++i) {
+            // everything not yet computed must stay in order with us
+            if (!(*done & (1ull << (i - node_n))) &&
+                !ggml_graph_wave_is_nop(cgraph->nodes[i]) &&
+                ggml_graph_wave_conflicts(cgraph->nodes[i], node)) {
+                ok = false;
+            }
+        }
+        if (!ok) {
+            if (j == node_n) {
+                return false;
+            }
+            continue;
+        }
+        const int nt = ggml_get_n_tasks(node, n_threads, n_threads);
+        size_t ws = ggml_graph_node_work_size(node, nt);
+        if (ws) {
+            ws += CACHE_LINE_SIZE*(nt - 1);
+            ws = GGML_PAD(ws, CACHE_LINE_SIZE);
+        }
+        if (j != node_n && size + ws > work_size) {
+            continue;
+        }
+        wave->node[n] = j;
+        wave->offs[n] = size;
+        wave->wsize[n] = ws;
+        n_tasks[n] = nt;
+        cost[n] = ggml_graph_wave_cost(node);
+        size += ws;
+        ++n;
+    }
+    if (n < 2) {
+        return false;
+    }
+
+    // every node gets one thread, then the rest are handed out one at
+    // a time to whichever node has the most work left per thread
+    int threads[GGML_WAVE_MAX];
+    int left = n_threads - n;
+    for (int k = 0; k < n; ++k) {
+        threads[k] = 1;
+    }
+    while (left > 0) {
+        int best = -1;
+        double best_cost = 0;
+        for (int k = 0; k < n; ++k) {
+            const double c = (double) cost[k] / threads[k];
+            if (threads[k] < n_tasks[k] && c > best_cost) {
+                best_cost = c;
+                best = k;
+            }
+        }
+        if (best < 0) {
+            break;
+        }
+        ++threads[best];
+        --left;
+    }
+    threads[n - 1] += left; // idle threads have to go somewhere
+
+    wave->ith[0] = 0;
+    for (int k = 0; k < n; ++k) {
+        wave->ith[k + 1] = wave->ith[k] + threads[k];
+        wave->nth[k] = MIN(threads[k], n_tasks[k]);
+        *done |= 1ull << (wave->node[k] - node_n);
+    }
+    wave->size = size;
+    wave->n = n;
+    return true;
+}
+
+static void ggml_graph_compute_thread_sync_node(int * node_n, struct ggml_compute_state * state, const bool do_yield) {
+    // wait for other threads to finish
+    const int last_node_n = * node_n;
+    int backoff = 0;
+
+    sync_wait_start();
+    while (true) {
+        * node_n = atomic_load_explicit(&state->shared->node_n, memory_order_acquire);
+        if (* node_n != last_node_n) break;
+        backoff = ggml_delay(backoff);
+    }
+    sync_wait_end();
+}
+
+static void ggml_graph_compute_thread_sync_task(int * task_phase, struct ggml_compute_state * state, const bool do_yield) {
+    // wait for other threads to finish
+    const int last_task_phase = * task_phase;
+    int backoff = 0;
+
+    sync_wait_start();
+    while (true) {
+        * task_phase = atomic_load_explicit(&state->shared->node_task, memory_order_acquire);
+        if (* task_phase != last_task_phase) break;
+        backoff = ggml_delay(backoff);
+    }
+    sync_wait_end();
+}
+
+//
+// adaptive thread counts
+//
+// Ops that ggml gives every thread don't always get faster with more
+// of them. Generating a token is bound by memory bandwidth, which a few
+// cores saturate, after which each extra thread only adds to the cost
+// of the barriers. With --adaptive-threads, each kind of node, which is
+// its op and how many rows it has rounded down to a power of two, so
+// prompt processing and generation are told apart, tries all threads,
+// then half, a quarter and so on, measuring the time per byte it reads
+// and writes. Once every count was tried a few times, the fewest threads
+// that come within a few percent of the fastest are used, and the other
+// counts are tried again now and then, in case the machine got busier.
+// Threads that a node leaves out back off until the next one, and a
+// node that ends up with one thread runs on the dispatching thread
+// without waking the others at all.
+//
+
+#define GGML_ADAPT_ROWS   16   // classes of row counts, by log2
+#define GGML_ADAPT_LEVELS 6    // n_threads, n_threads/2, ..., n_threads/32
+#define GGML_ADAPT_TRIALS 4    // runs of each level before choosing
+#define GGML_ADAPT_RETRY  256  // runs between trying another level again
+#define GGML_ADAPT_SLACK  1.05 // fewer threads win unless this much slower
+
+struct ggml_adapt_stat {
+    int n_threads;                          // what the levels are halvings of
+    uint32_t runs;
+    uint8_t trials[GGML_ADAPT_LEVELS];
+    float ns_per_byte[GGML_ADAPT_LEVELS];   // moving average
+};
+
+static struct ggml_adapt_stat g_adapt[GGML_OP_COUNT][GGML_ADAPT_ROWS];
+static atomic_int g_adapt_lock;
+
+static void ggml_adapt_lock(void) {
+    int backoff = 0;
+    while (atomic_exchange_explicit(&g_adapt_lock, 1, memory_order_acquire)) {
+        backoff = ggml_delay(backoff);
+    }
+}
+
+static void ggml_adapt_unlock(void) {
+    atomic_store_explicit(&g_adapt_lock, 0, memory_order_release);
+}
+
+static int64_t ggml_adapt_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+static int ggml_adapt_levels(int n_threads) {
+    int n = 1;
+    while (n < GGML_ADAPT_LEVELS && n_threads >> n) {
+        ++n;
+    }
+    return n;
+}
+
+// returns the stats of node, or null if its thread count is left alone
+static struct ggml_adapt_stat * ggml_adapt_find(const struct ggml_tensor * node, int n_threads, int n_tasks) {
+    if (!FLAG_adaptive_threads || n_threads < 2 || n_tasks != n_threads) {
+        return NULL;
+    }
+    const int64_t nrows = ggml_nrows(node);
+    int row_class = 0;
+    while (row_class < GGML_ADAPT_ROWS - 1 && nrows >> (row_class + 1)) {
+        ++row_class;
+    }
+    return &g_adapt[node->op][row_class];
+}
+
+// picks how many halvings of n_threads the next run of a node gets
+static int ggml_adapt_pick(struct ggml_adapt_stat * st, int n_threads) {
+    const int levels = ggml_adapt_levels(n_threads);
+    int level = 0;
+    ggml_adapt_lock();
+    if (st->n_threads != n_threads) {
+        memset(st, 0, sizeof(*st));
+        st->n_threads = n_threads;
+    }
+    ++st->runs;
+    for (int l = 1; l < levels; ++l) {
+        if (st->trials[l] < st->trials[level]) {
+            level = l;
+        }
+    }
+    if (st->trials[level] >= GGML_ADAPT_TRIALS) {
+        if (st->runs % GGML_ADAPT_RETRY == 0) {
+            level = st->runs / GGML_ADAPT_RETRY % levels;
+        } else {
+            float best = st->ns_per_byte[0];
+            for (int l = 1; l < levels; ++l) {
+                best = MIN(best, st->ns_per_byte[l]);
+            }
+            for (int l = 0; l < levels; ++l) {
+                if (st->ns_per_byte[l] <= best * GGML_ADAPT_SLACK) {
+                    level = l;
+                }
+            }
+        }
+    }
+    ggml_adapt_unlock();
+    return level;
+}
+
+static void ggml_adapt_record(struct ggml_adapt_stat * st, int level, const struct ggml_tensor * node, int64_t ns) {
+    const float x = (float) ns / MAX(ggml_graph_wave_cost(node), 1);
+    ggml_adapt_lock();
+    if (st->trials[level] < 255) {
+        ++st->trials[level];
+    }
+    st->ns_per_byte[level] = st->trials[level] > 1 ? 0.75f*st->ns_per_byte[level] + 0.25f*x : x;
+    ggml_adapt_unlock();
+}
+
+static thread_ret_t ggml_graph_compute_thread(void * data) {
+    struct ggml_compute_state * state = (struct ggml_compute_state *) data;
+
+    const struct ggml_cgraph * cgraph = state->shared->cgraph;
+    const struct ggml_cplan  * cplan  = state->shared->cplan;
+
+    const int   n_threads   = state->shared->n_threads;
+
+    set_numa_thread_affinity(state->ith);
 
     int node_n     = -1;
     int task_phase = GGML_TASK_TYPE_FINALIZE;
@@ -18096,6 +20474,7 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
                 /*.wsize   =*/ cplan->work_size,
                 /*.wdata   =*/ cplan->work_data,
                 /*.barrier =*/ &state->shared->barrier,
+                /*.src1_cache =*/ &state->shared->src1_cache,
             };
 
 #ifdef LLAMAFILE_DEBUG
@@ -18106,17 +20485,48 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
                 /* FINALIZE */
                 struct ggml_tensor * node = cgraph->nodes[node_n];
                 if (GGML_OP_HAS_FINALIZE[node->op]) {
-                    params.nth = ggml_get_n_tasks(node, n_threads, state->shared->n_threads);
+                    params.nth = state->shared->n_tasks;
                     ggml_compute_forward(&params, node);
                 }
+                if (state->shared->adapt) {
+                    ggml_adapt_record(state->shared->adapt, state->shared->adapt_level, node,
+                                      ggml_adapt_now() - state->shared->adapt_start);
+                    state->shared->adapt = NULL;
+                }
                 ggml_graph_compute_perf_stats_node(node, state->shared);
+                for (int k = 1; k < state->shared->wave.n; ++k) {
+                    ggml_graph_compute_perf_stats_node(cgraph->nodes[state->shared->wave.node[k]], state->shared);
+                }
             }
 
+            state->shared->wave.n = 0;
+            bool multithreaded = false;
+
             // distribute new work or execute it direct if 1T
             while (++node_n < cgraph->n_nodes) {
+                // skip nodes that an earlier wave computed out of order
+                state->shared->done >>= 1;
+                if (state->shared->done & 1) {
+                    continue;
+                }
+
                 GGML_PRINT_DEBUG_5("%s: %d/%d\n", __func__, node_n, cgraph->n_nodes);
                 struct ggml_tensor * node = cgraph->nodes[node_n];
-                const int n_tasks = ggml_get_n_tasks(node, n_threads, state->shared->n_threads);
+                int n_tasks = ggml_get_n_tasks(node, n_threads, state->shared->n_threads);
+
+                if (cplan->node_callback) {
+                    cplan->node_callback(node, cplan->node_callback_data);
+                }
+
+                struct ggml_adapt_stat * adapt = ggml_adapt_find(node, n_threads, n_tasks);
+                int adapt_level = 0;
+                if (adapt) {
+                    adapt_level = ggml_adapt_pick(adapt, n_threads);
+                    n_tasks = n_threads >> adapt_level;
+                    state->shared->adapt_start = ggml_adapt_now();
+                }
+
+                ggml_src1_cache_prepare(&state->shared->src1_cache, cgraph, node_n);
 
                 state->shared->perf_node_start_cycles  = ggml_perf_cycles();
                 state->shared->perf_node_start_time_us = ggml_perf_time_us();
@@ -18144,8 +20554,16 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
                         ggml_compute_forward(&params, node);
                     }
 
+                    if (adapt) {
+                        ggml_adapt_record(adapt, adapt_level, node, ggml_adapt_now() - state->shared->adapt_start);
+                    }
+
                     ggml_graph_compute_perf_stats_node(node, state->shared);
                 } else {
+                    state->shared->n_tasks = n_tasks;
+                    state->shared->adapt = adapt;
+                    state->shared->adapt_level = adapt_level;
+                    multithreaded = true;
                     break;
                 }
 
@@ -18154,6 +20572,19 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
                 }
             }
 
+            // see if other nodes can run alongside this one
+            if (multithreaded) {
+                struct ggml_graph_wave * wave = &state->shared->wave;
+                if (ggml_graph_wave_build(cgraph, node_n, n_threads, cplan->work_size - cplan->src1_cache_size,
+                                          wave, &state->shared->done)) {
+                    // a wave shares out the threads itself
+                    state->shared->adapt = NULL;
+                }
+                for (int k = 1; k < wave->n; ++k) {
+                    ggml_src1_cache_clobber(&state->shared->src1_cache, cgraph->nodes[wave->node[k]]);
+                }
+            }
+
             task_phase = GGML_TASK_TYPE_INIT;
 
             atomic_store_explicit(&state->shared->n_active,  n_threads,  memory_order_release);
@@ -18167,46 +20598,75 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
         // check if we should stop
         if (node_n >= cgraph->n_nodes) break;
 
-        /* INIT & COMPUTE */
-        struct ggml_tensor * node = cgraph->nodes[node_n];
-        const int n_tasks = ggml_get_n_tasks(node, n_threads, state->shared->n_threads);
-
-        struct ggml_compute_params params = {
-            /*.type    =*/ GGML_TASK_TYPE_INIT,
-            /*.ith     =*/ state->ith,
-            /*.nth     =*/ n_tasks,
-            /*.wsize   =*/ cplan->work_size,
-            /*.wdata   =*/ cplan->work_data,
-            /*.barrier =*/ &state->shared->barrier,
-        };
+        struct ggml_graph_wave * wave = &state->shared->wave;
+        if (wave->n) {
+            /* COMPUTE our part of the wave */
+            int k = 0;
+            while (state->ith >= wave->ith[k + 1]) {
+                ++k;
+            }
+            struct ggml_compute_params params = {
+                /*.type    =*/ GGML_TASK_TYPE_COMPUTE,
+                /*.ith     =*/ state->ith - wave->ith[k],
+                /*.nth     =*/ wave->nth[k],
+                /*.wsize   =*/ wave->wsize[k],
+                /*.wdata   =*/ wave->wsize[k] ? (char *) cplan->work_data + wave->offs[k] : NULL,
+                /*.barrier =*/ &wave->barrier[k],
+                /*.src1_cache =*/ &state->shared->src1_cache,
+            };
 
 #ifdef LLAMAFILE_DEBUG
-        llamafile_debug_op_index = node_n;
+            llamafile_debug_op_index = wave->node[k];
 #endif
 
-        if (GGML_OP_HAS_INIT[node->op]) {
-            if (state->ith < n_tasks) {
-                ggml_compute_forward(&params, node);
+            if (params.ith < params.nth) {
+                ggml_compute_forward(&params, cgraph->nodes[wave->node[k]]);
             }
-            if (atomic_fetch_sub(&state->shared->n_active, 1) == 1) {
-                task_phase = GGML_TASK_TYPE_COMPUTE;
-                atomic_store_explicit(&state->shared->n_active,  n_threads,  memory_order_release);
-                atomic_store_explicit(&state->shared->node_task, task_phase, memory_order_release);
-            }
-            else {
-                // TODO: this sched_yield can have significant impact on the performance - either positive or negative
-                //       depending on the workload and the operating system.
-                //       since it is not clear what is the best approach, it should potentially become user-configurable
-                //       ref: https://github.com/ggerganov/ggml/issues/291
-                // UPD:  adding the do_yield flag seems to resolve the issue universally
-                const bool do_yield = node_n < 0 || cgraph->nodes[node_n]->op == GGML_OP_MUL_MAT;
-                ggml_graph_compute_thread_sync_task(&task_phase, state, do_yield);
+        } else {
+            /* INIT & COMPUTE */
+            struct ggml_tensor * node = cgraph->nodes[node_n];
+            const int n_tasks = state->shared->n_tasks;
+
+            struct ggml_compute_params params = {
+                /*.type    =*/ GGML_TASK_TYPE_INIT,
+                /*.ith     =*/ state->ith,
+                /*.nth     =*/ n_tasks,
+                /*.wsize   =*/ cplan->work_size,
+                /*.wdata   =*/ cplan->work_data,
+                /*.barrier =*/ &state->shared->barrier,
+                /*.src1_cache =*/ &state->shared->src1_cache,
+            };
+
+#ifdef LLAMAFILE_DEBUG
+            llamafile_debug_op_index = node_n;
+#endif
+
+            if (GGML_OP_HAS_INIT[node->op]) {
+                if (state->ith < n_tasks) {
+                    ggml_compute_forward(&params, node);
+                }
+                if (atomic_fetch_sub(&state->shared->n_active, 1) == 1) {
+                    task_phase = GGML_TASK_TYPE_COMPUTE;
+                    atomic_store_explicit(&state->shared->n_active,  n_threads,  memory_order_release);
+                    atomic_store_explicit(&state->shared->node_task, task_phase, memory_order_release);
+                }
+                else {
+                    // TODO: this sched_yield can have significant impact on the performance - either positive or negative
+                    //       depending on the workload and the operating system.
+                    //       since it is not clear what is the best approach, it should potentially become user-configurable
+                    //       ref: https://github.com/ggerganov/ggml/issues/291
+                    // UPD:  adding the do_yield flag seems to resolve the issue universally
+                    const bool do_yield = node_n < 0 || (cgraph->nodes[node_n]->op == GGML_OP_MUL_MAT ||
+                                                            cgraph->nodes[node_n]->op == GGML_OP_MUL_MAT_SWIGLU ||
+                                                            cgraph->nodes[node_n]->op == GGML_OP_MUL_MAT_AXPY);
+                    ggml_graph_compute_thread_sync_task(&task_phase, state, do_yield);
+                }
             }
-        }
 
-        if (state->ith < n_tasks) {
-            params.type = GGML_TASK_TYPE_COMPUTE;
-            ggml_compute_forward(&params, node);
+            if (state->ith < n_tasks) {
+                params.type = GGML_TASK_TYPE_COMPUTE;
+                ggml_compute_forward(&params, node);
+            }
         }
 
         if (atomic_fetch_sub(&state->shared->n_active, 1) == 1) {
@@ -18249,194 +20709,44 @@ struct ggml_cplan ggml_graph_plan(const struct ggml_cgraph * cgraph, int n_threa
 
         max_tasks = MAX(max_tasks, n_tasks);
 
-        size_t cur = 0;
-
-        switch (node->op) {
-            case GGML_OP_CPY:
-            case GGML_OP_DUP:
-                {
-                    if (ggml_is_quantized(node->type)) {
-                        cur = ggml_type_size(GGML_TYPE_F32) * node->ne[0] * n_tasks;
-                    }
-                } break;
-            case GGML_OP_ADD:
-            case GGML_OP_ADD1:
-                {
-                    if (ggml_is_quantized(node->src[0]->type)) {
-                        cur = ggml_type_size(GGML_TYPE_F32) * node->src[0]->ne[0] * n_tasks;
-                    }
-                } break;
-            case GGML_OP_ACC:
-                {
-                    if (ggml_is_quantized(node->src[0]->type)) {
-                        cur = ggml_type_size(GGML_TYPE_F32) * node->src[1]->ne[0] * n_tasks;
-                    }
-                } break;
-            case GGML_OP_MUL_MAT:
-                {
-                    const enum ggml_type vec_dot_type = type_traits[node->src[0]->type].vec_dot_type;
-
-#if defined(GGML_USE_CLBLAST)
-                    if (ggml_cl_can_mul_mat(node->src[0], node->src[1], node)) {
-                        cur = ggml_cl_mul_mat_get_wsize(node->src[0], node->src[1], node);
-                    } else
-#endif
-#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
-                    if (ggml_compute_forward_mul_mat_use_blas(node)) {
-                        if (node->src[0]->type != GGML_TYPE_F32) {
-                            // here we need memory for fully dequantized matrix from src0
-                            // take into account that src0 can be broadcasted into src1[2,3]
-                            cur = ggml_type_size(GGML_TYPE_F32)
-                                * node->src[0]->ne[0]*node->src[0]->ne[1]
-                                * node->src[1]->ne[2]*node->src[1]->ne[3];
-                        }
-                    } else
-#endif
-                    if (node->src[1]->type != vec_dot_type) {
-                        cur = ggml_row_size(vec_dot_type, ggml_nelements(node->src[1]));
-                    }
-                } break;
-            case GGML_OP_MUL_MAT_ID:
-                {
-                    cur = 0;
-                    const struct ggml_tensor * src0 = node->src[0];
-                    const struct ggml_tensor * src1 = node->src[1];
-                    const struct ggml_tensor * src2 = node->src[2];
-                    const enum ggml_type vec_dot_type = type_traits[src0->type].vec_dot_type;
-                    if (src1->type != vec_dot_type) {
-                        cur += ggml_row_size(vec_dot_type, ggml_nelements(src1));
-                    }
-                    const int n_as = src0->ne[2];
-                    cur += GGML_PAD(cur, sizeof(int64_t));       // align
-                    cur += n_as * sizeof(int64_t);               // matrix_row_counts
-                    cur += n_as * src1->ne[2] * sizeof(int64_t); // matrix_rows
-                    size_t cur2 = llamafile_mixmul_needs(src0, src1, src2);
-                    cur = cur > cur2 ? cur : cur2;
-                } break;
-            case GGML_OP_OUT_PROD:
-                {
-                    if (ggml_is_quantized(node->src[0]->type)) {
-                        cur = ggml_type_size(GGML_TYPE_F32) * node->src[0]->ne[0] * n_tasks;
-                    }
-                } break;
-            case GGML_OP_SOFT_MAX:
-            case GGML_OP_ROPE:
-                {
-                    cur = ggml_type_size(GGML_TYPE_F32) * node->ne[0] * n_tasks;
-                } break;
-            case GGML_OP_CONV_TRANSPOSE_1D:
-                {
-                    GGML_ASSERT(node->src[0]->ne[3] == 1);
-                    GGML_ASSERT(node->src[1]->ne[2] == 1);
-                    GGML_ASSERT(node->src[1]->ne[3] == 1);
-
-                    const int64_t ne00 = node->src[0]->ne[0];  // K
-                    const int64_t ne01 = node->src[0]->ne[1];  // Cout
-                    const int64_t ne02 = node->src[0]->ne[2];  // Cin
-
-                    const int64_t ne10 = node->src[1]->ne[0];  // L
-                    const int64_t ne11 = node->src[1]->ne[1];  // Cin
-
-                    if ((node->src[0]->type == GGML_TYPE_F16 ||
-                         node->src[0]->type == GGML_TYPE_BF16) &&
-                        node->src[1]->type == GGML_TYPE_F32) {
-                        cur += sizeof(ggml_fp16_t)*ne00*ne01*ne02;
-                        cur += sizeof(ggml_fp16_t)*ne10*ne11;
-                    } else if (node->src[0]->type == GGML_TYPE_F32 &&
-                               node->src[1]->type == GGML_TYPE_F32) {
-                        cur += sizeof(float)*ne00*ne01*ne02;
-                        cur += sizeof(float)*ne10*ne11;
-                    } else {
-                        GGML_ASSERT(false);
-                    }
-                } break;
-            case GGML_OP_CONV_TRANSPOSE_2D:
-                {
-                    const int64_t ne00 = node->src[0]->ne[0]; // W
-                    const int64_t ne01 = node->src[0]->ne[1]; // H
-                    const int64_t ne02 = node->src[0]->ne[2]; // Channels Out
-                    const int64_t ne03 = node->src[0]->ne[3]; // Channels In
-
-                    const int64_t ne10 = node->src[1]->ne[0]; // W
-                    const int64_t ne11 = node->src[1]->ne[1]; // H
-                    const int64_t ne12 = node->src[1]->ne[2]; // Channels In
+        work_size = MAX(work_size, ggml_graph_node_work_size(node, n_tasks));
+    }
 
-                    cur += sizeof(ggml_fp16_t)*ne00*ne01*ne02*ne03;
-                    cur += sizeof(ggml_fp16_t)*ne10*ne11*ne12;
-                } break;
-            case GGML_OP_FLASH_ATTN:
-                {
-                    const int64_t ne11 = ggml_up(node->src[1]->ne[1], GGML_SOFT_MAX_UNROLL);
-
-                    if (node->src[1]->type == GGML_TYPE_F32) {
-                        cur  = sizeof(float)*ne11*n_tasks; // TODO: this can become (n_tasks-1)
-                        cur += sizeof(float)*ne11*n_tasks; // this is overestimated by x2
-                    } else if (node->src[1]->type == GGML_TYPE_F16) {
-                        cur  = sizeof(float)*ne11*n_tasks; // TODO: this can become (n_tasks-1)
-                        cur += sizeof(float)*ne11*n_tasks; // this is overestimated by x2
-                    } else if (node->src[1]->type == GGML_TYPE_BF16) {
-                        cur  = sizeof(float)*ne11*n_tasks; // TODO: this can become (n_tasks-1)
-                        cur += sizeof(float)*ne11*n_tasks; // this is overestimated by x2
-                    }
-                } break;
-            case GGML_OP_FLASH_ATTN_EXT:
-                {
-                    const int64_t ne00 = node->src[0]->ne[0]; // D
+    if (work_size > 0) {
+        work_size += CACHE_LINE_SIZE*(n_threads - 1);
+    }
 
-                    cur = 2*sizeof(float)*ne00*n_tasks; // 2x head size
-                } break;
-            case GGML_OP_FLASH_FF:
-                {
-                    if (node->src[1]->type == GGML_TYPE_F32) {
-                        cur  = sizeof(float)*node->src[1]->ne[1]*n_tasks; // TODO: this can become (n_tasks-1)
-                        cur += sizeof(float)*node->src[1]->ne[1]*n_tasks; // this is overestimated by x2
-                    } else if (node->src[1]->type == GGML_TYPE_F16) {
-                        cur  = sizeof(float)*node->src[1]->ne[1]*n_tasks; // TODO: this can become (n_tasks-1)
-                        cur += sizeof(float)*node->src[1]->ne[1]*n_tasks; // this is overestimated by x2
-                    } else if (node->src[1]->type == GGML_TYPE_BF16) {
-                        cur  = sizeof(float)*node->src[1]->ne[1]*n_tasks; // TODO: this can become (n_tasks-1)
-                        cur += sizeof(float)*node->src[1]->ne[1]*n_tasks; // this is overestimated by x2
-                    }
-                } break;
-            case GGML_OP_FLASH_ATTN_BACK:
-                {
-                    const int64_t    D = node->src[0]->ne[0];
-                    const int64_t ne11 = ggml_up(node->src[1]->ne[1], GGML_SOFT_MAX_UNROLL);
-                    const int64_t mxDn = MAX(D, ne11) * 2; // *2 because of S and SM in ggml_compute_forward_flash_attn_back
-                    if (node->src[1]->type == GGML_TYPE_F32) {
-                        cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
-                        cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
-                    } else if (node->src[1]->type == GGML_TYPE_F16) {
-                        cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
-                        cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
-                    } else if (node->src[1]->type == GGML_TYPE_BF16) {
-                        cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
-                        cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
-                    }
-                } break;
+    n_threads = MIN(max_tasks, n_threads);
 
-            case GGML_OP_CROSS_ENTROPY_LOSS:
-                {
-                    cur = ggml_type_size(node->type)*(n_tasks + node->src[0]->ne[0]*n_tasks);
-                } break;
-            case GGML_OP_COUNT:
-                {
-                    GGML_ASSERT(false);
-                } break;
-            default:
-                break;
+    // nodes that run in the same wave each need their own scratch space.
+    // this replays the decisions ggml_graph_compute_thread() will make
+    {
+        struct ggml_graph_wave wave;
+        uint64_t done = 0;
+        for (int i = 0; i < cgraph->n_nodes; ++i, done >>= 1) {
+            if ((done & 1) || ggml_get_n_tasks(cgraph->nodes[i], n_threads, n_threads) == 1) {
+                continue;
+            }
+            if (ggml_graph_wave_build(cgraph, i, n_threads, SIZE_MAX, &wave, &done)) {
+                work_size = MAX(work_size, wave.size);
+            }
         }
-
-        work_size = MAX(work_size, cur);
     }
 
-    if (work_size > 0) {
-        work_size += CACHE_LINE_SIZE*(n_threads - 1);
+    // the src1 cache goes after the scratch space of any node or wave
+    size_t src1_cache_size = 0;
+    for (int i = 0; i < cgraph->n_nodes; ++i) {
+        src1_cache_size = MAX(src1_cache_size, ggml_src1_cache_need(cgraph, i));
+    }
+    if (src1_cache_size > 0) {
+        src1_cache_size = GGML_PAD(src1_cache_size, CACHE_LINE_SIZE);
+        work_size = GGML_PAD(work_size, CACHE_LINE_SIZE) + src1_cache_size;
     }
 
-    cplan.n_threads = MIN(max_tasks, n_threads);
+    cplan.n_threads = n_threads;
     cplan.work_size = work_size;
     cplan.work_data = NULL;
+    cplan.src1_cache_size = src1_cache_size;
 
     return cplan;
 }
@@ -18480,6 +20790,163 @@ static void print_graph(FILE *f, const struct ggml_cgraph *g, int n_threads) {
     }
 }
 
+//
+// persistent worker threads
+//
+// creating and joining threads for every graph costs more than the
+// graph itself when decoding a single token on many cores, and every
+// new thread starts with cold caches. so worker threads are created
+// once and kept around for the lifetime of the process. between two
+// graphs they spin for a little while, since the next graph usually
+// arrives right away, and then go to sleep on a condition variable.
+//
+// the pool is shared by every caller of ggml_graph_compute(), which
+// includes the cpu backend. if two threads compute graphs at the same
+// time, the one that doesn't get the pool falls back to creating its
+// own threads like before.
+//
+
+#define GGML_POOL_MAX_THREADS 512
+#define GGML_POOL_SPIN_US     2000
+
+struct ggml_pool_worker {
+    atomic_uint generation;              // bumped to hand out a graph
+    struct ggml_compute_state * state;   // work for the current graph
+    ggml_thread_t thrd;
+    int ith;                             // thread index it always gets
+};
+
+static struct ggml_pool {
+    pthread_mutex_t owner;               // held while a graph uses the pool
+    pthread_mutex_t lock;                // protects the condition below
+    pthread_cond_t  cond;
+    atomic_int n_sleeping;
+    atomic_int n_done;                   // workers finished with the graph
+    int n_workers;                       // threads created so far
+    struct ggml_pool_worker * workers[GGML_POOL_MAX_THREADS];
+} g_pool = {
+    .owner = PTHREAD_MUTEX_INITIALIZER,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static inline void ggml_pool_pause(void) {
+#if defined(__x86_64__)
+    _mm_pause();
+#elif defined(__aarch64__)
+    __asm__ volatile("yield");
+#endif
+}
+
+static unsigned ggml_pool_wait(struct ggml_pool_worker * w, unsigned seen) {
+    unsigned gen;
+    int64_t t_start = 0;
+    for (int i = 0;; ++i) {
+        gen = atomic_load_explicit(&w->generation, memory_order_acquire);
+        if (gen != seen) {
+            return gen;
+        }
+        if (i % 256) {
+            ggml_pool_pause();
+            continue;
+        }
+        int64_t now = ggml_time_us();
+        if (!t_start) {
+            t_start = now;
+        } else if (now - t_start > GGML_POOL_SPIN_US) {
+            break;
+        }
+    }
+    pthread_mutex_lock(&g_pool.lock);
+    atomic_fetch_add(&g_pool.n_sleeping, 1);
+    while ((gen = atomic_load(&w->generation)) == seen) {
+        pthread_cond_wait(&g_pool.cond, &g_pool.lock);
+    }
+    atomic_fetch_sub(&g_pool.n_sleeping, 1);
+    pthread_mutex_unlock(&g_pool.lock);
+    return gen;
+}
+
+static thread_ret_t ggml_pool_worker_main(void * arg) {
+    struct ggml_pool_worker * w = arg;
+    unsigned seen = 0;
+    if (!ggml_is_numa()) {
+        llamafile_pin_thread(w->ith);
+    }
+    for (;;) {
+        seen = ggml_pool_wait(w, seen);
+        ggml_graph_compute_thread(w->state);
+#ifdef LLAMAFILE_DEBUG
+        if (FLAG_trap) {
+            llamafile_trapping_enabled(-1);
+        }
+#endif
+        atomic_fetch_add_explicit(&g_pool.n_done, 1, memory_order_release);
+    }
+    return 0;
+}
+
+// a child of fork() has none of the pool's threads, so it forgets them
+// and starts its own the next time it computes a graph
+static void ggml_pool_atfork_child(void) {
+    for (int i = 0; i < g_pool.n_workers; ++i) {
+        free(g_pool.workers[i]);
+    }
+    g_pool.n_workers = 0;
+    atomic_store(&g_pool.n_sleeping, 0);
+    pthread_mutex_init(&g_pool.owner, NULL);
+    pthread_mutex_init(&g_pool.lock, NULL);
+    pthread_cond_init(&g_pool.cond, NULL);
+}
+
+static void ggml_pool_init(void) {
+    pthread_atfork(NULL, NULL, ggml_pool_atfork_child);
+    llamafile_plan_cores();
+}
+
+// runs workers[1..n_threads) on pooled threads, or returns false if
+// the pool is busy computing some other graph
+static bool ggml_pool_start(struct ggml_compute_state * workers, int n_threads) {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    if (n_threads > GGML_POOL_MAX_THREADS) {
+        return false;
+    }
+    pthread_once(&once, ggml_pool_init);
+    if (pthread_mutex_trylock(&g_pool.owner)) {
+        return false;
+    }
+    while (g_pool.n_workers < n_threads - 1) {
+        struct ggml_pool_worker * w = calloc(1, sizeof(struct ggml_pool_worker));
+        GGML_ASSERT(w);
+        w->ith = g_pool.n_workers + 1;
+        const int rc = ggml_thread_create(&w->thrd, NULL, ggml_pool_worker_main, w);
+        GGML_ASSERT(rc == 0);
+        UNUSED(rc);
+        g_pool.workers[g_pool.n_workers++] = w;
+    }
+    atomic_store_explicit(&g_pool.n_done, 0, memory_order_relaxed);
+    for (int j = 1; j < n_threads; ++j) {
+        struct ggml_pool_worker * w = g_pool.workers[j - 1];
+        workers[j].thrd = w->thrd;
+        w->state = &workers[j];
+        atomic_fetch_add(&w->generation, 1);
+    }
+    if (atomic_load(&g_pool.n_sleeping)) {
+        pthread_mutex_lock(&g_pool.lock);
+        pthread_cond_broadcast(&g_pool.cond);
+        pthread_mutex_unlock(&g_pool.lock);
+    }
+    return true;
+}
+
+static void ggml_pool_finish(int n_threads) {
+    int backoff = 0;
+    while (atomic_load_explicit(&g_pool.n_done, memory_order_acquire) < n_threads - 1) {
+        backoff = ggml_delay(backoff);
+    }
+    pthread_mutex_unlock(&g_pool.owner);
+}
+
 enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cplan * cplan) {
     {
         GGML_ASSERT(cplan);
@@ -18505,17 +20972,23 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
         /*.n_active                =*/ n_threads,
         /*.node_n                  =*/ -1,
         /*.node_task               =*/ GGML_TASK_TYPE_FINALIZE,
+        /*.n_tasks                 =*/ 0,
         /*.barrier                 =*/ {0, 0},
         /*.abort_callback          =*/ NULL,
         /*.abort_callback_data     =*/ NULL,
     };
+    if (cplan->src1_cache_size > 0) {
+        state_shared.src1_cache.size = cplan->src1_cache_size;
+        state_shared.src1_cache.data = (char *) cplan->work_data + cplan->work_size - cplan->src1_cache_size;
+    }
     struct ggml_compute_state * workers = alloca(sizeof(struct ggml_compute_state)*n_threads);
 
 #ifdef LLAMAFILE_DEBUG
     llamafile_debug_graph = cgraph;
 #endif
 
-    // create thread pool
+    // hand out work to the thread pool
+    bool pooled = false;
     if (n_threads > 1) {
         for (int j = 1; j < n_threads; ++j) {
             workers[j] = (struct ggml_compute_state) {
@@ -18525,10 +20998,18 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
                 .ec = GGML_STATUS_SUCCESS,
                 .is_main_thread = false, // [jart]
             };
-
-            const int rc = ggml_thread_create(&workers[j].thrd, NULL, ggml_graph_compute_thread, &workers[j]);
-            GGML_ASSERT(rc == 0);
-            UNUSED(rc);
+        }
+        pooled = ggml_pool_start(workers, n_threads);
+        if (pooled && !ggml_is_numa()) {
+            // the pool's threads are pinned, so this one must be too
+            llamafile_pin_thread(0);
+        }
+        if (!pooled) {
+            for (int j = 1; j < n_threads; ++j) {
+                const int rc = ggml_thread_create(&workers[j].thrd, NULL, ggml_graph_compute_thread, &workers[j]);
+                GGML_ASSERT(rc == 0);
+                UNUSED(rc);
+            }
         }
     }
 
@@ -18546,12 +21027,19 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
 
     // don't leave affinity set on the main thread
     clear_numa_thread_affinity();
+    llamafile_unpin_thread();
 
-    // join or kill thread pool
+    // wait for the thread pool
     if (n_threads > 1) {
+        if (pooled) {
+            ggml_pool_finish(n_threads);
+        }
         for (int j = 1; j < n_threads; j++) {
-            const int rc = ggml_thread_join(workers[j].thrd, NULL);
-            GGML_ASSERT(rc == 0);
+            if (!pooled) {
+                const int rc = ggml_thread_join(workers[j].thrd, NULL);
+                GGML_ASSERT(rc == 0);
+                UNUSED(rc);
+            }
             if (workers[j].ec != GGML_STATUS_SUCCESS)
                 compute_status = workers[j].ec;
         }
@@ -20309,6 +22797,7 @@ size_t ggml_quantize_chunk(
         case GGML_TYPE_Q5_0:    result = quantize_q5_0(src + start, (char *) dst + start_row * row_size, nrows, n_per_row, imatrix); break;
         case GGML_TYPE_Q5_1:    result = quantize_q5_1(src + start, (char *) dst + start_row * row_size, nrows, n_per_row, imatrix); break;
         case GGML_TYPE_Q8_0:    result = quantize_q8_0(src + start, (char *) dst + start_row * row_size, nrows, n_per_row, imatrix); break;
+        case GGML_TYPE_F8_E4M3: result = quantize_f8_e4m3(src + start, (char *) dst + start_row * row_size, nrows, n_per_row, imatrix); break;
         case GGML_TYPE_Q2_K:    result = quantize_q2_K(src + start, (char *) dst + start_row * row_size, nrows, n_per_row, imatrix); break;
         case GGML_TYPE_Q3_K:    result = quantize_q3_K(src + start, (char *) dst + start_row * row_size, nrows, n_per_row, imatrix); break;
         case GGML_TYPE_Q4_K:    result = quantize_q4_K(src + start, (char *) dst + start_row * row_size, nrows, n_per_row, imatrix); break;
@@ -20415,6 +22904,8 @@ union gguf_value {
 
         uint64_t n;  // GGUFv2
         void * data;
+
+        bool packed; // strings share one allocation, owned by the first
     } arr;
 };
 
@@ -20487,13 +22978,85 @@ static bool gguf_fread_el(struct llamafile * file, void * dst, size_t size, size
     return n == size;
 }
 
-static bool gguf_fread_str(struct llamafile * file, struct gguf_str * p, size_t * offset) {
+// gguf metadata is parsed out of a window of the file held in memory,
+// which is the file's own mapping when it has one, and otherwise is a
+// buffer refilled with large reads. issuing a read per scalar and per
+// string of a 150k token vocabulary crawls on network filesystems.
+#define GGUF_READ_CHUNK (4*1024*1024)
+
+struct gguf_reader {
+    struct llamafile * file;
+    const char * data; // window into the file
+    size_t size;       // bytes in window
+    size_t pos;        // read position in window
+    size_t fpos;       // file position of the end of the window
+    char * buf;        // owned window, or NULL if data is the mapping
+};
+
+static void gguf_reader_init(struct gguf_reader * r, struct llamafile * file) {
+    const char * content = llamafile_content(file);
+    r->file = file;
+    r->pos  = 0;
+    r->fpos = llamafile_tell(file);
+    if (content) {
+        r->size = r->fpos < llamafile_size(file) ? llamafile_size(file) - r->fpos : 0;
+        r->data = content + r->fpos;
+        r->fpos += r->size;
+        r->buf  = NULL;
+    } else {
+        r->size = 0;
+        r->buf  = GGML_MALLOC(GGUF_READ_CHUNK);
+        r->data = r->buf;
+    }
+}
+
+// puts the file position right after the last byte consumed
+static void gguf_reader_free(struct gguf_reader * r) {
+    llamafile_seek(r->file, r->fpos - (r->size - r->pos), SEEK_SET);
+    GGML_FREE(r->buf);
+}
+
+static bool gguf_read_el(struct gguf_reader * r, void * dst, size_t size, size_t * offset) {
+    for (;;) {
+        const size_t n = MIN(size, r->size - r->pos);
+        memcpy(dst, r->data + r->pos, n);
+        r->pos  += n;
+        *offset += n;
+        dst   = (char *) dst + n;
+        size -= n;
+        if (!size) {
+            return true;
+        }
+        if (!r->buf) {
+            return false;
+        }
+        const size_t remain = llamafile_size(r->file) - MIN(r->fpos, llamafile_size(r->file));
+        if (size >= GGUF_READ_CHUNK) {
+            // big arrays skip the window
+            if (size > remain || llamafile_read(r->file, dst, size) != (long) size) {
+                return false;
+            }
+            r->fpos += size;
+            *offset += size;
+            return true;
+        }
+        const size_t amt = MIN(remain, GGUF_READ_CHUNK);
+        if (!amt || llamafile_read(r->file, r->buf, amt) != (long) amt) {
+            return false;
+        }
+        r->fpos += amt;
+        r->size  = amt;
+        r->pos   = 0;
+    }
+}
+
+static bool gguf_read_str(struct gguf_reader * r, struct gguf_str * p, size_t * offset) {
     p->n    = 0;
     p->data = NULL;
 
     bool ok = true;
 
-    ok = ok && gguf_fread_el(file, &p->n, sizeof(p->n), offset);
+    ok = ok && gguf_read_el(r, &p->n, sizeof(p->n), offset);
 
     // early exit if string length is invalid, prevents from integer overflow
     if (p->n == SIZE_MAX) {
@@ -20503,11 +23066,56 @@ static bool gguf_fread_str(struct llamafile * file, struct gguf_str * p, size_t
 
     p->data = GGML_CALLOC(p->n + 1, 1);
 
-    ok = ok && gguf_fread_el(file,  p->data, p->n, offset);
+    ok = ok && gguf_read_el(r, p->data, p->n, offset);
 
     return ok;
 }
 
+// reads a string array into a single allocation, rather than calling
+// malloc once for each of the tokens and merges of the vocabulary
+static bool gguf_read_arr_str(struct gguf_reader * r, struct gguf_str * arr, uint64_t n, size_t * offset) {
+    size_t cap = 0;
+    size_t len = 0;
+    char * blob = NULL;
+
+    bool ok = true;
+
+    for (uint64_t j = 0; ok && j < n; ++j) {
+        uint64_t sn = 0;
+        ok = ok && gguf_read_el(r, &sn, sizeof(sn), offset);
+        if (!ok || sn >= SIZE_MAX/2 - len) {
+            ok = false;
+            break;
+        }
+        if (len + sn + 1 > cap) {
+            cap = MAX(len + sn + 1, MAX(cap * 2, 4096));
+            char * p = realloc(blob, cap);
+            if (!p) {
+                ok = false;
+                break;
+            }
+            blob = p;
+        }
+        ok = ok && gguf_read_el(r, blob + len, sn, offset);
+        blob[len + sn] = '\0';
+        arr[j].n    = sn;
+        arr[j].data = (char *) (uintptr_t) len; // rebased below
+        len += sn + 1;
+    }
+
+    if (!ok || n == 0) {
+        memset(arr, 0, n * sizeof(*arr));
+        free(blob);
+        return ok;
+    }
+
+    for (uint64_t j = 0; j < n; ++j) {
+        arr[j].data = blob + (uintptr_t) arr[j].data;
+    }
+
+    return true;
+}
+
 static void gguf_free_kv(struct gguf_kv * kv) {
     if (kv->key.data) {
         GGML_FREE(kv->key.data);
@@ -20521,7 +23129,11 @@ static void gguf_free_kv(struct gguf_kv * kv) {
 
     if (kv->type == GGUF_TYPE_ARRAY) {
         if (kv->value.arr.data) {
-            if (kv->value.arr.type == GGUF_TYPE_STRING) {
+            if (kv->value.arr.type == GGUF_TYPE_STRING && kv->value.arr.packed) {
+                if (kv->value.arr.n > 0) {
+                    GGML_FREE(((struct gguf_str *) kv->value.arr.data)[0].data);
+                }
+            } else if (kv->value.arr.type == GGUF_TYPE_STRING) {
                 for (uint64_t j = 0; j < kv->value.arr.n; ++j) {
                     struct gguf_str * str = &((struct gguf_str *) kv->value.arr.data)[j];
                     if (str->data) {
@@ -20561,13 +23173,17 @@ struct gguf_context * gguf_init_from_file(struct llamafile * file, struct gguf_i
 
     char magic[4];
 
+    struct gguf_reader r;
+    gguf_reader_init(&r, file);
+
     // check the magic before making allocations
     {
-        gguf_fread_el(file, &magic, sizeof(magic), &offset);
+        gguf_read_el(&r, &magic, sizeof(magic), &offset);
 
         for (uint32_t i = 0; i < sizeof(magic); i++) {
             if (magic[i] != GGUF_MAGIC[i]) {
                 fprintf(stderr, "%s: invalid magic characters '%c%c%c%c'\n", __func__, magic[0], magic[1], magic[2], magic[3]);
+                gguf_reader_free(&r);
                 return NULL;
             }
         }
@@ -20585,12 +23201,13 @@ struct gguf_context * gguf_init_from_file(struct llamafile * file, struct gguf_i
         ctx->infos = NULL;
         ctx->data  = NULL;
 
-        ok = ok && gguf_fread_el(file, &ctx->header.version,   sizeof(ctx->header.version),   &offset);
-        ok = ok && gguf_fread_el(file, &ctx->header.n_tensors, sizeof(ctx->header.n_tensors), &offset);
-        ok = ok && gguf_fread_el(file, &ctx->header.n_kv,      sizeof(ctx->header.n_kv),      &offset);
+        ok = ok && gguf_read_el(&r, &ctx->header.version,   sizeof(ctx->header.version),   &offset);
+        ok = ok && gguf_read_el(&r, &ctx->header.n_tensors, sizeof(ctx->header.n_tensors), &offset);
+        ok = ok && gguf_read_el(&r, &ctx->header.n_kv,      sizeof(ctx->header.n_kv),      &offset);
 
         if (ctx->header.version == 1) {
             fprintf(stderr, "%s: GGUFv1 is no longer supported. please use a more up-to-date version\n", __func__);
+            gguf_reader_free(&r);
             gguf_free(ctx);
             return NULL;
         }
@@ -20603,6 +23220,7 @@ struct gguf_context * gguf_init_from_file(struct llamafile * file, struct gguf_i
 
         if (!ok) {
             fprintf(stderr, "%s: failed to read header\n", __func__);
+            gguf_reader_free(&r);
             gguf_free(ctx);
             return NULL;
         }
@@ -20621,28 +23239,28 @@ struct gguf_context * gguf_init_from_file(struct llamafile * file, struct gguf_i
 
             //fprintf(stderr, "%s: reading kv %d\n", __func__, i);
 
-            ok = ok && gguf_fread_str(file, &kv->key,                    &offset);
-            ok = ok && gguf_fread_el (file, &kv->type, sizeof(kv->type), &offset);
+            ok = ok && gguf_read_str(&r, &kv->key,                    &offset);
+            ok = ok && gguf_read_el (&r, &kv->type, sizeof(kv->type), &offset);
 
             //fprintf(stderr, "%s: reading kv with key %s\n", __func__, kv->key.data);
 
             switch (kv->type) {
-                case GGUF_TYPE_UINT8:   ok = ok && gguf_fread_el (file, &kv->value.uint8,   sizeof(kv->value.uint8),   &offset); break;
-                case GGUF_TYPE_INT8:    ok = ok && gguf_fread_el (file, &kv->value.int8,    sizeof(kv->value.int8),    &offset); break;
-                case GGUF_TYPE_UINT16:  ok = ok && gguf_fread_el (file, &kv->value.uint16,  sizeof(kv->value.uint16),  &offset); break;
-                case GGUF_TYPE_INT16:   ok = ok && gguf_fread_el (file, &kv->value.int16,   sizeof(kv->value.int16),   &offset); break;
-                case GGUF_TYPE_UINT32:  ok = ok && gguf_fread_el (file, &kv->value.uint32,  sizeof(kv->value.uint32),  &offset); break;
-                case GGUF_TYPE_INT32:   ok = ok && gguf_fread_el (file, &kv->value.int32,   sizeof(kv->value.int32),   &offset); break;
-                case GGUF_TYPE_FLOAT32: ok = ok && gguf_fread_el (file, &kv->value.float32, sizeof(kv->value.float32), &offset); break;
-                case GGUF_TYPE_UINT64:  ok = ok && gguf_fread_el (file, &kv->value.uint64,  sizeof(kv->value.uint64),  &offset); break;
-                case GGUF_TYPE_INT64:   ok = ok && gguf_fread_el (file, &kv->value.int64,   sizeof(kv->value.int64),   &offset); break;
-                case GGUF_TYPE_FLOAT64: ok = ok && gguf_fread_el (file, &kv->value.float64, sizeof(kv->value.float64), &offset); break;
-                case GGUF_TYPE_BOOL:    ok = ok && gguf_fread_el (file, &kv->value.bool_,   sizeof(kv->value.bool_),   &offset); break;
-                case GGUF_TYPE_STRING:  ok = ok && gguf_fread_str(file, &kv->value.str,                                &offset); break;
+                case GGUF_TYPE_UINT8:   ok = ok && gguf_read_el (&r, &kv->value.uint8,   sizeof(kv->value.uint8),   &offset); break;
+                case GGUF_TYPE_INT8:    ok = ok && gguf_read_el (&r, &kv->value.int8,    sizeof(kv->value.int8),    &offset); break;
+                case GGUF_TYPE_UINT16:  ok = ok && gguf_read_el (&r, &kv->value.uint16,  sizeof(kv->value.uint16),  &offset); break;
+                case GGUF_TYPE_INT16:   ok = ok && gguf_read_el (&r, &kv->value.int16,   sizeof(kv->value.int16),   &offset); break;
+                case GGUF_TYPE_UINT32:  ok = ok && gguf_read_el (&r, &kv->value.uint32,  sizeof(kv->value.uint32),  &offset); break;
+                case GGUF_TYPE_INT32:   ok = ok && gguf_read_el (&r, &kv->value.int32,   sizeof(kv->value.int32),   &offset); break;
+                case GGUF_TYPE_FLOAT32: ok = ok && gguf_read_el (&r, &kv->value.float32, sizeof(kv->value.float32), &offset); break;
+                case GGUF_TYPE_UINT64:  ok = ok && gguf_read_el (&r, &kv->value.uint64,  sizeof(kv->value.uint64),  &offset); break;
+                case GGUF_TYPE_INT64:   ok = ok && gguf_read_el (&r, &kv->value.int64,   sizeof(kv->value.int64),   &offset); break;
+                case GGUF_TYPE_FLOAT64: ok = ok && gguf_read_el (&r, &kv->value.float64, sizeof(kv->value.float64), &offset); break;
+                case GGUF_TYPE_BOOL:    ok = ok && gguf_read_el (&r, &kv->value.bool_,   sizeof(kv->value.bool_),   &offset); break;
+                case GGUF_TYPE_STRING:  ok = ok && gguf_read_str(&r, &kv->value.str,                                &offset); break;
                 case GGUF_TYPE_ARRAY:
                     {
-                        ok = ok && gguf_fread_el(file, &kv->value.arr.type, sizeof(kv->value.arr.type), &offset);
-                        ok = ok && gguf_fread_el(file, &kv->value.arr.n,    sizeof(kv->value.arr.n),    &offset);
+                        ok = ok && gguf_read_el(&r, &kv->value.arr.type, sizeof(kv->value.arr.type), &offset);
+                        ok = ok && gguf_read_el(&r, &kv->value.arr.n,    sizeof(kv->value.arr.n),    &offset);
 
                         switch (kv->value.arr.type) {
                             case GGUF_TYPE_UINT8:
@@ -20660,28 +23278,29 @@ struct gguf_context * gguf_init_from_file(struct llamafile * file, struct gguf_i
                                     // prevent from integer overflow in the malloc below
                                     if (kv->value.arr.n >= SIZE_MAX/gguf_type_size(kv->value.arr.type)) {
                                         fprintf(stderr, "%s: array size is too large (%" PRIu64 ")\n", __func__, kv->value.arr.n);
+                                        gguf_reader_free(&r);
                                         gguf_free(ctx);
                                         return NULL;
                                     }
 
                                     kv->value.arr.data = GGML_CALLOC(kv->value.arr.n, gguf_type_size(kv->value.arr.type));
 
-                                    ok = ok && gguf_fread_el(file, kv->value.arr.data, kv->value.arr.n * gguf_type_size(kv->value.arr.type), &offset);
+                                    ok = ok && gguf_read_el(&r, kv->value.arr.data, kv->value.arr.n * gguf_type_size(kv->value.arr.type), &offset);
                                 } break;
                             case GGUF_TYPE_STRING:
                                 {
                                     // prevent from integer overflow in the malloc below
                                     if (kv->value.arr.n >= SIZE_MAX/sizeof(struct gguf_str)) {
                                         fprintf(stderr, "%s: array size is too large (%" PRIu64 ")\n", __func__, kv->value.arr.n);
+                                        gguf_reader_free(&r);
                                         gguf_free(ctx);
                                         return NULL;
                                     }
 
-                                    kv->value.arr.data = GGML_CALLOC(kv->value.arr.n, sizeof(struct gguf_str));
+                                    kv->value.arr.data   = GGML_CALLOC(kv->value.arr.n, sizeof(struct gguf_str));
+                                    kv->value.arr.packed = true;
 
-                                    for (uint64_t j = 0; j < kv->value.arr.n; ++j) {
-                                        ok = ok && gguf_fread_str(file, &((struct gguf_str *) kv->value.arr.data)[j], &offset);
-                                    }
+                                    ok = ok && gguf_read_arr_str(&r, kv->value.arr.data, kv->value.arr.n, &offset);
                                 } break;
                             case GGUF_TYPE_ARRAY:
                             default: GGML_ASSERT(false && "invalid type"); break;
@@ -20699,6 +23318,7 @@ struct gguf_context * gguf_init_from_file(struct llamafile * file, struct gguf_i
 
         if (!ok) {
             fprintf(stderr, "%s: failed to read key-value pairs\n", __func__);
+            gguf_reader_free(&r);
             gguf_free(ctx);
             return NULL;
         }
@@ -20715,17 +23335,17 @@ struct gguf_context * gguf_init_from_file(struct llamafile * file, struct gguf_i
                 info->ne[j] = 1;
             }
 
-            ok = ok && gguf_fread_str(file, &info->name,                          &offset);
-            ok = ok && gguf_fread_el (file, &info->n_dims, sizeof(info->n_dims),  &offset);
+            ok = ok && gguf_read_str(&r, &info->name,                          &offset);
+            ok = ok && gguf_read_el (&r, &info->n_dims, sizeof(info->n_dims),  &offset);
 
             ok = ok && (info->n_dims <= GGML_MAX_DIMS);
 
             for (uint32_t j = 0; j < info->n_dims; ++j) {
-                ok = ok && gguf_fread_el(file, &info->ne[j], sizeof(info->ne[j]), &offset);
+                ok = ok && gguf_read_el(&r, &info->ne[j], sizeof(info->ne[j]), &offset);
             }
 
-            ok = ok && gguf_fread_el (file, &info->type,   sizeof(info->type),    &offset);
-            ok = ok && gguf_fread_el (file, &info->offset, sizeof(info->offset),  &offset);
+            ok = ok && gguf_read_el (&r, &info->type,   sizeof(info->type),    &offset);
+            ok = ok && gguf_read_el (&r, &info->offset, sizeof(info->offset),  &offset);
 
             // TODO: return an error instead of crashing with GGML_ASSERT
             gguf_tensor_info_sanitize(info);
@@ -20740,12 +23360,15 @@ struct gguf_context * gguf_init_from_file(struct llamafile * file, struct gguf_i
 
             if (!ok) {
                 fprintf(stderr, "%s: failed to read tensor info\n", __func__);
+                gguf_reader_free(&r);
                 gguf_free(ctx);
                 return NULL;
             }
         }
     }
 
+    gguf_reader_free(&r);
+
     ctx->alignment = GGUF_DEFAULT_ALIGNMENT;
 
     int alignment_idx = gguf_find_key(ctx, "general.alignment");
@@ -21222,6 +23845,7 @@ void gguf_set_arr_str(struct gguf_context * ctx, const char * key, const char **
     ctx->kv[idx].value.arr.type = GGUF_TYPE_STRING;
     ctx->kv[idx].value.arr.n    = n;
     ctx->kv[idx].value.arr.data = GGML_CALLOC(n, sizeof(struct gguf_str));
+    ctx->kv[idx].value.arr.packed = false;
     for (int i = 0; i < n; i++) {
         struct gguf_str * str = &((struct gguf_str *)ctx->kv[idx].value.arr.data)[i];
         str->n    = strlen(data[i]);
@@ -21507,15 +24131,33 @@ void gguf_write_to_file(const struct gguf_context * ctx, const char * fname, boo
         GGML_ASSERT(false && "failed to open file for writing");
     }
 
+    // only the metadata is serialized in memory; tensor data is streamed
+    // straight from where it lives, so writing a model doesn't need a
+    // second copy of it
     struct gguf_buf buf = gguf_buf_init(16*1024);
 
-    gguf_write_to_buf(ctx, &buf, only_meta);
+    gguf_write_to_buf(ctx, &buf, true);
 
-    fwrite(buf.data, 1, buf.offset, file);
+    bool ok = fwrite(buf.data, 1, buf.offset, file) == buf.offset;
 
     gguf_buf_free(buf);
 
-    fclose(file);
+    if (!only_meta) {
+        static const char zeros[64];
+        for (uint32_t i = 0; ok && i < ctx->header.n_tensors; ++i) {
+            const struct gguf_tensor_info * info = &ctx->infos[i];
+            ok = fwrite(info->data, 1, info->size, file) == info->size;
+            for (size_t pad = GGML_PAD(info->size, ctx->alignment) - info->size; ok && pad;) {
+                const size_t n = MIN(pad, sizeof(zeros));
+                ok = fwrite(zeros, 1, n, file) == n;
+                pad -= n;
+            }
+        }
+    }
+
+    if (fclose(file) || !ok) {
+        GGML_ASSERT(false && "failed to write file");
+    }
 }
 
 size_t gguf_get_meta_size(const struct gguf_context * ctx) {
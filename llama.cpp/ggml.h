@@ -236,6 +236,7 @@
 #define GGML_MAX_NAME           64
 #endif
 #define GGML_MAX_OP_PARAMS      64
+#define GGML_MAX_MASKED_EXPERTS 256
 #define GGML_DEFAULT_N_THREADS  4
 #define GGML_DEFAULT_GRAPH_SIZE 2048
 #if UINTPTR_MAX == 0xFFFFFFFF
@@ -379,6 +380,7 @@ extern "C" {
         GGML_TYPE_F64     = 28,
         GGML_TYPE_IQ1_M   = 29,
         GGML_TYPE_BF16    = 30,
+        GGML_TYPE_F8_E4M3 = 31,
         GGML_TYPE_COUNT,
     };
 
@@ -420,6 +422,7 @@ extern "C" {
         GGML_FTYPE_MOSTLY_IQ4_XS  = 22, // except 1d tensors
         GGML_FTYPE_MOSTLY_IQ1_M   = 23, // except 1d tensors
         GGML_FTYPE_MOSTLY_BF16    = 24, // except 1d tensors
+        GGML_FTYPE_MOSTLY_F8_E4M3 = 25, // except 1d tensors
     };
 
     // available tensor operations:
@@ -447,10 +450,13 @@ extern "C" {
         GGML_OP_NORM, // normalize
         GGML_OP_RMS_NORM,
         GGML_OP_RMS_NORM_BACK,
+        GGML_OP_RMS_NORM_MUL,
         GGML_OP_GROUP_NORM,
 
         GGML_OP_MUL_MAT,
         GGML_OP_MUL_MAT_ID,
+        GGML_OP_MUL_MAT_SWIGLU,
+        GGML_OP_MUL_MAT_AXPY,
         GGML_OP_OUT_PROD,
 
         GGML_OP_SCALE,
@@ -612,6 +618,9 @@ extern "C" {
     // If it returns true, the computation is aborted
     typedef bool (*ggml_abort_callback)(void * data);
 
+    // called by one thread before each node is computed
+    typedef void (*ggml_node_callback)(const struct ggml_tensor * node, void * data);
+
     // the compute plan that needs to be prepared for ggml_graph_compute()
     // since https://github.com/ggerganov/ggml/issues/287
     struct ggml_cplan {
@@ -620,9 +629,16 @@ extern "C" {
 
         int n_threads;
 
+        // bytes at the end of work_data where a quantized mul_mat src1
+        // is kept for other mul_mats of the same activation to reuse
+        size_t src1_cache_size;
+
         // abort ggml_graph_compute when true
         ggml_abort_callback abort_callback;
         void *              abort_callback_data;
+
+        ggml_node_callback node_callback;
+        void *             node_callback_data;
     };
 
     enum ggml_cgraph_eval_order {
@@ -682,6 +698,7 @@ extern "C" {
     };
 
     struct ggml_barrier;
+    struct ggml_src1_cache;
 
     struct ggml_compute_params {
         enum ggml_task_type type;
@@ -694,8 +711,18 @@ extern "C" {
         void * wdata;
 
         struct ggml_barrier *barrier;
+
+        // quantized src1 shared between mul_mats, may be NULL
+        struct ggml_src1_cache * src1_cache;
     };
 
+    // blocks until all `nth` threads sharing the barrier have called it
+    GGML_API void ggml_syncthreads(struct ggml_barrier * b, int nth);
+
+    // barrier for threads that are not run by ggml_graph_compute()
+    GGML_API struct ggml_barrier * ggml_barrier_new(void);
+    GGML_API void                  ggml_barrier_free(struct ggml_barrier * b);
+
     // numa strategies
     enum ggml_numa_strategy {
         GGML_NUMA_STRATEGY_DISABLED   = 0,
@@ -703,9 +730,18 @@ extern "C" {
         GGML_NUMA_STRATEGY_ISOLATE    = 2,
         GGML_NUMA_STRATEGY_NUMACTL    = 3,
         GGML_NUMA_STRATEGY_MIRROR     = 4,
+        GGML_NUMA_STRATEGY_SHARD      = 5,
+        GGML_NUMA_STRATEGY_TIER       = 6,
         GGML_NUMA_STRATEGY_COUNT
     };
 
+    // a range of weights and how many of its bytes are read per token
+    struct ggml_numa_span {
+        size_t offs;
+        size_t size;
+        float  heat;
+    };
+
     //
     // GUID
     //
@@ -731,6 +767,10 @@ extern "C" {
 
     GGML_API void    ggml_numa_init(enum ggml_numa_strategy numa); // call once for better performance on NUMA systems
     GGML_API bool    ggml_is_numa(void); // true if init detected that system has >1 NUMA node
+    GGML_API bool    ggml_numa_mirror(const void * data, size_t size); // copies weights to every node if strategy is mirror
+    GGML_API bool    ggml_numa_shard(const void * data, size_t size, struct ggml_tensor ** tensors, int n_tensors); // splits matrix rows over nodes if strategy is shard
+    GGML_API bool    ggml_numa_tier(const void * data, size_t size, struct ggml_numa_span * spans, int n_spans); // puts hottest spans in fastest memory if strategy is tier
+    GGML_API bool    ggml_numa_tier_place(void * data, size_t size); // moves a buffer, e.g. the kv cache, to the fastest memory with room if strategy is tier
 
     GGML_API void    ggml_print_object (const struct ggml_object * obj);
     GGML_API void    ggml_print_objects(const struct ggml_context * ctx);
@@ -789,6 +829,8 @@ extern "C" {
     GGML_API size_t  ggml_set_scratch (struct ggml_context * ctx, struct ggml_scratch scratch);
     GGML_API bool    ggml_get_no_alloc(struct ggml_context * ctx);
     GGML_API void    ggml_set_no_alloc(struct ggml_context * ctx, bool no_alloc);
+    GGML_API bool    ggml_get_no_names(struct ggml_context * ctx);
+    GGML_API void    ggml_set_no_names(struct ggml_context * ctx, bool no_names); // skip "(view)", "(copy)", etc. suffixes
 
     GGML_API void *  ggml_get_mem_buffer     (const struct ggml_context * ctx);
     GGML_API size_t  ggml_get_mem_size       (const struct ggml_context * ctx);
@@ -1142,6 +1184,17 @@ extern "C" {
             struct ggml_tensor  * a,
             float                 eps);
 
+    // rms_norm(a) * b in a single pass, with b broadcast along the rows
+    // the result may be stored as the vec_dot type of the matrices that
+    // consume it, so that they don't have to convert it
+    // only implemented by the cpu backend
+    GGML_API struct ggml_tensor * ggml_rms_norm_mul(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            struct ggml_tensor  * b,
+            float                 eps,
+            enum ggml_type        type);
+
     // group normalize along ne0*ne1*n_groups
     // used in stable-diffusion
     // TODO: eps is hardcoded to 1e-6 for now
@@ -1184,6 +1237,46 @@ extern "C" {
             struct ggml_tensor  * b,
             struct ggml_tensor  * ids);
 
+    // ggml_mul_mat_id for only the experts whose bit is set in mask, which
+    // has GGML_MAX_MASKED_EXPERTS bits. rows of the result for the other
+    // experts are zero. if packed, as holds just the masked experts, in the
+    // order of their ids. this lets the experts of one layer live on several
+    // backends, each computing the ones it has, whose results are added
+    GGML_API struct ggml_tensor * ggml_mul_mat_id_masked(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * as,
+            struct ggml_tensor  * b,
+            struct ggml_tensor  * ids,
+            const uint32_t      * mask,
+            bool                  packed);
+
+    // silu(gate * b) * (up * b) without storing either product
+    // only implemented by the cpu backend
+    GGML_API struct ggml_tensor * ggml_mul_mat_swiglu(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * gate,
+            struct ggml_tensor  * up,
+            struct ggml_tensor  * b);
+
+    // ggml_mul_mat_swiglu for only the neurons whose value in pred is
+    // positive. pred has the shape of the result, and the other neurons
+    // come out as zero without reading their rows of gate and up
+    GGML_API struct ggml_tensor * ggml_mul_mat_swiglu_sparse(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * gate,
+            struct ggml_tensor  * up,
+            struct ggml_tensor  * b,
+            struct ggml_tensor  * pred);
+
+    // ggml_mul_mat(ggml_transpose(a), b) as a sum of the rows of a scaled
+    // by the columns of b, skipping the rows whose scale is zero, which is
+    // cheap when b comes out of ggml_mul_mat_swiglu_sparse
+    // only implemented by the cpu backend
+    GGML_API struct ggml_tensor * ggml_mul_mat_axpy(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            struct ggml_tensor  * b);
+
     // A: m columns, n rows,
     // B: p columns, n rows,
     // result is m columns, p rows
@@ -33,9 +33,16 @@ struct StatParams {
     int         n_output_frequency = 10;
     int         verbosity = 1;
     int         keep_every = 0;
+    int         n_threads = 1;
     bool        collect_output_weight = false;
 };
 
+// an activation row and where its squares are accumulated in Stats
+struct Row {
+    const float * x;
+    size_t offset;
+};
+
 class IMatrixCollector {
 public:
     IMatrixCollector() = default;
@@ -51,7 +58,10 @@ private:
     int                                    m_last_call = 0;
     std::vector<float>                     m_src1_data;
     std::vector<char>                      m_ids; // the expert ids from ggml_mul_mat_id
-                                                  //
+    std::vector<Row>                       m_rows;
+    std::vector<std::thread>               m_workers;
+
+    void accumulate(Stats & e, int n_cols);
     void save_imatrix(const char * file_name, const char * dataset) const;
     void keep_imatrix(int ncall) const;
 };
@@ -138,36 +148,29 @@ bool IMatrixCollector::collect_imatrix(struct ggml_tensor * t, bool ask, void *
         if (m_params.verbosity > 1) {
             printf("%s[%d]: %32s, %s, %5d x %5d, %d\n", __func__, m_last_call, wname.c_str(), ggml_op_name(t->op), (int)src1->ne[0], (int)src1->ne[2], (int)src1->type);
         }
-        // loop over all possible experts, regardless if they are used or not in the batch
-        for (int ex = 0; ex < n_as; ++ex) {
-            size_t e_start = ex*src1->ne[0];
+        // find the expert of each row in a single pass over the ids
+        m_rows.clear();
+        for (int idx = 0; idx < n_ids; ++idx) {
+            for (int row = 0; row < (int)src1->ne[2]; ++row) {
+                const int excur = *(const int32_t *) (m_ids.data() + row*ids->nb[1] + idx*ids->nb[0]);
 
-            for (int idx = 0; idx < n_ids; ++idx) {
-                for (int row = 0; row < (int)src1->ne[2]; ++row) {
-                    const int excur = *(const int32_t *) (m_ids.data() + row*ids->nb[1] + idx*ids->nb[0]);
+                GGML_ASSERT(excur >= 0 && excur < n_as); // sanity check
 
-                    GGML_ASSERT(excur >= 0 && excur < n_as); // sanity check
+                const int64_t i11 = idx % src1->ne[1];
+                const int64_t i12 = row;
+                const float * x = (const float *)((const char *)data + i11*src1->nb[1] + i12*src1->nb[2]);
 
-                    if (excur != ex) continue;
-
-                    const int64_t i11 = idx % src1->ne[1];
-                    const int64_t i12 = row;
-                    const float * x = (const float *)((const char *)data + i11*src1->nb[1] + i12*src1->nb[2]);
-
-                    for (int j = 0; j < (int)src1->ne[0]; ++j) {
-                        e.values[e_start + j] += x[j]*x[j];
-                        e.counts[e_start + j]++;
-                    }
-                }
+                m_rows.push_back({x, (size_t)excur*src1->ne[0]});
             }
-            if (e.ncall > m_last_call) {
-                m_last_call = e.ncall;
-                if (m_last_call % m_params.n_output_frequency == 0) {
-                    save_imatrix();
-                }
-                if (m_params.keep_every > 0 && m_last_call%m_params.keep_every == 0) {
-                    keep_imatrix(m_last_call);
-                }
+        }
+        accumulate(e, src1->ne[0]);
+        if (e.ncall > m_last_call) {
+            m_last_call = e.ncall;
+            if (m_last_call % m_params.n_output_frequency == 0) {
+                save_imatrix();
+            }
+            if (m_params.keep_every > 0 && m_last_call%m_params.keep_every == 0) {
+                keep_imatrix(m_last_call);
             }
         }
     } else {
@@ -184,13 +187,11 @@ bool IMatrixCollector::collect_imatrix(struct ggml_tensor * t, bool ask, void *
         if (m_params.verbosity > 1) {
             printf("%s[%d]: %32s, %s, %5d x %5d, %d\n", __func__, m_last_call, wname.c_str(), ggml_op_name(t->op), (int)src1->ne[0], (int)src1->ne[1], (int)src1->type);
         }
+        m_rows.clear();
         for (int row = 0; row < (int)src1->ne[1]; ++row) {
-            const float * x = data + row * src1->ne[0];
-            for (int j = 0; j < (int)src1->ne[0]; ++j) {
-                e.values[j] += x[j]*x[j];
-                e.counts[j]++;
-            }
+            m_rows.push_back({data + row * src1->ne[0], 0});
         }
+        accumulate(e, src1->ne[0]);
         if (e.ncall > m_last_call) {
             m_last_call = e.ncall;
             if (m_last_call % m_params.n_output_frequency == 0) {
@@ -205,6 +206,37 @@ bool IMatrixCollector::collect_imatrix(struct ggml_tensor * t, bool ask, void *
     return true;
 }
 
+// add the squares of m_rows to e on up to n_threads threads
+// each thread owns a slice of the columns of every row, so the threads
+// never write to the same accumulator and nothing needs merging later,
+// which matters for MoE models where the accumulators are large
+void IMatrixCollector::accumulate(Stats & e, int n_cols) {
+    const int64_t work = (int64_t)m_rows.size()*n_cols;
+    const int nth = std::max<int64_t>(1, std::min<int64_t>(m_params.n_threads, work/65536));
+    // keep slices a multiple of 16 floats so threads don't share cache lines
+    const int slice = ((n_cols + nth - 1)/nth + 15) & ~15;
+    auto compute = [this, &e, n_cols, slice] (int ith) {
+        const int j0 = std::min(n_cols, ith*slice);
+        const int j1 = std::min(n_cols, j0 + slice);
+        for (const Row & r : m_rows) {
+            float * values = e.values.data() + r.offset;
+            int   * counts = e.counts.data() + r.offset;
+            for (int j = j0; j < j1; ++j) {
+                values[j] += r.x[j]*r.x[j];
+                counts[j]++;
+            }
+        }
+    };
+    m_workers.resize(nth - 1);
+    for (int ith = 1; ith < nth; ++ith) {
+        m_workers[ith - 1] = std::thread(compute, ith);
+    }
+    compute(0);
+    for (auto & w : m_workers) {
+        w.join();
+    }
+}
+
 void IMatrixCollector::save_imatrix() const {
     save_imatrix(m_params.ofile.empty() ? "imatrix.dat" : m_params.ofile.c_str(), m_params.dataset.c_str());
 }
@@ -395,11 +427,11 @@ static void process_logits(
     }
 }
 
-static bool compute_imatrix(llama_context * ctx, const gpt_params & params, bool compute_ppl, int from_chunk) {
+static bool compute_imatrix(llama_context * ctx, const gpt_params & params, int n_seq, bool compute_ppl, int from_chunk) {
 
     const bool add_bos = llama_should_add_bos_token(llama_get_model(ctx));
     GGML_ASSERT(llama_add_eos_token(llama_get_model(ctx)) != 1);
-    const int n_ctx = llama_n_ctx(ctx);
+    const int n_ctx = llama_n_ctx(ctx) / n_seq;
 
     auto tim1 = std::chrono::high_resolution_clock::now();
     fprintf(stderr, "%s: tokenizing the input ..\n", __func__);
@@ -443,22 +475,27 @@ static bool compute_imatrix(llama_context * ctx, const gpt_params & params, bool
     double nll = 0.0;
     double nll2 = 0.0;
 
-    fprintf(stderr, "%s: computing over %d chunks with batch_size %d\n", __func__, n_chunk, n_batch);
+    fprintf(stderr, "%s: computing over %d chunks with batch_size %d, n_seq=%d\n", __func__, n_chunk, n_batch, n_seq);
 
     std::vector<std::thread> workers(std::thread::hardware_concurrency() - 1);
 
     const int num_batches = (n_ctx + n_batch - 1) / n_batch;
+    const int first = n_ctx/2;
+
+    GGML_ASSERT(n_seq == 1 || n_batch == n_seq * n_ctx);
+
+    llama_batch batch = llama_batch_init(std::min(n_batch, n_ctx*n_seq), 0, 1);
 
     std::vector<float> logits;
     if (compute_ppl && num_batches > 1) {
         logits.reserve((size_t)n_ctx * n_vocab);
     }
 
-    for (int i = 0; i < n_chunk; ++i) {
+    for (int i = 0; i < n_chunk; i += n_seq) {
         const int start =     i * n_ctx;
         const int end   = start + n_ctx;
 
-        std::vector<float> logits;
+        const int n_seq_batch = std::min(n_seq, n_chunk - i);
 
         const auto t_start = std::chrono::high_resolution_clock::now();
 
@@ -469,35 +506,54 @@ static bool compute_imatrix(llama_context * ctx, const gpt_params & params, bool
             const int batch_start = start + j * n_batch;
             const int batch_size  = std::min(end - batch_start, n_batch);
 
-            // save original token and restore it after eval
-            const auto token_org = tokens[batch_start];
+            batch.n_tokens = 0;
+            for (int seq = 0; seq < n_seq_batch; seq++) {
+                int seq_start = batch_start + seq*n_ctx;
+
+                // save original token and restore it after eval
+                const auto token_org = tokens[seq_start];
 
-            // add BOS token for the first batch of each chunk
-            if (add_bos && j == 0) {
-                tokens[batch_start] = llama_token_bos(llama_get_model(ctx));
+                // add BOS token for the first batch of each chunk
+                if (add_bos && j == 0) {
+                    tokens[seq_start] = llama_token_bos(llama_get_model(ctx));
+                }
+
+                // every token is an output, since rows that aren't are dropped
+                // before the last layer, which would then go missing from it
+                for (int k = 0; k < batch_size; ++k) {
+                    const int idx = seq*n_ctx + k;
+                    batch.token   [idx]    = tokens[seq_start + k];
+                    batch.pos     [idx]    = j*n_batch + k;
+                    batch.n_seq_id[idx]    = 1;
+                    batch.seq_id  [idx][0] = seq;
+                    batch.logits  [idx]    = 1;
+                }
+                batch.n_tokens += batch_size;
+
+                // restore the original token in case it was set to BOS
+                tokens[seq_start] = token_org;
             }
 
-            // TODO: use batch.logits to save computations instead of relying on logits_all == true
-            if (llama_decode(ctx, llama_batch_get_one(tokens.data() + batch_start, batch_size, j * n_batch, 0))) {
+            if (llama_decode(ctx, batch)) {
                 fprintf(stderr, "%s : failed to eval\n", __func__);
+                llama_batch_free(batch);
                 return false;
             }
 
-            // restore the original token in case it was set to BOS
-            tokens[batch_start] = token_org;
-
             if (compute_ppl && num_batches > 1) {
-                const auto * batch_logits = llama_get_logits(ctx);
-                logits.insert(logits.end(), batch_logits, batch_logits + batch_size * n_vocab);
+                for (int k = std::max(0, first - j*n_batch); k < batch_size; ++k) {
+                    const auto * batch_logits = llama_get_logits_ith(ctx, k);
+                    logits.insert(logits.end(), batch_logits, batch_logits + n_vocab);
+                }
             }
         }
 
-        const auto t_end = std::chrono::high_resolution_clock::now();
-
         if (i == 0) {
+            llama_synchronize(ctx);
+            const auto t_end = std::chrono::high_resolution_clock::now();
             const float t_total = std::chrono::duration<float>(t_end - t_start).count();
             fprintf(stderr, "%s: %.2f seconds per pass - ETA ", __func__, t_total);
-            int total_seconds = (int)(t_total * n_chunk);
+            int total_seconds = (int)(t_total*n_chunk/n_seq);
             if (total_seconds >= 60*60) {
                 fprintf(stderr, "%d hours ", total_seconds / (60*60));
                 total_seconds = total_seconds % (60*60);
@@ -506,13 +562,15 @@ static bool compute_imatrix(llama_context * ctx, const gpt_params & params, bool
         }
 
         if (compute_ppl) {
-            const int first = n_ctx/2;
-            const auto all_logits = num_batches > 1 ? logits.data() : llama_get_logits(ctx);
-            process_logits(n_vocab, all_logits + first*n_vocab, tokens.data() + start + first, n_ctx - 1 - first,
-                    workers, nll, nll2, logit_history.data() + start + first, prob_history.data() + start + first);
-            count += n_ctx - first - 1;
-
-            printf("[%d]%.4lf,", i + 1, std::exp(nll / count));
+            for (int seq = 0; seq < n_seq_batch; seq++) {
+                const float * all_logits = num_batches > 1 ? logits.data() : llama_get_logits_ith(ctx, seq*n_ctx + first);
+                const int seq_first = start + seq*n_ctx + first;
+                process_logits(n_vocab, all_logits, tokens.data() + seq_first, n_ctx - 1 - first,
+                        workers, nll, nll2, logit_history.data() + seq_first, prob_history.data() + seq_first);
+                count += n_ctx - first - 1;
+
+                printf("[%d]%.4lf,", i + seq + 1, std::exp(nll / count));
+            }
             fflush(stdout);
 
             logits.clear();
@@ -520,6 +578,8 @@ static bool compute_imatrix(llama_context * ctx, const gpt_params & params, bool
     }
     printf("\n");
 
+    llama_batch_free(batch);
+
     if (compute_ppl) {
         nll2 /= count;
         nll /= count;
@@ -603,8 +663,21 @@ int main(int argc, char ** argv) {
         return 1;
     }
 
-    params.logits_all = true;
-    params.n_batch = std::min(params.n_batch, params.n_ctx);
+    if (params.n_ctx <= 0) {
+        fprintf(stderr, "%s: imatrix tool requires '--ctx-size' > 0\n", __func__);
+        return 1;
+    }
+
+    // evaluate several chunks at once as separate sequences, either
+    // when asked to with -np or when the batch is big enough for it
+    const int n_seq = std::max(params.n_parallel, params.n_batch / params.n_ctx);
+    if (n_seq > 1) {
+        params.n_batch    = n_seq * params.n_ctx;
+        params.n_ctx      = n_seq * params.n_ctx;
+        params.n_parallel = n_seq;
+    } else {
+        params.n_batch = std::min(params.n_batch, params.n_ctx);
+    }
 
     print_build_info();
 
@@ -620,6 +693,7 @@ int main(int argc, char ** argv) {
     }
 
     sparams.dataset = params.prompt_file;
+    sparams.n_threads = params.n_threads_batch > 0 ? params.n_threads_batch : params.n_threads;
     g_collector.set_parameters(std::move(sparams));
 
     if (!combine_files.empty()) {
@@ -688,7 +762,7 @@ int main(int argc, char ** argv) {
         fprintf(stderr, "%s\n", get_system_info(params).c_str());
     }
 
-    bool OK = compute_imatrix(ctx, params, compute_ppl, from_chunk);
+    bool OK = compute_imatrix(ctx, params, n_seq, compute_ppl, from_chunk);
     if (!OK) {
         return 1;
     }
@@ -0,0 +1,516 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+
+#include "llama.cpp/common.h"
+#include "llama.cpp/llama.h"
+#include "llamafile/llamafile.h"
+#include "llamafile/version.h"
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <numeric>
+#include <sstream>
+#include <string>
+#include <vector>
+
+//
+// llamafile-bench
+//
+// Measures prompt processing and text generation speed for every
+// combination of the settings passed on the command line, so results
+// can be compared across releases and hardware. Each setting accepts a
+// comma separated list of values.
+//
+
+enum output_format {
+    OUTPUT_MD,
+    OUTPUT_CSV,
+    OUTPUT_JSON,
+};
+
+struct bench_params {
+    std::vector<std::string> model;
+    std::vector<int> n_prompt = {512};
+    std::vector<int> n_gen = {128};
+    std::vector<int> n_batch = {2048};
+    std::vector<int> n_ubatch = {512};
+    std::vector<ggml_type> type_k = {GGML_TYPE_F16};
+    std::vector<ggml_type> type_v = {GGML_TYPE_F16};
+    std::vector<int> n_threads = {get_math_cpu_count()};
+    std::vector<int> n_gpu_layers = {-1};
+    std::vector<bool> flash_attn = {false};
+    int reps = 5;
+    output_format output = OUTPUT_MD;
+    bool verbose = false;
+};
+
+struct bench_test {
+    std::string model;
+    int n_prompt;
+    int n_gen;
+    int n_batch;
+    int n_ubatch;
+    ggml_type type_k;
+    ggml_type type_v;
+    int n_threads;
+    int n_gpu_layers;
+    bool flash_attn;
+};
+
+struct bench_result {
+    bench_test test;
+    std::string model_desc;
+    uint64_t model_size;
+    uint64_t model_n_params;
+    std::vector<double> samples_ts; // tokens per second of each repetition
+
+    double avg_ts() const {
+        if (samples_ts.empty())
+            return 0;
+        return std::accumulate(samples_ts.begin(), samples_ts.end(), 0.0) / samples_ts.size();
+    }
+
+    double stdev_ts() const {
+        if (samples_ts.size() < 2)
+            return 0;
+        double avg = avg_ts();
+        double sum = 0;
+        for (double x : samples_ts)
+            sum += (x - avg) * (x - avg);
+        return std::sqrt(sum / (samples_ts.size() - 1));
+    }
+
+    std::string test_name() const {
+        char buf[64];
+        if (test.n_prompt && test.n_gen)
+            snprintf(buf, sizeof(buf), "pp%d+tg%d", test.n_prompt, test.n_gen);
+        else if (test.n_prompt)
+            snprintf(buf, sizeof(buf), "pp%d", test.n_prompt);
+        else
+            snprintf(buf, sizeof(buf), "tg%d", test.n_gen);
+        return buf;
+    }
+};
+
+static void usage(const char *prog) {
+    bench_params p;
+    fprintf(stderr, "usage: %s [options]\n", prog);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -h, --help\n");
+    fprintf(stderr, "  -m, --model FNAME                 (may be repeated)\n");
+    fprintf(stderr, "  -p, --n-prompt N,...              (default: %d)\n", p.n_prompt[0]);
+    fprintf(stderr, "  -n, --n-gen N,...                 (default: %d)\n", p.n_gen[0]);
+    fprintf(stderr, "  -b, --batch-size N,...            (default: %d)\n", p.n_batch[0]);
+    fprintf(stderr, "  -ub, --ubatch-size N,...          (default: %d)\n", p.n_ubatch[0]);
+    fprintf(stderr, "  -ctk, --cache-type-k TYPE,...     (default: %s)\n", ggml_type_name(p.type_k[0]));
+    fprintf(stderr, "  -ctv, --cache-type-v TYPE,...     (default: %s)\n", ggml_type_name(p.type_v[0]));
+    fprintf(stderr, "  -t, --threads N,...               (default: %d)\n", p.n_threads[0]);
+    fprintf(stderr, "  -ngl, --n-gpu-layers N|auto,...   (default: llamafile's choice)\n");
+    fprintf(stderr, "  -fa, --flash-attn 0|1,...         (default: %d)\n", (int)p.flash_attn[0]);
+    fprintf(stderr, "  -r, --repetitions N               (default: %d)\n", p.reps);
+    fprintf(stderr, "  -o, --output md|csv|json          (default: md)\n");
+    fprintf(stderr, "  -v, --verbose                     show llama.cpp logs\n");
+    exit(1);
+}
+
+static std::vector<std::string> split(const std::string &s) {
+    std::vector<std::string> res;
+    std::stringstream ss(s);
+    std::string item;
+    while (std::getline(ss, item, ','))
+        res.push_back(item);
+    return res;
+}
+
+static std::vector<int> parse_ints(const char *s) {
+    std::vector<int> res;
+    for (const std::string &x : split(s))
+        res.push_back(std::stoi(x));
+    return res;
+}
+
+static int parse_gpu_layers(const std::string &s) {
+    if (s == "auto")
+        return LLAMAFILE_GPU_LAYERS_AUTO;
+    return std::stoi(s);
+}
+
+static bool parse_type(const std::string &s, ggml_type *type) {
+    for (int t = 0; t < GGML_TYPE_COUNT; ++t) {
+        const char *name = ggml_type_name((ggml_type)t);
+        if (name && s == name) {
+            *type = (ggml_type)t;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bench_params parse_args(int argc, char **argv) {
+    bench_params p;
+    bool have_model = false;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-v" || arg == "--verbose") {
+            p.verbose = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            fprintf(stderr, "error: missing value for %s\n", arg.c_str());
+            usage(argv[0]);
+        }
+        const char *val = argv[++i];
+        if (arg == "-m" || arg == "--model") {
+            if (!have_model)
+                p.model.clear();
+            p.model.push_back(val);
+            have_model = true;
+        } else if (arg == "-p" || arg == "--n-prompt") {
+            p.n_prompt = parse_ints(val);
+        } else if (arg == "-n" || arg == "--n-gen") {
+            p.n_gen = parse_ints(val);
+        } else if (arg == "-b" || arg == "--batch-size") {
+            p.n_batch = parse_ints(val);
+        } else if (arg == "-ub" || arg == "--ubatch-size") {
+            p.n_ubatch = parse_ints(val);
+        } else if (arg == "-ctk" || arg == "--cache-type-k" || arg == "-ctv" ||
+                   arg == "--cache-type-v") {
+            std::vector<ggml_type> types;
+            for (const std::string &s : split(val)) {
+                ggml_type t;
+                if (!parse_type(s, &t)) {
+                    fprintf(stderr, "error: unknown cache type: %s\n", s.c_str());
+                    exit(1);
+                }
+                types.push_back(t);
+            }
+            if (arg == "-ctk" || arg == "--cache-type-k")
+                p.type_k = types;
+            else
+                p.type_v = types;
+        } else if (arg == "-t" || arg == "--threads") {
+            p.n_threads = parse_ints(val);
+        } else if (arg == "-ngl" || arg == "--n-gpu-layers") {
+            p.n_gpu_layers.clear();
+            for (const std::string &s : split(val))
+                p.n_gpu_layers.push_back(parse_gpu_layers(s));
+        } else if (arg == "-fa" || arg == "--flash-attn") {
+            p.flash_attn.clear();
+            for (int x : parse_ints(val))
+                p.flash_attn.push_back(x != 0);
+        } else if (arg == "-r" || arg == "--repetitions") {
+            p.reps = std::stoi(val);
+        } else if (arg == "-o" || arg == "--output") {
+            if (!strcmp(val, "md")) {
+                p.output = OUTPUT_MD;
+            } else if (!strcmp(val, "csv")) {
+                p.output = OUTPUT_CSV;
+            } else if (!strcmp(val, "json")) {
+                p.output = OUTPUT_JSON;
+            } else {
+                fprintf(stderr, "error: unknown output format: %s\n", val);
+                exit(1);
+            }
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            usage(argv[0]);
+        }
+    }
+    if (p.model.empty()) {
+        fprintf(stderr, "error: no model specified\n");
+        usage(argv[0]);
+    }
+    if (p.n_prompt.empty() || p.n_gen.empty() || p.n_batch.empty() || p.n_ubatch.empty() ||
+        p.n_threads.empty() || p.n_gpu_layers.empty() || p.flash_attn.empty()) {
+        fprintf(stderr, "error: empty list of values\n");
+        exit(1);
+    }
+    if (p.reps < 1) {
+        fprintf(stderr, "error: --repetitions must be positive\n");
+        exit(1);
+    }
+    return p;
+}
+
+// every combination of settings, with the model params outermost so
+// the model only needs to be reloaded when they change
+static std::vector<bench_test> get_tests(const bench_params &p) {
+    std::vector<bench_test> tests;
+    for (const auto &m : p.model)
+        for (int ngl : p.n_gpu_layers)
+            for (int nb : p.n_batch)
+                for (int nub : p.n_ubatch)
+                    for (ggml_type tk : p.type_k)
+                        for (ggml_type tv : p.type_v)
+                            for (bool fa : p.flash_attn)
+                                for (int nt : p.n_threads) {
+                                    bench_test t = {m, 0, 0, nb, nub, tk, tv, nt, ngl, fa};
+                                    for (int n : p.n_prompt)
+                                        if (n > 0) {
+                                            t.n_prompt = n;
+                                            t.n_gen = 0;
+                                            tests.push_back(t);
+                                        }
+                                    for (int n : p.n_gen)
+                                        if (n > 0) {
+                                            t.n_prompt = 0;
+                                            t.n_gen = n;
+                                            tests.push_back(t);
+                                        }
+                                }
+    return tests;
+}
+
+static bool test_prompt(llama_context *ctx, int n_prompt, int n_batch) {
+    std::vector<llama_token> tokens(n_batch, llama_token_bos(llama_get_model(ctx)));
+    for (int n_processed = 0; n_processed < n_prompt;) {
+        int n = std::min(n_prompt - n_processed, n_batch);
+        if (llama_decode(ctx, llama_batch_get_one(tokens.data(), n, n_processed, 0)))
+            return false;
+        n_processed += n;
+    }
+    llama_synchronize(ctx);
+    return true;
+}
+
+static bool test_gen(llama_context *ctx, int n_gen) {
+    llama_token token = llama_token_bos(llama_get_model(ctx));
+    for (int i = 0; i < n_gen; ++i) {
+        if (llama_decode(ctx, llama_batch_get_one(&token, 1, i, 0)))
+            return false;
+        llama_synchronize(ctx);
+    }
+    return true;
+}
+
+static std::string file_name(const std::string &path) {
+    size_t i = path.find_last_of("/\\");
+    return i == std::string::npos ? path : path.substr(i + 1);
+}
+
+static std::string json_escape(const std::string &s) {
+    std::string res;
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            res += '\\';
+            res += c;
+        } else if ((unsigned char)c < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            res += buf;
+        } else {
+            res += c;
+        }
+    }
+    return res;
+}
+
+static void print_header(const bench_params &p) {
+    switch (p.output) {
+    case OUTPUT_MD:
+        printf("| model | size | params | backend | ngl | threads | n_batch | n_ubatch | type_k "
+               "| type_v | fa | test | t/s |\n");
+        printf("| ----- | ---: | -----: | ------- | --: | ------: | ------: | -------: | ------ "
+               "| ------ | -: | ---- | --: |\n");
+        break;
+    case OUTPUT_CSV:
+        printf("build,model,model_desc,model_size,model_n_params,backend,n_gpu_layers,n_threads,"
+               "n_batch,n_ubatch,type_k,type_v,flash_attn,n_prompt,n_gen,avg_ts,stddev_ts\n");
+        break;
+    case OUTPUT_JSON:
+        printf("[\n");
+        break;
+    }
+    fflush(stdout);
+}
+
+static void print_result(const bench_params &p, const bench_result &r, bool first) {
+    const bench_test &t = r.test;
+    const char *backend = llamafile_describe_gpu();
+    switch (p.output) {
+    case OUTPUT_MD:
+        printf("| %s | %.2f GiB | %.2f B | %s | %d | %d | %d | %d | %s | %s | %d | %s | %.2f ± %.2f |\n",
+               r.model_desc.c_str(), r.model_size / 1024.0 / 1024.0 / 1024.0,
+               r.model_n_params / 1e9, backend, t.n_gpu_layers, t.n_threads, t.n_batch,
+               t.n_ubatch, ggml_type_name(t.type_k), ggml_type_name(t.type_v), t.flash_attn,
+               r.test_name().c_str(), r.avg_ts(), r.stdev_ts());
+        break;
+    case OUTPUT_CSV:
+        printf("\"%s\",\"%s\",\"%s\",%llu,%llu,%s,%d,%d,%d,%d,%s,%s,%d,%d,%d,%.6f,%.6f\n",
+               LLAMAFILE_VERSION_STRING, file_name(t.model).c_str(), r.model_desc.c_str(),
+               (unsigned long long)r.model_size, (unsigned long long)r.model_n_params, backend,
+               t.n_gpu_layers, t.n_threads, t.n_batch, t.n_ubatch, ggml_type_name(t.type_k),
+               ggml_type_name(t.type_v), t.flash_attn, t.n_prompt, t.n_gen, r.avg_ts(),
+               r.stdev_ts());
+        break;
+    case OUTPUT_JSON:
+        printf("%s  {\n", first ? "" : ",\n");
+        printf("    \"build\": \"%s\",\n", LLAMAFILE_VERSION_STRING);
+        printf("    \"model\": \"%s\",\n", json_escape(file_name(t.model)).c_str());
+        printf("    \"model_desc\": \"%s\",\n", json_escape(r.model_desc).c_str());
+        printf("    \"model_size\": %llu,\n", (unsigned long long)r.model_size);
+        printf("    \"model_n_params\": %llu,\n", (unsigned long long)r.model_n_params);
+        printf("    \"backend\": \"%s\",\n", backend);
+        printf("    \"n_gpu_layers\": %d,\n", t.n_gpu_layers);
+        printf("    \"n_threads\": %d,\n", t.n_threads);
+        printf("    \"n_batch\": %d,\n", t.n_batch);
+        printf("    \"n_ubatch\": %d,\n", t.n_ubatch);
+        printf("    \"type_k\": \"%s\",\n", ggml_type_name(t.type_k));
+        printf("    \"type_v\": \"%s\",\n", ggml_type_name(t.type_v));
+        printf("    \"flash_attn\": %s,\n", t.flash_attn ? "true" : "false");
+        printf("    \"n_prompt\": %d,\n", t.n_prompt);
+        printf("    \"n_gen\": %d,\n", t.n_gen);
+        printf("    \"samples_ts\": [");
+        for (size_t i = 0; i < r.samples_ts.size(); ++i)
+            printf("%s%.6f", i ? ", " : "", r.samples_ts[i]);
+        printf("],\n");
+        printf("    \"avg_ts\": %.6f,\n", r.avg_ts());
+        printf("    \"stddev_ts\": %.6f\n", r.stdev_ts());
+        printf("  }");
+        break;
+    }
+    fflush(stdout);
+}
+
+static void print_footer(const bench_params &p) {
+    if (p.output == OUTPUT_JSON)
+        printf("\n]\n");
+    else if (p.output == OUTPUT_MD)
+        printf("\nbuild: llamafile v%s\n", LLAMAFILE_VERSION_STRING);
+}
+
+static void llama_null_log_callback(enum ggml_log_level level, const char *text, void *user_data) {
+    (void)level;
+    (void)text;
+    (void)user_data;
+}
+
+int main(int argc, char **argv) {
+
+    if (llamafile_has(argv, "--version")) {
+        puts("llamafile-bench v" LLAMAFILE_VERSION_STRING);
+        return 0;
+    }
+
+    if (llamafile_has(argv, "-h") || //
+        llamafile_has(argv, "-help") || //
+        llamafile_has(argv, "--help")) {
+        llamafile_help("/zip/llama.cpp/llama-bench/llama-bench.1.asc");
+        __builtin_unreachable();
+    }
+
+    llamafile_check_cpu();
+
+    bench_params params = parse_args(argc, argv);
+
+    if (!params.verbose)
+        llama_log_set(llama_null_log_callback, NULL);
+
+    // settle the gpu story once, using the most layers anyone asked for,
+    // since llamafile_gpu_layers() turns the gpu off for zero layers
+    int ngl_max = *std::max_element(params.n_gpu_layers.begin(), params.n_gpu_layers.end());
+    int ngl_default = llamafile_gpu_layers(ngl_max);
+    for (int &ngl : params.n_gpu_layers) {
+        if (ngl == ngl_max)
+            ngl = ngl_default;
+        if (FLAG_gpu == LLAMAFILE_GPU_DISABLE)
+            ngl = 0;
+        else if (ngl == INT_MAX)
+            ngl = 9999;
+        else if (ngl != LLAMAFILE_GPU_LAYERS_AUTO)
+            ngl = std::max(ngl, 0);
+    }
+
+    // -ngl auto has to leave room for the biggest test
+    int n_ctx_max = std::max(*std::max_element(params.n_prompt.begin(), params.n_prompt.end()),
+                             *std::max_element(params.n_gen.begin(), params.n_gen.end()));
+    int n_ubatch_max = *std::max_element(params.n_ubatch.begin(), params.n_ubatch.end());
+
+    llama_backend_init();
+
+    print_header(params);
+
+    llama_model *model = nullptr;
+    std::string model_path;
+    int model_ngl = 0;
+    bool first = true;
+
+    for (const bench_test &t : get_tests(params)) {
+        if (!model || model_path != t.model || model_ngl != t.n_gpu_layers) {
+            if (model)
+                llama_free_model(model);
+            llama_model_params mparams = llama_model_default_params();
+            mparams.n_gpu_layers = t.n_gpu_layers;
+            mparams.n_ctx_fit = n_ctx_max;
+            mparams.n_ubatch_fit = n_ubatch_max;
+            if (!(model = llama_load_model_from_file(t.model.c_str(), mparams))) {
+                fprintf(stderr, "%s: error: failed to load model '%s'\n", argv[0], t.model.c_str());
+                return 1;
+            }
+            model_path = t.model;
+            model_ngl = t.n_gpu_layers;
+        }
+
+        llama_context_params cparams = llama_context_default_params();
+        cparams.n_ctx = t.n_prompt + t.n_gen;
+        cparams.n_batch = t.n_batch;
+        cparams.n_ubatch = t.n_ubatch;
+        cparams.type_k = t.type_k;
+        cparams.type_v = t.type_v;
+        cparams.flash_attn = t.flash_attn;
+        cparams.n_threads = t.n_threads;
+        cparams.n_threads_batch = t.n_threads;
+
+        llama_context *ctx;
+        if (!(ctx = llama_new_context_with_model(model, cparams))) {
+            fprintf(stderr, "%s: error: failed to create context for %s\n", argv[0],
+                    t.model.c_str());
+            return 1;
+        }
+
+        bench_result r;
+        r.test = t;
+        char buf[128];
+        llama_model_desc(model, buf, sizeof(buf));
+        r.model_desc = buf;
+        r.model_size = llama_model_size(model);
+        r.model_n_params = llama_model_n_params(model);
+
+        // warm up caches and lazily initialized gpu state
+        if (t.n_prompt)
+            test_prompt(ctx, std::min(t.n_batch, std::min(t.n_prompt, 32)), t.n_batch);
+        if (t.n_gen)
+            test_gen(ctx, 1);
+
+        for (int i = 0; i < params.reps; ++i) {
+            llama_kv_cache_clear(ctx);
+            auto t0 = std::chrono::steady_clock::now();
+            bool ok = t.n_prompt ? test_prompt(ctx, t.n_prompt, t.n_batch) : test_gen(ctx, t.n_gen);
+            auto t1 = std::chrono::steady_clock::now();
+            if (!ok) {
+                fprintf(stderr, "%s: error: failed to decode\n", argv[0]);
+                return 1;
+            }
+            double secs = std::chrono::duration<double>(t1 - t0).count();
+            r.samples_ts.push_back((t.n_prompt + t.n_gen) / secs);
+        }
+
+        print_result(params, r, first);
+        first = false;
+
+        llama_free(ctx);
+    }
+
+    print_footer(params);
+
+    if (model)
+        llama_free_model(model);
+    llama_backend_free();
+    return 0;
+}
@@ -3,6 +3,12 @@
 #define LLAMA_API_INTERNAL
 #include "llamafile/log.h"
 #include "llamafile/debug.h"
+#include "llamafile/sgemm.h"
+#include "llamafile/perfctr.h"
+#include "llamafile/energy.h"
+#include "llamafile/trace.h"
+#include "llamafile/flight.h"
+#include "llamafile/version.h"
 #include "llama.h"
 
 #include "unicode.h"
@@ -24,10 +30,12 @@
 #include <algorithm>
 #include <future>
 #include <array>
+#include <atomic>
 #include <cassert>
 #include <cinttypes>
 #include <climits>
 #include <cmath>
+#include <condition_variable>
 #include <cosmo.h>
 #include <cstdarg>
 #include <cstddef>
@@ -40,6 +48,7 @@
 #include <fstream>
 #include <functional>
 #include <initializer_list>
+#include <list>
 #include <map>
 #include <memory>
 #include <mutex>
@@ -50,17 +59,22 @@
 #include <set>
 #include <sstream>
 #include <thread>
+#include <tuple>
 #include <type_traits>
 #include <unordered_map>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/mman.h>
 #include <sys/resource.h>
+#include <sys/stat.h>
+#include <third_party/zlib/zlib.h>
 
 #define LLAMA_ATTRIBUTE_FORMAT(...) __attribute__((__format__(__gnu_printf__, __VA_ARGS__)))
 
 #define LLAMA_MAX_NODES   8192
 #define LLAMA_MAX_EXPERTS 60
+#define LLAMA_MAX_SEQ_CHECKPOINTS 16
+#define LLAMA_MAX_SEQ     256
 
 //
 // logging
@@ -119,9 +133,11 @@ static bool is_float_close(float a, float b, float abs_tol) {
 }
 
 static void zeros(std::ofstream & file, size_t n) {
-    char zero = 0;
-    for (size_t i = 0; i < n; ++i) {
-        file.write(&zero, 1);
+    static const char zero[4096] = {};
+    while (n) {
+        const size_t k = std::min(n, sizeof(zero));
+        file.write(zero, k);
+        n -= k;
     }
 }
 
@@ -251,6 +267,7 @@ enum llm_kv {
     LLM_KV_ATTENTION_LAYERNORM_EPS,
     LLM_KV_ATTENTION_LAYERNORM_RMS_EPS,
     LLM_KV_ATTENTION_CAUSAL,
+    LLM_KV_ATTENTION_SLIDING_WINDOW,
 
     LLM_KV_ROPE_DIMENSION_COUNT,
     LLM_KV_ROPE_FREQ_BASE,
@@ -328,6 +345,7 @@ static const std::map<llm_kv, const char *> LLM_KV_NAMES = {
     { LLM_KV_ATTENTION_LAYERNORM_EPS,       "%s.attention.layer_norm_epsilon"     },
     { LLM_KV_ATTENTION_LAYERNORM_RMS_EPS,   "%s.attention.layer_norm_rms_epsilon" },
     { LLM_KV_ATTENTION_CAUSAL,              "%s.attention.causal"                 },
+    { LLM_KV_ATTENTION_SLIDING_WINDOW,      "%s.attention.sliding_window"         },
 
     { LLM_KV_ROPE_DIMENSION_COUNT,          "%s.rope.dimension_count"                 },
     { LLM_KV_ROPE_FREQ_BASE,                "%s.rope.freq_base"                       },
@@ -414,6 +432,9 @@ enum llm_tensor {
     LLM_TENSOR_FFN_DOWN_SHEXP,
     LLM_TENSOR_FFN_GATE_SHEXP,
     LLM_TENSOR_FFN_UP_SHEXP,
+    LLM_TENSOR_FFN_PRED_A,    // activation predictor
+    LLM_TENSOR_FFN_PRED_B,
+    LLM_TENSOR_FFN_DOWN_T,    // ffn_down transposed, for sparse activations
     LLM_TENSOR_ATTN_Q_NORM,
     LLM_TENSOR_ATTN_K_NORM,
     LLM_TENSOR_LAYER_OUT_NORM,
@@ -451,6 +472,9 @@ static const std::map<llm_arch, std::map<llm_tensor, std::string>> LLM_TENSOR_NA
             { LLM_TENSOR_FFN_GATE_EXPS,   "blk.%d.ffn_gate_exps" },
             { LLM_TENSOR_FFN_DOWN_EXPS,   "blk.%d.ffn_down_exps" },
             { LLM_TENSOR_FFN_UP_EXPS,     "blk.%d.ffn_up_exps" },
+            { LLM_TENSOR_FFN_PRED_A,      "blk.%d.ffn_pred_a" },
+            { LLM_TENSOR_FFN_PRED_B,      "blk.%d.ffn_pred_b" },
+            { LLM_TENSOR_FFN_DOWN_T,      "blk.%d.ffn_down_t" },
         },
     },
     {
@@ -1178,6 +1202,17 @@ struct llama_file {
         }
     }
 
+    // unlike read_raw() this is safe to call from several threads
+    void read_at(void * ptr, size_t len, size_t offset) const {
+        long rc = llamafile_pread(file, ptr, len, offset);
+        if (rc == -1) {
+            throw std::runtime_error(format("read error: %s", strerror(errno)));
+        }
+        if (len && !rc) {
+            throw std::runtime_error("unexpectedly reached end of file");
+        }
+    }
+
     uint32_t read_u32() const {
         uint32_t ret;
         read_raw(&ret, sizeof(ret));
@@ -1205,6 +1240,27 @@ struct llama_file {
 };
 using llama_files = std::vector<std::unique_ptr<llama_file>>;
 
+// hashes what identifies the weights in a file, in order to name memory
+// that's shared by processes which load the same model (--share-weights)
+static uint64_t llama_file_identity(uint64_t h, const llama_file * file) {
+    auto mix = [&h](const void * p, size_t n) {
+        for (size_t i = 0; i < n; ++i) {
+            h = (h ^ ((const uint8_t *) p)[i]) * 0x100000001b3;
+        }
+    };
+    std::string name = llamafile_name(file->file);
+    std::string path = name.substr(0, name.find('@'));
+    struct stat st = {};
+    stat(path.c_str(), &st);
+    size_t size = llamafile_size(file->file);
+    mix(name.c_str(), name.size() + 1);
+    mix(&size, sizeof(size));
+    mix(&st.st_dev, sizeof(st.st_dev));
+    mix(&st.st_ino, sizeof(st.st_ino));
+    mix(&st.st_mtim, sizeof(st.st_mtim));
+    return h;
+}
+
 struct llama_mmap {
     void * addr;
     size_t size;
@@ -1217,15 +1273,127 @@ struct llama_mmap {
     // list of mapped fragments (first_offset, last_offset)
     std::vector<std::pair<size_t, size_t>> mapped_fragments;
 
-    llama_mmap(struct llama_file * file, size_t prefetch = (size_t) -1 /* -1 = max value */, bool numa = false) {
+    // size of the anonymous copy made by --hugepages, which we must unmap
+    size_t copy_size = 0;
+
+    // whether that copy is shared with other processes (--share-weights)
+    bool copy_shared = false;
+
+    // whether that copy was read into large pages on windows
+    bool copy_windows = false;
+
+    // whether --stream-weights may page these weights in and out, which
+    // are then mapped from a file, or inflated on the heap if not droppable
+    bool streamed = false;
+    bool droppable = false;
+
+    // puts the --hugepages copy in memory shared with other processes
+    // which load the same file, so it's only read and paid for once
+    bool share_hugepages(struct llama_file * file) {
+        bool created;
+        std::string name = format("llamafile-%016" PRIx64 "-weights", llama_file_identity(0xcbf29ce484222325, file));
+        void * p = llamafile_shm_attach(name.c_str(), size, &created);
+        if (!p) {
+            LLAMA_LOG_WARN("warning: --share-weights failed to attach /dev/shm/%s: %s\n", name.c_str(), strerror(errno));
+            return false;
+        }
+        if (created) {
+            const size_t chunk = 64 * 1024 * 1024;
+            for (size_t i = 0; i < size; i += chunk) {
+                if (llamafile_pread(file->file, (char *) p + i, std::min(chunk, size - i), i) <= 0) {
+                    LLAMA_LOG_WARN("warning: --share-weights failed to read weights: %s\n", strerror(errno));
+                    llamafile_shm_detach(p);
+                    return false;
+                }
+            }
+            llamafile_shm_publish(p);
+        }
+        addr = p;
+        copy_shared = true;
+        is_owned = true;
+        mapped_fragments.emplace_back(0, size);
+        return true;
+    }
+
+    // copies weights into memory that's backed by 2mb pages, so a big
+    // model needs thousands of tlb entries rather than millions
+    bool copy_to_hugepages(struct llama_file * file) {
+        if (FLAG_share_weights && share_hugepages(file)) {
+            return true;
+        }
+        const size_t huge = 2 * 1024 * 1024;
+        size_t n = GGML_PAD(size, huge);
+        // hugetlbfs pages are guaranteed if the admin reserved some
+        void * p = mmap(NULL, n, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        size_t mapped = n;
+        if (p == MAP_FAILED) {
+            // otherwise ask for transparent huge pages, which must be aligned
+            p = mmap(NULL, n + huge, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED) {
+                LLAMA_LOG_WARN("warning: --hugepages failed to allocate %zu bytes: %s\n", n, strerror(errno));
+                return false;
+            }
+            uintptr_t lo = (uintptr_t) p;
+            uintptr_t hi = GGML_PAD(lo, huge);
+            if (hi > lo) {
+                munmap(p, hi - lo);
+            }
+            if (huge - (hi - lo)) {
+                munmap((char *) hi + n, huge - (hi - lo));
+            }
+            p = (void *) hi;
+            if (madvise(p, n, MADV_HUGEPAGE)) {
+                LLAMA_LOG_WARN("warning: madvise(.., MADV_HUGEPAGE) failed: %s\n", strerror(errno));
+            }
+        }
+        const size_t chunk = 64 * 1024 * 1024;
+        for (size_t i = 0; i < size; i += chunk) {
+            if (llamafile_pread(file->file, (char *) p + i, std::min(chunk, size - i), i) <= 0) {
+                LLAMA_LOG_WARN("warning: --hugepages failed to read weights: %s\n", strerror(errno));
+                munmap(p, mapped);
+                return false;
+            }
+        }
+        mprotect(p, n, PROT_READ);
+        addr = p;
+        copy_size = mapped;
+        is_owned = true;
+        mapped_fragments.emplace_back(0, size);
+        return true;
+    }
+
+    // with lazy, pages are read when first used, or by a background thread
+    llama_mmap(struct llama_file * file, size_t prefetch = (size_t) -1 /* -1 = max value */, bool numa = false, bool lazy = false) {
         size = llamafile_size(file->file);
+        if (FLAG_hugepages && IsLinux() && copy_to_hugepages(file)) {
+            return;
+        }
+        if (FLAG_hugepages && IsWindows() && (addr = llamafile_win_load(file->file, &copy_size))) {
+            copy_windows = true;
+            is_owned = true;
+            mapped_fragments.emplace_back(0, size);
+            return;
+        }
         if (!llamafile_fp(file->file)) {
-            // file is an uncompressed zip asset
-            // therefore it's already mapped
+            // file is a zip asset, which is already mapped,
+            // or was inflated into memory if it's compressed
             is_owned = false;
             addr = llamafile_content(file->file);
+            if (FLAG_stream_weights && !numa) {
+                streamed = true;
+                return;
+            }
             if (!llamafile_has_gpu()) {
-                llamafile_schlep(addr, size);
+                if (lazy) {
+                    llamafile_warmup(addr, size);
+                } else {
+                    if (IsWindows()) {
+                        // the mapping wasn't populated, so let windows read
+                        // it in before we fault the pages one at a time
+                        llamafile_prefetch(addr, size);
+                    }
+                    llamafile_schlep(addr, size);
+                }
             }
             return;
         }
@@ -1239,17 +1407,18 @@ struct llama_mmap {
         }
         // prefetch/readahead impairs performance on NUMA systems
         if (numa) { prefetch = 0; }
+        // streaming reads layers in as they're about to be used
+        streamed = droppable = FLAG_stream_weights && !numa;
+        if (streamed) { prefetch = 0; }
         addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
         if (addr == MAP_FAILED) {
             throw std::runtime_error(format("mmap failed: %s", strerror(errno)));
         }
 
         if (prefetch > 0) {
-            // Advise the kernel to preload the mapped memory
-            if ((err = posix_madvise(addr, std::min(size, prefetch), POSIX_MADV_WILLNEED))) {
-                fprintf(stderr, "warning: posix_madvise(.., POSIX_MADV_WILLNEED) failed: %s\n",
-                        strerror(err));
-            }
+            // Advise the kernel to preload the mapped memory, which takes
+            // PrefetchVirtualMemory() on windows
+            llamafile_prefetch(addr, std::min(size, prefetch));
         }
         if (numa) {
             // advise the kernel not to use readahead
@@ -1262,8 +1431,12 @@ struct llama_mmap {
 
         // report terminal progress of loading weights off the disk into
         // the cpu. if we're using gpu inference, then don't even bother
-        if (!llamafile_has_gpu()) {
-            llamafile_schlep(addr, size);
+        if (!llamafile_has_gpu() && !streamed) {
+            if (lazy) {
+                llamafile_warmup(addr, size);
+            } else {
+                llamafile_schlep(addr, size);
+            }
         }
 
         // initialize list of mapped_fragments
@@ -1334,6 +1507,18 @@ struct llama_mmap {
     }
 
     ~llama_mmap() {
+        if (copy_shared) {
+            llamafile_shm_detach(addr);
+            return;
+        }
+        if (copy_windows) {
+            llamafile_win_free(addr);
+            return;
+        }
+        if (copy_size) {
+            munmap(addr, copy_size);
+            return;
+        }
 #if 0
         // TODO(jart): make this safe
         for (const auto & frag : mapped_fragments) {
@@ -1533,7 +1718,11 @@ static size_t llama_get_device_count() {
 static size_t llama_get_device_memory(int device) {
     size_t total = 0;
     size_t free = 0;
-    ggml_backend_cuda_get_device_memory(device, &total, &free);
+    if (llamafile_has_metal()) {
+        ggml_backend_metal_get_device_memory(&free, &total);
+    } else {
+        ggml_backend_cuda_get_device_memory(device, &free, &total);
+    }
     if (!free) free = 1;
     return free;
 // #if defined(GGML_USE_CUBLAS)
@@ -1630,6 +1819,7 @@ struct llama_hparams {
     uint32_t n_expert = 0;
     uint32_t n_expert_used = 0;
     uint32_t n_vocab_type = 0; // for BERT-style token types
+    uint32_t n_swa = 0; // sliding window attention, how many positions back a token sees, 0 if all
 
     float f_norm_eps;
     float f_norm_rms_eps;
@@ -1669,6 +1859,7 @@ struct llama_hparams {
         if (this->n_ff          != other.n_ff)          return true;
         if (this->n_expert      != other.n_expert)      return true;
         if (this->n_expert_used != other.n_expert_used) return true;
+        if (this->n_swa         != other.n_swa)         return true;
 
         if (this->rope_finetuned  != other.rope_finetuned)  return true;
         if (this->n_yarn_orig_ctx != other.n_yarn_orig_ctx) return true;
@@ -1735,11 +1926,18 @@ struct llama_cparams {
     float yarn_beta_fast;
     float yarn_beta_slow;
     float defrag_thold;
+    float defrag_max_ms;
+    uint32_t n_seq_checkpoint;
+    uint32_t n_cpu_decode;
+
+    int32_t logits_top_k; // see llama_set_logits_top_k()
+    int32_t n_layer_exit; // see llama_set_n_layer_exit()
 
     bool embeddings;
     bool causal_attn;
     bool offload_kqv;
     bool flash_attn;
+    bool swa_evict;
 
     enum llama_pooling_type pooling_type;
 
@@ -1785,12 +1983,25 @@ struct llama_layer {
     struct ggml_tensor * ffn_down; // w2
     struct ggml_tensor * ffn_up;   // w3
 
+    // ff activation sparsity, which is predicted by a low rank mlp,
+    // and ffn_down transposed so that its inactive rows can be skipped
+    struct ggml_tensor * ffn_pred_a;
+    struct ggml_tensor * ffn_pred_b;
+    struct ggml_tensor * ffn_down_t;
+
     // ff MoE
     struct ggml_tensor * ffn_gate_inp;
     struct ggml_tensor * ffn_gate_exps;
     struct ggml_tensor * ffn_down_exps;
     struct ggml_tensor * ffn_up_exps ;
 
+    // copies of the hot experts in vram, packed in the order of their ids,
+    // when ffn_*_exps are kept in host memory for the others
+    struct ggml_tensor * ffn_gate_exps_gpu;
+    struct ggml_tensor * ffn_down_exps_gpu;
+    struct ggml_tensor * ffn_up_exps_gpu;
+    uint32_t             ffn_exps_gpu_mask[GGML_MAX_MASKED_EXPERTS/32];
+
     // ff shared expert (shexp)
     struct ggml_tensor * ffn_gate_inp_shexp;
     struct ggml_tensor * ffn_gate_shexp;
@@ -1818,15 +2029,88 @@ struct llama_layer {
     struct ggml_tensor * ssm_dt_b;
 };
 
+// the sequences a kv cell belongs to, as a bitset rather than a tree, so
+// a cell is a few words with no heap allocations, and asking whether it
+// belongs to a sequence is a bit test. ids outside [0, LLAMA_MAX_SEQ) are
+// never stored, which contexts, llama_decode() and the kv cache functions
+// make sure of, so the cells and seq_cells always agree.
+struct llama_seq_set {
+    uint64_t bits[LLAMA_MAX_SEQ / 64] = {};
+
+    struct iterator {
+        const llama_seq_set * set;
+        int id;
+
+        llama_seq_id operator*() const { return id; }
+        bool operator!=(const iterator & other) const { return id != other.id; }
+        iterator & operator++() { id = set->next(id + 1); return *this; }
+    };
+
+    // returns first id >= id in the set, or LLAMA_MAX_SEQ if there's none
+    int next(int id) const {
+        for (int w = id / 64; w < LLAMA_MAX_SEQ / 64; ++w, id = w * 64) {
+            const uint64_t x = bits[w] & (~0ull << (id % 64));
+            if (x) {
+                return w * 64 + __builtin_ctzll(x);
+            }
+        }
+        return LLAMA_MAX_SEQ;
+    }
+
+    iterator begin() const { return {this, next(0)}; }
+    iterator end() const { return {this, LLAMA_MAX_SEQ}; }
+
+    size_t count(llama_seq_id id) const {
+        return 0 <= id && id < LLAMA_MAX_SEQ && (bits[id / 64] >> (id % 64) & 1);
+    }
+
+    void insert(llama_seq_id id) {
+        if (0 <= id && id < LLAMA_MAX_SEQ) {
+            bits[id / 64] |= 1ull << (id % 64);
+        }
+    }
+
+    void erase(llama_seq_id id) {
+        if (0 <= id && id < LLAMA_MAX_SEQ) {
+            bits[id / 64] &= ~(1ull << (id % 64));
+        }
+    }
+
+    void clear() {
+        memset(bits, 0, sizeof(bits));
+    }
+
+    bool empty() const {
+        for (uint64_t w : bits) {
+            if (w) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    size_t size() const {
+        size_t n = 0;
+        for (uint64_t w : bits) {
+            n += __builtin_popcountll(w);
+        }
+        return n;
+    }
+
+    bool operator==(const llama_seq_set & other) const {
+        return !memcmp(bits, other.bits, sizeof(bits));
+    }
+};
+
 struct llama_kv_cell {
     llama_pos pos   = -1;
     llama_pos delta = 0;
     int32_t   src   = 0; // used by recurrent state models to copy states
 
-    std::set<llama_seq_id> seq_id;
+    llama_seq_set seq_id;
 
     bool has_seq_id(const llama_seq_id & id) const {
-        return seq_id.find(id) != seq_id.end();
+        return seq_id.count(id);
     }
 
     bool is_empty() const {
@@ -1838,10 +2122,39 @@ struct llama_kv_cell {
     }
 };
 
+// cells are handed out in fixed size blocks. each sequence appends to
+// a block of its own, so the cells of a finished sequence come back as
+// whole blocks rather than as holes between the cells of other ones.
+struct llama_kv_block {
+    uint32_t     used  = 0;  // cells with pos >= 0
+    llama_seq_id owner = -1; // sequence that appends to this block
+};
+
+// batch tokens [i_token, i_token + n) went to cells [cell, cell + n)
+struct llama_kv_run {
+    uint32_t i_token;
+    uint32_t cell;
+    uint32_t n;
+};
+
 // ring-buffer of cached KV data
+// the state of a sequence of a recurrent model after position pos, which
+// holds the rows of its cell in every k_l and v_l tensor one after another
+struct llama_kv_checkpoint {
+    llama_pos pos = -1;
+    std::vector<uint8_t> data;
+};
+
 struct llama_kv_cache {
     bool has_shift = false;
+
+    // the range of cells with a delta, which are all the K-shift rotates
+    uint32_t shift_begin = 0;
+    uint32_t shift_end   = 0;
     bool do_defrag = false;
+
+    // measured cost of moving a cell during defrag, 0 if unknown
+    float defrag_us_per_cell = 0.0f;
     bool do_copy   = false;
     bool recurrent = false; // with recurrent state models, a cell can hold the state for more than one past token
     bool v_trans   = true;  // the value tensor is transposed
@@ -1861,6 +2174,23 @@ struct llama_kv_cache {
 
     std::vector<llama_kv_cell> cells;
 
+    // block allocator, unused by recurrent models
+    static constexpr uint32_t block_size = 32;
+    std::vector<llama_kv_block> blocks;
+    std::set<uint32_t> free_blocks; // blocks without cells in use
+    std::unordered_map<llama_seq_id, uint32_t> tails; // last cell given to each sequence
+
+    // indexes that spare us from scanning every cell, unused by recurrent models
+    std::vector<uint64_t> used_mask; // bit i is set if cell i is in use
+    std::unordered_map<llama_seq_id, std::set<uint32_t>> seq_cells; // cells of each sequence
+
+    // states to roll each sequence back to, oldest first, recurrent models only
+    std::vector<std::vector<llama_kv_checkpoint>> checkpoints;
+
+    // where the tokens of the last batch were stored. the graph writes
+    // each run separately when there's more than one of them
+    std::vector<llama_kv_run> runs;
+
     std::vector<struct ggml_tensor *> k_l; // per layer
     std::vector<struct ggml_tensor *> v_l;
 
@@ -1910,6 +2240,114 @@ struct llama_control_vector {
     }
 };
 
+// the logit biases and control vectors of individual sequences, kept on
+// the backend in tables with a row for each sequence that has any. they
+// are allocated once, so a sequence changing its own only uploads a row.
+// row 0 is for the tokens of every other sequence: it holds the logit
+// bias of every sequence and no control vector. the bias rows of the
+// others are that plus their own
+
+struct llama_steering {
+    struct ggml_tensor * bias = nullptr;       // F32 [n_vocab, n_rows]
+    std::vector<struct ggml_tensor *> cvec;    // F32 [n_embd, n_rows] per layer
+    std::vector<struct ggml_context *> ctxs;
+    std::vector<ggml_backend_buffer_t> bufs;
+
+    int32_t n_rows = 0;
+    std::map<llama_seq_id, int32_t> rows;      // the row of each sequence that has one
+    std::vector<int32_t> free_rows;
+
+    std::map<llama_seq_id, std::vector<std::pair<llama_token, float>>> logit_bias; // -1 is every sequence
+    std::set<llama_seq_id> cvec_seqs;          // the sequences with a control vector
+
+    int32_t row_of(llama_seq_id seq_id) const {
+        auto it = rows.find(seq_id);
+        return it == rows.end() ? 0 : it->second;
+    }
+
+    ~llama_steering() {
+        for (struct ggml_context * ctx : ctxs) {
+            ggml_free(ctx);
+        }
+        for (ggml_backend_buffer_t buf : bufs) {
+            ggml_backend_buffer_free(buf);
+        }
+    }
+};
+
+// a LoRA adapter that's evaluated alongside the weights, as W x + s B (A x),
+// rather than merged into them. A is kept transposed, so that both of its
+// products are ordinary matmuls
+
+struct llama_lora_weight {
+    struct ggml_tensor * a = nullptr; // [n_in, r]
+    struct ggml_tensor * b = nullptr; // [r, n_out]
+};
+
+struct llama_lora_adapter {
+    const struct llama_model * model = nullptr;
+    float alpha_r = 1.0f; // alpha / r
+
+    std::unordered_map<const struct ggml_tensor *, llama_lora_weight> weights; // by base weight
+    std::vector<struct ggml_context *> ctxs;
+    std::vector<ggml_backend_buffer_t> bufs;
+
+    const llama_lora_weight * weight_for(const struct ggml_tensor * w) const {
+        auto it = weights.find(w);
+        return it == weights.end() ? nullptr : &it->second;
+    }
+
+    ~llama_lora_adapter() {
+        for (struct ggml_context * ctx : ctxs) {
+            ggml_free(ctx);
+        }
+        for (ggml_backend_buffer_t buf : bufs) {
+            ggml_backend_buffer_free(buf);
+        }
+    }
+};
+
+// words the bpe tokenizer already split, which are most of them in any
+// text, so they needn't be merged again, least recently used is evicted
+
+#define LLAMA_BPE_CACHE_SIZE 16384
+#define LLAMA_BPE_CACHE_MAX_WORD 128
+
+struct llama_bpe_cache {
+    using entry = std::pair<std::string, std::vector<llama_token>>;
+
+    std::mutex lock;
+    std::list<entry> lru; // most recently used last
+    std::unordered_map<std::string, std::list<entry>::iterator> index;
+
+    bool get(const std::string & word, std::vector<llama_token> & output) {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = index.find(word);
+        if (it == index.end()) {
+            return false;
+        }
+        lru.splice(lru.end(), lru, it->second);
+        output.insert(output.end(), it->second->second.begin(), it->second->second.end());
+        return true;
+    }
+
+    void put(const std::string & word, const llama_token * ids, size_t n_ids) {
+        if (word.size() > LLAMA_BPE_CACHE_MAX_WORD) {
+            return;
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        if (index.count(word)) {
+            return;
+        }
+        if (lru.size() == LLAMA_BPE_CACHE_SIZE) {
+            index.erase(lru.front().first);
+            lru.pop_front();
+        }
+        lru.emplace_back(word, std::vector<llama_token>(ids, ids + n_ids));
+        index.emplace(word, std::prev(lru.end()));
+    }
+};
+
 struct llama_vocab {
     using id    = int32_t;
     using token = std::string;
@@ -1927,9 +2365,23 @@ struct llama_vocab {
     std::unordered_map<token, id> token_to_id;
     std::vector<token_data>       id_to_token;
 
+    // token ids keyed by their text in an open addressed table, so pieces
+    // of the input can be looked up without copying them into strings
+    std::vector<id> text_slots;
+    size_t          max_token_len = 0;
+
     std::unordered_map<token, id> special_tokens_cache;
 
-    std::map<std::pair<std::string, std::string>, int> bpe_ranks;
+    // bpe merges keyed by the ids of the tokens they join, in an open addressed table
+    struct bpe_merge {
+        uint64_t key; // left << 32 | right, or UINT64_MAX if empty
+        int32_t  rank;
+        id       result;
+    };
+    std::vector<bpe_merge> bpe_merges;
+    uint32_t n_merges = 0;
+
+    mutable llama_bpe_cache bpe_cache;
 
     // default LLaMA special tokens
     id special_bos_id  = 1;
@@ -1950,22 +2402,131 @@ struct llama_vocab {
     id special_eot_id    = -1; // TODO: move above after "eos_id", and here add "file separator" token
 
     bool add_space_prefix = true;
+    bool spm_splittable   = false; // no token has a ▁ that follows other text
+
+    // pieces of every token rendered once at load time, without and with special tokens
+    struct piece {
+        uint32_t offset;
+        uint32_t length;
+        llama_piece_utf8 utf8;
+    };
+    std::vector<char>  piece_data;
+    std::vector<piece> pieces[2];
+
+    // code points of pieces that grammars can match, i.e. text that isn't eog, kept 0 terminated
+    std::vector<bool>               cp_text;
+    std::vector<uint32_t>           cp_offsets;
+    std::vector<llama_partial_utf8> cp_partials;
+    std::vector<uint32_t>           cp_data;
+
+    // text tokens sorted by code points, with the number each shares with the one before it,
+    // which is a trie of the vocabulary walked depth first
+    std::vector<llama_token>        cp_order;
+    std::vector<uint32_t>           cp_shared;
 
-    int find_bpe_rank(const std::string & token_left, const std::string & token_right) const {
-        GGML_ASSERT(token_left.find(' ') == std::string::npos);
-        GGML_ASSERT(token_left.find('\n') == std::string::npos);
-        GGML_ASSERT(token_right.find(' ') == std::string::npos);
-        GGML_ASSERT(token_right.find('\n') == std::string::npos);
+    static size_t text_hash(const char * text, size_t n) {
+        return std::hash<std::string_view>()(std::string_view(text, n));
+    }
 
-        auto it = bpe_ranks.find(std::make_pair(token_left, token_right));
-        if (it == bpe_ranks.end()) {
+    // returns the token whose text is the n bytes at text, or -1
+    id find_token(const char * text, size_t n) const {
+        if (n > max_token_len || text_slots.empty()) {
             return -1;
         }
+        const size_t mask = text_slots.size() - 1;
+        for (size_t i = text_hash(text, n) & mask;; i = (i + 1) & mask) {
+            const id tok = text_slots[i];
+            if (tok < 0) {
+                return -1;
+            }
+            const token & t = id_to_token[tok].text;
+            if (t.size() == n && !memcmp(t.data(), text, n)) {
+                return tok;
+            }
+        }
+    }
+
+    void add_text_slot(id tok) {
+        const token & t = id_to_token[tok].text;
+        const size_t mask = text_slots.size() - 1;
+        size_t i = text_hash(t.data(), t.size()) & mask;
+        while (text_slots[i] >= 0) {
+            i = (i + 1) & mask;
+        }
+        text_slots[i] = tok;
+        max_token_len = std::max(max_token_len, t.size());
+    }
+
+    static size_t bpe_merge_hash(uint64_t key) {
+        return (key * 0x9e3779b97f4a7c15ull) >> 32;
+    }
+
+    const bpe_merge * find_bpe_merge(id left, id right) const {
+        if (left < 0 || right < 0 || bpe_merges.empty()) {
+            return nullptr;
+        }
+        const uint64_t key = (uint64_t) left << 32 | (uint32_t) right;
+        const size_t mask = bpe_merges.size() - 1;
+        for (size_t i = bpe_merge_hash(key) & mask;; i = (i + 1) & mask) {
+            if (bpe_merges[i].key == key) {
+                return &bpe_merges[i];
+            }
+            if (bpe_merges[i].key == UINT64_MAX) {
+                return nullptr;
+            }
+        }
+    }
 
-        return it->second;
+    // the first rank of a pair wins, like the map this used to be
+    void add_bpe_merge(id left, id right, int32_t rank, id result) {
+        const uint64_t key = (uint64_t) left << 32 | (uint32_t) right;
+        const size_t mask = bpe_merges.size() - 1;
+        size_t i = bpe_merge_hash(key) & mask;
+        for (; bpe_merges[i].key != UINT64_MAX; i = (i + 1) & mask) {
+            if (bpe_merges[i].key == key) {
+                return;
+            }
+        }
+        bpe_merges[i] = { key, rank, result };
+        ++n_merges;
     }
 };
 
+// expert stats files have a line for each layer, listing how many times
+// each of its experts was picked
+
+static std::vector<uint64_t> llama_load_expert_stats(const std::string & fname, uint32_t n_layer, uint32_t n_expert) {
+    std::ifstream fin(fname);
+    if (!fin) {
+        return {};
+    }
+    std::vector<uint64_t> counts(n_layer*n_expert);
+    std::string line;
+    for (uint32_t il = 0; il < n_layer && std::getline(fin, line); ++il) {
+        std::istringstream words(line);
+        for (uint32_t x = 0; x < n_expert && words >> counts[il*n_expert + x]; ++x) {
+        }
+    }
+    if (fin.bad()) {
+        LLAMA_LOG_WARN("%s: failed to read %s\n", __func__, fname.c_str());
+        return {};
+    }
+    return counts;
+}
+
+static void llama_save_expert_stats(const std::string & fname, uint32_t n_layer, uint32_t n_expert, const std::vector<uint64_t> & counts) {
+    std::ofstream fout(fname);
+    for (uint32_t il = 0; il < n_layer; ++il) {
+        for (uint32_t x = 0; x < n_expert; ++x) {
+            fout << (x ? " " : "") << counts[il*n_expert + x];
+        }
+        fout << "\n";
+    }
+    if (!fout) {
+        LLAMA_LOG_WARN("%s: failed to write %s\n", __func__, fname.c_str());
+    }
+}
+
 struct llama_model {
     e_model     type  = MODEL_UNKNOWN;
     llm_arch    arch  = LLM_ARCH_UNKNOWN;
@@ -2023,13 +2584,45 @@ struct llama_model {
     llama_mlocks mlock_bufs;
     llama_mlocks mlock_mmaps;
 
+    // weights were interleaved by llamafile_repack()
+    bool repacked = false;
+
+    // memory holding them if it's shared with other processes
+    void * repack_shm = nullptr;
+
     // for quantize-stats only
     std::vector<std::pair<std::string, struct ggml_tensor *>> tensors_by_name;
 
+    // spans of mapped memory holding the weights of each layer, which
+    // --stream-weights pages in ahead of use and lets go of afterwards
+    struct stream_span {
+        uintptr_t lo;
+        uintptr_t hi;
+        int       il;
+        bool      droppable;
+    };
+    std::vector<std::vector<stream_span>> stream_layers;
+    std::vector<stream_span> stream_index; // every span, sorted by address
+
+    // how often each layer picked each expert [n_layer][n_expert], which is
+    // saved to expert_stats for choosing the experts to keep in vram
+    std::string expert_stats;
+    mutable std::vector<uint64_t> expert_counts;
+    mutable std::mutex expert_counts_lock;
+
     int64_t t_load_us = 0;
     int64_t t_start_us = 0;
 
     ~llama_model() {
+        if (!expert_stats.empty() && !expert_counts.empty()) {
+            llama_save_expert_stats(expert_stats, hparams.n_layer, hparams.n_expert, expert_counts);
+        }
+        if (repacked) {
+            for (const auto & it : tensors_by_name) {
+                llamafile_unrepack(it.second->data);
+            }
+            llamafile_shm_detach(repack_shm);
+        }
         for (struct ggml_context * ctx : ctxs) {
             ggml_free(ctx);
         }
@@ -2044,9 +2637,43 @@ struct llama_model {
     }
 };
 
+// the last decode graph, which is computed again as long as the next
+// batch has the same shape. only the cells it writes to have to change.
+struct llama_graph_cache {
+    struct ggml_cgraph * gf = nullptr; // lives in buf_compute_meta
+
+    uint32_t n_tokens  = 0;
+    uint32_t n_kv      = 0;
+    int32_t  n_outputs = 0;
+    uint32_t kv_head   = 0;
+    bool     embd      = false;
+    bool     steer_bias = false;
+    bool     steer_cvec = false;
+    uint32_t n_shortlist = 0;
+
+    std::vector<llama_lora_adapter *> lora;
+};
+
 struct llama_context {
     llama_context(const llama_model & model) : model(model), t_start_us(model.t_start_us), t_load_us(model.t_load_us) {}
     ~llama_context() {
+        if (decode_thread.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(decode_mutex);
+                decode_quit = true;
+            }
+            decode_cv.notify_all();
+            decode_thread.join();
+        }
+        if (stream_thread.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(stream_mutex);
+                stream_quit = true;
+            }
+            stream_cv.notify_all();
+            stream_thread.join();
+        }
+
         ggml_backend_sched_free(sched);
 
         for (ggml_backend_t backend : backends) {
@@ -2071,18 +2698,40 @@ struct llama_context {
 
     std::mt19937 rng;
 
+    // batch being decoded by llama_decode_async()
+    std::thread             decode_thread;
+    std::mutex              decode_mutex;
+    std::condition_variable decode_cv;
+    llama_batch             decode_batch   = {};
+    std::atomic<bool>       decode_pending = false; // until llama_decode_wait()
+    bool                    decode_done    = false;
+    bool                    decode_quit    = false;
+    int32_t                 decode_ret     = 0;
+
+    // layer whose weights are being used, for llama_stream_worker()
+    std::thread             stream_thread;
+    std::mutex              stream_mutex;
+    std::condition_variable stream_cv;
+    int                     stream_layer = -1;
+    int                     stream_seen  = -1; // only used by the compute thread
+    bool                    stream_quit  = false;
+
     bool has_evaluated_once = false;
 
     int64_t t_start_us;
     int64_t t_load_us;
-    int64_t t_sample_us = 0;
+    std::atomic<int64_t> t_sample_us{0}; // threads may sample different sequences at once
     int64_t t_p_eval_us = 0;
     int64_t t_eval_us   = 0;
 
     int64_t t_compute_start_us = 0;
     int64_t n_queued_tokens = 0;
 
-    int32_t n_sample = 0; // number of tokens sampled
+    double j_compute_start = -1; // llamafile_energy() when the evals began
+    double j_p_eval = 0;
+    double j_eval   = 0;
+
+    std::atomic<int32_t> n_sample{0}; // number of tokens sampled
     int32_t n_p_eval = 0; // number of tokens in eval calls for the prompt (with batch size > 1)
     int32_t n_eval   = 0; // number of eval calls
 
@@ -2099,6 +2748,12 @@ struct llama_context {
 
     bool logits_all = false;
 
+    // the k most likely tokens of each output (2-dimensional arrays: [n_outputs][n_top_k])
+    // populated instead of logits when llama_set_logits_top_k() is used
+    int32_t n_top_k = 0;
+    std::vector<llama_token> top_k_ids;
+    std::vector<float>       top_k_logits;
+
     // embeddings output (2-dimensional array: [n_outputs][n_embd])
     // populated only when pooling_type == LLAMA_POOLING_TYPE_NONE
     size_t  embd_size = 0; // capacity (of floats) for embeddings
@@ -2112,10 +2767,16 @@ struct llama_context {
     std::vector<uint8_t> buf_compute_meta;
     ggml_backend_sched_t sched = nullptr;
 
+    llama_graph_cache graph_cache;
+
     ggml_abort_callback abort_callback      = nullptr;
     void *              abort_callback_data = nullptr;
 
     // input tensors
+    // output tensors
+    struct ggml_tensor * t_top_k_ids    = nullptr; // I32 [n_top_k, n_outputs]
+    struct ggml_tensor * t_top_k_logits = nullptr; // F32 [1, n_top_k, n_outputs]
+
     struct ggml_tensor * inp_tokens;    // I32 [n_batch]
     struct ggml_tensor * inp_embd;      // F32 [n_embd, n_batch]
     struct ggml_tensor * inp_pos;       // I32 [n_batch]
@@ -2129,9 +2790,32 @@ struct llama_context {
     struct ggml_tensor * inp_s_mask;    // F32 [1, n_kv]
     struct ggml_tensor * inp_s_seq;     // I32 [n_kv, n_batch]
 
+    // scratch for filling inp_KQ_mask
+    std::vector<llama_seq_id> kq_mask_seqs; // sequences of the ubatch
+    std::vector<llama_pos>    kq_mask_pos;  // [n_kv] cell positions each of them sees
+
     // control vectors
     struct llama_control_vector cvec;
 
+    // runtime lora adapters and their scales, by sequence, where -1 is every sequence
+    std::map<llama_seq_id, std::vector<std::pair<llama_lora_adapter *, float>>> lora_seq;
+    std::vector<llama_lora_adapter *> lora_batch;       // the adapters used by the ubatch
+    std::vector<struct ggml_tensor *> inp_lora_scale;   // F32 [1, n_batch] of each of them
+    std::vector<struct ggml_tensor *> lora_scale_out;   // their rows for the outputs
+
+    // logit biases and control vectors of individual sequences
+    struct llama_steering steering;
+    bool steer_bias = false;                            // the ubatch has outputs to bias
+    bool steer_cvec = false;                            // the ubatch has tokens to steer
+    struct ggml_tensor * inp_steer_rows = nullptr;      // I32 [n_batch] steering row of each token
+    struct ggml_tensor * inp_steer_out  = nullptr;      // I32 [n_outputs] those of the outputs
+
+    // the tokens llama_set_output_shortlist() restricts the logits to
+    std::vector<llama_token> shortlist;
+    std::vector<float>       shortlist_logits;          // [n_outputs][n_shortlist] before they're spread out
+    bool shortlist_batch = false;                       // the ubatch only computes the logits of the shortlist
+    struct ggml_tensor * inp_shortlist = nullptr;       // I32 [n_shortlist]
+
 #ifdef GGML_USE_MPI
     ggml_mpi_context * ctx_mpi = NULL;
 #endif
@@ -2141,23 +2825,139 @@ struct llama_context {
 // kv cache helpers
 //
 
-static bool llama_kv_cache_init(
-             struct llama_kv_cache & cache,
-               const llama_context * ctx,
-                         ggml_type   type_k,
-                         ggml_type   type_v,
-                          uint32_t   kv_size,
-                              bool   offload) {
-    const llama_model & model = ctx->model;
-    const llama_cparams & cparams = ctx->cparams;
-
-    const struct llama_hparams & hparams = model.hparams;
+// recomputes the block allocator state and the indexes from the cells
+static void llama_kv_cache_index_rebuild(struct llama_kv_cache & cache) {
+    cache.blocks.clear();
+    cache.free_blocks.clear();
+    cache.tails.clear();
+    cache.used_mask.clear();
+    cache.seq_cells.clear();
+    if (cache.recurrent) {
+        return;
+    }
+    const uint32_t n_blocks = (cache.size + cache.block_size - 1) / cache.block_size;
+    cache.blocks.resize(n_blocks);
+    cache.used_mask.resize((cache.size + 63) / 64);
+    for (uint32_t i = 0; i < cache.size; ++i) {
+        if (cache.cells[i].pos >= 0) {
+            cache.blocks[i / cache.block_size].used++;
+            cache.used_mask[i / 64] |= 1ull << (i % 64);
+            for (llama_seq_id seq_id : cache.cells[i].seq_id) {
+                cache.seq_cells[seq_id].insert(i);
+            }
+        }
+    }
+    // the bits past the end look used so runs of free cells stop there
+    if (cache.size % 64) {
+        cache.used_mask.back() |= ~0ull << (cache.size % 64);
+    }
+    for (uint32_t b = 0; b < n_blocks; ++b) {
+        if (!cache.blocks[b].used) {
+            cache.free_blocks.insert(b);
+        }
+    }
+}
 
-    const uint32_t n_embd_k_gqa = hparams.n_embd_k_gqa() + hparams.n_embd_k_s();
-    const uint32_t n_embd_v_gqa = hparams.n_embd_v_gqa() + hparams.n_embd_v_s();
-    const int64_t  n_layer      = hparams.n_layer;
+// must be called when a cell's pos goes from -1 to something else
+static void llama_kv_cache_cell_take(struct llama_kv_cache & cache, uint32_t i) {
+    if (cache.blocks.empty()) {
+        return;
+    }
+    cache.used_mask[i / 64] |= 1ull << (i % 64);
+    const uint32_t b = i / cache.block_size;
+    if (cache.blocks[b].used++ == 0) {
+        cache.free_blocks.erase(b);
+    }
+}
 
-    cache.has_shift = false;
+// must be called when a cell's pos is set back to -1
+static void llama_kv_cache_cell_release(struct llama_kv_cache & cache, uint32_t i) {
+    if (cache.blocks.empty()) {
+        return;
+    }
+    cache.used_mask[i / 64] &= ~(1ull << (i % 64));
+    const uint32_t b = i / cache.block_size;
+    GGML_ASSERT(cache.blocks[b].used > 0);
+    if (--cache.blocks[b].used == 0) {
+        cache.blocks[b].owner = -1;
+        cache.free_blocks.insert(b);
+    }
+}
+
+// adds seq_id to a cell that's in use
+static void llama_kv_cache_cell_seq_add(struct llama_kv_cache & cache, uint32_t i, llama_seq_id seq_id) {
+    cache.cells[i].seq_id.insert(seq_id);
+    cache.seq_cells[seq_id].insert(i);
+}
+
+// empties a cell that's in use, whatever sequences it belonged to
+static void llama_kv_cache_cell_free(struct llama_kv_cache & cache, uint32_t i) {
+    for (llama_seq_id seq_id : cache.cells[i].seq_id) {
+        auto it = cache.seq_cells.find(seq_id);
+        it->second.erase(i);
+        if (it->second.empty()) {
+            cache.seq_cells.erase(it);
+        }
+    }
+    cache.cells[i].seq_id.clear();
+    cache.cells[i].pos = -1;
+    cache.used--;
+    llama_kv_cache_cell_release(cache, i);
+}
+
+// returns the first cell in use at or after i, or cache.size
+static uint32_t llama_kv_cache_next_used(const struct llama_kv_cache & cache, uint32_t i) {
+    while (i < cache.size) {
+        const uint64_t w = cache.used_mask[i / 64] >> (i % 64);
+        if (w) {
+            i += __builtin_ctzll(w);
+            break;
+        }
+        i += 64 - i % 64;
+    }
+    return std::min(i, cache.size);
+}
+
+// returns the first cell of n free cells in a row at or after i, or
+// cache.size if there's no such run before the end of the cache
+static uint32_t llama_kv_cache_find_free(const struct llama_kv_cache & cache, uint32_t i, uint32_t n) {
+    uint32_t run = 0;
+    while (i < cache.size) {
+        const uint64_t w = cache.used_mask[i / 64] >> (i % 64);
+        if (w & 1) {
+            // skip the cells in use
+            const uint64_t f = ~w;
+            i += f ? __builtin_ctzll(f) : 64;
+            run = 0;
+        } else {
+            const uint32_t k = w ? __builtin_ctzll(w) : 64 - i % 64;
+            i   += k;
+            run += k;
+            if (run >= n) {
+                return i - run;
+            }
+        }
+    }
+    return cache.size;
+}
+
+static bool llama_kv_cache_init(
+             struct llama_kv_cache & cache,
+               const llama_context * ctx,
+                         ggml_type   type_k,
+                         ggml_type   type_v,
+                          uint32_t   kv_size,
+                              bool   offload) {
+    const llama_model & model = ctx->model;
+    const llama_cparams & cparams = ctx->cparams;
+
+    const struct llama_hparams & hparams = model.hparams;
+
+    const uint32_t n_embd_k_gqa = hparams.n_embd_k_gqa() + hparams.n_embd_k_s();
+    const uint32_t n_embd_v_gqa = hparams.n_embd_v_gqa() + hparams.n_embd_v_s();
+    const int64_t  n_layer      = hparams.n_layer;
+
+    cache.has_shift = false;
 
     // TODO: find a nicer way to add other recurrent model architectures
     cache.recurrent = model.arch == LLM_ARCH_MAMBA;
@@ -2185,8 +2985,12 @@ static bool llama_kv_cache_init(
         for (uint32_t i = 0; i < cache.size; ++i) {
             cache.cells[i].src = i;
         }
+        cache.checkpoints.clear();
+        cache.checkpoints.resize(kv_size);
     }
 
+    llama_kv_cache_index_rebuild(cache);
+
 #ifdef GGML_USE_CLBLAST
     offload = false;
 #endif
@@ -2243,19 +3047,65 @@ static bool llama_kv_cache_init(
         }
         ggml_backend_buffer_clear(buf, 0);
         LLAMA_LOG_INFO("%s: %10s KV buffer size = %8.2f MiB\n", __func__, ggml_backend_buffer_name(buf), ggml_backend_buffer_get_size(buf)/1024.0/1024.0);
+        // the whole cache is read for every token, so it's as hot as the
+        // weights, which got the fastest memory first
+        if (ggml_backend_buffer_is_host(buf) &&
+            ggml_numa_tier_place(ggml_backend_buffer_get_base(buf), ggml_backend_buffer_get_size(buf))) {
+            LLAMA_LOG_INFO("%s: moved KV buffer to the fastest memory tier with room\n", __func__);
+        }
         cache.bufs.push_back(buf);
     }
 
     return true;
 }
 
-// find an empty slot of size "n_tokens" in the cache
-// updates the cache head
-// Note: On success, it's important that cache.head points
-// to the first cell of the slot.
+// picks the cell where the next token of seq_id should go
+static uint32_t llama_kv_cache_next_cell(struct llama_kv_cache & cache, llama_seq_id seq_id) {
+    const uint32_t bs = cache.block_size;
+
+    // keep appending to the block this sequence is filling
+    auto it = cache.tails.find(seq_id);
+    if (it != cache.tails.end()) {
+        const uint32_t b = it->second / bs;
+        if (cache.blocks[b].owner == seq_id) {
+            uint32_t c = it->second + 1;
+            // reuse cells that were given back at the end of the block
+            while (c > b*bs && cache.cells[c - 1].pos < 0) {
+                --c;
+            }
+            if (c < std::min((b + 1)*bs, cache.size) && cache.cells[c].pos < 0) {
+                return c;
+            }
+        }
+    }
+
+    // start a new block, lowest first, to keep kv_self.n small
+    if (!cache.free_blocks.empty()) {
+        const uint32_t b = *cache.free_blocks.begin();
+        cache.blocks[b].owner = seq_id;
+        return b*bs;
+    }
+
+    // every block has cells in use, so take any free cell
+    uint32_t c = llama_kv_cache_find_free(cache, cache.head, 1);
+    if (c == cache.size) {
+        c = llama_kv_cache_find_free(cache, 0, 1);
+    }
+    if (c == cache.size) {
+        return UINT32_MAX;
+    }
+    cache.head = c;
+    return c;
+}
+
+// find an empty slot for the tokens in the batch
+// updates the cache head and runs
+// Note: On success, if contiguous is true, it's important that
+// cache.head points to the first cell of the slot.
 static bool llama_kv_cache_find_slot(
            struct llama_kv_cache & cache,
-        const struct llama_batch & batch) {
+        const struct llama_batch & batch,
+                            bool   contiguous = false) {
     const uint32_t n_ctx    = cache.size;
     const uint32_t n_tokens = batch.n_tokens;
 
@@ -2312,43 +3162,58 @@ static bool llama_kv_cache_find_slot(
         return false;
     }
 
-    uint32_t n_tested = 0;
+    cache.runs.clear();
 
-    while (true) {
-        if (cache.head + n_tokens > n_ctx) {
-            n_tested += n_ctx - cache.head;
-            cache.head = 0;
-            continue;
+    if (!contiguous) {
+        if (cache.used + n_tokens > n_ctx) {
+            return false;
         }
 
-        bool found = true;
         for (uint32_t i = 0; i < n_tokens; i++) {
-            if (cache.cells[cache.head + i].pos >= 0) {
-                found = false;
-                cache.head += i + 1;
-                n_tested   += i + 1;
-                break;
+            const llama_seq_id seq_id = batch.n_seq_id[i] > 0 ? batch.seq_id[i][0] : 0;
+            const uint32_t c = llama_kv_cache_next_cell(cache, seq_id);
+            GGML_ASSERT(c != UINT32_MAX);
+
+            cache.cells[c].pos = batch.pos[i];
+            llama_kv_cache_cell_take(cache, c);
+            for (int32_t j = 0; j < batch.n_seq_id[i]; j++) {
+                llama_kv_cache_cell_seq_add(cache, c, batch.seq_id[i][j]);
             }
-        }
+            cache.tails[seq_id] = c;
 
-        if (found) {
-            break;
+            if (!cache.runs.empty() && cache.runs.back().cell + cache.runs.back().n == c) {
+                cache.runs.back().n++;
+            } else {
+                cache.runs.push_back({i, c, 1});
+            }
         }
 
-        if (n_tested >= n_ctx) {
-            //LLAMA_LOG_ERROR("%s: failed to find a slot for %d tokens\n", __func__, n_tokens);
-            return false;
-        }
+        cache.head = cache.runs.front().cell;
+        cache.used += n_tokens;
+
+        return true;
+    }
+
+    uint32_t head = llama_kv_cache_find_free(cache, cache.head, n_tokens);
+    if (head == n_ctx) {
+        head = llama_kv_cache_find_free(cache, 0, n_tokens);
     }
+    if (head == n_ctx) {
+        //LLAMA_LOG_ERROR("%s: failed to find a slot for %d tokens\n", __func__, n_tokens);
+        return false;
+    }
+    cache.head = head;
 
     for (uint32_t i = 0; i < n_tokens; i++) {
         cache.cells[cache.head + i].pos = batch.pos[i];
+        llama_kv_cache_cell_take(cache, cache.head + i);
 
         for (int32_t j = 0; j < batch.n_seq_id[i]; j++) {
-            cache.cells[cache.head + i].seq_id.insert(batch.seq_id[i][j]);
+            llama_kv_cache_cell_seq_add(cache, cache.head + i, batch.seq_id[i][j]);
         }
     }
 
+    cache.runs.push_back({0, cache.head, n_tokens});
     cache.used += n_tokens;
 
     return true;
@@ -2356,6 +3221,19 @@ static bool llama_kv_cache_find_slot(
 
 // find how many cells are currently in use
 static uint32_t llama_kv_cache_cell_max(const struct llama_kv_cache & cache) {
+    if (!cache.recurrent) {
+        for (size_t w = cache.used_mask.size(); w > 0; --w) {
+            uint64_t bits = cache.used_mask[w - 1];
+            if (w == cache.used_mask.size() && cache.size % 64) {
+                bits &= ~(~0ull << (cache.size % 64));
+            }
+            if (bits) {
+                return (w - 1)*64 + 64 - __builtin_clzll(bits);
+            }
+        }
+        return 0;
+    }
+
     for (uint32_t i = cache.size; i > 0; --i) {
         const llama_kv_cell & cell = cache.cells[i - 1];
 
@@ -2374,12 +3252,119 @@ static void llama_kv_cache_clear(struct llama_kv_cache & cache) {
     }
     cache.head = 0;
     cache.used = 0;
+    llama_kv_cache_index_rebuild(cache);
+    for (auto & ckpts : cache.checkpoints) {
+        ckpts.clear();
+    }
 
     for (auto & buf : cache.bufs) {
         ggml_backend_buffer_clear(buf, 0);
     }
 }
 
+static bool llama_kv_cache_seq_rm(
+        struct llama_kv_cache & cache,
+                 llama_seq_id   seq_id,
+                    llama_pos   p0,
+                    llama_pos   p1);
+
+// saves the state of a sequence of a recurrent model, so it can be rolled
+// back to the tokens it has seen so far. when there are too many, every
+// other old one is dropped, which keeps recent ones close together and
+// older ones further apart
+static void llama_kv_cache_seq_checkpoint(struct llama_kv_cache & cache, llama_seq_id seq_id) {
+    if (!cache.recurrent || seq_id < 0 || (uint32_t) seq_id >= cache.size) {
+        return;
+    }
+    const llama_kv_cell & cell = cache.cells[seq_id];
+    auto & ckpts = cache.checkpoints[seq_id];
+    if (cell.pos < 0 || !cell.has_seq_id(seq_id) || (!ckpts.empty() && ckpts.back().pos == cell.pos)) {
+        return;
+    }
+
+    size_t size = 0;
+    for (size_t il = 0; il < cache.k_l.size(); ++il) {
+        size += ggml_nbytes(cache.k_l[il])/cache.size + ggml_nbytes(cache.v_l[il])/cache.size;
+    }
+
+    // a pending copy hasn't moved the state into its own cell yet
+    const size_t src = cell.src;
+
+    llama_kv_checkpoint ckpt;
+    ckpt.pos = cell.pos;
+    ckpt.data.resize(size);
+    size_t offs = 0;
+    for (size_t il = 0; il < cache.k_l.size(); ++il) {
+        for (ggml_tensor * t : { cache.k_l[il], cache.v_l[il] }) {
+            const size_t row_size = ggml_nbytes(t)/cache.size;
+            ggml_backend_tensor_get(t, ckpt.data.data() + offs, src*row_size, row_size);
+            offs += row_size;
+        }
+    }
+    ckpts.push_back(std::move(ckpt));
+
+    if (ckpts.size() > LLAMA_MAX_SEQ_CHECKPOINTS) {
+        std::vector<llama_kv_checkpoint> kept;
+        for (size_t i = 0; i < ckpts.size(); ++i) {
+            if (i % 2 == 0 || i + 1 == ckpts.size()) {
+                kept.push_back(std::move(ckpts[i]));
+            }
+        }
+        ckpts.swap(kept);
+    }
+}
+
+// removes the positions >= p0 of a sequence and returns the last position
+// that's left, or -1 if none is. recurrent models go back to their newest
+// checkpoint before p0, so the tokens after the position returned have to
+// be decoded again
+static llama_pos llama_kv_cache_seq_rewind(struct llama_kv_cache & cache, llama_seq_id seq_id, llama_pos p0) {
+    if (p0 < 0) p0 = 0;
+
+    if (!cache.recurrent) {
+        llama_kv_cache_seq_rm(cache, seq_id, p0, -1);
+        llama_pos p_max = -1;
+        auto it = cache.seq_cells.find(seq_id);
+        if (it != cache.seq_cells.end()) {
+            for (uint32_t i : it->second) {
+                p_max = std::max(p_max, cache.cells[i].pos);
+            }
+        }
+        return p_max;
+    }
+
+    if (seq_id < 0 || (uint32_t) seq_id >= cache.size) {
+        return -1;
+    }
+    llama_kv_cell & cell = cache.cells[seq_id];
+    auto & ckpts = cache.checkpoints[seq_id];
+    while (!ckpts.empty() && ckpts.back().pos >= p0) {
+        ckpts.pop_back();
+    }
+    if (cell.pos < p0) {
+        return cell.pos;
+    }
+    if (ckpts.empty()) {
+        llama_kv_cache_seq_rm(cache, seq_id, -1, -1);
+        return -1;
+    }
+
+    const llama_kv_checkpoint & ckpt = ckpts.back();
+    size_t offs = 0;
+    for (size_t il = 0; il < cache.k_l.size(); ++il) {
+        for (ggml_tensor * t : { cache.k_l[il], cache.v_l[il] }) {
+            const size_t row_size = ggml_nbytes(t)/cache.size;
+            ggml_backend_tensor_set(t, ckpt.data.data() + offs, seq_id*row_size, row_size);
+            offs += row_size;
+        }
+    }
+    cell.src = seq_id;
+    cell.pos = ckpt.pos;
+    cell.seq_id.insert(seq_id);
+
+    return cell.pos;
+}
+
 static bool llama_kv_cache_seq_rm(
         struct llama_kv_cache & cache,
                  llama_seq_id   seq_id,
@@ -2397,9 +3382,18 @@ static bool llama_kv_cache_seq_rm(
             return false;
         }
         if (0 <= seq_id) {
-            // partial intersection is invalid
+            // partial intersection is invalid, unless a checkpoint ends right before p0
             if ((0 < p0 && p0 <= cache.cells[seq_id].pos) || (0 < p1 && p1 <= cache.cells[seq_id].pos)) {
-                return false;
+                if (p1 <= cache.cells[seq_id].pos) {
+                    return false;
+                }
+                const auto & ckpts = cache.checkpoints[seq_id];
+                const auto it = std::find_if(ckpts.begin(), ckpts.end(),
+                        [p0](const llama_kv_checkpoint & ckpt) { return ckpt.pos == p0 - 1; });
+                if (it == ckpts.end()) {
+                    return false;
+                }
+                return llama_kv_cache_seq_rewind(cache, seq_id, p0) == p0 - 1;
             }
         } else {
             // seq_id is negative, then the range should include everything or nothing
@@ -2409,6 +3403,47 @@ static bool llama_kv_cache_seq_rm(
         }
     }
 
+    if (!cache.recurrent) {
+        if (seq_id >= LLAMA_MAX_SEQ) {
+            return false;
+        }
+        if (seq_id >= 0) {
+            auto it = cache.seq_cells.find(seq_id);
+            if (it == cache.seq_cells.end()) {
+                return true;
+            }
+            std::set<uint32_t> & cells = it->second;
+            for (auto c = cells.begin(); c != cells.end();) {
+                const uint32_t i = *c;
+                if (cache.cells[i].pos < p0 || cache.cells[i].pos >= p1) {
+                    ++c;
+                    continue;
+                }
+                c = cells.erase(c);
+                cache.cells[i].seq_id.erase(seq_id);
+                if (cache.cells[i].is_empty()) {
+                    llama_kv_cache_cell_free(cache, i);
+                    new_head = std::min(new_head, i);
+                }
+            }
+            if (cells.empty()) {
+                cache.seq_cells.erase(it);
+            }
+        } else {
+            for (uint32_t i = llama_kv_cache_next_used(cache, 0); i < cache.size; i = llama_kv_cache_next_used(cache, i + 1)) {
+                if (cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
+                    llama_kv_cache_cell_free(cache, i);
+                    new_head = std::min(new_head, i);
+                }
+            }
+        }
+
+        // If we freed up a slot, set head to it so searching can start there.
+        if (new_head != cache.size && new_head < cache.head) cache.head = new_head;
+
+        return true;
+    }
+
     for (uint32_t i = 0; i < cache.size; ++i) {
         if (cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
             if (seq_id < 0) {
@@ -2420,9 +3455,13 @@ static bool llama_kv_cache_seq_rm(
             }
             if (cache.cells[i].is_empty()) {
                 // keep count of the number of used cells
-                if (cache.cells[i].pos >= 0) cache.used--;
+                if (cache.cells[i].pos >= 0) {
+                    cache.used--;
+                    llama_kv_cache_cell_release(cache, i);
+                }
 
                 cache.cells[i].pos = -1;
+                cache.checkpoints[i].clear();
                 if (new_head == cache.size) new_head = i;
             }
         }
@@ -2461,28 +3500,74 @@ static void llama_kv_cache_seq_cp(
             cache.do_copy = true;
 
             cache.cells[seq_id_dst].pos = cache.cells[seq_id_src].pos;
+            cache.checkpoints[seq_id_dst] = cache.checkpoints[seq_id_src];
         }
         return;
     }
     // otherwise, this is the KV cache of a Transformer-like model
 
+    if (seq_id_src < 0 || seq_id_src >= LLAMA_MAX_SEQ || seq_id_dst < 0 || seq_id_dst >= LLAMA_MAX_SEQ) {
+        LLAMA_LOG_ERROR("%s: seq_id must be in [0, %d)\n", __func__, LLAMA_MAX_SEQ);
+        return;
+    }
+
     cache.head = 0;
 
-    for (uint32_t i = 0; i < cache.size; ++i) {
-        if (cache.cells[i].has_seq_id(seq_id_src) && cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
+    auto it = cache.seq_cells.find(seq_id_src);
+    if (it == cache.seq_cells.end() || seq_id_src == seq_id_dst) {
+        return;
+    }
+    std::set<uint32_t> & dst = cache.seq_cells[seq_id_dst];
+    it = cache.seq_cells.find(seq_id_src); // in case the insertion above rehashed
+    for (uint32_t i : it->second) {
+        if (cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
             cache.cells[i].seq_id.insert(seq_id_dst);
+            dst.insert(i);
         }
     }
+    if (dst.empty()) {
+        cache.seq_cells.erase(seq_id_dst);
+    }
 }
 
 static void llama_kv_cache_seq_keep(struct llama_kv_cache & cache, llama_seq_id seq_id) {
     uint32_t new_head = cache.size;
 
+    if (!cache.recurrent) {
+        std::set<uint32_t> keep;
+        auto it = cache.seq_cells.find(seq_id);
+        if (it != cache.seq_cells.end()) {
+            keep.swap(it->second);
+        }
+        cache.seq_cells.clear();
+        for (uint32_t i = llama_kv_cache_next_used(cache, 0); i < cache.size; i = llama_kv_cache_next_used(cache, i + 1)) {
+            cache.cells[i].seq_id.clear();
+            if (keep.count(i)) {
+                cache.cells[i].seq_id.insert(seq_id);
+            } else {
+                llama_kv_cache_cell_free(cache, i);
+                new_head = std::min(new_head, i);
+            }
+        }
+        if (!keep.empty()) {
+            cache.seq_cells[seq_id].swap(keep);
+        }
+
+        // If we freed up a slot, set head to it so searching can start there.
+        if (new_head != cache.size && new_head < cache.head) cache.head = new_head;
+
+        return;
+    }
+
     for (uint32_t i = 0; i < cache.size; ++i) {
         if (!cache.cells[i].has_seq_id(seq_id)) {
-            if (cache.cells[i].pos >= 0) cache.used--;
+            if (cache.cells[i].pos >= 0) {
+                cache.used--;
+                llama_kv_cache_cell_release(cache, i);
+            }
             cache.cells[i].pos = -1;
             cache.cells[i].seq_id.clear();
+            cache.checkpoints[i].clear();
             if (new_head == cache.size) new_head = i;
         } else {
             cache.cells[i].seq_id.clear();
@@ -2511,23 +3596,35 @@ static void llama_kv_cache_seq_add(
             llama_kv_cell & cell = cache.cells[seq_id];
             if (cell.has_seq_id(seq_id) && p0 <= cell.pos && cell.pos < p1) {
                 cell.pos += delta;
+                auto & ckpts = cache.checkpoints[seq_id];
+                for (auto & ckpt : ckpts) {
+                    if (p0 <= ckpt.pos && ckpt.pos < p1) {
+                        ckpt.pos += delta;
+                    }
+                }
+                ckpts.erase(std::remove_if(ckpts.begin(), ckpts.end(),
+                            [](const llama_kv_checkpoint & ckpt) { return ckpt.pos < 0; }), ckpts.end());
             }
         }
         return;
     }
 
-    for (uint32_t i = 0; i < cache.size; ++i) {
-        if (cache.cells[i].has_seq_id(seq_id) && cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
+    auto it = cache.seq_cells.find(seq_id);
+    if (it == cache.seq_cells.end()) {
+        cache.head = 0;
+        return;
+    }
+
+    // copied since freeing a cell removes it from the set
+    const std::vector<uint32_t> cells(it->second.begin(), it->second.end());
+    for (uint32_t i : cells) {
+        if (cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
             cache.has_shift = true;
             cache.cells[i].pos   += delta;
             cache.cells[i].delta += delta;
 
             if (cache.cells[i].pos < 0) {
-                if (!cache.cells[i].is_empty()) {
-                    cache.used--;
-                }
-                cache.cells[i].pos = -1;
-                cache.cells[i].seq_id.clear();
+                llama_kv_cache_cell_free(cache, i);
                 if (new_head == cache.size) {
                     new_head = i;
                 }
@@ -2555,13 +3652,23 @@ static void llama_kv_cache_seq_div(
             llama_kv_cell & cell = cache.cells[seq_id];
             if (cell.has_seq_id(seq_id) && p0 <= cell.pos && cell.pos < p1) {
                 cell.pos /= d;
+                for (auto & ckpt : cache.checkpoints[seq_id]) {
+                    if (p0 <= ckpt.pos && ckpt.pos < p1) {
+                        ckpt.pos /= d;
+                    }
+                }
             }
         }
         return;
     }
 
-    for (uint32_t i = 0; i < cache.size; ++i) {
-        if (cache.cells[i].has_seq_id(seq_id) && cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
+    auto it = cache.seq_cells.find(seq_id);
+    if (it == cache.seq_cells.end()) {
+        return;
+    }
+
+    for (uint32_t i : it->second) {
+        if (cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
             cache.has_shift = true;
 
             {
@@ -2576,6 +3683,16 @@ static void llama_kv_cache_seq_div(
 static llama_pos llama_kv_cache_seq_pos_max(struct llama_kv_cache & cache, llama_seq_id seq_id) {
     llama_pos result = 0;
 
+    if (!cache.recurrent) {
+        auto it = cache.seq_cells.find(seq_id);
+        if (it != cache.seq_cells.end()) {
+            for (uint32_t i : it->second) {
+                result = std::max(result, cache.cells[i].pos);
+            }
+        }
+        return result;
+    }
+
     for (uint32_t i = 0; i < cache.size; ++i) {
         if (cache.cells[i].has_seq_id(seq_id)) {
             result = std::max(result, cache.cells[i].pos);
@@ -2795,6 +3912,159 @@ namespace GGUFMeta {
 
 using llama_buf_map = std::unordered_map<uint32_t, ggml_backend_buffer_t>;
 
+//
+// offloaded weight uploader
+//
+// Tensors that live in device memory are read off disk by a few threads
+// into host staging buffers, while the loading thread copies the filled
+// ones to the device. That keeps several large reads in flight, so the
+// disk runs near full speed, and hides the device copies behind them.
+// The staging buffers are pinned when the backend supports it, so the
+// copies don't have to go through the driver's own bounce buffer.
+//
+
+#define LLAMA_UPLOAD_SLOTS 4
+#define LLAMA_UPLOAD_CHUNK ((size_t) 32 * 1024 * 1024)
+
+struct llama_tensor_uploader {
+    struct chunk {
+        ggml_tensor      * tensor;
+        const llama_file * file;
+        size_t             file_offs;
+        size_t             tensor_offs;
+        size_t             size;
+    };
+
+    std::vector<chunk> chunks;
+
+    std::mutex              mutex;
+    std::condition_variable cond;
+    size_t                  n_claimed  = 0; // chunks handed out to readers
+    size_t                  n_consumed = 0; // chunks copied to the device
+    bool                    aborted    = false;
+    std::vector<int>        status;         // 0 = pending, 1 = read, 2 = invalid, -1 = failed
+    std::exception_ptr      error;
+
+    // splits on row boundaries so each chunk can be validated on its own
+    void add(ggml_tensor * cur, const llama_file * file, size_t offs) {
+        const size_t n_size   = ggml_nbytes(cur);
+        const size_t row_size = ggml_row_size(cur->type, cur->ne[0]);
+        const size_t step     = std::max(LLAMA_UPLOAD_CHUNK / row_size, (size_t) 1) * row_size;
+        for (size_t i = 0; i < n_size; i += step) {
+            chunks.push_back({cur, file, offs + i, i, std::min(step, n_size - i)});
+        }
+    }
+
+    void reader(uint8_t * staging, size_t slot_size, size_t n_slots, bool check_tensors) {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            size_t i = n_claimed;
+            if (aborted || i == chunks.size()) {
+                return;
+            }
+            ++n_claimed;
+            // wait for the device copy that last used this slot
+            cond.wait(lock, [&] { return aborted || i < n_consumed + n_slots; });
+            if (aborted) {
+                return;
+            }
+            lock.unlock();
+            const chunk & c = chunks[i];
+            uint8_t * dst = staging + i % n_slots * slot_size;
+            int rc = 1;
+            try {
+                c.file->read_at(dst, c.size, c.file_offs);
+                if (check_tensors && !ggml_validate_row_data(c.tensor->type, dst, c.size)) {
+                    rc = 2;
+                }
+            } catch (...) {
+                lock.lock();
+                if (!error) {
+                    error = std::current_exception();
+                }
+                lock.unlock();
+                rc = -1;
+            }
+            lock.lock();
+            status[i] = rc;
+            cond.notify_all();
+        }
+    }
+
+    // uploads all chunks, calling progress with the bytes done after each
+    // one, and returns false if it asked to stop
+    bool run(bool check_tensors, const std::function<bool(size_t)> & progress) {
+        if (chunks.empty()) {
+            return true;
+        }
+
+        size_t slot_size = 0;
+        for (const auto & c : chunks) {
+            slot_size = std::max(slot_size, c.size);
+        }
+        slot_size = GGML_PAD(slot_size, 4096);
+        const size_t n_slots = std::min((size_t) LLAMA_UPLOAD_SLOTS, chunks.size());
+
+        ggml_backend_buffer_t buf = ggml_backend_buft_alloc_buffer(llama_default_buffer_type_cpu(true), slot_size * n_slots);
+        if (buf == nullptr) {
+            buf = ggml_backend_buft_alloc_buffer(ggml_backend_cpu_buffer_type(), slot_size * n_slots);
+        }
+        if (buf == nullptr) {
+            throw std::runtime_error("failed to allocate staging buffers for offloaded tensors");
+        }
+        uint8_t * staging = (uint8_t *) ggml_backend_buffer_get_base(buf);
+
+        status.assign(chunks.size(), 0);
+        std::vector<std::thread> readers;
+        for (size_t t = 0; t < n_slots; ++t) {
+            readers.emplace_back([this, staging, slot_size, n_slots, check_tensors] { reader(staging, slot_size, n_slots, check_tensors); });
+        }
+
+        auto stop = [&] {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                aborted = true;
+            }
+            cond.notify_all();
+            for (auto & th : readers) {
+                th.join();
+            }
+            ggml_backend_buffer_free(buf);
+        };
+
+        for (size_t i = 0; i < chunks.size(); ++i) {
+            const chunk & c = chunks[i];
+            int rc;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cond.wait(lock, [&] { return status[i] != 0; });
+                rc = status[i];
+            }
+            if (rc == -1) {
+                stop();
+                std::rethrow_exception(error);
+            }
+            if (rc == 2) {
+                stop();
+                throw std::runtime_error(format("tensor '%s' has invalid data", ggml_get_name(c.tensor)));
+            }
+            ggml_backend_tensor_set(c.tensor, staging + i % n_slots * slot_size, c.tensor_offs, c.size);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                n_consumed = i + 1;
+            }
+            cond.notify_all();
+            if (!progress(c.size)) {
+                stop();
+                return false;
+            }
+        }
+
+        stop();
+        return true;
+    }
+};
+
 struct llama_model_loader {
     int n_kv      = 0;
     int n_tensors = 0;
@@ -2886,8 +4156,10 @@ struct llama_model_loader {
                 throw std::runtime_error(format("illegal split file: %d, model must be loaded with the first split", idx));
             }
 
+            // siblings are named after what was actually opened, so
+            // the shards of a model inside a llamafile are found in it
             char split_prefix[PATH_MAX] = {0};
-            if (!llama_split_prefix(split_prefix, sizeof(split_prefix), fname.c_str(), idx, n_split)) {
+            if (!llama_split_prefix(split_prefix, sizeof(split_prefix), llamafile_name(lf->file), idx, n_split)) {
                 throw std::runtime_error(format("invalid split file: %s", fname.c_str()));
             }
 
@@ -2987,6 +4259,7 @@ struct llama_model_loader {
                 case GGML_TYPE_Q5_0:    ftype = LLAMA_FTYPE_MOSTLY_Q5_0;    break;
                 case GGML_TYPE_Q5_1:    ftype = LLAMA_FTYPE_MOSTLY_Q5_1;    break;
                 case GGML_TYPE_Q8_0:    ftype = LLAMA_FTYPE_MOSTLY_Q8_0;    break;
+                case GGML_TYPE_F8_E4M3: ftype = LLAMA_FTYPE_MOSTLY_F8_E4M3; break;
                 case GGML_TYPE_Q2_K:    ftype = LLAMA_FTYPE_MOSTLY_Q2_K;    break;
                 case GGML_TYPE_Q3_K:    ftype = LLAMA_FTYPE_MOSTLY_Q3_K_M;  break;
                 case GGML_TYPE_Q4_K:    ftype = LLAMA_FTYPE_MOSTLY_Q4_K_M;  break;
@@ -3249,12 +4522,12 @@ struct llama_model_loader {
         }
     }
 
-    void init_mappings(bool prefetch = true, llama_mlocks * mlock_mmaps = nullptr) {
+    void init_mappings(bool prefetch = true, llama_mlocks * mlock_mmaps = nullptr, bool lazy = false) {
         if (use_mmap) {
             mappings.reserve(files.size());
             mmaps_used.reserve(files.size());
             for (const auto & file : files) {
-                std::unique_ptr<llama_mmap> mapping(new llama_mmap(file.get(), prefetch ? -1 : 0, ggml_is_numa()));
+                std::unique_ptr<llama_mmap> mapping(new llama_mmap(file.get(), prefetch ? -1 : 0, ggml_is_numa(), lazy));
                 mmaps_used.emplace_back(mapping->size, 0);
                 if (mlock_mmaps) {
                     std::unique_ptr<llama_mlock> mlock_mmap(new llama_mlock());
@@ -3332,7 +4605,7 @@ struct llama_model_loader {
             void * progress_callback_user_data) {
         GGML_ASSERT(size_data != 0 && "call init_mappings() first");
 
-        std::vector<no_init<uint8_t>> read_buf;
+        llama_tensor_uploader uploader;
         std::vector<std::future<std::pair<ggml_tensor *, bool>>> validation_result;
 
         for (struct ggml_tensor * cur = ggml_get_first_tensor(ctx); cur != NULL; cur = ggml_get_next_tensor(ctx, cur)) {
@@ -3358,13 +4631,18 @@ struct llama_model_loader {
                 }
                 uint8_t * data = (uint8_t *) mapping->addr + weight->offs;
 
+                GGML_ASSERT(buf_mmap || cur->data); // either we have a buffer to allocate the tensor in, or it is already allocated
+                if (!(buf_mmap && cur->data == nullptr) && !ggml_backend_buffer_is_host(cur->buffer)) {
+                    uploader.add(cur, files.at(weight->idx).get(), weight->offs);
+                    continue;
+                }
+
                 if (check_tensors) {
                     validation_result.emplace_back(std::async(std::launch::async, [cur, data, n_size] {
                         return std::make_pair(cur, ggml_validate_row_data(cur->type, data, n_size));
                     }));
                 }
 
-                GGML_ASSERT(buf_mmap || cur->data); // either we have a buffer to allocate the tensor in, or it is already allocated
                 if (buf_mmap && cur->data == nullptr) {
                     ggml_backend_tensor_alloc(buf_mmap, cur, data);
                     if (lmlocks) {
@@ -3390,19 +4668,22 @@ struct llama_model_loader {
                         }));
                     }
                 } else {
-                    read_buf.resize(n_size);
-                    file->seek(weight->offs, SEEK_SET);
-                    file->read_raw(read_buf.data(), n_size);
-                    ggml_backend_tensor_set(cur, read_buf.data(), 0, n_size);
-                    if (check_tensors && !ggml_validate_row_data(cur->type, read_buf.data(), n_size)) {
-                        throw std::runtime_error(format("tensor '%s' has invalid data", ggml_get_name(cur)));
-                    }
+                    uploader.add(cur, file.get(), weight->offs);
+                    continue;
                 }
             }
 
             size_done += n_size;
         }
 
+        bool keep_going = uploader.run(check_tensors, [&](size_t n_size) {
+            size_done += n_size;
+            return !progress_callback || progress_callback((float) size_done / size_data, progress_callback_user_data);
+        });
+        if (!keep_going) {
+            return false;
+        }
+
         // check validation results
         bool validation_failed = false;
         for (auto & future : validation_result) {
@@ -3481,6 +4762,7 @@ static std::string llama_model_ftype_name(llama_ftype ftype) {
         case LLAMA_FTYPE_MOSTLY_Q5_0: return "Q5_0";
         case LLAMA_FTYPE_MOSTLY_Q5_1: return "Q5_1";
         case LLAMA_FTYPE_MOSTLY_Q8_0: return "Q8_0";
+        case LLAMA_FTYPE_MOSTLY_F8_E4M3: return "F8_E4M3";
 
         // K-quants
         case LLAMA_FTYPE_MOSTLY_Q2_K:   return "Q2_K - Medium";
@@ -3650,6 +4932,8 @@ static void llm_load_hparams(
     hparams.n_embd_head_v = (hparams.n_head == 0) ? 0 : hparams.n_embd / hparams.n_head;
     ml.get_key(LLM_KV_ATTENTION_VALUE_LENGTH, hparams.n_embd_head_v, false);
 
+    ml.get_key(LLM_KV_ATTENTION_SLIDING_WINDOW, hparams.n_swa, false);
+
     // arch-specific KVs
     switch (model.arch) {
         case LLM_ARCH_LLAMA:
@@ -4022,6 +5306,8 @@ static std::vector<llama_vocab::id> llama_tokenize_internal(
 );
 static llama_token llama_byte_to_token(const llama_vocab & vocab, uint8_t ch);
 
+static void llama_vocab_build_pieces(llama_vocab & vocab);
+
 static void llm_load_vocab(
         llama_model_loader & ml,
         llama_model & model) {
@@ -4031,6 +5317,8 @@ static void llm_load_vocab(
 
     const auto kv = LLM_KV(model.arch);
 
+    std::vector<std::pair<std::string, std::string>> merges;
+
     // determine vocab type
     {
         std::string tokenizer_model;
@@ -4119,7 +5407,7 @@ static void llm_load_vocab(
                 vocab.type = LLAMA_VOCAB_TYPE_SPM;
                 return;
             }
-            // read bpe merges and populate bpe ranks
+            // read bpe merges, which are indexed once the tokens are loaded
             const int merges_keyidx = gguf_find_key(ctx, kv(LLM_KV_TOKENIZER_MERGES).c_str());
             if (merges_keyidx == -1) {
                 throw std::runtime_error("cannot find tokenizer merges in model file\n");
@@ -4141,7 +5429,7 @@ static void llm_load_vocab(
                     second = word.substr(pos + 1);
                 }
 
-                vocab.bpe_ranks.emplace(std::make_pair(first, second), i);
+                merges.emplace_back(std::move(first), std::move(second));
             }
 
             // default special tokens
@@ -4242,7 +5530,49 @@ static void llm_load_vocab(
     }
     GGML_ASSERT(vocab.id_to_token.size() == vocab.token_to_id.size());
 
-    // determine the newline token: LLaMA "<0x0A>" == 10 == '\n', Falcon 193 == '\n'
+    {
+        size_t n_slots = 1;
+        while (n_slots < n_vocab * 2) {
+            n_slots *= 2;
+        }
+        vocab.text_slots.assign(n_slots, -1);
+        for (uint32_t i = 0; i < n_vocab; i++) {
+            vocab.add_text_slot(i);
+        }
+    }
+
+    // then big inputs may be cut before any ▁ that follows other text
+    if (vocab.type == LLAMA_VOCAB_TYPE_SPM) {
+        static const char k_space[] = "\xE2\x96\x81";
+        vocab.spm_splittable = true;
+        for (const auto & token_data : vocab.id_to_token) {
+            const std::string & text = token_data.text;
+            for (size_t pos = text.find(k_space, 1); pos != std::string::npos; pos = text.find(k_space, pos + 3)) {
+                if (pos < 3 || text.compare(pos - 3, 3, k_space) != 0) {
+                    vocab.spm_splittable = false;
+                }
+            }
+        }
+    }
+
+    // merges whose tokens aren't in the vocab can never apply
+    if (!merges.empty()) {
+        size_t n_slots = 1;
+        while (n_slots < merges.size() * 2) {
+            n_slots *= 2;
+        }
+        vocab.bpe_merges.assign(n_slots, { UINT64_MAX, 0, 0 });
+        for (size_t i = 0; i < merges.size(); i++) {
+            const auto left   = vocab.token_to_id.find(merges[i].first);
+            const auto right  = vocab.token_to_id.find(merges[i].second);
+            const auto result = vocab.token_to_id.find(merges[i].first + merges[i].second);
+            if (left != vocab.token_to_id.end() && right != vocab.token_to_id.end() && result != vocab.token_to_id.end()) {
+                vocab.add_bpe_merge(left->second, right->second, i, result->second);
+            }
+        }
+    }
+
+    // determine the newline token: LLaMA "<0x0A>" == 10 == '\n', Falcon 193 == '\n'
     if (vocab.type == LLAMA_VOCAB_TYPE_SPM) {
         try {
             vocab.linefeed_id = llama_byte_to_token(vocab, '\n');
@@ -4419,6 +5749,8 @@ static void llm_load_vocab(
             );
         }
     }
+
+    llama_vocab_build_pieces(vocab);
 }
 
 static void llm_load_print_meta(llama_model_loader & ml, llama_model & model) {
@@ -4432,13 +5764,14 @@ static void llm_load_print_meta(llama_model_loader & ml, llama_model & model) {
     LLAMA_LOG_INFO("%s: arch             = %s\n",     __func__, LLM_ARCH_NAMES.at(model.arch));
     LLAMA_LOG_INFO("%s: vocab type       = %s\n",     __func__, llama_model_vocab_type_name(vocab.type));
     LLAMA_LOG_INFO("%s: n_vocab          = %u\n",     __func__, hparams.n_vocab);
-    LLAMA_LOG_INFO("%s: n_merges         = %u\n",     __func__, (int) vocab.bpe_ranks.size());
+    LLAMA_LOG_INFO("%s: n_merges         = %u\n",     __func__, (int) vocab.n_merges);
     LLAMA_LOG_INFO("%s: n_ctx_train      = %u\n",     __func__, hparams.n_ctx_train);
     LLAMA_LOG_INFO("%s: n_embd           = %u\n",     __func__, hparams.n_embd);
     LLAMA_LOG_INFO("%s: n_head           = %u\n",     __func__, hparams.n_head);
     LLAMA_LOG_INFO("%s: n_head_kv        = %u\n",     __func__, hparams.n_head_kv);
     LLAMA_LOG_INFO("%s: n_layer          = %u\n",     __func__, hparams.n_layer);
     LLAMA_LOG_INFO("%s: n_rot            = %u\n",     __func__, hparams.n_rot);
+    LLAMA_LOG_INFO("%s: n_swa            = %u\n",     __func__, hparams.n_swa);
     LLAMA_LOG_INFO("%s: n_embd_head_k    = %u\n",     __func__, hparams.n_embd_head_k);
     LLAMA_LOG_INFO("%s: n_embd_head_v    = %u\n",     __func__, hparams.n_embd_head_v);
     LLAMA_LOG_INFO("%s: n_gqa            = %u\n",     __func__, hparams.n_gqa());
@@ -4500,7 +5833,334 @@ static void llm_load_print_meta(llama_model_loader & ml, llama_model & model) {
     if (vocab.special_eot_id    != -1) { LLAMA_LOG_INFO( "%s: EOT token        = %d '%s'\n", __func__, vocab.special_eot_id,    vocab.id_to_token[vocab.special_eot_id].text.c_str() );    }
 }
 
+// finds the weights of each layer that are still in memory mapped by
+// --stream-weights, after they've been offloaded, copied and repacked
+static void llama_model_init_stream(llama_model & model) {
+    const int n_layer = model.hparams.n_layer;
+    const uintptr_t pagesz = sysconf(_SC_PAGESIZE);
+    std::vector<llama_model::stream_span> spans;
+    for (const auto & it : model.tensors_by_name) {
+        int il;
+        ggml_tensor * t = it.second;
+        if (sscanf(it.first.c_str(), "blk.%d.", &il) != 1 || il < 0 || il >= n_layer ||
+            !t->buffer || !ggml_backend_buffer_is_host(t->buffer)) {
+            continue;
+        }
+        const uintptr_t lo = (uintptr_t) t->data;
+        const uintptr_t hi = lo + ggml_nbytes(t);
+        for (const auto & mapping : model.mappings) {
+            const uintptr_t base = (uintptr_t) mapping->addr;
+            if (mapping->streamed && lo >= base && hi <= base + mapping->size) {
+                spans.push_back({lo, hi, il, mapping->droppable});
+                break;
+            }
+        }
+    }
+    if (spans.empty()) {
+        LLAMA_LOG_WARN("%s: --stream-weights found no memory mapped weights to stream\n", __func__);
+        return;
+    }
+    std::sort(spans.begin(), spans.end(), [](const auto & a, const auto & b) { return a.lo < b.lo; });
+    // the tensors of a layer are usually stored next to each other
+    size_t size = 0;
+    for (const auto & s : spans) {
+        auto & index = model.stream_index;
+        if (!index.empty() && index.back().il == s.il && index.back().droppable == s.droppable &&
+            s.lo <= index.back().hi + pagesz) {
+            index.back().hi = std::max(index.back().hi, s.hi);
+        } else {
+            index.push_back(s);
+        }
+        size += s.hi - s.lo;
+    }
+    model.stream_layers.resize(n_layer);
+    for (const auto & s : model.stream_index) {
+        model.stream_layers[s.il].push_back(s);
+    }
+    LLAMA_LOG_INFO("%s: streaming %.2f MiB of weights in %zu spans\n", __func__,
+                   size / 1024.0 / 1024.0, model.stream_index.size());
+}
+
 // Returns false if cancelled by progress_callback
+// describes the weights in buf by how many of their bytes are read per
+// token, which is all of them, except for the token embeddings, which
+// have one row looked up, and the experts, which are read as often as
+// the router picks them, going by the expert stats if there are any
+static std::vector<ggml_numa_span> llama_model_tier_spans(const llama_model & model, ggml_backend_buffer_t buf) {
+    const auto & hparams = model.hparams;
+    const char * base = (const char *) ggml_backend_buffer_get_base(buf);
+
+    std::map<const ggml_tensor *, uint32_t> exps;
+    for (uint32_t il = 0; il < hparams.n_layer; ++il) {
+        const auto & layer = model.layers[il];
+        for (const ggml_tensor * t : { layer.ffn_gate_exps, layer.ffn_down_exps, layer.ffn_up_exps }) {
+            if (t) {
+                exps[t] = il;
+            }
+        }
+    }
+
+    std::vector<ggml_numa_span> spans;
+    for (const auto & it : model.tensors_by_name) {
+        const ggml_tensor * t = it.second;
+        if (t->buffer != buf) {
+            continue;
+        }
+        const size_t offs = (const char *) t->data - base;
+        const size_t size = ggml_nbytes(t);
+        auto e = exps.find(t);
+        if (e != exps.end() && t->ne[2] == (int64_t) hparams.n_expert) {
+            const uint32_t n_expert = hparams.n_expert;
+            const uint64_t * counts = nullptr;
+            uint64_t total = 0;
+            if (!model.expert_counts.empty()) {
+                counts = model.expert_counts.data() + e->second*n_expert;
+                total = std::accumulate(counts, counts + n_expert, (uint64_t) 0);
+            }
+            for (uint32_t x = 0; x < n_expert; ++x) {
+                const double picked = total ? (double) counts[x] / total : 1.0 / n_expert;
+                spans.push_back({ offs + x*t->nb[2], t->nb[2], (float) (t->nb[2] * picked * hparams.n_expert_used) });
+            }
+        } else if (t == model.tok_embd && t != model.output) {
+            spans.push_back({ offs, size, (float) t->nb[1] });
+        } else {
+            spans.push_back({ offs, size, (float) size });
+        }
+    }
+    return spans;
+}
+
+// gives every numa node its own copy of the weights in host memory,
+// if the user asked for --numa mirror, or its own rows of every matrix
+// if the user asked for --numa shard, or puts the weights read most per
+// token in the fastest memory if the user asked for --numa tier
+static void llama_model_mirror_numa(const llama_model & model) {
+    size_t size = 0;
+    size_t size_sharded = 0;
+    size_t size_tiered = 0;
+    for (ggml_backend_buffer_t buf : model.bufs) {
+        if (!ggml_backend_buffer_is_host(buf)) {
+            continue;
+        }
+        void * base = ggml_backend_buffer_get_base(buf);
+        size_t buf_size = ggml_backend_buffer_get_size(buf);
+        if (ggml_numa_mirror(base, buf_size)) {
+            size += buf_size;
+            continue;
+        }
+        std::vector<ggml_tensor *> tensors;
+        for (const auto & it : model.tensors_by_name) {
+            if (it.second->buffer == buf) {
+                tensors.push_back(it.second);
+            }
+        }
+        if (ggml_numa_shard(base, buf_size, tensors.data(), (int) tensors.size())) {
+            size_sharded += buf_size;
+            continue;
+        }
+        std::vector<ggml_numa_span> spans = llama_model_tier_spans(model, buf);
+        if (ggml_numa_tier(base, buf_size, spans.data(), (int) spans.size())) {
+            size_tiered += buf_size;
+        }
+    }
+    if (size) {
+        LLAMA_LOG_INFO("%s: mirrored %.2f MiB of weights to each numa node\n", __func__, size / 1024.0 / 1024.0);
+    }
+    if (size_sharded) {
+        LLAMA_LOG_INFO("%s: split %.2f MiB of weights over the numa nodes\n", __func__, size_sharded / 1024.0 / 1024.0);
+    }
+    if (size_tiered) {
+        LLAMA_LOG_INFO("%s: placed %.2f MiB of weights in memory tiers by bytes read per token\n", __func__, size_tiered / 1024.0 / 1024.0);
+    }
+}
+
+static bool llama_model_can_repack(const llama_model & model, const ggml_tensor * t) {
+    if (t == model.tok_embd && t != model.output) {
+        return false; // only used by ggml_get_rows()
+    }
+    return t->buffer && ggml_backend_buffer_is_host(t->buffer) && ggml_is_matrix(t);
+}
+
+// makes interleaved copies of the quantized weights in host memory, so
+// matmul kernels can load eight rows at a time. it's opt-in because the
+// copies live on the heap, whereas the originals are usually mmap()'d
+static void llama_model_repack(const llama_model & model) {
+    size_t size = 0;
+    for (const auto & it : model.tensors_by_name) {
+        const ggml_tensor * t = it.second;
+        if (!llama_model_can_repack(model, t)) {
+            continue;
+        }
+        llamafile_unrepack(t->data);
+        if (llamafile_repack(t->data, t->ne[1], t->ne[0] / ggml_blck_size(t->type),
+                             t->nb[1] / ggml_type_size(t->type), t->type)) {
+            size += ggml_nbytes(t);
+        }
+    }
+    if (size) {
+        LLAMA_LOG_INFO("%s: repacked %.2f MiB of weights\n", __func__, size / 1024.0 / 1024.0);
+    }
+}
+
+// like llama_model_repack() except the copies are put in memory that's
+// shared by processes loading the same model, where the first fills it
+static bool llama_model_repack_shared(llama_model & model, uint64_t identity) {
+    size_t size = 0;
+    for (const auto & it : model.tensors_by_name) {
+        const ggml_tensor * t = it.second;
+        if (llama_model_can_repack(model, t)) {
+            size += GGML_PAD(llamafile_repack_size(t->ne[1], t->ne[0] / ggml_blck_size(t->type), t->type), 64);
+        }
+    }
+    if (!size) {
+        return true;
+    }
+    bool created;
+    // layout may change between releases, and offloading changes which tensors are on the host
+    identity = (identity ^ LLAMAFILE_VERSION) * 0x100000001b3;
+    identity = (identity ^ size) * 0x100000001b3;
+    std::string name = format("llamafile-%016" PRIx64 "-repack", identity);
+    uint8_t * p = (uint8_t *) llamafile_shm_attach(name.c_str(), size, &created);
+    if (!p) {
+        LLAMA_LOG_WARN("%s: failed to attach /dev/shm/%s: %s\n", __func__, name.c_str(), strerror(errno));
+        return false;
+    }
+    size_t off = 0;
+    for (const auto & it : model.tensors_by_name) {
+        const ggml_tensor * t = it.second;
+        if (!llama_model_can_repack(model, t)) {
+            continue;
+        }
+        size_t n = llamafile_repack_size(t->ne[1], t->ne[0] / ggml_blck_size(t->type), t->type);
+        if (n) {
+            llamafile_unrepack(t->data);
+            llamafile_repack_into(p + off, created, t->data, t->ne[1], t->ne[0] / ggml_blck_size(t->type),
+                                  t->nb[1] / ggml_type_size(t->type), t->type);
+            off += GGML_PAD(n, 64);
+        }
+    }
+    if (created) {
+        llamafile_shm_publish(p);
+    }
+    model.repack_shm = p;
+    LLAMA_LOG_INFO("%s: %s %.2f MiB of repacked weights in /dev/shm/%s\n", __func__,
+                   created ? "shared" : "attached to", size / 1024.0 / 1024.0, name.c_str());
+    return true;
+}
+
+// times each tinyblas register tile on every distinct shape of weights
+// in host memory, the first time a model is seen on this kind of cpu
+static void llama_model_tune(const llama_model & model) {
+    int64_t t_start_us = ggml_time_us();
+    std::set<std::tuple<int, int64_t, int64_t>> shapes;
+    for (const auto & it : model.tensors_by_name) {
+        const ggml_tensor * t = it.second;
+        if (t == model.tok_embd && t != model.output) {
+            continue; // only used by ggml_get_rows()
+        }
+        if (!t->buffer || !ggml_backend_buffer_is_host(t->buffer) || !ggml_is_matrix(t)) {
+            continue;
+        }
+        int64_t k = t->ne[0] / ggml_blck_size(t->type);
+        if (!shapes.emplace(t->type, t->ne[1], k).second) {
+            continue;
+        }
+        int tile = llamafile_tune(t->data, t->ne[1], k, t->nb[1] / ggml_type_size(t->type), t->type);
+        if (tile > 0) {
+            LLAMA_LOG_INFO("%s: %s %" PRId64 "x%" PRId64 " uses tile %d\n", __func__,
+                           ggml_type_name(t->type), t->ne[1], t->ne[0], tile);
+        }
+    }
+    llamafile_tune_save();
+    LLAMA_LOG_INFO("%s: tuned %zu shapes in %.2f ms\n", __func__, shapes.size(),
+                   (ggml_time_us() - t_start_us) / 1000.0);
+}
+
+// copies the experts that each offloaded moe layer picks most often, as
+// counted in the expert stats, to the layer's gpu, packed in the order of
+// their ids. the layer's expert tensors stay in host memory for the rest
+static void llama_model_copy_hot_experts(llama_model & model, int n_gpu_experts) {
+    const auto & hparams = model.hparams;
+    const uint32_t n_expert = hparams.n_expert;
+
+    std::map<ggml_backend_buffer_type_t, ggml_context *> ctx_map;
+    for (uint32_t il = 0; il < hparams.n_layer; ++il) {
+        auto & layer = model.layers[il];
+        ggml_backend_buffer_type_t buft = model.buft_layer[il].buft;
+        if (!layer.ffn_gate_exps || !layer.ffn_down_exps || !layer.ffn_up_exps ||
+            buft == llama_default_buffer_type_cpu(true)) {
+            continue;
+        }
+
+        std::vector<uint32_t> order(n_expert);
+        std::iota(order.begin(), order.end(), 0);
+        if (!model.expert_counts.empty()) {
+            const uint64_t * counts = model.expert_counts.data() + il*n_expert;
+            std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+                return counts[a] > counts[b];
+            });
+        }
+        for (int x = 0; x < n_gpu_experts; ++x) {
+            layer.ffn_exps_gpu_mask[order[x]/32] |= 1u << (order[x]%32);
+        }
+
+        ggml_context *& ctx = ctx_map[buft];
+        if (!ctx) {
+            struct ggml_init_params params = {
+                /*.mem_size   =*/ ggml_tensor_overhead()*hparams.n_layer*3,
+                /*.mem_buffer =*/ NULL,
+                /*.no_alloc   =*/ true,
+            };
+            ctx = ggml_init(params);
+            if (!ctx) {
+                throw std::runtime_error(format("failed to create context"));
+            }
+            model.ctxs.push_back(ctx);
+        }
+
+        auto copy_of = [&](const struct ggml_tensor * exps) {
+            struct ggml_tensor * cur = ggml_new_tensor_3d(ctx, exps->type, exps->ne[0], exps->ne[1], n_gpu_experts);
+            ggml_format_name(cur, "%s.gpu", exps->name);
+            return cur;
+        };
+        layer.ffn_gate_exps_gpu = copy_of(layer.ffn_gate_exps);
+        layer.ffn_down_exps_gpu = copy_of(layer.ffn_down_exps);
+        layer.ffn_up_exps_gpu   = copy_of(layer.ffn_up_exps);
+    }
+
+    for (auto & it : ctx_map) {
+        ggml_backend_buffer_t buf = ggml_backend_alloc_ctx_tensors_from_buft(it.second, it.first);
+        if (buf == nullptr) {
+            throw std::runtime_error("unable to allocate backend buffer for the hot experts");
+        }
+        ggml_backend_buffer_set_usage(buf, GGML_BACKEND_BUFFER_USAGE_WEIGHTS);
+        model.bufs.push_back(buf);
+        LLAMA_LOG_INFO("%s: %10s buffer size = %8.2f MiB for %d of %u experts per layer\n", __func__,
+                ggml_backend_buffer_name(buf), ggml_backend_buffer_get_size(buf) / 1024.0 / 1024.0, n_gpu_experts, n_expert);
+    }
+
+    for (auto & layer : model.layers) {
+        const std::pair<const struct ggml_tensor *, struct ggml_tensor *> copies[] = {
+            { layer.ffn_gate_exps, layer.ffn_gate_exps_gpu },
+            { layer.ffn_down_exps, layer.ffn_down_exps_gpu },
+            { layer.ffn_up_exps,   layer.ffn_up_exps_gpu   },
+        };
+        for (const auto & it : copies) {
+            if (!it.second) {
+                continue;
+            }
+            size_t slot = 0;
+            for (uint32_t x = 0; x < n_expert; ++x) {
+                if (layer.ffn_exps_gpu_mask[x/32] >> (x%32) & 1) {
+                    ggml_backend_tensor_set(it.second, (const char *) it.first->data + x*it.first->nb[2],
+                            slot*it.second->nb[2], it.first->nb[2]);
+                    slot++;
+                }
+            }
+        }
+    }
+}
+
 static bool llm_load_tensors(
         llama_model_loader & ml,
         llama_model & model,
@@ -4509,6 +6169,11 @@ static bool llm_load_tensors(
         int main_gpu,
         const float * tensor_split,
         bool use_mlock,
+        bool use_repack,
+        bool use_tune,
+        bool lazy_load,
+        int n_gpu_experts,
+        const char * expert_stats,
         llama_progress_callback progress_callback,
         void * progress_callback_user_data) {
     model.t_start_us = ggml_time_us();
@@ -4604,6 +6269,20 @@ static bool llm_load_tensors(
         }
     }
 
+    // the experts of offloaded moe layers may stay in host memory, with
+    // copies of the n_gpu_experts picked most often put in vram
+    const bool split_experts = n_gpu_experts > 0 && (uint32_t) n_gpu_experts < hparams.n_expert &&
+                               hparams.n_expert <= GGML_MAX_MASKED_EXPERTS && !llamafile_has_metal();
+    auto is_layer_exps_split = [&](int i) {
+        return split_experts && model.buft_layer[i].buft != llama_default_buffer_type_cpu(true);
+    };
+
+    if (expert_stats && *expert_stats && hparams.n_expert > 0) {
+        model.expert_stats  = expert_stats;
+        model.expert_counts = llama_load_expert_stats(model.expert_stats, n_layer, hparams.n_expert);
+        model.expert_counts.resize(n_layer*hparams.n_expert);
+    }
+
     // count used buffer types
     std::map<ggml_backend_buffer_type_t, int> buft_layer_count;
     buft_layer_count[model.buft_input.buft]++;
@@ -4660,6 +6339,9 @@ static bool llm_load_tensors(
         ggml_context * ctx_output_split = ctx_map.at(model.buft_output.buft_matrix);
         auto ctx_for_layer              = [&](int i) { return ctx_map.at(model.buft_layer[i].buft); };
         auto ctx_for_layer_split        = [&](int i) { return ctx_map.at(model.buft_layer[i].buft_matrix); };
+        auto ctx_for_layer_exps         = [&](int i) {
+            return is_layer_exps_split(i) ? ctx_map.at(llama_default_buffer_type_cpu(true)) : ctx_for_layer_split(i);
+        };
 
         model.layers.resize(n_layer);
 
@@ -4688,6 +6370,7 @@ static bool llm_load_tensors(
                     for (int i = 0; i < n_layer; ++i) {
                         ggml_context * ctx_layer = ctx_for_layer(i);
                         ggml_context * ctx_split = ctx_for_layer_split(i);
+                        ggml_context * ctx_exps = ctx_for_layer_exps(i);
 
                         auto & layer = model.layers[i];
 
@@ -4710,13 +6393,22 @@ static bool llm_load_tensors(
                             layer.ffn_gate = ml.create_tensor(ctx_split, tn(LLM_TENSOR_FFN_GATE, "weight", i), {n_embd,   n_ff});
                             layer.ffn_down = ml.create_tensor(ctx_split, tn(LLM_TENSOR_FFN_DOWN, "weight", i), {  n_ff, n_embd});
                             layer.ffn_up   = ml.create_tensor(ctx_split, tn(LLM_TENSOR_FFN_UP,   "weight", i), {n_embd,   n_ff});
+
+                            // optional activation predictor, whose rank is up to the model
+                            const ggml_tensor * pred_a = ml.get_tensor_meta(tn(LLM_TENSOR_FFN_PRED_A, "weight", i).c_str());
+                            if (pred_a) {
+                                const int64_t n_rank = pred_a->ne[1];
+                                layer.ffn_pred_a = ml.create_tensor(ctx_layer, tn(LLM_TENSOR_FFN_PRED_A, "weight", i), {n_embd, n_rank});
+                                layer.ffn_pred_b = ml.create_tensor(ctx_layer, tn(LLM_TENSOR_FFN_PRED_B, "weight", i), {n_rank, n_ff});
+                                layer.ffn_down_t = ml.create_tensor(ctx_split, tn(LLM_TENSOR_FFN_DOWN_T, "weight", i), {n_embd, n_ff}, false);
+                            }
                         } else {
                             layer.ffn_gate_inp = ml.create_tensor(ctx_layer, tn(LLM_TENSOR_FFN_GATE_INP, "weight", i), {n_embd, n_expert});
 
-                            layer.ffn_gate_exps = ml.create_tensor(ctx_split, tn(LLM_TENSOR_FFN_GATE_EXPS, "weight", i), {n_embd,   n_ff, n_expert}, false);
+                            layer.ffn_gate_exps = ml.create_tensor(ctx_exps, tn(LLM_TENSOR_FFN_GATE_EXPS, "weight", i), {n_embd,   n_ff, n_expert}, false);
                             if (layer.ffn_gate_exps) {
-                                layer.ffn_down_exps = ml.create_tensor(ctx_split, tn(LLM_TENSOR_FFN_DOWN_EXPS, "weight", i), {  n_ff, n_embd, n_expert});
-                                layer.ffn_up_exps   = ml.create_tensor(ctx_split, tn(LLM_TENSOR_FFN_UP_EXPS,   "weight", i), {n_embd,   n_ff, n_expert});
+                                layer.ffn_down_exps = ml.create_tensor(ctx_exps, tn(LLM_TENSOR_FFN_DOWN_EXPS, "weight", i), {  n_ff, n_embd, n_expert});
+                                layer.ffn_up_exps   = ml.create_tensor(ctx_exps, tn(LLM_TENSOR_FFN_UP_EXPS,   "weight", i), {n_embd,   n_ff, n_expert});
                             } else {
                                 // merge split expert into a single tensor for compatibility with older models
                                 // requires disabling mmap
@@ -4726,9 +6418,9 @@ static bool llm_load_tensors(
                                 ggml_type type_down = ml.require_tensor_meta(tn(LLM_TENSOR_FFN_DOWN_EXP, "weight", i, 0).c_str())->type;
                                 ggml_type type_up   = ml.require_tensor_meta(tn(LLM_TENSOR_FFN_UP_EXP,   "weight", i, 0).c_str())->type;
 
-                                layer.ffn_gate_exps = ggml_new_tensor_3d(ctx_split, type_gate, n_embd,   n_ff, n_expert);
-                                layer.ffn_down_exps = ggml_new_tensor_3d(ctx_split, type_down,   n_ff, n_embd, n_expert);
-                                layer.ffn_up_exps   = ggml_new_tensor_3d(ctx_split, type_up,   n_embd,   n_ff, n_expert);
+                                layer.ffn_gate_exps = ggml_new_tensor_3d(ctx_exps, type_gate, n_embd,   n_ff, n_expert);
+                                layer.ffn_down_exps = ggml_new_tensor_3d(ctx_exps, type_down,   n_ff, n_embd, n_expert);
+                                layer.ffn_up_exps   = ggml_new_tensor_3d(ctx_exps, type_up,   n_embd,   n_ff, n_expert);
 
                                 ggml_set_name(layer.ffn_gate_exps, tn(LLM_TENSOR_FFN_GATE_EXPS, "weight", i).c_str());
                                 ggml_set_name(layer.ffn_down_exps, tn(LLM_TENSOR_FFN_DOWN_EXPS, "weight", i).c_str());
@@ -4736,9 +6428,9 @@ static bool llm_load_tensors(
 
                                 for (uint32_t x = 0; x < n_expert; ++x) {
                                     // the individual experts are loaded into a view of the merged tensor
-                                    ml.create_tensor_as_view(ctx_split, layer.ffn_gate_exps, tn(LLM_TENSOR_FFN_GATE_EXP, "weight", i, x), { n_embd, n_ff }, layer.ffn_gate_exps->nb[2]*x);
-                                    ml.create_tensor_as_view(ctx_split, layer.ffn_down_exps, tn(LLM_TENSOR_FFN_DOWN_EXP, "weight", i, x), { n_ff, n_embd }, layer.ffn_down_exps->nb[2]*x);
-                                    ml.create_tensor_as_view(ctx_split, layer.ffn_up_exps,   tn(LLM_TENSOR_FFN_UP_EXP,   "weight", i, x), { n_embd, n_ff }, layer.ffn_up_exps->nb[2]*x);
+                                    ml.create_tensor_as_view(ctx_exps, layer.ffn_gate_exps, tn(LLM_TENSOR_FFN_GATE_EXP, "weight", i, x), { n_embd, n_ff }, layer.ffn_gate_exps->nb[2]*x);
+                                    ml.create_tensor_as_view(ctx_exps, layer.ffn_down_exps, tn(LLM_TENSOR_FFN_DOWN_EXP, "weight", i, x), { n_ff, n_embd }, layer.ffn_down_exps->nb[2]*x);
+                                    ml.create_tensor_as_view(ctx_exps, layer.ffn_up_exps,   tn(LLM_TENSOR_FFN_UP_EXP,   "weight", i, x), { n_embd, n_ff }, layer.ffn_up_exps->nb[2]*x);
                                 }
                             }
                         }
@@ -4767,6 +6459,7 @@ static bool llm_load_tensors(
                     for (int i = 0; i < n_layer; ++i) {
                         ggml_context * ctx_layer = ctx_for_layer(i);
                         ggml_context * ctx_split = ctx_for_layer_split(i);
+                        ggml_context * ctx_exps = ctx_for_layer_exps(i);
 
                         auto & layer = model.layers[i];
 
@@ -4783,10 +6476,10 @@ static bool llm_load_tensors(
 
                         layer.ffn_gate_inp = ml.create_tensor(ctx_layer, tn(LLM_TENSOR_FFN_GATE_INP, "weight", i), {n_embd, n_expert});
 
-                        layer.ffn_gate_exps = ml.create_tensor(ctx_split, tn(LLM_TENSOR_FFN_GATE_EXPS, "weight", i), {n_embd, n_ff, n_expert}, false);
+                        layer.ffn_gate_exps = ml.create_tensor(ctx_exps, tn(LLM_TENSOR_FFN_GATE_EXPS, "weight", i), {n_embd, n_ff, n_expert}, false);
                         if (layer.ffn_gate_exps) {
-                            layer.ffn_down_exps = ml.create_tensor(ctx_split, tn(LLM_TENSOR_FFN_DOWN_EXPS, "weight", i), {  n_ff, n_embd, n_expert});
-                            layer.ffn_up_exps   = ml.create_tensor(ctx_split, tn(LLM_TENSOR_FFN_UP_EXPS,   "weight", i), {n_embd,   n_ff, n_expert});
+                            layer.ffn_down_exps = ml.create_tensor(ctx_exps, tn(LLM_TENSOR_FFN_DOWN_EXPS, "weight", i), {  n_ff, n_embd, n_expert});
+                            layer.ffn_up_exps   = ml.create_tensor(ctx_exps, tn(LLM_TENSOR_FFN_UP_EXPS,   "weight", i), {n_embd,   n_ff, n_expert});
                         } else {
                             // merge split expert into a single tensor for compatibility with older models
                             // requires disabling mmap
@@ -4796,9 +6489,9 @@ static bool llm_load_tensors(
                             ggml_type type_down = ml.require_tensor_meta(tn(LLM_TENSOR_FFN_DOWN_EXP, "weight", i, 0).c_str())->type;
                             ggml_type type_up   = ml.require_tensor_meta(tn(LLM_TENSOR_FFN_UP_EXP,   "weight", i, 0).c_str())->type;
 
-                            layer.ffn_gate_exps = ggml_new_tensor_3d(ctx_split, type_gate, n_embd,   n_ff, n_expert);
-                            layer.ffn_down_exps = ggml_new_tensor_3d(ctx_split, type_down,   n_ff, n_embd, n_expert);
-                            layer.ffn_up_exps   = ggml_new_tensor_3d(ctx_split, type_up,   n_embd,   n_ff, n_expert);
+                            layer.ffn_gate_exps = ggml_new_tensor_3d(ctx_exps, type_gate, n_embd,   n_ff, n_expert);
+                            layer.ffn_down_exps = ggml_new_tensor_3d(ctx_exps, type_down,   n_ff, n_embd, n_expert);
+                            layer.ffn_up_exps   = ggml_new_tensor_3d(ctx_exps, type_up,   n_embd,   n_ff, n_expert);
 
                             ggml_set_name(layer.ffn_gate_exps, tn(LLM_TENSOR_FFN_GATE_EXPS, "weight", i).c_str());
                             ggml_set_name(layer.ffn_down_exps, tn(LLM_TENSOR_FFN_DOWN_EXPS, "weight", i).c_str());
@@ -4806,9 +6499,9 @@ static bool llm_load_tensors(
 
                             for (uint32_t x = 0; x < n_expert; ++x) {
                                 // the individual experts are loaded into a view of the merged tensor
-                                ml.create_tensor_as_view(ctx_split, layer.ffn_gate_exps, tn(LLM_TENSOR_FFN_GATE_EXP, "weight", i, x), { n_embd, n_ff }, layer.ffn_gate_exps->nb[2]*x);
-                                ml.create_tensor_as_view(ctx_split, layer.ffn_down_exps, tn(LLM_TENSOR_FFN_DOWN_EXP, "weight", i, x), { n_ff, n_embd }, layer.ffn_down_exps->nb[2]*x);
-                                ml.create_tensor_as_view(ctx_split, layer.ffn_up_exps,   tn(LLM_TENSOR_FFN_UP_EXP,   "weight", i, x), { n_embd, n_ff }, layer.ffn_up_exps->nb[2]*x);
+                                ml.create_tensor_as_view(ctx_exps, layer.ffn_gate_exps, tn(LLM_TENSOR_FFN_GATE_EXP, "weight", i, x), { n_embd, n_ff }, layer.ffn_gate_exps->nb[2]*x);
+                                ml.create_tensor_as_view(ctx_exps, layer.ffn_down_exps, tn(LLM_TENSOR_FFN_DOWN_EXP, "weight", i, x), { n_ff, n_embd }, layer.ffn_down_exps->nb[2]*x);
+                                ml.create_tensor_as_view(ctx_exps, layer.ffn_up_exps,   tn(LLM_TENSOR_FFN_UP_EXP,   "weight", i, x), { n_embd, n_ff }, layer.ffn_up_exps->nb[2]*x);
                             }
                         }
 
@@ -4832,6 +6525,7 @@ static bool llm_load_tensors(
                 for (int i = 0; i < n_layer; ++i) {
                     ggml_context * ctx_layer = ctx_for_layer(i);
                     ggml_context * ctx_split = ctx_for_layer_split(i);
+                    ggml_context * ctx_exps = ctx_for_layer_exps(i);
 
                     auto & layer = model.layers[i];
 
@@ -4843,9 +6537,9 @@ static bool llm_load_tensors(
                     layer.attn_out_norm   = ml.create_tensor(ctx_layer, tn(LLM_TENSOR_ATTN_OUT_NORM, "weight", i), {n_embd});
 
                     layer.ffn_gate_inp  = ml.create_tensor(ctx_layer, tn(LLM_TENSOR_FFN_GATE_INP,  "weight", i), {n_embd, n_expert});
-                    layer.ffn_gate_exps = ml.create_tensor(ctx_split, tn(LLM_TENSOR_FFN_GATE_EXPS, "weight", i), {n_embd, n_ff,   n_expert});
-                    layer.ffn_down_exps = ml.create_tensor(ctx_split, tn(LLM_TENSOR_FFN_DOWN_EXPS, "weight", i), {n_ff,   n_embd, n_expert});
-                    layer.ffn_up_exps   = ml.create_tensor(ctx_split, tn(LLM_TENSOR_FFN_UP_EXPS,   "weight", i), {n_embd, n_ff,   n_expert});
+                    layer.ffn_gate_exps = ml.create_tensor(ctx_exps, tn(LLM_TENSOR_FFN_GATE_EXPS, "weight", i), {n_embd, n_ff,   n_expert});
+                    layer.ffn_down_exps = ml.create_tensor(ctx_exps, tn(LLM_TENSOR_FFN_DOWN_EXPS, "weight", i), {n_ff,   n_embd, n_expert});
+                    layer.ffn_up_exps   = ml.create_tensor(ctx_exps, tn(LLM_TENSOR_FFN_UP_EXPS,   "weight", i), {n_embd, n_ff,   n_expert});
                 }
             } break;
             case LLM_ARCH_BAICHUAN:
@@ -5258,6 +6952,7 @@ static bool llm_load_tensors(
                     for (int i = 0; i < n_layer; ++i) {
                         ggml_context * ctx_layer = ctx_for_layer(i);
                         ggml_context * ctx_split = ctx_for_layer_split(i);
+                        ggml_context * ctx_exps = ctx_for_layer_exps(i);
 
                         auto & layer = model.layers[i];
 
@@ -5282,9 +6977,9 @@ static bool llm_load_tensors(
 
                         // MoE branch
                         auto n_ff_exp = n_ff / hparams.n_expert_used;
-                        layer.ffn_gate_exps = ml.create_tensor(ctx_split, tn(LLM_TENSOR_FFN_GATE_EXPS, "weight", i), {  n_embd, n_ff_exp, n_expert});
-                        layer.ffn_down_exps = ml.create_tensor(ctx_split, tn(LLM_TENSOR_FFN_DOWN_EXPS, "weight", i), {n_ff_exp,   n_embd, n_expert});
-                        layer.ffn_up_exps   = ml.create_tensor(ctx_split, tn(LLM_TENSOR_FFN_UP_EXPS,   "weight", i), {  n_embd, n_ff_exp, n_expert});
+                        layer.ffn_gate_exps = ml.create_tensor(ctx_exps, tn(LLM_TENSOR_FFN_GATE_EXPS, "weight", i), {  n_embd, n_ff_exp, n_expert});
+                        layer.ffn_down_exps = ml.create_tensor(ctx_exps, tn(LLM_TENSOR_FFN_DOWN_EXPS, "weight", i), {n_ff_exp,   n_embd, n_expert});
+                        layer.ffn_up_exps   = ml.create_tensor(ctx_exps, tn(LLM_TENSOR_FFN_UP_EXPS,   "weight", i), {  n_embd, n_ff_exp, n_expert});
 
                         // Shared expert branch
                         layer.ffn_gate_inp_shexp = ml.create_tensor(ctx_layer, tn(LLM_TENSOR_FFN_GATE_INP_SHEXP, "weight", i), {n_embd});
@@ -5756,7 +7451,7 @@ static bool llm_load_tensors(
 
     ml.done_getting_tensors();
 
-    ml.init_mappings(true, use_mlock ? &model.mlock_mmaps : nullptr);
+    ml.init_mappings(!lazy_load, use_mlock ? &model.mlock_mmaps : nullptr, lazy_load);
     model.mappings.reserve(ml.mappings.size());
 
     // create the backend buffers
@@ -5792,7 +7487,11 @@ static bool llm_load_tensors(
                 model.bufs.push_back(buf);
                 bufs.emplace(idx, buf);
 // #ifdef GGML_USE_CUDA
-                if (llamafile_has_cuda() && n_layer >= n_gpu_layers) {
+                // weights left on the cpu are copied to the gpu whenever a
+                // large batch is offloaded, which only goes at full speed
+                // without staging if the gpu can read them directly
+                if (llamafile_has_cuda() && n_layer >= n_gpu_layers &&
+                    ((use_mlock && !lazy_load) || getenv("GGML_CUDA_REGISTER_HOST"))) {
                     ggml_backend_cuda_register_host_buffer(
                         ggml_backend_buffer_get_base(buf),
                         ggml_backend_buffer_get_size(buf));
@@ -5884,18 +7583,127 @@ static bool llm_load_tensors(
         }
     }
 
+    // before the weights in host memory get repacked
+    if (split_experts) {
+        llama_model_copy_hot_experts(model, n_gpu_experts);
+    }
+
     if (use_mmap_buffer) {
         for (auto & mapping : ml.mappings) {
             model.mappings.emplace_back(std::move(mapping));
         }
     }
 
+    llama_model_mirror_numa(model);
+
+    llamafile_tune_load();
+    if (use_tune) {
+        llama_model_tune(model);
+    }
+
+    if (use_repack) {
+        model.repacked = true;
+        uint64_t identity = 0xcbf29ce484222325;
+        for (const auto & file : ml.files) {
+            identity = llama_file_identity(identity, file.get());
+        }
+        if (!FLAG_share_weights || !llama_model_repack_shared(model, identity)) {
+            llama_model_repack(model);
+        }
+    }
+
+    if (FLAG_stream_weights) {
+        llama_model_init_stream(model);
+    }
+
     // loading time will be recalculate after the first eval, so
     // we take page faults deferred by mmap() into consideration
     model.t_load_us = ggml_time_us() - model.t_start_us;
     return true;
 }
 
+// picks how many layers `-ngl auto` offloads
+//
+// layers are offloaded from the last one down, so we add up the weights
+// of each from the gguf tensor table, plus its share of a f16 kv cache,
+// until the free memory of the devices is used up. what's left for the
+// compute buffers is estimated from the biggest intermediates of one
+// ubatch, and a scratch copy of the biggest weight for dequantizing
+//
+static int llama_fit_gpu_layers(llama_model_loader & ml, const llama_model & model, const llama_model_params & params) {
+    const auto & hparams = model.hparams;
+    const int n_layer = hparams.n_layer;
+
+    const size_t n_ctx    = params.n_ctx_fit ? params.n_ctx_fit : hparams.n_ctx_train;
+    const size_t n_ubatch = std::min(n_ctx, (size_t) (params.n_ubatch_fit ? params.n_ubatch_fit : 512));
+
+    size_t avail = 0;
+    if (params.split_mode == LLAMA_SPLIT_MODE_NONE) {
+        avail = llama_get_device_memory(params.main_gpu);
+    } else {
+        for (size_t i = 0; i < llama_get_device_count(); ++i) {
+            avail += llama_get_device_memory(i);
+        }
+    }
+
+    // only the hot experts of a layer go to vram with --gpu-experts
+    const uint32_t n_expert = hparams.n_expert;
+    const bool split_experts = params.n_gpu_experts > 0 && (uint32_t) params.n_gpu_experts < n_expert &&
+                               n_expert <= GGML_MAX_MASKED_EXPERTS && !llamafile_has_metal();
+
+    std::vector<size_t> layer_size(n_layer);
+    size_t output_size = 0;
+    size_t max_elements = 0;
+    for (const auto & w : ml.weights) {
+        const char * name = ggml_get_name(w.tensor);
+        int il;
+        if (sscanf(name, "blk.%d.", &il) == 1 && il >= 0 && il < n_layer) {
+            if (split_experts && strstr(name, "_exps.")) {
+                layer_size[il] += ggml_nbytes(w.tensor) / n_expert * params.n_gpu_experts;
+            } else {
+                layer_size[il] += ggml_nbytes(w.tensor);
+            }
+        } else if (!strncmp(name, "output", 6)) {
+            output_size += ggml_nbytes(w.tensor);
+        }
+        max_elements = std::max(max_elements, (size_t) ggml_nelements(w.tensor));
+    }
+    // tied embeddings get duplicated as the output
+    if (!ml.get_tensor_meta("output.weight")) {
+        if (struct ggml_tensor * t = ml.get_tensor_meta("token_embd.weight")) {
+            output_size += ggml_nbytes(t);
+        }
+    }
+
+    const size_t kv_size = n_ctx * (hparams.n_embd_k_gqa() + hparams.n_embd_v_gqa()) * sizeof(ggml_fp16_t) +
+                           (hparams.n_embd_k_s() + hparams.n_embd_v_s()) * sizeof(float);
+    const size_t compute_size =
+        n_ubatch * n_ctx * hparams.n_head * sizeof(float) +                     // kq
+        n_ubatch * hparams.n_vocab * sizeof(float) +                            // logits
+        n_ubatch * (4 * hparams.n_embd + 2 * hparams.n_ff) * sizeof(float) +    // activations
+        max_elements * sizeof(ggml_fp16_t);                                     // dequantized weight
+    const size_t reserve = 256ull * 1024 * 1024;
+
+    int n_gpu = 0;
+    size_t used = compute_size + reserve;
+    for (int il = n_layer - 1; il >= 0 && used + layer_size[il] + kv_size <= avail; --il) {
+        used += layer_size[il] + kv_size;
+        ++n_gpu;
+    }
+    if (n_gpu == n_layer && used + output_size <= avail) {
+        used += output_size;
+        ++n_gpu;
+    }
+    if (!n_gpu) {
+        used = 0;
+    }
+
+    LLAMA_LOG_INFO("%s: -ngl auto offloads %d/%d layers using %.2f of %.2f MiB free for n_ctx = %zu\n",
+            __func__, n_gpu, n_layer + 1, used / 1024.0 / 1024.0, avail / 1024.0 / 1024.0, n_ctx);
+
+    return n_gpu;
+}
+
 // Returns 0 on success, -1 on error, and -2 on cancellation via llama_progress_callback
 static int llama_model_load(const std::string & fname, llama_model & model, llama_model_params & params) {
     try {
@@ -5948,6 +7756,10 @@ static int llama_model_load(const std::string & fname, llama_model & model, llam
         }
 #endif
 
+        if (params.n_gpu_layers == LLAMAFILE_GPU_LAYERS_AUTO) {
+            params.n_gpu_layers = llama_fit_gpu_layers(ml, model, params);
+        }
+
 #ifdef GGML_USE_SYCL
         if (params.split_mode == LLAMA_SPLIT_MODE_NONE) {
             ggml_backend_sycl_set_single_device_mode(params.main_gpu);
@@ -5960,6 +7772,7 @@ static int llama_model_load(const std::string & fname, llama_model & model, llam
 
         if (!llm_load_tensors(
             ml, model, params.n_gpu_layers, params.split_mode,  params.main_gpu, params.tensor_split, params.use_mlock,
+            params.repack, params.tune, params.lazy_load, params.n_gpu_experts, params.expert_stats,
             params.progress_callback, params.progress_callback_user_data
         )) {
             return -2;
@@ -6037,7 +7850,8 @@ static void llm_build_kv_store(
                     int32_t   n_tokens,
                     int32_t   kv_head,
          const llm_build_cb & cb,
-                    int64_t   il) {
+                    int64_t   il,
+                       bool   use_runs = true) {
     const int64_t n_ctx = cparams.n_ctx;
 
     const int64_t n_embd_k_gqa = hparams.n_embd_k_gqa();
@@ -6045,6 +7859,18 @@ static void llm_build_kv_store(
 
     GGML_ASSERT(kv.size == n_ctx);
 
+    if (use_runs && kv.runs.size() > 1) {
+        // the batch went to several places in the cache
+        for (const llama_kv_run & run : kv.runs) {
+            struct ggml_tensor * k_run = k_cur->ne[2] == n_tokens
+                ? ggml_view_3d(ctx, k_cur, k_cur->ne[0], k_cur->ne[1], run.n, k_cur->nb[1], k_cur->nb[2], run.i_token*k_cur->nb[2])
+                : ggml_view_2d(ctx, k_cur, k_cur->ne[0], run.n, k_cur->nb[1], run.i_token*k_cur->nb[1]);
+            struct ggml_tensor * v_run = ggml_view_2d(ctx, v_cur, v_cur->ne[0], run.n, v_cur->nb[1], run.i_token*v_cur->nb[1]);
+            llm_build_kv_store(ctx, hparams, cparams, kv, graph, k_run, v_run, run.n, run.cell, cb, il, false);
+        }
+        return;
+    }
+
     struct ggml_tensor * k_cache_view = ggml_view_1d(ctx, kv.k_l[il], n_tokens*n_embd_k_gqa,
             (ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa))*kv_head);
     cb(k_cache_view, "k_cache_view", il);
@@ -6104,8 +7930,81 @@ static struct ggml_tensor * llm_build_norm(
     return cur;
 }
 
+// multiplies cur by a weight, adding the low-rank branch of each runtime
+// lora adapter of the ubatch that has one for it. tokens of sequences not
+// using an adapter are given a scale of 0, so sequences with different
+// adapters are still decoded together, at the cost of the adapter's rank
+static struct ggml_tensor * llm_build_lora_mm(
+        struct ggml_context * ctx,
+       struct llama_context & lctx,
+         struct ggml_tensor * w,
+         struct ggml_tensor * cur) {
+    struct ggml_tensor * res = ggml_mul_mat(ctx, w, cur);
+
+    for (size_t i = 0; i < lctx.lora_batch.size(); ++i) {
+        const llama_lora_weight * lw = lctx.lora_batch[i]->weight_for(w);
+        if (!lw) {
+            continue;
+        }
+        GGML_ASSERT(ggml_n_dims(cur) <= 2);
+
+        struct ggml_tensor * scale = lctx.inp_lora_scale[i];
+        if (cur->ne[1] != scale->ne[1]) {
+            // the last layer only computes the rows that are output
+            if (!lctx.lora_scale_out[i]) {
+                GGML_ASSERT(lctx.inp_out_ids && lctx.inp_out_ids->ne[0] == cur->ne[1]);
+                lctx.lora_scale_out[i] = ggml_get_rows(ctx, scale, lctx.inp_out_ids);
+            }
+            scale = lctx.lora_scale_out[i];
+        }
+
+        struct ggml_tensor * ax = ggml_mul_mat(ctx, lw->a, cur);
+        ax = ggml_mul(ctx, ax, scale);
+        res = ggml_add(ctx, res, ggml_mul_mat(ctx, lw->b, ax));
+    }
+
+    return res;
+}
+
+// multiplies cur by the output projection, which is the largest matmul of
+// a decode step with a big vocab, so only the rows of the shortlist are
+// computed when there is one
+static struct ggml_tensor * llm_build_output(
+        struct ggml_context * ctx,
+       struct llama_context & lctx,
+         struct ggml_tensor * w,
+         struct ggml_tensor * cur) {
+    if (lctx.inp_shortlist) {
+        w = ggml_get_rows(ctx, w, lctx.inp_shortlist);
+    }
+    return ggml_mul_mat(ctx, w, cur);
+}
+
+// adds the control vector of layer il to its output, and those of the
+// sequences with their own, gathered by the steering row of each token
+static struct ggml_tensor * llm_build_cvec(
+        struct ggml_context * ctx,
+       struct llama_context & lctx,
+         struct ggml_tensor * cur,
+                        int   il) {
+    ggml_tensor * layer_dir = lctx.cvec.tensor_for(il);
+    if (layer_dir != nullptr) {
+        cur = ggml_add(ctx, cur, layer_dir);
+    }
+
+    if (lctx.steer_cvec && (size_t) il < lctx.steering.cvec.size() && lctx.steering.cvec[il] && cur->ne[1] > 0) {
+        // the last layer only computes the rows that are output
+        struct ggml_tensor * rows = cur->ne[1] == lctx.inp_steer_rows->ne[0] ? lctx.inp_steer_rows : lctx.inp_steer_out;
+        GGML_ASSERT(rows->ne[0] == cur->ne[1]);
+        cur = ggml_add(ctx, cur, ggml_get_rows(ctx, lctx.steering.cvec[il], rows));
+    }
+
+    return cur;
+}
+
 static struct ggml_tensor * llm_build_ffn(
         struct ggml_context * ctx,
+       struct llama_context & lctx,
          struct ggml_tensor * cur,
          struct ggml_tensor * up,
          struct ggml_tensor * up_b,
@@ -6118,7 +8017,7 @@ static struct ggml_tensor * llm_build_ffn(
           llm_ffn_gate_type   type_gate,
          const llm_build_cb & cb,
                         int   il) {
-    struct ggml_tensor * tmp = ggml_mul_mat(ctx, up, cur);
+    struct ggml_tensor * tmp = llm_build_lora_mm(ctx, lctx, up, cur);
     cb(tmp, "ffn_up", il);
 
     if (up_b) {
@@ -6130,12 +8029,12 @@ static struct ggml_tensor * llm_build_ffn(
         switch (type_gate) {
             case LLM_FFN_SEQ:
                 {
-                    cur = ggml_mul_mat(ctx, gate, tmp);
+                    cur = llm_build_lora_mm(ctx, lctx, gate, tmp);
                     cb(cur, "ffn_gate", il);
                 } break;
             case LLM_FFN_PAR:
                 {
-                    cur = ggml_mul_mat(ctx, gate, cur);
+                    cur = llm_build_lora_mm(ctx, lctx, gate, cur);
                     cb(cur, "ffn_gate", il);
                 } break;
         }
@@ -6183,7 +8082,7 @@ static struct ggml_tensor * llm_build_ffn(
         cb(cur, "ffn_gate_par", il);
     }
 
-    cur = ggml_mul_mat(ctx, down, cur);
+    cur = llm_build_lora_mm(ctx, lctx, down, cur);
     if (down_b) {
         cb(cur, "ffn_down", il);
     }
@@ -6195,6 +8094,37 @@ static struct ggml_tensor * llm_build_ffn(
     return cur;
 }
 
+// a gated silu ffn that only computes the neurons which a low rank mlp
+// predicts will be active for a token, like powerinfer and deja vu do
+// for models whose activations are mostly zero. it runs on the cpu.
+static struct ggml_tensor * llm_build_ffn_sparse(
+        struct ggml_context * ctx,
+         struct ggml_tensor * cur,
+         struct ggml_tensor * up,
+         struct ggml_tensor * gate,
+         struct ggml_tensor * down,
+         struct ggml_tensor * down_t,
+         struct ggml_tensor * pred_a,
+         struct ggml_tensor * pred_b,
+         const llm_build_cb & cb,
+                        int   il) {
+    struct ggml_tensor * pred = ggml_mul_mat(ctx, pred_a, cur);
+    pred = ggml_relu(ctx, pred);
+    pred = ggml_mul_mat(ctx, pred_b, pred); // [n_ff, n_tokens]
+    cb(pred, "ffn_pred", il);
+
+    cur = ggml_mul_mat_swiglu_sparse(ctx, gate, up, cur, pred);
+    cb(cur, "ffn_gate_par", il);
+
+    if (down_t) {
+        cur = ggml_mul_mat_axpy(ctx, down_t, cur);
+    } else {
+        cur = ggml_mul_mat(ctx, down, cur);
+    }
+
+    return cur;
+}
+
 static struct ggml_tensor * llm_build_moe_ffn(
         struct ggml_context * ctx,
          struct ggml_tensor * cur,
@@ -6202,6 +8132,10 @@ static struct ggml_tensor * llm_build_moe_ffn(
          struct ggml_tensor * up_exps,
          struct ggml_tensor * gate_exps,
          struct ggml_tensor * down_exps,
+         struct ggml_tensor * up_exps_gpu,
+         struct ggml_tensor * gate_exps_gpu,
+         struct ggml_tensor * down_exps_gpu,
+             const uint32_t * exps_gpu_mask,
                     int64_t   n_expert,
                     int64_t   n_expert_used,
             llm_ffn_op_type   type_op,
@@ -6239,40 +8173,70 @@ static struct ggml_tensor * llm_build_moe_ffn(
     }
 
     cur = ggml_reshape_3d(ctx, cur, n_embd, 1, n_tokens);
-    ggml_tensor * up = ggml_mul_mat_id(ctx, up_exps, cur, selected_experts); // [n_ff, n_expert_used, n_tokens]
-    cb(up, "ffn_moe_up", il);
 
-    ggml_tensor * gate = ggml_mul_mat_id(ctx, gate_exps, cur, selected_experts); // [n_ff, n_expert_used, n_tokens]
-    cb(gate, "ffn_moe_gate", il);
+    // the ffn of the selected experts, or of those of them in mask, if any
+    auto build_experts = [&](ggml_tensor * up_exps, ggml_tensor * gate_exps, ggml_tensor * down_exps,
+                             const uint32_t * mask, bool packed) {
+        auto mul_mat_id = [&](ggml_tensor * as, ggml_tensor * b) {
+            return mask ? ggml_mul_mat_id_masked(ctx, as, b, selected_experts, mask, packed)
+                        : ggml_mul_mat_id(ctx, as, b, selected_experts);
+        };
 
-    switch (type_op) {
-        case LLM_FFN_SILU:
-            {
-                gate = ggml_silu(ctx, gate);
-                cb(gate, "ffn_moe_silu", il);
-            } break;
-        case LLM_FFN_GELU:
-            {
-                gate = ggml_gelu(ctx, gate);
-                cb(gate, "ffn_moe_gelu", il);
-            } break;
-        default:
-            GGML_ASSERT(false);
-    }
+        ggml_tensor * up = mul_mat_id(up_exps, cur); // [n_ff, n_expert_used, n_tokens]
+        cb(up, "ffn_moe_up", il);
 
-    ggml_tensor * par = ggml_mul(ctx, up, gate); // [n_ff, n_expert_used, n_tokens]
-    cb(par, "ffn_moe_gate_par", il);
+        ggml_tensor * gate = mul_mat_id(gate_exps, cur); // [n_ff, n_expert_used, n_tokens]
+        cb(gate, "ffn_moe_gate", il);
 
-    ggml_tensor * experts = ggml_mul_mat_id(ctx, down_exps, par, selected_experts); // [n_embd, n_expert_used, n_tokens]
-    cb(experts, "ffn_moe_down", il);
+        switch (type_op) {
+            case LLM_FFN_SILU:
+                {
+                    gate = ggml_silu(ctx, gate);
+                    cb(gate, "ffn_moe_silu", il);
+                } break;
+            case LLM_FFN_GELU:
+                {
+                    gate = ggml_gelu(ctx, gate);
+                    cb(gate, "ffn_moe_gelu", il);
+                } break;
+            default:
+                GGML_ASSERT(false);
+        }
 
-    experts = ggml_mul(ctx, experts, weights);
+        ggml_tensor * par = ggml_mul(ctx, up, gate); // [n_ff, n_expert_used, n_tokens]
+        cb(par, "ffn_moe_gate_par", il);
 
-    // aggregate experts
-    ggml_tensor * moe_out = nullptr;
-    for (int i = 0; i < n_expert_used; ++i) {
-        ggml_tensor * cur_expert = ggml_view_2d(ctx, experts, n_embd, n_tokens,
-                experts->nb[2], i*experts->nb[1]);
+        ggml_tensor * experts = mul_mat_id(down_exps, par); // [n_embd, n_expert_used, n_tokens]
+        cb(experts, "ffn_moe_down", il);
+
+        return experts;
+    };
+
+    ggml_tensor * experts;
+    if (up_exps_gpu) {
+        // the hot experts are computed from their copies in vram, and the
+        // others from host memory, each leaving the rows of the other zero
+        uint32_t exps_cpu_mask[GGML_MAX_MASKED_EXPERTS/32] = {};
+        for (int64_t x = 0; x < n_expert; ++x) {
+            if (!(exps_gpu_mask[x/32] >> (x%32) & 1)) {
+                exps_cpu_mask[x/32] |= 1u << (x%32);
+            }
+        }
+        experts = ggml_add(ctx,
+                build_experts(up_exps_gpu, gate_exps_gpu, down_exps_gpu, exps_gpu_mask, true),
+                build_experts(up_exps, gate_exps, down_exps, exps_cpu_mask, false));
+        cb(experts, "ffn_moe_down_split", il);
+    } else {
+        experts = build_experts(up_exps, gate_exps, down_exps, nullptr, false);
+    }
+
+    experts = ggml_mul(ctx, experts, weights);
+
+    // aggregate experts
+    ggml_tensor * moe_out = nullptr;
+    for (int i = 0; i < n_expert_used; ++i) {
+        ggml_tensor * cur_expert = ggml_view_2d(ctx, experts, n_embd, n_tokens,
+                experts->nb[2], i*experts->nb[1]);
 
         if (i == 0) {
             moe_out = cur_expert;
@@ -6291,6 +8255,7 @@ static struct ggml_tensor * llm_build_moe_ffn(
 
 static struct ggml_tensor * llm_build_kqv(
         struct ggml_context * ctx,
+       struct llama_context & lctx,
           const llama_model & model,
         const llama_hparams & hparams,
         const llama_cparams & cparams,
@@ -6420,7 +8385,7 @@ static struct ggml_tensor * llm_build_kqv(
 
     ggml_build_forward_expand(graph, cur);
 
-    cur = ggml_mul_mat(ctx, wo, cur);
+    cur = llm_build_lora_mm(ctx, lctx, wo, cur);
     if (wo_b) {
         cb(cur, "kqv_wo", il);
     }
@@ -6434,6 +8399,7 @@ static struct ggml_tensor * llm_build_kqv(
 
 static struct ggml_tensor * llm_build_kv(
         struct ggml_context * ctx,
+       struct llama_context & lctx,
           const llama_model & model,
         const llama_hparams & hparams,
         const llama_cparams & cparams,
@@ -6463,7 +8429,7 @@ static struct ggml_tensor * llm_build_kv(
 
     struct ggml_tensor * cur;
 
-    cur  = llm_build_kqv(ctx, model, hparams, cparams, kv, graph, wo, wo_b,
+    cur  = llm_build_kqv(ctx, lctx, model, hparams, cparams, kv, graph, wo, wo_b,
             q_cur, kq_mask, kq_pos, n_tokens, n_kv, kq_scale, cb, il);
     cb(cur, "kqv_out", il);
 
@@ -6479,7 +8445,7 @@ struct llm_build_context {
     const llama_kv_cache & kv_self;
 
     const int64_t n_embd;
-    const int64_t n_layer;
+    const int64_t n_layer; // evaluated, fewer than the model's after llama_set_n_layer_exit()
     const int64_t n_rot;
     const int64_t n_ctx;       // user-specified context size (can be different from n_ctx_train)
     const int64_t n_head;
@@ -6530,7 +8496,7 @@ struct llm_build_context {
         batch            (batch),
         kv_self          (lctx.kv_self),
         n_embd           (hparams.n_embd),
-        n_layer          (hparams.n_layer),
+        n_layer          (cparams.n_layer_exit > 0 ? std::min((int64_t) cparams.n_layer_exit, (int64_t) hparams.n_layer) : hparams.n_layer),
         n_rot            (hparams.n_rot),
         n_ctx            (cparams.n_ctx),
         n_head           (hparams.n_head),
@@ -6571,6 +8537,10 @@ struct llm_build_context {
 
         ctx0 = ggml_init(params);
 
+        // nobody looks at the names of intermediate views unless an eval
+        // callback is installed, so don't spend time formatting them
+        ggml_set_no_names(ctx0, lctx.cparams.cb_eval == nullptr);
+
         lctx.inp_tokens = nullptr;
         lctx.inp_embd = nullptr;
         lctx.inp_pos = nullptr;
@@ -6583,6 +8553,34 @@ struct llm_build_context {
         lctx.inp_s_copy = nullptr;
         lctx.inp_s_mask = nullptr;
         lctx.inp_s_seq = nullptr;
+
+        lctx.inp_lora_scale.clear();
+        lctx.lora_scale_out.clear();
+        for (size_t i = 0; i < lctx.lora_batch.size(); ++i) {
+            struct ggml_tensor * scale = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, 1, n_tokens);
+            cb(scale, "inp_lora_scale", -1);
+            ggml_set_input(scale);
+            lctx.inp_lora_scale.push_back(scale);
+            lctx.lora_scale_out.push_back(nullptr);
+        }
+
+        lctx.inp_steer_rows = nullptr;
+        lctx.inp_steer_out  = nullptr;
+        if (lctx.steer_bias || lctx.steer_cvec) {
+            lctx.inp_steer_rows = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
+            cb(lctx.inp_steer_rows, "inp_steer_rows", -1);
+            ggml_set_input(lctx.inp_steer_rows);
+            lctx.inp_steer_out = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_outputs);
+            cb(lctx.inp_steer_out, "inp_steer_out", -1);
+            ggml_set_input(lctx.inp_steer_out);
+        }
+
+        lctx.inp_shortlist = nullptr;
+        if (lctx.shortlist_batch) {
+            lctx.inp_shortlist = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, lctx.shortlist.size());
+            cb(lctx.inp_shortlist, "inp_shortlist", -1);
+            ggml_set_input(lctx.inp_shortlist);
+        }
     }
 
     void free() {
@@ -6596,23 +8594,36 @@ struct llm_build_context {
         struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, LLAMA_MAX_NODES, false);
 
         GGML_ASSERT(kv_self.size == n_ctx);
+        GGML_ASSERT(kv_self.shift_begin < kv_self.shift_end && kv_self.shift_end <= kv_self.size);
 
-        lctx.inp_K_shift = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_ctx);
+        const int64_t n_shift = kv_self.shift_end - kv_self.shift_begin;
+
+        lctx.inp_K_shift = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_shift);
         cb(lctx.inp_K_shift, "K_shift", -1);
         ggml_set_input(lctx.inp_K_shift);
 
-        for (int il = 0; il < n_layer; ++il) {
-            struct ggml_tensor * tmp =
-                // we rotate only the first n_rot dimensions
-                ggml_rope_custom_inplace(ctx0,
-                        ggml_view_3d(ctx0, kv_self.k_l[il],
-                            n_embd_head_k, n_head_kv, n_ctx,
-                            ggml_row_size(kv_self.k_l[il]->type, n_embd_head_k),
-                            ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa),
-                            0),
-                        lctx.inp_K_shift, n_rot, rope_type, 0, n_orig_ctx, freq_base, freq_scale,
-                        ext_factor, attn_factor, beta_fast, beta_slow);
+        for (int il = 0; il < (int) hparams.n_layer; ++il) {
+            struct ggml_tensor * k =
+                ggml_view_3d(ctx0, kv_self.k_l[il],
+                    n_embd_head_k, n_head_kv, n_shift,
+                    ggml_row_size(kv_self.k_l[il]->type, n_embd_head_k),
+                    ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa),
+                    ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa)*kv_self.shift_begin);
+
+            struct ggml_tensor * tmp = k;
+            if (k->type == GGML_TYPE_BF16) {
+                // the rope op only knows f32 and f16, so round trip through f32
+                tmp = ggml_cast(ctx0, k, GGML_TYPE_F32);
+                cb(tmp, "K_f32", il);
+            }
+            // we rotate only the first n_rot dimensions
+            tmp = ggml_rope_custom_inplace(ctx0, tmp,
+                    lctx.inp_K_shift, n_rot, rope_type, 0, n_orig_ctx, freq_base, freq_scale,
+                    ext_factor, attn_factor, beta_fast, beta_slow);
             cb(tmp, "K_shifted", il);
+            if (k->type == GGML_TYPE_BF16) {
+                tmp = ggml_cpy(ctx0, tmp, k);
+            }
             ggml_build_forward_expand(gf, tmp);
         }
 
@@ -6626,7 +8637,7 @@ struct llm_build_context {
 
         struct ggml_tensor * state_copy = build_inp_s_copy();
 
-        for (int il = 0; il < n_layer; ++il) {
+        for (int il = 0; il < (int) hparams.n_layer; ++il) {
             struct ggml_tensor * conv_states = ggml_reshape_2d(ctx0, kv_self.k_l[il], hparams.n_embd_k_s(), kv_self.size);
             struct ggml_tensor * ssm_states  = ggml_reshape_2d(ctx0, kv_self.v_l[il], hparams.n_embd_v_s(), kv_self.size);
 
@@ -6658,7 +8669,7 @@ struct llm_build_context {
                 nm++;
             }
 
-            for (int il = 0; il < n_layer; ++il) {
+            for (int il = 0; il < (int) hparams.n_layer; ++il) {
                 ggml_tensor * view_k_src = ggml_view_2d(ctx0, kv_self.k_l[il],
                         n_embd_k_gqa, nm,
                         ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa),
@@ -6707,6 +8718,40 @@ struct llm_build_context {
         return gf;
     }
 
+    // the cpu backend has fused kernels for the norm -> matmul and the
+    // swiglu part of a layer, which only pay off for small batches where
+    // the cost is dominated by memory traffic rather than compute
+    bool can_fuse(std::initializer_list<const ggml_tensor *> ws) const {
+        if (n_tokens >= 32) {
+            return false;
+        }
+        for (const ggml_tensor * w : ws) {
+            if (!w || !w->buffer || !ggml_backend_buffer_is_host(w->buffer)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // the type that a fused norm should output so that none of the
+    // matrices reading it have to convert it again
+    static ggml_type fused_norm_type(std::initializer_list<const ggml_tensor *> ws) {
+        ggml_type type = GGML_TYPE_COUNT;
+        for (const ggml_tensor * w : ws) {
+            const ggml_type vec_dot_type = ggml_internal_get_type_traits(w->type).vec_dot_type;
+            if (type != GGML_TYPE_COUNT && type != vec_dot_type) {
+                return GGML_TYPE_F32;
+            }
+            type = vec_dot_type;
+        }
+        if (type == GGML_TYPE_COUNT ||
+            !ggml_internal_get_type_traits(type).from_float ||
+            (*ws.begin())->ne[0] % ggml_blck_size(type) != 0) {
+            return GGML_TYPE_F32;
+        }
+        return type;
+    }
+
     struct ggml_tensor * build_inp_pos() {
         lctx.inp_pos = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
         cb(lctx.inp_pos, "inp_pos", -1);
@@ -6805,29 +8850,34 @@ struct llm_build_context {
             struct ggml_tensor * inpSA = inpL;
 
             // norm
-            cur = llm_build_norm(ctx0, inpL, hparams,
-                    model.layers[il].attn_norm, NULL,
-                    LLM_NORM_RMS, cb, il);
+            if (can_fuse({model.layers[il].attn_norm, model.layers[il].wq, model.layers[il].wk, model.layers[il].wv})) {
+                cur = ggml_rms_norm_mul(ctx0, inpL, model.layers[il].attn_norm, hparams.f_norm_rms_eps,
+                        fused_norm_type({model.layers[il].wq, model.layers[il].wk, model.layers[il].wv}));
+            } else {
+                cur = llm_build_norm(ctx0, inpL, hparams,
+                        model.layers[il].attn_norm, NULL,
+                        LLM_NORM_RMS, cb, il);
+            }
             cb(cur, "attn_norm", il);
 
             // self-attention
             {
                 // compute Q and K and RoPE them
-                struct ggml_tensor * Qcur = ggml_mul_mat(ctx0, model.layers[il].wq, cur);
+                struct ggml_tensor * Qcur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wq, cur);
                 cb(Qcur, "Qcur", il);
                 if (model.layers[il].bq) {
                     Qcur = ggml_add(ctx0, Qcur, model.layers[il].bq);
                     cb(Qcur, "Qcur", il);
                 }
 
-                struct ggml_tensor * Kcur = ggml_mul_mat(ctx0, model.layers[il].wk, cur);
+                struct ggml_tensor * Kcur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wk, cur);
                 cb(Kcur, "Kcur", il);
                 if (model.layers[il].bk) {
                     Kcur = ggml_add(ctx0, Kcur, model.layers[il].bk);
                     cb(Kcur, "Kcur", il);
                 }
 
-                struct ggml_tensor * Vcur = ggml_mul_mat(ctx0, model.layers[il].wv, cur);
+                struct ggml_tensor * Vcur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wv, cur);
                 cb(Vcur, "Vcur", il);
                 if (model.layers[il].bv) {
                     Vcur = ggml_add(ctx0, Vcur, model.layers[il].bv);
@@ -6848,7 +8898,7 @@ struct llm_build_context {
                 );
                 cb(Kcur, "Kcur", il);
 
-                cur = llm_build_kv(ctx0, model, hparams, cparams, kv_self, gf,
+                cur = llm_build_kv(ctx0, lctx, model, hparams, cparams, kv_self, gf,
                         model.layers[il].wo, model.layers[il].bo,
                         Kcur, Vcur, Qcur, KQ_mask, nullptr, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
@@ -6865,13 +8915,42 @@ struct llm_build_context {
             cb(ffn_inp, "ffn_inp", il);
 
             // feed-forward network
-            if (model.layers[il].ffn_gate_inp == nullptr) {
+            if (model.layers[il].ffn_pred_a &&
+                model.layers[il].ffn_gate->type == model.layers[il].ffn_up->type &&
+                can_fuse({model.layers[il].ffn_norm, model.layers[il].ffn_gate, model.layers[il].ffn_up,
+                          model.layers[il].ffn_pred_a, model.layers[il].ffn_pred_b})) {
+                cur = ggml_rms_norm_mul(ctx0, ffn_inp, model.layers[il].ffn_norm, hparams.f_norm_rms_eps,
+                        fused_norm_type({model.layers[il].ffn_gate, model.layers[il].ffn_pred_a}));
+                cb(cur, "ffn_norm", il);
+
+                cur = llm_build_ffn_sparse(ctx0, cur,
+                        model.layers[il].ffn_up,
+                        model.layers[il].ffn_gate,
+                        model.layers[il].ffn_down,
+                        can_fuse({model.layers[il].ffn_down_t}) ? model.layers[il].ffn_down_t : NULL,
+                        model.layers[il].ffn_pred_a,
+                        model.layers[il].ffn_pred_b,
+                        cb, il);
+                cb(cur, "ffn_out", il);
+            } else if (model.layers[il].ffn_gate_inp == nullptr &&
+                model.layers[il].ffn_gate->type == model.layers[il].ffn_up->type &&
+                can_fuse({model.layers[il].ffn_norm, model.layers[il].ffn_gate, model.layers[il].ffn_up, model.layers[il].ffn_down})) {
+                cur = ggml_rms_norm_mul(ctx0, ffn_inp, model.layers[il].ffn_norm, hparams.f_norm_rms_eps,
+                        fused_norm_type({model.layers[il].ffn_gate}));
+                cb(cur, "ffn_norm", il);
+
+                cur = ggml_mul_mat_swiglu(ctx0, model.layers[il].ffn_gate, model.layers[il].ffn_up, cur);
+                cb(cur, "ffn_gate_par", il);
+
+                cur = ggml_mul_mat(ctx0, model.layers[il].ffn_down, cur);
+                cb(cur, "ffn_out", il);
+            } else if (model.layers[il].ffn_gate_inp == nullptr) {
                 cur = llm_build_norm(ctx0, ffn_inp, hparams,
                         model.layers[il].ffn_norm, NULL,
                         LLM_NORM_RMS, cb, il);
                 cb(cur, "ffn_norm", il);
 
-                cur = llm_build_ffn(ctx0, cur,
+                cur = llm_build_ffn(ctx0, lctx, cur,
                         model.layers[il].ffn_up,   NULL,
                         model.layers[il].ffn_gate, NULL,
                         model.layers[il].ffn_down, NULL,
@@ -6890,6 +8969,10 @@ struct llm_build_context {
                         model.layers[il].ffn_up_exps,
                         model.layers[il].ffn_gate_exps,
                         model.layers[il].ffn_down_exps,
+                        model.layers[il].ffn_up_exps_gpu,
+                        model.layers[il].ffn_gate_exps_gpu,
+                        model.layers[il].ffn_down_exps_gpu,
+                        model.layers[il].ffn_exps_gpu_mask,
                         n_expert, n_expert_used,
                         LLM_FFN_SILU, true,
                         cb, il);
@@ -6899,10 +8982,7 @@ struct llm_build_context {
             cur = ggml_add(ctx0, cur, ffn_inp);
             cb(cur, "ffn_out", il);
 
-            ggml_tensor * layer_dir = lctx.cvec.tensor_for(il);
-            if (layer_dir != nullptr) {
-                cur = ggml_add(ctx0, cur, layer_dir);
-            }
+            cur = llm_build_cvec(ctx0, lctx, cur, il);
             cb(cur, "l_out", il);
 
             // input for next layer
@@ -6917,7 +8997,7 @@ struct llm_build_context {
         cb(cur, "result_norm", -1);
 
         // lm_head
-        cur = ggml_mul_mat(ctx0, model.output, cur);
+        cur = llm_build_output(ctx0, lctx, model.output, cur);
         cb(cur, "result_output", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -6956,13 +9036,13 @@ struct llm_build_context {
 
             // self-attention
             {
-                struct ggml_tensor * Qcur = ggml_mul_mat(ctx0, model.layers[il].wq, cur);
+                struct ggml_tensor * Qcur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wq, cur);
                 cb(Qcur, "Qcur", il);
 
-                struct ggml_tensor * Kcur = ggml_mul_mat(ctx0, model.layers[il].wk, cur);
+                struct ggml_tensor * Kcur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wk, cur);
                 cb(Kcur, "Kcur", il);
 
-                struct ggml_tensor * Vcur = ggml_mul_mat(ctx0, model.layers[il].wv, cur);
+                struct ggml_tensor * Vcur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wv, cur);
                 cb(Vcur, "Vcur", il);
 
                 switch (model.type) {
@@ -6988,7 +9068,7 @@ struct llm_build_context {
                 cb(Qcur, "Qcur", il);
                 cb(Kcur, "Kcur", il);
 
-                cur = llm_build_kv(ctx0, model, hparams, cparams, kv_self, gf,
+                cur = llm_build_kv(ctx0, lctx, model, hparams, cparams, kv_self, gf,
                         model.layers[il].wo, NULL,
                         Kcur, Vcur, Qcur, KQ_mask, KQ_pos, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
@@ -7010,7 +9090,7 @@ struct llm_build_context {
                         LLM_NORM_RMS, cb, il);
                 cb(cur, "ffn_norm", il);
 
-                cur = llm_build_ffn(ctx0, cur,
+                cur = llm_build_ffn(ctx0, lctx, cur,
                         model.layers[il].ffn_up,   NULL,
                         model.layers[il].ffn_gate, NULL,
                         model.layers[il].ffn_down, NULL,
@@ -7034,7 +9114,7 @@ struct llm_build_context {
         cb(cur, "result_norm", -1);
 
         // lm_head
-        cur = ggml_mul_mat(ctx0, model.output, cur);
+        cur = llm_build_output(ctx0, lctx, model.output, cur);
         cb(cur, "result_output", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -7073,13 +9153,13 @@ struct llm_build_context {
 
             // self-attention
             {
-                struct ggml_tensor * Qcur = ggml_mul_mat(ctx0, model.layers[il].wq, cur);
+                struct ggml_tensor * Qcur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wq, cur);
                 cb(Qcur, "Qcur", il);
 
-                struct ggml_tensor * Kcur = ggml_mul_mat(ctx0, model.layers[il].wk, cur);
+                struct ggml_tensor * Kcur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wk, cur);
                 cb(Kcur, "Kcur", il);
 
-                struct ggml_tensor * Vcur = ggml_mul_mat(ctx0, model.layers[il].wv, cur);
+                struct ggml_tensor * Vcur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wv, cur);
                 cb(Vcur, "Vcur", il);
 
                 Qcur = ggml_rope_custom(
@@ -7095,7 +9175,7 @@ struct llm_build_context {
                     ext_factor, attn_factor, beta_fast, beta_slow
                 );
                 cb(Kcur, "Kcur", il);
-                cur = llm_build_kv(ctx0, model, hparams, cparams, kv_self, gf,
+                cur = llm_build_kv(ctx0, lctx, model, hparams, cparams, kv_self, gf,
                         model.layers[il].wo, NULL,
                         Kcur, Vcur, Qcur, KQ_mask, KQ_pos, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
@@ -7117,7 +9197,7 @@ struct llm_build_context {
                         LLM_NORM_RMS, cb, il);
                 cb(cur, "ffn_norm", il);
 
-                cur = llm_build_ffn(ctx0, cur,
+                cur = llm_build_ffn(ctx0, lctx, cur,
                         model.layers[il].ffn_up,   NULL,
                         model.layers[il].ffn_gate, NULL,
                         model.layers[il].ffn_down, NULL,
@@ -7139,7 +9219,7 @@ struct llm_build_context {
         cb(cur, "result_norm", -1);
 
         // lm_head
-        cur = ggml_mul_mat(ctx0, model.output, cur);
+        cur = llm_build_output(ctx0, lctx, model.output, cur);
         cb(cur, "result_output", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -7188,7 +9268,7 @@ struct llm_build_context {
                     cur = attn_norm;
                 }
 
-                cur = ggml_mul_mat(ctx0, model.layers[il].wqkv, cur);
+                cur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wqkv, cur);
                 cb(cur, "wqkv", il);
 
                 struct ggml_tensor * Qcur = ggml_cont(ctx0, ggml_view_2d(ctx0, cur, n_embd,     n_tokens, cur->nb[1], 0*sizeof(float)*(n_embd)));
@@ -7215,7 +9295,7 @@ struct llm_build_context {
                 );
                 cb(Kcur, "Kcur", il);
 
-                cur = llm_build_kv(ctx0, model, hparams, cparams, kv_self, gf,
+                cur = llm_build_kv(ctx0, lctx, model, hparams, cparams, kv_self, gf,
                         model.layers[il].wo, NULL,
                         Kcur, Vcur, Qcur, KQ_mask, nullptr, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
@@ -7232,7 +9312,7 @@ struct llm_build_context {
 
             // feed forward
             {
-                cur = llm_build_ffn(ctx0, attn_norm, // !! use the attn norm, not the result
+                cur = llm_build_ffn(ctx0, lctx, attn_norm, // !! use the attn norm, not the result
                         model.layers[il].ffn_up,   NULL,
                         NULL,                      NULL,
                         model.layers[il].ffn_down, NULL,
@@ -7260,7 +9340,7 @@ struct llm_build_context {
                 LLM_NORM, cb, -1);
         cb(cur, "result_norm", -1);
 
-        cur = ggml_mul_mat(ctx0, model.output, cur);
+        cur = llm_build_output(ctx0, lctx, model.output, cur);
         cb(cur, "result_output", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -7305,21 +9385,21 @@ struct llm_build_context {
             // self-attention
             {
                 // compute Q and K and RoPE them
-                struct ggml_tensor * Qcur = ggml_mul_mat(ctx0, model.layers[il].wq, cur);
+                struct ggml_tensor * Qcur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wq, cur);
                 cb(Qcur, "Qcur", il);
                 if (model.layers[il].bq) {
                     Qcur = ggml_add(ctx0, Qcur, model.layers[il].bq);
                     cb(Qcur, "Qcur", il);
                 }
 
-                struct ggml_tensor * Kcur = ggml_mul_mat(ctx0, model.layers[il].wk, cur);
+                struct ggml_tensor * Kcur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wk, cur);
                 cb(Kcur, "Kcur", il);
                 if (model.layers[il].bk) {
                     Kcur = ggml_add(ctx0, Kcur, model.layers[il].bk);
                     cb(Kcur, "Kcur", il);
                 }
 
-                struct ggml_tensor * Vcur = ggml_mul_mat(ctx0, model.layers[il].wv, cur);
+                struct ggml_tensor * Vcur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wv, cur);
                 cb(Vcur, "Vcur", il);
                 if (model.layers[il].bv) {
                     Vcur = ggml_add(ctx0, Vcur, model.layers[il].bv);
@@ -7340,7 +9420,7 @@ struct llm_build_context {
                 );
                 cb(Kcur, "Kcur", il);
 
-                cur = llm_build_kv(ctx0, model, hparams, cparams, kv_self, gf,
+                cur = llm_build_kv(ctx0, lctx, model, hparams, cparams, kv_self, gf,
                         model.layers[il].wo, model.layers[il].bo,
                         Kcur, Vcur, Qcur, KQ_mask, nullptr, n_tokens, kv_head, n_kv, 1.0f, cb, il);
             }
@@ -7377,6 +9457,10 @@ struct llm_build_context {
                     model.layers[il].ffn_up_exps,
                     model.layers[il].ffn_gate_exps,
                     model.layers[il].ffn_down_exps,
+                    model.layers[il].ffn_up_exps_gpu,
+                    model.layers[il].ffn_gate_exps_gpu,
+                    model.layers[il].ffn_down_exps_gpu,
+                    model.layers[il].ffn_exps_gpu_mask,
                     n_expert, n_expert_used,
                     LLM_FFN_GELU, true,
                     cb, il);
@@ -7395,10 +9479,7 @@ struct llm_build_context {
             cur = ggml_add(ctx0, cur, ffn_inp);
             cb(cur, "ffn_out", il);
 
-            ggml_tensor * layer_dir = lctx.cvec.tensor_for(il);
-            if (layer_dir != nullptr) {
-                cur = ggml_add(ctx0, cur, layer_dir);
-            }
+            cur = llm_build_cvec(ctx0, lctx, cur, il);
             cb(cur, "l_out", il);
 
             // input for next layer
@@ -7413,7 +9494,7 @@ struct llm_build_context {
         cb(cur, "result_norm", -1);
 
         // lm_head
-        cur = ggml_mul_mat(ctx0, model.output, cur);
+        cur = llm_build_output(ctx0, lctx, model.output, cur);
 
         // Grok
         // multiply logits by output_multiplier_scale of 0.5773502691896257
@@ -7464,7 +9545,7 @@ struct llm_build_context {
                 struct ggml_tensor * Kcur = nullptr;
                 struct ggml_tensor * Vcur = nullptr;
 
-                cur = ggml_mul_mat(ctx0, model.layers[il].wqkv, cur);
+                cur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wqkv, cur);
                 cb(cur, "wqkv", il);
 
                 cur = ggml_clamp(ctx0, cur, -hparams.f_clamp_kqv, hparams.f_clamp_kqv);
@@ -7492,7 +9573,7 @@ struct llm_build_context {
                 );
                 cb(Kcur, "Kcur", il);
 
-                cur = llm_build_kv(ctx0, model, hparams, cparams, kv_self, gf,
+                cur = llm_build_kv(ctx0, lctx, model, hparams, cparams, kv_self, gf,
                         model.layers[il].wo, NULL,
                         Kcur, Vcur, Qcur, KQ_mask, nullptr, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
@@ -7520,6 +9601,10 @@ struct llm_build_context {
                     model.layers[il].ffn_up_exps,
                     model.layers[il].ffn_gate_exps,
                     model.layers[il].ffn_down_exps,
+                    model.layers[il].ffn_up_exps_gpu,
+                    model.layers[il].ffn_gate_exps_gpu,
+                    model.layers[il].ffn_down_exps_gpu,
+                    model.layers[il].ffn_exps_gpu_mask,
                     n_expert, n_expert_used,
                     LLM_FFN_SILU, true,
                     cb, il);
@@ -7528,10 +9613,7 @@ struct llm_build_context {
             cur = ggml_add(ctx0, cur, ffn_inp);
             cb(cur, "ffn_out", il);
 
-            ggml_tensor * layer_dir = lctx.cvec.tensor_for(il);
-            if (layer_dir != nullptr) {
-                cur = ggml_add(ctx0, cur, layer_dir);
-            }
+            cur = llm_build_cvec(ctx0, lctx, cur, il);
             cb(cur, "l_out", il);
 
             // input for next layer
@@ -7546,7 +9628,7 @@ struct llm_build_context {
         cb(cur, "result_norm", -1);
 
         // lm_head
-        cur = ggml_mul_mat(ctx0, model.output, cur);
+        cur = llm_build_output(ctx0, lctx, model.output, cur);
 
         cb(cur, "result_output", -1);
 
@@ -7588,7 +9670,7 @@ struct llm_build_context {
 
             // self-attention
             {
-                cur = ggml_mul_mat(ctx0, model.layers[il].wqkv, cur);
+                cur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wqkv, cur);
                 cb(cur, "wqkv", il);
 
                 cur = ggml_add(ctx0, cur, model.layers[il].bqkv);
@@ -7604,7 +9686,7 @@ struct llm_build_context {
 
                 Qcur = ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens);
 
-                cur = llm_build_kv(ctx0, model, hparams, cparams, kv_self, gf,
+                cur = llm_build_kv(ctx0, lctx, model, hparams, cparams, kv_self, gf,
                         model.layers[il].wo, model.layers[il].bo,
                         Kcur, Vcur, Qcur, KQ_mask, nullptr, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
@@ -7628,7 +9710,7 @@ struct llm_build_context {
                         LLM_NORM, cb, il);
                 cb(cur, "ffn_norm", il);
 
-                cur = llm_build_ffn(ctx0, cur,
+                cur = llm_build_ffn(ctx0, lctx, cur,
                         model.layers[il].ffn_up,   model.layers[il].ffn_up_b,
                         NULL,                      NULL,
                         model.layers[il].ffn_down, model.layers[il].ffn_down_b,
@@ -7647,7 +9729,7 @@ struct llm_build_context {
                 LLM_NORM, cb, -1);
         cb(cur, "result_norm", -1);
 
-        cur = ggml_mul_mat(ctx0, model.output, cur);
+        cur = llm_build_output(ctx0, lctx, model.output, cur);
         cb(cur, "result_output", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -7684,7 +9766,7 @@ struct llm_build_context {
 
             // self attention
             {
-                cur = ggml_mul_mat(ctx0, model.layers[il].wqkv, cur);
+                cur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wqkv, cur);
                 cb(cur, "wqkv", il);
 
                 cur = ggml_add(ctx0, cur, model.layers[il].bqkv);
@@ -7808,7 +9890,7 @@ struct llm_build_context {
                         );
                 cb(Vcur, "Vcur", il);
 
-                cur = llm_build_kv(ctx0, model, hparams, cparams, kv_self, gf,
+                cur = llm_build_kv(ctx0, lctx, model, hparams, cparams, kv_self, gf,
                         model.layers[il].wo, model.layers[il].bo,
                         Kcur, Vcur, Q, KQ_mask, nullptr, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
@@ -7831,7 +9913,7 @@ struct llm_build_context {
                         LLM_NORM, cb, il);
                 cb(cur, "ffn_norm", il);
 
-                cur = llm_build_ffn(ctx0, cur,
+                cur = llm_build_ffn(ctx0, lctx, cur,
                         model.layers[il].ffn_up,   model.layers[il].ffn_up_b,
                         NULL,                      NULL,
                         model.layers[il].ffn_down, model.layers[il].ffn_down_b,
@@ -7854,7 +9936,7 @@ struct llm_build_context {
                 LLM_NORM, cb, -1);
         cb(cur, "result_norm", -1);
 
-        cur = ggml_mul_mat(ctx0, model.output, cur);
+        cur = llm_build_output(ctx0, lctx, model.output, cur);
         cb(cur, "result_output", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -7889,13 +9971,13 @@ struct llm_build_context {
 
             // self-attention
             {
-                struct ggml_tensor * Qcur = ggml_mul_mat(ctx0, model.layers[il].wq, cur);
+                struct ggml_tensor * Qcur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wq, cur);
                 cb(Qcur, "Qcur", il);
 
-                struct ggml_tensor * Kcur = ggml_mul_mat(ctx0, model.layers[il].wk, cur);
+                struct ggml_tensor * Kcur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wk, cur);
                 cb(Kcur, "Kcur", il);
 
-                struct ggml_tensor * Vcur = ggml_mul_mat(ctx0, model.layers[il].wv, cur);
+                struct ggml_tensor * Vcur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wv, cur);
                 cb(Vcur, "Vcur", il);
 
                 Kcur = ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens);
@@ -7904,7 +9986,7 @@ struct llm_build_context {
                 Qcur = ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head,    n_tokens);
                 cb(Qcur, "Qcur", il);
 
-                cur = llm_build_kv(ctx0, model, hparams, cparams, kv_self, gf,
+                cur = llm_build_kv(ctx0, lctx, model, hparams, cparams, kv_self, gf,
                         model.layers[il].wo, NULL,
                         Kcur, Vcur, Qcur, KQ_mask, KQ_pos, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
@@ -7926,7 +10008,7 @@ struct llm_build_context {
                         LLM_NORM_RMS, cb, il);
                 cb(cur, "ffn_norm", il);
 
-                cur = llm_build_ffn(ctx0, cur,
+                cur = llm_build_ffn(ctx0, lctx, cur,
                         model.layers[il].ffn_up,   NULL,
                         model.layers[il].ffn_gate, NULL,
                         model.layers[il].ffn_down, NULL,
@@ -7950,7 +10032,7 @@ struct llm_build_context {
         cb(cur, "result_norm", -1);
 
         // lm_head
-        cur = ggml_mul_mat(ctx0, model.output, cur);
+        cur = llm_build_output(ctx0, lctx, model.output, cur);
         cb(cur, "result_output", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -8001,20 +10083,20 @@ struct llm_build_context {
 
             // self-attention
             if (model.arch == LLM_ARCH_BERT) {
-                Qcur = ggml_add(ctx0, ggml_mul_mat(ctx0, model.layers[il].wq, cur), model.layers[il].bq);
+                Qcur = ggml_add(ctx0, llm_build_lora_mm(ctx0, lctx, model.layers[il].wq, cur), model.layers[il].bq);
                 cb(Qcur, "Qcur", il);
 
-                Kcur = ggml_add(ctx0, ggml_mul_mat(ctx0, model.layers[il].wk, cur), model.layers[il].bk);
+                Kcur = ggml_add(ctx0, llm_build_lora_mm(ctx0, lctx, model.layers[il].wk, cur), model.layers[il].bk);
                 cb(Kcur, "Kcur", il);
 
-                Vcur = ggml_add(ctx0, ggml_mul_mat(ctx0, model.layers[il].wv, cur), model.layers[il].bv);
+                Vcur = ggml_add(ctx0, llm_build_lora_mm(ctx0, lctx, model.layers[il].wv, cur), model.layers[il].bv);
                 cb(Vcur, "Vcur", il);
 
                 Qcur = ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head,    n_tokens);
                 Kcur = ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens);
             } else {
                 // compute Q and K and RoPE them
-                cur = ggml_mul_mat(ctx0, model.layers[il].wqkv, cur);
+                cur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wqkv, cur);
                 cb(cur, "wqkv", il);
 
                 Qcur = ggml_cont(ctx0, ggml_view_2d(ctx0, cur, n_embd,     n_tokens, cur->nb[1], 0*sizeof(float)*(n_embd)));
@@ -8063,7 +10145,7 @@ struct llm_build_context {
 
             ggml_build_forward_expand(gf, cur);
 
-            cur = ggml_mul_mat(ctx0, model.layers[il].wo, cur);
+            cur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wo, cur);
             if (model.layers[il].bo) {
                 cb(cur, "kqv_wo", il);
             }
@@ -8091,14 +10173,14 @@ struct llm_build_context {
 
             // feed-forward network
             if (model.arch == LLM_ARCH_BERT) {
-                cur = llm_build_ffn(ctx0, cur,
+                cur = llm_build_ffn(ctx0, lctx, cur,
                         model.layers[il].ffn_up,   model.layers[il].ffn_up_b,
                         NULL,                      NULL,
                         model.layers[il].ffn_down, model.layers[il].ffn_down_b,
                         NULL,
                         LLM_FFN_GELU, LLM_FFN_SEQ, cb, il);
             } else {
-                cur = llm_build_ffn(ctx0, cur,
+                cur = llm_build_ffn(ctx0, lctx, cur,
                         model.layers[il].ffn_up,   NULL,
                         model.layers[il].ffn_gate, NULL,
                         model.layers[il].ffn_down, NULL,
@@ -8181,7 +10263,7 @@ struct llm_build_context {
 
             // self-attention
             {
-                cur = ggml_mul_mat(ctx0, model.layers[il].wqkv, cur);
+                cur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wqkv, cur);
                 cb(cur, "wqkv", il);
 
                 cur = ggml_add(ctx0, cur, model.layers[il].bqkv);
@@ -8197,7 +10279,7 @@ struct llm_build_context {
 
                 Qcur = ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens);
 
-                cur = llm_build_kv(ctx0, model, hparams, cparams, kv_self, gf,
+                cur = llm_build_kv(ctx0, lctx, model, hparams, cparams, kv_self, gf,
                         model.layers[il].wo, model.layers[il].bo,
                         Kcur, Vcur, Qcur, KQ_mask, KQ_pos, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
@@ -8221,7 +10303,7 @@ struct llm_build_context {
                         LLM_NORM, cb, il);
                 cb(cur, "ffn_norm", il);
 
-                cur = llm_build_ffn(ctx0, cur,
+                cur = llm_build_ffn(ctx0, lctx, cur,
                         model.layers[il].ffn_up,   model.layers[il].ffn_up_b,
                         NULL,                      NULL,
                         model.layers[il].ffn_down, model.layers[il].ffn_down_b,
@@ -8240,7 +10322,7 @@ struct llm_build_context {
                 LLM_NORM, cb, -1);
         cb(cur, "result_norm", -1);
 
-        cur = ggml_mul_mat(ctx0, model.output, cur);
+        cur = llm_build_output(ctx0, lctx, model.output, cur);
         cb(cur, "result_output", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -8290,7 +10372,7 @@ struct llm_build_context {
             {
                 cur = attn_norm;
 
-                cur = ggml_mul_mat(ctx0, model.layers[il].wqkv, cur);
+                cur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wqkv, cur);
                 cb(cur, "wqkv", il);
 
                 if (model.layers[il].bqkv){
@@ -8328,13 +10410,13 @@ struct llm_build_context {
                     Qcur = ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head,    n_tokens);
                     Kcur = ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens);
 
-                    cur = llm_build_kv(ctx0, model, hparams, cparams, kv_self, gf,
+                    cur = llm_build_kv(ctx0, lctx, model, hparams, cparams, kv_self, gf,
                             model.layers[il].wo, model.layers[il].bo,
                             Kcur, Vcur, Qcur, KQ_mask, nullptr, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
                 } else {
                     Qcur = ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens);
 
-                    cur = llm_build_kv(ctx0, model, hparams, cparams, kv_self, gf,
+                    cur = llm_build_kv(ctx0, lctx, model, hparams, cparams, kv_self, gf,
                             model.layers[il].wo, model.layers[il].bo,
                             Kcur, Vcur, Qcur, KQ_mask, KQ_pos, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
                 }
@@ -8358,7 +10440,7 @@ struct llm_build_context {
                         model.layers[il].ffn_norm_b,
                         LLM_NORM, cb, il);
                 cb(cur, "ffn_norm", il);
-                cur = llm_build_ffn(ctx0, cur,
+                cur = llm_build_ffn(ctx0, lctx, cur,
                         model.layers[il].ffn_up,   model.layers[il].ffn_up_b,
                         NULL,                      NULL,
                         model.layers[il].ffn_down, model.layers[il].ffn_down_b,
@@ -8382,7 +10464,7 @@ struct llm_build_context {
                 LLM_NORM, cb, -1);
         cb(cur, "result_norm", -1);
 
-        cur = ggml_mul_mat(ctx0, model.output, cur);
+        cur = llm_build_output(ctx0, lctx, model.output, cur);
         cb(cur, "result_output", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -8422,21 +10504,21 @@ struct llm_build_context {
             // self-attention
             {
                 // compute Q and K and RoPE them
-                struct ggml_tensor * Qcur = ggml_mul_mat(ctx0, model.layers[il].wq, cur);
+                struct ggml_tensor * Qcur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wq, cur);
                 cb(Qcur, "Qcur", il);
                 if (model.layers[il].bq) {
                     Qcur = ggml_add(ctx0, Qcur, model.layers[il].bq);
                     cb(Qcur, "Qcur", il);
                 }
 
-                struct ggml_tensor * Kcur = ggml_mul_mat(ctx0, model.layers[il].wk, cur);
+                struct ggml_tensor * Kcur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wk, cur);
                 cb(Kcur, "Kcur", il);
                 if (model.layers[il].bk) {
                     Kcur = ggml_add(ctx0, Kcur, model.layers[il].bk);
                     cb(Kcur, "Kcur", il);
                 }
 
-                struct ggml_tensor * Vcur = ggml_mul_mat(ctx0, model.layers[il].wv, cur);
+                struct ggml_tensor * Vcur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wv, cur);
                 cb(Vcur, "Vcur", il);
                 if (model.layers[il].bv) {
                     Vcur = ggml_add(ctx0, Vcur, model.layers[il].bv);
@@ -8478,7 +10560,7 @@ struct llm_build_context {
                 );
                 cb(Kcur, "Kcur", il);
 
-                cur = llm_build_kv(ctx0, model, hparams, cparams, kv_self, gf,
+                cur = llm_build_kv(ctx0, lctx, model, hparams, cparams, kv_self, gf,
                         model.layers[il].wo, NULL,
                         Kcur, Vcur, Qcur, KQ_mask, nullptr, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
@@ -8506,7 +10588,7 @@ struct llm_build_context {
                     // parallel residual
                     cur = inpSA;
                 }
-                cur = llm_build_ffn(ctx0, cur,
+                cur = llm_build_ffn(ctx0, lctx, cur,
                         model.layers[il].ffn_up,   NULL,
                         model.layers[il].ffn_gate, NULL,
                         model.layers[il].ffn_down, NULL,
@@ -8531,7 +10613,7 @@ struct llm_build_context {
         cb(cur, "result_norm", -1);
 
         // lm_head
-        cur = ggml_mul_mat(ctx0, model.output, cur);
+        cur = llm_build_output(ctx0, lctx, model.output, cur);
         cb(cur, "result_output", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -8566,7 +10648,7 @@ struct llm_build_context {
 
             // self-attention
             {
-                cur = ggml_mul_mat(ctx0, model.layers[il].wqkv, cur);
+                cur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wqkv, cur);
                 cb(cur, "wqkv", il);
 
                 cur = ggml_add(ctx0, cur, model.layers[il].bqkv);
@@ -8596,7 +10678,7 @@ struct llm_build_context {
                 );
                 cb(Kcur, "Kcur", il);
 
-                cur = llm_build_kv(ctx0, model, hparams, cparams, kv_self, gf,
+                cur = llm_build_kv(ctx0, lctx, model, hparams, cparams, kv_self, gf,
                         model.layers[il].wo, NULL,
                         Kcur, Vcur, Qcur, KQ_mask, nullptr, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
@@ -8618,7 +10700,7 @@ struct llm_build_context {
                         LLM_NORM_RMS, cb, il);
                 cb(cur, "ffn_norm", il);
 
-                cur = llm_build_ffn(ctx0, cur,
+                cur = llm_build_ffn(ctx0, lctx, cur,
                         model.layers[il].ffn_up,   NULL,
                         model.layers[il].ffn_gate, NULL,
                         model.layers[il].ffn_down, NULL,
@@ -8642,7 +10724,7 @@ struct llm_build_context {
         cb(cur, "result_norm", -1);
 
         // lm_head
-        cur = ggml_mul_mat(ctx0, model.output, cur);
+        cur = llm_build_output(ctx0, lctx, model.output, cur);
         cb(cur, "result_output", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -8680,17 +10762,17 @@ struct llm_build_context {
             // self-attention
             {
                 // compute Q and K and RoPE them
-                struct ggml_tensor * Qcur = ggml_mul_mat(ctx0, model.layers[il].wq, cur);
+                struct ggml_tensor * Qcur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wq, cur);
                 cb(Qcur, "Qcur", il);
                 Qcur = ggml_add(ctx0, Qcur, model.layers[il].bq);
                 cb(Qcur, "Qcur", il);
 
-                struct ggml_tensor * Kcur = ggml_mul_mat(ctx0, model.layers[il].wk, cur);
+                struct ggml_tensor * Kcur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wk, cur);
                 cb(Kcur, "Kcur", il);
                 Kcur = ggml_add(ctx0, Kcur, model.layers[il].bk);
                 cb(Kcur, "Kcur", il);
 
-                struct ggml_tensor * Vcur = ggml_mul_mat(ctx0, model.layers[il].wv, cur);
+                struct ggml_tensor * Vcur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wv, cur);
                 cb(Vcur, "Vcur", il);
                 Vcur = ggml_add(ctx0, Vcur, model.layers[il].bv);
                 cb(Vcur, "Vcur", il);
@@ -8709,7 +10791,7 @@ struct llm_build_context {
                 );
                 cb(Kcur, "Kcur", il);
 
-                cur = llm_build_kv(ctx0, model, hparams, cparams, kv_self, gf,
+                cur = llm_build_kv(ctx0, lctx, model, hparams, cparams, kv_self, gf,
                         model.layers[il].wo, model.layers[il].bo,
                         Kcur, Vcur, Qcur, KQ_mask, nullptr, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
@@ -8730,7 +10812,7 @@ struct llm_build_context {
                     LLM_NORM_RMS, cb, il);
             cb(cur, "ffn_norm", il);
 
-            cur = llm_build_ffn(ctx0, cur,
+            cur = llm_build_ffn(ctx0, lctx, cur,
                     model.layers[il].ffn_up,   NULL,
                     model.layers[il].ffn_gate, NULL,
                     model.layers[il].ffn_down, NULL,
@@ -8753,7 +10835,7 @@ struct llm_build_context {
         cb(cur, "result_norm", -1);
 
         // lm_head
-        cur = ggml_mul_mat(ctx0, model.output, cur);
+        cur = llm_build_output(ctx0, lctx, model.output, cur);
         cb(cur, "result_output", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -8794,17 +10876,17 @@ struct llm_build_context {
             // self_attention
             {
                 // compute Q and K and RoPE them
-                struct ggml_tensor * Qcur = ggml_mul_mat(ctx0, model.layers[il].wq, cur);
+                struct ggml_tensor * Qcur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wq, cur);
                 cb(Qcur, "Qcur", il);
                 Qcur = ggml_add(ctx0, Qcur, model.layers[il].bq);
                 cb(Qcur, "Qcur", il);
 
-                struct ggml_tensor * Kcur = ggml_mul_mat(ctx0, model.layers[il].wk, cur);
+                struct ggml_tensor * Kcur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wk, cur);
                 cb(Kcur, "Kcur", il);
                 Kcur = ggml_add(ctx0, Kcur, model.layers[il].bk);
                 cb(Kcur, "Kcur", il);
 
-                struct ggml_tensor * Vcur = ggml_mul_mat(ctx0, model.layers[il].wv, cur);
+                struct ggml_tensor * Vcur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wv, cur);
                 cb(Vcur, "Vcur", il);
                 Vcur = ggml_add(ctx0, Vcur, model.layers[il].bv);
                 cb(Vcur, "Vcur", il);
@@ -8823,7 +10905,7 @@ struct llm_build_context {
                 );
                 cb(Kcur, "Kcur", il);
 
-                cur = llm_build_kv(ctx0, model, hparams, cparams, kv_self, gf,
+                cur = llm_build_kv(ctx0, lctx, model, hparams, cparams, kv_self, gf,
                         model.layers[il].wo, model.layers[il].bo,
                         Kcur, Vcur, Qcur, KQ_mask, nullptr, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
@@ -8851,6 +10933,10 @@ struct llm_build_context {
                         model.layers[il].ffn_up_exps,
                         model.layers[il].ffn_gate_exps,
                         model.layers[il].ffn_down_exps,
+                        model.layers[il].ffn_up_exps_gpu,
+                        model.layers[il].ffn_gate_exps_gpu,
+                        model.layers[il].ffn_down_exps_gpu,
+                        model.layers[il].ffn_exps_gpu_mask,
                         n_expert, n_expert_used,
                         LLM_FFN_SILU, false,
                         cb, il);
@@ -8865,7 +10951,7 @@ struct llm_build_context {
                 ggml_tensor * cur_gate = ggml_div(ctx0, ggml_silu(ctx0, cur_gate_inp), cur_gate_inp);
                 cb(cur_gate, "ffn_shexp_gate", il);
 
-                ggml_tensor * cur_ffn = llm_build_ffn(ctx0, cur,
+                ggml_tensor * cur_ffn = llm_build_ffn(ctx0, lctx, cur,
                         model.layers[il].ffn_up_shexp,   NULL,
                         model.layers[il].ffn_gate_shexp, NULL,
                         model.layers[il].ffn_down_shexp, NULL,
@@ -8897,7 +10983,7 @@ struct llm_build_context {
         cb(cur, "result_norm", -1);
 
         // lm_head
-        cur = ggml_mul_mat(ctx0, model.output, cur);
+        cur = llm_build_output(ctx0, lctx, model.output, cur);
         cb(cur, "result_output", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -8939,7 +11025,7 @@ struct llm_build_context {
                 struct ggml_tensor * Vcur = nullptr;
 
                 if (model.layers[il].wqkv) {
-                    cur = ggml_mul_mat(ctx0, model.layers[il].wqkv, attn_norm_output);
+                    cur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wqkv, attn_norm_output);
                     cb(cur, "wqkv", il);
 
                     cur = ggml_add(ctx0, cur, model.layers[il].bqkv);
@@ -8949,9 +11035,9 @@ struct llm_build_context {
                     Kcur = ggml_cont(ctx0, ggml_view_2d(ctx0, cur, n_embd_gqa, n_tokens, cur->nb[1], 1*sizeof(float)*(n_embd)));
                     Vcur = ggml_cont(ctx0, ggml_view_2d(ctx0, cur, n_embd_gqa, n_tokens, cur->nb[1], 1*sizeof(float)*(n_embd + n_embd_gqa)));
                 } else {
-                    Qcur = ggml_add(ctx0, ggml_mul_mat(ctx0, model.layers[il].wq, attn_norm_output), model.layers[il].bq);
-                    Kcur = ggml_add(ctx0, ggml_mul_mat(ctx0, model.layers[il].wk, attn_norm_output), model.layers[il].bk);
-                    Vcur = ggml_add(ctx0, ggml_mul_mat(ctx0, model.layers[il].wv, attn_norm_output), model.layers[il].bv);
+                    Qcur = ggml_add(ctx0, llm_build_lora_mm(ctx0, lctx, model.layers[il].wq, attn_norm_output), model.layers[il].bq);
+                    Kcur = ggml_add(ctx0, llm_build_lora_mm(ctx0, lctx, model.layers[il].wk, attn_norm_output), model.layers[il].bk);
+                    Vcur = ggml_add(ctx0, llm_build_lora_mm(ctx0, lctx, model.layers[il].wv, attn_norm_output), model.layers[il].bv);
                 }
 
                 cb(Qcur, "Qcur", il);
@@ -8978,7 +11064,7 @@ struct llm_build_context {
                 );
                 cb(Kcur, "Kcur", il);
 
-                cur = llm_build_kv(ctx0, model, hparams, cparams, kv_self, gf,
+                cur = llm_build_kv(ctx0, lctx, model, hparams, cparams, kv_self, gf,
                         model.layers[il].wo, model.layers[il].bo,
                         Kcur, Vcur, Qcur, KQ_mask, nullptr, n_tokens, kv_head, n_kv, 1.0f, cb, il);
             }
@@ -8993,7 +11079,7 @@ struct llm_build_context {
 
             // FF
             {
-                ffn_output = llm_build_ffn(ctx0, attn_norm_output,
+                ffn_output = llm_build_ffn(ctx0, lctx, attn_norm_output,
                         model.layers[il].ffn_up,   model.layers[il].ffn_up_b,
                         NULL,                      NULL,
                         model.layers[il].ffn_down, model.layers[il].ffn_down_b,
@@ -9017,10 +11103,15 @@ struct llm_build_context {
                 LLM_NORM, cb, -1);
         cb(cur, "result_norm", -1);
 
-        cur = ggml_mul_mat(ctx0, model.output, cur);
+        cur = llm_build_output(ctx0, lctx, model.output, cur);
         cb(cur, "result_output_no_bias", -1);
 
-        cur = ggml_add(ctx0, cur, model.output_b);
+        struct ggml_tensor * output_b = model.output_b;
+        if (lctx.inp_shortlist) {
+            output_b = ggml_get_rows(ctx0, ggml_reshape_2d(ctx0, output_b, 1, output_b->ne[0]), lctx.inp_shortlist);
+            output_b = ggml_reshape_1d(ctx0, output_b, ggml_nelements(output_b));
+        }
+        cur = ggml_add(ctx0, cur, output_b);
         cb(cur, "result_output", -1);
         ggml_build_forward_expand(gf, cur);
         return gf;
@@ -9060,7 +11151,7 @@ struct llm_build_context {
                 struct ggml_tensor * Vcur = nullptr;
 
                 if (model.layers[il].wqkv) {
-                    cur = ggml_mul_mat(ctx0, model.layers[il].wqkv, attn_norm_output);
+                    cur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wqkv, attn_norm_output);
                     cb(cur, "wqkv", il);
 
                     Qcur = ggml_cont(ctx0, ggml_view_2d(ctx0, cur, n_embd,     n_tokens, cur->nb[1], 0 * sizeof(float) * (n_embd)));
@@ -9068,9 +11159,9 @@ struct llm_build_context {
                     Vcur = ggml_cont(ctx0, ggml_view_2d(ctx0, cur, n_embd_gqa, n_tokens, cur->nb[1], 1 * sizeof(float) * (n_embd + n_embd_gqa)));
                 }
                 else {
-                    Qcur = ggml_add(ctx0, ggml_mul_mat(ctx0, model.layers[il].wq, attn_norm_output), model.layers[il].bq);
-                    Kcur = ggml_add(ctx0, ggml_mul_mat(ctx0, model.layers[il].wk, attn_norm_output), model.layers[il].bk);
-                    Vcur = ggml_add(ctx0, ggml_mul_mat(ctx0, model.layers[il].wv, attn_norm_output), model.layers[il].bv);
+                    Qcur = ggml_add(ctx0, llm_build_lora_mm(ctx0, lctx, model.layers[il].wq, attn_norm_output), model.layers[il].bq);
+                    Kcur = ggml_add(ctx0, llm_build_lora_mm(ctx0, lctx, model.layers[il].wk, attn_norm_output), model.layers[il].bk);
+                    Vcur = ggml_add(ctx0, llm_build_lora_mm(ctx0, lctx, model.layers[il].wv, attn_norm_output), model.layers[il].bv);
                 }
 
                 cb(Qcur, "Qcur", il);
@@ -9095,7 +11186,7 @@ struct llm_build_context {
                 );
                 cb(Kcur, "Kcur", il);
 
-                cur = llm_build_kv(ctx0, model, hparams, cparams, kv_self, gf,
+                cur = llm_build_kv(ctx0, lctx, model, hparams, cparams, kv_self, gf,
                         model.layers[il].wo, model.layers[il].bo,
                         Kcur, Vcur, Qcur, KQ_mask, nullptr, n_tokens, kv_head, n_kv, 1.0f, cb, il);
             }
@@ -9147,7 +11238,7 @@ struct llm_build_context {
             LLM_NORM_RMS, cb, -1);
         cb(cur, "result_norm", -1);
 
-        cur = ggml_mul_mat(ctx0, model.output, cur);
+        cur = llm_build_output(ctx0, lctx, model.output, cur);
         cb(cur, "result_output", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -9187,13 +11278,13 @@ struct llm_build_context {
             // self-attention
             {
                 // compute Q and K and RoPE them
-                struct ggml_tensor * Qcur = ggml_mul_mat(ctx0, model.layers[il].wq, cur);
+                struct ggml_tensor * Qcur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wq, cur);
                 cb(Qcur, "Qcur", il);
 
-                struct ggml_tensor * Kcur = ggml_mul_mat(ctx0, model.layers[il].wk, cur);
+                struct ggml_tensor * Kcur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wk, cur);
                 cb(Kcur, "Kcur", il);
 
-                struct ggml_tensor * Vcur = ggml_mul_mat(ctx0, model.layers[il].wv, cur);
+                struct ggml_tensor * Vcur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wv, cur);
                 cb(Vcur, "Vcur", il);
 
                 Qcur = ggml_rope_custom(
@@ -9208,7 +11299,7 @@ struct llm_build_context {
                         ext_factor, attn_factor, beta_fast, beta_slow);
                 cb(Kcur, "Kcur", il);
 
-                cur = llm_build_kv(ctx0, model, hparams, cparams, kv_self, gf,
+                cur = llm_build_kv(ctx0, lctx, model, hparams, cparams, kv_self, gf,
                         model.layers[il].wo, NULL,
                         Kcur, Vcur, Qcur, KQ_mask, nullptr, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
@@ -9226,7 +11317,7 @@ struct llm_build_context {
 
             // feed-forward network
             {
-                cur = llm_build_ffn(ctx0, cur,
+                cur = llm_build_ffn(ctx0, lctx, cur,
                         model.layers[il].ffn_up, NULL,
                         model.layers[il].ffn_gate, NULL,
                         model.layers[il].ffn_down, NULL,
@@ -9253,7 +11344,7 @@ struct llm_build_context {
         cb(cur, "result_norm", -1);
 
         // lm_head
-        cur = ggml_mul_mat(ctx0, model.output, cur);
+        cur = llm_build_output(ctx0, lctx, model.output, cur);
         cb(cur, "result_output", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -9295,7 +11386,7 @@ struct llm_build_context {
 
             // self-attention
             {
-                cur = ggml_mul_mat(ctx0, model.layers[il].wqkv, cur);
+                cur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wqkv, cur);
                 cb(cur, "wqkv", il);
 
                 cur = ggml_add(ctx0, cur, model.layers[il].bqkv);
@@ -9311,7 +11402,7 @@ struct llm_build_context {
 
                 Qcur = ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens);
 
-                cur = llm_build_kv(ctx0, model, hparams, cparams, kv_self, gf,
+                cur = llm_build_kv(ctx0, lctx, model, hparams, cparams, kv_self, gf,
                         model.layers[il].wo, model.layers[il].bo,
                         Kcur, Vcur, Qcur, KQ_mask, nullptr, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
@@ -9335,7 +11426,7 @@ struct llm_build_context {
                         LLM_NORM, cb, il);
                 cb(cur, "ffn_norm", il);
 
-                cur = llm_build_ffn(ctx0, cur,
+                cur = llm_build_ffn(ctx0, lctx, cur,
                         model.layers[il].ffn_up,   model.layers[il].ffn_up_b,
                         NULL,                      NULL,
                         model.layers[il].ffn_down, model.layers[il].ffn_down_b,
@@ -9354,7 +11445,7 @@ struct llm_build_context {
                 LLM_NORM, cb, -1);
         cb(cur, "result_norm", -1);
 
-        cur = ggml_mul_mat(ctx0, model.output, cur);
+        cur = llm_build_output(ctx0, lctx, model.output, cur);
         cb(cur, "result_output", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -9390,7 +11481,7 @@ struct llm_build_context {
 
             // self-attention
             {
-                cur = ggml_mul_mat(ctx0, model.layers[il].wqkv, cur);
+                cur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wqkv, cur);
                 cb(cur, "wqkv", il);
 
                 cur = ggml_add(ctx0, cur, model.layers[il].bqkv);
@@ -9418,7 +11509,7 @@ struct llm_build_context {
                 );
                 cb(Kcur, "Kcur", il);
 
-                cur = llm_build_kv(ctx0, model, hparams, cparams, kv_self, gf,
+                cur = llm_build_kv(ctx0, lctx, model, hparams, cparams, kv_self, gf,
                         model.layers[il].wo, model.layers[il].bo,
                         Kcur, Vcur, Qcur, KQ_mask, nullptr, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
@@ -9442,7 +11533,7 @@ struct llm_build_context {
                         LLM_NORM, cb, il);
                 cb(cur, "ffn_norm", il);
 
-                cur = llm_build_ffn(ctx0, cur,
+                cur = llm_build_ffn(ctx0, lctx, cur,
                         model.layers[il].ffn_up,   model.layers[il].ffn_up_b,
                         NULL,                      NULL,
                         model.layers[il].ffn_down, model.layers[il].ffn_down_b,
@@ -9461,7 +11552,7 @@ struct llm_build_context {
                 LLM_NORM, cb, -1);
         cb(cur, "result_norm", -1);
 
-        cur = ggml_mul_mat(ctx0, model.output, cur);
+        cur = llm_build_output(ctx0, lctx, model.output, cur);
         cb(cur, "result_output", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -9499,21 +11590,21 @@ struct llm_build_context {
             // self-attention
             {
                 // compute Q and K and RoPE them
-                struct ggml_tensor * Qcur = ggml_mul_mat(ctx0, model.layers[il].wq, cur);
+                struct ggml_tensor * Qcur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wq, cur);
                 cb(Qcur, "Qcur", il);
                 // if (model.layers[il].bq) {
                 //     Qcur = ggml_add(ctx0, Qcur, model.layers[il].bq);
                 //     cb(Qcur, "Qcur", il);
                 // }
 
-                struct ggml_tensor * Kcur = ggml_mul_mat(ctx0, model.layers[il].wk, cur);
+                struct ggml_tensor * Kcur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wk, cur);
                 cb(Kcur, "Kcur", il);
                 // if (model.layers[il].bk) {
                 //     Kcur = ggml_add(ctx0, Kcur, model.layers[il].bk);
                 //     cb(Kcur, "Kcur", il);
                 // }
 
-                struct ggml_tensor * Vcur = ggml_mul_mat(ctx0, model.layers[il].wv, cur);
+                struct ggml_tensor * Vcur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wv, cur);
                 cb(Vcur, "Vcur", il);
                 // if (model.layers[il].bv) {
                 //     Vcur = ggml_add(ctx0, Vcur, model.layers[il].bv);
@@ -9534,7 +11625,7 @@ struct llm_build_context {
                 );
                 cb(Kcur, "Kcur", il);
 
-                cur = llm_build_kv(ctx0, model, hparams, cparams, kv_self, gf,
+                cur = llm_build_kv(ctx0, lctx, model, hparams, cparams, kv_self, gf,
                         model.layers[il].wo, NULL,
                         Kcur, Vcur, Qcur, KQ_mask, nullptr, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
@@ -9555,7 +11646,7 @@ struct llm_build_context {
                     LLM_NORM, cb, il);
             cb(cur, "ffn_norm", il);
 
-            cur = llm_build_ffn(ctx0, cur,
+            cur = llm_build_ffn(ctx0, lctx, cur,
                     model.layers[il].ffn_up,   NULL,
                     model.layers[il].ffn_gate, NULL,
                     model.layers[il].ffn_down, NULL,
@@ -9578,7 +11669,7 @@ struct llm_build_context {
         cb(cur, "result_norm", -1);
 
         // lm_head
-        cur = ggml_mul_mat(ctx0, model.output, cur);
+        cur = llm_build_output(ctx0, lctx, model.output, cur);
         cb(cur, "result_output", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -9616,21 +11707,21 @@ struct llm_build_context {
             // self-attention
             {
                 // compute Q and K and RoPE them
-                struct ggml_tensor * Qcur = ggml_mul_mat(ctx0, model.layers[il].wq, cur);
+                struct ggml_tensor * Qcur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wq, cur);
                 cb(Qcur, "Qcur", il);
                 if (model.layers[il].bq) {
                     Qcur = ggml_add(ctx0, Qcur, model.layers[il].bq);
                     cb(Qcur, "Qcur", il);
                 }
 
-                struct ggml_tensor * Kcur = ggml_mul_mat(ctx0, model.layers[il].wk, cur);
+                struct ggml_tensor * Kcur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wk, cur);
                 cb(Kcur, "Kcur", il);
                 if (model.layers[il].bk) {
                     Kcur = ggml_add(ctx0, Kcur, model.layers[il].bk);
                     cb(Kcur, "Kcur", il);
                 }
 
-                struct ggml_tensor * Vcur = ggml_mul_mat(ctx0, model.layers[il].wv, cur);
+                struct ggml_tensor * Vcur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wv, cur);
                 cb(Vcur, "Vcur", il);
                 if (model.layers[il].bv) {
                     Vcur = ggml_add(ctx0, Vcur, model.layers[il].bv);
@@ -9651,7 +11742,7 @@ struct llm_build_context {
                 );
                 cb(Kcur, "Kcur", il);
 
-                cur = llm_build_kv(ctx0, model, hparams, cparams, kv_self, gf,
+                cur = llm_build_kv(ctx0, lctx, model, hparams, cparams, kv_self, gf,
                         model.layers[il].wo, model.layers[il].bo,
                         Kcur, Vcur, Qcur, KQ_mask, nullptr, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
@@ -9672,7 +11763,7 @@ struct llm_build_context {
                     LLM_NORM_RMS, cb, il);
             cb(cur, "ffn_norm", il);
 
-            cur = llm_build_ffn(ctx0, cur,
+            cur = llm_build_ffn(ctx0, lctx, cur,
                     model.layers[il].ffn_up,   NULL,
                     model.layers[il].ffn_gate, NULL,
                     model.layers[il].ffn_down, NULL,
@@ -9695,7 +11786,7 @@ struct llm_build_context {
         cb(cur, "result_norm", -1);
 
         // lm_head
-        cur = ggml_mul_mat(ctx0, model.output, cur);
+        cur = llm_build_output(ctx0, lctx, model.output, cur);
         cb(cur, "result_output", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -9746,21 +11837,21 @@ struct llm_build_context {
             // self-attention
             {
                 // compute Q and K and RoPE them
-                struct ggml_tensor * Qcur = ggml_mul_mat(ctx0, model.layers[il].wq, cur);
+                struct ggml_tensor * Qcur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wq, cur);
                 cb(Qcur, "Qcur", il);
                 if (model.layers[il].bq) {
                     Qcur = ggml_add(ctx0, Qcur, model.layers[il].bq);
                     cb(Qcur, "Qcur", il);
                 }
 
-                struct ggml_tensor * Kcur = ggml_mul_mat(ctx0, model.layers[il].wk, cur);
+                struct ggml_tensor * Kcur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wk, cur);
                 cb(Kcur, "Kcur", il);
                 if (model.layers[il].bk) {
                     Kcur = ggml_add(ctx0, Kcur, model.layers[il].bk);
                     cb(Kcur, "Kcur", il);
                 }
 
-                struct ggml_tensor * Vcur = ggml_mul_mat(ctx0, model.layers[il].wv, cur);
+                struct ggml_tensor * Vcur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wv, cur);
                 cb(Vcur, "Vcur", il);
                 if (model.layers[il].bv) {
                     Vcur = ggml_add(ctx0, Vcur, model.layers[il].bv);
@@ -9781,7 +11872,7 @@ struct llm_build_context {
                 );
                 cb(Kcur, "Kcur", il);
 
-                cur = llm_build_kv(ctx0, model, hparams, cparams, kv_self, gf,
+                cur = llm_build_kv(ctx0, lctx, model, hparams, cparams, kv_self, gf,
                         model.layers[il].wo, model.layers[il].bo,
                         Kcur, Vcur, Qcur, KQ_mask, nullptr, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
@@ -9808,7 +11899,7 @@ struct llm_build_context {
                         LLM_NORM_RMS, cb, il);
                 cb(cur, "ffn_norm", il);
 
-                cur = llm_build_ffn(ctx0, cur,
+                cur = llm_build_ffn(ctx0, lctx, cur,
                         model.layers[il].ffn_up,   NULL,
                         model.layers[il].ffn_gate, NULL,
                         model.layers[il].ffn_down, NULL,
@@ -9841,7 +11932,7 @@ struct llm_build_context {
         cb(cur, "lmhead_scaling", -1);
 
         // lm_head
-        cur = ggml_mul_mat(ctx0, model.tok_embd, cur);
+        cur = llm_build_output(ctx0, lctx, model.tok_embd, cur);
         cb(cur, "result_output", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -9878,13 +11969,13 @@ struct llm_build_context {
             // self-attention
             {
                 // compute Q and K and RoPE them
-                struct ggml_tensor * Qcur = ggml_mul_mat(ctx0, model.layers[il].wq, cur);
+                struct ggml_tensor * Qcur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wq, cur);
                 cb(Qcur, "Qcur", il);
 
-                struct ggml_tensor * Kcur = ggml_mul_mat(ctx0, model.layers[il].wk, cur);
+                struct ggml_tensor * Kcur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wk, cur);
                 cb(Kcur, "Kcur", il);
 
-                struct ggml_tensor * Vcur = ggml_mul_mat(ctx0, model.layers[il].wv, cur);
+                struct ggml_tensor * Vcur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wv, cur);
                 cb(Vcur, "Vcur", il);
 
                 Qcur = ggml_rope_custom(
@@ -9902,7 +11993,7 @@ struct llm_build_context {
                         ext_factor, attn_factor, beta_fast, beta_slow);
                 cb(Kcur, "Kcur", il);
 
-                cur = llm_build_kv(ctx0, model, hparams, cparams, kv_self, gf,
+                cur = llm_build_kv(ctx0, lctx, model, hparams, cparams, kv_self, gf,
                         model.layers[il].wo, NULL,
                         Kcur, Vcur, Qcur, KQ_mask, nullptr, n_tokens, kv_head, n_kv, 1.0f, cb, il);
             }
@@ -9924,7 +12015,7 @@ struct llm_build_context {
 
             // feed-forward network
             {
-                cur = llm_build_ffn(ctx0, cur,
+                cur = llm_build_ffn(ctx0, lctx, cur,
                         model.layers[il].ffn_up, NULL,
                         model.layers[il].ffn_gate, NULL,
                         model.layers[il].ffn_down, NULL,
@@ -9948,7 +12039,7 @@ struct llm_build_context {
         cb(cur, "result_norm", -1);
 
         // lm_head
-        cur = ggml_mul_mat(ctx0, model.output, cur);
+        cur = llm_build_output(ctx0, lctx, model.output, cur);
         cb(cur, "result_output", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -9986,21 +12077,21 @@ struct llm_build_context {
             // self-attention
             {
                 // compute Q and K and RoPE them
-                struct ggml_tensor * Qcur = ggml_mul_mat(ctx0, model.layers[il].wq, cur);
+                struct ggml_tensor * Qcur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wq, cur);
                 cb(Qcur, "Qcur", il);
                 if (model.layers[il].bq) {
                     Qcur = ggml_add(ctx0, Qcur, model.layers[il].bq);
                     cb(Qcur, "Qcur", il);
                 }
 
-                struct ggml_tensor * Kcur = ggml_mul_mat(ctx0, model.layers[il].wk, cur);
+                struct ggml_tensor * Kcur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wk, cur);
                 cb(Kcur, "Kcur", il);
                 if (model.layers[il].bk) {
                     Kcur = ggml_add(ctx0, Kcur, model.layers[il].bk);
                     cb(Kcur, "Kcur", il);
                 }
 
-                struct ggml_tensor * Vcur = ggml_mul_mat(ctx0, model.layers[il].wv, cur);
+                struct ggml_tensor * Vcur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wv, cur);
                 cb(Vcur, "Vcur", il);
                 if (model.layers[il].bv) {
                     Vcur = ggml_add(ctx0, Vcur, model.layers[il].bv);
@@ -10021,7 +12112,7 @@ struct llm_build_context {
                 );
                 cb(Kcur, "Kcur", il);
 
-                cur = llm_build_kv(ctx0, model, hparams, cparams, kv_self, gf,
+                cur = llm_build_kv(ctx0, lctx, model, hparams, cparams, kv_self, gf,
                         model.layers[il].wo, model.layers[il].bo,
                         Kcur, Vcur, Qcur, KQ_mask, nullptr, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
@@ -10043,7 +12134,7 @@ struct llm_build_context {
                     LLM_NORM, cb, il);
             cb(cur, "ffn_norm", il);
 
-            cur = llm_build_ffn(ctx0, cur,
+            cur = llm_build_ffn(ctx0, lctx, cur,
                         model.layers[il].ffn_up,   model.layers[il].ffn_up_b,
                         NULL,                      NULL,
                         model.layers[il].ffn_down, model.layers[il].ffn_down_b,
@@ -10065,7 +12156,7 @@ struct llm_build_context {
         cb(cur, "result_norm", -1);
 
         // lm_head
-        cur = ggml_mul_mat(ctx0, model.output, cur);
+        cur = llm_build_output(ctx0, lctx, model.output, cur);
         cb(cur, "result_output", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -10212,7 +12303,7 @@ struct llm_build_context {
         cb(cur, "result_norm", -1);
 
         // lm_head
-        cur = ggml_mul_mat(ctx0, model.output, cur);
+        cur = llm_build_output(ctx0, lctx, model.output, cur);
         cb(cur, "result_output", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -10251,21 +12342,21 @@ struct llm_build_context {
             // self-attention
             {
                 // compute Q and K and RoPE them
-                struct ggml_tensor * Qcur = ggml_mul_mat(ctx0, model.layers[il].wq, cur);
+                struct ggml_tensor * Qcur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wq, cur);
                 cb(Qcur, "Qcur", il);
                 if (model.layers[il].bq) {
                     Qcur = ggml_add(ctx0, Qcur, model.layers[il].bq);
                     cb(Qcur, "Qcur", il);
                 }
 
-                struct ggml_tensor * Kcur = ggml_mul_mat(ctx0, model.layers[il].wk, cur);
+                struct ggml_tensor * Kcur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wk, cur);
                 cb(Kcur, "Kcur", il);
                 if (model.layers[il].bk) {
                     Kcur = ggml_add(ctx0, Kcur, model.layers[il].bk);
                     cb(Kcur, "Kcur", il);
                 }
 
-                struct ggml_tensor * Vcur = ggml_mul_mat(ctx0, model.layers[il].wv, cur);
+                struct ggml_tensor * Vcur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wv, cur);
                 cb(Vcur, "Vcur", il);
                 if (model.layers[il].bv) {
                     Vcur = ggml_add(ctx0, Vcur, model.layers[il].bv);
@@ -10311,7 +12402,7 @@ struct llm_build_context {
                 );
                 cb(Kcur, "Kcur", il);
 
-                cur = llm_build_kv(ctx0, model, hparams, cparams, kv_self, gf,
+                cur = llm_build_kv(ctx0, lctx, model, hparams, cparams, kv_self, gf,
                         model.layers[il].wo, model.layers[il].bo,
                         Kcur, Vcur, Qcur, KQ_mask, nullptr, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
@@ -10328,7 +12419,7 @@ struct llm_build_context {
 
             // feed-forward network
             {
-                cur = llm_build_ffn(ctx0, ffn_inp,
+                cur = llm_build_ffn(ctx0, lctx, ffn_inp,
                         model.layers[il].ffn_up,   NULL,
                         model.layers[il].ffn_gate, NULL,
                         model.layers[il].ffn_down, NULL,
@@ -10354,7 +12445,7 @@ struct llm_build_context {
         cb(cur, "result_norm", -1);
 
         // lm_head
-        cur = ggml_mul_mat(ctx0, model.output, cur);
+        cur = llm_build_output(ctx0, lctx, model.output, cur);
 
         if (f_logit_scale) {
             cur = ggml_scale(ctx0, cur, f_logit_scale);
@@ -10407,21 +12498,21 @@ struct llm_build_context {
             // self-attention
             {
                 // compute Q and K and RoPE them
-                struct ggml_tensor * Qcur = ggml_mul_mat(ctx0, model.layers[il].wq, cur);
+                struct ggml_tensor * Qcur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wq, cur);
                 cb(Qcur, "Qcur", il);
                 if (hparams.f_clamp_kqv > 0.0f) {
                     Qcur = ggml_clamp(ctx0, Qcur, -hparams.f_clamp_kqv, hparams.f_clamp_kqv);
                     cb(Qcur, "Qcur", il);
                 }
 
-                struct ggml_tensor * Kcur = ggml_mul_mat(ctx0, model.layers[il].wk, cur);
+                struct ggml_tensor * Kcur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wk, cur);
                 cb(Kcur, "Kcur", il);
                 if (hparams.f_clamp_kqv > 0.0f) {
                     Kcur = ggml_clamp(ctx0, Kcur, -hparams.f_clamp_kqv, hparams.f_clamp_kqv);
                     cb(Kcur, "Kcur", il);
                 }
 
-                struct ggml_tensor * Vcur = ggml_mul_mat(ctx0, model.layers[il].wv, cur);
+                struct ggml_tensor * Vcur = llm_build_lora_mm(ctx0, lctx, model.layers[il].wv, cur);
                 cb(Vcur, "Vcur", il);
                 if (hparams.f_clamp_kqv > 0.0f) {
                     Vcur = ggml_clamp(ctx0, Vcur, -hparams.f_clamp_kqv, hparams.f_clamp_kqv);
@@ -10442,7 +12533,7 @@ struct llm_build_context {
                 );
                 cb(Kcur, "Kcur", il);
 
-                cur = llm_build_kv(ctx0, model, hparams, cparams, kv_self, gf,
+                cur = llm_build_kv(ctx0, lctx, model, hparams, cparams, kv_self, gf,
                         model.layers[il].wo, nullptr,
                         Kcur, Vcur, Qcur, KQ_mask, nullptr, n_tokens, kv_head, n_kv, 1.0f/sqrtf(float(n_embd_head)), cb, il);
             }
@@ -10464,7 +12555,7 @@ struct llm_build_context {
                     LLM_NORM, cb, il);
             cb(cur, "ffn_norm", il);
 
-            cur = llm_build_ffn(ctx0, cur,
+            cur = llm_build_ffn(ctx0, lctx, cur,
                     model.layers[il].ffn_up,   NULL,
                     model.layers[il].ffn_gate, NULL,
                     model.layers[il].ffn_down, NULL,
@@ -10475,10 +12566,7 @@ struct llm_build_context {
             cur = ggml_add(ctx0, cur, ffn_inp);
             cb(cur, "ffn_out", il);
 
-            ggml_tensor * layer_dir = lctx.cvec.tensor_for(il);
-            if (layer_dir != nullptr) {
-                cur = ggml_add(ctx0, cur, layer_dir);
-            }
+            cur = llm_build_cvec(ctx0, lctx, cur, il);
             cb(cur, "l_out", il);
 
             // input for next layer
@@ -10493,7 +12581,7 @@ struct llm_build_context {
         cb(cur, "result_norm", -1);
 
         // lm_head
-        cur = ggml_mul_mat(ctx0, model.output, cur);
+        cur = llm_build_output(ctx0, lctx, model.output, cur);
         cb(cur, "result_output", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -10553,6 +12641,26 @@ static struct ggml_cgraph * llama_build_graph_s_copy(llama_context & lctx) {
     return result;
 }
 
+// same as ggml_format_name(cur, "%s-%d", name, il) without going
+// through vsnprintf(), which runs thousands of times per graph build
+static void llama_set_layer_name(struct ggml_tensor * cur, const char * name, int il) {
+    char digits[12];
+    int nd = 0;
+    do {
+        digits[nd++] = '0' + il % 10;
+        il /= 10;
+    } while (il > 0);
+    size_t n = strnlen(name, sizeof(cur->name) - 1);
+    memcpy(cur->name, name, n);
+    if (n < sizeof(cur->name) - 1) {
+        cur->name[n++] = '-';
+    }
+    while (nd > 0 && n < sizeof(cur->name) - 1) {
+        cur->name[n++] = digits[--nd];
+    }
+    cur->name[n] = '\0';
+}
+
 static struct ggml_cgraph * llama_build_graph(
          llama_context & lctx,
      const llama_batch & batch,
@@ -10562,22 +12670,43 @@ static struct ggml_cgraph * llama_build_graph(
     // this callback allows us to apply custom logic to each tensor (e.g. ggml-alloc, offloading, etc.)
     llm_build_cb cb = [&](struct ggml_tensor * cur, const char * name, int il) {
         if (il >= 0) {
-            ggml_format_name(cur, "%s-%d", name, il);
+            llama_set_layer_name(cur, name, il);
         } else {
             ggml_set_name(cur, name);
         }
 
         if (!lctx.cparams.offload_kqv) {
-            if (strcmp(name, "kqv_merged_cont") == 0) {
-                // all nodes between the KV store and the attention output are run on the CPU
-                ggml_backend_sched_set_tensor_backend(lctx.sched, cur, lctx.backend_cpu);
+            if (batch.n_tokens < 32) {
+                if (strcmp(name, "kqv_merged_cont") == 0) {
+                    // all nodes between the KV store and the attention output are run on the CPU
+                    ggml_backend_sched_set_tensor_backend(lctx.sched, cur, lctx.backend_cpu);
+                }
+            } else if (il != -1 && (strcmp(name, "kq") == 0 ||
+                                    strncmp(name, "kq_", 3) == 0 ||
+                                    strncmp(name, "kqv", 3) == 0)) {
+                // attention over a large batch is compute bound, so it's worth copying the
+                // part of the host kv cache in use to the gpu of the layer, although reading
+                // it from ram beats pcie when generating, which is why that stays on the CPU
+                for (auto * backend : lctx.backends) {
+                    if (ggml_backend_buft_supports_backend(lctx.model.buft_layer[il].buft, backend)) {
+                        ggml_backend_sched_set_tensor_backend(lctx.sched, cur, backend);
+                        break;
+                    }
+                }
             }
         }
 
+        // the experts picked are read back after the graph is computed to be counted
+        if (il != -1 && !lctx.model.expert_counts.empty() && strcmp(name, "ffn_moe_argsort") == 0) {
+            ggml_set_output(cur);
+        }
+
         // norm may be automatically assigned to the backend of the previous layer, increasing data transfer between backends
         // FIXME: fix in ggml_backend_sched
+        // unless the scheduler puts the whole ubatch on the cpu
         const bool full_offload = lctx.model.n_gpu_layers > (int)lctx.model.hparams.n_layer;
-        if (batch.n_tokens < 32 || full_offload) {
+        const bool cpu_decode = batch.n_tokens <= (int) lctx.cparams.n_cpu_decode;
+        if ((batch.n_tokens < 32 || full_offload) && !cpu_decode) {
             if (il != -1 && strcmp(name, "norm") == 0) {
                 for (auto * backend : lctx.backends) {
                     if (ggml_backend_buft_supports_backend(lctx.model.buft_layer[il].buft, backend)) {
@@ -10591,6 +12720,11 @@ static struct ggml_cgraph * llama_build_graph(
 
     struct ggml_cgraph * result = NULL;
 
+    if (worst_case) {
+        // the reserved graph stores the whole batch in one place
+        lctx.kv_self.runs.clear();
+    }
+
     struct llm_build_context llm(lctx, batch, cb, worst_case);
 
     llm.init();
@@ -10717,20 +12851,55 @@ static struct ggml_cgraph * llama_build_graph(
             GGML_ASSERT(false);
     }
 
+    // add the logit biases of the sequences on the backend, so that the
+    // most likely tokens below are picked with them
+    struct ggml_tensor * res = result->nodes[result->n_nodes - 1];
+
+    if (lctx.steer_bias && lctx.steering.bias && strcmp(res->name, "result_output") == 0 && res->ne[1] > 0) {
+        GGML_ASSERT(lctx.inp_steer_out->ne[0] == res->ne[1]);
+        ggml_set_name(res, "result_output_unbiased");
+
+        res = ggml_add(llm.ctx0, res, ggml_get_rows(llm.ctx0, lctx.steering.bias, lctx.inp_steer_out));
+        cb(res, "result_output", -1);
+
+        ggml_build_forward_expand(result, res);
+    }
+
+    // pick the most likely tokens on the backend, so that the logits
+    // don't have to travel to the host when nothing else needs them
+    lctx.t_top_k_ids    = nullptr;
+    lctx.t_top_k_logits = nullptr;
+
+    const int64_t top_k = lctx.cparams.logits_top_k;
+
+    // a shortlist is already small, and its ids aren't those of the vocab
+    if (top_k > 0 && !lctx.inp_shortlist && strcmp(res->name, "result_output") == 0 && res->ne[0] > top_k && res->ne[1] > 0) {
+        struct ggml_tensor * ids = ggml_cont(llm.ctx0, ggml_top_k(llm.ctx0, res, top_k));
+        cb(ids, "result_top_k_ids", -1);
+
+        struct ggml_tensor * logits = ggml_get_rows(llm.ctx0, ggml_reshape_3d(llm.ctx0, res, 1, res->ne[0], res->ne[1]), ids);
+        cb(logits, "result_top_k_logits", -1);
+
+        ggml_build_forward_expand(result, logits);
+
+        lctx.t_top_k_ids    = ids;
+        lctx.t_top_k_logits = logits;
+    }
+
     llm.free();
 
     return result;
 }
 
 static void llama_set_k_shift(llama_context & lctx) {
-    const int64_t kv_size = lctx.kv_self.size;
+    const auto & kv_self = lctx.kv_self;
 
     assert(ggml_backend_buffer_is_host(lctx.inp_K_shift->buffer));
 
     int32_t * data = (int32_t *) lctx.inp_K_shift->data;
 
-    for (int i = 0; i < kv_size; ++i) {
-        data[i] = lctx.kv_self.cells[i].delta;
+    for (uint32_t i = kv_self.shift_begin; i < kv_self.shift_end; ++i) {
+        data[i - kv_self.shift_begin] = kv_self.cells[i].delta;
     }
 }
 
@@ -10746,6 +12915,70 @@ static void llama_set_s_copy(llama_context & lctx) {
     }
 }
 
+// the scale a sequence has for a runtime lora adapter
+static float llama_lora_scale(const llama_context & lctx, const llama_lora_adapter * adapter, llama_seq_id seq_id) {
+    float scale = 0.0f;
+    for (llama_seq_id id : {(llama_seq_id) -1, seq_id}) {
+        auto it = lctx.lora_seq.find(id);
+        if (it == lctx.lora_seq.end()) {
+            continue;
+        }
+        for (const auto & a : it->second) {
+            if (a.first == adapter) {
+                scale += a.second;
+            }
+        }
+    }
+    return scale * adapter->alpha_r;
+}
+
+// gathers the runtime lora adapters the tokens of a ubatch use
+static void llama_lora_prepare(llama_context & lctx, const llama_batch & batch) {
+    lctx.lora_batch.clear();
+    if (lctx.lora_seq.empty()) {
+        return;
+    }
+    auto add = [&](llama_seq_id seq_id) {
+        auto it = lctx.lora_seq.find(seq_id);
+        if (it == lctx.lora_seq.end()) {
+            return;
+        }
+        for (const auto & a : it->second) {
+            if (std::find(lctx.lora_batch.begin(), lctx.lora_batch.end(), a.first) == lctx.lora_batch.end()) {
+                lctx.lora_batch.push_back(a.first);
+            }
+        }
+    };
+    add(-1);
+    for (int32_t i = 0; i < batch.n_tokens; ++i) {
+        if (i == 0 || batch.seq_id[i][0] != batch.seq_id[i - 1][0]) {
+            add(batch.seq_id[i][0]);
+        }
+    }
+    // so the same adapters in another order can reuse the graph
+    std::sort(lctx.lora_batch.begin(), lctx.lora_batch.end());
+}
+
+// finds out whether the tokens of a ubatch use any of the steering rows
+static void llama_steering_prepare(llama_context & lctx, const llama_batch & batch) {
+    const llama_steering & st = lctx.steering;
+
+    lctx.steer_bias = st.bias && st.logit_bias.count(-1);
+    lctx.steer_cvec = false;
+    for (int32_t i = 0; i < batch.n_tokens && !(lctx.steer_bias && lctx.steer_cvec); ++i) {
+        const llama_seq_id seq_id = batch.seq_id[i][0];
+        if (!st.row_of(seq_id)) {
+            continue;
+        }
+        if (st.bias && st.logit_bias.count(seq_id)) {
+            lctx.steer_bias = true;
+        }
+        if (st.cvec_seqs.count(seq_id)) {
+            lctx.steer_cvec = true;
+        }
+    }
+}
+
 static void llama_set_inputs(llama_context & lctx, const llama_batch & batch) {
     //
     // set input data
@@ -10755,6 +12988,44 @@ static void llama_set_inputs(llama_context & lctx, const llama_batch & batch) {
     const auto & cparams = lctx.cparams;
     const auto & kv_self = lctx.kv_self;
 
+    if (!lctx.lora_batch.empty()) {
+        const int64_t n_tokens = batch.n_tokens;
+
+        std::vector<float> scale(n_tokens);
+        for (size_t i = 0; i < lctx.lora_batch.size(); ++i) {
+            for (int64_t j = 0; j < n_tokens; ++j) {
+                scale[j] = llama_lora_scale(lctx, lctx.lora_batch[i], batch.seq_id[j][0]);
+            }
+            ggml_backend_tensor_set(lctx.inp_lora_scale[i], scale.data(), 0, n_tokens*sizeof(float));
+        }
+    }
+
+    if (lctx.steer_bias || lctx.steer_cvec) {
+        const int64_t n_tokens = batch.n_tokens;
+
+        std::vector<int32_t> rows(n_tokens);
+        std::vector<int32_t> rows_out;
+        for (int64_t i = 0; i < n_tokens; ++i) {
+            rows[i] = lctx.steering.row_of(batch.seq_id[i][0]);
+            if (lctx.n_outputs == n_tokens || (batch.logits && batch.logits[i]) ||
+                (!batch.logits && lctx.n_outputs == 1 && i == n_tokens - 1)) {
+                rows_out.push_back(rows[i]);
+            }
+        }
+        GGML_ASSERT((int32_t) rows_out.size() == lctx.n_outputs);
+        // a table that isn't in the graph has no buffer
+        if (lctx.inp_steer_rows->buffer) {
+            ggml_backend_tensor_set(lctx.inp_steer_rows, rows.data(), 0, n_tokens*sizeof(int32_t));
+        }
+        if (lctx.inp_steer_out->buffer && !rows_out.empty()) {
+            ggml_backend_tensor_set(lctx.inp_steer_out, rows_out.data(), 0, rows_out.size()*sizeof(int32_t));
+        }
+    }
+
+    if (lctx.inp_shortlist && lctx.inp_shortlist->buffer) {
+        ggml_backend_tensor_set(lctx.inp_shortlist, lctx.shortlist.data(), 0, lctx.shortlist.size()*sizeof(int32_t));
+    }
+
     if (batch.token) {
         const int64_t n_tokens = batch.n_tokens;
 
@@ -10822,19 +13093,54 @@ static void llama_set_inputs(llama_context & lctx, const llama_batch & batch) {
             // For causal attention, use only the previous KV cells
             // of the correct sequence for each token of the batch.
             // It's assumed that if a token in the batch has multiple sequences, they are equivalent.
+
+            // the positions of the cells as each sequence of the batch sees
+            // them, where cells of other sequences are never visible, so a
+            // row of the mask is a compare over n_kv cells that vectorizes
+            std::vector<llama_seq_id> & seqs    = lctx.kq_mask_seqs;
+            std::vector<llama_pos>    & seq_pos = lctx.kq_mask_pos;
+            llama_seq_set batch_seqs;
+            uint8_t seq_index[LLAMA_MAX_SEQ]; // index in seqs of the ones in batch_seqs
+            seqs.clear();
+            for (int j = 0; j < n_tokens; ++j) {
+                const llama_seq_id seq_id = batch.seq_id[j][0];
+                if (!batch_seqs.count(seq_id)) {
+                    batch_seqs.insert(seq_id);
+                    seq_index[seq_id] = seqs.size();
+                    seqs.push_back(seq_id);
+                }
+            }
+            seq_pos.assign(seqs.size()*n_kv, INT32_MAX);
+
+            // a single pass over the cells, which only visits the sequences
+            // of a cell that are also in the batch, a few words at a time
+            for (int i = 0; i < n_kv; ++i) {
+                const llama_kv_cell & cell = lctx.kv_self.cells[i];
+                for (int w = 0; w < LLAMA_MAX_SEQ / 64; ++w) {
+                    for (uint64_t x = cell.seq_id.bits[w] & batch_seqs.bits[w]; x; x &= x - 1) {
+                        const int k = seq_index[w*64 + __builtin_ctzll(x)];
+                        seq_pos[k*n_kv + i] = cell.pos;
+                    }
+                }
+            }
+
             for (int h = 0; h < 1; ++h) {
                 for (int j = 0; j < n_tokens; ++j) {
                     const llama_pos    pos    = batch.pos[j];
                     const llama_seq_id seq_id = batch.seq_id[j][0];
 
+                    float * row = data + h*(n_kv*n_tokens) + j*n_kv;
+                    if (j > 0 && pos == batch.pos[j - 1] && seq_id == batch.seq_id[j - 1][0]) {
+                        memcpy(row, row - n_kv, n_kv*sizeof(float));
+                        continue;
+                    }
+
+                    // with a sliding window, only the last n_swa positions are seen
+                    const llama_pos pos_min = hparams.n_swa ? pos - (llama_pos) hparams.n_swa : -1;
+
+                    const llama_pos * cell_pos = seq_pos.data() + seq_index[seq_id]*n_kv;
                     for (int i = 0; i < n_kv; ++i) {
-                        float f;
-                        if (!lctx.kv_self.cells[i].has_seq_id(seq_id) || lctx.kv_self.cells[i].pos > pos) {
-                            f = -INFINITY;
-                        } else {
-                            f = 0.0f;
-                        }
-                        data[h*(n_kv*n_tokens) + j*n_kv + i] = f;
+                        row[i] = cell_pos[i] <= pos && cell_pos[i] > pos_min ? 0.0f : -INFINITY;
                     }
                 }
             }
@@ -11055,6 +13361,105 @@ static size_t llama_output_reserve(llama_context & lctx, size_t n_outputs) {
 }
 
 
+#ifndef MADV_COLD
+#define MADV_COLD 20
+#endif
+
+// returns the layer whose weights p points into, or -1 if it isn't one
+// that's streamed
+static int llama_stream_find(const llama_model & model, const void * p) {
+    const uintptr_t x = (uintptr_t) p;
+    const auto & index = model.stream_index;
+    auto it = std::upper_bound(index.begin(), index.end(), x,
+                               [](uintptr_t x, const auto & s) { return x < s.lo; });
+    if (it == index.begin()) {
+        return -1;
+    }
+    --it;
+    return x < it->hi ? it->il : -1;
+}
+
+// asks the kernel to read in the weights of a layer, or to let go of
+// them, which only covers the pages that no other layer shares
+static void llama_stream_advise(const std::vector<llama_model::stream_span> & spans, bool need) {
+    const uintptr_t pagesz = sysconf(_SC_PAGESIZE);
+    for (const auto & s : spans) {
+        if (need) {
+            const uintptr_t lo = s.lo & -pagesz;
+            const uintptr_t hi = GGML_PAD(s.hi, pagesz);
+            madvise((void *) lo, hi - lo, MADV_WILLNEED);
+        } else {
+            const uintptr_t lo = GGML_PAD(s.lo, pagesz);
+            const uintptr_t hi = s.hi & -pagesz;
+            // dropping pages is only safe when they can be read back
+            // from the file, rather than having been inflated
+            if (hi > lo && madvise((void *) lo, hi - lo, MADV_COLD) && s.droppable) {
+                madvise((void *) lo, hi - lo, MADV_DONTNEED);
+            }
+        }
+    }
+}
+
+// keeps the weights of the next few layers in memory while the cpu is
+// computing one, and pushes out the ones it's done with, so a model that
+// doesn't fit in ram is read off disk in order instead of page faulting
+static void llama_stream_worker(struct llama_context * ctx) {
+    const int ahead = 2;
+    const auto & layers = ctx->model.stream_layers;
+    const int n_layer = layers.size();
+    std::vector<bool> resident(n_layer);
+    int done = -1;
+    std::unique_lock<std::mutex> lock(ctx->stream_mutex);
+    for (;;) {
+        ctx->stream_cv.wait(lock, [&] { return ctx->stream_quit || ctx->stream_layer != done; });
+        if (ctx->stream_quit) {
+            break;
+        }
+        const int il = done = ctx->stream_layer;
+        lock.unlock();
+        resident[il] = true;
+        // the layers after the last are the first ones of the next token
+        for (int k = 1; k <= ahead; ++k) {
+            const int j = (il + k) % n_layer;
+            if (!resident[j]) {
+                llama_stream_advise(layers[j], true);
+                resident[j] = true;
+            }
+        }
+        for (int j = 0; j < n_layer; ++j) {
+            if (resident[j] && (j - il + n_layer) % n_layer > ahead) {
+                llama_stream_advise(layers[j], false);
+                resident[j] = false;
+            }
+        }
+        lock.lock();
+    }
+}
+
+// called by the cpu backend before each node, to tell the stream thread
+// when it moves on to the weights of another layer
+static void llama_stream_node(const struct ggml_tensor * node, void * data) {
+    struct llama_context * ctx = (struct llama_context *) data;
+    for (int i = 0; i < GGML_MAX_SRC; ++i) {
+        if (!node->src[i]) {
+            continue;
+        }
+        const int il = llama_stream_find(ctx->model, node->src[i]->data);
+        if (il < 0) {
+            continue;
+        }
+        if (il != ctx->stream_seen) {
+            ctx->stream_seen = il;
+            {
+                std::lock_guard<std::mutex> lock(ctx->stream_mutex);
+                ctx->stream_layer = il;
+            }
+            ctx->stream_cv.notify_all();
+        }
+        return;
+    }
+}
+
 static void llama_graph_compute(
         llama_context & lctx,
           ggml_cgraph * gf,
@@ -11073,6 +13478,12 @@ static void llama_graph_compute(
     if (lctx.backend_cpu != nullptr) {
         ggml_backend_cpu_set_n_threads(lctx.backend_cpu, n_threads);
         ggml_backend_cpu_set_abort_callback(lctx.backend_cpu, lctx.abort_callback, lctx.abort_callback_data);
+        if (!lctx.model.stream_index.empty()) {
+            if (!lctx.stream_thread.joinable()) {
+                lctx.stream_thread = std::thread(llama_stream_worker, &lctx);
+            }
+            ggml_backend_cpu_set_node_callback(lctx.backend_cpu, llama_stream_node, &lctx);
+        }
     }
 
     ggml_backend_sched_graph_compute_async(lctx.sched, gf);
@@ -11084,6 +13495,67 @@ static void llama_graph_compute(
 #endif
 }
 
+// adds the experts that each moe layer of a computed graph picked to the
+// model's expert stats
+static void llama_count_experts(llama_context & lctx, struct ggml_cgraph * gf) {
+    const auto & model = lctx.model;
+    const uint32_t n_expert      = model.hparams.n_expert;
+    const uint32_t n_expert_used = model.hparams.n_expert_used;
+
+    ggml_backend_sched_synchronize(lctx.sched);
+
+    std::vector<int32_t> ids;
+    std::lock_guard<std::mutex> guard(model.expert_counts_lock);
+    for (uint32_t il = 0; il < model.hparams.n_layer; ++il) {
+        char name[GGML_MAX_NAME];
+        snprintf(name, sizeof(name), "ffn_moe_argsort-%u", il);
+        struct ggml_tensor * t = ggml_graph_get_tensor(gf, name);
+        if (!t) {
+            continue;
+        }
+        // the experts of each token by decreasing probability [n_expert, n_tokens]
+        ids.resize(ggml_nelements(t));
+        ggml_backend_tensor_get(t, ids.data(), 0, ggml_nbytes(t));
+        for (size_t i = 0; i < ids.size(); i += n_expert) {
+            for (uint32_t k = 0; k < n_expert_used; ++k) {
+                model.expert_counts[il*n_expert + ids[i + k]]++;
+            }
+        }
+    }
+}
+
+// retargets the KV cache stores of a reused graph by delta cells
+static void llama_graph_move_kv_store(llama_context & lctx, struct ggml_cgraph * gf, int64_t delta) {
+    if (!delta) {
+        return;
+    }
+
+    const auto & hparams = lctx.model.hparams;
+
+    for (int i = 0; i < gf->n_nodes; ++i) {
+        struct ggml_tensor * t = gf->nodes[i];
+        if (!t->view_src) {
+            continue;
+        }
+
+        size_t stride;
+        if (strncmp(t->name, "k_cache_view", 12) == 0) {
+            stride = ggml_row_size(t->view_src->type, hparams.n_embd_k_gqa());
+        } else if (strncmp(t->name, "v_cache_view", 12) == 0) {
+            // the V cache is transposed when not using flash attention
+            stride = lctx.cparams.flash_attn
+                ? ggml_row_size(t->view_src->type, hparams.n_embd_v_gqa())
+                : ggml_element_size(t->view_src);
+        } else {
+            continue;
+        }
+
+        GGML_ASSERT(t->view_src->data);
+        t->view_offs += delta*(int64_t) stride;
+        t->data = (char *) t->view_src->data + t->view_offs;
+    }
+}
+
 // decode a batch of tokens by evaluating the transformer
 //
 //   - lctx:      llama context
@@ -11104,6 +13576,17 @@ static int llama_decode_internal(
         return -1;
     }
 
+    if (batch_all.seq_id) {
+        for (uint32_t i = 0; i < n_tokens_all; ++i) {
+            for (int32_t s = 0; s < batch_all.n_seq_id[i]; ++s) {
+                if (batch_all.seq_id[i][s] < 0 || batch_all.seq_id[i][s] >= LLAMA_MAX_SEQ) {
+                    LLAMA_LOG_ERROR("%s: invalid seq_id[%u][%d] = %d >= %d\n", __func__, i, s, batch_all.seq_id[i][s], LLAMA_MAX_SEQ);
+                    return -1;
+                }
+            }
+        }
+    }
+
     const auto & model   = lctx.model;
     const auto & hparams = model.hparams;
     const auto & cparams = lctx.cparams;
@@ -11116,6 +13599,7 @@ static int llama_decode_internal(
 
     if (lctx.t_compute_start_us == 0) {
         lctx.t_compute_start_us = ggml_time_us();
+        lctx.j_compute_start = llamafile_energy();
     }
     lctx.n_queued_tokens += n_tokens_all;
 
@@ -11132,6 +13616,7 @@ static int llama_decode_internal(
 
     uint32_t n_outputs = 0;
     uint32_t n_outputs_prev = 0;
+    bool shortlisted = false;
 
     const auto n_ubatch = cparams.n_ubatch;
 
@@ -11158,6 +13643,12 @@ static int llama_decode_internal(
         return -2;
     };
 
+    lctx.n_top_k = 0;
+    if (cparams.logits_top_k > 0) {
+        lctx.top_k_ids.resize(n_outputs*cparams.logits_top_k);
+        lctx.top_k_logits.resize(n_outputs*cparams.logits_top_k);
+    }
+
     // set output mappings
     if (batch_all.logits) {
         int32_t i_logits = 0;
@@ -11262,10 +13753,57 @@ static int llama_decode_internal(
 
         //printf("kv_self.n = %5d, kv_self.used = %5d, kv_self.head = %5d\n", kv_self.n, kv_self.used, kv_self.head);
 
-        ggml_backend_sched_reset(lctx.sched);
-        ggml_backend_sched_set_eval_callback(lctx.sched, lctx.cparams.cb_eval, lctx.cparams.cb_eval_user_data);
+        // graphs that extract embeddings get trimmed below, and the
+        // recurrent ones read state at the kv head, so only reuse the rest
+        const bool can_reuse = !kv_self.recurrent && hparams.causal_attn && cparams.causal_attn && !cparams.embeddings &&
+                               kv_self.runs.size() <= 1 && ggml_backend_sched_get_n_copies(lctx.sched) == 1;
+
+        llama_graph_cache & gc = lctx.graph_cache;
+
+        llama_lora_prepare(lctx, u_batch);
+        llama_steering_prepare(lctx, u_batch);
+
+        // the logits biased on the backend need the whole vocab
+        lctx.shortlist_batch = !lctx.shortlist.empty() && lctx.n_outputs > 0 && !lctx.steer_bias &&
+                               !cparams.embeddings && hparams.causal_attn;
+        const uint32_t n_shortlist = lctx.shortlist_batch ? lctx.shortlist.size() : 0;
+
+        const bool reused = can_reuse && gc.gf &&
+                            gc.n_tokens  == n_tokens &&
+                            gc.n_kv      == kv_self.n &&
+                            gc.n_outputs == lctx.n_outputs &&
+                            gc.embd      == (u_batch.embd != nullptr) &&
+                            gc.steer_bias == lctx.steer_bias &&
+                            gc.steer_cvec == lctx.steer_cvec &&
+                            gc.n_shortlist == n_shortlist &&
+                            gc.lora      == lctx.lora_batch;
+
+        ggml_cgraph * gf = nullptr;
+
+        if (reused) {
+            gf = gc.gf;
+            llama_graph_move_kv_store(lctx, gf, (int64_t) kv_self.head - gc.kv_head);
+            gc.kv_head = kv_self.head;
+        } else {
+            ggml_backend_sched_reset(lctx.sched);
+            ggml_backend_sched_set_eval_callback(lctx.sched, lctx.cparams.cb_eval, lctx.cparams.cb_eval_user_data);
 
-        ggml_cgraph * gf = llama_build_graph(lctx, u_batch, false);
+            gf = llama_build_graph(lctx, u_batch, false);
+
+            gc = llama_graph_cache();
+            if (can_reuse) {
+                gc.gf        = gf;
+                gc.n_tokens  = n_tokens;
+                gc.n_kv      = kv_self.n;
+                gc.n_outputs = lctx.n_outputs;
+                gc.kv_head   = kv_self.head;
+                gc.embd      = u_batch.embd != nullptr;
+                gc.steer_bias = lctx.steer_bias;
+                gc.steer_cvec = lctx.steer_cvec;
+                gc.n_shortlist = n_shortlist;
+                gc.lora      = lctx.lora_batch;
+            }
+        }
 
         // the output is always the last tensor in the graph
         struct ggml_tensor * res  = gf->nodes[gf->n_nodes - 1];
@@ -11299,6 +13837,9 @@ static int llama_decode_internal(
                 // TODO: is this safe?
                 gf->n_nodes = i_embd + 1;
             }
+        } else if (lctx.t_top_k_logits) {
+            res  = nullptr; // only the most likely tokens are extracted
+            embd = nullptr;
         } else {
             embd = nullptr; // do not extract embeddings when not needed
             GGML_ASSERT(strcmp(res->name, "result_output") == 0 && "missing result_output tensor");
@@ -11324,12 +13865,35 @@ static int llama_decode_internal(
             n_threads = std::min(20, n_threads);
         }
 
-        ggml_backend_sched_alloc_graph(lctx.sched, gf);
+        if (!reused) {
+            ggml_backend_sched_alloc_graph(lctx.sched, gf);
+        }
 
         llama_set_inputs(lctx, u_batch);
 
         llama_graph_compute(lctx, gf, n_threads);
 
+        if (!lctx.model.expert_counts.empty()) {
+            llama_count_experts(lctx, gf);
+        }
+
+        // save the states of the sequences that have come far enough
+        if (kv_self.recurrent && cparams.n_seq_checkpoint > 0) {
+            bool synced = false;
+            for (uint32_t s = kv_self.head; s < kv_self.head + kv_self.n; ++s) {
+                const auto & ckpts = kv_self.checkpoints[s];
+                const llama_pos p_last = ckpts.empty() ? -1 : ckpts.back().pos;
+                if (kv_self.cells[s].pos - p_last < (llama_pos) cparams.n_seq_checkpoint) {
+                    continue;
+                }
+                if (!synced) {
+                    ggml_backend_sched_synchronize(lctx.sched);
+                    synced = true;
+                }
+                llama_kv_cache_seq_checkpoint(kv_self, s);
+            }
+        }
+
         // update the kv ring buffer
         {
             kv_self.head += n_tokens;
@@ -11340,6 +13904,27 @@ static int llama_decode_internal(
             }
         }
 
+        // free the cells that slid out of the attention window, which no
+        // token after this batch can see, so sequences can run on past
+        // n_ctx without a context shift. this assumes that sequences only
+        // grow, since the cells a rewound sequence needs may be gone.
+        if (cparams.swa_evict && hparams.n_swa && hparams.causal_attn) {
+            std::unordered_map<llama_seq_id, llama_pos> pos_max;
+            for (uint32_t i = 0; i < n_tokens; ++i) {
+                for (int32_t s = 0; s < u_batch.n_seq_id[i]; ++s) {
+                    auto it = pos_max.emplace(u_batch.seq_id[i][s], u_batch.pos[i]).first;
+                    it->second = std::max(it->second, u_batch.pos[i]);
+                }
+            }
+            for (const auto & it : pos_max) {
+                // the next token is at pos + 1 and sees the n_swa positions before it
+                const llama_pos p1 = it.second + 2 - (llama_pos) hparams.n_swa;
+                if (p1 > 0) {
+                    llama_kv_cache_seq_rm(kv_self, it.first, -1, p1);
+                }
+            }
+        }
+
 #ifdef GGML_PERF
         // print timing information per ggml operation (for debugging purposes)
         // requires GGML_PERF to be defined
@@ -11363,10 +13948,45 @@ static int llama_decode_internal(
             if (n_outputs_new) {
                 GGML_ASSERT( n_outputs_prev + n_outputs_new <= n_outputs);
                 GGML_ASSERT((n_outputs_prev + n_outputs_new)*n_vocab <= (int64_t) lctx.logits_size);
-                ggml_backend_tensor_get_async(backend_res, res, logits_out, 0, n_outputs_new*n_vocab*sizeof(float));
+                if (lctx.inp_shortlist) {
+                    // spread the logits of the shortlist out over the vocab
+                    const int64_t n_shortlist = lctx.shortlist.size();
+                    GGML_ASSERT(res->ne[0] == n_shortlist);
+                    lctx.shortlist_logits.resize(n_outputs_new*n_shortlist);
+                    ggml_backend_tensor_get_async(backend_res, res, lctx.shortlist_logits.data(), 0, n_outputs_new*n_shortlist*sizeof(float));
+                    ggml_backend_synchronize(backend_res);
+                    std::fill(logits_out, logits_out + n_outputs_new*n_vocab, -INFINITY);
+                    for (int32_t i = 0; i < n_outputs_new; ++i) {
+                        for (int64_t j = 0; j < n_shortlist; ++j) {
+                            logits_out[i*n_vocab + lctx.shortlist[j]] = lctx.shortlist_logits[i*n_shortlist + j];
+                        }
+                    }
+                    shortlisted = true;
+                } else {
+                    ggml_backend_tensor_get_async(backend_res, res, logits_out, 0, n_outputs_new*n_vocab*sizeof(float));
+                }
             }
         }
 
+        // extract the most likely tokens
+        if (lctx.t_top_k_logits && lctx.n_outputs) {
+            ggml_tensor * ids    = lctx.t_top_k_ids;
+            ggml_tensor * logits = lctx.t_top_k_logits;
+
+            const int32_t k = ids->ne[0];
+            const int32_t n_outputs_new = lctx.n_outputs;
+
+            GGML_ASSERT(ids->ne[1] == n_outputs_new);
+            GGML_ASSERT((n_outputs_prev + n_outputs_new)*k <= (int64_t) lctx.top_k_ids.size());
+
+            ggml_backend_tensor_get_async(ggml_backend_sched_get_tensor_backend(lctx.sched, ids), ids,
+                    lctx.top_k_ids.data() + n_outputs_prev*k, 0, n_outputs_new*k*sizeof(llama_token));
+            ggml_backend_tensor_get_async(ggml_backend_sched_get_tensor_backend(lctx.sched, logits), logits,
+                    lctx.top_k_logits.data() + n_outputs_prev*k, 0, n_outputs_new*k*sizeof(float));
+
+            lctx.n_top_k = k;
+        }
+
         // extract embeddings
         if (embd) {
             ggml_backend_t backend_embd = ggml_backend_sched_get_tensor_backend(lctx.sched, embd);
@@ -11416,6 +14036,11 @@ static int llama_decode_internal(
     // set to total number of outputs in the batch, for use in llama_get_logits_ith
     lctx.n_outputs = n_outputs;
 
+    // the ubatches that were shortlisted have no top k of their own
+    if (shortlisted) {
+        lctx.n_top_k = 0;
+    }
+
     // wait for the computation to finish (automatically done when obtaining the model output)
     //llama_synchronize(&lctx);
 
@@ -11432,8 +14057,10 @@ static int llama_decode_internal(
     }
 
     // Reset state for the next token before backend sync, to allow the CPU activities in the reset to
-    // overlap with device computation.
-    ggml_backend_sched_reset(lctx.sched);
+    // overlap with device computation. A graph kept for reuse needs the state.
+    if (!lctx.graph_cache.gf) {
+        ggml_backend_sched_reset(lctx.sched);
+    }
 
     return 0;
 }
@@ -11452,10 +14079,22 @@ static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
 
     assert(n_used <= n_kv);
 
-    //const int64_t t_start = ggml_time_us();
+    const int64_t t_start = ggml_time_us();
 
     // number of cells moved
     uint32_t n_moves = 0;
+    uint32_t n_cells = 0;
+
+    // with a time budget, move only as many cells as we can afford and
+    // leave the rest to the next updates. the first pass has to guess.
+    uint32_t max_cells = n_kv;
+    if (lctx.cparams.defrag_max_ms > 0.0f) {
+        if (kv_self.defrag_us_per_cell > 0.0f) {
+            max_cells = std::max(1.0f, lctx.cparams.defrag_max_ms*1000.0f/kv_self.defrag_us_per_cell);
+        } else {
+            max_cells = kv_self.block_size;
+        }
+    }
 
     // each move requires 6*n_layer tensors (see build_defrag)
     //   - source view, destination view, copy operation
@@ -11536,7 +14175,12 @@ static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
                 continue;
             }
 
-            // this cell goes to (i0 + nf)
+            if (n_cells == max_cells) {
+                stop = true;
+                break;
+            }
+
+            // this cell goes to (i0 + nf)
             ids[i1] = i0 + nf;
 
             // move the cell meta data
@@ -11552,13 +14196,14 @@ static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
             }
 
             nf++;
+            n_cells++;
 
             if (nf == nh) {
                 break;
             }
         }
 
-        if (stop || n_moves == max_moves) {
+        if (stop || n_moves == max_moves || n_cells == max_cells) {
             break;
         }
 
@@ -11571,6 +14216,8 @@ static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
         return;
     }
 
+    llama_kv_cache_index_rebuild(kv_self);
+
     //LLAMA_LOG_INFO("(tmp log) KV defrag cell moves: %u\n", n_moves);
 
     //LLAMA_LOG_INFO("expected gf nodes: %u\n", 6*n_moves*n_layer);
@@ -11655,7 +14302,17 @@ static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
     llama_graph_compute(lctx, gf, lctx.cparams.n_threads);
 #endif
 
-    //const int64_t t_end = ggml_time_us();
+    if (lctx.cparams.defrag_max_ms > 0.0f) {
+        ggml_backend_sched_synchronize(lctx.sched);
+
+        const int64_t t_end = ggml_time_us();
+
+        // the cost per cell is not quite linear, so keep a moving average
+        const float us_per_cell = float(t_end - t_start)/n_cells;
+        kv_self.defrag_us_per_cell = kv_self.defrag_us_per_cell > 0.0f
+            ? 0.75f*kv_self.defrag_us_per_cell + 0.25f*us_per_cell
+            : us_per_cell;
+    }
 
     //LLAMA_LOG_INFO("(tmp log) KV defrag time: %.3f ms\n", (t_end - t_start)/1000.0);
 }
@@ -11663,9 +14320,30 @@ static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
 static void llama_kv_cache_update_internal(struct llama_context & lctx) {
     bool need_reserve = false;
 
+    // all of the graphs below overwrite the one kept for reuse
+    if (lctx.kv_self.has_shift || lctx.kv_self.do_copy || lctx.kv_self.do_defrag) {
+        lctx.graph_cache = llama_graph_cache();
+    }
+
     // apply K-shift if needed
     if (lctx.model.hparams.rope_type != LLAMA_ROPE_TYPE_NONE && lctx.kv_self.has_shift) {
+        // a context shift only moves the cells of one sequence, past the
+        // tokens it keeps, so the cells of the other sequences and the
+        // ones in front are left out, rather than rotated by zero
         {
+            auto & kv_self = lctx.kv_self;
+
+            kv_self.shift_begin = kv_self.size;
+            kv_self.shift_end   = 0;
+            for (uint32_t i = 0; i < kv_self.size; ++i) {
+                if (kv_self.cells[i].delta != 0) {
+                    kv_self.shift_begin = std::min(kv_self.shift_begin, i);
+                    kv_self.shift_end   = i + 1;
+                }
+            }
+        }
+
+        if (lctx.kv_self.shift_begin < lctx.kv_self.shift_end) {
             ggml_backend_sched_reset(lctx.sched);
 
             ggml_cgraph * gf = llama_build_graph_k_shift(lctx);
@@ -11684,7 +14362,7 @@ static void llama_kv_cache_update_internal(struct llama_context & lctx) {
 
             kv_self.has_shift = false;
 
-            for (uint32_t i = 0; i < kv_self.size; ++i) {
+            for (uint32_t i = kv_self.shift_begin; i < kv_self.shift_end; ++i) {
                 kv_self.cells[i].delta = 0;
             }
         }
@@ -11837,13 +14515,49 @@ struct llm_symbol {
 
 static_assert(std::is_trivially_copyable<llm_symbol>::value, "llm_symbol is not trivially copyable");
 
+// big inputs, like the files perplexity and imatrix read, are cut into
+// pieces no merge can reach across, which are tokenized on all cores
+
+#define LLAMA_TOKENIZE_CHUNK (256 * 1024)
+
+static void llama_tokenize_chunks(size_t n_chunks, std::vector<llama_vocab::id> & output,
+                                  const std::function<void(size_t, std::vector<llama_vocab::id> &)> & tokenize_chunk) {
+    std::vector<std::vector<llama_vocab::id>> results(n_chunks);
+    std::vector<std::exception_ptr> errors(n_chunks);
+    std::atomic<size_t> next{0};
+    auto work = [&] {
+        for (size_t i; (i = next++) < n_chunks;) {
+            try {
+                tokenize_chunk(i, results[i]);
+            } catch (...) {
+                errors[i] = std::current_exception();
+            }
+        }
+    };
+    const size_t n_threads = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), n_chunks);
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < n_threads; ++i) {
+        threads.emplace_back(work);
+    }
+    work();
+    for (auto & thread : threads) {
+        thread.join();
+    }
+    for (size_t i = 0; i < n_chunks; ++i) {
+        if (errors[i]) {
+            std::rethrow_exception(errors[i]);
+        }
+        output.insert(output.end(), results[i].begin(), results[i].end());
+    }
+}
+
 // SPM tokenizer
 // original implementation:
 // https://github.com/ggerganov/llama.cpp/commit/074bea2eb1f1349a0118239c4152914aecaa1be4
 
 struct llm_bigram_spm {
     struct comparator {
-        bool operator()(llm_bigram_spm & l, llm_bigram_spm & r) {
+        bool operator()(const llm_bigram_spm & l, const llm_bigram_spm & r) const {
             return (l.score < r.score) || (l.score == r.score && l.left > r.left);
         }
     };
@@ -11851,6 +14565,7 @@ struct llm_bigram_spm {
     using queue = std::priority_queue<llm_bigram_spm, queue_storage, comparator>;
     llm_symbol::index left;
     llm_symbol::index right;
+    llama_vocab::id id;
     float score;
     size_t size;
 };
@@ -11862,6 +14577,7 @@ struct llm_tokenizer_spm {
         // split string into utf8 chars
         int index = 0;
         size_t offs = 0;
+        symbols.reserve(text.size());
         while (offs < text.size()) {
             llm_symbol sym;
             size_t len = utf8_len(text[offs]);
@@ -11873,6 +14589,7 @@ struct llm_tokenizer_spm {
             index++;
             symbols.emplace_back(sym);
         }
+        ids.assign(symbols.size(), -1);
 
         // seed the work queue with all possible 2-character tokens.
         for (size_t i = 1; i < symbols.size(); ++i) {
@@ -11896,6 +14613,7 @@ struct llm_tokenizer_spm {
             // merge the right sym into the left one
             left_sym.n += right_sym.n;
             right_sym.n = 0;
+            ids[bigram.left] = bigram.id;
 
             //LLAMA_LOG_INFO("left = '%*s' size = %zu\n", (int) left_sym.n, left_sym.text, bigram.size);
 
@@ -11911,36 +14629,28 @@ struct llm_tokenizer_spm {
         }
 
         for (int i = 0; i != -1; i = symbols[i].next) {
-            auto & symbol = symbols[i];
-            resegment(symbol, output);
+            resegment(i, output);
         }
     }
 
 private:
-    void resegment(llm_symbol & symbol, std::vector<llama_vocab::id> & output) {
-        auto text = std::string(symbol.text, symbol.n);
-        auto token = vocab.token_to_id.find(text);
+    // a merged symbol is the token of its last merge, and a character
+    // that never merged is a token of its own or falls back to bytes
+    void resegment(int i, std::vector<llama_vocab::id> & output) {
+        const llm_symbol & symbol = symbols[i];
+        llama_vocab::id token_id = ids[i] >= 0 ? ids[i] : vocab.find_token(symbol.text, symbol.n);
 
         // Do we need to support is_unused?
-        if (token != vocab.token_to_id.end()) {
-            output.push_back((*token).second);
+        if (token_id >= 0) {
+            output.push_back(token_id);
             return;
         }
 
-        const auto p = rev_merge.find(text);
-
-        if (p == rev_merge.end()) {
-            // output any symbols that did not form tokens as bytes.
-            output.reserve(output.size() + symbol.n);
-            for (int j = 0; j < (int)symbol.n; ++j) {
-                llama_vocab::id token_id = llama_byte_to_token(vocab, symbol.text[j]);
-                output.push_back(token_id);
-            }
-            return;
+        // output any symbols that did not form tokens as bytes.
+        output.reserve(output.size() + symbol.n);
+        for (int j = 0; j < (int)symbol.n; ++j) {
+            output.push_back(llama_byte_to_token(vocab, symbol.text[j]));
         }
-
-        resegment(symbols[p->second.first],  output);
-        resegment(symbols[p->second.second], output);
     }
 
     void try_add_bigram(int left, int right) {
@@ -11948,39 +14658,59 @@ private:
             return;
         }
 
-        const std::string text = std::string(symbols[left].text, symbols[left].n + symbols[right].n);
-        auto token = vocab.token_to_id.find(text);
-
-        if (token == vocab.token_to_id.end()) {
-            return;
-        }
+        const size_t size = symbols[left].n + symbols[right].n;
+        const llama_vocab::id token_id = vocab.find_token(symbols[left].text, size);
 
-        if (static_cast<size_t>((*token).second) >= vocab.id_to_token.size()) {
+        // Do we need to support is_unused?
+        if (token_id < 0) {
             return;
         }
 
-        const auto & tok_data = vocab.id_to_token[(*token).second];
-
         llm_bigram_spm bigram;
         bigram.left  = left;
         bigram.right = right;
-        bigram.score = tok_data.score;
-        bigram.size  = text.size();
+        bigram.id    = token_id;
+        bigram.score = vocab.id_to_token[token_id].score;
+        bigram.size  = size;
 
         work_queue.push(bigram);
-
-        // Do we need to support is_unused?
-        rev_merge[text] = std::make_pair(left, right);
     }
 
     const llama_vocab & vocab;
 
     std::vector<llm_symbol> symbols;
+    std::vector<llama_vocab::id> ids; // token each symbol merged into, or -1
     llm_bigram_spm::queue work_queue;
-
-    std::map<std::string, std::pair<int, int>> rev_merge;
 };
 
+static void llm_tokenize_spm(const llama_vocab & vocab, const std::string & text, std::vector<llama_vocab::id> & output) {
+    if (!vocab.spm_splittable || text.size() < 2 * LLAMA_TOKENIZE_CHUNK) {
+        llm_tokenizer_spm tokenizer(vocab);
+        tokenizer.tokenize(text, output);
+        return;
+    }
+
+    // no merge reaches across a ▁ that follows other text
+    static const char k_space[] = "\xE2\x96\x81";
+    std::vector<size_t> cuts = { 0 };
+    for (size_t pos = LLAMA_TOKENIZE_CHUNK; pos < text.size(); pos = cuts.back() + LLAMA_TOKENIZE_CHUNK) {
+        size_t cut = text.find(k_space, pos);
+        while (cut != std::string::npos && text.compare(cut - 3, 3, k_space) == 0) {
+            cut = text.find(k_space, cut + 3);
+        }
+        if (cut == std::string::npos) {
+            break;
+        }
+        cuts.push_back(cut);
+    }
+    cuts.push_back(text.size());
+    llama_tokenize_chunks(cuts.size() - 1, output, [&](size_t i, std::vector<llama_vocab::id> & chunk) {
+        const std::string piece = text.substr(cuts[i], cuts[i + 1] - cuts[i]);
+        llm_tokenizer_spm tokenizer(vocab);
+        tokenizer.tokenize(piece, chunk);
+    });
+}
+
 // BPE tokenizer
 // adapted from https://github.com/cmp-nct/ggllm.cpp [MIT License]
 // tried to simplify unicode stuff, so most likely does not work 100% correctly!
@@ -11998,17 +14728,16 @@ struct llm_bigram_bpe {
     using queue = std::priority_queue<llm_bigram_bpe, queue_storage, comparator>;
     llm_symbol::index left;
     llm_symbol::index right;
-    std::string text;
+    llama_vocab::id left_id;
+    llama_vocab::id right_id;
+    llama_vocab::id result;
     int rank;
-    size_t size;
 };
 
 struct llm_tokenizer_bpe {
     llm_tokenizer_bpe(const llama_vocab & vocab): vocab(vocab) {}
 
     void tokenize(const std::string & text, std::vector<llama_vocab::id> & output) {
-        int final_prev_index = -1;
-
         std::vector<std::string> word_collection;
         switch (vocab.type) {
             case LLAMA_VOCAB_TYPE_BPE:
@@ -12089,11 +14818,44 @@ struct llm_tokenizer_bpe {
                 break;
         }
 
-        symbols_final.clear();
+        if (text.size() < 2 * LLAMA_TOKENIZE_CHUNK) {
+            tokenize_words(word_collection, 0, word_collection.size(), vocab.bpe_cache, output);
+            return;
+        }
+
+        // words are merged on their own, so any of them may begin a chunk
+        std::vector<size_t> cuts = { 0 };
+        size_t n_bytes = 0;
+        for (size_t i = 0; i < word_collection.size(); ++i) {
+            n_bytes += word_collection[i].size();
+            if (n_bytes >= LLAMA_TOKENIZE_CHUNK) {
+                cuts.push_back(i + 1);
+                n_bytes = 0;
+            }
+        }
+        if (cuts.back() != word_collection.size()) {
+            cuts.push_back(word_collection.size());
+        }
+        llama_tokenize_chunks(cuts.size() - 1, output, [&](size_t i, std::vector<llama_vocab::id> & chunk) {
+            // a cache of its own, which doesn't need to be fought over
+            llama_bpe_cache cache;
+            llm_tokenizer_bpe tokenizer(vocab);
+            tokenizer.tokenize_words(word_collection, cuts[i], cuts[i + 1], cache, chunk);
+        });
+    }
+
+    void tokenize_words(const std::vector<std::string> & words, size_t begin, size_t end,
+                        llama_bpe_cache & cache, std::vector<llama_vocab::id> & output) {
+        for (size_t w = begin; w < end; ++w) {
+            const std::string & word = words[w];
+            if (word.empty() || cache.get(word, output)) {
+                continue;
+            }
+            const size_t n_output = output.size();
 
-        for (auto & word : word_collection) {
             work_queue = llm_bigram_bpe::queue();
             symbols.clear();
+            symbol_ids.clear();
 
             int index = 0;
             size_t offset = 0;
@@ -12108,6 +14870,7 @@ struct llm_tokenizer_bpe {
                 sym.next = offset == word.size() ? -1 : index + 1;
                 index++;
                 symbols.emplace_back(sym);
+                symbol_ids.push_back(vocab.find_token(sym.text, sym.n));
             }
             for (size_t i = 1; i < symbols.size(); ++i) {
                 add_new_bigram(i - 1, i);
@@ -12124,15 +14887,14 @@ struct llm_tokenizer_bpe {
                 if (left_symbol.n == 0 || right_symbol.n == 0) {
                     continue;
                 }
-                std::string left_token = std::string(left_symbol.text, left_symbol.n);
-                std::string right_token = std::string(right_symbol.text, right_symbol.n);
-                if (left_token + right_token != bigram.text) {
+                if (symbol_ids[bigram.left] != bigram.left_id || symbol_ids[bigram.right] != bigram.right_id) {
                     continue;  // Skip this bigram if it's outdated
                 }
 
                 // merge the right sym into the left one
                 left_symbol.n += right_symbol.n;
                 right_symbol.n = 0;
+                symbol_ids[bigram.left] = bigram.result;
 
                 // remove the right sym from the chain
                 left_symbol.next = right_symbol.next;
@@ -12144,45 +14906,23 @@ struct llm_tokenizer_bpe {
                 add_new_bigram(bigram.left, left_symbol.next);  // right side of current symbol
             }
 
-            // add the finished tokens to the final list keeping correct order for next and prev
-            for (auto & sym : symbols) {
-                if (sym.n > 0) {
-                    sym.prev = final_prev_index;
-                    sym.next = -1;
-                    if (final_prev_index != -1) {
-                        symbols_final[final_prev_index].next = symbols_final.size();
-                    }
-                    symbols_final.emplace_back(sym);
-                    final_prev_index = symbols_final.size() - 1;
-                }
-            }
-        }
-
-        symbols = symbols_final;
-
-        if (!symbols.empty()) {
             for (int i = 0; i != -1; i = symbols[i].next) {
-                auto & symbol = symbols[i];
-                if (symbol.n == 0) {
+                const auto & symbol = symbols[i];
+                if (symbol_ids[i] >= 0) {
+                    output.push_back(symbol_ids[i]);
                     continue;
                 }
-
-                const std::string str = std::string(symbol.text, symbol.n);
-                const auto token = vocab.token_to_id.find(str);
-
-                if (token == vocab.token_to_id.end()) {
-                    for (auto j = str.begin(); j != str.end(); ++j) {
-                        std::string byte_str(1, *j);
-                        auto token_multibyte = vocab.token_to_id.find(byte_str);
-                        if (token_multibyte == vocab.token_to_id.end()) {
-                            throw std::runtime_error("ERROR: byte not found in vocab");
-                        }
-                        output.push_back((*token_multibyte).second);
+                for (size_t j = 0; j < symbol.n; ++j) {
+                    std::string byte_str(1, symbol.text[j]);
+                    auto token_multibyte = vocab.token_to_id.find(byte_str);
+                    if (token_multibyte == vocab.token_to_id.end()) {
+                        throw std::runtime_error("ERROR: byte not found in vocab");
                     }
-                } else {
-                    output.push_back((*token).second);
+                    output.push_back((*token_multibyte).second);
                 }
             }
+
+            cache.put(word, output.data() + n_output, output.size() - n_output);
         }
     }
 
@@ -12192,24 +14932,20 @@ private:
             return;
         }
 
-        std::string left_token  = std::string(symbols[left].text,  symbols[left].n);
-        std::string right_token = std::string(symbols[right].text, symbols[right].n);
+        const auto * merge = vocab.find_bpe_merge(symbol_ids[left], symbol_ids[right]);
 
-        int rank_found = -1;
-
-        rank_found = vocab.find_bpe_rank(left_token, right_token);
-
-        if (rank_found < 0) {
+        if (!merge) {
             return;
         }
 
         llm_bigram_bpe bigram;
 
-        bigram.left  = left;
-        bigram.right = right;
-        bigram.text  = left_token + right_token;
-        bigram.size  = left_token.size() + right_token.size();
-        bigram.rank  = rank_found;
+        bigram.left     = left;
+        bigram.right    = right;
+        bigram.left_id  = symbol_ids[left];
+        bigram.right_id = symbol_ids[right];
+        bigram.result   = merge->result;
+        bigram.rank     = merge->rank;
 
         work_queue.push(bigram);
     }
@@ -12217,7 +14953,7 @@ private:
     const llama_vocab & vocab;
 
     std::vector<llm_symbol> symbols;
-    std::vector<llm_symbol> symbols_final;
+    std::vector<llama_vocab::id> symbol_ids;
 
     llm_bigram_bpe::queue work_queue;
 };
@@ -12518,9 +15254,8 @@ static std::vector<llama_vocab::id> llama_tokenize_internal(const llama_vocab &
 #ifdef PRETOKENIZERDEBUG
                         LLAMA_LOG_WARN("TT: (%ld %ld %ld) '%s'\n", raw_text.length(), fragment.offset, fragment.length, raw_text.c_str());
 #endif
-                        llm_tokenizer_spm tokenizer(vocab);
                         llama_escape_whitespace(raw_text);
-                        tokenizer.tokenize(raw_text, output);
+                        llm_tokenize_spm(vocab, raw_text, output);
                     } else { // if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_TOKEN)
                         output.push_back(fragment.token);
                     }
@@ -12906,6 +15641,233 @@ static std::vector<llama_grammar_candidate> llama_grammar_reject_candidates(
     return rejects;
 }
 
+// Every sampling step would otherwise run the whole vocabulary through
+// the parser, even though constrained output like JSON keeps revisiting
+// the same few parser states. So the set of tokens that a state allows
+// is computed once, and kept as a bitset. States can't be enumerated
+// ahead of time, since the stacks of a pushdown parser don't have to be
+// bounded, which is why the cache fills in lazily instead. It is keyed
+// on the rules too, so each request for the same schema reuses the
+// bitsets of the ones before it.
+
+#define LLAMA_GRAMMAR_MAX_STATES 256
+#define LLAMA_GRAMMAR_MAX_CACHED 8
+
+struct llama_grammar_masks {
+    std::mutex lock;
+
+    size_t                                          hash;
+    std::vector<std::vector<llama_grammar_element>> rules;
+
+    // bit i of a mask is set if token i of this model is allowed in that state
+    const llama_model                                    * model = nullptr;
+    std::map<std::vector<uint32_t>, std::vector<uint32_t>> states;
+};
+
+static std::mutex                                        g_grammar_masks_lock;
+static std::vector<std::shared_ptr<llama_grammar_masks>> g_grammar_masks;
+
+static size_t llama_grammar_hash_rules(const std::vector<std::vector<llama_grammar_element>> & rules) {
+    size_t h = 0xcbf29ce484222325ull;
+    for (const auto & rule : rules) {
+        for (const auto & elem : rule) {
+            h = (h ^ elem.type)  * 0x100000001b3ull;
+            h = (h ^ elem.value) * 0x100000001b3ull;
+        }
+    }
+    return h;
+}
+
+static bool llama_grammar_same_rules(
+        const std::vector<std::vector<llama_grammar_element>> & a,
+        const std::vector<std::vector<llama_grammar_element>> & b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); i++) {
+        if (a[i].size() != b[i].size()) {
+            return false;
+        }
+        for (size_t j = 0; j < a[i].size(); j++) {
+            if (a[i][j].type != b[i][j].type || a[i][j].value != b[i][j].value) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// returns cache of masks for grammars with these rules, most recently used ones are kept
+static std::shared_ptr<llama_grammar_masks> llama_grammar_get_masks(
+        const std::vector<std::vector<llama_grammar_element>> & rules) {
+    const size_t hash = llama_grammar_hash_rules(rules);
+    std::lock_guard<std::mutex> lock(g_grammar_masks_lock);
+    for (size_t i = 0; i < g_grammar_masks.size(); i++) {
+        auto masks = g_grammar_masks[i];
+        if (masks->hash == hash && llama_grammar_same_rules(masks->rules, rules)) {
+            g_grammar_masks.erase(g_grammar_masks.begin() + i);
+            g_grammar_masks.push_back(masks);
+            return masks;
+        }
+    }
+    auto masks = std::make_shared<llama_grammar_masks>();
+    masks->hash  = hash;
+    masks->rules = rules;
+    if (g_grammar_masks.size() == LLAMA_GRAMMAR_MAX_CACHED) {
+        g_grammar_masks.erase(g_grammar_masks.begin());
+    }
+    g_grammar_masks.push_back(masks);
+    return masks;
+}
+
+// identifies parser state by position within rules, so it's the same for copies of grammar
+static std::vector<uint32_t> llama_grammar_state_key(const struct llama_grammar * grammar) {
+    std::vector<uint32_t> key;
+    key.push_back(grammar->partial_utf8.value);
+    key.push_back(grammar->partial_utf8.n_remain);
+    for (const auto & stack : grammar->stacks) {
+        key.push_back(stack.size());
+        for (const llama_grammar_element * pos : stack) {
+            for (size_t ir = 0; ir < grammar->rules.size(); ir++) {
+                const auto & rule = grammar->rules[ir];
+                if (rule.data() <= pos && pos < rule.data() + rule.size()) {
+                    key.push_back(ir);
+                    key.push_back(pos - rule.data());
+                    break;
+                }
+            }
+        }
+    }
+    return key;
+}
+
+// walks the vocabulary trie, so the code points that tokens have in common are only matched once
+static void llama_grammar_walk_vocab(
+        const llama_vocab & vocab, const struct llama_grammar * grammar, std::vector<uint32_t> & mask) {
+    const uint32_t * cps = vocab.cp_data.data();
+
+    // stacks[d] is what remains of the grammar after the first d code points of the current token
+    std::vector<std::vector<std::vector<const llama_grammar_element *>>> stacks(1, grammar->stacks);
+    uint32_t failed = UINT32_MAX; // code point at this depth was rejected
+
+    for (size_t i = 0; i < vocab.cp_order.size(); i++) {
+        const llama_token id     = vocab.cp_order[i];
+        const uint32_t    shared = vocab.cp_shared[i];
+        const uint32_t  * token  = cps + vocab.cp_offsets[id];
+        if (shared > failed) {
+            continue;
+        }
+        failed = UINT32_MAX;
+        uint32_t depth = std::min<uint32_t>(shared, stacks.size() - 1);
+        stacks.resize(depth + 1);
+        for (; token[depth]; depth++) {
+            std::vector<std::vector<const llama_grammar_element *>> next;
+            llama_grammar_accept(grammar->rules, stacks[depth], token[depth], next);
+            if (next.empty()) {
+                failed = depth;
+                break;
+            }
+            stacks.push_back(std::move(next));
+        }
+        if (failed != UINT32_MAX) {
+            continue;
+        }
+        const llama_partial_utf8 partial = vocab.cp_partials[id];
+        bool allowed = partial.n_remain == 0;
+        for (const auto & stack : stacks[depth]) {
+            if (allowed) {
+                break;
+            }
+            allowed = !stack.empty() && llama_grammar_match_partial_char(stack.back(), partial);
+        }
+        if (allowed) {
+            mask[id / 32] |= 1u << (id % 32);
+        }
+    }
+}
+
+// runs every token in the vocabulary through the parser in its current state
+static std::vector<uint32_t> llama_grammar_build_mask(
+        struct llama_context * ctx, const struct llama_grammar * grammar) {
+    const llama_vocab & vocab   = ctx->model.vocab;
+    const int32_t       n_vocab = llama_n_vocab(&ctx->model);
+
+    std::vector<uint32_t> mask((n_vocab + 31) / 32);
+    for (const auto & stack : grammar->stacks) {
+        if (stack.empty()) {
+            for (const llama_token id : { vocab.special_eos_id, vocab.special_eot_id }) {
+                if (0 <= id && id < n_vocab) {
+                    mask[id / 32] |= 1u << (id % 32);
+                }
+            }
+            break;
+        }
+    }
+
+    if (grammar->partial_utf8.n_remain == 0) {
+        llama_grammar_walk_vocab(vocab, grammar, mask);
+        return mask;
+    }
+
+    // the trie doesn't continue a sequence that a previous token split
+    std::vector<std::pair<std::vector<uint32_t>, llama_partial_utf8>> candidates_decoded;
+    std::vector<llama_grammar_candidate>                              candidates_grammar;
+    candidates_decoded.reserve(n_vocab);
+    candidates_grammar.reserve(n_vocab);
+    for (llama_token id = 0; id < n_vocab; id++) {
+        if (vocab.cp_text[id]) {
+            int32_t length;
+            const char * piece = llama_token_get_piece(&ctx->model, id, false, &length);
+            mask[id / 32] |= 1u << (id % 32);
+            candidates_decoded.push_back(decode_utf8(std::string(piece, length), grammar->partial_utf8));
+            candidates_grammar.push_back({ (size_t) id, candidates_decoded.back().first.data(), candidates_decoded.back().second });
+        }
+    }
+    const auto rejects = llama_grammar_reject_candidates(grammar->rules, grammar->stacks, candidates_grammar);
+    for (const auto & reject : rejects) {
+        mask[reject.index / 32] &= ~(1u << (reject.index % 32));
+    }
+    return mask;
+}
+
+// applies memoized mask for current state, returning false if caller should check tokens itself
+static bool llama_grammar_apply_mask(
+        struct llama_context * ctx, llama_token_data_array * candidates, const struct llama_grammar * grammar) {
+    if (!grammar->masks) {
+        return false;
+    }
+    llama_grammar_masks & masks = *grammar->masks;
+    const int32_t n_vocab = llama_n_vocab(&ctx->model);
+    std::lock_guard<std::mutex> lock(masks.lock);
+
+    if (masks.model != &ctx->model) {
+        masks.model = &ctx->model;
+        masks.states.clear();
+    }
+
+    auto key = llama_grammar_state_key(grammar);
+    auto it  = masks.states.find(key);
+    if (it == masks.states.end()) {
+        // it's cheaper to check a handful of tokens directly than the whole vocab
+        if (candidates->size * 4 < (size_t) n_vocab) {
+            return false;
+        }
+        if (masks.states.size() == LLAMA_GRAMMAR_MAX_STATES) {
+            masks.states.clear();
+        }
+        it = masks.states.emplace(std::move(key), llama_grammar_build_mask(ctx, grammar)).first;
+    }
+
+    const uint32_t * mask = it->second.data();
+    for (size_t i = 0; i < candidates->size; ++i) {
+        const llama_token id = candidates->data[i].id;
+        if (!(mask[id / 32] & (1u << (id % 32)))) {
+            candidates->data[i].logit = -INFINITY;
+        }
+    }
+    return true;
+}
+
 //
 // grammar - external
 //
@@ -12947,7 +15909,9 @@ struct llama_grammar * llama_grammar_init(
         }
     } while (true);
 
-    return new llama_grammar{ std::move(vec_rules), std::move(stacks), {} };
+    auto masks = llama_grammar_get_masks(vec_rules);
+
+    return new llama_grammar{ std::move(vec_rules), std::move(stacks), {}, std::move(masks) };
 }
 
 void llama_grammar_free(struct llama_grammar * grammar) {
@@ -12955,18 +15919,29 @@ void llama_grammar_free(struct llama_grammar * grammar) {
 }
 
 struct llama_grammar * llama_grammar_copy(const struct llama_grammar * grammar) {
-    llama_grammar * result = new llama_grammar{ grammar->rules, grammar->stacks, grammar->partial_utf8 };
-
-    // redirect elements in stacks to point to new rules
-    for (size_t is = 0; is < result->stacks.size(); is++) {
-        for (size_t ie = 0; ie < result->stacks[is].size(); ie++) {
-            for (size_t ir0 = 0; ir0 < grammar->rules.size(); ir0++) {
-                for (size_t ir1 = 0; ir1 < grammar->rules[ir0].size(); ir1++) {
-                    if (grammar->stacks[is][ie] == &grammar->rules[ir0][ir1]) {
-                         result->stacks[is][ie]  =  &result->rules[ir0][ir1];
-                    }
-                }
-            }
+    llama_grammar * result = new llama_grammar{ grammar->rules, grammar->stacks, grammar->partial_utf8, grammar->masks };
+
+    // redirect elements in stacks to point to new rules, looking up the
+    // rule of each by its address, since grammars made from big schemas
+    // have thousands of elements and are copied for every request
+    std::vector<std::pair<const llama_grammar_element *, size_t>> starts;
+    starts.reserve(grammar->rules.size());
+    for (size_t ir = 0; ir < grammar->rules.size(); ir++) {
+        if (!grammar->rules[ir].empty()) {
+            starts.emplace_back(grammar->rules[ir].data(), ir);
+        }
+    }
+    const std::less<const llama_grammar_element *> before;
+    std::sort(starts.begin(), starts.end(), [&](const auto & a, const auto & b) { return before(a.first, b.first); });
+    for (auto & stack : result->stacks) {
+        for (auto & elem : stack) {
+            auto it = std::upper_bound(starts.begin(), starts.end(), elem,
+                    [&](const llama_grammar_element * p, const auto & s) { return before(p, s.first); });
+            GGML_ASSERT(it != starts.begin());
+            --it;
+            const auto & rule = grammar->rules[it->second];
+            GGML_ASSERT((size_t) (elem - it->first) < rule.size());
+            elem = result->rules[it->second].data() + (elem - it->first);
         }
     }
 
@@ -12984,16 +15959,44 @@ void llama_set_rng_seed(struct llama_context * ctx, uint32_t seed) {
     ctx->rng.seed(seed);
 }
 
-void llama_sample_softmax(struct llama_context * ctx, llama_token_data_array * candidates) {
+// Candidates less likely than exp(-LLAMA_SOFTMAX_CUTOFF), relative to the
+// most likely one, are put after the rest without being sorted, since the
+// probability of any sampler picking them is below what a float can add to
+// the sum of the others. So a big vocab costs a pass over the logits, plus
+// sorting the handful of tokens that are in the running.
+
+#define LLAMA_SOFTMAX_CUTOFF    30.0f
+#define LLAMA_SOFTMAX_SORT_ALL  1024
+
+static void llama_sample_softmax_impl(struct llama_context * ctx, llama_token_data_array * candidates, size_t min_sorted) {
     GGML_ASSERT(candidates->size > 0);
 
     const int64_t t_start_sample_us = ggml_time_us();
 
     // Sort the logits in descending order
     if (!candidates->sorted) {
-        std::sort(candidates->data, candidates->data + candidates->size, [](const llama_token_data & a, const llama_token_data & b) {
+        auto comp = [](const llama_token_data & a, const llama_token_data & b) {
             return a.logit > b.logit;
-        });
+        };
+        llama_token_data * begin = candidates->data;
+        llama_token_data * end   = candidates->data + candidates->size;
+        if (candidates->size <= LLAMA_SOFTMAX_SORT_ALL) {
+            std::sort(begin, end, comp);
+        } else {
+            float max_l = -INFINITY;
+            for (size_t i = 0; i < candidates->size; ++i) {
+                max_l = std::max(max_l, begin[i].logit);
+            }
+            const float min_l = max_l - LLAMA_SOFTMAX_CUTOFF;
+            llama_token_data * mid = std::partition(begin, end, [min_l](const llama_token_data & td) {
+                return td.logit >= min_l;
+            });
+            if ((size_t) (mid - begin) >= min_sorted) {
+                std::sort(begin, mid, comp);
+            } else {
+                std::partial_sort(begin, begin + std::min(min_sorted, candidates->size), end, comp);
+            }
+        }
         candidates->sorted = true;
     }
 
@@ -13013,6 +16016,10 @@ void llama_sample_softmax(struct llama_context * ctx, llama_token_data_array * c
     }
 }
 
+void llama_sample_softmax(struct llama_context * ctx, llama_token_data_array * candidates) {
+    llama_sample_softmax_impl(ctx, candidates, 0);
+}
+
 void llama_sample_top_k(struct llama_context * ctx, llama_token_data_array * candidates, int32_t k, size_t min_keep) {
     // TODO: move bucket sort to separate function so that top_p/tail_free/typical/softmax first is equally fast
     // if (k >= (int32_t)candidates->size) {
@@ -13440,6 +16447,11 @@ void llama_sample_grammar(struct llama_context * ctx, llama_token_data_array * c
     GGML_ASSERT(ctx);
     const int64_t t_start_sample_us = ggml_time_us();
 
+    if (llama_grammar_apply_mask(ctx, candidates, grammar)) {
+        ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
+        return;
+    }
+
     bool allow_eog = false;
     for (const auto & stack : grammar->stacks) {
         if (stack.empty()) {
@@ -13453,18 +16465,23 @@ void llama_sample_grammar(struct llama_context * ctx, llama_token_data_array * c
     std::vector<llama_grammar_candidate>                              candidates_grammar;
     candidates_grammar.reserve(candidates->size);
 
+    const llama_vocab & vocab = ctx->model.vocab;
+
     for (size_t i = 0; i < candidates->size; ++i) {
-        const llama_token id    = candidates->data[i].id;
-        const std::string piece = llama_token_to_piece(ctx, id, false);
+        const llama_token id = candidates->data[i].id;
 
         if (llama_token_is_eog(&ctx->model, id)) {
             if (!allow_eog) {
                 candidates->data[i].logit = -INFINITY;
             }
-        } else if (piece.empty() || piece[0] == 0) {
+        } else if (!vocab.cp_text[id]) {
             candidates->data[i].logit = -INFINITY;
+        } else if (grammar->partial_utf8.n_remain == 0) {
+            candidates_grammar.push_back({ i, vocab.cp_data.data() + vocab.cp_offsets[id], vocab.cp_partials[id] });
         } else {
-            candidates_decoded.push_back(decode_utf8(piece, grammar->partial_utf8));
+            int32_t length;
+            const char * piece = llama_token_get_piece(&ctx->model, id, false, &length);
+            candidates_decoded.push_back(decode_utf8(std::string(piece, length), grammar->partial_utf8));
             candidates_grammar.push_back({ i, candidates_decoded.back().first.data(), candidates_decoded.back().second });
         }
     }
@@ -13521,7 +16538,8 @@ llama_token llama_sample_token_mirostat(struct llama_context * ctx, llama_token_
     int64_t t_start_sample_us;
     t_start_sample_us = ggml_time_us();
 
-    llama_sample_softmax(nullptr, candidates);
+    // the estimate below needs the m most likely tokens in order, however unlikely
+    llama_sample_softmax_impl(nullptr, candidates, std::max(m, 0));
 
     // Estimate s_hat using the most probable m tokens
     float s_hat = 0.0;
@@ -13647,6 +16665,42 @@ llama_token llama_sample_token(struct llama_context * ctx, llama_token_data_arra
     return llama_sample_token_with_rng(ctx, candidates, ctx->rng);
 }
 
+int32_t llama_grammar_forced_text(const struct llama_grammar * grammar, char * buf, int32_t size) {
+    if (grammar->partial_utf8.n_remain != 0) {
+        return 0;
+    }
+
+    std::vector<std::vector<const llama_grammar_element *>> stacks = grammar->stacks;
+    std::vector<std::vector<const llama_grammar_element *>> new_stacks;
+    int32_t n = 0;
+    while (!stacks.empty()) {
+        // every stack has to want the same single character next
+        uint32_t chr = 0;
+        for (const auto & stack : stacks) {
+            if (stack.empty()) {
+                return n;
+            }
+            const llama_grammar_element * pos = stack.back();
+            if (pos->type != LLAMA_GRETYPE_CHAR || pos->value == 0 ||
+                pos[1].type == LLAMA_GRETYPE_CHAR_ALT ||
+                pos[1].type == LLAMA_GRETYPE_CHAR_RNG_UPPER ||
+                (chr && chr != pos->value)) {
+                return n;
+            }
+            chr = pos->value;
+        }
+        const std::string utf8 = unicode_cpt_to_utf8(chr);
+        if (n + (int32_t) utf8.size() > size) {
+            return n;
+        }
+        memcpy(buf + n, utf8.data(), utf8.size());
+        n += utf8.size();
+        llama_grammar_accept(grammar->rules, stacks, chr, new_stacks);
+        stacks.swap(new_stacks);
+    }
+    return n;
+}
+
 void llama_grammar_accept_token(struct llama_context * ctx, struct llama_grammar * grammar, llama_token token) {
     const int64_t t_start_sample_us = ggml_time_us();
 
@@ -13659,14 +16713,21 @@ void llama_grammar_accept_token(struct llama_context * ctx, struct llama_grammar
         GGML_ASSERT(false);
     }
 
-    const std::string piece = llama_token_to_piece(ctx, token, false);
+    const llama_vocab & vocab = ctx->model.vocab;
 
     // Note terminating 0 in decoded string
-    const auto   decoded     = decode_utf8(piece, grammar->partial_utf8);
-    const auto & code_points = decoded.first;
+    std::pair<std::vector<uint32_t>, llama_partial_utf8> decoded;
+    const uint32_t * code_points;
+    if (grammar->partial_utf8.n_remain == 0 && 0 <= token && (size_t) token < vocab.cp_offsets.size()) {
+        code_points    = vocab.cp_data.data() + vocab.cp_offsets[token];
+        decoded.second = vocab.cp_partials[token];
+    } else {
+        decoded     = decode_utf8(llama_token_to_piece(ctx, token, false), grammar->partial_utf8);
+        code_points = decoded.first.data();
+    }
     std::vector<std::vector<const llama_grammar_element *>> tmp_new_stacks;
-    for (auto it = code_points.begin(), end = code_points.end() - 1; it != end; ++it) {
-        llama_grammar_accept(grammar->rules, grammar->stacks, *it, tmp_new_stacks);
+    for (; *code_points; ++code_points) {
+        llama_grammar_accept(grammar->rules, grammar->stacks, *code_points, tmp_new_stacks);
         grammar->stacks = tmp_new_stacks;
     }
     grammar->partial_utf8 = decoded.second;
@@ -13960,67 +17021,6 @@ struct quantize_state_internal {
         {}
 };
 
-static void llama_tensor_dequantize_internal(
-    struct ggml_tensor * tensor, std::vector<no_init<float>> & output, std::vector<std::thread> & workers,
-    const size_t nelements, const int nthread
-) {
-    if (output.size() < nelements) {
-        output.resize(nelements);
-    }
-    float * f32_output = (float *) output.data();
-
-    ggml_type_traits_t qtype;
-    if (ggml_is_quantized(tensor->type)) {
-        qtype = ggml_internal_get_type_traits(tensor->type);
-        if (qtype.to_float == NULL) {
-            throw std::runtime_error(format("type %s unsupported for integer quantization: no dequantization available", ggml_type_name(tensor->type)));
-        }
-    } else if (tensor->type != GGML_TYPE_F16) {
-        throw std::runtime_error(format("cannot dequantize/convert tensor type %s", ggml_type_name(tensor->type)));
-    }
-
-    if (nthread < 2) {
-        if (tensor->type == GGML_TYPE_F16) {
-            ggml_fp16_to_fp32_row((ggml_fp16_t *)tensor->data, f32_output, nelements);
-        } else if (ggml_is_quantized(tensor->type)) {
-            qtype.to_float(tensor->data, f32_output, nelements);
-        } else {
-            GGML_ASSERT(false); // unreachable
-        }
-        return;
-    }
-
-    size_t block_size = tensor->type == GGML_TYPE_F16 ? 1 : (size_t)ggml_blck_size(tensor->type);
-    size_t block_size_bytes = ggml_type_size(tensor->type);
-
-    GGML_ASSERT(nelements % block_size == 0);
-    size_t nblocks = nelements / block_size;
-    size_t blocks_per_thread = nblocks / nthread;
-    size_t spare_blocks = nblocks - (blocks_per_thread * nthread); // if blocks aren't divisible by thread count
-
-    size_t in_buff_offs = 0;
-    size_t out_buff_offs = 0;
-
-    for (int tnum = 0; tnum < nthread; tnum++) {
-        size_t thr_blocks = blocks_per_thread + (tnum == nthread - 1 ? spare_blocks : 0); // num blocks for this thread
-        size_t thr_elems = thr_blocks * block_size; // number of elements for this thread
-        size_t thr_block_bytes = thr_blocks * block_size_bytes; // number of input bytes for this thread
-
-        auto compute = [qtype] (ggml_type typ, uint8_t * inbuf, float * outbuf, int nels) {
-            if (typ == GGML_TYPE_F16) {
-                ggml_fp16_to_fp32_row((ggml_fp16_t *)inbuf, outbuf, nels);
-            } else {
-                qtype.to_float(inbuf, outbuf, nels);
-            }
-        };
-        workers.emplace_back(compute, tensor->type, (uint8_t *) tensor->data + in_buff_offs, f32_output + out_buff_offs, thr_elems);
-        in_buff_offs += thr_block_bytes;
-        out_buff_offs += thr_elems;
-    }
-    for (auto & w : workers) { w.join(); }
-    workers.clear();
-}
-
 static ggml_type llama_tensor_get_type(quantize_state_internal & qs, ggml_type new_type, const ggml_tensor * tensor, llama_ftype ftype) {
     const std::string name = ggml_get_name(tensor);
 
@@ -14063,7 +17063,7 @@ static ggml_type llama_tensor_get_type(quantize_state_internal & qs, ggml_type n
                      ftype == LLAMA_FTYPE_MOSTLY_IQ1_M) {
                 new_type = GGML_TYPE_Q5_K;
             }
-            else if (new_type != GGML_TYPE_Q8_0) {
+            else if (new_type != GGML_TYPE_Q8_0 && new_type != GGML_TYPE_F8_E4M3) {
                 new_type = GGML_TYPE_Q6_K;
             }
         }
@@ -14304,71 +17304,497 @@ static ggml_type llama_tensor_get_type(quantize_state_internal & qs, ggml_type n
     return new_type;
 }
 
-static size_t llama_tensor_quantize_internal(enum ggml_type new_type, const float * f32_data, void * new_data, const int64_t chunk_size, int64_t nrows, int64_t n_per_row, const float * imatrix, std::vector<std::thread> & workers, const int nthread) {
-    if (nthread < 2) {
-        // single-thread
-        size_t new_size = ggml_quantize_chunk(new_type, f32_data, new_data, 0, nrows, n_per_row, imatrix);
-        if (!ggml_validate_row_data(new_type, new_data, new_size)) {
-            throw std::runtime_error("quantized data validation failed");
-        }
-        return new_size;
-    }
-
-    std::mutex mutex;
-    int64_t counter = 0;
-    size_t new_size = 0;
-    bool valid = true;
-    auto compute = [&mutex, &counter, &new_size, &valid, new_type, f32_data, new_data, chunk_size,
-            nrows, n_per_row, imatrix]() {
-        const int64_t nrows_per_chunk = chunk_size / n_per_row;
-        size_t local_size = 0;
-        while (true) {
-            std::unique_lock<std::mutex> lock(mutex);
-            int64_t first_row = counter; counter += nrows_per_chunk;
-            if (first_row >= nrows) {
-                if (local_size > 0) {
-                    new_size += local_size;
-                }
-                break;
-            }
-            lock.unlock();
-            const int64_t this_nrow = std::min(nrows - first_row, nrows_per_chunk);
-            size_t this_size = ggml_quantize_chunk(new_type, f32_data, new_data, first_row * n_per_row, this_nrow, n_per_row, imatrix);
-            local_size += this_size;
-
-            // validate the quantized data
-            const size_t row_size  = ggml_row_size(new_type, n_per_row);
-            void * this_data = (char *) new_data + first_row * row_size;
-            if (!ggml_validate_row_data(new_type, this_data, this_size)) {
-                std::unique_lock<std::mutex> lock(mutex);
-                valid = false;
-                break;
-            }
-        }
-    };
-    for (int it = 0; it < nthread - 1; ++it) {
-        workers.emplace_back(compute);
-    }
-    compute();
-    for (auto & w : workers) { w.join(); }
-    workers.clear();
-    if (!valid) {
-        throw std::runtime_error("quantized data validation failed");
+//
+// pipelined quantizer
+//
+// A pool of threads that lives as long as the model is being quantized
+// converts and quantizes a chunk of rows at a time, taking chunks from a
+// queue that spans tensors, so small tensors are quantized side by side
+// while big ones get every thread. A loading thread reads tensors ahead
+// of the pool, and the calling thread writes finished ones to the output
+// file in order. Only as many tensors are loaded as fit in a window of
+// memory, after which their pages of the input are dropped, so the RAM
+// needed doesn't grow with the size of the model. A tensor bigger than
+// the window is quantized on its own.
+//
+
+#define LLAMA_QUANTIZE_WINDOW ((size_t) 4 * 1024 * 1024 * 1024)
+#define LLAMA_QUANTIZE_MIN_CHUNK (32 * 512)
+
+// the codebook types search a grid for every group of values, so a single
+// row is already plenty of work, and smaller chunks balance the threads
+// better on the last tensors
+static bool llama_quantize_is_slow(ggml_type type) {
+    switch (type) {
+        case GGML_TYPE_IQ2_XXS:
+        case GGML_TYPE_IQ2_XS:
+        case GGML_TYPE_IQ2_S:
+        case GGML_TYPE_IQ3_XXS:
+        case GGML_TYPE_IQ3_S:
+        case GGML_TYPE_IQ1_S:
+        case GGML_TYPE_IQ1_M:
+            return true;
+        default:
+            return false;
     }
-    return new_size;
 }
 
-static void llama_model_quantize_internal(const std::string & fname_inp, const std::string & fname_out, const llama_model_quantize_params * params) {
-    ggml_type default_type;
-    llama_ftype ftype = params->ftype;
+struct llama_quantize_job {
+    ggml_tensor * tensor;
+    ggml_type     new_type;
+    bool          quantize;
+    const float * imatrix;
+    size_t        new_size;          // bytes of output
+    size_t        cost;              // bytes this job holds while in flight
+    int64_t       rows_per_chunk;
+    int64_t       chunks_per_matrix;
+    int64_t       n_chunks;          // zero if tensor is copied as is
+    int64_t       n_done = 0;
+    bool          valid  = true;
+    std::vector<no_init<uint8_t>> input;  // when not using mmap
+    std::vector<no_init<uint8_t>> output;
+};
 
-    switch (params->ftype) {
+struct llama_quantize_pipeline {
+    std::vector<llama_quantize_job> jobs;
+    llama_model_loader & ml;
+    size_t window;
+
+    std::mutex               mutex;
+    std::condition_variable  cond;
+    size_t                   n_loaded   = 0; // jobs whose input is ready
+    size_t                   job_next   = 0; // job the pool takes chunks from
+    int64_t                  chunk_next = 0;
+    size_t                   in_flight  = 0; // cost of jobs loaded but not written
+    bool                     aborted    = false;
+    std::exception_ptr       error;
+    std::vector<std::thread> threads;
+
+    llama_quantize_pipeline(llama_model_loader & ml, size_t window) : ml(ml), window(window) {}
+
+    ~llama_quantize_pipeline() {
+        stop();
+    }
+
+    void start(int nthread) {
+        threads.emplace_back([this] { loader(); });
+        for (int i = 0; i < nthread; ++i) {
+            threads.emplace_back([this] { worker(); });
+        }
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            aborted = true;
+        }
+        cond.notify_all();
+        for (auto & th : threads) {
+            th.join();
+        }
+        threads.clear();
+    }
+
+    void loader() {
+        for (size_t i = 0; i < jobs.size(); ++i) {
+            llama_quantize_job & job = jobs[i];
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cond.wait(lock, [&] { return aborted || !in_flight || in_flight + job.cost <= window; });
+                if (aborted) {
+                    return;
+                }
+                in_flight += job.cost;
+            }
+            try {
+                if (!ml.use_mmap) {
+                    job.input.resize(ggml_nbytes(job.tensor));
+                    job.tensor->data = job.input.data();
+                }
+                ml.load_data_for(job.tensor);
+                if (job.quantize) {
+                    job.output.resize(job.new_size);
+                }
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!error) {
+                    error = std::current_exception();
+                }
+                aborted = true;
+                cond.notify_all();
+                return;
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            n_loaded = i + 1;
+            cond.notify_all();
+        }
+    }
+
+    void worker() {
+        std::vector<no_init<float>> f32_buf;
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            while (job_next < n_loaded && chunk_next == jobs[job_next].n_chunks) {
+                ++job_next;
+                chunk_next = 0;
+            }
+            if (aborted || job_next == jobs.size()) {
+                return;
+            }
+            if (job_next == n_loaded) {
+                cond.wait(lock);
+                continue;
+            }
+            llama_quantize_job & job = jobs[job_next];
+            const int64_t c = chunk_next++;
+            lock.unlock();
+            const bool ok = quantize_chunk(job, c, f32_buf);
+            lock.lock();
+            job.valid &= ok;
+            if (++job.n_done == job.n_chunks) {
+                cond.notify_all();
+            }
+        }
+    }
+
+    static bool quantize_chunk(llama_quantize_job & job, int64_t c, std::vector<no_init<float>> & f32_buf) {
+        const ggml_tensor * tensor = job.tensor;
+        const int64_t n_per_row = tensor->ne[0];
+        const int64_t nrows     = tensor->ne[1];
+
+        // each expert is quantized separately since they have different importance matrices
+        const int64_t i03   = c / job.chunks_per_matrix;
+        const int64_t row   = c % job.chunks_per_matrix * job.rows_per_chunk;
+        const int64_t n     = std::min(nrows - row, job.rows_per_chunk);
+        const int64_t first = i03 * nrows + row;
+
+        const uint8_t * src = (const uint8_t *) tensor->data + first * ggml_row_size(tensor->type, n_per_row);
+        const float * f32_data;
+        if (tensor->type == GGML_TYPE_F32) {
+            f32_data = (const float *) src;
+        } else {
+            if (f32_buf.size() < (size_t) (n * n_per_row)) {
+                f32_buf.resize(n * n_per_row);
+            }
+            if (tensor->type == GGML_TYPE_F16) {
+                ggml_fp16_to_fp32_row((const ggml_fp16_t *) src, (float *) f32_buf.data(), n * n_per_row);
+            } else {
+                ggml_internal_get_type_traits(tensor->type).to_float(src, (float *) f32_buf.data(), n * n_per_row);
+            }
+            f32_data = (const float *) f32_buf.data();
+        }
+
+        void * dst = (uint8_t *) job.output.data() + first * ggml_row_size(job.new_type, n_per_row);
+        const float * imatrix = job.imatrix ? job.imatrix + i03 * n_per_row : nullptr;
+        const size_t size = ggml_quantize_chunk(job.new_type, f32_data, dst, 0, n, n_per_row, imatrix);
+        return ggml_validate_row_data(job.new_type, dst, size);
+    }
+
+    // waits for job to be computed, and rethrows errors of other threads
+    llama_quantize_job & wait(size_t i) {
+        llama_quantize_job & job = jobs[i];
+        std::unique_lock<std::mutex> lock(mutex);
+        cond.wait(lock, [&] { return aborted || (i < n_loaded && job.n_done == job.n_chunks); });
+        if (aborted) {
+            lock.unlock();
+            stop();
+            if (error) {
+                std::rethrow_exception(error);
+            }
+            throw std::runtime_error("quantization was aborted");
+        }
+        if (!job.valid) {
+            lock.unlock();
+            stop();
+            throw std::runtime_error("quantized data validation failed");
+        }
+        return job;
+    }
+
+    // frees memory of written job, so more can be loaded
+    void release(llama_quantize_job & job) {
+        if (ml.use_mmap && !FLAG_hugepages) {
+            // drop the pages of the input that only this tensor used
+            const uintptr_t page = sysconf(_SC_PAGESIZE);
+            const uintptr_t lo = ((uintptr_t) job.tensor->data + page - 1) & -page;
+            const uintptr_t hi = ((uintptr_t) job.tensor->data + ggml_nbytes(job.tensor)) & -page;
+            if (hi > lo) {
+                madvise((void *) lo, hi - lo, MADV_DONTNEED);
+            }
+        }
+        std::vector<no_init<uint8_t>>().swap(job.input);
+        std::vector<no_init<uint8_t>>().swap(job.output);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            in_flight -= job.cost;
+        }
+        cond.notify_all();
+    }
+};
+
+static bool llama_tensor_is_quantizable(const llama_model & model, const llama_model_quantize_params * params, const ggml_tensor * tensor) {
+    const std::string name = ggml_get_name(tensor);
+
+    // This used to be a regex, but <regex> has an extreme cost to compile times.
+    bool quantize = name.rfind("weight") == name.size() - 6; // ends with 'weight'?
+
+    // quantize only 2D and 3D tensors (experts)
+    quantize &= (ggml_n_dims(tensor) >= 2);
+
+    // do not quantize norm tensors
+    quantize &= name.find("_norm.weight") == std::string::npos;
+
+    quantize &= params->quantize_output_tensor || name != "output.weight";
+    quantize &= !params->only_copy;
+
+    // do not quantize expert gating tensors
+    // NOTE: can't use LLM_TN here because the layer number is not known
+    quantize &= name.find("ffn_gate_inp.weight") == std::string::npos;
+
+    // do not quantize positional embeddings and token types (BERT)
+    quantize &= name != LLM_TN(model.arch)(LLM_TENSOR_POS_EMBD,    "weight");
+    quantize &= name != LLM_TN(model.arch)(LLM_TENSOR_TOKEN_TYPES, "weight");
+
+    // do not quantize Mamba's small yet 2D weights
+    // NOTE: can't use LLM_TN here because the layer number is not known
+    quantize &= name.find("ssm_conv1d.weight") == std::string::npos;
+    quantize &= name.find("ssm_x.weight")      == std::string::npos;
+    quantize &= name.find("ssm_dt.weight")     == std::string::npos;
+
+    return quantize;
+}
+
+// rows of each tensor that the planner quantizes to measure the error of a type
+#define LLAMA_QUANTIZE_PLAN_ROWS 64
+
+// error of the types a tensor may be quantized to, measured on a sample of its rows
+struct llama_quantize_plan_entry {
+    int64_t                nelements;
+    int                    level = 0;  // index of the chosen type
+    std::vector<ggml_type> types;      // cheapest first
+    std::vector<double>    bits;       // size of the whole tensor in each type
+    std::vector<double>    error;      // estimated imatrix weighted squared error in each type
+};
+
+static const float * llama_tensor_get_imatrix(
+        const std::unordered_map<std::string, std::vector<float>> * imatrix_data, const ggml_tensor * tensor) {
+    if (!imatrix_data) {
+        return nullptr;
+    }
+    auto it = imatrix_data->find(tensor->name);
+    if (it == imatrix_data->end() || it->second.size() != (size_t)tensor->ne[0]*tensor->ne[2]) {
+        return nullptr;
+    }
+    return it->second.data();
+}
+
+// measures the error of each type on a sample of rows spread over the tensor
+static void llama_tensor_measure_types(
+        llama_model_loader & ml, const ggml_tensor * tensor, const float * imatrix,
+        llama_quantize_plan_entry & entry, int nthread) {
+    const int64_t n_per_row = tensor->ne[0];
+    const int64_t nrows     = tensor->ne[1] * tensor->ne[2];
+    const int64_t n_sample  = std::min(nrows, (int64_t) LLAMA_QUANTIZE_PLAN_ROWS);
+    const size_t  row_size  = ggml_row_size(tensor->type, n_per_row);
+
+    const auto * w = ml.get_weight(ggml_get_name(tensor));
+    GGML_ASSERT(w != nullptr);
+
+    // gather the sampled rows as f32
+    std::vector<int64_t> rows(n_sample);
+    std::vector<float> src(n_sample * n_per_row);
+    std::vector<uint8_t> raw(ml.use_mmap ? 0 : row_size);
+    for (int64_t s = 0; s < n_sample; ++s) {
+        rows[s] = s * nrows / n_sample;
+        const uint8_t * data;
+        if (ml.use_mmap) {
+            data = (const uint8_t *) ml.mappings.at(w->idx)->addr + w->offs + rows[s] * row_size;
+        } else {
+            const auto & file = ml.files.at(w->idx);
+            file->seek(w->offs + rows[s] * row_size, SEEK_SET);
+            file->read_raw(raw.data(), row_size);
+            data = raw.data();
+        }
+        float * dst = src.data() + s * n_per_row;
+        if (tensor->type == GGML_TYPE_F32) {
+            memcpy(dst, data, n_per_row * sizeof(float));
+        } else if (tensor->type == GGML_TYPE_F16) {
+            ggml_fp16_to_fp32_row((const ggml_fp16_t *) data, dst, n_per_row);
+        } else {
+            ggml_internal_get_type_traits(tensor->type).to_float(data, dst, n_per_row);
+        }
+    }
+
+    const size_t n_types = entry.types.size();
+    std::vector<double> error(n_types * n_sample);
+    std::atomic<int64_t> next(0);
+
+    auto compute = [&]() {
+        std::vector<uint8_t> q;
+        std::vector<float> y(n_per_row);
+        for (int64_t k; (k = next++) < (int64_t) (n_types * n_sample);) {
+            const ggml_type type = entry.types[k / n_sample];
+            const int64_t   s    = k % n_sample;
+            const float *   x    = src.data() + s * n_per_row;
+            const float *   imat = imatrix ? imatrix + rows[s] / tensor->ne[1] * n_per_row : nullptr;
+            q.resize(ggml_row_size(type, n_per_row));
+            ggml_quantize_chunk(type, x, q.data(), 0, 1, n_per_row, imat);
+            ggml_internal_get_type_traits(type).to_float(q.data(), y.data(), n_per_row);
+            double sum = 0;
+            for (int64_t j = 0; j < n_per_row; ++j) {
+                const double d = x[j] - y[j];
+                sum += (imat ? imat[j] : 1.0f) * d * d;
+            }
+            error[k] = sum;
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (int t = 1; t < nthread; ++t) {
+        workers.emplace_back(compute);
+    }
+    compute();
+    for (auto & worker : workers) {
+        worker.join();
+    }
+
+    // scale the error of the sampled rows up to the whole tensor
+    for (size_t t = 0; t < n_types; ++t) {
+        double sum = 0;
+        for (int64_t s = 0; s < n_sample; ++s) {
+            sum += error[t * n_sample + s];
+        }
+        entry.error[t] = sum * nrows / n_sample;
+    }
+}
+
+// picks a type for every tensor the planner can handle, so the quantized
+// tensors average params->target_bpw bits per weight with the least error
+// overall. the smallest type goes first everywhere, then the upgrade that
+// removes the most error per added bit is applied until the budget is met.
+// tensors left to the ftype's rules are marked GGML_TYPE_COUNT.
+static std::vector<ggml_type> llama_tensor_plan_types(
+        llama_model_loader & ml, const llama_model & model, const llama_model_quantize_params * params,
+        const std::unordered_map<std::string, std::vector<float>> * imatrix_data, int nthread) {
+    static const ggml_type k_types[]   = { GGML_TYPE_Q2_K, GGML_TYPE_Q3_K, GGML_TYPE_Q4_K, GGML_TYPE_Q5_K, GGML_TYPE_Q6_K, GGML_TYPE_Q8_0 };
+    static const ggml_type q32_types[] = { GGML_TYPE_Q4_0, GGML_TYPE_Q5_0, GGML_TYPE_Q8_0 };
+
+    std::vector<ggml_type> plan(ml.n_tensors, GGML_TYPE_COUNT);
+    if (params->target_bpw <= 0) {
+        return plan;
+    }
+
+    std::vector<llama_quantize_plan_entry> entries(ml.n_tensors);
+    std::vector<int> planned;
+    double budget = 0;
+    double total  = 0;
+
+    const int64_t t_start_us = ggml_time_us();
+
+    for (int i = 0; i < ml.n_tensors; ++i) {
+        const ggml_tensor * tensor = ml.get_weight(i)->tensor;
+        if (!llama_tensor_is_quantizable(model, params, tensor)) {
+            continue;
+        }
+        // leave the tensors whose types were given explicitly alone
+        if ((params->token_embedding_type < GGML_TYPE_COUNT && strcmp(tensor->name, "token_embd.weight") == 0) ||
+            (params->output_tensor_type   < GGML_TYPE_COUNT && strcmp(tensor->name, "output.weight")     == 0)) {
+            continue;
+        }
+        if (tensor->type != GGML_TYPE_F32 && tensor->type != GGML_TYPE_F16 &&
+            (!params->allow_requantize || ggml_internal_get_type_traits(tensor->type).to_float == NULL)) {
+            continue;
+        }
+
+        llama_quantize_plan_entry & entry = entries[i];
+        entry.nelements = ggml_nelements(tensor);
+        const double src_bpw = 8.0 * ggml_type_size(tensor->type) / ggml_blck_size(tensor->type);
+        if (tensor->ne[0] % QK_K == 0) {
+            entry.types.assign(std::begin(k_types), std::end(k_types));
+        } else if (tensor->ne[0] % ggml_blck_size(GGML_TYPE_Q8_0) == 0) {
+            entry.types.assign(std::begin(q32_types), std::end(q32_types));
+        }
+        // never plan a type that is bigger than what the tensor already is
+        while (entry.types.size() > 1 &&
+               8.0 * ggml_type_size(entry.types.back()) / ggml_blck_size(entry.types.back()) > src_bpw) {
+            entry.types.pop_back();
+        }
+        if (entry.types.empty()) {
+            continue;
+        }
+        for (ggml_type type : entry.types) {
+            entry.bits.push_back(8.0 * ggml_row_size(type, tensor->ne[0]) * (entry.nelements / tensor->ne[0]));
+        }
+        entry.error.resize(entry.types.size());
+
+        llama_tensor_measure_types(ml, tensor, llama_tensor_get_imatrix(imatrix_data, tensor), entry, nthread);
+
+        planned.push_back(i);
+        budget += params->target_bpw * entry.nelements;
+        total  += entry.bits[0];
+    }
+
+    if (planned.empty()) {
+        return plan;
+    }
+
+    if (total > budget) {
+        LLAMA_LOG_WARN("%s: %.3f bits per weight is below the smallest planned types, which take %.3f\n",
+                __func__, params->target_bpw, total / (budget / params->target_bpw));
+    }
+
+    for (;;) {
+        int    best_i     = -1;
+        int    best_level = 0;
+        double best_gain  = 0;
+        for (int i : planned) {
+            const llama_quantize_plan_entry & entry = entries[i];
+            for (size_t l = entry.level + 1; l < entry.types.size(); ++l) {
+                const double dbits = entry.bits[l] - entry.bits[entry.level];
+                const double derr  = entry.error[entry.level] - entry.error[l];
+                if (total + dbits > budget || derr <= 0) {
+                    continue;
+                }
+                const double gain = derr / dbits;
+                if (gain > best_gain) {
+                    best_i     = i;
+                    best_level = l;
+                    best_gain  = gain;
+                }
+            }
+        }
+        if (best_i < 0) {
+            break;
+        }
+        llama_quantize_plan_entry & entry = entries[best_i];
+        total += entry.bits[best_level] - entry.bits[entry.level];
+        entry.level = best_level;
+    }
+
+    double nelements = 0;
+    for (int i : planned) {
+        plan[i] = entries[i].types[entries[i].level];
+        nelements += entries[i].nelements;
+    }
+
+    LLAMA_LOG_INFO("%s: planned %zu tensors at %.3f bits per weight in %.2f s\n", __func__,
+            planned.size(), total / nelements, (ggml_time_us() - t_start_us) / 1e6);
+
+    return plan;
+}
+
+static void llama_model_quantize_internal(const std::string & fname_inp, const std::string & fname_out, const llama_model_quantize_params * params) {
+    ggml_type default_type;
+    llama_ftype ftype = params->ftype;
+
+    switch (params->ftype) {
         case LLAMA_FTYPE_MOSTLY_Q4_0: default_type = GGML_TYPE_Q4_0; break;
         case LLAMA_FTYPE_MOSTLY_Q4_1: default_type = GGML_TYPE_Q4_1; break;
         case LLAMA_FTYPE_MOSTLY_Q5_0: default_type = GGML_TYPE_Q5_0; break;
         case LLAMA_FTYPE_MOSTLY_Q5_1: default_type = GGML_TYPE_Q5_1; break;
         case LLAMA_FTYPE_MOSTLY_Q8_0: default_type = GGML_TYPE_Q8_0; break;
         case LLAMA_FTYPE_MOSTLY_BF16: default_type = GGML_TYPE_BF16; break;
+        case LLAMA_FTYPE_MOSTLY_F8_E4M3: default_type = GGML_TYPE_F8_E4M3; break;
         case LLAMA_FTYPE_MOSTLY_F16:  default_type = GGML_TYPE_F16;  break;
         case LLAMA_FTYPE_ALL_F32:     default_type = GGML_TYPE_F32;  break;
 
@@ -14495,14 +17921,8 @@ static void llama_model_quantize_internal(const std::string & fname_inp, const s
     size_t total_size_org = 0;
     size_t total_size_new = 0;
 
-    std::vector<std::thread> workers;
-    workers.reserve(nthread);
-
-    int idx = 0;
-
-    std::vector<no_init<uint8_t>> read_data;
-    std::vector<no_init<uint8_t>> work;
-    std::vector<no_init<float>> f32_conv_buf;
+    llama_quantize_pipeline pipeline(ml, params->window_size ? params->window_size : LLAMA_QUANTIZE_WINDOW);
+    pipeline.jobs.resize(ml.n_tensors);
 
     uint16_t n_split = 1;
     // Assume split index is continuous
@@ -14564,66 +17984,28 @@ static void llama_model_quantize_internal(const std::string & fname_inp, const s
     };
 
     const auto tn = LLM_TN(model.arch);
-    new_ofstream(0);
-    for (int i = 0; i < ml.n_tensors; ++i) {
-        auto weight = ml.get_weight(i);
-        struct ggml_tensor * tensor = weight->tensor;
-        if (weight->idx != cur_split && params->keep_split) {
-            close_ofstream();
-            new_ofstream(weight->idx);
-        }
-
-        const std::string name = ggml_get_name(tensor);
-
-        if (!ml.use_mmap) {
-            if (read_data.size() < ggml_nbytes(tensor)) {
-                read_data.resize(ggml_nbytes(tensor));
-            }
-            tensor->data = read_data.data();
-        }
-        ml.load_data_for(tensor);
-
-        LLAMA_LOG_INFO("[%4d/%4d] %36s - [%s], type = %6s, ",
-               ++idx, ml.n_tensors,
-               ggml_get_name(tensor),
-               llama_format_tensor_shape(tensor).c_str(),
-               ggml_type_name(tensor->type));
 
-        // This used to be a regex, but <regex> has an extreme cost to compile times.
-        bool quantize = name.rfind("weight") == name.size() - 6; // ends with 'weight'?
+    const std::vector<ggml_type> plan = llama_tensor_plan_types(ml, model, params, imatrix_data, nthread);
 
-        // quantize only 2D and 3D tensors (experts)
-        quantize &= (ggml_n_dims(tensor) >= 2);
-
-        // do not quantize norm tensors
-        quantize &= name.find("_norm.weight") == std::string::npos;
-
-        quantize &= params->quantize_output_tensor || name != "output.weight";
-        quantize &= !params->only_copy;
-
-        // do not quantize expert gating tensors
-        // NOTE: can't use LLM_TN here because the layer number is not known
-        quantize &= name.find("ffn_gate_inp.weight") == std::string::npos;
+    // decide what to do with every tensor up front, in order, since the
+    // type chosen for a tensor depends on the ones that came before it
+    for (int i = 0; i < ml.n_tensors; ++i) {
+        struct ggml_tensor * tensor = ml.get_weight(i)->tensor;
+        llama_quantize_job & job = pipeline.jobs[i];
 
-        // do not quantize positional embeddings and token types (BERT)
-        quantize &= name != LLM_TN(model.arch)(LLM_TENSOR_POS_EMBD,    "weight");
-        quantize &= name != LLM_TN(model.arch)(LLM_TENSOR_TOKEN_TYPES, "weight");
+        const std::string name = ggml_get_name(tensor);
 
-        // do not quantize Mamba's small yet 2D weights
-        // NOTE: can't use LLM_TN here because the layer number is not known
-        quantize &= name.find("ssm_conv1d.weight") == std::string::npos;
-        quantize &= name.find("ssm_x.weight")      == std::string::npos;
-        quantize &= name.find("ssm_dt.weight")     == std::string::npos;
+        bool quantize = llama_tensor_is_quantizable(model, params, tensor);
 
-        enum ggml_type new_type;
-        void * new_data;
-        size_t new_size;
+        enum ggml_type new_type = tensor->type;
 
         if (quantize) {
             new_type = default_type;
 
-            // get more optimal quantization type based on the tensor shape, layer, etc.
-            if (!params->pure && ggml_is_quantized(default_type)) {
+            if (plan[i] != GGML_TYPE_COUNT) {
+                new_type = plan[i];
+            } else if (!params->pure && ggml_is_quantized(default_type)) {
+                // get more optimal quantization type based on the tensor shape, layer, etc.
                 new_type = llama_tensor_get_type(qs, new_type, tensor, ftype);
             }
             if (params->token_embedding_type < GGML_TYPE_COUNT && strcmp(tensor->name, "token_embd.weight") == 0) {
@@ -14638,101 +18020,123 @@ static void llama_model_quantize_internal(const std::string & fname_inp, const s
             quantize = tensor->type != new_type;
         }
 
+        job.tensor   = tensor;
+        job.quantize = quantize;
+        job.imatrix  = nullptr;
+        job.n_chunks = 0;
+
         if (!quantize) {
-            new_type = tensor->type;
-            new_data = tensor->data;
-            new_size = ggml_nbytes(tensor);
-            LLAMA_LOG_INFO("size = %8.3f MB\n", ggml_nbytes(tensor)/1024.0/1024.0);
-        } else {
-            const int64_t nelements = ggml_nelements(tensor);
+            job.new_type = tensor->type;
+            job.new_size = ggml_nbytes(tensor);
+            job.cost     = ggml_nbytes(tensor);
+            continue;
+        }
 
-            const float * imatrix = nullptr;
-            if (imatrix_data) {
-                auto it = imatrix_data->find(tensor->name);
-                if (it == imatrix_data->end()) {
-                    LLAMA_LOG_INFO("\n====== %s: did not find weights for %s\n", __func__, tensor->name);
+        const float * imatrix = nullptr;
+        if (imatrix_data) {
+            auto it = imatrix_data->find(tensor->name);
+            if (it == imatrix_data->end()) {
+                LLAMA_LOG_INFO("\n====== %s: did not find weights for %s\n", __func__, tensor->name);
+            } else {
+                if (it->second.size() == (size_t)tensor->ne[0]*tensor->ne[2]) {
+                    imatrix = it->second.data();
                 } else {
-                    if (it->second.size() == (size_t)tensor->ne[0]*tensor->ne[2]) {
-                        imatrix = it->second.data();
-                    } else {
-                        LLAMA_LOG_INFO("\n====== %s: imatrix size %d is different from tensor size %d for %s\n", __func__,
-                                int(it->second.size()), int(tensor->ne[0]*tensor->ne[2]), tensor->name);
-
-                        // this can happen when quantizing an old mixtral model with split tensors with a new incompatible imatrix
-                        // this is a significant error and it may be good idea to abort the process if this happens,
-                        // since many people will miss the error and not realize that most of the model is being quantized without an imatrix
-                        // tok_embd should be ignored in this case, since it always causes this warning
-                        if (name != tn(LLM_TENSOR_TOKEN_EMBD, "weight")) {
-                            throw std::runtime_error(format("imatrix size %d is different from tensor size %d for %s",
-                                    int(it->second.size()), int(tensor->ne[0]*tensor->ne[2]), tensor->name));
-                        }
+                    LLAMA_LOG_INFO("\n====== %s: imatrix size %d is different from tensor size %d for %s\n", __func__,
+                            int(it->second.size()), int(tensor->ne[0]*tensor->ne[2]), tensor->name);
+
+                    // this can happen when quantizing an old mixtral model with split tensors with a new incompatible imatrix
+                    // this is a significant error and it may be good idea to abort the process if this happens,
+                    // since many people will miss the error and not realize that most of the model is being quantized without an imatrix
+                    // tok_embd should be ignored in this case, since it always causes this warning
+                    if (name != tn(LLM_TENSOR_TOKEN_EMBD, "weight")) {
+                        throw std::runtime_error(format("imatrix size %d is different from tensor size %d for %s",
+                                int(it->second.size()), int(tensor->ne[0]*tensor->ne[2]), tensor->name));
                     }
                 }
             }
-            if ((new_type == GGML_TYPE_IQ2_XXS ||
-                 new_type == GGML_TYPE_IQ2_XS  ||
-                 new_type == GGML_TYPE_IQ2_S   ||
-                 new_type == GGML_TYPE_IQ1_S   ||
-                (new_type == GGML_TYPE_IQ1_M && strcmp(tensor->name, "token_embd.weight") && strcmp(tensor->name, "output.weight"))  ||
-                (new_type == GGML_TYPE_Q2_K && params->ftype == LLAMA_FTYPE_MOSTLY_Q2_K_S && strcmp(tensor->name, "token_embd.weight") != 0)) && !imatrix) {
-                LLAMA_LOG_ERROR("\n\n============================================================\n");
-                LLAMA_LOG_ERROR("Missing importance matrix for tensor %s in a very low-bit quantization\n", tensor->name);
-                LLAMA_LOG_ERROR("The result will be garbage, so bailing out\n");
-                LLAMA_LOG_ERROR("============================================================\n\n");
-                throw std::runtime_error(format("Missing importance matrix for tensor %s in a very low-bit quantization", tensor->name));
-            }
-
-            float * f32_data;
+        }
+        if ((new_type == GGML_TYPE_IQ2_XXS ||
+             new_type == GGML_TYPE_IQ2_XS  ||
+             new_type == GGML_TYPE_IQ2_S   ||
+             new_type == GGML_TYPE_IQ1_S   ||
+            (new_type == GGML_TYPE_IQ1_M && strcmp(tensor->name, "token_embd.weight") && strcmp(tensor->name, "output.weight"))  ||
+            (new_type == GGML_TYPE_Q2_K && params->ftype == LLAMA_FTYPE_MOSTLY_Q2_K_S && strcmp(tensor->name, "token_embd.weight") != 0)) && !imatrix) {
+            LLAMA_LOG_ERROR("\n\n============================================================\n");
+            LLAMA_LOG_ERROR("Missing importance matrix for tensor %s in a very low-bit quantization\n", tensor->name);
+            LLAMA_LOG_ERROR("The result will be garbage, so bailing out\n");
+            LLAMA_LOG_ERROR("============================================================\n\n");
+            throw std::runtime_error(format("Missing importance matrix for tensor %s in a very low-bit quantization", tensor->name));
+        }
 
-            if (tensor->type == GGML_TYPE_F32) {
-                f32_data = (float *) tensor->data;
-            } else if (ggml_is_quantized(tensor->type) && !params->allow_requantize) {
+        if (tensor->type != GGML_TYPE_F32) {
+            if (ggml_is_quantized(tensor->type) && !params->allow_requantize) {
                 throw std::runtime_error(format("requantizing from type %s is disabled", ggml_type_name(tensor->type)));
-            } else {
-                llama_tensor_dequantize_internal(tensor, f32_conv_buf, workers, nelements, nthread);
-                f32_data = (float *) f32_conv_buf.data();
             }
+            if (ggml_is_quantized(tensor->type)) {
+                if (ggml_internal_get_type_traits(tensor->type).to_float == NULL) {
+                    throw std::runtime_error(format("type %s unsupported for integer quantization: no dequantization available", ggml_type_name(tensor->type)));
+                }
+            } else if (tensor->type != GGML_TYPE_F16) {
+                throw std::runtime_error(format("cannot dequantize/convert tensor type %s", ggml_type_name(tensor->type)));
+            }
+        }
 
-            LLAMA_LOG_INFO("converting to %s .. ", ggml_type_name(new_type));
-            fflush(stdout);
+        const int64_t n_per_row = tensor->ne[0];
+        const int64_t nrows = tensor->ne[1];
 
-            if (work.size() < (size_t)nelements * 4) {
-                work.resize(nelements * 4); // upper bound on size
-            }
-            new_data = work.data();
+        job.new_type          = new_type;
+        job.imatrix           = imatrix;
+        job.new_size          = ggml_row_size(new_type, n_per_row) * nrows * tensor->ne[2];
+        job.cost              = ggml_nbytes(tensor) + job.new_size;
+        job.rows_per_chunk    = llama_quantize_is_slow(new_type) ? 1 : std::max((int64_t) 1, (LLAMA_QUANTIZE_MIN_CHUNK + n_per_row - 1) / n_per_row);
+        job.chunks_per_matrix = (nrows + job.rows_per_chunk - 1) / job.rows_per_chunk;
+        job.n_chunks          = job.chunks_per_matrix * tensor->ne[2];
+    }
 
-            const int64_t n_per_row = tensor->ne[0];
-            const int64_t nrows = tensor->ne[1];
+    pipeline.start(nthread);
 
-            static const int64_t min_chunk_size = 32 * 512;
-            const int64_t chunk_size = n_per_row >= min_chunk_size ? n_per_row : n_per_row * ((min_chunk_size + n_per_row - 1)/n_per_row);
+    int idx = 0;
+    new_ofstream(0);
+    for (int i = 0; i < ml.n_tensors; ++i) {
+        auto weight = ml.get_weight(i);
+        if (weight->idx != cur_split && params->keep_split) {
+            close_ofstream();
+            new_ofstream(weight->idx);
+        }
 
-            const int64_t nelements_matrix = tensor->ne[0] * tensor->ne[1];
-            const int64_t nchunk = (nelements_matrix + chunk_size - 1)/chunk_size;
-            const int64_t nthread_use = nthread > 1 ? std::max((int64_t)1, std::min((int64_t)nthread, nchunk)) : 1;
+        llama_quantize_job & job = pipeline.wait(i);
+        struct ggml_tensor * tensor = job.tensor;
+        const std::string name = ggml_get_name(tensor);
 
-            // quantize each expert separately since they have different importance matrices
-            new_size = 0;
-            for (int64_t i03 = 0; i03 < tensor->ne[2]; ++i03) {
-                const float * f32_data_03 = f32_data + i03 * nelements_matrix;
-                void * new_data_03 = (char *)new_data + ggml_row_size(new_type, n_per_row) * i03 * nrows;
-                const float * imatrix_03 = imatrix ? imatrix + i03 * n_per_row : nullptr;
+        LLAMA_LOG_INFO("[%4d/%4d] %36s - [%s], type = %6s, ",
+               ++idx, ml.n_tensors,
+               ggml_get_name(tensor),
+               llama_format_tensor_shape(tensor).c_str(),
+               ggml_type_name(tensor->type));
 
-                new_size += llama_tensor_quantize_internal(new_type, f32_data_03, new_data_03, chunk_size, nrows, n_per_row, imatrix_03, workers, nthread_use);
-            }
-            LLAMA_LOG_INFO("size = %8.2f MiB -> %8.2f MiB\n", ggml_nbytes(tensor)/1024.0/1024.0, new_size/1024.0/1024.0);
+        const void * new_data;
+        if (!job.quantize) {
+            new_data = tensor->data;
+            LLAMA_LOG_INFO("size = %8.3f MB\n", ggml_nbytes(tensor)/1024.0/1024.0);
+        } else {
+            new_data = job.output.data();
+            LLAMA_LOG_INFO("converting to %s .. size = %8.2f MiB -> %8.2f MiB\n", ggml_type_name(job.new_type),
+                    ggml_nbytes(tensor)/1024.0/1024.0, job.new_size/1024.0/1024.0);
         }
         total_size_org += ggml_nbytes(tensor);
-        total_size_new += new_size;
+        total_size_new += job.new_size;
 
         // update the gguf meta data as we go
-        gguf_set_tensor_type(ctx_outs[cur_split], name.c_str(), new_type);
-        gguf_set_tensor_data(ctx_outs[cur_split], name.c_str(), new_data, new_size);
+        gguf_set_tensor_type(ctx_outs[cur_split], name.c_str(), job.new_type);
+        gguf_set_tensor_data(ctx_outs[cur_split], name.c_str(), new_data, job.new_size);
 
         // write tensor data + padding
-        fout.write((const char *) new_data, new_size);
-        zeros(fout, GGML_PAD(new_size, align) - new_size);
+        fout.write((const char *) new_data, job.new_size);
+        zeros(fout, GGML_PAD(job.new_size, align) - job.new_size);
+
+        pipeline.release(job);
     }
+    pipeline.stop();
     close_ofstream();
     for (auto & c:ctx_outs) {
         gguf_free(c);
@@ -14747,51 +18151,34 @@ static void llama_model_quantize_internal(const std::string & fname_inp, const s
     }
 }
 
-static int llama_apply_lora_from_file_internal(
-    const struct llama_model & model, const char * path_lora, float scale, const char * path_base_model, int n_threads
-) {
-    LLAMA_LOG_INFO("%s: applying lora adapter from '%s' - please wait ...\n", __func__, path_lora);
-
-    const int64_t t_start_lora_us = ggml_time_us();
-
-    llama_file fin(path_lora, "rb");
+struct llama_lora_tensor_meta {
+    std::string name;
+    ggml_type type;
+    int32_t ne[2];
+    size_t offset;
+};
 
+// reads the header of a ggla file and the names, shapes and offsets of its tensors
+static bool llama_lora_read_meta(
+        llama_file & fin, int32_t & lora_r, int32_t & lora_alpha,
+        std::map<std::string, llama_lora_tensor_meta> & tensor_meta_map) {
     // verify magic and version
     {
         uint32_t magic = fin.read_u32();
         if (magic != LLAMA_FILE_MAGIC_GGLA) {
             LLAMA_LOG_ERROR("%s: bad file magic\n", __func__);
-            return 1;
+            return false;
         }
 
         uint32_t format_version = fin.read_u32();
         if (format_version != 1) {
             LLAMA_LOG_ERROR("%s: unsupported file version\n", __func__ );
-            return 1;
+            return false;
         }
     }
 
-    int32_t lora_r = fin.read_u32();
-    int32_t lora_alpha = fin.read_u32();
-    float scaling = scale * (float)lora_alpha / (float)lora_r;
-
-    LLAMA_LOG_INFO("%s: r = %d, alpha = %d, scaling = %.2f\n", __func__, lora_r, lora_alpha, scaling);
-
-    // load base model
-    std::unique_ptr<llama_model_loader> ml;
-    if (path_base_model) {
-        LLAMA_LOG_INFO("%s: loading base model from '%s'\n", __func__, path_base_model);
-        ml.reset(new llama_model_loader(path_base_model, /*use_mmap*/ true, /*check_tensors*/ false, /*kv_overrides*/ nullptr));
-        ml->init_mappings(/*prefetch*/ false); // no prefetching
-    }
-
-    struct tensor_meta {
-        std::string name;
-        ggml_type type;
-        int32_t ne[2];
-        size_t offset;
-    };
-    std::map<std::string, tensor_meta> tensor_meta_map;
+    lora_r = fin.read_u32();
+    lora_alpha = fin.read_u32();
 
     // load all tensor meta
     while (true) {
@@ -14810,7 +18197,7 @@ static int llama_apply_lora_from_file_internal(
 
         if (n_dims != 1 && n_dims != 2) {
             LLAMA_LOG_ERROR("%s: unsupported tensor dimension %d\n", __func__, n_dims);
-            return 1;
+            return false;
         }
 
         int32_t ne[2] = { 1, 1 };
@@ -14833,7 +18220,7 @@ static int llama_apply_lora_from_file_internal(
         }
         if (lora_suffix != ".loraA" && lora_suffix != ".loraB") {
             LLAMA_LOG_ERROR("%s: error: '%s' is not a lora tensor\n", __func__, name.c_str());
-            return 1;
+            return false;
         }
 
         // tensor type
@@ -14845,7 +18232,7 @@ static int llama_apply_lora_from_file_internal(
                     {
                         LLAMA_LOG_ERROR("%s: invalid tensor data type '%d'\n",
                                 __func__, ftype);
-                        return 1;
+                        return false;
                     }
         }
 
@@ -14856,7 +18243,37 @@ static int llama_apply_lora_from_file_internal(
         // skip tensor data
         fin.seek(offset + ggml_row_size(wtype, ne[0]) * ne[1], SEEK_SET);
 
-        tensor_meta_map.emplace(name, tensor_meta{ name, wtype, { ne[0], ne[1] }, offset });
+        tensor_meta_map.emplace(name, llama_lora_tensor_meta{ name, wtype, { ne[0], ne[1] }, offset });
+    }
+
+    return true;
+}
+
+static int llama_apply_lora_from_file_internal(
+    const struct llama_model & model, const char * path_lora, float scale, const char * path_base_model, int n_threads
+) {
+    LLAMA_LOG_INFO("%s: applying lora adapter from '%s' - please wait ...\n", __func__, path_lora);
+
+    const int64_t t_start_lora_us = ggml_time_us();
+
+    llama_file fin(path_lora, "rb");
+
+    int32_t lora_r;
+    int32_t lora_alpha;
+    std::map<std::string, llama_lora_tensor_meta> tensor_meta_map;
+    if (!llama_lora_read_meta(fin, lora_r, lora_alpha, tensor_meta_map)) {
+        return 1;
+    }
+    float scaling = scale * (float)lora_alpha / (float)lora_r;
+
+    LLAMA_LOG_INFO("%s: r = %d, alpha = %d, scaling = %.2f\n", __func__, lora_r, lora_alpha, scaling);
+
+    // load base model
+    std::unique_ptr<llama_model_loader> ml;
+    if (path_base_model) {
+        LLAMA_LOG_INFO("%s: loading base model from '%s'\n", __func__, path_base_model);
+        ml.reset(new llama_model_loader(path_base_model, /*use_mmap*/ true, /*check_tensors*/ false, /*kv_overrides*/ nullptr));
+        ml->init_mappings(/*prefetch*/ false); // no prefetching
     }
 
     bool warned = false;
@@ -14880,8 +18297,8 @@ static int llama_apply_lora_from_file_internal(
             continue;
         }
 
-        tensor_meta & metaA = tensor_meta_map.at(base_name + ".loraA");
-        tensor_meta & metaB = tensor_meta_map.at(base_name + ".loraB");
+        llama_lora_tensor_meta & metaA = tensor_meta_map.at(base_name + ".loraA");
+        llama_lora_tensor_meta & metaB = tensor_meta_map.at(base_name + ".loraB");
 
         ggml_init_params lora_init_params = {
             /* .mem_size   */ ggml_tensor_overhead()*128 + ggml_graph_overhead(),
@@ -14921,7 +18338,7 @@ static int llama_apply_lora_from_file_internal(
         }
 
         // load tensor data
-        auto load_tensor = [&read_buf, &fin](const tensor_meta & tensor_meta, ggml_tensor * tensor) {
+        auto load_tensor = [&read_buf, &fin](const llama_lora_tensor_meta & tensor_meta, ggml_tensor * tensor) {
             read_buf.resize(ggml_nbytes(tensor));
             fin.seek(tensor_meta.offset, SEEK_SET);
             fin.read_raw(read_buf.data(), ggml_nbytes(tensor));
@@ -15025,6 +18442,130 @@ static int llama_apply_lora_from_file_internal(
     return 0;
 }
 
+static bool llama_lora_adapter_load(llama_lora_adapter & adapter, const llama_model & model, const char * path_lora) {
+    LLAMA_LOG_INFO("%s: loading lora adapter from '%s' ...\n", __func__, path_lora);
+
+    const int64_t t_start_lora_us = ggml_time_us();
+
+    llama_file fin(path_lora, "rb");
+
+    int32_t lora_r;
+    int32_t lora_alpha;
+    std::map<std::string, llama_lora_tensor_meta> tensor_meta_map;
+    if (!llama_lora_read_meta(fin, lora_r, lora_alpha, tensor_meta_map)) {
+        return false;
+    }
+    if (lora_r <= 0) {
+        LLAMA_LOG_ERROR("%s: invalid lora rank %d\n", __func__, lora_r);
+        return false;
+    }
+    adapter.model = &model;
+    adapter.alpha_r = (float) lora_alpha / (float) lora_r;
+
+    // the tensors of the adapter go in the same kind of memory as the
+    // weights they apply to, so they're computed on the same backend
+    struct pending {
+        const ggml_tensor * base;
+        const llama_lora_tensor_meta * meta_a;
+        const llama_lora_tensor_meta * meta_b;
+        llama_lora_weight lw;
+    };
+    std::vector<pending> todo;
+    std::map<ggml_backend_buffer_type_t, int> buft_count;
+    for (const auto & it : model.tensors_by_name) {
+        const ggml_tensor * base = it.second;
+        auto ita = tensor_meta_map.find(it.first + ".loraA");
+        auto itb = tensor_meta_map.find(it.first + ".loraB");
+        if (ita == tensor_meta_map.end() || itb == tensor_meta_map.end()) {
+            continue;
+        }
+        const llama_lora_tensor_meta & ma = ita->second;
+        const llama_lora_tensor_meta & mb = itb->second;
+        if (ggml_n_dims(base) != 2 || base->ne[0] != ma.ne[1] || base->ne[1] != mb.ne[1] || ma.ne[0] != mb.ne[0]) {
+            LLAMA_LOG_ERROR("%s: incompatible tensor dimensions for '%s';"
+                            " are you sure that this adapter is for this model?\n", __func__, it.first.c_str());
+            return false;
+        }
+        if (!base->buffer) {
+            continue;
+        }
+        buft_count[ggml_backend_buffer_get_type(base->buffer)] += 2;
+        todo.push_back({base, &ma, &mb, {}});
+    }
+    if (todo.empty()) {
+        LLAMA_LOG_ERROR("%s: adapter has no tensors for this model\n", __func__);
+        return false;
+    }
+
+    std::map<ggml_backend_buffer_type_t, ggml_context *> ctx_map;
+    for (auto & it : buft_count) {
+        struct ggml_init_params params = {
+            /*.mem_size   =*/ it.second * ggml_tensor_overhead(),
+            /*.mem_buffer =*/ NULL,
+            /*.no_alloc   =*/ true,
+        };
+        ggml_context * ctx = ggml_init(params);
+        if (!ctx) {
+            LLAMA_LOG_ERROR("%s: failed to allocate context for lora adapter\n", __func__);
+            return false;
+        }
+        adapter.ctxs.push_back(ctx);
+        ctx_map[it.first] = ctx;
+    }
+
+    for (pending & p : todo) {
+        ggml_context * ctx = ctx_map.at(ggml_backend_buffer_get_type(p.base->buffer));
+        p.lw.a = ggml_new_tensor_2d(ctx, p.meta_a->type, p.meta_a->ne[1], p.meta_a->ne[0]);
+        p.lw.b = ggml_new_tensor_2d(ctx, p.meta_b->type, p.meta_b->ne[0], p.meta_b->ne[1]);
+        ggml_set_name(p.lw.a, p.meta_a->name.c_str());
+        ggml_set_name(p.lw.b, p.meta_b->name.c_str());
+    }
+
+    for (auto & it : ctx_map) {
+        ggml_backend_buffer_t buf = ggml_backend_alloc_ctx_tensors_from_buft(it.second, it.first);
+        if (!buf) {
+            LLAMA_LOG_ERROR("%s: failed to allocate buffer for lora adapter\n", __func__);
+            return false;
+        }
+        adapter.bufs.push_back(buf);
+    }
+
+    std::vector<no_init<uint8_t>> read_buf;
+    std::vector<no_init<uint8_t>> transposed;
+    for (pending & p : todo) {
+        const size_t size_a = ggml_nbytes(p.lw.a);
+        read_buf.resize(size_a);
+        fin.seek(p.meta_a->offset, SEEK_SET);
+        fin.read_raw(read_buf.data(), size_a);
+
+        // the file has A as [r, n_in]
+        const int64_t r    = p.meta_a->ne[0];
+        const int64_t n_in = p.meta_a->ne[1];
+        const size_t  ts   = ggml_type_size(p.lw.a->type);
+        transposed.resize(size_a);
+        for (int64_t i = 0; i < n_in; ++i) {
+            for (int64_t k = 0; k < r; ++k) {
+                memcpy(&transposed[(k*n_in + i)*ts], &read_buf[(i*r + k)*ts], ts);
+            }
+        }
+        ggml_backend_tensor_set(p.lw.a, transposed.data(), 0, size_a);
+
+        const size_t size_b = ggml_nbytes(p.lw.b);
+        read_buf.resize(size_b);
+        fin.seek(p.meta_b->offset, SEEK_SET);
+        fin.read_raw(read_buf.data(), size_b);
+        ggml_backend_tensor_set(p.lw.b, read_buf.data(), 0, size_b);
+
+        adapter.weights[p.base] = p.lw;
+    }
+
+    const int64_t t_lora_us = ggml_time_us() - t_start_lora_us;
+    LLAMA_LOG_INFO("%s: r = %d, alpha = %d, %zu tensors (%.2f ms)\n", __func__,
+                   lora_r, lora_alpha, adapter.weights.size(), t_lora_us / 1000.0);
+
+    return true;
+}
+
 //
 // interface implementation
 //
@@ -15037,10 +18578,17 @@ struct llama_model_params llama_model_default_params() {
         /*.progress_callback           =*/ nullptr,
         /*.progress_callback_user_data =*/ nullptr,
         /*.kv_overrides                =*/ nullptr,
+        /*.n_ctx_fit                   =*/ 0,
+        /*.n_ubatch_fit                =*/ 0,
+        /*.n_gpu_experts               =*/ 0,
+        /*.expert_stats                =*/ nullptr,
         /*.vocab_only                  =*/ false,
         /*.use_mmap                    =*/ true,
         /*.use_mlock                   =*/ false,
         /*.check_tensors               =*/ false,
+        /*.repack                      =*/ false,
+        /*.tune                        =*/ false,
+        /*.lazy_load                   =*/ false,
     };
 
 #ifdef GGML_USE_METAL // [jart] let llamafile/gpu.c handle this
@@ -15070,6 +18618,9 @@ struct llama_context_params llama_context_default_params() {
         /*.yarn_beta_slow              =*/ 1.0f,
         /*.yarn_orig_ctx               =*/ 0,
         /*.defrag_thold                =*/ -1.0f,
+        /*.defrag_max_ms               =*/ 0.0f,
+        /*.n_seq_checkpoint            =*/ 0,
+        /*.n_cpu_decode                =*/ 0,
         /*.cb_eval                     =*/ nullptr,
         /*.cb_eval_user_data           =*/ nullptr,
         /*.type_k                      =*/ GGML_TYPE_F16,
@@ -15078,6 +18629,7 @@ struct llama_context_params llama_context_default_params() {
         /*.embeddings                  =*/ false,
         /*.offload_kqv                 =*/ true,
         /*.flash_attn                  =*/ false,
+        /*.swa_evict                   =*/ false,
         /*.abort_callback              =*/ nullptr,
         /*.abort_callback_data         =*/ nullptr,
     };
@@ -15098,6 +18650,8 @@ struct llama_model_quantize_params llama_model_quantize_default_params() {
         /*.keep_split                  =*/ false,
         /*.imatrix                     =*/ nullptr,
         /*.kv_overrides                =*/ nullptr,
+        /*.window_size                 =*/ 0,
+        /*.target_bpw                  =*/ 0.0f,
     };
 
     return result;
@@ -15118,6 +18672,10 @@ size_t llama_max_devices(void) {
 // #endif
 }
 
+size_t llama_max_parallel_sequences(void) {
+    return LLAMA_MAX_SEQ;
+}
+
 bool llama_supports_mmap(void) {
     return llama_mmap::SUPPORTED;
 }
@@ -15224,6 +18782,11 @@ struct llama_context * llama_new_context_with_model(
         return nullptr;
     }
 
+    if (params.n_seq_max > LLAMA_MAX_SEQ) {
+        LLAMA_LOG_ERROR("%s: n_seq_max must be <= %d\n", __func__, LLAMA_MAX_SEQ);
+        return nullptr;
+    }
+
     llama_context * ctx = new llama_context(*model);
 
     const auto & hparams = model->hparams;
@@ -15237,9 +18800,15 @@ struct llama_context * llama_new_context_with_model(
     cparams.yarn_beta_fast   = params.yarn_beta_fast;
     cparams.yarn_beta_slow   = params.yarn_beta_slow;
     cparams.defrag_thold     = params.defrag_thold;
+    cparams.defrag_max_ms    = params.defrag_max_ms;
+    cparams.n_seq_checkpoint = params.n_seq_checkpoint;
+    cparams.n_cpu_decode     = params.n_cpu_decode;
+    cparams.logits_top_k     = 0;
+    cparams.n_layer_exit     = 0;
     cparams.embeddings       = params.embeddings;
     cparams.offload_kqv      = params.offload_kqv;
     cparams.flash_attn       = params.flash_attn;
+    cparams.swa_evict        = params.swa_evict;
     cparams.pooling_type     = params.pooling_type;
 
     cparams.n_ctx            = params.n_ctx           == 0    ? hparams.n_ctx_train           : params.n_ctx;
@@ -15342,6 +18911,14 @@ struct llama_context * llama_new_context_with_model(
     GGML_ASSERT(hparams.n_embd_head_k % ggml_blck_size(type_k) == 0);
     GGML_ASSERT(hparams.n_embd_head_v % ggml_blck_size(type_v) == 0);
 
+    // without flash attention v is stored transposed, so a quantized
+    // block would span several kv cells
+    if (ggml_is_quantized(type_v) && !cparams.flash_attn) {
+        LLAMA_LOG_ERROR("%s: V cache quantization requires flash_attn\n", __func__);
+        llama_free(ctx);
+        return nullptr;
+    }
+
     if (!hparams.vocab_only) {
         // initialize backends
 if (llamafile_has_metal()) {
@@ -15492,7 +19069,7 @@ if (llamafile_has_metal()) {
             // enabling pipeline parallelism in the scheduler increases memory usage, so it is only done when necessary
             bool pipeline_parallel = llama_get_device_count() > 1 && model->n_gpu_layers > (int)model->hparams.n_layer && model->split_mode == LLAMA_SPLIT_MODE_LAYER;
 // #ifndef GGML_USE_CUDA
-            if (llamafile_has_cuda()) {
+            if (!llamafile_has_cuda()) {
             // pipeline parallelism requires support for async compute and events
             // currently this is only implemented in the CUDA backend
             pipeline_parallel = false;
@@ -15504,6 +19081,11 @@ if (llamafile_has_metal()) {
                 LLAMA_LOG_INFO("%s: pipeline parallelism enabled (n_copies=%d)\n", __func__, ggml_backend_sched_get_n_copies(ctx->sched));
             }
 
+            if (cparams.n_cpu_decode > 0 && ctx->backends.size() > 1) {
+                ggml_backend_sched_set_host_decode(ctx->sched, cparams.n_cpu_decode);
+                LLAMA_LOG_INFO("%s: ubatches of up to %u tokens run on the CPU over weights in shared memory\n", __func__, cparams.n_cpu_decode);
+            }
+
             // build worst-case graph
             int n_tokens = (int)std::min(cparams.n_ctx, cparams.n_ubatch);
             int n_past = cparams.n_ctx - n_tokens;
@@ -15744,7 +19326,14 @@ uint32_t llama_model_quantize(
 
 int32_t llama_model_apply_lora_from_file(const struct llama_model * model, const char * path_lora, float scale, const char * path_base_model, int32_t n_threads) {
     try {
-        return llama_apply_lora_from_file_internal(*model, path_lora, scale, path_base_model, n_threads);
+        int rc = llama_apply_lora_from_file_internal(*model, path_lora, scale, path_base_model, n_threads);
+        if (!rc) {
+            llama_model_mirror_numa(*model);
+            if (model->repacked) {
+                llama_model_repack(*model); // lora changed the weights
+            }
+        }
+        return rc;
     } catch (const std::exception & err) {
         LLAMA_LOG_ERROR("%s: failed to apply lora adapter: %s\n", __func__, err.what());
         return 1;
@@ -15820,27 +19409,299 @@ int32_t llama_control_vector_apply(struct llama_context * lctx, const float * da
         return 1;
     }
 
-    if (cvec.tensors.empty()) {
-        if (!llama_control_vector_init(cvec, model)) {
+    if (cvec.tensors.empty()) {
+        if (!llama_control_vector_init(cvec, model)) {
+            return 1;
+        }
+    }
+
+    cvec.layer_start = il_start;
+    cvec.layer_end   = il_end;
+
+    for (size_t il = 1; il < model.hparams.n_layer; il++) {
+        assert(cvec.tensors[il] != nullptr);
+
+        const size_t off = n_embd * (il - 1); // buffer doesn't have data for layer 0, since it's never present
+        if (off + n_embd <= len) {
+            ggml_backend_tensor_set(cvec.tensors[il], data + off, 0, n_embd * ggml_element_size(cvec.tensors[il]));
+        }
+    }
+
+    return 0;
+}
+
+// allocates a steering table for each buffer type, with n_rows rows of
+// ne0 floats, and zeroes them. layer -1 is the output
+static bool llama_steering_alloc(llama_steering & st, const llama_model & model, const std::vector<int> & layers,
+                                 int64_t ne0, std::vector<struct ggml_tensor *> & tensors) {
+    std::map<ggml_backend_buffer_type_t, ggml_context *> ctx_map;
+    for (int il : layers) {
+        ggml_backend_buffer_type_t buft = il < 0 ? model.buft_output.buft : model.buft_layer[il].buft;
+        if (ctx_map.count(buft)) {
+            continue;
+        }
+        struct ggml_init_params params = {
+            /*.mem_size   =*/ layers.size() * ggml_tensor_overhead(),
+            /*.mem_buffer =*/ NULL,
+            /*.no_alloc   =*/ true,
+        };
+        ggml_context * ctx = ggml_init(params);
+        if (!ctx) {
+            LLAMA_LOG_ERROR("%s: failed to allocate context for steering\n", __func__);
+            return false;
+        }
+        ctx_map[buft] = ctx;
+        st.ctxs.push_back(ctx);
+    }
+
+    for (int il : layers) {
+        ggml_backend_buffer_type_t buft = il < 0 ? model.buft_output.buft : model.buft_layer[il].buft;
+        tensors.push_back(ggml_new_tensor_2d(ctx_map.at(buft), GGML_TYPE_F32, ne0, st.n_rows));
+    }
+
+    for (auto it : ctx_map) {
+        ggml_backend_buffer_t buf = ggml_backend_alloc_ctx_tensors_from_buft(it.second, it.first);
+        if (!buf) {
+            LLAMA_LOG_ERROR("%s: failed to allocate buffer for steering\n", __func__);
+            return false;
+        }
+        ggml_backend_buffer_clear(buf, 0);
+        st.bufs.push_back(buf);
+    }
+
+    return true;
+}
+
+// writes the bias row of a sequence, which adds its own to that of every sequence
+static void llama_steering_write_bias(llama_context & lctx, int32_t row, llama_seq_id seq_id) {
+    llama_steering & st = lctx.steering;
+    if (!st.bias) {
+        return;
+    }
+    std::vector<float> data(st.bias->ne[0], 0.0f);
+    auto add = [&](llama_seq_id id) {
+        auto it = st.logit_bias.find(id);
+        if (it != st.logit_bias.end()) {
+            for (const auto & b : it->second) {
+                data[b.first] += b.second;
+            }
+        }
+    };
+    add(-1);
+    if (seq_id >= 0) {
+        add(seq_id);
+    }
+    ggml_backend_tensor_set(st.bias, data.data(), row*st.bias->nb[1], data.size()*sizeof(float));
+}
+
+static void llama_steering_write_bias_all(llama_context & lctx) {
+    llama_steering_write_bias(lctx, 0, -1);
+    for (const auto & it : lctx.steering.rows) {
+        llama_steering_write_bias(lctx, it.second, it.first);
+    }
+}
+
+// the row of a sequence, giving it one if it has none, or -1 if they're all taken
+static int32_t llama_steering_row(llama_context & lctx, llama_seq_id seq_id) {
+    llama_steering & st = lctx.steering;
+    if (int32_t row = st.row_of(seq_id)) {
+        return row;
+    }
+    if (st.free_rows.empty()) {
+        LLAMA_LOG_ERROR("%s: more than %d sequences are steered\n", __func__, st.n_rows - 1);
+        return -1;
+    }
+    const int32_t row = st.free_rows.back();
+    st.free_rows.pop_back();
+    st.rows[seq_id] = row;
+
+    llama_steering_write_bias(lctx, row, seq_id);
+    for (struct ggml_tensor * t : st.cvec) {
+        if (t) {
+            std::vector<float> zeros(t->ne[0], 0.0f);
+            ggml_backend_tensor_set(t, zeros.data(), row*t->nb[1], zeros.size()*sizeof(float));
+        }
+    }
+    return row;
+}
+
+// gives the row of a sequence back once it has neither
+static void llama_steering_release(llama_context & lctx, llama_seq_id seq_id) {
+    llama_steering & st = lctx.steering;
+    auto it = st.rows.find(seq_id);
+    if (it == st.rows.end() || st.logit_bias.count(seq_id) || st.cvec_seqs.count(seq_id)) {
+        return;
+    }
+    st.free_rows.push_back(it->second);
+    st.rows.erase(it);
+}
+
+static void llama_steering_init_rows(llama_context & lctx) {
+    llama_steering & st = lctx.steering;
+    if (st.n_rows) {
+        return;
+    }
+    st.n_rows = lctx.cparams.n_seq_max + 1;
+    for (int32_t row = st.n_rows - 1; row > 0; --row) {
+        st.free_rows.push_back(row);
+    }
+}
+
+int32_t llama_set_logit_bias(struct llama_context * ctx, llama_seq_id seq_id, const llama_token * tokens, const float * bias, int32_t n) {
+    llama_decode_wait(ctx);
+
+    llama_steering & st = ctx->steering;
+    const int32_t n_vocab = ctx->model.hparams.n_vocab;
+
+    if (seq_id < 0) {
+        seq_id = -1;
+    }
+    for (int32_t i = 0; i < n; ++i) {
+        if (tokens[i] < 0 || tokens[i] >= n_vocab) {
+            LLAMA_LOG_ERROR("%s: invalid token %d\n", __func__, tokens[i]);
+            return 1;
+        }
+    }
+
+    if (n <= 0) {
+        if (!st.logit_bias.erase(seq_id)) {
+            return 0;
+        }
+        if (seq_id == -1) {
+            llama_steering_write_bias_all(*ctx);
+        } else if (int32_t row = st.row_of(seq_id)) {
+            llama_steering_write_bias(*ctx, row, seq_id);
+            llama_steering_release(*ctx, seq_id);
+        }
+        return 0;
+    }
+
+    llama_steering_init_rows(*ctx);
+    const bool first = !st.bias;
+    if (first) {
+        std::vector<struct ggml_tensor *> tensors;
+        if (!llama_steering_alloc(st, ctx->model, {-1}, n_vocab, tensors)) {
+            return 1;
+        }
+        st.bias = tensors[0];
+    }
+
+    std::vector<std::pair<llama_token, float>> & v = st.logit_bias[seq_id];
+    v.clear();
+    for (int32_t i = 0; i < n; ++i) {
+        v.emplace_back(tokens[i], bias[i]);
+    }
+
+    if (seq_id == -1 || first) {
+        llama_steering_write_bias_all(*ctx);
+    }
+    if (seq_id != -1) {
+        const int32_t row = llama_steering_row(*ctx, seq_id);
+        if (row < 0) {
+            st.logit_bias.erase(seq_id);
+            return 1;
+        }
+        llama_steering_write_bias(*ctx, row, seq_id);
+    }
+    return 0;
+}
+
+int32_t llama_control_vector_apply_seq(struct llama_context * lctx, llama_seq_id seq_id, const float * data, size_t len, int32_t n_embd, int32_t il_start, int32_t il_end) {
+    if (seq_id < 0) {
+        return llama_control_vector_apply(lctx, data, len, n_embd, il_start, il_end);
+    }
+
+    llama_decode_wait(lctx);
+
+    const llama_model & model = lctx->model;
+    llama_steering & st = lctx->steering;
+
+    if (data == nullptr) {
+        st.cvec_seqs.erase(seq_id);
+        llama_steering_release(*lctx, seq_id);
+        return 0;
+    }
+
+    if (n_embd != (int) model.hparams.n_embd) {
+        LLAMA_LOG_ERROR("%s: control vector n_embd does not match model\n", __func__);
+        return 1;
+    }
+
+    llama_steering_init_rows(*lctx);
+    if (st.cvec.empty()) {
+        std::vector<int> layers;
+        for (int il = 1; il < (int) model.hparams.n_layer; ++il) {
+            layers.push_back(il);
+        }
+        std::vector<struct ggml_tensor *> tensors;
+        if (!llama_steering_alloc(st, model, layers, n_embd, tensors)) {
             return 1;
         }
+        st.cvec.push_back(nullptr); // there's never a tensor for layer 0
+        st.cvec.insert(st.cvec.end(), tensors.begin(), tensors.end());
     }
 
-    cvec.layer_start = il_start;
-    cvec.layer_end   = il_end;
+    const int32_t row = llama_steering_row(*lctx, seq_id);
+    if (row < 0) {
+        return 1;
+    }
 
+    std::vector<float> zeros(n_embd, 0.0f);
     for (size_t il = 1; il < model.hparams.n_layer; il++) {
-        assert(cvec.tensors[il] != nullptr);
-
         const size_t off = n_embd * (il - 1); // buffer doesn't have data for layer 0, since it's never present
-        if (off + n_embd <= len) {
-            ggml_backend_tensor_set(cvec.tensors[il], data + off, 0, n_embd * ggml_element_size(cvec.tensors[il]));
+        const bool used = (int) il >= il_start && (int) il <= il_end && off + n_embd <= len;
+        ggml_backend_tensor_set(st.cvec[il], used ? data + off : zeros.data(), row*st.cvec[il]->nb[1], n_embd*sizeof(float));
+    }
+    st.cvec_seqs.insert(seq_id);
+
+    return 0;
+}
+
+struct llama_lora_adapter * llama_lora_adapter_init(struct llama_model * model, const char * path_lora) {
+    try {
+        std::unique_ptr<llama_lora_adapter> adapter(new llama_lora_adapter);
+        if (llama_lora_adapter_load(*adapter, *model, path_lora)) {
+            return adapter.release();
         }
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: failed to load lora adapter: %s\n", __func__, err.what());
     }
+    return nullptr;
+}
+
+void llama_lora_adapter_free(struct llama_lora_adapter * adapter) {
+    delete adapter;
+}
 
+int32_t llama_lora_adapter_set(struct llama_context * ctx, struct llama_lora_adapter * adapter, llama_seq_id seq_id, float scale) {
+    if (adapter->model != &ctx->model) {
+        LLAMA_LOG_ERROR("%s: lora adapter was loaded for another model\n", __func__);
+        return 1;
+    }
+    if (seq_id < 0) {
+        seq_id = -1;
+    }
+    auto & v = ctx->lora_seq[seq_id];
+    v.erase(std::remove_if(v.begin(), v.end(), [&](const std::pair<llama_lora_adapter *, float> & a) {
+        return a.first == adapter;
+    }), v.end());
+    if (scale != 0.0f) {
+        v.emplace_back(adapter, scale);
+    }
+    if (v.empty()) {
+        ctx->lora_seq.erase(seq_id);
+    }
     return 0;
 }
 
+void llama_lora_adapter_clear(struct llama_context * ctx, llama_seq_id seq_id) {
+    if (seq_id < 0) {
+        ctx->lora_seq.clear();
+    } else {
+        ctx->lora_seq.erase(seq_id);
+    }
+}
+
 struct llama_kv_cache_view llama_kv_cache_view_init(const struct llama_context * ctx, int32_t n_seq_max) {
     struct llama_kv_cache_view result = {
         /*.n_cells            = */ 0,
@@ -15945,21 +19806,47 @@ int32_t llama_get_kv_cache_used_cells(const struct llama_context * ctx) {
 }
 
 void llama_kv_cache_clear(struct llama_context * ctx) {
+    llama_decode_wait(ctx);
     llama_kv_cache_clear(ctx->kv_self);
 }
 
+// states are read and written in place, which can't wait for the copies
+// seq_cp() asked for, nor race with the graph that's still computing
+static void llama_kv_cache_sync_states(struct llama_context * ctx) {
+    llama_decode_wait(ctx);
+    if (ctx->kv_self.recurrent) {
+        llama_synchronize(ctx);
+        if (ctx->kv_self.do_copy) {
+            llama_kv_cache_update_internal(*ctx);
+        }
+    }
+}
+
 bool llama_kv_cache_seq_rm(struct llama_context * ctx, llama_seq_id seq_id, llama_pos p0, llama_pos p1) {
+    llama_kv_cache_sync_states(ctx);
     return llama_kv_cache_seq_rm(ctx->kv_self, seq_id, p0, p1);
 }
 
+llama_pos llama_kv_cache_seq_rewind(struct llama_context * ctx, llama_seq_id seq_id, llama_pos p0) {
+    llama_kv_cache_sync_states(ctx);
+    return llama_kv_cache_seq_rewind(ctx->kv_self, seq_id, p0);
+}
+
+void llama_kv_cache_seq_checkpoint(struct llama_context * ctx, llama_seq_id seq_id) {
+    llama_kv_cache_sync_states(ctx);
+    llama_kv_cache_seq_checkpoint(ctx->kv_self, seq_id);
+}
+
 void llama_kv_cache_seq_cp(struct llama_context * ctx, llama_seq_id seq_id_src, llama_seq_id seq_id_dst, llama_pos p0, llama_pos p1) {
     if (seq_id_src == seq_id_dst) {
         return;
     }
+    llama_decode_wait(ctx);
     llama_kv_cache_seq_cp(ctx->kv_self, seq_id_src, seq_id_dst, p0, p1);
 }
 
 void llama_kv_cache_seq_keep(struct llama_context * ctx, llama_seq_id seq_id) {
+    llama_decode_wait(ctx);
     llama_kv_cache_seq_keep(ctx->kv_self, seq_id);
 }
 
@@ -15967,6 +19854,7 @@ void llama_kv_cache_seq_add(struct llama_context * ctx, llama_seq_id seq_id, lla
     if (delta == 0) {
         return;
     }
+    llama_decode_wait(ctx);
 
     llama_kv_cache_seq_add(ctx->kv_self, seq_id, p0, p1, delta);
 }
@@ -15975,19 +19863,23 @@ void llama_kv_cache_seq_div(struct llama_context * ctx, llama_seq_id seq_id, lla
     if (d == 1) {
         return;
     }
+    llama_decode_wait(ctx);
 
     llama_kv_cache_seq_div(ctx->kv_self, seq_id, p0, p1, d);
 }
 
 llama_pos llama_kv_cache_seq_pos_max(struct llama_context * ctx, llama_seq_id seq_id) {
+    llama_decode_wait(ctx);
     return llama_kv_cache_seq_pos_max(ctx->kv_self, seq_id);
 }
 
 void llama_kv_cache_defrag(struct llama_context * ctx) {
+    llama_decode_wait(ctx);
     llama_kv_cache_defrag(ctx->kv_self);
 }
 
 void llama_kv_cache_update(struct llama_context * ctx) {
+    llama_decode_wait(ctx);
     llama_kv_cache_update_internal(*ctx);
 }
 
@@ -16089,6 +19981,18 @@ struct llama_data_buffer_context : llama_data_context {
     }
 };
 
+struct llama_data_vector_context : llama_data_context {
+    std::vector<uint8_t> buf;
+
+    void write(const void * src, size_t size) override {
+        buf.insert(buf.end(), (const uint8_t *) src, (const uint8_t *) src + size);
+    }
+
+    size_t get_size_written() override {
+        return buf.size();
+    }
+};
+
 struct llama_data_file_context : llama_data_context {
     llama_file * file;
     size_t size_written = 0;
@@ -16105,22 +20009,8 @@ struct llama_data_file_context : llama_data_context {
     }
 };
 
-/** copy state data into either a buffer or file depending on the passed in context
- *
- * file context:
- * llama_file file("/path", "wb");
- * llama_data_file_context data_ctx(&file);
- * llama_state_get_data(ctx, &data_ctx);
- *
- * buffer context:
- * std::vector<uint8_t> buf(max_size, 0);
- * llama_data_buffer_context data_ctx(&buf.data());
- * llama_state_get_data(ctx, &data_ctx);
- *
-*/
-static void llama_state_get_data_internal(struct llama_context * ctx, llama_data_context * data_ctx) {
-    llama_synchronize(ctx);
-
+// copies the rng and the outputs of the last batch
+static void llama_state_get_outputs_internal(struct llama_context * ctx, llama_data_context * data_ctx) {
     // copy rng
     {
         std::ostringstream rng_ss;
@@ -16192,6 +20082,25 @@ static void llama_state_get_data_internal(struct llama_context * ctx, llama_data
             }
         }
     }
+}
+
+/** copy state data into either a buffer or file depending on the passed in context
+ *
+ * file context:
+ * llama_file file("/path", "wb");
+ * llama_data_file_context data_ctx(&file);
+ * llama_state_get_data(ctx, &data_ctx);
+ *
+ * buffer context:
+ * std::vector<uint8_t> buf(max_size, 0);
+ * llama_data_buffer_context data_ctx(&buf.data());
+ * llama_state_get_data(ctx, &data_ctx);
+ *
+*/
+static void llama_state_get_data_internal(struct llama_context * ctx, llama_data_context * data_ctx) {
+    llama_synchronize(ctx);
+
+    llama_state_get_outputs_internal(ctx, data_ctx);
 
     // copy kv cache
     {
@@ -16273,12 +20182,9 @@ size_t llama_state_get_data(struct llama_context * ctx, uint8_t * dst) {
     return data_ctx.get_size_written();
 }
 
-// Sets the state reading from the specified source address
-size_t llama_state_set_data(struct llama_context * ctx, const uint8_t * src) {
-    llama_synchronize(ctx);
-
-    const uint8_t * inp = src;
-
+// restores what llama_state_get_outputs_internal() wrote, returning
+// the first byte after it
+static const uint8_t * llama_state_set_outputs_internal(struct llama_context * ctx, const uint8_t * inp) {
     // set rng
     {
         size_t rng_size;
@@ -16346,6 +20252,17 @@ size_t llama_state_set_data(struct llama_context * ctx, const uint8_t * src) {
         }
     }
 
+    return inp;
+}
+
+// Sets the state reading from the specified source address
+size_t llama_state_set_data(struct llama_context * ctx, const uint8_t * src) {
+    llama_synchronize(ctx);
+
+    const uint8_t * inp = src;
+
+    inp = llama_state_set_outputs_internal(ctx, inp);
+
     // set kv cache
     {
         const auto & kv_self = ctx->kv_self;
@@ -16431,6 +20348,8 @@ size_t llama_state_set_data(struct llama_context * ctx, const uint8_t * src) {
                 ctx->kv_self.cells[i].seq_id.insert(seq_id);
             }
         }
+
+        llama_kv_cache_index_rebuild(ctx->kv_self);
     }
 
     const size_t nread    = inp - src;
@@ -16454,82 +20373,573 @@ static bool llama_state_load_file_internal(struct llama_context * ctx, const cha
             return false;
         }
 
-        llama_hparams session_hparams;
-        file.read_raw(&session_hparams, sizeof(llama_hparams));
+        llama_hparams session_hparams;
+        file.read_raw(&session_hparams, sizeof(llama_hparams));
+
+        if (session_hparams != ctx->model.hparams) {
+            LLAMA_LOG_INFO("%s : model hparams didn't match from session file!\n", __func__);
+            return false;
+        }
+    }
+
+    // load the prompt
+    {
+        const uint32_t n_token_count = file.read_u32();
+
+        if (n_token_count > n_token_capacity) {
+            LLAMA_LOG_ERROR("%s : token count in session file exceeded capacity! %u > %zu\n", __func__, n_token_count, n_token_capacity);
+            return false;
+        }
+
+        file.read_raw(tokens_out, sizeof(llama_token) * n_token_count);
+        *n_token_count_out = n_token_count;
+    }
+
+    // restore the context state
+    {
+        const size_t n_state_size_cur = llamafile_size(file.file) - file.tell();
+        const size_t n_state_size_max = llama_state_get_size(ctx);
+
+        if (n_state_size_cur > n_state_size_max) {
+            LLAMA_LOG_ERROR("%s : the state size in session file is too big! max %zu, got %zu\n", __func__, n_state_size_max, n_state_size_cur);
+            return false;
+        }
+
+        std::vector<uint8_t> state_data(n_state_size_max);
+        file.read_raw(state_data.data(), n_state_size_cur);
+
+        llama_state_set_data(ctx, state_data.data());
+    }
+
+    return true;
+}
+
+static bool llama_state_load_append_internal(struct llama_context * ctx, int fd, llama_token * tokens_out, size_t n_token_capacity, size_t * n_token_count_out);
+
+bool llama_state_load_file(struct llama_context * ctx, const char * path_session, llama_token * tokens_out, size_t n_token_capacity, size_t * n_token_count_out) {
+    try {
+        // files written by llama_state_append_file() are read through a mapping
+        int fd = open(path_session, O_RDONLY | O_CLOEXEC);
+        if (fd != -1) {
+            uint32_t magic = 0;
+            bool ok = false;
+            bool append = pread(fd, &magic, sizeof(magic), 0) == sizeof(magic) && magic == LLAMA_FILE_MAGIC_GGSA;
+            if (append) {
+                llama_synchronize(ctx);
+                ok = llama_state_load_append_internal(ctx, fd, tokens_out, n_token_capacity, n_token_count_out);
+            }
+            close(fd);
+            if (append) {
+                return ok;
+            }
+        }
+        return llama_state_load_file_internal(ctx, path_session, tokens_out, n_token_capacity, n_token_count_out);
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("error loading session file: %s\n", err.what());
+        return false;
+    }
+}
+
+static bool llama_state_save_file_internal(struct llama_context * ctx, const char * path_session, const llama_token * tokens, size_t n_token_count) {
+    llama_file file(path_session, "wb");
+
+    file.write_u32(LLAMA_SESSION_MAGIC);
+    file.write_u32(LLAMA_SESSION_VERSION);
+
+    file.write_raw(&ctx->model.hparams, sizeof(llama_hparams));
+
+    // save the prompt
+    file.write_u32((uint32_t) n_token_count);
+    file.write_raw(tokens, sizeof(llama_token) * n_token_count);
+
+    // save the context state using stream saving
+    llama_data_file_context data_ctx(&file);
+    llama_state_get_data_internal(ctx, &data_ctx);
+
+    return true;
+}
+
+bool llama_state_save_file(struct llama_context * ctx, const char * path_session, const llama_token * tokens, size_t n_token_count) {
+    try {
+        return llama_state_save_file_internal(ctx, path_session, tokens, n_token_count);
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("error saving session file: %s\n", err.what());
+        return false;
+    }
+}
+
+//
+// append-only session files
+//
+// a session file written by llama_state_append_file() is a header and
+// a list of records. each record holds the tokens and the kv cells that
+// were added since the record before it, so saving a long conversation
+// after every turn only writes what that turn added. the rng, logits and
+// embeddings are small, so every record has a copy and the last one wins.
+// kv data is stored per layer, deflated if that makes it smaller.
+//
+
+#define LLAMA_SESSION_APPEND_VERSION 1
+#define LLAMA_SESSION_RECORD_END     0x656e6472u // 'endr', marks a record that was fully written
+
+struct llama_session_record {
+    size_t   offset;     // of the record in the file
+    size_t   offset_kv;  // of its first kv blob
+    size_t   offset_out; // of its output state
+    size_t   size_out;
+    uint32_t n_tokens;
+    const llama_token * tokens;
+    uint32_t cell_begin;
+    uint32_t cell_end;
+    uint32_t kv_used;
+    size_t   offset_cells;
+};
+
+// reads a session file mapped into memory, bounds checking everything
+struct llama_session_reader {
+    const uint8_t * data;
+    size_t size;
+    size_t pos = 0;
+
+    llama_session_reader(const uint8_t * data, size_t size) : data(data), size(size) {}
+
+    bool read(void * dst, size_t n) {
+        if (n > size - pos) {
+            return false;
+        }
+        memcpy(dst, data + pos, n);
+        pos += n;
+        return true;
+    }
+
+    bool skip(size_t n) {
+        if (n > size - pos) {
+            return false;
+        }
+        pos += n;
+        return true;
+    }
+
+    // returns a blob written by llama_session_write_blob()
+    bool blob(const uint8_t ** p, uint64_t * raw_size, uint64_t * stored_size) {
+        if (!read(raw_size, sizeof(*raw_size)) || !read(stored_size, sizeof(*stored_size))) {
+            return false;
+        }
+        *p = data + pos;
+        return *stored_size <= *raw_size && skip(*stored_size);
+    }
+};
+
+static void llama_session_write(FILE * f, const void * p, size_t n) {
+    if (n && fwrite(p, n, 1, f) != 1) {
+        throw std::runtime_error(format("write error: %s", strerror(errno)));
+    }
+}
+
+static void llama_session_write_blob(FILE * f, const void * p, size_t n, bool compress, std::vector<uint8_t> & tmp) {
+    uint64_t raw_size = n;
+    uint64_t stored_size = n;
+    const void * stored = p;
+    if (compress && n) {
+        uLongf len = compressBound(n);
+        tmp.resize(len);
+        if (compress2(tmp.data(), &len, (const Bytef *) p, n, Z_BEST_SPEED) == Z_OK && len < n) {
+            stored = tmp.data();
+            stored_size = len;
+        }
+    }
+    llama_session_write(f, &raw_size, sizeof(raw_size));
+    llama_session_write(f, &stored_size, sizeof(stored_size));
+    llama_session_write(f, stored, stored_size);
+}
+
+// returns the raw bytes of a blob, inflating into tmp if need be
+static const uint8_t * llama_session_read_blob(const uint8_t * p, uint64_t raw_size, uint64_t stored_size, std::vector<uint8_t> & tmp) {
+    if (stored_size == raw_size) {
+        return p;
+    }
+    tmp.resize(raw_size);
+    uLongf len = raw_size;
+    if (uncompress(tmp.data(), &len, p, stored_size) != Z_OK || len != raw_size) {
+        throw std::runtime_error("corrupt kv data in session file");
+    }
+    return tmp.data();
+}
+
+// what a session file has to agree on with the context loading it
+struct llama_session_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t n_layer;
+    uint32_t kv_size;
+    uint32_t v_trans;
+    uint32_t type_k;
+    uint32_t type_v;
+    uint32_t n_embd_k_gqa;
+    uint32_t n_embd_v_gqa;
+};
+
+static llama_session_header llama_session_header_for(const struct llama_context * ctx) {
+    const auto & kv_self = ctx->kv_self;
+    const auto & hparams = ctx->model.hparams;
+    llama_session_header h = {};
+    h.magic        = LLAMA_FILE_MAGIC_GGSA;
+    h.version      = LLAMA_SESSION_APPEND_VERSION;
+    h.n_layer      = hparams.n_layer;
+    h.kv_size      = kv_self.size;
+    h.v_trans      = kv_self.v_trans;
+    h.type_k       = kv_self.type_k;
+    h.type_v       = kv_self.type_v;
+    h.n_embd_k_gqa = hparams.n_embd_k_gqa() + hparams.n_embd_k_s();
+    h.n_embd_v_gqa = hparams.n_embd_v_gqa() + hparams.n_embd_v_s();
+    return h;
+}
+
+// checks the header and finds the records that were completely written
+static bool llama_session_scan(const struct llama_context * ctx, const uint8_t * data, size_t size,
+                               std::vector<llama_session_record> & records, size_t * end) {
+    llama_session_reader r(data, size);
+    llama_session_header h;
+    llama_hparams hparams;
+    const llama_session_header want = llama_session_header_for(ctx);
+    if (!r.read(&h, sizeof(h)) || h.magic != want.magic || h.version != want.version) {
+        return false;
+    }
+    if (!r.read(&hparams, sizeof(hparams)) || hparams != ctx->model.hparams) {
+        LLAMA_LOG_INFO("%s : model hparams didn't match from session file!\n", __func__);
+        return false;
+    }
+    if (h.n_layer != want.n_layer || h.v_trans != want.v_trans || h.type_k != want.type_k || h.type_v != want.type_v ||
+        h.n_embd_k_gqa != want.n_embd_k_gqa || h.n_embd_v_gqa != want.n_embd_v_gqa) {
+        LLAMA_LOG_INFO("%s : kv cache layout didn't match from session file!\n", __func__);
+        return false;
+    }
+
+    records.clear();
+    *end = r.pos;
+    uint32_t cell_end = 0;
+    for (;;) {
+        llama_session_record rec = {};
+        rec.offset = r.pos;
+        if (!r.read(&rec.n_tokens, sizeof(rec.n_tokens))) {
+            break;
+        }
+        rec.tokens = (const llama_token *) (data + r.pos);
+        if (!r.skip((size_t) rec.n_tokens * sizeof(llama_token)) ||
+            !r.read(&rec.cell_begin, sizeof(rec.cell_begin)) ||
+            !r.read(&rec.cell_end,   sizeof(rec.cell_end)) ||
+            !r.read(&rec.kv_used,    sizeof(rec.kv_used)) ||
+            rec.cell_begin != cell_end || rec.cell_end < rec.cell_begin) {
+            break;
+        }
+        rec.offset_cells = r.pos;
+        bool ok = true;
+        for (uint32_t i = rec.cell_begin; ok && i < rec.cell_end; ++i) {
+            llama_pos pos;
+            uint32_t n_seq;
+            ok = r.read(&pos, sizeof(pos)) && r.read(&n_seq, sizeof(n_seq)) && r.skip((size_t) n_seq * sizeof(llama_seq_id));
+        }
+        rec.offset_kv = r.pos;
+        for (uint32_t il = 0; ok && il < 2 * h.n_layer; ++il) {
+            const uint8_t * p;
+            uint64_t raw_size, stored_size;
+            ok = r.blob(&p, &raw_size, &stored_size);
+        }
+        uint64_t size_out = 0;
+        ok = ok && r.read(&size_out, sizeof(size_out));
+        rec.offset_out = r.pos;
+        rec.size_out = size_out;
+        uint32_t mark = 0;
+        if (!ok || !r.skip(size_out) || !r.read(&mark, sizeof(mark)) || mark != LLAMA_SESSION_RECORD_END) {
+            break;
+        }
+        records.push_back(rec);
+        cell_end = rec.cell_end;
+        *end = r.pos;
+    }
+    return true;
+}
+
+// appends the tokens and kv cells [cell_begin, cell_end) as a record
+static void llama_session_write_record(struct llama_context * ctx, FILE * f, const llama_token * tokens, uint32_t n_tokens,
+                                       uint32_t cell_begin, uint32_t cell_end, bool compress) {
+    const auto & kv_self = ctx->kv_self;
+    const llama_session_header h = llama_session_header_for(ctx);
+
+    llama_session_write(f, &n_tokens, sizeof(n_tokens));
+    llama_session_write(f, tokens, (size_t) n_tokens * sizeof(llama_token));
+    llama_session_write(f, &cell_begin, sizeof(cell_begin));
+    llama_session_write(f, &cell_end, sizeof(cell_end));
+    llama_session_write(f, &kv_self.used, sizeof(kv_self.used));
+
+    for (uint32_t i = cell_begin; i < cell_end; ++i) {
+        const auto & cell = kv_self.cells[i];
+        const uint32_t n_seq = cell.seq_id.size();
+        llama_session_write(f, &cell.pos, sizeof(cell.pos));
+        llama_session_write(f, &n_seq, sizeof(n_seq));
+        for (llama_seq_id seq_id : cell.seq_id) {
+            llama_session_write(f, &seq_id, sizeof(seq_id));
+        }
+    }
+
+    const uint32_t n_cells = cell_end - cell_begin;
+    std::vector<uint8_t> buf;
+    std::vector<uint8_t> tmp;
+    for (uint32_t il = 0; il < h.n_layer; ++il) {
+        const ggml_tensor * k = kv_self.k_l[il];
+        buf.resize(ggml_row_size(k->type, (size_t) h.n_embd_k_gqa * n_cells));
+        ggml_backend_tensor_get(k, buf.data(), ggml_row_size(k->type, (size_t) h.n_embd_k_gqa * cell_begin), buf.size());
+        llama_session_write_blob(f, buf.data(), buf.size(), compress, tmp);
+
+        const ggml_tensor * v = kv_self.v_l[il];
+        if (!kv_self.v_trans) {
+            buf.resize(ggml_row_size(v->type, (size_t) h.n_embd_v_gqa * n_cells));
+            ggml_backend_tensor_get(v, buf.data(), ggml_row_size(v->type, (size_t) h.n_embd_v_gqa * cell_begin), buf.size());
+        } else {
+            // only the new part of each row of the transposed v
+            const size_t row_size   = ggml_row_size(v->type, n_cells);
+            const size_t row_stride = ggml_row_size(v->type, kv_self.size);
+            const size_t row_offs   = ggml_row_size(v->type, cell_begin);
+            buf.resize(row_size * h.n_embd_v_gqa);
+            for (uint32_t ir = 0; row_size && ir < h.n_embd_v_gqa; ++ir) {
+                ggml_backend_tensor_get(v, buf.data() + ir*row_size, ir*row_stride + row_offs, row_size);
+            }
+        }
+        llama_session_write_blob(f, buf.data(), buf.size(), compress, tmp);
+    }
+
+    llama_data_vector_context out;
+    llama_state_get_outputs_internal(ctx, &out);
+    const uint64_t size_out = out.buf.size();
+    llama_session_write(f, &size_out, sizeof(size_out));
+    llama_session_write(f, out.buf.data(), out.buf.size());
+
+    const uint32_t mark = LLAMA_SESSION_RECORD_END;
+    llama_session_write(f, &mark, sizeof(mark));
+}
+
+// returns true if the cells saved in records still hold the same thing
+static bool llama_session_cells_match(const struct llama_context * ctx, const uint8_t * data,
+                                      const std::vector<llama_session_record> & records) {
+    const auto & kv_self = ctx->kv_self;
+    for (const auto & rec : records) {
+        llama_session_reader r(data, rec.offset_kv);
+        r.pos = rec.offset_cells;
+        for (uint32_t i = rec.cell_begin; i < rec.cell_end; ++i) {
+            llama_pos pos;
+            uint32_t n_seq;
+            r.read(&pos, sizeof(pos));
+            r.read(&n_seq, sizeof(n_seq));
+            if (i >= kv_self.size) {
+                return false;
+            }
+            const auto & cell = kv_self.cells[i];
+            if (cell.pos != pos || cell.seq_id.size() != n_seq) {
+                return false;
+            }
+            for (uint32_t j = 0; j < n_seq; ++j) {
+                llama_seq_id seq_id;
+                r.read(&seq_id, sizeof(seq_id));
+                if (!cell.has_seq_id(seq_id)) {
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+struct llama_session_map {
+    void * addr = MAP_FAILED;
+    size_t size = 0;
 
-        if (session_hparams != ctx->model.hparams) {
-            LLAMA_LOG_INFO("%s : model hparams didn't match from session file!\n", __func__);
-            return false;
+    ~llama_session_map() {
+        if (addr != MAP_FAILED) {
+            munmap(addr, size);
         }
     }
 
-    // load the prompt
-    {
-        const uint32_t n_token_count = file.read_u32();
-
-        if (n_token_count > n_token_capacity) {
-            LLAMA_LOG_ERROR("%s : token count in session file exceeded capacity! %u > %zu\n", __func__, n_token_count, n_token_capacity);
+    bool map(int fd) {
+        struct stat st;
+        if (fstat(fd, &st) || !st.st_size) {
             return false;
         }
+        size = st.st_size;
+        addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        return addr != MAP_FAILED;
+    }
+};
 
-        file.read_raw(tokens_out, sizeof(llama_token) * n_token_count);
-        *n_token_count_out = n_token_count;
+static bool llama_state_append_file_internal(struct llama_context * ctx, const char * path_session, const llama_token * tokens, size_t n_token_count, bool compress) {
+    llama_synchronize(ctx);
+
+    FILE * f = fopen(path_session, "r+be");
+    if (!f && errno == ENOENT) {
+        f = fopen(path_session, "w+be");
+    }
+    if (!f) {
+        throw std::runtime_error(format("failed to open %s: %s", path_session, strerror(errno)));
     }
+    std::unique_ptr<FILE, decltype(&fclose)> closer(f, &fclose);
 
-    // restore the context state
+    // see how much of what we have is in the file already
+    uint32_t n_saved = 0;
+    uint32_t cells_saved = 0;
+    size_t end = 0;
     {
-        const size_t n_state_size_cur = llamafile_size(file.file) - file.tell();
-        const size_t n_state_size_max = llama_state_get_size(ctx);
+        llama_session_map m;
+        std::vector<llama_session_record> records;
+        if (m.map(fileno(f)) && llama_session_scan(ctx, (const uint8_t *) m.addr, m.size, records, &end) && !records.empty()) {
+            for (const auto & rec : records) {
+                if (n_saved + rec.n_tokens > n_token_count ||
+                    memcmp(tokens + n_saved, rec.tokens, rec.n_tokens * sizeof(llama_token))) {
+                    records.clear();
+                    break;
+                }
+                n_saved += rec.n_tokens;
+            }
+            if (!records.empty() && llama_session_cells_match(ctx, (const uint8_t *) m.addr, records)) {
+                cells_saved = records.back().cell_end;
+            } else {
+                n_saved = 0;
+            }
+        }
+    }
 
-        if (n_state_size_cur > n_state_size_max) {
-            LLAMA_LOG_ERROR("%s : the state size in session file is too big! max %zu, got %zu\n", __func__, n_state_size_max, n_state_size_cur);
-            return false;
+    const uint32_t cell_end = llama_kv_cache_cell_max(ctx->kv_self);
+    if (!n_saved || cells_saved > cell_end) {
+        // start over
+        n_saved = 0;
+        cells_saved = 0;
+        if (ftruncate(fileno(f), 0) || fseeko(f, 0, SEEK_SET)) {
+            throw std::runtime_error(format("failed to truncate %s: %s", path_session, strerror(errno)));
+        }
+        const llama_session_header h = llama_session_header_for(ctx);
+        llama_session_write(f, &h, sizeof(h));
+        llama_session_write(f, &ctx->model.hparams, sizeof(llama_hparams));
+    } else {
+        // drop whatever a save that got interrupted left behind
+        if (ftruncate(fileno(f), end) || fseeko(f, end, SEEK_SET)) {
+            throw std::runtime_error(format("failed to truncate %s: %s", path_session, strerror(errno)));
         }
+    }
 
-        std::vector<uint8_t> state_data(n_state_size_max);
-        file.read_raw(state_data.data(), n_state_size_cur);
+    llama_session_write_record(ctx, f, tokens + n_saved, n_token_count - n_saved, cells_saved, cell_end, compress);
 
-        llama_state_set_data(ctx, state_data.data());
+    if (fflush(f)) {
+        throw std::runtime_error(format("write error: %s", strerror(errno)));
     }
-
     return true;
 }
 
-bool llama_state_load_file(struct llama_context * ctx, const char * path_session, llama_token * tokens_out, size_t n_token_capacity, size_t * n_token_count_out) {
+bool llama_state_append_file(struct llama_context * ctx, const char * path_session, const llama_token * tokens, size_t n_token_count, bool compress) {
+    // the cells of recurrent models are per sequence states, not tokens
+    if (ctx->kv_self.recurrent) {
+        return llama_state_save_file(ctx, path_session, tokens, n_token_count);
+    }
     try {
-        return llama_state_load_file_internal(ctx, path_session, tokens_out, n_token_capacity, n_token_count_out);
+        return llama_state_append_file_internal(ctx, path_session, tokens, n_token_count, compress);
     } catch (const std::exception & err) {
-        LLAMA_LOG_ERROR("error loading session file: %s\n", err.what());
+        LLAMA_LOG_ERROR("error saving session file: %s\n", err.what());
         return false;
     }
 }
 
-static bool llama_state_save_file_internal(struct llama_context * ctx, const char * path_session, const llama_token * tokens, size_t n_token_count) {
-    llama_file file(path_session, "wb");
-
-    file.write_u32(LLAMA_SESSION_MAGIC);
-    file.write_u32(LLAMA_SESSION_VERSION);
+static bool llama_state_load_append_internal(struct llama_context * ctx, int fd, llama_token * tokens_out, size_t n_token_capacity, size_t * n_token_count_out) {
+    llama_session_map m;
+    std::vector<llama_session_record> records;
+    size_t end;
+    if (!m.map(fd) || !llama_session_scan(ctx, (const uint8_t *) m.addr, m.size, records, &end)) {
+        return false;
+    }
+    if (records.empty()) {
+        LLAMA_LOG_ERROR("%s : session file has no complete records\n", __func__);
+        return false;
+    }
 
-    file.write_raw(&ctx->model.hparams, sizeof(llama_hparams));
+    const uint8_t * data = (const uint8_t *) m.addr;
+    auto & kv_self = ctx->kv_self;
+    const llama_session_header h = llama_session_header_for(ctx);
 
-    // save the prompt
-    file.write_u32((uint32_t) n_token_count);
-    file.write_raw(tokens, sizeof(llama_token) * n_token_count);
+    size_t n_tokens = 0;
+    for (const auto & rec : records) {
+        n_tokens += rec.n_tokens;
+    }
+    if (n_tokens > n_token_capacity) {
+        LLAMA_LOG_ERROR("%s : token count in session file exceeded capacity! %zu > %zu\n", __func__, n_tokens, n_token_capacity);
+        return false;
+    }
+    if (records.back().cell_end > kv_self.size) {
+        LLAMA_LOG_ERROR("%s : session file has %u kv cells but the cache only has %u\n", __func__, records.back().cell_end, kv_self.size);
+        return false;
+    }
 
-    // save the context state using stream saving
-    llama_data_file_context data_ctx(&file);
-    llama_state_get_data_internal(ctx, &data_ctx);
+    llama_kv_cache_clear(ctx);
 
-    return true;
-}
+    n_tokens = 0;
+    std::vector<uint8_t> tmp;
+    for (const auto & rec : records) {
+        memcpy(tokens_out + n_tokens, rec.tokens, rec.n_tokens * sizeof(llama_token));
+        n_tokens += rec.n_tokens;
 
-bool llama_state_save_file(struct llama_context * ctx, const char * path_session, const llama_token * tokens, size_t n_token_count) {
-    try {
-        return llama_state_save_file_internal(ctx, path_session, tokens, n_token_count);
-    } catch (const std::exception & err) {
-        LLAMA_LOG_ERROR("error saving session file: %s\n", err.what());
-        return false;
+        llama_session_reader r(data, m.size);
+        r.pos = rec.offset_cells;
+        for (uint32_t i = rec.cell_begin; i < rec.cell_end; ++i) {
+            llama_pos pos;
+            uint32_t n_seq;
+            r.read(&pos, sizeof(pos));
+            r.read(&n_seq, sizeof(n_seq));
+            kv_self.cells[i].pos = pos;
+            for (uint32_t j = 0; j < n_seq; ++j) {
+                llama_seq_id seq_id;
+                r.read(&seq_id, sizeof(seq_id));
+                kv_self.cells[i].seq_id.insert(seq_id);
+            }
+        }
+
+        // uncompressed blobs go from the mapping straight to the cache
+        for (uint32_t il = 0; il < h.n_layer; ++il) {
+            const uint8_t * p;
+            uint64_t raw_size, stored_size;
+
+            ggml_tensor * k = kv_self.k_l[il];
+            r.blob(&p, &raw_size, &stored_size);
+            GGML_ASSERT(raw_size == ggml_row_size(k->type, (size_t) h.n_embd_k_gqa * (rec.cell_end - rec.cell_begin)));
+            if (raw_size) {
+                ggml_backend_tensor_set(k, llama_session_read_blob(p, raw_size, stored_size, tmp),
+                                        ggml_row_size(k->type, (size_t) h.n_embd_k_gqa * rec.cell_begin), raw_size);
+            }
+
+            ggml_tensor * v = kv_self.v_l[il];
+            r.blob(&p, &raw_size, &stored_size);
+            GGML_ASSERT(raw_size == ggml_row_size(v->type, (size_t) h.n_embd_v_gqa * (rec.cell_end - rec.cell_begin)));
+            if (!raw_size) {
+                continue;
+            }
+            const uint8_t * src = llama_session_read_blob(p, raw_size, stored_size, tmp);
+            if (!kv_self.v_trans) {
+                ggml_backend_tensor_set(v, src, ggml_row_size(v->type, (size_t) h.n_embd_v_gqa * rec.cell_begin), raw_size);
+            } else {
+                const size_t row_size   = ggml_row_size(v->type, rec.cell_end - rec.cell_begin);
+                const size_t row_stride = ggml_row_size(v->type, kv_self.size);
+                const size_t row_offs   = ggml_row_size(v->type, rec.cell_begin);
+                for (uint32_t ir = 0; ir < h.n_embd_v_gqa; ++ir) {
+                    ggml_backend_tensor_set(v, src + ir*row_size, ir*row_stride + row_offs, row_size);
+                }
+            }
+        }
     }
+
+    kv_self.head = records.back().cell_end;
+    kv_self.used = records.back().kv_used;
+    llama_kv_cache_index_rebuild(kv_self);
+
+    const auto & last = records.back();
+    const uint8_t * out_end = llama_state_set_outputs_internal(ctx, data + last.offset_out);
+    GGML_ASSERT(out_end == data + last.offset_out + last.size_out);
+
+    *n_token_count_out = n_tokens;
+    return true;
 }
 
 size_t llama_state_seq_get_size(struct llama_context* ctx, llama_seq_id seq_id) {
@@ -16724,40 +21134,43 @@ size_t llama_state_seq_get_data(struct llama_context* ctx, uint8_t* dst, llama_s
     return llama_state_seq_get_data_internal(ctx, data_ctx, seq_id);
 }
 
-size_t llama_state_seq_set_data(struct llama_context * ctx, const uint8_t * src, llama_seq_id dest_seq_id) {
+// reads the sequence state through r, which stops any read that would
+// go past the end of the data
+static bool llama_state_seq_set_data_internal(struct llama_context * ctx, llama_session_reader & r, llama_seq_id dest_seq_id) {
     llama_synchronize(ctx);
 
     auto & kv_self = ctx->kv_self;
     GGML_ASSERT(!kv_self.recurrent); // not implemented
 
+    if (dest_seq_id < 0 || dest_seq_id >= LLAMA_MAX_SEQ) {
+        LLAMA_LOG_ERROR("%s: seq_id must be in [0, %d)\n", __func__, LLAMA_MAX_SEQ);
+        return false;
+    }
+
     // Wipe the slot
     llama_kv_cache_seq_rm(kv_self, dest_seq_id, -1, -1);
 
-    const uint8_t * inp = src;
-
     // Read size of size_t
     uint32_t size_t_size;
-    memcpy(&size_t_size, inp, sizeof(size_t_size));
-    inp += sizeof(size_t_size);
+    if (!r.read(&size_t_size, sizeof(size_t_size))) {
+        LLAMA_LOG_ERROR("%s: sequence state is truncated\n", __func__);
+        return false;
+    }
     if (size_t_size != sizeof(size_t)) {
         LLAMA_LOG_ERROR("%s: size_t size mismatch\n", __func__);
-        return 0;
+        return false;
     }
 
-    // Read the cell count
+    // Read the cell count, the layer count and n_embd_v_gqa
     uint32_t cell_count;
-    memcpy(&cell_count, inp, sizeof(cell_count));
-    inp += sizeof(cell_count);
-
-    // Read the layer count
     uint32_t n_layer_ref;
-    memcpy(&n_layer_ref, inp, sizeof(n_layer_ref));
-    inp += sizeof(n_layer_ref);
-
-    // Read n_embd_v_gqa
     uint32_t n_embd_v_gqa_ref;
-    memcpy(&n_embd_v_gqa_ref, inp, sizeof(n_embd_v_gqa_ref));
-    inp += sizeof(n_embd_v_gqa_ref);
+    if (!r.read(&cell_count, sizeof(cell_count)) ||
+        !r.read(&n_layer_ref, sizeof(n_layer_ref)) ||
+        !r.read(&n_embd_v_gqa_ref, sizeof(n_embd_v_gqa_ref))) {
+        LLAMA_LOG_ERROR("%s: sequence state is truncated\n", __func__);
+        return false;
+    }
 
     // Sanity check model compatibility
     const auto & hparams = ctx->model.hparams;
@@ -16766,11 +21179,15 @@ size_t llama_state_seq_set_data(struct llama_context * ctx, const uint8_t * src,
     const uint32_t n_embd_v_gqa = hparams.n_embd_v_gqa() + hparams.n_embd_v_s();
     if (n_layer != n_layer_ref) {
         LLAMA_LOG_ERROR("%s: mismatched n_layer (%d != %d)\n", __func__, n_layer, n_layer_ref);
-        return 0;
+        return false;
     }
     if (n_embd_v_gqa != n_embd_v_gqa_ref) {
         LLAMA_LOG_ERROR("%s: mismatched n_embd_v_gqa (%d != %d)\n", __func__, n_embd_v_gqa, n_embd_v_gqa_ref);
-        return 0;
+        return false;
+    }
+    if (cell_count > kv_self.size || (size_t) cell_count * sizeof(llama_pos) > r.size - r.pos) {
+        LLAMA_LOG_ERROR("%s: sequence state has more cells (%u) than fit\n", __func__, cell_count);
+        return false;
     }
 
     // Allocate the new cells for the slot
@@ -16779,17 +21196,16 @@ size_t llama_state_seq_set_data(struct llama_context * ctx, const uint8_t * src,
         batch.n_tokens = cell_count;
         for (uint32_t i = 0; i < cell_count; ++i) {
             llama_pos pos;
-            memcpy(&pos, inp, sizeof(pos));
-            inp += sizeof(pos);
+            r.read(&pos, sizeof(pos));
 
             batch.pos[i] = pos;
             batch.n_seq_id[i] = 1;
             batch.seq_id[i][0] = dest_seq_id;
         }
-        if (!llama_kv_cache_find_slot(kv_self, batch)) {
+        if (!llama_kv_cache_find_slot(kv_self, batch, true)) {
             llama_batch_free(batch);
             LLAMA_LOG_ERROR("%s: failed to find available cells in kv cache\n", __func__);
-            return 0;
+            return false;
         }
 
         // DEBUG CHECK: kv_self.head should be our first cell, kv_self.head + cell_count - 1 should be our last cell (verify seq_id and pos values)
@@ -16807,34 +21223,53 @@ size_t llama_state_seq_set_data(struct llama_context * ctx, const uint8_t * src,
     const uint32_t kv_size = kv_self.size;
     const uint32_t kv_head = kv_self.head;
 
+    // copies n bytes of the state into the tensor, if that many are left
+    auto read_tensor = [&](struct ggml_tensor * t, size_t offset, size_t n) {
+        const uint8_t * p = r.data + r.pos;
+        if (!r.skip(n)) {
+            LLAMA_LOG_ERROR("%s: sequence state is truncated\n", __func__);
+            return false;
+        }
+        ggml_backend_tensor_set(t, p, offset, n);
+        return true;
+    };
+
     // For each layer, read the keys for each cell, one row is one cell, read as one contiguous blo
     for (int il = 0; il < (int)n_layer; ++il) {
         // Read type of key
         int32_t k_type_i_ref;
-        memcpy(&k_type_i_ref, inp, sizeof(k_type_i_ref));
-        inp += sizeof(k_type_i_ref);
+        if (!r.read(&k_type_i_ref, sizeof(k_type_i_ref))) {
+            llama_kv_cache_seq_rm(kv_self, dest_seq_id, -1, -1);
+            LLAMA_LOG_ERROR("%s: sequence state is truncated\n", __func__);
+            return false;
+        }
         const int32_t k_type_i = (int32_t)kv_self.k_l[il]->type;
         if (k_type_i != k_type_i_ref) {
             llama_kv_cache_seq_rm(kv_self, dest_seq_id, -1, -1);
             LLAMA_LOG_ERROR("%s: mismatched key type (%d != %d, layer %d)\n", __func__, k_type_i, k_type_i_ref, il);
-            return 0;
+            return false;
         }
 
         // Read row size of key
         size_t k_size_row_ref;
-        memcpy(&k_size_row_ref, inp, sizeof(k_size_row_ref));
-        inp += sizeof(k_size_row_ref);
+        if (!r.read(&k_size_row_ref, sizeof(k_size_row_ref))) {
+            llama_kv_cache_seq_rm(kv_self, dest_seq_id, -1, -1);
+            LLAMA_LOG_ERROR("%s: sequence state is truncated\n", __func__);
+            return false;
+        }
         const size_t k_size_row = ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa);
         if (k_size_row != k_size_row_ref) {
             llama_kv_cache_seq_rm(kv_self, dest_seq_id, -1, -1);
             LLAMA_LOG_ERROR("%s: mismatched key row size (%zu != %zu, layer %d)\n", __func__, k_size_row, k_size_row_ref, il);
-            return 0;
+            return false;
         }
 
         if (cell_count) {
             // Read and set the keys for the whole cell range
-            ggml_backend_tensor_set(kv_self.k_l[il], inp, kv_head * k_size_row, cell_count * k_size_row);
-            inp += cell_count * k_size_row;
+            if (!read_tensor(kv_self.k_l[il], kv_head * k_size_row, cell_count * k_size_row)) {
+                llama_kv_cache_seq_rm(kv_self, dest_seq_id, -1, -1);
+                return false;
+            }
         }
     }
 
@@ -16843,30 +21278,38 @@ size_t llama_state_seq_set_data(struct llama_context * ctx, const uint8_t * src,
         for (int il = 0; il < (int)n_layer; ++il) {
             // Read type of value
             int32_t v_type_i_ref;
-            memcpy(&v_type_i_ref, inp, sizeof(v_type_i_ref));
-            inp += sizeof(v_type_i_ref);
+            if (!r.read(&v_type_i_ref, sizeof(v_type_i_ref))) {
+                llama_kv_cache_seq_rm(kv_self, dest_seq_id, -1, -1);
+                LLAMA_LOG_ERROR("%s: sequence state is truncated\n", __func__);
+                return false;
+            }
             const int32_t v_type_i = (int32_t)kv_self.v_l[il]->type;
             if (v_type_i != v_type_i_ref) {
                 llama_kv_cache_seq_rm(kv_self, dest_seq_id, -1, -1);
                 LLAMA_LOG_ERROR("%s: mismatched value type (%d != %d, layer %d)\n", __func__, v_type_i, v_type_i_ref, il);
-                return 0;
+                return false;
             }
 
             // Read row size of value
             size_t v_size_row_ref;
-            memcpy(&v_size_row_ref, inp, sizeof(v_size_row_ref));
-            inp += sizeof(v_size_row_ref);
+            if (!r.read(&v_size_row_ref, sizeof(v_size_row_ref))) {
+                llama_kv_cache_seq_rm(kv_self, dest_seq_id, -1, -1);
+                LLAMA_LOG_ERROR("%s: sequence state is truncated\n", __func__);
+                return false;
+            }
             const size_t v_size_row = ggml_row_size(kv_self.v_l[il]->type, n_embd_v_gqa);
             if (v_size_row != v_size_row_ref) {
                 llama_kv_cache_seq_rm(kv_self, dest_seq_id, -1, -1);
                 LLAMA_LOG_ERROR("%s: mismatched value row size (%zu != %zu, layer %d)\n", __func__, v_size_row, v_size_row_ref, il);
-                return 0;
+                return false;
             }
 
             if (cell_count) {
                 // Read and set the values for the whole cell range
-                ggml_backend_tensor_set(kv_self.v_l[il], inp, kv_head * v_size_row, cell_count * v_size_row);
-                inp += cell_count * v_size_row;
+                if (!read_tensor(kv_self.v_l[il], kv_head * v_size_row, cell_count * v_size_row)) {
+                    llama_kv_cache_seq_rm(kv_self, dest_seq_id, -1, -1);
+                    return false;
+                }
             }
         }
     } else {
@@ -16874,40 +21317,67 @@ size_t llama_state_seq_set_data(struct llama_context * ctx, const uint8_t * src,
         for (int il = 0; il < (int)n_layer; ++il) {
             // Read type of value
             int32_t v_type_i_ref;
-            memcpy(&v_type_i_ref, inp, sizeof(v_type_i_ref));
-            inp += sizeof(v_type_i_ref);
+            if (!r.read(&v_type_i_ref, sizeof(v_type_i_ref))) {
+                llama_kv_cache_seq_rm(kv_self, dest_seq_id, -1, -1);
+                LLAMA_LOG_ERROR("%s: sequence state is truncated\n", __func__);
+                return false;
+            }
             const int32_t v_type_i = (int32_t)kv_self.v_l[il]->type;
             if (v_type_i != v_type_i_ref) {
                 llama_kv_cache_seq_rm(kv_self, dest_seq_id, -1, -1);
                 LLAMA_LOG_ERROR("%s: mismatched value type (%d != %d, layer %d)\n", __func__, v_type_i, v_type_i_ref, il);
-                return 0;
+                return false;
             }
 
             // Read element size of value
             size_t v_size_el_ref;
-            memcpy(&v_size_el_ref, inp, sizeof(v_size_el_ref));
-            inp += sizeof(v_size_el_ref);
+            if (!r.read(&v_size_el_ref, sizeof(v_size_el_ref))) {
+                llama_kv_cache_seq_rm(kv_self, dest_seq_id, -1, -1);
+                LLAMA_LOG_ERROR("%s: sequence state is truncated\n", __func__);
+                return false;
+            }
             const size_t v_size_el = ggml_type_size(kv_self.v_l[il]->type);
             if (v_size_el != v_size_el_ref) {
                 llama_kv_cache_seq_rm(kv_self, dest_seq_id, -1, -1);
                 LLAMA_LOG_ERROR("%s: mismatched value element size (%zu != %zu, layer %d)\n", __func__, v_size_el, v_size_el_ref, il);
-                return 0;
+                return false;
             }
 
             if (cell_count) {
                 // For each row in the transposed matrix, read the values for the whole cell range
                 for (uint32_t j = 0; j < n_embd_v_gqa; ++j) {
                     const size_t dst_offset = (kv_head + j * kv_size) * v_size_el;
-                    ggml_backend_tensor_set(kv_self.v_l[il], inp, dst_offset, cell_count * v_size_el);
-                    inp += cell_count * v_size_el;
+                    if (!read_tensor(kv_self.v_l[il], dst_offset, cell_count * v_size_el)) {
+                        llama_kv_cache_seq_rm(kv_self, dest_seq_id, -1, -1);
+                        return false;
+                    }
                 }
             }
         }
     }
 
-    const size_t nread = inp - src;
+    return true;
+}
 
-    return nread;
+size_t llama_state_seq_set_data(struct llama_context * ctx, const uint8_t * src, llama_seq_id dest_seq_id) {
+    llama_session_reader r(src, SIZE_MAX);
+    if (!llama_state_seq_set_data_internal(ctx, r, dest_seq_id)) {
+        return 0;
+    }
+    return r.pos;
+}
+
+size_t llama_state_seq_set_data_checked(struct llama_context * ctx, const uint8_t * src, size_t size, llama_seq_id dest_seq_id) {
+    llama_session_reader r(src, size);
+    if (!llama_state_seq_set_data_internal(ctx, r, dest_seq_id)) {
+        return 0;
+    }
+    if (r.pos != size) {
+        llama_kv_cache_seq_rm(ctx->kv_self, dest_seq_id, -1, -1);
+        LLAMA_LOG_ERROR("%s: sequence state has %zu bytes left over\n", __func__, size - r.pos);
+        return 0;
+    }
+    return r.pos;
 }
 
 static size_t llama_state_seq_save_file_internal(struct llama_context * ctx, const char * filepath, llama_seq_id seq_id, const llama_token * tokens, size_t n_token_count) {
@@ -16961,12 +21431,11 @@ static size_t llama_state_seq_load_file_internal(struct llama_context * ctx, con
         const size_t state_size = llamafile_size(file.file) - file.tell();
         std::vector<uint8_t> state_data(state_size);
         file.read_raw(state_data.data(), state_size);
-        const size_t nread = llama_state_seq_set_data(ctx, state_data.data(), dest_seq_id);
+        const size_t nread = llama_state_seq_set_data_checked(ctx, state_data.data(), state_size, dest_seq_id);
         if (!nread) {
             LLAMA_LOG_ERROR("%s: failed to restore sequence state\n", __func__);
             return 0;
         }
-        GGML_ASSERT(nread <= state_size);
         GGML_ASSERT(nread + sizeof(uint32_t) * 3 + sizeof(llama_token) * *n_token_count_out == file.tell());
     }
 
@@ -17005,6 +21474,38 @@ void llama_set_causal_attn(struct llama_context * ctx, bool causal_attn) {
     ctx->cparams.causal_attn = causal_attn;
 }
 
+void llama_set_logits_top_k(struct llama_context * ctx, int32_t k) {
+    k = std::max(k, 0);
+    if (ctx->cparams.logits_top_k != k) {
+        ctx->cparams.logits_top_k = k;
+        // the graph ends differently now
+        ctx->graph_cache = llama_graph_cache();
+    }
+}
+
+void llama_set_output_shortlist(struct llama_context * ctx, const llama_token * tokens, int32_t n_tokens) {
+    const int32_t n_vocab = ctx->model.hparams.n_vocab;
+    ctx->shortlist.clear();
+    for (int32_t i = 0; i < n_tokens; ++i) {
+        if (tokens[i] < 0 || tokens[i] >= n_vocab) {
+            LLAMA_LOG_ERROR("%s: invalid token %d in the shortlist\n", __func__, tokens[i]);
+            ctx->shortlist.clear();
+            return;
+        }
+        ctx->shortlist.push_back(tokens[i]);
+    }
+}
+
+void llama_set_n_layer_exit(struct llama_context * ctx, int32_t n_layer) {
+    if (n_layer <= 0 || n_layer >= (int32_t) ctx->model.hparams.n_layer || ctx->kv_self.recurrent) {
+        n_layer = 0;
+    }
+    if (ctx->cparams.n_layer_exit != n_layer) {
+        ctx->cparams.n_layer_exit = n_layer;
+        ctx->graph_cache = llama_graph_cache();
+    }
+}
+
 struct llama_batch llama_batch_get_one(
              llama_token * tokens,
                  int32_t   n_tokens,
@@ -17060,18 +21561,81 @@ void llama_batch_free(struct llama_batch batch) {
     if (batch.logits)   free(batch.logits);
 }
 
-int32_t llama_decode(
+static int32_t llama_decode_impl(
         struct llama_context * ctx,
           struct llama_batch   batch) {
+    const long long trace_start = llamafile_tracing || llamafile_flight_enabled ? llamafile_trace_now() : 0;
+    llamafile_perf_phase = batch.n_tokens > 1 ? LLAMAFILE_PERF_PROMPT : LLAMAFILE_PERF_EVAL;
     const int ret = llama_decode_internal(*ctx, batch);
     if (ret < 0) {
         LLAMA_LOG_ERROR("%s: failed to decode, ret = %d\n", __func__, ret);
     }
+    if (llamafile_flight_enabled) {
+        llamafile_flight_record(LLAMAFILE_FLIGHT_DECODE, NULL, batch.n_tokens, ctx->kv_self.n, trace_start, llamafile_trace_now());
+    }
+    if (llamafile_tracing) {
+        char label[64];
+        snprintf(label, sizeof(label), "%d tokens", batch.n_tokens);
+        llamafile_trace_event("llama", "decode", label, 0, trace_start, llamafile_trace_now());
+    }
 
     return ret;
 }
 
+int32_t llama_decode(
+        struct llama_context * ctx,
+          struct llama_batch   batch) {
+    llama_decode_wait(ctx);
+    return llama_decode_impl(ctx, batch);
+}
+
+static void llama_decode_worker(struct llama_context * ctx) {
+    std::unique_lock<std::mutex> lock(ctx->decode_mutex);
+    for (;;) {
+        ctx->decode_cv.wait(lock, [ctx] { return ctx->decode_quit || (ctx->decode_pending && !ctx->decode_done); });
+        if (ctx->decode_quit) {
+            break;
+        }
+        const llama_batch batch = ctx->decode_batch;
+        lock.unlock();
+        const int32_t ret = llama_decode_impl(ctx, batch);
+        lock.lock();
+        ctx->decode_ret = ret;
+        ctx->decode_done = true;
+        ctx->decode_cv.notify_all();
+    }
+}
+
+int32_t llama_decode_async(
+        struct llama_context * ctx,
+          struct llama_batch   batch) {
+    llama_decode_wait(ctx);
+    if (!ctx->decode_thread.joinable()) {
+        ctx->decode_thread = std::thread(llama_decode_worker, ctx);
+    }
+    {
+        std::lock_guard<std::mutex> lock(ctx->decode_mutex);
+        ctx->decode_batch = batch;
+        ctx->decode_done = false;
+        ctx->decode_pending = true;
+    }
+    ctx->decode_cv.notify_all();
+    return 0;
+}
+
+int32_t llama_decode_wait(struct llama_context * ctx) {
+    if (!ctx->decode_pending) {
+        return 0;
+    }
+    std::unique_lock<std::mutex> lock(ctx->decode_mutex);
+    ctx->decode_cv.wait(lock, [ctx] { return ctx->decode_done; });
+    ctx->decode_pending = false;
+    ctx->decode_done = false;
+    return ctx->decode_ret;
+}
+
 void llama_synchronize(struct llama_context * ctx) {
+    llama_decode_wait(ctx);
     ggml_backend_sched_synchronize(ctx->sched);
 
     // FIXME: if multiple single tokens are evaluated without a synchronization,
@@ -17079,11 +21643,15 @@ void llama_synchronize(struct llama_context * ctx) {
     // this should only happen when using batch size 1 to evaluate a batch
 
     // add the evaluation to the stats
+    const double joules = ctx->n_queued_tokens && ctx->j_compute_start >= 0 ?
+        llamafile_energy() - ctx->j_compute_start : 0;
     if (ctx->n_queued_tokens == 1) {
         ctx->t_eval_us += ggml_time_us() - ctx->t_compute_start_us;
+        ctx->j_eval += joules;
         ctx->n_eval++;
     } else if (ctx->n_queued_tokens > 1) {
         ctx->t_p_eval_us += ggml_time_us() - ctx->t_compute_start_us;
+        ctx->j_p_eval += joules;
         ctx->n_p_eval += ctx->n_queued_tokens;
     }
 
@@ -17093,8 +21661,11 @@ void llama_synchronize(struct llama_context * ctx) {
         ctx->has_evaluated_once = true;
     }
 
-    ctx->n_queued_tokens = 0;
-    ctx->t_compute_start_us = 0;
+    // once there's nothing queued, this is safe to call from several threads
+    if (ctx->n_queued_tokens || ctx->t_compute_start_us) {
+        ctx->n_queued_tokens = 0;
+        ctx->t_compute_start_us = 0;
+    }
 }
 
 float * llama_get_logits(struct llama_context * ctx) {
@@ -17141,6 +21712,34 @@ float * llama_get_logits_ith(struct llama_context * ctx, int32_t i) {
     }
 }
 
+int32_t llama_get_top_k_ith(struct llama_context * ctx, int32_t i, const llama_token ** ids, const float ** logits) {
+    llama_synchronize(ctx);
+
+    const int32_t k = ctx->n_top_k;
+    if (!k) {
+        return 0;
+    }
+
+    int32_t j = -1;
+    if (i < 0) {
+        j = ctx->n_outputs + i;
+    } else if ((size_t) i < ctx->output_ids.size()) {
+        j = ctx->output_ids[i];
+    }
+    if (j < 0 || j >= ctx->n_outputs) {
+        LLAMA_LOG_ERROR("%s: invalid logits id %d\n", __func__, i);
+        return 0;
+    }
+
+    if (ids) {
+        *ids = ctx->top_k_ids.data() + j*k;
+    }
+    if (logits) {
+        *logits = ctx->top_k_logits.data() + j*k;
+    }
+    return k;
+}
+
 float * llama_get_embeddings(struct llama_context * ctx) {
     llama_synchronize(ctx);
 
@@ -17296,15 +21895,15 @@ static std::string llama_decode_text(const std::string & text) {
 }
 
 // does not write null-terminator to buf
-int32_t llama_token_to_piece(const struct llama_model * model, llama_token token, char * buf, int32_t length, bool special) {
-    if (0 <= token && token < llama_n_vocab(model)) {
-        switch (llama_vocab_get_type(model->vocab)) {
+static int32_t llama_token_to_piece_impl(const llama_vocab & vocab, llama_token token, char * buf, int32_t length, bool special) {
+    if (0 <= token && token < (llama_token) vocab.id_to_token.size()) {
+        switch (llama_vocab_get_type(vocab)) {
         case LLAMA_VOCAB_TYPE_WPM:
         case LLAMA_VOCAB_TYPE_SPM: {
             // NOTE: we accept all unsupported token types,
             // suppressing them like CONTROL tokens.
-            if (llama_is_normal_token(model->vocab, token)) {
-                std::string result = model->vocab.id_to_token[token].text;
+            if (llama_is_normal_token(vocab, token)) {
+                std::string result = vocab.id_to_token[token].text;
                 llama_unescape_whitespace(result);
                 if (length < (int) result.length()) {
                     return -(int) result.length();
@@ -17312,25 +21911,25 @@ int32_t llama_token_to_piece(const struct llama_model * model, llama_token token
                 memcpy(buf, result.c_str(), result.length());
                 return result.length();
             } else if (
-                    (llama_is_user_defined_token(model->vocab, token)) ||
-                    (llama_is_control_token     (model->vocab, token) && special)) {
-                std::string result = model->vocab.id_to_token[token].text;
+                    (llama_is_user_defined_token(vocab, token)) ||
+                    (llama_is_control_token     (vocab, token) && special)) {
+                std::string result = vocab.id_to_token[token].text;
                 if (length < (int) result.length()) {
                     return -(int) result.length();
                 }
                 memcpy(buf, result.c_str(), result.length());
                 return result.length();
-            } else if (llama_is_unknown_token(model->vocab, token)) { // NOLINT
+            } else if (llama_is_unknown_token(vocab, token)) { // NOLINT
                 if (length < 3) {
                     return -3;
                 }
                 memcpy(buf, "\xe2\x96\x85", 3);
                 return 3;
-            } else if (llama_is_byte_token(model->vocab, token)) {
+            } else if (llama_is_byte_token(vocab, token)) {
                 if (length < 1) {
                     return -1;
                 }
-                buf[0] = llama_token_to_byte(model->vocab, token);
+                buf[0] = llama_token_to_byte(vocab, token);
                 return 1;
             }
             break;
@@ -17338,8 +21937,8 @@ int32_t llama_token_to_piece(const struct llama_model * model, llama_token token
         case LLAMA_VOCAB_TYPE_BPE: {
             // NOTE: we accept all unsupported token types,
             // suppressing them like CONTROL tokens.
-            if (llama_is_normal_token(model->vocab, token)) {
-                std::string result = model->vocab.id_to_token[token].text;
+            if (llama_is_normal_token(vocab, token)) {
+                std::string result = vocab.id_to_token[token].text;
                 result = llama_decode_text(result);
                 if (length < (int) result.length()) {
                     return -(int) result.length();
@@ -17347,9 +21946,9 @@ int32_t llama_token_to_piece(const struct llama_model * model, llama_token token
                 memcpy(buf, result.c_str(), result.length());
                 return result.length();
             } else if (
-                    (llama_is_user_defined_token(model->vocab, token)) ||
-                    (llama_is_control_token     (model->vocab, token) && special)) {
-                std::string result = model->vocab.id_to_token[token].text;
+                    (llama_is_user_defined_token(vocab, token)) ||
+                    (llama_is_control_token     (vocab, token) && special)) {
+                std::string result = vocab.id_to_token[token].text;
                 if (length < (int) result.length()) {
                     return -(int) result.length();
                 }
@@ -17365,6 +21964,123 @@ int32_t llama_token_to_piece(const struct llama_model * model, llama_token token
     return 0;
 }
 
+// where the utf-8 characters of a piece start and end
+static llama_piece_utf8 llama_piece_utf8_of(const char * s, uint32_t n) {
+    llama_piece_utf8 u = {0, 0, 0};
+    while (u.head < n && u.head < 4 && (s[u.head] & 0xC0) == 0x80) {
+        u.head++;
+    }
+    for (uint32_t i = 1; i < 5 && i <= n; ++i) {
+        const unsigned char c = s[n - i];
+        if ((c & 0xC0) == 0x80) {
+            continue;
+        }
+        const uint8_t len = (c & 0xE0) == 0xC0 ? 2 : (c & 0xF0) == 0xE0 ? 3 : (c & 0xF8) == 0xF0 ? 4 : 1;
+        if (i < len) {
+            u.tail = i;
+            u.need = len;
+        }
+        break;
+    }
+    return u;
+}
+
+static void llama_vocab_build_pieces(llama_vocab & vocab) {
+    const llama_token n_vocab = vocab.id_to_token.size();
+    std::vector<char> buf(64);
+
+    for (int special = 0; special < 2; special++) {
+        vocab.pieces[special].resize(n_vocab);
+    }
+    vocab.piece_data.clear();
+    for (llama_token id = 0; id < n_vocab; id++) {
+        for (int special = 0; special < 2; special++) {
+            int32_t n = llama_token_to_piece_impl(vocab, id, buf.data(), buf.size(), special);
+            if (n < 0) {
+                buf.resize(-n);
+                n = llama_token_to_piece_impl(vocab, id, buf.data(), buf.size(), special);
+            }
+            const llama_vocab::piece & plain = vocab.pieces[0][id];
+            if (special && (uint32_t) n == plain.length &&
+                    !memcmp(buf.data(), vocab.piece_data.data() + plain.offset, n)) {
+                // most tokens render the same either way
+                vocab.pieces[1][id] = plain;
+                continue;
+            }
+            vocab.pieces[special][id] = { (uint32_t) vocab.piece_data.size(), (uint32_t) n, llama_piece_utf8_of(buf.data(), n) };
+            vocab.piece_data.insert(vocab.piece_data.end(), buf.data(), buf.data() + n);
+        }
+    }
+
+    vocab.cp_text.assign(n_vocab, false);
+    vocab.cp_offsets.assign(n_vocab, 0);
+    vocab.cp_partials.assign(n_vocab, {});
+    vocab.cp_data.assign(1, 0); // everything else points at an empty string
+    vocab.cp_order.clear();
+    for (llama_token id = 0; id < n_vocab; id++) {
+        const llama_vocab::piece & p = vocab.pieces[0][id];
+        const char * text = vocab.piece_data.data() + p.offset;
+        if (id == vocab.special_eos_id || id == vocab.special_eot_id || !p.length || !text[0]) {
+            continue;
+        }
+        const auto decoded = decode_utf8(std::string(text, p.length), {});
+        vocab.cp_text[id]     = true;
+        vocab.cp_offsets[id]  = vocab.cp_data.size();
+        vocab.cp_partials[id] = decoded.second;
+        vocab.cp_data.insert(vocab.cp_data.end(), decoded.first.begin(), decoded.first.end());
+        vocab.cp_order.push_back(id);
+    }
+
+    const uint32_t * cps = vocab.cp_data.data();
+    const auto & offsets = vocab.cp_offsets;
+    std::sort(vocab.cp_order.begin(), vocab.cp_order.end(), [&](llama_token a, llama_token b) {
+        const uint32_t * x = cps + offsets[a];
+        const uint32_t * y = cps + offsets[b];
+        for (; *x && *x == *y; x++, y++) {}
+        return *x < *y;
+    });
+    vocab.cp_shared.assign(vocab.cp_order.size(), 0);
+    for (size_t i = 1; i < vocab.cp_order.size(); i++) {
+        const uint32_t * x = cps + offsets[vocab.cp_order[i - 1]];
+        const uint32_t * y = cps + offsets[vocab.cp_order[i]];
+        uint32_t n = 0;
+        for (; x[n] && x[n] == y[n]; n++) {}
+        vocab.cp_shared[i] = n;
+    }
+}
+
+int32_t llama_token_to_piece(const struct llama_model * model, llama_token token, char * buf, int32_t length, bool special) {
+    const llama_vocab & vocab = model->vocab;
+    if (0 <= token && (size_t) token < vocab.pieces[special].size()) {
+        const llama_vocab::piece & p = vocab.pieces[special][token];
+        if (length < (int32_t) p.length) {
+            return -(int32_t) p.length;
+        }
+        memcpy(buf, vocab.piece_data.data() + p.offset, p.length);
+        return p.length;
+    }
+    return llama_token_to_piece_impl(vocab, token, buf, length, special);
+}
+
+const char * llama_token_get_piece(const struct llama_model * model, llama_token token, bool special, int32_t * length) {
+    const llama_vocab & vocab = model->vocab;
+    if (0 <= token && (size_t) token < vocab.pieces[special].size()) {
+        const llama_vocab::piece & p = vocab.pieces[special][token];
+        *length = p.length;
+        return vocab.piece_data.data() + p.offset;
+    }
+    *length = 0;
+    return "";
+}
+
+struct llama_piece_utf8 llama_token_get_piece_utf8(const struct llama_model * model, llama_token token, bool special) {
+    const llama_vocab & vocab = model->vocab;
+    if (0 <= token && (size_t) token < vocab.pieces[special].size()) {
+        return vocab.pieces[special][token].utf8;
+    }
+    return {0, 0, 0};
+}
+
 // trim whitespace from the beginning and end of a string
 static std::string trim(const std::string & str) {
     size_t start = 0;
@@ -17652,9 +22368,12 @@ struct llama_timings llama_get_timings(struct llama_context * ctx) {
         /*.t_p_eval_ms =*/ 1e-3 * ctx->t_p_eval_us,
         /*.t_eval_ms   =*/ 1e-3 * ctx->t_eval_us,
 
-        /*.n_sample =*/ std::max(1, ctx->n_sample),
+        /*.n_sample =*/ std::max(1, ctx->n_sample.load()),
         /*.n_p_eval =*/ std::max(1, ctx->n_p_eval),
         /*.n_eval   =*/ std::max(1, ctx->n_eval),
+
+        /*.j_p_eval =*/ ctx->j_compute_start >= 0 ? ctx->j_p_eval : -1,
+        /*.j_eval   =*/ ctx->j_compute_start >= 0 ? ctx->j_eval   : -1,
     };
 
     return result;
@@ -17673,6 +22392,33 @@ void llama_print_timings(struct llama_context * ctx) {
     LLAMA_LOG_INFO("%s:        eval time = %10.2f ms / %5d runs   (%8.2f ms per token, %8.2f tokens per second)\n",
             __func__, timings.t_eval_ms, timings.n_eval, timings.t_eval_ms / timings.n_eval, 1e3 / timings.t_eval_ms * timings.n_eval);
     LLAMA_LOG_INFO("%s:       total time = %10.2f ms / %5d tokens\n", __func__, (timings.t_end_ms - timings.t_start_ms), (timings.n_p_eval + timings.n_eval));
+    if (timings.j_p_eval >= 0) {
+        LLAMA_LOG_INFO("%s:  prompt eval energy = %10.2f J  / %5d tokens (%8.4f J per token, %8.2f tokens per joule) [%s]\n",
+                __func__, timings.j_p_eval, timings.n_p_eval, timings.j_p_eval / timings.n_p_eval, timings.n_p_eval / timings.j_p_eval, llamafile_energy_sources());
+        LLAMA_LOG_INFO("%s:         eval energy = %10.2f J  / %5d runs   (%8.4f J per token, %8.2f tokens per joule)\n",
+                __func__, timings.j_eval, timings.n_eval, timings.j_eval / timings.n_eval, timings.n_eval / timings.j_eval);
+    }
+
+    if (llamafile_perf_enabled) {
+        // totals over all threads, where llc is the last level cache
+        LLAMA_LOG_INFO("%s: %-16s %8s %10s %6s %8s %9s %8s\n", __func__, "cpu counters", "calls", "thread ms",
+                "ipc", "llc mpki", "dtlb mpki", "llc gb");
+        for (int phase = 0; phase < LLAMAFILE_PERF_PHASES; ++phase) {
+            for (int op = 0; op < LLAMAFILE_PERF_OPS; ++op) {
+                struct llamafile_perf_stats st;
+                llamafile_perf_get(phase, op, &st);
+                if (!st.calls) {
+                    continue;
+                }
+                char name[32];
+                snprintf(name, sizeof(name), "%s %s", llamafile_perf_phase_name(phase), llamafile_perf_op_name(op));
+                const double kinst = st.instructions ? st.instructions / 1e3 : 1;
+                LLAMA_LOG_INFO("%s: %-16s %8llu %10.2f %6.2f %8.2f %9.2f %8.2f\n", __func__, name, st.calls,
+                        st.time_ns / 1e6, st.cycles ? (double) st.instructions / st.cycles : 0.,
+                        st.llc_misses / kinst, st.dtlb_misses / kinst, st.llc_misses * 64 / 1e9);
+            }
+        }
+    }
 
     llamafile_trapping_enabled(+1);  // [jart]
 }
@@ -17682,6 +22428,7 @@ void llama_reset_timings(struct llama_context * ctx) {
     ctx->t_sample_us = ctx->n_sample = 0;
     ctx->t_eval_us   = ctx->n_eval   = 0;
     ctx->t_p_eval_us = ctx->n_p_eval = 0;
+    ctx->j_eval = ctx->j_p_eval = 0;
 }
 
 const char * llama_print_system_info(void) {
@@ -17729,11 +22476,11 @@ void llama_dump_timing_info_yaml(FILE * stream, const llama_context * ctx) {
             1.0e-3 * ctx->t_sample_us / ctx->n_sample);
     fprintf(stream, "n_eval: %d  # number of tokens generated (excluding the first one)\n", ctx->n_eval);
     fprintf(stream, "n_p_eval: %d  # number of tokens processed in batches at the beginning\n", ctx->n_p_eval);
-    fprintf(stream, "n_sample: %d  # number of sampled tokens\n", ctx->n_sample);
+    fprintf(stream, "n_sample: %d  # number of sampled tokens\n", ctx->n_sample.load());
     fprintf(stream, "t_eval_us: %" PRId64 "  # total microseconds spent generating tokens\n", ctx->t_eval_us);
     fprintf(stream, "t_load_us: %" PRId64 "  # total microseconds spent loading the model\n", ctx->t_load_us);
     fprintf(stream, "t_p_eval_us: %" PRId64 "  # total microseconds spent prompt processing\n", ctx->t_p_eval_us);
-    fprintf(stream, "t_sample_us: %" PRId64 "  # total microseconds spent sampling\n", ctx->t_sample_us);
+    fprintf(stream, "t_sample_us: %" PRId64 "  # total microseconds spent sampling\n", ctx->t_sample_us.load());
     fprintf(stream, "ts_eval: %.2f  # tokens / second during generation\n",
             1.0e6 * ctx->n_eval / ctx->t_eval_us);
     fprintf(stream, "ts_p_eval: %.2f  # tokens / second during prompt processing\n",
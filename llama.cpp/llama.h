@@ -40,6 +40,7 @@
 #define LLAMA_FILE_MAGIC_GGLA 0x67676c61u // 'ggla'
 #define LLAMA_FILE_MAGIC_GGSN 0x6767736eu // 'ggsn'
 #define LLAMA_FILE_MAGIC_GGSQ 0x67677371u // 'ggsq'
+#define LLAMA_FILE_MAGIC_GGSA 0x67677361u // 'ggsa'
 
 #define LLAMA_SESSION_MAGIC   LLAMA_FILE_MAGIC_GGSN
 #define LLAMA_SESSION_VERSION 6
@@ -59,6 +60,7 @@ extern "C" {
 
     struct llama_model;
     struct llama_context;
+    struct llama_lora_adapter;
 
     typedef int32_t llama_pos;
     typedef int32_t llama_token;
@@ -140,6 +142,7 @@ extern "C" {
         LLAMA_FTYPE_MOSTLY_IQ4_XS        = 30, // except 1d tensors
         LLAMA_FTYPE_MOSTLY_IQ1_M         = 31, // except 1d tensors
         LLAMA_FTYPE_MOSTLY_BF16          = 32, // except 1d tensors
+        LLAMA_FTYPE_MOSTLY_F8_E4M3       = 33, // except 1d tensors
 
         LLAMA_FTYPE_GUESSED = 1024, // not specified in the model file
     };
@@ -253,11 +256,27 @@ extern "C" {
         // override key-value pairs of the model meta data
         const struct llama_model_kv_override * kv_overrides;
 
+        // context size that `n_gpu_layers = -2` (auto) leaves room for, 0 = from model
+        uint32_t n_ctx_fit;
+        uint32_t n_ubatch_fit;
+
+        // experts of each offloaded MoE layer copied to VRAM, the ones picked
+        // most often according to expert_stats, while the layer's expert
+        // tensors stay in host memory for the others, 0 = offload them all
+        int32_t n_gpu_experts;
+
+        // file counting how often each layer picked each expert, which is
+        // read when loading the model and written when it's freed, NULL = none
+        const char * expert_stats;
+
         // Keep the booleans together to avoid misalignment during copy-by-value.
         bool vocab_only;    // only load the vocabulary, no weights
         bool use_mmap;      // use mmap if possible
         bool use_mlock;     // force system to keep model in RAM
         bool check_tensors; // validate model tensor data
+        bool repack;        // interleave cpu weights for the matmul kernels
+        bool tune;          // benchmark cpu matmul kernels on the model's shapes
+        bool lazy_load;     // don't wait for the weights to be read before returning
     };
 
     struct llama_context_params {
@@ -282,6 +301,9 @@ extern "C" {
         float    yarn_beta_slow;   // YaRN high correction dim
         uint32_t yarn_orig_ctx;    // YaRN original context size
         float    defrag_thold;     // defragment the KV cache if holes/size > thold, < 0 disabled (default)
+        float    defrag_max_ms;    // spend at most this long defragmenting per update, the rest waits for later, 0 = unbounded
+        uint32_t n_seq_checkpoint; // recurrent models: save the state of a sequence every this many tokens, 0 = never
+        uint32_t n_cpu_decode;     // compute ubatches of at most this many tokens on the cpu, over gpu weights in shared memory, 0 = never
 
         ggml_backend_sched_eval_callback cb_eval;
         void * cb_eval_user_data;
@@ -294,6 +316,7 @@ extern "C" {
         bool embeddings;  // if true, extract embeddings (together with logits)
         bool offload_kqv; // whether to offload the KQV ops (including the KV cache) to GPU
         bool flash_attn;  // whether to use flash attention
+        bool swa_evict;   // free kv cells once they slide out of the attention window (sequences can't be rewound)
 
         // Abort callback
         // if it returns true, execution of llama_decode() will be aborted
@@ -315,6 +338,8 @@ extern "C" {
         bool keep_split;                     // quantize to the same number of shards
         void * imatrix;                      // pointer to importance matrix data
         void * kv_overrides;                 // pointer to vector containing overrides
+        size_t window_size;                  // bytes of tensors to hold in memory at once, 0 = 4 GiB
+        float target_bpw;                    // average bits per weight of the quantized tensors, with types picked by measured error, 0 = off
     } llama_model_quantize_params;
 
     // grammar types
@@ -363,6 +388,11 @@ extern "C" {
         int32_t n_sample;
         int32_t n_p_eval;
         int32_t n_eval;
+
+        // joules the host consumed during the evals, or -1 if there's
+        // no energy counter we can read
+        double j_p_eval;
+        double j_eval;
     };
 
     // used in chat template
@@ -404,6 +434,10 @@ extern "C" {
 
     LLAMA_API size_t llama_max_devices(void);
 
+    // Sequence ids must be in [0, llama_max_parallel_sequences()), which
+    // also bounds n_seq_max. The KV cache functions ignore other ids.
+    LLAMA_API size_t llama_max_parallel_sequences(void);
+
     LLAMA_API bool llama_supports_mmap       (void);
     LLAMA_API bool llama_supports_mlock      (void);
     LLAMA_API bool llama_supports_gpu_offload(void);
@@ -476,6 +510,32 @@ extern "C" {
                           const char * path_base_model,
                              int32_t   n_threads);
 
+    // Load a LoRA adapter that is computed alongside the weights of the
+    // model, rather than merged into them, so adapters can be swapped at
+    // runtime and several of them used at once by different sequences.
+    // The adapter must be freed before the model, and after the contexts
+    // using it stopped doing so. Returns NULL on failure.
+    LLAMA_API struct llama_lora_adapter * llama_lora_adapter_init(
+            struct llama_model * model,
+                    const char * path_lora);
+
+    LLAMA_API void llama_lora_adapter_free(struct llama_lora_adapter * adapter);
+
+    // Apply a loaded adapter to the tokens of a sequence, or of every
+    // sequence if seq_id is negative. A scale of 0 removes it. The KV
+    // cache isn't changed, so the cells a sequence evaluated under other
+    // adapters should be removed by the caller. Returns 0 on success.
+    LLAMA_API int32_t llama_lora_adapter_set(
+            struct llama_context * ctx,
+      struct llama_lora_adapter * adapter,
+                    llama_seq_id   seq_id,
+                           float   scale);
+
+    // Remove the adapters of a sequence, or all of them if seq_id is negative
+    LLAMA_API void llama_lora_adapter_clear(
+            struct llama_context * ctx,
+                    llama_seq_id   seq_id);
+
     // Apply a loaded control vector to a llama_context, or if data is NULL, clear
     // the currently loaded vector.
     // n_embd should be the size of a single layer's control, and data should point
@@ -490,6 +550,35 @@ extern "C" {
                          int32_t   il_start,
                          int32_t   il_end);
 
+    // Apply a control vector to the tokens of one sequence, on top of the one
+    // llama_control_vector_apply() gives every sequence, which is what a
+    // negative seq_id does. If data is NULL, the sequence's is removed. The
+    // vectors of sequences are rows of tables allocated on first use, with
+    // room for n_seq_max of them, so changing one doesn't reallocate. The KV
+    // cache isn't changed, so the caller should remove the cells a sequence
+    // evaluated with another vector. Returns 0 on success.
+    LLAMA_API int32_t llama_control_vector_apply_seq(
+            struct llama_context * lctx,
+                    llama_seq_id   seq_id,
+                     const float * data,
+                          size_t   len,
+                         int32_t   n_embd,
+                         int32_t   il_start,
+                         int32_t   il_end);
+
+    // Add a bias to the logits of a sequence, or of every sequence if seq_id
+    // is negative, which is applied on the backend before the logits are
+    // copied out, or their most likely tokens picked by
+    // llama_set_logits_top_k(). It replaces the sequence's earlier bias, and
+    // n of 0 removes it. Up to n_seq_max sequences can have their own.
+    // Returns 0 on success.
+    LLAMA_API int32_t llama_set_logit_bias(
+            struct llama_context * ctx,
+                    llama_seq_id   seq_id,
+               const llama_token * tokens,
+                     const float * bias,
+                         int32_t   n);
+
     //
     // KV cache
     //
@@ -555,6 +644,7 @@ extern "C" {
 
     // Removes all tokens that belong to the specified sequence and have positions in [p0, p1)
     // Returns false if a partial sequence cannot be removed. Removing a whole sequence never fails
+    // Recurrent models can only remove [p0, inf), and only if a checkpoint ends at p0 - 1
     // seq_id < 0 : match any sequence
     // p0 < 0     : [0,  p1]
     // p1 < 0     : [p0, inf)
@@ -564,6 +654,20 @@ extern "C" {
                        llama_pos   p0,
                        llama_pos   p1);
 
+    // Removes the tokens of the specified sequence with positions >= p0, and returns the
+    // largest position left (-1 if none). Recurrent models go back to their newest checkpoint
+    // before p0 instead, so the tokens after the position returned have to be decoded again
+    LLAMA_API llama_pos llama_kv_cache_seq_rewind(
+            struct llama_context * ctx,
+                    llama_seq_id   seq_id,
+                       llama_pos   p0);
+
+    // Saves the current state of the specified sequence for llama_kv_cache_seq_rewind()
+    // Besides the ones llama_context_params.n_seq_checkpoint takes. No-op unless recurrent
+    LLAMA_API void llama_kv_cache_seq_checkpoint(
+            struct llama_context * ctx,
+                    llama_seq_id   seq_id);
+
     // Copy all tokens that belong to the specified sequence to another sequence
     // Note that this does not allocate extra KV cache memory - it simply assigns the tokens to the new sequence
     // p0 < 0 : [0,  p1]
@@ -678,6 +782,17 @@ extern "C" {
                           size_t   n_token_count),
         "use llama_state_save_file instead");
 
+    // Save the state to a session file that can be extended later. When the
+    // file already holds a prefix of tokens whose kv cells are unchanged, only
+    // the new tokens and cells are appended. If compress is true, the kv data
+    // is deflated. llama_state_load_file() reads these files as well.
+    LLAMA_API bool llama_state_append_file(
+            struct llama_context * ctx,
+                      const char * path_session,
+               const llama_token * tokens,
+                          size_t   n_token_count,
+                            bool   compress);
+
     // Get the exact size needed to copy the KV cache of a single sequence
     LLAMA_API size_t llama_state_seq_get_size(
             struct llama_context * ctx,
@@ -698,6 +813,15 @@ extern "C" {
                    const uint8_t * src,
                     llama_seq_id   dest_seq_id);
 
+    // Same as llama_state_seq_set_data(), but never reads past src + size,
+    // and fails unless the state takes up exactly size bytes. Use this for
+    // data that didn't come straight from llama_state_seq_get_data().
+    LLAMA_API size_t llama_state_seq_set_data_checked(
+            struct llama_context * ctx,
+                   const uint8_t * src,
+                          size_t   size,
+                    llama_seq_id   dest_seq_id);
+
     LLAMA_API size_t llama_state_seq_save_file(
             struct llama_context * ctx,
                       const char * filepath,
@@ -750,6 +874,20 @@ extern "C" {
             struct llama_context * ctx,
               struct llama_batch   batch);
 
+    // Starts decoding a batch on a thread of the context and returns right
+    // away, so the caller can prepare its next batch, sample or write out
+    // results in the meantime. One batch may be in flight at a time, and
+    // its arrays must not be changed until llama_decode_wait() returns.
+    // Other calls on ctx that read results or change the KV cache wait for
+    // the decode to finish first. Returns 0 if the batch was started.
+    LLAMA_API int32_t llama_decode_async(
+            struct llama_context * ctx,
+              struct llama_batch   batch);
+
+    // Waits for the batch started by llama_decode_async() and returns what
+    // llama_decode() would have, or 0 if there's none
+    LLAMA_API int32_t llama_decode_wait(struct llama_context * ctx);
+
     // Set the number of threads used for decoding
     // n_threads is the number of threads used for generation (single token)
     // n_threads_batch is the number of threads used for prompt and batch processing (multiple tokens)
@@ -759,6 +897,30 @@ extern "C" {
     // If set to true, the model will only attend to the past tokens
     LLAMA_API void llama_set_causal_attn(struct llama_context * ctx, bool causal_attn);
 
+    // Only bring the k most likely tokens of each output back from the backend,
+    // selected at the end of the graph, instead of all n_vocab logits.
+    // While k > 0, llama_decode() doesn't update the logits buffer; use
+    // llama_get_top_k_ith() to read the outputs. 0 to disable (default).
+    LLAMA_API void llama_set_logits_top_k(struct llama_context * ctx, int32_t k);
+
+    // Only compute the logits of these tokens, by multiplying with their rows
+    // of the output matrix alone, which saves most of the work of a decode
+    // step for models with a big vocab when the caller knows which tokens can
+    // come next, e.g. from a grammar. The logits of the other tokens are
+    // -INFINITY. It's ignored by batches with a logit bias from
+    // llama_set_logit_bias(), and by embeddings, which need the whole vocab,
+    // and llama_get_top_k_ith() has nothing while it's in effect. Invalid
+    // tokens clear it. 0 tokens to compute every logit (default).
+    LLAMA_API void llama_set_output_shortlist(struct llama_context * ctx, const llama_token * tokens, int32_t n_tokens);
+
+    // Have llama_decode() evaluate only the first n_layer layers, followed by
+    // the output norm and head, which drafts tokens for the full model to
+    // verify without a second model. The cells it decodes into only hold the
+    // first n_layer layers, so remove them with llama_kv_cache_seq_rm() before
+    // decoding those positions with every layer again. 0 to use every layer
+    // (default), which is also what models with a recurrent state always do.
+    LLAMA_API void llama_set_n_layer_exit(struct llama_context * ctx, int32_t n_layer);
+
     // Set abort callback
     LLAMA_API void llama_set_abort_callback(struct llama_context * ctx, ggml_abort_callback abort_callback, void * abort_callback_data);
 
@@ -780,6 +942,12 @@ extern "C" {
     // returns NULL for invalid ids.
     LLAMA_API float * llama_get_logits_ith(struct llama_context * ctx, int32_t i);
 
+    // Get the ids and logits of the most likely tokens for the ith output,
+    // sorted by decreasing logit, when llama_set_logits_top_k() is in effect.
+    // Returns how many tokens there are, or 0 if the last decode copied the
+    // full logits instead. ids and logits may be NULL.
+    LLAMA_API int32_t llama_get_top_k_ith(struct llama_context * ctx, int32_t i, const llama_token ** ids, const float ** logits);
+
     // Get all output token embeddings.
     // when pooling_type == LLAMA_POOLING_TYPE_NONE or when using a generative model,
     // the embeddings for which llama_batch.logits[i] != 0 are stored contiguously
@@ -863,6 +1031,29 @@ extern "C" {
                                int32_t   length,
                                   bool   special);
 
+    // Same as llama_token_to_piece(), but returns the piece the model rendered when it was loaded.
+    // The memory is owned by the model and isn't null terminated.
+    // @param length Receives the number of bytes in the piece.
+    LLAMA_API const char * llama_token_get_piece(
+              const struct llama_model * model,
+                           llama_token   token,
+                                  bool   special,
+                               int32_t * length);
+
+    // Where the UTF-8 characters of a piece from llama_token_get_piece() start and end,
+    // which was worked out when the model was loaded. This lets text be streamed a token
+    // at a time without scanning it for unfinished characters.
+    struct llama_piece_utf8 {
+        uint8_t head; // continuation bytes it starts with, that finish a character of earlier pieces
+        uint8_t tail; // bytes it ends with, of a character that later pieces finish
+        uint8_t need; // bytes that character has in all, or 0 if tail is 0
+    };
+
+    LLAMA_API struct llama_piece_utf8 llama_token_get_piece_utf8(
+              const struct llama_model * model,
+                           llama_token   token,
+                                  bool   special);
+
     /// Apply chat template. Inspired by hf apply_chat_template() on python.
     /// Both "model" and "custom_template" are optional, but at least one is required. "custom_template" has higher precedence than "model"
     /// NOTE: This function does not use a jinja parser. It only support a pre-defined list of template. See more: https://github.com/ggerganov/llama.cpp/wiki/Templates-supported-by-llama_chat_apply_template
@@ -924,6 +1115,7 @@ extern "C" {
                              float   scale);
 
     /// @details Sorts candidate tokens by their logits in descending order and calculate probabilities based on logits.
+    ///          Tokens over 30 nats less likely than the most likely one may be left unsorted at the end.
     LLAMA_API void llama_sample_softmax(
             struct llama_context * ctx,
           llama_token_data_array * candidates);
@@ -1025,6 +1217,15 @@ extern "C" {
             struct llama_grammar * grammar,
                      llama_token   token);
 
+    /// @details Writes the text the grammar allows nothing else in place of
+    /// from where it is, e.g. the keys and punctuation of a JSON schema, up
+    /// to size bytes, returning its length. It stops at the first character
+    /// there's a choice about, or where the grammar could end.
+    LLAMA_API int32_t llama_grammar_forced_text(
+      const struct llama_grammar * grammar,
+                            char * buf,
+                         int32_t   size);
+
     //
     // Beam search
     //
@@ -1101,11 +1302,13 @@ extern "C" {
 // Internal API to be implemented by llama.cpp and used by tests/benchmarks only
 #ifdef LLAMA_API_INTERNAL
 
+#include <memory>
 #include <random>
 #include <string>
 #include <vector>
 
 struct ggml_tensor;
+struct llama_grammar_masks;
 
 struct llama_partial_utf8 {
     uint32_t value;    // bit value so far (unshifted)
@@ -1118,6 +1321,9 @@ struct llama_grammar {
 
     // buffer for partially generated UTF-8 sequence from accepted tokens
     llama_partial_utf8                                      partial_utf8;
+
+    // tokens allowed in each parser state seen so far, shared by copies
+    std::shared_ptr<llama_grammar_masks>                    masks;
 };
 
 struct llama_grammar_candidate {
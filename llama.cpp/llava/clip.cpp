@@ -5,6 +5,7 @@
 // so there might be still unnecessary artifacts hanging around
 // I'll gradually clean and extend it
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <cstdlib>
@@ -18,6 +19,7 @@
 #include <sstream>
 #include <cinttypes>
 #include <limits>
+#include <thread>
 #include "llama.cpp/log.h"
 #include "llama.cpp/ggml-backend.h"
 #include "llama.cpp/llava/clip.h"
@@ -508,6 +510,11 @@ struct clip_ctx {
     ggml_gallocr_t compute_alloc = NULL;
 };
 
+// the ldp projectors assume a single 24x24 grid of patches
+static bool clip_can_batch(const clip_ctx * ctx) {
+    return ctx->proj_type == PROJECTOR_TYPE_MLP || ctx->proj_type == PROJECTOR_TYPE_MLP_NORM;
+}
+
 static ggml_cgraph * clip_image_build_graph(clip_ctx * ctx, const clip_image_f32_batch * imgs) {
     if (!ctx->has_vision_encoder) {
         LOG_TEE("This gguf file seems to have no vision encoder\n");
@@ -531,7 +538,7 @@ static ggml_cgraph * clip_image_build_graph(clip_ctx * ctx, const clip_image_f32
     const int batch_size = imgs->size;
 
     if (ctx->has_llava_projector) {
-        GGML_ASSERT(batch_size == 1);
+        GGML_ASSERT(batch_size == 1 || clip_can_batch(ctx));
     }
 
     struct ggml_init_params params = {
@@ -558,8 +565,10 @@ static ggml_cgraph * clip_image_build_graph(clip_ctx * ctx, const clip_image_f32
     ggml_set_name(embeddings, "embeddings");
     ggml_set_input(embeddings);
 
-    embeddings = ggml_acc(ctx0, embeddings, model.class_embedding,
-            embeddings->nb[1], embeddings->nb[2], embeddings->nb[3], 0);
+    for (int b = 0; b < batch_size; b++) {
+        embeddings = ggml_acc(ctx0, embeddings, model.class_embedding,
+                embeddings->nb[1], embeddings->nb[2], embeddings->nb[3], b * embeddings->nb[2]);
+    }
 
     embeddings = ggml_acc(ctx0, embeddings, inp,
             embeddings->nb[1], embeddings->nb[2], embeddings->nb[3], model.class_embedding->nb[1]);
@@ -662,9 +671,11 @@ static ggml_cgraph * clip_image_build_graph(clip_ctx * ctx, const clip_image_f32
 
     // llava projector
     {
-        embeddings = ggml_reshape_2d(ctx0, embeddings, embeddings->ne[0], embeddings->ne[1]);
+        // the images are concatenated, so the mlp projectors work on all
+        // of them at once, and the class embedding of each one is skipped
+        embeddings = ggml_reshape_2d(ctx0, embeddings, embeddings->ne[0], embeddings->ne[1] * batch_size);
 
-        struct ggml_tensor * patches = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, num_patches);
+        struct ggml_tensor * patches = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, num_patches * batch_size);
         ggml_set_name(patches, "patches");
         ggml_set_input(patches);
 
@@ -1286,6 +1297,21 @@ void clip_image_f32_batch_free(struct clip_image_f32_batch  * batch) {
         batch->size = 0;
     }
 }
+void clip_image_f32_batch_append(struct clip_image_f32_batch * dst, struct clip_image_f32_batch * src) {
+    const size_t size = dst->size + src->size;
+    clip_image_f32 * data = new clip_image_f32[size];
+    for (size_t i = 0; i < dst->size; ++i) {
+        data[i] = std::move(dst->data[i]);
+    }
+    for (size_t i = 0; i < src->size; ++i) {
+        data[dst->size + i] = std::move(src->data[i]);
+    }
+    clip_image_f32_batch_free(dst);
+    clip_image_f32_batch_free(src);
+    src->data = nullptr;
+    dst->data = data;
+    dst->size = size;
+}
 
 static void build_clip_img_from_data(const stbi_uc * data, int nx, int ny, clip_image_u8 * img) {
     img->nx = nx;
@@ -1358,64 +1384,99 @@ static void bilinear_resize(const clip_image_u8& src, clip_image_u8& dst, int ta
 }
 
 // Normalize image to float32 - careful with pytorch .to(model.device, dtype=torch.float16) - this sometimes reduces precision (32>16>32), sometimes not
-static void normalize_image_u8_to_f32(const clip_image_u8* src, clip_image_f32* dst, const float mean[3], const float std[3]) {
-    dst->nx = src->nx;
-    dst->ny = src->ny;
-    dst->buf.resize(src->buf.size());
-
-    for (size_t i = 0; i < src->buf.size(); ++i) {
-        int c = i % 3; // rgb
-        dst->buf[i] = (static_cast<float>(src->buf[i]) / 255.0f - mean[c]) / std[c];
+//
+// there are only 256 values per channel, so they're normalized once
+// up front and then every subpixel is a table lookup
+struct clip_normalizer {
+    float lut[3][256];
+
+    clip_normalizer(const float mean[3], const float std[3]) {
+        for (int c = 0; c < 3; ++c) {
+            for (int v = 0; v < 256; ++v) {
+                lut[c][v] = (static_cast<float>(v) / 255.0f - mean[c]) / std[c];
+            }
+        }
     }
-}
+};
 
-inline float clip(float x, float lower, float upper) {
-    return std::max(lower, std::min(x, upper));
+// calls f(i0, i1) on [0, n) split among threads, if there's enough work
+template <typename F>
+static void clip_parallel_for(int n, size_t work, const F & f) {
+    const int nth = std::min({(int) std::thread::hardware_concurrency(), 8, (int) (work / 65536) + 1, n});
+    if (nth <= 1) {
+        f(0, n);
+        return;
+    }
+    std::vector<std::thread> threads;
+    for (int t = 1; t < nth; ++t) {
+        threads.emplace_back([&f, n, t, nth]() { f((int64_t) n * t / nth, (int64_t) n * (t + 1) / nth); });
+    }
+    f(0, n / nth);
+    for (auto & th : threads) {
+        th.join();
+    }
 }
 
-static bool bicubic_resize(const clip_image_u8 &img, clip_image_u8 &dst, int target_width, int target_height) {
+// bicubic resize of img to target_width x target_height, that passes each
+// subpixel to store(y, x, c, value) rather than writing it to an image, so
+// it can go straight to where the encoder wants it
+//
+// the source columns of every output column are worked out up front, and
+// big images have their output rows divided among threads
+template <typename Store>
+static void bicubic_resize(const clip_image_u8 &img, int target_width, int target_height, const Store & store) {
     const int nx = img.nx;
     const int ny = img.ny;
+    const uint8_t * src = img.buf.data();
 
-    dst.nx = target_width;
-    dst.ny = target_height;
-    dst.buf.resize(3 * target_width * target_height);
-
-    float Cc;
-    float C[5];
-    float d0, d2, d3, a0, a1, a2, a3;
-    int i, j, k, jj;
-    int x, y;
-    float dx, dy;
-    float tx, ty;
-
-    tx = (float)nx / (float)target_width;
-    ty = (float)ny / (float)target_height;
+    const float tx = (float)nx / (float)target_width;
+    const float ty = (float)ny / (float)target_height;
 
     // Bicubic interpolation; adapted from ViT.cpp, inspired from :
     //    -> https://github.com/yglukhov/bicubic-interpolation-image-processing/blob/master/libimage.c#L36
     //    -> https://en.wikipedia.org/wiki/Bicubic_interpolation
 
-    for (i = 0; i < target_height; i++) {
-        for (j = 0; j < target_width; j++) {
-            x = (int)(tx * j);
-            y = (int)(ty * i);
+    std::vector<int> xs(4 * target_width);
+    std::vector<float> dxs(target_width);
+    for (int j = 0; j < target_width; j++) {
+        const int x = (int)(tx * j);
+        dxs[j] = tx * j - x;
+        for (int ii = 0; ii < 4; ii++) {
+            xs[4 * j + ii] = std::min(std::max(x - 1 + ii, 0), nx - 1) * 3;
+        }
+    }
 
-            dx = tx * j - x;
-            dy = ty * i - y;
+    clip_parallel_for(target_height, (size_t) target_width * target_height * 3, [&](int i0, int i1) {
+        for (int i = i0; i < i1; i++) {
+            const int y = (int)(ty * i);
+            const float dy = ty * i - y;
 
-            for (k = 0; k < 3; k++) {
-                for (jj = 0; jj <= 3; jj++) {
-                    d0 = img.buf[(clip(y - 1 + jj, 0, ny - 1) * nx + clip(x - 1, 0, nx - 1)) * 3 + k] - img.buf[(clip(y - 1 + jj, 0, ny - 1) * nx + clip(x, 0, nx - 1)) * 3 + k];
-                    d2 = img.buf[(clip(y - 1 + jj, 0, ny - 1) * nx + clip(x + 1, 0, nx - 1)) * 3 + k] - img.buf[(clip(y - 1 + jj, 0, ny - 1) * nx + clip(x, 0, nx - 1)) * 3 + k];
-                    d3 = img.buf[(clip(y - 1 + jj, 0, ny - 1) * nx + clip(x + 2, 0, nx - 1)) * 3 + k] - img.buf[(clip(y - 1 + jj, 0, ny - 1) * nx + clip(x, 0, nx - 1)) * 3 + k];
-                    a0 = img.buf[(clip(y - 1 + jj, 0, ny - 1) * nx + clip(x, 0, nx - 1)) * 3 + k];
+            const uint8_t * rows[4];
+            for (int jj = 0; jj < 4; jj++) {
+                rows[jj] = src + (size_t) std::min(std::max(y - 1 + jj, 0), ny - 1) * nx * 3;
+            }
 
-                    a1 = -1.0 / 3 * d0 + d2 - 1.0 / 6 * d3;
-                    a2 =  1.0 / 2 * d0 +      1.0 / 2 * d2;
-                    a3 = -1.0 / 6 * d0 -      1.0 / 2 * d2 + 1.0 / 6 * d3;
+            for (int j = 0; j < target_width; j++) {
+                const int * xj = &xs[4 * j];
+                const float dx = dxs[j];
+
+                for (int k = 0; k < 3; k++) {
+                    float C[4];
+                    float d0, d2, d3, a0, a1, a2, a3;
+
+                    for (int jj = 0; jj < 4; jj++) {
+                        const uint8_t * row = rows[jj] + k;
+                        d0 = row[xj[0]] - row[xj[1]];
+                        d2 = row[xj[2]] - row[xj[1]];
+                        d3 = row[xj[3]] - row[xj[1]];
+                        a0 = row[xj[1]];
 
-                    C[jj] = a0 + a1 * dx + a2 * dx * dx + a3 * dx * dx * dx;
+                        a1 = -1.0 / 3 * d0 + d2 - 1.0 / 6 * d3;
+                        a2 =  1.0 / 2 * d0 +      1.0 / 2 * d2;
+                        a3 = -1.0 / 6 * d0 -      1.0 / 2 * d2 + 1.0 / 6 * d3;
+
+                        C[jj] = a0 + a1 * dx + a2 * dx * dx + a3 * dx * dx * dx;
+                    }
 
                     d0 = C[0] - C[1];
                     d2 = C[2] - C[1];
@@ -1424,20 +1485,20 @@ static bool bicubic_resize(const clip_image_u8 &img, clip_image_u8 &dst, int tar
                     a1 = -1.0 / 3 * d0 + d2 - 1.0 / 6 * d3;
                     a2 =  1.0 / 2 * d0 +      1.0 / 2 * d2;
                     a3 = -1.0 / 6 * d0 -      1.0 / 2 * d2 + 1.0 / 6 * d3;
-                    Cc = a0 + a1 * dy + a2 * dy * dy + a3 * dy * dy * dy;
+                    const float Cc = a0 + a1 * dy + a2 * dy * dy + a3 * dy * dy * dy;
 
-                    const uint8_t Cc2 = std::min(std::max(std::round(Cc), 0.0f), 255.0f);
-                    dst.buf[(i * target_width + j) * 3 + k] = float(Cc2);
+                    store(i, j, k, (uint8_t) std::min(std::max(std::round(Cc), 0.0f), 255.0f));
                 }
             }
         }
-    }
-
-    return true;
+    });
 }
 
-// llava-1.6 type of resize_and_pad (black)
-static void resize_and_pad_image(const clip_image_u8& image, clip_image_u8 &image_output, const std::pair<int, int>& target_resolution) {
+// llava-1.6 type of resize_and_pad (black), followed by splitting the
+// result into patch_size squares, where the resized image goes straight
+// into the normalized patches without an intermediate u8 image
+static void resize_and_pad_to_patches(const clip_image_u8 & image, const std::pair<int, int> & target_resolution, int patch_size,
+                                      const clip_normalizer & norm, clip_image_f32 * patches) {
     int target_width = target_resolution.first;
     int target_height = target_resolution.second;
 
@@ -1454,28 +1515,32 @@ static void resize_and_pad_image(const clip_image_u8& image, clip_image_u8 &imag
         new_width = std::min(static_cast<int>(std::ceil(image.nx * scale_h)), target_width);
     }
 
-    clip_image_u8 resized_image;
-    // bilinear_resize(image, resized_image, new_width, new_height);
-    bicubic_resize(image, resized_image, new_width, new_height);
-
-    clip_image_u8 padded_image;
-    padded_image.nx = target_width;
-    padded_image.ny = target_height;
-    padded_image.buf.resize(3 * target_width * target_height, 0); // Initialize with black
-
     // Calculate padding offsets
     int pad_x = (target_width - new_width) / 2;
     int pad_y = (target_height - new_height) / 2;
 
-    // Copy the resized image into the center of the padded buffer
-    for (int y = 0; y < new_height; ++y) {
-        for (int x = 0; x < new_width; ++x) {
-            for (int c = 0; c < 3; ++c) {
-                padded_image.buf[3 * ((y + pad_y) * target_width + (x + pad_x)) + c] = resized_image.buf[3 * (y * new_width + x) + c];
+    // spatially sorted patches, which start out black
+    const int n_cols = (target_width + patch_size - 1) / patch_size;
+    for (int i = 0, n = 0; i < target_height; i += patch_size) {
+        for (int j = 0; j < target_width; j += patch_size, n++) {
+            clip_image_f32 & patch = patches[n];
+            patch.nx = std::min(patch_size, target_width - j);
+            patch.ny = std::min(patch_size, target_height - i);
+            patch.buf.resize(3 * patch.nx * patch.ny);
+            for (size_t m = 0; m < patch.buf.size(); m += 3) {
+                patch.buf[m + 0] = norm.lut[0][0];
+                patch.buf[m + 1] = norm.lut[1][0];
+                patch.buf[m + 2] = norm.lut[2][0];
             }
         }
     }
-    image_output = std::move(padded_image);
+
+    bicubic_resize(image, new_width, new_height, [&](int y, int x, int c, uint8_t v) {
+        const int gy = y + pad_y;
+        const int gx = x + pad_x;
+        clip_image_f32 & patch = patches[(gy / patch_size) * n_cols + gx / patch_size];
+        patch.buf[3 * ((gy % patch_size) * patch.nx + gx % patch_size) + c] = norm.lut[c][v];
+    });
 }
 
 /**
@@ -1511,29 +1576,6 @@ static std::pair<int, int> select_best_resolution(const std::pair<int, int> & or
     return best_fit;
 }
 
-static std::vector<clip_image_u8*> divide_to_patches_u8(const clip_image_u8 & image, int patch_size) {
-    std::vector<clip_image_u8*> patches;
-    int width = image.nx;
-    int height = image.ny;
-    for (int i = 0; i < height; i += patch_size) {
-        for (int j = 0; j < width; j += patch_size) {
-            clip_image_u8 *patch = clip_image_u8_init();
-            patch->nx = std::min(patch_size, width - j);
-            patch->ny = std::min(patch_size, height - i);
-            patch->buf.resize(3 * patch->nx * patch->ny);
-            for (int y = 0; y < patch->ny; ++y) {
-                for (int x = 0; x < patch->nx; ++x) {
-                    for (int c = 0; c < 3; ++c) {
-                        patch->buf[3 * (y * patch->nx + x) + c] = image.buf[3 * ((i + y) * width + (j + x)) + c];
-                    }
-                }
-            }
-            patches.push_back(patch);
-        }
-    }
-    return patches;
-}
-
 // returns the normalized float tensor for llava-1.5, for spatial_unpad with anyres processing for llava-1.6 it returns the normalized image patch tensors as a vector
 // res_imgs memory is being allocated here, previous allocations will be freed if found
 bool clip_image_preprocess(struct clip_ctx * ctx, const clip_image_u8 * img, clip_image_f32_batch * res_imgs) {
@@ -1572,13 +1614,7 @@ bool clip_image_preprocess(struct clip_ctx * ctx, const clip_image_u8 * img, cli
 
         // copy from the input image
         for (int y = 0; y < img->ny; y++) {
-            for (int x = 0; x < img->nx; x++) {
-                const int i = 3 * (y * img->nx + x);
-                const int j = 3 * (y * temp->nx + x);
-                temp->buf[j]   = img->buf[i];
-                temp->buf[j+1] = img->buf[i+1];
-                temp->buf[j+2] = img->buf[i+2];
-            }
+            memcpy(&temp->buf[3 * y * temp->nx], &img->buf[3 * y * img->nx], 3 * img->nx);
         }
     } else {
         if (params.image_grid_pinpoints[0] != 0) {
@@ -1588,37 +1624,26 @@ bool clip_image_preprocess(struct clip_ctx * ctx, const clip_image_u8 * img, cli
                 possible_resolutions.push_back({params.image_grid_pinpoints[i], params.image_grid_pinpoints[i+1]});
             }
             std::pair<int, int> best_resolution = select_best_resolution({img->nx, img->ny}, possible_resolutions);
-            // clip_image_save_to_bmp(*img, "input.bmp");
-            resize_and_pad_image(*img, *temp, best_resolution);  // we do not pad with mean-bg color anymore in llava-1.6
-            // clip_image_save_to_bmp(*temp, "resized.bmp");
-            // visually verify normalized image:
-            // normalize_image_u8_to_f32(*temp, *res, ctx->image_mean, ctx->image_std);
-            // {
-            //     clip_image_u8 * temp2 = clip_image_u8_init();
-            //     clip_image_convert_f32_to_u8(*res, *temp2);
-            //     clip_image_save_to_bmp(*temp2, "resized_normalized_f32.bmp");
-            //     clip_image_u8_free(temp2);
-            // }
-
-            std::vector<clip_image_u8 *> patches = divide_to_patches_u8(*temp, params.image_size); // prepare spatial sorted main patches of image_size each (336 in llava-1.6)
-
-            clip_image_u8 *image_original_resize = clip_image_u8_init();
-            // bilinear_resize(*img, *image_original_resize, params.image_size, params.image_size); // in python this is "shortest_edge", but all CLIP are square
-            bicubic_resize(*img, *image_original_resize, params.image_size, params.image_size); // in python this is "shortest_edge", but all CLIP are square
-            patches.insert(patches.begin(), image_original_resize);
-            // clip_image_f32_batch_init(patches.size());
-            res_imgs->size = patches.size();
+            const int patch_size = params.image_size; // 336 in llava-1.6
+            const int n_patches = ((best_resolution.first + patch_size - 1) / patch_size) *
+                                  ((best_resolution.second + patch_size - 1) / patch_size);
+            const clip_normalizer norm(ctx->image_mean, ctx->image_std);
+
+            res_imgs->size = 1 + n_patches;
             res_imgs->data = new clip_image_f32[res_imgs->size];
-            int num=0;
-            for (auto& patch : patches) {
-                normalize_image_u8_to_f32(patch, &res_imgs->data[num], ctx->image_mean, ctx->image_std);
-                num++;
-            }
 
-            for (size_t i = 0; i < patches.size(); i++) {
-                // LOG_TEE("patch %d: %d %d\n", i, patches[i]->nx, patches[i]->ny);
-                clip_image_u8_free(patches[i]);
-            }
+            // in python this is "shortest_edge", but all CLIP are square
+            clip_image_f32 & res = res_imgs->data[0];
+            res.nx = patch_size;
+            res.ny = patch_size;
+            res.buf.resize(3 * patch_size * patch_size);
+            float * out = res.buf.data();
+            bicubic_resize(*img, patch_size, patch_size, [&](int y, int x, int c, uint8_t v) {
+                out[3 * (y * patch_size + x) + c] = norm.lut[c][v];
+            });
+
+            // we do not pad with mean-bg color anymore in llava-1.6
+            resize_and_pad_to_patches(*img, best_resolution, patch_size, norm, res_imgs->data + 1);
 
             clip_image_u8_free(temp);
 
@@ -1647,48 +1672,52 @@ bool clip_image_preprocess(struct clip_ctx * ctx, const clip_image_u8 * img, cli
     const int nx3 = int(nx / scale + 0.5f);
     const int ny3 = int(ny / scale + 0.5f);
 
-    const auto & m3 = ctx->image_mean; // {0.48145466f, 0.4578275f, 0.40821073f};
-    const auto & s3 = ctx->image_std;  // {0.26862954f, 0.26130258f, 0.27577711f};
-
-    for (int y = 0; y < ny3; y++) {
-        for (int x = 0; x < nx3; x++) {
-            for (int c = 0; c < 3; c++) {
-                // linear interpolation
-                const float sx = (x + 0.5f) * scale - 0.5f;
-                const float sy = (y + 0.5f) * scale - 0.5f;
-
-                const int x0 = std::max(0, (int)std::floor(sx));
-                const int y0 = std::max(0, (int)std::floor(sy));
+    const clip_normalizer norm(ctx->image_mean, ctx->image_std); // {0.48145466f, 0.4578275f, 0.40821073f}, {0.26862954f, 0.26130258f, 0.27577711f}
+
+    // linear interpolation, where the columns are worked out up front
+    std::vector<int> xs0(nx3), xs1(nx3);
+    std::vector<float> dxs(nx3);
+    for (int x = 0; x < nx3; x++) {
+        const float sx = (x + 0.5f) * scale - 0.5f;
+        const int x0 = std::max(0, (int)std::floor(sx));
+        const int x1 = std::min(x0 + 1, nx - 1);
+        xs0[x] = 3 * x0;
+        xs1[x] = 3 * x1;
+        dxs[x] = sx - x0;
+    }
 
-                const int x1 = std::min(x0 + 1, nx - 1);
-                const int y1 = std::min(y0 + 1, ny - 1);
+    clip_parallel_for(ny3, (size_t) nx3 * ny3 * 3, [&](int y_begin, int y_end) {
+        for (int y = y_begin; y < y_end; y++) {
+            const float sy = (y + 0.5f) * scale - 0.5f;
 
-                const float dx = sx - x0;
-                const float dy = sy - y0;
+            const int y0 = std::max(0, (int)std::floor(sy));
+            const int y1 = std::min(y0 + 1, ny - 1);
 
-                const int j00 = 3 * (y0 * nx + x0) + c;
-                const int j01 = 3 * (y0 * nx + x1) + c;
-                const int j10 = 3 * (y1 * nx + x0) + c;
-                const int j11 = 3 * (y1 * nx + x1) + c;
+            const float dy = sy - y0;
 
-                const float v00 = temp->buf[j00];
-                const float v01 = temp->buf[j01];
-                const float v10 = temp->buf[j10];
-                const float v11 = temp->buf[j11];
+            const uint8_t * row0 = &temp->buf[3 * y0 * nx];
+            const uint8_t * row1 = &temp->buf[3 * y1 * nx];
 
-                const float v0 = v00 * (1.0f - dx) + v01 * dx;
-                const float v1 = v10 * (1.0f - dx) + v11 * dx;
+            for (int x = 0; x < nx3; x++) {
+                const float dx = dxs[x];
+                for (int c = 0; c < 3; c++) {
+                    const float v00 = row0[xs0[x] + c];
+                    const float v01 = row0[xs1[x] + c];
+                    const float v10 = row1[xs0[x] + c];
+                    const float v11 = row1[xs1[x] + c];
 
-                const float v = v0 * (1.0f - dy) + v1 * dy;
+                    const float v0 = v00 * (1.0f - dx) + v01 * dx;
+                    const float v1 = v10 * (1.0f - dx) + v11 * dx;
 
-                const uint8_t v2 = std::min(std::max(std::round(v), 0.0f), 255.0f);
+                    const float v = v0 * (1.0f - dy) + v1 * dy;
 
-                const int i = 3 * (y * nx3 + x) + c;
+                    const uint8_t v2 = std::min(std::max(std::round(v), 0.0f), 255.0f);
 
-                res->buf[i] = ((float(v2) / 255.0f) - m3[c]) / s3[c];
+                    res->buf[3 * (y * nx3 + x) + c] = norm.lut[c][v2];
+                }
             }
         }
-    }
+    });
     clip_image_u8_free(temp);
 
     // {
@@ -1776,8 +1805,17 @@ bool clip_image_batch_encode(clip_ctx * ctx, const int n_threads, const clip_ima
     }
 
     int batch_size = imgs->size;
-    if (ctx->has_llava_projector) {
-        GGML_ASSERT(batch_size == 1); // TODO: support multiple images
+    if (ctx->has_llava_projector && batch_size > 1 && !clip_can_batch(ctx)) {
+        const size_t n_embd = clip_embd_nbytes(ctx) / sizeof(float);
+        for (int b = 0; b < batch_size; b++) {
+            clip_image_f32_batch img{};
+            img.size = 1;
+            img.data = &imgs->data[b];
+            if (!clip_image_batch_encode(ctx, n_threads, &img, vec + b * n_embd)) {
+                return false;
+            }
+        }
+        return true;
     }
 
     // build the inference graph
@@ -1797,19 +1835,17 @@ bool clip_image_batch_encode(clip_ctx * ctx, const int n_threads, const clip_ima
         struct ggml_tensor * inp_raw = ggml_graph_get_tensor(gf, "inp_raw");
         float * data = (float *)malloc(ggml_nbytes(inp_raw));
 
-        for (size_t i = 0; i < imgs->size; i++) {
-            const int nx = imgs->data[i].nx;
-            const int ny = imgs->data[i].ny;
+        for (int b = 0; b < batch_size; b++) {
+            const int nx = imgs->data[b].nx;
+            const int ny = imgs->data[b].ny;
             GGML_ASSERT(nx == image_size && ny == image_size);
 
             const int n = nx * ny;
 
-            for (int b = 0; b < batch_size; b++) {
-                for (int k = 0; k < 3; k++) {
-                    for (int y = 0; y < ny; y++) {
-                        for (int x = 0; x < nx; x++) {
-                            data[(b * 3 * n) + k * n + y * nx + x] = imgs->data[b].buf[3 * (y * nx + x) + k];
-                        }
+            for (int k = 0; k < 3; k++) {
+                for (int y = 0; y < ny; y++) {
+                    for (int x = 0; x < nx; x++) {
+                        data[(b * 3 * n) + k * n + y * nx + x] = imgs->data[b].buf[3 * (y * nx + x) + k];
                     }
                 }
             }
@@ -1841,8 +1877,10 @@ bool clip_image_batch_encode(clip_ctx * ctx, const int n_threads, const clip_ima
     {
         struct ggml_tensor * patches = ggml_graph_get_tensor(gf, "patches");
         int* patches_data = (int*)malloc(ggml_nbytes(patches));
-        for (int i = 0; i < num_patches; i++) {
-            patches_data[i] = i + 1;
+        for (int b = 0; b < batch_size; b++) {
+            for (int i = 0; i < num_patches; i++) {
+                patches_data[b * num_patches + i] = b * num_positions + i + 1;
+            }
         }
         ggml_backend_tensor_set(patches, patches_data, 0, ggml_nbytes(patches));
         free(patches_data);
@@ -1905,8 +1943,12 @@ bool clip_model_quantize(const char * fname_inp, const char * fname_out, const i
         ".*weight",
     };
 
-    std::vector<uint8_t> work(512);
-    std::vector<float> conv_buf(512);
+    // tensors are converted and quantized a slice of rows at a time, and
+    // each slice is written out as soon as it's done, so memory use stays
+    // bounded by the slice size rather than the largest tensor
+    const size_t slice_elms = 4 * 1024 * 1024;
+    std::vector<uint8_t> work;
+    std::vector<float> conv_buf;
     size_t total_size_org = 0;
     size_t total_size_new = 0;
 
@@ -1915,7 +1957,6 @@ bool clip_model_quantize(const char * fname_inp, const char * fname_out, const i
         struct ggml_tensor * cur = ggml_get_tensor(ctx_data, name.c_str());
 
         enum ggml_type new_type;
-        void * new_data;
         size_t new_size;
 
         bool quantize = false;
@@ -1935,45 +1976,43 @@ bool clip_model_quantize(const char * fname_inp, const char * fname_out, const i
                 new_type = GGML_TYPE_Q8_0; // ggml_get_rows needs non K type
                 // LOG_TEE("%s: quantizing %s to %s\n", __func__, name.c_str(), ggml_type_name(new_type));
             }
-            const size_t n_elms = ggml_nelements(cur);
-            float * f32_data;
-
-            switch (cur->type) {
-            case GGML_TYPE_F32:
-                f32_data = (float *)cur->data;
-                break;
-            case GGML_TYPE_F16:
-                if (conv_buf.size() < n_elms) {
-                    conv_buf.resize(n_elms);
-                }
-                for (size_t j = 0; j < n_elms; ++j) {
-                    conv_buf[j] = ggml_fp16_to_fp32(((ggml_fp16_t *)cur->data)[j]);
-                }
-                f32_data = (float *)conv_buf.data();
-                break;
-            default:
+            if (cur->type != GGML_TYPE_F32 && cur->type != GGML_TYPE_F16) {
                 LOG_TEE("Please use an input file in f32 or f16\n");
                 gguf_free(ctx_out);
                 return false;
             }
 
-            if (work.size() < n_elms * 4) {
-                work.resize(n_elms * 4);
+            const int64_t n_per_row = cur->ne[0];
+            const int64_t nrows = ggml_nrows(cur);
+            const int64_t rows_per_slice = std::max((int64_t) 1, (int64_t) slice_elms / n_per_row);
+            const size_t new_row_size = ggml_row_size(new_type, n_per_row);
+
+            new_size = 0;
+            for (int64_t row = 0; row < nrows; row += rows_per_slice) {
+                const int64_t n = std::min(rows_per_slice, nrows - row);
+                const float * f32_data;
+                if (cur->type == GGML_TYPE_F32) {
+                    f32_data = (const float *) cur->data + row * n_per_row;
+                } else {
+                    conv_buf.resize(n * n_per_row);
+                    ggml_fp16_to_fp32_row((const ggml_fp16_t *) cur->data + row * n_per_row, conv_buf.data(), n * n_per_row);
+                    f32_data = conv_buf.data();
+                }
+                work.resize(n * new_row_size);
+                const size_t size = ggml_quantize_chunk(new_type, f32_data, work.data(), 0, n, n_per_row, nullptr);
+                fout.write((const char *) work.data(), size);
+                new_size += size;
             }
-            new_data = work.data();
-
-            new_size = ggml_quantize_chunk(new_type, f32_data, new_data, 0, n_elms/cur->ne[0], cur->ne[0], nullptr);
         } else {
             new_type = cur->type;
-            new_data = cur->data;
             new_size = ggml_nbytes(cur);
+            fout.write((const char *) cur->data, new_size);
         }
         const size_t orig_size = ggml_nbytes(cur);
         total_size_org += orig_size;
         total_size_new += new_size;
         gguf_set_tensor_type(ctx_out, name.c_str(), new_type);
-        gguf_set_tensor_data(ctx_out, name.c_str(), new_data, new_size);
-        fout.write((const char *)new_data, new_size);
+        gguf_set_tensor_data(ctx_out, name.c_str(), nullptr, new_size);
         size_t pad = GGML_PAD(new_size, gguf_get_alignment(ctx_out)) - new_size;
         for (size_t j = 0; j < pad; ++j) {
             fout.put(0);
@@ -9,8 +9,15 @@
 #include "llama.cpp/base64.h"
 #include "llamafile/version.h"
 
+#include "llama.cpp/json.h"
+
+#include <atomic>
+#include <condition_variable>
 #include <cstdio>
 #include <cstdlib>
+#include <deque>
+#include <mutex>
+#include <thread>
 #include <vector>
 #include <unistd.h>
 #include <signal.h>
@@ -156,17 +163,37 @@ static struct llava_image_embed * load_image(llava_context * ctx_llava, gpt_para
     return embed;
 }
 
+// returns true if prompt uses <image> to say where the image goes
+static bool split_prompt(const std::string & prompt, std::string * system_prompt, std::string * user_prompt) {
+    size_t image_pos = prompt.find("<image>");
+    if (image_pos != std::string::npos) {
+        // new templating mode: Provide the full prompt including system message and use <image> as a placeholder for the image
+        *system_prompt = prompt.substr(0, image_pos);
+        *user_prompt = prompt.substr(image_pos + std::string("<image>").length());
+        return true;
+    }
+    // llava-1.5 native mode
+    *system_prompt = "A chat between a curious human and an artificial intelligence assistant. The assistant gives helpful, detailed, and polite answers to the human's questions.\nUSER:";
+    *user_prompt = prompt + "\nASSISTANT:";
+    return false;
+}
+
+// returns true if the text generated so far ends the reply
+static bool reply_finished(const std::string & response, const std::string & piece) {
+    return piece == "</s>" ||
+           piece.find("###") != std::string::npos || // Yi-VL behavior
+           response.find("<|im_end|>") != std::string::npos || // Yi-34B llava-1.6 - for some reason those decode not as the correct token (tokenizer works)
+           response.find("<|im_start|>") != std::string::npos || // Yi-34B llava-1.6
+           response.find("USER:") != std::string::npos; // mistral llava-1.6
+}
+
 static void process_prompt(struct llava_context * ctx_llava, struct llava_image_embed * image_embed, gpt_params * params, const std::string & prompt) {
     int n_past = 0;
 
     const int max_tgt_len = params->n_predict < 0 ? 256 : params->n_predict;
 
     std::string system_prompt, user_prompt;
-    size_t image_pos = prompt.find("<image>");
-    if (image_pos != std::string::npos) {
-        // new templating mode: Provide the full prompt including system message and use <image> as a placeholder for the image
-        system_prompt = prompt.substr(0, image_pos);
-        user_prompt = prompt.substr(image_pos + std::string("<image>").length());
+    if (split_prompt(prompt, &system_prompt, &user_prompt)) {
         LOG_TEE("system_prompt: %s\n", system_prompt.c_str());
         if (params->verbose_prompt) {
             auto tmp = ::llama_tokenize(ctx_llava->ctx_llama, system_prompt, true, true);
@@ -182,9 +209,6 @@ static void process_prompt(struct llava_context * ctx_llava, struct llava_image_
             }
         }
     } else {
-        // llava-1.5 native mode
-        system_prompt = "A chat between a curious human and an artificial intelligence assistant. The assistant gives helpful, detailed, and polite answers to the human's questions.\nUSER:";
-        user_prompt = prompt + "\nASSISTANT:";
         if (params->verbose_prompt) {
             auto tmp = ::llama_tokenize(ctx_llava->ctx_llama, user_prompt, true, true);
             for (int i = 0; i < (int) tmp.size(); i++) {
@@ -239,7 +263,7 @@ static struct llama_model * llava_init(gpt_params * params) {
     return model;
 }
 
-static struct llava_context * llava_init_context(gpt_params * params, llama_model * model) {
+static struct llava_context * llava_init_context(gpt_params * params, llama_model * model, int n_seq = 1) {
     const char * clip_path = params->mmproj.c_str();
 
     auto prompt = params->prompt;
@@ -251,7 +275,7 @@ static struct llava_context * llava_init_context(gpt_params * params, llama_mode
 
 
     llama_context_params ctx_params = llama_context_params_from_gpt_params(*params);
-    ctx_params.n_ctx           = params->n_ctx < 2048 ? 2048 : params->n_ctx; // we need a longer context size to process image embeddings
+    ctx_params.n_ctx           = params->n_ctx < 2048 * n_seq ? 2048 * n_seq : params->n_ctx; // we need a longer context size to process image embeddings
 
     llama_context * ctx_llama = llama_new_context_with_model(model, ctx_params);
 
@@ -279,6 +303,348 @@ static void llava_free(struct llava_context * ctx_llava) {
     llama_backend_free();
 }
 
+//
+// pipelined captioning of many images, used when -np is more than one
+//
+// loader threads decode and preprocess the images, an encoder thread runs
+// the vision model on batches of them, and the main thread generates the
+// replies of up to -np images at once, as sequences of one llama context
+// that share each batch. so image decoding, clip and the llm all overlap,
+// and a sequence whose reply is done takes the next encoded image. the
+// replies are written to stdout as json lines in the order they finish.
+//
+
+struct llava_job {
+    size_t index;
+    clip_image_u8 * img = nullptr;      // decoded image
+    clip_image_f32_batch prep = {};     // preprocessed, if clip can batch it
+    llava_image_embed * embed = nullptr;
+};
+
+// blocking queue of bounded size
+template <typename T>
+struct llava_queue {
+    std::mutex mu;
+    std::condition_variable cv;
+    std::deque<T> items;
+    size_t cap;
+    bool closed = false;
+
+    explicit llava_queue(size_t cap) : cap(cap) {}
+
+    void push(T item) {
+        std::unique_lock<std::mutex> lock(mu);
+        cv.wait(lock, [this] { return items.size() < cap; });
+        items.push_back(std::move(item));
+        cv.notify_all();
+    }
+
+    // returns false once the queue is closed and drained, or if it's
+    // empty and wait is false
+    bool pop(T * item, bool wait = true) {
+        std::unique_lock<std::mutex> lock(mu);
+        if (wait) {
+            cv.wait(lock, [this] { return !items.empty() || closed; });
+        }
+        if (items.empty()) {
+            return false;
+        }
+        *item = std::move(items.front());
+        items.pop_front();
+        cv.notify_all();
+        return true;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(mu);
+        closed = true;
+        cv.notify_all();
+    }
+};
+
+struct llava_seq {
+    llama_seq_id id;
+    bool active = false;
+    size_t index;
+    int n_past;
+    int n_decoded;
+    llama_token sampled;
+    std::string response;
+    llama_sampling_context * ctx_sampling = nullptr;
+};
+
+static void llava_batch_write(const gpt_params & params, const llava_seq & seq, const char * error = nullptr) {
+    nlohmann::json out = {
+        {"index", seq.index},
+        {"image", params.image[seq.index]},
+    };
+    if (error) {
+        out["error"] = error;
+    } else {
+        out["content"] = seq.response;
+    }
+    std::string line = out.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace);
+    line += '\n';
+    fwrite(line.data(), line.size(), 1, stdout);
+    fflush(stdout);
+}
+
+// evaluates tokens or image embeddings for a sequence on its own, with
+// logits for the last one if logits_last is true
+static bool llava_seq_eval(llama_context * ctx, llama_batch & batch, const llama_token * tokens, const float * embd,
+                           int n, int n_batch, llama_seq_id seq, int * n_past, bool logits_last) {
+    const int n_embd = llama_n_embd(llama_get_model(ctx));
+    for (int i = 0; i < n; i += n_batch) {
+        const int n_eval = std::min(n - i, n_batch);
+        batch.n_tokens = n_eval;
+        for (int j = 0; j < n_eval; ++j) {
+            if (embd) {
+                memcpy(batch.embd + (size_t) j * n_embd, embd + (size_t) (i + j) * n_embd, n_embd * sizeof(float));
+            } else {
+                batch.token[j] = tokens[i + j];
+            }
+            batch.pos[j] = (*n_past)++;
+            batch.n_seq_id[j] = 1;
+            batch.seq_id[j][0] = seq;
+            batch.logits[j] = logits_last && i + j == n - 1;
+        }
+        if (llama_decode(ctx, batch)) {
+            LOG_TEE("%s : failed to eval. token %d/%d (batch size %d, n_past %d)\n", __func__, i, n, n_batch, *n_past);
+            return false;
+        }
+    }
+    return true;
+}
+
+static int llava_batch(gpt_params & params, llama_model * model) {
+    const int n_seq = params.n_parallel;
+    const size_t n_images = params.image.size();
+    const int max_tgt_len = params.n_predict < 0 ? 256 : params.n_predict;
+
+    llava_context * ctx_llava = llava_init_context(&params, model, n_seq);
+    if (!ctx_llava) {
+        return 1;
+    }
+    g_ctx = ctx_llava;
+    llama_context * ctx = ctx_llava->ctx_llama;
+    clip_ctx * ctx_clip = ctx_llava->ctx_clip;
+    const int n_ctx_seq = llama_n_ctx(ctx) / n_seq;
+    const int n_batch = params.n_batch;
+
+    // llava-1.6 splits images into a grid of pieces, which llava.cpp merges
+    const bool flat = strcmp(clip_patch_merge_type(ctx_clip), "spatial_unpad") != 0;
+
+    std::string system_prompt, user_prompt;
+    split_prompt(params.prompt.empty() ? "describe the image in detail." : params.prompt, &system_prompt, &user_prompt);
+    const std::vector<llama_token> system_tokens = ::llama_tokenize(ctx, system_prompt, true, true);
+    const std::vector<llama_token> user_tokens = ::llama_tokenize(ctx, user_prompt, false, true);
+
+    // decode and preprocess images
+    llava_queue<llava_job> loaded(2 * n_seq);
+    std::atomic<size_t> next_image(0);
+    std::atomic<int> n_loaders_running;
+    const int n_loaders = std::max(1, std::min(4, params.n_threads / 2));
+    n_loaders_running = n_loaders;
+    std::vector<std::thread> loaders;
+    for (int t = 0; t < n_loaders; ++t) {
+        loaders.emplace_back([&] {
+            for (size_t i; (i = next_image++) < n_images;) {
+                llava_job job;
+                job.index = i;
+                job.img = clip_image_u8_init();
+                if (!clip_image_load_from_file(params.image[i].c_str(), job.img)) {
+                    clip_image_u8_free(job.img);
+                    job.img = nullptr;
+                } else if (flat) {
+                    if (!clip_image_preprocess(ctx_clip, job.img, &job.prep)) {
+                        clip_image_f32_batch_free(&job.prep);
+                    }
+                    clip_image_u8_free(job.img);
+                    job.img = nullptr;
+                }
+                loaded.push(std::move(job));
+            }
+            if (!--n_loaders_running) {
+                loaded.close();
+            }
+        });
+    }
+
+    // run the vision encoder on as many images as are ready
+    llava_queue<llava_job> encoded(2 * n_seq);
+    std::thread encoder([&] {
+        const size_t n_embd_bytes = clip_embd_nbytes(ctx_clip);
+        llava_job job;
+        while (loaded.pop(&job)) {
+            std::vector<llava_job> jobs;
+            jobs.push_back(std::move(job));
+            while ((int) jobs.size() < n_seq && loaded.pop(&job, false)) {
+                jobs.push_back(std::move(job));
+            }
+            clip_image_f32_batch imgs = {};
+            std::vector<llava_job *> batched;
+            for (llava_job & j : jobs) {
+                if (flat && j.prep.size == 1) {
+                    clip_image_f32_batch_append(&imgs, &j.prep);
+                    batched.push_back(&j);
+                } else if (!flat && j.img) {
+                    float * embd;
+                    int n_pos;
+                    if (llava_image_embed_make_with_clip_img(ctx_clip, params.n_threads, j.img, &embd, &n_pos)) {
+                        j.embed = (llava_image_embed *) malloc(sizeof(llava_image_embed));
+                        j.embed->embed = embd;
+                        j.embed->n_image_pos = n_pos;
+                    }
+                    clip_image_u8_free(j.img);
+                    j.img = nullptr;
+                }
+            }
+            if (!batched.empty()) {
+                std::vector<float> vec(batched.size() * n_embd_bytes / sizeof(float));
+                if (clip_image_batch_encode(ctx_clip, params.n_threads, &imgs, vec.data())) {
+                    for (size_t b = 0; b < batched.size(); ++b) {
+                        llava_job & j = *batched[b];
+                        j.embed = (llava_image_embed *) malloc(sizeof(llava_image_embed));
+                        j.embed->embed = (float *) malloc(n_embd_bytes);
+                        j.embed->n_image_pos = clip_n_patches(ctx_clip);
+                        memcpy(j.embed->embed, (const char *) vec.data() + b * n_embd_bytes, n_embd_bytes);
+                    }
+                }
+                clip_image_f32_batch_free(&imgs);
+            }
+            for (llava_job & j : jobs) {
+                clip_image_f32_batch_free(&j.prep);
+                encoded.push(std::move(j));
+            }
+        }
+        encoded.close();
+    });
+
+    // generate the replies
+    std::vector<llava_seq> seqs(n_seq);
+    for (int i = 0; i < n_seq; ++i) {
+        seqs[i].id = i;
+        seqs[i].ctx_sampling = llama_sampling_init(params.sparams);
+    }
+    llama_batch batch = llama_batch_init(std::max(n_batch, n_seq), 0, 1);
+    llama_batch batch_embd = llama_batch_init(n_batch, llama_n_embd(model), 1);
+    bool done = false;
+    int status = 0;
+    size_t n_finished = 0;
+    const int64_t t_start = ggml_time_us();
+
+    // returns true if seq is done after it sampled from logits idx
+    auto accept = [&](llava_seq & seq, int idx) {
+        const llama_token id = llama_sampling_sample(seq.ctx_sampling, ctx, NULL, idx);
+        llama_sampling_accept(seq.ctx_sampling, ctx, id, true);
+        seq.sampled = id;
+        ++seq.n_decoded;
+        const std::string piece = llama_token_is_eog(model, id) ? "</s>" : llama_token_to_piece(ctx, id);
+        if (piece != "</s>") {
+            seq.response += piece;
+        }
+        if (reply_finished(seq.response, piece) || seq.n_decoded >= max_tgt_len || seq.n_past >= n_ctx_seq) {
+            llava_batch_write(params, seq);
+            llama_kv_cache_seq_rm(ctx, seq.id, -1, -1);
+            seq.active = false;
+            ++n_finished;
+            return true;
+        }
+        return false;
+    };
+
+    for (;;) {
+        // give free sequences the images that were encoded, waiting for
+        // one only if there's nothing else to do
+        for (llava_seq & seq : seqs) {
+            if (seq.active || done) {
+                continue;
+            }
+            const bool busy = std::any_of(seqs.begin(), seqs.end(), [](const llava_seq & s) { return s.active; });
+            llava_job job;
+            if (!encoded.pop(&job, !busy)) {
+                done = !busy;
+                break;
+            }
+            seq.index = job.index;
+            seq.n_past = 0;
+            seq.n_decoded = 0;
+            seq.response.clear();
+            if (!job.embed) {
+                llava_batch_write(params, seq, "failed to load image");
+                ++n_finished;
+                continue;
+            }
+            if ((int) (system_tokens.size() + job.embed->n_image_pos + user_tokens.size()) >= n_ctx_seq) {
+                llava_batch_write(params, seq, "prompt does not fit in the context of a sequence");
+                llava_image_embed_free(job.embed);
+                ++n_finished;
+                continue;
+            }
+            llama_sampling_reset(seq.ctx_sampling);
+            bool ok = llava_seq_eval(ctx, batch, system_tokens.data(), nullptr, system_tokens.size(), n_batch, seq.id, &seq.n_past, false) &&
+                      llava_seq_eval(ctx, batch_embd, nullptr, job.embed->embed, job.embed->n_image_pos, n_batch, seq.id, &seq.n_past, false) &&
+                      llava_seq_eval(ctx, batch, user_tokens.data(), nullptr, user_tokens.size(), n_batch, seq.id, &seq.n_past, true);
+            llava_image_embed_free(job.embed);
+            if (!ok) {
+                status = 1;
+                done = true;
+                break;
+            }
+            seq.active = true;
+            accept(seq, batch.n_tokens - 1);
+        }
+
+        llama_batch_clear(batch);
+        for (llava_seq & seq : seqs) {
+            if (seq.active) {
+                llama_batch_add(batch, seq.sampled, seq.n_past++, {seq.id}, true);
+            }
+        }
+        if (!batch.n_tokens) {
+            if (done) {
+                break;
+            }
+            continue;
+        }
+        if (llama_decode(ctx, batch)) {
+            LOG_TEE("%s : failed to decode batch\n", __func__);
+            status = 1;
+            break;
+        }
+        int idx = 0;
+        for (llava_seq & seq : seqs) {
+            if (seq.active) {
+                accept(seq, idx++);
+            }
+        }
+    }
+
+    // drain what's left if decoding failed, so the threads can finish
+    llava_job job;
+    while (encoded.pop(&job)) {
+        if (job.embed) {
+            llava_image_embed_free(job.embed);
+        }
+    }
+    encoder.join();
+    for (std::thread & t : loaders) {
+        t.join();
+    }
+
+    const double t_seconds = (ggml_time_us() - t_start) / 1e6;
+    LOG_TEE("%s: %zu of %zu images done in %.2f s (%.2f images/s)\n", __func__, n_finished, n_images, t_seconds, n_finished / t_seconds);
+    llama_print_timings(ctx);
+
+    for (llava_seq & seq : seqs) {
+        llama_sampling_free(seq.ctx_sampling);
+    }
+    llama_batch_free(batch);
+    llama_batch_free(batch_embd);
+    llava_free(ctx_llava);
+    return status;
+}
+
 static void llama_log_callback_logTee(ggml_log_level level, const char * text, void * user_data) {
     (void) level;
     (void) user_data;
@@ -311,6 +677,10 @@ int llava_cli(int argc, char ** argv, gpt_params & params) {
         return 1;
     }
 
+    if (params.n_parallel > 1 && params.image.size() > 1) {
+        return llava_batch(params, model);
+    }
+
     for (auto & image : params.image) {
         auto ctx_llava = llava_init_context(&params, model);
 
@@ -247,16 +247,18 @@ static bool encode_image_with_clip(clip_ctx * ctx_clip, int n_threads, const cli
         }
     } else {
         // spatial_unpad llava-1.6 type embedding
-        // TODO: CLIP needs batching support - in HF the llm projection is separate after encoding, which might be a solution to quickly get batching working
+        // all the subimages are encoded by a single graph
+        const size_t n_embd = clip_embd_nbytes(ctx_clip) / sizeof(float); // 576 patches * 4096 embeddings
+        std::vector<float> image_embd_all(n_embd * img_res_v.size);
         std::vector<float *> image_embd_v;
         image_embd_v.resize(img_res_v.size);
         for (size_t i = 0; i < img_res_v.size; i++) {
-            image_embd_v[i] = (float *)malloc(clip_embd_nbytes(ctx_clip)); // 576 patches * 4096 embeddings * 4 bytes = 9437184
-            const bool encoded = clip_image_encode(ctx_clip, n_threads, &img_res_v.data[i], image_embd_v[i]); // image data is in 3x336x336 format and will be converted to 336x336x3 inside
-            if (!encoded) {
-                LOG_TEE("Unable to encode image - spatial_unpad - subimage %d of %d\n", (int) i+1, (int) img_res_v.size);
-                return false;
-            }
+            image_embd_v[i] = image_embd_all.data() + i * n_embd;
+        }
+        if (!clip_image_batch_encode(ctx_clip, n_threads, &img_res_v, image_embd_all.data())) { // image data is in 3x336x336 format and will be converted to 336x336x3 inside
+            LOG_TEE("Unable to encode image - spatial_unpad - %d subimages\n", (int) img_res_v.size);
+            delete[] img_res_v.data;
+            return false;
         }
         const int64_t t_img_enc_batch_us = ggml_time_us();
         LOG_TEE("%s: %d segments encoded in %8.2f ms\n", __func__, (int)img_res_v.size, (t_img_enc_batch_us - t_img_enc_start_us) / 1000.0);
@@ -281,9 +283,6 @@ static bool encode_image_with_clip(clip_ctx * ctx_clip, int n_threads, const cli
         clip_llava_handle_patches(ctx_clip, image_embd_v, grid_shape, image_embd, &n_img_pos_out);
         *n_img_pos = n_img_pos_out;
 
-        for (size_t i = 0; i < image_embd_v.size(); i++) {
-            free(image_embd_v[i]);
-        }
         image_embd_v.clear();
 
         // debug image/segment/normalization content:
@@ -11,6 +11,7 @@ LLAMA_CPP_MAIN_OBJS = $(LLAMA_CPP_MAIN_SRCS:%.cpp=o/$(MODE)/%.o)
 o/$(MODE)/llama.cpp/main/main:					\
 		o/$(MODE)/llama.cpp/main/main.o			\
 		o/$(MODE)/llama.cpp/main/embedding.o		\
+		o/$(MODE)/llama.cpp/main/batch.o		\
 		o/$(MODE)/llama.cpp/server/server.a		\
 		o/$(MODE)/llama.cpp/llava/llava.a		\
 		o/$(MODE)/llama.cpp/llama.cpp.a			\
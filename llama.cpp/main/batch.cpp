@@ -0,0 +1,272 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+
+#include "llama.cpp/common.h"
+#include "llama.cpp/llama.h"
+#include "llama.cpp/json.h"
+#include "llama.cpp/sampling.h"
+#include "llamafile/llamafile.h"
+
+#include <cinttypes>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// generates completions for a jsonl file of prompts
+//
+// each line of --batch-file is a prompt string, or an object with a
+// "prompt" and optionally an "id" and "n_predict". up to --parallel
+// prompts are generated at once, as sequences of one context decoded
+// in the same batches, and the sequence of a prompt that finishes is
+// given the next one right away. every completion is written to stdout
+// as a line of json once it's done, so they come out of order and carry
+// the index of their input line.
+
+using json = nlohmann::json;
+
+struct batch_seq {
+    llama_seq_id id;
+    bool active = false;
+    size_t index;  // line of the prompt in the batch file
+    json user_id;  // "id" of the prompt, if it had one
+    int n_prompt;
+    int n_past;
+    int n_predict;
+    int n_decoded;
+    int32_t i_batch = -1;  // index of the logits to sample from
+    llama_token sampled;
+    std::string content;
+    llama_sampling_context * ctx_sampling = nullptr;
+};
+
+struct batch_reader {
+    FILE * f;
+    size_t n_lines = 0;
+    char * buf = nullptr;
+    size_t cap = 0;
+
+    ~batch_reader() {
+        free(buf);
+    }
+
+    // returns the next prompt, or false at the end of the file
+    bool next(json & prompt, size_t * index) {
+        ssize_t len;
+        while ((len = getline(&buf, &cap, f)) != -1) {
+            *index = n_lines++;
+            std::string line(buf, len);
+            if (line.find_first_not_of(" \t\r\n") == std::string::npos) {
+                continue;
+            }
+            prompt = json::parse(line, nullptr, false);
+            if (prompt.is_discarded()) {
+                fprintf(stderr, "%s:%zu: error: invalid json\n", __func__, *index + 1);
+                continue;
+            }
+            if (prompt.is_string()) {
+                prompt = json{{"prompt", prompt}};
+            }
+            if (!prompt.is_object() || !prompt.contains("prompt") || !prompt["prompt"].is_string()) {
+                fprintf(stderr, "%s:%zu: error: expected a string or an object with a prompt\n", __func__, *index + 1);
+                continue;
+            }
+            return true;
+        }
+        return false;
+    }
+};
+
+static void batch_write(const batch_seq & seq, const char * stop) {
+    json out = {
+        {"index", seq.index},
+        {"content", seq.content},
+        {"tokens_evaluated", seq.n_prompt},
+        {"tokens_predicted", seq.n_decoded},
+        {"stop", stop},
+    };
+    if (!seq.user_id.is_null()) {
+        out["id"] = seq.user_id;
+    }
+    std::string line = out.dump(-1, ' ', false, json::error_handler_t::replace);
+    line += '\n';
+    fwrite(line.data(), line.size(), 1, stdout);
+    fflush(stdout);
+}
+
+// returns the stop string content ends with, if any
+static const std::string * batch_stop_string(const std::string & content, const std::vector<std::string> & antiprompt) {
+    for (const std::string & s : antiprompt) {
+        if (!s.empty() && content.size() >= s.size() &&
+            !content.compare(content.size() - s.size(), s.size(), s)) {
+            return &s;
+        }
+    }
+    return nullptr;
+}
+
+int batch_cli(int argc, char ** argv) {
+    gpt_params params;
+
+    if (!gpt_params_parse(argc, argv, params)) {
+        return 1;
+    }
+
+    FILE * f = params.batch_file == "-" ? stdin : fopen(params.batch_file.c_str(), "r");
+    if (!f) {
+        fprintf(stderr, "%s: error: failed to open '%s': %s\n", __func__, params.batch_file.c_str(), strerror(errno));
+        return 1;
+    }
+
+    if (params.seed == LLAMA_DEFAULT_SEED) {
+        params.seed = _rand64();
+    }
+    params.n_parallel = std::max(params.n_parallel, 1);
+
+    llama_backend_init();
+    llama_numa_init(params.numa);
+
+    llama_model * model;
+    llama_context * ctx;
+    std::tie(model, ctx) = llama_init_from_gpt_params(params);
+    if (model == NULL) {
+        fprintf(stderr, "%s: error: unable to load model\n", __func__);
+        return 1;
+    }
+
+    // each sequence gets an equal share of the kv cache
+    const int n_ctx_seq = llama_n_ctx(ctx) / params.n_parallel;
+    const int32_t n_batch = llama_n_batch(ctx);
+
+    std::vector<batch_seq> seqs(params.n_parallel);
+    for (int i = 0; i < params.n_parallel; ++i) {
+        seqs[i].id = i;
+        seqs[i].ctx_sampling = llama_sampling_init(params.sparams);
+    }
+
+    batch_reader reader;
+    reader.f = f;
+    // sequences never hold more than n_ctx tokens between them
+    llama_batch batch = llama_batch_init(llama_n_ctx(ctx), 0, 1);
+    size_t n_done = 0;
+    size_t n_failed = 0;
+    int64_t n_tokens_predicted = 0;
+    const int64_t t_start = ggml_time_us();
+    bool eof = false;
+
+    for (;;) {
+        llama_batch_clear(batch);
+
+        // the tokens sampled last time around
+        int n_active = 0;
+        for (batch_seq & seq : seqs) {
+            if (seq.active) {
+                seq.i_batch = batch.n_tokens;
+                llama_batch_add(batch, seq.sampled, seq.n_past++, {seq.id}, true);
+                ++n_active;
+            }
+        }
+
+        // refill the sequences that are free with new prompts
+        for (batch_seq & seq : seqs) {
+            while (!seq.active && !eof) {
+                json prompt;
+                if (!reader.next(prompt, &seq.index)) {
+                    eof = true;
+                    break;
+                }
+                std::vector<llama_token> tokens = ::llama_tokenize(ctx, prompt["prompt"].get<std::string>(), true, true);
+                seq.user_id = prompt.contains("id") ? prompt["id"] : json();
+                seq.n_predict = prompt.value("n_predict", params.n_predict);
+                seq.n_prompt = tokens.size();
+                seq.n_past = 0;
+                seq.n_decoded = 0;
+                seq.content.clear();
+                if (tokens.empty() || (int) tokens.size() >= n_ctx_seq) {
+                    batch_write(seq, "prompt_too_long");
+                    ++n_failed;
+                    continue;
+                }
+                llama_sampling_reset(seq.ctx_sampling);
+                llama_sampling_set_rng_seed(seq.ctx_sampling, params.seed + seq.index);
+                for (size_t j = 0; j < tokens.size(); ++j) {
+                    llama_batch_add(batch, tokens[j], seq.n_past++, {seq.id}, j == tokens.size() - 1);
+                    llama_sampling_accept(seq.ctx_sampling, ctx, tokens[j], false);
+                }
+                seq.i_batch = batch.n_tokens - 1;
+                seq.active = true;
+                ++n_active;
+            }
+        }
+
+        if (!n_active) {
+            break;
+        }
+
+        // prompts can make the batch larger than n_batch
+        for (int32_t i = 0; i < batch.n_tokens; i += n_batch) {
+            const int32_t n_tokens = std::min(n_batch, batch.n_tokens - i);
+            llama_batch batch_view = {
+                n_tokens,
+                batch.token    + i,
+                nullptr,
+                batch.pos      + i,
+                batch.n_seq_id + i,
+                batch.seq_id   + i,
+                batch.logits   + i,
+                0, 0, 0, // unused
+            };
+            if (llama_decode(ctx, batch_view)) {
+                fprintf(stderr, "%s: error: failed to decode batch\n", __func__);
+                return 1;
+            }
+
+            for (batch_seq & seq : seqs) {
+                if (!seq.active || seq.i_batch < i || seq.i_batch >= i + n_tokens) {
+                    continue;
+                }
+                const llama_token id = llama_sampling_sample(seq.ctx_sampling, ctx, NULL, seq.i_batch - i);
+                llama_sampling_accept(seq.ctx_sampling, ctx, id, true);
+                seq.i_batch = -1;
+                seq.sampled = id;
+                ++seq.n_decoded;
+                ++n_tokens_predicted;
+
+                const char * stop = nullptr;
+                if (llama_token_is_eog(model, id)) {
+                    stop = "eos";
+                } else {
+                    seq.content += llama_token_to_piece(ctx, id);
+                    if (const std::string * s = batch_stop_string(seq.content, params.antiprompt)) {
+                        seq.content.resize(seq.content.size() - s->size());
+                        stop = "word";
+                    } else if ((seq.n_predict >= 0 && seq.n_decoded >= seq.n_predict) || seq.n_past >= n_ctx_seq) {
+                        stop = "limit";
+                    }
+                }
+                if (stop) {
+                    batch_write(seq, stop);
+                    llama_kv_cache_seq_rm(ctx, seq.id, -1, -1);
+                    seq.active = false;
+                    ++n_done;
+                }
+            }
+        }
+    }
+
+    const double t_seconds = (ggml_time_us() - t_start) / 1e6;
+    fprintf(stderr, "%s: %zu completions, %zu prompts skipped, %" PRId64 " tokens predicted in %.2f s (%.2f tokens/s)\n",
+            __func__, n_done, n_failed, n_tokens_predicted, t_seconds, n_tokens_predicted / t_seconds);
+
+    for (batch_seq & seq : seqs) {
+        llama_sampling_free(seq.ctx_sampling);
+    }
+    llama_batch_free(batch);
+    llama_print_timings(ctx);
+    llama_free(ctx);
+    llama_free_model(model);
+    llama_backend_free();
+    if (f != stdin) {
+        fclose(f);
+    }
+    return 0;
+}
@@ -5,7 +5,9 @@
 #include "llama.cpp/llama.h"
 #include "llamafile/llamafile.h"
 
+#include <cstdio>
 #include <ctime>
+#include <future>
 
 #if defined(_MSC_VER)
 #pragma warning(disable: 4244 4267) // possible loss of data
@@ -63,6 +65,191 @@ static void batch_decode(llama_context * ctx, llama_batch & batch, float * outpu
     }
 }
 
+// writes embeddings to stdout in the format chosen by --embd-format
+struct embd_writer {
+    std::string format;
+    int n_embd;
+    size_t n_rows = 0;
+    std::string line;
+    std::vector<ggml_fp16_t> half;
+
+    enum { NPY_HEADER_SIZE = 128 };
+
+    // numpy can't be told the shape afterwards, so the header is written
+    // with room for any row count and filled in by end()
+    bool write_npy_header() {
+        char header[NPY_HEADER_SIZE];
+        memcpy(header, "\x93NUMPY\x01\x00", 8);
+        header[8] = NPY_HEADER_SIZE - 10; // little endian length of what follows
+        header[9] = 0;
+        int n = snprintf(header + 10, sizeof(header) - 10,
+                         "{'descr': '<f4', 'fortran_order': False, 'shape': (%20zu, %d), }",
+                         n_rows, n_embd);
+        if (n < 0 || 10 + n >= NPY_HEADER_SIZE) {
+            return false;
+        }
+        memset(header + 10 + n, ' ', NPY_HEADER_SIZE - 10 - n);
+        header[NPY_HEADER_SIZE - 1] = '\n';
+        return fwrite(header, NPY_HEADER_SIZE, 1, stdout) == 1;
+    }
+
+    bool begin() {
+        if (format != "npy") {
+            return true;
+        }
+        if (fseeko(stdout, 0, SEEK_CUR)) {
+            fprintf(stderr, "error: --embd-format npy needs stdout to be a seekable file\n");
+            return false;
+        }
+        return write_npy_header();
+    }
+
+    bool write(const float * emb, int n) {
+        n_rows += n;
+        if (format == "text") {
+            for (int j = 0; j < n; ++j) {
+                line.clear();
+                char buf[32];
+                for (int i = 0; i < n_embd; ++i) {
+                    int k = snprintf(buf, sizeof(buf), i ? " %g" : "%g", emb[j * n_embd + i]);
+                    line.append(buf, k);
+                }
+                line += '\n';
+                if (fwrite(line.data(), line.size(), 1, stdout) != 1) {
+                    return false;
+                }
+            }
+            return !fflush(stdout);
+        }
+        if (format == "f16") {
+            half.resize((size_t) n * n_embd);
+            ggml_fp32_to_fp16_row(emb, half.data(), half.size());
+            return fwrite(half.data(), sizeof(ggml_fp16_t), half.size(), stdout) == half.size();
+        }
+        return fwrite(emb, sizeof(float), (size_t) n * n_embd, stdout) == (size_t) n * n_embd;
+    }
+
+    bool end() {
+        if (format == "npy" && (fseeko(stdout, 0, SEEK_SET) || !write_npy_header())) {
+            return false;
+        }
+        return !fflush(stdout);
+    }
+};
+
+// reads and tokenizes lines of the --embd-input file a batch at a time
+struct embd_reader {
+    FILE * f;
+    llama_context * ctx;
+    llama_token sep;
+    size_t n_batch;
+    size_t n_truncated = 0;
+    std::vector<llama_token> carry; // line that didn't fit in the last batch
+    char * buf = nullptr;
+    size_t cap = 0;
+
+    ~embd_reader() {
+        free(buf);
+    }
+
+    // returns the token lists of as many lines as fit in n_batch tokens,
+    // or nothing at the end of the input
+    std::vector<std::vector<llama_token>> read_batch() {
+        std::vector<std::vector<llama_token>> inputs;
+        size_t n_tokens = 0;
+        if (!carry.empty()) {
+            n_tokens = carry.size();
+            inputs.push_back(std::move(carry));
+            carry.clear();
+        }
+        ssize_t len;
+        while ((len = getline(&buf, &cap, f)) != -1) {
+            while (len && (buf[len - 1] == '\n' || buf[len - 1] == '\r')) {
+                --len;
+            }
+            std::vector<llama_token> inp = ::llama_tokenize(ctx, std::string(buf, len), true, false);
+            if (inp.empty() || inp.back() != sep) {
+                inp.push_back(sep);
+            }
+            if (inp.size() > n_batch) {
+                inp.resize(n_batch - 1);
+                inp.push_back(sep);
+                ++n_truncated;
+            }
+            if (n_tokens + inp.size() > n_batch) {
+                carry = std::move(inp);
+                break;
+            }
+            n_tokens += inp.size();
+            inputs.push_back(std::move(inp));
+        }
+        return inputs;
+    }
+};
+
+// embeds each line of --embd-input, decoding one batch while the next
+// one is read and tokenized, and writing embeddings as batches finish
+static int embedding_stream(gpt_params & params, llama_model * model, llama_context * ctx) {
+    FILE * f = params.embd_input == "-" ? stdin : fopen(params.embd_input.c_str(), "r");
+    if (!f) {
+        fprintf(stderr, "%s: error: failed to open '%s': %s\n", __func__, params.embd_input.c_str(), strerror(errno));
+        return 1;
+    }
+
+    const int n_embd = llama_n_embd(model);
+    embd_writer writer;
+    writer.format = params.embd_format;
+    writer.n_embd = n_embd;
+    if (!writer.begin()) {
+        return 1;
+    }
+
+    embd_reader reader;
+    reader.f = f;
+    reader.ctx = ctx;
+    reader.sep = llama_token_sep(model);
+    reader.n_batch = params.n_batch;
+
+    struct llama_batch batch = llama_batch_init(params.n_batch, 0, 1);
+    std::vector<float> embeddings;
+    std::vector<std::vector<llama_token>> inputs = reader.read_batch();
+    int status = 0;
+    while (!inputs.empty()) {
+        llama_batch_clear(batch);
+        for (size_t s = 0; s < inputs.size(); ++s) {
+            batch_add_seq(batch, inputs[s], s);
+        }
+        const int n_seq = inputs.size();
+
+        // the reader only touches the vocab, so it can run during decode
+        std::future<std::vector<std::vector<llama_token>>> next =
+            std::async(std::launch::async, [&reader] { return reader.read_batch(); });
+
+        embeddings.assign((size_t) n_seq * n_embd, 0);
+        batch_decode(ctx, batch, embeddings.data(), n_seq, n_embd);
+        if (!writer.write(embeddings.data(), n_seq)) {
+            fprintf(stderr, "%s: error: failed to write embeddings: %s\n", __func__, strerror(errno));
+            next.wait();
+            status = 1;
+            break;
+        }
+        inputs = next.get();
+    }
+
+    if (!status && !writer.end()) {
+        fprintf(stderr, "%s: error: failed to write embeddings: %s\n", __func__, strerror(errno));
+        status = 1;
+    }
+    LOG_TEE("%s: embedded %zu lines, %zu of which were truncated to %d tokens\n",
+            __func__, writer.n_rows, reader.n_truncated, params.n_batch);
+
+    llama_batch_free(batch);
+    if (f != stdin) {
+        fclose(f);
+    }
+    return status;
+}
+
 static void llama_log_callback_logTee(ggml_log_level level, const char * text, void * user_data) {
     (void) level;
     (void) user_data;
@@ -126,6 +313,16 @@ int embedding_cli(int argc, char ** argv) {
         LOG("%s\n", get_system_info(params).c_str());
     }
 
+    if (!params.embd_input.empty()) {
+        GGML_ASSERT(params.n_batch >= params.n_ctx);
+        int status = embedding_stream(params, model, ctx);
+        llama_print_timings(ctx);
+        llama_free(ctx);
+        llama_free_model(model);
+        llama_backend_free();
+        return status;
+    }
+
     // split the prompt into lines
     std::vector<std::string> prompts = split_lines(params.prompt, params.multiline_input);
 
@@ -206,7 +403,16 @@ int embedding_cli(int argc, char ** argv) {
     // [jart] print very carefully so this tool can be shell scriptable
     // print the first part of the embeddings or for a single prompt, the full embedding
     bool demo_mode = n_prompts > 1 && params.interactive;
-    for (int j = 0; j < n_prompts; j++) {
+    if (params.embd_format != "text") {
+        embd_writer writer;
+        writer.format = params.embd_format;
+        writer.n_embd = n_embd;
+        if (!writer.begin() || !writer.write(emb, n_prompts) || !writer.end()) {
+            fprintf(stderr, "%s: error: failed to write embeddings: %s\n", __func__, strerror(errno));
+            return 1;
+        }
+    }
+    for (int j = 0; params.embd_format == "text" && j < n_prompts; j++) {
         LOG("embedding %d: ", j);
         int display_count = n_embd;
         if (demo_mode) {
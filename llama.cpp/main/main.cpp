@@ -20,6 +20,7 @@
 #include <stdatomic.h>
 #include <third_party/nsync/futex.internal.h>
 
+#include "llamafile/trace.h"
 #include "llamafile/version.h"
 #include "llama.cpp/llama.h"
 #include "llama.cpp/common.h"
@@ -102,6 +103,7 @@ static void *safe_sigint_handler(void *arg) {
     printf("\n");
     llama_print_timings(*g_ctx);
     write_logfile(*g_ctx, *g_params, *g_model, *g_input_tokens, g_output_ss->str(), *g_output_tokens);
+    llamafile_trace_end();
     _exit(128 + SIGINT);
 }
 
@@ -156,6 +158,11 @@ int main(int argc, char ** argv) {
     LoadZipArgs(&argc, &argv);
     launch_sigint_thread();
 
+    if (llamafile_has(argv, "--batch-file")) {
+        int batch_cli(int, char **);
+        return batch_cli(argc, argv);
+    }
+
     if (!llamafile_has(argv, "--cli") &&
         (llamafile_has(argv, "--server") ||
          (!llamafile_has(argv, "-p") &&
@@ -772,7 +779,7 @@ int main(int argc, char ** argv) {
             // optionally save the session on first sample (for faster prompt loading next time)
             if (!path_session.empty() && need_to_save_session && !params.prompt_cache_ro) {
                 need_to_save_session = false;
-                llama_state_save_file(ctx, path_session.c_str(), session_tokens.data(), session_tokens.size());
+                llama_state_append_file(ctx, path_session.c_str(), session_tokens.data(), session_tokens.size(), params.prompt_cache_compress);
 
                 LOG("saved session to %s\n", path_session.c_str());
             }
@@ -1022,7 +1029,7 @@ int main(int argc, char ** argv) {
 
     if (!path_session.empty() && params.prompt_cache_all && !params.prompt_cache_ro) {
         LOG_TEE("\n%s: saving final output to session file '%s'\n", __func__, path_session.c_str());
-        llama_state_save_file(ctx, path_session.c_str(), session_tokens.data(), session_tokens.size());
+        llama_state_append_file(ctx, path_session.c_str(), session_tokens.data(), session_tokens.size(), params.prompt_cache_compress);
     }
 
     llama_print_timings(ctx);
@@ -10,11 +10,17 @@
 #include <sstream>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
+#include <functional>
 #include <atomic>
 #include <vector>
 #include <array>
 #include <fstream>
 #include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #if defined(_MSC_VER)
 #pragma warning(disable: 4244 4267) // possible loss of data
@@ -151,8 +157,85 @@ static double log_softmax(int n_vocab, const float * logits, uint16_t * log_prob
     return max_logit + log_sum_exp - logits[tok];
 }
 
+// threads that are started once and then reused for every batch, since
+// creating them anew each time costs more than the work of small batches
+struct thread_pool {
+    explicit thread_pool(int n_threads) {
+        for (int i = 1; i < n_threads; ++i) {
+            threads.emplace_back(&thread_pool::worker, this, i);
+        }
+    }
+
+    ~thread_pool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+        cv_work.notify_all();
+        for (auto & t : threads) {
+            t.join();
+        }
+    }
+
+    // number of threads, including the one calling run()
+    size_t size() const {
+        return threads.size() + 1;
+    }
+
+    // calls compute() on n threads (0 = all of them) and waits for them
+    void run(const std::function<void()> & compute, size_t n = 0) {
+        n = n ? std::min(n, size()) : size();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job     = &compute;
+            n_job   = n;
+            pending = threads.size();
+            ++generation;
+        }
+        cv_work.notify_all();
+        compute();
+        std::unique_lock<std::mutex> lock(mutex);
+        cv_done.wait(lock, [this] { return pending == 0; });
+        job = nullptr;
+    }
+
+private:
+    void worker(size_t ith) {
+        int seen = 0;
+        while (true) {
+            const std::function<void()> * compute;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv_work.wait(lock, [this, seen] { return quit || generation != seen; });
+                if (quit) {
+                    return;
+                }
+                seen = generation;
+                compute = ith < n_job ? job : nullptr;
+            }
+            if (compute) {
+                (*compute)();
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--pending == 0) {
+                cv_done.notify_one();
+            }
+        }
+    }
+
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable cv_work;
+    std::condition_variable cv_done;
+    const std::function<void()> * job = nullptr;
+    size_t n_job = 0;
+    size_t pending = 0;
+    int generation = 0;
+    bool quit = false;
+};
+
 static void process_logits(
-    int n_vocab, const float * logits, const int * tokens, int n_token, std::vector<std::thread> & workers,
+    int n_vocab, const float * logits, const int * tokens, int n_token, thread_pool & workers,
     double & nll, double & nll2, float * logit_history, float * prob_history
 ) {
     std::mutex mutex;
@@ -177,17 +260,11 @@ static void process_logits(
             prob_history[i]  = results.prob;
         }
     };
-    for (auto & w : workers) {
-        w = std::thread(compute);
-    }
-    compute();
-    for (auto & w : workers) {
-        w.join();
-    }
+    workers.run(compute);
 }
 
 static void process_logits(std::ostream& out, int n_vocab, const float * logits, const int * tokens, int n_token,
-        std::vector<std::thread> & workers, std::vector<uint16_t> & log_probs, double & nll, double & nll2) {
+        thread_pool & workers, std::vector<uint16_t> & log_probs, double & nll, double & nll2) {
     std::mutex mutex;
     const int nv = 2*((n_vocab + 1)/2) + 4;
     int counter = 0;
@@ -207,13 +284,7 @@ static void process_logits(std::ostream& out, int n_vocab, const float * logits,
             local_nll2 += v*v;
         }
     };
-    for (auto & w : workers) {
-        w = std::thread(compute);
-    }
-    compute();
-    for (auto & w : workers) {
-        w.join();
-    }
+    workers.run(compute);
     out.write((const char *)log_probs.data(), n_token*nv*sizeof(uint16_t));
 }
 
@@ -295,12 +366,12 @@ static std::pair<double, float> log_softmax(int n_vocab, const float * logits, c
 }
 
 static void process_logits(int n_vocab, const float * logits, const int * tokens, int n_token,
-        std::vector<std::thread> & workers, const std::vector<uint16_t> & base_log_probs, kl_divergence_result & kld,
+        thread_pool & workers, const uint16_t * base_log_probs, kl_divergence_result & kld,
         float * kld_values, float * p_diff_values) {
     std::mutex mutex;
     const int nv = 2*((n_vocab + 1)/2) + 4;
     int counter = 0;
-    auto compute = [&mutex, &counter, &base_log_probs, &kld, n_vocab, logits, tokens, n_token, nv, kld_values, p_diff_values] () {
+    auto compute = [&mutex, &counter, base_log_probs, &kld, n_vocab, logits, tokens, n_token, nv, kld_values, p_diff_values] () {
         kl_divergence_result local_kld;
         while (true) {
             std::unique_lock<std::mutex> lock(mutex);
@@ -322,18 +393,12 @@ static void process_logits(int n_vocab, const float * logits, const int * tokens
                 break;
             }
             lock.unlock();
-            std::pair<double, float> v = log_softmax(n_vocab, logits + i*n_vocab, base_log_probs.data() + i*nv, tokens[i+1], local_kld);
+            std::pair<double, float> v = log_softmax(n_vocab, logits + i*n_vocab, base_log_probs + (size_t)i*nv, tokens[i+1], local_kld);
             kld_values[i]    = (float)v.first;
             p_diff_values[i] = v.second;
         }
     };
-    for (auto & w : workers) {
-        w = std::thread(compute);
-    }
-    compute();
-    for (auto & w : workers) {
-        w.join();
-    }
+    workers.run(compute);
 }
 
 static results_perplexity perplexity_v2(llama_context * ctx, const gpt_params & params) {
@@ -536,14 +601,17 @@ static results_perplexity perplexity(llama_context * ctx, const gpt_params & par
 
     llama_batch batch = llama_batch_init(std::min(n_batch, n_ctx*n_seq), 0, 1);
 
-    std::vector<float> logits;
-    if (num_batches > 1) {
-        logits.reserve((size_t)n_ctx * n_vocab);
-    }
+    // the running totals when each sequence of a pass was scored
+    struct ppl_total {
+        double nll;
+        double nll2;
+        int count;
+    };
+    std::vector<ppl_total> totals(n_seq);
 
     fprintf(stderr, "%s: calculating perplexity over %d chunks, n_ctx=%d, batch_size=%d, n_seq=%d\n", __func__, n_chunk, n_ctx, n_batch, n_seq);
 
-    std::vector<std::thread> workers(std::thread::hardware_concurrency() - 1);
+    thread_pool workers(std::thread::hardware_concurrency());
 
     std::vector<uint16_t> log_probs;
     if (!params.logits_file.empty()) {
@@ -551,7 +619,7 @@ static results_perplexity perplexity(llama_context * ctx, const gpt_params & par
         logits_stream.write((const char *)&n_chunk, sizeof(n_chunk));
         logits_stream.write((const char *)tokens.data(), n_chunk*n_ctx*sizeof(tokens[0]));
         const int nv = 2*((n_vocab + 1)/2) + 4;
-        log_probs.resize(n_ctx * nv);
+        log_probs.resize((size_t)std::min(n_ctx, n_batch) * nv);
     }
 
     // We get the logits for all the tokens in the context window (params.n_ctx)
@@ -583,8 +651,6 @@ static results_perplexity perplexity(llama_context * ctx, const gpt_params & par
             const int batch_start = start + j * n_batch;
             const int batch_size  = std::min(end - batch_start, n_batch);
 
-            int n_outputs = 0;
-
             batch.n_tokens = 0;
             for (int seq = 0; seq < n_seq_batch; seq++) {
                 int seq_start = batch_start + seq*n_ctx;
@@ -604,8 +670,6 @@ static results_perplexity perplexity(llama_context * ctx, const gpt_params & par
                     batch.n_seq_id[idx]    = 1;
                     batch.seq_id  [idx][0] = seq;
                     batch.logits  [idx]    = batch.pos[idx] >= first ? 1 : 0;
-
-                    n_outputs += batch.logits[idx] != 0;
                 }
                 batch.n_tokens += batch_size;
 
@@ -618,9 +682,28 @@ static results_perplexity perplexity(llama_context * ctx, const gpt_params & par
                 return {tokens, -1, logit_history, prob_history};
             }
 
-            if (num_batches > 1 && n_outputs > 0) {
-                const auto * batch_logits = llama_get_logits(ctx);
-                logits.insert(logits.end(), batch_logits, batch_logits + n_outputs * n_vocab);
+            // score the outputs of the batch right away, since the logits of
+            // a whole chunk don't fit in memory when the context is long
+            const int p0 = std::max(first, j*n_batch);
+            const int p1 = std::min(j*n_batch + batch_size, n_ctx - 1);
+            for (int seq = 0; seq < n_seq_batch; seq++) {
+                if (p0 < p1) {
+                    const float * batch_logits = llama_get_logits_ith(ctx, seq*n_ctx + p0 - j*n_batch);
+                    const size_t off = start + seq*n_ctx + p0;
+                    if (!params.logits_file.empty()) {
+                        process_logits(logits_stream, n_vocab, batch_logits,
+                                tokens.data() + off, p1 - p0,
+                                workers, log_probs, nll, nll2);
+                    } else {
+                        process_logits(n_vocab, batch_logits,
+                                tokens.data() + off, p1 - p0,
+                                workers, nll, nll2,
+                                logit_history.data() + off,
+                                prob_history.data()  + off);
+                    }
+                    count += p1 - p0;
+                }
+                totals[seq] = {nll, nll2, count};
             }
         }
 
@@ -639,35 +722,19 @@ static results_perplexity perplexity(llama_context * ctx, const gpt_params & par
         }
 
         for (int seq = 0; seq < n_seq_batch; seq++) {
-            const float * all_logits = num_batches > 1 ? logits.data() : llama_get_logits_ith(ctx, seq*n_ctx + first);
-
-            llama_token * tokens_data = tokens.data() + start + seq*n_ctx + first;
-            if (!params.logits_file.empty()) {
-                process_logits(logits_stream, n_vocab, all_logits,
-                        tokens_data, n_ctx - 1 - first,
-                        workers, log_probs, nll, nll2);
-            } else {
-                process_logits(n_vocab, all_logits,
-                        tokens_data, n_ctx - 1 - first,
-                        workers, nll, nll2,
-                        logit_history.data() + start + seq*n_ctx + first,
-                        prob_history.data()  + start + seq*n_ctx + first);
-            }
-            count += n_ctx - first - 1;
+            const ppl_total & t = totals[seq];
 
             // perplexity is e^(average negative log-likelihood)
             if (params.ppl_output_type == 0) {
-                printf("[%d]%.4lf,", i + seq + 1, std::exp(nll / count));
+                printf("[%d]%.4lf,", i + seq + 1, std::exp(t.nll / t.count));
             } else {
-                double av = nll/count;
-                double av2 = nll2/count - av*av;
-                if (av2 > 0) av2 = sqrt(av2/(count-1));
-                printf("%8d  %.4lf  %4lf  %4lf\n", i*n_ctx, std::exp(nll / count), av, av2);
+                double av = t.nll/t.count;
+                double av2 = t.nll2/t.count - av*av;
+                if (av2 > 0) av2 = sqrt(av2/(t.count-1));
+                printf("%8d  %.4lf  %4lf  %4lf\n", i*n_ctx, std::exp(t.nll / t.count), av, av2);
             }
         }
         fflush(stdout);
-
-        logits.clear();
     }
     printf("\n");
 
@@ -724,7 +791,7 @@ static bool decode_helper(llama_context * ctx, llama_batch & batch, std::vector<
 
 #define K_TOKEN_CHUNK 4
 
-static void compute_logprobs(const float * batch_logits, int n_vocab, std::vector<std::thread>& workers,
+static void compute_logprobs(const float * batch_logits, int n_vocab, thread_pool & workers,
         const std::vector<std::pair<size_t, llama_token>>& eval_pairs, std::vector<float>& eval_results) {
     if (eval_results.size() != eval_pairs.size()) {
         eval_results.resize(eval_pairs.size());
@@ -756,12 +823,7 @@ static void compute_logprobs(const float * batch_logits, int n_vocab, std::vecto
         }
     };
 
-    for (size_t it = 0; it < max_threads; ++it) {
-        workers[it] = std::thread(compute);
-    }
-    for (size_t it = 0; it < max_threads; ++it) {
-        workers[it].join();
-    }
+    workers.run(compute, max_threads);
 }
 
 static void hellaswag_score(llama_context * ctx, const gpt_params & params) {
@@ -893,7 +955,7 @@ static void hellaswag_score(llama_context * ctx, const gpt_params & params) {
 
     std::vector<std::pair<size_t, llama_token>> eval_pairs;
     std::vector<float> eval_results;
-    std::vector<std::thread> workers(std::thread::hardware_concurrency());
+    thread_pool workers(std::thread::hardware_concurrency());
 
     for (size_t i0 = 0; i0 < hs_task_count; i0++) {
         int n_cur = 0;
@@ -1175,7 +1237,7 @@ static void winogrande_score(llama_context * ctx, const gpt_params & params) {
 
     std::vector<std::pair<size_t, llama_token>> eval_pairs;
     std::vector<float> eval_results;
-    std::vector<std::thread> workers(std::thread::hardware_concurrency());
+    thread_pool workers(std::thread::hardware_concurrency());
 
     int n_correct = 0;
     int n_done    = 0;
@@ -1529,7 +1591,7 @@ static void multiple_choice_score(llama_context * ctx, const gpt_params & params
 
     std::vector<std::pair<size_t, llama_token>> eval_pairs;
     std::vector<float> eval_results;
-    std::vector<std::thread> workers(std::thread::hardware_concurrency());
+    thread_pool workers(std::thread::hardware_concurrency());
     std::vector<int> batch_indeces;
 
     int n_done = 0;
@@ -1689,36 +1751,72 @@ static void multiple_choice_score(llama_context * ctx, const gpt_params & params
     printf("\n");
 }
 
+// read-only mapping of the log-probabilities written by --kl-divergence-base
+// the kernel reads the file ahead of us, and we don't have to copy it
+struct logits_file_mapping {
+    const char * data = nullptr;
+    size_t size = 0;
+
+    bool open(const char * fname) {
+        int fd = ::open(fname, O_RDONLY);
+        if (fd == -1) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) || !st.st_size) {
+            close(fd);
+            return false;
+        }
+        void * p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED) {
+            return false;
+        }
+        madvise(p, st.st_size, MADV_SEQUENTIAL);
+        data = (const char *)p;
+        size = st.st_size;
+        return true;
+    }
+
+    ~logits_file_mapping() {
+        if (data) {
+            munmap((void *)data, size);
+        }
+    }
+};
+
 static void kl_divergence(llama_context * ctx, const gpt_params & params) {
     if (params.logits_file.empty()) {
         fprintf(stderr, "%s: you must provide a name of a file containing the log probabilities of the base model\n", __func__);
         return;
     }
-    std::ifstream in(params.logits_file.c_str(), std::ios::binary);
-    if (!in) {
+    logits_file_mapping in;
+    if (!in.open(params.logits_file.c_str())) {
         fprintf(stderr, "%s: failed to open %s\n", __func__, params.logits_file.c_str());
         return;
     }
+    size_t offset = 0;
+    auto read = [&in, &offset] (void * dst, size_t n) {
+        if (in.size - offset < n) {
+            return false;
+        }
+        memcpy(dst, in.data + offset, n);
+        offset += n;
+        return true;
+    };
     {
         char check[9]; check[8] = 0;
-        in.read(check, 8);
-        if (in.fail() || strncmp("_logits_", check, 8) != 0) {
+        if (!read(check, 8) || strncmp("_logits_", check, 8) != 0) {
             fprintf(stderr, "%s: %s does not look like a file containing log-probabilities\n", __func__, params.logits_file.c_str());
             return;
         }
     }
 
-    uint32_t n_ctx;
-    in.read((char *)&n_ctx, sizeof(n_ctx));
-    if (n_ctx > llama_n_ctx(ctx)) {
-        fprintf(stderr, "%s: %s has been computed with %u, while the current context is %d. Increase it with -c and retry\n",
-                __func__, params.logits_file.c_str(), n_ctx, params.n_ctx);
-    }
+    uint32_t n_ctx = 0;
+    read(&n_ctx, sizeof(n_ctx));
 
     int n_vocab, n_chunk;
-    in.read((char *)&n_vocab, sizeof(n_vocab));
-    in.read((char *)&n_chunk, sizeof(n_chunk));
-    if (in.fail()) {
+    if (!read(&n_vocab, sizeof(n_vocab)) || !read(&n_chunk, sizeof(n_chunk))) {
         fprintf(stderr, "%s: failed reading n_vocab, n_chunk from %s\n", __func__, params.logits_file.c_str());
         return;
     }
@@ -1727,7 +1825,7 @@ static void kl_divergence(llama_context * ctx, const gpt_params & params) {
     }
 
     std::vector<llama_token> tokens(n_ctx * n_chunk);
-    if (in.read((char *)tokens.data(), tokens.size()*sizeof(tokens[0])).fail()) {
+    if (!read(tokens.data(), tokens.size()*sizeof(tokens[0]))) {
         fprintf(stderr, "%s: failed reading evaluation tokens from %s\n", __func__, params.logits_file.c_str());
         return;
     }
@@ -1735,18 +1833,28 @@ static void kl_divergence(llama_context * ctx, const gpt_params & params) {
     const int n_batch = params.n_batch;
     const int num_batches = (n_ctx + n_batch - 1)/n_batch;
     const int nv = 2*((n_vocab + 1)/2) + 4;
+    const int first = n_ctx/2;
     const bool add_bos = llama_should_add_bos_token(llama_get_model(ctx));
     GGML_ASSERT(llama_add_eos_token(llama_get_model(ctx)) != 1);
 
-    std::vector<uint16_t> log_probs_uint16(size_t(n_ctx - 1 - n_ctx/2) * nv);
-    std::vector<float>    kld_values(size_t(n_ctx - 1 - n_ctx/2)*n_chunk);
-    std::vector<float> p_diff_values(size_t(n_ctx - 1 - n_ctx/2)*n_chunk);
-    std::vector<float> logits;
-    if (num_batches > 1) {
-        logits.reserve(n_ctx * n_vocab);
+    // evaluate as many chunks at once as fit in the batch and the context
+    const int n_seq = std::max(1, std::min({n_batch / (int)n_ctx, (int)(llama_n_ctx(ctx) / n_ctx), (int)llama_n_seq_max(ctx)}));
+    if (n_ctx * n_seq > llama_n_ctx(ctx)) {
+        fprintf(stderr, "%s: %s has been computed with %u, while the current context is %d. Increase it with -c and retry\n",
+                __func__, params.logits_file.c_str(), n_ctx, params.n_ctx);
     }
 
-    std::vector<std::thread> workers(std::thread::hardware_concurrency() - 1);
+    // log-probs for the second half of each chunk follow the tokens
+    const size_t chunk_log_probs = size_t(n_ctx - 1 - first) * nv;
+    const uint16_t * base_log_probs = (const uint16_t *)(in.data + offset);
+    const int n_chunk_read = std::min<size_t>(n_chunk, (in.size - offset) / (chunk_log_probs*sizeof(uint16_t)));
+
+    std::vector<float>    kld_values(size_t(n_ctx - 1 - first)*n_chunk);
+    std::vector<float> p_diff_values(size_t(n_ctx - 1 - first)*n_chunk);
+
+    llama_batch batch = llama_batch_init(std::min(n_batch, (int)n_ctx*n_seq), 0, 1);
+
+    thread_pool workers(std::thread::hardware_concurrency());
 
     auto mean_and_uncertainty = [] (double sum, double sum2, size_t count) {
         if (count < 1) {
@@ -1767,17 +1875,21 @@ static void kl_divergence(llama_context * ctx, const gpt_params & params) {
     };
 
     kl_divergence_result kld;
-    auto    kld_ptr =    kld_values.data();
-    auto p_diff_ptr = p_diff_values.data();
 
-    for (int i = 0; i < n_chunk; ++i) {
+    // the running totals when each sequence of a pass was scored
+    std::vector<kl_divergence_result> totals(n_seq);
+
+    for (int i = 0; i < n_chunk; i += n_seq) {
         const int start =     i * n_ctx;
         const int end   = start + n_ctx;
 
+        const int n_seq_batch = std::min(n_seq, n_chunk - i);
+
         const auto t_start = std::chrono::high_resolution_clock::now();
 
-        if (in.read((char *)log_probs_uint16.data(), log_probs_uint16.size()*sizeof(uint16_t)).fail()) {
-            fprintf(stderr, "%s: failed reading log-probs for chunk %d\n", __func__, i);
+        if (i + n_seq_batch > n_chunk_read) {
+            fprintf(stderr, "%s: failed reading log-probs for chunk %d\n", __func__, n_chunk_read);
+            llama_batch_free(batch);
             return;
         }
 
@@ -1788,35 +1900,59 @@ static void kl_divergence(llama_context * ctx, const gpt_params & params) {
             const int batch_start = start + j * n_batch;
             const int batch_size  = std::min(end - batch_start, n_batch);
 
-            // save original token and restore it after eval
-            const auto token_org = tokens[batch_start];
+            batch.n_tokens = 0;
+            for (int seq = 0; seq < n_seq_batch; seq++) {
+                int seq_start = batch_start + seq*n_ctx;
 
-            // add BOS token for the first batch of each chunk
-            if (add_bos && j == 0) {
-                tokens[batch_start] = llama_token_bos(llama_get_model(ctx));
+                // save original token and restore it after eval
+                const auto token_org = tokens[seq_start];
+
+                // add BOS token for the first batch of each chunk
+                if (add_bos && j == 0) {
+                    tokens[seq_start] = llama_token_bos(llama_get_model(ctx));
+                }
+
+                for (int k = 0; k < batch_size; ++k) {
+                    const int idx = seq*n_ctx + k;
+                    batch.token   [idx]    = tokens[seq_start + k];
+                    batch.pos     [idx]    = j*n_batch + k;
+                    batch.n_seq_id[idx]    = 1;
+                    batch.seq_id  [idx][0] = seq;
+                    batch.logits  [idx]    = batch.pos[idx] >= first ? 1 : 0;
+                }
+                batch.n_tokens += batch_size;
+
+                // restore the original token in case it was set to BOS
+                tokens[seq_start] = token_org;
             }
 
-            // TODO: use llama_batch.logits instead of relying on logits_all == true
-            if (llama_decode(ctx, llama_batch_get_one(tokens.data() + batch_start, batch_size, j * n_batch, 0))) {
+            if (llama_decode(ctx, batch)) {
                 fprintf(stderr, "%s : failed to eval\n", __func__);
+                llama_batch_free(batch);
                 return;
             }
 
-            // restore the original token in case it was set to BOS
-            tokens[batch_start] = token_org;
-
-            if (num_batches > 1) {
-                const auto * batch_logits = llama_get_logits(ctx);
-                logits.insert(logits.end(), batch_logits, batch_logits + batch_size * n_vocab);
+            // score the outputs of the batch right away, like perplexity()
+            const int p0 = std::max(first, j*n_batch);
+            const int p1 = std::min(j*n_batch + batch_size, (int)n_ctx - 1);
+            for (int seq = 0; seq < n_seq_batch; seq++) {
+                if (p0 < p1) {
+                    const size_t off = size_t(i + seq)*(n_ctx - 1 - first) + (p0 - first);
+                    process_logits(n_vocab, llama_get_logits_ith(ctx, seq*n_ctx + p0 - j*n_batch),
+                            tokens.data() + start + seq*n_ctx + p0, p1 - p0,
+                            workers, base_log_probs + off*nv, kld,
+                            kld_values.data() + off, p_diff_values.data() + off);
+                }
+                totals[seq] = kld;
             }
         }
 
-        const auto t_end = std::chrono::high_resolution_clock::now();
-
         if (i == 0) {
+            llama_synchronize(ctx);
+            const auto t_end = std::chrono::high_resolution_clock::now();
             const float t_total = std::chrono::duration<float>(t_end - t_start).count();
             fprintf(stderr, "%s: %.2f seconds per pass - ETA ", __func__, t_total);
-            int total_seconds = (int)(t_total * n_chunk);
+            int total_seconds = (int)(t_total*n_chunk/n_seq);
             if (total_seconds >= 60*60) {
                 fprintf(stderr, "%d hours ", total_seconds / (60*60));
                 total_seconds = total_seconds % (60*60);
@@ -1826,46 +1962,43 @@ static void kl_divergence(llama_context * ctx, const gpt_params & params) {
             printf("\nchunk             PPL               ln(PPL(Q)/PPL(base))          KL Divergence              Δp RMS            Same top p\n");
         }
 
-        const int first = n_ctx/2;
-        const float * all_logits = num_batches > 1 ? logits.data() : llama_get_logits(ctx);
-        process_logits(n_vocab, all_logits + first*n_vocab, tokens.data() + start + first, n_ctx - 1 - first,
-                workers, log_probs_uint16, kld, kld_ptr, p_diff_ptr);
-        p_diff_ptr += n_ctx - 1 - first;
-        kld_ptr    += n_ctx - 1 - first;
+        for (int seq = 0; seq < n_seq_batch; seq++) {
+            const kl_divergence_result & t = totals[seq];
 
-        printf("%4d", i+1);
+            printf("%4d", i + seq + 1);
 
-        auto log_ppl = mean_and_uncertainty(kld.sum_nll, kld.sum_nll2, kld.count);
-        const double ppl_val = exp(log_ppl.first);
-        const double ppl_unc = ppl_val * log_ppl.second; // ppl_unc = sqrt( (dexp(x) / dx) ** 2 * log_ppl.second ** 2 )
-        printf("    %9.4lf ± %9.4lf", ppl_val, ppl_unc);
+            auto log_ppl = mean_and_uncertainty(t.sum_nll, t.sum_nll2, t.count);
+            const double ppl_val = exp(log_ppl.first);
+            const double ppl_unc = ppl_val * log_ppl.second; // ppl_unc = sqrt( (dexp(x) / dx) ** 2 * log_ppl.second ** 2 )
+            printf("    %9.4lf ± %9.4lf", ppl_val, ppl_unc);
 
-        auto log_ppl_base = mean_and_uncertainty(kld.sum_nll_base, kld.sum_nll_base2, kld.count);
-        const double log_ppl_cov = covariance(kld.sum_nll, kld.sum_nll_base, kld.sum_nll_nll_base, kld.count);
-        const double log_ppl_ratio_val = log_ppl.first - log_ppl_base.first;
-        const double log_ppl_ratio_unc = sqrt(log_ppl.second*log_ppl.second + log_ppl_base.second*log_ppl_base.second - 2.0*log_ppl_cov);
-        printf("    %10.5lf ± %10.5lf", log_ppl_ratio_val, log_ppl_ratio_unc);
+            auto log_ppl_base = mean_and_uncertainty(t.sum_nll_base, t.sum_nll_base2, t.count);
+            const double log_ppl_cov = covariance(t.sum_nll, t.sum_nll_base, t.sum_nll_nll_base, t.count);
+            const double log_ppl_ratio_val = log_ppl.first - log_ppl_base.first;
+            const double log_ppl_ratio_unc = sqrt(log_ppl.second*log_ppl.second + log_ppl_base.second*log_ppl_base.second - 2.0*log_ppl_cov);
+            printf("    %10.5lf ± %10.5lf", log_ppl_ratio_val, log_ppl_ratio_unc);
 
-        auto kl_div = mean_and_uncertainty(kld.sum_kld, kld.sum_kld2, kld.count);
-        printf("    %10.5lf ± %10.5lf", kl_div.first, kl_div.second);
+            auto kl_div = mean_and_uncertainty(t.sum_kld, t.sum_kld2, t.count);
+            printf("    %10.5lf ± %10.5lf", kl_div.first, kl_div.second);
 
-        auto p_diff_mse   = mean_and_uncertainty(kld.sum_p_diff2, kld.sum_p_diff4, kld.count);
-        const double p_diff_rms_val = sqrt(p_diff_mse.first);
-        const double p_diff_rms_unc = 0.5/p_diff_rms_val * p_diff_mse.second;
-        printf("    %6.3lf ± %6.3lf %%", 100.0*p_diff_rms_val, 100.0*p_diff_rms_unc);
+            auto p_diff_mse   = mean_and_uncertainty(t.sum_p_diff2, t.sum_p_diff4, t.count);
+            const double p_diff_rms_val = sqrt(p_diff_mse.first);
+            const double p_diff_rms_unc = 0.5/p_diff_rms_val * p_diff_mse.second;
+            printf("    %6.3lf ± %6.3lf %%", 100.0*p_diff_rms_val, 100.0*p_diff_rms_unc);
 
-        double p_top_val = 1.*kld.n_same_top/kld.count;
-        double p_top_unc = sqrt(p_top_val*(1 - p_top_val)/(kld.count - 1));
-        printf("    %6.3lf ± %6.3lf %%", 100.0*p_top_val, 100.0*p_top_unc);
+            double p_top_val = 1.*t.n_same_top/t.count;
+            double p_top_unc = sqrt(p_top_val*(1 - p_top_val)/(t.count - 1));
+            printf("    %6.3lf ± %6.3lf %%", 100.0*p_top_val, 100.0*p_top_unc);
 
-        printf("\n");
+            printf("\n");
+        }
 
         fflush(stdout);
-
-        logits.clear();
     }
     printf("\n");
 
+    llama_batch_free(batch);
+
     if (kld.count < 100) return; // we do not wish to do statistics on so few values
 
     std::sort(kld_values.begin(), kld_values.end());
@@ -1996,7 +2129,7 @@ int main(int argc, char ** argv) {
 
     const bool ppl = !params.hellaswag && !params.winogrande && !params.multiple_choice && !params.kl_divergence;
 
-    if (ppl) {
+    if (ppl || params.kl_divergence) {
         const int32_t n_seq = std::max(1, params.n_batch / n_ctx);
         const int32_t n_kv = n_seq * n_ctx;
 
@@ -3,37 +3,97 @@
 
 #define LLAMA_API_INTERNAL
 #include "sampling.h"
+#include "llamafile/flight.h"
+#include "llamafile/trace.h"
+#include <cstring>
+#include <functional>
+#include <mutex>
 #include <random>
 
+#define TOP_K_BITS 11
+
+// grammars compiled for earlier requests are kept, since clients tend to
+// send the same few grammars over and over, and parsing a big one costs
+// more than generating a token. the masks of allowed tokens that grammars
+// build as they're used are cached by llama.cpp, keyed on the rules.
+#define LLAMA_SAMPLING_MAX_GRAMMARS 32
+
+struct llama_sampling_grammar {
+    size_t                      hash;
+    std::string                 text;
+    grammar_parser::parse_state parsed;
+    llama_grammar             * initial = nullptr; // copied by each context, never advanced
+
+    ~llama_sampling_grammar() {
+        llama_grammar_free(initial);
+    }
+};
+
+static std::mutex                                                 g_grammars_lock;
+static std::vector<std::shared_ptr<const llama_sampling_grammar>> g_grammars; // most recently used last
+
+// returns compiled grammar, or null if it's invalid
+static std::shared_ptr<const llama_sampling_grammar> llama_sampling_compile_grammar(const std::string & text) {
+    const size_t hash = std::hash<std::string>()(text);
+    {
+        std::lock_guard<std::mutex> lock(g_grammars_lock);
+        for (size_t i = 0; i < g_grammars.size(); i++) {
+            auto grammar = g_grammars[i];
+            if (grammar->hash == hash && grammar->text == text) {
+                g_grammars.erase(g_grammars.begin() + i);
+                g_grammars.push_back(grammar);
+                return grammar;
+            }
+        }
+    }
+
+    grammar_parser::parse_state parsed = grammar_parser::parse(text.c_str());
+
+    // will be empty (default) if there are parse errors
+    if (parsed.rules.empty()) {
+        fprintf(stderr, "%s: failed to parse grammar\n", __func__);
+        return nullptr;
+    }
+
+    // Ensure that there is a "root" node.
+    if (parsed.symbol_ids.find("root") == parsed.symbol_ids.end()) {
+        fprintf(stderr, "%s: grammar does not contain a 'root' symbol\n", __func__);
+        return nullptr;
+    }
+
+    auto grammar = std::make_shared<llama_sampling_grammar>();
+    grammar->hash   = hash;
+    grammar->text   = text;
+    grammar->parsed = std::move(parsed);
+
+    std::vector<const llama_grammar_element *> grammar_rules(grammar->parsed.c_rules());
+    grammar->initial = llama_grammar_init(
+            grammar_rules.data(),
+            grammar_rules.size(), grammar->parsed.symbol_ids.at("root"));
+
+    std::lock_guard<std::mutex> lock(g_grammars_lock);
+    if (g_grammars.size() == LLAMA_SAMPLING_MAX_GRAMMARS) {
+        g_grammars.erase(g_grammars.begin());
+    }
+    g_grammars.push_back(grammar);
+    return grammar;
+}
+
 struct llama_sampling_context * llama_sampling_init(const struct llama_sampling_params & params) {
     struct llama_sampling_context * result = new llama_sampling_context();
 
     result->params  = params;
     result->grammar = nullptr;
 
-    // if there is a grammar, parse it
+    // if there is a grammar, compile it, unless it was already
     if (!params.grammar.empty()) {
-        result->parsed_grammar = grammar_parser::parse(params.grammar.c_str());
-
-        // will be empty (default) if there are parse errors
-        if (result->parsed_grammar.rules.empty()) {
-            fprintf(stderr, "%s: failed to parse grammar\n", __func__);
+        result->compiled_grammar = llama_sampling_compile_grammar(params.grammar);
+        if (!result->compiled_grammar) {
             delete result;
             return nullptr;
         }
 
-        // Ensure that there is a "root" node.
-        if (result->parsed_grammar.symbol_ids.find("root") == result->parsed_grammar.symbol_ids.end()) {
-            fprintf(stderr, "%s: grammar does not contain a 'root' symbol\n", __func__);
-            delete result;
-            return nullptr;
-        }
-
-        std::vector<const llama_grammar_element *> grammar_rules(result->parsed_grammar.c_rules());
-
-        result->grammar = llama_grammar_init(
-                grammar_rules.data(),
-                grammar_rules.size(), result->parsed_grammar.symbol_ids.at("root"));
+        result->grammar = llama_grammar_copy(result->compiled_grammar->initial);
     }
 
     result->prev.resize(params.n_prev);
@@ -59,15 +119,12 @@ void llama_sampling_reset(llama_sampling_context * ctx) {
         ctx->grammar = NULL;
     }
 
-    if (!ctx->parsed_grammar.rules.empty()) {
-        std::vector<const llama_grammar_element *> grammar_rules(ctx->parsed_grammar.c_rules());
-
-        ctx->grammar = llama_grammar_init(
-                grammar_rules.data(),
-                grammar_rules.size(), ctx->parsed_grammar.symbol_ids.at("root"));
+    if (ctx->compiled_grammar) {
+        ctx->grammar = llama_grammar_copy(ctx->compiled_grammar->initial);
     }
 
     std::fill(ctx->prev.begin(), ctx->prev.end(), 0);
+    ctx->penalty_window = -1;
     ctx->cur.clear();
     ctx->n_considered = 0;
 }
@@ -90,6 +147,7 @@ void llama_sampling_cp(llama_sampling_context * src, llama_sampling_context * ds
     }
 
     dst->prev = src->prev;
+    dst->penalty_window = -1;
 }
 
 llama_token llama_sampling_last(llama_sampling_context * ctx) {
@@ -192,12 +250,16 @@ static llama_token llama_sampling_sample_impl(
 
     std::vector<float> original_logits;
     auto cur_p = llama_sampling_prepare(ctx_sampling, ctx_main, ctx_cfg, idx, !is_resampling, &original_logits);
-    if (!is_resampling) {
+
+    // with top-k output there are no logits to restore when resampling,
+    // since the candidates are rebuilt from the untouched top-k arrays
+    const bool top_k_output = llama_get_top_k_ith(ctx_main, idx, nullptr, nullptr) > 0;
+    if (!is_resampling && !top_k_output && ctx_sampling->grammar != NULL) {
         GGML_ASSERT(!original_logits.empty());
     }
     llama_token id = 0;
     // Get a pointer to the logits
-    float * logits = llama_get_logits_ith(ctx_main, idx);
+    float * logits = top_k_output ? nullptr : llama_get_logits_ith(ctx_main, idx);
 
     if (temp < 0.0) {
         // greedy sampling, with probs
@@ -239,11 +301,14 @@ static llama_token llama_sampling_sample_impl(
 
     if (ctx_sampling->grammar != NULL && !is_resampling) {
         // Create an array with a single token data element for the sampled id
-        llama_token_data single_token_data = {id, logits[id], 0.0f};
+        // (only whether the grammar rejects it matters, not its logit)
+        llama_token_data single_token_data = {id, logits ? logits[id] : 0.0f, 0.0f};
         llama_token_data_array single_token_data_array = { &single_token_data, 1, false };
 
         // Apply grammar constraints to the single token
+        const int64_t t_start_us = ggml_time_us();
         llama_sample_grammar(ctx_main, &single_token_data_array, ctx_sampling->grammar);
+        ctx_sampling->t_grammar_us += ggml_time_us() - t_start_us;
 
         // Check if the token is valid according to the grammar by seeing if its logit has been set to -INFINITY
         bool is_valid = single_token_data_array.data[0].logit != -INFINITY;
@@ -253,7 +318,9 @@ static llama_token llama_sampling_sample_impl(
             LOG("Resampling because token %d: '%s' does not meet grammar rules\n", id, llama_token_to_piece(ctx_main, id).c_str());
 
             // Restore logits from the copy
-            std::copy(original_logits.begin(), original_logits.end(), logits);
+            if (logits) {
+                std::copy(original_logits.begin(), original_logits.end(), logits);
+            }
 
             return llama_sampling_sample_impl(ctx_sampling, ctx_main, ctx_cfg, idx, true);  // Pass true for is_resampling
         }
@@ -264,6 +331,121 @@ static llama_token llama_sampling_sample_impl(
     return id;
 }
 
+// returns how many of the most likely tokens sampling could pick from, or 0 if it needs all of them
+static int32_t llama_sampling_top_k_needed(const llama_sampling_params & params) {
+    if (!params.grammar.empty()) {
+        return 0;
+    }
+    // penalties can lower the most likely tokens below the ones we dropped
+    if (params.penalty_last_n != 0 &&
+        (params.penalty_repeat != 1.0f || params.penalty_freq != 0.0f || params.penalty_present != 0.0f)) {
+        return 0;
+    }
+    if (params.temp <= 0) {
+        // greedy, but the probabilities would be normalized over k tokens
+        return params.n_probs == 0 ? 1 : 0;
+    }
+    // everything else has to see the same tokens that the top-k sampler keeps
+    if (params.mirostat != 0 || params.top_k <= 0 ||
+        params.samplers_sequence.empty() || params.samplers_sequence[0] != llama_sampler_type::TOP_K) {
+        return 0;
+    }
+    return std::max({params.top_k, params.n_probs, params.min_keep});
+}
+
+// maps float to integer that sorts the same way
+static inline uint32_t llama_sampling_order_key(float f) {
+    uint32_t u;
+    memcpy(&u, &f, sizeof(u));
+    return u & 0x80000000u ? ~u : u | 0x80000000u;
+}
+
+// puts at least the k most likely tokens in cur, without building the others
+//
+// This is a radix select. A histogram of the top bits of each logit
+// says which bucket the kth largest falls into. Everything above that
+// bucket survives, and the bucket itself is only sorted if it's large.
+static void llama_sampling_select_top_k(
+        const float * logits, int32_t n_vocab, int32_t k,
+        std::vector<llama_token_data> & cur, std::vector<llama_token> & ties) {
+    uint32_t hist[1 << TOP_K_BITS] = {};
+    for (int32_t i = 0; i < n_vocab; i++) {
+        hist[llama_sampling_order_key(logits[i]) >> (32 - TOP_K_BITS)]++;
+    }
+    uint32_t bucket = 1 << TOP_K_BITS;
+    uint32_t above = 0;
+    while (bucket > 0 && above + hist[bucket - 1] < (uint32_t) k) {
+        above += hist[--bucket];
+    }
+    bucket = bucket ? bucket - 1 : 0;
+    ties.clear();
+    for (int32_t i = 0; i < n_vocab; i++) {
+        uint32_t b = llama_sampling_order_key(logits[i]) >> (32 - TOP_K_BITS);
+        if (b > bucket) {
+            cur.emplace_back(llama_token_data{i, logits[i], 0.0f});
+        } else if (b == bucket) {
+            ties.push_back(i);
+        }
+    }
+    size_t want = k - cur.size();
+    if (ties.size() > 2 * want + 64) {
+        std::nth_element(ties.begin(), ties.begin() + want, ties.end(), [logits](llama_token a, llama_token b) {
+            return logits[a] > logits[b];
+        });
+        ties.resize(want);
+    }
+    for (llama_token id : ties) {
+        cur.emplace_back(llama_token_data{id, logits[id], 0.0f});
+    }
+}
+
+static void llama_sampling_count_token(llama_sampling_context * ctx_sampling, llama_token id, int32_t delta) {
+    if (id < 0 || (size_t) id >= ctx_sampling->penalty_counts.size()) {
+        return;
+    }
+    if ((ctx_sampling->penalty_counts[id] += delta) > 0 && !ctx_sampling->penalty_listed[id]) {
+        ctx_sampling->penalty_listed[id] = true;
+        ctx_sampling->penalty_tokens.push_back(id);
+    }
+}
+
+// counts the last `window` tokens of prev from scratch
+static void llama_sampling_count_penalties(llama_sampling_context * ctx_sampling, int n_vocab, int32_t window) {
+    const auto & prev = ctx_sampling->prev;
+    ctx_sampling->penalty_counts.assign(n_vocab, 0);
+    ctx_sampling->penalty_listed.assign(n_vocab, false);
+    ctx_sampling->penalty_tokens.clear();
+    ctx_sampling->penalty_window = window;
+    for (size_t i = prev.size() - window; i < prev.size(); ++i) {
+        llama_sampling_count_token(ctx_sampling, prev[i], 1);
+    }
+}
+
+// same as llama_sample_repetition_penalties(), for candidates that are the vocab in order
+static void llama_sampling_apply_penalties(llama_sampling_context * ctx_sampling, llama_token_data_array * cur_p) {
+    const llama_sampling_params & params = ctx_sampling->params;
+    auto & tokens = ctx_sampling->penalty_tokens;
+    size_t j = 0;
+    for (size_t i = 0; i < tokens.size(); ++i) {
+        const llama_token id = tokens[i];
+        const int32_t count = ctx_sampling->penalty_counts[id];
+        if (!count) {
+            ctx_sampling->penalty_listed[id] = false;
+            continue;
+        }
+        tokens[j++] = id;
+        llama_token_data & td = cur_p->data[id];
+        if (td.logit <= 0) {
+            td.logit *= params.penalty_repeat;
+        } else {
+            td.logit /= params.penalty_repeat;
+        }
+        td.logit -= float(count) * params.penalty_freq + params.penalty_present;
+    }
+    tokens.resize(j);
+    cur_p->sorted = false;
+}
+
 static llama_token_data_array llama_sampling_prepare_impl(
                   struct llama_sampling_context * ctx_sampling,
                   struct llama_context * ctx_main,
@@ -285,28 +467,61 @@ static llama_token_data_array llama_sampling_prepare_impl(
     auto & prev = ctx_sampling->prev;
     auto & cur  = ctx_sampling->cur;
 
+    // the backend may have kept only the most likely tokens, in which
+    // case the others are assumed to be out of the running
+    const llama_token * top_k_ids    = nullptr;
+    const float       * top_k_logits = nullptr;
+    const int32_t n_top_k = llama_get_top_k_ith(ctx_main, idx, &top_k_ids, &top_k_logits);
+
+    cur.clear();
+
     // Get a pointer to the logits
-    float * logits = llama_get_logits_ith(ctx_main, idx);
+    float * logits = nullptr;
 
-    if (apply_grammar && original_logits != NULL) {
-        // Only make a copy of the original logits if we are not applying grammar checks, not sure if I actually have to do this.
-        *original_logits = {logits, logits + llama_n_vocab(llama_get_model(ctx_main))};
-    }
+    if (n_top_k > 0) {
+        GGML_ASSERT(!ctx_cfg && "guidance needs the full logits");
 
-    // apply params.logit_bias map
-    for (auto it = params.logit_bias.begin(); it != params.logit_bias.end(); it++) {
-        logits[it->first] += it->second;
-    }
+        for (int32_t i = 0; i < n_top_k; i++) {
+            cur.emplace_back(llama_token_data{top_k_ids[i], top_k_logits[i], 0.0f});
+        }
 
-    if (ctx_cfg) {
-        float * logits_guidance = llama_get_logits_ith(ctx_cfg, idx);
-        llama_sample_apply_guidance(ctx_main, logits, logits_guidance, params.cfg_scale);
-    }
+        // apply params.logit_bias map to the tokens we have, unless the backend did
+        for (auto & td : cur) {
+            auto it = params.logit_bias.find(td.id);
+            if (it != params.logit_bias.end() && !params.logit_bias_in_graph) {
+                td.logit += it->second;
+            }
+        }
+    } else {
+        logits = llama_get_logits_ith(ctx_main, idx);
 
-    cur.clear();
+        if (apply_grammar && original_logits != NULL && ctx_sampling->grammar != NULL) {
+            // keep a copy of the logits, so they can be restored if the grammar makes us resample
+            *original_logits = {logits, logits + llama_n_vocab(llama_get_model(ctx_main))};
+        }
+
+        // apply params.logit_bias map, unless the backend did
+        if (!params.logit_bias_in_graph) {
+            for (auto it = params.logit_bias.begin(); it != params.logit_bias.end(); it++) {
+                logits[it->first] += it->second;
+            }
+        }
 
-    for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
-        cur.emplace_back(llama_token_data{token_id, logits[token_id], 0.0f});
+        if (ctx_cfg) {
+            float * logits_guidance = llama_get_logits_ith(ctx_cfg, idx);
+            llama_sample_apply_guidance(ctx_main, logits, logits_guidance, params.cfg_scale);
+        }
+
+        // if sampling only looks at the most likely tokens, then the rest
+        // of the vocabulary doesn't need to be sorted by every sampler
+        const int32_t k = llama_sampling_top_k_needed(params);
+        if (k > 0 && (int64_t) k * 8 < n_vocab) {
+            llama_sampling_select_top_k(logits, n_vocab, k, cur, ctx_sampling->ties);
+        } else {
+            for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
+                cur.emplace_back(llama_token_data{token_id, logits[token_id], 0.0f});
+            }
+        }
     }
 
     llama_token_data_array cur_p = { cur.data(), cur.size(), false };
@@ -315,11 +530,30 @@ static llama_token_data_array llama_sampling_prepare_impl(
     const auto& penalty_tokens = params.use_penalty_prompt_tokens ? params.penalty_prompt_tokens : prev;
     const int penalty_tokens_used_size = std::min((int)penalty_tokens.size(), penalty_last_n);
     if (penalty_tokens_used_size) {
-        const float nl_logit = logits[llama_token_nl(llama_get_model(ctx_main))];
+        float nl_logit = -INFINITY;
+        if (logits) {
+            nl_logit = logits[llama_token_nl(llama_get_model(ctx_main))];
+        } else {
+            for (const auto & td : cur) {
+                if (td.id == llama_token_nl(llama_get_model(ctx_main))) {
+                    nl_logit = td.logit;
+                    break;
+                }
+            }
+        }
 
-        llama_sample_repetition_penalties(ctx_main, &cur_p,
-                penalty_tokens.data() + penalty_tokens.size() - penalty_tokens_used_size,
-                penalty_tokens_used_size, penalty_repeat, penalty_freq, penalty_present);
+        if (!params.use_penalty_prompt_tokens && logits && cur_p.size == (size_t) n_vocab &&
+            (penalty_repeat != 1.0f || penalty_freq != 0.0f || penalty_present != 0.0f)) {
+            if (ctx_sampling->penalty_window != penalty_tokens_used_size ||
+                ctx_sampling->penalty_counts.size() != (size_t) n_vocab) {
+                llama_sampling_count_penalties(ctx_sampling, n_vocab, penalty_tokens_used_size);
+            }
+            llama_sampling_apply_penalties(ctx_sampling, &cur_p);
+        } else {
+            llama_sample_repetition_penalties(ctx_main, &cur_p,
+                    penalty_tokens.data() + penalty_tokens.size() - penalty_tokens_used_size,
+                    penalty_tokens_used_size, penalty_repeat, penalty_freq, penalty_present);
+        }
 
         if (!penalize_nl) {
             for (size_t idx = 0; idx < cur_p.size; idx++) {
@@ -333,19 +567,40 @@ static llama_token_data_array llama_sampling_prepare_impl(
 
     // apply grammar checks before sampling logic
     if (apply_grammar && ctx_sampling->grammar != NULL) {
+        const int64_t t_start_us = ggml_time_us();
         llama_sample_grammar(ctx_main, &cur_p, ctx_sampling->grammar);
+        ctx_sampling->t_grammar_us += ggml_time_us() - t_start_us;
     }
 
     return cur_p;
 }
 
+bool llama_sampling_fits_top_k(const llama_sampling_params & params, int32_t k) {
+    if (k <= 0 || !params.cfg_negative_prompt.empty()) {
+        return false;
+    }
+    // unless the bias is in the graph, the backend picks its tokens before it's applied
+    for (const auto & it : params.logit_bias) {
+        if (it.second > 0 && !params.logit_bias_in_graph) {
+            return false;
+        }
+    }
+    const int32_t needed = llama_sampling_top_k_needed(params);
+    return needed > 0 && needed <= k;
+}
+
 llama_token llama_sampling_sample(
                   struct llama_sampling_context * ctx_sampling,
                   struct llama_context * ctx_main,
                   struct llama_context * ctx_cfg,
                   const int idx) {
     // Call the implementation function with is_resampling set to false by default
-    return llama_sampling_sample_impl(ctx_sampling, ctx_main, ctx_cfg, idx, false);
+    const long long t_start = llamafile_flight_enabled ? llamafile_trace_now() : 0;
+    const llama_token id = llama_sampling_sample_impl(ctx_sampling, ctx_main, ctx_cfg, idx, false);
+    if (llamafile_flight_enabled) {
+        llamafile_flight_record(LLAMAFILE_FLIGHT_SAMPLE, NULL, id, idx, t_start, llamafile_trace_now());
+    }
+    return id;
 }
 
 llama_token_data_array llama_sampling_prepare(
@@ -363,10 +618,21 @@ void llama_sampling_accept(
         struct llama_context * ctx_main,
         llama_token id,
         bool apply_grammar) {
+    const int32_t window = ctx_sampling->penalty_window;
+    if (window > 0) {
+        llama_sampling_count_token(ctx_sampling, ctx_sampling->prev[ctx_sampling->prev.size() - window], -1);
+    }
+
     ctx_sampling->prev.erase(ctx_sampling->prev.begin());
     ctx_sampling->prev.push_back(id);
 
+    if (window > 0) {
+        llama_sampling_count_token(ctx_sampling, id, 1);
+    }
+
     if (ctx_sampling->grammar != NULL && apply_grammar) {
+        const int64_t t_start_us = ggml_time_us();
         llama_grammar_accept_token(ctx_main, ctx_sampling->grammar, id);
+        ctx_sampling->t_grammar_us += ggml_time_us() - t_start_us;
     }
 }
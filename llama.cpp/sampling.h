@@ -4,6 +4,7 @@
 
 #include "grammar-parser.h"
 
+#include <memory>
 #include <random>
 #include <string>
 #include <unordered_map>
@@ -59,6 +60,7 @@ typedef struct llama_sampling_params {
     float       cfg_scale     = 1.f; // how strong is guidance
 
     std::unordered_map<llama_token, float> logit_bias; // logit bias for specific tokens
+    bool logit_bias_in_graph = false; // logit_bias was given to llama_set_logit_bias(), so the logits have it
 
     std::vector<llama_token> penalty_prompt_tokens;
     bool                     use_penalty_prompt_tokens = false;
@@ -76,13 +78,24 @@ struct llama_sampling_context {
     llama_grammar * grammar;
 
     // internal
-    grammar_parser::parse_state parsed_grammar;
+    std::shared_ptr<const struct llama_sampling_grammar> compiled_grammar;
 
     // TODO: replace with ring-buffer
     std::vector<llama_token>      prev;
     std::vector<llama_token_data> cur;
+    std::vector<llama_token>      ties; // scratch for selecting the most likely tokens
+
+    // occurrences of each token in the penalized end of prev, which are
+    // kept up to date as tokens are accepted, so penalties only have to
+    // visit the tokens that are present
+    std::vector<int32_t>          penalty_counts;
+    std::vector<llama_token>      penalty_tokens; // tokens that may have a count, each listed once
+    std::vector<bool>             penalty_listed;
+    int32_t                       penalty_window = -1; // -1 if counts must be rebuilt
     size_t n_considered;
 
+    int64_t t_grammar_us = 0; // time spent applying the grammar
+
     std::mt19937 rng;
 };
 
@@ -116,6 +129,10 @@ std::string llama_sampling_print(const llama_sampling_params & params);
 // Print sampling order into a string
 std::string llama_sampling_order_print(const llama_sampling_params & params);
 
+// Returns true if sampling with these parameters gives the same result when
+// the context only outputs the k most likely tokens (see llama_set_logits_top_k)
+bool llama_sampling_fits_top_k(const llama_sampling_params & params, int32_t k);
+
 // this is a common sampling function used across the examples for convenience
 // it can serve as a starting point for implementing your own sampling function
 // Note: When using multiple sequences, it is the caller's responsibility to call
@@ -0,0 +1,18 @@
+#-*-mode:makefile-gmake;indent-tabs-mode:t;tab-width:8;coding:utf-8-*-┐
+#── vi: set noet ft=make ts=8 sw=8 fenc=utf-8 :vi ────────────────────┘
+
+PKGS += LLAMA_CPP_SERVER_BENCH
+
+LLAMA_CPP_SERVER_BENCH_FILES := $(wildcard llama.cpp/server-bench/*)
+LLAMA_CPP_SERVER_BENCH_HDRS = $(filter %.h,$(LLAMA_CPP_SERVER_BENCH_FILES))
+LLAMA_CPP_SERVER_BENCH_SRCS = $(filter %.cpp,$(LLAMA_CPP_SERVER_BENCH_FILES))
+LLAMA_CPP_SERVER_BENCH_OBJS = $(LLAMA_CPP_SERVER_BENCH_SRCS:%.cpp=o/$(MODE)/%.o)
+
+.PHONY: o/$(MODE)/llama.cpp/server-bench
+o/$(MODE)/llama.cpp/server-bench:					\
+		o/$(MODE)/llama.cpp/server-bench/server-bench
+
+o/$(MODE)/llama.cpp/server-bench/server-bench:				\
+		o/$(MODE)/llama.cpp/server-bench/server-bench.o		\
+		o/$(MODE)/llama.cpp/server-bench/server-bench.1.asc.zip.o	\
+		o/$(MODE)/llama.cpp/llama.cpp.a
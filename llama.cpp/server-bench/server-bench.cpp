@@ -0,0 +1,567 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+
+#include "llama.cpp/server/httplib.h"
+#include "llama.cpp/json.h"
+#include "llamafile/llamafile.h"
+#include "llamafile/version.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+//
+// llamafile-server-bench
+//
+// Loads a running llamafile server with N concurrent streaming clients,
+// each sending its next request as soon as the previous one finishes,
+// and measures what a user would see: time to first token, the latency
+// between tokens, and overall throughput. The workload is drawn up
+// front from a seeded generator, so the same flags replay the same
+// requests against every build of the server being compared.
+//
+
+using json = nlohmann::ordered_json;
+
+enum output_format {
+    OUTPUT_MD,
+    OUTPUT_JSON,
+};
+
+// request lengths that are either fixed, or uniformly random in [lo,hi]
+struct length_dist {
+    int lo;
+    int hi;
+};
+
+struct bench_params {
+    std::string host = "127.0.0.1";
+    int port = 8080;
+    std::string api_key;
+    std::vector<std::string> endpoints = {"completion"};
+    std::vector<int> clients = {1, 4, 16};
+    int n_requests = 64;
+    length_dist n_prompt = {128, 1024};
+    length_dist n_gen = {64, 256};
+    std::string trace;
+    unsigned seed = 42;
+    int timeout = 600;
+    int warmup = 1;
+    output_format output = OUTPUT_MD;
+};
+
+struct bench_request {
+    std::string prompt;
+    int n_prompt; // words sent, which is about how many tokens
+    int n_gen;
+};
+
+struct request_result {
+    bool ok = false;
+    int n_prompt = 0;
+    int n_gen = 0;
+    double ttft = 0; // seconds until the first token arrived
+    double e2e = 0;  // seconds until the response was complete
+    std::vector<double> itl; // seconds between successive tokens
+    std::string error;
+};
+
+struct run_result {
+    std::string endpoint;
+    int clients;
+    double duration;
+    double slots_busy; // mean fraction of server slots processing
+    std::vector<request_result> requests;
+};
+
+static void usage(const char *prog) {
+    bench_params p;
+    fprintf(stderr, "usage: %s [options]\n", prog);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -h, --help\n");
+    fprintf(stderr, "  --host HOST                       (default: %s)\n", p.host.c_str());
+    fprintf(stderr, "  --port N                          (default: %d)\n", p.port);
+    fprintf(stderr, "  --api-key KEY                     sent as bearer token\n");
+    fprintf(stderr, "  -e, --endpoint completion|chat,...  (default: completion)\n");
+    fprintf(stderr, "  -c, --clients N,...               concurrent clients (default: 1,4,16)\n");
+    fprintf(stderr, "  -r, --requests N                  requests per run (default: %d)\n", p.n_requests);
+    fprintf(stderr, "  -p, --n-prompt N|LO-HI            prompt tokens (default: %d-%d)\n", p.n_prompt.lo, p.n_prompt.hi);
+    fprintf(stderr, "  -n, --n-gen N|LO-HI               generated tokens (default: %d-%d)\n", p.n_gen.lo, p.n_gen.hi);
+    fprintf(stderr, "  --trace FNAME                     replay \"PROMPT GEN\" lengths, one pair per line\n");
+    fprintf(stderr, "  -s, --seed N                      (default: %u)\n", p.seed);
+    fprintf(stderr, "  --warmup N                        untimed requests per run (default: %d)\n", p.warmup);
+    fprintf(stderr, "  --timeout SECONDS                 per request (default: %d)\n", p.timeout);
+    fprintf(stderr, "  -o, --output md|json              (default: md)\n");
+    exit(1);
+}
+
+static std::vector<std::string> split(const std::string &s) {
+    std::vector<std::string> res;
+    std::stringstream ss(s);
+    std::string item;
+    while (std::getline(ss, item, ','))
+        res.push_back(item);
+    return res;
+}
+
+static length_dist parse_dist(const char *s) {
+    length_dist d;
+    const char *dash = strchr(s, '-');
+    d.lo = atoi(s);
+    d.hi = dash ? atoi(dash + 1) : d.lo;
+    if (d.lo < 1 || d.hi < d.lo) {
+        fprintf(stderr, "error: bad length distribution: %s\n", s);
+        exit(1);
+    }
+    return d;
+}
+
+static bench_params parse_args(int argc, char **argv) {
+    bench_params p;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            fprintf(stderr, "error: missing value for %s\n", arg.c_str());
+            usage(argv[0]);
+        }
+        const char *val = argv[++i];
+        if (arg == "--host") {
+            p.host = val;
+        } else if (arg == "--port") {
+            p.port = atoi(val);
+        } else if (arg == "--api-key") {
+            p.api_key = val;
+        } else if (arg == "-e" || arg == "--endpoint") {
+            p.endpoints = split(val);
+            for (const std::string &e : p.endpoints) {
+                if (e != "completion" && e != "chat") {
+                    fprintf(stderr, "error: unknown endpoint: %s\n", e.c_str());
+                    exit(1);
+                }
+            }
+        } else if (arg == "-c" || arg == "--clients") {
+            p.clients.clear();
+            for (const std::string &s : split(val))
+                p.clients.push_back(std::stoi(s));
+        } else if (arg == "-r" || arg == "--requests") {
+            p.n_requests = atoi(val);
+        } else if (arg == "-p" || arg == "--n-prompt") {
+            p.n_prompt = parse_dist(val);
+        } else if (arg == "-n" || arg == "--n-gen") {
+            p.n_gen = parse_dist(val);
+        } else if (arg == "--trace") {
+            p.trace = val;
+        } else if (arg == "-s" || arg == "--seed") {
+            p.seed = strtoul(val, 0, 10);
+        } else if (arg == "--warmup") {
+            p.warmup = atoi(val);
+        } else if (arg == "--timeout") {
+            p.timeout = atoi(val);
+        } else if (arg == "-o" || arg == "--output") {
+            if (!strcmp(val, "md")) {
+                p.output = OUTPUT_MD;
+            } else if (!strcmp(val, "json")) {
+                p.output = OUTPUT_JSON;
+            } else {
+                fprintf(stderr, "error: unknown output format: %s\n", val);
+                exit(1);
+            }
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            usage(argv[0]);
+        }
+    }
+    if (p.endpoints.empty() || p.clients.empty()) {
+        fprintf(stderr, "error: empty list of values\n");
+        exit(1);
+    }
+    for (int c : p.clients) {
+        if (c < 1) {
+            fprintf(stderr, "error: --clients must be positive\n");
+            exit(1);
+        }
+    }
+    if (p.n_requests < 1) {
+        fprintf(stderr, "error: --requests must be positive\n");
+        exit(1);
+    }
+    return p;
+}
+
+// short common words, which nearly every vocabulary has as one token
+static const char *const kWords[] = {
+    " the",  " of",   " and",  " to",    " in",   " is",   " was",   " for",  " on",
+    " that", " with", " as",   " by",    " at",   " from", " his",   " it",   " an",
+    " were", " are",  " which"," this",  " be",   " or",   " new",   " had",  " first",
+    " not",  " but",  " one",  " their", " after"," also", " its",   " two",  " they",
+    " has",  " have", " who",  " time",  " her",  " would"," city",  " year", " other",
+    " when", " into", " made", " world", " more", " over", " state", " may",  " war",
+};
+
+// random words, so no two prompts share a prefix the server could cache
+static std::string make_prompt(std::mt19937 &rng, int n_words) {
+    std::uniform_int_distribution<int> pick(0, sizeof(kWords) / sizeof(*kWords) - 1);
+    std::string prompt;
+    for (int i = 0; i < n_words; ++i)
+        prompt += kWords[pick(rng)];
+    return prompt;
+}
+
+static std::vector<bench_request> make_workload(const bench_params &p, int n) {
+    std::vector<std::pair<int, int>> lengths;
+    if (!p.trace.empty()) {
+        std::ifstream in(p.trace);
+        if (!in) {
+            perror(p.trace.c_str());
+            exit(1);
+        }
+        int np, ng;
+        while (in >> np >> ng)
+            if (np > 0 && ng > 0)
+                lengths.emplace_back(np, ng);
+        if (lengths.empty()) {
+            fprintf(stderr, "error: %s: no \"PROMPT GEN\" pairs\n", p.trace.c_str());
+            exit(1);
+        }
+    }
+    std::mt19937 rng(p.seed);
+    std::vector<bench_request> workload;
+    for (int i = 0; i < n; ++i) {
+        bench_request r;
+        if (!lengths.empty()) {
+            r.n_prompt = lengths[i % lengths.size()].first;
+            r.n_gen = lengths[i % lengths.size()].second;
+        } else {
+            r.n_prompt = std::uniform_int_distribution<int>(p.n_prompt.lo, p.n_prompt.hi)(rng);
+            r.n_gen = std::uniform_int_distribution<int>(p.n_gen.lo, p.n_gen.hi)(rng);
+        }
+        r.prompt = make_prompt(rng, r.n_prompt);
+        workload.push_back(std::move(r));
+    }
+    return workload;
+}
+
+static double now() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static httplib::Headers make_headers(const bench_params &p) {
+    httplib::Headers headers = {{"Accept", "text/event-stream"}};
+    if (!p.api_key.empty())
+        headers.emplace("Authorization", "Bearer " + p.api_key);
+    return headers;
+}
+
+// sends one streaming request and times the tokens as they arrive
+static request_result send_request(httplib::Client &cli, const bench_params &p,
+                                   const std::string &endpoint, const bench_request &br) {
+    request_result rr;
+    json body;
+    httplib::Request req;
+    req.method = "POST";
+    if (endpoint == "chat") {
+        req.path = "/v1/chat/completions";
+        body = {
+            {"messages", json::array({{{"role", "user"}, {"content", br.prompt}}})},
+            {"max_tokens", br.n_gen},
+            {"ignore_eos", true},
+            {"stream", true},
+        };
+    } else {
+        req.path = "/completion";
+        body = {
+            {"prompt", br.prompt},
+            {"n_predict", br.n_gen},
+            {"ignore_eos", true},
+            {"cache_prompt", false},
+            {"stream", true},
+        };
+    }
+    req.headers = make_headers(p);
+    req.set_header("Content-Type", "application/json");
+    req.body = body.dump();
+
+    rr.n_prompt = br.n_prompt;
+    std::string pending;
+    double t_start = now();
+    double t_last = 0;
+    auto on_token = [&]() {
+        double t = now();
+        if (!rr.n_gen)
+            rr.ttft = t - t_start;
+        else
+            rr.itl.push_back(t - t_last);
+        t_last = t;
+        ++rr.n_gen;
+    };
+    auto on_event = [&](const std::string &data) {
+        if (data == "[DONE]")
+            return;
+        json ev = json::parse(data, nullptr, false);
+        if (ev.is_discarded() || !ev.is_object())
+            return;
+        if (ev.contains("error")) {
+            rr.error = ev["error"].dump();
+            return;
+        }
+        if (endpoint == "chat") {
+            if (ev.contains("choices") && !ev["choices"].empty()) {
+                const json &delta = ev["choices"][0].value("delta", json::object());
+                if (delta.contains("content") && !delta["content"].get<std::string>().empty())
+                    on_token();
+            }
+        } else {
+            if (!ev.value("content", std::string()).empty())
+                on_token();
+            if (ev.value("stop", false)) {
+                // the server knows how many tokens it really saw
+                rr.n_prompt = ev.value("tokens_evaluated", rr.n_prompt);
+                rr.n_gen = std::max(rr.n_gen, ev.value("tokens_predicted", 0));
+            }
+        }
+    };
+    req.content_receiver = [&](const char *data, size_t len, uint64_t, uint64_t) {
+        pending.append(data, len);
+        size_t end;
+        while ((end = pending.find("\n\n")) != std::string::npos) {
+            std::string event = pending.substr(0, end);
+            pending.erase(0, end + 2);
+            if (!event.compare(0, 6, "data: "))
+                on_event(event.substr(6));
+            else if (!event.compare(0, 7, "error: "))
+                rr.error = event.substr(7);
+        }
+        return true;
+    };
+
+    auto res = cli.send(req);
+    rr.e2e = now() - t_start;
+    if (!res) {
+        rr.error = httplib::to_string(res.error());
+    } else if (res->status != 200) {
+        rr.error = "HTTP " + std::to_string(res->status);
+    } else if (rr.error.empty() && !rr.n_gen) {
+        rr.error = "no tokens were generated";
+    }
+    rr.ok = rr.error.empty();
+    return rr;
+}
+
+// runs the workload with n clients while sampling how busy the slots are
+static run_result run(const bench_params &p, const std::string &endpoint, int n_clients,
+                      const std::vector<bench_request> &workload) {
+    run_result result;
+    result.endpoint = endpoint;
+    result.clients = n_clients;
+    result.requests.resize(p.n_requests);
+
+    std::atomic<int> next(0);
+    std::atomic<bool> done(false);
+    auto client = [&]() {
+        httplib::Client cli(p.host, p.port);
+        cli.set_keep_alive(true);
+        cli.set_read_timeout(p.timeout, 0);
+        cli.set_write_timeout(p.timeout, 0);
+        int i;
+        while ((i = next.fetch_add(1)) < p.n_requests)
+            result.requests[i] = send_request(cli, p, endpoint, workload[p.warmup + i]);
+    };
+
+    double busy = 0;
+    int samples = 0;
+    auto monitor = [&]() {
+        httplib::Client cli(p.host, p.port);
+        httplib::Headers headers;
+        if (!p.api_key.empty())
+            headers.emplace("Authorization", "Bearer " + p.api_key);
+        while (!done) {
+            auto res = cli.Get("/health", headers);
+            if (res && (res->status == 200 || res->status == 503)) {
+                json health = json::parse(res->body, nullptr, false);
+                if (!health.is_discarded() && health.contains("slots_processing")) {
+                    int processing = health["slots_processing"];
+                    int idle = health["slots_idle"];
+                    if (processing + idle > 0) {
+                        busy += (double)processing / (processing + idle);
+                        ++samples;
+                    }
+                }
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+    };
+
+    // let the server allocate and fault in whatever it does lazily
+    {
+        httplib::Client cli(p.host, p.port);
+        cli.set_read_timeout(p.timeout, 0);
+        for (int i = 0; i < p.warmup; ++i) {
+            request_result rr = send_request(cli, p, endpoint, workload[i]);
+            if (!rr.ok) {
+                fprintf(stderr, "error: warmup request to %s:%d failed: %s\n", p.host.c_str(),
+                        p.port, rr.error.c_str());
+                exit(1);
+            }
+        }
+    }
+
+    std::thread mon(monitor);
+    std::vector<std::thread> threads;
+    double t_start = now();
+    for (int i = 0; i < n_clients; ++i)
+        threads.emplace_back(client);
+    for (auto &t : threads)
+        t.join();
+    result.duration = now() - t_start;
+    done = true;
+    mon.join();
+    result.slots_busy = samples ? busy / samples : NAN;
+    return result;
+}
+
+static double percentile(std::vector<double> v, double fraction) {
+    if (v.empty())
+        return NAN;
+    std::sort(v.begin(), v.end());
+    double x = fraction * (v.size() - 1);
+    size_t i = x;
+    x -= i;
+    return (1 - x) * v[i] + x * v[std::min(i + 1, v.size() - 1)];
+}
+
+struct run_summary {
+    int ok = 0;
+    int failed = 0;
+    long long n_prompt = 0;
+    long long n_gen = 0;
+    std::vector<double> ttft;
+    std::vector<double> itl;
+    std::vector<double> e2e;
+    std::string first_error;
+
+    explicit run_summary(const run_result &r) {
+        for (const request_result &rr : r.requests) {
+            if (!rr.ok) {
+                if (!failed++)
+                    first_error = rr.error;
+                continue;
+            }
+            ++ok;
+            n_prompt += rr.n_prompt;
+            n_gen += rr.n_gen;
+            ttft.push_back(rr.ttft);
+            e2e.push_back(rr.e2e);
+            itl.insert(itl.end(), rr.itl.begin(), rr.itl.end());
+        }
+    }
+};
+
+static void print_header(const bench_params &p) {
+    switch (p.output) {
+    case OUTPUT_MD:
+        printf("| endpoint | clients | ok | failed | req/s | gen t/s | total t/s | ttft p50 | ttft p90 "
+               "| ttft p99 | itl p50 | itl p90 | itl p99 | e2e p50 | e2e p99 | slots busy |\n");
+        printf("| -------- | ------: | -: | -----: | ----: | ------: | --------: | -------: | -------: "
+               "| -------: | ------: | ------: | ------: | ------: | ------: | ---------: |\n");
+        break;
+    case OUTPUT_JSON:
+        printf("[\n");
+        break;
+    }
+    fflush(stdout);
+}
+
+static void print_result(const bench_params &p, const run_result &r, bool first) {
+    run_summary s(r);
+    switch (p.output) {
+    case OUTPUT_MD:
+        printf("| %s | %d | %d | %d | %.2f | %.1f | %.1f | %.0f ms | %.0f ms | %.0f ms | %.1f ms "
+               "| %.1f ms | %.1f ms | %.2f s | %.2f s | %.0f%% |\n",
+               r.endpoint.c_str(), r.clients, s.ok, s.failed, s.ok / r.duration,
+               s.n_gen / r.duration, (s.n_prompt + s.n_gen) / r.duration,
+               1e3 * percentile(s.ttft, .5), 1e3 * percentile(s.ttft, .9),
+               1e3 * percentile(s.ttft, .99), 1e3 * percentile(s.itl, .5),
+               1e3 * percentile(s.itl, .9), 1e3 * percentile(s.itl, .99), percentile(s.e2e, .5),
+               percentile(s.e2e, .99), 100 * r.slots_busy);
+        break;
+    case OUTPUT_JSON: {
+        auto pcts = [](const std::vector<double> &v) {
+            return json{{"p50", percentile(v, .5)},
+                        {"p90", percentile(v, .9)},
+                        {"p99", percentile(v, .99)},
+                        {"max", percentile(v, 1)}};
+        };
+        json j = {
+            {"build", LLAMAFILE_VERSION_STRING},
+            {"endpoint", r.endpoint},
+            {"clients", r.clients},
+            {"requests_ok", s.ok},
+            {"requests_failed", s.failed},
+            {"duration", r.duration},
+            {"prompt_tokens", s.n_prompt},
+            {"gen_tokens", s.n_gen},
+            {"requests_per_second", s.ok / r.duration},
+            {"gen_tokens_per_second", s.n_gen / r.duration},
+            {"total_tokens_per_second", (s.n_prompt + s.n_gen) / r.duration},
+            {"ttft", pcts(s.ttft)},
+            {"itl", pcts(s.itl)},
+            {"e2e", pcts(s.e2e)},
+            {"slots_busy", std::isnan(r.slots_busy) ? json(nullptr) : json(r.slots_busy)},
+        };
+        if (s.failed)
+            j["first_error"] = s.first_error;
+        printf("%s  %s", first ? "" : ",\n", j.dump().c_str());
+        break;
+    }
+    }
+    if (s.failed && p.output == OUTPUT_MD)
+        fprintf(stderr, "warning: %d requests failed, e.g. %s\n", s.failed, s.first_error.c_str());
+    fflush(stdout);
+}
+
+static void print_footer(const bench_params &p) {
+    if (p.output == OUTPUT_JSON)
+        printf("\n]\n");
+    else if (p.output == OUTPUT_MD)
+        printf("\nbuild: llamafile v%s\n", LLAMAFILE_VERSION_STRING);
+}
+
+int main(int argc, char **argv) {
+
+    if (llamafile_has(argv, "--version")) {
+        puts("llamafile-server-bench v" LLAMAFILE_VERSION_STRING);
+        return 0;
+    }
+
+    if (llamafile_has(argv, "-h") || llamafile_has(argv, "-help") ||
+        llamafile_has(argv, "--help")) {
+        llamafile_help("/zip/llama.cpp/server-bench/server-bench.1.asc");
+        __builtin_unreachable();
+    }
+
+    bench_params p = parse_args(argc, argv);
+    std::vector<bench_request> workload = make_workload(p, p.warmup + p.n_requests);
+
+    print_header(p);
+    bool first = true;
+    for (const std::string &endpoint : p.endpoints) {
+        for (int clients : p.clients) {
+            print_result(p, run(p, endpoint, clients, workload), first);
+            first = false;
+        }
+    }
+    print_footer(p);
+
+    return 0;
+}
@@ -0,0 +1,55 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+
+#pragma once
+
+#include "llama.cpp/llama.h"
+
+#include <algorithm>
+#include <cstdint>
+
+//
+// detokenizer
+//
+// Keeps track of whether the text a slot generated so far ends in the
+// middle of a utf-8 character, using the layout of each piece that the
+// model worked out at load time, so that streaming only ever sends
+// whole characters without looking at the text again.
+//
+
+struct server_detokenizer {
+    uint8_t pending = 0; // bytes of an unfinished character at the end of the text
+    uint8_t need = 0;    // bytes that character has in all
+
+    void reset() {
+        pending = 0;
+        need = 0;
+    }
+
+    // takes the next piece of the text, and returns how many bytes at
+    // the end of the text need to be held back for now
+    int feed(int32_t length, llama_piece_utf8 u) {
+        if (!length) {
+            return pending;
+        }
+        if (pending) {
+            const int k = std::min<int>(need - pending, u.head);
+            if (k == length) {
+                // the whole piece went into the character
+                pending += k;
+                if (pending == need) {
+                    reset();
+                }
+                return pending;
+            }
+            // finished, or broken by a byte that can't continue it,
+            // in which case the bytes are sent as they are
+            reset();
+        }
+        if (u.tail) {
+            pending = u.tail;
+            need = u.need;
+        }
+        return pending;
+    }
+};
@@ -0,0 +1,80 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "llamafile/sha256.h"
+
+//
+// embedding cache
+//
+// Remembers the normalized embeddings of the last texts the server was
+// asked to embed, keyed by the SHA-256 of the model, its pooling and the
+// text, so that retrieval clients which embed the same chunks over and
+// over only have them evaluated once. It's used by the http threads, so
+// unlike the image cache it has a lock of its own.
+//
+
+struct server_embd_cache {
+    struct entry {
+        std::vector<float> embd;
+        std::list<std::string>::iterator lru;
+    };
+
+    size_t n_max = 0; // maximum number of texts, 0 if disabled
+    std::mutex lock;
+    std::unordered_map<std::string, entry> entries;
+    std::list<std::string> order; // keys, most recently used first
+
+    static std::string key(const std::string & model, int pooling, const std::string & text) {
+        std::string s = model;
+        s += '\0';
+        s += std::to_string(pooling);
+        s += '\0';
+        s += text;
+        unsigned char digest[32];
+        llamafile_sha256(s.data(), s.size(), digest);
+        return std::string((const char *) digest, sizeof(digest));
+    }
+
+    bool get(const std::string & key, std::vector<float> * embd) {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = entries.find(key);
+        if (it == entries.end()) {
+            return false;
+        }
+        order.splice(order.begin(), order, it->second.lru);
+        *embd = it->second.embd;
+        return true;
+    }
+
+    void put(const std::string & key, const std::vector<float> & embd) {
+        if (!n_max || embd.empty()) {
+            return;
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = entries.find(key);
+        if (it != entries.end()) {
+            order.splice(order.begin(), order, it->second.lru);
+            it->second.embd = embd;
+            return;
+        }
+        // a cache for retrieval holds many more entries than the image
+        // cache, so the least recently used one is found in a list
+        while (entries.size() >= n_max) {
+            entries.erase(order.back());
+            order.pop_back();
+        }
+        order.push_front(key);
+        entry & e = entries[key];
+        e.embd = embd;
+        e.lru = order.begin();
+    }
+};
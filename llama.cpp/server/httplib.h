@@ -465,6 +465,7 @@ struct Request {
   MultipartFormDataMap files;
   Ranges ranges;
   Match matches;
+  std::function<bool()> is_connection_closed = []() { return true; };
 
   // for client
   ResponseHandler response_handler;
@@ -530,6 +531,12 @@ struct Response {
       const std::string &content_type, ContentProviderWithoutLength provider,
       ContentProviderResourceReleaser resource_releaser = nullptr);
 
+  // Sends the headers of a chunked response, then gives the socket to
+  // `handler`, which writes the chunks and closes it, so the thread is
+  // free to serve other requests in the meantime.
+  void set_detached_content(const std::string &content_type,
+                            std::function<void(socket_t)> handler);
+
   Response() = default;
   Response(const Response &) = default;
   Response &operator=(const Response &) = default;
@@ -547,6 +554,7 @@ struct Response {
   ContentProviderResourceReleaser content_provider_resource_releaser_;
   bool is_chunked_content_provider_ = false;
   bool content_provider_success_ = false;
+  std::function<void(socket_t)> detach_handler_;
 };
 
 class Stream {
@@ -751,7 +759,8 @@ public:
 protected:
   bool process_request(Stream &strm, bool close_connection,
                        bool &connection_closed,
-                       const std::function<void(Request &)> &setup_request);
+                       const std::function<void(Request &)> &setup_request,
+                       std::function<void(socket_t)> *detach = nullptr);
 
   std::atomic<socket_t> svr_sock_{INVALID_SOCKET};
   size_t keep_alive_max_count_ = CPPHTTPLIB_KEEPALIVE_MAX_COUNT;
@@ -4973,6 +4982,14 @@ inline void Response::set_chunked_content_provider(
   is_chunked_content_provider_ = true;
 }
 
+inline void
+Response::set_detached_content(const std::string &content_type,
+                               std::function<void(socket_t)> handler) {
+  set_header("Content-Type", content_type);
+  set_header("Transfer-Encoding", "chunked");
+  detach_handler_ = std::move(handler);
+}
+
 // Result implementation
 inline bool Result::has_request_header(const std::string &key) const {
   return request_headers_.find(key) != request_headers_.end();
@@ -5456,7 +5473,8 @@ inline bool Server::write_response_core(Stream &strm, bool close_connection,
   if (need_apply_ranges) { apply_ranges(req, res, content_type, boundary); }
 
   // Prepare additional headers
-  if (close_connection || req.get_header_value("Connection") == "close") {
+  if (close_connection || req.get_header_value("Connection") == "close" ||
+      res.detach_handler_) {
     res.set_header("Connection", "close");
   } else {
     std::stringstream ss;
@@ -5471,7 +5489,8 @@ inline bool Server::write_response_core(Stream &strm, bool close_connection,
   }
 
   if (!res.has_header("Content-Length") && res.body.empty() &&
-      !res.content_length_ && !res.content_provider_) {
+      !res.content_length_ && !res.content_provider_ &&
+      !res.detach_handler_) {
     res.set_header("Content-Length", "0");
   }
 
@@ -6041,7 +6060,8 @@ inline bool Server::dispatch_request_for_content_reader(
 inline bool
 Server::process_request(Stream &strm, bool close_connection,
                         bool &connection_closed,
-                        const std::function<void(Request &)> &setup_request) {
+                        const std::function<void(Request &)> &setup_request,
+                        std::function<void(socket_t)> *detach) {
   std::array<char, 2048> buf{};
 
   detail::stream_line_reader line_reader(strm, buf.data(), buf.size());
@@ -6106,6 +6126,10 @@ Server::process_request(Stream &strm, bool close_connection,
   req.set_header("LOCAL_ADDR", req.local_addr);
   req.set_header("LOCAL_PORT", std::to_string(req.local_port));
 
+  req.is_connection_closed = [&]() {
+    return !detail::is_socket_alive(strm.socket());
+  };
+
   if (req.has_header("Range")) {
     const auto &range_header_value = req.get_header_value("Range");
     if (!detail::parse_range_header(range_header_value, req.ranges)) {
@@ -6168,9 +6192,20 @@ Server::process_request(Stream &strm, bool close_connection,
   }
 #endif
 
+  if (res.detach_handler_ && (!detach || req.method == "HEAD")) {
+    res.detach_handler_ = nullptr;
+    res.headers.erase("Transfer-Encoding");
+    if (routed) { res.status = 501; }
+  }
+
   if (routed) {
     if (res.status == -1) { res.status = req.ranges.empty() ? 200 : 206; }
-    return write_response_with_content(strm, close_connection, req, res);
+    auto ret = write_response_with_content(strm, close_connection, req, res);
+    if (res.detach_handler_) {
+      *detach = std::move(res.detach_handler_); // even if the client is gone
+      connection_closed = true;
+    }
+    return ret;
   } else {
     if (res.status == -1) { res.status = 404; }
     return write_response(strm, close_connection, req, res);
@@ -6180,15 +6215,22 @@ Server::process_request(Stream &strm, bool close_connection,
 inline bool Server::is_valid() const { return true; }
 
 inline bool Server::process_and_close_socket(socket_t sock) {
+  std::function<void(socket_t)> detach;
   auto ret = detail::process_server_socket(
       svr_sock_, sock, keep_alive_max_count_, keep_alive_timeout_sec_,
       read_timeout_sec_, read_timeout_usec_, write_timeout_sec_,
       write_timeout_usec_,
-      [this](Stream &strm, bool close_connection, bool &connection_closed) {
+      [this, &detach](Stream &strm, bool close_connection,
+                      bool &connection_closed) {
         return process_request(strm, close_connection, connection_closed,
-                               nullptr);
+                               nullptr, &detach);
       });
 
+  if (detach) {
+    detach(sock);
+    return ret;
+  }
+
   detail::shutdown_socket(sock);
   detail::close_socket(sock);
   return ret;
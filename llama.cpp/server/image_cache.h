@@ -0,0 +1,79 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <string>
+
+#include "llama.cpp/llama.h"
+#include "llamafile/sha256.h"
+
+//
+// image cache
+//
+// Remembers the embeddings of the last few images the server has seen,
+// keyed by the SHA-256 of their bytes, so a chat that sends the same
+// picture every turn only has it decoded, preprocessed and run through
+// CLIP once. Embeddings are shared with the slots using them, so the
+// cache evicting an image doesn't take it away from a slot.
+//
+
+struct server_image_cache {
+    struct entry {
+        std::shared_ptr<float> embd;
+        int32_t n_tokens = 0;
+        int64_t t_last_used = 0;
+    };
+
+    size_t n_max = 0; // maximum number of images, 0 if disabled
+    std::map<std::string, entry> entries;
+    int64_t n_used = 0; // logical clock
+
+    static std::string hash(const void * data, size_t size) {
+        unsigned char digest[32];
+        llamafile_sha256(data, size, digest);
+        return std::string((const char *) digest, sizeof(digest));
+    }
+
+    // in the prompt, an image is a run of this made up token, so prompt
+    // caching can tell whether the slot already evaluated this picture
+    static llama_token token(const std::string & hash) {
+        uint32_t x;
+        memcpy(&x, hash.data(), sizeof(x));
+        return -2 - (llama_token) (x & 0x3fffffff);
+    }
+
+    bool get(const std::string & hash, std::shared_ptr<float> * embd, int32_t * n_tokens) {
+        auto it = entries.find(hash);
+        if (it == entries.end()) {
+            return false;
+        }
+        it->second.t_last_used = ++n_used;
+        *embd = it->second.embd;
+        *n_tokens = it->second.n_tokens;
+        return true;
+    }
+
+    void put(const std::string & hash, const std::shared_ptr<float> & embd, int32_t n_tokens) {
+        if (!n_max) {
+            return;
+        }
+        while (entries.size() >= n_max && !entries.count(hash)) {
+            auto lru = entries.begin();
+            for (auto it = entries.begin(); it != entries.end(); ++it) {
+                if (it->second.t_last_used < lru->second.t_last_used) {
+                    lru = it;
+                }
+            }
+            entries.erase(lru);
+        }
+        entry & e = entries[hash];
+        e.embd = embd;
+        e.n_tokens = n_tokens;
+        e.t_last_used = ++n_used;
+    }
+};
@@ -0,0 +1,127 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+
+#pragma once
+
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "llama.cpp/llava/clip.h"
+#include "llama.cpp/llava/llava.h"
+
+//
+// image encoder
+//
+// A thread that owns the CLIP context and runs the vision encoder for
+// the main loop, so a slot that was sent a picture waits for it on its
+// own while the other slots go on decoding. Jobs own the image they
+// encode, so a slot can be reset while its images are in flight. When
+// a job finishes, `on_done` is called from the encoder thread to wake
+// up the main loop, which picks the result up with collect().
+//
+
+struct server_image_encoder {
+    struct job {
+        int slot_id = -1;
+        int task_id = -1;
+        size_t index = 0;               // which image of the slot
+        std::string hash;
+        clip_image_u8 * img = nullptr;  // owned by the job
+        std::shared_ptr<float> embd;
+        int32_t n_tokens = 0;
+        bool ok = false;
+    };
+
+    clip_ctx * clp_ctx = nullptr;
+    int n_threads = 1;
+    std::function<void()> on_done;
+
+    std::thread thread;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::deque<job> pending;
+    std::vector<job> finished;
+    bool stopping = false;
+
+    bool running() const {
+        return thread.joinable();
+    }
+
+    void start(clip_ctx * clp_ctx_, int n_threads_, std::function<void()> on_done_) {
+        clp_ctx = clp_ctx_;
+        n_threads = n_threads_;
+        on_done = std::move(on_done_);
+        thread = std::thread([this] { work(); });
+    }
+
+    ~server_image_encoder() {
+        stop();
+    }
+
+    // waits for the image being encoded, if any, and drops the rest
+    void stop() {
+        if (!running()) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_one();
+        thread.join();
+        for (job & j : pending) {
+            clip_image_u8_free(j.img);
+        }
+        pending.clear();
+    }
+
+    void submit(job j) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            pending.push_back(std::move(j));
+        }
+        wake.notify_one();
+    }
+
+    // takes the jobs that finished since the last call
+    std::vector<job> collect() {
+        std::vector<job> res;
+        std::lock_guard<std::mutex> guard(lock);
+        res.swap(finished);
+        return res;
+    }
+
+    void work() {
+        for (;;) {
+            job j;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                wake.wait(guard, [this] { return stopping || !pending.empty(); });
+                if (stopping) {
+                    return;
+                }
+                j = std::move(pending.front());
+                pending.pop_front();
+            }
+            float * embd = nullptr;
+            j.ok = llava_image_embed_make_with_clip_img(clp_ctx, n_threads, j.img, &embd, &j.n_tokens);
+            if (j.ok) {
+                j.embd = std::shared_ptr<float>(embd, free);
+            }
+            clip_image_u8_free(j.img);
+            j.img = nullptr;
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                finished.push_back(std::move(j));
+            }
+            on_done();
+        }
+    }
+};
@@ -0,0 +1,213 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <type_traits>
+
+#include "llama.cpp/json.h"
+
+//
+// json writer
+//
+// Appends json to a string as it's written, for the small objects of a
+// fixed shape that are streamed for every token, which would otherwise
+// each be built as a document and then dumped. The output is the same
+// bytes dump(-1, ' ', false, error_handler_t::replace) gives, as long as
+// the keys of each object are written in sorted order, like nlohmann's
+// std::map keeps them.
+//
+
+struct json_writer {
+    std::string & out;
+    bool comma = false; // whether the next value needs one before it
+
+    explicit json_writer(std::string & out) : out(out) {}
+
+    json_writer & begin_object() {
+        sep();
+        out += '{';
+        comma = false;
+        return *this;
+    }
+
+    json_writer & end_object() {
+        out += '}';
+        comma = true;
+        return *this;
+    }
+
+    json_writer & begin_array() {
+        sep();
+        out += '[';
+        comma = false;
+        return *this;
+    }
+
+    json_writer & end_array() {
+        out += ']';
+        comma = true;
+        return *this;
+    }
+
+    // key must be plain ascii
+    json_writer & key(const char * k) {
+        sep();
+        out += '"';
+        out += k;
+        out += "\":";
+        comma = false;
+        return *this;
+    }
+
+    json_writer & value(const std::string & s) {
+        sep();
+        write_string(s);
+        comma = true;
+        return *this;
+    }
+
+    json_writer & value(const char * s) {
+        return value(std::string(s));
+    }
+
+    json_writer & value(bool b) {
+        sep();
+        out += b ? "true" : "false";
+        comma = true;
+        return *this;
+    }
+
+    json_writer & value(std::nullptr_t) {
+        sep();
+        out += "null";
+        comma = true;
+        return *this;
+    }
+
+    template <typename T,
+              typename std::enable_if<std::is_integral<T>::value && !std::is_same<T, bool>::value, int>::type = 0>
+    json_writer & value(T x) {
+        char buf[24];
+        sep();
+        if (std::is_signed<T>::value) {
+            out.append(buf, snprintf(buf, sizeof(buf), "%lld", (long long) x));
+        } else {
+            out.append(buf, snprintf(buf, sizeof(buf), "%llu", (unsigned long long) x));
+        }
+        comma = true;
+        return *this;
+    }
+
+    // floats are widened to double, which is what json stores them as
+    json_writer & value(double x) {
+        char buf[64];
+        sep();
+        if (std::isfinite(x)) {
+            out.append(buf, nlohmann::detail::to_chars(buf, buf + sizeof(buf), x) - buf);
+        } else {
+            out += "null";
+        }
+        comma = true;
+        return *this;
+    }
+
+    template <typename T>
+    json_writer & field(const char * k, const T & v) {
+        return key(k).value(v);
+    }
+
+  private:
+    void sep() {
+        if (comma) {
+            out += ',';
+        }
+    }
+
+    static bool is_utf8(const std::string & s) {
+        const unsigned char * p = (const unsigned char *) s.data();
+        const unsigned char * e = p + s.size();
+        while (p < e) {
+            int n;
+            uint32_t c = *p;
+            if (c < 0x80) {
+                ++p;
+                continue;
+            } else if ((c & 0xe0) == 0xc0) {
+                n = 1, c &= 0x1f;
+            } else if ((c & 0xf0) == 0xe0) {
+                n = 2, c &= 0x0f;
+            } else if ((c & 0xf8) == 0xf0) {
+                n = 3, c &= 0x07;
+            } else {
+                return false;
+            }
+            if (e - p <= n) {
+                return false;
+            }
+            for (int i = 1; i <= n; ++i) {
+                if ((p[i] & 0xc0) != 0x80) {
+                    return false;
+                }
+                c = c << 6 | (p[i] & 0x3f);
+            }
+            static const uint32_t min[] = {0, 0x80, 0x800, 0x10000};
+            if (c < min[n] || c > 0x10ffff || (c >= 0xd800 && c <= 0xdfff)) {
+                return false;
+            }
+            p += n + 1;
+        }
+        return true;
+    }
+
+    void write_string(const std::string & s) {
+        size_t i = 0;
+        while (i < s.size()) {
+            const unsigned char c = s[i];
+            if (c < 0x20 || c == '"' || c == '\\' || c >= 0x80) {
+                break;
+            }
+            ++i;
+        }
+        if (i == s.size()) {
+            out += '"';
+            out += s;
+            out += '"';
+            return;
+        }
+
+        // leave the replacement of broken utf-8 to nlohmann
+        if (!is_utf8(s)) {
+            out += nlohmann::json(s).dump(-1, ' ', false, nlohmann::json::error_handler_t::replace);
+            return;
+        }
+
+        out += '"';
+        out.append(s, 0, i);
+        for (; i < s.size(); ++i) {
+            const unsigned char c = s[i];
+            switch (c) {
+                case '\b': out += "\\b";  break;
+                case '\t': out += "\\t";  break;
+                case '\n': out += "\\n";  break;
+                case '\f': out += "\\f";  break;
+                case '\r': out += "\\r";  break;
+                case '"':  out += "\\\""; break;
+                case '\\': out += "\\\\"; break;
+                default:
+                    if (c < 0x20) {
+                        char buf[8];
+                        out.append(buf, snprintf(buf, sizeof(buf), "\\u%04x", c));
+                    } else {
+                        out += (char) c;
+                    }
+                    break;
+            }
+        }
+        out += '"';
+    }
+};
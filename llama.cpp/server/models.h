@@ -0,0 +1,126 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+
+#pragma once
+
+#include <dirent.h>
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "llama.cpp/ggml.h"
+#include "llama.cpp/llama.h"
+
+//
+// model registry
+//
+// Lets one server answer for a directory of GGUF files, which requests
+// pick by their name, less the extension, in their `model` field. A
+// model is loaded the first time it's asked for and stays resident
+// afterwards, until the weights of all of them add up to more than the
+// budget, when the one used the longest time ago is freed, unless some
+// request is still using it. Weights are mapped into memory, so loading
+// a model again mostly costs page faults, and an idle one only occupies
+// the page cache.
+//
+
+struct server_models {
+    struct entry {
+        std::string path;
+        std::shared_ptr<llama_model> model; // null while it isn't loaded
+        size_t size = 0;
+        int64_t t_last_used = 0;
+    };
+
+    llama_model_params mparams = llama_model_default_params();
+    size_t budget = 0; // bytes of weights kept loaded, 0 for no limit
+
+    std::mutex lock;
+    std::map<std::string, entry> entries; // only modified by scan()
+    size_t used = 0;
+
+    // registers every gguf file in dir, returning how many there are
+    int scan(const std::string & dir) {
+        DIR * d = opendir(dir.c_str());
+        if (!d) {
+            return -1;
+        }
+        while (struct dirent * e = readdir(d)) {
+            const std::string file = e->d_name;
+            const size_t n = file.size();
+            if (n > 5 && !file.compare(n - 5, 5, ".gguf")) {
+                entries[file.substr(0, n - 5)].path = dir + "/" + file;
+            }
+        }
+        closedir(d);
+        return entries.size();
+    }
+
+    bool empty() const {
+        return entries.empty();
+    }
+
+    // returns name if it's one of ours, otherwise the empty string, which
+    // stands for the model the server was started with
+    std::string resolve(const std::string & name) const {
+        return entries.count(name) ? name : std::string();
+    }
+
+    std::vector<std::string> names() const {
+        std::vector<std::string> res;
+        for (const auto & it : entries) {
+            res.push_back(it.first);
+        }
+        return res;
+    }
+
+    // returns the model called name, loading it if need be, or null if
+    // there's no such model or it failed to load
+    std::shared_ptr<llama_model> acquire(const std::string & name) {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = entries.find(name);
+        if (it == entries.end()) {
+            return nullptr;
+        }
+        entry & e = it->second;
+        e.t_last_used = ggml_time_us();
+        if (e.model) {
+            return e.model;
+        }
+        llama_model * model = llama_load_model_from_file(e.path.c_str(), mparams);
+        if (!model) {
+            return nullptr;
+        }
+        e.model.reset(model, llama_free_model);
+        e.size = llama_model_size(model);
+        used += e.size;
+        std::shared_ptr<llama_model> res = e.model;
+        evict();
+        return res;
+    }
+
+    // frees the least recently used models nobody holds until the rest
+    // fit the budget
+    void evict() {
+        while (budget && used > budget) {
+            entry * lru = nullptr;
+            for (auto & it : entries) {
+                entry & e = it.second;
+                if (e.model && e.model.use_count() == 1 &&
+                    (!lru || e.t_last_used < lru->t_last_used)) {
+                    lru = &e;
+                }
+            }
+            if (!lru) {
+                break;
+            }
+            lru->model.reset();
+            used -= lru->size;
+            lru->size = 0;
+        }
+    }
+};
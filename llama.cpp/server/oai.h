@@ -12,6 +12,7 @@
 
 #include "llama.cpp/json.h"
 #include "utils.h"
+#include "json_writer.h"
 
 #define DEFAULT_OAICOMPAT_MODEL "gpt-3.5-turbo-0613"
 
@@ -54,6 +55,20 @@ inline static json oaicompat_completion_params_parse(
     llama_params["repeat_last_n"]     = json_value(body, "repeat_last_n", default_sparams.penalty_last_n);
     llama_params["ignore_eos"]        = json_value(body, "ignore_eos", false);
     llama_params["tfs_z"]             = json_value(body, "tfs_z", default_sparams.tfs_z);
+    llama_params["n"]                 = json_value(body, "n", 1);
+    llama_params["timings_detail"]    = json_value(body, "timings_detail", false);
+    llama_params["priority"]          = json_value(body, "priority", 0);
+
+    if (body.count("deadline_ms") != 0) {
+        llama_params["deadline_ms"] = body["deadline_ms"];
+    }
+
+    if (body.count("lora") != 0) {
+        llama_params["lora"] = body["lora"];
+    }
+    if (body.count("control_vectors") != 0) {
+        llama_params["control_vectors"] = body["control_vectors"];
+    }
 
     if (body.count("grammar") != 0) {
         llama_params["grammar"] = json_value(body, "grammar", json::object());
@@ -81,6 +96,7 @@ inline static json format_final_response_oaicompat(const json &request, const ta
     int num_tokens_predicted = json_value(result, "tokens_predicted", 0);
     int num_prompt_tokens    = json_value(result, "tokens_evaluated", 0);
     std::string content      = json_value(result, "content", std::string(""));
+    int index                = json_value(result, "index", 0);
 
     std::string finish_reason = "length";
     if (stopped_word || stopped_eos) {
@@ -89,10 +105,10 @@ inline static json format_final_response_oaicompat(const json &request, const ta
 
     json choices =
         streaming ? json::array({json{{"finish_reason", finish_reason},
-                                        {"index", 0},
+                                        {"index", index},
                                         {"delta", json::object()}}})
                   : json::array({json{{"finish_reason", finish_reason},
-                                        {"index", 0},
+                                        {"index", index},
                                         {"message", json{{"content", content},
                                                          {"role", "assistant"}}}}});
 
@@ -118,6 +134,28 @@ inline static json format_final_response_oaicompat(const json &request, const ta
         res["completion_probabilities"] = json_value(result, "completion_probabilities", json::array());
     }
 
+    if (result.contains("timings_detail")) {
+        res["timings_detail"] = result["timings_detail"];
+    }
+
+    return res;
+}
+
+// merges the choices of a request with n > 1, which share their prompt
+inline static json format_final_response_oaicompat(const json &request, const std::vector<task_result> &responses)
+{
+    json res = format_final_response_oaicompat(request, responses[0]);
+    int num_tokens_predicted = 0;
+    json choices = json::array();
+    for (const task_result &response : responses) {
+        json choice = format_final_response_oaicompat(request, response);
+        num_tokens_predicted += choice["usage"]["completion_tokens"].get<int>();
+        choices.push_back(choice["choices"][0]);
+    }
+    const int num_prompt_tokens = res["usage"]["prompt_tokens"].get<int>();
+    res["choices"] = choices;
+    res["usage"]["completion_tokens"] = num_tokens_predicted;
+    res["usage"]["total_tokens"] = num_tokens_predicted + num_prompt_tokens;
     return res;
 }
 
@@ -136,6 +174,7 @@ inline static std::vector<json> format_partial_response_oaicompat(const task_res
     bool stopped_eos    = json_value(result, "stopped_eos", false);
     bool stopped_limit  = json_value(result, "stopped_limit", false);
     std::string content = json_value(result, "content", std::string(""));
+    int index           = json_value(result, "index", 0);
 
     std::string finish_reason;
     if (stopped_word || stopped_eos) {
@@ -151,19 +190,19 @@ inline static std::vector<json> format_partial_response_oaicompat(const task_res
 
     if (!finish_reason.empty()) {
         choices = json::array({json{{"finish_reason", finish_reason},
-                                    {"index", 0},
+                                    {"index", index},
                                     {"delta", json::object()}}});
     } else {
         if (first) {
             if (content.empty()) {
                 choices = json::array({json{{"finish_reason", nullptr},
-                                            {"index", 0},
+                                            {"index", index},
                                             {"delta", json{{"role", "assistant"}}}}});
             } else {
                 // We have to send this as two updates to conform to openai behavior
                 json initial_ret = json{{"choices", json::array({json{
                                         {"finish_reason", nullptr},
-                                        {"index", 0},
+                                        {"index", index},
                                         {"delta", json{
                                             {"role", "assistant"}
                                         }}}})},
@@ -174,7 +213,7 @@ inline static std::vector<json> format_partial_response_oaicompat(const task_res
 
                 json second_ret = json{
                             {"choices", json::array({json{{"finish_reason", nullptr},
-                                                            {"index", 0},
+                                                            {"index", index},
                                                             {"delta", json{
                                                             {"content", content}}}
                                                             }})},
@@ -194,7 +233,7 @@ inline static std::vector<json> format_partial_response_oaicompat(const task_res
 
             choices = json::array({json{
                 {"finish_reason", nullptr},
-                {"index", 0},
+                {"index", index},
                 {"delta",
                 json{
                     {"content", content},
@@ -212,6 +251,50 @@ inline static std::vector<json> format_partial_response_oaicompat(const task_res
     return std::vector<json>({ret});
 }
 
+// writes the event format_partial_response_oaicompat() would make of a
+// token, returning false if there's nothing to send
+inline static bool write_partial_response_oaicompat(std::string &sse, const std::string &content,
+                                                    int index, bool first, const std::string &modelname)
+{
+    if (!first && content.empty()) {
+        return false;
+    }
+    const std::time_t t = std::time(0);
+    const auto event = [&](bool role, bool text) {
+        sse += "data: ";
+        json_writer w(sse);
+        w.begin_object();
+        w.key("choices").begin_array().begin_object();
+        w.key("delta").begin_object();
+        if (text) {
+            w.field("content", content);
+        }
+        if (role) {
+            w.field("role", "assistant");
+        }
+        w.end_object();
+        w.field("finish_reason", nullptr);
+        w.field("index", index);
+        w.end_object().end_array();
+        w.field("created", (int64_t) t);
+        w.field("id", gen_chatcmplid());
+        w.field("model", modelname);
+        w.field("object", "chat.completion.chunk");
+        w.end_object();
+        sse += "\n\n";
+    };
+    if (first) {
+        // We have to send this as two updates to conform to openai behavior
+        event(true, false);
+        if (!content.empty()) {
+            event(false, true);
+        }
+    } else {
+        event(false, true);
+    }
+    return true;
+}
+
 inline static json format_embeddings_response_oaicompat(const json &request, const json &embeddings)
 {
     json res =
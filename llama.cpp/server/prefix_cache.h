@@ -0,0 +1,441 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+
+#pragma once
+
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include <cstdint>
+
+#include "llama.cpp/ggml.h"
+#include "llama.cpp/llama.h"
+#include "prefix_store.h"
+
+//
+// prefix cache
+//
+// A token radix tree shared by all slots, which remembers the prompts
+// of finished requests so that another slot can pick them up later on.
+//
+// Every entry owns a private sequence id in the KV cache, starting at
+// `seq_base`. Entries are created with llama_kv_cache_seq_cp(), which
+// only tags the cells of the source slot with one more sequence id, so
+// caching a prefix costs no memory until the slot overwrites it. When
+// the cache is full, or the KV cache runs out of cells, the entry used
+// the longest time ago is evicted, to the prefix store on disk if the
+// server was given a --prefix-cache-dir, where fetch() finds it again.
+//
+
+struct server_prefix_cache {
+    struct node {
+        std::vector<llama_token> edge; // tokens leading into this node
+        std::map<llama_token, int> children;
+        int parent = -1;
+        llama_seq_id seq = -1; // entry terminating at this node
+    };
+
+    struct entry {
+        int node = -1; // -1 if this entry is free
+        int32_t n_tokens = 0;
+        int64_t t_last_used = 0;
+    };
+
+    llama_context * ctx = nullptr;
+    llama_seq_id seq_base = 0;  // first sequence id owned by the cache
+    int32_t n_max = 0;          // maximum number of entries, 0 if disabled
+
+    std::vector<node> nodes;    // nodes[0] is the root
+    std::vector<int> free_nodes;
+    std::vector<entry> entries; // indexed by seq - seq_base
+    int32_t n_used = 0;
+
+    server_prefix_store store;
+    std::vector<llama_token> system; // tokens of the system prompt
+    std::unordered_map<int, std::shared_ptr<server_prefix_store::pending>> reads; // by slot
+
+    bool init(llama_context * ctx_, llama_seq_id seq_base_) {
+        ctx = ctx_;
+        seq_base = seq_base_;
+        if (n_max <= 0) {
+            n_max = 0;
+            return false;
+        }
+        // models with a recurrent state (e.g. mamba) only have as many
+        // sequences as --parallel asks for, which we detect by probing
+        if (!llama_kv_cache_seq_rm(ctx, seq_base + n_max - 1, -1, -1)) {
+            n_max = 0;
+            return false;
+        }
+        entries.assign(n_max, entry());
+        reset();
+        return true;
+    }
+
+    bool enabled() const {
+        return n_max > 0;
+    }
+
+    int32_t size() const {
+        return n_used;
+    }
+
+    // forgets every entry without touching the KV cache. it's used
+    // after llama_kv_cache_clear() has already removed our cells.
+    void reset() {
+        nodes.clear();
+        nodes.emplace_back();
+        free_nodes.clear();
+        for (entry & e : entries) {
+            e = entry();
+        }
+        n_used = 0;
+    }
+
+    // removes every entry from the KV cache
+    void clear() {
+        for (size_t i = 0; i < entries.size(); ++i) {
+            if (entries[i].node >= 0) {
+                llama_kv_cache_seq_rm(ctx, seq_base + i, -1, -1);
+            }
+        }
+        reset();
+    }
+
+    // finds the longest cached prefix of `tokens`
+    //
+    // returns the number of leading tokens whose KV cells are held by
+    // `*seq`, which is zero if nothing matched.
+    int32_t find(const std::vector<llama_token> & tokens, llama_seq_id * seq) {
+        if (!enabled()) {
+            return 0;
+        }
+        int cur;
+        const int32_t n_match = match(tokens, &cur);
+        if (!n_match) {
+            return 0;
+        }
+        const llama_seq_id best = most_recent(cur);
+        if (best < 0) {
+            return 0;
+        }
+        entries[best - seq_base].t_last_used = ggml_time_us();
+        *seq = best;
+        return n_match;
+    }
+
+    // reads a longer prefix of `tokens` back from disk
+    //
+    // `n_have` is how many tokens the slot could start from otherwise,
+    // and each slot has at most one read in flight.
+    // returns true while the read is in flight, in which case the slot
+    // should ask again later. once it's done the prefix is an entry that
+    // find() returns like any other.
+    bool fetch(int slot, const std::vector<llama_token> & tokens, int32_t n_have) {
+        if (!enabled() || !store.enabled()) {
+            return false;
+        }
+        std::vector<llama_token> seq_tokens = system;
+        seq_tokens.insert(seq_tokens.end(), tokens.begin(), tokens.end());
+        std::string name;
+        int cur;
+        const int32_t n_disk = store.find(seq_tokens, system.size(), &name) - (int32_t) system.size();
+        auto it = reads.find(slot);
+        if (n_disk <= std::max(n_have, match(tokens, &cur))) {
+            if (it != reads.end()) {
+                reads.erase(it);
+            }
+            return false;
+        }
+        // the index may point elsewhere by now, e.g. after a put(), in
+        // which case the worker finishes the old read for nobody
+        if (it == reads.end() || it->second->name != name) {
+            reads[slot] = store.get(name);
+            return true;
+        }
+        if (!it->second->done.load(std::memory_order_acquire)) {
+            return true;
+        }
+        auto r = it->second;
+        reads.erase(it);
+        if (!r->ok || !restore(r->data)) {
+            store.remove(name);
+        }
+        return false;
+    }
+
+    // remembers the first `n_tokens` of `tokens`
+    //
+    // the KV cells for those tokens must currently belong to `seq_src`
+    // at positions [n_offset, n_offset + n_tokens) where n_offset is the
+    // length of the system prompt, which every slot shares.
+    void insert(const std::vector<llama_token> & tokens, int32_t n_tokens,
+                llama_seq_id seq_src, llama_pos n_offset) {
+        if (!enabled() || n_tokens <= 0) {
+            return;
+        }
+        const int end = walk(tokens, n_tokens);
+        if (end < 0) {
+            // an entry already holds this prefix or something longer
+            llama_seq_id seq = -end - 1;
+            entries[seq - seq_base].t_last_used = ggml_time_us();
+            return;
+        }
+        llama_seq_id seq = acquire();
+        llama_kv_cache_seq_cp(ctx, seq_src, seq, 0, n_offset + n_tokens);
+        link(tokens, n_tokens, seq);
+    }
+
+    // drops the entry that was used the longest time ago
+    bool evict() {
+        llama_seq_id lru = -1;
+        int64_t t_lru = INT64_MAX;
+        for (size_t i = 0; i < entries.size(); ++i) {
+            if (entries[i].node >= 0 && entries[i].t_last_used < t_lru) {
+                t_lru = entries[i].t_last_used;
+                lru = seq_base + i;
+            }
+        }
+        if (lru < 0) {
+            return false;
+        }
+        if (store.enabled()) {
+            spill(lru);
+        }
+        remove(lru);
+        return true;
+    }
+
+    void remove(llama_seq_id seq) {
+        entry & e = entries[seq - seq_base];
+        if (e.node < 0) {
+            return;
+        }
+        llama_kv_cache_seq_rm(ctx, seq, -1, -1);
+        int x = e.node;
+        nodes[x].seq = -1;
+        e = entry();
+        --n_used;
+        // prune branches that no longer lead anywhere
+        while (x > 0 && nodes[x].seq < 0 && nodes[x].children.empty()) {
+            const int parent = nodes[x].parent;
+            nodes[parent].children.erase(nodes[x].edge[0]);
+            release_node(x);
+            x = parent;
+        }
+        // keep the tree path compressed
+        if (x > 0 && nodes[x].seq < 0 && nodes[x].children.size() == 1) {
+            const int c = nodes[x].children.begin()->second;
+            nodes[x].edge.insert(nodes[x].edge.end(), nodes[c].edge.begin(), nodes[c].edge.end());
+            nodes[x].children.swap(nodes[c].children);
+            for (auto & it : nodes[x].children) {
+                nodes[it.second].parent = x;
+            }
+            nodes[x].seq = nodes[c].seq;
+            if (nodes[x].seq >= 0) {
+                entries[nodes[x].seq - seq_base].node = x;
+            }
+            release_node(c);
+        }
+    }
+
+  private:
+    // returns the number of leading tokens on a path of the tree
+    int32_t match(const std::vector<llama_token> & tokens, int * end) const {
+        int cur = 0;
+        size_t i = 0;
+        while (i < tokens.size()) {
+            auto it = nodes[cur].children.find(tokens[i]);
+            if (it == nodes[cur].children.end()) {
+                break;
+            }
+            const node & child = nodes[it->second];
+            size_t k = 0;
+            while (k < child.edge.size() && i + k < tokens.size() && child.edge[k] == tokens[i + k]) {
+                ++k;
+            }
+            i += k;
+            cur = it->second;
+            if (k < child.edge.size()) {
+                break;
+            }
+        }
+        *end = cur;
+        return i;
+    }
+
+    // makes seq, which holds the cells of tokens, an entry of the tree
+    void link(const std::vector<llama_token> & tokens, int32_t n_tokens, llama_seq_id seq) {
+        const int leaf = split(tokens, n_tokens);
+        nodes[leaf].seq = seq;
+        entry & e = entries[seq - seq_base];
+        e.node = leaf;
+        e.n_tokens = n_tokens;
+        e.t_last_used = ggml_time_us();
+        // shorter entries along the path are now redundant
+        for (int p = nodes[leaf].parent; p > 0;) {
+            const int parent = nodes[p].parent;
+            if (nodes[p].seq >= 0) {
+                remove(nodes[p].seq);
+            }
+            p = parent;
+        }
+    }
+
+    // writes the cells of an entry to the prefix store
+    void spill(llama_seq_id seq) {
+        std::vector<llama_token> tokens;
+        for (int x = entries[seq - seq_base].node; x > 0; x = nodes[x].parent) {
+            tokens.insert(tokens.begin(), nodes[x].edge.begin(), nodes[x].edge.end());
+        }
+        tokens.insert(tokens.begin(), system.begin(), system.end());
+        // every slot holds the system prompt, so it isn't written
+        llama_kv_cache_seq_rm(ctx, seq, 0, system.size());
+        store.put(ctx, seq, tokens, system.size());
+    }
+
+    // turns a file of the prefix store back into an entry
+    //
+    // returns false if the file is damaged. running out of KV cells is
+    // not the file's fault, so the prompt is just evaluated instead.
+    bool restore(const std::vector<uint8_t> & data) {
+        uint32_t header[4];
+        if (data.size() < sizeof(header)) {
+            return false;
+        }
+        memcpy(header, data.data(), sizeof(header));
+        const size_t n_header = sizeof(header) + (size_t) header[3] * sizeof(llama_token);
+        if (header[0] != PREFIX_STORE_MAGIC || header[1] != PREFIX_STORE_VERSION ||
+            header[2] != system.size() || header[3] <= system.size() || data.size() <= n_header) {
+            return false;
+        }
+        // the file was found by a hash that covers the system prompt, and
+        // it has no cells for it, so they must be the slot's own
+        std::vector<llama_token> tokens(header[3] - system.size());
+        memcpy(tokens.data(), data.data() + sizeof(header) + system.size() * sizeof(llama_token),
+               tokens.size() * sizeof(llama_token));
+        if (walk(tokens, tokens.size()) < 0) {
+            return true;
+        }
+        const int32_t n_ctx = llama_n_ctx(ctx);
+        while (n_used > 0 && n_ctx - llama_get_kv_cache_used_cells(ctx) < (int32_t) tokens.size()) {
+            evict();
+        }
+        const llama_seq_id seq = acquire();
+        if (!llama_state_seq_set_data_checked(ctx, data.data() + n_header, data.size() - n_header, seq)) {
+            llama_kv_cache_seq_rm(ctx, seq, -1, -1);
+            --n_used;
+            return true;
+        }
+        llama_kv_cache_seq_rm(ctx, seq, 0, system.size());
+        link(tokens, tokens.size(), seq);
+        return true;
+    }
+
+    // returns -seq-1 if tokens are already covered by an entry
+    int walk(const std::vector<llama_token> & tokens, int32_t n_tokens) {
+        int cur = 0;
+        int32_t i = 0;
+        while (i < n_tokens) {
+            auto it = nodes[cur].children.find(tokens[i]);
+            if (it == nodes[cur].children.end()) {
+                return 0;
+            }
+            const node & child = nodes[it->second];
+            size_t k = 0;
+            while (k < child.edge.size() && i + (int32_t) k < n_tokens && child.edge[k] == tokens[i + k]) {
+                ++k;
+            }
+            i += k;
+            cur = it->second;
+            if (k < child.edge.size() && i < n_tokens) {
+                return 0; // diverges in the middle of an edge
+            }
+        }
+        const llama_seq_id seq = most_recent(cur);
+        return seq >= 0 ? -seq - 1 : 0;
+    }
+
+    // creates the path for tokens, splitting edges as needed
+    int split(const std::vector<llama_token> & tokens, int32_t n_tokens) {
+        int cur = 0;
+        int32_t i = 0;
+        while (i < n_tokens) {
+            auto it = nodes[cur].children.find(tokens[i]);
+            if (it == nodes[cur].children.end()) {
+                const int leaf = new_node();
+                nodes[leaf].edge.assign(tokens.begin() + i, tokens.begin() + n_tokens);
+                nodes[leaf].parent = cur;
+                nodes[cur].children[tokens[i]] = leaf;
+                return leaf;
+            }
+            int child = it->second;
+            size_t k = 0;
+            while (k < nodes[child].edge.size() && i + (int32_t) k < n_tokens && nodes[child].edge[k] == tokens[i + k]) {
+                ++k;
+            }
+            if (k < nodes[child].edge.size()) {
+                const int mid = new_node();
+                nodes[mid].edge.assign(nodes[child].edge.begin(), nodes[child].edge.begin() + k);
+                nodes[mid].parent = cur;
+                nodes[mid].children[nodes[child].edge[k]] = child;
+                nodes[child].edge.erase(nodes[child].edge.begin(), nodes[child].edge.begin() + k);
+                nodes[child].parent = mid;
+                nodes[cur].children[tokens[i]] = mid;
+                child = mid;
+            }
+            i += k;
+            cur = child;
+        }
+        return cur;
+    }
+
+    llama_seq_id most_recent(int root) const {
+        llama_seq_id best = -1;
+        int64_t t_best = INT64_MIN;
+        std::vector<int> todo = {root};
+        while (!todo.empty()) {
+            const int x = todo.back();
+            todo.pop_back();
+            const llama_seq_id seq = nodes[x].seq;
+            if (seq >= 0 && entries[seq - seq_base].t_last_used > t_best) {
+                t_best = entries[seq - seq_base].t_last_used;
+                best = seq;
+            }
+            for (const auto & it : nodes[x].children) {
+                todo.push_back(it.second);
+            }
+        }
+        return best;
+    }
+
+    llama_seq_id acquire() {
+        if (n_used == n_max) {
+            evict();
+        }
+        for (size_t i = 0; i < entries.size(); ++i) {
+            if (entries[i].node < 0) {
+                ++n_used;
+                return seq_base + i;
+            }
+        }
+        GGML_ASSERT(!"prefix cache has no free entries");
+        return -1;
+    }
+
+    int new_node() {
+        if (!free_nodes.empty()) {
+            const int x = free_nodes.back();
+            free_nodes.pop_back();
+            return x;
+        }
+        nodes.emplace_back();
+        return nodes.size() - 1;
+    }
+
+    void release_node(int x) {
+        nodes[x] = node();
+        free_nodes.push_back(x);
+    }
+};
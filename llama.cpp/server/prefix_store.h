@@ -0,0 +1,378 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <dirent.h>
+#include <fcntl.h>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#include "llama.cpp/llama.h"
+#include "llamafile/sha256.h"
+
+#define PREFIX_STORE_MAGIC   0x67677078u // 'ggpx'
+#define PREFIX_STORE_VERSION 1
+#define PREFIX_STORE_BLOCK   128 // tokens per content hash
+
+//
+// prefix store
+//
+// The disk tier of the prefix cache. When an entry is evicted from the
+// KV cache its cells are serialized with llama_state_seq_get_data() to
+// a file in --prefix-cache-dir, so a later prompt with the same prefix
+// can read them back instead of evaluating it again, which on an SSD
+// is much cheaper than prefill for long prompts.
+//
+// Files are content addressed. The tokens of a sequence, system prompt
+// included, are cut into blocks of PREFIX_STORE_BLOCK, and each block
+// is hashed together with the hash of the blocks before it, starting
+// from a hash of the model and the length of the system prompt, whose
+// cells aren't written since every slot already holds them. So a file
+// is only ever found for a system prompt of the same length, over the
+// same tokens. A file is named after the hash of its last
+// full block and is indexed under the hash of every block, so a prompt
+// is matched by hashing it block by block until the index misses.
+//
+// The reads and writes are done in order by a thread of their own, so
+// a slot waiting for its prefix doesn't hold up those that are decoding.
+//
+
+struct server_prefix_store {
+    struct file {
+        std::vector<std::string> blocks; // hashes this file is indexed under
+        size_t size = 0;
+        int64_t t_last_used = 0;
+    };
+
+    struct pending {
+        std::string name;
+        std::vector<uint8_t> data;
+        std::atomic<bool> done{false};
+        bool ok = false;
+    };
+
+    std::string dir;         // ends with a slash, empty if disabled
+    size_t n_bytes_max = 0;  // size limit of the directory, 0 for none
+    size_t n_bytes = 0;
+    std::string salt;        // hash of the model and kv cache types
+    std::function<void()> on_read; // called by the worker after a read
+
+    // only touched by the thread that owns the llama_context
+    std::unordered_map<std::string, std::string> index; // block hash -> file
+    std::unordered_map<std::string, file> files;
+
+    std::mutex lock;
+    std::condition_variable cond;
+    std::deque<std::function<void()>> jobs;
+    std::thread worker;
+    bool stopping = false;
+
+    ~server_prefix_store() {
+        if (worker.joinable()) {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                stopping = true;
+            }
+            cond.notify_one();
+            worker.join(); // finishes writing what was evicted
+        }
+    }
+
+    bool enabled() const {
+        return !dir.empty();
+    }
+
+    int32_t size() const {
+        return files.size();
+    }
+
+    // indexes the files that are already in the directory
+    bool init(const llama_model * model, const std::string & model_salt) {
+        if (dir.empty()) {
+            return false;
+        }
+        if (dir.back() != '/') {
+            dir += '/';
+        }
+        mkdir(dir.c_str(), 0755);
+        DIR * d = opendir(dir.c_str());
+        if (!d) {
+            dir.clear();
+            return false;
+        }
+        char desc[128];
+        llama_model_desc(model, desc, sizeof(desc));
+        std::string s = desc;
+        s += '\0';
+        s += std::to_string(llama_model_size(model));
+        s += '\0';
+        s += std::to_string(llama_model_n_params(model));
+        s += '\0';
+        s += model_salt;
+        unsigned char digest[32];
+        llamafile_sha256(s.data(), s.size(), digest);
+        salt.assign((const char *) digest, sizeof(digest));
+        const int64_t t_now = ggml_time_us();
+        while (struct dirent * e = readdir(d)) {
+            std::string name = e->d_name;
+            if (name.size() != 64 || name.find_first_not_of("0123456789abcdef") != std::string::npos) {
+                continue;
+            }
+            std::vector<llama_token> tokens;
+            uint32_t n_offset;
+            struct stat st;
+            if (stat((dir + name).c_str(), &st) || !read_tokens(dir + name, &tokens, &n_offset)) {
+                continue;
+            }
+            // files written for another model never hash to their name
+            std::vector<std::string> blocks = hash(tokens, tokens.size(), n_offset);
+            if (blocks.empty() || hex(blocks.back()) != name) {
+                continue;
+            }
+            // older files are let go of first
+            add(name, std::move(blocks), st.st_size, t_now - (int64_t) (time(0) - st.st_mtime) * 1000000);
+        }
+        closedir(d);
+        worker = std::thread([this] { work(); });
+        return true;
+    }
+
+    // returns the hashes of every full block of the first n tokens, of
+    // which the first n_offset are those of the system prompt
+    std::vector<std::string> hash(const std::vector<llama_token> & tokens, size_t n, uint32_t n_offset) const {
+        std::vector<std::string> blocks;
+        std::string h = seed(n_offset);
+        for (size_t i = PREFIX_STORE_BLOCK; i <= n; i += PREFIX_STORE_BLOCK) {
+            std::string s = h;
+            s.append((const char *) (tokens.data() + i - PREFIX_STORE_BLOCK), PREFIX_STORE_BLOCK * sizeof(llama_token));
+            unsigned char digest[32];
+            llamafile_sha256(s.data(), s.size(), digest);
+            h.assign((const char *) digest, sizeof(digest));
+            blocks.push_back(h);
+        }
+        return blocks;
+    }
+
+    // finds the file holding the longest prefix of tokens
+    //
+    // returns the number of leading tokens its name vouches for, which
+    // is zero if nothing matched. the file may hold more tokens.
+    int32_t find(const std::vector<llama_token> & tokens, uint32_t n_offset, std::string * name) const {
+        int32_t n_match = 0;
+        std::string h = seed(n_offset);
+        for (size_t i = PREFIX_STORE_BLOCK; i <= tokens.size(); i += PREFIX_STORE_BLOCK) {
+            std::string s = h;
+            s.append((const char *) (tokens.data() + i - PREFIX_STORE_BLOCK), PREFIX_STORE_BLOCK * sizeof(llama_token));
+            unsigned char digest[32];
+            llamafile_sha256(s.data(), s.size(), digest);
+            h.assign((const char *) digest, sizeof(digest));
+            auto it = index.find(h);
+            if (it == index.end()) {
+                break;
+            }
+            *name = it->second;
+            n_match = i;
+        }
+        return n_match;
+    }
+
+    // writes the cells of seq, which hold tokens at positions [0, n)
+    //
+    // the cells are copied out of the KV cache right away and written
+    // by the worker, so the sequence may be removed once this returns.
+    bool put(llama_context * ctx, llama_seq_id seq, const std::vector<llama_token> & tokens, uint32_t n_offset) {
+        if (!enabled() || tokens.size() < PREFIX_STORE_BLOCK) {
+            return false;
+        }
+        std::vector<std::string> blocks = hash(tokens, tokens.size(), n_offset);
+        const std::string name = hex(blocks.back());
+        if (files.count(name)) {
+            // it was read back from this very file
+            files[name].t_last_used = ggml_time_us();
+            return true;
+        }
+        const uint32_t header[4] = {PREFIX_STORE_MAGIC, PREFIX_STORE_VERSION, n_offset, (uint32_t) tokens.size()};
+        const size_t n_header = sizeof(header) + tokens.size() * sizeof(llama_token);
+        auto blob = std::make_shared<std::vector<uint8_t>>(n_header + llama_state_seq_get_size(ctx, seq));
+        memcpy(blob->data(), header, sizeof(header));
+        memcpy(blob->data() + sizeof(header), tokens.data(), tokens.size() * sizeof(llama_token));
+        const size_t n_written = llama_state_seq_get_data(ctx, blob->data() + n_header, seq);
+        if (!n_written) {
+            return false;
+        }
+        blob->resize(n_header + n_written);
+        add(name, std::move(blocks), blob->size(), ggml_time_us());
+        const std::string path = dir + name;
+        submit([path, blob] {
+            // renamed into place so other workers never see half a file
+            const std::string tmp = path + ".tmp." + std::to_string(getpid());
+            const int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd == -1) {
+                return;
+            }
+            bool ok = true;
+            for (size_t i = 0; ok && i < blob->size();) {
+                const ssize_t rc = write(fd, blob->data() + i, blob->size() - i);
+                ok = rc > 0;
+                i += ok ? rc : 0;
+            }
+            close(fd);
+            if (!ok || rename(tmp.c_str(), path.c_str())) {
+                unlink(tmp.c_str());
+            }
+        });
+        trim();
+        return true;
+    }
+
+    // starts reading a file in the background
+    std::shared_ptr<pending> get(const std::string & name) {
+        auto r = std::make_shared<pending>();
+        r->name = name;
+        files[name].t_last_used = ggml_time_us();
+        const std::string path = dir + name;
+        submit([this, path, r] {
+            const int fd = open(path.c_str(), O_RDONLY);
+            struct stat st;
+            if (fd != -1 && !fstat(fd, &st)) {
+                r->data.resize(st.st_size);
+                size_t i = 0;
+                while (i < r->data.size()) {
+                    const ssize_t rc = pread(fd, r->data.data() + i, r->data.size() - i, i);
+                    if (rc <= 0) {
+                        break;
+                    }
+                    i += rc;
+                }
+                r->ok = i == r->data.size();
+            }
+            if (fd != -1) {
+                close(fd);
+            }
+            r->done.store(true, std::memory_order_release);
+            if (on_read) {
+                on_read();
+            }
+        });
+        return r;
+    }
+
+    // forgets a file, e.g. because it couldn't be read back
+    void remove(const std::string & name) {
+        auto it = files.find(name);
+        if (it == files.end()) {
+            return;
+        }
+        for (const std::string & h : it->second.blocks) {
+            auto ix = index.find(h);
+            if (ix != index.end() && ix->second == name) {
+                index.erase(ix);
+            }
+        }
+        n_bytes -= it->second.size;
+        files.erase(it);
+        const std::string path = dir + name;
+        submit([path] { unlink(path.c_str()); });
+    }
+
+  private:
+    std::string seed(uint32_t n_offset) const {
+        std::string s = salt;
+        s.append((const char *) &n_offset, sizeof(n_offset));
+        unsigned char digest[32];
+        llamafile_sha256(s.data(), s.size(), digest);
+        return std::string((const char *) digest, sizeof(digest));
+    }
+
+    static std::string hex(const std::string & h) {
+        static const char digits[] = "0123456789abcdef";
+        std::string s;
+        for (unsigned char c : h) {
+            s += digits[c >> 4];
+            s += digits[c & 15];
+        }
+        return s;
+    }
+
+    static bool read_tokens(const std::string & path, std::vector<llama_token> * tokens, uint32_t * n_offset) {
+        FILE * f = fopen(path.c_str(), "rb");
+        if (!f) {
+            return false;
+        }
+        uint32_t header[4];
+        bool ok = fread(header, sizeof(header), 1, f) == 1 &&
+                  header[0] == PREFIX_STORE_MAGIC && header[1] == PREFIX_STORE_VERSION &&
+                  header[2] <= header[3] && header[3] <= (1u << 24);
+        if (ok) {
+            *n_offset = header[2];
+            tokens->resize(header[3]);
+            ok = fread(tokens->data(), sizeof(llama_token), tokens->size(), f) == tokens->size();
+        }
+        fclose(f);
+        return ok;
+    }
+
+    void add(const std::string & name, std::vector<std::string> blocks, size_t size, int64_t t_last_used) {
+        // a newer file takes over the blocks it shares with older ones
+        for (const std::string & h : blocks) {
+            index[h] = name;
+        }
+        file & f = files[name];
+        f.blocks = std::move(blocks);
+        f.size = size;
+        f.t_last_used = t_last_used;
+        n_bytes += size;
+    }
+
+    // deletes the files used the longest time ago until under budget
+    void trim() {
+        while (n_bytes_max && n_bytes > n_bytes_max && files.size() > 1) {
+            auto lru = files.end();
+            for (auto it = files.begin(); it != files.end(); ++it) {
+                if (lru == files.end() || it->second.t_last_used < lru->second.t_last_used) {
+                    lru = it;
+                }
+            }
+            remove(lru->first);
+        }
+    }
+
+    void submit(std::function<void()> job) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            jobs.push_back(std::move(job));
+        }
+        cond.notify_one();
+    }
+
+    void work() {
+        for (;;) {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                cond.wait(guard, [this] { return stopping || !jobs.empty(); });
+                if (jobs.empty()) {
+                    return;
+                }
+                job = std::move(jobs.front());
+                jobs.pop_front();
+            }
+            job();
+        }
+    }
+};
@@ -6,11 +6,26 @@
 #include "llama.cpp/grammar-parser.h"
 #include "llama.cpp/llava/llava.h"
 #include "llama.cpp/stb_image.h"
+#include "llama.cpp/ggml-backend.h"
 #include "utils.h"
 #include "oai.h"
+#include "prefix_cache.h"
+#include "image_cache.h"
+#include "embd_cache.h"
+#include "image_encoder.h"
+#include "json_writer.h"
+#include "streams.h"
+#include "stop_strings.h"
+#include "detokenizer.h"
+#include "models.h"
+#include "workers.h"
 #include "llamafile/micros.h"
 #include "llamafile/llamafile.h"
+#include "llamafile/energy.h"
 #include "llamafile/debug.h"
+#include "llamafile/perfctr.h"
+#include "llamafile/flight.h"
+#include "llamafile/trace.h"
 #include "macsandbox.h"
 
 // increase max payload length to allow use of larger context size
@@ -23,11 +38,22 @@
 #include <chrono>
 #include <condition_variable>
 #include <atomic>
+#include <fcntl.h>
 #include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #include <libc/calls/pledge.h>
 #include <tool/args/args.h>
 #include <libc/dce.h>
 
+#define SLOT_EXPORT_MAGIC   0x67677378u // 'ggsx'
+#define SLOT_EXPORT_VERSION 1
+#define SLOT_EXPORT_CHUNK   (1024 * 1024) // bytes sent per write by /slots/{id}?action=export
+
+#define SCORE_MAX_SEQ 64 // documents /score packs behind one copy of the query
+#define STATUS_INTERVAL_US 100000 // how often /health, /slots and /metrics see busy slots change
+
 double g_prompt_per_second_jart;
 
 using json = nlohmann::json;
@@ -36,13 +62,46 @@ struct server_params
 {
     std::string hostname = "127.0.0.1";
     std::vector<std::string> api_keys;
+    std::vector<std::string> lora_runtime;
+    std::vector<std::string> control_vector_runtime;
     std::string public_path = "/zip/llama.cpp/server/public";
     std::string chat_template = "";
+    std::string slot_save_path;
+    std::string prefix_cache_dir;
+    std::string snapshot_path;
+    std::string unix_socket;
+    std::string models_dir;
+    std::vector<double> metrics_latency_buckets = {
+        0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60,
+    };
     int32_t port = 8080;
     int32_t read_timeout = 600;
     int32_t write_timeout = 600;
+    int32_t n_prefix_cache = 0;
+    int32_t n_prefix_cache_disk = 0;
+    int32_t n_preempt_pool = 0;
+    int32_t n_models_budget = 0;
+    int32_t n_image_cache = 4;
+    int32_t n_embd_cache = 0;
+    int32_t n_stream_threads = 1;
+    int32_t n_workers = 1;
+    int32_t n_queue_max = 0;
+    float queue_timeout = 0;
+    int32_t n_prefill_chunk = 0;
+    int32_t n_logits_top_k = 0;
+    int32_t n_layer_draft = 0;
+    int32_t n_lookup_ngram = 0;
+    int32_t n_slot_reserve = 512;
+    int32_t n_shift_block = 0;
+    int32_t n_attn_sinks = 0;
+    bool jump_forward = false;
+    float slot_prompt_similarity = 0.5f;
+    bool dynamic_slots = false;
+    bool tune_ubatch = false;
+    bool sync_images = false;
     bool nobrowser = false;
     bool slots_endpoint = true;
+    bool slot_transfer = false;
     bool metrics_endpoint = false;
 };
 
@@ -58,37 +117,106 @@ static size_t common_part(const std::vector<llama_token> &a, const std::vector<l
     return i;
 }
 
-enum stop_type
+// picks the physical batch size by timing the matmul that dominates
+// prompt processing, using a slice of the model's real first layer
+//
+// bigger batches amortize reading the weights over more tokens, until
+// the activations stop fitting in cache. we return the smallest size
+// whose throughput is within 5% of the best one, since this also saves
+// compute buffer memory. returns 0 if the weights aren't on the cpu.
+static int32_t probe_ubatch(llama_model *model, int32_t n_batch, int n_threads)
 {
-    STOP_FULL,
-    STOP_PARTIAL,
-};
+    ggml_tensor *w = llama_get_model_tensor(model, "blk.0.ffn_up.weight");
+    if (!w)
+    {
+        w = llama_get_model_tensor(model, "blk.0.attn_q.weight");
+    }
+    if (!w || !w->buffer || !ggml_backend_buffer_is_host(w->buffer))
+    {
+        return 0;
+    }
+    const int64_t K = w->ne[0];
+    const int64_t M = std::min<int64_t>(w->ne[1], 4096);
 
-static bool ends_with(const std::string &str, const std::string &suffix)
-{
-    return str.size() >= suffix.size() &&
-           0 == str.compare(str.size() - suffix.size(), suffix.size(), suffix);
+    int32_t n_best = 0;
+    double us_best = 0;
+    std::vector<std::pair<int32_t, double>> timings;
+    for (int32_t n = 64; n <= std::min(n_batch, 4096); n *= 2)
+    {
+        const size_t mem_size = 8 * ggml_tensor_overhead() + ggml_graph_overhead() +
+                                (K * 2 + M) * n * sizeof(float) + (1 << 20);
+        ggml_init_params ip = { mem_size, NULL, false };
+        ggml_context *g = ggml_init(ip);
+        if (!g)
+        {
+            break;
+        }
+        ggml_tensor *wv = ggml_view_2d(g, w, K, M, w->nb[1], 0);
+        ggml_tensor *x = ggml_new_tensor_2d(g, GGML_TYPE_F32, K, n);
+        float *xd = (float *) x->data;
+        for (int64_t i = 0; i < K * n; ++i)
+        {
+            xd[i] = 1e-3f * (i % 1013) - 0.5f;
+        }
+        ggml_cgraph *gf = ggml_new_graph(g);
+        ggml_build_forward_expand(gf, ggml_mul_mat(g, wv, x));
+        ggml_graph_compute_with_ctx(g, gf, n_threads); // fault in the weights
+        int reps = 0;
+        const int64_t t_start = ggml_time_us();
+        do
+        {
+            ggml_graph_compute_with_ctx(g, gf, n_threads);
+            ++reps;
+        } while (reps < 10 && ggml_time_us() - t_start < 100000);
+        const double us_per_token = (double) (ggml_time_us() - t_start) / reps / n;
+        ggml_free(g);
+        timings.emplace_back(n, us_per_token);
+        if (!n_best || us_per_token < us_best)
+        {
+            n_best = n;
+            us_best = us_per_token;
+        }
+    }
+    for (const auto &t : timings)
+    {
+        LOG_VERBOSE("ubatch probe", {{"n_ubatch", t.first}, {"us_per_token", t.second}});
+        if (t.second <= us_best * 1.05)
+        {
+            return t.first;
+        }
+    }
+    return n_best;
 }
 
-static size_t find_partial_stop_string(const std::string &stop,
-                                       const std::string &text)
+// an array of inputs, as opposed to one prompt given as an array of tokens
+static bool is_multi_input(const json &prompt)
 {
-    if (!text.empty() && !stop.empty())
+    if (!prompt.is_array() || prompt.empty())
+    {
+        return false;
+    }
+    for (const json &elem : prompt)
     {
-        const char text_last_char = text.back();
-        for (int64_t char_index = stop.size() - 1; char_index >= 0; char_index--)
+        if (elem.is_number())
         {
-            if (stop[char_index] == text_last_char)
-            {
-                const std::string current_partial = stop.substr(0, char_index + 1);
-                if (ends_with(text, current_partial))
-                {
-                    return text.size() - char_index - 1;
-                }
-            }
+            return false;
         }
     }
-    return std::string::npos;
+    return true;
+}
+
+// a saved slot is only read back once, if ever, so keeping it in the
+// page cache would just push out the model weights
+static void drop_page_cache(const std::string &path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+    {
+        return;
+    }
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
 }
 
 // TODO: reuse llama_detokenize
@@ -98,7 +226,14 @@ static std::string tokens_to_str(llama_context *ctx, Iter begin, Iter end)
     std::string ret;
     for (; begin != end; ++begin)
     {
-        ret += llama_token_to_piece(ctx, *begin, false);
+        if (*begin < 0)
+        {
+            ret += "[img]"; // see server_image_cache::token()
+            continue;
+        }
+        int32_t length;
+        const char * piece = llama_token_get_piece(llama_get_model(ctx), *begin, false, &length);
+        ret.append(piece, length);
     }
     return ret;
 }
@@ -106,7 +241,9 @@ static std::string tokens_to_str(llama_context *ctx, Iter begin, Iter end)
 // format incomplete utf-8 multibyte character for output
 static std::string tokens_to_output_formatted_string(const llama_context *ctx, const llama_token token)
 {
-    std::string out = token == -1 ? "" : llama_token_to_piece(ctx, token, false);
+    int32_t length = 0;
+    const char * piece = token == -1 ? "" : llama_token_get_piece(llama_get_model(ctx), token, false, &length);
+    std::string out(piece, length);
     // if the size is 1 and first bit is 1, meaning it's a partial character
     //   (size > 1 meaning it's already a known token)
     if (out.size() == 1 && (out[0] & 0x80) == 0x80)
@@ -144,10 +281,33 @@ static json probs_vector_to_json(const llama_context *ctx, const std::vector<com
     return out;
 }
 
+// same as probs_vector_to_json(), without the document
+static void write_probs(json_writer &w, const llama_context *ctx, const std::vector<completion_token_output> &probs)
+{
+    w.begin_array();
+    for (const auto &prob : probs)
+    {
+        w.begin_object();
+        w.field("content", tokens_to_output_formatted_string(ctx, prob.tok));
+        w.key("probs").begin_array();
+        for (const auto &p : prob.probs)
+        {
+            w.begin_object();
+            w.field("prob", (double) p.prob);
+            w.field("tok_str", tokens_to_output_formatted_string(ctx, p.tok));
+            w.end_object();
+        }
+        w.end_array();
+        w.end_object();
+    }
+    w.end_array();
+}
+
 struct llama_client_slot
 {
     int id;
     int task_id = -1;
+    int priority = 0; // of the task, lower ones are preempted first
 
     struct slot_params params;
 
@@ -169,14 +329,27 @@ struct llama_client_slot
     int32_t num_prompt_tokens_processed = 0;
 
     json prompt;
+    std::vector<llama_token> prompt_tokens; // tokenized early by get_slot()
+    std::string session_id;
     std::string generated_text;
     llama_token sampled;
     std::vector<llama_token> cache_tokens;
     std::vector<completion_token_output> generated_token_probs;
 
+    // speculative decoding
+    std::vector<llama_token> cache_tokens_dft; // tokens in the draft model's kv cache
+    std::vector<llama_token> drafted;          // guesses being verified in this batch
+
+    // the only tokens the slot may generate, sorted, or empty for any
+    std::vector<llama_token> shortlist;
+    int32_t i_batch_dft      = -1;
+    int32_t n_draft_total    = 0;
+    int32_t n_draft_accepted = 0;
+
     bool infill = false;
     bool embedding = false;
     bool has_next_token = true;
+    bool ingesting_prompt = false; // prompt is partially in the kv cache
     bool truncated = false;
     bool stopped_eos = false;
     bool stopped_word = false;
@@ -186,6 +359,8 @@ struct llama_client_slot
     std::string oaicompat_model;
 
     std::string stopping_word;
+    server_stop_strings stop_strings;
+    server_detokenizer detokenizer;
 
     // sampling
     struct llama_sampling_params sparams;
@@ -199,6 +374,19 @@ struct llama_client_slot
 
     // multimodal
     std::vector<slot_image> images;
+    bool encoding_images = false; // waiting for the image encoder
+    int n_images_pending = 0;
+
+    bool cancelled = false; // its client went away
+
+    // the runtime lora adapters the kv cache of the slot was computed with
+    std::vector<std::pair<int, float>> lora;
+
+    // and the runtime control vectors
+    std::vector<std::pair<int, float>> control_vectors;
+
+    // tokens sampled by a worker, waiting for the main loop
+    std::vector<completion_token_output> drawn;
 
     // stats
     size_t sent_count = 0;
@@ -213,6 +401,26 @@ struct llama_client_slot
     // multitasks
     int multitask_id = -1;
 
+    // requests with n > 1 generate each choice in a slot of its own, and
+    // the first of those evaluates the prompt for the others
+    int fork_of       = -1; // slot evaluating our prompt, or -1 if it's us
+    int32_t index     = 0;  // which of the choices this slot generates
+    int32_t n_choices = 1;
+    int32_t n_shared  = 0;  // prompt tokens whose cells we share with them
+
+    // latency metrics
+    int64_t t_task_posted = 0;
+    int64_t t_last_token  = 0;
+
+    // timings detail
+    int32_t n_prompt_cached = 0; // prompt tokens that were already in the kv cache
+    int32_t n_decode_calls  = 0; // llama_decode() calls with tokens of ours
+    int32_t n_decode_shared = 0; // how many of those had tokens of other slots too
+    int64_t t_decode_us     = 0; // time spent in those calls
+    int64_t t_sampling_us   = 0; // time spent drawing tokens, grammar included
+    double j_prompt         = 0; // our share of the joules of those calls
+    double j_predicted      = 0;
+
     void reset() {
         num_prompt_tokens      = 0;
         generated_text         = "";
@@ -221,18 +429,36 @@ struct llama_client_slot
         stopped_word           = false;
         stopped_limit          = false;
         stopping_word          = "";
+        stop_strings.reset();
+        detokenizer.reset();
         n_past                 = 0;
         sent_count             = 0;
         sent_token_probs_index = 0;
         infill                 = false;
         ga_i                   = 0;
         n_past_se              = 0;
-
+        ingesting_prompt       = false;
+        n_draft_total          = 0;
+        n_draft_accepted       = 0;
+        n_shared               = 0;
+        n_prompt_cached        = 0;
+        n_decode_calls         = 0;
+        n_decode_shared        = 0;
+        t_decode_us            = 0;
+        t_sampling_us          = 0;
+        j_prompt               = 0;
+        j_predicted            = 0;
+        encoding_images        = false;
+        n_images_pending       = 0;
+        cancelled              = false;
+
+        prompt_tokens.clear();
+        drafted.clear();
         generated_token_probs.clear();
 
         for (slot_image & img : images)
         {
-            free(img.image_embedding);
+            img.image_embedding.reset();
             if (img.img_data) {
                 clip_image_u8_free(img.img_data);
             }
@@ -288,7 +514,7 @@ struct llama_client_slot
     }
 
     json get_formated_timings() {
-        return json
+        json timings =
         {
             {"prompt_n",               num_prompt_tokens_processed},
             {"prompt_ms",              t_prompt_processing},
@@ -301,6 +527,41 @@ struct llama_client_slot
             {"predicted_per_token_ms", t_token_generation / n_decoded},
             {"predicted_per_second",   1e3 / t_token_generation * n_decoded},
         };
+        if (*llamafile_energy_sources())
+        {
+            timings["prompt_joules"]              = j_prompt;
+            timings["prompt_per_token_joules"]    = j_prompt / num_prompt_tokens_processed;
+            timings["predicted_joules"]           = j_predicted;
+            timings["predicted_per_token_joules"] = j_predicted / n_decoded;
+        }
+        return timings;
+    }
+
+    // queue wait is from when the task was posted until the slot began
+    // evaluating its prompt, and the decode time includes the tokens of
+    // any other slots that shared the batch
+    double t_queue_ms() const {
+        return t_task_posted && t_start_process_prompt > t_task_posted ? (t_start_process_prompt - t_task_posted) / 1e3 : 0;
+    }
+
+    double t_grammar_ms() const {
+        return ctx_sampling ? ctx_sampling->t_grammar_us / 1e3 : 0;
+    }
+
+    json get_formated_timings_detail() const {
+        return json
+        {
+            {"queue_ms",            t_queue_ms()},
+            {"prompt_n_cached",     n_prompt_cached},
+            {"prompt_n_evaluated",  num_prompt_tokens_processed},
+            {"decode_calls",        n_decode_calls},
+            {"decode_calls_shared", n_decode_shared},
+            {"decode_ms",           t_decode_us / 1e3},
+            {"sampling_ms",         t_sampling_us / 1e3},
+            {"grammar_ms",          t_grammar_ms()},
+            {"draft_n",             n_draft_total},
+            {"draft_n_accepted",    n_draft_accepted},
+        };
     }
 
     void print_timings() const {
@@ -333,6 +594,44 @@ struct llama_client_slot
             {"n_tokens_second",    n_tokens_second},
         });
 
+        if (n_draft_total > 0)
+        {
+            sprintf(buffer, "    draft acceptance = %10.2f %% / %5d tokens", 100.0 * n_draft_accepted / n_draft_total, n_draft_total);
+            LOG_INFO(buffer, {
+                {"slot_id",          id},
+                {"task_id",          task_id},
+                {"n_draft_total",    n_draft_total},
+                {"n_draft_accepted", n_draft_accepted},
+            });
+        }
+
+        sprintf(buffer, "     time breakdown = %10.2f ms queue, %10.2f ms decode (%d calls, %d shared), %8.2f ms sampling, %8.2f ms grammar",
+                t_queue_ms(), t_decode_us / 1e3, n_decode_calls, n_decode_shared, t_sampling_us / 1e3, t_grammar_ms());
+        LOG_INFO(buffer, {
+            {"slot_id",         id},
+            {"task_id",         task_id},
+            {"t_queue",         t_queue_ms()},
+            {"n_prompt_cached", n_prompt_cached},
+            {"n_decode_calls",  n_decode_calls},
+            {"n_decode_shared", n_decode_shared},
+            {"t_decode",        t_decode_us / 1e3},
+            {"t_sampling",      t_sampling_us / 1e3},
+            {"t_grammar",       t_grammar_ms()},
+        });
+
+        if (*llamafile_energy_sources())
+        {
+            sprintf(buffer, "              energy = %10.2f J prompt (%8.4f J per token), %10.2f J generation (%8.4f J per token)",
+                    j_prompt, j_prompt / num_prompt_tokens_processed, j_predicted, j_predicted / n_decoded);
+            LOG_INFO(buffer, {
+                {"slot_id",     id},
+                {"task_id",     task_id},
+                {"j_prompt",    j_prompt},
+                {"j_predicted", j_predicted},
+                {"sources",     llamafile_energy_sources()},
+            });
+        }
+
         sprintf(buffer, "          total time = %10.2f ms", t_prompt_processing + t_token_generation);
         LOG_INFO(buffer, {
             {"slot_id",             id},
@@ -344,7 +643,69 @@ struct llama_client_slot
     }
 };
 
+// prometheus style histogram with cumulative buckets
+struct llama_histogram {
+    std::vector<double> bounds;   // upper bound of each bucket, ascending
+    std::vector<uint64_t> counts; // observations per bucket, last is +Inf
+    double sum = 0;
+    uint64_t count = 0;
+
+    void init(std::vector<double> bounds_) {
+        bounds = std::move(bounds_);
+        std::sort(bounds.begin(), bounds.end());
+        counts.assign(bounds.size() + 1, 0);
+        sum = 0;
+        count = 0;
+    }
+
+    void observe(double value) {
+        const size_t i = std::lower_bound(bounds.begin(), bounds.end(), value) - bounds.begin();
+        counts[i] += 1;
+        sum += value;
+        count += 1;
+    }
+
+    json to_json() const {
+        return json {
+            {"bounds", bounds},
+            {"counts", counts},
+            {"sum",    sum},
+            {"count",  count},
+        };
+    }
+};
+
 struct llama_metrics {
+    // distributions since startup
+    llama_histogram queue_wait_seconds;        // request arrival to slot assignment
+    llama_histogram time_to_first_token_seconds;
+    llama_histogram inter_token_seconds;
+    llama_histogram decode_batch_tokens;       // tokens per llama_decode call
+    llama_histogram kv_cache_usage_ratio;      // sampled after each decode
+
+    void init(const std::vector<double> &latency_buckets, int32_t n_batch) {
+        queue_wait_seconds.init(latency_buckets);
+        time_to_first_token_seconds.init(latency_buckets);
+        inter_token_seconds.init(latency_buckets);
+        std::vector<double> batch_buckets;
+        for (int32_t n = 1; n < n_batch; n *= 2) {
+            batch_buckets.push_back(n);
+        }
+        batch_buckets.push_back(n_batch);
+        decode_batch_tokens.init(batch_buckets);
+        kv_cache_usage_ratio.init({0.1, 0.2, 0.3, 0.4, 0.5, 0.6, 0.7, 0.8, 0.9, 0.95, 1});
+    }
+
+    json histograms_to_json() const {
+        return json {
+            {"queue_wait_seconds",          queue_wait_seconds.to_json()},
+            {"time_to_first_token_seconds", time_to_first_token_seconds.to_json()},
+            {"inter_token_seconds",         inter_token_seconds.to_json()},
+            {"decode_batch_tokens",         decode_batch_tokens.to_json()},
+            {"kv_cache_usage_ratio",        kv_cache_usage_ratio.to_json()},
+        };
+    }
+
     uint64_t n_prompt_tokens_processed_total = 0;
     uint64_t n_tokens_predicted_total        = 0;
 
@@ -354,36 +715,62 @@ struct llama_metrics {
     uint64_t n_tokens_predicted       = 0;
     uint64_t t_tokens_generation      = 0;
 
+    double j_prompt_total    = 0;
+    double j_predicted_total = 0;
+    double j_prompt          = 0;
+    double j_predicted       = 0;
 
     void on_prompt_eval(const llama_client_slot &slot) {
         n_prompt_tokens_processed_total += slot.num_prompt_tokens_processed;
+        j_prompt_total                  += slot.j_prompt;
 
         n_prompt_tokens_processed += slot.num_prompt_tokens_processed;
         t_prompt_processing       += slot.t_prompt_processing;
+        j_prompt                  += slot.j_prompt;
     }
 
     void on_prediction(const llama_client_slot &slot) {
         n_tokens_predicted_total += slot.n_decoded;
+        j_predicted_total        += slot.j_predicted;
 
         n_tokens_predicted  += slot.n_decoded;
         t_tokens_generation += slot.t_token_generation;
+        j_predicted         += slot.j_predicted;
     }
 
     void reset_bucket() {
         n_prompt_tokens_processed = 0;
         t_prompt_processing       = 0;
+        j_prompt                  = 0;
         n_tokens_predicted        = 0;
         t_tokens_generation       = 0;
+        j_predicted               = 0;
     }
 };
 
 struct llama_server_context
 {
-    llama_model *model = nullptr;
+    llama_model *model = nullptr;  // the one being generated with
     llama_context *ctx = nullptr;
 
+    // the model of --model, whose context outlives its turns, so http
+    // threads tokenize with it, and the others of --models-dir
+    llama_model *model_main = nullptr;
+    llama_context *ctx_main = nullptr;
+    server_models models;
+    std::string model_name; // of the model in use, empty for model_main
+    std::shared_ptr<llama_model> model_guest;
+
+    std::vector<llama_lora_adapter *> lora_adapters; // from --lora-runtime
+    std::vector<llama_control_vector_data> control_vectors; // from --control-vector-runtime
+
     clip_ctx *clp_ctx = nullptr;
 
+    // draft model for speculative decoding
+    llama_model *model_dft = nullptr;
+    llama_context *ctx_dft = nullptr;
+    llama_batch batch_dft = {};
+
     gpt_params params;
 
     llama_batch batch;
@@ -395,6 +782,57 @@ struct llama_server_context
 
     int32_t n_ctx;  // total context for all clients / slots
 
+    // fraction of a prompt an idle slot must already hold to be preferred
+    float slot_prompt_similarity = 0.5f;
+
+    // maximum prompt tokens evaluated per step, or 0 for n_batch
+    int32_t n_prefill_chunk = 0;
+
+    // tokens per output the backend hands back when every slot
+    // sampling from the batch can do with that many, 0 for all
+    int32_t n_logits_top_k = 0;
+
+    // when there's no draft model, draft with just this many layers of
+    // the target model and let all of them verify the guesses, 0 for off
+    int32_t n_layer_draft = 0;
+
+    // the union of the shortlists of the slots in the batch being decoded,
+    // which is all the output head computes when every slot has one
+    std::vector<llama_token> output_shortlist;
+
+    // otherwise, guess what followed the longest earlier occurrence of
+    // up to this many of the last tokens of a slot, 0 for off
+    int32_t n_lookup_ngram = 0;
+
+    // draft the text the grammar of a slot leaves no choice about
+    bool jump_forward = false;
+
+    // time matmuls at startup to pick n_ubatch
+    bool tune_ubatch = false;
+
+    // slots share the whole kv cache instead of n_ctx / n_parallel each,
+    // reserving their prompt plus n_predict (or n_slot_reserve) cells
+    bool dynamic_slots = false;
+    int32_t n_slot_reserve = 512;
+
+    // a full slot drops this many of its oldest tokens, rather than half
+    // of those past n_keep, and keeps at least its first n_attn_sinks,
+    // which the model attends to regardless of what they are
+    int32_t n_shift_block = 0;
+    int32_t n_attn_sinks = 0;
+
+    // run clip on the main loop, rather than beside it
+    bool sync_images = false;
+
+    // admission control: requests are turned away when this many are
+    // already waiting for a slot, or when they'd wait longer than their
+    // deadline, which is queue_timeout seconds unless they say otherwise
+    int32_t n_queue_max = 0;
+    double queue_timeout = 0;
+    std::atomic<int64_t> t_request_avg_us{0}; // how long a slot is busy with a request
+    std::atomic<uint64_t> n_requests_rejected{0};
+    uint64_t n_requests_expired = 0;
+
     // system prompt
     bool system_need_update = false;
 
@@ -411,15 +849,65 @@ struct llama_server_context
     llama_server_queue queue_tasks;
     llama_server_response queue_results;
 
+    server_prefix_cache prefix_cache;
+
+    // generations of low priority swapped out to host memory to make room
+    // for requests of higher priority, holding up to preempt_pool bytes
+    struct parked_slot
+    {
+        llama_client_slot slot;
+        std::string blob; // from export_slot()
+    };
+    std::vector<parked_slot> parked_slots;
+    size_t preempt_pool = 0;
+    size_t preempt_pool_used = 0;
+
+    server_image_cache image_cache;
+    server_embd_cache embd_cache;
+    server_image_encoder image_encoder;
+    server_workers workers;
+    server_streams streams;
+
     llama_metrics metrics;
 
+    // the last publish_status()
+    std::shared_ptr<const json> published;
+    int64_t t_published = 0;
+    std::atomic<bool> metrics_scraped{false};
+
     ~llama_server_context()
     {
+        image_encoder.stop();
+        if (ctx != ctx_main)
+        {
+            llama_free(ctx);
+            ctx = ctx_main;
+        }
+        for (parked_slot &parked : parked_slots)
+        {
+            llama_sampling_free(parked.slot.ctx_sampling);
+        }
+        parked_slots.clear();
+        if (ctx_dft)
+        {
+            llama_free(ctx_dft);
+            ctx_dft = nullptr;
+        }
+        if (model_dft)
+        {
+            llama_free_model(model_dft);
+            model_dft = nullptr;
+        }
         if (ctx)
         {
             llama_free(ctx);
             ctx = nullptr;
         }
+        for (llama_lora_adapter *adapter : lora_adapters)
+        {
+            llama_lora_adapter_free(adapter);
+        }
+        lora_adapters.clear();
         if (model)
         {
             llama_free_model(model);
@@ -451,6 +939,16 @@ struct llama_server_context
             return false;
         }
 
+        if (tune_ubatch)
+        {
+            retune_ubatch();
+            if (ctx == nullptr)
+            {
+                LOG_ERROR("unable to create context", {{"n_ubatch", params.n_ubatch}});
+                return false;
+            }
+        }
+
         if (multimodal) {
             const int n_embd_clip = clip_n_mmproj_embd(clp_ctx);
             const int n_embd_llm  = llama_n_embd(model);
@@ -462,11 +960,260 @@ struct llama_server_context
             }
         }
 
+        if (!params.model_draft.empty() && !load_draft_model())
+        {
+            return false;
+        }
+
         n_ctx = llama_n_ctx(ctx);
 
         add_bos_token = llama_should_add_bos_token(model);
         GGML_ASSERT(llama_add_eos_token(model) != 1);
 
+        model_main = model;
+        ctx_main = ctx;
+        return true;
+    }
+
+    // the model a task runs on, which is empty for the main model
+    std::string model_of(const task_server &task) const
+    {
+        if (task.type != TASK_TYPE_COMPLETION)
+        {
+            return std::string();
+        }
+        return models.resolve(json_value(task.data, "model", std::string()));
+    }
+
+    // moves the main loop over to another model, which is given a context
+    // of its own, while the main model keeps its context for its next turn
+    bool switch_model(const std::string &name)
+    {
+        std::shared_ptr<llama_model> next;
+        llama_context *ctx_next = ctx_main;
+        if (!name.empty())
+        {
+            next = models.acquire(name);
+            if (!next)
+            {
+                LOG_ERROR("unable to load model", {{"model", name}});
+                return false;
+            }
+            llama_context_params cparams = llama_context_params_from_gpt_params(params);
+            cparams.n_ctx = n_ctx;
+            ctx_next = llama_new_context_with_model(next.get(), cparams);
+            if (!ctx_next)
+            {
+                LOG_ERROR("unable to create context", {{"model", name}});
+                return false;
+            }
+        }
+
+        // the slots lose their cells, and the adapters they had with them
+        for (llama_client_slot &slot : slots)
+        {
+            if (!slot.lora.empty())
+            {
+                llama_lora_adapter_clear(ctx, slot.id);
+                slot.lora.clear();
+            }
+            if (!slot.control_vectors.empty())
+            {
+                slot.control_vectors.clear();
+                set_control_vectors(slot.id, slot.control_vectors);
+            }
+            slot.cache_tokens.clear();
+            slot.n_past    = 0;
+            slot.n_past_se = 0;
+        }
+        kv_cache_clear();
+        if (ctx != ctx_main)
+        {
+            llama_free(ctx);
+        }
+
+        ctx = ctx_next;
+        model = next ? next.get() : model_main;
+        model_guest = std::move(next);
+        model_name = name;
+        prefix_cache.ctx = ctx;
+        add_bos_token = llama_should_add_bos_token(model);
+        system_need_update = true;
+
+        LOG_INFO("switched model", {{"model", name.empty() ? params.model_alias : name}});
+        return true;
+    }
+
+    // makes sure the model of a task is the one in use, or returns false
+    // if it had to be deferred until the slots are done with the current
+    // model, or failed
+    bool bind_model(task_server &task)
+    {
+        const std::string name = model_of(task);
+        if (name == model_name)
+        {
+            // tasks for another model have to wait for the slots to empty,
+            // so we don't start anything new while one of them is waiting
+            for (const task_server &deferred : queue_tasks.queue_tasks_deferred)
+            {
+                if (deferred.type == TASK_TYPE_COMPLETION && model_of(deferred) != model_name)
+                {
+                    queue_tasks.defer_(task);
+                    return false;
+                }
+            }
+            return true;
+        }
+        bool busy = !parked_slots.empty();
+        for (const llama_client_slot &slot : slots)
+        {
+            busy |= !slot.available();
+        }
+        if (busy)
+        {
+            LOG_VERBOSE("waiting for the slots to switch model", {{"task_id", task.id}, {"model", name}});
+            queue_tasks.defer_(task);
+            return false;
+        }
+        if (!switch_model(name))
+        {
+            send_error(task, "unable to load model");
+            return false;
+        }
+        return true;
+    }
+
+    // gives the logit bias of a slot to the contexts, or returns false if
+    // the sampler must apply it, because they've no room left for it
+    bool set_logit_bias(int slot_id, const std::unordered_map<llama_token, float> &logit_bias)
+    {
+        std::vector<llama_token> tokens;
+        std::vector<float> bias;
+        for (const auto &it : logit_bias)
+        {
+            tokens.push_back(it.first);
+            bias.push_back(it.second);
+        }
+        if (llama_set_logit_bias(ctx, slot_id, tokens.data(), bias.data(), tokens.size()))
+        {
+            llama_set_logit_bias(ctx, slot_id, nullptr, nullptr, 0);
+            return false;
+        }
+        if (ctx_dft)
+        {
+            // only the quality of the drafts suffers without it
+            llama_set_logit_bias(ctx_dft, slot_id, tokens.data(), bias.data(), tokens.size());
+        }
+        return true;
+    }
+
+    // steers the tokens of a slot with the sum of some runtime control vectors
+    bool set_control_vectors(int slot_id, const std::vector<std::pair<int, float>> &cvecs)
+    {
+        const int n_embd = llama_n_embd(model);
+        if (cvecs.empty())
+        {
+            return !llama_control_vector_apply_seq(ctx, slot_id, nullptr, 0, n_embd, 0, 0);
+        }
+        std::vector<float> sum;
+        for (const auto &c : cvecs)
+        {
+            const std::vector<float> &v = control_vectors[c.first].data;
+            sum.resize(std::max(sum.size(), v.size()), 0.0f);
+            for (size_t i = 0; i < v.size(); ++i)
+            {
+                sum[i] += c.second * v[i];
+            }
+        }
+        const int il_start = params.control_vector_layer_start > 0 ? params.control_vector_layer_start : 1;
+        const int il_end = params.control_vector_layer_end > 0 ? params.control_vector_layer_end : llama_n_layer(model);
+        if (llama_control_vector_apply_seq(ctx, slot_id, sum.data(), sum.size(), n_embd, il_start, il_end))
+        {
+            LOG_ERROR("failed to apply control vectors", {{"slot_id", slot_id}});
+            return false;
+        }
+        return true;
+    }
+
+    // recreates the context with the physical batch size that runs the
+    // fastest on this machine
+    void retune_ubatch()
+    {
+        if (!params.control_vectors.empty())
+        {
+            // these are applied to the context we'd have to replace
+            LOG_WARNING("physical batch size can't be tuned with control vectors", {});
+            return;
+        }
+        const int n_threads = params.n_threads_batch > 0 ? params.n_threads_batch : params.n_threads;
+        const int32_t n_ubatch = probe_ubatch(model, params.n_batch, n_threads);
+        if (n_ubatch <= 0)
+        {
+            LOG_WARNING("physical batch size can't be tuned when the model is offloaded", {});
+            return;
+        }
+        LOG_INFO("tuned physical batch size", {
+            {"n_batch",  params.n_batch},
+            {"n_ubatch", n_ubatch},
+        });
+        if (n_ubatch == (int32_t) llama_n_ubatch(ctx))
+        {
+            return;
+        }
+        params.n_ubatch = n_ubatch;
+        llama_free(ctx);
+        ctx = llama_new_context_with_model(model, llama_context_params_from_gpt_params(params));
+    }
+
+    bool load_draft_model()
+    {
+        gpt_params params_dft = params;
+        params_dft.model = params.model_draft;
+        params_dft.model_url.clear();
+        params_dft.hf_repo.clear();
+        params_dft.hf_file.clear();
+        params_dft.lora_adapter.clear();
+        params_dft.lora_base.clear();
+        params_dft.control_vectors.clear();
+        params_dft.expert_stats.clear();
+        params_dft.n_gpu_experts = 0;
+        params_dft.n_ctx = llama_n_ctx(ctx);
+        params_dft.n_gpu_layers = params.n_gpu_layers_draft;
+        if (params.n_threads_draft > 0)
+        {
+            params_dft.n_threads = params.n_threads_draft;
+        }
+        if (params.n_threads_batch_draft > 0)
+        {
+            params_dft.n_threads_batch = params.n_threads_batch_draft;
+        }
+
+        std::tie(model_dft, ctx_dft) = llama_init_from_gpt_params(params_dft);
+        if (model_dft == nullptr)
+        {
+            LOG_ERROR("unable to load draft model", {{"model", params.model_draft}});
+            return false;
+        }
+
+        // drafted tokens are compared by id, so the vocabs must agree
+        if (llama_vocab_type(model_dft) != llama_vocab_type(model) ||
+            llama_n_vocab(model_dft)    != llama_n_vocab(model)    ||
+            llama_token_bos(model_dft)  != llama_token_bos(model)  ||
+            llama_token_eos(model_dft)  != llama_token_eos(model))
+        {
+            LOG_ERROR("draft model vocab must match the target model", {
+                {"model",       params.model},
+                {"model_draft", params.model_draft},
+                {"n_vocab",     llama_n_vocab(model)},
+                {"n_vocab_dft", llama_n_vocab(model_dft)},
+            });
+            return false;
+        }
+
+        LOG_INFO("draft model loaded", {
+            {"model_draft", params.model_draft},
+            {"n_draft",     params.n_draft},
+        });
         return true;
     }
 
@@ -484,7 +1231,7 @@ struct llama_server_context
         // create slots
         all_slots_are_idle = true;
 
-        const int32_t n_ctx_slot = n_ctx / params.n_parallel;
+        const int32_t n_ctx_slot = dynamic_slots ? n_ctx : n_ctx / params.n_parallel;
 
         LOG_INFO("initializing slots", {{"n_slots", params.n_parallel}});
         for (int i = 0; i < params.n_parallel; i++)
@@ -529,17 +1276,117 @@ struct llama_server_context
         default_generation_settings_for_props["seed"] = -1;
 
         batch = llama_batch_init(n_ctx, 0, params.n_parallel);
-    }
 
-    std::vector<llama_token> tokenize(const json & json_prompt, bool add_special) const
-    {
-        // TODO: currently, we tokenize using special tokens by default
-        //       this is not always correct (see https://github.com/ggerganov/llama.cpp/pull/4160#issuecomment-1824826216)
-        //       but it's better compared to completely ignoring ChatML and other chat templates
-        const bool TMP_FORCE_SPECIAL = true;
+        // slots are sampled in parallel while the compute threads are idle
+        workers.start(std::min(params.n_threads, params.n_parallel) - 1);
 
-        // If `add_bos` is true, we only add BOS, when json_prompt is a string,
-        // or the first element of the json_prompt array is a string.
+        // images are encoded while the other slots keep decoding
+        if (multimodal && !sync_images)
+        {
+            image_encoder.start(clp_ctx, params.n_threads, [this] {
+                task_server task;
+                task.type = TASK_TYPE_NEXT_RESPONSE;
+                task.target_id = -1;
+                queue_tasks.post(task);
+            });
+        }
+
+        if (ctx_dft)
+        {
+            // the draft model's guesses are rolled back with
+            // llama_kv_cache_seq_rm(), which a recurrent state can't do
+            // (the target model rewinds to a checkpoint instead)
+            if (params.n_draft <= 0 || !llama_kv_cache_seq_rm(ctx_dft, params.n_parallel, -1, -1))
+            {
+                LOG_WARNING("speculative decoding is not supported by this model, ignoring draft model", {});
+                llama_free(ctx_dft);
+                llama_free_model(model_dft);
+                ctx_dft = nullptr;
+                model_dft = nullptr;
+            }
+            else
+            {
+                batch_dft = llama_batch_init(n_ctx, 0, 1);
+            }
+        }
+        else if (n_layer_draft > 0)
+        {
+            if (params.n_draft <= 0 || n_layer_draft >= llama_n_layer(model) ||
+                !llama_kv_cache_seq_rm(ctx, params.n_parallel, -1, -1))
+            {
+                LOG_WARNING("self-speculative decoding is not supported by this model, ignoring draft layers", {
+                    {"n_layer_draft", n_layer_draft},
+                    {"n_layer",       llama_n_layer(model)},
+                });
+                n_layer_draft = 0;
+            }
+            else
+            {
+                batch_dft = llama_batch_init(n_ctx, 0, 1);
+            }
+        }
+        else if (n_lookup_ngram > 0 && params.n_draft <= 0)
+        {
+            n_lookup_ngram = 0;
+        }
+        if (params.n_draft <= 0)
+        {
+            jump_forward = false;
+        }
+
+        // self-extend rewrites kv positions in place, which would corrupt
+        // the cache entries that alias the cells of a slot
+        if (params.grp_attn_n != 1) {
+            prefix_cache.n_max = 0;
+        }
+        // every entry holds a sequence id of its own, past those of the slots
+        if (prefix_cache.n_max > n_seq_spare(0)) {
+            LOG_WARNING("prefix cache is limited by the number of sequence ids", {
+                {"n_entries", n_seq_spare(0)},
+                {"n_seq_max", llama_max_parallel_sequences()},
+            });
+            prefix_cache.n_max = n_seq_spare(0);
+        }
+        if (prefix_cache.n_max > 0) {
+            if (prefix_cache.init(ctx, params.n_parallel)) {
+                LOG_INFO("prefix cache enabled", {{"n_entries", prefix_cache.n_max}});
+            } else {
+                LOG_WARNING("prefix cache is not supported by this model", {});
+            }
+        }
+        if (prefix_cache.enabled() && prefix_cache.store.enabled()) {
+            const std::string path = prefix_cache.store.dir;
+            // like images, the slot that waits for a read is woken up
+            prefix_cache.store.on_read = [this] {
+                task_server task;
+                task.type = TASK_TYPE_NEXT_RESPONSE;
+                task.target_id = -1;
+                queue_tasks.post(task);
+            };
+            if (prefix_cache.store.init(model, params.cache_type_k + '/' + params.cache_type_v)) {
+                LOG_INFO("prefix store enabled", {{"path", path}, {"n_files", prefix_cache.store.size()}});
+            } else {
+                LOG_WARNING("could not open prefix cache directory", {{"path", path}});
+            }
+        } else {
+            prefix_cache.store.dir.clear();
+        }
+    }
+
+    std::vector<llama_token> tokenize(const json & json_prompt, bool add_special) const
+    {
+        return tokenize(ctx, json_prompt, add_special);
+    }
+
+    static std::vector<llama_token> tokenize(const llama_context *ctx, const json & json_prompt, bool add_special)
+    {
+        // TODO: currently, we tokenize using special tokens by default
+        //       this is not always correct (see https://github.com/ggerganov/llama.cpp/pull/4160#issuecomment-1824826216)
+        //       but it's better compared to completely ignoring ChatML and other chat templates
+        const bool TMP_FORCE_SPECIAL = true;
+
+        // If `add_bos` is true, we only add BOS, when json_prompt is a string,
+        // or the first element of the json_prompt array is a string.
         std::vector<llama_token> prompt_tokens;
 
         if (json_prompt.is_array())
@@ -581,24 +1428,65 @@ struct llama_server_context
         return prompt_tokens;
     }
 
-    llama_client_slot* get_slot(int id) {
+    // chooses the slot for a new task
+    //
+    // an explicitly requested slot wins, then the slot that previously
+    // served the same session, then the idle slot whose cache shares the
+    // longest prefix with the prompt, and finally the least recently used
+    llama_client_slot* get_slot(int id, const std::string &session_id = "",
+                                const std::vector<llama_token> &prompt_tokens = {}) {
         int64_t t_last = ggml_time_us();
         llama_client_slot *last_used = nullptr;
+        llama_client_slot *same_session = nullptr;
+        llama_client_slot *most_similar = nullptr;
+        size_t n_similar = slot_prompt_similarity * prompt_tokens.size();
 
         for (llama_client_slot & slot : slots)
         {
-            if (slot.id == id && slot.available())
+            if (!slot.available())
+            {
+                continue;
+            }
+
+            if (slot.id == id)
             {
                 return &slot;
             }
 
-            if (slot.available() && slot.t_last_used < t_last)
+            if (!session_id.empty() && slot.session_id == session_id)
+            {
+                same_session = &slot;
+            }
+
+            if (!prompt_tokens.empty())
+            {
+                const size_t n_common = common_part(slot.cache_tokens, prompt_tokens);
+                if (n_common > n_similar || (n_common == n_similar && most_similar &&
+                                             slot.t_last_used < most_similar->t_last_used))
+                {
+                    if (n_common > 0)
+                    {
+                        most_similar = &slot;
+                        n_similar = n_common;
+                    }
+                }
+            }
+
+            if (slot.t_last_used < t_last)
             {
                 last_used = &slot;
                 t_last = slot.t_last_used;
             }
         }
 
+        if (same_session)
+        {
+            return same_session;
+        }
+        if (most_similar)
+        {
+            return most_similar;
+        }
         return last_used;
     }
 
@@ -616,6 +1504,7 @@ struct llama_server_context
 
         slot->params.stream             = json_value(data, "stream",            false);
         slot->params.cache_prompt       = json_value(data, "cache_prompt",      false);
+        slot->params.timings_detail     = json_value(data, "timings_detail",    false);
         slot->params.n_predict          = json_value(data, "n_predict",         default_params.n_predict);
         slot->sparams.top_k             = json_value(data, "top_k",             default_sparams.top_k);
         slot->sparams.top_p             = json_value(data, "top_p",             default_sparams.top_p);
@@ -713,6 +1602,7 @@ struct llama_server_context
         }
 
         slot->sparams.logit_bias.clear();
+        slot->sparams.logit_bias_in_graph = false;
 
         if (json_value(data, "ignore_eos", false))
         {
@@ -761,6 +1651,36 @@ struct llama_server_context
             }
         }
 
+        // the bias is added to the logits on the backend, so the most
+        // likely tokens it brings back already have it
+        slot->sparams.logit_bias_in_graph = set_logit_bias(slot->id, slot->sparams.logit_bias);
+
+        slot->shortlist.clear();
+
+        const auto &shortlist = data.find("shortlist");
+        if (shortlist != data.end() && shortlist->is_array())
+        {
+            const int n_vocab = llama_n_vocab(model);
+            for (const auto &el : *shortlist)
+            {
+                if (el.is_number_integer())
+                {
+                    llama_token tok = el.get<llama_token>();
+                    if (tok >= 0 && tok < n_vocab)
+                    {
+                        slot->shortlist.push_back(tok);
+                    }
+                }
+                else if (el.is_string())
+                {
+                    auto toks = llama_tokenize(model, el.get<std::string>(), false);
+                    slot->shortlist.insert(slot->shortlist.end(), toks.begin(), toks.end());
+                }
+            }
+            std::sort(slot->shortlist.begin(), slot->shortlist.end());
+            slot->shortlist.erase(std::unique(slot->shortlist.begin(), slot->shortlist.end()), slot->shortlist.end());
+        }
+
         slot->params.antiprompt.clear();
 
         const auto &stop = data.find("stop");
@@ -774,6 +1694,7 @@ struct llama_server_context
                 }
             }
         }
+        slot->stop_strings.init(slot->params.antiprompt);
 
         const auto &samplers_sequence = data.find("samplers");
         if (samplers_sequence != data.end() && samplers_sequence->is_array())
@@ -800,10 +1721,31 @@ struct llama_server_context
             {
                 for (const auto &img : *images_data)
                 {
-                    const std::vector<uint8_t> image_buffer = base64_decode(img["data"].get<std::string>());
+                    // large images were decoded by parse_request_body()
+                    std::vector<uint8_t> decoded;
+                    const std::vector<uint8_t> *bytes = &decoded;
+                    if (img["data"].is_binary())
+                    {
+                        bytes = &img["data"].get_binary();
+                    }
+                    else
+                    {
+                        decoded = base64_decode(img["data"].get_ref<const std::string &>());
+                    }
+                    const std::vector<uint8_t> &image_buffer = *bytes;
 
                     slot_image img_sl;
                     img_sl.id = img.count("id") != 0 ? img["id"].get<int>() : slot->images.size();
+                    img_sl.hash = server_image_cache::hash(image_buffer.data(), image_buffer.size());
+                    if (image_cache.get(img_sl.hash, &img_sl.image_embedding, &img_sl.image_tokens))
+                    {
+                        LOG_VERBOSE("image embedding reused from cache", {
+                            {"slot_id",   slot->id},
+                            {"img_sl_id", img_sl.id}
+                        });
+                        slot->images.push_back(img_sl);
+                        continue;
+                    }
                     img_sl.img_data = clip_image_u8_init();
                     if (!clip_image_load_from_bytes(image_buffer.data(), image_buffer.size(), img_sl.img_data))
                     {
@@ -861,11 +1803,73 @@ struct llama_server_context
                     }
                     slot->prompt = "";
                     slot->params.input_suffix = prompt.substr(begin_prefix);
-                    slot->params.cache_prompt = false; // multimodal doesn't support cache prompt
                 }
             }
         }
 
+        // runtime lora adapters, by their index in --lora-runtime
+        std::vector<std::pair<int, float>> lora;
+        const auto &lora_data = data.find("lora");
+        if (lora_data != data.end() && lora_data->is_array())
+        {
+            for (const auto &el : *lora_data)
+            {
+                const int id = json_value(el, "id", -1);
+                const float scale = json_value(el, "scale", 1.0f);
+                if (id < 0 || id >= (int) lora_adapters.size() || model != model_main)
+                {
+                    LOG_ERROR("invalid lora adapter id", {{"slot_id", slot->id}, {"id", id}});
+                    return false;
+                }
+                if (scale != 0.0f)
+                {
+                    lora.emplace_back(id, scale);
+                }
+            }
+        }
+        if (lora != slot->lora)
+        {
+            // what the slot has cached was computed with other adapters
+            llama_lora_adapter_clear(ctx, slot->id);
+            for (const auto &a : lora)
+            {
+                llama_lora_adapter_set(ctx, lora_adapters[a.first], slot->id, a.second);
+            }
+            slot->lora = lora;
+            slot->cache_tokens.clear();
+        }
+
+        // runtime control vectors, by their index in --control-vector-runtime
+        std::vector<std::pair<int, float>> cvecs;
+        const auto &cvec_data = data.find("control_vectors");
+        if (cvec_data != data.end() && cvec_data->is_array())
+        {
+            for (const auto &el : *cvec_data)
+            {
+                const int id = json_value(el, "id", -1);
+                const float scale = json_value(el, "scale", 1.0f);
+                if (id < 0 || id >= (int) control_vectors.size() || model != model_main)
+                {
+                    LOG_ERROR("invalid control vector id", {{"slot_id", slot->id}, {"id", id}});
+                    return false;
+                }
+                if (scale != 0.0f)
+                {
+                    cvecs.emplace_back(id, scale);
+                }
+            }
+        }
+        if (cvecs != slot->control_vectors)
+        {
+            if (!set_control_vectors(slot->id, cvecs))
+            {
+                return false;
+            }
+            // what the slot has cached was computed with other vectors
+            slot->control_vectors = cvecs;
+            slot->cache_tokens.clear();
+        }
+
         if (slot->ctx_sampling != nullptr)
         {
             llama_sampling_free(slot->ctx_sampling);
@@ -889,9 +1893,78 @@ struct llama_server_context
         return true;
     }
 
+    // decides whether the kv cache has room for a task on the given slot,
+    // which then gets as much context as the task is expected to need
+    bool admit_slot(llama_client_slot &slot, const task_server &task, const std::vector<llama_token> &prompt_tokens)
+    {
+        const int32_t n_system = system_tokens.size();
+        const int32_t n_avail = n_ctx - n_system;
+        int32_t n_reserved = 0;
+        for (const llama_client_slot &other : slots)
+        {
+            if (&other != &slot && !other.available())
+            {
+                n_reserved += other.n_ctx - n_system;
+            }
+        }
+
+        // prompts that aren't tokenized up front, e.g. images or infill,
+        // get whatever is left over
+        int32_t n_needed = n_avail - n_reserved;
+        if (!prompt_tokens.empty())
+        {
+            const int32_t n_predict = json_value(task.data, "n_predict", params.n_predict);
+            n_needed = prompt_tokens.size() + (n_predict > 0 ? n_predict : n_slot_reserve);
+        }
+        // leave room for n_keep and a context shift
+        n_needed = std::min(std::max(n_needed, 64), n_avail);
+
+        if (n_reserved > 0 && n_reserved + n_needed > n_avail)
+        {
+            LOG_VERBOSE("not enough kv cells for task", {
+                {"task_id",    task.id},
+                {"n_needed",   n_needed},
+                {"n_reserved", n_reserved},
+            });
+            return false;
+        }
+        slot.n_ctx = n_system + n_needed;
+
+        // reclaim the cells that idle slots keep around for cache_prompt
+        while (n_ctx - llama_get_kv_cache_used_cells(ctx) < n_needed)
+        {
+            llama_client_slot *lru = nullptr;
+            for (llama_client_slot &other : slots)
+            {
+                if (&other != &slot && other.available() && !other.cache_tokens.empty() &&
+                    (!lru || other.t_last_used < lru->t_last_used))
+                {
+                    lru = &other;
+                }
+            }
+            if (!lru)
+            {
+                break;
+            }
+            llama_kv_cache_seq_rm(ctx, lru->id, n_system, -1);
+            lru->cache_tokens.clear();
+            lru->n_past = 0;
+        }
+        return true;
+    }
+
     void kv_cache_clear() {
         // clear the entire KV cache
         llama_kv_cache_clear(ctx);
+        prefix_cache.reset();
+        if (ctx_dft)
+        {
+            llama_kv_cache_clear(ctx_dft);
+            for (llama_client_slot &slot : slots)
+            {
+                slot.cache_tokens_dft.clear();
+            }
+        }
         clean_kv_cache = false;
     }
 
@@ -924,7 +1997,15 @@ struct llama_server_context
                     batch.logits   + i,
                     0, 0, 0, // unused
                 };
-                if (llama_decode(ctx, batch_view) != 0)
+                // the draft model evaluates the same tokens meanwhile
+                llama_decode_async(ctx, batch_view);
+                if (ctx_dft && llama_decode(ctx_dft, batch_view) != 0)
+                {
+                    llama_decode_wait(ctx);
+                    LOG_TEE("%s: llama_decode() failed for draft model\n", __func__);
+                    return;
+                }
+                if (llama_decode_wait(ctx) != 0)
                 {
                     LOG_TEE("%s: llama_decode() failed\n", __func__);
                     return;
@@ -937,13 +2018,21 @@ struct llama_server_context
             LOG_TEE("evaluated %d prompt tokens in %ld us at %g tok/sec\n",
                     n_tokens, t2 - t1, g_prompt_per_second_jart);
 
+            // recurrent states are never rewound past the system prompt
+            llama_kv_cache_seq_checkpoint(ctx, 0);
+
             // assign the system KV cache to all parallel sequences
             for (int32_t i = 1; i < params.n_parallel; ++i)
             {
                 llama_kv_cache_seq_cp(ctx, 0, i, 0, system_tokens.size());
+                if (ctx_dft)
+                {
+                    llama_kv_cache_seq_cp(ctx_dft, 0, i, 0, system_tokens.size());
+                }
             }
         }
 
+        prefix_cache.system = system_tokens;
         LOG_TEE("system prompt updated\n");
         system_need_update = false;
     }
@@ -967,47 +2056,15 @@ struct llama_server_context
         notify_system_prompt_changed();
     }
 
-    static size_t find_stopping_strings(const std::string &text, const size_t last_token_size,
-                                        const stop_type type, llama_client_slot &slot)
-    {
-        size_t stop_pos = std::string::npos;
-
-        for (const std::string &word : slot.params.antiprompt)
-        {
-            size_t pos;
-            if (type == STOP_FULL)
-            {
-                const size_t tmp = word.size() + last_token_size;
-                const size_t from_pos = text.size() > tmp ? text.size() - tmp : 0;
-                pos = text.find(word, from_pos);
-            }
-            else
-            {
-                pos = find_partial_stop_string(word, text);
-            }
-            if (pos != std::string::npos &&
-                (stop_pos == std::string::npos || pos < stop_pos))
-            {
-                if (type == STOP_FULL)
-                {
-                    slot.stopped_word = true;
-                    slot.stopping_word = word;
-                    slot.has_next_token = false;
-                }
-                stop_pos = pos;
-            }
-        }
-
-        return stop_pos;
-    }
-
     bool process_token(completion_token_output &result, llama_client_slot &slot) {
         // remember which tokens were sampled - used for repetition penalties during sampling
-        const std::string token_str = llama_token_to_piece(ctx, result.tok);
+        int32_t token_len;
+        const char *token_str = llama_token_get_piece(model, result.tok, true, &token_len);
         slot.sampled = result.tok;
 
         // search stop word and delete it
-        slot.generated_text += token_str;
+        slot.stop_strings.feed(token_str, token_len, std::min(slot.sent_count, slot.generated_text.size()));
+        slot.generated_text.append(token_str, token_len);
         slot.has_next_token = true;
 
         if (slot.ctx_sampling->params.use_penalty_prompt_tokens && result.tok != -1)
@@ -1017,56 +2074,32 @@ struct llama_server_context
         }
 
         // check if there is incomplete UTF-8 character at the end
-        bool incomplete = false;
-        for (unsigned i = 1; i < 5 && i <= slot.generated_text.size(); ++i)
-        {
-            unsigned char c = slot.generated_text[slot.generated_text.size() - i];
-            if ((c & 0xC0) == 0x80)
-            {
-                // continuation byte: 10xxxxxx
-                continue;
-            }
-            if ((c & 0xE0) == 0xC0)
-            {
-                // 2-byte character: 110xxxxx ...
-                incomplete = i < 2;
-            }
-            else if ((c & 0xF0) == 0xE0)
-            {
-                // 3-byte character: 1110xxxx ...
-                incomplete = i < 3;
-            }
-            else if ((c & 0xF8) == 0xF0)
-            {
-                // 4-byte character: 11110xxx ...
-                incomplete = i < 4;
-            }
-            // else 1-byte character or invalid byte
-            break;
-        }
+        bool incomplete = slot.detokenizer.feed(token_len, llama_token_get_piece_utf8(model, result.tok, true)) > 0;
 
         if (!incomplete)
         {
             size_t pos = std::min(slot.sent_count, slot.generated_text.size());
-            const std::string str_test = slot.generated_text.substr(pos);
             bool is_stop_full = false;
-            size_t stop_pos = find_stopping_strings(str_test, token_str.size(), STOP_FULL, slot);
+            size_t stop_pos = slot.stop_strings.full_match();
             if (stop_pos != std::string::npos)
             {
                 is_stop_full = true;
+                slot.stopped_word = true;
+                slot.stopping_word = slot.params.antiprompt[slot.stop_strings.match_word];
+                slot.has_next_token = false;
                 slot.generated_text.erase(
-                    slot.generated_text.begin() + pos + stop_pos,
+                    slot.generated_text.begin() + stop_pos,
                     slot.generated_text.end());
                 pos = std::min(slot.sent_count, slot.generated_text.size());
             }
             else
             {
                 is_stop_full = false;
-                stop_pos = find_stopping_strings(str_test, token_str.size(), STOP_PARTIAL, slot);
+                stop_pos = slot.stop_strings.partial_match(pos);
             }
 
             // check if there is any token to predict
-            if (stop_pos == std::string::npos || (!slot.has_next_token && !is_stop_full && stop_pos > 0))
+            if (stop_pos == std::string::npos || (!slot.has_next_token && !is_stop_full && stop_pos > pos))
             {
                 // no send the stop word in the response
                 result.text_to_send = slot.generated_text.substr(pos, std::string::npos);
@@ -1082,6 +2115,11 @@ struct llama_server_context
 
         if (incomplete)
         {
+            // the token still goes into the kv cache
+            if (slot.command != RELEASE)
+            {
+                slot.cache_tokens.push_back(result.tok);
+            }
             slot.has_next_token = true;
         }
 
@@ -1114,7 +2152,7 @@ struct llama_server_context
         return slot.has_next_token; // continue
     }
 
-    bool process_images(llama_client_slot &slot) const
+    bool process_images(llama_client_slot &slot)
     {
         for (slot_image &img : slot.images)
         {
@@ -1123,11 +2161,13 @@ struct llama_server_context
                 continue;
             }
 
-            if (!llava_image_embed_make_with_clip_img(clp_ctx, params.n_threads, img.img_data, &img.image_embedding, &img.image_tokens)) {
+            float * image_embedding = nullptr;
+            if (!llava_image_embed_make_with_clip_img(clp_ctx, params.n_threads, img.img_data, &image_embedding, &img.image_tokens)) {
                 LOG_TEE("Error processing the given image");
                 return false;
             }
-
+            img.image_embedding = std::shared_ptr<float>(image_embedding, free);
+            image_cache.put(img.hash, img.image_embedding, img.image_tokens);
 
             img.request_encode_image = false;
         }
@@ -1135,6 +2175,77 @@ struct llama_server_context
         return slot.images.size() > 0;
     }
 
+    // hands the images of a slot to the encoder thread, returning true
+    // if the slot has to wait for them before its prompt can be loaded
+    bool submit_images(llama_client_slot &slot)
+    {
+        if (slot.encoding_images)
+        {
+            return slot.n_images_pending > 0;
+        }
+        for (size_t i = 0; i < slot.images.size(); ++i)
+        {
+            slot_image &img = slot.images[i];
+            if (!img.request_encode_image)
+            {
+                continue;
+            }
+            server_image_encoder::job job;
+            job.slot_id = slot.id;
+            job.task_id = slot.task_id;
+            job.index = i;
+            job.hash = img.hash;
+            job.img = img.img_data;
+            img.img_data = nullptr;
+            image_encoder.submit(std::move(job));
+            slot.n_images_pending++;
+        }
+        slot.encoding_images = slot.n_images_pending > 0;
+        return slot.encoding_images;
+    }
+
+    // gives the images the encoder thread is done with to their slots
+    void collect_images()
+    {
+        if (!image_encoder.running())
+        {
+            return;
+        }
+        for (server_image_encoder::job &job : image_encoder.collect())
+        {
+            all_slots_are_idle = false;
+            if (job.ok)
+            {
+                image_cache.put(job.hash, job.embd, job.n_tokens);
+            }
+            llama_client_slot *slot = &slots[job.slot_id];
+            if (!slot->encoding_images || slot->task_id != job.task_id)
+            {
+                continue; // request was cancelled
+            }
+            if (!job.ok)
+            {
+                LOG_ERROR("failed to encode image", {
+                    {"slot_id", slot->id},
+                    {"task_id", slot->task_id}
+                });
+                task_server task;
+                task.id = slot->task_id;
+                task.multitask_id = slot->multitask_id;
+                send_error(task, "failed to encode image");
+                slot->reset();
+                slot->command = NONE;
+                queue_tasks.notify_slot_changed();
+                continue;
+            }
+            slot_image &img = slot->images[job.index];
+            img.image_embedding = job.embd;
+            img.image_tokens = job.n_tokens;
+            img.request_encode_image = false;
+            slot->n_images_pending--;
+        }
+    }
+
     void send_error(task_server& task, const std::string &error)
     {
         LOG_TEE("task %i - error: %s\n", task.id, error.c_str());
@@ -1202,17 +2313,9 @@ struct llama_server_context
         res.error = false;
         res.stop = false;
 
-        res.result_json = json
-        {
-            {"content",    tkn.text_to_send},
-            {"stop",       false},
-            {"slot_id",    slot.id},
-            {"multimodal", multimodal}
-        };
-
+        std::vector<completion_token_output> probs_output = {};
         if (slot.sparams.n_probs > 0)
         {
-            std::vector<completion_token_output> probs_output = {};
             const std::vector<llama_token> to_send_toks = llama_tokenize(ctx, tkn.text_to_send, false);
             size_t probs_pos      = std::min(slot.sent_token_probs_index,                       slot.generated_token_probs.size());
             size_t probs_stop_pos = std::min(slot.sent_token_probs_index + to_send_toks.size(), slot.generated_token_probs.size());
@@ -1221,22 +2324,109 @@ struct llama_server_context
                 probs_output = std::vector<completion_token_output>(slot.generated_token_probs.begin() + probs_pos, slot.generated_token_probs.begin() + probs_stop_pos);
             }
             slot.sent_token_probs_index = probs_stop_pos;
-            res.result_json["completion_probabilities"] = probs_vector_to_json(ctx, probs_output);
         }
 
-        if (slot.oaicompat)
+        // tokens are written out as the http thread is going to send
+        // them, unless a multitask is going to collect them
+        if (slot.multitask_id == -1)
         {
-            res.result_json["oaicompat_token_ctr"] = slot.n_decoded;
-            res.result_json["model"] = slot.oaicompat_model;
+            if (slot.oaicompat)
+            {
+                if (!write_partial_response_oaicompat(res.sse, tkn.text_to_send, slot.n_choices > 1 ? slot.index : 0,
+                                                      slot.n_decoded == 0, slot.oaicompat_model))
+                {
+                    return; // nothing to send
+                }
+            }
+            else
+            {
+                res.sse = "data: ";
+                json_writer w(res.sse);
+                w.begin_object();
+                if (slot.sparams.n_probs > 0)
+                {
+                    w.key("completion_probabilities");
+                    write_probs(w, ctx, probs_output);
+                }
+                w.field("content", tkn.text_to_send);
+                if (slot.n_choices > 1)
+                {
+                    w.field("index", slot.index);
+                }
+                w.field("multimodal", multimodal);
+                w.field("slot_id", slot.id);
+                w.field("stop", false);
+                w.end_object();
+                res.sse += "\n\n";
+            }
+            queue_results.send(std::move(res));
+            return;
         }
 
-        queue_results.send(res);
-    }
-
-    void send_final_response(llama_client_slot &slot)
-    {
-        task_result res;
-        res.id = slot.task_id;
+        res.result_json = json
+        {
+            {"content",    tkn.text_to_send},
+            {"stop",       false},
+            {"slot_id",    slot.id},
+            {"multimodal", multimodal}
+        };
+
+        if (slot.n_choices > 1)
+        {
+            res.result_json["index"] = slot.index;
+        }
+
+        if (slot.sparams.n_probs > 0)
+        {
+            res.result_json["completion_probabilities"] = probs_vector_to_json(ctx, probs_output);
+        }
+
+        if (slot.oaicompat)
+        {
+            res.result_json["oaicompat_token_ctr"] = slot.n_decoded;
+            res.result_json["model"] = slot.oaicompat_model;
+        }
+
+        queue_results.send(res);
+    }
+
+    // roughly how long a request arriving now would wait for a slot
+    double estimate_queue_wait() const
+    {
+        const int n_deferred = queue_tasks.n_deferred;
+        if (!n_deferred)
+        {
+            return 0;
+        }
+        return ((double) n_deferred / params.n_parallel + 0.5) * t_request_avg_us / 1e6;
+    }
+
+    // returns true if a request should be turned away, because the queue
+    // is full or it would wait for longer than its deadline
+    bool overloaded(const json &data, double *wait)
+    {
+        *wait = estimate_queue_wait();
+        const double deadline = json_value(data, "deadline_ms", queue_timeout * 1e3) / 1e3;
+        if ((n_queue_max > 0 && queue_tasks.n_deferred >= n_queue_max) || (deadline > 0 && *wait > deadline))
+        {
+            n_requests_rejected++;
+            return true;
+        }
+        return false;
+    }
+
+    void send_final_response(llama_client_slot &slot)
+    {
+        // a moving average, for estimate_queue_wait()
+        if (slot.t_start_process_prompt > slot.t_task_posted)
+        {
+            const int64_t t_request_us = ggml_time_us() - slot.t_start_process_prompt;
+            const int64_t t_avg = t_request_avg_us;
+            t_request_avg_us = t_avg ? t_avg + (t_request_us - t_avg) / 8 : t_request_us;
+        }
+
+        task_result res;
+        res.id = slot.task_id;
         res.multitask_id = slot.multitask_id;
         res.error = false;
         res.stop = true;
@@ -1260,6 +2450,16 @@ struct llama_server_context
             {"timings",             slot.get_formated_timings()}
         };
 
+        if (slot.params.timings_detail)
+        {
+            res.result_json["timings_detail"] = slot.get_formated_timings_detail();
+        }
+
+        if (slot.n_choices > 1)
+        {
+            res.result_json["index"] = slot.index;
+        }
+
         if (slot.sparams.n_probs > 0)
         {
             std::vector<completion_token_output> probs = {};
@@ -1331,6 +2531,321 @@ struct llama_server_context
         queue_results.send(res);
     }
 
+    // returns how many sequence ids are left past those of the slots and
+    // n_seq_used more, since the kv cache only tracks so many
+    int32_t n_seq_spare(int32_t n_seq_used) const
+    {
+        return std::max((int32_t) llama_max_parallel_sequences() - params.n_parallel - n_seq_used, 0);
+    }
+
+    // embeds many inputs at once, without going through the slots
+    //
+    // inputs are packed into batches of up to n_ubatch tokens, each with
+    // a sequence id of its own past those of the slots and the prefix
+    // cache, whose cells are dropped again once the embeddings are read
+    void embed_batch(task_server &task)
+    {
+        const json &inputs = task.data["inputs"];
+        const int n_embd = llama_n_embd(model);
+        const int32_t n_budget = std::min((int32_t) llama_n_ubatch(ctx), n_ctx);
+        const llama_seq_id seq_base = params.n_parallel + prefix_cache.n_max;
+        const int32_t n_seq_free = n_seq_spare(prefix_cache.n_max);
+
+        if (!n_seq_free)
+        {
+            send_error(task, "no sequence ids are left for batched embeddings. decrease --parallel or --prefix-cache");
+            return;
+        }
+        std::vector<std::vector<llama_token>> tokens;
+        int32_t n_seq_max = 0;
+        int32_t n_seq = 0;
+        int32_t n_tokens = 0;
+        for (const json &input : inputs)
+        {
+            tokens.push_back(tokenize(input, true));
+            if (tokens.back().empty())
+            {
+                send_error(task, "input is empty");
+                return;
+            }
+            if ((int32_t) tokens.back().size() > n_budget)
+            {
+                send_error(task, "input is too large to process. increase the physical batch size");
+                return;
+            }
+            if (n_tokens + (int32_t) tokens.back().size() > n_budget || n_seq == n_seq_free)
+            {
+                n_seq_max = std::max(n_seq_max, n_seq);
+                n_seq = 0;
+                n_tokens = 0;
+            }
+            n_tokens += tokens.back().size();
+            ++n_seq;
+        }
+        n_seq_max = std::max(n_seq_max, n_seq);
+
+        // models with a recurrent state can't hold the extra sequences
+        if (n_seq_max > 0 && !llama_kv_cache_seq_rm(ctx, seq_base + n_seq_max - 1, -1, -1))
+        {
+            send_error(task, "batched embeddings are not supported by this model");
+            return;
+        }
+
+        std::vector<json> results(tokens.size());
+        size_t k_first = 0;
+        while (k_first < tokens.size())
+        {
+            llama_batch_clear(batch);
+            size_t k_last = k_first;
+            for (; k_last < tokens.size() && k_last - k_first < (size_t) n_seq_free &&
+                   batch.n_tokens + tokens[k_last].size() <= (size_t) n_budget; ++k_last)
+            {
+                const llama_seq_id seq = seq_base + (k_last - k_first);
+                for (size_t j = 0; j < tokens[k_last].size(); ++j)
+                {
+                    llama_batch_add(batch, tokens[k_last][j], j, { seq }, j == tokens[k_last].size() - 1);
+                }
+            }
+
+            int ret = llama_decode(ctx, batch);
+            if (ret > 0 && prefix_cache.size() > 0)
+            {
+                prefix_cache.clear();
+                ret = llama_decode(ctx, batch);
+            }
+            if (ret != 0)
+            {
+                for (size_t k = k_first; k < k_last; ++k)
+                {
+                    llama_kv_cache_seq_rm(ctx, seq_base + (k - k_first), -1, -1);
+                }
+                send_error(task, "failed to decode embedding batch");
+                return;
+            }
+
+            for (int32_t i = 0; i < batch.n_tokens; ++i)
+            {
+                if (!batch.logits[i])
+                {
+                    continue;
+                }
+                const llama_seq_id seq = batch.seq_id[i][0];
+                const float *embd = llama_get_embeddings_seq(ctx, seq);
+                if (embd == NULL)
+                {
+                    embd = llama_get_embeddings_ith(ctx, i);
+                }
+                std::vector<float> out(n_embd, 0.0f);
+                if (embd == NULL)
+                {
+                    LOG_ERROR("failed to get embeddings (please report this)", {
+                            {"token",  batch.token[i]},
+                            {"seq_id", seq}
+                        });
+                }
+                else
+                {
+                    llama_embd_normalize(embd, out.data(), n_embd);
+                }
+                results[k_first + (seq - seq_base)] = json {
+                    {"embedding", out},
+                };
+            }
+
+            for (size_t k = k_first; k < k_last; ++k)
+            {
+                llama_kv_cache_seq_rm(ctx, seq_base + (k - k_first), -1, -1);
+            }
+
+            LOG_VERBOSE("embedding batch decoded", {
+                {"task_id",  task.id},
+                {"n_seq",    k_last - k_first},
+                {"n_tokens", batch.n_tokens},
+            });
+            k_first = k_last;
+        }
+        llama_batch_clear(batch);
+
+        task_result res;
+        res.id = task.id;
+        res.multitask_id = task.multitask_id;
+        res.stop = true;
+        res.error = false;
+        res.result_json = json { { "results", results } };
+        queue_results.send(res);
+    }
+
+    // scores documents by how likely the model finds each of them as a
+    // continuation of the query, without going through the slots
+    //
+    // like the hellaswag score of perplexity.cpp, the documents are packed
+    // into batches of up to n_batch tokens behind one copy of the query,
+    // whose tokens belong to the sequences of all of them. only logits of
+    // positions predicting a document token are computed
+    void score_batch(task_server &task)
+    {
+        const std::vector<llama_token> query = tokenize(task.data["query"], true);
+        const json &documents = task.data["documents"];
+        const int32_t n_budget = std::min((int32_t) llama_n_batch(ctx), n_ctx);
+        const int32_t n_vocab = llama_n_vocab(model);
+        const llama_seq_id seq_base = params.n_parallel + prefix_cache.n_max;
+        const int32_t n_seq_batch = std::min({(int32_t) documents.size(), SCORE_MAX_SEQ, n_seq_spare(prefix_cache.n_max)});
+
+        if (query.empty())
+        {
+            send_error(task, "query is empty");
+            return;
+        }
+        if (!n_seq_spare(prefix_cache.n_max))
+        {
+            send_error(task, "no sequence ids are left for scoring. decrease --parallel or --prefix-cache");
+            return;
+        }
+        std::vector<std::vector<llama_token>> tokens;
+        for (const json &document : documents)
+        {
+            tokens.push_back(tokenize(document, false));
+            if (tokens.back().empty())
+            {
+                send_error(task, "document is empty");
+                return;
+            }
+            if (query.size() + tokens.back().size() > (size_t) n_budget)
+            {
+                send_error(task, "query and document are too large to process. increase the batch size");
+                return;
+            }
+        }
+
+        // models with a recurrent state can't hold the extra sequences
+        if (n_seq_batch > 0 && !llama_kv_cache_seq_rm(ctx, seq_base + n_seq_batch - 1, -1, -1))
+        {
+            send_error(task, "scoring is not supported by this model");
+            return;
+        }
+
+        llama_batch sbatch = llama_batch_init(n_budget, 0, std::max(n_seq_batch, 1));
+        std::vector<json> results(tokens.size());
+        std::vector<int32_t> i_first(n_seq_batch); // batch index of the logits predicting each first token
+        size_t k_first = 0;
+        while (k_first < tokens.size())
+        {
+            llama_batch_clear(sbatch);
+            size_t k_last = k_first;
+            size_t n_tokens = query.size();
+            while (k_last < tokens.size() && k_last - k_first < (size_t) n_seq_batch &&
+                   n_tokens + tokens[k_last].size() <= (size_t) n_budget)
+            {
+                n_tokens += tokens[k_last++].size();
+            }
+            std::vector<llama_seq_id> seqs;
+            for (size_t k = k_first; k < k_last; ++k)
+            {
+                seqs.push_back(seq_base + (k - k_first));
+            }
+            for (size_t j = 0; j < query.size(); ++j)
+            {
+                llama_batch_add(sbatch, query[j], j, seqs, j == query.size() - 1);
+            }
+            for (size_t k = k_first; k < k_last; ++k)
+            {
+                i_first[k - k_first] = sbatch.n_tokens;
+                for (size_t j = 0; j < tokens[k].size(); ++j)
+                {
+                    llama_batch_add(sbatch, tokens[k][j], query.size() + j, { seqs[k - k_first] }, j < tokens[k].size() - 1);
+                }
+            }
+
+            int ret = llama_decode(ctx, sbatch);
+            if (ret > 0 && prefix_cache.size() > 0)
+            {
+                prefix_cache.clear();
+                ret = llama_decode(ctx, sbatch);
+            }
+            if (ret == 0)
+            {
+                for (size_t k = k_first; k < k_last; ++k)
+                {
+                    double logprob = 0;
+                    const std::vector<llama_token> &doc = tokens[k];
+                    for (size_t j = 0; j < doc.size(); ++j)
+                    {
+                        // the first token is predicted by the last of the query
+                        const int32_t i = j ? i_first[k - k_first] + j - 1 : query.size() - 1;
+                        const float *logits = llama_get_logits_ith(ctx, i);
+                        float max = logits[0];
+                        for (int32_t v = 1; v < n_vocab; ++v)
+                        {
+                            max = std::max(max, logits[v]);
+                        }
+                        double sum = 0;
+                        for (int32_t v = 0; v < n_vocab; ++v)
+                        {
+                            sum += expf(logits[v] - max);
+                        }
+                        logprob += logits[doc[j]] - max - log(sum);
+                    }
+                    results[k] = json {
+                        {"index",        k},
+                        {"logprob",      logprob},
+                        {"logprob_mean", logprob / doc.size()},
+                        {"n_tokens",     doc.size()},
+                    };
+                }
+            }
+
+            for (const llama_seq_id seq : seqs)
+            {
+                llama_kv_cache_seq_rm(ctx, seq, -1, -1);
+            }
+            if (ret != 0)
+            {
+                llama_batch_free(sbatch);
+                send_error(task, "failed to decode score batch");
+                return;
+            }
+
+            LOG_VERBOSE("score batch decoded", {
+                {"task_id",  task.id},
+                {"n_seq",    k_last - k_first},
+                {"n_tokens", sbatch.n_tokens},
+            });
+            k_first = k_last;
+        }
+        llama_batch_free(sbatch);
+
+        task_result res;
+        res.id = task.id;
+        res.multitask_id = task.multitask_id;
+        res.stop = true;
+        res.error = false;
+        res.result_json = json {
+            {"results",             results},
+            {"tokens_evaluated",    query.size()},
+        };
+        queue_results.send(res);
+    }
+
+    void request_score(int task_id, json query, json documents)
+    {
+        task_server task;
+        task.id = task_id;
+        task.target_id = -1;
+        task.type = TASK_TYPE_SCORE;
+        task.data = { { "query", std::move(query) }, { "documents", std::move(documents) } };
+        queue_tasks.post(task);
+    }
+
+    void request_embeddings(int task_id, json inputs)
+    {
+        task_server task;
+        task.id = task_id;
+        task.target_id = -1;
+        task.type = TASK_TYPE_EMBEDDING_BATCH;
+        task.data = { { "inputs", std::move(inputs) } };
+        queue_tasks.post(task);
+    }
+
     void request_completion(int task_id, json data, bool infill, bool embedding, int multitask_id)
     {
         task_server task;
@@ -1341,6 +2856,13 @@ struct llama_server_context
         task.embedding_mode = embedding;
         task.type = TASK_TYPE_COMPLETION;
         task.multitask_id = multitask_id;
+        task.t_posted = ggml_time_us();
+        task.priority = json_value(task.data, "priority", 0);
+        const double deadline_ms = json_value(task.data, "deadline_ms", queue_timeout * 1e3);
+        if (deadline_ms > 0)
+        {
+            task.t_deadline = task.t_posted + deadline_ms * 1e3;
+        }
 
         // when a completion task's prompt array is not a singleton, we split it into multiple requests
         // otherwise, it's a single-prompt task, we actually queue it
@@ -1360,7 +2882,7 @@ struct llama_server_context
             // if there are numbers, it needs to be treated like a single prompt,
             // queue_tasks handles a mix of strings and numbers just fine.
             if (numbers) {
-                queue_tasks.post(task);
+                queue_tasks.post(std::move(task));
             } else {
                 split_multiprompt_task(task_id, task);
             }
@@ -1369,103 +2891,1018 @@ struct llama_server_context
             if (task.data.contains("prompt") && task.data["prompt"].is_string() && task.data["prompt"].get<std::string>().empty()) {
                 task.data["prompt"] = " "; // add a space so that we have one token
             }
-            queue_tasks.post(task);
+            queue_tasks.post(std::move(task));
+        }
+    }
+
+    // lays out a multimodal prompt as tokens, where each image is a run
+    // of server_image_cache::token(), so cache_prompt can tell how much
+    // of it the slot has already evaluated
+    std::vector<llama_token> tokenize_images(llama_client_slot &slot)
+    {
+        std::vector<llama_token> tokens;
+        std::string prompt;
+        for (size_t k = 0; k < slot.images.size(); ++k)
+        {
+            slot_image &img = slot.images[k];
+            std::vector<llama_token> prefix_tokens = tokenize(img.prefix_prompt, k == 0 && add_bos_token);
+            tokens.insert(tokens.end(), prefix_tokens.begin(), prefix_tokens.end());
+            img.i_token = tokens.size();
+            tokens.insert(tokens.end(), img.image_tokens, server_image_cache::token(img.hash));
+            prompt += img.prefix_prompt;
+            prompt += "[img-" + std::to_string(img.id) + "]";
         }
+        std::vector<llama_token> suffix_tokens = tokenize(slot.params.input_suffix, false);
+        tokens.insert(tokens.end(), suffix_tokens.begin(), suffix_tokens.end());
+        prompt += slot.params.input_suffix;
+
+        // the prompt was cleared when the images were loaded
+        slot.prompt = prompt;
+        return tokens;
     }
 
-    // for multiple images processing
-    bool ingest_images(llama_client_slot &slot, int n_batch)
+    // evaluates the tokens of a multimodal prompt from slot.n_past on
+    //
+    // the text leading up to each image is decoded by itself, followed by
+    // the image, so only the text after the last image is left in the
+    // batch that's shared with the other slots
+    bool ingest_images(llama_client_slot &slot, const std::vector<llama_token> &prompt_tokens, int n_batch)
     {
-        int image_idx = 0;
-        std::string prompt = "";
+        const int n_embd = llama_n_embd(model);
+        int32_t i = slot.n_past;
 
-        while (image_idx < (int) slot.images.size())
+        for (const slot_image &img : slot.images)
         {
-            slot_image &img = slot.images[image_idx];
+            if (i >= img.i_token + img.image_tokens)
+            {
+                continue; // already in the cache
+            }
 
             long t1 = micros();
+            int n_tokens = 0;
 
-            // process prefix prompt
-            for (int32_t i = 0; i < (int32_t) batch.n_tokens; i += n_batch)
+            for (; i < img.i_token; i += n_batch)
             {
-                const int32_t n_tokens = std::min(n_batch, (int32_t) (batch.n_tokens - i));
-                llama_batch batch_view = {
-                    n_tokens,
-                    batch.token    + i,
-                    nullptr,
-                    batch.pos      + i,
-                    batch.n_seq_id + i,
-                    batch.seq_id   + i,
-                    batch.logits   + i,
-                    0, 0, 0, // unused
-                };
-                if (llama_decode(ctx, batch_view))
+                const int32_t n_eval = std::min(n_batch, img.i_token - i);
+                llama_batch batch_text = llama_batch_init(n_eval, 0, 1);
+                for (int32_t j = 0; j < n_eval; ++j)
+                {
+                    llama_batch_add(batch_text, prompt_tokens[i + j], system_tokens.size() + i + j, { slot.id }, false);
+                }
+                const int ret = llama_decode(ctx, batch_text);
+                llama_batch_free(batch_text);
+                if (ret)
                 {
                     LOG_TEE("%s : failed to eval\n", __func__);
                     return false;
                 }
+                n_tokens += n_eval;
             }
+            i = img.i_token;
 
-            // process image with llm
-            for (int i = 0; i < img.image_tokens; i += n_batch)
+            for (int32_t j = slot.n_past > i ? slot.n_past - i : 0; j < img.image_tokens; j += n_batch)
             {
-                int n_eval = img.image_tokens - i;
-                if (n_eval > n_batch)
-                {
-                    n_eval = n_batch;
-                }
-
-                const int n_embd = llama_n_embd(model);
-                llama_batch batch_img = { n_eval, nullptr, (img.image_embedding + i * n_embd), nullptr, nullptr, nullptr, nullptr, slot.n_past, 1, 0, };
+                const int32_t n_eval = std::min(n_batch, img.image_tokens - j);
+                llama_batch batch_img = { n_eval, nullptr, (img.image_embedding.get() + j * n_embd), nullptr, nullptr, nullptr, nullptr, (llama_pos) system_tokens.size() + i + j, 1, slot.id, };
                 if (llama_decode(ctx, batch_img))
                 {
                     LOG_TEE("%s : failed to eval image\n", __func__);
                     return false;
                 }
-                slot.n_past += n_eval;
+                n_tokens += n_eval;
             }
-            image_idx++;
+            i += img.image_tokens;
 
             long t2 = micros();
-            int n_tokens = batch.n_tokens + img.image_tokens;
             g_prompt_per_second_jart = 1e6 / (t2 - t1) * n_tokens;
             LOG_TEE("evaluated %d image tokens in %ld us at %g tok/sec\n",
                     n_tokens, t2 - t1, g_prompt_per_second_jart);
+        }
 
-            llama_batch_clear(batch);
-
-            // append prefix of next image
-            const auto json_prompt = (image_idx >= (int) slot.images.size()) ?
-                slot.params.input_suffix : // no more images, then process suffix prompt
-                (json)(slot.images[image_idx].prefix_prompt);
+        for (; i < (int32_t) prompt_tokens.size(); ++i)
+        {
+            llama_batch_add(batch, prompt_tokens[i], system_tokens.size() + i, { slot.id }, false);
+        }
+        slot.n_past = prompt_tokens.size();
 
-            // rebuild the prompt since it was cleared earlier
-            prompt += img.prefix_prompt;
-            prompt += "[img-" + std::to_string(img.id) + "]";
-            prompt += json_prompt;
+        return true;
+    }
 
-            std::vector<llama_token> append_tokens = tokenize(json_prompt, false); // has next image
-            for (int i = 0; i < (int) append_tokens.size(); ++i)
+    // adds the next piece of a slot's prompt to the batch
+    //
+    // the chunk is taken out of the shared `n_prefill` budget. once the
+    // last prompt token is in, its logits are requested so the slot will
+    // sample its first token as soon as this batch has been decoded.
+    void ingest_prompt_chunk(llama_client_slot &slot, int32_t &n_prefill)
+    {
+        const int32_t n_prompt = slot.cache_tokens.size();
+        std::vector<llama_seq_id> seq_ids = { slot.id };
+        for (const llama_client_slot &other : slots)
+        {
+            if (other.fork_of == slot.id && other.ingesting_prompt)
             {
-                llama_batch_add(batch, append_tokens[i], system_tokens.size() + slot.n_past, { slot.id }, true);
-                slot.n_past += 1;
+                seq_ids.push_back(other.id);
             }
         }
+        if (seq_ids.size() == 1)
+        {
+            for (; slot.n_past < n_prompt && n_prefill > 0; ++slot.n_past, --n_prefill)
+            {
+                llama_batch_add(batch, slot.cache_tokens[slot.n_past], system_tokens.size() + slot.n_past, { slot.id }, false);
+            }
+            if (slot.n_past == n_prompt)
+            {
+                batch.logits[batch.n_tokens - 1] = true;
+                slot.i_batch = batch.n_tokens - 1;
+                slot.ingesting_prompt = false;
+            }
+            return;
+        }
 
-        // There is no prompt caching in multimodal currently
-        slot.num_prompt_tokens = slot.n_past;
-        slot.num_prompt_tokens_processed = slot.n_past;
-
-        // prompt for multimodal is set to empty to avoid processing those tokens here
-        slot.prompt = prompt;
+        // every token but the last goes into cells shared by all choices,
+        // whereas the last is decoded once per choice, since the samplers
+        // modify the logits they're given
+        const int32_t n_shared = n_prompt - 1;
+        for (; slot.n_past < n_shared && n_prefill > 0; ++slot.n_past, --n_prefill)
+        {
+            llama_batch_add(batch, slot.cache_tokens[slot.n_past], system_tokens.size() + slot.n_past, seq_ids, false);
+        }
+        const bool done = slot.n_past == n_shared && n_prefill > 0;
+        for (llama_seq_id id : seq_ids)
+        {
+            llama_client_slot &branch = slots[id];
+            branch.n_past = slot.n_past;
+            if (done)
+            {
+                llama_batch_add(batch, slot.cache_tokens[n_shared], system_tokens.size() + n_shared, { id }, true);
+                branch.i_batch = batch.n_tokens - 1;
+                branch.n_past = n_prompt;
+                branch.n_shared = n_shared;
+                branch.ingesting_prompt = false;
+            }
+        }
+        if (done)
+        {
+            --n_prefill;
+        }
+    }
 
-        return true;
+    // takes a generating slot of a recurrent model back to the newest
+    // checkpoint of its state before n_past, since the state can't be cut
+    // anywhere else, and has it decode the tokens from there on again like
+    // a prompt, the last of which is the token it sampled
+    void rewind_slot(llama_client_slot &slot, int32_t n_past)
+    {
+        const llama_pos p0 = system_tokens.size();
+        const llama_pos p_end = llama_kv_cache_seq_rewind(ctx, slot.id, p0 + n_past);
+        slot.n_past = std::max(0, p_end + 1 - p0);
+        slot.ingesting_prompt = slot.n_past < (int32_t) slot.cache_tokens.size();
+        LOG_VERBOSE("slot rewound to checkpoint", {
+            { "slot_id", slot.id },
+            { "n_past",  slot.n_past },
+            { "n_redo",  n_past - slot.n_past },
+        });
     }
 
-    void request_cancel(int task_id)
+    // has the other choices of a request start out with the prompt the
+    // first one holds in its kv cache, which it's about to feed them too
+    void fork_slot(llama_client_slot &slot)
     {
-        task_server task;
-        task.type = TASK_TYPE_CANCEL;
+        const llama_pos p0 = system_tokens.size();
+        for (llama_client_slot &other : slots)
+        {
+            if (other.fork_of != slot.id || other.state != IDLE || other.command != LOAD_PROMPT)
+            {
+                continue;
+            }
+            other.state   = PROCESSING;
+            other.command = NONE;
+            other.t_start_process_prompt      = slot.t_start_process_prompt;
+            other.t_start_genereration        = 0;
+            other.num_prompt_tokens           = slot.num_prompt_tokens;
+            other.num_prompt_tokens_processed = slot.num_prompt_tokens_processed;
+            other.n_prompt_cached             = slot.n_prompt_cached;
+            other.params.n_keep               = slot.params.n_keep;
+            other.truncated                   = slot.truncated;
+            other.cache_tokens                = slot.cache_tokens;
+            other.n_past                      = slot.n_past;
+            other.n_past_se                   = 0;
+            other.ga_i                        = 0;
+            other.n_decoded                   = 0;
+            other.ingesting_prompt            = true;
+            llama_sampling_cp(slot.ctx_sampling, other.ctx_sampling);
+
+            llama_kv_cache_seq_rm(ctx, other.id, p0, -1);
+            llama_kv_cache_seq_cp(ctx, slot.id, other.id, p0, p0 + slot.n_past);
+
+            LOG_INFO("slot forked", {
+                { "slot_id", other.id },
+                { "task_id", other.task_id },
+                { "fork_of", slot.id },
+                { "n_past",  other.n_past },
+            });
+        }
+    }
+
+    // has the draft model guess the next tokens of every generating slot
+    //
+    // the draft kv cache is first brought up to date with the tokens the
+    // target model has seen, after which the guesses of all slots are
+    // made together, one token per llama_decode() call. without a draft
+    // model, the first n_layer_draft layers of the target model guess in
+    // its own kv cache, and their cells are dropped again afterwards
+    std::vector<int32_t> draft_tokens()
+    {
+        llama_context *ctx_guess = ctx_dft ? ctx_dft : ctx;
+        if (!ctx_dft)
+        {
+            llama_set_logits_top_k(ctx, 0);
+            llama_set_n_layer_exit(ctx, n_layer_draft);
+        }
+
+        const llama_pos p0 = system_tokens.size();
+        const std::vector<int32_t> n_max = draft_limits();
+
+        llama_batch_clear(batch_dft);
+        for (llama_client_slot &slot : slots)
+        {
+            if (n_max[slot.id] <= 0)
+            {
+                continue;
+            }
+
+            if (!ctx_dft)
+            {
+                slot.cache_tokens_dft = slot.cache_tokens;
+            }
+
+            // the last token, which was just sampled, is always missing
+            size_t n_same = common_part(slot.cache_tokens_dft, slot.cache_tokens);
+            n_same = std::min(n_same, slot.cache_tokens.size() - 1);
+            llama_kv_cache_seq_rm(ctx_guess, slot.id, p0 + n_same, -1);
+            slot.cache_tokens_dft.resize(n_same);
+            for (size_t k = n_same; k < slot.cache_tokens.size(); ++k)
+            {
+                llama_batch_add(batch_dft, slot.cache_tokens[k], p0 + k, { slot.id }, false);
+                slot.cache_tokens_dft.push_back(slot.cache_tokens[k]);
+            }
+            batch_dft.logits[batch_dft.n_tokens - 1] = true;
+            slot.i_batch_dft = batch_dft.n_tokens - 1;
+        }
+
+        const int32_t n_vocab = llama_n_vocab(model);
+        while (batch_dft.n_tokens > 0)
+        {
+            for (int32_t i = 0; i < batch_dft.n_tokens; i += params.n_batch)
+            {
+                const int32_t n_tokens = std::min(params.n_batch, batch_dft.n_tokens - i);
+                llama_batch batch_view = {
+                    n_tokens,
+                    batch_dft.token    + i,
+                    nullptr,
+                    batch_dft.pos      + i,
+                    batch_dft.n_seq_id + i,
+                    batch_dft.seq_id   + i,
+                    batch_dft.logits   + i,
+                    0, 0, 0, // unused
+                };
+                if (llama_decode(ctx_guess, batch_view) != 0)
+                {
+                    // not worth failing the request over, start afresh next time
+                    LOG_WARNING("failed to decode draft batch", {{"n_tokens", n_tokens}});
+                    for (llama_client_slot &slot : slots)
+                    {
+                        if (ctx_dft)
+                        {
+                            llama_kv_cache_seq_rm(ctx_dft, slot.id, p0, -1);
+                            slot.cache_tokens_dft.clear();
+                        }
+                        slot.drafted.clear();
+                    }
+                    end_self_draft();
+                    return n_max;
+                }
+                for (llama_client_slot &slot : slots)
+                {
+                    if (slot.i_batch_dft < i || slot.i_batch_dft >= i + n_tokens)
+                    {
+                        continue;
+                    }
+                    const float *logits = llama_get_logits_ith(ctx_guess, slot.i_batch_dft - i);
+                    slot.drafted.push_back(std::max_element(logits, logits + n_vocab) - logits);
+                }
+            }
+
+            // feed the guesses back in to extend them
+            llama_batch_clear(batch_dft);
+            for (llama_client_slot &slot : slots)
+            {
+                if (slot.i_batch_dft < 0)
+                {
+                    continue;
+                }
+                slot.i_batch_dft = -1;
+                const llama_token id = slot.drafted.back();
+                if ((int32_t) slot.drafted.size() >= n_max[slot.id] || llama_token_is_eog(model, id))
+                {
+                    continue;
+                }
+                llama_batch_add(batch_dft, id, p0 + slot.cache_tokens_dft.size(), { slot.id }, true);
+                slot.cache_tokens_dft.push_back(id);
+                slot.i_batch_dft = batch_dft.n_tokens - 1;
+            }
+        }
+
+        end_self_draft();
+        return n_max;
+    }
+
+    // forgets the previous guesses and works out how many tokens each
+    // slot may guess now, so that all of them fit in one verifying view
+    std::vector<int32_t> draft_limits()
+    {
+        const llama_pos p0 = system_tokens.size();
+        int32_t n_budget = params.n_batch;
+        for (llama_client_slot &slot : slots)
+        {
+            slot.drafted.clear();
+            slot.i_batch_dft = -1;
+            if (slot.state != IDLE && slot.command != RELEASE && !slot.ingesting_prompt)
+            {
+                --n_budget;
+            }
+        }
+
+        std::vector<int32_t> n_max(slots.size(), 0);
+        for (llama_client_slot &slot : slots)
+        {
+            if (slot.state == IDLE || slot.command == RELEASE || slot.ingesting_prompt ||
+                slot.embedding || slot.ga_n != 1 || !slot.images.empty() || slot.cache_tokens.empty())
+            {
+                continue;
+            }
+            const int32_t n_room = slot.n_ctx - (int32_t) (p0 + slot.cache_tokens.size()) - 1;
+            n_max[slot.id] = std::max(0, std::min({params.n_draft, n_room, n_budget}));
+            n_budget -= n_max[slot.id];
+        }
+        return n_max;
+    }
+
+    // guesses that the text goes on the way it did after the last time
+    // its final n-gram came up, which pays off whenever the output quotes
+    // the prompt, e.g. when summarizing, editing code or answering from
+    // retrieved documents. the longest n-gram that matches wins
+    std::vector<int32_t> lookup_tokens()
+    {
+        const std::vector<int32_t> n_max = draft_limits();
+        for (llama_client_slot &slot : slots)
+        {
+            if (n_max[slot.id] <= 0)
+            {
+                continue;
+            }
+            const std::vector<llama_token> &tokens = slot.cache_tokens;
+            const int32_t n_tokens = tokens.size();
+            for (int32_t n = std::min(n_lookup_ngram, n_tokens - 1); n > 0 && slot.drafted.empty(); --n)
+            {
+                for (int32_t j = n_tokens - n - 1; j >= 0; --j)
+                {
+                    if (!std::equal(tokens.begin() + j, tokens.begin() + j + n, tokens.end() - n))
+                    {
+                        continue;
+                    }
+                    for (int32_t k = j + n; k < n_tokens && (int32_t) slot.drafted.size() < n_max[slot.id]; ++k)
+                    {
+                        slot.drafted.push_back(tokens[k]);
+                        if (llama_token_is_eog(model, tokens[k]))
+                        {
+                            break;
+                        }
+                    }
+                    break;
+                }
+            }
+        }
+        return n_max;
+    }
+
+    // guesses the text the grammar of a slot allows nothing else in place
+    // of, e.g. the keys and punctuation of a json schema, which takes the
+    // place of any other guess. sampling still checks the tokens, since
+    // the model may spell the same text with other ones, so they're only
+    // drafted as far as their pieces spell it out exactly, which rules
+    // out e.g. the space a tokenizer puts in front of the text
+    void jump_tokens(const std::vector<int32_t> &n_max)
+    {
+        char buf[256];
+        for (llama_client_slot &slot : slots)
+        {
+            if (n_max[slot.id] <= 0 || !slot.ctx_sampling || !slot.ctx_sampling->grammar)
+            {
+                continue;
+            }
+            const int32_t n = llama_grammar_forced_text(slot.ctx_sampling->grammar, buf, sizeof(buf));
+            if (n <= 0)
+            {
+                continue;
+            }
+            const std::string text(buf, n);
+            size_t n_spelled = 0;
+            slot.drafted.clear();
+            for (const llama_token id : ::llama_tokenize(model, text, false))
+            {
+                const std::string piece = llama_token_to_piece(ctx, id);
+                if ((int32_t) slot.drafted.size() >= n_max[slot.id] || piece.empty() ||
+                    text.compare(n_spelled, piece.size(), piece) != 0)
+                {
+                    break;
+                }
+                n_spelled += piece.size();
+                slot.drafted.push_back(id);
+            }
+        }
+    }
+
+    // the cells the first layers guessed into are missing the rest of
+    // them, so the full model has to decode those positions afresh
+    void end_self_draft()
+    {
+        if (ctx_dft)
+        {
+            return;
+        }
+        const llama_pos p0 = system_tokens.size();
+        for (llama_client_slot &slot : slots)
+        {
+            if (!slot.cache_tokens_dft.empty())
+            {
+                llama_kv_cache_seq_rm(ctx, slot.id, p0 + slot.cache_tokens.size() - 1, -1);
+                slot.cache_tokens_dft.clear();
+            }
+        }
+        llama_set_n_layer_exit(ctx, 0);
+    }
+
+    // charges a llama_decode() call to the slots that had tokens in it,
+    // and splits the joules it cost among them by their tokens
+    void account_decode(const llama_batch &batch_view, int64_t t_us, double joules)
+    {
+        std::vector<int32_t> in_batch(slots.size());
+        int32_t n_owned = 0;
+        for (int32_t k = 0; k < batch_view.n_tokens; ++k)
+        {
+            for (int32_t s = 0; s < batch_view.n_seq_id[k]; ++s)
+            {
+                const llama_seq_id seq = batch_view.seq_id[k][s];
+                if (seq >= 0 && seq < (llama_seq_id) slots.size())
+                {
+                    in_batch[seq] += 1;
+                    n_owned += 1;
+                }
+            }
+        }
+        const int n_slots = in_batch.size() - std::count(in_batch.begin(), in_batch.end(), 0);
+        for (auto & slot : slots)
+        {
+            if (slot.id < (int) in_batch.size() && in_batch[slot.id])
+            {
+                slot.n_decode_calls  += 1;
+                slot.n_decode_shared += n_slots > 1;
+                slot.t_decode_us     += t_us;
+                if (joules > 0)
+                {
+                    (slot.n_decoded ? slot.j_predicted : slot.j_prompt) += joules * in_batch[slot.id] / n_owned;
+                }
+            }
+        }
+    }
+
+    // samples the next token of a slot from row idx of the last batch
+    // view, which only touches the slot's sampling state, so different
+    // slots may be drawn from at the same time
+    completion_token_output draw_token(llama_client_slot &slot, int32_t idx)
+    {
+        completion_token_output result;
+        const int64_t t_start = ggml_time_us();
+        if (!slot.shortlist.empty())
+        {
+            // the batch may have computed the logits of other slots'
+            // shortlists, or of the whole vocab
+            float * logits = llama_get_logits_ith(ctx, idx);
+            const int n_vocab = llama_n_vocab(model);
+            auto it = slot.shortlist.begin();
+            for (llama_token tok = 0; tok < n_vocab; ++tok)
+            {
+                if (it != slot.shortlist.end() && *it == tok)
+                {
+                    ++it;
+                }
+                else
+                {
+                    logits[tok] = -INFINITY;
+                }
+            }
+        }
+        const llama_token id = llama_sampling_sample(slot.ctx_sampling, ctx, NULL, idx);
+
+        llama_sampling_accept(slot.ctx_sampling, ctx, id, true);
+
+        llama_token_data_array cur_p = { slot.ctx_sampling->cur.data(), slot.ctx_sampling->cur.size(), false };
+        result.tok = id;
+
+        const int32_t n_probs = slot.sparams.n_probs;
+        if (slot.sparams.temp <= 0 && n_probs > 0)
+        {
+            // for llama_sample_token_greedy we need to sort candidates
+            llama_sample_softmax(ctx, &cur_p);
+        }
+
+        for (size_t i = 0; i < std::min(cur_p.size, (size_t)n_probs); ++i)
+        {
+            result.probs.push_back({cur_p.data[i].id, cur_p.data[i].p});
+        }
+        slot.t_sampling_us += ggml_time_us() - t_start;
+        return result;
+    }
+
+    // draws as many tokens as the slot's draft gets right into slot.drawn
+    void draw_tokens(llama_client_slot &slot, int32_t idx, int32_t n_verify)
+    {
+        slot.drawn.clear();
+        for (int32_t n = 0;; ++n)
+        {
+            slot.drawn.push_back(draw_token(slot, idx + n));
+            if (n >= n_verify || slot.drawn.back().tok != slot.drafted[n])
+            {
+                break;
+            }
+        }
+    }
+
+    // hands a token that was drawn to the client, returning false once
+    // the slot has nothing left to generate
+    bool finish_token(completion_token_output &result, llama_client_slot &slot)
+    {
+        slot.n_decoded += 1;
+        const int64_t t_now = ggml_time_us();
+        if (slot.n_decoded == 1)
+        {
+            slot.t_start_genereration = t_now;
+            slot.t_prompt_processing = (slot.t_start_genereration - slot.t_start_process_prompt) / 1e3;
+            metrics.on_prompt_eval(slot);
+            if (slot.t_task_posted)
+            {
+                metrics.time_to_first_token_seconds.observe((t_now - slot.t_task_posted) / 1e6);
+            }
+        }
+        else
+        {
+            metrics.inter_token_seconds.observe((t_now - slot.t_last_token) / 1e6);
+        }
+        slot.t_last_token = t_now;
+
+        if (!process_token(result, slot))
+        {
+            slot.release();
+            slot.print_timings();
+            send_final_response(slot);
+            metrics.on_prediction(slot);
+            return false;
+        }
+        return true;
+    }
+
+    // writes kv cache of slot to file, returning bytes written or zero
+    size_t save_slot(llama_client_slot &slot, const std::string &filepath, size_t *n_saved)
+    {
+        // the last token of the cache may not have been evaluated yet
+        *n_saved = std::min(slot.cache_tokens.size(), (size_t) std::max(slot.n_past, 0));
+        const size_t n_written = llama_state_seq_save_file(ctx, filepath.c_str(), slot.id, slot.cache_tokens.data(), *n_saved);
+        if (n_written)
+        {
+            drop_page_cache(filepath);
+        }
+        return n_written;
+    }
+
+    // reads kv cache of slot from file, returning bytes read or zero
+    size_t restore_slot(llama_client_slot &slot, const std::string &filepath, size_t *n_restored)
+    {
+        std::vector<llama_token> tokens(dynamic_slots ? n_ctx : slot.n_ctx);
+        *n_restored = 0;
+        const size_t n_read = llama_state_seq_load_file(ctx, filepath.c_str(), slot.id, tokens.data(), tokens.size(), n_restored);
+        drop_page_cache(filepath);
+        if (n_read == 0)
+        {
+            // the slot lost its cells, including those of the system prompt
+            slot.cache_tokens.clear();
+            slot.n_past = 0;
+            if (!system_tokens.empty())
+            {
+                system_need_update = true;
+            }
+            return 0;
+        }
+        tokens.resize(*n_restored);
+        slot.cache_tokens = std::move(tokens);
+        slot.n_past = *n_restored;
+        slot.t_last_used = ggml_time_us();
+        return n_read;
+    }
+
+    // whether slot should wait for a prefix of its prompt to be read back
+    // from --prefix-cache-dir, while the other slots keep decoding
+    bool fetch_prefix(llama_client_slot &slot)
+    {
+        if (!slot.params.cache_prompt || slot.infill || !slot.images.empty() || slot.ga_n != 1 ||
+            !slot.lora.empty() || !slot.control_vectors.empty())
+        {
+            return false;
+        }
+        // tokenized once, then picked up below as if the client had
+        if (slot.prompt_tokens.empty())
+        {
+            slot.prompt_tokens = tokenize(slot.prompt, system_prompt.empty());
+        }
+        return prefix_cache.fetch(slot.id, slot.prompt_tokens, common_part(slot.cache_tokens, slot.prompt_tokens));
+    }
+
+    // serializes the tokens and kv cells of slot for another server, as
+    // 'ggsx', the token count, the tokens, then llama_state_seq_get_data()
+    bool export_slot(llama_client_slot &slot, std::string &blob, size_t *n_exported)
+    {
+        *n_exported = std::min(slot.cache_tokens.size(), (size_t) std::max(slot.n_past, 0));
+        const uint32_t header[3] = {SLOT_EXPORT_MAGIC, SLOT_EXPORT_VERSION, (uint32_t) *n_exported};
+        const size_t n_header = sizeof(header) + *n_exported * sizeof(llama_token);
+        const size_t n_state = llama_state_seq_get_size(ctx, slot.id);
+        // sized once, so the cells are copied out of the backend buffers
+        // straight into the response, which the http thread then streams
+        blob.resize(n_header + n_state);
+        memcpy(&blob[0], header, sizeof(header));
+        memcpy(&blob[sizeof(header)], slot.cache_tokens.data(), *n_exported * sizeof(llama_token));
+        const size_t n_written = llama_state_seq_get_data(ctx, (uint8_t *) &blob[n_header], slot.id);
+        if (n_written == 0)
+        {
+            blob.clear();
+            return false;
+        }
+        blob.resize(n_header + n_written);
+        return true;
+    }
+
+    // replaces the cells of slot with those exported by another server
+    size_t import_slot(llama_client_slot &slot, const std::string &blob, size_t *n_imported)
+    {
+        uint32_t header[3];
+        *n_imported = 0;
+        if (blob.size() < sizeof(header))
+        {
+            return 0;
+        }
+        memcpy(header, blob.data(), sizeof(header));
+        const size_t n_tokens = header[2];
+        const size_t n_header = sizeof(header) + n_tokens * sizeof(llama_token);
+        if (header[0] != SLOT_EXPORT_MAGIC || header[1] != SLOT_EXPORT_VERSION ||
+            n_tokens > (size_t) (dynamic_slots ? n_ctx : slot.n_ctx) || blob.size() <= n_header)
+        {
+            return 0;
+        }
+        const size_t n_read = llama_state_seq_set_data_checked(ctx, (const uint8_t *) blob.data() + n_header,
+                                                               blob.size() - n_header, slot.id);
+        if (n_read == 0)
+        {
+            // the slot lost its cells, including those of the system prompt
+            slot.cache_tokens.clear();
+            slot.n_past = 0;
+            if (!system_tokens.empty())
+            {
+                system_need_update = true;
+            }
+            return 0;
+        }
+        slot.cache_tokens.resize(n_tokens);
+        memcpy(slot.cache_tokens.data(), blob.data() + sizeof(header), n_tokens * sizeof(llama_token));
+        slot.n_past = n_tokens;
+        slot.t_last_used = ggml_time_us();
+        *n_imported = n_tokens;
+        return n_header + n_read;
+    }
+
+    // whether the generation of slot can be swapped out and resumed later
+    // from its cells and sampling context alone
+    bool can_park(const llama_client_slot &slot) const
+    {
+        return slot.state == PROCESSING && slot.command == NONE && slot.has_next_token &&
+               slot.n_decoded > 0 && !slot.ingesting_prompt && !slot.cancelled &&
+               !slot.embedding && slot.n_choices == 1 && slot.fork_of == -1 &&
+               slot.multitask_id == -1 && slot.ga_n == 1 && slot.images.empty() &&
+               slot.drawn.empty() && !ctx_dft && !dynamic_slots;
+    }
+
+    // moves the generation of slot to the preemption pool and leaves the
+    // slot idle, or returns false if the pool has no room for it
+    bool park_slot(llama_client_slot &slot)
+    {
+        const size_t n_state = llama_state_seq_get_size(ctx, slot.id);
+        if (preempt_pool_used + n_state > preempt_pool)
+        {
+            return false;
+        }
+        parked_slot parked;
+        size_t n_exported;
+        if (!export_slot(slot, parked.blob, &n_exported) ||
+            preempt_pool_used + parked.blob.size() > preempt_pool)
+        {
+            return false;
+        }
+        preempt_pool_used += parked.blob.size();
+        parked.slot = slot;
+        parked_slots.push_back(std::move(parked));
+
+        LOG_INFO("slot preempted", {
+            {"slot_id",   slot.id},
+            {"task_id",   slot.task_id},
+            {"priority",  slot.priority},
+            {"n_past",    slot.n_past},
+            {"n_written", parked_slots.back().blob.size()},
+        });
+
+        // the sampling context went with it
+        slot.ctx_sampling = nullptr;
+        llama_kv_cache_seq_rm(ctx, slot.id, system_tokens.size(), -1);
+        slot.cache_tokens.clear();
+        slot.reset();
+        slot.state = IDLE;
+        slot.command = NONE;
+        slot.task_id = -1;
+        return true;
+    }
+
+    // parks the generation of the lowest priority below priority, taking
+    // the one with the fewest cells among equals, so it's cheapest to move
+    bool preempt_slot(int priority)
+    {
+        llama_client_slot *victim = nullptr;
+        for (llama_client_slot &slot : slots)
+        {
+            if (slot.priority < priority && can_park(slot) &&
+                (!victim || slot.priority < victim->priority ||
+                 (slot.priority == victim->priority && slot.n_past < victim->n_past)))
+            {
+                victim = &slot;
+            }
+        }
+        return victim && park_slot(*victim);
+    }
+
+    // puts parked generations back into idle slots, highest priority first,
+    // unless a request waiting for a slot has a higher priority still
+    void resume_parked_slots()
+    {
+        while (!parked_slots.empty())
+        {
+            auto it = std::max_element(parked_slots.begin(), parked_slots.end(),
+                                       [](const parked_slot &a, const parked_slot &b) {
+                                           return a.slot.priority < b.slot.priority;
+                                       });
+            for (const task_server &task : queue_tasks.queue_tasks_deferred)
+            {
+                if (task.priority > it->slot.priority && model_of(task) == model_name)
+                {
+                    return;
+                }
+            }
+            llama_client_slot *target = get_slot(-1);
+            if (target == nullptr)
+            {
+                return;
+            }
+
+            parked_slot parked = std::move(*it);
+            parked_slots.erase(it);
+            preempt_pool_used -= parked.blob.size();
+            llama_client_slot &slot = parked.slot;
+
+            // the adapters and vectors of a sequence go by its id
+            size_t n_imported;
+            bool ok = import_slot(*target, parked.blob, &n_imported);
+            if (ok && slot.lora != target->lora)
+            {
+                llama_lora_adapter_clear(ctx, target->id);
+                for (const auto &a : slot.lora)
+                {
+                    llama_lora_adapter_set(ctx, lora_adapters[a.first], target->id, a.second);
+                }
+                target->lora = slot.lora;
+            }
+            if (ok && slot.control_vectors != target->control_vectors)
+            {
+                ok = set_control_vectors(target->id, slot.control_vectors);
+            }
+            if (!ok)
+            {
+                LOG_ERROR("unable to resume preempted slot", {{"slot_id", target->id}, {"task_id", slot.task_id}});
+                task_server task;
+                task.id = slot.task_id;
+                task.multitask_id = slot.multitask_id;
+                send_error(task, "unable to resume preempted generation");
+                llama_sampling_free(slot.ctx_sampling);
+                llama_kv_cache_seq_rm(ctx, target->id, system_tokens.size(), -1);
+                target->cache_tokens.clear();
+                target->n_past = 0;
+                continue;
+            }
+            slot.sparams.logit_bias_in_graph = set_logit_bias(target->id, slot.sparams.logit_bias);
+            slot.ctx_sampling->params.logit_bias_in_graph = slot.sparams.logit_bias_in_graph;
+
+            LOG_INFO("slot resumed", {
+                {"slot_id",  target->id},
+                {"task_id",  slot.task_id},
+                {"priority", slot.priority},
+                {"n_past",   slot.n_past},
+            });
+
+            if (target->ctx_sampling != nullptr)
+            {
+                llama_sampling_free(target->ctx_sampling);
+            }
+            slot.id = target->id;
+            *target = std::move(slot);
+            all_slots_are_idle = false;
+        }
+    }
+
+    // saves what a restarted server needs to get back to full speed, i.e.
+    // the kv cache of each slot, and the batch size `-ub auto` picked
+    void save_snapshot(const std::string &path)
+    {
+        json saved = json::array();
+        for (llama_client_slot &slot : slots)
+        {
+            size_t n_saved;
+            if (slot.n_past > 0 && save_slot(slot, path + ".slot" + std::to_string(slot.id), &n_saved))
+            {
+                saved.push_back(slot.id);
+            }
+        }
+        const json info = {
+            {"model",         params.model},
+            {"n_ctx",         n_ctx},
+            {"n_batch",       params.n_batch},
+            {"n_ubatch",      llama_n_ubatch(ctx)},
+            {"n_parallel",    params.n_parallel},
+            {"system_prompt", system_prompt},
+            {"slots",         saved},
+        };
+        const std::string temp = path + ".tmp";
+        {
+            std::ofstream out(temp);
+            out << info.dump();
+            if (!out.flush())
+            {
+                LOG_ERROR("failed to write snapshot", {{"path", temp}});
+                return;
+            }
+        }
+        if (rename(temp.c_str(), path.c_str()))
+        {
+            LOG_ERROR("failed to write snapshot", {{"path", path}, {"error", strerror(errno)}});
+            return;
+        }
+        LOG_INFO("saved snapshot", {{"path", path}, {"n_slots", saved.size()}});
+    }
+
+    // restores slots saved by save_snapshot() if the server is the same
+    void restore_snapshot(const std::string &path, const json &info)
+    {
+        if (json_value(info, "n_ctx", 0) != n_ctx ||
+            json_value(info, "n_parallel", 0) != params.n_parallel ||
+            json_value(info, "system_prompt", std::string()) != system_prompt)
+        {
+            LOG_WARNING("snapshot was made by a differently configured server", {{"path", path}});
+            return;
+        }
+        if (system_need_update)
+        {
+            // do it now, since it clears the kv cache
+            update_system_prompt();
+        }
+        size_t n_slots = 0;
+        for (const int id : json_value(info, "slots", json::array()))
+        {
+            size_t n_restored;
+            if (0 <= id && id < (int) slots.size() &&
+                restore_slot(slots[id], path + ".slot" + std::to_string(id), &n_restored))
+            {
+                ++n_slots;
+            }
+        }
+        LOG_INFO("restored snapshot", {{"path", path}, {"n_slots", n_slots}});
+    }
+
+    void process_slot_action(task_server &task, llama_client_slot &slot)
+    {
+        const int64_t t_start = ggml_time_us();
+        const llama_pos p0 = system_tokens.size();
+        json data;
+        std::string blob;
+        if (task.type == TASK_TYPE_SLOT_SAVE)
+        {
+            size_t n_saved;
+            const size_t n_written = save_slot(slot, task.data["filepath"], &n_saved);
+            if (n_written == 0)
+            {
+                send_error(task, "unable to save slot");
+                return;
+            }
+            data = {
+                { "id_slot",   slot.id },
+                { "filename",  task.data["filename"] },
+                { "n_saved",   n_saved },
+                { "n_written", n_written },
+                { "timings",   { { "save_ms", (ggml_time_us() - t_start) / 1e3 } } },
+            };
+        }
+        else if (task.type == TASK_TYPE_SLOT_RESTORE)
+        {
+            size_t n_restored;
+            const size_t n_read = restore_slot(slot, task.data["filepath"], &n_restored);
+            if (n_read == 0)
+            {
+                send_error(task, "unable to restore slot, no available space in KV cache or invalid slot save file");
+                return;
+            }
+            data = {
+                { "id_slot",    slot.id },
+                { "filename",   task.data["filename"] },
+                { "n_restored", n_restored },
+                { "n_read",     n_read },
+                { "timings",    { { "restore_ms", (ggml_time_us() - t_start) / 1e3 } } },
+            };
+        }
+        else if (task.type == TASK_TYPE_SLOT_EXPORT)
+        {
+            size_t n_exported;
+            if (!export_slot(slot, blob, &n_exported))
+            {
+                send_error(task, "unable to export slot");
+                return;
+            }
+            data = {
+                { "id_slot",    slot.id },
+                { "n_exported", n_exported },
+                { "n_written",  blob.size() },
+                { "timings",    { { "export_ms", (ggml_time_us() - t_start) / 1e3 } } },
+            };
+        }
+        else if (task.type == TASK_TYPE_SLOT_IMPORT)
+        {
+            size_t n_imported;
+            const size_t n_read = import_slot(slot, task.blob, &n_imported);
+            if (n_read == 0)
+            {
+                send_error(task, "unable to import slot, no available space in KV cache or state exported by a different model");
+                return;
+            }
+            data = {
+                { "id_slot",    slot.id },
+                { "n_imported", n_imported },
+                { "n_read",     n_read },
+                { "timings",    { { "import_ms", (ggml_time_us() - t_start) / 1e3 } } },
+            };
+        }
+        else
+        {
+            const size_t n_erased = slot.cache_tokens.size();
+            llama_kv_cache_seq_rm(ctx, slot.id, p0, -1);
+            slot.cache_tokens.clear();
+            slot.n_past = 0;
+            data = {
+                { "id_slot",  slot.id },
+                { "n_erased", n_erased },
+            };
+        }
+
+        LOG_INFO("slot action", {
+            { "task_id", task.id },
+            { "slot_id", slot.id },
+            { "action",  task.data["action"] },
+        });
+
+        task_result res;
+        res.id = task.id;
+        res.multitask_id = task.multitask_id;
+        res.stop = true;
+        res.error = false;
+        res.result_json = data;
+        res.blob = std::move(blob);
+        queue_results.send(res);
+    }
+
+    void request_cancel(int task_id)
+    {
+        task_server task;
+        task.type = TASK_TYPE_CANCEL;
         task.target_id = task_id;
         queue_tasks.post(task);
     }
@@ -1501,12 +3938,71 @@ struct llama_server_context
 
     void process_single_task(task_server& task)
     {
+        if (!models.empty() && task.type != TASK_TYPE_CANCEL &&
+            task.type != TASK_TYPE_NEXT_RESPONSE && !bind_model(task))
+        {
+            return;
+        }
         switch (task.type)
         {
             case TASK_TYPE_COMPLETION: {
-                llama_client_slot *slot = get_slot(json_value(task.data, "slot_id", -1));
-                if (slot == nullptr)
+                const int slot_id = json_value(task.data, "slot_id", -1);
+                const std::string session_id = json_value(task.data, "session_id", std::string());
+                const int n_choices = json_value(task.data, "n", 1);
+
+                if (n_choices < 1 || n_choices > (int) slots.size())
+                {
+                    send_error(task, "n must be between 1 and the number of slots");
+                    break;
+                }
+                if (n_choices > 1 && (task.embedding_mode || task.multitask_id != -1 ||
+                                      task.data.contains("image_data") || params.grp_attn_n != 1))
+                {
+                    send_error(task, "n > 1 is not supported with embeddings, multiple prompts, images or self-extend");
+                    break;
+                }
+
+                // when the prompt is going to be cached, route it to the slot
+                // that already holds most of it, so we tokenize it right away
+                std::vector<llama_token> prompt_tokens;
+                if ((slot_id == -1 || dynamic_slots) && !task.infill_mode && !task.embedding_mode &&
+                    (json_value(task.data, "cache_prompt", false) || dynamic_slots) &&
+                    !task.data.contains("system_prompt") &&
+                    !task.data.contains("image_data") &&
+                    task.data.contains("prompt") &&
+                    (task.data["prompt"].is_string() || task.data["prompt"].is_array()))
+                {
+                    prompt_tokens = tokenize(task.data["prompt"], system_prompt.empty());
+                }
+
+                // every choice needs a slot, and they're all taken at once
+                std::vector<llama_client_slot *> branches;
+                for (int i = 0; i < n_choices; ++i)
                 {
+                    llama_client_slot *slot = i ? get_slot(-1) : get_slot(slot_id, session_id, prompt_tokens);
+                    if (slot != nullptr && dynamic_slots && !admit_slot(*slot, task, prompt_tokens))
+                    {
+                        slot = nullptr;
+                    }
+                    if (slot == nullptr)
+                    {
+                        break;
+                    }
+                    slot->command = LOAD_PROMPT; // so it isn't picked twice
+                    branches.push_back(slot);
+                }
+                if ((int) branches.size() < n_choices)
+                {
+                    for (llama_client_slot *slot : branches)
+                    {
+                        slot->command = NONE;
+                    }
+                    // make room by swapping out a generation of lower priority,
+                    // and give this task the slot once the deferred are retried
+                    if (n_choices == 1 && slot_id == -1 && preempt_pool && preempt_slot(task.priority))
+                    {
+                        queue_tasks.notify_slot_changed();
+                    }
                     // if no slot is available, we defer this task for processing later
                     LOG_VERBOSE("no slot is available", {{"task_id", task.id}});
                     queue_tasks.defer_(task);
@@ -1516,6 +4012,10 @@ struct llama_server_context
                 if (task.data.contains("system_prompt"))
                 {
                     if (!all_slots_are_idle) {
+                        for (llama_client_slot *slot : branches)
+                        {
+                            slot->command = NONE;
+                        }
                         send_error(task, "system prompt can only be updated when all slots are idle");
                         break;
                     }
@@ -1530,100 +4030,195 @@ struct llama_server_context
                     }
                 }
 
-                slot->reset();
+                if (task.t_posted)
+                {
+                    metrics.queue_wait_seconds.observe((ggml_time_us() - task.t_posted) / 1e6);
+                }
 
-                slot->infill       = task.infill_mode;
-                slot->embedding    = task.embedding_mode;
-                slot->task_id      = task.id;
-                slot->multitask_id = task.multitask_id;
+                const uint32_t seed = json_value(task.data, "seed", (uint32_t) LLAMA_DEFAULT_SEED);
+                for (int i = 0; i < n_choices; ++i)
+                {
+                    llama_client_slot *slot = branches[i];
+                    slot->reset();
+
+                    slot->infill        = task.infill_mode;
+                    slot->embedding     = task.embedding_mode;
+                    slot->task_id       = task.id;
+                    slot->priority      = task.priority;
+                    slot->multitask_id  = task.multitask_id;
+                    slot->t_task_posted = task.t_posted;
+                    slot->fork_of       = i ? branches[0]->id : -1;
+                    slot->index         = i;
+                    slot->n_choices     = n_choices;
+                    if (!i)
+                    {
+                        slot->prompt_tokens = std::move(prompt_tokens);
+                        if (!session_id.empty())
+                        {
+                            slot->session_id = session_id;
+                        }
+                    }
 
-                if (!launch_slot_with_data(slot, task.data))
+                    // a fixed seed still gives every choice its own samples
+                    json data = i + 1 < n_choices ? task.data : std::move(task.data);
+                    if (i && seed != LLAMA_DEFAULT_SEED)
+                    {
+                        data["seed"] = seed + i;
+                    }
+
+                    if (!launch_slot_with_data(slot, data))
+                    {
+                        for (int j = 0; j < n_choices; ++j)
+                        {
+                            branches[j]->command = NONE;
+                        }
+                        // send error result
+                        send_error(task, "internal_error");
+                        break;
+                    }
+                }
+            } break;
+            case TASK_TYPE_CANCEL: { // release the slots linked with the task id
+                if (queue_tasks.remove_deferred(task.target_id))
                 {
-                    // send error result
-                    send_error(task, "internal_error");
                     break;
                 }
-            } break;
-            case TASK_TYPE_CANCEL: { // release slot linked with the task id
+                for (size_t i = 0; i < parked_slots.size(); ++i)
+                {
+                    if (parked_slots[i].slot.task_id == task.target_id)
+                    {
+                        preempt_pool_used -= parked_slots[i].blob.size();
+                        llama_sampling_free(parked_slots[i].slot.ctx_sampling);
+                        parked_slots.erase(parked_slots.begin() + i);
+                        break;
+                    }
+                }
                 for (auto & slot : slots)
                 {
                     if (slot.task_id == task.target_id)
                     {
-                        slot.release();
-                        break;
+                        if (slot.encoding_images || (slot.state == IDLE && slot.command == LOAD_PROMPT))
+                        {
+                            // it hasn't started, so there's nothing to keep
+                            slot.reset();
+                            slot.command = NONE;
+                            queue_tasks.notify_slot_changed();
+                        }
+                        else if (slot.state == PROCESSING && slot.command != RELEASE)
+                        {
+                            slot.cancelled = true;
+                            slot.release();
+                        }
                     }
                 }
             } break;
             case TASK_TYPE_NEXT_RESPONSE: {
                 // do nothing
             } break;
-            case TASK_TYPE_METRICS: {
-                json slots_data        = json::array();
-                int n_idle_slots       = 0;
-                int n_processing_slots = 0;
-
-                for (llama_client_slot &slot: slots) {
-                    json slot_data = get_formated_generation(slot);
-                    slot_data["id"] = slot.id;
-                    slot_data["task_id"] = slot.task_id;
-                    slot_data["state"] = slot.state;
-                    slot_data["prompt"] = slot.prompt;
-                    slot_data["next_token"] = {
-                            {"has_next_token", slot.has_next_token},
-                            {"n_remain", slot.n_remaining},
-                            {"num_tokens_predicted", slot.n_decoded},
-                            {"stopped_eos", slot.stopped_eos},
-                            {"stopped_word", slot.stopped_word},
-                            {"stopped_limit", slot.stopped_limit},
-                            {"stopping_word", slot.stopping_word},
-                    };
-                    if (slot_data["state"] == IDLE) {
-                        n_idle_slots++;
-                    } else {
-                        n_processing_slots++;
-                    }
-                    slots_data.push_back(slot_data);
+            case TASK_TYPE_EMBEDDING_BATCH: {
+                embed_batch(task);
+            } break;
+            case TASK_TYPE_SCORE: {
+                score_batch(task);
+            } break;
+            case TASK_TYPE_SLOT_SAVE:
+            case TASK_TYPE_SLOT_RESTORE:
+            case TASK_TYPE_SLOT_ERASE:
+            case TASK_TYPE_SLOT_EXPORT:
+            case TASK_TYPE_SLOT_IMPORT: {
+                if (task.target_id < 0 || task.target_id >= (int) slots.size())
+                {
+                    send_error(task, "invalid slot id");
+                    break;
                 }
-                LOG_INFO("slot data", {
-                    {"task_id",            task.id},
-                    {"n_idle_slots",       n_idle_slots},
-                    {"n_processing_slots", n_processing_slots}
-                });
-                LOG_VERBOSE("slot data", {
-                    {"task_id",            task.id},
-                    {"n_idle_slots",       n_idle_slots},
-                    {"n_processing_slots", n_processing_slots},
-                    {"slots",              slots_data}
-                });
-                task_result res;
-                res.id = task.id;
-                res.multitask_id = task.multitask_id;
-                res.stop = true;
-                res.error = false;
-                res.result_json = {
-                        { "idle",                            n_idle_slots       },
-                        { "processing",                      n_processing_slots },
-                        { "deferred",                        queue_tasks.queue_tasks_deferred.size() },
-
-                        { "n_prompt_tokens_processed_total", metrics.n_prompt_tokens_processed_total},
-                        { "n_tokens_predicted_total",        metrics.n_tokens_predicted_total},
-
-                        { "n_prompt_tokens_processed",       metrics.n_prompt_tokens_processed},
-                        { "t_prompt_processing",             metrics.t_prompt_processing},
-                        { "n_tokens_predicted",              metrics.n_tokens_predicted},
-                        { "t_tokens_generation",             metrics.t_tokens_generation},
-
-                        { "kv_cache_tokens_count",          llama_get_kv_cache_token_count(ctx)},
-                        { "kv_cache_used_cells",            llama_get_kv_cache_used_cells(ctx)},
-
-                        { "slots",                          slots_data },
-                };
-                metrics.reset_bucket();
-                queue_results.send(res);
+                llama_client_slot &slot = slots[task.target_id];
+                if (!slot.available())
+                {
+                    // wait for the slot to finish its current task
+                    LOG_VERBOSE("slot is busy", {{"task_id", task.id}, {"slot_id", slot.id}});
+                    queue_tasks.defer_(task);
+                    break;
+                }
+                process_slot_action(task, slot);
             } break;
         }
     }
 
+    // gathers the state of the slots and the metrics for /health, /slots
+    // and /metrics, which read the last of these without waiting for us
+    void publish_status(int64_t t_now)
+    {
+        json slots_data        = json::array();
+        int n_idle_slots       = 0;
+        int n_processing_slots = 0;
+
+        for (llama_client_slot &slot: slots) {
+            json slot_data = get_formated_generation(slot);
+            slot_data["id"] = slot.id;
+            slot_data["task_id"] = slot.task_id;
+            slot_data["state"] = slot.state;
+            slot_data["prompt"] = slot.prompt;
+            slot_data["next_token"] = {
+                    {"has_next_token", slot.has_next_token},
+                    {"n_remain", slot.n_remaining},
+                    {"num_tokens_predicted", slot.n_decoded},
+                    {"stopped_eos", slot.stopped_eos},
+                    {"stopped_word", slot.stopped_word},
+                    {"stopped_limit", slot.stopped_limit},
+                    {"stopping_word", slot.stopping_word},
+            };
+            if (slot_data["state"] == IDLE) {
+                n_idle_slots++;
+            } else {
+                n_processing_slots++;
+            }
+            slots_data.push_back(slot_data);
+        }
+
+        // the throughput gauges cover the time since the last scrape
+        if (metrics_scraped.exchange(false)) {
+            metrics.reset_bucket();
+        }
+
+        auto status = std::make_shared<const json>(json {
+                { "idle",                            n_idle_slots       },
+                { "processing",                      n_processing_slots },
+                { "deferred",                        queue_tasks.queue_tasks_deferred.size() },
+                { "parked",                          parked_slots.size() },
+                { "n_requests_rejected",             n_requests_rejected.load() },
+                { "n_requests_expired",              n_requests_expired },
+
+                { "n_prompt_tokens_processed_total", metrics.n_prompt_tokens_processed_total},
+                { "n_tokens_predicted_total",        metrics.n_tokens_predicted_total},
+
+                { "n_prompt_tokens_processed",       metrics.n_prompt_tokens_processed},
+                { "t_prompt_processing",             metrics.t_prompt_processing},
+                { "n_tokens_predicted",              metrics.n_tokens_predicted},
+                { "t_tokens_generation",             metrics.t_tokens_generation},
+
+                { "j_prompt_total",                  metrics.j_prompt_total},
+                { "j_predicted_total",               metrics.j_predicted_total},
+                { "j_prompt",                        metrics.j_prompt},
+                { "j_predicted",                     metrics.j_predicted},
+                { "energy_sources",                  llamafile_energy_sources()},
+
+                { "kv_cache_tokens_count",          llama_get_kv_cache_token_count(ctx)},
+                { "kv_cache_used_cells",            llama_get_kv_cache_used_cells(ctx)},
+                { "prefix_cache_entries",           prefix_cache.size()},
+                { "prefix_cache_files",             prefix_cache.store.size()},
+                { "histograms",                     metrics.histograms_to_json()},
+
+                { "slots",                          slots_data },
+        });
+        std::atomic_store(&published, std::shared_ptr<const json>(std::move(status)));
+        t_published = t_now;
+    }
+
+    std::shared_ptr<const json> get_status() const
+    {
+        return std::atomic_load(&published);
+    }
+
     void on_finish_multitask(task_multi& multitask)
     {
         // all subtasks done == multitask is done
@@ -1652,6 +4247,18 @@ struct llama_server_context
 
         llama_batch_clear(batch);
 
+        collect_images();
+
+        if (queue_tasks.n_deferred)
+        {
+            for (task_server &task : queue_tasks.take_expired(ggml_time_us()))
+            {
+                LOG_INFO("request expired waiting for a slot", {{"task_id", task.id}});
+                send_error(task, "request timed out waiting for a free slot");
+                n_requests_expired++;
+            }
+        }
+
         if (all_slots_are_idle)
         {
             if (system_prompt.empty() && clean_kv_cache)
@@ -1674,10 +4281,27 @@ struct llama_server_context
             {
                 if (slot.is_processing() && system_tokens.size() + slot.cache_tokens.size() >= (size_t) slot.n_ctx)
                 {
-                    // Shift context
-                    const int n_keep    = slot.params.n_keep + add_bos_token;
+                    // Shift context. a rolling window drops one block at a
+                    // time, which re-rotates the cache more often, but in
+                    // smaller steps, and forgets only the oldest history
+                    const int n_keep    = std::max(slot.params.n_keep + add_bos_token, std::min(n_attn_sinks, slot.n_ctx / 2));
                     const int n_left    = (int) system_tokens.size() + slot.n_past - n_keep;
-                    const int n_discard = n_left / 2;
+                    const int n_discard = n_shift_block > 0 ? std::min(n_shift_block, n_left) : n_left / 2;
+
+                    // the other choices of the request would lose their prompt
+                    if (n_keep + n_discard < (int) system_tokens.size() + slot.n_shared)
+                    {
+                        slot.stopped_limit = true;
+                        slot.has_next_token = false;
+                        slot.release();
+                        slot.print_timings();
+                        send_final_response(slot);
+                        metrics.on_prediction(slot);
+                        continue;
+                    }
+
+                    // cells shared with the prefix cache would move too
+                    prefix_cache.clear();
 
                     LOG_INFO("slot context shift", {
                         {"slot_id",         slot.id},
@@ -1690,8 +4314,11 @@ struct llama_server_context
                         {"n_system_tokens", system_tokens.size()},
                         {"n_cache_tokens",  slot.cache_tokens.size()}
                     });
-                    llama_kv_cache_seq_rm (ctx, slot.id, n_keep            , n_keep + n_discard);
-                    llama_kv_cache_seq_add(ctx, slot.id, n_keep + n_discard, system_tokens.size() + slot.n_past, -n_discard);
+                    const bool shifted = llama_kv_cache_seq_rm(ctx, slot.id, n_keep, n_keep + n_discard);
+                    if (shifted)
+                    {
+                        llama_kv_cache_seq_add(ctx, slot.id, n_keep + n_discard, system_tokens.size() + slot.n_past, -n_discard);
+                    }
 
                     for (size_t i = n_keep + n_discard; i < slot.cache_tokens.size(); i++)
                     {
@@ -1702,11 +4329,35 @@ struct llama_server_context
 
                     slot.n_past -= n_discard;
 
+                    // a recurrent state can't forget the tokens in the middle
+                    if (!shifted)
+                    {
+                        rewind_slot(slot, n_keep - (int) system_tokens.size());
+                    }
+
                     slot.truncated = true;
                 }
             }
         }
 
+        std::vector<int32_t> n_max_draft;
+        if (ctx_dft || n_layer_draft > 0)
+        {
+            n_max_draft = draft_tokens();
+        }
+        else if (n_lookup_ngram > 0)
+        {
+            n_max_draft = lookup_tokens();
+        }
+        else if (jump_forward)
+        {
+            n_max_draft = draft_limits();
+        }
+        if (jump_forward)
+        {
+            jump_tokens(n_max_draft);
+        }
+
         // decode any currently ongoing sequences
         LOG_VERBOSE("decoding ongoing sequences", {});
         for (auto & slot : slots)
@@ -1714,6 +4365,32 @@ struct llama_server_context
             // release the slot
             if (slot.command == RELEASE)
             {
+                if (slot.ingesting_prompt)
+                {
+                    // only part of the prompt made it into the kv cache
+                    slot.cache_tokens.resize(slot.n_past);
+                    slot.ingesting_prompt = false;
+                }
+
+                if (slot.params.cache_prompt && slot.images.empty() && slot.lora.empty() && slot.control_vectors.empty())
+                {
+                    // let other slots reuse what we've evaluated
+                    const int32_t n_cached = std::min((int32_t) slot.cache_tokens.size(), slot.n_past);
+                    prefix_cache.insert(slot.cache_tokens, n_cached, slot.id, system_tokens.size());
+                }
+                else if (slot.cancelled && !slot.params.cache_prompt)
+                {
+                    // nobody is going to continue this, so free its cells now
+                    llama_kv_cache_seq_rm(ctx, slot.id, system_tokens.size(), -1);
+                    slot.cache_tokens.clear();
+                    slot.n_past = 0;
+                    if (ctx_dft)
+                    {
+                        llama_kv_cache_seq_rm(ctx_dft, slot.id, system_tokens.size(), -1);
+                        slot.cache_tokens_dft.clear();
+                    }
+                }
+
                 slot.state = IDLE;
                 slot.command = NONE;
                 slot.t_last_used = ggml_time_us();
@@ -1732,7 +4409,7 @@ struct llama_server_context
                 continue;
             }
 
-            if (slot.state == IDLE)
+            if (slot.state == IDLE || slot.ingesting_prompt)
             {
                 continue;
             }
@@ -1744,186 +4421,258 @@ struct llama_server_context
             // TODO: we always have to take into account the "system_tokens"
             //       this is not great and needs to be improved somehow
             llama_batch_add(batch, slot.sampled, system_tokens.size() + slot_npast, { slot.id }, true);
+
+            // the target model verifies all the guesses at once, and a
+            // recurrent one can come back here if some are wrong
+            if (!slot.drafted.empty())
+            {
+                llama_kv_cache_seq_checkpoint(ctx, slot.id);
+            }
+            for (size_t k = 0; k < slot.drafted.size(); ++k)
+            {
+                llama_batch_add(batch, slot.drafted[k], system_tokens.size() + slot.n_past + 1 + k, { slot.id }, true);
+            }
             slot.n_past += 1;
         }
 
         // process in chunks of params.n_batch
         int32_t n_batch = params.n_batch;
 
+        // cap the prompt tokens evaluated per step
+        int32_t n_prefill = n_prefill_chunk > 0 ? n_prefill_chunk : params.n_batch;
+
         // assign workload to the slots
-        if (params.cont_batching || batch.n_tokens == 0)
+        const bool can_load_prompt = params.cont_batching || batch.n_tokens == 0;
+        for (auto & slot : slots)
         {
-            for (auto & slot : slots)
+            const bool has_prompt = slot.prompt.is_array() || (slot.prompt.is_string() && !slot.prompt.get<std::string>().empty()) || !slot.images.empty();
+
+            // empty prompt passed -> release the slot and send empty response
+            // note: infill mode allows empty prompt
+            if (can_load_prompt && slot.state == IDLE && slot.command == LOAD_PROMPT && !has_prompt && !slot.infill)
+            {
+                slot.release();
+                slot.print_timings();
+                send_final_response(slot);
+                continue;
+            }
+
+            // the other choices of a request are fed by the first one
+            if (slot.fork_of >= 0)
             {
-                const bool has_prompt = slot.prompt.is_array() || (slot.prompt.is_string() && !slot.prompt.get<std::string>().empty()) || !slot.images.empty();
+                continue;
+            }
 
-                // empty prompt passed -> release the slot and send empty response
-                // note: infill mode allows empty prompt
-                if (slot.state == IDLE && slot.command == LOAD_PROMPT && !has_prompt && !slot.infill)
+            // need process the prompt
+            if (can_load_prompt && slot.state == IDLE && slot.command == LOAD_PROMPT)
+            {
+                if (image_encoder.running() && submit_images(slot))
                 {
-                    slot.release();
-                    slot.print_timings();
-                    send_final_response(slot);
                     continue;
                 }
-
-                // need process the prompt
-                if (slot.state == IDLE && slot.command == LOAD_PROMPT)
+                if (prefix_cache.store.enabled() && fetch_prefix(slot))
                 {
-                    slot.state = PROCESSING;
-                    slot.command = NONE;
-                    std::vector<llama_token> prompt_tokens;
-                    slot.t_start_process_prompt = ggml_time_us();
-                    slot.t_start_genereration = 0;
-
-                    if (slot.infill)
-                    {
-                        bool suff_rm_leading_spc = true;
-                        if (params.input_suffix.find_first_of(' ') == 0 && params.input_suffix.size() > 1)
-                        {
-                            params.input_suffix.erase(0, 1);
-                            suff_rm_leading_spc = false;
-                        }
-                        auto prefix_tokens = tokenize(slot.params.input_prefix, false);
-                        auto suffix_tokens = tokenize(slot.params.input_suffix, false);
+                    continue;
+                }
+                slot.state = PROCESSING;
+                slot.command = NONE;
+                std::vector<llama_token> prompt_tokens;
+                slot.t_start_process_prompt = ggml_time_us();
+                slot.t_start_genereration = 0;
 
-                        const int space_token = 29871; // TODO: this should not be hardcoded
-                        if (suff_rm_leading_spc && !suffix_tokens.empty() && suffix_tokens[0] == space_token) {
-                            suffix_tokens.erase(suffix_tokens.begin());
-                        }
+                const bool has_images = process_images(slot);
 
-                        prefix_tokens.insert(prefix_tokens.begin(), llama_token_prefix(model));
-                        prefix_tokens.insert(prefix_tokens.begin(), llama_token_bos(model)); // always add BOS
-                        prefix_tokens.insert(prefix_tokens.end(),   llama_token_suffix(model));
-                        prefix_tokens.insert(prefix_tokens.end(),   suffix_tokens.begin(), suffix_tokens.end());
-                        prefix_tokens.push_back(llama_token_middle(model));
-                        prompt_tokens = prefix_tokens;
-                    }
-                    else
+                if (slot.infill)
+                {
+                    bool suff_rm_leading_spc = true;
+                    if (params.input_suffix.find_first_of(' ') == 0 && params.input_suffix.size() > 1)
                     {
-                        prompt_tokens = tokenize(slot.prompt, system_prompt.empty());  // add BOS if there isn't system prompt
+                        params.input_suffix.erase(0, 1);
+                        suff_rm_leading_spc = false;
                     }
+                    auto prefix_tokens = tokenize(slot.params.input_prefix, false);
+                    auto suffix_tokens = tokenize(slot.params.input_suffix, false);
 
-                    slot.num_prompt_tokens = prompt_tokens.size();
-
-                    if (slot.params.n_keep < 0)
-                    {
-                        slot.params.n_keep = slot.num_prompt_tokens;
+                    const int space_token = 29871; // TODO: this should not be hardcoded
+                    if (suff_rm_leading_spc && !suffix_tokens.empty() && suffix_tokens[0] == space_token) {
+                        suffix_tokens.erase(suffix_tokens.begin());
                     }
-                    slot.params.n_keep = std::min(slot.n_ctx - 4, slot.params.n_keep);
 
-                    // if input prompt is too big, truncate it
-                    if (slot.num_prompt_tokens >= slot.n_ctx)
-                    {
-                        const int n_left = slot.n_ctx - slot.params.n_keep;
-                        const int n_block_size = n_left / 2;
-                        const int erased_blocks = (slot.num_prompt_tokens - slot.params.n_keep - n_block_size) / n_block_size;
-
-                        std::vector<llama_token> new_tokens(prompt_tokens.begin(), prompt_tokens.begin() + slot.params.n_keep);
-                        new_tokens.insert(new_tokens.end(), prompt_tokens.begin() + slot.params.n_keep + erased_blocks * n_block_size, prompt_tokens.end());
-
-                        LOG_VERBOSE("input truncated", {
-                            {"n_ctx",  slot.n_ctx},
-                            {"n_keep", slot.params.n_keep},
-                            {"n_left", n_left},
-                            {"new_tokens", tokens_to_str(ctx, new_tokens.cbegin(), new_tokens.cend())},
-                        });
-                        slot.truncated = true;
-                        prompt_tokens = new_tokens;
+                    prefix_tokens.insert(prefix_tokens.begin(), llama_token_prefix(model));
+                    prefix_tokens.insert(prefix_tokens.begin(), llama_token_bos(model)); // always add BOS
+                    prefix_tokens.insert(prefix_tokens.end(),   llama_token_suffix(model));
+                    prefix_tokens.insert(prefix_tokens.end(),   suffix_tokens.begin(), suffix_tokens.end());
+                    prefix_tokens.push_back(llama_token_middle(model));
+                    prompt_tokens = prefix_tokens;
+                }
+                else if (has_images)
+                {
+                    prompt_tokens = tokenize_images(slot);
+                }
+                else if (!slot.prompt_tokens.empty())
+                {
+                    prompt_tokens = std::move(slot.prompt_tokens);
+                    slot.prompt_tokens.clear();
+                }
+                else
+                {
+                    prompt_tokens = tokenize(slot.prompt, system_prompt.empty());  // add BOS if there isn't system prompt
+                }
 
-                        slot.num_prompt_tokens = prompt_tokens.size();
-                        GGML_ASSERT(slot.num_prompt_tokens < slot.n_ctx);
-                    }
+                slot.num_prompt_tokens = prompt_tokens.size();
 
-                    if (!slot.params.cache_prompt)
-                    {
-                        llama_sampling_reset(slot.ctx_sampling);
+                if (slot.params.n_keep < 0)
+                {
+                    slot.params.n_keep = slot.num_prompt_tokens;
+                }
+                slot.params.n_keep = std::min(slot.n_ctx - 4, slot.params.n_keep);
 
-                        slot.n_past = 0;
-                        slot.n_past_se = 0;
-                        slot.ga_i = 0;
-                        slot.num_prompt_tokens_processed = slot.num_prompt_tokens;
-                    }
-                    else
-                    {
-                        // push the prompt into the sampling context (do not apply grammar)
-                        for (auto &token : prompt_tokens)
-                        {
-                            llama_sampling_accept(slot.ctx_sampling, ctx, token, false);
-                        }
+                // if input prompt is too big, truncate it
+                // (images can't be cut in half, so they're left alone)
+                if (slot.num_prompt_tokens >= slot.n_ctx && !has_images)
+                {
+                    const int n_left = slot.n_ctx - slot.params.n_keep;
+                    const int n_block_size = n_left / 2;
+                    const int erased_blocks = (slot.num_prompt_tokens - slot.params.n_keep - n_block_size) / n_block_size;
+
+                    std::vector<llama_token> new_tokens(prompt_tokens.begin(), prompt_tokens.begin() + slot.params.n_keep);
+                    new_tokens.insert(new_tokens.end(), prompt_tokens.begin() + slot.params.n_keep + erased_blocks * n_block_size, prompt_tokens.end());
+
+                    LOG_VERBOSE("input truncated", {
+                        {"n_ctx",  slot.n_ctx},
+                        {"n_keep", slot.params.n_keep},
+                        {"n_left", n_left},
+                        {"new_tokens", tokens_to_str(ctx, new_tokens.cbegin(), new_tokens.cend())},
+                    });
+                    slot.truncated = true;
+                    prompt_tokens = new_tokens;
 
-                        slot.n_past = common_part(slot.cache_tokens, prompt_tokens);
+                    slot.num_prompt_tokens = prompt_tokens.size();
+                    GGML_ASSERT(slot.num_prompt_tokens < slot.n_ctx);
+                }
 
-                        // the last token of the cache is not in the KV cache until the next call to llama_decode
-                        // (it was sampled, pushed into the "cache_tokens", but not yet put in the context)
-                        if (slot.n_past > 0 && slot.n_past == (int32_t) slot.cache_tokens.size())
-                        {
-                            slot.n_past -= 1;
-                        }
+                if (!slot.params.cache_prompt)
+                {
+                    llama_sampling_reset(slot.ctx_sampling);
 
-                        slot.num_prompt_tokens_processed = slot.num_prompt_tokens - slot.n_past;
+                    slot.n_past = 0;
+                    slot.n_past_se = 0;
+                    slot.ga_i = 0;
+                    slot.num_prompt_tokens_processed = slot.num_prompt_tokens;
+                }
+                else
+                {
+                    // push the prompt into the sampling context (do not apply grammar)
+                    for (auto &token : prompt_tokens)
+                    {
+                        llama_sampling_accept(slot.ctx_sampling, ctx, token, false);
+                    }
 
-                        if (slot.ga_n != 1)
-                        {
-                            int ga_i = 0;
-                            int32_t ga_n = slot.ga_n;
-                            int32_t ga_w = slot.ga_w;
-                            int32_t slot_npast = 0;
-                            for (int k = 0; k < slot.n_past; ++k)
-                            {
-                                while (slot_npast >= ga_i + ga_w) {
-                                    const int bd = (ga_w/ga_n)*(ga_n - 1);
-                                    slot_npast -= bd;
-                                    ga_i += ga_w/ga_n;
-                                }
-                                slot_npast++;
-                            }
-                            slot.n_past_se = slot_npast;
-                            slot.ga_i = ga_i;
-                        }
+                    slot.n_past = common_part(slot.cache_tokens, prompt_tokens);
+
+                    // the last token of the cache is not in the KV cache until the next call to llama_decode
+                    // (it was sampled, pushed into the "cache_tokens", but not yet put in the context)
+                    if (slot.n_past > 0 && slot.n_past == (int32_t) slot.cache_tokens.size())
+                    {
+                        slot.n_past -= 1;
+                    }
 
-                        LOG_INFO("slot progression", {
-                            { "slot_id", slot.id },
-                            { "task_id", slot.task_id },
-                            { "n_past",  slot.n_past },
-                            { "num_prompt_tokens_processed", slot.num_prompt_tokens_processed }
+                    // another slot may have evaluated more of this prompt
+                    llama_seq_id seq_cached;
+                    const int32_t n_cached = slot.ga_n == 1 && slot.lora.empty() && slot.control_vectors.empty() ? prefix_cache.find(prompt_tokens, &seq_cached) : 0;
+                    if (n_cached > slot.n_past)
+                    {
+                        const llama_pos p0 = system_tokens.size();
+                        llama_kv_cache_seq_rm(ctx, slot.id, p0, -1);
+                        llama_kv_cache_seq_cp(ctx, seq_cached, slot.id, p0, p0 + n_cached);
+                        slot.cache_tokens.assign(prompt_tokens.begin(), prompt_tokens.begin() + n_cached);
+                        slot.n_past = n_cached;
+
+                        LOG_INFO("slot prompt prefix reused from cache", {
+                            { "slot_id",  slot.id },
+                            { "task_id",  slot.task_id },
+                            { "n_cached", n_cached },
                         });
                     }
 
-                    slot.cache_tokens = prompt_tokens;
+                    slot.num_prompt_tokens_processed = slot.num_prompt_tokens - slot.n_past;
+                    slot.n_prompt_cached = slot.n_past;
 
-                    if (slot.n_past == slot.num_prompt_tokens && slot.n_past > 0)
+                    if (slot.ga_n != 1)
                     {
-                        // we have to evaluate at least 1 token to generate logits.
-                        LOG_INFO("we have to evaluate at least 1 token to generate logits", {
-                            { "slot_id", slot.id },
-                            { "task_id", slot.task_id }
-                        });
-                        slot.n_past--;
-                        if (slot.ga_i > 0)
+                        int ga_i = 0;
+                        int32_t ga_n = slot.ga_n;
+                        int32_t ga_w = slot.ga_w;
+                        int32_t slot_npast = 0;
+                        for (int k = 0; k < slot.n_past; ++k)
                         {
-                            slot.n_past_se--;
+                            while (slot_npast >= ga_i + ga_w) {
+                                const int bd = (ga_w/ga_n)*(ga_n - 1);
+                                slot_npast -= bd;
+                                ga_i += ga_w/ga_n;
+                            }
+                            slot_npast++;
                         }
+                        slot.n_past_se = slot_npast;
+                        slot.ga_i = ga_i;
                     }
 
-                    int p0 = (int) system_tokens.size() + slot.n_past;
-                    LOG_INFO("kv cache rm [p0, end)", {
+                    LOG_INFO("slot progression", {
                         { "slot_id", slot.id },
                         { "task_id", slot.task_id },
-                        { "p0",      p0 }
+                        { "n_past",  slot.n_past },
+                        { "num_prompt_tokens_processed", slot.num_prompt_tokens_processed }
+                    });
+                }
+
+                slot.cache_tokens = prompt_tokens;
+
+                if (slot.n_past == slot.num_prompt_tokens && slot.n_past > 0)
+                {
+                    // we have to evaluate at least 1 token to generate logits.
+                    LOG_INFO("we have to evaluate at least 1 token to generate logits", {
+                        { "slot_id", slot.id },
+                        { "task_id", slot.task_id }
                     });
-                    llama_kv_cache_seq_rm(ctx, slot.id, p0, -1);
+                    slot.n_past--;
+                    if (slot.ga_i > 0)
+                    {
+                        slot.n_past_se--;
+                    }
+                }
+
+                int p0 = (int) system_tokens.size() + slot.n_past;
+                LOG_INFO("kv cache rm [p0, end)", {
+                    { "slot_id", slot.id },
+                    { "task_id", slot.task_id },
+                    { "p0",      p0 }
+                });
+                if (!llama_kv_cache_seq_rm(ctx, slot.id, p0, -1))
+                {
+                    // a recurrent state goes back to its newest checkpoint instead
+                    slot.n_past = std::max(0, llama_kv_cache_seq_rewind(ctx, slot.id, p0) + 1 - (int) system_tokens.size());
+                    slot.num_prompt_tokens_processed = slot.num_prompt_tokens - slot.n_past;
+                    slot.n_prompt_cached = slot.n_past;
+                }
 
-                    LOG_VERBOSE("prompt ingested", {
-                                                    {"n_past",  slot.n_past},
-                                                    {"cached",  tokens_to_str(ctx, slot.cache_tokens.cbegin(), slot.cache_tokens.cbegin() + slot.n_past)},
-                                                    {"to_eval", tokens_to_str(ctx, slot.cache_tokens.cbegin() + slot.n_past, slot.cache_tokens.cend())},
-                                                });
+                LOG_VERBOSE("prompt ingested", {
+                                                {"n_past",  slot.n_past},
+                                                {"cached",  tokens_to_str(ctx, slot.cache_tokens.cbegin(), slot.cache_tokens.cbegin() + slot.n_past)},
+                                                {"to_eval", tokens_to_str(ctx, slot.cache_tokens.cbegin() + slot.n_past, slot.cache_tokens.cend())},
+                                            });
 
-                    const bool has_images = process_images(slot);
+                slot.n_decoded = 0;
 
-                    // process the prefix of first image
-                    std::vector<llama_token> prefix_tokens = has_images ? tokenize(slot.images[0].prefix_prompt, add_bos_token) : prompt_tokens;
+                // plain prompts are evaluated a chunk at a time, so they
+                // can share each batch with slots that are generating
+                if (!has_images && !slot.embedding && slot.ga_n == 1)
+                {
+                    slot.ingesting_prompt = true;
+                    fork_slot(slot);
+                }
+                else
+                {
+                    std::vector<llama_token> prefix_tokens = has_images ? std::vector<llama_token>() : prompt_tokens;
 
                     int32_t slot_npast = slot.n_past_se > 0 ? slot.n_past_se : slot.n_past;
 
@@ -1945,7 +4694,7 @@ struct llama_server_context
                         slot_npast++;
                     }
 
-                    if (has_images && !ingest_images(slot, n_batch))
+                    if (has_images && !ingest_images(slot, prompt_tokens, n_batch))
                     {
                         LOG_ERROR("failed processing images", {
                             "slot_id", slot.id,
@@ -1963,10 +4712,14 @@ struct llama_server_context
                         batch.logits[batch.n_tokens - 1] = true;
                     }
 
-                    slot.n_decoded = 0;
-                    slot.i_batch   = batch.n_tokens - 1;
+                    slot.i_batch = batch.n_tokens - 1;
                 }
             }
+
+            if (slot.ingesting_prompt)
+            {
+                ingest_prompt_chunk(slot, n_prefill);
+            }
         }
 
         if (batch.n_tokens == 0)
@@ -1975,6 +4728,46 @@ struct llama_server_context
             return true;
         }
 
+        // skip copying the full logits when no slot needs them
+        if (n_logits_top_k > 0)
+        {
+            bool fits = true;
+            for (const auto & slot : slots)
+            {
+                if (slot.i_batch >= 0 && (!slot.shortlist.empty() || !llama_sampling_fits_top_k(slot.sparams, n_logits_top_k)))
+                {
+                    fits = false;
+                }
+            }
+            llama_set_logits_top_k(ctx, fits ? n_logits_top_k : 0);
+        }
+
+        // only compute the logits of the tokens the slots may generate
+        // when each slot sampling from the batch has a shortlist
+        output_shortlist.clear();
+        for (const auto & slot : slots)
+        {
+            if (slot.i_batch < 0)
+            {
+                continue;
+            }
+            if (slot.shortlist.empty())
+            {
+                output_shortlist.clear();
+                break;
+            }
+            output_shortlist.insert(output_shortlist.end(), slot.shortlist.begin(), slot.shortlist.end());
+        }
+        std::sort(output_shortlist.begin(), output_shortlist.end());
+        output_shortlist.erase(std::unique(output_shortlist.begin(), output_shortlist.end()), output_shortlist.end());
+        llama_set_output_shortlist(ctx, output_shortlist.data(), output_shortlist.size());
+
+        // make room for this batch by evicting cached prefixes
+        while (prefix_cache.size() > 0 && n_ctx - llama_get_kv_cache_used_cells(ctx) < batch.n_tokens)
+        {
+            prefix_cache.evict();
+        }
+
         for (int32_t i = 0; i < (int32_t) batch.n_tokens; i += n_batch)
         {
             const int32_t n_tokens = std::min(n_batch, (int32_t) (batch.n_tokens - i));
@@ -2021,14 +4814,31 @@ struct llama_server_context
                 0, 0, 0, // unused
             };
 
+            const int64_t t_decode = ggml_time_us();
+            const double j_decode = llamafile_energy();
             const int ret = llama_decode(ctx, batch_view);
+            if (ret == 0)
+            {
+                metrics.decode_batch_tokens.observe(n_tokens);
+                metrics.kv_cache_usage_ratio.observe(1. * llama_get_kv_cache_used_cells(ctx) / n_ctx);
+            }
 
             if (ret != 0)
             {
+                if (ret > 0 && prefix_cache.size() > 0)
+                {
+                    // the cached prefixes are less important than progress
+                    LOG_TEE("%s : failed to find free space in the KV cache, dropping %d cached prefixes\n", __func__, prefix_cache.size());
+                    prefix_cache.clear();
+                    i -= n_batch;
+                    continue;
+                }
+
                 if (n_batch == 1 || ret < 0)
                 {
                     // if you get here, it means the KV cache is full - try increasing it via the context size
                     LOG_TEE("%s : failed to decode the batch, n_batch = %d, ret = %d\n", __func__, n_batch, ret);
+                    llama_set_output_shortlist(ctx, nullptr, 0);
                     return false;
                 }
 
@@ -2040,6 +4850,7 @@ struct llama_server_context
                 continue;
             }
 
+            std::vector<llama_client_slot *> ready;
             for (auto & slot : slots)
             {
                 if (slot.i_batch < (int) i || slot.i_batch >= (int) (i + n_tokens))
@@ -2056,43 +4867,54 @@ struct llama_server_context
                     continue;
                 }
 
-                completion_token_output result;
-                const llama_token id = llama_sampling_sample(slot.ctx_sampling, ctx, NULL, slot.i_batch - i);
+                ready.push_back(&slot);
+            }
 
-                llama_sampling_accept(slot.ctx_sampling, ctx, id, true);
+            // sample the slots in parallel, each for as long as its draft
+            // guessed right, once the last of the outputs is ready to read
+            llama_synchronize(ctx);
+            account_decode(batch_view, ggml_time_us() - t_decode, j_decode >= 0 ? llamafile_energy() - j_decode : 0);
+            workers.run(ready.size(), [&](int j) {
+                llama_client_slot &slot = *ready[j];
+                const int32_t n_verify = std::min((int32_t) slot.drafted.size(), i + n_tokens - 1 - slot.i_batch);
+                draw_tokens(slot, slot.i_batch - i, n_verify);
+            });
 
-                slot.n_decoded += 1;
-                if (slot.n_decoded == 1)
+            for (llama_client_slot *ready_slot : ready)
+            {
+                llama_client_slot &slot = *ready_slot;
+                const int32_t n_verify = std::min((int32_t) slot.drafted.size(), i + n_tokens - 1 - slot.i_batch);
+                int32_t n_accepted = 0;
+                for (completion_token_output &result : slot.drawn)
                 {
-                    slot.t_start_genereration = ggml_time_us();
-                    slot.t_prompt_processing = (slot.t_start_genereration - slot.t_start_process_prompt) / 1e3;
-                    metrics.on_prompt_eval(slot);
+                    if (!finish_token(result, slot) ||
+                        n_accepted >= n_verify || result.tok != slot.drafted[n_accepted])
+                    {
+                        break;
+                    }
+                    ++n_accepted;
                 }
+                slot.drawn.clear();
+                slot.n_past += n_accepted;
+                slot.n_draft_total += slot.drafted.size();
+                slot.n_draft_accepted += n_accepted;
 
-                llama_token_data_array cur_p = { slot.ctx_sampling->cur.data(), slot.ctx_sampling->cur.size(), false };
-                result.tok = id;
-
-                const int32_t n_probs = slot.sparams.n_probs;
-                if (slot.sparams.temp <= 0 && n_probs > 0)
-                {
-                    // for llama_sample_token_greedy we need to sort candidates
-                    llama_sample_softmax(ctx, &cur_p);
-                }
+                slot.i_batch = -1;
+            }
+        }
 
-                for (size_t i = 0; i < std::min(cur_p.size, (size_t)n_probs); ++i)
-                {
-                    result.probs.push_back({cur_p.data[i].id, cur_p.data[i].p});
-                }
+        llama_set_output_shortlist(ctx, nullptr, 0);
 
-                if (!process_token(result, slot))
+        // forget the guesses that turned out wrong
+        for (auto & slot : slots)
+        {
+            if (!slot.drafted.empty())
+            {
+                if (!llama_kv_cache_seq_rm(ctx, slot.id, system_tokens.size() + slot.n_past, -1))
                 {
-                    slot.release();
-                    slot.print_timings();
-                    send_final_response(slot);
-                    metrics.on_prediction(slot);
+                    rewind_slot(slot, slot.n_past);
                 }
-
-                slot.i_batch = -1;
+                slot.drafted.clear();
             }
         }
 
@@ -2101,7 +4923,15 @@ struct llama_server_context
     }
 
     void run_on_all_tasks_finished() {
+        resume_parked_slots();
         update_slots();
+        // busy slots change with every token, so they're only caught
+        // every so often, while the loop is idle it's done right away
+        const int64_t t_now = ggml_time_us();
+        if (all_slots_are_idle || t_now - t_published >= STATUS_INTERVAL_US)
+        {
+            publish_status(t_now);
+        }
     }
 };
 
@@ -2124,7 +4954,8 @@ static void server_print_usage(const char *argv0, const gpt_params &params,
     printf("  --yarn-attn-factor N      YaRN: scale sqrt(t) or attention magnitude (default: 1.0)\n");
     printf("  --yarn-beta-slow N        YaRN: high correction dim or alpha (default: %.1f)\n", params.yarn_beta_slow);
     printf("  --yarn-beta-fast N        YaRN: low correction dim or beta (default: %.1f)\n", params.yarn_beta_fast);
-    printf("  -b N, --batch-size N      batch size for prompt processing (default: %d)\n", params.n_batch);
+    printf("  -b N, --batch-size N      logical batch size for prompt processing (default: %d)\n", params.n_batch);
+    printf("  -ub N, --ubatch-size N    physical batch size, or 'auto' to pick the fastest one at startup (default: %d)\n", params.n_ubatch);
     printf("  --memory-f32              use f32 instead of f16 for memory key+value (default: disabled)\n");
     printf("                            not recommended: doubles context memory required and no measurable increase in quality\n");
     if (llama_supports_mlock())
@@ -2135,13 +4966,32 @@ static void server_print_usage(const char *argv0, const gpt_params &params,
     {
         printf("  --no-mmap                 do not memory-map model (slower load but may reduce pageouts if not using mlock)\n");
     }
+    printf("  --hugepages               copy weights into 2mb pages to reduce tlb misses (linux and windows, uses more memory)\n");
+    printf("  --share-weights           let processes loading the same model share --hugepages and --repack copies\n");
+    printf("  --verify                  check the crc32 of weights stored in a zip or llamafile while loading them\n");
+    printf("  --adaptive-threads        measure how each kind of op scales and give it only the threads that help\n");
+    printf("  --stream-weights          read weights a few layers ahead and let go of used ones, for models bigger than ram\n");
+    printf("  --trace FNAME             save per-op timings of every thread and backend as a chrome trace at exit\n");
+    printf("  --flight-recorder FNAME   keep the last events of the decode loop, saved to FNAME on SIGUSR1 and served by /flight\n");
+    printf("  --perf-counters           count cycles, instructions and cache misses of matmul and attention ops\n");
+    printf("  --repack                  copy q4_0 and q8_0 weights into a faster layout for cpu matmuls (uses more memory)\n");
+    printf("  --tune                    benchmark cpu matmul tiles on this model and save the winners in ~/.llamafile\n");
+    printf("  --lazy-load               start without waiting for weights to load off disk; they're read on first use\n");
     printf("  --numa TYPE               attempt optimizations that help on some NUMA systems\n");
     printf("                              - distribute: spread execution evenly over all nodes\n");
     printf("                              - isolate: only spawn threads on CPUs on the node that execution started on\n");
     printf("                              - numactl: use the CPU map provided my numactl\n");
+    printf("                              - replicate: like distribute, but copy weights to every node\n");
+    printf("                              - shard: like distribute, but put each node's rows of every matrix on that node\n");
+    printf("                              - tier: put the weights read most per token and the kv cache in the fastest memory (hbm, dram, cxl)\n");
     if (llama_supports_gpu_offload()) {
         printf("  -ngl N, --n-gpu-layers N\n");
-        printf("                            number of layers to store in VRAM\n");
+        printf("                            number of layers to store in VRAM, or `auto` to fit as many as\n");
+        printf("                            free memory allows with the chosen context size\n");
+        printf("  --gpu-experts N           store only the N experts each offloaded MoE layer picks most often\n");
+        printf("                            in VRAM, computing the others from host memory (default: all)\n");
+        printf("  --expert-stats FNAME      file counting how often each expert is picked, which is read to\n");
+        printf("                            choose the --gpu-experts and updated on exit\n");
         printf("  -sm SPLIT_MODE, --split-mode SPLIT_MODE\n");
         printf("                            how to split the model across multiple GPUs, one of:\n");
         printf("                              - none: use one GPU only\n");
@@ -2151,15 +5001,35 @@ static void server_print_usage(const char *argv0, const gpt_params &params,
         printf("                            fraction of the model to offload to each GPU, comma-separated list of proportions, e.g. 3,1\n");
         printf("  -mg i, --main-gpu i       the GPU to use for the model (with split-mode = none),\n");
         printf("                            or for intermediate results and KV (with split-mode = row)\n");
+        printf("  --cuda-graphs             replay each decode step on nvidia gpus as one cuda graph\n");
     }
     printf("  -m FNAME, --model FNAME\n");
     printf("                            model path (default: %s)\n", params.model.c_str());
     printf("  -a ALIAS, --alias ALIAS\n");
     printf("                            set an alias for the model, will be added as `model` field in completion response\n");
+    printf("  -md FNAME, --model-draft FNAME\n");
+    printf("                            draft model for speculative decoding, which must share the vocab of --model (default: unused)\n");
+    printf("  --draft N                 number of tokens to draft for speculative decoding (default: %d)\n", params.n_draft);
+    printf("  --state-checkpoint N      with recurrent models, save the state of each slot every N tokens, to reuse\n");
+    printf("                            prompt prefixes and roll back without starting over (default: %d, 0 = never)\n", params.n_seq_checkpoint);
+    printf("  --cpu-decode N            compute batches of up to N tokens on the cpu, reading the weights of gpus that share\n");
+    printf("                            memory with it in place, e.g. to decode on the cpu of an apu (default: %d, 0 = never)\n", params.n_cpu_decode);
+    printf("  --draft-layers N          without a draft model, draft with the first N layers of --model (default: %d, 0 = disabled)\n", sparams.n_layer_draft);
+    printf("  --lookup-ngram N          without a draft model, draft what followed the last N tokens earlier in the slot (default: %d, 0 = disabled)\n", sparams.n_lookup_ngram);
+    printf("  --jump-forward            draft the text a grammar leaves no choice about, like the keys of a json schema\n");
+    if (llama_supports_gpu_offload()) {
+        printf("  -ngld N, --n-gpu-layers-draft N\n");
+        printf("                            number of layers of the draft model to store in VRAM\n");
+    }
     printf("  --lora FNAME              apply LoRA adapter (implies --no-mmap)\n");
     printf("  --lora-base FNAME         optional model to use as a base for the layers modified by the LoRA adapter\n");
+    printf("  --lora-runtime FNAME      load a LoRA adapter that requests can select with \"lora\", without merging it (can be repeated)\n");
+    printf("  --control-vector-runtime FNAME\n");
+    printf("                            load a control vector that requests can select with \"control_vectors\" (can be repeated)\n");
     printf("  --host                    ip address to listen (default  (default: %s)\n", sparams.hostname.c_str());
     printf("  --port PORT               port to listen (default  (default: %d)\n", sparams.port);
+    printf("  --unix-socket PATH        listen on a unix domain socket at PATH instead of --host and --port\n");
+    printf("  --workers N               number of server processes sharing the weights and the listening socket, restarted if they crash (default: %d)\n", sparams.n_workers);
     printf("  --path PUBLIC_PATH        path from which to serve static files (default %s)\n", sparams.public_path.c_str());
     printf("  --api-key API_KEY         optional api key to enhance server security. If set, requests must include this key for access.\n");
     printf("  --api-key-file FNAME      path to file containing api keys delimited by new lines. If set, requests must include one of the keys for access.\n");
@@ -2167,6 +5037,26 @@ static void server_print_usage(const char *argv0, const gpt_params &params,
     printf("  --embedding               enable embedding vector output (default: %s)\n", params.embedding ? "enabled" : "disabled");
     printf("  -np N, --parallel N       number of slots for process requests (default: %d)\n", params.n_parallel);
     printf("  -cb, --cont-batching      enable continuous batching (a.k.a dynamic batching) (default: disabled)\n");
+    printf("  -sps F, --slot-prompt-similarity F\n");
+    printf("                            fraction of a cached prompt an idle slot must match to be preferred over the least recently used one (default: %.2f)\n", sparams.slot_prompt_similarity);
+    printf("  --dynamic-slots           let slots share the whole context, admitting requests while the kv cache has room for them (default: disabled)\n");
+    printf("  --slot-reserve N          kv cells reserved for the reply when a request sets no n_predict, with --dynamic-slots (default: %d)\n", sparams.n_slot_reserve);
+    printf("  --shift-block N           tokens a full slot forgets at a time, oldest first, rather than half its history (default: %d, 0 = half)\n", sparams.n_shift_block);
+    printf("  --attention-sinks N       tokens at the start of a slot that a context shift always keeps, besides n_keep (default: %d)\n", sparams.n_attn_sinks);
+    printf("  --prefill-chunk N         maximum number of prompt tokens evaluated per step, so prompts don't stall generating slots (default: same as --batch-size)\n");
+    printf("  --queue-depth N           number of requests that may wait for a slot, beyond which new ones get 429 (default: %d, 0 = unlimited)\n", sparams.n_queue_max);
+    printf("  --queue-timeout N         seconds a request may wait for a slot before it's dropped, and new ones that would wait longer get 429 (default: %g, 0 = forever)\n", (double) sparams.queue_timeout);
+    printf("  --stream-threads N        number of threads writing streamed responses, so they don't each keep an http thread (default: %d, 0 = use the http threads)\n", sparams.n_stream_threads);
+    printf("  --image-cache N           number of image embeddings to remember by the hash of their bytes (default: %d, 0 = disabled)\n", sparams.n_image_cache);
+    printf("  --embedding-cache N       number of text embeddings to remember by the hash of the model, pooling and text (default: %d, 0 = disabled)\n", sparams.n_embd_cache);
+    printf("  --sync-images             encode images on the main loop, pausing the other slots, rather than on a thread of their own\n");
+    printf("  --models-dir DIR          serve the gguf files in DIR too, to requests whose model field names one of them\n");
+    printf("  --models-budget N         MiB of weights of models from --models-dir kept loaded (default: %d, 0 = unlimited)\n", sparams.n_models_budget);
+    printf("  --preempt-pool N          MiB of host memory for generations swapped out by requests of higher priority (default: %d, 0 = disabled)\n", sparams.n_preempt_pool);
+    printf("  --prefix-cache N          number of prompt prefixes to share across slots when cache_prompt is set (default: %d, 0 = disabled)\n", sparams.n_prefix_cache);
+    printf("  --prefix-cache-dir PATH   write the prompt prefixes evicted from --prefix-cache to PATH and read them back for prompts that start with them\n");
+    printf("  --prefix-cache-disk N     MiB of prompt prefixes kept in --prefix-cache-dir (default: %d, 0 = unlimited)\n", sparams.n_prefix_cache_disk);
+    printf("  --logits-top-k N          select the N most likely tokens on the backend and copy only those, when sampling wouldn't look further (default: %d, 0 = disabled)\n", sparams.n_logits_top_k);
     printf("  -spf FNAME, --system-prompt-file FNAME\n");
     printf("                            set a file to load a system prompt (initial prompt of all slots), this is useful for chat applications.\n");
     printf("  -ctk TYPE, --cache-type-k TYPE\n");
@@ -2174,10 +5064,15 @@ static void server_print_usage(const char *argv0, const gpt_params &params,
     printf("  -ctv TYPE, --cache-type-v TYPE\n");
     printf("                            KV cache data type for V (default: f16)\n");
     printf("  --mmproj MMPROJ_FILE      path to a multimodal projector file for LLaVA.\n");
+    printf("  --slot-save-path PATH     directory in which /slots/{id}?action=save stores the kv cache of slots (default: disabled)\n");
+    printf("  --slot-transfer           allow /slots/{id}?action=export and action=import (default: disabled)\n");
+    printf("  --snapshot PATH           save the kv cache of slots to PATH on exit, and restore it on startup (default: disabled)\n");
     printf("  --log-format              log output format: json or text (default: json)\n");
     printf("  --log-disable             disables logging to a file.\n");
     printf("  --slots-endpoint-disable  disables slots monitoring endpoint.\n");
     printf("  --metrics                 enable prometheus compatible metrics endpoint (default: %s).\n", sparams.metrics_endpoint ? "enabled" : "disabled");
+    printf("  --metrics-latency-buckets LIST\n");
+    printf("                            comma-separated upper bounds in seconds of the latency histogram buckets (default: 0.005,0.01,...,30,60)\n");
     printf("\n");
     printf("  -n, --n-predict           maximum tokens to predict (default: %d)\n", params.n_predict);
     printf("  --override-kv KEY=TYPE:VALUE\n");
@@ -2209,74 +5104,143 @@ static void server_params_parse(int argc, char **argv, server_params &sparams,
                 invalid_param = true;
                 break;
             }
-            sparams.port = std::stoi(argv[i]);
+            sparams.port = std::stoi(argv[i]);
+        }
+        else if (arg == "--host")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            sparams.hostname = argv[i];
+        }
+        else if (arg == "--unix-socket")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            sparams.unix_socket = argv[i];
+        }
+        else if (arg == "--workers")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            sparams.n_workers = std::max(1, std::stoi(argv[i]));
+        }
+        else if (arg == "--path")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            sparams.public_path = argv[i];
+        }
+        else if (arg == "--api-key")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            sparams.api_keys.emplace_back(argv[i]);
+        }
+        else if (arg == "--api-key-file")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            std::ifstream key_file(argv[i]);
+            if (!key_file) {
+                fprintf(stderr, "error: failed to open file '%s'\n", argv[i]);
+                invalid_param = true;
+                break;
+            }
+            std::string key;
+            while (std::getline(key_file, key)) {
+               if (key.size() > 0) {
+                   sparams.api_keys.push_back(key);
+               }
+            }
+            key_file.close();
+        }
+        else if (arg == "--timeout" || arg == "-to")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            sparams.read_timeout = std::stoi(argv[i]);
+            sparams.write_timeout = std::stoi(argv[i]);
         }
-        else if (arg == "--host")
+        else if (arg == "-m" || arg == "--model")
         {
             if (++i >= argc)
             {
                 invalid_param = true;
                 break;
             }
-            sparams.hostname = argv[i];
+            params.model = argv[i];
         }
-        else if (arg == "--path")
+        else if (arg == "-md" || arg == "--model-draft" || arg == "--draft-model")
         {
             if (++i >= argc)
             {
                 invalid_param = true;
                 break;
             }
-            sparams.public_path = argv[i];
+            params.model_draft = argv[i];
         }
-        else if (arg == "--api-key")
+        else if (arg == "--draft")
         {
             if (++i >= argc)
             {
                 invalid_param = true;
                 break;
             }
-            sparams.api_keys.emplace_back(argv[i]);
+            params.n_draft = std::stoi(argv[i]);
         }
-        else if (arg == "--api-key-file")
+        else if (arg == "--state-checkpoint")
         {
             if (++i >= argc)
             {
                 invalid_param = true;
                 break;
             }
-            std::ifstream key_file(argv[i]);
-            if (!key_file) {
-                fprintf(stderr, "error: failed to open file '%s'\n", argv[i]);
-                invalid_param = true;
-                break;
-            }
-            std::string key;
-            while (std::getline(key_file, key)) {
-               if (key.size() > 0) {
-                   sparams.api_keys.push_back(key);
-               }
-            }
-            key_file.close();
+            params.n_seq_checkpoint = std::stoi(argv[i]);
         }
-        else if (arg == "--timeout" || arg == "-to")
+        else if (arg == "--cpu-decode")
         {
             if (++i >= argc)
             {
                 invalid_param = true;
                 break;
             }
-            sparams.read_timeout = std::stoi(argv[i]);
-            sparams.write_timeout = std::stoi(argv[i]);
+            params.n_cpu_decode = std::stoi(argv[i]);
         }
-        else if (arg == "-m" || arg == "--model")
+        else if (arg == "-ngld" || arg == "--n-gpu-layers-draft")
         {
             if (++i >= argc)
             {
                 invalid_param = true;
                 break;
             }
-            params.model = argv[i];
+            if (llama_supports_gpu_offload()) {
+                params.n_gpu_layers_draft = std::stoi(argv[i]);
+            } else {
+                LOG_WARNING("Not compiled with GPU offload support, --n-gpu-layers-draft option will be ignored. "
+                        "See main README.md for information on enabling GPU BLAS support",
+                        {{"n_gpu_layers_draft", params.n_gpu_layers_draft}});
+            }
         }
         else if (arg == "-a" || arg == "--alias")
         {
@@ -2409,7 +5373,23 @@ static void server_params_parse(int argc, char **argv, server_params &sparams,
                 break;
             }
             params.n_batch = std::stoi(argv[i]);
-            params.n_batch = std::min(512, params.n_batch);
+        }
+        else if (arg == "-ub" || arg == "--ubatch-size")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            if (std::string(argv[i]) == "auto")
+            {
+                sparams.tune_ubatch = true;
+            }
+            else
+            {
+                params.n_ubatch = std::stoi(argv[i]);
+                sparams.tune_ubatch = false;
+            }
         }
         else if (arg == "--gpu-layers" || arg == "-ngl" || arg == "--n-gpu-layers")
         {
@@ -2419,13 +5399,35 @@ static void server_params_parse(int argc, char **argv, server_params &sparams,
                 break;
             }
             if (llama_supports_gpu_offload()) {
-                params.n_gpu_layers = std::stoi(argv[i]);
+                if (std::strcmp(argv[i], "auto") == 0) {
+                    params.n_gpu_layers = LLAMAFILE_GPU_LAYERS_AUTO;
+                } else {
+                    params.n_gpu_layers = std::stoi(argv[i]);
+                }
             } else {
                 LOG_WARNING("Not compiled with GPU offload support, --n-gpu-layers option will be ignored. "
                         "See main README.md for information on enabling GPU BLAS support",
                         {{"n_gpu_layers", params.n_gpu_layers}});
             }
         }
+        else if (arg == "--gpu-experts")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            params.n_gpu_experts = std::stoi(argv[i]);
+        }
+        else if (arg == "--expert-stats")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            params.expert_stats = argv[i];
+        }
         else if (arg == "--split-mode" || arg == "-sm")
         {
             if (++i >= argc) {
@@ -2521,6 +5523,24 @@ static void server_params_parse(int argc, char **argv, server_params &sparams,
             }
             params.lora_base = argv[i];
         }
+        else if (arg == "--lora-runtime")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            sparams.lora_runtime.push_back(argv[i]);
+        }
+        else if (arg == "--control-vector-runtime")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            sparams.control_vector_runtime.push_back(argv[i]);
+        }
         else if (arg == "-v" || arg == "--verbose")
         {
 #if SERVER_VERBOSE != 1
@@ -2558,51 +5578,301 @@ static void server_params_parse(int argc, char **argv, server_params &sparams,
         {
             FLAG_nocompile = true;
         }
-        else if (arg == "--recompile")
+        else if (arg == "--recompile")
+        {
+            FLAG_recompile = true;
+        }
+        else if (arg == "--cuda-graphs")
+        {
+            FLAG_cuda_graphs = true;
+        }
+        else if (arg == "--gpu")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            FLAG_gpu = llamafile_gpu_parse(argv[i]);
+            if (FLAG_gpu == -2)
+            {
+                fprintf(stderr, "error: invalid --gpu flag value: %s\n", argv[i]);
+                exit(1);
+            }
+        }
+        else if (arg == "--mlock")
+        {
+            params.use_mlock = true;
+        }
+        else if (arg == "--no-mmap")
+        {
+            params.use_mmap = false;
+        }
+        else if (arg == "--hugepages")
+        {
+            FLAG_hugepages = true;
+        }
+        else if (arg == "--share-weights")
+        {
+            FLAG_share_weights = true;
+        }
+        else if (arg == "--verify")
+        {
+            FLAG_verify = true;
+        }
+        else if (arg == "--adaptive-threads")
+        {
+            FLAG_adaptive_threads = true;
+        }
+        else if (arg == "--stream-weights")
+        {
+            FLAG_stream_weights = true;
+        }
+        else if (arg == "--trace")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            if (!llamafile_trace_begin(argv[i]))
+            {
+                exit(1);
+            }
+        }
+        else if (arg == "--flight-recorder")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            if (!llamafile_flight_begin(argv[i]))
+            {
+                exit(1);
+            }
+        }
+        else if (arg == "--perf-counters")
+        {
+            llamafile_perf_begin();
+        }
+        else if (arg == "--repack")
+        {
+            params.repack = true;
+        }
+        else if (arg == "--tune")
+        {
+            params.tune = true;
+        }
+        else if (arg == "--lazy-load")
+        {
+            params.lazy_load = true;
+        }
+        else if (arg == "--numa") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            } else {
+                std::string value(argv[i]);
+                /**/ if (value == "distribute" || value == "" ) { params.numa = GGML_NUMA_STRATEGY_DISTRIBUTE; }
+                else if (value == "isolate") { params.numa = GGML_NUMA_STRATEGY_ISOLATE; }
+                else if (value == "numactl") { params.numa = GGML_NUMA_STRATEGY_NUMACTL; }
+                else if (value == "mirror" || value == "replicate") { params.numa = GGML_NUMA_STRATEGY_MIRROR; }
+                else if (value == "shard") { params.numa = GGML_NUMA_STRATEGY_SHARD; }
+                else if (value == "tier") { params.numa = GGML_NUMA_STRATEGY_TIER; }
+                else { invalid_param = true; break; }
+            }
+        }
+        else if (arg == "--embedding")
+        {
+            params.embedding = true;
+        }
+        else if (arg == "-cb" || arg == "--cont-batching")
+        {
+            params.cont_batching = true;
+        }
+        else if (arg == "--dynamic-slots")
+        {
+            sparams.dynamic_slots = true;
+        }
+        else if (arg == "--slot-reserve")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            sparams.n_slot_reserve = std::stoi(argv[i]);
+        }
+        else if (arg == "--shift-block")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            sparams.n_shift_block = std::stoi(argv[i]);
+        }
+        else if (arg == "--attention-sinks")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            sparams.n_attn_sinks = std::stoi(argv[i]);
+        }
+        else if (arg == "--prefill-chunk")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            sparams.n_prefill_chunk = std::stoi(argv[i]);
+        }
+        else if (arg == "--queue-depth")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            sparams.n_queue_max = std::stoi(argv[i]);
+        }
+        else if (arg == "--queue-timeout")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            sparams.queue_timeout = std::stof(argv[i]);
+        }
+        else if (arg == "--stream-threads")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            sparams.n_stream_threads = std::stoi(argv[i]);
+        }
+        else if (arg == "--sync-images")
+        {
+            sparams.sync_images = true;
+        }
+        else if (arg == "--image-cache")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            sparams.n_image_cache = std::stoi(argv[i]);
+        }
+        else if (arg == "--embedding-cache")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            sparams.n_embd_cache = std::stoi(argv[i]);
+        }
+        else if (arg == "--models-dir")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            sparams.models_dir = argv[i];
+        }
+        else if (arg == "--models-budget")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            sparams.n_models_budget = std::stoi(argv[i]);
+        }
+        else if (arg == "--preempt-pool")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            sparams.n_preempt_pool = std::stoi(argv[i]);
+        }
+        else if (arg == "--prefix-cache")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            sparams.n_prefix_cache = std::stoi(argv[i]);
+        }
+        else if (arg == "--prefix-cache-dir")
         {
-            FLAG_recompile = true;
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            sparams.prefix_cache_dir = argv[i];
         }
-        else if (arg == "--gpu")
+        else if (arg == "--prefix-cache-disk")
         {
             if (++i >= argc)
             {
                 invalid_param = true;
                 break;
             }
-            FLAG_gpu = llamafile_gpu_parse(argv[i]);
-            if (FLAG_gpu == -2)
+            sparams.n_prefix_cache_disk = std::stoi(argv[i]);
+        }
+        else if (arg == "--logits-top-k")
+        {
+            if (++i >= argc)
             {
-                fprintf(stderr, "error: invalid --gpu flag value: %s\n", argv[i]);
-                exit(1);
+                invalid_param = true;
+                break;
             }
+            sparams.n_logits_top_k = std::stoi(argv[i]);
         }
-        else if (arg == "--mlock")
+        else if (arg == "--draft-layers")
         {
-            params.use_mlock = true;
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            sparams.n_layer_draft = std::stoi(argv[i]);
         }
-        else if (arg == "--no-mmap")
+        else if (arg == "--lookup-ngram")
         {
-            params.use_mmap = false;
-        }
-        else if (arg == "--numa") {
-            if (++i >= argc) {
+            if (++i >= argc)
+            {
                 invalid_param = true;
                 break;
-            } else {
-                std::string value(argv[i]);
-                /**/ if (value == "distribute" || value == "" ) { params.numa = GGML_NUMA_STRATEGY_DISTRIBUTE; }
-                else if (value == "isolate") { params.numa = GGML_NUMA_STRATEGY_ISOLATE; }
-                else if (value == "numactl") { params.numa = GGML_NUMA_STRATEGY_NUMACTL; }
-                else { invalid_param = true; break; }
             }
+            sparams.n_lookup_ngram = std::stoi(argv[i]);
         }
-        else if (arg == "--embedding")
+        else if (arg == "--jump-forward")
         {
-            params.embedding = true;
+            sparams.jump_forward = true;
         }
-        else if (arg == "-cb" || arg == "--cont-batching")
+        else if (arg == "-sps" || arg == "--slot-prompt-similarity")
         {
-            params.cont_batching = true;
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            sparams.slot_prompt_similarity = std::stof(argv[i]);
         }
         else if (arg == "-np" || arg == "--parallel")
         {
@@ -2647,6 +5917,32 @@ static void server_params_parse(int argc, char **argv, server_params &sparams,
         else if (arg == "-ctv" || arg == "--cache-type-v") {
             params.cache_type_v = argv[++i];
         }
+        else if (arg == "--slot-save-path")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            sparams.slot_save_path = argv[i];
+            if (!sparams.slot_save_path.empty() && sparams.slot_save_path.back() != '/')
+            {
+                sparams.slot_save_path += '/';
+            }
+        }
+        else if (arg == "--slot-transfer")
+        {
+            sparams.slot_transfer = true;
+        }
+        else if (arg == "--snapshot")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            sparams.snapshot_path = argv[i];
+        }
         else if(arg == "--mmproj")
         {
             if (++i >= argc)
@@ -2690,6 +5986,26 @@ static void server_params_parse(int argc, char **argv, server_params &sparams,
         {
             sparams.metrics_endpoint = true;
         }
+        else if (arg == "--metrics-latency-buckets")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            sparams.metrics_latency_buckets.clear();
+            std::stringstream ss(argv[i]);
+            std::string bound;
+            while (std::getline(ss, bound, ','))
+            {
+                sparams.metrics_latency_buckets.push_back(std::stod(bound));
+            }
+            if (sparams.metrics_latency_buckets.empty())
+            {
+                invalid_param = true;
+                break;
+            }
+        }
         else if (arg == "--chat-template")
         {
             if (++i >= argc)
@@ -2735,6 +6051,318 @@ static void server_params_parse(int argc, char **argv, server_params &sparams,
     }
 }
 
+// turns a result of a streamed task into the events to send, returning
+// true once the stream is over
+typedef std::function<bool(task_result &, std::string &)> stream_format_t;
+
+static stream_format_t completion_stream_format(int n_choices)
+{
+    int n_stopped = 0;
+    return [n_choices, n_stopped](task_result &result, std::string &str) mutable
+    {
+        if (result.error)
+        {
+            str = "error: " + result.result_json.dump(-1, ' ', false, json::error_handler_t::replace) + "\n\n";
+            return true;
+        }
+        str = !result.sse.empty() ? std::move(result.sse) :
+            "data: " + result.result_json.dump(-1, ' ', false, json::error_handler_t::replace) + "\n\n";
+        return result.stop && ++n_stopped == n_choices;
+    };
+}
+
+static stream_format_t chat_stream_format(int n_choices)
+{
+    int n_stopped = 0;
+    return [n_choices, n_stopped](task_result &result, std::string &str) mutable
+    {
+        if (result.error)
+        {
+            str = "error: " + result.result_json.dump(-1, ' ', false, json::error_handler_t::replace) + "\n\n";
+            return true;
+        }
+        if (!result.sse.empty())
+        {
+            str = std::move(result.sse);
+        }
+        else
+        {
+            for (const json &chunk : format_partial_response_oaicompat(result))
+            {
+                if (!chunk.empty())
+                {
+                    str += "data: " + chunk.dump(-1, ' ', false, json::error_handler_t::replace) + "\n\n";
+                }
+            }
+        }
+        return result.stop && ++n_stopped == n_choices;
+    };
+}
+
+static stream_format_t infill_stream_format()
+{
+    return [](task_result &result, std::string &str)
+    {
+        if (result.error)
+        {
+            return true;
+        }
+        str = !result.sse.empty() ? std::move(result.sse) :
+            "data: " + result.result_json.dump(-1, ' ', false, json::error_handler_t::replace) + "\n\n";
+        return result.stop;
+    };
+}
+
+// answers 429 if the server is too busy to take a request on
+static bool reject_if_overloaded(llama_server_context &llama, const json &data, httplib::Response &res)
+{
+    double wait;
+    if (!llama.overloaded(data, &wait))
+    {
+        return false;
+    }
+    const int retry_after = std::max(1, (int) std::ceil(wait));
+    LOG_WARNING("server is busy, request rejected", {
+        {"n_deferred",     llama.queue_tasks.n_deferred.load()},
+        {"estimated_wait", wait}
+    });
+    res.status = 429;
+    res.set_header("Retry-After", std::to_string(retry_after));
+    res.set_content("Server busy, retry after " + std::to_string(retry_after) + " seconds", "text/plain; charset=utf-8");
+    return true;
+}
+
+// gives up on a task whose client hung up before its result was ready,
+// so its slot stops generating for nobody
+static void abandon_task(llama_server_context &llama, int task_id)
+{
+    LOG_INFO("client disconnected", {{"task_id", task_id}});
+    llama.request_cancel(task_id);
+    llama.queue_results.remove_waiting_task_id(task_id);
+}
+
+// how a request wants its embeddings written
+struct embd_format
+{
+    std::string encoding = "float"; // float, base64, float16, int8 or binary
+    int32_t dimensions = 0;         // leading dimensions kept, 0 for all
+};
+
+// reads encoding_format and dimensions from a request body, returning
+// false with the reason in err if they can't be honored
+static bool parse_embd_format(const json &body, embd_format &fmt, std::string &err)
+{
+    fmt.encoding = json_value(body, "encoding_format", std::string("float"));
+    if (fmt.encoding != "float" && fmt.encoding != "base64" && fmt.encoding != "float16" &&
+        fmt.encoding != "int8" && fmt.encoding != "binary")
+    {
+        err = "encoding_format must be float, base64, float16, int8 or binary";
+        return false;
+    }
+    fmt.dimensions = json_value(body, "dimensions", 0);
+    if (body.contains("dimensions") && fmt.dimensions < 1)
+    {
+        err = "dimensions must be a positive number";
+        return false;
+    }
+    return true;
+}
+
+// computes the normalized embeddings of inputs, each a string or a list
+// of tokens, on the main model. texts are looked up in the embedding
+// cache first and the rest are evaluated by a single task, which embeds
+// many at once without going through the slots, unless there's only one
+// or there are images. returns false with the task's error in err
+static bool compute_embeddings(llama_server_context &llama, const json &inputs, json image_data,
+                               std::vector<std::vector<float>> &out, std::string &err)
+{
+    const bool cacheable = llama.embd_cache.n_max && image_data.is_string();
+    const int pooling = llama_pooling_type(llama.ctx_main);
+    std::vector<std::string> keys(inputs.size());
+    std::vector<size_t> missing;
+    json prompts = json::array();
+    out.assign(inputs.size(), std::vector<float>());
+    for (size_t i = 0; i < inputs.size(); ++i)
+    {
+        if (cacheable && inputs[i].is_string())
+        {
+            keys[i] = server_embd_cache::key(llama.params.model_alias, pooling, inputs[i].get_ref<const std::string &>());
+            if (llama.embd_cache.get(keys[i], &out[i]))
+            {
+                continue;
+            }
+        }
+        missing.push_back(i);
+        prompts.push_back(inputs[i]);
+    }
+    if (missing.empty())
+    {
+        return true;
+    }
+
+    const int task_id = llama.queue_tasks.get_new_id();
+    llama.queue_results.add_waiting_task_id(task_id);
+    if (prompts.size() > 1 && image_data.is_string())
+    {
+        llama.request_embeddings(task_id, prompts);
+    }
+    else
+    {
+        json prompt = prompts.size() > 1 ? prompts : prompts[0];
+        llama.request_completion(task_id, { {"prompt", std::move(prompt)}, { "n_predict", 0}, {"image_data", std::move(image_data)} }, false, true, -1);
+    }
+    task_result result = llama.queue_results.recv(task_id);
+    llama.queue_results.remove_waiting_task_id(task_id);
+    if (result.error)
+    {
+        err = json_value(result.result_json, "content", std::string("failed to compute embeddings"));
+        return false;
+    }
+
+    for (size_t j = 0; j < missing.size(); ++j)
+    {
+        const json &elem = missing.size() > 1 ? result.result_json.at("results").at(j) : result.result_json;
+        const size_t i = missing[j];
+        out[i] = json_value(elem, "embedding", std::vector<float>());
+        if (!keys[i].empty())
+        {
+            llama.embd_cache.put(keys[i], out[i]);
+        }
+    }
+    return true;
+}
+
+// writes the embedding field of a result, with a scale field after it
+// for int8. the vector is cut to the leading dimensions first, as models
+// trained with matryoshka representation learning allow, and normalized
+// again, so that the dot product is still the cosine similarity
+static void write_embedding(json_writer &w, std::vector<float> embd, const embd_format &fmt)
+{
+    if (fmt.dimensions > 0 && (size_t) fmt.dimensions < embd.size())
+    {
+        embd.resize(fmt.dimensions);
+        llama_embd_normalize(embd.data(), embd.data(), embd.size());
+    }
+    const size_t n = embd.size();
+
+    w.key("embedding");
+    if (fmt.encoding == "float")
+    {
+        w.begin_array();
+        for (float x : embd)
+        {
+            w.value((double) x);
+        }
+        w.end_array();
+    }
+    else if (fmt.encoding == "int8")
+    {
+        float amax = 0;
+        for (float x : embd)
+        {
+            amax = std::max(amax, std::fabs(x));
+        }
+        const float scale = amax / 127;
+        const float inv = scale ? 1 / scale : 0;
+        w.begin_array();
+        for (float x : embd)
+        {
+            w.value((int) std::lrintf(x * inv));
+        }
+        w.end_array();
+        w.field("scale", (double) scale);
+    }
+    else
+    {
+        // the rest are base64 strings of little endian numbers, or of
+        // the sign bits packed most significant first like numpy.packbits
+        std::vector<uint8_t> bytes;
+        if (fmt.encoding == "base64")
+        {
+            bytes.resize(n * 4);
+            memcpy(bytes.data(), embd.data(), bytes.size());
+        }
+        else if (fmt.encoding == "float16")
+        {
+            bytes.resize(n * 2);
+            for (size_t i = 0; i < n; ++i)
+            {
+                const ggml_fp16_t h = ggml_fp32_to_fp16(embd[i]);
+                memcpy(&bytes[i * 2], &h, 2);
+            }
+        }
+        else
+        {
+            bytes.resize((n + 7) / 8);
+            for (size_t i = 0; i < n; ++i)
+            {
+                bytes[i / 8] |= (embd[i] > 0) << (7 - i % 8);
+            }
+        }
+        std::string str;
+        base64_encode(bytes.data(), bytes.size(), str);
+        w.value(str);
+    }
+}
+
+// streams the results of a task as server-sent events, from one of the
+// stream threads when there are any, otherwise from the http thread
+static void set_stream_response(const httplib::Request &req, httplib::Response &res,
+                                llama_server_context &llama, int task_id, stream_format_t format)
+{
+    if (llama.streams.running())
+    {
+        res.set_detached_content("text/event-stream", [&llama, task_id, format](socket_t sock)
+        {
+            llama.queue_results.subscribe(task_id, llama.streams.add(sock, task_id, format));
+        });
+        return;
+    }
+
+    const auto chunked_content_provider = [task_id, format, &llama, &req](size_t, httplib::DataSink &sink) mutable
+    {
+        while (true)
+        {
+            task_result result;
+            if (!llama.queue_results.recv(task_id, result, req.is_connection_closed))
+            {
+                llama.queue_results.remove_waiting_task_id(task_id);
+                return false;
+            }
+            std::string str;
+            const bool last = format(result, str);
+            if (!str.empty())
+            {
+                LOG_VERBOSE("data stream", {
+                    { "to_send", str }
+                });
+                if (!sink.write(str.c_str(), str.size()))
+                {
+                    llama.queue_results.remove_waiting_task_id(task_id);
+                    return false;
+                }
+            }
+            if (last)
+            {
+                break;
+            }
+        }
+
+        llama.queue_results.remove_waiting_task_id(task_id);
+        sink.done();
+        return true;
+    };
+
+    auto on_complete = [task_id, &llama] (bool)
+    {
+        // cancel
+        llama.request_cancel(task_id);
+        llama.queue_results.remove_waiting_task_id(task_id);
+    };
+
+    res.set_chunked_content_provider("text/event-stream", chunked_content_provider, on_complete);
+}
+
 /* llama.cpp completion api semantics */
 static json format_partial_response(
     llama_server_context &llama, llama_client_slot *slot, const std::string &content, const std::vector<completion_token_output> &probs
@@ -2831,6 +6459,135 @@ static const char *sockaddr2str(const struct sockaddr *sa, char *buf, size_t siz
   }
 }
 
+// the pledge() promises of a server process on linux and openbsd
+static void server_promises(const server_params &sparams, char *promises, size_t size) {
+    if (IsOpenbsd()) {
+        strlcpy(promises, "stdio inet", size);
+    } else {
+        strlcpy(promises, "stdio anet", size);
+    }
+    if (!sparams.unix_socket.empty()) {
+        strlcat(promises, " unix", size);
+    }
+    if (!startswith(sparams.public_path.c_str(), "/zip/") || !sparams.slot_save_path.empty() ||
+        !sparams.prefix_cache_dir.empty() || !sparams.snapshot_path.empty()) {
+        strlcat(promises, " rpath", size);
+    }
+    if (!sparams.slot_save_path.empty() || !sparams.prefix_cache_dir.empty() || !sparams.snapshot_path.empty()) {
+        strlcat(promises, " wpath cpath", size);
+    }
+}
+
+//
+// pre-fork workers
+//
+// With --workers N the process that loaded the weights and bound the
+// socket forks N copies of itself, which share the weights copy-on-write
+// and take turns accepting connections on the socket. Each one has its
+// own context and slots, and pledges itself like a lone server would.
+// The parent stays behind to restart the ones that crash, and to pass
+// ctrl-c and sigterm on to them. It must fork before it starts threads,
+// since a child only gets the one that called fork().
+//
+
+static pid_t g_worker_pids[64];
+static volatile sig_atomic_t g_workers_stopping;
+
+static void server_prefork_signal(int) {
+    g_workers_stopping = 1;
+    for (pid_t pid : g_worker_pids) {
+        if (pid > 0) {
+            kill(pid, SIGINT);
+        }
+    }
+}
+
+// returns the index of the worker in each child. in the parent it only
+// returns once every worker has exited, with -1 and the exit status.
+static int server_prefork(int n_workers, const char *promises, int *status) {
+    n_workers = std::min(n_workers, (int)(sizeof(g_worker_pids) / sizeof(*g_worker_pids)));
+    int64_t started[sizeof(g_worker_pids) / sizeof(*g_worker_pids)] = {};
+
+    struct sigaction sa = {};
+    sa.sa_handler = server_prefork_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    // a respawned worker inherits our pledge before narrowing it down,
+    // so we keep whatever the workers need plus the right to fork them
+    bool pledged = false;
+    *status = 0;
+    for (int n_running = 0;;) {
+        for (int i = 0; i < n_workers && !g_workers_stopping; ++i) {
+            if (g_worker_pids[i]) {
+                continue;
+            }
+            const pid_t pid = fork();
+            if (pid == -1) {
+                LOG_ERROR("failed to fork worker", {{"worker", i}, {"error", strerror(errno)}});
+                *status = 1;
+                server_prefork_signal(SIGINT);
+                break;
+            }
+            if (!pid) {
+                signal(SIGINT, SIG_DFL);
+                signal(SIGTERM, SIG_DFL);
+                return i;
+            }
+            LOG_INFO("started worker", {{"worker", i}, {"pid", pid}});
+            g_worker_pids[i] = pid;
+            started[i] = ggml_time_ms();
+            ++n_running;
+        }
+        if (promises && !pledged) {
+            char buf[128];
+            snprintf(buf, sizeof(buf), "%s proc", promises);
+            if (pledge(buf, 0)) {
+                perror("pledge");
+                exit(1);
+            }
+            pledged = true;
+        }
+        if (!n_running) {
+            return -1;
+        }
+
+        int ws;
+        const pid_t pid = waitpid(-1, &ws, 0);
+        if (pid == -1) {
+            if (errno != EINTR) {
+                perror("waitpid");
+                exit(1);
+            }
+            continue;
+        }
+        for (int i = 0; i < n_workers; ++i) {
+            if (g_worker_pids[i] != pid) {
+                continue;
+            }
+            g_worker_pids[i] = 0;
+            --n_running;
+            if (WIFEXITED(ws) && !WEXITSTATUS(ws)) {
+                // it was asked to stop, so it isn't restarted
+                LOG_INFO("worker exited", {{"worker", i}, {"pid", pid}});
+            } else if (!g_workers_stopping) {
+                LOG_WARNING("worker crashed, restarting it", {
+                    {"worker", i},
+                    {"pid", pid},
+                    {"status", WIFSIGNALED(ws) ? strsignal(WTERMSIG(ws)) : std::to_string(WEXITSTATUS(ws))},
+                });
+                // one that can't stay up doesn't get to spin
+                if (ggml_time_ms() - started[i] < 1000) {
+                    sleep(1);
+                }
+            } else {
+                *status = 1;
+            }
+        }
+    }
+}
+
 int server_cli(int argc, char **argv)
 {
 #if SERVER_VERBOSE != 1
@@ -2881,21 +6638,9 @@ int server_cli(int argc, char **argv)
         server_state current_state = state.load();
         switch(current_state) {
             case SERVER_STATE_READY: {
-                // request slots data using task queue
-                task_server task;
-                task.id   = llama.queue_tasks.get_new_id();
-                task.type = TASK_TYPE_METRICS;
-                task.target_id = -1;
-
-                llama.queue_results.add_waiting_task_id(task.id);
-                llama.queue_tasks.post(task);
-
-                // get the result
-                task_result result = llama.queue_results.recv(task.id);
-                llama.queue_results.remove_waiting_task_id(task.id);
-
-                int n_idle_slots       = result.result_json["idle"];
-                int n_processing_slots = result.result_json["processing"];
+                const std::shared_ptr<const json> status = llama.get_status();
+                int n_idle_slots       = (*status)["idle"];
+                int n_processing_slots = (*status)["processing"];
 
                 json health = {
                         {"status",           "ok"},
@@ -2903,7 +6648,7 @@ int server_cli(int argc, char **argv)
                         {"slots_processing", n_processing_slots}};
                 res.status = 200; // HTTP OK
                 if (sparams.slots_endpoint && req.has_param("include_slots")) {
-                    health["slots"] = result.result_json["slots"];
+                    health["slots"] = (*status)["slots"];
                 }
 
                 if (n_idle_slots == 0) {
@@ -2928,40 +6673,33 @@ int server_cli(int argc, char **argv)
 
     if (sparams.slots_endpoint) {
         svr.Get("/slots", [&](const httplib::Request&, httplib::Response& res) {
-            // request slots data using task queue
-            task_server task;
-            task.id = llama.queue_tasks.get_new_id();
-            task.type = TASK_TYPE_METRICS;
-            task.target_id = -1;
-
-            llama.queue_results.add_waiting_task_id(task.id);
-            llama.queue_tasks.post(task);
-
-            // get the result
-            task_result result = llama.queue_results.recv(task.id);
-            llama.queue_results.remove_waiting_task_id(task.id);
+            const std::shared_ptr<const json> status = llama.get_status();
+            res.set_content((*status)["slots"].dump(), "application/json");
+            res.status = 200; // HTTP OK
+        });
+    }
 
-            res.set_content(result.result_json["slots"].dump(), "application/json");
+    if (llamafile_flight_enabled) {
+        svr.Get("/flight", [&](const httplib::Request&, httplib::Response& res) {
+            // read directly from the rings, so it's served even while
+            // the decode loop is busy
+            size_t len;
+            char *data = llamafile_flight_dump(&len);
+            if (!data) {
+                res.set_content(R"({"error": "out of memory"})", "application/json");
+                res.status = 500;
+                return;
+            }
+            res.set_content(data, len, "application/json");
+            free(data);
             res.status = 200; // HTTP OK
         });
     }
 
     if (sparams.metrics_endpoint) {
         svr.Get("/metrics", [&](const httplib::Request&, httplib::Response& res) {
-            // request slots data using task queue
-            task_server task;
-            task.id = llama.queue_tasks.get_new_id();
-            task.type = TASK_TYPE_METRICS;
-            task.target_id = -1;
-
-            llama.queue_results.add_waiting_task_id(task.id);
-            llama.queue_tasks.post(task);
-
-            // get the result
-            task_result result = llama.queue_results.recv(task.id);
-            llama.queue_results.remove_waiting_task_id(task.id);
-
-            json data = result.result_json;
+            const json data = *llama.get_status();
+            llama.metrics_scraped = true;
 
             uint64_t n_prompt_tokens_processed = data["n_prompt_tokens_processed"];
             uint64_t t_prompt_processing       = data["t_prompt_processing"];
@@ -2981,6 +6719,14 @@ int server_cli(int argc, char **argv)
                             {"name",  "tokens_predicted_total"},
                             {"help",  "Number of generation tokens processed."},
                             {"value",  data["n_tokens_predicted_total"]}
+                    }, {
+                            {"name",  "requests_rejected_total"},
+                            {"help",  "Number of requests turned away with 429 because the server was busy."},
+                            {"value",  data["n_requests_rejected"]}
+                    }, {
+                            {"name",  "requests_expired_total"},
+                            {"help",  "Number of requests that timed out waiting for a slot."},
+                            {"value",  data["n_requests_expired"]}
                     }}},
                     {"gauge", {{
                             {"name",  "prompt_tokens_seconds"},
@@ -3009,6 +6755,31 @@ int server_cli(int argc, char **argv)
                   }}}
             };
 
+            if (!data["energy_sources"].get<std::string>().empty()) {
+                const double j_prompt    = data["j_prompt"];
+                const double j_predicted = data["j_predicted"];
+                all_metrics_def["counter"].push_back({
+                        {"name",  "prompt_joules_total"},
+                        {"help",  "Joules the host consumed processing prompt tokens."},
+                        {"value",  data["j_prompt_total"]}
+                });
+                all_metrics_def["counter"].push_back({
+                        {"name",  "tokens_predicted_joules_total"},
+                        {"help",  "Joules the host consumed generating tokens."},
+                        {"value",  data["j_predicted_total"]}
+                });
+                all_metrics_def["gauge"].push_back({
+                        {"name",  "prompt_tokens_joule"},
+                        {"help",  "Average prompt efficiency in tokens/J."},
+                        {"value",  j_prompt > 0 ? n_prompt_tokens_processed / j_prompt : 0}
+                });
+                all_metrics_def["gauge"].push_back({
+                        {"name",  "predicted_tokens_joule"},
+                        {"help",  "Average generation efficiency in tokens/J."},
+                        {"value",  j_predicted > 0 ? n_tokens_predicted / j_predicted : 0}
+                });
+            }
+
             std::stringstream prometheus;
             for (const auto& el : all_metrics_def.items()) {
                 const auto& type = el.key();
@@ -3022,6 +6793,68 @@ int server_cli(int argc, char **argv)
                 }
             }
 
+            static const std::map<std::string, std::string> histograms_help = {
+                {"queue_wait_seconds",          "Time requests wait for a slot."},
+                {"time_to_first_token_seconds", "Time from request arrival to its first generated token."},
+                {"inter_token_seconds",         "Time between consecutive generated tokens of a request."},
+                {"decode_batch_tokens",         "Number of tokens per llama_decode() call."},
+                {"kv_cache_usage_ratio",        "KV-cache usage after each llama_decode() call."},
+            };
+            for (const auto& el : data["histograms"].items()) {
+                const std::string name = el.key();
+                const json& h = el.value();
+                const auto help = histograms_help.find(name);
+                prometheus << "# HELP llamacpp:" << name << " " << (help != histograms_help.end() ? help->second : name) << "\n"
+                           << "# TYPE llamacpp:" << name << " histogram\n";
+                uint64_t cumulative = 0;
+                for (size_t i = 0; i < h["counts"].size(); ++i) {
+                    cumulative += h["counts"][i].get<uint64_t>();
+                    prometheus << "llamacpp:" << name << "_bucket{le=\"";
+                    if (i < h["bounds"].size()) {
+                        prometheus << h["bounds"][i].get<double>();
+                    } else {
+                        prometheus << "+Inf";
+                    }
+                    prometheus << "\"} " << cumulative << "\n";
+                }
+                prometheus << "llamacpp:" << name << "_sum "   << h["sum"].get<double>()     << "\n"
+                           << "llamacpp:" << name << "_count " << h["count"].get<uint64_t>() << "\n";
+            }
+
+            if (llamafile_perf_enabled) {
+                // hardware counters summed over every thread, by phase and op
+                static const char * const counters_help[][2] = {
+                    {"cpu_op_calls_total",        "Number of times a thread ran the op."},
+                    {"cpu_op_seconds_total",      "Thread seconds spent in the op."},
+                    {"cpu_cycles_total",          "CPU cycles spent in the op."},
+                    {"cpu_instructions_total",    "Instructions retired in the op."},
+                    {"cpu_llc_misses_total",      "Last level cache misses in the op."},
+                    {"cpu_dtlb_misses_total",     "Data TLB read misses in the op."},
+                };
+                for (int c = 0; c < 6; ++c) {
+                    prometheus << "# HELP llamacpp:" << counters_help[c][0] << " " << counters_help[c][1] << "\n"
+                               << "# TYPE llamacpp:" << counters_help[c][0] << " counter\n";
+                    for (int phase = 0; phase < LLAMAFILE_PERF_PHASES; ++phase) {
+                        for (int op = 0; op < LLAMAFILE_PERF_OPS; ++op) {
+                            llamafile_perf_stats st;
+                            llamafile_perf_get(phase, op, &st);
+                            const unsigned long long values[6] = {
+                                st.calls, 0, st.cycles, st.instructions, st.llc_misses, st.dtlb_misses,
+                            };
+                            prometheus << "llamacpp:" << counters_help[c][0]
+                                       << "{phase=\"" << llamafile_perf_phase_name(phase)
+                                       << "\",op=\"" << llamafile_perf_op_name(op) << "\"} ";
+                            if (c == 1) {
+                                prometheus << st.time_ns / 1e9;
+                            } else {
+                                prometheus << values[c];
+                            }
+                            prometheus << "\n";
+                        }
+                    }
+                }
+            }
+
             res.set_content(prometheus.str(), "text/plain; version=0.0.4");
             res.status = 200; // HTTP OK
         });
@@ -3066,22 +6899,140 @@ int server_cli(int argc, char **argv)
                 }
             });
 
+    llama.prefix_cache.n_max = sparams.n_prefix_cache;
+    llama.prefix_cache.store.dir = sparams.prefix_cache_dir;
+    llama.prefix_cache.store.n_bytes_max = (size_t) std::max(sparams.n_prefix_cache_disk, 0) << 20;
+    llama.preempt_pool = (size_t) std::max(sparams.n_preempt_pool, 0) << 20;
+    llama.image_cache.n_max = std::max(0, sparams.n_image_cache);
+    llama.embd_cache.n_max = std::max(0, sparams.n_embd_cache);
+    llama.sync_images = sparams.sync_images;
+    llama.n_queue_max = sparams.n_queue_max;
+    llama.queue_timeout = sparams.queue_timeout;
+    llama.slot_prompt_similarity = sparams.slot_prompt_similarity;
+    llama.n_prefill_chunk = sparams.n_prefill_chunk;
+    llama.n_logits_top_k = sparams.n_logits_top_k;
+    llama.n_layer_draft = sparams.n_layer_draft;
+    llama.n_lookup_ngram = sparams.n_lookup_ngram;
+    llama.jump_forward = sparams.jump_forward;
+    llama.dynamic_slots = sparams.dynamic_slots;
+    llama.tune_ubatch = sparams.tune_ubatch;
+    llama.n_slot_reserve = sparams.n_slot_reserve;
+    llama.n_shift_block = std::max(0, sparams.n_shift_block);
+    llama.n_attn_sinks = std::max(0, sparams.n_attn_sinks);
+    llama.metrics.init(sparams.metrics_latency_buckets, params.n_batch);
+
+    // a snapshot from the last run of this model remembers what the
+    // physical batch size was tuned to, so it needn't be probed again
+    json snapshot;
+    if (!sparams.snapshot_path.empty())
+    {
+        std::ifstream in(sparams.snapshot_path);
+        if (in)
+        {
+            snapshot = json::parse(in, nullptr, false);
+        }
+        if (snapshot.is_discarded() || !snapshot.is_object() ||
+            json_value(snapshot, "model", std::string()) != params.model ||
+            json_value(snapshot, "n_batch", 0) != params.n_batch)
+        {
+            snapshot = json();
+        }
+        else if (llama.tune_ubatch && json_value(snapshot, "n_ubatch", 0) > 0)
+        {
+            params.n_ubatch = json_value(snapshot, "n_ubatch", 0);
+            llama.tune_ubatch = false;
+        }
+    }
+
+    // open the energy counters while the sandbox still lets us
+    if (llamafile_energy() >= 0)
+    {
+        LOG_INFO("measuring energy", {{"sources", llamafile_energy_sources()}});
+    }
+
     // load the model
     if (!llama.load_model(params))
     {
         state.store(SERVER_STATE_ERROR);
         return 1;
     } else {
-        llama.initialize();
-        state.store(SERVER_STATE_READY);
-        LOG_INFO("model loaded", {});
+        for (const std::string &path : sparams.lora_runtime)
+        {
+            llama_lora_adapter *adapter = llama_lora_adapter_init(llama.model, path.c_str());
+            if (!adapter)
+            {
+                LOG_ERROR("unable to load lora adapter", {{"path", path}});
+                state.store(SERVER_STATE_ERROR);
+                return 1;
+            }
+            llama.lora_adapters.push_back(adapter);
+        }
+        for (const std::string &path : sparams.control_vector_runtime)
+        {
+            llama_control_vector_data cvec = llama_control_vector_load({{1.0f, path}});
+            if (cvec.n_embd != llama_n_embd(llama.model))
+            {
+                LOG_ERROR("unable to load control vector", {{"path", path}});
+                state.store(SERVER_STATE_ERROR);
+                return 1;
+            }
+            llama.control_vectors.push_back(std::move(cvec));
+        }
+    }
+
+    if (!sparams.models_dir.empty())
+    {
+        if (llama.multimodal || llama.ctx_dft || sparams.n_layer_draft > 0 || !sparams.snapshot_path.empty())
+        {
+            LOG_ERROR("--models-dir can't be used with --mmproj, --model-draft, --draft-layers or --snapshot", {});
+            state.store(SERVER_STATE_ERROR);
+            return 1;
+        }
+        llama.models.mparams = llama_model_params_from_gpt_params(params);
+        llama.models.budget = (size_t) std::max(sparams.n_models_budget, 0) << 20;
+        const int n_models = llama.models.scan(sparams.models_dir);
+        if (n_models < 0)
+        {
+            LOG_ERROR("unable to open models directory", {{"path", sparams.models_dir}, {"error", strerror(errno)}});
+            state.store(SERVER_STATE_ERROR);
+            return 1;
+        }
+        LOG_INFO("models registered", {{"path", sparams.models_dir}, {"n_models", n_models}});
+    }
+
+    if (sparams.n_workers > 1)
+    {
+        if (llamafile_has_gpu())
+        {
+            LOG_ERROR("--workers can't be used with a gpu", {});
+            return 1;
+        }
+        if (!sparams.snapshot_path.empty() || llamafile_flight_enabled)
+        {
+            LOG_ERROR("--workers can't be used with --snapshot or --flight-recorder", {});
+            return 1;
+        }
     }
 
     // set timeouts and change hostname and port
     svr.set_read_timeout (sparams.read_timeout);
     svr.set_write_timeout(sparams.write_timeout);
 
-    for (int i = 0;; ++i) {
+    if (!sparams.unix_socket.empty()) {
+        // a socket file left behind by an earlier run would fail the bind
+        struct stat st;
+        if (!stat(sparams.unix_socket.c_str(), &st) && S_ISSOCK(st.st_mode)) {
+            unlink(sparams.unix_socket.c_str());
+        }
+        svr.set_address_family(AF_UNIX);
+        if (!svr.bind_to_port(sparams.unix_socket, sparams.port)) {
+            fprintf(stderr, "\ncouldn't bind to unix socket: %s\n\n", sparams.unix_socket.c_str());
+            return 1;
+        }
+        sparams.nobrowser = true;
+    }
+
+    for (int i = 0; sparams.unix_socket.empty(); ++i) {
         if (svr.bind_to_port(sparams.hostname, sparams.port)) {
             break;
         } else if (i < 10) {
@@ -3096,9 +7047,10 @@ int server_cli(int argc, char **argv)
     svr.set_base_dir(sparams.public_path);
 
     // to make it ctrl+clickable:
-    const char *connect_host;
-    if (sparams.hostname != "0.0.0.0") {
-        connect_host = sparams.hostname.c_str();
+    const char *connect_host = sparams.hostname.c_str();
+    if (!sparams.unix_socket.empty()) {
+        LOG_TEE("\nllama server listening at unix:%s\n\n", sparams.unix_socket.c_str());
+    } else if (sparams.hostname != "0.0.0.0") {
         LOG_TEE("\nllama server listening at http://%s:%d\n\n",
                 sparams.hostname.c_str(), sparams.port);
     } else {
@@ -3124,8 +7076,12 @@ int server_cli(int argc, char **argv)
     }
 
     std::unordered_map<std::string, std::string> log_data;
-    log_data["hostname"] = sparams.hostname;
-    log_data["port"] = std::to_string(sparams.port);
+    if (!sparams.unix_socket.empty()) {
+        log_data["unix_socket"] = sparams.unix_socket;
+    } else {
+        log_data["hostname"] = sparams.hostname;
+        log_data["port"] = std::to_string(sparams.port);
+    }
 
     if (sparams.api_keys.size() == 1) {
         log_data["api_key"] = "api_key: ****" + sparams.api_keys[0].substr(sparams.api_keys[0].length() - 4);
@@ -3140,6 +7096,48 @@ int server_cli(int argc, char **argv)
         llamafile_launch_browser(url);
     }
 
+    char promises[64];
+    server_promises(sparams, promises, sizeof(promises));
+    const bool sandboxed = !FLAG_unsecure && !IsXnu() && !llamafile_has_gpu();
+    if (sandboxed) {
+        __pledge_mode = PLEDGE_PENALTY_RETURN_EPERM;
+    }
+
+    int worker = 0;
+    if (sparams.n_workers > 1)
+    {
+        int status;
+        worker = server_prefork(sparams.n_workers, sandboxed && !pledge(0, 0) ? promises : nullptr, &status);
+        if (worker == -1)
+        {
+            if (!sparams.unix_socket.empty())
+            {
+                unlink(sparams.unix_socket.c_str());
+            }
+            return status;
+        }
+        log_data["worker"] = std::to_string(worker);
+    }
+
+    // the threads of the server are started once we've forked
+    if (sparams.n_stream_threads > 0 &&
+        !llama.streams.start(sparams.n_stream_threads, [&llama](int task_id) {
+            llama.request_cancel(task_id);
+            llama.queue_results.remove_waiting_task_id(task_id);
+        }))
+    {
+        LOG_ERROR("failed to start stream threads", {});
+        return 1;
+    }
+    llama.initialize();
+    if (snapshot.is_object())
+    {
+        llama.restore_snapshot(sparams.snapshot_path, snapshot);
+    }
+    llama.publish_status(ggml_time_us());
+    state.store(SERVER_STATE_READY);
+    LOG_INFO("model loaded", {});
+
     if (!FLAG_unsecure) {
         if (IsXnu()) {
             // Cosmopolitan libc explicitly does not support cosmo_dlopen on x64
@@ -3178,16 +7176,7 @@ int server_cli(int argc, char **argv)
             // - Filesystem access is disabled entirely (except ZipOS).
             // - On Linux, network access is restricted to accept() only.
             // Cosmopolitan Libc implements pledge() on Linux using SECCOMP.
-            char promises[32];
-            if (IsOpenbsd()) {
-                strlcpy(promises, "stdio inet", sizeof(promises));
-            } else {
-                strlcpy(promises, "stdio anet", sizeof(promises));
-            }
-            if (!startswith(sparams.public_path.c_str(), "/zip/")) {
-                strlcat(promises, " rpath", sizeof(promises));
-            }
-            __pledge_mode = PLEDGE_PENALTY_RETURN_EPERM;
+            // - With --workers, each worker does this after it's forked.
             if (pledge(0, 0)) {
                 LOG_TEE("warning: this OS doesn't support pledge() security\n");
             } else if (pledge(promises, 0)) {
@@ -3253,20 +7242,109 @@ int server_cli(int argc, char **argv)
                 res.set_content(data.dump(), "application/json; charset=utf-8");
             });
 
+    if (sparams.slots_endpoint) {
+        svr.Post(R"(/slots/(\d+))", [&](const httplib::Request &req, httplib::Response &res) {
+            res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
+            if (!validate_api_key(req, res)) {
+                return;
+            }
+            const std::string action = req.get_param_value("action");
+            task_server task;
+            task.target_id = std::stoi(req.matches[1]);
+            task.data = { { "action", action } };
+            if (action == "save" || action == "restore") {
+                if (sparams.slot_save_path.empty()) {
+                    res.status = 501; // HTTP Not Implemented
+                    res.set_content("slots can only be saved when --slot-save-path is set", "text/plain; charset=utf-8");
+                    return;
+                }
+                const json body = req.body.empty() ? json::object() : json::parse(req.body);
+                const std::string filename = json_value(body, "filename", std::string());
+                if (!validate_file_name(filename)) {
+                    res.status = 400; // HTTP Bad Request
+                    res.set_content("invalid filename", "text/plain; charset=utf-8");
+                    return;
+                }
+                task.type = action == "save" ? TASK_TYPE_SLOT_SAVE : TASK_TYPE_SLOT_RESTORE;
+                task.data["filename"] = filename;
+                task.data["filepath"] = sparams.slot_save_path + filename;
+            } else if (action == "erase") {
+                task.type = TASK_TYPE_SLOT_ERASE;
+            } else if (action == "export" || action == "import") {
+                if (!sparams.slot_transfer) {
+                    res.status = 501; // HTTP Not Implemented
+                    res.set_content("slots can only be exported and imported when --slot-transfer is set", "text/plain; charset=utf-8");
+                    return;
+                }
+                if (action == "export") {
+                    task.type = TASK_TYPE_SLOT_EXPORT;
+                } else {
+                    task.type = TASK_TYPE_SLOT_IMPORT;
+                    task.blob = req.body;
+                }
+            } else {
+                res.status = 400; // HTTP Bad Request
+                res.set_content("action must be save, restore, erase, export or import", "text/plain; charset=utf-8");
+                return;
+            }
+
+            task.id = llama.queue_tasks.get_new_id();
+            llama.queue_results.add_waiting_task_id(task.id);
+            llama.queue_tasks.post(task);
+
+            task_result result = llama.queue_results.recv(task.id);
+            llama.queue_results.remove_waiting_task_id(task.id);
+
+            if (result.error) {
+                res.status = task.target_id < (int) llama.slots.size() ? 500 : 404;
+                res.set_content(result.result_json["content"], "text/plain; charset=utf-8");
+                return;
+            }
+            if (task.type == TASK_TYPE_SLOT_EXPORT) {
+                // streamed in pieces from the http thread, so the main loop
+                // only pays for copying the cells out of the kv cache
+                auto blob = std::make_shared<std::string>(std::move(result.blob));
+                res.set_header("X-Slot-Tokens", std::to_string(json_value(result.result_json, "n_exported", 0)));
+                res.set_content_provider(blob->size(), "application/octet-stream",
+                    [blob](size_t offset, size_t length, httplib::DataSink &sink) {
+                        return sink.write(blob->data() + offset, std::min(length, (size_t) SLOT_EXPORT_CHUNK));
+                    });
+                return;
+            }
+            res.set_content(result.result_json.dump(), "application/json");
+        });
+    }
+
     svr.Post("/completion", [&llama, &validate_api_key](const httplib::Request &req, httplib::Response &res)
             {
                 res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
                 if (!validate_api_key(req, res)) {
                     return;
                 }
-                json data = json::parse(req.body);
+                json data = parse_request_body(req.body);
+                if (reject_if_overloaded(llama, data, res)) {
+                    return;
+                }
+                const int n_choices = std::max(json_value(data, "n", 1), 1);
+                const bool stream = json_value(data, "stream", false);
                 const int task_id = llama.queue_tasks.get_new_id();
                 llama.queue_results.add_waiting_task_id(task_id);
-                llama.request_completion(task_id, data, false, false, -1);
-                if (!json_value(data, "stream", false)) {
+                llama.request_completion(task_id, std::move(data), false, false, -1);
+                if (!stream) {
                     std::string completion_text;
-                    task_result result = llama.queue_results.recv(task_id);
-                    if (!result.error && result.stop) {
+                    std::vector<task_result> results = llama.queue_results.recv_choices(task_id, n_choices, req.is_connection_closed);
+                    if (results.empty()) {
+                        return abandon_task(llama, task_id);
+                    }
+                    task_result result = results[0];
+                    if (!result.error && result.stop && n_choices > 1) {
+                        json choices = json::array();
+                        for (const task_result &choice : results) {
+                            choices.push_back(choice.result_json);
+                        }
+                        res.set_content(json{{"results", choices}}.dump(-1, ' ', false, json::error_handler_t::replace), "application/json; charset=utf-8");
+                    }
+                    else if (!result.error && result.stop) {
                         res.set_content(result.result_json.dump(-1, ' ', false, json::error_handler_t::replace), "application/json; charset=utf-8");
                     }
                     else
@@ -3276,61 +7354,11 @@ int server_cli(int argc, char **argv)
                     }
                     llama.queue_results.remove_waiting_task_id(task_id);
                 } else {
-                    const auto chunked_content_provider = [task_id, &llama](size_t, httplib::DataSink & sink)
-                    {
-                        while (true)
-                        {
-                            task_result result = llama.queue_results.recv(task_id);
-                            if (!result.error) {
-                                const std::string str =
-                                    "data: " +
-                                    result.result_json.dump(-1, ' ', false, json::error_handler_t::replace) +
-                                    "\n\n";
-                                LOG_VERBOSE("data stream", {
-                                    { "to_send", str }
-                                });
-                                if (!sink.write(str.c_str(), str.size()))
-                                {
-                                    llama.queue_results.remove_waiting_task_id(task_id);
-                                    return false;
-                                }
-                                if (result.stop) {
-                                    break;
-                                }
-                            } else {
-                                const std::string str =
-                                    "error: " +
-                                    result.result_json.dump(-1, ' ', false, json::error_handler_t::replace) +
-                                    "\n\n";
-                                LOG_VERBOSE("data stream", {
-                                    { "to_send", str }
-                                });
-                                if (!sink.write(str.c_str(), str.size()))
-                                {
-                                    llama.queue_results.remove_waiting_task_id(task_id);
-                                    return false;
-                                }
-                                break;
-                            }
-                        }
-
-                        llama.queue_results.remove_waiting_task_id(task_id);
-                        sink.done();
-                        return true;
-                    };
-
-                    auto on_complete = [task_id, &llama] (bool)
-                    {
-                        // cancel
-                        llama.request_cancel(task_id);
-                        llama.queue_results.remove_waiting_task_id(task_id);
-                    };
-
-                    res.set_chunked_content_provider("text/event-stream", chunked_content_provider, on_complete);
+                    set_stream_response(req, res, llama, task_id, completion_stream_format(n_choices));
                 }
             });
 
-    svr.Get("/v1/models", [&params](const httplib::Request& req, httplib::Response& res)
+    svr.Get("/v1/models", [&params, &llama](const httplib::Request& req, httplib::Response& res)
             {
                 res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
                 std::time_t t = std::time(0);
@@ -3346,6 +7374,15 @@ int server_cli(int argc, char **argv)
                         },
                     }}
                 };
+                for (const std::string &name : llama.models.names())
+                {
+                    models["data"].push_back({
+                        {"id", name},
+                        {"object", "model"},
+                        {"created", t},
+                        {"owned_by", "llamacpp"}
+                    });
+                }
 
                 res.set_content(models.dump(), "application/json; charset=utf-8");
             });
@@ -3358,7 +7395,14 @@ int server_cli(int argc, char **argv)
                 if (!validate_api_key(req, res)) {
                     return;
                 }
-                json data = oaicompat_completion_params_parse(llama.model, json::parse(req.body), sparams.chat_template);
+                // the chat template is that of the model the request names
+                json body = json::parse(req.body);
+                std::shared_ptr<llama_model> model = llama.models.acquire(json_value(body, "model", std::string()));
+                json data = oaicompat_completion_params_parse(model ? model.get() : llama.model_main, body, sparams.chat_template);
+                if (reject_if_overloaded(llama, data, res)) {
+                    return;
+                }
+                const int n_choices = std::max(json_value(data, "n", 1), 1);
 
                 const int task_id = llama.queue_tasks.get_new_id();
                 llama.queue_results.add_waiting_task_id(task_id);
@@ -3366,10 +7410,14 @@ int server_cli(int argc, char **argv)
 
                 if (!json_value(data, "stream", false)) {
                     std::string completion_text;
-                    task_result result = llama.queue_results.recv(task_id);
+                    std::vector<task_result> results = llama.queue_results.recv_choices(task_id, n_choices, req.is_connection_closed);
+                    if (results.empty()) {
+                        return abandon_task(llama, task_id);
+                    }
+                    task_result result = results[0];
 
                     if (!result.error && result.stop) {
-                        json oaicompat_result = format_final_response_oaicompat(data, result);
+                        json oaicompat_result = format_final_response_oaicompat(data, results);
 
                         res.set_content(oaicompat_result.dump(-1, ' ', false,
                                             json::error_handler_t::replace),
@@ -3380,55 +7428,7 @@ int server_cli(int argc, char **argv)
                     }
                     llama.queue_results.remove_waiting_task_id(task_id);
                 } else {
-                    const auto chunked_content_provider = [task_id, &llama](size_t, httplib::DataSink &sink) {
-                        while (true) {
-                            task_result llama_result = llama.queue_results.recv(task_id);
-                            if (!llama_result.error) {
-                                std::vector<json> result_array = format_partial_response_oaicompat( llama_result);
-
-                                for (auto it = result_array.begin(); it != result_array.end(); ++it)
-                                {
-                                    if (!it->empty()) {
-                                        const std::string str =
-                                            "data: " +
-                                            it->dump(-1, ' ', false, json::error_handler_t::replace) +
-                                            "\n\n";
-                                        LOG_VERBOSE("data stream", {{"to_send", str}});
-                                        if (!sink.write(str.c_str(), str.size())) {
-                                            llama.queue_results.remove_waiting_task_id(task_id);
-                                            return false;
-                                        }
-                                    }
-                                }
-                                if (llama_result.stop) {
-                                    break;
-                                }
-                            } else {
-                                const std::string str =
-                                    "error: " +
-                                    llama_result.result_json.dump(-1, ' ', false,
-                                            json::error_handler_t::replace) +
-                                    "\n\n";
-                                LOG_VERBOSE("data stream", {{"to_send", str}});
-                                if (!sink.write(str.c_str(), str.size())) {
-                                    llama.queue_results.remove_waiting_task_id(task_id);
-                                    return false;
-                                }
-                                break;
-                            }
-                        }
-                        sink.done();
-                        llama.queue_results.remove_waiting_task_id(task_id);
-                        return true;
-                    };
-
-                    auto on_complete = [task_id, &llama](bool) {
-                        // cancel request
-                        llama.request_cancel(task_id);
-                        llama.queue_results.remove_waiting_task_id(task_id);
-                    };
-
-                    res.set_chunked_content_provider("text/event-stream", chunked_content_provider, on_complete);
+                    set_stream_response(req, res, llama, task_id, chat_stream_format(n_choices));
                 }
             });
 
@@ -3439,12 +7439,19 @@ int server_cli(int argc, char **argv)
                     return;
                 }
                 json data = json::parse(req.body);
+                if (reject_if_overloaded(llama, data, res)) {
+                    return;
+                }
+                data.erase("n"); // infill only has one choice
                 const int task_id = llama.queue_tasks.get_new_id();
                 llama.queue_results.add_waiting_task_id(task_id);
                 llama.request_completion(task_id, data, true, false, -1);
                 if (!json_value(data, "stream", false)) {
                     std::string completion_text;
-                    task_result result = llama.queue_results.recv(task_id);
+                    task_result result;
+                    if (!llama.queue_results.recv(task_id, result, req.is_connection_closed)) {
+                        return abandon_task(llama, task_id);
+                    }
                     if (!result.error && result.stop)
                     {
                         res.set_content(result.result_json.dump(-1, ' ', false, json::error_handler_t::replace), "application/json; charset=utf-8");
@@ -3456,46 +7463,7 @@ int server_cli(int argc, char **argv)
                     }
                     llama.queue_results.remove_waiting_task_id(task_id);
                 } else {
-                    const auto chunked_content_provider = [task_id, &llama](size_t, httplib::DataSink & sink) {
-                        while (true)
-                        {
-                            task_result result = llama.queue_results.recv(task_id);
-                            if (!result.error) {
-                                const std::string str =
-                                "data: " +
-                                result.result_json.dump(-1, ' ', false, json::error_handler_t::replace) +
-                                "\n\n";
-                                LOG_VERBOSE("data stream", {
-                                    { "to_send", str }
-                                });
-                                if (!sink.write(str.c_str(), str.size()))
-                                {
-                                    llama.queue_results.remove_waiting_task_id(task_id);
-                                    return false;
-                                }
-                                if (result.stop)
-                                {
-                                    break;
-                                }
-                            }
-                            else
-                            {
-                                break;
-                            }
-                        }
-
-                        llama.queue_results.remove_waiting_task_id(task_id);
-                        sink.done();
-                        return true;
-                    };
-
-                    auto on_complete = [task_id, &llama] (bool)
-                    {
-                        // cancel
-                        llama.request_cancel(task_id);
-                    };
-
-                    res.set_chunked_content_provider("text/event-stream", chunked_content_provider, on_complete);
+                    set_stream_response(req, res, llama, task_id, infill_stream_format());
                 }
             });
 
@@ -3509,7 +7477,7 @@ int server_cli(int argc, char **argv)
                 std::vector<llama_token> tokens;
                 if (body.count("content") != 0)
                 {
-                    tokens = llama.tokenize(body["content"], false);
+                    tokens = llama.tokenize(llama.ctx_main, body["content"], false);
                 }
                 const json data = format_tokenizer_response(tokens);
                 return res.set_content(data.dump(), "application/json; charset=utf-8");
@@ -3523,7 +7491,7 @@ int server_cli(int argc, char **argv)
                 if (body.count("tokens") != 0)
                 {
                     const std::vector<llama_token> tokens = body["tokens"];
-                    content = tokens_to_str(llama.ctx, tokens.cbegin(), tokens.cend());
+                    content = tokens_to_str(llama.ctx_main, tokens.cbegin(), tokens.cend());
                 }
 
                 const json data = format_detokenized_response(content);
@@ -3533,7 +7501,10 @@ int server_cli(int argc, char **argv)
     svr.Post("/embedding", [&llama](const httplib::Request &req, httplib::Response &res)
             {
                 res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
-                const json body = json::parse(req.body);
+                json body = parse_request_body(req.body);
+                if (reject_if_overloaded(llama, body, res)) {
+                    return;
+                }
                 json prompt;
                 if (body.count("content") != 0)
                 {
@@ -3546,84 +7517,114 @@ int server_cli(int argc, char **argv)
 
                 json image_data;
                 if (body.count("image_data") != 0) {
-                    image_data = body["image_data"];
+                    image_data = std::move(body["image_data"]);
                 }
                 else
                 {
                     image_data = "";
                 }
 
-                // create and queue the task
-                const int task_id = llama.queue_tasks.get_new_id();
-                llama.queue_results.add_waiting_task_id(task_id);
-                llama.request_completion(task_id, { {"prompt", prompt}, { "n_predict", 0}, {"image_data", image_data} }, false, true, -1);
+                embd_format fmt;
+                std::string err;
+                if (!parse_embd_format(body, fmt, err)) {
+                    res.status = 400;
+                    return res.set_content(err, "text/plain; charset=utf-8");
+                }
 
-                // get the result
-                task_result result = llama.queue_results.recv(task_id);
-                llama.queue_results.remove_waiting_task_id(task_id);
+                const bool multi = is_multi_input(prompt);
+                std::vector<std::vector<float>> embds;
+                if (!compute_embeddings(llama, multi ? prompt : json::array({prompt}), std::move(image_data), embds, err)) {
+                    res.status = 500;
+                    return res.set_content(err, "text/plain; charset=utf-8");
+                }
 
-                // send the result
-                return res.set_content(result.result_json.dump(), "application/json; charset=utf-8");
+                std::string out;
+                json_writer w(out);
+                w.begin_object();
+                if (multi) {
+                    w.key("results").begin_array();
+                    for (const auto &embd : embds) {
+                        w.begin_object();
+                        write_embedding(w, embd, fmt);
+                        w.end_object();
+                    }
+                    w.end_array();
+                } else {
+                    write_embedding(w, embds[0], fmt);
+                }
+                w.end_object();
+                return res.set_content(out, "application/json; charset=utf-8");
             });
 
-    svr.Post("/v1/embeddings", [&llama](const httplib::Request &req, httplib::Response &res)
+    svr.Post("/score", [&llama, &validate_api_key](const httplib::Request &req, httplib::Response &res)
             {
                 res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
-                const json body = json::parse(req.body);
-
-                json prompt;
-                if (body.count("input") != 0)
-                {
-                    prompt = body["input"];
-                    // batch
-                    if(prompt.is_array()) {
-                        json data = json::array();
-                        int i = 0;
-                        for (const json &elem : prompt) {
-                            const int task_id = llama.queue_tasks.get_new_id();
-                            llama.queue_results.add_waiting_task_id(task_id);
-                            llama.request_completion(task_id, { {"prompt", elem}, { "n_predict", 0} }, false, true, -1);
-
-                            // get the result
-                            task_result result = llama.queue_results.recv(task_id);
-                            llama.queue_results.remove_waiting_task_id(task_id);
-
-                            json embedding = json{
-                                {"embedding", json_value(result.result_json, "embedding", json::array())},
-                                {"index", i++},
-                                {"object", "embedding"}
-                            };
-                            data.push_back(embedding);
-                        }
-                        json result = format_embeddings_response_oaicompat(body, data);
-                        return res.set_content(result.dump(), "application/json; charset=utf-8");
-                    }
+                if (!validate_api_key(req, res)) {
+                    return;
                 }
-                else
-                {
-                    prompt = "";
+                if (llama.params.embedding) {
+                    res.status = 501; // HTTP Not Implemented
+                    return res.set_content("scoring needs logits, which aren't computed with --embedding", "text/plain; charset=utf-8");
+                }
+                json body = parse_request_body(req.body);
+                json documents = json_value(body, "documents", json::array());
+                if (!body.contains("query") || !documents.is_array() || documents.empty()) {
+                    res.status = 400; // HTTP Bad Request
+                    return res.set_content("query and a non-empty array of documents are required", "text/plain; charset=utf-8");
                 }
 
-                // create and queue the task
                 const int task_id = llama.queue_tasks.get_new_id();
                 llama.queue_results.add_waiting_task_id(task_id);
-                llama.request_completion(task_id, { {"prompt", prompt}, { "n_predict", 0}}, false, true, -1);
-
-                // get the result
+                llama.request_score(task_id, std::move(body["query"]), std::move(documents));
                 task_result result = llama.queue_results.recv(task_id);
                 llama.queue_results.remove_waiting_task_id(task_id);
+                if (result.error) {
+                    res.status = 500;
+                    return res.set_content(result.result_json["content"], "text/plain; charset=utf-8");
+                }
+                return res.set_content(result.result_json.dump(), "application/json; charset=utf-8");
+            });
 
-                json data = json::array({json{
-                        {"embedding", json_value(result.result_json, "embedding", json::array())},
-                        {"index", 0},
-                        {"object", "embedding"}
-                    }}
-                );
+    svr.Post("/v1/embeddings", [&llama](const httplib::Request &req, httplib::Response &res)
+            {
+                res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
+                const json body = json::parse(req.body);
 
-                json root = format_embeddings_response_oaicompat(body, data);
+                embd_format fmt;
+                std::string err;
+                if (!parse_embd_format(body, fmt, err)) {
+                    res.status = 400;
+                    return res.set_content(err, "text/plain; charset=utf-8");
+                }
+
+                const json prompt = json_value(body, "input", json(""));
+                std::vector<std::vector<float>> embds;
+                if (!compute_embeddings(llama, is_multi_input(prompt) ? prompt : json::array({prompt}), "", embds, err)) {
+                    res.status = 500;
+                    return res.set_content(err, "text/plain; charset=utf-8");
+                }
 
-                // send the result
-                return res.set_content(root.dump(), "application/json; charset=utf-8");
+                // same as format_embeddings_response_oaicompat(), without the document
+                std::string out;
+                json_writer w(out);
+                w.begin_object();
+                w.key("data").begin_array();
+                for (size_t i = 0; i < embds.size(); ++i) {
+                    w.begin_object();
+                    write_embedding(w, embds[i], fmt);
+                    w.field("index", i);
+                    w.field("object", "embedding");
+                    w.end_object();
+                }
+                w.end_array();
+                w.field("model", json_value(body, "model", std::string(DEFAULT_OAICOMPAT_MODEL)));
+                w.field("object", "list");
+                w.key("usage").begin_object();
+                w.field("prompt_tokens", 0);
+                w.field("total_tokens", 0);
+                w.end_object();
+                w.end_object();
+                return res.set_content(out, "application/json; charset=utf-8");
             });
 
     // GG: if I put the main loop inside a thread, it crashes on the first request when build in Debug!?
@@ -3662,6 +7663,11 @@ int server_cli(int argc, char **argv)
     sigemptyset (&sigint_action.sa_mask);
     sigint_action.sa_flags = 0;
     sigaction(SIGINT, &sigint_action, NULL);
+    if (!sparams.snapshot_path.empty())
+    {
+        // rolling deploys stop us with sigterm, which must not lose it
+        sigaction(SIGTERM, &sigint_action, NULL);
+    }
 #elif defined (_WIN32)
     auto console_ctrl_handler = +[](DWORD ctrl_type) -> BOOL {
         return (ctrl_type == CTRL_C_EVENT) ? (signal_handler(SIGINT), true) : false;
@@ -3672,6 +7678,17 @@ int server_cli(int argc, char **argv)
     svr.stop();
     t.join();
 
+    // the socket is the parent's to remove, once its workers are gone
+    if (!sparams.unix_socket.empty() && sparams.n_workers == 1)
+    {
+        unlink(sparams.unix_socket.c_str());
+    }
+
+    if (!sparams.snapshot_path.empty())
+    {
+        llama.save_snapshot(sparams.snapshot_path);
+    }
+
     llama_backend_free();
     return 0;
 }
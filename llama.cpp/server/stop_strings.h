@@ -0,0 +1,130 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+
+#pragma once
+
+#include <array>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+//
+// stop strings
+//
+// An Aho-Corasick automaton over the bytes of a request's stop strings,
+// which is fed each piece once as it's generated. That finds both full
+// matches, and the longest suffix of the text that might turn into one,
+// without searching the generated text again on every token.
+//
+// Text before `floor`, i.e. what was already sent to the client, never
+// takes part in a match.
+//
+
+struct server_stop_strings {
+    struct node {
+        std::array<int, 256> next; // transitions, already following failure links
+        int fail = 0;              // longest proper suffix that's also a node
+        int output = -1;           // nearest node on the failure chain ending a word
+        int word = -1;             // index of word ending at this node
+        uint32_t depth = 0;
+    };
+
+    std::vector<node> nodes; // nodes[0] is the root
+    std::vector<std::string> words;
+
+    int state = 0;
+    size_t n_fed = 0;                    // bytes of text seen so far
+    size_t match_pos = std::string::npos; // earliest full match not yet reported
+    int match_word = -1;
+
+    void init(const std::vector<std::string> & words_) {
+        words = words_;
+        nodes.assign(1, node());
+        nodes[0].next.fill(-1);
+        for (size_t w = 0; w < words.size(); ++w) {
+            int v = 0;
+            for (unsigned char c : words[w]) {
+                if (nodes[v].next[c] == -1) {
+                    nodes[v].next[c] = nodes.size();
+                    nodes.push_back(node());
+                    nodes.back().next.fill(-1);
+                    nodes.back().depth = nodes[v].depth + 1;
+                }
+                v = nodes[v].next[c];
+            }
+            if (v && nodes[v].word == -1) {
+                nodes[v].word = w;
+            }
+        }
+        // breadth first, so failure links point at nodes that are done
+        std::vector<int> queue;
+        for (int c = 0; c < 256; ++c) {
+            int u = nodes[0].next[c];
+            if (u == -1) {
+                nodes[0].next[c] = 0;
+            } else {
+                queue.push_back(u);
+            }
+        }
+        for (size_t i = 0; i < queue.size(); ++i) {
+            int v = queue[i];
+            const node & f = nodes[nodes[v].fail];
+            nodes[v].output = f.word != -1 ? nodes[v].fail : f.output;
+            for (int c = 0; c < 256; ++c) {
+                int u = nodes[v].next[c];
+                if (u == -1) {
+                    nodes[v].next[c] = nodes[nodes[v].fail].next[c];
+                } else {
+                    nodes[u].fail = nodes[nodes[v].fail].next[c];
+                    queue.push_back(u);
+                }
+            }
+        }
+        reset();
+    }
+
+    void reset() {
+        state = 0;
+        n_fed = 0;
+        match_pos = std::string::npos;
+        match_word = -1;
+    }
+
+    // consumes generated piece, remembering the earliest full match
+    void feed(const char * text, size_t size, size_t floor) {
+        if (words.empty()) {
+            n_fed += size;
+            return;
+        }
+        for (size_t i = 0; i < size; ++i) {
+            state = nodes[state].next[(unsigned char)text[i]];
+            ++n_fed;
+            int v = nodes[state].word != -1 ? state : nodes[state].output;
+            // longest word first, so the first one past the floor starts earliest
+            for (; v != -1; v = nodes[v].output) {
+                size_t pos = n_fed - nodes[v].depth;
+                if (pos >= floor) {
+                    // ties go to whichever word the request listed first
+                    if (pos < match_pos || (pos == match_pos && nodes[v].word < match_word)) {
+                        match_pos = pos;
+                        match_word = nodes[v].word;
+                    }
+                    break;
+                }
+            }
+        }
+    }
+
+    // returns offset in text of earliest full match, or npos
+    size_t full_match() const {
+        return match_pos;
+    }
+
+    // returns offset in text where a stop string might be starting, or npos
+    size_t partial_match(size_t floor) {
+        while (state && nodes[state].depth > n_fed - floor) {
+            state = nodes[state].fail;
+        }
+        return state ? n_fed - nodes[state].depth : std::string::npos;
+    }
+};
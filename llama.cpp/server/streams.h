@@ -0,0 +1,236 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <deque>
+#include <fcntl.h>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <poll.h>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "utils.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+//
+// server streams
+//
+// Threads that write streamed responses to their clients, so a client
+// waiting on tokens doesn't keep an http thread to itself for as long
+// as its generation goes on. httplib hands a socket over once it has
+// sent the headers, and the main loop pushes results here as it makes
+// them. Each thread polls the sockets it was given, writes what they'll
+// take without blocking, and notices when a client goes away, in which
+// case its task is cancelled. The connection is closed once the stream
+// is over, rather than kept alive.
+//
+
+struct server_streams {
+    // turns a result into the bytes to send, returning true on the last
+    using format_t = std::function<bool(task_result &, std::string &)>;
+
+    struct stream {
+        int sock;
+        int task_id;
+        format_t format;
+        std::deque<task_result> inbox; // guarded by the shard lock
+        std::string out;               // chunks not written yet
+        size_t n_sent = 0;
+        bool finished = false;
+    };
+
+    struct shard {
+        std::thread thread;
+        std::mutex lock;
+        std::vector<std::shared_ptr<stream>> added;
+        std::atomic<bool> signaled{false};
+        int wakeup[2] = {-1, -1};
+        bool stopping = false;
+    };
+
+    std::vector<std::unique_ptr<shard>> shards;
+    std::atomic<unsigned> next{0};
+    std::function<void(int)> on_close; // called with the task id
+
+    bool running() const {
+        return !shards.empty();
+    }
+
+    bool start(int n_threads, std::function<void(int)> on_close_) {
+        on_close = std::move(on_close_);
+        for (int i = 0; i < n_threads; ++i) {
+            std::unique_ptr<shard> sh(new shard);
+            if (pipe(sh->wakeup)) {
+                return false;
+            }
+            fcntl(sh->wakeup[0], F_SETFL, fcntl(sh->wakeup[0], F_GETFL) | O_NONBLOCK);
+            shard * p = sh.get();
+            sh->thread = std::thread([this, p] { work(*p); });
+            shards.push_back(std::move(sh));
+        }
+        return true;
+    }
+
+    ~server_streams() {
+        for (auto & sh : shards) {
+            {
+                std::lock_guard<std::mutex> guard(sh->lock);
+                sh->stopping = true;
+            }
+            signal(*sh);
+            sh->thread.join();
+            close(sh->wakeup[0]);
+            close(sh->wakeup[1]);
+        }
+    }
+
+    // takes ownership of a socket whose headers were sent, returning the
+    // function the results of the task should be pushed to
+    std::function<void(task_result &&)> add(int sock, int task_id, format_t format) {
+        fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+        std::shared_ptr<stream> s = std::make_shared<stream>();
+        s->sock = sock;
+        s->task_id = task_id;
+        s->format = std::move(format);
+        shard * sh = shards[next++ % shards.size()].get();
+        {
+            std::lock_guard<std::mutex> guard(sh->lock);
+            sh->added.push_back(s);
+        }
+        signal(*sh);
+        return [this, sh, s](task_result && result) {
+            {
+                std::lock_guard<std::mutex> guard(sh->lock);
+                s->inbox.push_back(std::move(result));
+            }
+            signal(*sh);
+        };
+    }
+
+  private:
+    static void signal(shard & sh) {
+        if (!sh.signaled.exchange(true)) {
+            char c = 0;
+            if (write(sh.wakeup[1], &c, 1) == -1) {
+            }
+        }
+    }
+
+    static void append_chunk(std::string & out, const std::string & data) {
+        char size[20];
+        out.append(size, snprintf(size, sizeof(size), "%zx\r\n", data.size()));
+        out += data;
+        out += "\r\n";
+    }
+
+    // returns false if the client is gone
+    static bool poll_stream(stream & s, short revents) {
+        if (revents & (POLLERR | POLLNVAL)) {
+            return false;
+        }
+        if (revents & (POLLIN | POLLHUP)) {
+            char buf[512];
+            ssize_t n = recv(s.sock, buf, sizeof(buf), 0);
+            if (!n || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                return false;
+            }
+        }
+        if (s.n_sent < s.out.size()) {
+            ssize_t n = send(s.sock, s.out.data() + s.n_sent, s.out.size() - s.n_sent, MSG_NOSIGNAL);
+            if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                return false;
+            }
+            if (n > 0 && (s.n_sent += n) == s.out.size()) {
+                s.out.clear();
+                s.n_sent = 0;
+            }
+        }
+        return true;
+    }
+
+    void work(shard & sh) {
+        std::vector<std::shared_ptr<stream>> streams;
+        std::vector<std::deque<task_result>> results;
+        std::vector<pollfd> fds;
+        for (;;) {
+            fds.resize(1);
+            fds[0] = {sh.wakeup[0], POLLIN, 0};
+            for (const auto & s : streams) {
+                fds.push_back({s->sock, (short) (POLLIN | (s->out.empty() ? 0 : POLLOUT)), 0});
+            }
+            if (poll(fds.data(), fds.size(), -1) < 0 && errno != EINTR) {
+                return;
+            }
+            if (fds[0].revents & POLLIN) {
+                char buf[64];
+                while (read(sh.wakeup[0], buf, sizeof(buf)) > 0) {
+                }
+            }
+            sh.signaled = false;
+
+            const size_t n_polled = streams.size();
+            {
+                std::lock_guard<std::mutex> guard(sh.lock);
+                if (sh.stopping) {
+                    break;
+                }
+                streams.insert(streams.end(), sh.added.begin(), sh.added.end());
+                sh.added.clear();
+                results.resize(streams.size());
+                for (size_t i = 0; i < streams.size(); ++i) {
+                    results[i].swap(streams[i]->inbox);
+                }
+            }
+
+            for (size_t i = 0; i < streams.size(); ++i) {
+                stream & s = *streams[i];
+                for (task_result & result : results[i]) {
+                    if (s.finished) {
+                        break;
+                    }
+                    std::string data;
+                    if (s.format(result, data)) {
+                        s.finished = true;
+                    }
+                    if (!data.empty()) {
+                        append_chunk(s.out, data);
+                    }
+                    if (s.finished) {
+                        s.out += "0\r\n\r\n";
+                    }
+                }
+                results[i].clear();
+            }
+
+            // walk backwards, so streams can be removed as we go
+            for (size_t i = streams.size(); i--;) {
+                stream & s = *streams[i];
+                const short revents = i < n_polled ? fds[i + 1].revents : 0;
+                const bool gone = !poll_stream(s, revents);
+                if (gone || (s.finished && s.out.empty())) {
+                    shutdown(s.sock, SHUT_RDWR);
+                    close(s.sock);
+                    on_close(s.task_id);
+                    streams[i] = std::move(streams.back());
+                    streams.pop_back();
+                    results[i].swap(results.back());
+                    results.pop_back();
+                }
+            }
+        }
+        for (const auto & s : streams) {
+            close(s->sock);
+        }
+    }
+};
@@ -3,12 +3,20 @@
 
 #pragma once
 
+#include <algorithm>
+#include <chrono>
+#include <cstring>
 #include <string>
 #include <vector>
 #include <set>
 #include <mutex>
+#include <shared_mutex>
 #include <condition_variable>
 #include <unordered_map>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
 
 #include "llama.cpp/json.h"
 #include "llama.cpp/llava/clip.h"
@@ -53,7 +61,13 @@ enum task_type {
     TASK_TYPE_COMPLETION,
     TASK_TYPE_CANCEL,
     TASK_TYPE_NEXT_RESPONSE,
-    TASK_TYPE_METRICS
+    TASK_TYPE_SLOT_SAVE,
+    TASK_TYPE_SLOT_RESTORE,
+    TASK_TYPE_SLOT_ERASE,
+    TASK_TYPE_SLOT_EXPORT,
+    TASK_TYPE_SLOT_IMPORT,
+    TASK_TYPE_EMBEDDING_BATCH,
+    TASK_TYPE_SCORE
 };
 
 struct task_server {
@@ -64,6 +78,10 @@ struct task_server {
     bool infill_mode = false;
     bool embedding_mode = false;
     int multitask_id = -1;
+    int64_t t_posted = 0; // when the request arrived, in microseconds
+    int64_t t_deadline = 0; // when to stop waiting for a slot, or 0
+    int priority = 0; // deferred tasks with higher ones get slots first
+    std::string blob; // state of a slot being imported
 };
 
 struct task_result {
@@ -72,6 +90,8 @@ struct task_result {
     bool stop;
     bool error;
     json result_json;
+    std::string sse; // event already written out, sent instead of result_json
+    std::string blob; // state of a slot that was exported
 };
 
 struct task_multi {
@@ -98,6 +118,7 @@ struct slot_params
 {
     bool stream       = true;
     bool cache_prompt = false; // remember the prompt to avoid reprocessing all prompt
+    bool timings_detail = false; // report where the time of the request went
 
     uint32_t seed      = -1; // RNG seed
     int32_t  n_keep    =  0; // number of tokens to keep from initial prompt
@@ -114,10 +135,12 @@ struct slot_image
     int32_t id;
 
     bool request_encode_image = false;
-    float * image_embedding = nullptr;
+    std::shared_ptr<float> image_embedding;
     int32_t image_tokens = 0;
+    int32_t i_token = 0; // where it starts among the prompt tokens
+    std::string hash;    // sha-256 of the image file
 
-    clip_image_u8 * img_data;
+    clip_image_u8 * img_data = nullptr;
 
     std::string prefix_prompt; // before of this image
 };
@@ -240,14 +263,77 @@ inline std::string format_chat(const struct llama_model * model, const std::stri
 // work queue utils
 //
 
+// unbounded multi-producer single-consumer queue
+//
+// this is dmitry vyukov's intrusive linked list. producers only need
+// one atomic exchange to push, so they never wait on each other or on
+// the consumer, and pop() never blocks.
+template <typename T>
+struct mpsc_queue {
+    struct node {
+        std::atomic<node *> next{nullptr};
+        T value;
+    };
+
+    std::atomic<node *> head; // most recently pushed node
+    node * tail;              // stub whose successor is popped next
+
+    mpsc_queue() {
+        tail = new node;
+        head.store(tail);
+    }
+
+    ~mpsc_queue() {
+        T value;
+        while (pop(value)) {
+        }
+        delete tail;
+    }
+
+    mpsc_queue(const mpsc_queue &) = delete;
+    mpsc_queue & operator=(const mpsc_queue &) = delete;
+
+    // may be called from any thread
+    void push(T value) {
+        node * n = new node;
+        n->value = std::move(value);
+        node * prev = head.exchange(n);
+        prev->next.store(n, std::memory_order_release);
+    }
+
+    // may only be called by the consumer thread
+    //
+    // a push that's still in progress may be reported as empty, which
+    // is fine since it will be noticed on the next call
+    bool pop(T & value) {
+        node * next = tail->next.load(std::memory_order_acquire);
+        if (!next) {
+            return false;
+        }
+        value = std::move(next->value);
+        delete tail;
+        tail = next;
+        return true;
+    }
+
+    bool empty() const {
+        return !tail->next.load(std::memory_order_acquire);
+    }
+};
+
 struct llama_server_queue {
-    int id = 0;
-    std::mutex mutex_tasks;
-    bool running;
+    std::atomic<int> id{0};
+    std::atomic<bool> running{false};
     // queues
-    std::vector<task_server> queue_tasks;
-    std::vector<task_server> queue_tasks_deferred;
-    std::vector<task_multi> queue_multitasks;
+    mpsc_queue<task_server> queue_tasks;
+    mpsc_queue<task_multi> queue_multitasks_new;
+    std::vector<task_server> queue_tasks_deferred; // owned by start_loop
+    std::vector<task_multi> queue_multitasks;    // owned by start_loop
+    std::atomic<int> n_deferred{0}; // for http threads to tell how busy we are
+    bool retry_deferred = false;
+    // the mutex is only acquired to wake up start_loop when it sleeps
+    std::atomic<bool> sleeping{false};
+    std::mutex mutex_sleep;
     std::condition_variable condition_tasks;
     // callback functions
     std::function<void(task_server&)> callback_new_task;
@@ -256,25 +342,51 @@ struct llama_server_queue {
 
     // Add a new task to the end of the queue
     int post(task_server task) {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
         if (task.id == -1) {
             task.id = id++;
             LOG_VERBOSE("new task id", {{"new_id", task.id}});
         }
-        queue_tasks.push_back(std::move(task));
-        condition_tasks.notify_one();
-        return task.id;
+        const int task_id = task.id;
+        queue_tasks.push(std::move(task));
+        wake();
+        return task_id;
     }
 
     // Add a new task, but defer until one slot is available
     void defer_(task_server task) {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
         queue_tasks_deferred.push_back(std::move(task));
+        n_deferred = queue_tasks_deferred.size();
+    }
+
+    // forgets a deferred task, returning false if there wasn't one
+    bool remove_deferred(int task_id) {
+        for (size_t i = 0; i < queue_tasks_deferred.size(); ++i) {
+            if (queue_tasks_deferred[i].id == task_id) {
+                queue_tasks_deferred.erase(queue_tasks_deferred.begin() + i);
+                n_deferred = queue_tasks_deferred.size();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // removes the deferred tasks whose deadline has passed
+    std::vector<task_server> take_expired(int64_t t_now) {
+        std::vector<task_server> expired;
+        for (size_t i = 0; i < queue_tasks_deferred.size();) {
+            if (queue_tasks_deferred[i].t_deadline && queue_tasks_deferred[i].t_deadline < t_now) {
+                expired.push_back(std::move(queue_tasks_deferred[i]));
+                queue_tasks_deferred.erase(queue_tasks_deferred.begin() + i);
+            } else {
+                ++i;
+            }
+        }
+        n_deferred = queue_tasks_deferred.size();
+        return expired;
     }
 
     // Get the next id for creating anew task
     int get_new_id() {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
         int new_id = id++;
         LOG_VERBOSE("new task id", {{"new_id", new_id}});
         return new_id;
@@ -297,21 +409,14 @@ struct llama_server_queue {
 
     // Call when the state of one slot is changed
     void notify_slot_changed() {
-        // move deferred tasks back to main loop
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        for (auto & task : queue_tasks_deferred) {
-            queue_tasks.push_back(std::move(task));
-        }
-        queue_tasks_deferred.clear();
+        // deferred tasks are retried before any new ones
+        retry_deferred = true;
     }
 
     // end the start_loop routine
     void terminate() {
-        {
-            std::unique_lock<std::mutex> lock(mutex_tasks);
-            running = false;
-        }
-        condition_tasks.notify_all();
+        running = false;
+        wake();
     }
 
     // Start the main loop.
@@ -320,21 +425,28 @@ struct llama_server_queue {
         while (true) {
             LOG_VERBOSE("new task may arrive", {});
             {
-                while (true)
-                {
-                    std::unique_lock<std::mutex> lock(mutex_tasks);
-                    if (queue_tasks.empty()) {
-                        lock.unlock();
-                        break;
+                if (retry_deferred) {
+                    retry_deferred = false;
+                    std::vector<task_server> tasks;
+                    tasks.swap(queue_tasks_deferred);
+                    n_deferred = 0;
+                    std::stable_sort(tasks.begin(), tasks.end(), [](const task_server & a, const task_server & b) {
+                        return a.priority > b.priority;
+                    });
+                    for (task_server & task : tasks) {
+                        LOG_VERBOSE("callback_new_task", {{"task_id", task.id}});
+                        callback_new_task(task);
                     }
-                    task_server task = queue_tasks.front();
-                    queue_tasks.erase(queue_tasks.begin());
-                    lock.unlock();
+                }
+                task_server task;
+                while (queue_tasks.pop(task))
+                {
                     LOG_VERBOSE("callback_new_task", {{"task_id", task.id}});
                     callback_new_task(task);
                 }
                 LOG_VERBOSE("callback_all_task_finished", {});
                 // process and update all the multitasks
+                adopt_multitasks();
                 auto queue_iterator = queue_multitasks.begin();
                 while (queue_iterator != queue_multitasks.end())
                 {
@@ -356,17 +468,20 @@ struct llama_server_queue {
             }
             LOG_VERBOSE("wait for new task", {});
             // wait for new task
-            {
-                std::unique_lock<std::mutex> lock(mutex_tasks);
-                if (queue_tasks.empty()) {
-                    if (!running) {
-                        LOG_VERBOSE("ending start_loop", {});
-                        return;
-                    }
-                    condition_tasks.wait(lock, [&]{
-                        return (!queue_tasks.empty() || !running);
-                    });
+            if (queue_tasks.empty() && !retry_deferred) {
+                if (!running) {
+                    LOG_VERBOSE("ending start_loop", {});
+                    return;
                 }
+                std::unique_lock<std::mutex> lock(mutex_sleep);
+                sleeping = true;
+                // pairs with the fence in wake(), so either we see the
+                // task that was pushed, or its poster sees us sleeping
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                condition_tasks.wait(lock, [&]{
+                    return (!queue_tasks.empty() || !running);
+                });
+                sleeping = false;
             }
         }
     }
@@ -378,17 +493,17 @@ struct llama_server_queue {
     // add a multitask by specifying the id of all subtask (subtask is a task_server)
     void add_multitask(int multitask_id, std::vector<int>& sub_ids)
     {
-        std::lock_guard<std::mutex> lock(mutex_tasks);
         task_multi multi;
         multi.id = multitask_id;
         std::copy(sub_ids.begin(), sub_ids.end(), std::inserter(multi.subtasks_remaining, multi.subtasks_remaining.end()));
-        queue_multitasks.push_back(multi);
+        queue_multitasks_new.push(std::move(multi));
     }
 
     // updatethe remaining subtasks, while appending results to multitask
     void update_multitask(int multitask_id, int subtask_id, task_result& result)
     {
-        std::lock_guard<std::mutex> lock(mutex_tasks);
+        // the subtask was posted after its multitask, so it's visible now
+        adopt_multitasks();
         for (auto& multitask : queue_multitasks)
         {
             if (multitask.id == multitask_id)
@@ -398,52 +513,132 @@ struct llama_server_queue {
             }
         }
     }
+
+  private:
+    void adopt_multitasks() {
+        task_multi multi;
+        while (queue_multitasks_new.pop(multi)) {
+            queue_multitasks.push_back(std::move(multi));
+        }
+    }
+
+    void wake() {
+        // if start_loop is going to sleep, it's either going to see our
+        // task, or it's holding the mutex until it's waiting on condition.
+        // the push only released the task, and a release store followed
+        // by a load of another variable may be reordered, so it's fenced
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleeping) {
+            std::unique_lock<std::mutex> lock(mutex_sleep);
+        }
+        condition_tasks.notify_one();
+    }
 };
 
 struct llama_server_response {
     typedef std::function<void(int, int, task_result&)> callback_multitask_t;
     callback_multitask_t callback_update_multitask;
+
+    // results for one task, which only its http thread waits upon,
+    // unless they're handed to a callback as they come
+    struct channel {
+        std::mutex mutex;
+        std::condition_variable condition;
+        std::deque<task_result> results;
+        std::function<void(task_result &&)> on_result;
+    };
+
     // for keeping track of all tasks waiting for the result
-    std::set<int> waiting_task_ids;
-    // the main result queue
-    std::vector<task_result> queue_results;
-    std::mutex mutex_results;
-    std::condition_variable condition_results;
+    std::unordered_map<int, std::shared_ptr<channel>> waiting_tasks;
+    std::shared_mutex mutex_waiting; // held exclusively only to (un)register
 
     void add_waiting_task_id(int task_id) {
         LOG_VERBOSE("waiting for task id", {{"task_id", task_id}});
-        std::unique_lock<std::mutex> lock(mutex_results);
-        waiting_task_ids.insert(task_id);
+        std::unique_lock<std::shared_mutex> lock(mutex_waiting);
+        waiting_tasks.emplace(task_id, std::make_shared<channel>());
     }
 
     void remove_waiting_task_id(int task_id) {
         LOG_VERBOSE("remove waiting for task id", {{"task_id", task_id}});
-        std::unique_lock<std::mutex> lock(mutex_results);
-        waiting_task_ids.erase(task_id);
+        std::unique_lock<std::shared_mutex> lock(mutex_waiting);
+        waiting_tasks.erase(task_id);
+    }
+
+    // hands the results of a task to `fn` from now on, starting with any
+    // that arrived already, rather than keeping them for recv()
+    void subscribe(int task_id, std::function<void(task_result &&)> fn) {
+        std::shared_ptr<channel> chan = find(task_id);
+        if (!chan) {
+            add_waiting_task_id(task_id);
+            chan = find(task_id);
+        }
+        std::unique_lock<std::mutex> lock(chan->mutex);
+        for (task_result & res : chan->results) {
+            fn(std::move(res));
+        }
+        chan->results.clear();
+        chan->on_result = std::move(fn);
     }
 
     // This function blocks the thread until there is a response for this task_id
     task_result recv(int task_id) {
-        while (true)
-        {
-            std::unique_lock<std::mutex> lock(mutex_results);
-            condition_results.wait(lock, [&]{
-                return !queue_results.empty();
-            });
+        std::shared_ptr<channel> chan = find(task_id);
+        if (!chan) {
+            add_waiting_task_id(task_id);
+            chan = find(task_id);
+        }
+        std::unique_lock<std::mutex> lock(chan->mutex);
+        chan->condition.wait(lock, [&]{
+            return !chan->results.empty();
+        });
+        task_result res = std::move(chan->results.front());
+        chan->results.pop_front();
+        assert(res.multitask_id == -1);
+        return res;
+    }
 
-            for (int i = 0; i < (int) queue_results.size(); i++)
-            {
-                if (queue_results[i].id == task_id)
-                {
-                    assert(queue_results[i].multitask_id == -1);
-                    task_result res = queue_results[i];
-                    queue_results.erase(queue_results.begin() + i);
-                    return res;
-                }
+    // like recv(), except it looks every so often whether the client is
+    // still there, and returns false without a result once it's gone
+    bool recv(int task_id, task_result & res, const std::function<bool()> & gone) {
+        std::shared_ptr<channel> chan = find(task_id);
+        if (!chan) {
+            add_waiting_task_id(task_id);
+            chan = find(task_id);
+        }
+        std::unique_lock<std::mutex> lock(chan->mutex);
+        while (!chan->condition.wait_for(lock, std::chrono::milliseconds(100), [&]{
+            return !chan->results.empty();
+        })) {
+            if (gone()) {
+                return false;
             }
         }
+        res = std::move(chan->results.front());
+        chan->results.pop_front();
+        assert(res.multitask_id == -1);
+        return true;
+    }
 
-        // should never reach here
+    // waits for the final results of the n choices of a completion, in
+    // order of their index, or returns the first error instead, or none
+    // at all if `gone` says the client went away in the meantime
+    std::vector<task_result> recv_choices(int task_id, int n_choices,
+                                          const std::function<bool()> & gone = nullptr) {
+        std::vector<task_result> results(n_choices);
+        for (int i = 0; i < n_choices; ++i) {
+            task_result res;
+            if (!gone) {
+                res = recv(task_id);
+            } else if (!recv(task_id, res, gone)) {
+                return {};
+            }
+            if (res.error || !res.stop) {
+                return {res};
+            }
+            const int index = json_value(res.result_json, "index", 0);
+            results.at(n_choices > 1 ? index : 0) = std::move(res);
+        }
+        return results;
     }
 
     // Register the function to update multitask
@@ -453,101 +648,289 @@ struct llama_server_response {
 
     // Send a new result to a waiting task_id
     void send(task_result result) {
-        std::unique_lock<std::mutex> lock(mutex_results);
         LOG_VERBOSE("send new result", {{"task_id", result.id}});
-        for (auto& task_id : waiting_task_ids) {
-            // LOG_TEE("waiting task id %i \n", task_id);
-            // for now, tasks that have associated parent multitasks just get erased once multitask picks up the result
-            if (result.multitask_id == task_id)
-            {
-                LOG_VERBOSE("callback_update_multitask", {{"task_id", task_id}});
-                callback_update_multitask(task_id, result.id, result);
-                continue;
-            }
-
-            if (result.id == task_id)
-            {
-                LOG_VERBOSE("queue_results.push_back", {{"task_id", task_id}});
-                queue_results.push_back(result);
-                condition_results.notify_all();
+        // for now, tasks that have associated parent multitasks just get erased once multitask picks up the result
+        if (result.multitask_id != -1 && find(result.multitask_id))
+        {
+            LOG_VERBOSE("callback_update_multitask", {{"task_id", result.multitask_id}});
+            callback_update_multitask(result.multitask_id, result.id, result);
+            return;
+        }
+        if (std::shared_ptr<channel> chan = find(result.id))
+        {
+            LOG_VERBOSE("queue_results.push_back", {{"task_id", result.id}});
+            std::unique_lock<std::mutex> lock(chan->mutex);
+            if (chan->on_result) {
+                chan->on_result(std::move(result));
                 return;
             }
+            chan->results.push_back(std::move(result));
+            chan->condition.notify_one();
         }
     }
+
+  private:
+    std::shared_ptr<channel> find(int task_id) {
+        std::shared_lock<std::shared_mutex> lock(mutex_waiting);
+        auto it = waiting_tasks.find(task_id);
+        return it != waiting_tasks.end() ? it->second : nullptr;
+    }
 };
 
 //
 // base64 utils (TODO: move to common in the future)
 //
 
-static const std::string base64_chars =
-             "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-             "abcdefghijklmnopqrstuvwxyz"
-             "0123456789+/";
-
-static inline bool is_base64(uint8_t c)
-{
-    return (isalnum(c) || (c == '+') || (c == '/'));
-}
-
-static inline std::vector<uint8_t> base64_decode(const std::string & encoded_string)
+// decodes base64 into `out`, which needs room for 3 bytes per 4 chars,
+// returning the number of bytes written. like the decoder this one
+// replaced, it stops at the first character not in the alphabet, so
+// padding and anything after it are ignored
+static size_t base64_decode(const char * in, size_t n, uint8_t * out)
 {
-    int i = 0;
-    int j = 0;
-    int in_ = 0;
-
-    int in_len = encoded_string.size();
-
-    uint8_t char_array_4[4];
-    uint8_t char_array_3[3];
-
-    std::vector<uint8_t> ret;
-
-    while (in_len-- && (encoded_string[in_] != '=') && is_base64(encoded_string[in_]))
+    static const struct table
     {
-        char_array_4[i++] = encoded_string[in_]; in_++;
-        if (i == 4)
+        uint8_t v[256];
+        table()
         {
-            for (i = 0; i <4; i++)
+            static const char alphabet[] =
+                "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                "abcdefghijklmnopqrstuvwxyz"
+                "0123456789+/";
+            memset(v, 0x40, sizeof(v));
+            for (int i = 0; i < 64; ++i)
             {
-                char_array_4[i] = base64_chars.find(char_array_4[i]);
+                v[(uint8_t) alphabet[i]] = i;
             }
+        }
+    } t;
 
-            char_array_3[0] = ((char_array_4[0]      ) << 2) + ((char_array_4[1] & 0x30) >> 4);
-            char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
-            char_array_3[2] = ((char_array_4[2] & 0x3) << 6) +   char_array_4[3];
+    const uint8_t * p = (const uint8_t *) in;
+    uint8_t * o = out;
+    size_t i = 0;
 
-            for (i = 0; (i < 3); i++)
-            {
-                ret.push_back(char_array_3[i]);
-            }
-            i = 0;
+    // eight characters at a time, until one of them isn't base64
+    for (; i + 8 <= n; i += 8)
+    {
+        const uint64_t a = t.v[p[i + 0]], b = t.v[p[i + 1]], c = t.v[p[i + 2]], d = t.v[p[i + 3]];
+        const uint64_t e = t.v[p[i + 4]], f = t.v[p[i + 5]], g = t.v[p[i + 6]], h = t.v[p[i + 7]];
+        if ((a | b | c | d | e | f | g | h) & 0x40)
+        {
+            break;
         }
+        const uint64_t x = a << 42 | b << 36 | c << 30 | d << 24 | e << 18 | f << 12 | g << 6 | h;
+        o[0] = x >> 40;
+        o[1] = x >> 32;
+        o[2] = x >> 24;
+        o[3] = x >> 16;
+        o[4] = x >> 8;
+        o[5] = x;
+        o += 6;
     }
 
-    if (i)
+    uint32_t x = 0;
+    int k = 0;
+    for (; i < n && !(t.v[p[i]] & 0x40); ++i)
     {
-        for (j = i; j <4; j++)
+        x = x << 6 | t.v[p[i]];
+        if (++k == 4)
         {
-            char_array_4[j] = 0;
+            o[0] = x >> 16;
+            o[1] = x >> 8;
+            o[2] = x;
+            o += 3;
+            x = 0;
+            k = 0;
         }
+    }
+    if (k == 2)
+    {
+        *o++ = x >> 4;
+    }
+    else if (k == 3)
+    {
+        *o++ = x >> 10;
+        *o++ = x >> 2;
+    }
+
+    return o - out;
+}
+
+static inline std::vector<uint8_t> base64_decode(const std::string & encoded_string)
+{
+    std::vector<uint8_t> ret(encoded_string.size() / 4 * 3 + 3);
+    ret.resize(base64_decode(encoded_string.data(), encoded_string.size(), ret.data()));
+    return ret;
+}
+
+// appends the padded base64 encoding of n bytes to out
+static void base64_encode(const void * in, size_t n, std::string & out)
+{
+    static const char alphabet[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+        "abcdefghijklmnopqrstuvwxyz"
+        "0123456789+/";
+    const uint8_t * p = (const uint8_t *) in;
+    const size_t k = out.size();
+    out.resize(k + (n + 2) / 3 * 4);
+    char * o = &out[k];
+    size_t i = 0;
+    for (; i + 3 <= n; i += 3)
+    {
+        const uint32_t x = p[i] << 16 | p[i + 1] << 8 | p[i + 2];
+        *o++ = alphabet[x >> 18];
+        *o++ = alphabet[x >> 12 & 63];
+        *o++ = alphabet[x >> 6 & 63];
+        *o++ = alphabet[x & 63];
+    }
+    if (i < n)
+    {
+        const uint32_t x = p[i] << 16 | (i + 1 < n ? p[i + 1] << 8 : 0);
+        *o++ = alphabet[x >> 18];
+        *o++ = alphabet[x >> 12 & 63];
+        *o++ = i + 1 < n ? alphabet[x >> 6 & 63] : '=';
+        *o++ = '=';
+    }
+}
+
+//
+// request bodies
+//
 
-        for (j = 0; j <4; j++)
+// returns the index of the quote ending the json string that starts at
+// `i`, setting `escaped` if it has any escape sequences
+static size_t json_string_end(const std::string & s, size_t i, bool * escaped)
+{
+    *escaped = false;
+    const char * p = s.data();
+    const char * end = p + s.size();
+    const char * q = nullptr;
+    for (const char * j = p + i + 1;;)
+    {
+        if (q < j && !(q = (const char *) memchr(j, '"', end - j)))
+        {
+            return std::string::npos;
+        }
+        const char * e = (const char *) memchr(j, '\\', q - j);
+        if (!e)
+        {
+            return q - p;
+        }
+        *escaped = true;
+        if ((j = e + 2) > end)
         {
-            char_array_4[j] = base64_chars.find(char_array_4[j]);
+            return std::string::npos;
         }
+    }
+}
 
-        char_array_3[0] = ((char_array_4[0]      ) << 2) + ((char_array_4[1] & 0x30) >> 4);
-        char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
-        char_array_3[2] = ((char_array_4[2] & 0x3) << 6) +   char_array_4[3];
+// parses the body of a request, except the images in it are decoded
+// straight out of the body into json binaries, rather than being built
+// into the document as strings megabytes long and copied from one
+// place to another on their way to the slot
+static json parse_request_body(const std::string & body)
+{
+    static const size_t min_body  = 256 * 1024; // smaller ones are parsed as is
+    static const size_t min_image = 4096;
 
-        for (j = 0; (j < i - 1); j++)
+    if (body.size() < min_body || body.find("\"image_data\"") == std::string::npos)
+    {
+        return json::parse(body);
+    }
+
+    std::string rest; // the body with image data replaced by "#0", "#1", etc.
+    std::vector<std::vector<uint8_t>> images;
+    std::string key;
+    size_t copied = 0;
+    int depth = 0;
+    int images_depth = -1; // depth inside the image_data array
+    bool want_images = false;
+
+    for (size_t i = 0; i < body.size(); ++i)
+    {
+        switch (body[i])
         {
-            ret.push_back(char_array_3[j]);
+            case '"':
+            {
+                bool escaped;
+                const size_t end = json_string_end(body, i, &escaped);
+                if (end == std::string::npos)
+                {
+                    return json::parse(body); // reports the error
+                }
+                size_t k = end + 1;
+                while (k < body.size() && isspace((unsigned char) body[k]))
+                {
+                    ++k;
+                }
+                const size_t len = end - i - 1;
+                if (k < body.size() && body[k] == ':')
+                {
+                    key = len <= 32 && !escaped ? body.substr(i + 1, len) : "";
+                    want_images = depth == 1 && key == "image_data";
+                }
+                else
+                {
+                    if (images_depth >= 0 && depth == images_depth + 1 && key == "data" &&
+                        !escaped && len >= min_image)
+                    {
+                        std::vector<uint8_t> image(len / 4 * 3 + 3);
+                        image.resize(base64_decode(body.data() + i + 1, len, image.data()));
+                        rest.append(body, copied, i - copied);
+                        rest += "\"#" + std::to_string(images.size()) + "\"";
+                        copied = end + 1;
+                        images.push_back(std::move(image));
+                    }
+                    want_images = false;
+                }
+                i = end;
+            } break;
+            case '[':
+            case '{':
+                ++depth;
+                if (body[i] == '[' && want_images)
+                {
+                    images_depth = depth;
+                }
+                want_images = false;
+                break;
+            case ']':
+            case '}':
+                if (depth == images_depth)
+                {
+                    images_depth = -1;
+                }
+                --depth;
+                break;
+            case ':':
+            case ',':
+            case ' ':
+            case '\t':
+            case '\r':
+            case '\n':
+                break;
+            default:
+                want_images = false;
+                break;
         }
     }
 
-    return ret;
+    if (images.empty())
+    {
+        return json::parse(body);
+    }
+    rest.append(body, copied, std::string::npos);
+
+    json data = json::parse(rest);
+    size_t n = 0;
+    for (json & img : data.at("image_data"))
+    {
+        if (n < images.size() && img.is_object() && img.contains("data") &&
+            img["data"] == "#" + std::to_string(n))
+        {
+            img["data"] = json::binary(std::move(images[n++]));
+        }
+    }
+    return data;
 }
 
 //
@@ -558,8 +941,7 @@ static std::string random_string()
 {
     static const std::string str("0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz");
 
-    std::random_device rd;
-    std::mt19937 generator(rd());
+    static thread_local std::mt19937 generator(std::random_device{}());
 
     std::string result(32, ' ');
 
@@ -0,0 +1,101 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//
+// server workers
+//
+// Threads that help the main loop with work it would otherwise do one
+// slot at a time, like sampling, in between calls to llama_decode(). So
+// they never compete with ggml's threads for cores. The caller takes
+// part in every run, and items are handed out one at a time, so a slot
+// with an expensive grammar doesn't hold up the rest.
+//
+
+struct server_workers {
+    std::vector<std::thread> threads;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable done;
+
+    const std::function<void(int)> * fn = nullptr;
+    std::atomic<int> next{0};
+    int n_items = 0;
+    int n_busy = 0;
+    unsigned generation = 0;
+    bool stopping = false;
+
+    void start(int n_threads) {
+        for (int i = 0; i < n_threads; ++i) {
+            threads.emplace_back([this] { work(); });
+        }
+    }
+
+    ~server_workers() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto & t : threads) {
+            t.join();
+        }
+    }
+
+    // calls fn(i) for each i in [0,n) and waits for them to finish
+    void run(int n, const std::function<void(int)> & fn_) {
+        if (threads.empty() || n < 2) {
+            for (int i = 0; i < n; ++i) {
+                fn_(i);
+            }
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            fn = &fn_;
+            n_items = n;
+            next = 0;
+            n_busy = threads.size();
+            ++generation;
+        }
+        wake.notify_all();
+        drain(fn_, n);
+        std::unique_lock<std::mutex> guard(lock);
+        done.wait(guard, [this] { return !n_busy; });
+        fn = nullptr;
+    }
+
+    void drain(const std::function<void(int)> & f, int n) {
+        for (int i; (i = next++) < n;) {
+            f(i);
+        }
+    }
+
+    void work() {
+        unsigned seen = 0;
+        std::unique_lock<std::mutex> guard(lock);
+        for (;;) {
+            wake.wait(guard, [&] { return stopping || generation != seen; });
+            if (stopping) {
+                return;
+            }
+            seen = generation;
+            const std::function<void(int)> & f = *fn;
+            const int n = n_items;
+            guard.unlock();
+            drain(f, n);
+            guard.lock();
+            if (!--n_busy) {
+                done.notify_one();
+            }
+        }
+    }
+};
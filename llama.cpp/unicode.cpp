@@ -1,10 +1,14 @@
 ﻿#include "unicode.h"
 #include "unicode-data.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cstddef>
 #include <cstdint>
+#include <cwctype>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <regex>
 #include <stdexcept>
 #include <string>
@@ -421,18 +425,869 @@ static std::vector<size_t> unicode_regex_split_stl(const std::string & text, con
     return bpe_offsets;
 }
 
-static std::vector<size_t> unicode_regex_split_custom(const std::string & text, const std::string & regex_expr, const std::vector<size_t> & offsets) {
-    std::vector<size_t> bpe_offsets;
+//
+// pre-tokenizer regex engine
+//
+// std::regex is a backtracking matcher, which is slow on long inputs, and
+// makes up most of the time spent tokenizing. So the regexes vocabs split
+// text with are compiled once, to a Thompson NFA, that's run as a Pike VM
+// over codepoints. Its threads are kept in priority order, so it finds the
+// same leftmost-first matches as the ECMAScript grammar of std::regex, in
+// time proportional to the text times the size of the program. Matches
+// that begin where the last one ended, which is nearly all of them, are
+// found by a dfa built from the vm as it goes. Regexes using syntax that
+// no pre-tokenizer needs, like backreferences, are left to std::regex.
+//
+// Codepoint classes are decided the same way as the std::regex fallback.
+// If a regex uses \p{L}, \p{N} or \p{P}, then it'd run on the collapsed
+// text, where \s, \d and \w only match ASCII. Otherwise std::wregex would
+// be used, which asks the C library.
+//
+
+#define UNICODE_REGEX_MAX_PROGRAM 20000
+#define UNICODE_REGEX_MAX_STATES  1000
+
+enum {
+    UNICODE_FLAG_LETTER      = 1 << 0, // \p{L}
+    UNICODE_FLAG_NUMBER      = 1 << 1, // \p{N}
+    UNICODE_FLAG_PUNCTUATION = 1 << 2, // \p{P}
+    UNICODE_FLAG_SPACE       = 1 << 3, // \s
+    UNICODE_FLAG_DIGIT       = 1 << 4, // \d
+    UNICODE_FLAG_WORD        = 1 << 5, // \w
+    UNICODE_FLAG_NEWLINE     = 1 << 6, // not matched by .
+};
+
+static uint8_t unicode_cpt_flags(uint32_t cp, bool collapsed) {
+    uint8_t flags = 0;
+    if (collapsed) {
+        if (cp < 128) {
+            if (('A' <= cp && cp <= 'Z') || ('a' <= cp && cp <= 'z')) {
+                flags |= UNICODE_FLAG_LETTER | UNICODE_FLAG_WORD;
+            } else if ('0' <= cp && cp <= '9') {
+                flags |= UNICODE_FLAG_NUMBER | UNICODE_FLAG_DIGIT | UNICODE_FLAG_WORD;
+            } else if (cp == '_') {
+                flags |= UNICODE_FLAG_PUNCTUATION | UNICODE_FLAG_WORD;
+            } else if (cp == ' ' || ('\t' <= cp && cp <= '\r')) {
+                flags |= UNICODE_FLAG_SPACE;
+            } else if ((0x21 <= cp && cp <= 0x23) || (0x25 <= cp && cp <= 0x2A) ||
+                       (0x2C <= cp && cp <= 0x2F) || (0x3A <= cp && cp <= 0x3B) ||
+                       (0x3F <= cp && cp <= 0x40) || (0x5B <= cp && cp <= 0x5D) ||
+                       cp == 0x7B || cp == 0x7D) {
+                flags |= UNICODE_FLAG_PUNCTUATION;
+            }
+        } else {
+            switch (unicode_cpt_type(cp)) {
+                case CODEPOINT_TYPE_LETTER:      flags |= UNICODE_FLAG_LETTER;      break;
+                case CODEPOINT_TYPE_NUMBER:      flags |= UNICODE_FLAG_NUMBER;      break;
+                case CODEPOINT_TYPE_PUNCTUATION: flags |= UNICODE_FLAG_PUNCTUATION; break;
+                default: break;
+            }
+        }
+        if (cp == '\n' || cp == '\r') {
+            flags |= UNICODE_FLAG_NEWLINE;
+        }
+    } else {
+        if (iswspace(cp)) {
+            flags |= UNICODE_FLAG_SPACE;
+        }
+        if (iswdigit(cp)) {
+            flags |= UNICODE_FLAG_DIGIT;
+        }
+        if (iswalnum(cp) || cp == '_') {
+            flags |= UNICODE_FLAG_WORD;
+        }
+        if (cp == '\n' || cp == '\r' || cp == 0x2028 || cp == 0x2029) {
+            flags |= UNICODE_FLAG_NEWLINE;
+        }
+    }
+    return flags;
+}
+
+struct unicode_regex_class {
+    std::vector<std::pair<uint32_t, uint32_t>> ranges; // sorted and disjoint
+    uint64_t ascii[2] = {}; // answers for the first 128 codepoints
+    uint8_t flags = 0;      // matches codepoints having any of these
+    uint8_t not_flags = 0;  // matches codepoints lacking any of these
+    bool negated = false;
+
+    bool match_slow(uint32_t cp, uint8_t cp_flags) const {
+        bool res = (cp_flags & flags) || (~cp_flags & not_flags);
+        if (!res) {
+            auto it = std::upper_bound(ranges.begin(), ranges.end(), std::make_pair(cp, UINT32_MAX));
+            res = it != ranges.begin() && cp <= (it - 1)->second;
+        }
+        return res != negated;
+    }
+
+    bool match(uint32_t cp, uint8_t cp_flags) const {
+        if (cp < 128) {
+            return ascii[cp >> 6] >> (cp & 63) & 1;
+        }
+        return match_slow(cp, cp_flags);
+    }
+
+    void finish(bool collapsed) {
+        std::sort(ranges.begin(), ranges.end());
+        std::vector<std::pair<uint32_t, uint32_t>> merged;
+        for (const auto & r : ranges) {
+            if (!merged.empty() && r.first <= merged.back().second + 1) {
+                merged.back().second = std::max(merged.back().second, r.second);
+            } else {
+                merged.push_back(r);
+            }
+        }
+        ranges = std::move(merged);
+        for (uint32_t cp = 0; cp < 128; ++cp) {
+            if (match_slow(cp, unicode_cpt_flags(cp, collapsed))) {
+                ascii[cp >> 6] |= (uint64_t) 1 << (cp & 63);
+            }
+        }
+    }
+};
+
+struct unicode_regex_inst {
+    enum op_type { CHAR, SPLIT, JMP, LOOK, NOT_LOOK, BOL, EOL, MATCH } op;
+    int x; // class for CHAR and LOOK, or target of JMP and preferred SPLIT
+    int y; // other target of SPLIT
+};
+
+struct unicode_regex_dfa;
+
+struct unicode_regex {
+    std::vector<unicode_regex_inst> prog;
+    std::vector<unicode_regex_class> classes;
+    std::vector<int> closures;     // instructions other than JMP and SPLIT, in order of preference
+    std::vector<int> closure_offs; // where each pc's closure starts, plus one for the end
+    std::shared_ptr<unicode_regex_dfa> dfa;
+    mutable std::mutex dfa_lock;
+    bool collapsed;
+
+    // flattens the jumps each pc leads to, so the vm needn't chase them
+    bool link() {
+        std::vector<int> seen(prog.size(), -1);
+        std::vector<int> stack;
+        for (size_t pc = 0; pc < prog.size(); ++pc) {
+            closure_offs.push_back(closures.size());
+            stack.assign(1, pc);
+            while (!stack.empty()) {
+                int at = stack.back();
+                stack.pop_back();
+                if (seen[at] == (int) pc) {
+                    continue;
+                }
+                seen[at] = pc;
+                if (prog[at].op == unicode_regex_inst::JMP) {
+                    stack.push_back(prog[at].x);
+                } else if (prog[at].op == unicode_regex_inst::SPLIT) {
+                    stack.push_back(prog[at].y);
+                    stack.push_back(prog[at].x);
+                } else {
+                    closures.push_back(at);
+                }
+            }
+            if (closures.size() > 50 * UNICODE_REGEX_MAX_PROGRAM) {
+                return false;
+            }
+        }
+        closure_offs.push_back(closures.size());
+        return true;
+    }
+};
+
+// recursive descent parser for the subset of ECMAScript we support
+struct unicode_regex_parser {
+    struct node {
+        enum { CHAR, CAT, ALT, REPEAT, BOL, EOL, LOOK, NOT_LOOK } type;
+        int cls = -1;
+        int min = 0;
+        int max = 0; // -1 is unbounded
+        bool greedy = true;
+        std::vector<node> kids;
+    };
+
+    const std::vector<uint32_t> & re;
+    unicode_regex & out;
+    size_t pos = 0;
+
+    unicode_regex_parser(const std::vector<uint32_t> & re, unicode_regex & out) : re(re), out(out) {}
+
+    bool at(uint32_t c) const {
+        return pos < re.size() && re[pos] == c;
+    }
+
+    int add_class(unicode_regex_class cls) {
+        cls.finish(out.collapsed);
+        out.classes.push_back(std::move(cls));
+        return out.classes.size() - 1;
+    }
+
+    // parses escape after backslash, as a class if it names one
+    bool parse_escape(unicode_regex_class & cls, uint32_t & c, bool & is_class) {
+        if (pos >= re.size()) {
+            return false;
+        }
+        is_class = true;
+        c = re[pos++];
+        switch (c) {
+            case 's': cls.flags     |= UNICODE_FLAG_SPACE; return true;
+            case 'S': cls.not_flags |= UNICODE_FLAG_SPACE; return true;
+            case 'd': cls.flags     |= UNICODE_FLAG_DIGIT; return true;
+            case 'D': cls.not_flags |= UNICODE_FLAG_DIGIT; return true;
+            case 'w': cls.flags     |= UNICODE_FLAG_WORD;  return true;
+            case 'W': cls.not_flags |= UNICODE_FLAG_WORD;  return true;
+            case 'p':
+                if (!out.collapsed || pos + 2 >= re.size() || re[pos] != '{' || re[pos + 2] != '}') {
+                    return false;
+                }
+                switch (re[pos + 1]) {
+                    case 'L': cls.flags |= UNICODE_FLAG_LETTER;      break;
+                    case 'N': cls.flags |= UNICODE_FLAG_NUMBER;      break;
+                    case 'P': cls.flags |= UNICODE_FLAG_PUNCTUATION; break;
+                    default: return false;
+                }
+                pos += 3;
+                return true;
+            default:
+                break;
+        }
+        is_class = false;
+        switch (c) {
+            case 'r': c = '\r'; return true;
+            case 'n': c = '\n'; return true;
+            case 't': c = '\t'; return true;
+            case 'f': c = '\f'; return true;
+            case 'v': c = '\v'; return true;
+            default:
+                // anything else that's escaped must stand for itself
+                return c >= 128 || !isalnum(c);
+        }
+    }
+
+    bool parse_bracket(node & n) {
+        unicode_regex_class cls;
+        if (at('^')) {
+            cls.negated = true;
+            ++pos;
+        }
+        if (at(']')) {
+            return false;
+        }
+        while (!at(']')) {
+            if (pos >= re.size()) {
+                return false;
+            }
+            uint32_t lo = re[pos++];
+            bool is_class = false;
+            if (lo == '\\' && !parse_escape(cls, lo, is_class)) {
+                return false;
+            }
+            if (is_class) {
+                continue;
+            }
+            uint32_t hi = lo;
+            if (at('-') && pos + 1 < re.size() && re[pos + 1] != ']') {
+                ++pos;
+                hi = re[pos++];
+                if (hi == '\\' && (!parse_escape(cls, hi, is_class) || is_class)) {
+                    return false;
+                }
+                if (hi < lo) {
+                    return false;
+                }
+            }
+            cls.ranges.emplace_back(lo, hi);
+        }
+        ++pos;
+        n.type = node::CHAR;
+        n.cls = add_class(std::move(cls));
+        return true;
+    }
+
+    bool parse_atom(node & n) {
+        uint32_t c = re[pos++];
+        unicode_regex_class cls;
+        switch (c) {
+            case '(':
+                if (at('?')) {
+                    if (pos + 1 >= re.size()) {
+                        return false;
+                    }
+                    uint32_t kind = re[pos + 1];
+                    pos += 2;
+                    if (kind == ':') {
+                        if (!parse_alt(n)) {
+                            return false;
+                        }
+                    } else if (kind == '!' || kind == '=') {
+                        // lookaheads may only peek at the next codepoint
+                        node inner;
+                        if (!parse_alt(inner) || inner.type != node::CAT || inner.kids.size() != 1 ||
+                            inner.kids[0].type != node::CHAR) {
+                            return false;
+                        }
+                        n.type = kind == '!' ? node::NOT_LOOK : node::LOOK;
+                        n.cls = inner.kids[0].cls;
+                    } else {
+                        return false;
+                    }
+                } else if (!parse_alt(n)) {
+                    return false;
+                }
+                if (!at(')')) {
+                    return false;
+                }
+                ++pos;
+                return true;
+            case '[':
+                return parse_bracket(n);
+            case '^':
+                n.type = node::BOL;
+                return true;
+            case '$':
+                n.type = node::EOL;
+                return true;
+            case '.':
+                cls.not_flags = UNICODE_FLAG_NEWLINE;
+                n.type = node::CHAR;
+                n.cls = add_class(std::move(cls));
+                return true;
+            case '\\': {
+                bool is_class;
+                if (!parse_escape(cls, c, is_class)) {
+                    return false;
+                }
+                if (!is_class) {
+                    cls.ranges.emplace_back(c, c);
+                }
+                n.type = node::CHAR;
+                n.cls = add_class(std::move(cls));
+                return true;
+            }
+            case '*': case '+': case '?': case '{': case '}': case ']':
+                return false;
+            default:
+                cls.ranges.emplace_back(c, c);
+                n.type = node::CHAR;
+                n.cls = add_class(std::move(cls));
+                return true;
+        }
+    }
+
+    bool parse_number(int & v) {
+        if (pos >= re.size() || !('0' <= re[pos] && re[pos] <= '9')) {
+            return false;
+        }
+        for (v = 0; pos < re.size() && '0' <= re[pos] && re[pos] <= '9'; ++pos) {
+            v = v * 10 + (re[pos] - '0');
+            if (v > 1000) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool parse_quantifier(node & n) {
+        int min, max;
+        uint32_t c = re[pos];
+        if (c == '*') {
+            min = 0, max = -1, ++pos;
+        } else if (c == '+') {
+            min = 1, max = -1, ++pos;
+        } else if (c == '?') {
+            min = 0, max = 1, ++pos;
+        } else if (c == '{') {
+            ++pos;
+            if (!parse_number(min)) {
+                return false;
+            }
+            max = min;
+            if (at(',')) {
+                ++pos;
+                max = -1;
+                if (!at('}') && (!parse_number(max) || max < min)) {
+                    return false;
+                }
+            }
+            if (!at('}')) {
+                return false;
+            }
+            ++pos;
+        } else {
+            return true;
+        }
+        if (n.type == node::BOL || n.type == node::EOL || n.type == node::LOOK || n.type == node::NOT_LOOK) {
+            return false;
+        }
+        node rep;
+        rep.type = node::REPEAT;
+        rep.min = min;
+        rep.max = max;
+        if (at('?')) {
+            rep.greedy = false;
+            ++pos;
+        }
+        rep.kids.push_back(std::move(n));
+        n = std::move(rep);
+        return true;
+    }
+
+    bool parse_seq(node & n) {
+        n.type = node::CAT;
+        while (pos < re.size() && !at('|') && !at(')')) {
+            node kid;
+            if (!parse_atom(kid) || (pos < re.size() && !parse_quantifier(kid))) {
+                return false;
+            }
+            n.kids.push_back(std::move(kid));
+        }
+        return true;
+    }
+
+    bool parse_alt(node & n) {
+        node seq;
+        if (!parse_seq(seq)) {
+            return false;
+        }
+        if (!at('|')) {
+            n = std::move(seq);
+            return true;
+        }
+        n.type = node::ALT;
+        n.kids.push_back(std::move(seq));
+        while (at('|')) {
+            ++pos;
+            node next;
+            if (!parse_seq(next)) {
+                return false;
+            }
+            n.kids.push_back(std::move(next));
+        }
+        return true;
+    }
+
+    int emit(unicode_regex_inst::op_type op, int x = 0, int y = 0) {
+        out.prog.push_back({op, x, y});
+        return out.prog.size() - 1;
+    }
+
+    void emit_split(int at, int loop, bool greedy) {
+        int next = out.prog.size();
+        out.prog[at].x = greedy ? loop : next;
+        out.prog[at].y = greedy ? next : loop;
+    }
+
+    bool compile(const node & n) {
+        if (out.prog.size() > UNICODE_REGEX_MAX_PROGRAM) {
+            return false;
+        }
+        switch (n.type) {
+            case node::CHAR:     emit(unicode_regex_inst::CHAR, n.cls);     return true;
+            case node::LOOK:     emit(unicode_regex_inst::LOOK, n.cls);     return true;
+            case node::NOT_LOOK: emit(unicode_regex_inst::NOT_LOOK, n.cls); return true;
+            case node::BOL:      emit(unicode_regex_inst::BOL);             return true;
+            case node::EOL:      emit(unicode_regex_inst::EOL);             return true;
+            case node::CAT:
+                for (const auto & kid : n.kids) {
+                    if (!compile(kid)) {
+                        return false;
+                    }
+                }
+                return true;
+            case node::ALT: {
+                std::vector<int> jumps;
+                for (size_t i = 0; i + 1 < n.kids.size(); ++i) {
+                    int split = emit(unicode_regex_inst::SPLIT);
+                    out.prog[split].x = split + 1;
+                    if (!compile(n.kids[i])) {
+                        return false;
+                    }
+                    jumps.push_back(emit(unicode_regex_inst::JMP));
+                    out.prog[split].y = out.prog.size();
+                }
+                if (!compile(n.kids.back())) {
+                    return false;
+                }
+                for (int j : jumps) {
+                    out.prog[j].x = out.prog.size();
+                }
+                return true;
+            }
+            case node::REPEAT: {
+                for (int i = 0; i < n.min; ++i) {
+                    if (!compile(n.kids[0])) {
+                        return false;
+                    }
+                }
+                if (n.max < 0) {
+                    int split = emit(unicode_regex_inst::SPLIT);
+                    if (!compile(n.kids[0])) {
+                        return false;
+                    }
+                    emit(unicode_regex_inst::JMP, split);
+                    emit_split(split, split + 1, n.greedy);
+                    return true;
+                }
+                // x{2,4} becomes xx(x(x)?)? where every ? skips to the end
+                std::vector<int> splits;
+                for (int i = n.min; i < n.max; ++i) {
+                    splits.push_back(emit(unicode_regex_inst::SPLIT));
+                    if (!compile(n.kids[0])) {
+                        return false;
+                    }
+                }
+                for (int split : splits) {
+                    emit_split(split, split + 1, n.greedy);
+                }
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool parse() {
+        node root;
+        if (!parse_alt(root) || pos != re.size() || !compile(root)) {
+            return false;
+        }
+        emit(unicode_regex_inst::MATCH);
+        return out.link();
+    }
+};
 
-    (void)(text);
-    (void)(regex_expr);
-    (void)(offsets);
-    // TODO: this implementation is actually wrong, uncomment and run:
-    //       make -j && ./bin/test-tokenizer-0 ../models/ggml-vocab-gpt-2.gguf
-    //if (regex_expr == "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)") {
-    //    bpe_offsets = unicode_regex_split_custom_gpt2(text, offsets);
-    //}
+// lazily built dfa, for matches anchored where the search begins
+//
+// Its states are the lists of vm threads still alive, in order of their
+// preference, which are all that matter when every thread started at the
+// same place. Transitions are made the first time they're needed, by
+// running the vm for one step. Codepoints outside ASCII are told apart by
+// which classes of the regex match them.
+struct unicode_regex_dfa {
+    struct state {
+        std::vector<int> pcs;
+        bool bol;
+        int ascii[128]; // next state times two, plus one if it matched before consuming, or -1
+        std::unordered_map<uint64_t, int> other;
+        int end = -1;   // one if it matches at end of chunk
+    };
 
+    const unicode_regex & re;
+    std::vector<state> states;
+    std::map<std::pair<std::vector<int>, bool>, int> index;
+    std::vector<size_t> mark;
+    size_t gen = 0;
+    std::vector<int> next;
+    bool matched;
+
+    explicit unicode_regex_dfa(const unicode_regex & re) : re(re), mark(re.prog.size(), 0) {
+        intern({}, false);  // dead
+        intern({0}, false); // start
+        intern({0}, true);  // start at beginning of chunk
+    }
+
+    int intern(const std::vector<int> & pcs, bool bol) {
+        auto it = index.find({pcs, bol});
+        if (it != index.end()) {
+            return it->second;
+        }
+        if (states.size() >= UNICODE_REGEX_MAX_STATES) {
+            return -1;
+        }
+        states.emplace_back();
+        states.back().pcs = pcs;
+        states.back().bol = bol;
+        std::fill(std::begin(states.back().ascii), std::end(states.back().ascii), -1);
+        index.emplace(std::make_pair(pcs, bol), states.size() - 1);
+        return states.size() - 1;
+    }
+
+    // returns false once a match cuts off the remaining threads
+    bool expand(int pc, bool bol, uint32_t cp, uint8_t cp_flags, bool at_end) {
+        for (int k = re.closure_offs[pc]; k < re.closure_offs[pc + 1]; ++k) {
+            int at = re.closures[k];
+            if (mark[at] == gen) {
+                continue;
+            }
+            mark[at] = gen;
+            const unicode_regex_inst & inst = re.prog[at];
+            bool follow = false;
+            switch (inst.op) {
+                case unicode_regex_inst::BOL:
+                    follow = bol;
+                    break;
+                case unicode_regex_inst::EOL:
+                    follow = at_end;
+                    break;
+                case unicode_regex_inst::LOOK:
+                case unicode_regex_inst::NOT_LOOK:
+                    follow = (!at_end && re.classes[inst.x].match(cp, cp_flags)) == (inst.op == unicode_regex_inst::LOOK);
+                    break;
+                case unicode_regex_inst::MATCH:
+                    matched = true;
+                    return false;
+                default:
+                    if (!at_end && re.classes[inst.x].match(cp, cp_flags)) {
+                        next.push_back(at + 1);
+                    }
+                    break;
+            }
+            if (follow && !expand(at + 1, bol, cp, cp_flags, at_end)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // runs the vm one step from state s, returning the transition
+    int step(int s, uint32_t cp, uint8_t cp_flags, bool at_end) {
+        const std::vector<int> pcs = states[s].pcs;
+        const bool bol = states[s].bol;
+        ++gen;
+        next.clear();
+        matched = false;
+        for (int pc : pcs) {
+            if (!expand(pc, bol, cp, cp_flags, at_end)) {
+                break;
+            }
+        }
+        if (at_end) {
+            return matched;
+        }
+        int ns = intern(next, false);
+        return ns < 0 ? -1 : ns * 2 + matched;
+    }
+
+    int transition(int s, uint32_t cp, uint8_t cp_flags) {
+        if (cp < 128) {
+            if (states[s].ascii[cp] < 0) {
+                int t = step(s, cp, cp_flags, false);
+                states[s].ascii[cp] = t;
+            }
+            return states[s].ascii[cp];
+        }
+        uint64_t key = 0;
+        for (size_t c = 0; c < re.classes.size(); ++c) {
+            if (re.classes[c].match_slow(cp, cp_flags)) {
+                key |= (uint64_t) 1 << c;
+            }
+        }
+        auto it = states[s].other.find(key);
+        if (it != states[s].other.end()) {
+            return it->second;
+        }
+        int t = step(s, cp, cp_flags, false);
+        if (t >= 0) {
+            states[s].other[key] = t;
+        }
+        return t;
+    }
+
+    // returns 1 if [pos,match_end) matches, 0 if nothing at pos does, or -1 if the dfa got too big
+    int match(const uint32_t * cpts, const uint8_t * flags, size_t pos, size_t end, bool bol, size_t & match_end) {
+        int s = bol ? 2 : 1;
+        int found = 0;
+        for (size_t i = pos;; ++i) {
+            if (i == end) {
+                if (states[s].end < 0) {
+                    states[s].end = step(s, 0, 0, true);
+                }
+                if (states[s].end) {
+                    found = 1;
+                    match_end = end;
+                }
+                break;
+            }
+            int t = transition(s, cpts[i], flags[i]);
+            if (t < 0) {
+                return -1;
+            }
+            if (t & 1) {
+                found = 1;
+                match_end = i;
+            }
+            if (!(s = t >> 1)) {
+                break;
+            }
+        }
+        return found;
+    }
+};
+
+static std::shared_ptr<const unicode_regex> unicode_regex_compile(const std::string & regex_expr, bool collapsed) {
+    static std::mutex lock;
+    static std::map<std::pair<std::string, bool>, std::shared_ptr<const unicode_regex>> cache;
+
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = cache.find({regex_expr, collapsed});
+    if (it != cache.end()) {
+        return it->second;
+    }
+    auto re = std::make_shared<unicode_regex>();
+    re->collapsed = collapsed;
+    const auto cpts_regex = unicode_cpts_from_utf8(regex_expr);
+    unicode_regex_parser parser(cpts_regex, *re);
+    std::shared_ptr<const unicode_regex> res;
+    // std::regex refuses categories mixed with non-ASCII, let it explain
+    bool ok = !collapsed || std::all_of(cpts_regex.begin(), cpts_regex.end(), [](uint32_t c) { return c < 128; });
+    if (ok && parser.parse()) {
+        if (re->classes.size() <= 64) {
+            re->dfa = std::make_shared<unicode_regex_dfa>(*re);
+        }
+        res = std::move(re);
+    }
+    cache[{regex_expr, collapsed}] = res;
+    return res;
+}
+
+// state of the pike vm, which is reused between searches
+struct unicode_regex_vm {
+    struct thread {
+        int pc;
+        size_t start;
+    };
+
+    const unicode_regex & re;
+    const uint32_t * cpts;
+    const uint8_t * flags;
+    std::vector<thread> clist;
+    std::vector<thread> nlist;
+    std::vector<size_t> mark;
+    size_t gen = 0;
+
+    unicode_regex_vm(const unicode_regex & re, const uint32_t * cpts, const uint8_t * flags)
+        : re(re), cpts(cpts), flags(flags), mark(re.prog.size(), 0) {}
+
+    // follows the empty transitions from pc, to threads at codepoint i
+    void add(std::vector<thread> & list, int pc, size_t start, size_t i, size_t bol, size_t end) {
+        for (int k = re.closure_offs[pc]; k < re.closure_offs[pc + 1]; ++k) {
+            int at = re.closures[k];
+            if (mark[at] == gen) {
+                continue;
+            }
+            mark[at] = gen;
+            const unicode_regex_inst & inst = re.prog[at];
+            switch (inst.op) {
+                case unicode_regex_inst::BOL:
+                    if (i == bol) {
+                        add(list, at + 1, start, i, bol, end);
+                    }
+                    break;
+                case unicode_regex_inst::EOL:
+                    if (i == end) {
+                        add(list, at + 1, start, i, bol, end);
+                    }
+                    break;
+                case unicode_regex_inst::LOOK:
+                case unicode_regex_inst::NOT_LOOK:
+                    if ((i < end && re.classes[inst.x].match(cpts[i], flags[i])) == (inst.op == unicode_regex_inst::LOOK)) {
+                        add(list, at + 1, start, i, bol, end);
+                    }
+                    break;
+                default:
+                    list.push_back({at, start});
+                    break;
+            }
+        }
+    }
+
+    // finds leftmost-first match in [pos,end), like std::regex_search()
+    //
+    // `continuous` only allows matches starting at pos, `not_null` forbids
+    // an empty match, and `prev_avail` means pos isn't the beginning.
+    bool search(size_t pos, size_t end, bool continuous, bool not_null, bool prev_avail,
+                size_t & match_start, size_t & match_end) {
+        const size_t bol = prev_avail ? SIZE_MAX : pos;
+        bool matched = false;
+        clist.clear();
+        ++gen;
+        for (size_t i = pos;; ++i) {
+            if (!matched && (i == pos || !continuous)) {
+                add(clist, 0, i, i, bol, end);
+            }
+            if (clist.empty() && (matched || continuous || i >= end)) {
+                break;
+            }
+            ++gen;
+            nlist.clear();
+            for (const thread & t : clist) {
+                const unicode_regex_inst & inst = re.prog[t.pc];
+                if (inst.op == unicode_regex_inst::MATCH) {
+                    if (not_null && t.start == i) {
+                        continue;
+                    }
+                    // threads after this one are less preferred
+                    matched = true;
+                    match_start = t.start;
+                    match_end = i;
+                    break;
+                }
+                if (i < end && re.classes[inst.x].match(cpts[i], flags[i])) {
+                    add(nlist, t.pc + 1, t.start, i + 1, bol, end);
+                }
+            }
+            std::swap(clist, nlist);
+            if (i >= end) {
+                break;
+            }
+        }
+        return matched;
+    }
+};
+
+// splits each chunk like iterating over it with std::regex_iterator
+static std::vector<size_t> unicode_regex_split_custom(const unicode_regex & re, const std::vector<uint32_t> & cpts,
+                                                      const std::vector<uint8_t> & flags, const std::vector<size_t> & offsets) {
+    std::vector<size_t> bpe_offsets; // store the offset of each word
+    bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
+    unicode_regex_vm vm(re, cpts.data(), flags.data());
+    // the dfa is only used by one thread at a time, and others make do with the vm
+    std::unique_lock<std::mutex> guard(re.dfa_lock, std::try_to_lock);
+    unicode_regex_dfa * dfa = guard.owns_lock() ? re.dfa.get() : nullptr;
+    size_t start = 0;
+    for (auto offset : offsets) {
+        const size_t end = start + offset;
+        size_t prev = start;
+        size_t match_start, match_end;
+        auto search = [&](size_t pos, bool continuous, bool not_null, bool prev_avail) {
+            if (dfa && !not_null) {
+                switch (dfa->match(cpts.data(), flags.data(), pos, end, !prev_avail, match_end)) {
+                    case 1:
+                        match_start = pos;
+                        return true;
+                    case 0:
+                        if (continuous || pos == end) {
+                            return false;
+                        }
+                        return vm.search(pos + 1, end, false, false, true, match_start, match_end);
+                    default:
+                        break;
+                }
+            }
+            return vm.search(pos, end, continuous, not_null, prev_avail, match_start, match_end);
+        };
+        bool found = search(start, false, false, false);
+        while (found) {
+            if (match_start > prev) {
+                bpe_offsets.emplace_back(match_start - prev);
+            }
+            bpe_offsets.emplace_back(match_end - match_start);
+            prev = match_end;
+            size_t pos = match_end;
+            if (match_start == match_end) {
+                if (pos == end) {
+                    break;
+                }
+                if (search(pos, true, true, true)) {
+                    continue;
+                }
+                ++pos;
+            }
+            found = search(pos, false, false, true);
+        }
+        if (prev < end) {
+            bpe_offsets.emplace_back(end - prev);
+        }
+        start = end;
+    }
     return bpe_offsets;
 }
 
@@ -541,67 +1396,64 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
         { CODEPOINT_TYPE_PUNCTUATION,   "\x21-\x23\x25-\x2A\x2C-\x2F\x3A-\x3B\x3F-\x40\\\x5B-\\\x5D\x5F\\\x7B\\\x7D" }, // !-#%-*,-/:-;?-@\[-\]_\{\}
     };
 
-    // compute collapsed codepoints only if needed by at least one regex
-    bool need_collapse = false;
-    for (auto & regex_expr : regex_exprs) {
-        // search for unicode categories
-        for (const auto & ucat : k_ucat_enum) {
-            if (std::string::npos != regex_expr.find(ucat.first)) {
-                need_collapse = true;
-                break;
-            }
-        }
-    }
-
     const auto cpts = unicode_cpts_from_utf8(text);
 
+    // classify codepoints only for the kinds of regex that need it
+    std::vector<uint8_t> cpt_flags[2];
+
     // generate a "collapsed" representation of the text, where all codepoints are replaced by a single byte
     // ref: https://github.com/ggerganov/llama.cpp/pull/6920#issuecomment-2081479935
     std::string text_collapsed;
-    if (need_collapse) {
-        // collapse all unicode categories
-        text_collapsed.resize(cpts.size());
-
-        for (size_t i = 0; i < cpts.size(); ++i) {
-            // keep single-byte codepoints as is
-            if (cpts[i] < 128) {
-                text_collapsed[i] = cpts[i];
-                continue;
-            }
 
-            const int cpt_type = unicode_cpt_type(cpts[i]);
+    std::vector<size_t> bpe_offsets = { cpts.size() };
 
-            if (k_ucat_cpt.find(cpt_type) != k_ucat_cpt.end()) {
-                text_collapsed[i] = k_ucat_cpt.at(cpt_type);
-            } else {
-                text_collapsed[i] = (char) 0xD0; // fallback
+    for (auto & regex_expr : regex_exprs) {
+        // if a unicode category is used in the regex, we use the collapsed text and replace the unicode category
+        // with the corresponding collapsed representation
+        bool use_collapsed = false;
+        for (auto & ucat : k_ucat_enum) {
+            if (std::string::npos != regex_expr.find(ucat.first)) {
+                use_collapsed = true;
+                break;
             }
         }
-    }
-
-    std::vector<size_t> bpe_offsets = { cpts.size() };
 
-    for (auto & regex_expr : regex_exprs) {
         // first, see if we have an efficient custom regex implementation
-        auto tmp = unicode_regex_split_custom(text, regex_expr, bpe_offsets);
-
-        if (!tmp.empty()) {
-            bpe_offsets = std::move(tmp);
+        if (auto re = unicode_regex_compile(regex_expr, use_collapsed)) {
+            std::vector<uint8_t> & flags = cpt_flags[use_collapsed];
+            if (flags.empty()) {
+                flags.resize(cpts.size());
+                for (size_t i = 0; i < cpts.size(); ++i) {
+                    flags[i] = unicode_cpt_flags(cpts[i], use_collapsed);
+                }
+            }
+            bpe_offsets = unicode_regex_split_custom(*re, cpts, flags, bpe_offsets);
             continue;
         }
 
-        // fallback to general-purpose std::regex / std::wregex
-        try {
-            // if a unicode category is used in the regex, we use the collapsed text and replace the unicode category
-            // with the corresponding collapsed representation
-            bool use_collapsed = false;
-            for (auto & ucat : k_ucat_enum) {
-                if (std::string::npos != regex_expr.find(ucat.first)) {
-                    use_collapsed = true;
-                    break;
+        if (use_collapsed && text_collapsed.empty()) {
+            // collapse all unicode categories
+            text_collapsed.resize(cpts.size());
+
+            for (size_t i = 0; i < cpts.size(); ++i) {
+                // keep single-byte codepoints as is
+                if (cpts[i] < 128) {
+                    text_collapsed[i] = cpts[i];
+                    continue;
+                }
+
+                const int cpt_type = unicode_cpt_type(cpts[i]);
+
+                if (k_ucat_cpt.find(cpt_type) != k_ucat_cpt.end()) {
+                    text_collapsed[i] = k_ucat_cpt.at(cpt_type);
+                } else {
+                    text_collapsed[i] = (char) 0xD0; // fallback
                 }
             }
+        }
 
+        // fallback to general-purpose std::regex / std::wregex
+        try {
             if (use_collapsed) {
                 // sanity-check that the original regex does not contain any non-ASCII characters
                 const auto cpts_regex = unicode_cpts_from_utf8(regex_expr);
@@ -61,6 +61,7 @@ o/$(MODE)/llamafile:					\
 # - 2018 cannonlake     SHA (-march=cannonlake)
 # - 2019 cascadelake    VNNI
 # - 2021 alderlake      efficiency cores
+# - 2023 sapphirerapids AMX-TILE AMX-INT8 AMX-BF16 (-march=sapphirerapids)
 #
 #### AMD CPU Line
 #
@@ -86,10 +87,12 @@ o/$(MODE)/llamafile:					\
 # - HWCAP_FPHP          +fp16     (e.g. m1, rpi5)  __ARM_FEATURE_FP16_SCALAR_ARITHMETIC
 # - HWCAP_ASIMDHP       +fp16     (e.g. m1, rpi5)  __ARM_FEATURE_FP16_VECTOR_ARITHMETIC
 # - HWCAP_ASIMDDP       +dotprod  (e.g. m1, rpi5)  __ARM_FEATURE_DOTPROD
+# - HWCAP2_I8MM         +i8mm     (e.g. m2, graviton3)  __ARM_FEATURE_MATMUL_INT8
+# - HWCAP2_BF16         +bf16     (e.g. m2, graviton3)  __ARM_FEATURE_BF16_VECTOR_ARITHMETIC
 #
 
 o/$(MODE)/llamafile/sgemm.o: private CXXFLAGS += -Os
-o/$(MODE)/llamafile/iqk_mul_mat.o: private TARGET_ARCH += -Xx86_64-mtune=skylake -Xx86_64-mavx2 -Xx86_64-mfma
+o/$(MODE)/llamafile/iqk_mul_mat.o: private TARGET_ARCH += -Xx86_64-mtune=skylake -Xx86_64-mavx2 -Xx86_64-mfma -Xaarch64-march=armv8.2-a+dotprod+fp16
 o/$(MODE)/llamafile/tinyblas_cpu_sgemm_amd_avx.o: private TARGET_ARCH += -Xx86_64-mtune=sandybridge -Xx86_64-mf16c
 o/$(MODE)/llamafile/tinyblas_cpu_mixmul_amd_avx.o: private TARGET_ARCH += -Xx86_64-mtune=sandybridge -Xx86_64-mf16c
 o/$(MODE)/llamafile/tinyblas_cpu_sgemm_amd_fma.o: private TARGET_ARCH += -Xx86_64-mtune=bdver2 -Xx86_64-mf16c -Xx86_64-mfma
@@ -102,8 +105,12 @@ o/$(MODE)/llamafile/tinyblas_cpu_sgemm_amd_avx512f.o: private TARGET_ARCH += -Xx
 o/$(MODE)/llamafile/tinyblas_cpu_mixmul_amd_avx512f.o: private TARGET_ARCH += -Xx86_64-mtune=cannonlake -Xx86_64-mf16c -Xx86_64-mfma -Xx86_64-mavx2 -Xx86_64-mavx512f
 o/$(MODE)/llamafile/tinyblas_cpu_sgemm_amd_zen4.o: private TARGET_ARCH += -Xx86_64-mtune=znver4 -Xx86_64-mf16c -Xx86_64-mfma -Xx86_64-mavx2 -Xx86_64-mavx512f -Xx86_64-mavx512vl -Xx86_64-mavx512vnni -Xx86_64-mavx512bf16
 o/$(MODE)/llamafile/tinyblas_cpu_mixmul_amd_zen4.o: private TARGET_ARCH += -Xx86_64-mtune=znver4 -Xx86_64-mf16c -Xx86_64-mfma -Xx86_64-mavx2 -Xx86_64-mavx512f -Xx86_64-mavx512vl -Xx86_64-mavx512vnni -Xx86_64-mavx512bf16
+o/$(MODE)/llamafile/tinyblas_cpu_sgemm_amd_amx.o: private TARGET_ARCH += -Xx86_64-mtune=sapphirerapids -Xx86_64-mf16c -Xx86_64-mfma -Xx86_64-mavx2 -Xx86_64-mavx512f -Xx86_64-mavx512vl -Xx86_64-mavx512vnni -Xx86_64-mavx512bf16 -Xx86_64-mamx-tile -Xx86_64-mamx-int8 -Xx86_64-mamx-bf16
+o/$(MODE)/llamafile/tinyblas_cpu_mixmul_amd_amx.o: private TARGET_ARCH += -Xx86_64-mtune=sapphirerapids -Xx86_64-mf16c -Xx86_64-mfma -Xx86_64-mavx2 -Xx86_64-mavx512f -Xx86_64-mavx512vl -Xx86_64-mavx512vnni -Xx86_64-mavx512bf16 -Xx86_64-mamx-tile -Xx86_64-mamx-int8 -Xx86_64-mamx-bf16
 o/$(MODE)/llamafile/tinyblas_cpu_sgemm_arm82.o: private TARGET_ARCH += -Xaarch64-march=armv8.2-a+dotprod+fp16
 o/$(MODE)/llamafile/tinyblas_cpu_mixmul_arm82.o: private TARGET_ARCH += -Xaarch64-march=armv8.2-a+dotprod+fp16
+o/$(MODE)/llamafile/tinyblas_cpu_sgemm_arm86.o: private TARGET_ARCH += -Xaarch64-march=armv8.6-a+dotprod+fp16+i8mm+bf16
+o/$(MODE)/llamafile/tinyblas_cpu_mixmul_arm86.o: private TARGET_ARCH += -Xaarch64-march=armv8.6-a+dotprod+fp16+i8mm+bf16
 
 ################################################################################
 # testing
@@ -112,6 +119,8 @@ o/$(MODE)/llamafile/sgemm_sss_test: private LDFLAGS += -fopenmp
 o/$(MODE)/llamafile/sgemm_sss_test.o: private CCFLAGS += -fopenmp
 o/$(MODE)/llamafile/sgemm_matmul_test: private LDFLAGS += -fopenmp
 o/$(MODE)/llamafile/sgemm_matmul_test.o: private CCFLAGS += -fopenmp
+o/$(MODE)/llamafile/sgemm_bench: private LDFLAGS += -fopenmp
+o/$(MODE)/llamafile/sgemm_bench.o: private CCFLAGS += -fopenmp
 
 o/$(MODE)/llamafile/sgemm_sss_test:			\
 		o/$(MODE)/llamafile/sgemm_sss_test.o	\
@@ -125,6 +134,38 @@ o/$(MODE)/llamafile/sgemm_vecdot_test:			\
 		o/$(MODE)/llamafile/sgemm_vecdot_test.o	\
 		o/$(MODE)/llama.cpp/llama.cpp.a
 
+o/$(MODE)/llamafile/sgemm_splitk_test:			\
+		o/$(MODE)/llamafile/sgemm_splitk_test.o	\
+		o/$(MODE)/llama.cpp/llama.cpp.a
+
+o/$(MODE)/llamafile/sgemm_iqk_test:			\
+		o/$(MODE)/llamafile/sgemm_iqk_test.o	\
+		o/$(MODE)/llama.cpp/llama.cpp.a
+
+o/$(MODE)/llamafile/sgemm_amx_test:			\
+		o/$(MODE)/llamafile/sgemm_amx_test.o	\
+		o/$(MODE)/llama.cpp/llama.cpp.a
+
+o/$(MODE)/llamafile/sgemm_repack_test:			\
+		o/$(MODE)/llamafile/sgemm_repack_test.o	\
+		o/$(MODE)/llama.cpp/llama.cpp.a
+
+o/$(MODE)/llamafile/sgemm_mmla_test:			\
+		o/$(MODE)/llamafile/sgemm_mmla_test.o	\
+		o/$(MODE)/llama.cpp/llama.cpp.a
+
+o/$(MODE)/llamafile/sgemm_f8_test:			\
+		o/$(MODE)/llamafile/sgemm_f8_test.o	\
+		o/$(MODE)/llama.cpp/llama.cpp.a
+
+o/$(MODE)/llamafile/quantize_iq_test:			\
+		o/$(MODE)/llamafile/quantize_iq_test.o	\
+		o/$(MODE)/llama.cpp/llama.cpp.a
+
+o/$(MODE)/llamafile/sgemm_bench:			\
+		o/$(MODE)/llamafile/sgemm_bench.o	\
+		o/$(MODE)/llama.cpp/llama.cpp.a
+
 o/$(MODE)/llamafile/%.o: llamafile/%.cu llamafile/BUILD.mk
 	@mkdir -p $(@D)
 	build/cudacc -fPIE -g -O3 -march=native -ffast-math --use_fast_math -c -o $@ $<
@@ -0,0 +1,422 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "llama.cpp/ggml.h"
+#include "llamafile.h"
+#include "log.h"
+#include "macros.h"
+#include "sgemm.h"
+#include <algorithm>
+#include <cosmo.h>
+#include <cpuid.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <malloc.h>
+#include <mutex>
+#include <pthread.h>
+#include <sched.h>
+
+//
+// hybrid cpu placement
+//
+// Intel chips since Alder Lake mix performance cores with slower
+// efficiency cores, and ARM big.LITTLE chips do the same. ggml gives
+// every thread an equal part of each operation, so each barrier waits
+// on whichever thread the kernel put on the slowest core. When a cpu
+// has more than one kind of core, the ggml thread pool pins thread i
+// to the i-th cpu of a plan listing the fastest cores first, and the
+// matmul kernels give each thread a share of the work that's in
+// proportion to how fast its kind of core ran a sample matmul.
+//
+
+#define CORES_MAX 512
+#define CORES_RUNS 5
+#define CORES_ROWS 256
+#define CORES_COLS 32
+#define CORES_DEPTH 1024
+
+namespace {
+
+struct core {
+    int cpu;
+    long key; // capacity or core type, where higher is faster
+    bool primary; // first hardware thread of its core
+};
+
+struct topology {
+    int n;
+    core cores[CORES_MAX];
+    int kinds; // number of distinct keys
+    bool pinnable; // cores were told apart on a system with affinity
+    int n_math; // cores of the fastest kind, counting each once
+} g_topo;
+
+struct plan {
+    bool active;
+    int n;
+    int cpu[CORES_MAX]; // where thread i runs, modulo n
+    long prefix[CORES_MAX + 1]; // summed speed of threads [0,i)
+} g_plan;
+
+thread_local bool t_pinned;
+thread_local bool t_restore;
+thread_local cpu_set_t t_saved;
+
+bool read_long(const char *path, long *x) {
+    FILE *f;
+    if (!(f = fopen(path, "r")))
+        return false;
+    bool ok = fscanf(f, "%ld", x) == 1;
+    fclose(f);
+    return ok;
+}
+
+// reads a list like "0-7,16" from sysfs
+bool read_cpus(const char *path, cpu_set_t *set) {
+    FILE *f;
+    char buf[1024];
+    if (!(f = fopen(path, "r")))
+        return false;
+    bool ok = !!fgets(buf, sizeof(buf), f);
+    fclose(f);
+    if (!ok)
+        return false;
+    CPU_ZERO(set);
+    for (char *p = buf; *p && *p != '\n';) {
+        char *e;
+        long lo = strtol(p, &e, 10);
+        if (e == p)
+            return false;
+        long hi = lo;
+        if (*e == '-')
+            hi = strtol(e + 1, &e, 10);
+        for (long i = lo; i <= hi && i < CPU_SETSIZE; ++i)
+            CPU_SET(i, set);
+        p = *e == ',' ? e + 1 : e;
+    }
+    return true;
+}
+
+bool pin(int cpu) {
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    CPU_SET(cpu, &mask);
+    return !pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask);
+}
+
+#ifdef __x86_64__
+// asks each cpu whether it's an atom or a core, and which of the
+// hardware threads of its core it is
+bool detect_cpuid(void) {
+    unsigned eax, ebx, ecx, edx;
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) || !(edx & (1u << 15)))
+        return false; // not hybrid
+    if (__get_cpuid_max(0, 0) < 0x1a)
+        return false;
+    bool x2apic = __get_cpuid_max(0, 0) >= 0xb;
+    for (int i = 0; i < g_topo.n; ++i) {
+        if (!pin(g_topo.cores[i].cpu))
+            return false;
+        __cpuid_count(0x1a, 0, eax, ebx, ecx, edx);
+        g_topo.cores[i].key = (eax >> 24) == 0x20 ? 1 : 2; // intel atom : intel core
+        if (x2apic) {
+            __cpuid_count(0xb, 0, eax, ebx, ecx, edx);
+            g_topo.cores[i].primary = !(edx & ((1u << (eax & 31)) - 1));
+        }
+    }
+    return true;
+}
+#endif
+
+void detect(void) {
+#ifdef __aarch64__
+    // apple silicon can't be pinned, but we can still count its cores
+    if (IsXnu()) {
+        int perflevels, physical;
+        size_t len = sizeof(int);
+        if (!sysctlbyname("hw.nperflevels", &perflevels, &len, 0, 0) && perflevels > 1 &&
+            !sysctlbyname("hw.perflevel0.physicalcpu", &physical, &len, 0, 0)) {
+            g_topo.kinds = perflevels;
+            g_topo.n_math = physical;
+        }
+        return;
+    }
+#endif
+
+    cpu_set_t mask;
+    if (pthread_getaffinity_np(pthread_self(), sizeof(mask), &mask))
+        return;
+    for (int cpu = 0; cpu < CPU_SETSIZE && g_topo.n < CORES_MAX; ++cpu)
+        if (CPU_ISSET(cpu, &mask))
+            g_topo.cores[g_topo.n++] = {cpu, 0, true};
+
+    // arm big.LITTLE and recent linux on intel publish each cpu's capacity
+    char path[128];
+    bool found = false;
+    for (int i = 0; i < g_topo.n; ++i) {
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cpu_capacity",
+                 g_topo.cores[i].cpu);
+        if (!read_long(path, &g_topo.cores[i].key))
+            break;
+        if (g_topo.cores[i].key != g_topo.cores[0].key)
+            found = true;
+    }
+
+    // linux has a perf pmu for each kind of core on intel hybrid chips
+    cpu_set_t atoms;
+    if (!found && read_cpus("/sys/devices/cpu_atom/cpus", &atoms)) {
+        for (int i = 0; i < g_topo.n; ++i) {
+            g_topo.cores[i].key = CPU_ISSET(g_topo.cores[i].cpu, &atoms) ? 1 : 2;
+            if (g_topo.cores[i].key != g_topo.cores[0].key)
+                found = true;
+        }
+    }
+
+#ifdef __x86_64__
+    // e.g. windows
+    if (!found) {
+        found = detect_cpuid();
+        pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask);
+    }
+#endif
+
+    if (!found)
+        return;
+    g_topo.pinnable = true;
+
+    for (int i = 0; i < g_topo.n; ++i) {
+        cpu_set_t siblings;
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list",
+                 g_topo.cores[i].cpu);
+        if (!read_cpus(path, &siblings))
+            continue;
+        for (int cpu = 0; cpu < g_topo.cores[i].cpu; ++cpu)
+            if (CPU_ISSET(cpu, &siblings))
+                g_topo.cores[i].primary = false;
+    }
+
+    long fastest = 0;
+    for (int i = 0; i < g_topo.n; ++i) {
+        bool seen = false;
+        for (int j = 0; j < i; ++j)
+            seen |= g_topo.cores[j].key == g_topo.cores[i].key;
+        g_topo.kinds += !seen;
+        fastest = MAX(fastest, g_topo.cores[i].key);
+    }
+    for (int i = 0; i < g_topo.n; ++i)
+        if (g_topo.cores[i].key == fastest && g_topo.cores[i].primary)
+            ++g_topo.n_math;
+}
+
+const topology &get_topology(void) {
+    static std::once_flag once;
+    std::call_once(once, detect);
+    return g_topo;
+}
+
+// returns microseconds the best of a few single threaded matmuls took
+long long time_matmul(int type) {
+    long k = CORES_DEPTH / ggml_blck_size((ggml_type)type);
+    size_t rowsize = ggml_row_size((ggml_type)type, CORES_DEPTH);
+    void *A = memalign(64, rowsize * CORES_ROWS);
+    void *B = memalign(64, rowsize * CORES_COLS);
+    float *C = (float *)memalign(64, sizeof(float) * CORES_ROWS * CORES_COLS);
+    long long best = -1;
+    if (A && B && C) {
+        memset(A, 0, rowsize * CORES_ROWS);
+        memset(B, 0, rowsize * CORES_COLS);
+        long ld = rowsize / ggml_type_size((ggml_type)type);
+        ggml_compute_params params = {GGML_TASK_TYPE_COMPUTE, 0, 1};
+        for (int run = 0; run <= CORES_RUNS; ++run) {
+            struct timespec start = timespec_real();
+            if (!llamafile_sgemm(&params, CORES_ROWS, CORES_COLS, k, A, ld, B, ld, C, CORES_ROWS,
+                                 type, type, GGML_TYPE_F32, GGML_PREC_DEFAULT)) {
+                best = -1;
+                break;
+            }
+            long long micros = timespec_tomicros(timespec_sub(timespec_real(), start));
+            if (run && (best < 0 || micros < best)) // first run warms up the caches
+                best = micros;
+        }
+    }
+    free(C);
+    free(B);
+    free(A);
+    return best < 0 ? -1 : MAX(best, 1);
+}
+
+void make_plan(void) {
+    const topology &topo = get_topology();
+    if (topo.kinds < 2 || !topo.pinnable)
+        return;
+
+    // time a matmul on one core of each kind
+    cpu_set_t mask;
+    if (pthread_getaffinity_np(pthread_self(), sizeof(mask), &mask))
+        return;
+    long long micros[CORES_MAX];
+    long long best = -1;
+    for (int i = 0; i < topo.n; ++i) {
+        micros[i] = -1;
+        for (int j = 0; j < i; ++j)
+            if (topo.cores[j].key == topo.cores[i].key && topo.cores[j].primary) {
+                micros[i] = micros[j];
+                break;
+            }
+        if (micros[i] != -1 || !topo.cores[i].primary)
+            continue;
+        if (!pin(topo.cores[i].cpu))
+            break;
+        if ((micros[i] = time_matmul(GGML_TYPE_Q8_0)) < 0)
+            micros[i] = time_matmul(GGML_TYPE_F32);
+        if (micros[i] < 0)
+            break;
+        if (best < 0 || micros[i] < best)
+            best = micros[i];
+    }
+    pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask);
+    if (best < 0)
+        return;
+
+    // sibling hyperthreads are timed like the primary thread of their kind
+    int weight[CORES_MAX];
+    bool uneven = false;
+    for (int i = 0; i < topo.n; ++i) {
+        if (micros[i] == -1)
+            for (int j = 0; j < topo.n; ++j)
+                if (topo.cores[j].key == topo.cores[i].key && micros[j] != -1) {
+                    micros[i] = micros[j];
+                    break;
+                }
+        if (micros[i] <= 0)
+            return;
+        weight[i] = MAX(1, 1024 * best / micros[i]);
+        if (weight[i] < 1024 * 9 / 10)
+            uneven = true;
+    }
+    if (!uneven)
+        return; // the kernel's scheduler does fine on its own
+
+    // fastest cores first, then the slower ones, then hyperthreads
+    int order[CORES_MAX];
+    int n = topo.n;
+    for (int i = 0; i < n; ++i)
+        order[i] = i;
+    std::stable_sort(order, order + n, [&](int a, int b) {
+        if (topo.cores[a].primary != topo.cores[b].primary)
+            return topo.cores[a].primary;
+        return weight[a] > weight[b];
+    });
+    for (int i = 0; i < CORES_MAX; ++i) {
+        if (i < n)
+            g_plan.cpu[i] = topo.cores[order[i]].cpu;
+        g_plan.prefix[i + 1] = g_plan.prefix[i] + weight[order[i % n]];
+    }
+    g_plan.n = n;
+    g_plan.active = true;
+
+    for (int i = 0, count = 0; i < n; ++i) {
+        const core &c = topo.cores[order[i]];
+        ++count;
+        if (!c.primary)
+            break;
+        if (i + 1 == n || !topo.cores[order[i + 1]].primary ||
+            topo.cores[order[i + 1]].key != c.key) {
+            tinylogf("llamafile: %d cores like cpu%d run matmuls at %d%% speed\n", count, c.cpu,
+                     weight[order[i]] * 100 / 1024);
+            count = 0;
+        }
+    }
+}
+
+} // namespace
+
+/**
+ * Returns number of performance cores, if the cpu has other kinds.
+ *
+ * Hyperthreads are only counted once. Zero is returned if every core
+ * is the same, or if the kinds of core couldn't be told apart.
+ */
+int llamafile_math_cpus(void) {
+    const topology &topo = get_topology();
+    return topo.kinds > 1 ? topo.n_math : 0;
+}
+
+/**
+ * Measures each kind of core, to decide where ggml threads should go.
+ *
+ * This pins the calling thread to each kind of core in turn, and then
+ * restores its affinity. It's a noop after the first call, and when
+ * the cores are all the same.
+ */
+void llamafile_plan_cores(void) {
+    static std::once_flag once;
+    std::call_once(once, make_plan);
+}
+
+/**
+ * Pins calling thread to the cpu of the ith ggml thread.
+ *
+ * Once this is called, llamafile_share() weighs the work of the calling
+ * thread by the speed of its core, even if pinning failed, since every
+ * thread of a graph has to agree on how work gets divided.
+ */
+void llamafile_pin_thread(int ith) {
+    if (!g_plan.active)
+        return;
+    if (!t_pinned)
+        t_restore = !pthread_getaffinity_np(pthread_self(), sizeof(t_saved), &t_saved);
+    pin(g_plan.cpu[ith % g_plan.n]);
+    t_pinned = true;
+}
+
+/**
+ * Gives calling thread back the affinity it had before being pinned.
+ */
+void llamafile_unpin_thread(void) {
+    if (!t_pinned)
+        return;
+    t_pinned = false;
+    if (t_restore)
+        pthread_setaffinity_np(pthread_self(), sizeof(t_saved), &t_saved);
+}
+
+/**
+ * Divides work between the threads of a graph.
+ *
+ * Threads that were pinned by llamafile_pin_thread() get a share that's
+ * in proportion to the speed of their core. Otherwise the work is split
+ * into equal parts, the way ggml has always done it.
+ *
+ * @param total is number of work items
+ * @param ith is thread index in [0,nth)
+ * @param nth is number of threads
+ * @param start receives first item of this thread
+ * @param end receives one past last item of this thread
+ */
+void llamafile_share(long total, int ith, int nth, long *start, long *end) {
+    if (t_pinned && nth > 1 && nth <= CORES_MAX) {
+        long whole = g_plan.prefix[nth];
+        *start = total * g_plan.prefix[ith] / whole;
+        *end = total * g_plan.prefix[ith + 1] / whole;
+    } else {
+        long duty = (total + nth - 1) / nth;
+        *start = MIN(duty * ith, total);
+        *end = MIN(*start + duty, total);
+    }
+}
@@ -25,12 +25,14 @@
 #include <cosmo.h>
 #include <dlfcn.h>
 #include <errno.h>
+#include <glob.h>
 #include <libgen.h>
 #include <limits.h>
 #include <pthread.h>
 #include <signal.h>
 #include <spawn.h>
 #include <stdatomic.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
@@ -101,6 +103,7 @@ static struct Cuda {
     typeof(ggml_backend_cuda_get_device_count) *GGML_CALL get_device_count;
     typeof(ggml_backend_cuda_unregister_host_buffer) *GGML_CALL unreg_host_buf;
     typeof(ggml_backend_cuda_register_host_buffer) *GGML_CALL register_host_buffer;
+    typeof(ggml_cuda_tune) *GGML_CALL tune;
 } ggml_cuda;
 
 static const char *Dlerror(void) {
@@ -518,6 +521,29 @@ static dontinline bool get_nvcc_arch_flag(const char *nvcc, char flag[static 32]
     return true;
 }
 
+// returns true if an --offload-arch=LIST flag names a microarchitecture
+// with matrix cores, i.e. cdna and rdna3, which hipblaslt and rocwmma use
+static bool has_amd_matrix_cores(const char *offload_arch) {
+    return strstr(offload_arch, "gfx908") || strstr(offload_arch, "gfx90a") ||
+           strstr(offload_arch, "gfx94") || strstr(offload_arch, "gfx11");
+}
+
+// returns true if the rocm sdk has a file, e.g. a library that's optional
+static bool get_rocm_file_path(char path[static PATH_MAX], const char *name) {
+    const char *hip_path;
+    if (!(hip_path = getenv("HIP_PATH")) && !(hip_path = getenv("ROCM_PATH")))
+        hip_path = "/opt/rocm";
+    strlcpy(path, hip_path, PATH_MAX);
+    strlcat(path, "/", PATH_MAX);
+    strlcat(path, name, PATH_MAX);
+    if (FileExists(path)) {
+        return true;
+    } else {
+        tinylog(__func__, ": note: ", path, " does not exist\n", NULL);
+        return false;
+    }
+}
+
 static bool compile_amd_windows(const char *clangxx, const char *dso, const char *src,
                                 const char *tmpdso) {
     const char *lib = IsWindows() ? "lib" : GetDsoExtension();
@@ -530,6 +556,13 @@ static bool compile_amd_windows(const char *clangxx, const char *dso, const char
         return false;
     }
 
+    // use matrix cores for flash attention and prefill if rocm has them
+    char path[PATH_MAX];
+    bool matrix_cores = has_amd_matrix_cores(offload_arch);
+    bool rocwmma = matrix_cores && get_rocm_file_path(path, "include/rocwmma/rocwmma.hpp");
+    bool hipblaslt = matrix_cores && !FLAG_tinyblas &&
+                     get_rocm_file_path(path, gc(xasprintf("lib/hipblaslt.%s", lib)));
+
     // run the compiler to create a native build
     //
     // there's a higher level program called hipcc, but we can't use it,
@@ -542,7 +575,7 @@ static bool compile_amd_windows(const char *clangxx, const char *dso, const char
         "-x",
         "hip",
         "--hip-link",
-        "-std=gnu++14",
+        rocwmma ? "-std=gnu++17" : "-std=gnu++14",
         "-fuse-ld=lld",
         "-DGGML_BUILD=1",
         "-DGGML_SHARED=1",
@@ -564,8 +597,12 @@ static bool compile_amd_windows(const char *clangxx, const char *dso, const char
         "-mllvm",
         "-amdgpu-early-inline-all=true",
         FLAG_tinyblas ? "-DGGML_USE_TINYBLAS" : "-DIGNORE",
+        rocwmma ? "-DGGML_HIP_ROCWMMA_FATTN" : "-DIGNORE",
+        hipblaslt ? "-DGGML_USE_HIPBLASLT" : "-DIGNORE",
         "-isystem",
         gc(xasprintf("%s/include", hip_path)),
+        hipblaslt ? "-l" : "-DIGNORE",
+        hipblaslt ? gc(xasprintf("%s/lib/hipblaslt.%s", hip_path, lib)) : "-DIGNORE",
         BLAS_ONLY("-l"),
         BLAS_ONLY(gc(xasprintf("%s/lib/hipblas.%s", hip_path, lib))),
         BLAS_ONLY("-l"),
@@ -587,6 +624,12 @@ static bool compile_amd_unix(const char *dso, const char *src, const char *tmpds
     if (!get_amd_offload_arch_flag(offload_arch))
         strcpy(offload_arch, "--offload-arch=native");
 
+    // use matrix cores for flash attention and prefill if rocm has them
+    char path[PATH_MAX];
+    bool matrix_cores = has_amd_matrix_cores(offload_arch);
+    bool rocwmma = matrix_cores && get_rocm_file_path(path, "include/rocwmma/rocwmma.hpp");
+    bool hipblaslt = matrix_cores && !FLAG_tinyblas && get_rocm_file_path(path, "lib/libhipblaslt.so");
+
     char *args[] = {
         "hipcc",
         "-O3",
@@ -608,9 +651,12 @@ static bool compile_amd_unix(const char *dso, const char *src, const char *tmpds
         "-DK_QUANTS_PER_ITERATION=2",
         "-DGGML_CUDA_PEER_MAX_BATCH_SIZE=128",
         FLAG_tinyblas ? "-DGGML_USE_TINYBLAS" : "-DIGNORE",
+        rocwmma ? "-DGGML_HIP_ROCWMMA_FATTN" : "-DIGNORE",
+        hipblaslt ? "-DGGML_USE_HIPBLASLT" : "-DIGNORE",
         "-o",
         (char *)tmpdso,
         (char *)src,
+        hipblaslt ? "-lhipblaslt" : "-DIGNORE",
         BLAS_ONLY("-lhipblas"),
         BLAS_ONLY("-lrocblas"),
         NULL,
@@ -727,6 +773,14 @@ static bool link_cuda_dso(const char *dso, const char *dir) {
     // ask the library if actual gpu devices exist
     if (ggml_cuda.link(ggml_backend_api())) {
         tinylog(__func__, ": GPU support loaded\n", NULL);
+        // tinyblas picks its kernels for each gpu architecture once and
+        // keeps the verdict next to the dso; older ones don't have this
+        if ((ggml_cuda.tune = cosmo_dlsym(lib, "ggml_cuda_tune"))) {
+            char path[PATH_MAX];
+            strlcpy(path, dso, sizeof(path));
+            strlcat(path, ".tune", sizeof(path));
+            ggml_cuda.tune(path);
+        }
         return true;
     } else {
         tinylog(__func__, ": No GPU devices found\n", NULL);
@@ -735,6 +789,104 @@ static bool link_cuda_dso(const char *dso, const char *dir) {
     }
 }
 
+// FNV-1a, which is plenty for naming files by their ingredients
+static uint64_t HashBytes(uint64_t h, const void *data, size_t size) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < size; ++i)
+        h = (h ^ p[i]) * 0x100000001b3;
+    return h;
+}
+
+static uint64_t HashString(uint64_t h, const char *s) {
+    return HashBytes(h, s, strlen(s) + 1);
+}
+
+// hashes lines of file that start with prefix, or all if it's empty
+static bool HashFile(uint64_t *h, const char *path, const char *prefix) {
+    FILE *f;
+    char line[512];
+    if (!(f = fopen(path, "r")))
+        return false;
+    while (fgets(line, sizeof(line), f))
+        if (startswith(line, prefix))
+            *h = HashString(*h, line);
+    fclose(f);
+    return true;
+}
+
+static bool HashFiles(uint64_t *h, const char *pattern, const char *prefix) {
+    glob_t g;
+    bool ok = false;
+    if (!glob(pattern, 0, 0, &g)) {
+        ok = true;
+        for (size_t i = 0; i < g.gl_pathc; ++i)
+            ok &= HashFile(h, g.gl_pathv[i], prefix);
+        globfree(&g);
+    }
+    return ok;
+}
+
+// hashes the models of the installed gpus, plus the nvidia driver,
+// without running anything, since that's what takes so long to do
+static bool HashGpus(uint64_t *h, int vendor) {
+    if (!IsLinux())
+        return false;
+    if (vendor == LLAMAFILE_GPU_NVIDIA)
+        return HashFile(h, "/proc/driver/nvidia/version", "") &&
+               HashFiles(h, "/proc/driver/nvidia/gpus/*/information", "Model:");
+    else
+        return HashFiles(h, "/sys/class/kfd/kfd/topology/nodes/*/properties", "gfx_target_version");
+}
+
+// Computes where a gpu module would be in the shared module cache.
+//
+// Building ggml-cuda takes minutes, and the app dir doesn't survive
+// things like container restarts. So $LLAMAFILE_GPU_CACHE may name a
+// directory, e.g. on a volume shared by many machines, with modules
+// named after a hash of everything that decides what gets built. It
+// may be read-only, in which case modules are only ever linked from
+// it, and must be filled in by a machine that's able to compile.
+static bool get_cached_dso_path(char path[static PATH_MAX], const char *name, int vendor) {
+    const char *dir;
+    if (!(dir = getenv("LLAMAFILE_GPU_CACHE")) || !*dir)
+        return false;
+    uint64_t h = 0xcbf29ce484222325;
+    for (int i = 0; i < sizeof(srcs) / sizeof(*srcs); ++i)
+        if (!HashFile(&h, srcs[i].zip, ""))
+            return false;
+    if (!HashGpus(&h, vendor))
+        return false;
+    // the host side gets compiled with -march=native
+    char cpu[128];
+    llamafile_get_cpu_name(cpu, sizeof(cpu));
+    h = HashString(h, cpu);
+    h = HashString(h, FLAG_tinyblas ? "tinyblas" : "blas");
+    h = HashString(h, IsAarch64() ? "aarch64" : "x86_64");
+    char key[17];
+    for (int i = 0; i < 16; ++i)
+        key[i] = "0123456789abcdef"[h >> (60 - i * 4) & 15];
+    key[16] = 0;
+    strlcpy(path, dir, PATH_MAX);
+    if (!endswith(path, "/"))
+        strlcat(path, "/", PATH_MAX);
+    strlcat(path, name, PATH_MAX);
+    strlcat(path, "-", PATH_MAX);
+    strlcat(path, key, PATH_MAX);
+    strlcat(path, ".", PATH_MAX);
+    strlcat(path, GetDsoExtension(), PATH_MAX);
+    return true;
+}
+
+// copies freshly built module into the shared cache if it's writable
+static void publish_cuda_dso(const char *dso, const char *cached) {
+    char dir[PATH_MAX];
+    strlcpy(dir, cached, PATH_MAX);
+    if (access(dirname(dir), W_OK))
+        return;
+    if (llamafile_extract(dso, cached))
+        chmod(cached, 0644);
+}
+
 static bool import_cuda_impl(void) {
 
     // No dynamic linking support on OpenBSD yet.
@@ -778,6 +930,8 @@ static bool import_cuda_impl(void) {
     }
 
     char dso[PATH_MAX];
+    char cached[PATH_MAX];
+    bool is_cached;
     char bindir[PATH_MAX];
     const char *compiler_path;
     char compiler_path_buf[PATH_MAX];
@@ -807,7 +961,10 @@ static bool import_cuda_impl(void) {
         llamafile_get_app_dir(dso, PATH_MAX);
         strlcat(dso, "ggml-rocm.", PATH_MAX);
         strlcat(dso, GetDsoExtension(), PATH_MAX);
+        is_cached = get_cached_dso_path(cached, "ggml-rocm", LLAMAFILE_GPU_AMD);
         if (FLAG_nocompile) {
+            if (!FileExists(dso) && is_cached && FileExists(cached))
+                strlcpy(dso, cached, PATH_MAX);
             if ((FileExists(dso) || extract_cuda_dso(dso, "ggml-rocm")) &&
                 link_cuda_dso(dso, library_path)) {
                 ggml_cuda.has_amd_gpu = true;
@@ -836,9 +993,18 @@ static bool import_cuda_impl(void) {
             }
         }
 
+        // Check if a machine like ours already built it.
+        if (is_cached && !FLAG_recompile && FileExists(cached) &&
+            link_cuda_dso(cached, library_path)) {
+            ggml_cuda.has_amd_gpu = true;
+            return true;
+        }
+
         // Try building CUDA with ROCm SDK.
         if (compiler_path) {
             if (compile_amd(compiler_path, dso, src)) {
+                if (is_cached)
+                    publish_cuda_dso(dso, cached);
                 if (link_cuda_dso(dso, library_path)) {
                     ggml_cuda.has_amd_gpu = true;
                     return true;
@@ -890,6 +1056,9 @@ TryNvidia:
         llamafile_get_app_dir(dso, PATH_MAX);
         strlcat(dso, "ggml-cuda.", PATH_MAX);
         strlcat(dso, GetDsoExtension(), PATH_MAX);
+        is_cached = get_cached_dso_path(cached, "ggml-cuda", LLAMAFILE_GPU_NVIDIA);
+        if (FLAG_nocompile && !FileExists(dso) && is_cached && FileExists(cached))
+            strlcpy(dso, cached, PATH_MAX);
         if (FLAG_nocompile)
             return ((FileExists(dso) || extract_cuda_dso(dso, "ggml-cuda")) &&
                     link_cuda_dso(dso, library_path));
@@ -908,9 +1077,17 @@ TryNvidia:
             }
         }
 
+        // Check if a machine like ours already built it.
+        if (is_cached && !FLAG_recompile && FileExists(cached) &&
+            link_cuda_dso(cached, library_path))
+            return true;
+
         // Try building CUDA from source with mighty cuBLAS.
-        if (compiler_path && compile_nvidia(compiler_path, dso, src))
+        if (compiler_path && compile_nvidia(compiler_path, dso, src)) {
+            if (is_cached)
+                publish_cuda_dso(dso, cached);
             return link_cuda_dso(dso, library_path);
+        }
 
         // Try extracting prebuilt tinyBLAS DSO from PKZIP.
         if (extract_cuda_dso(dso, "ggml-cuda"))
@@ -0,0 +1,249 @@
+// -*- mode:c;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=c ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "energy.h"
+#include "llamafile.h"
+#include <cosmo.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+//
+// energy counters
+//
+// Reports the joules the host has consumed since some arbitrary point
+// in time, so the difference of two readings is what was spent between
+// them. Processor packages are measured with the powercap interface of
+// linux to RAPL, or failing that with the energy MSRs of AMD chips, and
+// NVIDIA gpus are measured with NVML, if libnvidia-ml is installed. The
+// counters cover everything running on the machine, not just us.
+//
+// The files are opened by the first call, so that calling this before
+// pledge() lets the sandboxed server read them later. The RAPL counters
+// are readable by root only on kernels since 5.10, in which case there
+// just won't be any sources and the function returns -1.
+//
+
+#define ENERGY_MAX 64
+#define POWERCAP "/sys/class/powercap/intel-rapl"
+#define MSR_AMD_RAPL_POWER_UNIT 0xc0010299
+#define MSR_AMD_PKG_ENERGY_STATUS 0xc001029b
+
+struct counter {
+    int fd;
+    bool msr;       // else a text file of powercap
+    uint64_t last;  // previous raw reading
+    uint64_t range; // raw value at which the counter wraps around
+    double scale;   // joules per raw unit
+    double joules;  // accumulated since the first reading
+};
+
+typedef int nvmlReturn_t;
+typedef struct nvmlDevice *nvmlDevice_t;
+
+static struct {
+    pthread_once_t once;
+    pthread_mutex_t lock;
+    int n;
+    struct counter cpu[ENERGY_MAX];
+    unsigned ngpu;
+    nvmlDevice_t gpu[ENERGY_MAX];
+    uint64_t gpu_first[ENERGY_MAX]; // millijoules
+    uint64_t gpu_last[ENERGY_MAX];
+    nvmlReturn_t (*nvmlDeviceGetTotalEnergyConsumption)(nvmlDevice_t, unsigned long long *);
+    char sources[64];
+} g_energy = {
+    PTHREAD_ONCE_INIT,
+    PTHREAD_MUTEX_INITIALIZER,
+};
+
+static bool read_u64(int fd, off_t off, bool text, uint64_t *x) {
+    if (text) {
+        char buf[32];
+        ssize_t n = pread(fd, buf, sizeof(buf) - 1, off);
+        if (n <= 0)
+            return false;
+        buf[n] = 0;
+        *x = strtoull(buf, 0, 10);
+    } else if (pread(fd, x, 8, off) != 8) {
+        return false;
+    }
+    return true;
+}
+
+static bool read_file_u64(const char *path, uint64_t *x) {
+    int fd;
+    bool ok;
+    if ((fd = open(path, O_RDONLY)) == -1)
+        return false;
+    ok = read_u64(fd, 0, true, x);
+    close(fd);
+    return ok;
+}
+
+// sums the package domains, whose subdomains (cores, dram, etc.) they
+// already include, or are left out of in the case of dram, which every
+// package reports separately as intel-rapl:N:M
+static void open_powercap(void) {
+    for (int i = 0; g_energy.n < ENERGY_MAX; ++i) {
+        char path[PATH_MAX];
+        uint64_t range;
+        struct counter *c = g_energy.cpu + g_energy.n;
+        snprintf(path, sizeof(path), POWERCAP "/intel-rapl:%d/max_energy_range_uj", i);
+        if (!read_file_u64(path, &range))
+            break;
+        snprintf(path, sizeof(path), POWERCAP "/intel-rapl:%d/energy_uj", i);
+        if ((c->fd = open(path, O_RDONLY)) == -1)
+            break;
+        if (!read_u64(c->fd, 0, true, &c->last)) {
+            close(c->fd);
+            break;
+        }
+        c->range = range + 1;
+        c->scale = 1e-6;
+        ++g_energy.n;
+    }
+}
+
+// reads the msr of the first cpu of each package, when the kernel has
+// no powercap driver for this amd chip
+static void open_amd_msr(void) {
+    int last_pkg = -1;
+    for (int cpu = 0; g_energy.n < ENERGY_MAX; ++cpu) {
+        char path[PATH_MAX];
+        uint64_t pkg, unit;
+        struct counter *c = g_energy.cpu + g_energy.n;
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+        if (!read_file_u64(path, &pkg))
+            break;
+        if ((int)pkg <= last_pkg)
+            continue;
+        snprintf(path, sizeof(path), "/dev/cpu/%d/msr", cpu);
+        if ((c->fd = open(path, O_RDONLY)) == -1)
+            break;
+        if (!read_u64(c->fd, MSR_AMD_RAPL_POWER_UNIT, false, &unit) ||
+            !read_u64(c->fd, MSR_AMD_PKG_ENERGY_STATUS, false, &c->last)) {
+            close(c->fd);
+            break;
+        }
+        c->msr = true;
+        c->last &= 0xffffffff;
+        c->range = 1ull << 32;
+        c->scale = 1. / (1u << ((unit >> 8) & 31));
+        last_pkg = pkg;
+        ++g_energy.n;
+    }
+}
+
+static void open_nvml(void) {
+    void *lib;
+    unsigned count;
+    nvmlReturn_t (*init)(void);
+    nvmlReturn_t (*get_count)(unsigned *);
+    nvmlReturn_t (*get_handle)(unsigned, nvmlDevice_t *);
+    if (FLAG_gpu != LLAMAFILE_GPU_AUTO && FLAG_gpu != LLAMAFILE_GPU_NVIDIA)
+        return;
+    if (!(lib = cosmo_dlopen(IsWindows() ? "nvml.dll" : "libnvidia-ml.so.1", RTLD_LAZY)))
+        return;
+    if (!(init = cosmo_dlsym(lib, "nvmlInit_v2")) ||
+        !(get_count = cosmo_dlsym(lib, "nvmlDeviceGetCount_v2")) ||
+        !(get_handle = cosmo_dlsym(lib, "nvmlDeviceGetHandleByIndex_v2")) ||
+        !(g_energy.nvmlDeviceGetTotalEnergyConsumption =
+              cosmo_dlsym(lib, "nvmlDeviceGetTotalEnergyConsumption")) ||
+        init() || get_count(&count)) {
+        cosmo_dlclose(lib);
+        return;
+    }
+    // gpus older than volta can't tell, so they're left out
+    for (unsigned i = 0; i < count && g_energy.ngpu < ENERGY_MAX; ++i) {
+        unsigned long long mj;
+        nvmlDevice_t dev;
+        if (get_handle(i, &dev) || g_energy.nvmlDeviceGetTotalEnergyConsumption(dev, &mj))
+            continue;
+        g_energy.gpu[g_energy.ngpu] = dev;
+        g_energy.gpu_first[g_energy.ngpu] = mj;
+        g_energy.gpu_last[g_energy.ngpu] = mj;
+        ++g_energy.ngpu;
+    }
+}
+
+static void energy_init(void) {
+    if (!IsLinux() && !IsWindows())
+        return;
+    if (IsLinux()) {
+        open_powercap();
+        if (g_energy.n)
+            strlcat(g_energy.sources, "rapl", sizeof(g_energy.sources));
+        else {
+            open_amd_msr();
+            if (g_energy.n)
+                strlcat(g_energy.sources, "msr", sizeof(g_energy.sources));
+        }
+    }
+    open_nvml();
+    if (g_energy.ngpu) {
+        if (*g_energy.sources)
+            strlcat(g_energy.sources, "+", sizeof(g_energy.sources));
+        strlcat(g_energy.sources, "nvml", sizeof(g_energy.sources));
+    }
+}
+
+/**
+ * Returns joules consumed by the host since the first call.
+ *
+ * @return energy in joules, or -1 if nothing can be measured
+ */
+double llamafile_energy(void) {
+    double joules = 0;
+    pthread_once(&g_energy.once, energy_init);
+    if (!g_energy.n && !g_energy.ngpu)
+        return -1;
+    pthread_mutex_lock(&g_energy.lock);
+    for (int i = 0; i < g_energy.n; ++i) {
+        uint64_t x;
+        struct counter *c = g_energy.cpu + i;
+        if (read_u64(c->fd, c->msr ? MSR_AMD_PKG_ENERGY_STATUS : 0, !c->msr, &x)) {
+            if (c->msr)
+                x &= 0xffffffff;
+            c->joules += ((x + c->range - c->last) % c->range) * c->scale;
+            c->last = x;
+        }
+        joules += c->joules;
+    }
+    for (unsigned i = 0; i < g_energy.ngpu; ++i) {
+        unsigned long long mj;
+        if (!g_energy.nvmlDeviceGetTotalEnergyConsumption(g_energy.gpu[i], &mj))
+            g_energy.gpu_last[i] = mj;
+        joules += (g_energy.gpu_last[i] - g_energy.gpu_first[i]) * 1e-3;
+    }
+    pthread_mutex_unlock(&g_energy.lock);
+    return joules;
+}
+
+/**
+ * Returns which counters llamafile_energy() reads, e.g. "rapl+nvml".
+ */
+const char *llamafile_energy_sources(void) {
+    pthread_once(&g_energy.once, energy_init);
+    return g_energy.sources;
+}
@@ -0,0 +1,13 @@
+#ifndef LLAMAFILE_ENERGY_H_
+#define LLAMAFILE_ENERGY_H_
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+double llamafile_energy(void);
+const char *llamafile_energy_sources(void);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* LLAMAFILE_ENERGY_H_ */
@@ -18,3 +18,8 @@
 #include "llamafile.h"
 
 bool FLAG_precise;
+bool FLAG_hugepages;
+bool FLAG_share_weights;
+bool FLAG_verify;
+bool FLAG_adaptive_threads;
+bool FLAG_stream_weights;
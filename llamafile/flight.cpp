@@ -0,0 +1,287 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "flight.h"
+#include "log.h"
+
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <pthread.h>
+#include <unistd.h>
+
+//
+// flight recorder
+//
+// Unlike the trace recorder, which keeps everything until exit, this
+// keeps only the last few thousand events of each thread that records
+// any, so it's cheap enough to leave on in production. Only the decode
+// loop records: a llama_decode() call, each backend split it computes,
+// and each token sampled, which is a handful of events per token rather
+// than one per op.
+//
+// Each thread owns a ring it alone writes to, so recording is a couple
+// of stores with no lock and no shared cache line. Readers copy a ring
+// while it's being written; every event has a sequence number that's
+// odd while it's being filled in, so events that were overwritten while
+// being copied are detected and skipped. The reader never stops the
+// writer, so dumping doesn't pause inference.
+//
+// Rings are linked into a list the first time their thread records and
+// are never freed, since the threads doing inference live until exit.
+//
+
+#define FLIGHT_EVENTS 8192 // per thread, must be two power
+
+namespace {
+
+struct Event {
+    std::atomic<unsigned long> seq;
+    int type;
+    int a;
+    int b;
+    char name[20];
+    long long start;
+    long long end;
+};
+
+struct Ring {
+    Ring *next;
+    int tid;
+    unsigned long count;
+    Event events[FLIGHT_EVENTS];
+};
+
+// what we copy out of a ring
+struct Record {
+    int type;
+    int a;
+    int b;
+    int tid;
+    char name[20];
+    long long start;
+    long long end;
+};
+
+const char *const kTypeNames[] = {"decode", "split", "sample"};
+
+const char *g_flight_path;
+std::atomic<Ring *> g_rings;
+thread_local Ring *g_ring;
+int g_wakeup[2] = {-1, -1};
+
+Ring *get_ring(void) {
+    if (g_ring)
+        return g_ring;
+    Ring *r;
+    if (!(r = (Ring *)calloc(1, sizeof(Ring))))
+        return nullptr;
+    r->tid = gettid();
+    r->next = g_rings.load(std::memory_order_relaxed);
+    while (!g_rings.compare_exchange_weak(r->next, r, std::memory_order_release,
+                                          std::memory_order_relaxed)) {
+    }
+    return g_ring = r;
+}
+
+// copies the events a ring holds, skipping any being overwritten
+void copy_ring(const Ring *r, Record *out, size_t *n) {
+    for (int i = 0; i < FLIGHT_EVENTS; ++i) {
+        const Event *e = &r->events[i];
+        unsigned long seq = e->seq.load(std::memory_order_acquire);
+        if (!seq || (seq & 1))
+            continue;
+        Record *o = &out[*n];
+        o->type = e->type;
+        o->a = e->a;
+        o->b = e->b;
+        o->tid = r->tid;
+        memcpy(o->name, e->name, sizeof(o->name));
+        o->name[sizeof(o->name) - 1] = 0;
+        o->start = e->start;
+        o->end = e->end;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (e->seq.load(std::memory_order_relaxed) != seq)
+            continue;
+        if (o->type < 0 || o->type >= (int)(sizeof(kTypeNames) / sizeof(*kTypeNames)))
+            continue;
+        ++*n;
+    }
+}
+
+void on_sigusr1(int sig) {
+    char c = 0;
+    int e = errno;
+    if (write(g_wakeup[1], &c, 1) == -1) {
+    }
+    errno = e;
+}
+
+// writes the rings to disk each time we're sent SIGUSR1
+void *dumper(void *arg) {
+    char c;
+    while (read(g_wakeup[0], &c, 1) == 1)
+        if (llamafile_flight_save(g_flight_path))
+            tinylog("flight recorder saved to ", g_flight_path, "\n", NULL);
+    return nullptr;
+}
+
+} // namespace
+
+bool llamafile_flight_enabled;
+
+/**
+ * Starts recording the decode loop, to be saved to `path` on SIGUSR1.
+ */
+bool llamafile_flight_begin(const char *path) {
+    if (llamafile_flight_enabled)
+        return true;
+    g_flight_path = path;
+    if (pipe(g_wakeup)) {
+        perror("pipe");
+        return false;
+    }
+    pthread_t th;
+    if (pthread_create(&th, nullptr, dumper, nullptr)) {
+        tinylog(__func__, ": error: failed to create thread\n", NULL);
+        return false;
+    }
+    pthread_detach(th);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_sigusr1;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &sa, nullptr);
+    llamafile_flight_enabled = true;
+    return true;
+}
+
+/**
+ * Records that something happened on the calling thread.
+ *
+ * @param type is LLAMAFILE_FLIGHT_DECODE, etc.
+ * @param name is optional detail, e.g. the backend
+ * @param a is e.g. the number of tokens
+ * @param b is e.g. the number of kv cells
+ * @param start is from llamafile_trace_now()
+ * @param end is from llamafile_trace_now()
+ */
+void llamafile_flight_record(int type, const char *name, int a, int b, long long start,
+                             long long end) {
+    Ring *r;
+    if (!(r = get_ring()))
+        return;
+    unsigned long n = r->count++;
+    Event *e = &r->events[n & (FLIGHT_EVENTS - 1)];
+    e->seq.store(n * 2 + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    e->type = type;
+    e->a = a;
+    e->b = b;
+    strlcpy(e->name, name ? name : "", sizeof(e->name));
+    e->start = start;
+    e->end = end;
+    e->seq.store(n * 2 + 2, std::memory_order_release);
+}
+
+/**
+ * Returns what every thread recorded, in Chrome trace JSON format.
+ *
+ * @param out_len receives length of result, if not null
+ * @return string that caller must free(), or null on error
+ */
+char *llamafile_flight_dump(size_t *out_len) {
+    size_t rings = 0;
+    for (Ring *r = g_rings.load(std::memory_order_acquire); r; r = r->next)
+        ++rings;
+    Record *recs;
+    if (!(recs = (Record *)malloc((rings ? rings : 1) * FLIGHT_EVENTS * sizeof(Record))))
+        return nullptr;
+    size_t n = 0;
+    Ring *r = g_rings.load(std::memory_order_acquire);
+    for (size_t i = 0; r && i < rings; r = r->next, ++i)
+        copy_ring(r, recs, &n);
+    char *buf = nullptr;
+    size_t len = 0;
+    FILE *f;
+    if (!(f = open_memstream(&buf, &len))) {
+        free(recs);
+        return nullptr;
+    }
+    int pid = getpid();
+    fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    fprintf(f, "{\"ph\":\"M\",\"pid\":%d,\"name\":\"process_name\",\"args\":{\"name\":\"llamafile\"}}",
+            pid);
+    for (size_t i = 0; i < n; ++i) {
+        const Record *e = &recs[i];
+        fprintf(f, ",\n{\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"cat\":\"flight\",\"name\":\"%s\"", pid,
+                e->tid, kTypeNames[e->type]);
+        fprintf(f, ",\"ts\":%.3f,\"dur\":%.3f,\"args\":{", e->start / 1e3,
+                (e->end - e->start) / 1e3);
+        switch (e->type) {
+        case LLAMAFILE_FLIGHT_DECODE:
+            fprintf(f, "\"n_tokens\":%d,\"n_kv\":%d", e->a, e->b);
+            break;
+        case LLAMAFILE_FLIGHT_SPLIT:
+            fprintf(f, "\"backend\":\"%s\",\"split\":%d,\"n_nodes\":%d", e->name, e->a, e->b);
+            break;
+        case LLAMAFILE_FLIGHT_SAMPLE:
+            fprintf(f, "\"token\":%d,\"idx\":%d", e->a, e->b);
+            break;
+        default:
+            break;
+        }
+        fprintf(f, "}}");
+    }
+    fprintf(f, "\n]}\n");
+    free(recs);
+    if (fclose(f)) {
+        free(buf);
+        return nullptr;
+    }
+    if (out_len)
+        *out_len = len;
+    return buf;
+}
+
+/**
+ * Writes what every thread recorded to `path`.
+ */
+bool llamafile_flight_save(const char *path) {
+    char *buf;
+    size_t len;
+    if (!(buf = llamafile_flight_dump(&len))) {
+        tinylog(__func__, ": error: out of memory\n", NULL);
+        return false;
+    }
+    FILE *f;
+    if (!(f = fopen(path, "w"))) {
+        perror(path);
+        free(buf);
+        return false;
+    }
+    bool ok = fwrite(buf, 1, len, f) == len;
+    if (fclose(f))
+        ok = false;
+    if (!ok)
+        perror(path);
+    free(buf);
+    return ok;
+}
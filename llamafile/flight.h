@@ -0,0 +1,22 @@
+#ifndef LLAMAFILE_FLIGHT_H_
+#define LLAMAFILE_FLIGHT_H_
+#include <stdbool.h>
+#include <stddef.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define LLAMAFILE_FLIGHT_DECODE 0
+#define LLAMAFILE_FLIGHT_SPLIT 1
+#define LLAMAFILE_FLIGHT_SAMPLE 2
+
+extern bool llamafile_flight_enabled;
+bool llamafile_flight_begin(const char *);
+void llamafile_flight_record(int, const char *, int, int, long long, long long);
+char *llamafile_flight_dump(size_t *);
+bool llamafile_flight_save(const char *);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* LLAMAFILE_FLIGHT_H_ */
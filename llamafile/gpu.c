@@ -29,6 +29,7 @@ bool FLAG_nogpu;
 bool FLAG_tinyblas;
 bool FLAG_nocompile;
 bool FLAG_recompile;
+bool FLAG_cuda_graphs;
 
 const char *llamafile_describe_gpu(void) {
     switch (FLAG_gpu) {
@@ -59,6 +60,16 @@ bool llamafile_has_gpu(void) {
  */
 int llamafile_gpu_layers(int n_gpu_layers) {
 
+    // `-ngl auto` is resolved by llama.cpp once it knows the model size
+    if (n_gpu_layers == LLAMAFILE_GPU_LAYERS_AUTO) {
+        if (llamafile_has_gpu())
+            return n_gpu_layers;
+        tinylogf("warning: --n-gpu-layers auto was passed but no GPUs were found;"
+                 " falling back to CPU inference\n");
+        FLAG_gpu = LLAMAFILE_GPU_DISABLE;
+        return 0;
+    }
+
     // if user explicitly passed `--gpu KIND` but didn't specify `-ngl
     // LAYERS` then assume the user wants their model fully offloaded.
     if (n_gpu_layers < 0 && FLAG_gpu > 0)
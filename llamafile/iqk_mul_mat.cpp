@@ -15,18 +15,23 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
-#ifdef __x86_64__
+#if defined(__x86_64__) || (defined(__aarch64__) && defined(__ARM_FEATURE_DOTPROD))
 
 #include "llama.cpp/ggml-impl.h"
 #include "llama.cpp/ggml-quants.h"
 #include "sgemm.h"
 
+#define GGML_COMMON_IMPL_C
+#include "llama.cpp/ggml-common.h"
+
 // clang-format off
 
 // This matrix - vector and matrix - matrix multiplication implementation
 // for k-quants and IQ4_XS makes prompt processing 150-200% faster
 // compared to mainline llama.cpp (and llamafile).
-// It is AVX2 only for now.
+// There are AVX2 and ARMv8.2 dotprod implementations. On AVX2 the
+// IQ1, IQ2 and IQ3 quants, as well as Q4_1, Q5_0 and Q5_1 are handled
+// too (Q4_0 and Q8_0 are left to tinyBLAS).
 //
 // Main idea is that unpacking the quants and the block scales to
 // be ready for dot products with the corresponding Q8_K quants
@@ -48,6 +53,32 @@ inline void make_q4_scales(const uint8_t * scales8, uint32_t * aux32) {
     aux32[0] = a0 & 0x3f3f3f3f;
 }
 
+typedef void (*mul_mat_t)(int n, float * s, size_t bs, const void * vx, size_t bx, const void * vy, size_t by, int nrc_x);
+
+inline void mul_mat_NxM(int n, float * s, size_t bs, const void * vx, size_t bx, const void * vy, size_t by, int nrc_x, int nrc_y,
+        mul_mat_t mm_nx1, mul_mat_t mm_nx2, mul_mat_t mm_nx4, mul_mat_t mm_nx8) {
+    const char * char_y = (const char *)vy;
+    auto process = [n, &s, bs, &char_y, by, vx, bx, nrc_x, &nrc_y] (mul_mat_t mul_mat, int step) {
+        if (!mul_mat || nrc_y < step) return true;
+        int n_step = nrc_y/step;
+        for (int iy = 0; iy < n_step; ++iy) {
+            mul_mat(n, s + step*iy*bs, bs, vx, bx, char_y + step*iy*by, by, nrc_x);
+        }
+        nrc_y -= step*n_step;
+        if (nrc_y == 0) return false;
+        char_y += step*n_step*by;
+        s += step*n_step*bs;
+        return true;
+    };
+    process(mm_nx8, 8) && process(mm_nx4, 4) && process(mm_nx2, 2) && process(mm_nx1, 1);
+}
+
+}
+
+#ifdef __x86_64__
+
+namespace {
+
 inline __m256i get_scale_shuffle_8(int i) {
     return _mm256_set1_epi16((2*i) | ((2*i+1) << 8));
 }
@@ -73,26 +104,6 @@ static inline float hsum_float_8(__m256 x) {
 
 #define MM256_SET_M128I(a, b) _mm256_insertf128_si256(_mm256_castsi128_si256(b), (a), 1)
 
-typedef void (*mul_mat_t)(int n, float * s, size_t bs, const void * vx, size_t bx, const void * vy, size_t by, int nrc_x);
-
-inline void mul_mat_NxM(int n, float * s, size_t bs, const void * vx, size_t bx, const void * vy, size_t by, int nrc_x, int nrc_y,
-        mul_mat_t mm_nx1, mul_mat_t mm_nx2, mul_mat_t mm_nx4, mul_mat_t mm_nx8) {
-    const char * char_y = (const char *)vy;
-    auto process = [n, &s, bs, &char_y, by, vx, bx, nrc_x, &nrc_y] (mul_mat_t mul_mat, int step) {
-        if (!mul_mat || nrc_y < step) return true;
-        int n_step = nrc_y/step;
-        for (int iy = 0; iy < n_step; ++iy) {
-            mul_mat(n, s + step*iy*bs, bs, vx, bx, char_y + step*iy*by, by, nrc_x);
-        }
-        nrc_y -= step*n_step;
-        if (nrc_y == 0) return false;
-        char_y += step*n_step*by;
-        s += step*n_step*bs;
-        return true;
-    };
-    process(mm_nx8, 8) && process(mm_nx4, 4) && process(mm_nx2, 2) && process(mm_nx1, 1);
-}
-
 template <int nrc_y> struct Q8 {
 
     Q8(const void * vy, int by) {
@@ -717,19 +728,753 @@ static void mul_mat_iq4_xs_q8_K_T(int n, float * s, size_t bs, const void * vx,
 
 }
 
+//
+// ========================================= IQ2, IQ3 and IQ1 ========================================================
+//
+// The dequantizers below unpack one super-block of a row of A into 8
+// groups of 32 unsigned values from the quant grid, together with the
+// signs that need to be applied to the Q8_K quants and the scales of
+// the groups. The same unpacked block is then used for every column.
+//
+
+// expands 32 bits into 32 bytes, which are 0xff where the bit is set
+inline __m256i bits_to_bytes(uint32_t x32) {
+    const __m256i shuf_mask = _mm256_set_epi64x(0x0303030303030303, 0x0202020202020202, 0x0101010101010101, 0x0000000000000000);
+    const __m256i bit_mask = _mm256_set1_epi64x(0x7fbfdfeff7fbfdfe);
+    const __m256i bytes = _mm256_or_si256(_mm256_shuffle_epi8(_mm256_set1_epi32(x32), shuf_mask), bit_mask);
+    return _mm256_cmpeq_epi8(bytes, _mm256_set1_epi64x(-1));
+}
+
+// turns a mask of 0x00 and 0xff bytes into +1 and -1
+inline __m256i mask_to_signs(__m256i mask) {
+    return _mm256_or_si256(mask, _mm256_set1_epi8(1));
+}
+
+inline __m256i signs_from_ksigns(uint32_t aux32) {
+    return mask_to_signs(_mm256_set_epi64x(ksigns64[(aux32 >> 21) & 127], ksigns64[(aux32 >> 14) & 127],
+                                           ksigns64[(aux32 >>  7) & 127], ksigns64[(aux32 >>  0) & 127]));
+}
+
+inline __m256i scales_16(int ls1, int ls2) {
+    return MM256_SET_M128I(_mm_set1_epi16(ls2), _mm_set1_epi16(ls1));
+}
+
+struct DequantizerIQ2XXS {
+    DequantizerIQ2XXS(const void * vx, size_t bx) : vx(vx), bx(bx) {}
+    inline void new_row(int ix) { x = (const block_iq2_xxs *)((const char *)vx + bx*ix); }
+    inline float prepare(int i, __m256i * values, __m256i * signs, __m256i * scales) const {
+        uint32_t aux32[2];
+        const uint8_t * aux8 = (const uint8_t *)aux32;
+        for (int ib = 0; ib < QK_K/32; ++ib) {
+            memcpy(aux32, x[i].qs + 4*ib, 2*sizeof(uint32_t));
+            values[ib] = _mm256_set_epi64x(iq2xxs_grid[aux8[3]], iq2xxs_grid[aux8[2]], iq2xxs_grid[aux8[1]], iq2xxs_grid[aux8[0]]);
+            signs[ib] = signs_from_ksigns(aux32[1]);
+            scales[ib] = _mm256_set1_epi16(2*(aux32[1] >> 28) + 1);
+        }
+        return GGML_FP16_TO_FP32(x[i].d);
+    }
+    static constexpr float norm = 0.125f;
+    const void * vx;
+    const size_t bx;
+    const block_iq2_xxs * x;
+};
+
+struct DequantizerIQ2XS {
+    DequantizerIQ2XS(const void * vx, size_t bx) : vx(vx), bx(bx) {}
+    inline void new_row(int ix) { x = (const block_iq2_xs *)((const char *)vx + bx*ix); }
+    inline float prepare(int i, __m256i * values, __m256i * signs, __m256i * scales) const {
+        for (int ib = 0; ib < QK_K/32; ++ib) {
+            const uint16_t * q2 = x[i].qs + 4*ib;
+            values[ib] = _mm256_set_epi64x(iq2xs_grid[q2[3] & 511], iq2xs_grid[q2[2] & 511], iq2xs_grid[q2[1] & 511], iq2xs_grid[q2[0] & 511]);
+            signs[ib] = mask_to_signs(_mm256_set_epi64x(ksigns64[q2[3] >> 9], ksigns64[q2[2] >> 9], ksigns64[q2[1] >> 9], ksigns64[q2[0] >> 9]));
+            scales[ib] = scales_16(2*(x[i].scales[ib] & 0xf) + 1, 2*(x[i].scales[ib] >> 4) + 1);
+        }
+        return GGML_FP16_TO_FP32(x[i].d);
+    }
+    static constexpr float norm = 0.125f;
+    const void * vx;
+    const size_t bx;
+    const block_iq2_xs * x;
+};
+
+struct DequantizerIQ2S {
+    DequantizerIQ2S(const void * vx, size_t bx) : vx(vx), bx(bx) {}
+    inline void new_row(int ix) { x = (const block_iq2_s *)((const char *)vx + bx*ix); }
+    inline float prepare(int i, __m256i * values, __m256i * signs, __m256i * scales) const {
+        const uint8_t * qs = x[i].qs;
+        const uint8_t * qh = x[i].qh;
+        const uint8_t * sb = x[i].qs + QK_K/8;
+        uint32_t aux32;
+        for (int ib = 0; ib < QK_K/32; ++ib) {
+            values[ib] = _mm256_set_epi64x(iq2s_grid[qs[4*ib+3] | ((qh[ib] << 2) & 0x300)],
+                                           iq2s_grid[qs[4*ib+2] | ((qh[ib] << 4) & 0x300)],
+                                           iq2s_grid[qs[4*ib+1] | ((qh[ib] << 6) & 0x300)],
+                                           iq2s_grid[qs[4*ib+0] | ((qh[ib] << 8) & 0x300)]);
+            memcpy(&aux32, sb + 4*ib, sizeof(uint32_t));
+            signs[ib] = mask_to_signs(bits_to_bytes(aux32));
+            scales[ib] = scales_16(2*(x[i].scales[ib] & 0xf) + 1, 2*(x[i].scales[ib] >> 4) + 1);
+        }
+        return GGML_FP16_TO_FP32(x[i].d);
+    }
+    static constexpr float norm = 0.125f;
+    const void * vx;
+    const size_t bx;
+    const block_iq2_s * x;
+};
+
+struct DequantizerIQ3XXS {
+    DequantizerIQ3XXS(const void * vx, size_t bx) : vx(vx), bx(bx) {}
+    inline void new_row(int ix) { x = (const block_iq3_xxs *)((const char *)vx + bx*ix); }
+    inline float prepare(int i, __m256i * values, __m256i * signs, __m256i * scales) const {
+        const uint8_t * gas = x[i].qs + QK_K/4;
+        uint32_t aux32;
+        for (int ib = 0; ib < QK_K/32; ++ib) {
+            const uint8_t * q3 = x[i].qs + 8*ib;
+            values[ib] = _mm256_set_epi32(iq3xxs_grid[q3[7]], iq3xxs_grid[q3[6]], iq3xxs_grid[q3[5]], iq3xxs_grid[q3[4]],
+                                          iq3xxs_grid[q3[3]], iq3xxs_grid[q3[2]], iq3xxs_grid[q3[1]], iq3xxs_grid[q3[0]]);
+            memcpy(&aux32, gas + 4*ib, sizeof(uint32_t));
+            signs[ib] = signs_from_ksigns(aux32);
+            scales[ib] = _mm256_set1_epi16(2*(aux32 >> 28) + 1);
+        }
+        return GGML_FP16_TO_FP32(x[i].d);
+    }
+    static constexpr float norm = 0.25f;
+    const void * vx;
+    const size_t bx;
+    const block_iq3_xxs * x;
+};
+
+struct DequantizerIQ3S {
+    DequantizerIQ3S(const void * vx, size_t bx) : vx(vx), bx(bx) {}
+    inline void new_row(int ix) { x = (const block_iq3_s *)((const char *)vx + bx*ix); }
+    inline float prepare(int i, __m256i * values, __m256i * signs, __m256i * scales) const {
+        const uint8_t * qh = x[i].qh;
+        uint32_t aux32;
+        for (int ib = 0; ib < QK_K/32; ++ib) {
+            const uint8_t * qs = x[i].qs + 8*ib;
+            values[ib] = _mm256_set_epi32(iq3s_grid[qs[7] | ((qh[ib] << 1) & 256)], iq3s_grid[qs[6] | ((qh[ib] << 2) & 256)],
+                                          iq3s_grid[qs[5] | ((qh[ib] << 3) & 256)], iq3s_grid[qs[4] | ((qh[ib] << 4) & 256)],
+                                          iq3s_grid[qs[3] | ((qh[ib] << 5) & 256)], iq3s_grid[qs[2] | ((qh[ib] << 6) & 256)],
+                                          iq3s_grid[qs[1] | ((qh[ib] << 7) & 256)], iq3s_grid[qs[0] | ((qh[ib] << 8) & 256)]);
+            memcpy(&aux32, x[i].signs + 4*ib, sizeof(uint32_t));
+            signs[ib] = mask_to_signs(bits_to_bytes(aux32));
+            scales[ib] = _mm256_set1_epi16(2*((x[i].scales[ib/2] >> 4*(ib%2)) & 0xf) + 1);
+        }
+        return GGML_FP16_TO_FP32(x[i].d);
+    }
+    static constexpr float norm = 1.f;
+    const void * vx;
+    const size_t bx;
+    const block_iq3_s * x;
+};
+
+template <typename Dequantizer, int nrc_y>
+static void mul_mat_iq_q8_K_T(int n, float * s, size_t bs, const void * vx, size_t bx, const void * vy, size_t by, int nrc_x) {
+    assert(n % QK_K == 0);
+    const int nb = n / QK_K;
+
+    Q8<nrc_y> q8(vy, by);
+
+    Dequantizer deq(vx, bx);
+
+    __m256i values[QK_K/32];
+    __m256i signs[QK_K/32];
+    __m256i scales[QK_K/32];
+    __m256  accd[nrc_y];
+
+    for (int ix = 0; ix < nrc_x; ++ix) {
+
+        deq.new_row(ix);
+
+        for (int iy = 0; iy < nrc_y; ++iy) accd[iy] = _mm256_setzero_ps();
+
+        for (int i = 0; i < nb; ++i) {
+
+            const float d = deq.prepare(i, values, signs, scales);
+
+            for (int iy = 0; iy < nrc_y; ++iy) {
+                __m256i sumi = _mm256_setzero_si256();
+                for (int k = 0; k < QK_K/32; ++k) {
+                    const __m256i q8s = _mm256_sign_epi8(q8.load_quants(iy, i, k), signs[k]);
+                    sumi = _mm256_add_epi32(sumi, _mm256_madd_epi16(_mm256_maddubs_epi16(values[k], q8s), scales[k]));
+                }
+                accd[iy] = _mm256_fmadd_ps(_mm256_set1_ps(d*q8.scale(iy, i)), _mm256_cvtepi32_ps(sumi), accd[iy]);
+            }
+
+        }
+
+        for (int iy = 0; iy < nrc_y; ++iy) {
+            s[ix+iy*bs] = Dequantizer::norm * hsum_float_8(accd[iy]);
+        }
+
+    }
+}
+
+// IQ1 grids hold -1, 0 and 1, so the values are their magnitudes and the
+// signs are the grid points themselves. On top of that every group of 8
+// is shifted by +/- delta, which takes a second sum over the Q8_K quants.
+
+struct DequantizerIQ1S {
+    DequantizerIQ1S(const void * vx, size_t bx) : vx(vx), bx(bx) {}
+    inline void new_row(int ix) { x = (const block_iq1_s *)((const char *)vx + bx*ix); }
+    inline float prepare(int i, __m256i * values, __m256i * signs, __m256i * deltas, __m256i * scales) const {
+        for (int ib = 0; ib < QK_K/32; ++ib) {
+            const uint8_t * qs = x[i].qs + 4*ib;
+            const uint16_t qh = x[i].qh[ib];
+            signs[ib] = _mm256_set_epi64x(iq1s_grid[qs[3] | ((qh >> 1) & 0x700)], iq1s_grid[qs[2] | ((qh << 2) & 0x700)],
+                                          iq1s_grid[qs[1] | ((qh << 5) & 0x700)], iq1s_grid[qs[0] | ((qh << 8) & 0x700)]);
+            values[ib] = _mm256_sign_epi8(signs[ib], signs[ib]);
+            deltas[ib] = _mm256_set1_epi8(qh & 0x8000 ? -1 : 1);
+            scales[ib] = _mm256_set1_epi16(2*((qh >> 12) & 7) + 1);
+        }
+        return GGML_FP16_TO_FP32(x[i].d);
+    }
+    static constexpr float delta = IQ1S_DELTA;
+    const void * vx;
+    const size_t bx;
+    const block_iq1_s * x;
+};
+
+struct DequantizerIQ1M {
+    DequantizerIQ1M(const void * vx, size_t bx) : vx(vx), bx(bx) {}
+    inline void new_row(int ix) { x = (const block_iq1_m *)((const char *)vx + bx*ix); }
+    inline float prepare(int i, __m256i * values, __m256i * signs, __m256i * deltas, __m256i * scales) const {
+        const uint16_t * sc = (const uint16_t *)x[i].scales;
+        iq1m_scale_t scale;
+        scale.u16 = (sc[0] >> 12) | ((sc[1] >> 8) & 0x00f0) | ((sc[2] >> 4) & 0x0f00) | (sc[3] & 0xf000);
+        for (int ib = 0; ib < QK_K/32; ++ib) {
+            const uint8_t * qs = x[i].qs + 4*ib;
+            const uint8_t * qh = x[i].qh + 2*ib;
+            signs[ib] = _mm256_set_epi64x(iq1s_grid[qs[3] | (((uint16_t)qh[1] << 4) & 0x700)], iq1s_grid[qs[2] | (((uint16_t)qh[1] << 8) & 0x700)],
+                                          iq1s_grid[qs[1] | (((uint16_t)qh[0] << 4) & 0x700)], iq1s_grid[qs[0] | (((uint16_t)qh[0] << 8) & 0x700)]);
+            values[ib] = _mm256_sign_epi8(signs[ib], signs[ib]);
+            deltas[ib] = _mm256_set_epi64x(qh[1] & 0x80 ? -1ll : 0x0101010101010101ll, qh[1] & 0x08 ? -1ll : 0x0101010101010101ll,
+                                           qh[0] & 0x80 ? -1ll : 0x0101010101010101ll, qh[0] & 0x08 ? -1ll : 0x0101010101010101ll);
+            scales[ib] = scales_16(2*((sc[ib/2] >> (6*(ib%2)+0)) & 7) + 1, 2*((sc[ib/2] >> (6*(ib%2)+3)) & 7) + 1);
+        }
+        return GGML_FP16_TO_FP32(scale.f16);
+    }
+    static constexpr float delta = IQ1M_DELTA;
+    const void * vx;
+    const size_t bx;
+    const block_iq1_m * x;
+};
+
+template <typename Dequantizer, int nrc_y>
+static void mul_mat_iq1_q8_K_T(int n, float * s, size_t bs, const void * vx, size_t bx, const void * vy, size_t by, int nrc_x) {
+    assert(n % QK_K == 0);
+    const int nb = n / QK_K;
+
+    Q8<nrc_y> q8(vy, by);
+
+    Dequantizer deq(vx, bx);
+
+    const __m256i ones = _mm256_set1_epi8(1);
+
+    __m256i values[QK_K/32];
+    __m256i signs[QK_K/32];
+    __m256i deltas[QK_K/32];
+    __m256i scales[QK_K/32];
+    __m256  accd[nrc_y];
+    __m256  accm[nrc_y];
+
+    for (int ix = 0; ix < nrc_x; ++ix) {
+
+        deq.new_row(ix);
+
+        for (int iy = 0; iy < nrc_y; ++iy) accd[iy] = accm[iy] = _mm256_setzero_ps();
+
+        for (int i = 0; i < nb; ++i) {
+
+            const float d = deq.prepare(i, values, signs, deltas, scales);
+
+            for (int iy = 0; iy < nrc_y; ++iy) {
+                __m256i sumi = _mm256_setzero_si256();
+                __m256i summ = _mm256_setzero_si256();
+                for (int k = 0; k < QK_K/32; ++k) {
+                    const __m256i q8b = q8.load_quants(iy, i, k);
+                    const __m256i dot = _mm256_maddubs_epi16(values[k], _mm256_sign_epi8(q8b, signs[k]));
+                    const __m256i dlt = _mm256_maddubs_epi16(ones, _mm256_sign_epi8(q8b, deltas[k]));
+                    sumi = _mm256_add_epi32(sumi, _mm256_madd_epi16(dot, scales[k]));
+                    summ = _mm256_add_epi32(summ, _mm256_madd_epi16(dlt, scales[k]));
+                }
+                const __m256 vd = _mm256_set1_ps(d*q8.scale(iy, i));
+                accd[iy] = _mm256_fmadd_ps(vd, _mm256_cvtepi32_ps(sumi), accd[iy]);
+                accm[iy] = _mm256_fmadd_ps(vd, _mm256_cvtepi32_ps(summ), accm[iy]);
+            }
+
+        }
+
+        for (int iy = 0; iy < nrc_y; ++iy) {
+            s[ix+iy*bs] = hsum_float_8(accd[iy]) + Dequantizer::delta * hsum_float_8(accm[iy]);
+        }
+
+    }
+}
+
+//
+// ========================================= Q4_1, Q5_0, Q5_1 ========================================================
+//
+// These use blocks of 32 and are multiplied with Q8_0 or Q8_1 columns.
+//
+
+template <int nrc_y, typename block_q8> struct Q8_32 {
+
+    Q8_32(const void * vy, int by) {
+        for (int iy = 0; iy < nrc_y; ++iy) y[iy] = (const block_q8 *)((const char *)vy + iy*by);
+    }
+
+    inline __m256i load_quants(int iy, int i) const { return _mm256_loadu_si256((const __m256i*)y[iy][i].qs); }
+    inline float scale(int iy, int i) const { return GGML_FP16_TO_FP32(y[iy][i].d); }
+
+    const block_q8 * y[nrc_y];
+};
+
+inline __m256i unpack_nibbles(const uint8_t * qs) {
+    const __m128i q = _mm_loadu_si128((const __m128i *)qs);
+    return _mm256_and_si256(MM256_SET_M128I(_mm_srli_epi16(q, 4), q), _mm256_set1_epi8(0xf));
+}
+
+struct DequantizerQ41 {
+    DequantizerQ41(const void * vx, size_t bx) : vx(vx), bx(bx) {}
+    inline void new_row(int ix) { x = (const block_q4_1 *)((const char *)vx + bx*ix); }
+    inline float prepare(int i, __m256i & values, float & m) const {
+        values = unpack_nibbles(x[i].qs);
+        m = GGML_FP16_TO_FP32(x[i].m);
+        return GGML_FP16_TO_FP32(x[i].d);
+    }
+    const void * vx;
+    const size_t bx;
+    const block_q4_1 * x;
+};
+
+struct DequantizerQ51 {
+    DequantizerQ51(const void * vx, size_t bx) : vx(vx), bx(bx) {}
+    inline void new_row(int ix) { x = (const block_q5_1 *)((const char *)vx + bx*ix); }
+    inline float prepare(int i, __m256i & values, float & m) const {
+        uint32_t qh;
+        memcpy(&qh, x[i].qh, sizeof(qh));
+        values = _mm256_or_si256(unpack_nibbles(x[i].qs), _mm256_and_si256(bits_to_bytes(qh), _mm256_set1_epi8(0x10)));
+        m = GGML_FP16_TO_FP32(x[i].m);
+        return GGML_FP16_TO_FP32(x[i].d);
+    }
+    const void * vx;
+    const size_t bx;
+    const block_q5_1 * x;
+};
+
+// quants with a min, i.e. x = d * q + m, which is multiplied with Q8_1
+template <typename Dequantizer, int nrc_y>
+static void mul_mat_qX_1_q8_1_T(int n, float * s, size_t bs, const void * vx, size_t bx, const void * vy, size_t by, int nrc_x) {
+    assert(n % QK8_1 == 0);
+    const int nb = n / QK8_1;
+
+    Q8_32<nrc_y, block_q8_1> q8(vy, by);
+
+    Dequantizer deq(vx, bx);
+
+    const __m256i ones = _mm256_set1_epi16(1);
+
+    __m256 accd[nrc_y];
+    float  accm[nrc_y];
+
+    for (int ix = 0; ix < nrc_x; ++ix) {
+
+        deq.new_row(ix);
+
+        for (int iy = 0; iy < nrc_y; ++iy) {
+            accd[iy] = _mm256_setzero_ps();
+            accm[iy] = 0.f;
+        }
+
+        for (int i = 0; i < nb; ++i) {
+            __m256i values;
+            float m;
+            const float d = deq.prepare(i, values, m);
+            for (int iy = 0; iy < nrc_y; ++iy) {
+                const __m256i dot = _mm256_madd_epi16(ones, _mm256_maddubs_epi16(values, q8.load_quants(iy, i)));
+                accd[iy] = _mm256_fmadd_ps(_mm256_set1_ps(d*q8.scale(iy, i)), _mm256_cvtepi32_ps(dot), accd[iy]);
+                accm[iy] += m*GGML_FP16_TO_FP32(q8.y[iy][i].s);
+            }
+        }
+
+        for (int iy = 0; iy < nrc_y; ++iy) {
+            s[ix+iy*bs] = hsum_float_8(accd[iy]) + accm[iy];
+        }
+
+    }
+}
+
+template <int nrc_y>
+static void mul_mat_q5_0_q8_0_T(int n, float * s, size_t bs, const void * vx, size_t bx, const void * vy, size_t by, int nrc_x) {
+    assert(n % QK8_0 == 0);
+    const int nb = n / QK8_0;
+
+    Q8_32<nrc_y, block_q8_0> q8(vy, by);
+
+    const __m256i ones = _mm256_set1_epi16(1);
+    const __m256i mh = _mm256_set1_epi8(-16); // 0xf0
+
+    __m256 accd[nrc_y];
+
+    for (int ix = 0; ix < nrc_x; ++ix) {
+
+        const block_q5_0 * x = (const block_q5_0 *)((const char *)vx + ix*bx);
+
+        for (int iy = 0; iy < nrc_y; ++iy) accd[iy] = _mm256_setzero_ps();
+
+        for (int i = 0; i < nb; ++i) {
+            uint32_t qh;
+            memcpy(&qh, x[i].qh, sizeof(qh));
+            // q - 16 as a signed byte, since the nibble only needs 0xf0
+            // or'ed into it when its fifth bit is clear
+            const __m256i q5 = _mm256_or_si256(unpack_nibbles(x[i].qs), _mm256_andnot_si256(bits_to_bytes(qh), mh));
+            const __m256i values = _mm256_sign_epi8(q5, q5);
+            const float d = GGML_FP16_TO_FP32(x[i].d);
+            for (int iy = 0; iy < nrc_y; ++iy) {
+                const __m256i q8s = _mm256_sign_epi8(q8.load_quants(iy, i), q5);
+                const __m256i dot = _mm256_madd_epi16(ones, _mm256_maddubs_epi16(values, q8s));
+                accd[iy] = _mm256_fmadd_ps(_mm256_set1_ps(d*q8.scale(iy, i)), _mm256_cvtepi32_ps(dot), accd[iy]);
+            }
+        }
+
+        for (int iy = 0; iy < nrc_y; ++iy) {
+            s[ix+iy*bs] = hsum_float_8(accd[iy]);
+        }
+
+    }
+}
+
+} // namespace
+
+#else // __aarch64__
+
+// The ARM kernels follow the same recipe as the AVX2 ones: the quants
+// and block scales of a row of A are unpacked once and then multiplied
+// with up to 8 Q8_K columns of B using the sdot instruction.
+
+namespace {
+
+template <int nrc_y> struct Q8 {
+
+    Q8(const void * vy, int by) {
+        for (int iy = 0; iy < nrc_y; ++iy) y[iy] = (const block_q8_K *)((const char *)vy + iy*by);
+    }
+
+    inline int8x16x2_t load_quants(int iy, int i, int j) const { return vld1q_s8_x2(y[iy][i].qs + 32*j); }
+    inline int16x8x2_t load_bsums(int iy, int i) const { return vld1q_s16_x2(y[iy][i].bsums); }
+    inline float scale(int iy, int i) const { return y[iy][i].d; }
+
+    const block_q8_K * y[nrc_y];
+};
+
+inline int32x4_t dot_32(int8x16_t x0, int8x16_t x1, int8x16x2_t y) {
+    return vdotq_s32(vdotq_s32(vdupq_n_s32(0), x0, y.val[0]), x1, y.val[1]);
+}
+
+// sum of the 8 mins of a q4_K/q5_K block weighted with the sums of the
+// corresponding 32 Q8_K quants
+inline int32x4_t sum_mins(const uint8_t * mins8, int16x8x2_t q8sums) {
+    const int16x8_t mins = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(mins8)));
+    const int16x8_t q8s = vpaddq_s16(q8sums.val[0], q8sums.val[1]);
+    return vmlal_high_s16(vmull_s16(vget_low_s16(mins), vget_low_s16(q8s)), mins, q8s);
+}
+
+//
+// ================================== q4_K =============================================
+//
+
+template <int nrc_y>
+static void mul_mat_q4_K_q8_K_T(int n, float * s, size_t bs, const void * vx, size_t bx, const void * vy, size_t by, int nrc_x) {
+    assert(n % QK_K == 0);
+    const int nb = n / QK_K;
+
+    Q8<nrc_y> q8(vy, by);
+
+    uint32_t utmp[4];
+
+    const uint8x16_t m4 = vdupq_n_u8(0xf);
+
+    float32x4_t acc[nrc_y];
+    int32x4_t   sumi[nrc_y];
+
+    for (int ix = 0; ix < nrc_x; ++ix) {
+
+        for (int iy = 0; iy < nrc_y; ++iy) acc[iy] = vdupq_n_f32(0.f);
+
+        const block_q4_K * x = (const block_q4_K *)((const char *)vx + bx*ix);
+
+        for (int i = 0; i < nb; ++i) {
+
+            const float d = GGML_FP16_TO_FP32(x[i].d), c = -GGML_FP16_TO_FP32(x[i].dmin);
+
+            make_q4_scales(x[i].scales, utmp);
+            const uint8_t * sc = (const uint8_t *)utmp;
+
+            for (int iy = 0; iy < nrc_y; ++iy) {
+                const int32x4_t prod = sum_mins(sc + 8, q8.load_bsums(iy, i));
+                acc[iy] = vmlaq_n_f32(acc[iy], vcvtq_f32_s32(prod), c*q8.scale(iy, i));
+                sumi[iy] = vdupq_n_s32(0);
+            }
+
+            const uint8_t * q4 = x[i].qs;
+
+            for (int j = 0; j < QK_K/64; ++j) {
+
+                const uint8x16x2_t q4bits = vld1q_u8_x2(q4); q4 += 32;
+
+                const int8x16_t q4l_0 = vreinterpretq_s8_u8(vandq_u8(q4bits.val[0], m4));
+                const int8x16_t q4l_1 = vreinterpretq_s8_u8(vandq_u8(q4bits.val[1], m4));
+                const int8x16_t q4h_0 = vreinterpretq_s8_u8(vshrq_n_u8(q4bits.val[0], 4));
+                const int8x16_t q4h_1 = vreinterpretq_s8_u8(vshrq_n_u8(q4bits.val[1], 4));
+
+                for (int iy = 0; iy < nrc_y; ++iy) {
+                    const int32x4_t pl = dot_32(q4l_0, q4l_1, q8.load_quants(iy, i, 2*j+0));
+                    const int32x4_t ph = dot_32(q4h_0, q4h_1, q8.load_quants(iy, i, 2*j+1));
+                    sumi[iy] = vmlaq_n_s32(sumi[iy], pl, sc[2*j+0]);
+                    sumi[iy] = vmlaq_n_s32(sumi[iy], ph, sc[2*j+1]);
+                }
+            }
+
+            for (int iy = 0; iy < nrc_y; ++iy) {
+                acc[iy] = vmlaq_n_f32(acc[iy], vcvtq_f32_s32(sumi[iy]), d*q8.scale(iy, i));
+            }
+
+        }
+
+        for (int iy = 0; iy < nrc_y; ++iy) {
+            s[ix+iy*bs] = vaddvq_f32(acc[iy]);
+        }
+
+    }
+}
+
+//
+// ========================================= q5_K ========================================================
+//
+
+template <int nrc_y>
+static void mul_mat_q5_K_q8_K_T(int n, float * s, size_t bs, const void * vx, size_t bx, const void * vy, size_t by, int nrc_x) {
+    assert(n % QK_K == 0);
+    const int nb = n / QK_K;
+
+    Q8<nrc_y> q8(vy, by);
+
+    uint32_t utmp[4];
+
+    const uint8x16_t m4   = vdupq_n_u8(0xf);
+    const uint8x16_t mone = vdupq_n_u8(1);
+    const uint8x16_t mtwo = vdupq_n_u8(2);
+
+    float32x4_t acc[nrc_y];
+    int32x4_t   sumi[nrc_y];
+
+    for (int ix = 0; ix < nrc_x; ++ix) {
+
+        for (int iy = 0; iy < nrc_y; ++iy) acc[iy] = vdupq_n_f32(0.f);
+
+        const block_q5_K * x = (const block_q5_K *)((const char *)vx + bx*ix);
+
+        for (int i = 0; i < nb; ++i) {
+
+            const float d = GGML_FP16_TO_FP32(x[i].d), c = -GGML_FP16_TO_FP32(x[i].dmin);
+
+            make_q4_scales(x[i].scales, utmp);
+            const uint8_t * sc = (const uint8_t *)utmp;
+
+            for (int iy = 0; iy < nrc_y; ++iy) {
+                const int32x4_t prod = sum_mins(sc + 8, q8.load_bsums(iy, i));
+                acc[iy] = vmlaq_n_f32(acc[iy], vcvtq_f32_s32(prod), c*q8.scale(iy, i));
+                sumi[iy] = vdupq_n_s32(0);
+            }
+
+            const uint8_t * q4 = x[i].qs;
+            uint8x16x2_t qhbits = vld1q_u8_x2(x[i].qh);
+
+            for (int j = 0; j < QK_K/64; ++j) {
+
+                const uint8x16x2_t q4bits = vld1q_u8_x2(q4); q4 += 32;
+
+                const int8x16_t q5l_0 = vreinterpretq_s8_u8(vorrq_u8(vandq_u8(q4bits.val[0], m4), vshlq_n_u8(vandq_u8(qhbits.val[0], mone), 4)));
+                const int8x16_t q5l_1 = vreinterpretq_s8_u8(vorrq_u8(vandq_u8(q4bits.val[1], m4), vshlq_n_u8(vandq_u8(qhbits.val[1], mone), 4)));
+                const int8x16_t q5h_0 = vreinterpretq_s8_u8(vorrq_u8(vshrq_n_u8(q4bits.val[0], 4), vshlq_n_u8(vandq_u8(qhbits.val[0], mtwo), 3)));
+                const int8x16_t q5h_1 = vreinterpretq_s8_u8(vorrq_u8(vshrq_n_u8(q4bits.val[1], 4), vshlq_n_u8(vandq_u8(qhbits.val[1], mtwo), 3)));
+                qhbits.val[0] = vshrq_n_u8(qhbits.val[0], 2);
+                qhbits.val[1] = vshrq_n_u8(qhbits.val[1], 2);
+
+                for (int iy = 0; iy < nrc_y; ++iy) {
+                    const int32x4_t pl = dot_32(q5l_0, q5l_1, q8.load_quants(iy, i, 2*j+0));
+                    const int32x4_t ph = dot_32(q5h_0, q5h_1, q8.load_quants(iy, i, 2*j+1));
+                    sumi[iy] = vmlaq_n_s32(sumi[iy], pl, sc[2*j+0]);
+                    sumi[iy] = vmlaq_n_s32(sumi[iy], ph, sc[2*j+1]);
+                }
+            }
+
+            for (int iy = 0; iy < nrc_y; ++iy) {
+                acc[iy] = vmlaq_n_f32(acc[iy], vcvtq_f32_s32(sumi[iy]), d*q8.scale(iy, i));
+            }
+
+        }
+
+        for (int iy = 0; iy < nrc_y; ++iy) {
+            s[ix+iy*bs] = vaddvq_f32(acc[iy]);
+        }
+
+    }
+}
+
+//
+// ========================================= q6_K ========================================================
+//
+
+template <int nrc_y>
+static void mul_mat_q6_K_q8_K_T(int n, float * s, size_t bs, const void * vx, size_t bx, const void * vy, size_t by, int nrc_x) {
+    assert(n % QK_K == 0);
+    const int nb = n / QK_K;
+
+    Q8<nrc_y> q8(vy, by);
+
+    const uint8x16_t m4 = vdupq_n_u8(0xf);
+    const uint8x16_t m3 = vdupq_n_u8(0x3);
+
+    float32x4_t acc[nrc_y];
+    int32x4_t   sumi[nrc_y];
+    int8x16_t   q6b[8];
+
+    for (int ix = 0; ix < nrc_x; ++ix) {
+
+        for (int iy = 0; iy < nrc_y; ++iy) acc[iy] = vdupq_n_f32(0.f);
+
+        const block_q6_K * x = (const block_q6_K *)((const char *)vx + ix*bx);
+
+        for (int i = 0; i < nb; ++i) {
+
+            const float d6 = GGML_FP16_TO_FP32(x[i].d);
+
+            const uint8_t * ql = x[i].ql;
+            const uint8_t * qh = x[i].qh;
+            const int8_t  * sc = x[i].scales;
+
+            // the quants are stored with an offset of 32, which we take
+            // out through the block sums of the Q8_K quants
+            const int8x16_t scales8 = vld1q_s8(sc);
+            const int16x8_t scales_l = vmovl_s8(vget_low_s8(scales8));
+            const int16x8_t scales_h = vmovl_high_s8(scales8);
+
+            for (int iy = 0; iy < nrc_y; ++iy) {
+                const int16x8x2_t q8sums = q8.load_bsums(iy, i);
+                int32x4_t prod = vmull_s16(vget_low_s16(scales_l), vget_low_s16(q8sums.val[0]));
+                prod = vmlal_high_s16(prod, scales_l, q8sums.val[0]);
+                prod = vmlal_s16(prod, vget_low_s16(scales_h), vget_low_s16(q8sums.val[1]));
+                prod = vmlal_high_s16(prod, scales_h, q8sums.val[1]);
+                acc[iy] = vmlaq_n_f32(acc[iy], vcvtq_f32_s32(prod), -32.f*d6*q8.scale(iy, i));
+                sumi[iy] = vdupq_n_s32(0);
+            }
+
+            for (int j = 0; j < QK_K/128; ++j) {
+
+                const uint8x16x4_t q6bits = vld1q_u8_x4(ql); ql += 64;
+                const uint8x16x2_t qhbits = vld1q_u8_x2(qh); qh += 32;
+
+                q6b[0] = vreinterpretq_s8_u8(vorrq_u8(vandq_u8(q6bits.val[0], m4), vshlq_n_u8(vandq_u8(qhbits.val[0], m3), 4)));
+                q6b[1] = vreinterpretq_s8_u8(vorrq_u8(vandq_u8(q6bits.val[1], m4), vshlq_n_u8(vandq_u8(qhbits.val[1], m3), 4)));
+                q6b[2] = vreinterpretq_s8_u8(vorrq_u8(vandq_u8(q6bits.val[2], m4), vshlq_n_u8(vandq_u8(vshrq_n_u8(qhbits.val[0], 2), m3), 4)));
+                q6b[3] = vreinterpretq_s8_u8(vorrq_u8(vandq_u8(q6bits.val[3], m4), vshlq_n_u8(vandq_u8(vshrq_n_u8(qhbits.val[1], 2), m3), 4)));
+                q6b[4] = vreinterpretq_s8_u8(vorrq_u8(vshrq_n_u8(q6bits.val[0], 4), vshlq_n_u8(vandq_u8(vshrq_n_u8(qhbits.val[0], 4), m3), 4)));
+                q6b[5] = vreinterpretq_s8_u8(vorrq_u8(vshrq_n_u8(q6bits.val[1], 4), vshlq_n_u8(vandq_u8(vshrq_n_u8(qhbits.val[1], 4), m3), 4)));
+                q6b[6] = vreinterpretq_s8_u8(vorrq_u8(vshrq_n_u8(q6bits.val[2], 4), vshlq_n_u8(vshrq_n_u8(qhbits.val[0], 6), 4)));
+                q6b[7] = vreinterpretq_s8_u8(vorrq_u8(vshrq_n_u8(q6bits.val[3], 4), vshlq_n_u8(vshrq_n_u8(qhbits.val[1], 6), 4)));
+
+                for (int iy = 0; iy < nrc_y; ++iy) {
+                    for (int k = 0; k < 4; ++k) {
+                        const int8x16x2_t q8b = q8.load_quants(iy, i, 4*j+k);
+                        sumi[iy] = vmlaq_n_s32(sumi[iy], vdotq_s32(vdupq_n_s32(0), q6b[2*k+0], q8b.val[0]), sc[8*j+2*k+0]);
+                        sumi[iy] = vmlaq_n_s32(sumi[iy], vdotq_s32(vdupq_n_s32(0), q6b[2*k+1], q8b.val[1]), sc[8*j+2*k+1]);
+                    }
+                }
+
+            }
+
+            for (int iy = 0; iy < nrc_y; ++iy) {
+                acc[iy] = vmlaq_n_f32(acc[iy], vcvtq_f32_s32(sumi[iy]), d6*q8.scale(iy, i));
+            }
+        }
+
+        for (int iy = 0; iy < nrc_y; ++iy) {
+            s[ix+iy*bs] = vaddvq_f32(acc[iy]);
+        }
+
+    }
+}
+
+//
+// ========================================= IQ4_XS ========================================================
+//
+
+template <int nrc_y>
+static void mul_mat_iq4_xs_q8_K_T(int n, float * s, size_t bs, const void * vx, size_t bx, const void * vy, size_t by, int nrc_x) {
+    assert(n % QK_K == 0);
+    const int nb = n / QK_K;
+
+    static const int8_t kvalues_iq4nl[16] = {-127, -104, -83, -65, -49, -35, -22, -10, 1, 13, 25, 38, 53, 69, 89, 113};
+
+    const int8x16_t values = vld1q_s8(kvalues_iq4nl);
+    const uint8x16_t m4 = vdupq_n_u8(0xf);
+
+    Q8<nrc_y> q8(vy, by);
+
+    float32x4_t acc[nrc_y];
+    int32x4_t   sumi[nrc_y];
+    int         ls[QK_K/32];
+
+    for (int ix = 0; ix < nrc_x; ++ix) {
+
+        const block_iq4_xs * x = (const block_iq4_xs *)((const char *)vx + ix*bx);
+
+        for (int iy = 0; iy < nrc_y; ++iy) acc[iy] = vdupq_n_f32(0.f);
+
+        for (int ibl = 0; ibl < nb; ++ibl) {
+            const uint8_t * qs = x[ibl].qs;
+            for (int ib = 0; ib < QK_K/32; ++ib) {
+                ls[ib] = (((x[ibl].scales_l[ib/2] >> 4*(ib%2)) & 0xf) | (((x[ibl].scales_h >> 2*ib) & 3) << 4)) - 32;
+            }
+            for (int iy = 0; iy < nrc_y; ++iy) sumi[iy] = vdupq_n_s32(0);
+            for (int ib = 0; ib < QK_K/32; ++ib) {
+                const uint8x16_t bits = vld1q_u8(qs); qs += 16;
+                const int8x16_t q4b_1 = vqtbl1q_s8(values, vandq_u8(bits, m4));
+                const int8x16_t q4b_2 = vqtbl1q_s8(values, vshrq_n_u8(bits, 4));
+                for (int iy = 0; iy < nrc_y; ++iy) {
+                    sumi[iy] = vmlaq_n_s32(sumi[iy], dot_32(q4b_1, q4b_2, q8.load_quants(iy, ibl, ib)), ls[ib]);
+                }
+            }
+            for (int iy = 0; iy < nrc_y; ++iy) {
+                acc[iy] = vmlaq_n_f32(acc[iy], vcvtq_f32_s32(sumi[iy]), GGML_FP16_TO_FP32(x[ibl].d)*q8.scale(iy, ibl));
+            }
+        }
+
+        for (int iy = 0; iy < nrc_y; ++iy) {
+            s[ix+iy*bs] = vaddvq_f32(acc[iy]);
+        }
+
+    }
+
+}
+
 } // namespace
 
+#endif // __x86_64__
+
 //
 // ============================== Matrix multiplications
 //
 
-bool iqk_mul_mat(long Nx, long Ny, long ne00, int typeA, const void * A, const void * B,
+bool iqk_mul_mat(long Nx, long Ny, long ne00, int typeA, const void * A, int typeB, const void * B,
         float * C, long stride_C, int ith, int nth) {
 
-    assert (ne00 % QK_K == 0);
-
     mul_mat_t mm_nx1, mm_nx2, mm_nx4, mm_nx8;
+    int expected_typeB = GGML_TYPE_Q8_K;
     switch (typeA) {
+#ifdef __x86_64__
         case GGML_TYPE_Q2_K:
             mm_nx1 = mul_mat_q2_K_q8_K_T<1>;
             mm_nx2 = mul_mat_q2_K_q8_K_T<2>;
@@ -742,6 +1487,7 @@ bool iqk_mul_mat(long Nx, long Ny, long ne00, int typeA, const void * A, const v
             mm_nx4 = mul_mat_q3_K_q8_K_T<4>;
             mm_nx8 = mul_mat_q3_K_q8_K_T<8>;
             break;
+#endif
         case GGML_TYPE_Q4_K:
             mm_nx1 = mul_mat_q4_K_q8_K_T<1>;
             mm_nx2 = mul_mat_q4_K_q8_K_T<2>;
@@ -766,16 +1512,85 @@ bool iqk_mul_mat(long Nx, long Ny, long ne00, int typeA, const void * A, const v
             mm_nx4 = mul_mat_iq4_xs_q8_K_T<4>;
             mm_nx8 = mul_mat_iq4_xs_q8_K_T<8>;
             break;
+#ifdef __x86_64__
+        case GGML_TYPE_IQ2_XXS:
+            mm_nx1 = mul_mat_iq_q8_K_T<DequantizerIQ2XXS, 1>;
+            mm_nx2 = mul_mat_iq_q8_K_T<DequantizerIQ2XXS, 2>;
+            mm_nx4 = mul_mat_iq_q8_K_T<DequantizerIQ2XXS, 4>;
+            mm_nx8 = mul_mat_iq_q8_K_T<DequantizerIQ2XXS, 8>;
+            break;
+        case GGML_TYPE_IQ2_XS:
+            mm_nx1 = mul_mat_iq_q8_K_T<DequantizerIQ2XS, 1>;
+            mm_nx2 = mul_mat_iq_q8_K_T<DequantizerIQ2XS, 2>;
+            mm_nx4 = mul_mat_iq_q8_K_T<DequantizerIQ2XS, 4>;
+            mm_nx8 = mul_mat_iq_q8_K_T<DequantizerIQ2XS, 8>;
+            break;
+        case GGML_TYPE_IQ2_S:
+            mm_nx1 = mul_mat_iq_q8_K_T<DequantizerIQ2S, 1>;
+            mm_nx2 = mul_mat_iq_q8_K_T<DequantizerIQ2S, 2>;
+            mm_nx4 = mul_mat_iq_q8_K_T<DequantizerIQ2S, 4>;
+            mm_nx8 = mul_mat_iq_q8_K_T<DequantizerIQ2S, 8>;
+            break;
+        case GGML_TYPE_IQ3_XXS:
+            mm_nx1 = mul_mat_iq_q8_K_T<DequantizerIQ3XXS, 1>;
+            mm_nx2 = mul_mat_iq_q8_K_T<DequantizerIQ3XXS, 2>;
+            mm_nx4 = mul_mat_iq_q8_K_T<DequantizerIQ3XXS, 4>;
+            mm_nx8 = mul_mat_iq_q8_K_T<DequantizerIQ3XXS, 8>;
+            break;
+        case GGML_TYPE_IQ3_S:
+            mm_nx1 = mul_mat_iq_q8_K_T<DequantizerIQ3S, 1>;
+            mm_nx2 = mul_mat_iq_q8_K_T<DequantizerIQ3S, 2>;
+            mm_nx4 = mul_mat_iq_q8_K_T<DequantizerIQ3S, 4>;
+            mm_nx8 = mul_mat_iq_q8_K_T<DequantizerIQ3S, 8>;
+            break;
+        case GGML_TYPE_IQ1_S:
+            mm_nx1 = mul_mat_iq1_q8_K_T<DequantizerIQ1S, 1>;
+            mm_nx2 = mul_mat_iq1_q8_K_T<DequantizerIQ1S, 2>;
+            mm_nx4 = mul_mat_iq1_q8_K_T<DequantizerIQ1S, 4>;
+            mm_nx8 = mul_mat_iq1_q8_K_T<DequantizerIQ1S, 8>;
+            break;
+        case GGML_TYPE_IQ1_M:
+            mm_nx1 = mul_mat_iq1_q8_K_T<DequantizerIQ1M, 1>;
+            mm_nx2 = mul_mat_iq1_q8_K_T<DequantizerIQ1M, 2>;
+            mm_nx4 = mul_mat_iq1_q8_K_T<DequantizerIQ1M, 4>;
+            mm_nx8 = mul_mat_iq1_q8_K_T<DequantizerIQ1M, 8>;
+            break;
+        case GGML_TYPE_Q4_1:
+            mm_nx1 = mul_mat_qX_1_q8_1_T<DequantizerQ41, 1>;
+            mm_nx2 = mul_mat_qX_1_q8_1_T<DequantizerQ41, 2>;
+            mm_nx4 = mul_mat_qX_1_q8_1_T<DequantizerQ41, 4>;
+            mm_nx8 = mul_mat_qX_1_q8_1_T<DequantizerQ41, 8>;
+            expected_typeB = GGML_TYPE_Q8_1;
+            break;
+        case GGML_TYPE_Q5_1:
+            mm_nx1 = mul_mat_qX_1_q8_1_T<DequantizerQ51, 1>;
+            mm_nx2 = mul_mat_qX_1_q8_1_T<DequantizerQ51, 2>;
+            mm_nx4 = mul_mat_qX_1_q8_1_T<DequantizerQ51, 4>;
+            mm_nx8 = mul_mat_qX_1_q8_1_T<DequantizerQ51, 8>;
+            expected_typeB = GGML_TYPE_Q8_1;
+            break;
+        case GGML_TYPE_Q5_0:
+            mm_nx1 = mul_mat_q5_0_q8_0_T<1>;
+            mm_nx2 = mul_mat_q5_0_q8_0_T<2>;
+            mm_nx4 = mul_mat_q5_0_q8_0_T<4>;
+            mm_nx8 = mul_mat_q5_0_q8_0_T<8>;
+            expected_typeB = GGML_TYPE_Q8_0;
+            break;
+#endif
         default:
             return false;
     }
 
+    if (typeB != expected_typeB) return false;
+
+    assert (ne00 % ggml_blck_size((ggml_type)typeA) == 0);
+
     auto row_size_qx = ggml_row_size((ggml_type)typeA, ne00);
-    auto row_size_q8 = ggml_row_size(GGML_TYPE_Q8_K, ne00);
+    auto row_size_q8 = ggml_row_size((ggml_type)typeB, ne00);
 
-    auto nrc_x = (Nx + nth - 1)/nth;
-    auto first_x = ith*nrc_x;
-    if (first_x + nrc_x > Nx) nrc_x = Nx - first_x;
+    long first_x, last_x;
+    llamafile_share(Nx, ith, nth, &first_x, &last_x);
+    auto nrc_x = last_x - first_x;
 
     mul_mat_NxM(ne00, C + first_x, stride_C,
                 (const char *)A + row_size_qx*first_x, row_size_qx,
@@ -786,4 +1601,4 @@ bool iqk_mul_mat(long Nx, long Ny, long ne00, int typeA, const void * A, const v
     return true;
 }
 
-#endif // __x86_64__
+#endif // __x86_64__ || __ARM_FEATURE_DOTPROD
@@ -18,6 +18,7 @@
 #include "llamafile.h"
 #include "zip.h"
 #include <assert.h>
+#include <ctype.h>
 #include <cosmo.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -26,10 +27,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/mman.h>
+#include <third_party/zlib/zlib.h>
 #include <unistd.h>
 
 #define Min(a, b) ((a) < (b) ? (a) : (b))
 
+#define INFLATE_CHUNK (32 * 1024 * 1024)
+
 __notice(llamafile_notice, "\
 llamafile (Apache 2.0)\n\
 Copyright 2023 Mozilla Foundation\n\
@@ -53,9 +57,87 @@ struct llamafile {
     size_t position;
     void *mapping;
     size_t mapsize;
+    size_t offset; // of content in the file, or -1 if it was inflated
     char fname[PATH_MAX];
 };
 
+// returns n if name ends with `-0000n-of-0000m.gguf`, otherwise zero
+static int llamafile_split_no(const char *name, int len) {
+    int no = 0, count = 0;
+    if (len < 20)
+        return 0;
+    name += len - 20;
+    if (name[0] != '-' || memcmp(name + 6, "-of-", 4) || memcasecmp(name + 15, ".gguf", 5))
+        return 0;
+    for (int i = 0; i < 5; ++i) {
+        if (!isdigit(name[1 + i]) || !isdigit(name[10 + i]))
+            return 0;
+        no = no * 10 + name[1 + i] - '0';
+        count = count * 10 + name[10 + i] - '0';
+    }
+    return 0 < no && no <= count ? no : 0;
+}
+
+// inflates deflate-compressed asset into anonymous memory
+//
+// a raw deflate stream can only be decoded front to back, so this isn't
+// split across threads, but it also doesn't need a temporary file. the
+// compressed pages are dropped once consumed so peak usage stays close
+// to the size of the weights, which are checked against the zip's crc.
+static bool llamafile_inflate(struct llamafile *file, size_t size, uint32_t crc) {
+    uint8_t *out;
+    if ((out = mmap(0, size ? size : 1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1,
+                    0)) == MAP_FAILED) {
+        fprintf(stderr, "%s: error: failed to allocate memory for inflating weights: %s\n",
+                file->fname, strerror(errno));
+        return false;
+    }
+    z_stream zs = {0};
+    if (inflateInit2(&zs, -MAX_WBITS) != Z_OK) {
+        fprintf(stderr, "%s: error: inflateInit2() failed\n", file->fname);
+        munmap(out, size ? size : 1);
+        return false;
+    }
+    int rc;
+    uint32_t got = 0;
+    size_t inpos = 0, outpos = 0, dropped = 0;
+    const uint8_t *in = (const uint8_t *)file->content;
+    long pagesz = sysconf(_SC_PAGESIZE);
+    do {
+        size_t inamt = Min(file->size - inpos, INFLATE_CHUNK);
+        size_t outamt = Min(size - outpos, INFLATE_CHUNK);
+        zs.next_in = (uint8_t *)in + inpos;
+        zs.avail_in = inamt;
+        zs.next_out = out + outpos;
+        zs.avail_out = outamt;
+        rc = inflate(&zs, Z_NO_FLUSH);
+        if (rc != Z_OK && rc != Z_STREAM_END)
+            break; // Z_BUF_ERROR means it was truncated or bigger than the cdir says
+        got = crc32(got, out + outpos, outamt - zs.avail_out);
+        inpos += inamt - zs.avail_in;
+        outpos += outamt - zs.avail_out;
+        size_t done = (((uintptr_t)in + inpos) & -pagesz) - ((uintptr_t)file->mapping + dropped);
+        if (done >= INFLATE_CHUNK) {
+            madvise((char *)file->mapping + dropped, done, MADV_DONTNEED);
+            dropped += done;
+        }
+    } while (rc == Z_OK);
+    inflateEnd(&zs);
+    if (rc != Z_STREAM_END || outpos != size || got != crc) {
+        fprintf(stderr, "%s: error: compressed weights are corrupted\n", file->fname);
+        munmap(out, size ? size : 1);
+        return false;
+    }
+    mprotect(out, size ? size : 1, PROT_READ);
+    munmap(file->mapping, file->mapsize);
+    file->mapping = out;
+    file->mapsize = size ? size : 1;
+    file->content = (char *)out;
+    file->size = size;
+    file->offset = -1;
+    return true;
+}
+
 static struct llamafile *llamafile_open_zip(const char *prog, const char *fname, const char *mode) {
     int fd = -1;
     uint8_t *bufdata = NULL;
@@ -76,6 +158,7 @@ static struct llamafile *llamafile_open_zip(const char *prog, const char *fname,
     if ((rc = lseek(fd, 0, SEEK_END)) == -1)
         goto Failure;
     file->size = rc;
+    size_t filesize = rc;
 
     // read the last 64kb of file
     // the zip file format magic can be anywhere in there
@@ -143,6 +226,8 @@ static struct llamafile *llamafile_open_zip(const char *prog, const char *fname,
     }
 
     // look for filename in the directory
+    // when guessing, the shards of a split gguf count as the first one,
+    // because the loader opens the rest by name, e.g. `foo.zip@x-00002-of-00003.gguf`
     int found = 0;
     char *zip_name = 0;
     unsigned cdir_offset;
@@ -162,6 +247,8 @@ static struct llamafile *llamafile_open_zip(const char *prog, const char *fname,
         if ((fname ? (fname_len == entry_name_len && !memcmp(fname, entry_name_bytes, fname_len))
                    : (entry_name_len > 5 &&
                       !memcasecmp(entry_name_bytes + entry_name_len - 5, ".gguf", 5)))) {
+            if (!fname && llamafile_split_no(entry_name_bytes, entry_name_len) > 1)
+                continue;
             zip_name = gc(strndup(entry_name_bytes, entry_name_len));
             off = get_zip_cfile_offset(cdirdata + entry_offset);
             file->size = get_zip_cfile_compressed_size(cdirdata + entry_offset);
@@ -182,11 +269,10 @@ static struct llamafile *llamafile_open_zip(const char *prog, const char *fname,
     }
     strlcat(file->fname, "@", PATH_MAX);
     strlcat(file->fname, zip_name, PATH_MAX);
-    if (ZIP_CFILE_COMPRESSIONMETHOD(cdirdata + cdir_offset) != kZipCompressionNone) {
-        fprintf(
-            stderr,
-            "%s: error: weights stored in the zip executable can't be stored using compression\n",
-            file->fname);
+    int method = ZIP_CFILE_COMPRESSIONMETHOD(cdirdata + cdir_offset);
+    if (method != kZipCompressionNone && method != kZipCompressionDeflate) {
+        fprintf(stderr, "%s: error: weights stored in the zip executable use unsupported compression\n",
+                file->fname);
         goto Invalid;
     }
 
@@ -202,6 +288,11 @@ static struct llamafile *llamafile_open_zip(const char *prog, const char *fname,
         goto Invalid;
     }
     off += ZIP_LFILE_HDRSIZE(lfile);
+    if (off > filesize || file->size > filesize - off) {
+        fprintf(stderr, "%s: error: zip file is truncated; was the download interrupted?\n",
+                file->fname);
+        goto Invalid;
+    }
 
     // perform sanity check
     // mapping weights for apple metal gpu requires 16kb alignment
@@ -210,11 +301,17 @@ static struct llamafile *llamafile_open_zip(const char *prog, const char *fname,
                 file->fname);
 
     // map the file into memory
+    // when verifying, the pages are read in by the threads computing the crc
+    // and when streaming, they're read in a few layers ahead of being used
+    // and windows --hugepages reads them into a copy without the cache
+    bool verify = FLAG_verify && method == kZipCompressionNone;
+    bool populate = !verify && !FLAG_stream_weights && !(FLAG_hugepages && IsWindows());
     long pagesz = sysconf(_SC_PAGESIZE);
     off_t mapoff = off & -pagesz;
     long skew = off - mapoff;
     file->mapsize = skew + file->size;
-    file->mapping = mmap(0, file->mapsize, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, mapoff);
+    file->mapping = mmap(0, file->mapsize, PROT_READ, MAP_SHARED | (populate ? MAP_POPULATE : 0),
+                         fd, mapoff);
     if (file->mapping == MAP_FAILED) {
         fprintf(stderr, "%s: warning: failed to map zip file: %s\n", file->fname, strerror(errno));
         goto Failure;
@@ -227,8 +324,36 @@ static struct llamafile *llamafile_open_zip(const char *prog, const char *fname,
 
     // setup our synthetic file
     file->position = 0;
+    file->offset = off;
     file->content = (char *)file->mapping + skew;
 
+    // check the weights against the crc in the central directory, since
+    // whatever is wrong with them would otherwise only show as garbage
+    if (verify) {
+        uint32_t want = ZIP_CFILE_CRC32(cdirdata + cdir_offset);
+        uint32_t got = llamafile_schlep_crc32(file->content, file->size);
+        if (got != want) {
+            fprintf(stderr, "%s: error: weights are corrupted (crc32 is %08x but should be %08x)\n",
+                    file->fname, got, want);
+            munmap(file->mapping, file->mapsize);
+            goto Invalid;
+        }
+    }
+
+    // decompress weights that weren't stored, e.g. by `zipalign -9`
+    if (method == kZipCompressionDeflate) {
+        int64_t size = get_zip_cfile_uncompressed_size(cdirdata + cdir_offset);
+        fprintf(stderr,
+                "%s: note: inflating compressed weights into memory; store them without "
+                "compression so they can be mapped instead\n",
+                file->fname);
+        if (size < 0 ||
+            !llamafile_inflate(file, size, ZIP_CFILE_CRC32(cdirdata + cdir_offset))) {
+            munmap(file->mapping, file->mapsize);
+            goto Invalid;
+        }
+    }
+
     // return object
     close(fd);
     return file;
@@ -302,10 +427,28 @@ struct llamafile *llamafile_open_gguf(const char *fname, const char *mode) {
     return llamafile_open_zip(fname, 0, mode);
 }
 
+/**
+ * Returns name of file, e.g. `foo.llamafile@weights.gguf` for zip assets.
+ *
+ * Unlike the name that was opened, this says which zip asset was picked
+ * when it had to be guessed, so it's what split siblings are named off.
+ */
+const char *llamafile_name(struct llamafile *file) {
+    return file->fname;
+}
+
 FILE *llamafile_fp(struct llamafile *file) {
     return file->fp;
 }
 
+/**
+ * Returns where the weights start in the file that llamafile_name()
+ * names, up to its `@`, or -1 if they were inflated into memory.
+ */
+size_t llamafile_offset(struct llamafile *file) {
+    return file->offset;
+}
+
 size_t llamafile_size(struct llamafile *file) {
     return file->size;
 }
@@ -361,6 +504,38 @@ long llamafile_read(struct llamafile *file, void *ptr, size_t len) {
     return len;
 }
 
+/**
+ * Reads bytes at offset without moving the file position.
+ *
+ * Unlike llamafile_read() this may be called by several threads at once
+ * on the same file, e.g. to keep more than one read in flight.
+ *
+ * @return `len` on success, 0 if the file is too short, or -1 w/ errno
+ */
+long llamafile_pread(struct llamafile *file, void *ptr, size_t len, size_t offset) {
+    if (len == 0)
+        return 0;
+    if (!file->fp) {
+        if (offset > file->size || len > file->size - offset)
+            return 0;
+        memcpy(ptr, file->content + offset, len);
+        return len;
+    }
+    int fd = fileno(file->fp);
+    for (size_t got = 0; got < len;) {
+        ssize_t rc = pread(fd, (char *)ptr + got, len - got, offset + got);
+        if (rc == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (!rc)
+            return 0;
+        got += rc;
+    }
+    return len;
+}
+
 long llamafile_write(struct llamafile *file, const void *ptr, size_t len) {
     if (len == 0)
         return 0;
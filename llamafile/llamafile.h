@@ -1,6 +1,7 @@
 #ifndef LLAMAFILE_H_
 #define LLAMAFILE_H_
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #ifdef __cplusplus
 extern "C" {
@@ -11,11 +12,14 @@ struct llamafile *llamafile_open_gguf(const char *, const char *);
 void llamafile_close(struct llamafile *);
 long llamafile_read(struct llamafile *, void *, size_t);
 long llamafile_write(struct llamafile *, const void *, size_t);
+long llamafile_pread(struct llamafile *, void *, size_t, size_t);
 bool llamafile_seek(struct llamafile *, size_t, int);
 void *llamafile_content(struct llamafile *);
 size_t llamafile_tell(struct llamafile *);
 size_t llamafile_size(struct llamafile *);
 FILE *llamafile_fp(struct llamafile *);
+const char *llamafile_name(struct llamafile *);
+size_t llamafile_offset(struct llamafile *);
 
 void llamafile_check_cpu(void);
 void llamafile_help(const char *);
@@ -25,11 +29,29 @@ bool llamafile_has(char **, const char *);
 bool llamafile_extract(const char *, const char *);
 int llamafile_is_file_newer_than(const char *, const char *);
 void llamafile_schlep(const void *, size_t);
+uint32_t llamafile_schlep_crc32(const void *, size_t);
+void llamafile_warmup(const void *, size_t);
+void *llamafile_shm_attach(const char *, size_t, bool *);
+void llamafile_shm_publish(void *);
+void llamafile_shm_detach(void *);
+void *llamafile_win_load(struct llamafile *, size_t *);
+void llamafile_win_free(void *);
+void llamafile_prefetch(const void *, size_t);
 void llamafile_get_app_dir(char *, size_t);
+void llamafile_get_cpu_name(char *, size_t);
 void llamafile_launch_browser(const char *);
+int llamafile_math_cpus(void);
+void llamafile_plan_cores(void);
+void llamafile_pin_thread(int);
+void llamafile_unpin_thread(void);
 
 extern bool FLAG_trap;
 extern bool FLAG_precise;
+extern bool FLAG_hugepages;
+extern bool FLAG_share_weights;
+extern bool FLAG_verify;
+extern bool FLAG_adaptive_threads;
+extern bool FLAG_stream_weights;
 extern bool FLAG_unsecure;
 
 #define LLAMAFILE_GPU_ERROR -2
@@ -42,7 +64,9 @@ extern int FLAG_gpu;
 extern bool FLAG_tinyblas;
 extern bool FLAG_nocompile;
 extern bool FLAG_recompile;
+extern bool FLAG_cuda_graphs;
 bool llamafile_has_gpu(void);
+#define LLAMAFILE_GPU_LAYERS_AUTO -2
 int llamafile_gpu_layers(int);
 bool llamafile_has_cuda(void);
 bool llamafile_has_metal(void);
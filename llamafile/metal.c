@@ -73,6 +73,7 @@ static struct Metal {
     typeof(ggml_backend_is_metal) *backend_is_metal;
     typeof(ggml_backend_metal_set_n_cb) *backend_set_n_cb;
     typeof(ggml_backend_metal_log_set_callback) *log_set_callback;
+    typeof(ggml_backend_metal_get_device_memory) *get_device_memory;
     typeof(ggml_backend_reg_metal_init) *reg_init;
 } ggml_metal;
 
@@ -216,6 +217,7 @@ static bool LinkMetal(const char *dso) {
     ok &= !!(ggml_metal.backend_is_metal = cosmo_dlsym(lib, "ggml_backend_is_metal"));
     ok &= !!(ggml_metal.backend_set_n_cb = cosmo_dlsym(lib, "ggml_backend_metal_set_n_cb"));
     ok &= !!(ggml_metal.log_set_callback = cosmo_dlsym(lib, "ggml_backend_metal_log_set_callback"));
+    ok &= !!(ggml_metal.get_device_memory = cosmo_dlsym(lib, "ggml_backend_metal_get_device_memory"));
     ok &= !!(ggml_metal.reg_init = cosmo_dlsym(lib, "ggml_backend_reg_metal_init"));
     if (!ok) {
         tinylog(Dlerror(), ": not all symbols could be imported\n", NULL);
@@ -313,6 +315,12 @@ void ggml_backend_metal_log_set_callback(ggml_log_callback log_callback, void *u
     return ggml_metal.log_set_callback(log_callback, user_data);
 }
 
+void ggml_backend_metal_get_device_memory(size_t *free, size_t *total) {
+    if (!llamafile_has_metal())
+        return;
+    return ggml_metal.get_device_memory(free, total);
+}
+
 ggml_backend_t ggml_backend_reg_metal_init(const char *params, void *user_data) {
     if (!llamafile_has_metal())
         return 0;
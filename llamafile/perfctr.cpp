@@ -0,0 +1,241 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "perfctr.h"
+#include "log.h"
+
+#include <atomic>
+#include <cosmo.h>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
+
+//
+// hardware performance counters
+//
+// Each thread that samples opens its own group of perf_event_open()
+// counters the first time, which only count user space, so the default
+// perf_event_paranoid setting of 2 allows them. Samples are taken with
+// read(), which costs a system call, so they're only taken around ops
+// that are big enough for that not to matter.
+//
+// Memory bandwidth isn't counted directly, since the uncore counters of
+// the memory controllers need privileges. Last level cache misses times
+// the cache line size are used to estimate it instead.
+//
+
+#define COUNTERS 4
+
+namespace {
+
+// struct perf_event_attr, up to PERF_ATTR_SIZE_VER0
+struct PerfEventAttr {
+    uint32_t type;
+    uint32_t size;
+    uint64_t config;
+    uint64_t sample_period;
+    uint64_t sample_type;
+    uint64_t read_format;
+    uint64_t flags;
+    uint32_t wakeup_events;
+    uint32_t bp_type;
+    uint64_t config1;
+};
+
+static_assert(sizeof(PerfEventAttr) == 64, "bad PerfEventAttr");
+
+#define PERF_TYPE_HARDWARE 0
+#define PERF_TYPE_HW_CACHE 3
+#define PERF_FORMAT_GROUP 8
+#define PERF_FLAG_EXCLUDE_KERNEL (1 << 5)
+#define PERF_FLAG_EXCLUDE_HV (1 << 6)
+
+const struct {
+    uint32_t type;
+    uint64_t config;
+} kCounters[COUNTERS] = {
+    {PERF_TYPE_HARDWARE, 0}, // cpu cycles
+    {PERF_TYPE_HARDWARE, 1}, // instructions
+    {PERF_TYPE_HARDWARE, 3}, // cache misses
+    {PERF_TYPE_HW_CACHE, 3 | 0 << 8 | 1 << 16}, // dtlb read misses
+};
+
+const char *const kOpNames[LLAMAFILE_PERF_OPS] = {"matmul", "sgemm", "attention"};
+const char *const kPhaseNames[LLAMAFILE_PERF_PHASES] = {"prompt", "eval"};
+
+std::atomic<unsigned long long> g_stats[LLAMAFILE_PERF_PHASES][LLAMAFILE_PERF_OPS][6];
+
+long perf_event_open(PerfEventAttr *attr, int group_fd) {
+    if (!IsLinux())
+        return -1;
+    long rc;
+#ifdef __x86_64__
+    register long r10 asm("r10") = group_fd;
+    register long r8 asm("r8") = 0; // flags
+    asm volatile("syscall"
+                 : "=a"(rc)
+                 : "0"(298L), // SYS_perf_event_open
+                   "D"(attr), // attributes
+                   "S"(0L), // this process
+                   "d"(-1L), // any cpu
+                   "r"(r10), "r"(r8)
+                 : "rcx", "r11", "memory");
+#elif defined(__aarch64__)
+    register long x0 asm("x0") = (long)attr;
+    register long x1 asm("x1") = 0; // this process
+    register long x2 asm("x2") = -1; // any cpu
+    register long x3 asm("x3") = group_fd;
+    register long x4 asm("x4") = 0; // flags
+    register long x8 asm("x8") = 241; // SYS_perf_event_open
+    asm volatile("svc\t0" : "+r"(x0) : "r"(x1), "r"(x2), "r"(x3), "r"(x4), "r"(x8) : "memory");
+    rc = x0;
+#else
+    rc = -1;
+#endif
+    return rc < 0 ? -1 : rc;
+}
+
+struct Group {
+    bool opened = false;
+    int leader = -1;
+    int fds[COUNTERS];
+    int slot[COUNTERS]; // index of counter in what read() returns, or -1
+    int n;
+
+    void open() {
+        opened = true;
+        n = 0;
+        for (int i = 0; i < COUNTERS; ++i) {
+            PerfEventAttr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.type = kCounters[i].type;
+            attr.size = sizeof(attr);
+            attr.config = kCounters[i].config;
+            attr.read_format = PERF_FORMAT_GROUP;
+            attr.flags = PERF_FLAG_EXCLUDE_KERNEL | PERF_FLAG_EXCLUDE_HV;
+            fds[i] = perf_event_open(&attr, leader);
+            slot[i] = -1;
+            if (fds[i] == -1) {
+                if (!i)
+                    return; // no cycles, no group
+                continue;
+            }
+            if (!i)
+                leader = fds[i];
+            slot[i] = n++;
+        }
+    }
+
+    bool read(unsigned long long count[COUNTERS]) {
+        if (!opened)
+            open();
+        if (leader == -1)
+            return false;
+        uint64_t buf[1 + COUNTERS];
+        if (::read(leader, buf, sizeof(buf)) < (long)sizeof(uint64_t) * (1 + n))
+            return false;
+        for (int i = 0; i < COUNTERS; ++i)
+            count[i] = slot[i] != -1 ? buf[1 + slot[i]] : 0;
+        return true;
+    }
+
+    ~Group() {
+        if (opened)
+            for (int i = 0; i < COUNTERS; ++i)
+                if (fds[i] != -1)
+                    close(fds[i]);
+    }
+};
+
+thread_local Group g_group;
+
+long long now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+} // namespace
+
+bool llamafile_perf_enabled;
+int llamafile_perf_phase;
+
+/**
+ * Turns on sampling of performance counters.
+ *
+ * @return false w/ warning if this system won't let us count
+ */
+bool llamafile_perf_begin(void) {
+    unsigned long long count[COUNTERS];
+    if (!g_group.read(count)) {
+        tinylog(__func__, ": warning: perf_event_open() isn't available; see "
+                          "/proc/sys/kernel/perf_event_paranoid\n", NULL);
+        return false;
+    }
+    llamafile_perf_enabled = true;
+    return true;
+}
+
+/**
+ * Reads counters of calling thread at start of operation.
+ */
+void llamafile_perf_start(struct llamafile_perf_sample *s) {
+    s->ok = llamafile_perf_enabled && g_group.read(s->count);
+    if (s->ok)
+        s->time = now();
+}
+
+/**
+ * Adds what calling thread counted since llamafile_perf_start() to `op`.
+ */
+void llamafile_perf_stop(const struct llamafile_perf_sample *s, int op) {
+    unsigned long long count[COUNTERS];
+    if (!s->ok)
+        return;
+    long long time = now();
+    if (!g_group.read(count))
+        return;
+    std::atomic<unsigned long long> *stats = g_stats[llamafile_perf_phase][op];
+    stats[0].fetch_add(1, std::memory_order_relaxed);
+    stats[1].fetch_add(time - s->time, std::memory_order_relaxed);
+    for (int i = 0; i < COUNTERS; ++i)
+        stats[2 + i].fetch_add(count[i] - s->count[i], std::memory_order_relaxed);
+}
+
+/**
+ * Returns totals of all threads since process started.
+ *
+ * Time is summed over threads too, so it isn't wall time.
+ */
+void llamafile_perf_get(int phase, int op, struct llamafile_perf_stats *st) {
+    std::atomic<unsigned long long> *stats = g_stats[phase][op];
+    st->calls = stats[0].load(std::memory_order_relaxed);
+    st->time_ns = stats[1].load(std::memory_order_relaxed);
+    st->cycles = stats[2].load(std::memory_order_relaxed);
+    st->instructions = stats[3].load(std::memory_order_relaxed);
+    st->llc_misses = stats[4].load(std::memory_order_relaxed);
+    st->dtlb_misses = stats[5].load(std::memory_order_relaxed);
+}
+
+const char *llamafile_perf_op_name(int op) {
+    return kOpNames[op];
+}
+
+const char *llamafile_perf_phase_name(int phase) {
+    return kPhaseNames[phase];
+}
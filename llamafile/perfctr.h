@@ -0,0 +1,44 @@
+#ifndef LLAMAFILE_PERFCTR_H_
+#define LLAMAFILE_PERFCTR_H_
+#include <stdbool.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define LLAMAFILE_PERF_MATMUL 0
+#define LLAMAFILE_PERF_SGEMM 1
+#define LLAMAFILE_PERF_ATTENTION 2
+#define LLAMAFILE_PERF_OPS 3
+
+#define LLAMAFILE_PERF_PROMPT 0
+#define LLAMAFILE_PERF_EVAL 1
+#define LLAMAFILE_PERF_PHASES 2
+
+struct llamafile_perf_sample {
+    bool ok;
+    long long time;
+    unsigned long long count[4];
+};
+
+struct llamafile_perf_stats {
+    unsigned long long calls;
+    unsigned long long time_ns;
+    unsigned long long cycles;
+    unsigned long long instructions;
+    unsigned long long llc_misses;
+    unsigned long long dtlb_misses;
+};
+
+extern bool llamafile_perf_enabled;
+extern int llamafile_perf_phase;
+bool llamafile_perf_begin(void);
+void llamafile_perf_start(struct llamafile_perf_sample *);
+void llamafile_perf_stop(const struct llamafile_perf_sample *, int);
+void llamafile_perf_get(int, int, struct llamafile_perf_stats *);
+const char *llamafile_perf_op_name(int);
+const char *llamafile_perf_phase_name(int);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* LLAMAFILE_PERFCTR_H_ */
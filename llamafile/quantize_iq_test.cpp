@@ -0,0 +1,150 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "bench.h"
+#include "debug.h"
+#include "llama.cpp/ggml.h"
+#include "numba.h"
+#include <cmath>
+#include <cosmo.h>
+#include <cstring>
+
+// checks that the simd codebook searches of the avx2 build quantize the
+// i-quants the same as the scalar loops of the avx build
+
+#define ITERATIONS 1
+#define ALLOC(n) (float *)memalign(4096, sizeof(float) * (n))
+
+#ifdef __x86_64__
+
+typedef size_t quantize_f(const float *, void *, int64_t, int64_t, const float *);
+
+extern "C" {
+void iq2xs_init_impl_amd_avx2(enum ggml_type);
+void iq2xs_init_impl_amd_avx(enum ggml_type);
+void iq3xs_init_impl_amd_avx2(int);
+void iq3xs_init_impl_amd_avx(int);
+quantize_f quantize_iq2_xxs_amd_avx2, quantize_iq2_xxs_amd_avx;
+quantize_f quantize_iq2_xs_amd_avx2, quantize_iq2_xs_amd_avx;
+quantize_f quantize_iq2_s_amd_avx2, quantize_iq2_s_amd_avx;
+quantize_f quantize_iq3_xxs_amd_avx2, quantize_iq3_xxs_amd_avx;
+quantize_f quantize_iq3_s_amd_avx2, quantize_iq3_s_amd_avx;
+quantize_f quantize_iq1_s_amd_avx2, quantize_iq1_s_amd_avx;
+quantize_f quantize_iq1_m_amd_avx2, quantize_iq1_m_amd_avx;
+}
+
+static double rmse(ggml_type type, const void *q, const float *x, int n) {
+    float *y = ALLOC(n);
+    ggml_internal_get_type_traits(type).to_float(q, y, n);
+    double sum = 0;
+    for (int i = 0; i < n; ++i)
+        sum += (x[i] - y[i]) * (x[i] - y[i]);
+    free(y);
+    return sqrt(sum / n);
+}
+
+int test(ggml_type type, quantize_f *simd, quantize_f *scalar) {
+    int m = 64;
+    int k = 4096;
+    float *X = ALLOC(k * m);
+    float *W = ALLOC(k);
+    size_t size = ggml_row_size(type, k) * m;
+    char *Q = (char *)memalign(4096, size);
+    char *R = (char *)memalign(4096, size);
+    randomize(X, k * m);
+    for (int l = 0; l < k; ++l)
+        W[l] = float01(rand32()) + .5f;
+
+    printf("%s\n", ggml_type_name(type));
+    BENCH(scalar(X, R, m, k, W));
+    BENCH(simd(X, Q, m, k, W));
+
+    // sums are added up in another order, so a near tie may go the
+    // other way, but that mustn't make the quantization any worse
+    long same = 0;
+    long blocks = size / ggml_type_size(type);
+    for (long i = 0; i < blocks; ++i)
+        same += !memcmp(Q + i * ggml_type_size(type), R + i * ggml_type_size(type),
+                        ggml_type_size(type));
+    double e1 = rmse(type, Q, X, k * m);
+    double e2 = rmse(type, R, X, k * m);
+    printf("%12g rmse simd\n", e1);
+    printf("%12g rmse scalar\n", e2);
+    printf("%12g blocks identical\n", (double)same / blocks);
+    if (same < blocks * .95 || std::fabs(e1 - e2) > e2 * 1e-3) {
+        fprintf(stderr, "%s:%d: %s simd quantization differs\n", __FILE__, __LINE__,
+                ggml_type_name(type));
+        return 2;
+    }
+
+    free(R);
+    free(Q);
+    free(W);
+    free(X);
+
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int rc;
+
+    if (!X86_HAVE(AVX2) || !X86_HAVE(FMA) || !X86_HAVE(F16C)) {
+        printf("skipping: this cpu doesn't have avx2\n");
+        return 0;
+    }
+
+    llamafile_trapping_enabled(+1);
+
+    // initializes the fp16 tables
+    ggml_init_params params = {ggml_tensor_overhead(), nullptr, true};
+    ggml_free(ggml_init(params));
+
+    // each build has its own copy of the codebook tables
+    static const ggml_type kIq2[] = {GGML_TYPE_IQ2_XXS, GGML_TYPE_IQ2_XS, GGML_TYPE_IQ2_S,
+                                     GGML_TYPE_IQ1_S};
+    for (ggml_type type : kIq2) {
+        iq2xs_init_impl_amd_avx2(type);
+        iq2xs_init_impl_amd_avx(type);
+    }
+    iq3xs_init_impl_amd_avx2(256);
+    iq3xs_init_impl_amd_avx(256);
+    iq3xs_init_impl_amd_avx2(512);
+    iq3xs_init_impl_amd_avx(512);
+
+    if ((rc = test(GGML_TYPE_IQ2_XXS, quantize_iq2_xxs_amd_avx2, quantize_iq2_xxs_amd_avx)))
+        return rc;
+    if ((rc = test(GGML_TYPE_IQ2_XS, quantize_iq2_xs_amd_avx2, quantize_iq2_xs_amd_avx)))
+        return rc;
+    if ((rc = test(GGML_TYPE_IQ2_S, quantize_iq2_s_amd_avx2, quantize_iq2_s_amd_avx)))
+        return rc;
+    if ((rc = test(GGML_TYPE_IQ3_XXS, quantize_iq3_xxs_amd_avx2, quantize_iq3_xxs_amd_avx)))
+        return rc;
+    if ((rc = test(GGML_TYPE_IQ3_S, quantize_iq3_s_amd_avx2, quantize_iq3_s_amd_avx)))
+        return rc;
+    if ((rc = test(GGML_TYPE_IQ1_S, quantize_iq1_s_amd_avx2, quantize_iq1_s_amd_avx)))
+        return rc;
+    if ((rc = test(GGML_TYPE_IQ1_M, quantize_iq1_m_amd_avx2, quantize_iq1_m_amd_avx)))
+        return rc;
+}
+
+#else
+
+int main(int argc, char *argv[]) {
+    printf("skipping: the simd searches are only compared on x86\n");
+}
+
+#endif // __x86_64__
@@ -0,0 +1,199 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sgemm.h"
+#include "llama.cpp/ggml-quants.h"
+#include "llama.cpp/ggml.h"
+#include <cstdlib>
+#include <cstring>
+#include <malloc.h>
+#include <mutex>
+
+//
+// load-time weight repacking
+//
+// The interleaved copy is made next to the original weights, which stay
+// in place for every op that isn't a matrix multiplication. It's looked
+// up by llamafile_sgemm() using the address of the original, so lookups
+// are lock-free, whereas registering and unregistering take a mutex.
+//
+
+#define REPACK_SLOTS 8192
+#define REPACK_TOMBSTONE ((const void *)-1)
+
+namespace {
+
+struct repack_entry {
+    const void *src;
+    long m;
+    long k;
+    long lda;
+    int type;
+    void *dst;
+    bool owned;
+};
+
+repack_entry g_repack[REPACK_SLOTS];
+int g_repack_count;
+std::mutex g_repack_lock;
+
+unsigned repack_hash(const void *src) {
+    return ((uintptr_t)src >> 6) * 0x9e3779b97f4a7c15ull >> 51;
+}
+
+template <typename TA, typename TX>
+void repack(TX *dst, const TA *src, long m, long k, long lda) {
+    constexpr int words = sizeof(src->qs) / 4;
+    for (long i = 0; i < m; i += 8)
+        for (long l = 0; l < k; ++l) {
+            TX *x = dst + i / 8 * k + l;
+            for (int r = 0; r < 8; ++r) {
+                const TA *a = src + lda * (i + r) + l;
+                x->d[r] = a->d;
+                for (int h = 0; h < words; ++h)
+                    memcpy(x->qs + 32 * h + 4 * r, a->qs + 4 * h, 4);
+            }
+        }
+}
+
+} // namespace
+
+/**
+ * Returns bytes needed to repack matrix, or zero if it can't be.
+ *
+ * @param m is rows in weights
+ * @param k is cols in weights in blocks
+ * @param Atype is GGML data type of weights
+ */
+size_t llamafile_repack_size(long m, long k, int Atype) {
+    if (m % 8)
+        return 0;
+    switch (Atype) {
+    case GGML_TYPE_Q4_0:
+        static_assert(sizeof(block_q4_0x8) == 8 * sizeof(block_q4_0), "bad block_q4_0x8");
+        return m / 8 * k * sizeof(block_q4_0x8);
+    case GGML_TYPE_Q8_0:
+        static_assert(sizeof(block_q8_0x8) == 8 * sizeof(block_q8_0), "bad block_q8_0x8");
+        return m / 8 * k * sizeof(block_q8_0x8);
+    default:
+        return 0;
+    }
+}
+
+static bool llamafile_repack_impl(void *dst, bool fill, const void *A, long m, long k, long lda,
+                                  int Atype) {
+    if (A == REPACK_TOMBSTONE)
+        return false;
+    size_t size;
+    if (!(size = llamafile_repack_size(m, k, Atype)))
+        return false;
+    std::lock_guard<std::mutex> lock(g_repack_lock);
+    if (g_repack_count >= REPACK_SLOTS / 2)
+        return false;
+    if (llamafile_repacked(A, m, k, lda, Atype))
+        return true;
+    bool owned = !dst;
+    if (owned && !(dst = memalign(64, size)))
+        return false;
+    if (fill) {
+        if (Atype == GGML_TYPE_Q4_0)
+            repack((block_q4_0x8 *)dst, (const block_q4_0 *)A, m, k, lda);
+        else
+            repack((block_q8_0x8 *)dst, (const block_q8_0 *)A, m, k, lda);
+    }
+    unsigned h = repack_hash(A);
+    while (g_repack[h].src && g_repack[h].src != REPACK_TOMBSTONE)
+        h = (h + 1) % REPACK_SLOTS;
+    g_repack[h].m = m;
+    g_repack[h].k = k;
+    g_repack[h].lda = lda;
+    g_repack[h].type = Atype;
+    g_repack[h].dst = dst;
+    g_repack[h].owned = owned;
+    __atomic_store_n(&g_repack[h].src, A, __ATOMIC_RELEASE);
+    __atomic_store_n(&g_repack_count, g_repack_count + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/**
+ * Makes an interleaved copy of a matrix of quantized weights.
+ *
+ * @param A is the weights, which must stay around until unrepacked
+ * @param m is rows in `A`, which must be a multiple of 8
+ * @param k is cols in `A` in blocks
+ * @param lda is row stride of `A` in blocks
+ * @param Atype is GGML data type of `A`
+ * @return true if `A` was repacked
+ */
+bool llamafile_repack(const void *A, long m, long k, long lda, int Atype) {
+    return llamafile_repack_impl(nullptr, true, A, m, k, lda, Atype);
+}
+
+/**
+ * Repacks matrix into memory owned by the caller.
+ *
+ * This is used when the copy is shared with other processes, which is
+ * why it's only written if `fill` is true. Otherwise `dst` is trusted
+ * to already hold what llamafile_repack() would have computed. It must
+ * be llamafile_repack_size() bytes, and outlive llamafile_unrepack().
+ */
+bool llamafile_repack_into(void *dst, bool fill, const void *A, long m, long k, long lda,
+                           int Atype) {
+    return llamafile_repack_impl(dst, fill, A, m, k, lda, Atype);
+}
+
+/**
+ * Returns interleaved copy of `A` if it was repacked with this shape.
+ */
+const void *llamafile_repacked(const void *A, long m, long k, long lda, int Atype) {
+    if (!__atomic_load_n(&g_repack_count, __ATOMIC_ACQUIRE))
+        return nullptr;
+    unsigned h = repack_hash(A);
+    for (int probes = 0; probes < REPACK_SLOTS; ++probes, h = (h + 1) % REPACK_SLOTS) {
+        const void *src = __atomic_load_n(&g_repack[h].src, __ATOMIC_ACQUIRE);
+        if (!src)
+            return nullptr;
+        if (src == A) {
+            const repack_entry &e = g_repack[h];
+            if (e.m == m && e.k == k && e.lda == lda && e.type == Atype)
+                return e.dst;
+            return nullptr;
+        }
+    }
+    return nullptr;
+}
+
+/**
+ * Frees the interleaved copy of `A`, if there is one.
+ */
+void llamafile_unrepack(const void *A) {
+    std::lock_guard<std::mutex> lock(g_repack_lock);
+    if (!g_repack_count)
+        return;
+    unsigned h = repack_hash(A);
+    for (int probes = 0; probes < REPACK_SLOTS && g_repack[h].src; ++probes, h = (h + 1) % REPACK_SLOTS)
+        if (g_repack[h].src == A) {
+            void *dst = g_repack[h].owned ? g_repack[h].dst : nullptr;
+            __atomic_store_n(&g_repack[h].src, REPACK_TOMBSTONE, __ATOMIC_RELEASE);
+            __atomic_store_n(&g_repack_count, g_repack_count - 1, __ATOMIC_RELEASE);
+            free(dst);
+            // sweep the tombstones once the last model is gone
+            if (!g_repack_count)
+                memset(g_repack, 0, sizeof(g_repack));
+            return;
+        }
+}
@@ -22,11 +22,19 @@
 #include <pthread.h>
 #include <stdatomic.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/auxv.h>
+#include <sys/mman.h>
+#include <third_party/zlib/zlib.h>
 #include <unistd.h>
 
 #define FPS 24
 #define THREADS 4
+#define CHUNK (8 * 1024 * 1024)
+
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22 // linux 5.14+
+#endif
 
 struct PageFaulter {
     long left;
@@ -35,6 +43,7 @@ struct PageFaulter {
     pthread_t th;
     const char *data;
     atomic_long *faults;
+    uint32_t *crc; // of left..right, if not null
 };
 
 static char Peek(volatile const char *ptr) {
@@ -43,11 +52,34 @@ static char Peek(volatile const char *ptr) {
 
 char (*pPeek)(volatile const char *) = Peek;
 
+// cleared once the kernel tells us it doesn't know MADV_POPULATE_READ
+static atomic_bool g_populate = true;
+
+// asks the kernel to fault in a whole chunk at once, which costs one
+// system call rather than taking a trap on each page
+static bool Populate(const char *p, long n, long pagesz) {
+    if (!IsLinux() || !atomic_load_explicit(&g_populate, memory_order_relaxed))
+        return false;
+    uintptr_t lo = (uintptr_t)p & -pagesz;
+    uintptr_t hi = ((uintptr_t)p + n + pagesz - 1) & -pagesz;
+    if (!madvise((void *)lo, hi - lo, MADV_POPULATE_READ))
+        return true;
+    if (errno == EINVAL || errno == ENOSYS)
+        atomic_store_explicit(&g_populate, false, memory_order_relaxed);
+    return false;
+}
+
 static void *PageFaulter(void *arg) {
     struct PageFaulter *pf = arg;
-    for (long i = pf->left; i < pf->right; i += pf->pagesz) {
-        pPeek(pf->data + i);
-        atomic_fetch_add_explicit(pf->faults, 1, memory_order_release);
+    for (long i = pf->left; i < pf->right; i += CHUNK) {
+        long n = pf->right - i < CHUNK ? pf->right - i : CHUNK;
+        long pages = (n + pf->pagesz - 1) / pf->pagesz;
+        if (!Populate(pf->data + i, n, pf->pagesz))
+            for (long j = 0; j < n; j += pf->pagesz)
+                pPeek(pf->data + i + j);
+        if (pf->crc)
+            *pf->crc = crc32(*pf->crc, (const uint8_t *)pf->data + i, n);
+        atomic_fetch_add_explicit(pf->faults, pages, memory_order_release);
     }
     return 0;
 }
@@ -67,29 +99,17 @@ static void FormatPercent(char sbuf[static 8], double x) {
     *p = 0;
 }
 
-/**
- * Loads memory off disk while reporting progress.
- */
-void llamafile_schlep(const void *data, size_t size) {
-
-    // don't bother if logging is disabled
-    if (FLAG_log_disable)
-        return;
-
-    // don't bother if memory is small
-    if (size < 128 * 1024 * 1024)
-        return;
-
-    // don't bother if stderr isn't a terminal
-    if (!isatty(2))
-        return;
+// faults in memory with several threads, each of which computes the
+// crc32 of its part when crcs isn't null, and reports progress if a
+// label is passed
+static void Schlep(const void *data, size_t size, const char *label, uint32_t crcs[THREADS]) {
 
     // launch threads
     errno_t err;
     atomic_long faults = 0;
     long stride = size / THREADS;
     long pagesz = getauxval(AT_PAGESZ);
-    long pages = (stride + pagesz - 1) / pagesz * THREADS;
+    long pages = 0;
     pthread_attr_t attr;
     pthread_attr_init(&attr);
     pthread_attr_setstacksize(&attr, 65536);
@@ -100,7 +120,11 @@ void llamafile_schlep(const void *data, size_t size) {
         pf[i].pagesz = pagesz;
         pf[i].faults = &faults;
         pf[i].left = stride * i;
-        pf[i].right = stride * (i + 1);
+        pf[i].right = i + 1 < THREADS ? stride * (i + 1) : size;
+        pf[i].crc = crcs ? crcs + i : 0;
+        if (crcs)
+            crcs[i] = 0;
+        pages += (pf[i].right - pf[i].left + pagesz - 1) / pagesz;
         err = pthread_create(&pf[i].th, &attr, PageFaulter, pf + i);
         if (err) {
             errno = err;
@@ -114,15 +138,90 @@ void llamafile_schlep(const void *data, size_t size) {
     for (;;) {
         char percent[8];
         long count = atomic_load_explicit(&faults, memory_order_acquire);
-        if (count == pages)
+        if (count == pages || !label)
             break;
         FormatPercent(percent, (double)count / pages);
-        tinyprint(2, "\rmemory map ", percent, "% loaded...\033[K", NULL);
+        tinyprint(2, "\r", label, " ", percent, "% loaded...\033[K", NULL);
         usleep(1. / FPS * 1e6);
     }
-    tinyprint(2, "\r\033[K", NULL);
+    if (label)
+        tinyprint(2, "\r\033[K", NULL);
 
     // wait for workers
     for (int i = 0; i < THREADS; ++i)
         pthread_join(pf[i].th, 0);
 }
+
+/**
+ * Loads memory off disk while reporting progress.
+ */
+void llamafile_schlep(const void *data, size_t size) {
+
+    // don't bother if logging is disabled
+    if (FLAG_log_disable)
+        return;
+
+    // don't bother if memory is small
+    if (size < 128 * 1024 * 1024)
+        return;
+
+    // don't bother if stderr isn't a terminal
+    if (!isatty(2))
+        return;
+
+    Schlep(data, size, "memory map", 0);
+}
+
+/**
+ * Loads memory off disk and returns its crc32.
+ *
+ * Each of the threads that fault in the pages checksums its part of
+ * the memory while it's still in cache, so the check costs little more
+ * than loading the weights does. Progress is reported the same way as
+ * schlep, but the memory is read even when it isn't.
+ */
+uint32_t llamafile_schlep_crc32(const void *data, size_t size) {
+    uint32_t crc, crcs[THREADS];
+    bool progress = !FLAG_log_disable && size >= 128 * 1024 * 1024 && isatty(2);
+    Schlep(data, size, progress ? "verifying weights," : 0, crcs);
+    crc = crcs[0];
+    for (int i = 1; i < THREADS; ++i) {
+        long left = size / THREADS * i;
+        long right = i + 1 < THREADS ? size / THREADS * (i + 1) : size;
+        crc = crc32_combine(crc, crcs[i], right - left);
+    }
+    return crc;
+}
+
+static void *Warmer(void *arg) {
+    PageFaulter(arg);
+    free(arg);
+    return 0;
+}
+
+/**
+ * Loads memory off disk on a background thread.
+ *
+ * This returns immediately. Pages are read in the same way as schlep,
+ * except no progress is reported, so that threads which need weights
+ * sooner can fault them in on their own. The memory must stay mapped
+ * for the life of the process.
+ */
+void llamafile_warmup(const void *data, size_t size) {
+    static atomic_long faults;
+    struct PageFaulter *pf;
+    if (!size || !(pf = malloc(sizeof(struct PageFaulter))))
+        return;
+    pf->data = data;
+    pf->pagesz = getauxval(AT_PAGESZ);
+    pf->faults = &faults;
+    pf->left = 0;
+    pf->right = size;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, 65536);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&pf->th, &attr, Warmer, pf))
+        free(pf);
+    pthread_attr_destroy(&attr);
+}
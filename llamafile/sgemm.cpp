@@ -16,15 +16,80 @@
 // limitations under the License.
 
 #include "sgemm.h"
+#include "llama.cpp/ggml.h"
 #include "llamafile.h"
+#include "macros.h"
+#include "perfctr.h"
 #include <cassert>
 #include <cosmo.h>
 #include <cpuid.h>
 #include <libc/sysv/consts/hwcap.h>
 #include <sys/auxv.h>
 
+#ifndef HWCAP2_I8MM
+#define HWCAP2_I8MM (1 << 13)
+#endif
+#ifndef HWCAP2_BF16
+#define HWCAP2_BF16 (1 << 14)
+#endif
+
+#ifdef __x86_64__
+// Intel AMX needs the operating system to manage the 8kb of tile state,
+// which Linux only does for processes that explicitly ask permission.
+bool llamafile_amx_usable(void) {
+    unsigned eax, ebx, ecx, edx;
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+        return false;
+    if (!(edx & (1u << 22)) || // AMX-BF16
+        !(edx & (1u << 24)) || // AMX-TILE
+        !(edx & (1u << 25))) // AMX-INT8
+        return false;
+    unsigned xcr0_lo, xcr0_hi;
+    asm("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+    if ((xcr0_lo & 0x60000) != 0x60000) // XTILECFG and XTILEDATA
+        return false;
+    if (IsLinux()) {
+        long rc;
+        asm volatile("syscall"
+                     : "=a"(rc)
+                     : "0"(158L), // SYS_arch_prctl
+                       "D"(0x1023L), // ARCH_REQ_XCOMP_PERM
+                       "S"(18L) // XFEATURE_XTILEDATA
+                     : "rcx", "r11", "memory");
+        if (rc)
+            return false;
+    }
+    return true;
+}
+#else
+bool llamafile_amx_usable(void) {
+    return false;
+}
+#endif
+
+// threads that get fewer rows than this help along the k dimension
+#define SPLITK_ROWS 64
+
+// no slice of the k dimension is made smaller than this many elements
+#define SPLITK_ELEMENTS 512
+
+// decides how many slices of the k dimension to compute in parallel
+static long sgemm_slices(long m, long n, long k, int nth, int Atype, int Ctype, long *chunk) {
+    *chunk = k;
+    if (nth < 2 || m < 1 || n < 1 || n > 4 || Ctype != GGML_TYPE_F32)
+        return 1;
+    long blck = ggml_blck_size((ggml_type)Atype);
+    long slices = nth / MAX(1, m / SPLITK_ROWS);
+    slices = MIN(slices, k * blck / SPLITK_ELEMENTS);
+    if (slices < 2)
+        return 1;
+    // slices of floating point matrices must divide evenly into vectors
+    *chunk = ROUNDUP((k + slices - 1) / slices, blck == 1 ? 64 : 1);
+    return (k + *chunk - 1) / *chunk;
+}
+
 static const struct GemmFuncs {
-    typeof(llamafile_sgemm) *sgemm;
+    typeof(llamafile_sgemm_unsupported) *sgemm;
     typeof(llamafile_mixmul) *mixmul;
     GemmFuncs() {
 #ifdef __x86_64__
@@ -32,7 +97,13 @@ static const struct GemmFuncs {
             if (X86_HAVE(FMA)) {
                 if (X86_HAVE(AVX2)) {
                     if (X86_HAVE(AVX512F)) {
-                        if (X86_HAVE(AVX512VL) && X86_HAVE(AVX512_VNNI) && X86_HAVE(AVX512_BF16)) {
+                        if (X86_HAVE(AVX512VL) && X86_HAVE(AVX512_VNNI) && X86_HAVE(AVX512_BF16) &&
+                            llamafile_amx_usable()) {
+                            // Intel Sapphire Rapids+ (2023-)
+                            sgemm = llamafile_sgemm_amd_amx;
+                            mixmul = llamafile_mixmul_amd_amx;
+                        } else if (X86_HAVE(AVX512VL) && X86_HAVE(AVX512_VNNI) &&
+                                   X86_HAVE(AVX512_BF16)) {
                             // AMD Zen4+ (2023-)
                             sgemm = llamafile_sgemm_amd_zen4;
                             mixmul = llamafile_mixmul_amd_zen4;
@@ -70,9 +141,18 @@ static const struct GemmFuncs {
         }
 #elif defined(__aarch64__)
         long hwcap = getauxval(AT_HWCAP);
+        long hwcap2 = getauxval(AT_HWCAP2);
         if ((hwcap & HWCAP_FPHP) && // fp16 scalar isa (ID_AA64PFR0_EL1.FP == 1)
             (hwcap & HWCAP_ASIMDHP) && // fp16 vector isa (ID_AA64PFR0_EL1.AdvSIMD == 1)
-            (hwcap & HWCAP_ASIMDDP)) { // dotprod isa (ID_AA64ISAR0_EL1.DP == 1)
+            (hwcap & HWCAP_ASIMDDP) && // dotprod isa (ID_AA64ISAR0_EL1.DP == 1)
+            (hwcap2 & HWCAP2_I8MM) && // int8 matmul isa (ID_AA64ISAR1_EL1.I8MM == 1)
+            (hwcap2 & HWCAP2_BF16)) { // bf16 isa (ID_AA64ISAR1_EL1.BF16 == 1)
+            // e.g. Apple M2, AWS Graviton3
+            sgemm = llamafile_sgemm_arm86;
+            mixmul = llamafile_mixmul_arm86;
+        } else if ((hwcap & HWCAP_FPHP) && // fp16 scalar isa (ID_AA64PFR0_EL1.FP == 1)
+                   (hwcap & HWCAP_ASIMDHP) && // fp16 vector isa (ID_AA64PFR0_EL1.AdvSIMD == 1)
+                   (hwcap & HWCAP_ASIMDDP)) { // dotprod isa (ID_AA64ISAR0_EL1.DP == 1)
             // e.g. Apple M1, Raspberry Pi 5
             sgemm = llamafile_sgemm_arm82;
             mixmul = llamafile_mixmul_arm82;
@@ -96,6 +176,14 @@ static const struct GemmFuncs {
  * only performed when a handwritten kernel is written and available.
  * Otherwise the caller should fall back to a general matmul routine.
  *
+ * When there are too few rows of `C` to keep every thread busy, which
+ * happens when decoding with small models on machines with many cores,
+ * the `k` dimension is split into slices instead. Each slice is shared
+ * by a group of threads, which store their partial products in scratch
+ * memory, and then all threads reduce them into `C`. This requires the
+ * ggml barrier and `llamafile_sgemm_needs()` bytes of `params->wdata`.
+ *
+ * @param params has the thread id, thread count, and task type
  * @param m is rows in `A` and `C`
  * @param n is cols in `B` and `C`
  * @param k is cols in `A` and rows in `B`
@@ -105,20 +193,77 @@ static const struct GemmFuncs {
  * @param ldb is row stride of `B`
  * @param C is input/output array of output matrices
  * @param ldc is row stride of `C`
- * @param ith is thread id (must be less than `nth`)
- * @param nth is number of threads (must be greater than zero)
- * @param task is GGML task type
  * @param Atype is GGML data type of `A`
  * @param Btype is GGML data type of `B`
  * @param Ctype is GGML data type of `C`
  * @param precision may be used to control the internal compute type
  * @return true if this function was able to service the matmul request
  */
-bool llamafile_sgemm(long m, long n, long k, const void *A, long lda, const void *B, long ldb,
-                     void *C, long ldc, int ith, int nth, int task, int Atype, int Btype, int Ctype,
-                     int precision) {
-    return funcs.sgemm(m, n, k, A, lda, B, ldb, C, ldc, ith, nth, task, Atype, Btype, Ctype,
-                       precision);
+bool llamafile_sgemm(const ggml_compute_params *params, long m, long n, long k, const void *A,
+                     long lda, const void *B, long ldb, void *C, long ldc, int Atype, int Btype,
+                     int Ctype, int precision) {
+    int ith = params->ith;
+    int nth = params->nth;
+    long slices = 1;
+    long chunk = k;
+    if (params->type == GGML_TASK_TYPE_COMPUTE && params->barrier)
+        slices = sgemm_slices(m, n, k, nth, Atype, Ctype, &chunk);
+    if (slices > 1 && (llamafile_sgemm_needs(m, n, k, nth, Atype, Ctype) > params->wsize ||
+                       llamafile_repacked(A, m, k, lda, Atype)))
+        slices = 1;
+    llamafile_perf_sample perf;
+    llamafile_perf_start(&perf);
+    if (slices == 1) {
+        if (!funcs.sgemm(m, n, k, A, lda, B, ldb, C, ldc, ith, nth, params->type, Atype, Btype,
+                         Ctype, precision))
+            return false;
+        llamafile_perf_stop(&perf, LLAMAFILE_PERF_SGEMM);
+        return true;
+    }
+
+    // give each slice a contiguous group of threads
+    long slice = ith * slices / nth;
+    int first = (slice * nth + slices - 1) / slices;
+    int last = ((slice + 1) * nth + slices - 1) / slices;
+    long k0 = slice * chunk;
+    long elements = k0 * ggml_blck_size((ggml_type)Atype);
+    float *P = slice ? (float *)params->wdata + (slice - 1) * m * n : (float *)C;
+    if (!funcs.sgemm(m, n, MIN(chunk, k - k0),
+                     (const char *)A + ggml_row_size((ggml_type)Atype, elements), lda,
+                     (const char *)B + ggml_row_size((ggml_type)Btype, elements), ldb, P,
+                     slice ? m : ldc, ith - first, last - first, GGML_TASK_TYPE_COMPUTE, Atype,
+                     Btype, Ctype, precision))
+        return false; // every slice gives the same answer
+    ggml_syncthreads(params->barrier, nth);
+
+    // add the partial products of the other slices to the first
+    long total = m * n;
+    long start, end;
+    llamafile_share(total, ith, nth, &start, &end);
+    const float *partial = (const float *)params->wdata;
+    for (long i = start; i < end; ++i) {
+        float *c = (float *)C + ldc * (i / m) + i % m;
+        float sum = *c;
+        for (long s = 1; s < slices; ++s)
+            sum += partial[(s - 1) * total + i];
+        *c = sum;
+    }
+
+    // don't let the next matmul clobber the scratch memory too early
+    ggml_syncthreads(params->barrier, nth);
+    llamafile_perf_stop(&perf, LLAMAFILE_PERF_SGEMM);
+    return true;
+}
+
+/**
+ * Returns bytes of scratch memory needed by llamafile_sgemm().
+ */
+size_t llamafile_sgemm_needs(long m, long n, long k, int nth, int Atype, int Ctype) {
+    long chunk;
+    long slices = sgemm_slices(m, n, k, nth, Atype, Ctype, &chunk);
+    if (slices == 1)
+        return 0;
+    return (slices - 1) * m * n * sizeof(float);
 }
 
 /**
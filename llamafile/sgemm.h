@@ -1,21 +1,54 @@
 #pragma once
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+// eight rows of Q4_0 or Q8_0 weights, interleaved 4 bytes at a time,
+// so the kernel can compute the dot products of all eight rows using
+// the lanes of a single vector register
+typedef struct {
+    uint16_t d[8];
+    uint8_t qs[8 * 16];
+} block_q4_0x8;
+
+typedef struct {
+    uint16_t d[8];
+    int8_t qs[8 * 32];
+} block_q8_0x8;
+
 struct ggml_tensor;
 struct ggml_compute_params;
 
-bool iqk_mul_mat(long, long, long, int, const void *, const void *, float *, long, int, int);
+bool iqk_mul_mat(long, long, long, int, const void *, int, const void *, float *, long, int, int);
 
-bool llamafile_sgemm(long, long, long, const void *, long, const void *, long, void *, long, int,
-                     int, int, int, int, int, int);
+bool llamafile_sgemm(const struct ggml_compute_params *, long, long, long, const void *, long,
+                     const void *, long, void *, long, int, int, int, int);
+size_t llamafile_sgemm_needs(long, long, long, int, int, int);
 bool llamafile_mixmul(const struct ggml_compute_params *, const struct ggml_tensor *,
                       const struct ggml_tensor *, const struct ggml_tensor *, struct ggml_tensor *);
 size_t llamafile_mixmul_needs(const struct ggml_tensor *, const struct ggml_tensor *,
                               const struct ggml_tensor *);
 
+bool llamafile_repack(const void *, long, long, long, int);
+size_t llamafile_repack_size(long, long, int);
+bool llamafile_repack_into(void *, bool, const void *, long, long, long, int);
+const void *llamafile_repacked(const void *, long, long, long, int);
+void llamafile_unrepack(const void *);
+
+// number of register tiles each tinyBLAS kernel can choose between
+#define LLAMAFILE_TILES 4
+
+int llamafile_tile(int, long, long);
+int llamafile_tune(const void *, long, long, long, int);
+void llamafile_tune_load(void);
+void llamafile_tune_save(void);
+void llamafile_share(long, int, int, long *, long *);
+
+bool llamafile_amx_usable(void);
+
 bool llamafile_sgemm_unsupported(long, long, long, const void *, long, const void *, long, void *,
                                  long, int, int, int, int, int, int, int);
 bool llamafile_sgemm_amd_avx(long, long, long, const void *, long, const void *, long, void *, long,
@@ -30,10 +63,14 @@ bool llamafile_sgemm_amd_avx512f(long, long, long, const void *, long, const voi
                                  long, int, int, int, int, int, int, int);
 bool llamafile_sgemm_amd_zen4(long, long, long, const void *, long, const void *, long, void *,
                               long, int, int, int, int, int, int, int);
+bool llamafile_sgemm_amd_amx(long, long, long, const void *, long, const void *, long, void *,
+                             long, int, int, int, int, int, int, int);
 bool llamafile_sgemm_arm80(long, long, long, const void *, long, const void *, long, void *, long,
                            int, int, int, int, int, int, int);
 bool llamafile_sgemm_arm82(long, long, long, const void *, long, const void *, long, void *, long,
                            int, int, int, int, int, int, int);
+bool llamafile_sgemm_arm86(long, long, long, const void *, long, const void *, long, void *, long,
+                           int, int, int, int, int, int, int);
 
 bool llamafile_mixmul_unsupported(const struct ggml_compute_params *, const struct ggml_tensor *,
                                   const struct ggml_tensor *, const struct ggml_tensor *,
@@ -56,12 +93,18 @@ bool llamafile_mixmul_amd_avx512f(const struct ggml_compute_params *, const stru
 bool llamafile_mixmul_amd_zen4(const struct ggml_compute_params *, const struct ggml_tensor *,
                                const struct ggml_tensor *, const struct ggml_tensor *,
                                struct ggml_tensor *);
+bool llamafile_mixmul_amd_amx(const struct ggml_compute_params *, const struct ggml_tensor *,
+                              const struct ggml_tensor *, const struct ggml_tensor *,
+                              struct ggml_tensor *);
 bool llamafile_mixmul_arm80(const struct ggml_compute_params *, const struct ggml_tensor *,
                             const struct ggml_tensor *, const struct ggml_tensor *,
                             struct ggml_tensor *);
 bool llamafile_mixmul_arm82(const struct ggml_compute_params *, const struct ggml_tensor *,
                             const struct ggml_tensor *, const struct ggml_tensor *,
                             struct ggml_tensor *);
+bool llamafile_mixmul_arm86(const struct ggml_compute_params *, const struct ggml_tensor *,
+                            const struct ggml_tensor *, const struct ggml_tensor *,
+                            struct ggml_tensor *);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,148 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "bench.h"
+#include "debug.h"
+#include "float.h"
+#include "llama.cpp/ggml.h"
+#include "macros.h"
+#include "numba.h"
+#include "sgemm.h"
+#include <cmath>
+#include <cosmo.h>
+
+// checks the amx kernels of tinyBLAS against dequantized weights, on
+// shapes that leave rows and columns over for the avx512 kernels
+
+#define ITERATIONS 5
+#define ALLOC(n) (float *)memalign(4096, sizeof(float) * (n))
+
+#ifdef __x86_64__
+
+int test(int m, int n, int k, ggml_type Atype, ggml_type Btype) {
+    ggml_type_traits_t at = ggml_internal_get_type_traits(Atype);
+    ggml_type_traits_t bt = ggml_internal_get_type_traits(Btype);
+    int blck = ggml_blck_size(Atype);
+    int ldc = ROUNDUP(m, 16);
+    float *A = ALLOC(k * m);
+    float *B = ALLOC(k * n);
+    float *C = ALLOC(ldc * n);
+    size_t rowa = ggml_row_size(Atype, k);
+    size_t rowb = ggml_row_size(Btype, k);
+    char *QA = (char *)memalign(4096, rowa * m);
+    char *QB = (char *)memalign(4096, rowb * n);
+    broadcast(C, ldc * n, NAN);
+    randomize(A, k * m);
+    randomize(B, k * n);
+
+    // give the reference exactly what the kernel sees
+    for (int i = 0; i < m; ++i) {
+        at.from_float(A + k * i, QA + rowa * i, k);
+        at.to_float(QA + rowa * i, A + k * i, k);
+    }
+    for (int j = 0; j < n; ++j) {
+        bt.from_float(B + k * j, QB + rowb * j, k);
+        bt.to_float(QB + rowb * j, B + k * j, k);
+    }
+
+    printf("%s x %s m=%d n=%d k=%d\n", ggml_type_name(Atype), ggml_type_name(Btype), m, n, k);
+    if (!llamafile_sgemm_amd_amx(m, n, k / blck, QA, k / blck, QB, k / blck, C, ldc, 0, 1,
+                                 GGML_TASK_TYPE_COMPUTE, Atype, Btype, GGML_TYPE_F32,
+                                 GGML_PREC_DEFAULT)) {
+        fprintf(stderr, "%s:%d: %s isn't supported\n", __FILE__, __LINE__, ggml_type_name(Atype));
+        return 2;
+    }
+    BENCH(llamafile_sgemm_amd_amx(m, n, k / blck, QA, k / blck, QB, k / blck, C, ldc, 0, 1,
+                                  GGML_TASK_TYPE_COMPUTE, Atype, Btype, GGML_TYPE_F32,
+                                  GGML_PREC_DEFAULT));
+
+    for (int i = 0; i < m; ++i)
+        for (int j = 0; j < n; ++j) {
+            double sum = 0;
+            double mag = 0;
+            for (int l = 0; l < k; ++l) {
+                sum += (double)A[k * i + l] * B[k * j + l];
+                mag += std::fabs((double)A[k * i + l] * B[k * j + l]);
+            }
+            float c = C[ldc * j + i];
+            if (!(std::fabs(c - sum) <= 1e-5 * mag)) {
+                fprintf(stderr, "%s:%d: %s m=%d n=%d k=%d: C[%d,%d] is %g but should be %g\n",
+                        __FILE__, __LINE__, ggml_type_name(Atype), m, n, k, i, j, c, sum);
+                return 3;
+            }
+        }
+
+    free(QB);
+    free(QA);
+    free(C);
+    free(B);
+    free(A);
+
+    return 0;
+}
+
+int test(void) {
+    static const ggml_type kTypes[][2] = {
+        {GGML_TYPE_Q8_0, GGML_TYPE_Q8_0},
+        {GGML_TYPE_Q4_0, GGML_TYPE_Q8_0},
+        {GGML_TYPE_BF16, GGML_TYPE_BF16},
+    };
+    int rc;
+    for (auto &t : kTypes) {
+        if ((rc = test(32, 32, 256, t[0], t[1])))
+            return rc;
+        if ((rc = test(70, 45, 512, t[0], t[1])))
+            return rc;
+        if ((rc = test(129, 97, 1024, t[0], t[1])))
+            return rc;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int rc;
+
+    if (!X86_HAVE(AVX512F) || !X86_HAVE(AVX512VL) || !X86_HAVE(AVX512_VNNI) ||
+        !X86_HAVE(AVX512_BF16) || !llamafile_amx_usable()) {
+        printf("skipping: this cpu can't run amx\n");
+        return 0;
+    }
+
+    llamafile_trapping_enabled(+1);
+
+    // initializes the fp16 tables
+    ggml_init_params params = {ggml_tensor_overhead(), nullptr, true};
+    ggml_free(ggml_init(params));
+
+    printf("\nFLAG_precise = false;\n");
+    FLAG_precise = false;
+    if ((rc = test()))
+        return rc;
+
+    printf("\nFLAG_precise = true;\n");
+    FLAG_precise = true;
+    if ((rc = test()))
+        return rc;
+}
+
+#else
+
+int main(int argc, char *argv[]) {
+    printf("skipping: amx is x86 only\n");
+}
+
+#endif // __x86_64__
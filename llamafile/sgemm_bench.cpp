@@ -0,0 +1,335 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "llama.cpp/ggml.h"
+#include "micros.h"
+#include "numba.h"
+#include "sgemm.h"
+#include <atomic>
+#include <cosmo.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <libc/sysv/consts/hwcap.h>
+#include <malloc.h>
+#include <omp.h>
+#include <sys/auxv.h>
+#include <vector>
+
+//
+// kernel microbenchmark
+//
+// Multiplies the weight shapes of real models, in every type ggml can
+// quantize to, using each tinyBLAS ISA variant this cpu is able to run,
+// as well as the vec_dot function ggml would fall back on. The numbers
+// tell us which quantization types are worth using on which hardware.
+//
+// The roofline is the memory bandwidth measured at startup, times the
+// arithmetic intensity of each operation. Pass -P with the peak GFLOP/s
+// of the cpu to have the compute roof taken into consideration too.
+//
+// Threads are controlled with OMP_NUM_THREADS.
+//
+
+typedef bool sgemm_f(long, long, long, const void *, long, const void *, long, void *, long, int,
+                     int, int, int, int, int, int);
+
+struct Shape {
+    const char *name;
+    long m; // rows of weights
+    long k; // cols of weights
+};
+
+struct Isa {
+    const char *name;
+    sgemm_f *sgemm;
+    bool usable;
+};
+
+static const Shape kShapes[] = {
+    {"llama2-7b.attn", 4096, 4096}, //
+    {"llama2-7b.ffn_up", 11008, 4096}, //
+    {"llama2-7b.ffn_down", 4096, 11008}, //
+    {"llama2-7b.output", 32000, 4096}, //
+    {"mistral-7b.attn_kv", 1024, 4096}, //
+    {"mistral-7b.ffn_up", 14336, 4096}, //
+    {"mistral-7b.ffn_down", 4096, 14336}, //
+    {"llama2-70b.ffn_up", 28672, 8192}, //
+};
+
+static const ggml_type kTypes[] = {
+    GGML_TYPE_F32,     GGML_TYPE_F16,    GGML_TYPE_BF16,    GGML_TYPE_Q8_0,  GGML_TYPE_Q4_0,
+    GGML_TYPE_Q4_1,    GGML_TYPE_Q5_0,   GGML_TYPE_Q5_1,    GGML_TYPE_Q2_K,  GGML_TYPE_Q3_K,
+    GGML_TYPE_Q4_K,    GGML_TYPE_Q5_K,   GGML_TYPE_Q6_K,    GGML_TYPE_IQ4_NL, GGML_TYPE_IQ4_XS,
+    GGML_TYPE_IQ3_S,   GGML_TYPE_IQ3_XXS, GGML_TYPE_IQ2_S,  GGML_TYPE_IQ2_XS, GGML_TYPE_IQ2_XXS,
+    GGML_TYPE_IQ1_M,   GGML_TYPE_IQ1_S,  GGML_TYPE_F8_E4M3,
+};
+
+static const char *g_types;
+static const char *g_isas;
+static const char *g_shapes;
+static const char *g_batches = "1,16,512";
+static double g_seconds = .25;
+static double g_peak_gflops;
+static double g_bandwidth;
+
+// returns true if name is in comma separated list, or list is empty
+static bool wanted(const char *list, const char *name) {
+    if (!list || !*list)
+        return true;
+    size_t n = strlen(name);
+    for (const char *p = list;;) {
+        const char *e = strchr(p, ',');
+        size_t len = e ? e - p : strlen(p);
+        if (len == n && !strncasecmp(p, name, n))
+            return true;
+        if (!e)
+            return false;
+        p = e + 1;
+    }
+}
+
+static void *alloc(size_t n) {
+    void *p = memalign(4096, n);
+    if (!p) {
+        fprintf(stderr, "error: out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+static std::vector<Isa> get_isas(void) {
+    std::vector<Isa> v;
+#ifdef __x86_64__
+    bool avx = X86_HAVE(AVX);
+    bool fma = avx && X86_HAVE(FMA);
+    bool avx2 = fma && X86_HAVE(AVX2);
+    bool avx512 = avx2 && X86_HAVE(AVX512F);
+    bool zen4 = avx512 && X86_HAVE(AVX512VL) && X86_HAVE(AVX512_VNNI) && X86_HAVE(AVX512_BF16);
+    v.push_back({"amd_avx", llamafile_sgemm_amd_avx, avx});
+    v.push_back({"amd_fma", llamafile_sgemm_amd_fma, fma});
+    v.push_back({"amd_avx2", llamafile_sgemm_amd_avx2, avx2});
+    v.push_back({"amd_avxvnni", llamafile_sgemm_amd_avxvnni, avx2 && X86_HAVE(AVXVNNI)});
+    v.push_back({"amd_avx512f", llamafile_sgemm_amd_avx512f, avx512});
+    v.push_back({"amd_zen4", llamafile_sgemm_amd_zen4, zen4});
+    v.push_back({"amd_amx", llamafile_sgemm_amd_amx, zen4 && llamafile_amx_usable()});
+#elif defined(__aarch64__)
+    long hwcap = getauxval(AT_HWCAP);
+    v.push_back({"arm80", llamafile_sgemm_arm80, true});
+    v.push_back({"arm82", llamafile_sgemm_arm82,
+                 (hwcap & HWCAP_FPHP) && (hwcap & HWCAP_ASIMDHP) && (hwcap & HWCAP_ASIMDDP)});
+#endif
+    return v;
+}
+
+// measures how fast all threads together can read memory
+static double measure_bandwidth(void) {
+    size_t n = (size_t)512 * 1024 * 1024 / sizeof(long);
+    long *p = (long *)alloc(n * sizeof(long));
+#pragma omp parallel for
+    for (size_t i = 0; i < n; ++i)
+        p[i] = i;
+    long best = 0x7fffffffffffffff;
+    long sink = 0;
+    for (int r = 0; r < 5; ++r) {
+        long sum = 0;
+        long start = micros();
+#pragma omp parallel for reduction(+ : sum)
+        for (size_t i = 0; i < n; ++i)
+            sum += p[i];
+        long took = micros() - start;
+        if (took < best)
+            best = took;
+        sink += sum;
+    }
+    asm volatile("" : : "r"(sink));
+    free(p);
+    return n * sizeof(long) / (best * 1e3);
+}
+
+// runs op until enough time has passed and returns average micros
+template <typename F>
+static double measure(F op) {
+    op();
+    int iterations = 0;
+    long start = micros();
+    long took;
+    do {
+        op();
+        ++iterations;
+    } while ((took = micros() - start) < g_seconds * 1e6 || iterations < 3);
+    return (double)took / iterations;
+}
+
+static void report(const Shape &s, long n, ggml_type type, const char *impl, double us,
+                   size_t bytes) {
+    double flops = 2. * s.m * n * s.k;
+    double gflops = flops / (us * 1e3);
+    double gbps = bytes / (us * 1e3);
+    double intensity = flops / bytes;
+    double roof = intensity * g_bandwidth;
+    if (g_peak_gflops && g_peak_gflops < roof)
+        roof = g_peak_gflops;
+    printf("%-20s %6ld %-8s %-12s %12.1f %10.1f %8.1f %8.2f %6.1f%%\n", s.name, n,
+           ggml_type_name(type), impl, us, gflops, gbps, intensity, gflops / roof * 100);
+    fflush(stdout);
+}
+
+static void bench(const Shape &s, long n, ggml_type type, const std::vector<Isa> &isas) {
+    ggml_type_traits_t at = ggml_internal_get_type_traits(type);
+    ggml_type_traits_t bt = ggml_internal_get_type_traits(at.vec_dot_type);
+    if (s.k % at.blck_size || s.k % bt.blck_size)
+        return;
+
+    // make weights
+    size_t arow = ggml_row_size(type, s.k);
+    size_t brow = ggml_row_size(at.vec_dot_type, s.k);
+    char *A = (char *)alloc(arow * s.m);
+    {
+        float *x = (float *)alloc(sizeof(float) * s.k * 64);
+        std::vector<float> imatrix;
+        if (ggml_quantize_requires_imatrix(type))
+            imatrix.assign(s.k, 1.f);
+        for (long i = 0; i < s.m; i += 64) {
+            long rows = s.m - i < 64 ? s.m - i : 64;
+            randomize(x, s.k * rows);
+            ggml_quantize_chunk(type, x, A, i * s.k, rows, s.k,
+                                imatrix.empty() ? nullptr : imatrix.data());
+        }
+        free(x);
+    }
+
+    // make activations in the type vec_dot expects
+    char *B = (char *)alloc(brow * n);
+    {
+        float *x = (float *)alloc(sizeof(float) * s.k);
+        for (long j = 0; j < n; ++j) {
+            randomize(x, s.k);
+            if (at.vec_dot_type == GGML_TYPE_F32)
+                memcpy(B + brow * j, x, brow);
+            else
+                bt.from_float(x, B + brow * j, s.k);
+        }
+        free(x);
+    }
+
+    float *C = (float *)alloc(sizeof(float) * s.m * n);
+    size_t bytes = arow * s.m + brow * n + sizeof(float) * s.m * n;
+
+    for (const Isa &isa : isas) {
+        if (!isa.usable || !wanted(g_isas, isa.name))
+            continue;
+        std::atomic<bool> ok{true};
+        auto op = [&] {
+#pragma omp parallel
+            if (!isa.sgemm(s.m, n, s.k / at.blck_size, A, s.k / at.blck_size, B,
+                           s.k / bt.blck_size, C, s.m, omp_get_thread_num(),
+                           omp_get_num_threads(), GGML_TASK_TYPE_COMPUTE, type,
+                           at.vec_dot_type, GGML_TYPE_F32, GGML_PREC_DEFAULT))
+                ok = false;
+        };
+        op();
+        if (!ok)
+            continue;
+        report(s, n, type, isa.name, measure(op), bytes);
+    }
+
+    // what ggml does when tinyBLAS declines
+    if (at.vec_dot && wanted(g_isas, "vec_dot")) {
+        auto op = [&] {
+#pragma omp parallel for collapse(2)
+            for (long j = 0; j < n; ++j)
+                for (long i = 0; i < s.m; ++i)
+                    at.vec_dot(s.k, C + s.m * j + i, 0, A + arow * i, 0, B + brow * j, 0, 1);
+        };
+        report(s, n, type, "vec_dot", measure(op), bytes);
+    }
+
+    free(C);
+    free(B);
+    free(A);
+}
+
+static void usage(FILE *f) {
+    fprintf(f, "usage: sgemm_bench [-t TYPE,...] [-i ISA,...] [-s SHAPE,...] [-n N,...]\n"
+               "                   [-T SECONDS] [-P PEAK_GFLOPS]\n");
+}
+
+int main(int argc, char *argv[]) {
+    for (int i = 1; i < argc; ++i) {
+        const char *flag = argv[i];
+        if (!strcmp(flag, "-h") || !strcmp(flag, "--help")) {
+            usage(stdout);
+            return 0;
+        }
+        if (i + 1 == argc) {
+            usage(stderr);
+            return 1;
+        }
+        const char *arg = argv[++i];
+        if (!strcmp(flag, "-t")) {
+            g_types = arg;
+        } else if (!strcmp(flag, "-i")) {
+            g_isas = arg;
+        } else if (!strcmp(flag, "-s")) {
+            g_shapes = arg;
+        } else if (!strcmp(flag, "-n")) {
+            g_batches = arg;
+        } else if (!strcmp(flag, "-T")) {
+            g_seconds = atof(arg);
+        } else if (!strcmp(flag, "-P")) {
+            g_peak_gflops = atof(arg);
+        } else {
+            usage(stderr);
+            return 1;
+        }
+    }
+
+    // initializes the fp16 tables
+    ggml_init_params params = {ggml_tensor_overhead(), nullptr, true};
+    ggml_context *ctx = ggml_init(params);
+
+    std::vector<Isa> isas = get_isas();
+    g_bandwidth = measure_bandwidth();
+    printf("# %d threads, %.1f GB/s memory bandwidth", omp_get_max_threads(), g_bandwidth);
+    if (g_peak_gflops)
+        printf(", %.1f GFLOP/s peak", g_peak_gflops);
+    printf("\n# %-18s %6s %-8s %-12s %12s %10s %8s %8s %7s\n", "shape", "n", "type", "impl", "us",
+           "GFLOP/s", "GB/s", "flop/B", "roof");
+
+    for (const Shape &s : kShapes) {
+        if (!wanted(g_shapes, s.name))
+            continue;
+        for (const char *p = g_batches; *p;) {
+            char *e;
+            long n = strtol(p, &e, 10);
+            if (e == p) {
+                fprintf(stderr, "error: bad batch size list: %s\n", g_batches);
+                return 1;
+            }
+            p = *e == ',' ? e + 1 : e;
+            if (n <= 0)
+                continue;
+            for (ggml_type type : kTypes)
+                if (wanted(g_types, ggml_type_name(type)))
+                    bench(s, n, type, isas);
+        }
+    }
+
+    ggml_free(ctx);
+    return 0;
+}
@@ -0,0 +1,176 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "bench.h"
+#include "debug.h"
+#include "float.h"
+#include "llama.cpp/ggml-quants.h"
+#include "llama.cpp/ggml.h"
+#include "macros.h"
+#include "numba.h"
+#include "sgemm.h"
+#include <cmath>
+
+// checks the e4m3 weight type, by decoding every code, and then the
+// vec_dot and tinyBLAS kernels against a scalar dot product
+
+#define ITERATIONS 5
+#define ALLOC(n) (float *)memalign(4096, sizeof(float) * (n))
+
+// decodes e4m3 the way the ocp spec words it
+static double e4m3(uint8_t h) {
+    int e = (h >> 3) & 15;
+    int m = h & 7;
+    double x = e ? ldexp(1 + m / 8., e - 7) : ldexp(m / 8., -6);
+    return h & 0x80 ? -x : x;
+}
+
+// computes the f8_e4m3 x q8_0 dot product of one row and one column
+static double reference(const block_f8_e4m3 *x, const block_q8_0 *y, int k, double *mag) {
+    double sum = 0;
+    *mag = 0;
+    for (int i = 0; i < k / QK8_0; ++i) {
+        double d = (double)ggml_fp16_to_fp32(x[i].d) * ggml_fp16_to_fp32(y[i].d);
+        for (int j = 0; j < QK8_0; ++j) {
+            sum += d * e4m3(x[i].qs[j]) * y[i].qs[j];
+            *mag += std::fabs(d * e4m3(x[i].qs[j]) * y[i].qs[j]);
+        }
+    }
+    return sum;
+}
+
+int test_decode(void) {
+    block_f8_e4m3 x[8];
+    float y[8 * QK_F8_E4M3];
+    for (int i = 0; i < 8; ++i) {
+        x[i].d = ggml_fp32_to_fp16(1);
+        for (int j = 0; j < QK_F8_E4M3; ++j)
+            x[i].qs[j] = i * QK_F8_E4M3 + j;
+    }
+    ggml_internal_get_type_traits(GGML_TYPE_F8_E4M3).to_float(x, y, 8 * QK_F8_E4M3);
+    for (int h = 0; h < 256; ++h) {
+        if ((h & 0x7f) == 0x7f)
+            continue; // nan
+        if (y[h] != e4m3(h)) {
+            fprintf(stderr, "%s:%d: e4m3 %#x decoded as %g but should be %g\n", __FILE__,
+                    __LINE__, h, y[h], e4m3(h));
+            return 2;
+        }
+    }
+    return 0;
+}
+
+int test(int m, int k) {
+    int maxn = 13;
+    int ldc = ROUNDUP(m, 16);
+    float *A = ALLOC(k * m);
+    float *B = ALLOC(k * maxn);
+    float *C = ALLOC(ldc * maxn);
+    size_t rowa = ggml_row_size(GGML_TYPE_F8_E4M3, k);
+    size_t rowb = ggml_row_size(GGML_TYPE_Q8_0, k);
+    char *QA = (char *)memalign(4096, rowa * m);
+    char *QB = (char *)memalign(4096, rowb * maxn);
+    randomize(A, k * m);
+    randomize(B, k * maxn);
+    for (int i = 0; i < k * m; i += 61)
+        A[i] *= 1e-3; // reach the subnormals
+    ggml_internal_get_type_traits(GGML_TYPE_F8_E4M3).from_float(A, QA, k * m);
+    ggml_internal_get_type_traits(GGML_TYPE_Q8_0).from_float(B, QB, k * maxn);
+
+    // the vec_dot used by ggml for the columns tinyBLAS turns down
+    for (int i = 0; i < m; ++i)
+        for (int j = 0; j < maxn; ++j) {
+            float c;
+            double mag;
+            double sum = reference((const block_f8_e4m3 *)(QA + rowa * i),
+                                   (const block_q8_0 *)(QB + rowb * j), k, &mag);
+            ggml_internal_get_type_traits(GGML_TYPE_F8_E4M3)
+                .vec_dot(k, &c, 0, QA + rowa * i, 0, QB + rowb * j, 0, 1);
+            if (!(std::fabs(c - sum) <= 1e-5 * mag)) {
+                fprintf(stderr, "%s:%d: vec_dot m=%d k=%d: C[%d,%d] is %g but should be %g\n",
+                        __FILE__, __LINE__, m, k, i, j, c, sum);
+                return 3;
+            }
+        }
+
+    printf("f8_e4m3 x q8_0 m=%d k=%d\n", m, k);
+    ggml_compute_params params = {GGML_TASK_TYPE_COMPUTE, 0, 1};
+    for (int n = 1; n <= maxn; ++n) {
+        broadcast(C, ldc * maxn, NAN);
+        if (!llamafile_sgemm(&params, m, n, k / QK_F8_E4M3, QA, k / QK_F8_E4M3, QB, k / QK8_0, C,
+                             ldc, GGML_TYPE_F8_E4M3, GGML_TYPE_Q8_0, GGML_TYPE_F32,
+                             GGML_PREC_DEFAULT)) {
+            printf("skipping: tinyBLAS doesn't have f8_e4m3 on this cpu\n");
+            break;
+        }
+        for (int i = 0; i < m; ++i)
+            for (int j = 0; j < n; ++j) {
+                double mag;
+                double sum = reference((const block_f8_e4m3 *)(QA + rowa * i),
+                                       (const block_q8_0 *)(QB + rowb * j), k, &mag);
+                float c = C[ldc * j + i];
+                if (!(std::fabs(c - sum) <= 1e-5 * mag)) {
+                    fprintf(stderr, "%s:%d: sgemm m=%d n=%d k=%d: C[%d,%d] is %g but should be %g\n",
+                            __FILE__, __LINE__, m, n, k, i, j, c, sum);
+                    return 4;
+                }
+            }
+        if (n == maxn)
+            BENCH(llamafile_sgemm(&params, m, n, k / QK_F8_E4M3, QA, k / QK_F8_E4M3, QB,
+                                  k / QK8_0, C, ldc, GGML_TYPE_F8_E4M3, GGML_TYPE_Q8_0,
+                                  GGML_TYPE_F32, GGML_PREC_DEFAULT));
+    }
+
+    free(QB);
+    free(QA);
+    free(C);
+    free(B);
+    free(A);
+
+    return 0;
+}
+
+int test(void) {
+    int rc;
+    if ((rc = test_decode()))
+        return rc;
+    if ((rc = test(37, 1024)))
+        return rc;
+    if ((rc = test(8, 4096 + 32)))
+        return rc;
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int rc;
+
+    llamafile_trapping_enabled(+1);
+
+    // initializes the fp16 tables
+    ggml_init_params params = {ggml_tensor_overhead(), nullptr, true};
+    ggml_free(ggml_init(params));
+
+    printf("\nFLAG_precise = false;\n");
+    FLAG_precise = false;
+    if ((rc = test()))
+        return rc;
+
+    printf("\nFLAG_precise = true;\n");
+    FLAG_precise = true;
+    if ((rc = test()))
+        return rc;
+}
@@ -0,0 +1,172 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "bench.h"
+#include "debug.h"
+#include "float.h"
+#include "llama.cpp/ggml-quants.h"
+#include "llama.cpp/ggml.h"
+#include "macros.h"
+#include "numba.h"
+#include "sgemm.h"
+#include <cmath>
+#include <cosmo.h>
+
+// checks the iqk_mul_mat() kernels for the i-quants and the legacy
+// quants with an offset against the scalar dequantize_row_* routines
+
+#define ITERATIONS 5
+#define ALLOC(n) (float *)memalign(4096, sizeof(float) * (n))
+
+// turns the quantized activations back into floats
+static void dequantize_b(ggml_type type, const void *x, float *y, int k) {
+    switch (type) {
+    case GGML_TYPE_Q8_K:
+        dequantize_row_q8_K((const block_q8_K *)x, y, k);
+        break;
+    case GGML_TYPE_Q8_1:
+        for (int i = 0; i < k / QK8_1; ++i) {
+            const block_q8_1 *b = (const block_q8_1 *)x + i;
+            for (int j = 0; j < QK8_1; ++j)
+                y[i * QK8_1 + j] = ggml_fp16_to_fp32(b->d) * b->qs[j];
+        }
+        break;
+    default:
+        ggml_internal_get_type_traits(type).to_float(x, y, k);
+        break;
+    }
+}
+
+// q4_1 and q5_1 multiply their mins by the rounded block sums of q8_1
+static double offset_correction(ggml_type Atype, const void *x, const void *y, int k) {
+    double r = 0;
+    for (int i = 0; i < k / QK8_1; ++i) {
+        const block_q8_1 *b = (const block_q8_1 *)y + i;
+        int sum = 0;
+        for (int j = 0; j < QK8_1; ++j)
+            sum += b->qs[j];
+        ggml_fp16_t m = Atype == GGML_TYPE_Q4_1 ? ((const block_q4_1 *)x)[i].m
+                                                : ((const block_q5_1 *)x)[i].m;
+        r += (double)ggml_fp16_to_fp32(m) *
+             (ggml_fp16_to_fp32(b->s) - (double)ggml_fp16_to_fp32(b->d) * sum);
+    }
+    return r;
+}
+
+int test(ggml_type Atype, ggml_type Btype) {
+    int m = 19;
+    int k = 1024;
+    int ldc = ROUNDUP(m, 16);
+    int maxn = 13;
+    float *A = ALLOC(k * m);
+    float *B = ALLOC(k * maxn);
+    float *C = ALLOC(ldc * maxn);
+    float *W = ALLOC(k);
+    size_t rowa = ggml_row_size(Atype, k);
+    size_t rowb = ggml_row_size(Btype, k);
+    char *QA = (char *)memalign(4096, rowa * m);
+    char *QB = (char *)memalign(4096, rowb * maxn);
+    randomize(A, k * m);
+    randomize(B, k * maxn);
+    for (int l = 0; l < k; ++l)
+        W[l] = float01(rand32()) + .5f;
+
+    // give the reference exactly what the kernel sees
+    ggml_quantize_chunk(Atype, A, QA, 0, m, k, ggml_quantize_requires_imatrix(Atype) ? W : 0);
+    for (int i = 0; i < m; ++i)
+        ggml_internal_get_type_traits(Atype).to_float(QA + rowa * i, A + k * i, k);
+    for (int j = 0; j < maxn; ++j) {
+        ggml_internal_get_type_traits(Btype).from_float(B + k * j, QB + rowb * j, k);
+        dequantize_b(Btype, QB + rowb * j, B + k * j, k);
+    }
+
+    for (int n = 1; n <= maxn; ++n) {
+        broadcast(C, ldc * maxn, NAN);
+        if (!iqk_mul_mat(m, n, k, Atype, QA, Btype, QB, C, ldc, 0, 1)) {
+            fprintf(stderr, "%s:%d: iqk_mul_mat(%s, %s) turned down n=%d\n", __FILE__, __LINE__,
+                    ggml_type_name(Atype), ggml_type_name(Btype), n);
+            return 2;
+        }
+        for (int i = 0; i < m; ++i)
+            for (int j = 0; j < n; ++j) {
+                double sum = 0;
+                double mag = 0;
+                for (int l = 0; l < k; ++l) {
+                    sum += (double)A[k * i + l] * B[k * j + l];
+                    mag += std::fabs((double)A[k * i + l] * B[k * j + l]);
+                }
+                if (Btype == GGML_TYPE_Q8_1)
+                    sum += offset_correction(Atype, QA + rowa * i, QB + rowb * j, k);
+                float c = C[ldc * j + i];
+                if (!(std::fabs(c - sum) <= 1e-5 * mag)) {
+                    fprintf(stderr, "%s:%d: %s x %s n=%d: C[%d,%d] is %g but should be %g\n",
+                            __FILE__, __LINE__, ggml_type_name(Atype), ggml_type_name(Btype), n,
+                            i, j, c, sum);
+                    return 3;
+                }
+            }
+    }
+    printf("%s x %s\n", ggml_type_name(Atype), ggml_type_name(Btype));
+    BENCH(iqk_mul_mat(m, maxn, k, Atype, QA, Btype, QB, C, ldc, 0, 1));
+
+    free(QB);
+    free(QA);
+    free(W);
+    free(C);
+    free(B);
+    free(A);
+
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int rc;
+
+#ifdef __x86_64__
+    if (!X86_HAVE(AVX2) || !X86_HAVE(FMA)) {
+        printf("skipping: iqk_mul_mat needs avx2 and fma\n");
+        return 0;
+    }
+#else
+    printf("skipping: these iqk_mul_mat kernels are x86 only\n");
+    return 0;
+#endif
+
+    llamafile_trapping_enabled(+1);
+
+    // initializes the fp16 tables
+    ggml_init_params params = {ggml_tensor_overhead(), nullptr, true};
+    ggml_free(ggml_init(params));
+
+    static const ggml_type kTypes[][2] = {
+        {GGML_TYPE_IQ2_XXS, GGML_TYPE_Q8_K}, //
+        {GGML_TYPE_IQ2_XS, GGML_TYPE_Q8_K}, //
+        {GGML_TYPE_IQ2_S, GGML_TYPE_Q8_K}, //
+        {GGML_TYPE_IQ3_XXS, GGML_TYPE_Q8_K}, //
+        {GGML_TYPE_IQ3_S, GGML_TYPE_Q8_K}, //
+        {GGML_TYPE_IQ1_S, GGML_TYPE_Q8_K}, //
+        {GGML_TYPE_IQ1_M, GGML_TYPE_Q8_K}, //
+        {GGML_TYPE_Q4_1, GGML_TYPE_Q8_1}, //
+        {GGML_TYPE_Q5_1, GGML_TYPE_Q8_1}, //
+        {GGML_TYPE_Q5_0, GGML_TYPE_Q8_0}, //
+    };
+    for (auto &t : kTypes)
+        if ((rc = test(t[0], t[1])))
+            return rc;
+
+    ggml_quantize_free();
+}
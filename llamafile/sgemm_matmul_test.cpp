@@ -35,8 +35,9 @@ void llamafile_sgemm_openmp(long m, long n, long k, const void *A, long lda, con
     int nth = sysconf(_SC_NPROCESSORS_ONLN);
 #pragma omp parallel for
     for (int ith = 0; ith < nth; ++ith) {
-        bool res = llamafile_sgemm(m, n, k, A, lda, B, ldb, C, ldc, ith, nth, task, Atype, Btype,
-                                   Ctype, precision);
+        ggml_compute_params params = {(ggml_task_type)task, ith, nth};
+        bool res = llamafile_sgemm(&params, m, n, k, A, lda, B, ldb, C, ldc, Atype, Btype, Ctype,
+                                   precision);
         assert(res);
     }
 }
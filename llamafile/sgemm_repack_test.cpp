@@ -0,0 +1,157 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "bench.h"
+#include "debug.h"
+#include "float.h"
+#include "llama.cpp/ggml.h"
+#include "macros.h"
+#include "numba.h"
+#include "sgemm.h"
+#include <cmath>
+
+// checks that llamafile_sgemm() gives the same answer once the weights
+// were interleaved by llamafile_repack(), when the repacked kernels run
+
+#define ITERATIONS 5
+#define ALLOC(n) (float *)memalign(4096, sizeof(float) * (n))
+
+// runs the matmul as three threads would, one after another
+static bool sgemm_serial(long m, long n, long k, const void *A, const void *B, float *C, long ldc,
+                         int Atype) {
+    for (int ith = 0; ith < 3; ++ith) {
+        ggml_compute_params params = {GGML_TASK_TYPE_COMPUTE, ith, 3};
+        if (!llamafile_sgemm(&params, m, n, k, A, k, B, k, C, ldc, Atype, GGML_TYPE_Q8_0,
+                             GGML_TYPE_F32, GGML_PREC_DEFAULT))
+            return false;
+    }
+    return true;
+}
+
+int test(int m, int k, ggml_type Atype) {
+    ggml_type_traits_t at = ggml_internal_get_type_traits(Atype);
+    ggml_type_traits_t bt = ggml_internal_get_type_traits(GGML_TYPE_Q8_0);
+    int blck = ggml_blck_size(Atype);
+    int maxn = 13;
+    int ldc = ROUNDUP(m, 16);
+    float *A = ALLOC(k * m);
+    float *B = ALLOC(k * maxn);
+    float *C = ALLOC(ldc * maxn);
+    float *D = ALLOC(ldc * maxn);
+    size_t rowa = ggml_row_size(Atype, k);
+    size_t rowb = ggml_row_size(GGML_TYPE_Q8_0, k);
+    char *QA = (char *)memalign(4096, rowa * m);
+    char *QB = (char *)memalign(4096, rowb * maxn);
+    randomize(A, k * m);
+    randomize(B, k * maxn);
+
+    // give the reference exactly what the kernel sees
+    for (int i = 0; i < m; ++i) {
+        at.from_float(A + k * i, QA + rowa * i, k);
+        at.to_float(QA + rowa * i, A + k * i, k);
+    }
+    for (int j = 0; j < maxn; ++j) {
+        bt.from_float(B + k * j, QB + rowb * j, k);
+        bt.to_float(QB + rowb * j, B + k * j, k);
+    }
+
+    printf("%s m=%d k=%d\n", ggml_type_name(Atype), m, k);
+    for (int n = 1; n <= maxn; ++n) {
+        broadcast(C, ldc * maxn, NAN);
+        broadcast(D, ldc * maxn, NAN);
+        if (!sgemm_serial(m, n, k / blck, QA, QB, D, ldc, Atype)) {
+            fprintf(stderr, "%s:%d: %s isn't supported\n", __FILE__, __LINE__,
+                    ggml_type_name(Atype));
+            return 2;
+        }
+        if (!llamafile_repack(QA, m, k / blck, k / blck, Atype) ||
+            !llamafile_repacked(QA, m, k / blck, k / blck, Atype)) {
+            fprintf(stderr, "%s:%d: %s m=%d k=%d wasn't repacked\n", __FILE__, __LINE__,
+                    ggml_type_name(Atype), m, k);
+            return 3;
+        }
+        bool ok = sgemm_serial(m, n, k / blck, QA, QB, C, ldc, Atype);
+        if (n == maxn)
+            BENCH(sgemm_serial(m, n, k / blck, QA, QB, C, ldc, Atype));
+        llamafile_unrepack(QA);
+        if (!ok || llamafile_repacked(QA, m, k / blck, k / blck, Atype)) {
+            fprintf(stderr, "%s:%d: %s repacked matmul failed\n", __FILE__, __LINE__,
+                    ggml_type_name(Atype));
+            return 4;
+        }
+        for (int i = 0; i < m; ++i)
+            for (int j = 0; j < n; ++j) {
+                double sum = 0;
+                double mag = 0;
+                for (int l = 0; l < k; ++l) {
+                    sum += (double)A[k * i + l] * B[k * j + l];
+                    mag += std::fabs((double)A[k * i + l] * B[k * j + l]);
+                }
+                float c = C[ldc * j + i];
+                float d = D[ldc * j + i];
+                if (!(std::fabs(c - sum) <= 1e-5 * mag && std::fabs(c - d) <= 1e-5 * mag)) {
+                    fprintf(stderr,
+                            "%s:%d: %s m=%d n=%d k=%d: C[%d,%d] is %g but should be %g (was %g "
+                            "before repacking)\n",
+                            __FILE__, __LINE__, ggml_type_name(Atype), m, n, k, i, j, c, sum, d);
+                    return 5;
+                }
+            }
+    }
+
+    free(QB);
+    free(QA);
+    free(D);
+    free(C);
+    free(B);
+    free(A);
+
+    return 0;
+}
+
+int test(void) {
+    int rc;
+    if ((rc = test(64, 512, GGML_TYPE_Q4_0)))
+        return rc;
+    if ((rc = test(200, 1024 + 32, GGML_TYPE_Q4_0)))
+        return rc;
+    if ((rc = test(64, 512, GGML_TYPE_Q8_0)))
+        return rc;
+    if ((rc = test(200, 1024 + 32, GGML_TYPE_Q8_0)))
+        return rc;
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int rc;
+
+    llamafile_trapping_enabled(+1);
+
+    // initializes the fp16 tables
+    ggml_init_params params = {ggml_tensor_overhead(), nullptr, true};
+    ggml_free(ggml_init(params));
+
+    printf("\nFLAG_precise = false;\n");
+    FLAG_precise = false;
+    if ((rc = test()))
+        return rc;
+
+    printf("\nFLAG_precise = true;\n");
+    FLAG_precise = true;
+    if ((rc = test()))
+        return rc;
+}
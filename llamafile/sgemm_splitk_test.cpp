@@ -0,0 +1,183 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "ansiblas.h"
+#include "bench.h"
+#include "debug.h"
+#include "float.h"
+#include "llama.cpp/ggml.h"
+#include "macros.h"
+#include "numba.h"
+#include "sgemm.h"
+#include <cassert>
+#include <cmath>
+#include <thread>
+#include <vector>
+
+// exercises the path of llamafile_sgemm() that splits the k dimension
+// across threads, which only happens for matrices with few rows and a
+// barrier that lets the threads add up each other's partial products
+
+#define NTH 8
+#define ITERATIONS 5
+#define ALLOC(n) (float *)memalign(4096, sizeof(float) * (n))
+
+void llamafile_sgemm_threads(int nth, void *wdata, size_t wsize, struct ggml_barrier *barrier,
+                             long m, long n, long k, const void *A, long lda, const void *B,
+                             long ldb, void *C, long ldc, int Atype, int Btype) {
+    std::vector<std::thread> threads;
+    for (int ith = 0; ith < nth; ++ith)
+        threads.emplace_back([=] {
+            ggml_compute_params params = {GGML_TASK_TYPE_COMPUTE, ith, nth, wsize, wdata, barrier};
+            bool res = llamafile_sgemm(&params, m, n, k, A, lda, B, ldb, C, ldc, Atype, Btype,
+                                       GGML_TYPE_F32, GGML_PREC_DEFAULT);
+            assert(res);
+        });
+    for (auto &t : threads)
+        t.join();
+}
+
+int test(int m, int n, int k, ggml_type Atype) {
+    ggml_type_traits_t tt = ggml_internal_get_type_traits(Atype);
+    ggml_type Btype = Atype == GGML_TYPE_F32 ? GGML_TYPE_F32 : tt.vec_dot_type;
+    ggml_type_traits_t bt = ggml_internal_get_type_traits(Btype);
+    int blck = ggml_blck_size(Atype);
+    assert(k % blck == 0);
+    int lda = ROUNDUP(k, 64);
+    int ldb = ROUNDUP(k, 64);
+    int ldc = ROUNDUP(m, 16);
+    float *A = ALLOC(lda * m);
+    float *B = ALLOC(ldb * n);
+    float *C = ALLOC(ldc * n);
+    float *D = ALLOC(ldc * n);
+    float *G = ALLOC(ldc * n);
+    broadcast(A, lda * m, 0);
+    broadcast(B, ldb * n, 0);
+    broadcast(C, ldc * n, NAN);
+    broadcast(D, ldc * n, NAN);
+    broadcast(G, ldc * n, NAN);
+    randomize(k, m, A, lda);
+    randomize(k, n, B, ldb);
+
+    // quantize the inputs and give the reference what the kernels see
+    size_t rowa = ggml_row_size(Atype, lda);
+    size_t rowb = ggml_row_size(Btype, ldb);
+    char *QA = (char *)memalign(4096, rowa * m);
+    char *QB = (char *)memalign(4096, rowb * n);
+    const void *a = A;
+    const void *b = B;
+    if (Atype != GGML_TYPE_F32) {
+        for (int i = 0; i < m; ++i) {
+            tt.from_float(A + lda * i, QA + rowa * i, lda);
+            tt.to_float(QA + rowa * i, A + lda * i, lda);
+        }
+        for (int j = 0; j < n; ++j) {
+            bt.from_float(B + ldb * j, QB + rowb * j, ldb);
+            bt.to_float(QB + rowb * j, B + ldb * j, ldb);
+        }
+        a = QA;
+        b = QB;
+    }
+    ansiBLAS::sgemm(m, n, k, A, lda, B, ldb, G, ldc);
+
+    size_t wsize = llamafile_sgemm_needs(m, n, k / blck, NTH, Atype, GGML_TYPE_F32);
+    if (!wsize) {
+        fprintf(stderr, "%s:%d: %s m=%d n=%d k=%d isn't split\n", __FILE__, __LINE__,
+                ggml_type_name(Atype), m, n, k);
+        return 2;
+    }
+    void *wdata = memalign(4096, wsize);
+    struct ggml_barrier *barrier = ggml_barrier_new();
+    printf("%s m=%d n=%d k=%d\n", ggml_type_name(Atype), m, n, k);
+    BENCH(llamafile_sgemm_threads(NTH, wdata, wsize, barrier, m, n, k / blck, a, lda / blck, b,
+                                  ldb / blck, C, ldc, Atype, Btype));
+    BENCH(llamafile_sgemm_threads(NTH, 0, 0, 0, m, n, k / blck, a, lda / blck, b, ldb / blck, D,
+                                  ldc, Atype, Btype));
+
+    // bound the error by the magnitudes that got summed
+    double err_worst = 0;
+    for (int i = 0; i < m; ++i)
+        for (int j = 0; j < n; ++j) {
+            float g = G[ldc * j + i];
+            float c = C[ldc * j + i];
+            float d = D[ldc * j + i];
+            if (flt::isnan(c)) {
+                fprintf(stderr, "%s:%d: found nan in output matrix: i=%d j=%d\n", __FILE__,
+                        __LINE__, i, j);
+                return 4;
+            }
+            double mag = 0;
+            for (int l = 0; l < k; ++l)
+                mag += std::fabs((double)A[lda * i + l] * B[ldb * j + l]);
+            double err = std::max(std::fabs(c - g), std::fabs(c - d)) / mag;
+            if (!(err <= err_worst))
+                err_worst = err;
+        }
+    printf("%12g worst error relative to magnitude\n", err_worst);
+    if (err_worst > 1e-5) {
+        fprintf(stderr, "%s:%d: %s m=%d n=%d k=%d split sum is wrong\n", __FILE__, __LINE__,
+                ggml_type_name(Atype), m, n, k);
+        return 5;
+    }
+
+    ggml_barrier_free(barrier);
+    free(wdata);
+    free(QB);
+    free(QA);
+    free(G);
+    free(D);
+    free(C);
+    free(B);
+    free(A);
+
+    return 0;
+}
+
+int test(void) {
+    int rc;
+    if ((rc = test(100, 1, 16384, GGML_TYPE_F32)))
+        return rc;
+    if ((rc = test(37, 3, 8192 + 48, GGML_TYPE_F32)))
+        return rc;
+    if ((rc = test(257, 4, 32768, GGML_TYPE_F32)))
+        return rc;
+    if ((rc = test(100, 1, 16384, GGML_TYPE_Q8_0)))
+        return rc;
+    if ((rc = test(37, 3, 8192 + 96, GGML_TYPE_Q8_0)))
+        return rc;
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int rc;
+
+    llamafile_trapping_enabled(+1);
+
+    // initializes the fp16 tables
+    ggml_init_params params = {ggml_tensor_overhead(), nullptr, true};
+    ggml_free(ggml_init(params));
+
+    printf("\nFLAG_precise = false;\n");
+    FLAG_precise = false;
+    if ((rc = test()))
+        return rc;
+
+    printf("\nFLAG_precise = true;\n");
+    FLAG_precise = true;
+    if ((rc = test()))
+        return rc;
+}
@@ -34,8 +34,9 @@ void llamafile_sgemm_openmp(long m, long n, long k, const void *A, long lda, con
     int nth = sysconf(_SC_NPROCESSORS_ONLN);
 #pragma omp parallel for
     for (int ith = 0; ith < nth; ++ith) {
-        bool res = llamafile_sgemm(m, n, k, A, lda, B, ldb, C, ldc, ith, nth, task, Atype, Btype,
-                                   Ctype, precision);
+        ggml_compute_params params = {(ggml_task_type)task, ith, nth};
+        bool res = llamafile_sgemm(&params, m, n, k, A, lda, B, ldb, C, ldc, Atype, Btype, Ctype,
+                                   precision);
         assert(res);
     }
 }
@@ -60,8 +61,9 @@ int test(void) {
     randomize(k, n, B, ldb);
 
     BENCH(ansiBLAS::sgemm(m, n, k, A, lda, B, ldb, G, ldc));
-    BENCH(llamafile_sgemm(m, n, k, A, lda, B, ldb, C, ldc, 0, 1, GGML_TASK_TYPE_COMPUTE,
-                          GGML_TYPE_F32, GGML_TYPE_F32, GGML_TYPE_F32, GGML_PREC_DEFAULT));
+    ggml_compute_params params = {GGML_TASK_TYPE_COMPUTE, 0, 1};
+    BENCH(llamafile_sgemm(&params, m, n, k, A, lda, B, ldb, C, ldc, GGML_TYPE_F32, GGML_TYPE_F32,
+                          GGML_TYPE_F32, GGML_PREC_DEFAULT));
 
     double err_sum = 0;
     long long err_worst = 0;
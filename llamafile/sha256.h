@@ -0,0 +1,13 @@
+#ifndef LLAMAFILE_SHA256_H_
+#define LLAMAFILE_SHA256_H_
+#include <stddef.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void llamafile_sha256(const void *, size_t, unsigned char[32]);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* LLAMAFILE_SHA256_H_ */
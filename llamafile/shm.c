@@ -0,0 +1,184 @@
+// -*- mode:c;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=c ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "llamafile.h"
+#include <cosmo.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+//
+// weights shared between processes
+//
+// Copies of weights we derive at load time, e.g. with --repack, would
+// otherwise be paid for by every server process on the host. Instead,
+// they may be put in a tmpfs file named after the model, so the first
+// process builds it, and the rest simply map it. Every process holds a
+// shared flock() on the file, and whoever detaches last deletes it. So
+// the memory is returned once the last server exits, unless they all
+// crash, in which case `rm /dev/shm/llamafile-*` reclaims it.
+//
+
+#define SHM_DIR "/dev/shm/"
+#define SHM_SLOTS 64
+
+struct shm {
+    void *addr;
+    size_t size;
+    int fd;
+    bool published;
+    char path[PATH_MAX];
+    char temp[PATH_MAX];
+};
+
+static struct shm g_shm[SHM_SLOTS];
+static pthread_mutex_t g_shm_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct shm *shm_find(void *addr) {
+    for (int i = 0; i < SHM_SLOTS; ++i)
+        if (g_shm[i].addr == addr)
+            return g_shm + i;
+    return 0;
+}
+
+static void *shm_map(struct shm *s, int fd, int prot) {
+    void *p;
+    if ((p = mmap(0, s->size, prot, MAP_SHARED, fd, 0)) == MAP_FAILED)
+        return 0;
+    // shmem only uses transparent huge pages if we ask for them
+    madvise(p, s->size, MADV_HUGEPAGE);
+    s->addr = p;
+    s->fd = fd;
+    return p;
+}
+
+/**
+ * Attaches to memory shared by processes that load the same weights.
+ *
+ * If some other process already published an object of this name and
+ * size, then it's mapped read-only and `*created` is set to false.
+ * Otherwise a private object is made and mapped read-write, in which
+ * case the caller fills it in, then calls llamafile_shm_publish().
+ *
+ * @param name is a unique file name like `llamafile-<hash>-repack`
+ * @return pointer to `size` bytes, or NULL w/ errno
+ */
+void *llamafile_shm_attach(const char *name, size_t size, bool *created) {
+    int fd;
+    void *res = 0;
+    struct stat st;
+    struct shm *s;
+    if (!IsLinux() || !size) {
+        errno = ENOTSUP;
+        return 0;
+    }
+    pthread_mutex_lock(&g_shm_lock);
+    if (!(s = shm_find(0))) {
+        errno = ENFILE;
+        goto Finish;
+    }
+    memset(s, 0, sizeof(*s));
+    s->size = size;
+    strlcpy(s->path, SHM_DIR, PATH_MAX);
+    strlcat(s->path, name, PATH_MAX);
+
+    // use the weights someone else made
+    if ((fd = open(s->path, O_RDONLY | O_CLOEXEC)) != -1) {
+        if (flock(fd, LOCK_SH) || fstat(fd, &st) || st.st_size != size) {
+            // it was made by a different build, using the same name
+            close(fd);
+            errno = EEXIST;
+            goto Finish;
+        }
+        if ((res = shm_map(s, fd, PROT_READ))) {
+            s->published = true;
+            *created = false;
+        } else {
+            close(fd);
+        }
+        goto Finish;
+    }
+    if (errno != ENOENT)
+        goto Finish;
+
+    // otherwise make them ourselves
+    snprintf(s->temp, PATH_MAX, "%s.%d", s->path, getpid());
+    if ((fd = open(s->temp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1)
+        goto Finish;
+    if (ftruncate(fd, size) || flock(fd, LOCK_SH) ||
+        !(res = shm_map(s, fd, PROT_READ | PROT_WRITE))) {
+        close(fd);
+        unlink(s->temp);
+        goto Finish;
+    }
+    *created = true;
+
+Finish:
+    pthread_mutex_unlock(&g_shm_lock);
+    return res;
+}
+
+/**
+ * Makes memory filled in after llamafile_shm_attach() visible to others.
+ *
+ * The mapping becomes read-only. If another process published the same
+ * weights in the meantime, ours are kept, but aren't shared.
+ */
+void llamafile_shm_publish(void *addr) {
+    struct shm *s;
+    pthread_mutex_lock(&g_shm_lock);
+    if ((s = shm_find(addr)) && !s->published) {
+        mprotect(addr, s->size, PROT_READ);
+        if (!link(s->temp, s->path))
+            s->published = true;
+        unlink(s->temp);
+        s->temp[0] = 0;
+    }
+    pthread_mutex_unlock(&g_shm_lock);
+}
+
+/**
+ * Unmaps memory from llamafile_shm_attach(), deleting it if last user.
+ */
+void llamafile_shm_detach(void *addr) {
+    struct shm *s;
+    struct stat st1, st2;
+    if (!addr)
+        return;
+    pthread_mutex_lock(&g_shm_lock);
+    if ((s = shm_find(addr))) {
+        munmap(addr, s->size);
+        if (!s->published) {
+            if (s->temp[0])
+                unlink(s->temp);
+        } else if (!flock(s->fd, LOCK_EX | LOCK_NB) && !fstat(s->fd, &st1) &&
+                   !stat(s->path, &st2) && st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino) {
+            unlink(s->path);
+        }
+        close(s->fd);
+        s->addr = 0;
+    }
+    pthread_mutex_unlock(&g_shm_lock);
+}
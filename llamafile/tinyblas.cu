@@ -37,19 +37,37 @@
 //     05-Mar-2024].
 
 #include <algorithm>
+#include <cmath>
+#include <cstdint>
 #include <cstdlib>
 #include <type_traits>
 
 #ifndef __HIP__
 #include <cuda_fp16.h>
 #include <cuda_runtime.h>
+#include <mma.h>
 #define __shfl_down(var, srcLane, warpSize) __shfl_down_sync(-1u, var, srcLane, warpSize)
+#define TINYBLAS_MMA
 #else
 #include <hip/hip_fp16.h>
 #include <hip/hip_runtime.h>
 #define cudaSuccess hipSuccess
 #define cudaStream_t hipStream_t
 #define cudaGetLastError hipGetLastError
+#define cudaEvent_t hipEvent_t
+#define cudaEventCreate hipEventCreate
+#define cudaEventRecord hipEventRecord
+#define cudaEventSynchronize hipEventSynchronize
+#define cudaEventElapsedTime hipEventElapsedTime
+#define cudaEventDestroy hipEventDestroy
+#define cudaFree hipFree
+#define cudaMemsetAsync hipMemsetAsync
+#endif
+
+#ifdef __HIP__
+#define tinyblasMalloc hipMalloc
+#else
+#define tinyblasMalloc cudaMalloc
 #endif
 
 #define WARPSIZE 32
@@ -69,8 +87,12 @@
 
 struct tinyblasContext {
     cudaStream_t stream;
+    bool mma; // if tensor core kernels were compiled for this device
+    int config; // kernel tinyblasGE_launch() uses, see tinyblasTune()
 };
 
+#define TINYBLAS_CONFIGS 4
+
 inline bool isone(float x) {
     return x == 1;
 }
@@ -353,6 +375,248 @@ static __device__ void matmul_warp2d(tinyblasOperation_t aT, //
                 }
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// tinyBLAS tensor core GEMM kernel
+//
+// This handles the transa=T transb=N case, which is the one ggml asks
+// for, on gpus that have tensor cores (Volta or newer). Each block has
+// four warps computing a 64x64 tile of `C` using 16x16x16 wmma tiles.
+// The first matrix may also be quantized with ggml's Q4_0 or Q8_0, in
+// which case weights are dequantized while they're being copied into
+// shared memory, and never need to be written out as f16.
+
+#define QK 32 // weights per quantization block
+#define MMA_BM 64
+#define MMA_BN 64
+#define MMA_BK 32
+#define MMA_BKP (MMA_BK + 8) // padding avoids bank conflicts
+#define MMA_WARPS 4
+#define MMA_THREADS (MMA_WARPS * WARPSIZE)
+
+struct tinyblas_q4_0 {
+    half d;
+    uint8_t qs[QK / 2];
+};
+
+struct tinyblas_q8_0 {
+    half d;
+    int8_t qs[QK];
+};
+
+// copies 16 values of row `i` starting at column `l` into shared memory
+__device__ __forceinline__ void mma_load(half *dst, const half *A, int lda, bool ok, int i, int l,
+                                         int k) {
+    for (int v = 0; v < 16; ++v)
+        dst[v] = ok && l + v < k ? A[lda * i + l + v] : (half)0.f;
+}
+
+__device__ __forceinline__ void mma_load(half *dst, const tinyblas_q8_0 *A, int lda, bool ok,
+                                         int i, int l, int k) {
+    if (!ok || l >= k) {
+        for (int v = 0; v < 16; ++v)
+            dst[v] = 0.f;
+        return;
+    }
+    const tinyblas_q8_0 *b = A + lda / QK * i + l / QK;
+    float d = __half2float(b->d);
+    for (int v = 0; v < 16; ++v)
+        dst[v] = __float2half(d * b->qs[l % QK + v]);
+}
+
+__device__ __forceinline__ void mma_load(half *dst, const tinyblas_q4_0 *A, int lda, bool ok,
+                                         int i, int l, int k) {
+    if (!ok || l >= k) {
+        for (int v = 0; v < 16; ++v)
+            dst[v] = 0.f;
+        return;
+    }
+    // first half of block is in the low nibbles, second half in the high
+    const tinyblas_q4_0 *b = A + lda / QK * i + l / QK;
+    const int shift = l % QK ? 4 : 0;
+    float d = __half2float(b->d);
+    for (int v = 0; v < 16; ++v)
+        dst[v] = __float2half(d * (((b->qs[v] >> shift) & 15) - 8));
+}
+
+template <typename SRC, typename DST>
+static __device__ void matmul_mma(int m, int n, int k, float alpha, //
+                                  const SRC *A, int lda, //
+                                  const half *B, int ldb, float beta, //
+                                  DST *C, int ldc) {
+#if defined(TINYBLAS_MMA) && __CUDA_ARCH__ >= 700
+    using namespace nvcuda;
+
+    __shared__ __align__(32) half As[MMA_BM * MMA_BKP];
+    __shared__ __align__(32) half Bs[MMA_BN * MMA_BKP];
+    __shared__ __align__(32) float Cs[MMA_WARPS][16 * 16];
+
+    const int warp = threadIdx.x / WARPSIZE;
+    const int lane = threadIdx.x % WARPSIZE;
+    const int wm = warp / 2 * 32;
+    const int wn = warp % 2 * 32;
+    const int i0 = blockIdx.x * MMA_BM;
+    const int j0 = blockIdx.y * MMA_BN;
+
+    // each thread copies half a row of both tiles
+    const int r = threadIdx.x / 2;
+    const int c = threadIdx.x % 2 * 16;
+    static_assert(MMA_THREADS == MMA_BM * 2 && MMA_THREADS == MMA_BN * 2, "");
+    static_assert(MMA_BK == QK, "");
+
+    wmma::fragment<wmma::accumulator, 16, 16, 16, float> acc[2][2];
+    for (int ii = 0; ii < 2; ++ii)
+        for (int jj = 0; jj < 2; ++jj)
+            wmma::fill_fragment(acc[ii][jj], 0.f);
+
+    for (int ll = 0; ll < k; ll += MMA_BK) {
+        mma_load(As + MMA_BKP * r + c, A, lda, i0 + r < m, i0 + r, ll + c, k);
+        mma_load(Bs + MMA_BKP * r + c, B, ldb, j0 + r < n, j0 + r, ll + c, k);
+        __syncthreads();
+        for (int kk = 0; kk < MMA_BK; kk += 16) {
+            wmma::fragment<wmma::matrix_a, 16, 16, 16, half, wmma::row_major> a[2];
+            wmma::fragment<wmma::matrix_b, 16, 16, 16, half, wmma::col_major> b[2];
+            for (int ii = 0; ii < 2; ++ii)
+                wmma::load_matrix_sync(a[ii], As + MMA_BKP * (wm + 16 * ii) + kk, MMA_BKP);
+            for (int jj = 0; jj < 2; ++jj)
+                wmma::load_matrix_sync(b[jj], Bs + MMA_BKP * (wn + 16 * jj) + kk, MMA_BKP);
+            for (int ii = 0; ii < 2; ++ii)
+                for (int jj = 0; jj < 2; ++jj)
+                    wmma::mma_sync(acc[ii][jj], a[ii], b[jj], acc[ii][jj]);
+        }
+        __syncthreads();
+    }
+
+    for (int ii = 0; ii < 2; ++ii)
+        for (int jj = 0; jj < 2; ++jj) {
+            wmma::store_matrix_sync(Cs[warp], acc[ii][jj], 16, wmma::mem_col_major);
+            __syncwarp();
+            for (int e = lane; e < 16 * 16; e += WARPSIZE) {
+                int row = i0 + wm + 16 * ii + e % 16;
+                int col = j0 + wn + 16 * jj + e / 16;
+                if (row < m && col < n) {
+                    float d = alpha * Cs[warp][e];
+                    if (beta)
+                        d += beta * (float)C[ldc * col + row];
+                    C[ldc * col + row] = d;
+                }
+            }
+            __syncwarp();
+        }
+#endif
+}
+
+template <typename SRC, typename DST>
+static __global__ void __launch_bounds__(MMA_THREADS)
+    tinyblasMMA_entry(int m, int n, int k, float alpha, const SRC *A, int lda, long long strideA,
+                      const half *B, int ldb, long long strideB, float beta, DST *C, int ldc,
+                      long long strideC) {
+    matmul_mma(m, n, k, alpha, A + strideA * blockIdx.z, lda, B + strideB * blockIdx.z, ldb, beta,
+               C + strideC * blockIdx.z, ldc);
+}
+
+template <typename DST>
+static __global__ void __launch_bounds__(MMA_THREADS)
+    tinyblasMMA_batched_entry(int m, int n, int k, float alpha, const half *const A[], int lda,
+                              const half *const B[], int ldb, float beta, DST *const C[], int ldc) {
+    matmul_mma(m, n, k, alpha, A[blockIdx.z], lda, B[blockIdx.z], ldb, beta, C[blockIdx.z], ldc);
+}
+
+static bool can_use_mma(tinyblasHandle_t handle, tinyblasOperation_t aT, tinyblasOperation_t bT,
+                        int n) {
+    return handle->mma && aT && !bT && n <= 65535 * MMA_BN;
+}
+
+template <typename SRC, typename DST>
+static tinyblasStatus_t tinyblasMMA_launch(tinyblasHandle_t handle, int m, int n, int k,
+                                           float alpha, const SRC *A, int lda, long long strideA,
+                                           const half *B, int ldb, long long strideB, float beta,
+                                           DST *C, int ldc, long long strideC, int batchCount) {
+    dim3 blocks(CEIL_DIV(m, MMA_BM), CEIL_DIV(n, MMA_BN), batchCount);
+    tinyblasMMA_entry<<<blocks, MMA_THREADS, 0, handle->stream>>>(
+        m, n, k, alpha, A, lda, strideA, B, ldb, strideB, beta, C, ldc, strideC);
+    if (cudaGetLastError() != cudaSuccess)
+        return TINYBLAS_STATUS_EXECUTION_FAILED;
+    return TINYBLAS_STATUS_SUCCESS;
+}
+
+// uses tensor cores if possible, which is only the case for f16 inputs
+template <typename WORD, typename SRC, typename DST>
+static bool mma_gsbe(tinyblasHandle_t, tinyblasOperation_t, tinyblasOperation_t, int, int, int,
+                     WORD, const SRC *, int, long long, const SRC *, int, long long, WORD, DST *,
+                     int, long long, int, tinyblasStatus_t *) {
+    return false;
+}
+
+template <typename DST>
+static bool mma_gsbe(tinyblasHandle_t handle, tinyblasOperation_t aT, tinyblasOperation_t bT,
+                     int m, int n, int k, float alpha, const half *A, int lda, long long strideA,
+                     const half *B, int ldb, long long strideB, float beta, DST *C, int ldc,
+                     long long strideC, int batchCount, tinyblasStatus_t *status) {
+    if (!can_use_mma(handle, aT, bT, n))
+        return false;
+    *status = tinyblasMMA_launch(handle, m, n, k, alpha, A, lda, strideA, B, ldb, strideB, beta, C,
+                                 ldc, strideC, batchCount);
+    return true;
+}
+
+template <typename WORD, typename SRC, typename DST>
+static bool mma_gbe(tinyblasHandle_t, tinyblasOperation_t, tinyblasOperation_t, int, int, int,
+                    WORD, const SRC *const *, int, const SRC *const *, int, WORD, DST *const *,
+                    int, int, tinyblasStatus_t *) {
+    return false;
+}
+
+template <typename DST>
+static bool mma_gbe(tinyblasHandle_t handle, tinyblasOperation_t aT, tinyblasOperation_t bT, int m,
+                    int n, int k, float alpha, const half *const *Aarray, int lda,
+                    const half *const *Barray, int ldb, float beta, DST *const *Carray, int ldc,
+                    int batchCount, tinyblasStatus_t *status) {
+    if (!can_use_mma(handle, aT, bT, n))
+        return false;
+    dim3 blocks(CEIL_DIV(m, MMA_BM), CEIL_DIV(n, MMA_BN), batchCount);
+    tinyblasMMA_batched_entry<<<blocks, MMA_THREADS, 0, handle->stream>>>(
+        m, n, k, alpha, Aarray, lda, Barray, ldb, beta, Carray, ldc);
+    *status = cudaGetLastError() != cudaSuccess ? TINYBLAS_STATUS_EXECUTION_FAILED
+                                                : TINYBLAS_STATUS_SUCCESS;
+    return true;
+}
+
+// multiplies quantized weights, which only tensor cores can do
+template <typename SRC>
+static tinyblasStatus_t tinyblasGQ_launch(tinyblasHandle_t handle, tinyblasOperation_t aT,
+                                          tinyblasOperation_t bT, int m, int n, int k,
+                                          const void *alpha, const SRC *A, int lda, const half *B,
+                                          int ldb, const void *beta, void *C,
+                                          tinyblasDataType_t Ctype, int ldc,
+                                          tinyblasComputeType_t computeType) {
+    if (!can_use_mma(handle, aT, bT, n) || k % QK || lda % QK)
+        return TINYBLAS_STATUS_NOT_SUPPORTED;
+    float a, b;
+    switch (computeType) {
+    case TINYBLAS_COMPUTE_16F:
+        a = *(const half *)alpha;
+        b = *(const half *)beta;
+        break;
+    case TINYBLAS_COMPUTE_32F:
+        a = *(const float *)alpha;
+        b = *(const float *)beta;
+        break;
+    default:
+        return TINYBLAS_STATUS_INVALID_VALUE;
+    }
+    switch (Ctype) {
+    case TINYBLAS_R_16F:
+        return tinyblasMMA_launch(handle, m, n, k, a, A, lda, 0, B, ldb, 0, b, (half *)C, ldc, 0, 1);
+    case TINYBLAS_R_32F:
+        if (computeType == TINYBLAS_COMPUTE_16F)
+            return TINYBLAS_STATUS_NOT_SUPPORTED;
+        return tinyblasMMA_launch(handle, m, n, k, a, A, lda, 0, B, ldb, 0, b, (float *)C, ldc, 0,
+                                  1);
+    default:
+        return TINYBLAS_STATUS_INVALID_VALUE;
+    }
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 // tinyBLAS canonical cuBLAS-like interface
 
@@ -370,6 +634,17 @@ static __device__ void matmul_warp2d(tinyblasOperation_t aT, //
 tinyblasStatus_t tinyblasCreate(tinyblasHandle_t *out_handle) {
     tinyblasHandle_t handle;
     if ((handle = (tinyblasHandle_t)malloc(sizeof(struct tinyblasContext)))) {
+        handle->stream = 0;
+        handle->mma = false;
+        handle->config = 0;
+#ifdef TINYBLAS_MMA
+        // the kernel is empty unless it was built for this architecture
+        cudaFuncAttributes attr;
+        if (cudaFuncGetAttributes(&attr, tinyblasMMA_entry<half, float>) == cudaSuccess)
+            handle->mma = attr.ptxVersion >= 70;
+        else
+            cudaGetLastError();
+#endif
         *out_handle = handle;
         return TINYBLAS_STATUS_SUCCESS;
     } else {
@@ -414,6 +689,117 @@ tinyblasStatus_t tinyblasGetStream(tinyblasHandle_t handle, void **out_stream) {
     return TINYBLAS_STATUS_SUCCESS;
 }
 
+/**
+ * Chooses which kernel tinyBLAS uses for general matrix multiplication.
+ *
+ * @param handle is pointer to handle created by tinyblasCreate()
+ * @param config is index of kernel returned by tinyblasTune(), where 0
+ *     is the default, which uses tensor cores if the gpu has them
+ * @return TINYBLAS_STATUS_SUCCESS on success otherwise error
+ */
+tinyblasStatus_t tinyblasSetConfig(tinyblasHandle_t handle, int config) {
+    if (config < 0 || config >= TINYBLAS_CONFIGS)
+        return TINYBLAS_STATUS_INVALID_VALUE;
+    handle->config = config;
+    return TINYBLAS_STATUS_SUCCESS;
+}
+
+/**
+ * Finds fastest kernel for general matrix multiplication on this gpu.
+ *
+ * Every kernel tinyblasSetConfig() accepts is timed multiplying f16
+ * matrices of the shapes found in the attention and feed forward
+ * layers of typical language models, with a prompt's worth of tokens
+ * as well as a few. This takes on the order of a second, so the caller
+ * should remember the answer for the gpu architecture. The kernel of
+ * the handle is left as it was.
+ *
+ * @param handle is pointer to handle created by tinyblasCreate() with
+ *     the current device being the one that's tuned
+ * @param out_config receives index of fastest kernel
+ * @param out_gflops receives its speed, or may be null
+ * @return TINYBLAS_STATUS_SUCCESS on success otherwise error
+ */
+tinyblasStatus_t tinyblasTune(tinyblasHandle_t handle, int *out_config, double *out_gflops) {
+    static const int kShapes[][3] = {
+        // m, n, k
+        {4096, 512, 4096}, // attention of 7b and 8b models
+        {14336, 512, 4096}, // feed forward up and gate
+        {4096, 512, 14336}, // feed forward down
+        {4096, 32, 4096}, // small batches
+    };
+    size_t a = 0, b = 0, c = 0;
+    double flops = 0;
+    for (const auto &s : kShapes) {
+        a = std::max(a, (size_t)s[0] * s[2]);
+        b = std::max(b, (size_t)s[1] * s[2]);
+        c = std::max(c, (size_t)s[0] * s[1]);
+        flops += 2. * s[0] * s[1] * s[2];
+    }
+
+    half *A = nullptr, *B = nullptr, *C = nullptr;
+    cudaEvent_t start = nullptr, stop = nullptr;
+    tinyblasStatus_t status = TINYBLAS_STATUS_ALLOC_FAILED;
+    const int config = handle->config;
+    float best = INFINITY;
+    *out_config = 0;
+    if (tinyblasMalloc((void **)&A, a * sizeof(half)) != cudaSuccess ||
+        tinyblasMalloc((void **)&B, b * sizeof(half)) != cudaSuccess ||
+        tinyblasMalloc((void **)&C, c * sizeof(half)) != cudaSuccess ||
+        cudaEventCreate(&start) != cudaSuccess || cudaEventCreate(&stop) != cudaSuccess) {
+        cudaGetLastError();
+        goto Finished;
+    }
+    cudaMemsetAsync(A, 0x11, a * sizeof(half), handle->stream);
+    cudaMemsetAsync(B, 0x11, b * sizeof(half), handle->stream);
+
+    // a kernel the gpu can't launch, e.g. for want of registers, is skipped
+    status = TINYBLAS_STATUS_EXECUTION_FAILED;
+    for (int i = 0; i < TINYBLAS_CONFIGS; ++i) {
+        handle->config = i;
+        tinyblasStatus_t err = TINYBLAS_STATUS_SUCCESS;
+        float elapsed = 0;
+        for (const auto &s : kShapes) {
+            const float alpha = 1, beta = 0;
+            float ms = 0;
+            for (int r = 0; r < 3 && err == TINYBLAS_STATUS_SUCCESS; ++r) {
+                if (r == 1) // the first one warms up
+                    cudaEventRecord(start, handle->stream);
+                err = tinyblasGemmEx(handle, TINYBLAS_OP_T, TINYBLAS_OP_N, s[0], s[1], s[2], &alpha,
+                                     A, TINYBLAS_R_16F, s[2], B, TINYBLAS_R_16F, s[2], &beta, C,
+                                     TINYBLAS_R_16F, s[0], TINYBLAS_COMPUTE_32F,
+                                     TINYBLAS_GEMM_DEFAULT);
+            }
+            cudaEventRecord(stop, handle->stream);
+            if (err != TINYBLAS_STATUS_SUCCESS || cudaEventSynchronize(stop) != cudaSuccess ||
+                cudaEventElapsedTime(&ms, start, stop) != cudaSuccess) {
+                err = TINYBLAS_STATUS_EXECUTION_FAILED;
+                cudaGetLastError();
+                break;
+            }
+            elapsed += ms;
+        }
+        if (err == TINYBLAS_STATUS_SUCCESS && elapsed < best) {
+            status = TINYBLAS_STATUS_SUCCESS;
+            best = elapsed;
+            *out_config = i;
+        }
+    }
+    if (out_gflops && status == TINYBLAS_STATUS_SUCCESS)
+        *out_gflops = flops * 2 / (best * 1e6);
+
+Finished:
+    handle->config = config;
+    if (stop)
+        cudaEventDestroy(stop);
+    if (start)
+        cudaEventDestroy(start);
+    cudaFree(C);
+    cudaFree(B);
+    cudaFree(A);
+    return status;
+}
+
 /**
  * Returns string describing tinyBLAS status code.
  */
@@ -515,18 +901,27 @@ tinyblasStatus_t tinyblasGE_launch(tinyblasHandle_t handle, tinyblasOperation_t
                                    int ldc) {
     if (can_use_matvec(aT, bT, m, n, k, alpha, beta))
         return matvec_launch<WORD>(handle, m, k, A, lda, B, C);
-    constexpr int TT = 256;
-    constexpr int BM = 128;
-    constexpr int BN = 64;
-    constexpr int BK = 64;
-    constexpr int VE = 16;
-    constexpr int WM = 32;
-    constexpr int WN = 32;
-    constexpr int WNI = 1;
-    constexpr int TM = 8;
-    constexpr int TN = 4;
-    return tinyblasGE_launcher<BM, BN, BK, VE, WM, WN, WNI, TM, TN, TT>(
-        handle, bT, aT, n, m, k, alpha, B, ldb, A, lda, beta, C, ldc);
+    tinyblasStatus_t status;
+    if (!handle->config &&
+        mma_gsbe(handle, aT, bT, m, n, k, alpha, A, lda, 0, B, ldb, 0, beta, C, ldc, 0, 1, &status))
+        return status;
+    // the tile shapes tinyblasTune() chooses between, which are all
+    // legal according to llamafile/pick_a_warp_kernel.c. the first is
+    // the default, and the only one that may use tensor cores instead
+    switch (handle->config) {
+    case 1: // BM, BN, BK, VE, WM, WN, WNI, TM, TN, TT
+        return tinyblasGE_launcher<64, 64, 32, 16, 32, 32, 1, 8, 4, 128>(
+            handle, bT, aT, n, m, k, alpha, B, ldb, A, lda, beta, C, ldc);
+    case 2:
+        return tinyblasGE_launcher<128, 128, 32, 16, 64, 32, 2, 8, 4, 256>(
+            handle, bT, aT, n, m, k, alpha, B, ldb, A, lda, beta, C, ldc);
+    case 3:
+        return tinyblasGE_launcher<128, 64, 32, 16, 64, 32, 1, 8, 8, 128>(
+            handle, bT, aT, n, m, k, alpha, B, ldb, A, lda, beta, C, ldc);
+    default:
+        return tinyblasGE_launcher<128, 64, 64, 16, 32, 32, 1, 8, 4, 256>(
+            handle, bT, aT, n, m, k, alpha, B, ldb, A, lda, beta, C, ldc);
+    }
 }
 
 /**
@@ -542,8 +937,12 @@ tinyblasStatus_t tinyblasGE_launch(tinyblasHandle_t handle, tinyblasOperation_t
  * @param k is cols in `A` and rows in `B`
  * @param alpha points to scalar that's multiplied against input
  * @param A is input array of first matrix
- * @param Atype is data type of `C`
- * @param lda is row stride of `A`
+ * @param Atype is data type of `A`, which may be TINYBLAS_R_Q4_0 or
+ *     TINYBLAS_R_Q8_0 if `transa` is set, `transb` isn't, `Btype` is
+ *     TINYBLAS_R_16F, and `k` and `lda` are multiples of 32; otherwise
+ *     TINYBLAS_STATUS_NOT_SUPPORTED is returned, e.g. if the gpu has no
+ *     tensor cores, so the caller can dequantize instead
+ * @param lda is row stride of `A`, in weights rather than blocks
  * @param B is input array of second matrix
  * @param Btype is data type of `C`
  * @param ldb is row stride of `B`
@@ -583,6 +982,14 @@ tinyblasStatus_t tinyblasGemmEx(tinyblasHandle_t handle, //
         return TINYBLAS_STATUS_DIMENSION_OVERFLOW;
     if (algo != TINYBLAS_GEMM_DEFAULT)
         return TINYBLAS_STATUS_INVALID_VALUE;
+    if ((Atype == TINYBLAS_R_Q4_0 || Atype == TINYBLAS_R_Q8_0) && Btype != TINYBLAS_R_16F)
+        return TINYBLAS_STATUS_NOT_SUPPORTED;
+    if (Atype == TINYBLAS_R_Q4_0)
+        return tinyblasGQ_launch(handle, transa, transb, m, n, k, alpha, (const tinyblas_q4_0 *)A,
+                                 lda, (const half *)B, ldb, beta, C, Ctype, ldc, computeType);
+    if (Atype == TINYBLAS_R_Q8_0)
+        return tinyblasGQ_launch(handle, transa, transb, m, n, k, alpha, (const tinyblas_q8_0 *)A,
+                                 lda, (const half *)B, ldb, beta, C, Ctype, ldc, computeType);
     if (Atype != Btype)
         return TINYBLAS_STATUS_NOT_SUPPORTED;
 
@@ -663,10 +1070,14 @@ static tinyblasStatus_t tinyblasGBE_launch(tinyblasHandle_t handle, tinyblasOper
                                            WORD alpha, const SRC *const *Aarray, int lda,
                                            const SRC *const *Barray, int ldb, WORD beta,
                                            DST *const *Carray, int ldc, int batchCount) {
+    tinyblasStatus_t status;
     if (can_use_matvec(transa, transb, m, n, k, alpha, beta)) {
         dim3 blocks(WARPSIZE, m / WARPSIZE, batchCount);
         matvecGBE_entry<WORD>
             <<<blocks, WARPSIZE, 0, handle->stream>>>(m, k, Aarray, lda, Barray, Carray);
+    } else if (mma_gbe(handle, transa, transb, m, n, k, alpha, Aarray, lda, Barray, ldb, beta,
+                       Carray, ldc, batchCount, &status)) {
+        return status;
     } else {
         constexpr int BM = 16;
         constexpr int BN = 16;
@@ -821,10 +1232,14 @@ static tinyblasStatus_t tinyblasGSBE_launch(tinyblasHandle_t handle, tinyblasOpe
                                             WORD alpha, const SRC *A, int lda, long long strideA,
                                             const SRC *B, int ldb, long long strideB, WORD beta,
                                             DST *C, int ldc, long long strideC, int batchCount) {
+    tinyblasStatus_t status;
     if (can_use_matvec(transa, transb, m, n, k, alpha, beta)) {
         dim3 blocks(WARPSIZE, m / WARPSIZE, batchCount);
         matvecGSBE_entry<WORD><<<blocks, WARPSIZE, 0, handle->stream>>>(m, k, A, lda, strideA, B,
                                                                         strideB, C, strideC);
+    } else if (mma_gsbe(handle, transa, transb, m, n, k, alpha, A, lda, strideA, B, ldb, strideB,
+                        beta, C, ldc, strideC, batchCount, &status)) {
+        return status;
     } else {
         constexpr int BM = 16;
         constexpr int BN = 16;
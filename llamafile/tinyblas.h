@@ -10,6 +10,8 @@ typedef enum tinyblasOperation {
 typedef enum tinyblasDataType {
     TINYBLAS_R_32F,
     TINYBLAS_R_16F,
+    TINYBLAS_R_Q4_0, // ggml block_q4_0, only for `A` with `B` as 16F
+    TINYBLAS_R_Q8_0, // ggml block_q8_0, only for `A` with `B` as 16F
 } tinyblasDataType_t;
 
 typedef enum tinyblasComputeType {
@@ -40,6 +42,8 @@ tinyblasStatus_t tinyblasCreate(tinyblasHandle_t *);
 tinyblasStatus_t tinyblasDestroy(tinyblasHandle_t);
 tinyblasStatus_t tinyblasSetStream(tinyblasHandle_t, void *);
 tinyblasStatus_t tinyblasGetStream(tinyblasHandle_t, void **);
+tinyblasStatus_t tinyblasSetConfig(tinyblasHandle_t, int);
+tinyblasStatus_t tinyblasTune(tinyblasHandle_t, int *, double *);
 
 tinyblasStatus_t tinyblasSgemm(tinyblasHandle_t, tinyblasOperation_t, tinyblasOperation_t, int, int,
                                int, const float *, const float *, int, const float *, int,
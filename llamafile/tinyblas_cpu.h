@@ -53,6 +53,13 @@
 #define MATRIX_ALIGN 4096
 #define MAX_ALIGN 4096
 
+// panel of B that floating point kernels keep in L2 when n is large.
+// 120 columns divides evenly into every tile width mnpack() may pick,
+// and 120 x 1024 floats is 480kb, which fits the L2 of most x86 cores
+// while the depth is enough to amortize the horizontal sums of C
+#define TINYBLAS_NC 120
+#define TINYBLAS_KC 1024
+
 #ifdef _MSC_VER
 #define NOINLINE __declspec(noinline)
 #else
@@ -116,6 +123,14 @@ template <>
 struct ggml_type_trait<block_q8_0> {
     static constexpr ggml_type id = GGML_TYPE_Q8_0;
 };
+template <>
+struct ggml_type_trait<block_q4_0> {
+    static constexpr ggml_type id = GGML_TYPE_Q4_0;
+};
+template <>
+struct ggml_type_trait<block_f8_e4m3> {
+    static constexpr ggml_type id = GGML_TYPE_F8_E4M3;
+};
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 // VECTORIZED ARITHMETIC OPERATIONS
@@ -411,6 +426,10 @@ inline void store(ggml_bf16_t *p, float f) {
     *p = GGML_FP32_TO_BF16(f);
 }
 
+inline void accum(float *p, float f) {
+    *p += f;
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 // FLOATING POINT MATRIX MULTIPLICATION
 
@@ -424,10 +443,55 @@ class tinyBLAS {
 
     void matmul(long m, long n, int task) {
         if (task == GGML_TASK_TYPE_COMPUTE)
-            mnpack(0, m, 0, n);
+            tunepack(m, n, FLAG_precise ? 0 : llamafile_tile(ggml_type_trait<TA>::id, m, k));
+    }
+
+    // computes the rows [m0,m) and columns [n0,n) of C
+    void matmul(long m0, long m, long n0, long n) {
+        mnpack(m0, m, n0, n);
     }
 
   private:
+    // uses the tile llamafile_tune() found fastest for this shape
+    void tunepack(long m, long n, int tile) {
+        switch (tile) {
+#if VECTOR_REGISTERS == 32
+        case 1:
+            tilepack<4, 6>(m, n);
+            break;
+        case 2:
+            tilepack<6, 4>(m, n);
+            break;
+        case 3:
+            tilepack<8, 3>(m, n);
+            break;
+#endif
+#if VECTOR_REGISTERS == 16
+        case 1:
+            tilepack<3, 4>(m, n);
+            break;
+        case 2:
+            tilepack<6, 2>(m, n);
+            break;
+        case 3:
+            tilepack<2, 6>(m, n);
+            break;
+#endif
+        default:
+            mnpack(0, m, 0, n);
+            break;
+        }
+    }
+
+    template <int RM, int RN>
+    void tilepack(long m, long n) {
+        long mp = m / RM * RM;
+        long np = n / RN * RN;
+        gemm<RM, RN, false>(0, mp, 0, np);
+        mnpack(mp, m, 0, np);
+        mnpack(0, m, np, n);
+    }
+
     NOINLINE void mnpack(long m0, long m, long n0, long n) {
         long mc, nc, mp, np;
 
@@ -607,14 +671,13 @@ class tinyBLAS {
 
     template <int RM, int RN, int PRECISE>
     NOINLINE void gemm(long m0, long m, long n0, long n) {
+        if (!PRECISE && n - n0 >= TINYBLAS_NC && k > TINYBLAS_KC)
+            return bgemm<RM, RN>(m0, m, n0, n);
         long ytiles = RM > 1 ? (m - m0) / RM : 1;
         long xtiles = RN > 1 ? (n - n0) / RN : 1;
         long tiles = xtiles * ytiles;
-        long duty = (tiles + nth - 1) / nth;
-        long start = duty * ith;
-        long end = start + duty;
-        if (end > tiles)
-            end = tiles;
+        long start, end;
+        llamafile_share(tiles, ith, nth, &start, &end);
         for (long job = start; job < end; ++job) {
             long ii = m0 + job / xtiles * RM;
             long jj = n0 + job % xtiles * RN;
@@ -641,6 +704,47 @@ class tinyBLAS {
         }
     }
 
+    // once B is too big for the cache, every row tile of A would stream
+    // all of it from memory. so we walk B in panels of TINYBLAS_NC cols
+    // and TINYBLAS_KC depth, which each thread reuses from its L2 cache
+    // for all its rows of A, and C accumulates the partial dot products
+    template <int RM, int RN>
+    NOINLINE void bgemm(long m0, long m, long n0, long n) {
+        long ytiles = RM > 1 ? (m - m0) / RM : 1;
+        long xtiles = RN > 1 ? (n - n0) / RN : 1;
+        long ptiles = MAX(1, TINYBLAS_NC / RN);
+        for (long px = 0; px < xtiles; px += ptiles) {
+            long xpanel = MIN(ptiles, xtiles - px);
+            long tiles = xpanel * ytiles;
+            long start, end;
+            llamafile_share(tiles, ith, nth, &start, &end);
+            for (long l0 = 0; l0 < k; l0 += TINYBLAS_KC) {
+                long l1 = MIN(k, l0 + TINYBLAS_KC);
+                for (long job = start; job < end; ++job) {
+                    long ii = m0 + job / xpanel * RM;
+                    long jj = n0 + (px + job % xpanel) * RN;
+                    D Cv[RN][RM] = {};
+                    for (long l = l0; l < l1; l += KN)
+#pragma GCC unroll 100
+                        for (int j = 0; j < RN; ++j)
+#pragma GCC unroll 100
+                            for (int i = 0; i < RM; ++i)
+                                Cv[j][i] = madd(load<V>(INDEX(A, lda, ii + i, l)), //
+                                                load<V>(INDEX(B, ldb, jj + j, l)), //
+                                                Cv[j][i]);
+#pragma GCC unroll 100
+                    for (int j = 0; j < RN; ++j)
+#pragma GCC unroll 100
+                        for (int i = 0; i < RM; ++i)
+                            if (l0)
+                                accum(INDEX(C, ldc, jj + j, ii + i), hsum(Cv[j][i]));
+                            else
+                                store(INDEX(C, ldc, jj + j, ii + i), hsum(Cv[j][i]));
+                }
+            }
+        }
+    }
+
     const TA *const A;
     const TB *const B;
     TC *const C;
@@ -666,10 +770,42 @@ class tinyBLAS_Q0_ARM {
 
     void matmul(long m, long n, int task) {
         if (task == GGML_TASK_TYPE_COMPUTE)
-            mnpack(0, m, 0, n);
+            tunepack(m, n, FLAG_precise ? 0 : llamafile_tile(ggml_type_trait<TA>::id, m, k));
+    }
+
+    // computes the rows [m0,m) and columns [n0,n) of C
+    void matmul(long m0, long m, long n0, long n) {
+        mnpack(m0, m, n0, n);
     }
 
   private:
+    // uses the tile llamafile_tune() found fastest for this shape
+    void tunepack(long m, long n, int tile) {
+        switch (tile) {
+        case 1:
+            tilepack<4, 3>(m, n);
+            break;
+        case 2:
+            tilepack<3, 4>(m, n);
+            break;
+        case 3:
+            tilepack<4, 4>(m, n);
+            break;
+        default:
+            mnpack(0, m, 0, n);
+            break;
+        }
+    }
+
+    template <int RM, int RN>
+    void tilepack(long m, long n) {
+        long mp = m / RM * RM;
+        long np = n / RN * RN;
+        gemm<RM, RN, false>(0, mp, 0, np);
+        mnpack(mp, m, 0, np);
+        mnpack(0, m, np, n);
+    }
+
     NOINLINE void mnpack(long m0, long m, long n0, long n) {
         long mc, nc, mp, np;
 
@@ -754,11 +890,8 @@ class tinyBLAS_Q0_ARM {
         long ytiles = RM > 1 ? (m - m0) / RM : 1;
         long xtiles = RN > 1 ? (n - n0) / RN : 1;
         long tiles = xtiles * ytiles;
-        long duty = (tiles + nth - 1) / nth;
-        long start = duty * ith;
-        long end = start + duty;
-        if (end > tiles)
-            end = tiles;
+        long start, end;
+        llamafile_share(tiles, ith, nth, &start, &end);
         for (long job = start; job < end; ++job) {
             long ii = m0 + job / xtiles * RM;
             long jj = n0 + job % xtiles * RN;
@@ -769,11 +902,8 @@ class tinyBLAS_Q0_ARM {
                 for (int j = 0; j < RN; ++j)
 #pragma GCC unroll 100
                     for (int i = 0; i < RM; ++i) {
-                        float32x4_t a = vcvtq_f32_s32(vdotq_s32(
-                            vdotq_s32(vdupq_n_s32(0), load_lo(INDEX(A, lda, ii + i, l)),
-                                      load_lo(INDEX(B, ldb, jj + j, l))),
-                            load_hi(INDEX(A, lda, ii + i, l)), load_hi(INDEX(B, ldb, jj + j, l))));
-                        float b = unhalf(INDEX(A, lda, ii + i, l)->d) *
+                        float32x4_t a = dot(INDEX(A, lda, ii + i, l), INDEX(B, ldb, jj + j, l));
+                        float b = scale(INDEX(A, lda, ii + i, l)) *
                                   unhalf(INDEX(B, ldb, jj + j, l)->d);
                         if (PRECISE)
                             Cv[j][i] = badder(a, b, Cv[j][i], &Ce[j][i]);
@@ -788,6 +918,38 @@ class tinyBLAS_Q0_ARM {
         }
     }
 
+    template <typename T>
+    inline float scale(const T *a) {
+        return unhalf(a->d);
+    }
+
+    template <typename T>
+    inline float32x4_t dot(const T *a, const block_q8_0 *b) {
+        return vcvtq_f32_s32(vdotq_s32(vdotq_s32(vdupq_n_s32(0), load_lo(a), load_lo(b)),
+                                       load_hi(a), load_hi(b)));
+    }
+
+    // e4m3 weights are widened to floats as they're loaded, by moving
+    // their bits into fp16 lanes, which scales them by 2**-8
+    inline float scale(const block_f8_e4m3 *a) {
+        return unhalf(a->d) * 256;
+    }
+
+    inline float32x4_t dot(const block_f8_e4m3 *a, const block_q8_0 *b) {
+        float32x4_t r = vdupq_n_f32(0);
+        for (int i = 0; i < QK_F8_E4M3; i += 8) {
+            uint16x8_t x = vmovl_u8(vld1_u8(a->qs + i));
+            float16x8_t h = vreinterpretq_f16_u16(
+                vorrq_u16(vshlq_n_u16(vandq_u16(x, vdupq_n_u16(0x80)), 8),
+                          vshlq_n_u16(vandq_u16(x, vdupq_n_u16(0x7f)), 7)));
+            int16x8_t y = vmovl_s8(vld1_s8(b->qs + i));
+            r = vfmaq_f32(r, vcvt_f32_f16(vget_low_f16(h)), vcvtq_f32_s32(vmovl_s16(vget_low_s16(y))));
+            r = vfmaq_f32(r, vcvt_f32_f16(vget_high_f16(h)),
+                          vcvtq_f32_s32(vmovl_s16(vget_high_s16(y))));
+        }
+        return r;
+    }
+
     inline int8x16_t load_lo(const block_q8_0 *b) {
         return vld1q_s8(b->qs);
     }
@@ -815,6 +977,446 @@ class tinyBLAS_Q0_ARM {
     const int ith;
     const int nth;
 };
+
+// multiplies weights that llamafile_repack() interleaved eight rows at a
+// time, so each load of A covers four rows and C is computed by column
+template <int CONFIG, typename TA, typename TB, typename TC>
+class tinyBLAS_Q0x8_ARM {
+  public:
+    tinyBLAS_Q0x8_ARM(long k, const TA *A, const TB *B, long ldb, TC *C, long ldc, int ith,
+                      int nth)
+        : A(A), B(B), C(C), k(k), ldb(ldb), ldc(ldc), ith(ith), nth(nth) {
+    }
+
+    void matmul(long m, long n, int task) {
+        if (task == GGML_TASK_TYPE_COMPUTE)
+            mnpack(0, m, 0, n);
+    }
+
+  private:
+    NOINLINE void mnpack(long m0, long m, long n0, long n) {
+        long nc, np;
+
+        switch (MIN(n - n0, 4)) {
+        case 4:
+            nc = 4;
+            gemm<4>(m0, m, n0, n);
+            break;
+        case 3:
+        case 2:
+            nc = 2;
+            gemm<2>(m0, m, n0, n);
+            break;
+        case 1:
+            nc = 1;
+            gemm<1>(m0, m, n0, n);
+            break;
+        default:
+            return;
+        }
+
+        np = n0 + (n - n0) / nc * nc;
+        mnpack(m0, m, np, n);
+    }
+
+    template <int RN>
+    NOINLINE void gemm(long m0, long m, long n0, long n) {
+        long ytiles = (m - m0) / 8;
+        long xtiles = (n - n0) / RN;
+        long tiles = xtiles * ytiles;
+        long start, end;
+        llamafile_share(tiles, ith, nth, &start, &end);
+        for (long job = start; job < end; ++job) {
+            long ii = m0 + job / xtiles * 8;
+            long jj = n0 + job % xtiles * RN;
+            float32x4_t Cv[RN][2] = {};
+            for (long l = 0; l < k; ++l) {
+                const TA *a = A + ii / 8 * k + l;
+                int8x16_t b[RN][2];
+#pragma GCC unroll 100
+                for (int j = 0; j < RN; ++j) {
+                    b[j][0] = vld1q_s8(INDEX(B, ldb, jj + j, l)->qs);
+                    b[j][1] = vld1q_s8(INDEX(B, ldb, jj + j, l)->qs + 16);
+                }
+                int32x4_t s[RN][2] = {};
+                dot<RN>(s, b, a);
+                float32x4_t d0 = vcvt_f32_f16(vreinterpret_f16_u16(vld1_u16(a->d)));
+                float32x4_t d1 = vcvt_f32_f16(vreinterpret_f16_u16(vld1_u16(a->d + 4)));
+#pragma GCC unroll 100
+                for (int j = 0; j < RN; ++j) {
+                    float db = unhalf(INDEX(B, ldb, jj + j, l)->d);
+                    Cv[j][0] = vmlaq_f32(Cv[j][0], vcvtq_f32_s32(s[j][0]), vmulq_n_f32(d0, db));
+                    Cv[j][1] = vmlaq_f32(Cv[j][1], vcvtq_f32_s32(s[j][1]), vmulq_n_f32(d1, db));
+                }
+            }
+#pragma GCC unroll 100
+            for (int j = 0; j < RN; ++j) {
+                float c[8];
+                vst1q_f32(c, Cv[j][0]);
+                vst1q_f32(c + 4, Cv[j][1]);
+#pragma GCC unroll 100
+                for (int r = 0; r < 8; ++r)
+                    store(INDEX(C, ldc, jj + j, ii + r), c[r]);
+            }
+        }
+    }
+
+    template <int RN>
+    inline void dot(int32x4_t (*s)[2], const int8x16_t (*b)[2], const block_q8_0x8 *a) {
+        step<RN, 0, 0>(s, b, vld1q_s8(a->qs + 32 * 0), vld1q_s8(a->qs + 32 * 0 + 16));
+        step<RN, 0, 1>(s, b, vld1q_s8(a->qs + 32 * 1), vld1q_s8(a->qs + 32 * 1 + 16));
+        step<RN, 0, 2>(s, b, vld1q_s8(a->qs + 32 * 2), vld1q_s8(a->qs + 32 * 2 + 16));
+        step<RN, 0, 3>(s, b, vld1q_s8(a->qs + 32 * 3), vld1q_s8(a->qs + 32 * 3 + 16));
+        step<RN, 1, 0>(s, b, vld1q_s8(a->qs + 32 * 4), vld1q_s8(a->qs + 32 * 4 + 16));
+        step<RN, 1, 1>(s, b, vld1q_s8(a->qs + 32 * 5), vld1q_s8(a->qs + 32 * 5 + 16));
+        step<RN, 1, 2>(s, b, vld1q_s8(a->qs + 32 * 6), vld1q_s8(a->qs + 32 * 6 + 16));
+        step<RN, 1, 3>(s, b, vld1q_s8(a->qs + 32 * 7), vld1q_s8(a->qs + 32 * 7 + 16));
+    }
+
+    template <int RN>
+    inline void dot(int32x4_t (*s)[2], const int8x16_t (*b)[2], const block_q4_0x8 *a) {
+        nibbles<RN, 0>(s, b, a);
+        nibbles<RN, 1>(s, b, a);
+        nibbles<RN, 2>(s, b, a);
+        nibbles<RN, 3>(s, b, a);
+    }
+
+    // low nibbles hold quants 4h..4h+3 of each row, high nibbles 16 more
+    template <int RN, int H>
+    inline void nibbles(int32x4_t (*s)[2], const int8x16_t (*b)[2], const block_q4_0x8 *a) {
+        uint8x16_t x0 = vld1q_u8(a->qs + 32 * H);
+        uint8x16_t x1 = vld1q_u8(a->qs + 32 * H + 16);
+        step<RN, 0, H>(
+            s, b, vsubq_s8(vreinterpretq_s8_u8(vandq_u8(x0, vdupq_n_u8(15))), vdupq_n_s8(8)),
+            vsubq_s8(vreinterpretq_s8_u8(vandq_u8(x1, vdupq_n_u8(15))), vdupq_n_s8(8)));
+        step<RN, 1, H>(s, b, vsubq_s8(vreinterpretq_s8_u8(vshrq_n_u8(x0, 4)), vdupq_n_s8(8)),
+                       vsubq_s8(vreinterpretq_s8_u8(vshrq_n_u8(x1, 4)), vdupq_n_s8(8)));
+    }
+
+    // multiplies four quants of rows 0-3 and 4-7 by word H of half P of b
+    template <int RN, int P, int H>
+    inline void step(int32x4_t (*s)[2], const int8x16_t (*b)[2], int8x16_t x0, int8x16_t x1) {
+#pragma GCC unroll 100
+        for (int j = 0; j < RN; ++j) {
+            s[j][0] = vdotq_laneq_s32(s[j][0], x0, b[j][P], H);
+            s[j][1] = vdotq_laneq_s32(s[j][1], x1, b[j][P], H);
+        }
+    }
+
+    const TA *const A;
+    const TB *const B;
+    TC *const C;
+    const long k;
+    const long ldb;
+    const long ldc;
+    const int ith;
+    const int nth;
+};
+#if defined(__ARM_FEATURE_MATMUL_INT8)
+// multiplies quants with the armv8.6 smmla instruction, which computes a
+// 2x2 block of C from eight quants of two rows of A and two columns of B
+// so it does twice the work of sdot per instruction. rows and columns of
+// C that can't be paired are left to tinyBLAS_Q0_ARM
+template <int CONFIG, typename TA, typename TB, typename TC>
+class tinyBLAS_Q0_MMLA {
+  public:
+    tinyBLAS_Q0_MMLA(long k, const TA *A, long lda, const TB *B, long ldb, TC *C, long ldc,
+                     int ith, int nth)
+        : A(A), B(B), C(C), k(k), lda(lda), ldb(ldb), ldc(ldc), ith(ith), nth(nth) {
+    }
+
+    void matmul(long m, long n, int task) {
+        if (task != GGML_TASK_TYPE_COMPUTE)
+            return;
+        tinyBLAS_Q0_ARM<CONFIG, TA, TB, TC> tb{k, A, lda, B, ldb, C, ldc, ith, nth};
+        if (FLAG_precise) {
+            tb.matmul(m, n, task);
+            return;
+        }
+        long mp = m & -2;
+        long np = n & -2;
+        mnpack(0, mp, 0, np);
+        tb.matmul(mp, m, 0, n);
+        tb.matmul(0, mp, np, n);
+    }
+
+  private:
+    // same as tinyBLAS_Q0_ARM::mnpack() except tiles count pairs
+    NOINLINE void mnpack(long m0, long m, long n0, long n) {
+        long mc, nc, mp, np;
+
+        switch ((MIN((m - m0) / 2, 3) << 4) | MIN((n - n0) / 2, 3)) {
+        case 0x33:
+            mc = 3;
+            nc = 3;
+            gemm<3, 3>(m0, m, n0, n);
+            break;
+        case 0x32:
+        case 0x23:
+        case 0x22:
+            mc = 2;
+            nc = 2;
+            gemm<2, 2>(m0, m, n0, n);
+            break;
+        case 0x31:
+        case 0x21:
+            mc = 2;
+            nc = 1;
+            gemm<2, 1>(m0, m, n0, n);
+            break;
+        case 0x13:
+        case 0x12:
+            mc = 1;
+            nc = 2;
+            gemm<1, 2>(m0, m, n0, n);
+            break;
+        case 0x11:
+            mc = 1;
+            nc = 1;
+            gemm<1, 1>(m0, m, n0, n);
+            break;
+        default:
+            return;
+        }
+
+        mp = m0 + (m - m0) / (mc * 2) * (mc * 2);
+        np = n0 + (n - n0) / (nc * 2) * (nc * 2);
+        mnpack(mp, m, n0, np);
+        mnpack(m0, m, np, n);
+    }
+
+    // computes RM pairs of rows by RN pairs of columns at a time, where
+    // each accumulator holds {a0·b0, a0·b1, a1·b0, a1·b1}
+    template <int RM, int RN>
+    NOINLINE void gemm(long m0, long m, long n0, long n) {
+        long ytiles = (m - m0) / (RM * 2);
+        long xtiles = (n - n0) / (RN * 2);
+        long tiles = xtiles * ytiles;
+        long start, end;
+        llamafile_share(tiles, ith, nth, &start, &end);
+        for (long job = start; job < end; ++job) {
+            long ii = m0 + job / xtiles * (RM * 2);
+            long jj = n0 + job % xtiles * (RN * 2);
+            float32x4_t Cv[RN][RM] = {};
+            for (long l = 0; l < k; ++l) {
+                int8x16_t Av[RM][4];
+                int8x16_t Bv[RN][4];
+                float32x4_t Ad[RM];
+                float32x4_t Bd[RN];
+#pragma GCC unroll 100
+                for (int i = 0; i < RM; ++i) {
+                    const TA *a0 = INDEX(A, lda, ii + i * 2 + 0, l);
+                    const TA *a1 = INDEX(A, lda, ii + i * 2 + 1, l);
+                    interleave(Av[i], load_lo(a0), load_hi(a0), load_lo(a1), load_hi(a1));
+                    float d0 = unhalf(a0->d);
+                    float d1 = unhalf(a1->d);
+                    Ad[i] = (float32x4_t){d0, d0, d1, d1};
+                }
+#pragma GCC unroll 100
+                for (int j = 0; j < RN; ++j) {
+                    const TB *b0 = INDEX(B, ldb, jj + j * 2 + 0, l);
+                    const TB *b1 = INDEX(B, ldb, jj + j * 2 + 1, l);
+                    interleave(Bv[j], load_lo(b0), load_hi(b0), load_lo(b1), load_hi(b1));
+                    float d0 = unhalf(b0->d);
+                    float d1 = unhalf(b1->d);
+                    Bd[j] = (float32x4_t){d0, d1, d0, d1};
+                }
+#pragma GCC unroll 100
+                for (int j = 0; j < RN; ++j)
+#pragma GCC unroll 100
+                    for (int i = 0; i < RM; ++i) {
+                        int32x4_t s = vdupq_n_s32(0);
+                        s = vmmlaq_s32(s, Av[i][0], Bv[j][0]);
+                        s = vmmlaq_s32(s, Av[i][1], Bv[j][1]);
+                        s = vmmlaq_s32(s, Av[i][2], Bv[j][2]);
+                        s = vmmlaq_s32(s, Av[i][3], Bv[j][3]);
+                        Cv[j][i] = vmlaq_f32(Cv[j][i], vcvtq_f32_s32(s), vmulq_f32(Ad[i], Bd[j]));
+                    }
+            }
+#pragma GCC unroll 100
+            for (int j = 0; j < RN; ++j)
+#pragma GCC unroll 100
+                for (int i = 0; i < RM; ++i) {
+                    store(INDEX(C, ldc, jj + j * 2 + 0, ii + i * 2 + 0), vgetq_lane_f32(Cv[j][i], 0));
+                    store(INDEX(C, ldc, jj + j * 2 + 1, ii + i * 2 + 0), vgetq_lane_f32(Cv[j][i], 1));
+                    store(INDEX(C, ldc, jj + j * 2 + 0, ii + i * 2 + 1), vgetq_lane_f32(Cv[j][i], 2));
+                    store(INDEX(C, ldc, jj + j * 2 + 1, ii + i * 2 + 1), vgetq_lane_f32(Cv[j][i], 3));
+                }
+        }
+    }
+
+    // turns two rows of 32 quants into the four 2x8 matrices smmla takes
+    static inline void interleave(int8x16_t v[4], int8x16_t lo0, int8x16_t hi0, int8x16_t lo1,
+                                  int8x16_t hi1) {
+        v[0] = vreinterpretq_s8_s64(vzip1q_s64(vreinterpretq_s64_s8(lo0), vreinterpretq_s64_s8(lo1)));
+        v[1] = vreinterpretq_s8_s64(vzip2q_s64(vreinterpretq_s64_s8(lo0), vreinterpretq_s64_s8(lo1)));
+        v[2] = vreinterpretq_s8_s64(vzip1q_s64(vreinterpretq_s64_s8(hi0), vreinterpretq_s64_s8(hi1)));
+        v[3] = vreinterpretq_s8_s64(vzip2q_s64(vreinterpretq_s64_s8(hi0), vreinterpretq_s64_s8(hi1)));
+    }
+
+    static inline int8x16_t load_lo(const block_q8_0 *b) {
+        return vld1q_s8(b->qs);
+    }
+
+    static inline int8x16_t load_hi(const block_q8_0 *b) {
+        return vld1q_s8(b->qs + 16);
+    }
+
+    static inline int8x16_t load_lo(const block_q4_0 *b) {
+        return vsubq_s8(vreinterpretq_s8_u8(vandq_u8(vld1q_u8(b->qs), vdupq_n_u8(0x0f))),
+                        vdupq_n_s8(0x8));
+    }
+
+    static inline int8x16_t load_hi(const block_q4_0 *b) {
+        return vsubq_s8(vreinterpretq_s8_u8(vshrq_n_u8(vld1q_u8(b->qs), 4)), vdupq_n_s8(0x8));
+    }
+
+    const TA *const A;
+    const TB *const B;
+    TC *const C;
+    const long k;
+    const long lda;
+    const long ldb;
+    const long ldc;
+    const int ith;
+    const int nth;
+};
+#endif // __ARM_FEATURE_MATMUL_INT8
+
+#if defined(__ARM_FEATURE_BF16_VECTOR_ARITHMETIC) && !defined(_MSC_VER)
+// multiplies brain floats with the armv8.6 bfmmla instruction, which
+// computes a 2x2 block of C from four elements of two rows of A and two
+// columns of B. rows and columns of C that can't be paired are left to
+// the ordinary tinyBLAS kernel
+template <int CONFIG, typename TA, typename TB, typename TC>
+class tinyBLAS_BF16_MMLA {
+  public:
+    tinyBLAS_BF16_MMLA(long k, const TA *A, long lda, const TB *B, long ldb, TC *C, long ldc,
+                       int ith, int nth)
+        : A(A), B(B), C(C), k(k), lda(lda), ldb(ldb), ldc(ldc), ith(ith), nth(nth) {
+    }
+
+    void matmul(long m, long n, int task) {
+        if (task != GGML_TASK_TYPE_COMPUTE)
+            return;
+        tinyBLAS<CONFIG, 4, float32x4_t, float32x4_t, TA, TB, TC> tb{
+            k, A, lda, B, ldb, C, ldc, ith, nth};
+        if (FLAG_precise) {
+            tb.matmul(m, n, task);
+            return;
+        }
+        long mp = m & -2;
+        long np = n & -2;
+        mnpack(0, mp, 0, np);
+        tb.matmul(mp, m, 0, n);
+        tb.matmul(0, mp, np, n);
+    }
+
+  private:
+    NOINLINE void mnpack(long m0, long m, long n0, long n) {
+        long mc, nc, mp, np;
+
+        switch ((MIN((m - m0) / 2, 3) << 4) | MIN((n - n0) / 2, 3)) {
+        case 0x33:
+            mc = 3;
+            nc = 3;
+            gemm<3, 3>(m0, m, n0, n);
+            break;
+        case 0x32:
+        case 0x23:
+        case 0x22:
+            mc = 2;
+            nc = 2;
+            gemm<2, 2>(m0, m, n0, n);
+            break;
+        case 0x31:
+        case 0x21:
+            mc = 2;
+            nc = 1;
+            gemm<2, 1>(m0, m, n0, n);
+            break;
+        case 0x13:
+        case 0x12:
+            mc = 1;
+            nc = 2;
+            gemm<1, 2>(m0, m, n0, n);
+            break;
+        case 0x11:
+            mc = 1;
+            nc = 1;
+            gemm<1, 1>(m0, m, n0, n);
+            break;
+        default:
+            return;
+        }
+
+        mp = m0 + (m - m0) / (mc * 2) * (mc * 2);
+        np = n0 + (n - n0) / (nc * 2) * (nc * 2);
+        mnpack(mp, m, n0, np);
+        mnpack(m0, m, np, n);
+    }
+
+    template <int RM, int RN>
+    NOINLINE void gemm(long m0, long m, long n0, long n) {
+        long ytiles = (m - m0) / (RM * 2);
+        long xtiles = (n - n0) / (RN * 2);
+        long tiles = xtiles * ytiles;
+        long start, end;
+        llamafile_share(tiles, ith, nth, &start, &end);
+        for (long job = start; job < end; ++job) {
+            long ii = m0 + job / xtiles * (RM * 2);
+            long jj = n0 + job % xtiles * (RN * 2);
+            float32x4_t Cv[RN][RM] = {};
+            for (long l = 0; l < k; l += 8) {
+                bfloat16x8_t Av[RM][2];
+                bfloat16x8_t Bv[RN][2];
+#pragma GCC unroll 100
+                for (int i = 0; i < RM; ++i)
+                    interleave(Av[i], INDEX(A, lda, ii + i * 2 + 0, l),
+                               INDEX(A, lda, ii + i * 2 + 1, l));
+#pragma GCC unroll 100
+                for (int j = 0; j < RN; ++j)
+                    interleave(Bv[j], INDEX(B, ldb, jj + j * 2 + 0, l),
+                               INDEX(B, ldb, jj + j * 2 + 1, l));
+#pragma GCC unroll 100
+                for (int j = 0; j < RN; ++j)
+#pragma GCC unroll 100
+                    for (int i = 0; i < RM; ++i)
+                        Cv[j][i] = vbfmmlaq_f32(vbfmmlaq_f32(Cv[j][i], Av[i][0], Bv[j][0]),
+                                                Av[i][1], Bv[j][1]);
+            }
+#pragma GCC unroll 100
+            for (int j = 0; j < RN; ++j)
+#pragma GCC unroll 100
+                for (int i = 0; i < RM; ++i) {
+                    store(INDEX(C, ldc, jj + j * 2 + 0, ii + i * 2 + 0), vgetq_lane_f32(Cv[j][i], 0));
+                    store(INDEX(C, ldc, jj + j * 2 + 1, ii + i * 2 + 0), vgetq_lane_f32(Cv[j][i], 1));
+                    store(INDEX(C, ldc, jj + j * 2 + 0, ii + i * 2 + 1), vgetq_lane_f32(Cv[j][i], 2));
+                    store(INDEX(C, ldc, jj + j * 2 + 1, ii + i * 2 + 1), vgetq_lane_f32(Cv[j][i], 3));
+                }
+        }
+    }
+
+    // turns eight elements of two rows into the two 2x4 matrices bfmmla takes
+    static inline void interleave(bfloat16x8_t v[2], const ggml_bf16_t *p0,
+                                  const ggml_bf16_t *p1) {
+        int64x2_t x0 = vreinterpretq_s64_u16(vld1q_u16((const uint16_t *)p0));
+        int64x2_t x1 = vreinterpretq_s64_u16(vld1q_u16((const uint16_t *)p1));
+        v[0] = vreinterpretq_bf16_s64(vzip1q_s64(x0, x1));
+        v[1] = vreinterpretq_bf16_s64(vzip2q_s64(x0, x1));
+    }
+
+    const TA *const A;
+    const TB *const B;
+    TC *const C;
+    const long k;
+    const long lda;
+    const long ldb;
+    const long ldc;
+    const int ith;
+    const int nth;
+};
+#endif // __ARM_FEATURE_BF16_VECTOR_ARITHMETIC
 #endif // __ARM_FEATURE_DOTPROD
 
 #if defined(__AVX2__) || defined(__AVX512F__)
@@ -828,10 +1430,55 @@ class tinyBLAS_Q0_AVX2 {
 
     void matmul(long m, long n, int task) {
         if (task == GGML_TASK_TYPE_COMPUTE)
-            mnpack(0, m, 0, n);
+            tunepack(m, n, FLAG_precise ? 0 : llamafile_tile(ggml_type_trait<TA>::id, m, k));
+    }
+
+    // computes the rows [m0,m) and columns [n0,n) of C
+    void matmul(long m0, long m, long n0, long n) {
+        mnpack(m0, m, n0, n);
     }
 
   private:
+    // uses the tile llamafile_tune() found fastest for this shape
+    void tunepack(long m, long n, int tile) {
+        switch (tile) {
+#if VECTOR_REGISTERS == 32
+        case 1:
+            tilepack<4, 4>(m, n);
+            break;
+        case 2:
+            tilepack<4, 3>(m, n);
+            break;
+        case 3:
+            tilepack<3, 4>(m, n);
+            break;
+#endif
+#if VECTOR_REGISTERS == 16
+        case 1:
+            tilepack<2, 3>(m, n);
+            break;
+        case 2:
+            tilepack<4, 2>(m, n);
+            break;
+        case 3:
+            tilepack<2, 4>(m, n);
+            break;
+#endif
+        default:
+            mnpack(0, m, 0, n);
+            break;
+        }
+    }
+
+    template <int RM, int RN>
+    void tilepack(long m, long n) {
+        long mp = m / RM * RM;
+        long np = n / RN * RN;
+        gemm<RM, RN, false>(0, mp, 0, np);
+        mnpack(mp, m, 0, np);
+        mnpack(0, m, np, n);
+    }
+
     void mnpack(long m0, long m, long n0, long n) {
         long mc, nc, mp, np;
 
@@ -978,11 +1625,8 @@ class tinyBLAS_Q0_AVX2 {
         long ytiles = RM > 1 ? (m - m0) / RM : 1;
         long xtiles = RN > 1 ? (n - n0) / RN : 1;
         long tiles = xtiles * ytiles;
-        long duty = (tiles + nth - 1) / nth;
-        long start = duty * ith;
-        long end = start + duty;
-        if (end > tiles)
-            end = tiles;
+        long start, end;
+        llamafile_share(tiles, ith, nth, &start, &end);
         for (long job = start; job < end; ++job) {
             long ii = m0 + job / xtiles * RM;
             long jj = n0 + job % xtiles * RN;
@@ -993,12 +1637,9 @@ class tinyBLAS_Q0_AVX2 {
                 for (int j = 0; j < RN; ++j)
 #pragma GCC unroll 100
                     for (int i = 0; i < RM; ++i) {
-                        __m256 a = _mm256_set1_ps(unhalf(INDEX(A, lda, ii + i, l)->d) *
+                        __m256 a = _mm256_set1_ps(scale(INDEX(A, lda, ii + i, l)) *
                                                   unhalf(INDEX(B, ldb, jj + j, l)->d));
-                        __m256 b = updot(_mm256_sign_epi8(load(INDEX(A, lda, ii + i, l)),
-                                                          load(INDEX(A, lda, ii + i, l))),
-                                         _mm256_sign_epi8(load(INDEX(B, ldb, jj + j, l)),
-                                                          load(INDEX(A, lda, ii + i, l))));
+                        __m256 b = dot(INDEX(A, lda, ii + i, l), INDEX(B, ldb, jj + j, l));
                         if (PRECISE)
                             Cv[j][i] = madder(a, b, Cv[j][i], &Ce[j][i]);
                         else
@@ -1012,6 +1653,38 @@ class tinyBLAS_Q0_AVX2 {
         }
     }
 
+    template <typename T>
+    inline float scale(const T *a) {
+        return unhalf(a->d);
+    }
+
+    template <typename T>
+    inline __m256 dot(const T *a, const block_q8_0 *b) {
+        __m256i x = load(a);
+        return updot(_mm256_sign_epi8(x, x), _mm256_sign_epi8(load(b), x));
+    }
+
+#if defined(__F16C__) && defined(__FMA__)
+    // e4m3 weights are widened to floats as they're loaded, by moving
+    // their bits into fp16 lanes, which scales them by 2**-8
+    inline float scale(const block_f8_e4m3 *a) {
+        return unhalf(a->d) * 256;
+    }
+
+    inline __m256 dot(const block_f8_e4m3 *a, const block_q8_0 *b) {
+        __m256 r = _mm256_setzero_ps();
+        for (int i = 0; i < QK_F8_E4M3; i += 8) {
+            __m128i x = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(a->qs + i)));
+            x = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(x, _mm_set1_epi16(0x80)), 8),
+                             _mm_slli_epi16(_mm_and_si128(x, _mm_set1_epi16(0x7f)), 7));
+            __m256 y = _mm256_cvtepi32_ps(
+                _mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i *)(b->qs + i))));
+            r = _mm256_fmadd_ps(_mm256_cvtph_ps(x), y, r);
+        }
+        return r;
+    }
+#endif
+
     inline __m256i load(const block_q8_0 *b) {
         return _mm256_loadu_si256((const __m256i *)b->qs);
     }
@@ -1044,6 +1717,444 @@ class tinyBLAS_Q0_AVX2 {
     const int ith;
     const int nth;
 };
+
+// multiplies weights that llamafile_repack() interleaved eight rows at a
+// time, so each load of A covers eight rows and C is computed by column
+template <int CONFIG, typename TA, typename TB, typename TC>
+class tinyBLAS_Q0x8_AVX2 {
+  public:
+    tinyBLAS_Q0x8_AVX2(long k, const TA *A, const TB *B, long ldb, TC *C, long ldc, int ith,
+                       int nth)
+        : A(A), B(B), C(C), k(k), ldb(ldb), ldc(ldc), ith(ith), nth(nth) {
+    }
+
+    void matmul(long m, long n, int task) {
+        if (task == GGML_TASK_TYPE_COMPUTE)
+            mnpack(0, m, 0, n);
+    }
+
+  private:
+    void mnpack(long m0, long m, long n0, long n) {
+        long nc, np;
+
+#if VECTOR_REGISTERS == 32
+        switch (MIN(n - n0, 8)) {
+        case 8:
+            nc = 8;
+            gemm<8>(m0, m, n0, n);
+            break;
+        case 7:
+        case 6:
+        case 5:
+        case 4:
+            nc = 4;
+            gemm<4>(m0, m, n0, n);
+            break;
+#else
+        switch (MIN(n - n0, 4)) {
+        case 4:
+            nc = 4;
+            gemm<4>(m0, m, n0, n);
+            break;
+#endif
+        case 3:
+        case 2:
+            nc = 2;
+            gemm<2>(m0, m, n0, n);
+            break;
+        case 1:
+            nc = 1;
+            gemm<1>(m0, m, n0, n);
+            break;
+        default:
+            return;
+        }
+
+        np = n0 + (n - n0) / nc * nc;
+        mnpack(m0, m, np, n);
+    }
+
+    template <int RN>
+    NOINLINE void gemm(long m0, long m, long n0, long n) {
+        long ytiles = (m - m0) / 8;
+        long xtiles = (n - n0) / RN;
+        long tiles = xtiles * ytiles;
+        long start, end;
+        llamafile_share(tiles, ith, nth, &start, &end);
+        for (long job = start; job < end; ++job) {
+            long ii = m0 + job / xtiles * 8;
+            long jj = n0 + job % xtiles * RN;
+            __m256 Cv[RN] = {};
+            for (long l = 0; l < k; ++l) {
+                const TA *a = A + ii / 8 * k + l;
+                __m256i s[RN] = {};
+                dot<RN>(s, a, jj, l);
+                __m256 da = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)a->d));
+#pragma GCC unroll 100
+                for (int j = 0; j < RN; ++j)
+                    Cv[j] = madd(_mm256_mul_ps(da, _mm256_set1_ps(unhalf(INDEX(B, ldb, jj + j, l)->d))),
+                                 _mm256_cvtepi32_ps(s[j]), Cv[j]);
+            }
+#pragma GCC unroll 100
+            for (int j = 0; j < RN; ++j) {
+                float c[8];
+                _mm256_storeu_ps(c, Cv[j]);
+#pragma GCC unroll 100
+                for (int r = 0; r < 8; ++r)
+                    store(INDEX(C, ldc, jj + j, ii + r), c[r]);
+            }
+        }
+    }
+
+    template <int RN>
+    inline void dot(__m256i *s, const block_q8_0x8 *a, long jj, long l) {
+#pragma GCC unroll 100
+        for (int h = 0; h < 8; ++h) {
+            __m256i x = _mm256_loadu_si256((const __m256i *)(a->qs + 32 * h));
+#pragma GCC unroll 100
+            for (int j = 0; j < RN; ++j)
+                s[j] = updot(s[j], x, word(INDEX(B, ldb, jj + j, l), h));
+        }
+    }
+
+    template <int RN>
+    inline void dot(__m256i *s, const block_q4_0x8 *a, long jj, long l) {
+#pragma GCC unroll 100
+        for (int h = 0; h < 4; ++h) {
+            __m256i x = _mm256_loadu_si256((const __m256i *)(a->qs + 32 * h));
+            __m256i lo = _mm256_sub_epi8(_mm256_and_si256(x, _mm256_set1_epi8(15)),
+                                         _mm256_set1_epi8(8));
+            __m256i hi = _mm256_sub_epi8(
+                _mm256_and_si256(_mm256_srli_epi16(x, 4), _mm256_set1_epi8(15)),
+                _mm256_set1_epi8(8));
+#pragma GCC unroll 100
+            for (int j = 0; j < RN; ++j) {
+                s[j] = updot(s[j], lo, word(INDEX(B, ldb, jj + j, l), h));
+                s[j] = updot(s[j], hi, word(INDEX(B, ldb, jj + j, l), h + 4));
+            }
+        }
+    }
+
+    // broadcasts four consecutive quants of `b` to every lane
+    inline __m256i word(const block_q8_0 *b, int h) {
+        int w;
+        memcpy(&w, b->qs + 4 * h, 4);
+        return _mm256_set1_epi32(w);
+    }
+
+    inline __m256i updot(__m256i s, __m256i x, __m256i y) {
+        __m256i u = _mm256_sign_epi8(x, x);
+        __m256i v = _mm256_sign_epi8(y, x);
+#if defined(__AVXVNNI__) || (defined(__AVX512VNNI__) && defined(__AVX512VL__))
+        return _mm256_dpbusd_epi32(s, u, v);
+#else
+        return _mm256_add_epi32(s, _mm256_madd_epi16(_mm256_set1_epi16(1),
+                                                     _mm256_maddubs_epi16(u, v)));
+#endif
+    }
+
+    const TA *const A;
+    const TB *const B;
+    TC *const C;
+    const long k;
+    const long ldb;
+    const long ldc;
+    const int ith;
+    const int nth;
+};
 #endif // __AVX2__
 
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// ADVANCED MATRIX EXTENSIONS
+//
+// Intel Sapphire Rapids has eight tile registers of 16 rows by 64 bytes,
+// which TDPBSSD and TDPBF16PS can multiply in a single instruction. The
+// kernels below compute C in 32x32 pieces, using four tiles for C along
+// with two tiles each for A and B. Since AMX wants its second operand to
+// have K interleaved across the columns, each panel of B is transposed
+// into a stack buffer on its way in. Edges that don't fill a whole piece
+// are computed by the AVX512 kernels instead.
+
+#if defined(__AMX_INT8__) && defined(__AMX_BF16__) && defined(__AVX512F__)
+
+inline void amx_config(int a_colsb, int b_rows) {
+    struct {
+        uint8_t palette_id;
+        uint8_t start_row;
+        uint8_t reserved[14];
+        uint16_t colsb[16];
+        uint8_t rows[16];
+    } cfg = {};
+    cfg.palette_id = 1;
+    for (int t = 0; t < 4; ++t) {
+        cfg.rows[t] = 16;
+        cfg.colsb[t] = 64;
+    }
+    for (int t = 4; t < 6; ++t) {
+        cfg.rows[t] = 16;
+        cfg.colsb[t] = a_colsb;
+    }
+    for (int t = 6; t < 8; ++t) {
+        cfg.rows[t] = b_rows;
+        cfg.colsb[t] = 64;
+    }
+    // gcc drops the stores to cfg when _tile_loadconfig() is used
+    asm volatile("ldtilecfg %0" : : "m"(cfg));
+}
+
+// transposes a 16x16 matrix of 32-bit words in place
+inline void transpose16x16(__m512i r[16]) {
+    __m512i t[16];
+#pragma GCC unroll 100
+    for (int i = 0; i < 16; i += 2) {
+        t[i + 0] = _mm512_unpacklo_epi32(r[i], r[i + 1]);
+        t[i + 1] = _mm512_unpackhi_epi32(r[i], r[i + 1]);
+    }
+#pragma GCC unroll 100
+    for (int i = 0; i < 16; i += 4) {
+        r[i + 0] = _mm512_unpacklo_epi64(t[i + 0], t[i + 2]);
+        r[i + 1] = _mm512_unpackhi_epi64(t[i + 0], t[i + 2]);
+        r[i + 2] = _mm512_unpacklo_epi64(t[i + 1], t[i + 3]);
+        r[i + 3] = _mm512_unpackhi_epi64(t[i + 1], t[i + 3]);
+    }
+#pragma GCC unroll 100
+    for (int c = 0; c < 4; ++c) {
+        __m512i u0 = _mm512_shuffle_i32x4(r[c + 0], r[c + 4], 0x44);
+        __m512i u1 = _mm512_shuffle_i32x4(r[c + 0], r[c + 4], 0xee);
+        __m512i u2 = _mm512_shuffle_i32x4(r[c + 8], r[c + 12], 0x44);
+        __m512i u3 = _mm512_shuffle_i32x4(r[c + 8], r[c + 12], 0xee);
+        t[c + 0] = _mm512_shuffle_i32x4(u0, u2, 0x88);
+        t[c + 4] = _mm512_shuffle_i32x4(u0, u2, 0xdd);
+        t[c + 8] = _mm512_shuffle_i32x4(u1, u3, 0x88);
+        t[c + 12] = _mm512_shuffle_i32x4(u1, u3, 0xdd);
+    }
+#pragma GCC unroll 100
+    for (int i = 0; i < 16; ++i)
+        r[i] = t[i];
+}
+
+template <int CONFIG, typename TA, typename TB, typename TC>
+class tinyBLAS_Q0_AMX {
+    static_assert(!(CONFIG & NCA), "tile loads need a strided A");
+
+  public:
+    tinyBLAS_Q0_AMX(long k, const TA *A, long lda, const TB *B, long ldb, TC *C, long ldc, int ith,
+                    int nth)
+        : A(A), B(B), C(C), k(k), lda(lda), ldb(ldb), ldc(ldc), ith(ith), nth(nth) {
+    }
+
+    void matmul(long m, long n, int task) {
+        if (task != GGML_TASK_TYPE_COMPUTE)
+            return;
+        long mp = m / 32 * 32;
+        long np = n / 32 * 32;
+        if (mp && np)
+            gemm(mp, np);
+        tinyBLAS_Q0_AVX2<CONFIG, TA, TB, TC> tb{k, A, lda, B, ldb, C, ldc, ith, nth};
+        tb.matmul(mp, m, 0, n);
+        tb.matmul(0, mp, np, n);
+    }
+
+  private:
+    NOINLINE void gemm(long m, long n) {
+        long xtiles = n / 32;
+        long tiles = m / 32 * xtiles;
+        long start, end;
+        llamafile_share(tiles, ith, nth, &start, &end);
+        if (start >= end)
+            return;
+        alignas(64) int8_t As[2][16][32];
+        alignas(64) int8_t Bs[2][16][64];
+        alignas(64) int32_t Ci[4][16][16];
+        alignas(64) float da[2][16];
+        alignas(64) float db[2][16];
+        amx_config(32, 8);
+        for (long job = start; job < end; ++job) {
+            long ii = job / xtiles * 32;
+            long jj = job % xtiles * 32;
+            __m512 Cv[2][2][16] = {};
+            for (long l = 0; l < k; l += 2) {
+                int blocks = k - l < 2 ? k - l : 2;
+                for (int j = 0; j < 2; ++j) {
+                    __m512i r[16];
+                    for (int c = 0; c < 16; ++c) {
+                        __m256i lo = _mm256_loadu_si256((const __m256i *)INDEX(B, ldb, jj + 16 * j + c, l)->qs);
+                        __m256i hi = blocks > 1 ? _mm256_loadu_si256((const __m256i *)INDEX(B, ldb, jj + 16 * j + c, l + 1)->qs)
+                                                : _mm256_setzero_si256();
+                        r[c] = _mm512_inserti64x4(_mm512_castsi256_si512(lo), hi, 1);
+                    }
+                    transpose16x16(r);
+                    for (int d = 0; d < 16; ++d)
+                        _mm512_store_si512((__m512i *)Bs[j][d], r[d]);
+                }
+                for (int b = 0; b < blocks; ++b) {
+                    long sa;
+                    const int8_t *a0 = stage(As[0], INDEX(A, lda, ii, l + b), &sa);
+                    const int8_t *a1 = stage(As[1], INDEX(A, lda, ii + 16, l + b), &sa);
+                    _tile_loadd(4, a0, sa);
+                    _tile_loadd(5, a1, sa);
+                    _tile_loadd(6, Bs[0][8 * b], 64);
+                    _tile_loadd(7, Bs[1][8 * b], 64);
+                    _tile_zero(0);
+                    _tile_zero(1);
+                    _tile_zero(2);
+                    _tile_zero(3);
+                    _tile_dpbssd(0, 4, 6);
+                    _tile_dpbssd(1, 4, 7);
+                    _tile_dpbssd(2, 5, 6);
+                    _tile_dpbssd(3, 5, 7);
+                    _tile_stored(0, Ci[0], 64);
+                    _tile_stored(1, Ci[1], 64);
+                    _tile_stored(2, Ci[2], 64);
+                    _tile_stored(3, Ci[3], 64);
+                    for (int r = 0; r < 16; ++r) {
+                        da[0][r] = unhalf(INDEX(A, lda, ii + r, l + b)->d);
+                        da[1][r] = unhalf(INDEX(A, lda, ii + 16 + r, l + b)->d);
+                        db[0][r] = unhalf(INDEX(B, ldb, jj + r, l + b)->d);
+                        db[1][r] = unhalf(INDEX(B, ldb, jj + 16 + r, l + b)->d);
+                    }
+#pragma GCC unroll 100
+                    for (int i = 0; i < 2; ++i)
+#pragma GCC unroll 100
+                        for (int j = 0; j < 2; ++j) {
+                            __m512 bd = _mm512_load_ps(db[j]);
+                            for (int r = 0; r < 16; ++r)
+                                Cv[i][j][r] = _mm512_fmadd_ps(
+                                    _mm512_mul_ps(_mm512_set1_ps(da[i][r]), bd),
+                                    _mm512_cvtepi32_ps(_mm512_load_si512((const __m512i *)Ci[2 * i + j][r])),
+                                    Cv[i][j][r]);
+                        }
+                }
+            }
+            for (int i = 0; i < 2; ++i)
+                for (int j = 0; j < 2; ++j)
+                    for (int r = 0; r < 16; ++r) {
+                        alignas(64) float row[16];
+                        _mm512_store_ps(row, Cv[i][j][r]);
+                        for (int c = 0; c < 16; ++c)
+                            store(INDEX(C, ldc, jj + 16 * j + c, ii + 16 * i + r), row[c]);
+                    }
+        }
+        _tile_release();
+    }
+
+    inline const int8_t *stage(int8_t (*)[32], const block_q8_0 *a, long *stride) {
+        *stride = lda * sizeof(block_q8_0);
+        return a->qs;
+    }
+
+    inline const int8_t *stage(int8_t (*buf)[32], const block_q4_0 *a, long *stride) {
+        for (int r = 0; r < 16; ++r) {
+            __m128i x = _mm_loadu_si128((const __m128i *)a[lda * r].qs);
+            _mm256_store_si256((__m256i *)buf[r],
+                               _mm256_sub_epi8(_mm256_and_si256(_mm256_set1_epi8(15),
+                                                                _mm256_insertf128_si256(_mm256_castsi128_si256(x),
+                                                                                        _mm_srli_epi16(x, 4), 1)),
+                                               _mm256_set1_epi8(8)));
+        }
+        *stride = 32;
+        return buf[0];
+    }
+
+    const TA *const A;
+    const TB *const B;
+    TC *const C;
+    const long k;
+    const long lda;
+    const long ldb;
+    const long ldc;
+    const int ith;
+    const int nth;
+};
+
+template <int CONFIG, typename TA, typename TB, typename TC>
+class tinyBLAS_BF16_AMX {
+    static_assert(!(CONFIG & NCA), "tile loads need a strided A");
+
+  public:
+    tinyBLAS_BF16_AMX(long k, const TA *A, long lda, const TB *B, long ldb, TC *C, long ldc,
+                      int ith, int nth)
+        : A(A), B(B), C(C), k(k), lda(lda), ldb(ldb), ldc(ldc), ith(ith), nth(nth) {
+    }
+
+    void matmul(long m, long n, int task) {
+        if (task != GGML_TASK_TYPE_COMPUTE)
+            return;
+        long mp = m / 32 * 32;
+        long np = n / 32 * 32;
+        if (mp && np)
+            gemm(mp, np);
+        tinyBLAS<CONFIG, 32, __m512, __m512bh, TA, TB, TC> tb{
+            k, A, lda, B, ldb, C, ldc, ith, nth};
+        tb.matmul(mp, m, 0, n);
+        tb.matmul(0, mp, np, n);
+    }
+
+  private:
+    NOINLINE void gemm(long m, long n) {
+        long xtiles = n / 32;
+        long tiles = m / 32 * xtiles;
+        long start, end;
+        llamafile_share(tiles, ith, nth, &start, &end);
+        if (start >= end)
+            return;
+        alignas(64) TB Bs[2][16][32];
+        alignas(64) float Cf[16][16];
+        amx_config(64, 16);
+        for (long job = start; job < end; ++job) {
+            long ii = job / xtiles * 32;
+            long jj = job % xtiles * 32;
+            _tile_zero(0);
+            _tile_zero(1);
+            _tile_zero(2);
+            _tile_zero(3);
+            for (long l = 0; l < k; l += 32) {
+                for (int j = 0; j < 2; ++j) {
+                    __m512i r[16];
+                    for (int c = 0; c < 16; ++c)
+                        r[c] = _mm512_loadu_si512(INDEX(B, ldb, jj + 16 * j + c, l));
+                    transpose16x16(r);
+                    for (int d = 0; d < 16; ++d)
+                        _mm512_store_si512((__m512i *)Bs[j][d], r[d]);
+                }
+                _tile_loadd(4, INDEX(A, lda, ii, l), lda * sizeof(TA));
+                _tile_loadd(5, INDEX(A, lda, ii + 16, l), lda * sizeof(TA));
+                _tile_loadd(6, Bs[0], 64);
+                _tile_loadd(7, Bs[1], 64);
+                _tile_dpbf16ps(0, 4, 6);
+                _tile_dpbf16ps(1, 4, 7);
+                _tile_dpbf16ps(2, 5, 6);
+                _tile_dpbf16ps(3, 5, 7);
+            }
+            _tile_stored(0, Cf, 64);
+            flush(Cf, ii, jj);
+            _tile_stored(1, Cf, 64);
+            flush(Cf, ii, jj + 16);
+            _tile_stored(2, Cf, 64);
+            flush(Cf, ii + 16, jj);
+            _tile_stored(3, Cf, 64);
+            flush(Cf, ii + 16, jj + 16);
+        }
+        _tile_release();
+    }
+
+    inline void flush(const float (*Cf)[16], long ii, long jj) {
+        for (int r = 0; r < 16; ++r)
+            for (int c = 0; c < 16; ++c)
+                store(INDEX(C, ldc, jj + c, ii + r), Cf[r][c]);
+    }
+
+    const TA *const A;
+    const TB *const B;
+    TC *const C;
+    const long k;
+    const long lda;
+    const long ldb;
+    const long ldc;
+    const int ith;
+    const int nth;
+};
+
+#endif // __AMX_INT8__
+
 } // namespace
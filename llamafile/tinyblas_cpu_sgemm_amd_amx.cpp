@@ -0,0 +1,4 @@
+#ifdef __x86_64__
+#define llamafile_sgemm_arch llamafile_sgemm_amd_amx
+#include "tinyblas_cpu_sgemm.inc"
+#endif // __x86_64__
@@ -0,0 +1,4 @@
+#ifdef __aarch64__
+#define llamafile_sgemm_arch llamafile_sgemm_arm86
+#include "tinyblas_cpu_sgemm.inc"
+#endif // __aarch64__
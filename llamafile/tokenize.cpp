@@ -15,11 +15,13 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <algorithm>
 #include <cerrno>
 #include <cmath>
 #include <cosmo.h>
 #include <cstdio>
 #include <cstring>
+#include <string>
 #include <vector>
 
 #include "llama.cpp/common.h"
@@ -36,6 +38,16 @@ int main(int argc, char **argv) {
     llamafile_check_cpu();
     log_disable();
 
+    // --benchmark tokenizes all input at once and reports throughput
+    bool benchmark = false;
+    for (int i = 1; i < argc; ++i)
+        if (!strcmp(argv[i], "--benchmark")) {
+            benchmark = true;
+            memmove(argv + i, argv + i + 1, (argc - i) * sizeof(*argv));
+            --argc;
+            --i;
+        }
+
     gpt_params params;
     params.n_ctx = 0;
 
@@ -54,6 +66,33 @@ int main(int argc, char **argv) {
 
     bool should_read_stdin = params.prompt.empty();
 
+    if (benchmark) {
+        std::string input = params.prompt;
+        if (should_read_stdin) {
+            ssize_t n;
+            char buf[65536];
+            while ((n = read(0, buf, sizeof(buf))) > 0)
+                input.append(buf, n);
+            if (n == -1) {
+                fprintf(stderr, "/dev/stdin: %s\n", strerror(errno));
+                exit(1);
+            }
+        }
+        int64_t best = INT64_MAX;
+        size_t n_tokens = 0;
+        for (int i = 0; i < 5; ++i) {
+            int64_t t0 = llama_time_us();
+            n_tokens = ::llama_tokenize(ctx, input, false).size();
+            best = std::min(best, llama_time_us() - t0);
+        }
+        best = std::max(best, (int64_t)1);
+        printf("%zu bytes %zu tokens %.3f ms %.2f MB/s %.0f tokens/s\n", input.size(), n_tokens,
+               best / 1e3, input.size() / (double)best, n_tokens * 1e6 / best);
+        llama_free(ctx);
+        llama_free_model(model);
+        return 0;
+    }
+
     for (;;) {
         ssize_t n;
         char buf[4097];
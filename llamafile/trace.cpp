@@ -0,0 +1,174 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "trace.h"
+#include "log.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
+
+//
+// chrome trace recorder
+//
+// Events are claimed from one big array with an atomic increment, so a
+// thread computing its share of a node never waits on any other thread
+// to record how long it took. The array is only written to disk, in the
+// JSON format chrome://tracing and ui.perfetto.dev load, when the process
+// exits. Pages of it that are never reached are never committed.
+//
+
+#define TRACE_MAX_EVENTS (1 << 22)
+
+namespace {
+
+struct Event {
+    const char *cat; // published last, so writer can skip torn events
+    char name[32];
+    char label[64];
+    size_t bytes;
+    int tid;
+    long long start;
+    long long end;
+};
+
+const char *g_trace_path;
+Event *g_events;
+std::atomic<long> g_count;
+std::atomic<bool> g_written;
+long long g_epoch;
+
+void put_string(FILE *f, const char *s) {
+    fputc('"', f);
+    for (; *s; ++s) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\')
+            fprintf(f, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(f, "\\u%04x", c);
+        else
+            fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+} // namespace
+
+bool llamafile_tracing;
+
+long long llamafile_trace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+/**
+ * Starts recording events, to be saved to `path` when process exits.
+ */
+bool llamafile_trace_begin(const char *path) {
+    if (g_events)
+        return true;
+    if (!(g_events = (Event *)calloc(TRACE_MAX_EVENTS, sizeof(Event)))) {
+        tinylog(__func__, ": error: out of memory\n", NULL);
+        return false;
+    }
+    g_trace_path = path;
+    g_epoch = llamafile_trace_now();
+    atexit(llamafile_trace_end);
+    llamafile_tracing = true;
+    return true;
+}
+
+/**
+ * Records that something happened on the calling thread.
+ *
+ * @param cat is category, which must be a string literal
+ * @param name is what happened, e.g. the op
+ * @param label is optional detail, e.g. the tensor name
+ * @param bytes is optional size of memory transferred
+ * @param start is from llamafile_trace_now()
+ * @param end is from llamafile_trace_now()
+ */
+void llamafile_trace_event(const char *cat, const char *name, const char *label, size_t bytes,
+                           long long start, long long end) {
+    if (!llamafile_tracing)
+        return;
+    long i = g_count.fetch_add(1, std::memory_order_relaxed);
+    if (i >= TRACE_MAX_EVENTS) {
+        if (i == TRACE_MAX_EVENTS)
+            tinylog(__func__, ": warning: trace is full; further events are dropped\n", NULL);
+        return;
+    }
+    Event *e = &g_events[i];
+    strlcpy(e->name, name, sizeof(e->name));
+    strlcpy(e->label, label ? label : "", sizeof(e->label));
+    e->bytes = bytes;
+    e->tid = gettid();
+    e->start = start;
+    e->end = end;
+    __atomic_store_n(&e->cat, cat, __ATOMIC_RELEASE);
+}
+
+/**
+ * Writes recorded events to the trace file.
+ *
+ * This is called automatically at exit, but may be called sooner, e.g.
+ * by a signal handler that's about to call _exit().
+ */
+void llamafile_trace_end(void) {
+    if (!g_events || g_written.exchange(true))
+        return;
+    llamafile_tracing = false;
+    FILE *f;
+    if (!(f = fopen(g_trace_path, "w"))) {
+        perror(g_trace_path);
+        return;
+    }
+    long n = g_count.load(std::memory_order_acquire);
+    if (n > TRACE_MAX_EVENTS)
+        n = TRACE_MAX_EVENTS;
+    int pid = getpid();
+    fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    fprintf(f, "{\"ph\":\"M\",\"pid\":%d,\"name\":\"process_name\",\"args\":{\"name\":\"llamafile\"}}",
+            pid);
+    for (long i = 0; i < n; ++i) {
+        const Event *e = &g_events[i];
+        const char *cat = __atomic_load_n(&e->cat, __ATOMIC_ACQUIRE);
+        if (!cat)
+            continue;
+        fprintf(f, ",\n{\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"cat\":\"%s\",\"name\":", pid, e->tid,
+                cat);
+        put_string(f, e->name);
+        fprintf(f, ",\"ts\":%.3f,\"dur\":%.3f,\"args\":{", (e->start - g_epoch) / 1e3,
+                (e->end - e->start) / 1e3);
+        const char *comma = "";
+        if (*e->label) {
+            fprintf(f, "\"name\":");
+            put_string(f, e->label);
+            comma = ",";
+        }
+        if (e->bytes)
+            fprintf(f, "%s\"bytes\":%zu", comma, e->bytes);
+        fprintf(f, "}}");
+    }
+    fprintf(f, "\n]}\n");
+    if (fclose(f))
+        perror(g_trace_path);
+}
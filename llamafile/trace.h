@@ -0,0 +1,18 @@
+#ifndef LLAMAFILE_TRACE_H_
+#define LLAMAFILE_TRACE_H_
+#include <stdbool.h>
+#include <stddef.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern bool llamafile_tracing;
+bool llamafile_trace_begin(const char *);
+void llamafile_trace_end(void);
+long long llamafile_trace_now(void);
+void llamafile_trace_event(const char *, const char *, const char *, size_t, long long, long long);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* LLAMAFILE_TRACE_H_ */
@@ -0,0 +1,298 @@
+// -*- mode:c++;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=cpp ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sgemm.h"
+#include "llama.cpp/ggml.h"
+#include "llamafile.h"
+#include "macros.h"
+#include <cerrno>
+#include <cosmo.h>
+#include <cpuid.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <malloc.h>
+#include <mutex>
+#include <sys/stat.h>
+#include <unistd.h>
+
+//
+// tinyBLAS tile autotuner
+//
+// Each kernel has a default register tile that was picked for the cpus
+// we had on hand, plus a few alternates that may do better on others,
+// depending on cache sizes and how many loads the core can issue. When
+// --tune is passed, every distinct weight shape in the model is timed
+// with each tile, and the winners are saved to ~/.llamafile/ where the
+// next run finds them. The profile is keyed on the cpu model so moving
+// a home directory between machines doesn't cause bad dispatches.
+//
+
+#define TUNE_ENTRIES 256
+#define TUNE_ROWS 512
+#define TUNE_COLS 128
+#define TUNE_RUNS 3
+
+namespace {
+
+struct tile_entry {
+    int type;
+    long m;
+    long k;
+    int tile;
+};
+
+tile_entry g_tile[TUNE_ENTRIES];
+int g_tile_count;
+std::mutex g_tile_lock;
+thread_local int g_tile_override = -1;
+
+void get_tune_path(char *path, size_t size) {
+    llamafile_get_app_dir(path, size);
+    strlcat(path, "tinyblas.tune", size);
+}
+
+int find_tile(int type, long m, long k) {
+    int n = __atomic_load_n(&g_tile_count, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < n; ++i)
+        if (g_tile[i].m == m && g_tile[i].k == k && g_tile[i].type == type)
+            return i;
+    return -1;
+}
+
+// records winning tile for shape, which the caller must hold the lock for
+void set_tile(int type, long m, long k, int tile) {
+    int i, n = g_tile_count;
+    if ((i = find_tile(type, m, k)) != -1) {
+        __atomic_store_n(&g_tile[i].tile, tile, __ATOMIC_RELAXED);
+        return;
+    }
+    if (n == TUNE_ENTRIES)
+        return;
+    g_tile[n].type = type;
+    g_tile[n].m = m;
+    g_tile[n].k = k;
+    g_tile[n].tile = tile;
+    __atomic_store_n(&g_tile_count, n + 1, __ATOMIC_RELEASE);
+}
+
+long long time_tile(const void *A, long m, long k, long lda, int Atype, const void *B, long ldb,
+                    float *C, int Btype, int tile) {
+    ggml_compute_params params = {GGML_TASK_TYPE_COMPUTE, 0, 1};
+    long long best = -1;
+    g_tile_override = tile;
+    for (int run = 0; run <= TUNE_RUNS; ++run) {
+        struct timespec start = timespec_real();
+        bool ok = llamafile_sgemm(&params, m, TUNE_COLS, k, A, lda, B, ldb, C, m, Atype, Btype,
+                                  GGML_TYPE_F32, GGML_PREC_DEFAULT);
+        long long micros = timespec_tomicros(timespec_sub(timespec_real(), start));
+        if (!ok) {
+            best = -1;
+            break;
+        }
+        if (run && (best < 0 || micros < best)) // first run warms up the caches
+            best = micros;
+    }
+    g_tile_override = -1;
+    return best;
+}
+
+} // namespace
+
+/**
+ * Returns cpu model name with spaces turned into underscores.
+ *
+ * The result is a single token, so it can key files like profiles.
+ */
+void llamafile_get_cpu_name(char *name, size_t size) {
+    char buf[128] = "unknown";
+#ifdef __x86_64__
+    unsigned regs[12];
+    if (__get_cpuid(0x80000000, regs, regs + 1, regs + 2, regs + 3) && regs[0] >= 0x80000004) {
+        for (unsigned i = 0; i < 3; ++i)
+            __get_cpuid(0x80000002 + i, regs + i * 4, regs + i * 4 + 1, regs + i * 4 + 2,
+                        regs + i * 4 + 3);
+        memcpy(buf, regs, sizeof(regs));
+        buf[sizeof(regs)] = 0;
+    }
+#elif defined(__aarch64__)
+    strlcpy(buf, "aarch64", sizeof(buf));
+    FILE *f;
+    if ((f = fopen("/sys/devices/system/cpu/cpu0/regs/identification/midr_el1", "r"))) {
+        if (!fgets(buf, sizeof(buf), f))
+            strlcpy(buf, "aarch64", sizeof(buf));
+        fclose(f);
+    }
+#endif
+    size_t j = 0;
+    for (size_t i = 0; buf[i] && j + 1 < size; ++i)
+        if (buf[i] > ' ')
+            name[j++] = buf[i];
+        else if (j && name[j - 1] != '_')
+            name[j++] = '_';
+    while (j && name[j - 1] == '_')
+        --j;
+    name[j] = 0;
+    if (!j)
+        strlcpy(name, "unknown", size);
+}
+
+/**
+ * Returns register tile tinyBLAS should use for weights of this shape.
+ *
+ * @param type is GGML data type of weights
+ * @param m is rows in weights
+ * @param k is cols in weights in blocks
+ * @return tile index in [0,LLAMAFILE_TILES) where 0 is the default
+ */
+int llamafile_tile(int type, long m, long k) {
+    if (g_tile_override >= 0)
+        return g_tile_override;
+    int i;
+    if ((i = find_tile(type, m, k)) != -1)
+        return __atomic_load_n(&g_tile[i].tile, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/**
+ * Benchmarks each register tile on a matrix of weights.
+ *
+ * The winner is remembered for the shape of `A`, and later gets used by
+ * all matrix multiplications of that shape. An alternate tile must beat
+ * the default by a few percent, so timing noise doesn't cause churn.
+ * Shapes that already have a tile, e.g. from llamafile_tune_load(),
+ * aren't measured again.
+ *
+ * @param A is the weights
+ * @param m is rows in `A`
+ * @param k is cols in `A` in blocks
+ * @param lda is row stride of `A` in blocks
+ * @param Atype is GGML data type of `A`
+ * @return winning tile, or -1 if tinyBLAS doesn't handle this type
+ */
+int llamafile_tune(const void *A, long m, long k, long lda, int Atype) {
+    switch (Atype) {
+    case GGML_TYPE_F32:
+    case GGML_TYPE_F16:
+    case GGML_TYPE_BF16:
+    case GGML_TYPE_Q8_0:
+    case GGML_TYPE_Q4_0:
+    case GGML_TYPE_F8_E4M3:
+        break;
+    default:
+        return -1;
+    }
+    int i;
+    if ((i = find_tile(Atype, m, k)) != -1)
+        return g_tile[i].tile;
+    int Btype = ggml_internal_get_type_traits((ggml_type)Atype).vec_dot_type;
+    size_t rowsize = ggml_row_size((ggml_type)Btype, k * ggml_blck_size((ggml_type)Atype));
+    long rows = MIN(m, TUNE_ROWS);
+    void *B = memalign(64, rowsize * TUNE_COLS);
+    float *C = (float *)memalign(64, sizeof(float) * rows * TUNE_COLS);
+    if (!B || !C) {
+        free(C);
+        free(B);
+        return -1;
+    }
+    memset(B, 0, rowsize * TUNE_COLS);
+    long ldb = rowsize / ggml_type_size((ggml_type)Btype);
+    long long best = -1;
+    int tile = -1;
+    for (int t = 0; t < LLAMAFILE_TILES; ++t) {
+        long long micros = time_tile(A, rows, k, lda, Atype, B, ldb, C, Btype, t);
+        if (micros < 0)
+            continue;
+        if (best < 0 || micros * 100 < best * 97) {
+            best = micros;
+            tile = t;
+        }
+    }
+    free(C);
+    free(B);
+    if (tile >= 0) {
+        std::lock_guard<std::mutex> lock(g_tile_lock);
+        set_tile(Atype, m, k, tile);
+    }
+    return tile;
+}
+
+/**
+ * Loads tiles that were saved by a previous run on this cpu model.
+ */
+void llamafile_tune_load(void) {
+    static std::once_flag once;
+    std::call_once(once, [] {
+        char path[PATH_MAX];
+        char want[128];
+        char line[256];
+        char cpu[128];
+        int type, tile;
+        long m, k;
+        FILE *f;
+        get_tune_path(path, sizeof(path));
+        if (!(f = fopen(path, "r")))
+            return;
+        llamafile_get_cpu_name(want, sizeof(want));
+        std::lock_guard<std::mutex> lock(g_tile_lock);
+        while (fgets(line, sizeof(line), f))
+            if (sscanf(line, "%127s %d %ld %ld %d", cpu, &type, &m, &k, &tile) == 5 &&
+                !strcmp(cpu, want) && 0 <= tile && tile < LLAMAFILE_TILES)
+                set_tile(type, m, k, tile);
+        fclose(f);
+    });
+}
+
+/**
+ * Saves tiles to the app dir, keeping ones measured on other cpus.
+ */
+void llamafile_tune_save(void) {
+    char path[PATH_MAX];
+    char temp[PATH_MAX];
+    char want[128];
+    char line[256];
+    char cpu[128];
+    FILE *f, *g;
+    llamafile_get_app_dir(path, sizeof(path));
+    if (mkdir(path, 0755) && errno != EEXIST) {
+        perror(path);
+        return;
+    }
+    get_tune_path(path, sizeof(path));
+    snprintf(temp, sizeof(temp), "%s.%d", path, getpid());
+    if (!(g = fopen(temp, "w"))) {
+        perror(temp);
+        return;
+    }
+    llamafile_get_cpu_name(want, sizeof(want));
+    if ((f = fopen(path, "r"))) {
+        while (fgets(line, sizeof(line), f))
+            if (sscanf(line, "%127s", cpu) == 1 && strcmp(cpu, want))
+                fputs(line, g);
+        fclose(f);
+    }
+    {
+        std::lock_guard<std::mutex> lock(g_tile_lock);
+        for (int i = 0; i < g_tile_count; ++i)
+            fprintf(g, "%s %d %ld %ld %d\n", want, g_tile[i].type, g_tile[i].m, g_tile[i].k,
+                    g_tile[i].tile);
+    }
+    if (fclose(g) || rename(temp, path)) {
+        perror(path);
+        unlink(temp);
+    }
+}
@@ -0,0 +1,337 @@
+// -*- mode:c;indent-tabs-mode:nil;c-basic-offset:4;coding:utf-8 -*-
+// vi: set et ft=c ts=4 sts=4 sw=4 fenc=utf-8 :vi
+//
+// Copyright 2024 Mozilla Foundation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "llamafile.h"
+#include <cosmo.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <uchar.h>
+#include <unistd.h>
+
+//
+// loading weights on windows
+//
+// Windows has no madvise(), so a file mapping is faulted in 4kb at a
+// time, and its pages are never bigger than that. With --hugepages we
+// instead read the weights into memory backed by large pages, which is
+// what VirtualAlloc(MEM_LARGE_PAGES) gives processes that were granted
+// "Lock pages in memory". The file is opened a second time without the
+// cache, so the reads go straight from disk to the copy, and several
+// threads keep a few of them in flight at once, which is what an nvme
+// drive needs to reach its bandwidth. Otherwise mappings are handed to
+// PrefetchVirtualMemory(), which reads them in with large requests.
+//
+
+#define THREADS 4
+#define DEPTH 2 // reads in flight per thread
+#define CHUNK (8 * 1024 * 1024)
+#define SECTOR 4096 // unbuffered i/o must be aligned to this
+
+#define WINAPI __attribute__((__ms_abi__))
+
+int64_t _get_osfhandle(int);
+
+#define kNtMemCommit 0x1000
+#define kNtMemReserve 0x2000
+#define kNtMemRelease 0x8000
+#define kNtMemLargePages 0x20000000
+#define kNtPageReadwrite 4
+#define kNtGenericRead 0x80000000u
+#define kNtFileShareAll 7 // read, write, delete
+#define kNtFileFlagNoBuffering 0x20000000
+#define kNtFileFlagOverlapped 0x40000000
+#define kNtErrorIoPending 997
+#define kNtErrorHandleEof 38
+#define kNtErrorNotAllAssigned 1300
+#define kNtTokenAdjustPrivileges 0x20
+#define kNtTokenQuery 8
+#define kNtSePrivilegeEnabled 2
+
+struct NtOverlapped {
+    uint64_t Internal;
+    uint64_t InternalHigh;
+    uint32_t Offset;
+    uint32_t OffsetHigh;
+    int64_t hEvent;
+};
+
+struct NtTokenPrivileges {
+    uint32_t PrivilegeCount;
+    uint32_t LuidLowPart;
+    int32_t LuidHighPart;
+    uint32_t Attributes;
+};
+
+struct NtMemoryRangeEntry {
+    void *VirtualAddress;
+    size_t NumberOfBytes;
+};
+
+static struct {
+    pthread_once_t once;
+    bool ok;
+    bool large; // if we may allocate large pages
+    void *(WINAPI *VirtualAlloc)(void *, size_t, uint32_t, uint32_t);
+    int (WINAPI *VirtualFree)(void *, size_t, uint32_t);
+    size_t (WINAPI *GetLargePageMinimum)(void);
+    int64_t (WINAPI *ReOpenFile)(int64_t, uint32_t, uint32_t, uint32_t);
+    int64_t (WINAPI *CreateEventW)(void *, int, int, const char16_t *);
+    int (WINAPI *ReadFile)(int64_t, void *, uint32_t, uint32_t *, struct NtOverlapped *);
+    int (WINAPI *GetOverlappedResult)(int64_t, struct NtOverlapped *, uint32_t *, int);
+    int (WINAPI *CloseHandle)(int64_t);
+    uint32_t (WINAPI *GetLastError)(void);
+    int64_t (WINAPI *GetCurrentProcess)(void);
+    int (WINAPI *PrefetchVirtualMemory)(int64_t, size_t, struct NtMemoryRangeEntry *, uint32_t);
+} g_win = {PTHREAD_ONCE_INIT};
+
+// large pages may only be allocated by processes that enable the
+// privilege, which the admin must have granted to the user beforehand
+static bool win_enable_large_pages(void) {
+    void *lib;
+    int64_t token;
+    struct NtTokenPrivileges tp = {1, 0, 0, kNtSePrivilegeEnabled};
+    int (WINAPI *OpenProcessToken)(int64_t, uint32_t, int64_t *);
+    int (WINAPI *LookupPrivilegeValueW)(const char16_t *, const char16_t *, void *);
+    int (WINAPI *AdjustTokenPrivileges)(int64_t, int, struct NtTokenPrivileges *, uint32_t, void *,
+                                        uint32_t *);
+    if (!(lib = cosmo_dlopen("advapi32.dll", RTLD_LAZY)))
+        return false;
+    if (!(OpenProcessToken = cosmo_dlsym(lib, "OpenProcessToken")) ||
+        !(LookupPrivilegeValueW = cosmo_dlsym(lib, "LookupPrivilegeValueW")) ||
+        !(AdjustTokenPrivileges = cosmo_dlsym(lib, "AdjustTokenPrivileges")) ||
+        !OpenProcessToken(g_win.GetCurrentProcess(), kNtTokenAdjustPrivileges | kNtTokenQuery,
+                          &token)) {
+        cosmo_dlclose(lib);
+        return false;
+    }
+    bool ok = LookupPrivilegeValueW(0, u"SeLockMemoryPrivilege", &tp.LuidLowPart) &&
+              AdjustTokenPrivileges(token, false, &tp, 0, 0, 0) &&
+              g_win.GetLastError() != kNtErrorNotAllAssigned;
+    g_win.CloseHandle(token);
+    cosmo_dlclose(lib);
+    return ok;
+}
+
+static void win_init(void) {
+    void *lib;
+    if (!IsWindows() || !(lib = cosmo_dlopen("kernel32.dll", RTLD_LAZY)))
+        return;
+    if (!(g_win.VirtualAlloc = cosmo_dlsym(lib, "VirtualAlloc")) ||
+        !(g_win.VirtualFree = cosmo_dlsym(lib, "VirtualFree")) ||
+        !(g_win.GetLargePageMinimum = cosmo_dlsym(lib, "GetLargePageMinimum")) ||
+        !(g_win.ReOpenFile = cosmo_dlsym(lib, "ReOpenFile")) ||
+        !(g_win.CreateEventW = cosmo_dlsym(lib, "CreateEventW")) ||
+        !(g_win.ReadFile = cosmo_dlsym(lib, "ReadFile")) ||
+        !(g_win.GetOverlappedResult = cosmo_dlsym(lib, "GetOverlappedResult")) ||
+        !(g_win.CloseHandle = cosmo_dlsym(lib, "CloseHandle")) ||
+        !(g_win.GetLastError = cosmo_dlsym(lib, "GetLastError")) ||
+        !(g_win.GetCurrentProcess = cosmo_dlsym(lib, "GetCurrentProcess"))) {
+        cosmo_dlclose(lib);
+        return;
+    }
+    // windows 8+
+    g_win.PrefetchVirtualMemory = cosmo_dlsym(lib, "PrefetchVirtualMemory");
+    g_win.large = g_win.GetLargePageMinimum() && win_enable_large_pages();
+    if (!g_win.large)
+        fprintf(stderr, "warning: --hugepages needs the \"Lock pages in memory\" privilege on "
+                        "windows; using normal pages\n");
+    g_win.ok = true;
+}
+
+struct WinReader {
+    pthread_t th;
+    int id;
+    int64_t handle;
+    char *buf;
+    size_t size; // bytes of buf that must be read
+    uint64_t offset; // of buf in the file, which is sector aligned
+    bool ok;
+};
+
+static bool win_issue(struct WinReader *r, struct NtOverlapped *ov, size_t i) {
+    size_t need = r->size - i < CHUNK ? r->size - i : CHUNK;
+    uint32_t len = (need + SECTOR - 1) & -SECTOR;
+    uint64_t off = r->offset + i;
+    int64_t event = ov->hEvent;
+    memset(ov, 0, sizeof(*ov));
+    ov->Offset = off;
+    ov->OffsetHigh = off >> 32;
+    ov->hEvent = event;
+    if (g_win.ReadFile(r->handle, r->buf + i, len, 0, ov))
+        return true;
+    return g_win.GetLastError() == kNtErrorIoPending;
+}
+
+static bool win_wait(struct WinReader *r, struct NtOverlapped *ov, size_t i) {
+    uint32_t got = 0;
+    size_t need = r->size - i < CHUNK ? r->size - i : CHUNK;
+    if (!g_win.GetOverlappedResult(r->handle, ov, &got, true) &&
+        g_win.GetLastError() != kNtErrorHandleEof)
+        return false;
+    return got >= need;
+}
+
+// reads every THREADS'th chunk, keeping DEPTH of them in flight
+static void *WinReader(void *arg) {
+    struct WinReader *r = arg;
+    struct NtOverlapped ov[DEPTH] = {0};
+    bool busy[DEPTH] = {0};
+    size_t pos[DEPTH];
+    int s = 0;
+    r->ok = true;
+    for (int k = 0; k < DEPTH; ++k)
+        if (!(ov[k].hEvent = g_win.CreateEventW(0, true, false, 0)))
+            r->ok = false;
+    for (size_t i = (size_t)r->id * CHUNK; r->ok && i < r->size;
+         i += (size_t)THREADS * CHUNK, s = (s + 1) % DEPTH) {
+        if (busy[s]) {
+            busy[s] = false;
+            if (!(r->ok = win_wait(r, &ov[s], pos[s])))
+                break;
+        }
+        pos[s] = i;
+        r->ok = busy[s] = win_issue(r, &ov[s], i);
+    }
+    // wait for whatever's still in flight, even after an error,
+    // since the kernel would otherwise write to our stack later
+    for (int k = 0; k < DEPTH; ++k)
+        if (busy[k] && !win_wait(r, &ov[k], pos[k]))
+            r->ok = false;
+    for (s = 0; s < DEPTH; ++s)
+        if (ov[s].hEvent)
+            g_win.CloseHandle(ov[s].hEvent);
+    return 0;
+}
+
+/**
+ * Reads weights into memory backed by large pages on Windows.
+ *
+ * The file is read with unbuffered overlapped i/o from several
+ * threads. If the process can't lock pages in memory, normal pages
+ * are used instead, which still spares us the page faults.
+ *
+ * @param mapped receives how many bytes were allocated
+ * @return pointer to the weights, to be passed to llamafile_win_free(),
+ *     or NULL if this isn't Windows, or the file can't be read this way
+ */
+void *llamafile_win_load(struct llamafile *file, size_t *mapped) {
+    pthread_once(&g_win.once, win_init);
+    if (!g_win.ok)
+        return 0;
+    size_t offset = llamafile_offset(file);
+    size_t size = llamafile_size(file);
+    if (offset == (size_t)-1 || !size)
+        return 0;
+
+    // reads must start on a sector, so we read a little before the
+    // weights when they're a zip asset which wasn't zipaligned
+    size_t skew = offset & (SECTOR - 1);
+    size_t n = (skew + size + SECTOR - 1) & -SECTOR;
+    char *p = 0;
+    if (g_win.large) {
+        size_t huge = g_win.GetLargePageMinimum();
+        size_t m = (n + huge - 1) / huge * huge;
+        if ((p = g_win.VirtualAlloc(0, m, kNtMemReserve | kNtMemCommit | kNtMemLargePages,
+                                    kNtPageReadwrite)))
+            n = m;
+    }
+    if (!p && !(p = g_win.VirtualAlloc(0, n, kNtMemReserve | kNtMemCommit, kNtPageReadwrite))) {
+        fprintf(stderr, "warning: --hugepages failed to allocate %zu bytes\n", n);
+        return 0;
+    }
+
+    // open the file again, bypassing the cache
+    int fd;
+    char path[PATH_MAX];
+    strlcpy(path, llamafile_name(file), sizeof(path));
+    if (strchr(path, '@'))
+        *strchr(path, '@') = 0;
+    int64_t handle = -1;
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) != -1) {
+        handle = g_win.ReOpenFile(_get_osfhandle(fd), kNtGenericRead, kNtFileShareAll,
+                                  kNtFileFlagNoBuffering | kNtFileFlagOverlapped);
+        close(fd);
+    }
+    if (handle == -1) {
+        fprintf(stderr, "warning: --hugepages failed to reopen %s for unbuffered reads\n", path);
+        g_win.VirtualFree(p, 0, kNtMemRelease);
+        return 0;
+    }
+
+    bool ok = true;
+    struct WinReader rd[THREADS];
+    for (int i = 0; i < THREADS; ++i) {
+        rd[i] = (struct WinReader){.id = i, .handle = handle, .buf = p, .size = skew + size,
+                                   .offset = offset - skew};
+        if (pthread_create(&rd[i].th, 0, WinReader, rd + i)) {
+            rd[i].th = 0;
+            WinReader(rd + i); // do it ourselves
+        }
+    }
+    for (int i = 0; i < THREADS; ++i) {
+        if (rd[i].th)
+            pthread_join(rd[i].th, 0);
+        ok &= rd[i].ok;
+    }
+    g_win.CloseHandle(handle);
+    if (!ok) {
+        fprintf(stderr, "warning: --hugepages failed to read weights from %s\n", path);
+        g_win.VirtualFree(p, 0, kNtMemRelease);
+        return 0;
+    }
+    *mapped = n;
+    return p + skew;
+}
+
+/**
+ * Frees weights that were read by llamafile_win_load().
+ */
+void llamafile_win_free(void *addr) {
+    if (addr && g_win.ok)
+        g_win.VirtualFree((void *)((uintptr_t)addr & -SECTOR), 0, kNtMemRelease);
+}
+
+/**
+ * Asks the operating system to read mapped pages in ahead of their use.
+ *
+ * On Windows this is PrefetchVirtualMemory(), which reads the file in
+ * with large requests, rather than one page per fault.
+ */
+void llamafile_prefetch(const void *addr, size_t size) {
+    if (!size)
+        return;
+    if (IsWindows()) {
+        pthread_once(&g_win.once, win_init);
+        if (g_win.ok && g_win.PrefetchVirtualMemory) {
+            struct NtMemoryRangeEntry range = {(void *)addr, size};
+            g_win.PrefetchVirtualMemory(g_win.GetCurrentProcess(), 1, &range, 0);
+        }
+        return;
+    }
+    errno_t err;
+    if ((err = posix_madvise((void *)addr, size, POSIX_MADV_WILLNEED)))
+        fprintf(stderr, "warning: posix_madvise(.., POSIX_MADV_WILLNEED) failed: %s\n",
+                strerror(err));
+}
@@ -19,10 +19,12 @@
 #include "zip.h"
 #include <assert.h>
 #include <cosmo.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <libgen.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -33,16 +35,21 @@
 #include <time.h>
 
 #define CHUNK 2097152
+#define MAX_THREADS 64
+#define DEFLATE_BOUND (CHUNK + CHUNK / 64 + 64)
 
 #define Min(a, b) ((a) < (b) ? (a) : (b))
+#define Max(a, b) ((a) > (b) ? (a) : (b))
 #define DOS_DATE(YEAR, MONTH_IDX1, DAY_IDX1) (((YEAR) - 1980) << 9 | (MONTH_IDX1) << 5 | (DAY_IDX1))
 #define DOS_TIME(HOUR, MINUTE, SECOND) ((HOUR) << 11 | (MINUTE) << 5 | (SECOND) >> 1)
 
+#define HUGE_ALIGNMENT (2 * 1024 * 1024)
+
 static const char *prog;
 static int FLAG_junk;
 static int FLAG_level;
 static int FLAG_verbose;
-static int FLAG_alignment = 65536;
+static int FLAG_alignment; // zero means pick one per asset
 static bool FLAG_nondeterministic;
 
 static wontreturn void Die(const char *thing, const char *reason) {
@@ -86,6 +93,169 @@ static void GetDosLocalTime(int64_t utcunixts, uint16_t *out_time, uint16_t *out
     *out_date = DOS_DATE(tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday);
 }
 
+// state of one thread copying a piece of an input file
+struct Worker {
+    pthread_t th;
+    int fd;
+    int zfd;
+    const char *path;
+    const char *zpath;
+    uint64_t off; // input offset
+    uint64_t len; // input bytes
+    uint64_t zoff; // output offset if stored
+    bool last; // ends the deflate stream
+    uint32_t crc;
+    uint8_t *iobuf;
+    uint8_t *cdbuf;
+    size_t cdlen;
+};
+
+static int nworkers;
+static struct Worker workers[MAX_THREADS];
+
+static void Read(int fd, void *buf, size_t size, uint64_t off, const char *path) {
+    for (size_t got = 0; got < size;) {
+        ssize_t rc = pread(fd, (char *)buf + got, size - got, off + got);
+        if (rc == -1 && errno == EINTR)
+            continue;
+        if (rc == -1)
+            DieSys(path);
+        if (!rc)
+            Die(path, "file shrank while it was being added");
+        got += rc;
+    }
+}
+
+// has kernel copy the bytes, which can be a reflink on btrfs or xfs,
+// since our stored assets are block aligned. returns false if we must
+// write the data ourselves, e.g. across filesystems or on old kernels
+static bool CopyRange(struct Worker *w) {
+    off_t in = w->off;
+    off_t out = w->zoff;
+    for (uint64_t done = 0; done < w->len;) {
+        ssize_t rc = copy_file_range(w->fd, &in, w->zfd, &out, w->len - done, 0);
+        if (rc <= 0)
+            return false;
+        done += rc;
+    }
+    return true;
+}
+
+static void *StoreWorker(void *arg) {
+    struct Worker *w = arg;
+    bool copied = CopyRange(w);
+    w->crc = 0;
+    for (uint64_t i = 0; i < w->len; i += CHUNK) {
+        size_t n = Min(w->len - i, CHUNK);
+        Read(w->fd, w->iobuf, n, w->off + i, w->path);
+        w->crc = crc32(w->crc, w->iobuf, n);
+        if (!copied && pwrite(w->zfd, w->iobuf, n, w->zoff + i) != n)
+            DieSys(w->zpath);
+    }
+    return 0;
+}
+
+// compresses one chunk as its own deflate run. since each chunk ends
+// with a full flush, which resets the compressor, runs can be made at
+// the same time and concatenated into a single valid deflate stream
+static void *DeflateWorker(void *arg) {
+    struct Worker *w = arg;
+    Read(w->fd, w->iobuf, w->len, w->off, w->path);
+    w->crc = crc32(0, w->iobuf, w->len);
+    z_stream zs = {0};
+    switch (deflateInit2(&zs, FLAG_level, Z_DEFLATED, -MAX_WBITS, DEF_MEM_LEVEL,
+                         Z_DEFAULT_STRATEGY)) {
+    case Z_OK:
+        break;
+    case Z_MEM_ERROR:
+        DieOom();
+    default:
+        unassert(!"deflateInit2() called with invalid parameters");
+    }
+    zs.next_in = w->iobuf;
+    zs.avail_in = w->len;
+    zs.next_out = w->cdbuf;
+    zs.avail_out = DEFLATE_BOUND;
+    switch (deflate(&zs, w->last ? Z_FINISH : Z_FULL_FLUSH)) {
+    case Z_MEM_ERROR:
+        DieOom();
+    case Z_STREAM_ERROR:
+        unassert(!"deflate() stream error");
+    default:
+        break;
+    }
+    unassert(!zs.avail_in && zs.avail_out);
+    w->cdlen = DEFLATE_BOUND - zs.avail_out;
+    deflateEnd(&zs); // reports Z_DATA_ERROR for runs that aren't last
+    return 0;
+}
+
+static void StartWorker(struct Worker *w, void *(*func)(void *)) {
+    int err;
+    if ((err = pthread_create(&w->th, 0, func, w)))
+        Die("pthread_create", strerror(err));
+}
+
+static void JoinWorker(struct Worker *w) {
+    unassert(!pthread_join(w->th, 0));
+}
+
+// copies file into zip as is, with threads computing the crc of slices
+static uint64_t Store(int fd, const char *path, uint64_t size, int zfd, const char *zpath,
+                      uint64_t zoff, uint32_t *out_crc) {
+    uint64_t slice = (size + nworkers - 1) / nworkers;
+    slice = (slice + CHUNK - 1) & -CHUNK;
+    int n = 0;
+    for (uint64_t off = 0; off < size; off += slice, ++n) {
+        struct Worker *w = workers + n;
+        w->fd = fd;
+        w->zfd = zfd;
+        w->path = path;
+        w->zpath = zpath;
+        w->off = off;
+        w->len = Min(size - off, slice);
+        w->zoff = zoff + off;
+        StartWorker(w, StoreWorker);
+    }
+    uint32_t crc = 0;
+    for (int i = 0; i < n; ++i) {
+        JoinWorker(workers + i);
+        crc = crc32_combine(crc, workers[i].crc, workers[i].len);
+    }
+    *out_crc = crc;
+    return size;
+}
+
+// compresses file into zip, with threads deflating chunks in batches
+static uint64_t Deflate(int fd, const char *path, uint64_t size, int zfd, const char *zpath,
+                        uint64_t zoff, uint32_t *out_crc) {
+    uint32_t crc = 0;
+    uint64_t compsize = 0;
+    uint64_t chunks = size ? (size + CHUNK - 1) / CHUNK : 1;
+    for (uint64_t chunk = 0; chunk < chunks; chunk += nworkers) {
+        int n = Min(chunks - chunk, nworkers);
+        for (int i = 0; i < n; ++i) {
+            struct Worker *w = workers + i;
+            w->fd = fd;
+            w->path = path;
+            w->off = (chunk + i) * CHUNK;
+            w->len = Min(size - w->off, CHUNK);
+            w->last = chunk + i == chunks - 1;
+            StartWorker(w, DeflateWorker);
+        }
+        for (int i = 0; i < n; ++i) {
+            struct Worker *w = workers + i;
+            JoinWorker(w);
+            crc = crc32_combine(crc, w->crc, w->len);
+            if (pwrite(zfd, w->cdbuf, w->cdlen, zoff + compsize) != w->cdlen)
+                DieSys(zpath);
+            compsize += w->cdlen;
+        }
+    }
+    *out_crc = crc;
+    return compsize;
+}
+
 int main(int argc, char *argv[]) {
 
     if (llamafile_has(argv, "-h") || llamafile_has(argv, "-help") ||
@@ -138,6 +308,14 @@ int main(int argc, char *argv[]) {
     if (optind == argc)
         Die(prog, "missing output argument");
 
+    // allocate buffers for copying threads
+    nworkers = Min(Max(sysconf(_SC_NPROCESSORS_ONLN), 1), MAX_THREADS);
+    for (int i = 0; i < nworkers; ++i) {
+        workers[i].iobuf = Malloc(CHUNK);
+        if (FLAG_level)
+            workers[i].cdbuf = Malloc(DEFLATE_BOUND);
+    }
+
     // open output file
     int zfd;
     ssize_t zsize;
@@ -277,72 +455,25 @@ int main(int argc, char *argv[]) {
         size_t namlen = strlen(name);
         size_t extlen = (2 + 2 + 8 + 8);
         size_t hdrlen = kZipLfileHdrMinSize + namlen + extlen;
-        while ((zsize + hdrlen) & (FLAG_alignment - 1))
+        size_t alignment = FLAG_alignment;
+        if (!alignment)
+            // align weights to huge pages, but don't pad small files as much
+            alignment = size >= HUGE_ALIGNMENT ? HUGE_ALIGNMENT : 65536;
+        while ((zsize + hdrlen) & (alignment - 1))
             ++zsize;
 
-        // initialize zlib in raw deflate mode
-        z_stream zs;
+        // copy file
+        uint32_t crc;
+        uint64_t compsize;
         int compression;
         if (!FLAG_level) {
             compression = kZipCompressionNone;
+            compsize = Store(fd, path, size, zfd, zpath, zsize + hdrlen, &crc);
         } else {
             compression = kZipCompressionDeflate;
-            zs.zalloc = 0;
-            zs.zfree = 0;
-            zs.opaque = 0;
-            switch (deflateInit2(&zs, FLAG_level, Z_DEFLATED, -MAX_WBITS, DEF_MEM_LEVEL,
-                                 Z_DEFAULT_STRATEGY)) {
-            case Z_OK:
-                break;
-            case Z_MEM_ERROR:
-                DieOom();
-            default:
-                unassert(!"deflateInit2() called with invalid parameters");
-            }
+            compsize = Deflate(fd, path, size, zfd, zpath, zsize + hdrlen, &crc);
         }
 
-        // copy file
-        ssize_t rc;
-        uint32_t crc = 0;
-        uint64_t compsize = 0;
-        _Alignas(4096) static uint8_t iobuf[CHUNK];
-        _Alignas(4096) static uint8_t cdbuf[CHUNK];
-        for (off_t i = 0; i < size; i += rc) {
-            // read chunk
-            if ((rc = pread(fd, iobuf, Min(size, CHUNK), i)) <= 0)
-                DieSys(path);
-            crc = crc32(crc, iobuf, rc);
-            if (!FLAG_level) {
-                // write uncompressed chunk to output
-                if (pwrite(zfd, iobuf, rc, zsize + hdrlen + compsize) != rc)
-                    DieSys(zpath);
-                compsize += rc;
-            } else {
-                // compress chunk and write to output
-                zs.avail_in = rc;
-                zs.next_in = iobuf;
-                do {
-                    zs.next_out = cdbuf;
-                    zs.avail_out = CHUNK;
-                    int boop;
-                    switch ((boop = deflate(&zs, rc != CHUNK ? Z_FINISH : Z_FULL_FLUSH))) {
-                    case Z_MEM_ERROR:
-                        DieOom();
-                    case Z_STREAM_ERROR:
-                        unassert(!"deflate() stream error");
-                    default:
-                        break;
-                    }
-                    ssize_t have = CHUNK - zs.avail_out;
-                    if (pwrite(zfd, cdbuf, have, zsize + hdrlen + compsize) != have)
-                        DieSys(zpath);
-                    compsize += have;
-                } while (!zs.avail_out);
-            }
-        }
-        if (FLAG_level)
-            unassert(deflateEnd(&zs) == Z_OK);
-
         // write local file header
         uint8_t *lochdr = Malloc(hdrlen);
         uint8_t *p = lochdr;